@@ -164,6 +164,9 @@ esac
 # start tpm2-abrmd daemon
 TABRMD_LOG_FILE=${TEST_BIN}_tabrmd.log
 TABRMD_PID_FILE=${TEST_BIN}_tabrmd.pid
+# tests watching what the daemon holds read its statistics segment
+TABRMD_STATS_SEGMENT=${TEST_BIN}_tabrmd.stats
+TABRMD_OPTS="${TABRMD_OPTS} --stats-segment=${TABRMD_STATS_SEGMENT}"
 tabrmd_start ${TABRMD_BIN} ${TABRMD_LOG_FILE} ${TABRMD_PID_FILE} "${TABRMD_OPTS}"
 if [ $? -ne 0 ]; then
     echo "failed to start tabrmd with name ${TABRMD_NAME}"
@@ -173,7 +176,7 @@ sleep 1
 # List session bus names registered
 dbus-send --session --dest=org.freedesktop.DBus --type=method_call --print-reply /org/freedesktop/DBus org.freedesktop.DBus.ListNames
 # execute the test script and capture exit code
-env G_MESSAGES_DEBUG=all TABRMD_TEST_TCTI_CONF="${TABRMD_TEST_TCTI_CONF}" TABRMD_TEST_TCTI_RETRIES=10 $@
+env G_MESSAGES_DEBUG=all TABRMD_TEST_TCTI_CONF="${TABRMD_TEST_TCTI_CONF}" TABRMD_TEST_TCTI_RETRIES=10 TABRMD_TEST_STATS_SEGMENT="${TABRMD_STATS_SEGMENT}" $@
 ret_test=$?
 
 # This sleep is sadly necessary: If we kill the tabrmd w/o sleeping for a
@@ -0,0 +1,136 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Run the ResourceManager microbenchmarks and the throughput benchmark
+# against a daemon on the null TCTI, then compare the results with a
+# baseline recorded by an earlier run. Each result is a line of the form
+# "name value" in the baseline file: the names ending in ':ns' are times,
+# lower is better, those ending in ':ops' are rates, higher is better.
+# The check fails if any result is more than the threshold, in percent,
+# worse than its baseline. With --update the baseline is written instead.
+#
+# This is run by 'make perf-check' and 'make perf-baseline' from the
+# build directory, inside a private session bus.
+set -u
+
+TEST_FUNC_LIB=${TEST_FUNC_LIB:-scripts/int-test-funcs.sh}
+if [ -e ${TEST_FUNC_LIB} ]; then
+    . ${TEST_FUNC_LIB}
+else
+    echo "Error: Unable to locate support test function library: " \
+         "${TEST_FUNC_LIB}"
+    exit 1
+fi
+
+usage_error ()
+{
+    echo "$0: $*" >&2
+    print_usage >&2
+    exit 2
+}
+print_usage ()
+{
+    cat <<END
+Usage:
+    perf-check.sh --baseline=FILE [--threshold=PERCENT] [--duration=SECONDS]
+        [--iterations=COUNT] [--update]
+The threshold defaults to 10 percent, each benchmark client runs for 5
+seconds and each microbenchmark for 1000000 iterations.
+END
+}
+BASELINE=""
+THRESHOLD=10
+DURATION=5
+ITERATIONS=1000000
+UPDATE=0
+while test $# -gt 0; do
+    case $1 in
+    --help) print_usage; exit $?;;
+    --baseline=*) BASELINE="${1#*=}";;
+    --threshold=*) THRESHOLD="${1#*=}";;
+    --duration=*) DURATION="${1#*=}";;
+    --iterations=*) ITERATIONS="${1#*=}";;
+    --update) UPDATE=1;;
+    *) usage_error "invalid option: '$1'";;
+    esac
+    shift
+done
+if [ -z "${BASELINE}" ]; then
+    usage_error "no baseline file given"
+fi
+for bin in src/tpm2-abrmd test/resource-manager_bench test/tpm2-abrmd-bench; do
+    if [ ! -x ${bin} ]; then
+        echo "${bin} missing: configure with --enable-unit and " \
+             "--enable-integration"
+        exit 1
+    fi
+done
+if [ ${UPDATE} -eq 0 ] && [ ! -f "${BASELINE}" ]; then
+    echo "no baseline in ${BASELINE}, run 'make perf-baseline' first"
+    exit 1
+fi
+
+RESULTS=$(mktemp /tmp/perf-check_XXXXXX)
+TABRMD_LOG_FILE=$(mktemp /tmp/perf-check-tabrmd_XXXXXX)
+TABRMD_PID_FILE=${RESULTS}.pid
+trap 'rm -f ${RESULTS} ${TABRMD_LOG_FILE} ${TABRMD_PID_FILE}' EXIT
+
+# "process GetRandom   1000000 iterations   812.3 ns each"
+echo "running ResourceManager microbenchmarks"
+./test/resource-manager_bench --iterations=${ITERATIONS} | \
+    sed -n -e 's/^\(.*[^ ]\) \+[0-9]\+ iterations \+\([0-9.]\+\) ns each$/\1 \2/p' | \
+    while read -r name value; do
+        echo "rm:${name// /_}:ns ${value}"
+    done >> ${RESULTS} || exit 1
+
+TABRMD_NAME="com.intel.tss2.TabrmdPerf$$"
+TABRMD_OPTS="--session --tcti=null --dbus-name=${TABRMD_NAME}"
+if [ `id -u` == "0" ]; then
+    TABRMD_OPTS="--allow-root ${TABRMD_OPTS}"
+fi
+daemon_start ./src/tpm2-abrmd "${TABRMD_OPTS}" ${TABRMD_LOG_FILE} \
+    ${TABRMD_PID_FILE} "" || exit 1
+# "getrandom   123456   24691.2   38   95   180   0"
+echo "running the throughput benchmark on the null TCTI"
+env TABRMD_TEST_TCTI_CONF="bus_type=session,bus_name=${TABRMD_NAME}" \
+    ./test/tpm2-abrmd-bench --duration=${DURATION} \
+    --mix=getrandom=4,pcrread=2,sign=1,policy=1,nvwrite=1,nvread=1 \
+    --nv-size=2048 | \
+    awk '$1 ~ /^(getrandom|pcrread|sign|policy|nvwrite|nvread|total)$/ &&
+         $3 != "-" {
+             print "bench:" $1 ":ops " $3
+         }' >> ${RESULTS}
+ret_bench=${PIPESTATUS[0]}
+daemon_stop ${TABRMD_PID_FILE}
+if [ ${ret_bench} -ne 0 ]; then
+    echo "throughput benchmark failed, daemon log in ${TABRMD_LOG_FILE}"
+    trap 'rm -f ${RESULTS} ${TABRMD_PID_FILE}' EXIT
+    exit 1
+fi
+
+if [ ${UPDATE} -eq 1 ]; then
+    cp ${RESULTS} "${BASELINE}"
+    echo "baseline written to ${BASELINE}:"
+    cat "${BASELINE}"
+    exit 0
+fi
+# results missing from the baseline are new benchmarks, not regressions
+awk -v threshold=${THRESHOLD} '
+    NR == FNR { baseline [$1] = $2; next }
+    !($1 in baseline) || baseline [$1] == 0 {
+        printf "%-40s %12.1f (new)\n", $1, $2; next
+    }
+    {
+        change = ($2 - baseline [$1]) * 100 / baseline [$1]
+        if ($1 ~ /:ops$/) change = -change
+        worse = change > threshold
+        printf "%-40s %12.1f %12.1f %+7.1f%%%s\n", $1, baseline [$1], $2,
+               change, worse ? " REGRESSION" : ""
+        failed += worse
+    }
+    END { exit failed > 0 }' "${BASELINE}" ${RESULTS}
+ret=$?
+if [ ${ret} -ne 0 ]; then
+    echo "performance regressed by more than ${THRESHOLD}% against ${BASELINE}"
+fi
+exit ${ret}
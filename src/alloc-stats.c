@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib-object.h>
+
+#include "alloc-stats.h"
+
+/*
+ * Counted with atomics rather than under a lock so the counters cost the
+ * hot path as little as possible. A gsize wraps after 4 GiB of bytes on
+ * 32 bit systems, scrapers handle that as a counter reset.
+ */
+static gsize alloc_stats_allocations [ALLOC_STATS_SUBSYSTEMS];
+static gsize alloc_stats_bytes [ALLOC_STATS_SUBSYSTEMS];
+
+static const gchar *alloc_stats_names [ALLOC_STATS_SUBSYSTEMS] = {
+    [ALLOC_STATS_BUFFER]     = "buffer",
+    [ALLOC_STATS_COMMAND]    = "command",
+    [ALLOC_STATS_RESPONSE]   = "response",
+    [ALLOC_STATS_SESSION]    = "session",
+    [ALLOC_STATS_OBJECT]     = "object",
+    [ALLOC_STATS_CONNECTION] = "connection",
+};
+
+/*
+ * Count an allocation of 'bytes' bytes by 'subsystem'. Use the
+ * ALLOC_STATS_ADD macro rather than calling this directly so that it's
+ * compiled out without --enable-alloc-stats.
+ */
+void
+alloc_stats_add (alloc_stats_subsystem_t subsystem,
+                 gsize                   bytes)
+{
+    g_assert (subsystem < ALLOC_STATS_SUBSYSTEMS);
+    g_atomic_pointer_add (&alloc_stats_allocations [subsystem], 1);
+    g_atomic_pointer_add (&alloc_stats_bytes [subsystem], bytes);
+}
+/*
+ * The allocations counted for 'subsystem' so far and the bytes they took.
+ */
+void
+alloc_stats_get (alloc_stats_subsystem_t  subsystem,
+                 gsize                   *allocations,
+                 gsize                   *bytes)
+{
+    g_assert (subsystem < ALLOC_STATS_SUBSYSTEMS);
+    *allocations = (gsize)g_atomic_pointer_get (&alloc_stats_allocations [subsystem]);
+    *bytes = (gsize)g_atomic_pointer_get (&alloc_stats_bytes [subsystem]);
+}
+/*
+ * The name of 'subsystem' in the metrics.
+ */
+const gchar*
+alloc_stats_name (alloc_stats_subsystem_t subsystem)
+{
+    g_assert (subsystem < ALLOC_STATS_SUBSYSTEMS);
+    return alloc_stats_names [subsystem];
+}
+/*
+ * The instance size of the GObject 'object', 0 if it's NULL.
+ */
+gsize
+alloc_stats_object_size (gpointer object)
+{
+    GTypeQuery query = { 0, };
+
+    if (object == NULL) {
+        return 0;
+    }
+    g_type_query (G_OBJECT_TYPE (object), &query);
+    return query.instance_size;
+}
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Counters of the heap allocations the daemon makes and the bytes they
+ * take, by the subsystem making them, for the metrics. They're compiled
+ * in with --enable-alloc-stats, otherwise ALLOC_STATS_ADD expands to
+ * nothing and its arguments are never evaluated. The subsystems:
+ *   buffer      command and response buffers the buffer pool couldn't
+ *               hand out from its free lists, e.g. for the CommandSource
+ *   command     Tpm2Command objects and the buffers not from the pool
+ *   response    Tpm2Response objects and the buffers not from the pool
+ *   session     SessionEntry objects and their saved context blobs
+ *   object      HandleMapEntry objects and their saved contexts
+ *   connection  Connection objects and the GIO streams of the client
+ * The bytes of objects are their instance size, not what the allocator
+ * rounds it up to.
+ */
+typedef enum {
+    ALLOC_STATS_BUFFER,
+    ALLOC_STATS_COMMAND,
+    ALLOC_STATS_RESPONSE,
+    ALLOC_STATS_SESSION,
+    ALLOC_STATS_OBJECT,
+    ALLOC_STATS_CONNECTION,
+    ALLOC_STATS_SUBSYSTEMS
+} alloc_stats_subsystem_t;
+
+#ifdef ENABLE_ALLOC_STATS
+#define ALLOC_STATS_ADD(subsystem, bytes) \
+    alloc_stats_add ((subsystem), (bytes))
+#else
+#define ALLOC_STATS_ADD(subsystem, bytes)
+#endif
+
+void          alloc_stats_add    (alloc_stats_subsystem_t  subsystem,
+                                  gsize                    bytes);
+void          alloc_stats_get    (alloc_stats_subsystem_t  subsystem,
+                                  gsize                   *allocations,
+                                  gsize                   *bytes);
+const gchar*  alloc_stats_name   (alloc_stats_subsystem_t  subsystem);
+gsize         alloc_stats_object_size (gpointer            object);
+
+G_END_DECLS
+#endif /* ALLOC_STATS_H */
@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "cap-cache.h"
+#include "tpm2-header.h"
+
+G_DEFINE_TYPE (CapCache, cap_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_TTL_MS,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+/*
+ * GObject property getter.
+ */
+static void
+cap_cache_get_property (GObject    *object,
+                        guint       property_id,
+                        GValue     *value,
+                        GParamSpec *pspec)
+{
+    CapCache *self = CAP_CACHE (object);
+
+    switch (property_id) {
+    case PROP_TTL_MS:
+        g_value_set_uint (value, self->ttl_ms);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+cap_cache_set_property (GObject        *object,
+                        guint           property_id,
+                        GValue const   *value,
+                        GParamSpec     *pspec)
+{
+    CapCache *self = CAP_CACHE (object);
+
+    switch (property_id) {
+    case PROP_TTL_MS:
+        self->ttl_ms = g_value_get_uint (value);
+        g_debug ("%s: ttl-ms: %u", __func__, self->ttl_ms);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+cap_cache_entry_free (cap_cache_entry_t *entry)
+{
+    g_bytes_unref (entry->response);
+    g_free (entry);
+}
+static void
+cap_cache_init (CapCache *self)
+{
+    self->table = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)cap_cache_entry_free);
+}
+/*
+ * GObject finalize function: release the GHashTable and with it all of
+ * the cached responses.
+ */
+static void
+cap_cache_finalize (GObject *object)
+{
+    CapCache *self = CAP_CACHE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    G_OBJECT_CLASS (cap_cache_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+cap_cache_class_init (CapCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (cap_cache_parent_class == NULL)
+        cap_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = cap_cache_finalize;
+    object_class->get_property = cap_cache_get_property;
+    object_class->set_property = cap_cache_set_property;
+
+    obj_properties [PROP_TTL_MS] =
+        g_param_spec_uint ("ttl-ms",
+                           "time to live",
+                           "milliseconds a GetCapability response is cached",
+                           0,
+                           CAP_CACHE_TTL_MAX,
+                           CAP_CACHE_TTL_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+CapCache*
+cap_cache_new (guint ttl_ms)
+{
+    g_debug ("%s with ttl_ms: %u", __func__, ttl_ms);
+    return CAP_CACHE (g_object_new (TYPE_CAP_CACHE,
+                                    "ttl-ms", ttl_ms,
+                                    NULL));
+}
+/*
+ * Generate the key used to cache the response to the provided
+ * GetCapability command: the property and count it asked for. Only
+ * queries without sessions for the TPM2_PT_VAR group of the
+ * TPM2_CAP_TPM_PROPERTIES capability are cached, the fixed ones are
+ * answered from the snapshot taken at startup.
+ * This function returns NULL if the command can't be cached. The caller
+ * must free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+cap_cache_key (Tpm2Command *command)
+{
+    guint32 params [2];
+
+    if (tpm2_command_get_code (command) != TPM2_CC_GetCapability ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_command_get_size (command) < TPM_HEADER_SIZE + 3 * sizeof (UINT32) ||
+        tpm2_command_get_cap (command) != TPM2_CAP_TPM_PROPERTIES)
+    {
+        return NULL;
+    }
+    params [0] = tpm2_command_get_prop (command);
+    params [1] = tpm2_command_get_prop_count (command);
+    if (params [0] < TPM2_PT_VAR) {
+        return NULL;
+    }
+    return g_bytes_new (params, sizeof (params));
+}
+/*
+ * Return TRUE if executing the command with the provided command code,
+ * answered with 'response_code', may change the TPM2_PT_VAR properties in
+ * a way a client would notice: the hierarchy and lockout state, the
+ * number of NV indices and persistent objects and the algorithm set. A
+ * failed authorization counts towards the lockout counter whatever the
+ * command.
+ */
+gboolean
+cap_cache_invalidates (TPM2_CC command_code,
+                       TSS2_RC response_code)
+{
+    TSS2_RC rc = response_code & ~TSS2_RC_LAYER_MASK;
+
+    /* the session, handle or parameter number is in the upper bits */
+    rc &= TPM2_RC_FMT1 | 0x3f;
+    if (rc == TPM2_RC_AUTH_FAIL || rc == TPM2_RC_BAD_AUTH) {
+        return TRUE;
+    }
+    switch (command_code) {
+    case TPM2_CC_Startup:
+    case TPM2_CC_Shutdown:
+    case TPM2_CC_Clear:
+    case TPM2_CC_ClearControl:
+    case TPM2_CC_HierarchyControl:
+    case TPM2_CC_HierarchyChangeAuth:
+    case TPM2_CC_SetPrimaryPolicy:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_DictionaryAttackLockReset:
+    case TPM2_CC_DictionaryAttackParameters:
+    case TPM2_CC_SetAlgorithmSet:
+    case TPM2_CC_EvictControl:
+    case TPM2_CC_NV_DefineSpace:
+    case TPM2_CC_NV_UndefineSpace:
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * Add the response to the GetCapability command with the provided key to
+ * the cache, to be dropped 'ttl_ms' after 'now', the monotonic time in
+ * microseconds. If the cache is full the expired entries are dropped
+ * first, if that's not enough FALSE is returned and nothing is added.
+ */
+gboolean
+cap_cache_insert (CapCache *cache,
+                  GBytes   *key,
+                  GBytes   *response,
+                  gint64    now)
+{
+    cap_cache_entry_t *entry;
+    GHashTableIter iter;
+
+    if (g_hash_table_size (cache->table) >= CAP_CACHE_MAX &&
+        !g_hash_table_contains (cache->table, key))
+    {
+        g_hash_table_iter_init (&iter, cache->table);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer*)&entry)) {
+            if (entry->expires <= now) {
+                g_hash_table_iter_remove (&iter);
+            }
+        }
+        if (g_hash_table_size (cache->table) >= CAP_CACHE_MAX) {
+            g_debug ("%s: cache is full", __func__);
+            return FALSE;
+        }
+    }
+    entry = g_new0 (cap_cache_entry_t, 1);
+    entry->response = g_bytes_ref (response);
+    entry->expires = now + (gint64)cache->ttl_ms * G_TIME_SPAN_MILLISECOND;
+    g_hash_table_replace (cache->table, g_bytes_ref (key), entry);
+    return TRUE;
+}
+/*
+ * Look up the response cached under 'key' that is still fresh at 'now'.
+ * Returns a new reference to the response, or NULL if there is none. An
+ * expired response is dropped.
+ */
+GBytes*
+cap_cache_lookup (CapCache *cache,
+                  GBytes   *key,
+                  gint64    now)
+{
+    cap_cache_entry_t *entry;
+
+    entry = g_hash_table_lookup (cache->table, key);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->expires <= now) {
+        g_hash_table_remove (cache->table, key);
+        return NULL;
+    }
+    return g_bytes_ref (entry->response);
+}
+/*
+ * Drop all cached responses. This must be done once any command that
+ * cap_cache_invalidates is true for has been sent to the TPM.
+ */
+void
+cap_cache_clear (CapCache *cache)
+{
+    if (g_hash_table_size (cache->table) > 0) {
+        g_debug ("%s: dropping %u cached GetCapability responses", __func__,
+                 g_hash_table_size (cache->table));
+        g_hash_table_remove_all (cache->table);
+    }
+}
+guint
+cap_cache_size (CapCache *cache)
+{
+    return g_hash_table_size (cache->table);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CAP_CACHE_H
+#define CAP_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define CAP_CACHE_TTL_DEFAULT 0
+#define CAP_CACHE_TTL_MAX     10000
+/* distinct GetCapability queries the cache holds */
+#define CAP_CACHE_MAX         16
+
+/*
+ * The CapCache holds the responses to GetCapability queries for the
+ * TPM2_PT_VAR group of the TPM properties, keyed by the property and
+ * count they asked for. These values change as the TPM is used, so each
+ * response is only kept for 'ttl_ms' milliseconds. The commands known to
+ * change them drop the whole cache right away, the TTL bounds how stale
+ * the values that change as a side effect of other commands, like the
+ * number of loaded objects, may get.
+ */
+typedef struct {
+    GBytes           *response;
+    gint64            expires;
+} cap_cache_entry_t;
+
+typedef struct _CapCacheClass {
+    GObjectClass      parent;
+} CapCacheClass;
+
+typedef struct _CapCache {
+    GObject           parent_instance;
+    GHashTable       *table;
+    guint             ttl_ms;
+} CapCache;
+
+#define TYPE_CAP_CACHE              (cap_cache_get_type   ())
+#define CAP_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CAP_CACHE, CapCache))
+#define CAP_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CAP_CACHE, CapCacheClass))
+#define IS_CAP_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CAP_CACHE))
+#define IS_CAP_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CAP_CACHE))
+#define CAP_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CAP_CACHE, CapCacheClass))
+
+GType            cap_cache_get_type        (void);
+CapCache*        cap_cache_new             (guint             ttl_ms);
+GBytes*          cap_cache_key             (Tpm2Command      *command);
+gboolean         cap_cache_invalidates     (TPM2_CC           command_code,
+                                            TSS2_RC           response_code);
+gboolean         cap_cache_insert          (CapCache         *cache,
+                                            GBytes           *key,
+                                            GBytes           *response,
+                                            gint64            now);
+GBytes*          cap_cache_lookup          (CapCache         *cache,
+                                            GBytes           *key,
+                                            gint64            now);
+void             cap_cache_clear           (CapCache         *cache);
+guint            cap_cache_size            (CapCache         *cache);
+
+G_END_DECLS
+#endif /* CAP_CACHE_H */
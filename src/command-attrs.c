@@ -30,6 +30,7 @@ command_attrs_finalize (GObject *obj)
 
     g_debug (__func__);
     g_clear_pointer (&attrs->command_attrs, g_free);
+    g_clear_pointer (&attrs->other, g_free);
     G_OBJECT_CLASS (command_attrs_parent_class)->finalize (obj);
 }
 
@@ -56,6 +57,69 @@ command_attrs_new (void)
     return COMMAND_ATTRS (g_object_new (TYPE_COMMAND_ATTRS, NULL));
 }
 /*
+ * The command code a TPMA_CC describes: the command index with the vendor
+ * bit, which is the same bit in a TPM2_CC.
+ */
+#define TPM2_CC_FROM_TPMA_CC(attrs) \
+    ((attrs) & (TPMA_CC_COMMANDINDEX_MASK | TPMA_CC_V))
+/*
+ * Whether the command 'attrs' describes can go to the TPM untouched: it
+ * has no handles in the command nor in the response, so there's nothing
+ * to load, map or evict for it. The commands the ResourceManager answers
+ * itself or that tell it the TPM state changed are left out, as are the
+ * vendor commands which aren't in the table.
+ */
+static gboolean
+command_attrs_classify_passthrough (TPMA_CC attrs)
+{
+    if ((attrs & TPMA_CC_CHANDLES_MASK) != 0 || (attrs & TPMA_CC_RHANDLE)) {
+        return FALSE;
+    }
+    switch (TPM2_CC_FROM_TPMA_CC (attrs)) {
+    case TPM2_CC_ContextLoad:
+    case TPM2_CC_FlushContext:
+    case TPM2_CC_GetCapability:
+    case TPM2_CC_Shutdown:
+    case TPM2_CC_Startup:
+        return FALSE;
+    default:
+        return TRUE;
+    }
+}
+/*
+ * Build the lookup tables from the TPMA_CCs reported by the TPM. Commands
+ * outside the range of the table are few, if any, so they're kept in a
+ * small array.
+ */
+static void
+command_attrs_build_tables (CommandAttrs *attrs)
+{
+    TPM2_CC command_code;
+    UINT32 i;
+
+    memset (attrs->table, 0, sizeof (attrs->table));
+    memset (attrs->passthrough, 0, sizeof (attrs->passthrough));
+    g_clear_pointer (&attrs->other, g_free);
+    attrs->other_count = 0;
+    attrs->other = g_new0 (TPMA_CC, attrs->count);
+    for (i = 0; i < attrs->count; ++i) {
+        command_code = TPM2_CC_FROM_TPMA_CC (attrs->command_attrs [i]);
+        if (command_code >= TPM2_CC_FIRST && command_code <= TPM2_CC_LAST) {
+            attrs->table [command_code - TPM2_CC_FIRST] =
+                attrs->command_attrs [i];
+            if (command_attrs_classify_passthrough (attrs->command_attrs [i])) {
+                attrs->passthrough [(command_code - TPM2_CC_FIRST) / 8] |=
+                    1 << ((command_code - TPM2_CC_FIRST) % 8);
+            }
+        } else {
+            attrs->other [attrs->other_count++] = attrs->command_attrs [i];
+        }
+    }
+    g_debug ("%s: %" PRIu32 " commands, %" PRIu32 " outside the table",
+             __func__, attrs->count, attrs->other_count);
+}
+/*
+ * Query the TPM for the attributes of the commands it implements.
  */
 gint
 command_attrs_init_tpm (CommandAttrs *attrs,
@@ -69,20 +133,47 @@ command_attrs_init_tpm (CommandAttrs *attrs,
     if (rc != TSS2_RC_SUCCESS) {
         return -1;
     }
+    command_attrs_build_tables (attrs);
 
     return 0;
 }
-
-/* TPM2_CC is in the lower 15 bits of the TPMA_CC */
-#define TPM2_CC_FROM_TPMA_CC(attrs) (attrs & 0x7fff)
+/*
+ * Get the TPMA_CC for 'command_code', 0 if the TPM doesn't implement the
+ * command. This runs for every command so commands defined by the spec
+ * are found in constant time. The TPMA_CC holds everything else the
+ * pipeline needs to know about the command: the number of handles in the
+ * command and response, and whether the command flushes its handles.
+ */
 TPMA_CC
 command_attrs_from_cc (CommandAttrs *attrs,
                        TPM2_CC        command_code)
 {
-    unsigned int i;
+    UINT32 i;
 
-    for (i = 0; i < attrs->count; ++i)
-        if (TPM2_CC_FROM_TPMA_CC (attrs->command_attrs[i]) == command_code)
-            return attrs->command_attrs[i];
+    if (command_code >= TPM2_CC_FIRST && command_code <= TPM2_CC_LAST) {
+        return attrs->table [command_code - TPM2_CC_FIRST];
+    }
+    for (i = 0; i < attrs->other_count; ++i) {
+        if (TPM2_CC_FROM_TPMA_CC (attrs->other [i]) == command_code) {
+            return attrs->other [i];
+        }
+    }
 
-    return (TPMA_CC) { 0 };}
+    return (TPMA_CC) { 0 };
+}
+/*
+ * Whether the command 'command_code' needs none of the ResourceManager's
+ * virtualization, going by its handles. This is worked out once when the
+ * tables are built. The sessions of a command are in its tag, so that's
+ * for the caller to check.
+ */
+gboolean
+command_attrs_is_passthrough (CommandAttrs *attrs,
+                              TPM2_CC       command_code)
+{
+    if (command_code < TPM2_CC_FIRST || command_code > TPM2_CC_LAST) {
+        return FALSE;
+    }
+    return (attrs->passthrough [(command_code - TPM2_CC_FIRST) / 8] >>
+            ((command_code - TPM2_CC_FIRST) % 8)) & 1;
+}
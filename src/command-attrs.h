@@ -19,10 +19,24 @@ typedef struct _CommandAttrsClass {
     GObjectClass    parent;
 } CommandAttrsClass;
 
+/* commands defined by the TPM2 spec are looked up in a direct-indexed table */
+#define COMMAND_ATTRS_TABLE_SIZE (TPM2_CC_LAST - TPM2_CC_FIRST + 1)
+
+/*
+ * 'command_attrs' are the 'count' TPMA_CCs reported by the TPM. 'table'
+ * holds the TPMA_CC of each command from TPM2_CC_FIRST to TPM2_CC_LAST,
+ * 0 for those the TPM doesn't implement. The 'other_count' vendor
+ * commands and commands past TPM2_CC_LAST are in 'other'. 'passthrough'
+ * has a bit for each command in 'table', see command_attrs_is_passthrough.
+ */
 typedef struct _CommandAttrs {
     GObject                parent_instance;
     TPMA_CC               *command_attrs;
     UINT32                 count;
+    TPMA_CC                table [COMMAND_ATTRS_TABLE_SIZE];
+    guint8                 passthrough [(COMMAND_ATTRS_TABLE_SIZE + 7) / 8];
+    TPMA_CC               *other;
+    UINT32                 other_count;
 } CommandAttrs;
 
 #include "tpm2.h"
@@ -40,6 +54,8 @@ gint             command_attrs_init_tpm    (CommandAttrs     *attrs,
                                             Tpm2 *tpm2);
 TPMA_CC          command_attrs_from_cc     (CommandAttrs     *attrs,
                                             TPM2_CC            command_code);
+gboolean         command_attrs_is_passthrough (CommandAttrs  *attrs,
+                                               TPM2_CC        command_code);
 
 G_END_DECLS
 #endif /* COMMAND_ATTRS_H */
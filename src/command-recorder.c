@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "command-recorder.h"
+
+G_DEFINE_TYPE (CommandRecorder, command_recorder, G_TYPE_OBJECT);
+
+static void
+command_recorder_init (CommandRecorder *self)
+{
+    g_mutex_init (&self->mutex);
+}
+static void
+command_recorder_finalize (GObject *object)
+{
+    CommandRecorder *self = COMMAND_RECORDER (object);
+
+    g_debug ("%s", __func__);
+    if (self->file != NULL) {
+        g_info ("%s: wrote %" PRIu64 " records to %s", __func__,
+                self->records, self->path);
+        fclose (self->file);
+    }
+    g_clear_object (&self->capture);
+    g_free (self->path);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (command_recorder_parent_class)->finalize (object);
+}
+static void
+command_recorder_class_init (CommandRecorderClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (command_recorder_parent_class == NULL)
+        command_recorder_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = command_recorder_finalize;
+}
+/*
+ * Create a CommandRecorder writing to a new file at 'path', replacing any
+ * file that's there. The commands hold whatever the clients send the TPM,
+ * authorization values included, so only the owner may read the file.
+ * Returns NULL if the file can't be created.
+ */
+CommandRecorder*
+command_recorder_new (const gchar *path)
+{
+    g_return_val_if_fail (path != NULL, NULL);
+    return command_recorder_new_full (path, NULL);
+}
+/*
+ * Create a CommandRecorder writing to 'path' like command_recorder_new and
+ * passing the messages on to 'capture' as well, taking a reference to it.
+ * Either may be NULL but not both.
+ */
+CommandRecorder*
+command_recorder_new_full (const gchar  *path,
+                           PcapngWriter *capture)
+{
+    CommandRecorder *recorder;
+    guint32 version = GUINT32_TO_BE (COMMAND_RECORDER_VERSION);
+    FILE *file;
+    gint fd;
+
+    g_return_val_if_fail (path != NULL || capture != NULL, NULL);
+    if (path == NULL) {
+        recorder = COMMAND_RECORDER (g_object_new (TYPE_COMMAND_RECORDER,
+                                                   NULL));
+        recorder->capture = g_object_ref (capture);
+        return recorder;
+    }
+    fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning ("%s: failed to create %s: %s", __func__, path,
+                   strerror (errno));
+        return NULL;
+    }
+    file = fdopen (fd, "w");
+    if (file == NULL) {
+        g_warning ("%s: fdopen failed for %s: %s", __func__, path,
+                   strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    if (fwrite (COMMAND_RECORDER_MAGIC, 1, strlen (COMMAND_RECORDER_MAGIC),
+                file) != strlen (COMMAND_RECORDER_MAGIC) ||
+        fwrite (&version, sizeof (version), 1, file) != 1)
+    {
+        g_warning ("%s: failed to write header to %s", __func__, path);
+        fclose (file);
+        return NULL;
+    }
+    recorder = COMMAND_RECORDER (g_object_new (TYPE_COMMAND_RECORDER, NULL));
+    recorder->file = file;
+    recorder->path = g_strdup (path);
+    recorder->start = g_get_monotonic_time ();
+    if (capture != NULL) {
+        recorder->capture = g_object_ref (capture);
+    }
+    g_info ("%s: recording commands to %s", __func__, path);
+    return recorder;
+}
+/*
+ * Append a record of 'type' for the connection with serial 'connection'
+ * and pass it on to the capture if there's one. Recording stops at the
+ * first write error: a partial record would make the rest of the file
+ * useless anyway.
+ */
+void
+command_recorder_add (CommandRecorder       *recorder,
+                      command_record_type_t  type,
+                      guint                  connection,
+                      guint8 const          *data,
+                      size_t                 size)
+{
+    guint8 header [COMMAND_RECORD_HEADER_SIZE];
+    guint64 time_be;
+    guint32 connection_be = GUINT32_TO_BE (connection);
+    guint32 size_be = GUINT32_TO_BE ((guint32)size);
+
+    g_mutex_lock (&recorder->mutex);
+    if (recorder->capture != NULL) {
+        if (type == COMMAND_RECORD_CLOSE) {
+            pcapng_writer_close (recorder->capture, connection);
+        } else {
+            pcapng_writer_add (recorder->capture,
+                               connection,
+                               type == COMMAND_RECORD_RESPONSE,
+                               data,
+                               size);
+        }
+    }
+    if (recorder->file == NULL) {
+        goto out;
+    }
+    time_be = GUINT64_TO_BE (g_get_monotonic_time () - recorder->start);
+    memcpy (&header [0], &time_be, sizeof (time_be));
+    memcpy (&header [8], &connection_be, sizeof (connection_be));
+    header [12] = (guint8)type;
+    memcpy (&header [13], &size_be, sizeof (size_be));
+    if (fwrite (header, sizeof (header), 1, recorder->file) != 1 ||
+        (size > 0 && fwrite (data, size, 1, recorder->file) != 1))
+    {
+        g_warning ("%s: failed to write to %s, recording stopped after %"
+                   PRIu64 " records", __func__, recorder->path,
+                   recorder->records);
+        fclose (recorder->file);
+        recorder->file = NULL;
+        goto out;
+    }
+    ++recorder->records;
+out:
+    g_mutex_unlock (&recorder->mutex);
+}
+/*
+ * Check that 'file' starts with the header of a recording of a version we
+ * can read.
+ */
+gboolean
+command_record_read_header (FILE *file)
+{
+    gchar magic [sizeof (COMMAND_RECORDER_MAGIC) - 1];
+    guint32 version;
+
+    if (fread (magic, sizeof (magic), 1, file) != 1 ||
+        memcmp (magic, COMMAND_RECORDER_MAGIC, sizeof (magic)) != 0)
+    {
+        g_warning ("%s: not a command recording", __func__);
+        return FALSE;
+    }
+    if (fread (&version, sizeof (version), 1, file) != 1 ||
+        GUINT32_FROM_BE (version) != COMMAND_RECORDER_VERSION)
+    {
+        g_warning ("%s: unsupported command recording version", __func__);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Read the next record from 'file' into 'record'. The data is allocated,
+ * the caller frees it with g_free. Returns 1 if a record was read, 0 at the
+ * end of the file and -1 if the file is truncated or corrupt.
+ */
+gint
+command_record_read (FILE             *file,
+                     command_record_t *record)
+{
+    guint8 header [COMMAND_RECORD_HEADER_SIZE];
+    guint64 time_be;
+    guint32 connection_be, size_be;
+    size_t num_read;
+
+    num_read = fread (header, 1, sizeof (header), file);
+    if (num_read == 0 && feof (file)) {
+        return 0;
+    } else if (num_read != sizeof (header)) {
+        g_warning ("%s: truncated record header", __func__);
+        return -1;
+    }
+    memcpy (&time_be, &header [0], sizeof (time_be));
+    memcpy (&connection_be, &header [8], sizeof (connection_be));
+    memcpy (&size_be, &header [13], sizeof (size_be));
+    record->time = GUINT64_FROM_BE (time_be);
+    record->connection = GUINT32_FROM_BE (connection_be);
+    record->type = header [12];
+    record->size = GUINT32_FROM_BE (size_be);
+    record->data = NULL;
+    if (record->type < COMMAND_RECORD_COMMAND ||
+        record->type > COMMAND_RECORD_CLOSE ||
+        record->size > G_MAXUINT16)
+    {
+        g_warning ("%s: bad record of type %u with %" PRIu32 " bytes",
+                   __func__, header [12], record->size);
+        return -1;
+    }
+    if (record->size == 0) {
+        return 1;
+    }
+    record->data = g_malloc (record->size);
+    if (fread (record->data, record->size, 1, file) != 1) {
+        g_warning ("%s: truncated record data", __func__);
+        g_clear_pointer (&record->data, g_free);
+        return -1;
+    }
+    return 1;
+}
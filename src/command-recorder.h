@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef COMMAND_RECORDER_H
+#define COMMAND_RECORDER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+
+#include "pcapng-writer.h"
+
+G_BEGIN_DECLS
+
+/*
+ * The CommandRecorder writes the command stream of every connection to a
+ * file so that a workload can be replayed later, see test/tpm2-abrmd-replay.
+ * The CommandSources record each command as it's read and the closing of
+ * connections, the ResponseSinks each response as it's written. Records
+ * from all threads go to the one file under the mutex.
+ *
+ * The file starts with COMMAND_RECORDER_MAGIC and the format version as a
+ * 32 bit integer, each record follows as:
+ *   time        64 bits, microseconds since the recording started
+ *   connection  32 bits, the serial of the connection
+ *   type        8 bits, a command_record_type_t
+ *   size        32 bits, the size of the data that follows
+ *   data        the command or response, nothing for a close
+ * All integers are big endian.
+ *
+ * The recorder may also feed a PcapngWriter, so the same messages are
+ * captured for Wireshark, with or without a recording file.
+ */
+#define COMMAND_RECORDER_MAGIC   "TABRMDCR"
+#define COMMAND_RECORDER_VERSION 1
+/* the size of a record without its data */
+#define COMMAND_RECORD_HEADER_SIZE (8 + 4 + 1 + 4)
+
+typedef enum {
+    COMMAND_RECORD_COMMAND = 1,
+    COMMAND_RECORD_RESPONSE,
+    COMMAND_RECORD_CLOSE,
+} command_record_type_t;
+
+typedef struct {
+    guint64                 time;
+    guint                   connection;
+    command_record_type_t   type;
+    guint32                 size;
+    guint8                 *data;
+} command_record_t;
+
+typedef struct _CommandRecorderClass {
+    GObjectClass        parent;
+} CommandRecorderClass;
+
+typedef struct _CommandRecorder {
+    GObject             parent_instance;
+    GMutex              mutex;
+    FILE               *file;
+    gchar              *path;
+    gint64              start;
+    guint64             records;
+    PcapngWriter       *capture;
+} CommandRecorder;
+
+#define TYPE_COMMAND_RECORDER            (command_recorder_get_type ())
+#define COMMAND_RECORDER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_COMMAND_RECORDER, CommandRecorder))
+#define COMMAND_RECORDER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TYPE_COMMAND_RECORDER, CommandRecorderClass))
+#define IS_COMMAND_RECORDER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_COMMAND_RECORDER))
+#define IS_COMMAND_RECORDER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TYPE_COMMAND_RECORDER))
+#define COMMAND_RECORDER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TYPE_COMMAND_RECORDER, CommandRecorderClass))
+
+GType            command_recorder_get_type (void);
+CommandRecorder* command_recorder_new      (const gchar            *path);
+CommandRecorder* command_recorder_new_full (const gchar            *path,
+                                            PcapngWriter           *capture);
+void             command_recorder_add      (CommandRecorder        *recorder,
+                                            command_record_type_t   type,
+                                            guint                   connection,
+                                            guint8 const           *data,
+                                            size_t                  size);
+gboolean         command_record_read_header (FILE                  *file);
+gint             command_record_read       (FILE                   *file,
+                                            command_record_t       *record);
+
+G_END_DECLS
+#endif /* COMMAND_RECORDER_H */
@@ -9,25 +9,35 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include "connection.h"
 #include "connection-manager.h"
 #include "command-source.h"
+#include "probes.h"
+#include "resource-manager.h"
+#include "shm-ring.h"
 #include "source-interface.h"
+#include "tabrmd.h"
+#include "tabrmd-defaults.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
 #include "util.h"
 
-#ifndef G_SOURCE_FUNC
-#define G_SOURCE_FUNC(x) ((GSourceFunc)(void*)x)
-#endif
-
 enum {
     PROP_0,
     PROP_COMMAND_ATTRS,
     PROP_CONNECTION_MANAGER,
     PROP_SINK,
+    PROP_MAX_QUEUED,
+    PROP_MAX_MEMORY,
+    PROP_SHARD,
+    PROP_SHARD_COUNT,
+    PROP_COMMAND_RECORDER,
+    PROP_TPM2,
+    PROP_RATE_LIMITER,
+    PROP_TRACE_BUFFER,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -62,16 +72,61 @@ command_source_source_interface_init (gpointer g_iface)
 /*
  * This is a callback function used to clean up memory used by the
  * source_data_t structure. It's called by the GHashTable when removing
- * source_data_t values.
+ * source_data_t values. The socket stops being watched by the epoll
+ * instance.
  */
 static void
 source_data_free (gpointer data)
 {
     source_data_t *source_data = (source_data_t*)data;
-    g_object_unref (source_data->cancellable);
-    g_source_unref (source_data->source);
+    CommandSource *self = source_data->self;
+
+    if (self->epoll_fd >= 0 &&
+        epoll_ctl (self->epoll_fd,
+                   EPOLL_CTL_DEL,
+                   g_socket_get_fd (source_data->socket),
+                   NULL) == -1)
+    {
+        g_debug ("%s: failed to remove socket from epoll: %s", __func__,
+                 strerror (errno));
+    }
+    if (self->epoll_fd >= 0 && source_data->doorbell >= 0 &&
+        epoll_ctl (self->epoll_fd,
+                   EPOLL_CTL_DEL,
+                   source_data->doorbell,
+                   NULL) == -1)
+    {
+        g_debug ("%s: failed to remove doorbell from epoll: %s", __func__,
+                 strerror (errno));
+    }
+    g_object_unref (source_data->connection);
+    g_object_unref (source_data->socket);
     g_free (source_data);
 }
+static void command_source_on_epoll_ready (CommandSource *self);
+/*
+ * The GSource watching the epoll instance. The epoll fd is added with
+ * g_source_add_unix_fd so no prepare / check functions are needed.
+ */
+typedef struct {
+    GSource        source;
+    CommandSource *self;
+} epoll_source_t;
+
+static gboolean
+command_source_epoll_dispatch (GSource     *source,
+                               GSourceFunc  callback,
+                               gpointer     user_data)
+{
+    UNUSED_PARAM(callback);
+    UNUSED_PARAM(user_data);
+
+    command_source_on_epoll_ready (((epoll_source_t*)source)->self);
+    return G_SOURCE_CONTINUE;
+}
+static GSourceFuncs command_source_epoll_funcs = {
+    .dispatch = command_source_epoll_dispatch,
+};
 /*
  * Initialize a CommandSource instance.
  */
@@ -80,20 +135,55 @@ command_source_init (CommandSource *source)
 {
     source->main_context = g_main_context_new ();
     source->main_loop = g_main_loop_new (source->main_context, FALSE);
+    source->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (source->epoll_fd == -1) {
+        g_error ("%s: failed to create epoll instance: %s", __func__,
+                 strerror (errno));
+    }
+    source->epoll_source = g_source_new (&command_source_epoll_funcs,
+                                         sizeof (epoll_source_t));
+    ((epoll_source_t*)source->epoll_source)->self = source;
+    g_source_add_unix_fd (source->epoll_source, source->epoll_fd, G_IO_IN);
+    g_source_attach (source->epoll_source, source->main_context);
+    g_mutex_init (&source->map_mutex);
     /*
-     * GHashTable mapping a GSocket to an instance of the source_data_t
-     * structure. The socket is the I/O mechanism for communicating with a
+     * GHashTable mapping a GInputStream to an instance of the source_data_t
+     * structure. The stream is the I/O mechanism for communicating with a
      * client (from Connection object), and the source_data_t instance is
-     * a collection of data that we use to manage callbacks for I/O events
-     * from the main loop.
-     * The hash table owns a reference to the socket (key) and it owns
+     * a collection of data that we use to handle I/O events from the epoll
+     * instance.
+     * The hash table owns a reference to the stream (key) and it owns
      * the structure held in the value (it will be freed when removed).
+     * Access is serialized by 'map_mutex': connections are added from the
+     * thread inserting them in the ConnectionManager.
      */
     source->istream_to_source_data_map =
         g_hash_table_new_full (g_direct_hash,
                                g_direct_equal,
                                g_object_unref,
                                source_data_free);
+    /*
+     * GHashTable mapping a multiplexed Connection to the GHashTable of its
+     * logical connections. It's kept apart from the source_data_t so a
+     * paused connection keeps its channels.
+     */
+    source->channels =
+        g_hash_table_new_full (g_direct_hash,
+                               g_direct_equal,
+                               g_object_unref,
+                               (GDestroyNotify)g_hash_table_unref);
+}
+/*
+ * Stop watching the provided input stream and free the data associated
+ * with it.
+ */
+static void
+command_source_unwatch (CommandSource *self,
+                        GInputStream  *istream)
+{
+    g_mutex_lock (&self->map_mutex);
+    g_hash_table_remove (self->istream_to_source_data_map, istream);
+    g_mutex_unlock (&self->map_mutex);
 }
 
 G_DEFINE_TYPE_WITH_CODE (
@@ -120,6 +210,38 @@ command_source_set_property (GObject       *object,
     case PROP_CONNECTION_MANAGER:
         self->connection_manager = CONNECTION_MANAGER (g_value_get_object (value));
         break;
+    case PROP_MAX_QUEUED:
+        self->max_queued = g_value_get_uint (value);
+        g_debug ("%s: max-queued: %u", __func__, self->max_queued);
+        break;
+    case PROP_MAX_MEMORY:
+        self->max_memory = (gsize)g_value_get_uint (value) * 1024;
+        g_debug ("%s: max-memory: %zu", __func__, self->max_memory);
+        break;
+    case PROP_SHARD:
+        self->shard = g_value_get_uint (value);
+        g_debug ("%s: shard: %u", __func__, self->shard);
+        break;
+    case PROP_SHARD_COUNT:
+        self->shard_count = g_value_get_uint (value);
+        g_debug ("%s: shard-count: %u", __func__, self->shard_count);
+        break;
+    case PROP_COMMAND_RECORDER:
+        g_clear_object (&self->command_recorder);
+        self->command_recorder = g_value_dup_object (value);
+        break;
+    case PROP_TPM2:
+        g_clear_object (&self->tpm2);
+        self->tpm2 = g_value_dup_object (value);
+        break;
+    case PROP_RATE_LIMITER:
+        g_clear_object (&self->rate_limiter);
+        self->rate_limiter = g_value_dup_object (value);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_clear_object (&self->trace_buffer);
+        self->trace_buffer = g_value_dup_object (value);
+        break;
     case PROP_SINK:
         /* be rigid initially, add flexiblity later if we need it */
         if (self->sink != NULL) {
@@ -154,11 +276,357 @@ command_source_get_property (GObject      *object,
     case PROP_SINK:
         g_value_set_object (value, self->sink);
         break;
+    case PROP_MAX_QUEUED:
+        g_value_set_uint (value, self->max_queued);
+        break;
+    case PROP_MAX_MEMORY:
+        g_value_set_uint (value, (guint)(self->max_memory / 1024));
+        break;
+    case PROP_SHARD:
+        g_value_set_uint (value, self->shard);
+        break;
+    case PROP_SHARD_COUNT:
+        g_value_set_uint (value, self->shard_count);
+        break;
+    case PROP_COMMAND_RECORDER:
+        g_value_set_object (value, self->command_recorder);
+        break;
+    case PROP_TPM2:
+        g_value_set_object (value, self->tpm2);
+        break;
+    case PROP_RATE_LIMITER:
+        g_value_set_object (value, self->rate_limiter);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_value_set_object (value, self->trace_buffer);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
     }
 }
+/*
+ * State for the GSource that waits for a paused connection to drain or
+ * for a throttled one to be let through by the RateLimiter.
+ */
+typedef struct {
+    CommandSource *self;
+    Connection    *connection;
+} resume_data_t;
+
+static void
+resume_data_free (gpointer data)
+{
+    resume_data_t *resume_data = (resume_data_t*)data;
+
+    g_object_unref (resume_data->connection);
+    g_free (resume_data);
+}
+/*
+ * Timeout callback for a paused or throttled connection. Once enough of
+ * its queued commands have been answered the connection is watched for
+ * input again, the RateLimiter is asked again when its next command is
+ * read. A connection that was closed in the mean time is left alone.
+ */
+static gboolean
+command_source_resume_callback (gpointer user_data)
+{
+    resume_data_t *data = (resume_data_t*)user_data;
+
+    if (connection_is_closed (data->connection)) {
+        return G_SOURCE_REMOVE;
+    }
+    if (data->self->max_queued > 0 &&
+        connection_get_queued (data->connection) >= data->self->max_queued)
+    {
+        return G_SOURCE_CONTINUE;
+    }
+    g_debug ("%s: resuming input from connection", __func__);
+    command_source_on_new_connection (data->self->connection_manager,
+                                      data->connection,
+                                      data->self);
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Stop reading commands from a connection that has 'max_queued' commands
+ * queued and not yet answered. The client blocks writing to its socket
+ * until the RM catches up: this keeps the memory used by the queues and
+ * the queueing delay bounded. The caller removes the input GSource.
+ */
+static void
+command_source_pause (CommandSource *self,
+                      Connection    *connection)
+{
+    resume_data_t *data;
+    GSource *source;
+
+    g_info ("%s: connection has %u commands queued, pausing input",
+            __func__, self->max_queued);
+    data = g_new0 (resume_data_t, 1);
+    data->self = self;
+    data->connection = g_object_ref (connection);
+    source = g_timeout_source_new (COMMAND_SOURCE_RESUME_INTERVAL_MS);
+    g_source_set_callback (source,
+                           command_source_resume_callback,
+                           data,
+                           resume_data_free);
+    g_source_attach (source, self->main_context);
+    g_source_unref (source);
+}
+/*
+ * Stop reading commands from a connection whose user has used up its rate
+ * for now. Its commands wait in the socket for 'wait_us' microseconds, so
+ * a user flooding the TPM only holds itself up: the queues and the TPM
+ * are left to the clients of other users. The caller removes the input
+ * GSource.
+ */
+static void
+command_source_throttle (CommandSource *self,
+                         Connection    *connection,
+                         gint64         wait_us)
+{
+    resume_data_t *data;
+    GSource *source;
+
+    g_debug ("%s: UID %" PRIu32 " over its rate, pausing input for %"
+             PRId64 "us", __func__, connection_get_uid (connection), wait_us);
+    data = g_new0 (resume_data_t, 1);
+    data->self = self;
+    data->connection = g_object_ref (connection);
+    source = g_timeout_source_new ((guint)((wait_us + 999) / 1000));
+    g_source_set_callback (source,
+                           command_source_resume_callback,
+                           data,
+                           resume_data_free);
+    g_source_attach (source, self->main_context);
+    g_source_unref (source);
+}
+/*
+ * Take the next command from the command ring of a connection using the
+ * shared memory transport. Returns NULL with '*closed' FALSE if there's no
+ * complete command in the ring. The client never writes to the socket of
+ * such a connection so input or a hangup there means it's gone, as does a
+ * corrupt ring or a command we wouldn't take from a socket: '*closed' is
+ * TRUE for these.
+ */
+static uint8_t*
+command_source_read_shm (source_data_t *data,
+                         size_t        *size,
+                         gboolean      *closed)
+{
+    shm_ring_t *ring = &data->shm->command;
+    uint8_t *buf;
+    gssize next;
+
+    *closed = FALSE;
+    next = shm_ring_next_size (ring);
+    if (next == 0) {
+        *closed = (g_socket_condition_check (data->socket,
+                                             G_IO_IN | G_IO_HUP | G_IO_ERR)
+                   != 0);
+        return NULL;
+    }
+    if (next < 0 || next > UTIL_BUF_MAX) {
+        g_warning ("%s: bad command in ring, closing connection", __func__);
+        *closed = TRUE;
+        return NULL;
+    }
+    buf = util_buf_get (next);
+    if (!shm_ring_read (ring, buf, next)) {
+        util_buf_put (buf, next);
+        *closed = TRUE;
+        return NULL;
+    }
+    *size = next;
+    return buf;
+}
+/*
+ * Take the next message from a multiplexed connection. The channel tag it
+ * starts with is returned through 'tag'. Returns NULL with '*closed' FALSE
+ * for a message with nothing but the tag: the client is done with that
+ * channel. On EOF, error or a malformed message NULL is returned with
+ * '*closed' TRUE.
+ */
+static uint8_t*
+command_source_read_mux (source_data_t *data,
+                         guint32       *tag,
+                         size_t        *size,
+                         gboolean      *closed)
+{
+    uint8_t packet [TABRMD_CHANNEL_TAG_SIZE + UTIL_BUF_MAX], *buf;
+    GError *error = NULL;
+    gssize num_read;
+    guint32 tag_be;
+
+    *closed = TRUE;
+    num_read = g_socket_receive (data->socket,
+                                 (gchar*)packet,
+                                 sizeof (packet),
+                                 NULL,
+                                 &error);
+    if (num_read < 0) {
+        g_warning ("%s: receive on socket produced error: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        return NULL;
+    } else if (num_read == 0) {
+        g_debug ("%s: receive produced EOF", __func__);
+        return NULL;
+    } else if (num_read < TABRMD_CHANNEL_TAG_SIZE) {
+        g_warning ("%s: message of %zd bytes is too short for a channel tag",
+                   __func__, num_read);
+        return NULL;
+    }
+    memcpy (&tag_be, packet, sizeof (tag_be));
+    *tag = GUINT32_FROM_BE (tag_be);
+    num_read -= TABRMD_CHANNEL_TAG_SIZE;
+    if (num_read == 0) {
+        *closed = FALSE;
+        return NULL;
+    }
+    if (num_read < TPM_HEADER_SIZE ||
+        get_command_size (&packet [TABRMD_CHANNEL_TAG_SIZE]) != (size_t)num_read)
+    {
+        g_warning ("%s: malformed command of %zd bytes on channel 0x%" PRIx32,
+                   __func__, num_read, *tag);
+        return NULL;
+    }
+    buf = util_buf_get (num_read);
+    memcpy (buf, &packet [TABRMD_CHANNEL_TAG_SIZE], num_read);
+    *size = num_read;
+    *closed = FALSE;
+    return buf;
+}
+/*
+ * Get the logical connection for channel 'tag' of the multiplexed
+ * 'connection', creating it for the first command on the channel. Returns
+ * NULL if the connection already has TABRMD_CHANNELS_MAX channels open.
+ * No reference is taken.
+ */
+static Connection*
+command_source_get_channel (CommandSource *self,
+                            Connection    *connection,
+                            guint32        tag)
+{
+    GHashTable *channels;
+    Connection *channel;
+
+    channels = g_hash_table_lookup (self->channels, connection);
+    if (channels == NULL) {
+        channels = g_hash_table_new_full (g_direct_hash,
+                                          g_direct_equal,
+                                          NULL,
+                                          g_object_unref);
+        g_hash_table_insert (self->channels,
+                             g_object_ref (connection),
+                             channels);
+    }
+    channel = g_hash_table_lookup (channels, GUINT_TO_POINTER (tag));
+    if (channel != NULL) {
+        return channel;
+    }
+    if (g_hash_table_size (channels) >= TABRMD_CHANNELS_MAX) {
+        g_warning ("%s: connection already has %u channels open", __func__,
+                   TABRMD_CHANNELS_MAX);
+        return NULL;
+    }
+    g_debug ("%s: opening channel 0x%" PRIx32, __func__, tag);
+    channel = connection_new_channel (connection, tag);
+    g_hash_table_insert (channels, GUINT_TO_POINTER (tag), channel);
+    return channel;
+}
+/*
+ * Close a logical connection the way a real one is closed: it's marked
+ * closed and the Sink is told it's gone so its objects and sessions are
+ * flushed from the TPM.
+ */
+static void
+command_source_remove_channel (CommandSource *self,
+                               Connection    *channel)
+{
+    ControlMessage *msg;
+
+    if (self->command_recorder != NULL) {
+        command_recorder_add (self->command_recorder,
+                              COMMAND_RECORD_CLOSE,
+                              connection_get_serial (channel),
+                              NULL,
+                              0);
+    }
+    connection_set_closed (channel);
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (channel));
+    sink_enqueue (self->sink, G_OBJECT (msg));
+    g_object_unref (msg);
+}
+static void
+command_source_close_channel (CommandSource *self,
+                              Connection    *connection,
+                              guint32        tag)
+{
+    GHashTable *channels;
+    Connection *channel;
+
+    channels = g_hash_table_lookup (self->channels, connection);
+    if (channels == NULL) {
+        return;
+    }
+    channel = g_hash_table_lookup (channels, GUINT_TO_POINTER (tag));
+    if (channel == NULL) {
+        g_debug ("%s: channel 0x%" PRIx32 " isn't open", __func__, tag);
+        return;
+    }
+    g_debug ("%s: closing channel 0x%" PRIx32, __func__, tag);
+    command_source_remove_channel (self, channel);
+    g_hash_table_remove (channels, GUINT_TO_POINTER (tag));
+}
+/*
+ * Close all logical connections of a multiplexed connection that's gone.
+ */
+static void
+command_source_close_channels (CommandSource *self,
+                               Connection    *connection)
+{
+    GHashTable *channels;
+    GHashTableIter iter;
+    gpointer channel;
+
+    channels = g_hash_table_lookup (self->channels, connection);
+    if (channels == NULL) {
+        return;
+    }
+    g_hash_table_iter_init (&iter, channels);
+    while (g_hash_table_iter_next (&iter, NULL, &channel)) {
+        command_source_remove_channel (self, CONNECTION (channel));
+    }
+    g_hash_table_remove (self->channels, connection);
+}
+/*
+ * Refuse a command from a connection using more than 'max_memory', its
+ * own buffer included. FlushContext is always let through since it's how
+ * the client gets back under the limit. Returns the response refusing the
+ * command or NULL to process it.
+ */
+static Tpm2Response*
+command_source_check_memory (CommandSource *self,
+                             Tpm2Command   *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    gsize mem;
+
+    if (self->max_memory == 0 ||
+        tpm2_command_get_code (command) == TPM2_CC_FlushContext)
+    {
+        return NULL;
+    }
+    mem = connection_get_mem (connection);
+    if (mem <= self->max_memory) {
+        return NULL;
+    }
+    g_info ("%s: connection using %zu bytes, over the limit of %zu",
+            __func__, mem, self->max_memory);
+    return tpm2_response_new_rc (connection, TSS2_RESMGR_RC_OUT_OF_MEMORY);
+}
 /*
  * This function is invoked by the GMainLoop thread when a client GSocket has
  * data ready. This is what makes the CommandSource a source (of Tpm2Commands).
@@ -168,71 +636,224 @@ command_source_get_property (GObject      *object,
  *
  * If an error occurs while getting the command from the GSocket the connection
  * with the client will be closed and removed from the ConnectionManager.
- * Additionally the function will return FALSE and the GSource will no longer
- * monitor the GSocket for the G_IO_IN condition.
+ * Additionally the function will return FALSE, the socket will no longer be
+ * watched and 'user_data' is freed.
+ *
+ * The Connection is the one 'user_data' holds a reference to for as long
+ * as the socket is watched: nothing is looked up and no reference is taken
+ * per command. It must not be used once command_source_unwatch has freed
+ * 'user_data'.
+ *
+ * Commands that don't need the ResourceManager to answer them, see
+ * command_preprocess, get their response here. They're still queued so
+ * that the responses go out in the order the commands came in.
+ *
+ * On a multiplexed connection each command is sent on the logical
+ * connection for its channel. Commands queued on any channel count against
+ * the connection when deciding whether to pause it.
+ *
+ * A connection whose user is over the rate of the RateLimiter isn't read
+ * from until it's back under it, see command_source_throttle.
  */
 gboolean
 command_source_on_input_ready (GInputStream *istream,
                                gpointer      user_data)
 {
     source_data_t *data = (source_data_t*)user_data;
-    Connection    *connection;
+    CommandSource *self = data->self;
+    Connection    *connection = data->connection;
+    Connection    *channel = connection;
     Tpm2Command   *command;
+    Tpm2Response  *response;
     TPMA_CC        attributes = { 0 };
     uint8_t       *buf;
     size_t         buf_size;
+    guint          queued;
+    guint32        tag = 0;
+    gboolean       closed;
+    gint64         wait, start = 0;
 
     g_debug (__func__);
-    connection =
-        connection_manager_lookup_istream (data->self->connection_manager,
-                                           istream);
-    if (connection == NULL) {
-        g_error ("%s: failed to get connection associated with istream",
-                 __func__);
-    }
-    buf = read_tpm_buffer_alloc (istream, &buf_size);
+    if (self->rate_limiter != NULL) {
+        wait = rate_limiter_wait (self->rate_limiter,
+                                  connection_get_uid (connection),
+                                  g_get_monotonic_time ());
+        if (wait > 0) {
+            command_source_throttle (self, connection, wait);
+            command_source_unwatch (self, istream);
+            return G_SOURCE_REMOVE;
+        }
+    }
+    if (self->trace_buffer != NULL) {
+        start = g_get_monotonic_time ();
+    }
+    if (data->shm != NULL) {
+        buf = command_source_read_shm (data, &buf_size, &closed);
+        if (buf == NULL && !closed) {
+            return G_SOURCE_CONTINUE;
+        }
+    } else if (data->mux) {
+        buf = command_source_read_mux (data, &tag, &buf_size, &closed);
+        if (buf == NULL && !closed) {
+            command_source_close_channel (self, connection, tag);
+            return G_SOURCE_CONTINUE;
+        }
+        if (buf != NULL) {
+            channel = command_source_get_channel (self, connection, tag);
+            if (channel == NULL) {
+                goto fail_out;
+            }
+        }
+    } else if (data->seqpacket) {
+        buf = read_tpm_packet_alloc (data->socket, &buf_size);
+    } else {
+        buf = read_tpm_buffer_alloc (istream, &buf_size);
+    }
     if (buf == NULL) {
         goto fail_out;
     }
-    attributes = command_attrs_from_cc (data->self->command_attrs,
+    TABRMD_PROBE3 (command_read, channel, get_command_code (buf), buf_size);
+    if (self->command_recorder != NULL) {
+        command_recorder_add (self->command_recorder,
+                              COMMAND_RECORD_COMMAND,
+                              connection_get_serial (channel),
+                              buf,
+                              buf_size);
+    }
+    attributes = command_attrs_from_cc (self->command_attrs,
                                         get_command_code (buf));
-    command = tpm2_command_new (connection, buf, buf_size, attributes);
+    command = tpm2_command_new_pooled (channel, buf, buf_size, attributes);
     if (command != NULL) {
-        sink_enqueue (data->self->sink, G_OBJECT (command));
+        tpm2_command_set_passthrough (
+            command,
+            command_attrs_is_passthrough (self->command_attrs,
+                                          tpm2_command_get_code (command)));
+        response = command_source_check_memory (self, command);
+        if (response == NULL) {
+            response = command_preprocess (self->tpm2, command);
+        }
+        if (response != NULL) {
+            tpm2_command_set_response (command, response);
+            g_object_unref (response);
+        }
+        connection_command_queued (channel);
+        queued = connection_get_queued (connection);
+        if (self->rate_limiter != NULL) {
+            rate_limiter_take (self->rate_limiter,
+                               connection_get_uid (connection));
+        }
+        if (self->trace_buffer != NULL) {
+            trace_buffer_add (self->trace_buffer,
+                              TRACE_READ,
+                              start,
+                              g_get_monotonic_time (),
+                              connection_get_serial (channel),
+                              tpm2_command_get_code (command));
+        }
+        sink_enqueue (self->sink, G_OBJECT (command));
         /* the sink now owns this message */
         g_object_unref (command);
     } else {
         goto fail_out;
     }
-    g_object_unref (connection);
+    if (self->max_queued > 0 && queued >= self->max_queued) {
+        command_source_pause (self, connection);
+        command_source_unwatch (self, istream);
+        return G_SOURCE_REMOVE;
+    }
     return G_SOURCE_CONTINUE;
 fail_out:
     if (buf != NULL) {
-        g_free (buf);
+        util_buf_put (buf, buf_size);
     }
     g_debug ("%s: removing connection from connection_manager", __func__);
-    connection_manager_remove (data->self->connection_manager,
+    command_source_close_channels (self, connection);
+    if (self->command_recorder != NULL) {
+        command_recorder_add (self->command_recorder,
+                              COMMAND_RECORD_CLOSE,
+                              connection_get_serial (connection),
+                              NULL,
+                              0);
+    }
+    connection_set_closed (connection);
+    connection_manager_remove (self->connection_manager,
                                connection);
     ControlMessage *msg =
         control_message_new_with_object (CONNECTION_REMOVED,
                                          G_OBJECT (connection));
-    sink_enqueue (data->self->sink, G_OBJECT (msg));
+    sink_enqueue (self->sink, G_OBJECT (msg));
     g_object_unref (msg);
-    g_object_unref (connection);
-    /*
-     * Remove data from hash table which includes the GCancellable associated
-     * with the G_IN_IO condition source. Don't call the cancellable though
-     * since we're letting this source die at the end of this function
-     * (returning FALSE).
-     */
-    g_debug ("%s: removing GCancellable", __func__);
-    g_hash_table_remove (data->self->istream_to_source_data_map, istream);
+    /* stop watching the socket, this frees 'data' */
+    g_debug ("%s: removing source data", __func__);
+    command_source_unwatch (self, istream);
     return G_SOURCE_REMOVE;
 }
+/*
+ * Check whether a connection has more input once a command has been read.
+ */
+static gboolean
+command_source_has_input (source_data_t *data)
+{
+    if (data->shm != NULL) {
+        return !shm_ring_is_empty (&data->shm->command);
+    }
+    return g_socket_condition_check (data->socket, G_IO_IN) & G_IO_IN;
+}
+/*
+ * Handle the events from the epoll instance. Sockets are watched in edge
+ * triggered mode: each ready connection is read until no more input is
+ * available, it's paused or it's closed. The doorbell of a connection
+ * using the shared memory transport is cleared before its ring is read so
+ * a command written after the ring is found empty wakes us up again.
+ */
+static void
+command_source_on_epoll_ready (CommandSource *self)
+{
+    struct epoll_event events [COMMAND_SOURCE_EVENTS_MAX];
+    source_data_t *data;
+    gboolean ret;
+    gint count, i;
+
+    count = epoll_wait (self->epoll_fd, events, COMMAND_SOURCE_EVENTS_MAX, 0);
+    if (count == -1) {
+        if (errno != EINTR) {
+            g_warning ("%s: epoll_wait failed: %s", __func__,
+                       strerror (errno));
+        }
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        data = (source_data_t*)events [i].data.ptr;
+        if (data->shm != NULL) {
+            shm_doorbell_clear (data->doorbell);
+        }
+        do {
+            ret = command_source_on_input_ready (data->istream, data);
+        } while (ret == G_SOURCE_CONTINUE && command_source_has_input (data));
+    }
+}
+/*
+ * Determine whether a Connection is read by this CommandSource. When
+ * several CommandSources share the connections each one takes those whose
+ * ID hashes to its shard. A Connection always maps to the same shard so
+ * its commands are read in order by a single thread.
+ */
+gboolean
+command_source_owns_connection (CommandSource *self,
+                                Connection    *connection)
+{
+    if (self->shard_count <= 1) {
+        return TRUE;
+    }
+    return g_int64_hash (connection_key_id (connection)) % self->shard_count ==
+        self->shard;
+}
 /*
  * This is a callback function invoked by the ConnectionManager when a new
- * Connection object is added to it. It creates and sets up the GIO
- * machinery needed to monitor the Connection for I/O events.
+ * Connection object is added to it. It adds the socket for the Connection
+ * to the epoll instance so that the CommandSource thread is notified when
+ * the client sends a command. Connections belonging to the shard of
+ * another CommandSource are ignored.
  */
 gint
 command_source_on_new_connection (ConnectionManager   *connection_manager,
@@ -240,57 +861,60 @@ command_source_on_new_connection (ConnectionManager   *connection_manager,
                                   CommandSource       *self)
 {
     GIOStream *iostream;
-    GPollableInputStream *istream;
     source_data_t *data;
+    struct epoll_event event = { 0, };
     UNUSED_PARAM(connection_manager);
 
-    g_info ("%s: adding new connection", __func__);
-    /*
-     * Take reference to socket, will be freed when the source_data_t
-     * structure is freed
-     */
+    if (!command_source_owns_connection (self, connection)) {
+        return 0;
+    }
+    g_info ("%s: adding new connection to shard %u", __func__, self->shard);
     iostream = connection_get_iostream (connection);
-    istream = G_POLLABLE_INPUT_STREAM (g_io_stream_get_input_stream (iostream));
-    g_object_ref (istream);
     data = g_malloc0 (sizeof (source_data_t));
-    data->cancellable = g_cancellable_new ();
-    data->source = g_pollable_input_stream_create_source (istream,
-                                                          data->cancellable);
-    /* we ignore the ID returned since we keep a reference to the source around */
-    g_source_attach (data->source, self->main_context);
     data->self = self;
-    g_source_set_callback (data->source,
-                           G_SOURCE_FUNC (command_source_on_input_ready),
-                           data,
-                           NULL);
+    data->connection = g_object_ref (connection);
+    data->istream = g_io_stream_get_input_stream (iostream);
+    data->socket =
+        g_object_ref (g_socket_connection_get_socket (G_SOCKET_CONNECTION (iostream)));
+    data->seqpacket =
+        g_socket_get_socket_type (data->socket) == G_SOCKET_TYPE_SEQPACKET;
+    data->mux = data->seqpacket && connection_get_mux (connection);
+    data->shm = connection_get_shm (connection);
+    data->doorbell = connection_get_shm_command_fd (connection);
     /*
-     * To stop watching this socket for G_IO_IN condition use this GHashTable
-     * to look up the GCancellable object. The hash table takes ownership of
-     * the reference to the istream and the source_data_t pointer.
+     * The hash table takes ownership of the reference to the istream and
+     * the source_data_t pointer.
      */
-    g_hash_table_insert (self->istream_to_source_data_map, istream, data);
+    g_mutex_lock (&self->map_mutex);
+    g_hash_table_insert (self->istream_to_source_data_map,
+                         g_object_ref (data->istream),
+                         data);
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = data;
+    if (epoll_ctl (self->epoll_fd,
+                   EPOLL_CTL_ADD,
+                   g_socket_get_fd (data->socket),
+                   &event) == -1)
+    {
+        g_warning ("%s: failed to add socket to epoll: %s", __func__,
+                   strerror (errno));
+    }
+    if (data->doorbell >= 0) {
+        if (epoll_ctl (self->epoll_fd,
+                       EPOLL_CTL_ADD,
+                       data->doorbell,
+                       &event) == -1)
+        {
+            g_warning ("%s: failed to add doorbell to epoll: %s", __func__,
+                       strerror (errno));
+        }
+        /* commands written while the connection was paused are read now */
+        shm_doorbell_ring (data->doorbell);
+    }
+    g_mutex_unlock (&self->map_mutex);
 
     return 0;
 }
-/*
- * callback for iterating over objects in the member socket_to_source_data_map
- * GHashMap to kill off the GSource. This requires cancelling it, and then
- * calling the GSource destroy function. This should only happen when the
- * CommandSource object is destroyed.
- */
-static void
-command_source_source_cancel (gpointer key,
-                              gpointer value,
-                              gpointer user_data)
-{
-    UNUSED_PARAM(key);
-    UNUSED_PARAM(user_data);
-    g_debug ("%s", __func__);
-    source_data_t *data = (source_data_t*)value;
-
-    g_debug ("%s: canceling cancellable and destroying source", __func__);
-    g_cancellable_cancel (data->cancellable);
-}
 /*
  * GObject dispose function. It's used to unref / release all GObjects held
  * by the CommandSource before chaining up to the parent.
@@ -302,13 +926,21 @@ command_source_dispose (GObject *object) {
     g_clear_object (&self->sink);
     g_clear_object (&self->connection_manager);
     g_clear_object (&self->command_attrs);
-    /* cancel all outstanding G_IO_IN condition GSources and destroy them */
-    if (self->istream_to_source_data_map != NULL) {
-        g_hash_table_foreach (self->istream_to_source_data_map,
-                              command_source_source_cancel,
-                              NULL);
-    }
+    g_clear_object (&self->command_recorder);
+    g_clear_object (&self->tpm2);
+    g_clear_object (&self->rate_limiter);
+    g_clear_object (&self->trace_buffer);
+    /* stop watching all connections, then the epoll instance itself */
     g_clear_pointer (&self->istream_to_source_data_map, g_hash_table_unref);
+    g_clear_pointer (&self->channels, g_hash_table_unref);
+    if (self->epoll_source != NULL) {
+        g_source_destroy (self->epoll_source);
+        g_clear_pointer (&self->epoll_source, g_source_unref);
+    }
+    if (self->epoll_fd >= 0) {
+        close (self->epoll_fd);
+        self->epoll_fd = -1;
+    }
     if (self->main_loop != NULL && g_main_loop_is_running (self->main_loop)) {
         g_main_loop_quit (self->main_loop);
     }
@@ -324,6 +956,9 @@ command_source_dispose (GObject *object) {
 static void
 command_source_finalize (GObject  *object)
 {
+    CommandSource *self = COMMAND_SOURCE (object);
+
+    g_mutex_clear (&self->map_mutex);
     G_OBJECT_CLASS (command_source_parent_class)->finalize (object);
 }
 /*
@@ -391,6 +1026,62 @@ command_source_class_init (CommandSourceClass *klass)
                              "Reference to a Sink object.",
                              G_TYPE_OBJECT,
                              G_PARAM_READWRITE);
+    obj_properties [PROP_MAX_QUEUED] =
+        g_param_spec_uint ("max-queued",
+                           "max queued commands",
+                           "maximum number of queued commands per connection, 0 for no limit",
+                           0,
+                           TABRMD_QUEUED_MAX,
+                           TABRMD_QUEUED_MAX_DEFAULT,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_MAX_MEMORY] =
+        g_param_spec_uint ("max-memory",
+                           "max memory per connection",
+                           "KiB of daemon memory each connection may use before its commands are refused, 0 for no limit",
+                           0,
+                           TABRMD_CONNECTION_MEMORY_MAX,
+                           TABRMD_CONNECTION_MEMORY_DEFAULT,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_SHARD] =
+        g_param_spec_uint ("shard",
+                           "shard",
+                           "index of the share of connections read by this CommandSource",
+                           0,
+                           TABRMD_READERS_MAX - 1,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_SHARD_COUNT] =
+        g_param_spec_uint ("shard-count",
+                           "shard count",
+                           "number of CommandSources sharing the connections",
+                           1,
+                           TABRMD_READERS_MAX,
+                           1,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_COMMAND_RECORDER] =
+        g_param_spec_object ("command-recorder",
+                             "CommandRecorder",
+                             "CommandRecorder the commands read are written to",
+                             TYPE_COMMAND_RECORDER,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_TPM2] =
+        g_param_spec_object ("tpm2",
+                             "Tpm2 object",
+                             "Tpm2 with the fixed capabilities used to answer commands before they're queued",
+                             TYPE_TPM2,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_RATE_LIMITER] =
+        g_param_spec_object ("rate-limiter",
+                             "RateLimiter",
+                             "RateLimiter limiting the commands read from the clients of each user",
+                             TYPE_RATE_LIMITER,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_TRACE_BUFFER] =
+        g_param_spec_object ("trace-buffer",
+                             "TraceBuffer",
+                             "TraceBuffer the time spent reading commands is traced to",
+                             TYPE_TRACE_BUFFER,
+                             G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -11,9 +11,13 @@
 #include <pthread.h>
 
 #include "command-attrs.h"
+#include "command-recorder.h"
 #include "connection-manager.h"
+#include "rate-limiter.h"
 #include "sink-interface.h"
 #include "thread.h"
+#include "tpm2.h"
+#include "trace-buffer.h"
 
 G_BEGIN_DECLS
 
@@ -21,6 +25,13 @@ G_BEGIN_DECLS
  * command larger than this size will be closed.
  */
 #define BUF_MAX 4096
+/*
+ * Interval in milliseconds at which a connection that has reached the
+ * limit on queued commands is checked to see if it can be read from again.
+ */
+#define COMMAND_SOURCE_RESUME_INTERVAL_MS 5
+/* maximum number of epoll events handled per main loop iteration */
+#define COMMAND_SOURCE_EVENTS_MAX 64
 
 typedef struct _CommandSourceClass {
     ThreadClass       parent;
@@ -32,8 +43,36 @@ typedef struct _CommandSource {
     CommandAttrs      *command_attrs;
     GMainContext      *main_context;
     GMainLoop         *main_loop;
+    GSource           *epoll_source;
+    gint               epoll_fd;
+    GMutex             map_mutex;
     GHashTable        *istream_to_source_data_map;
     Sink              *sink;
+    guint              max_queued;
+    /* bytes, see connection_get_mem, 0 for no limit */
+    gsize              max_memory;
+    /* this CommandSource reads the connections hashing to 'shard' */
+    guint              shard;
+    guint              shard_count;
+    /* records the commands read and the connections closed, may be NULL */
+    CommandRecorder   *command_recorder;
+    /*
+     * answers what it can of the commands read from the snapshot of its
+     * fixed capabilities before they're queued, may be NULL
+     */
+    Tpm2              *tpm2;
+    /*
+     * limits the commands read from the clients of each user, may be NULL,
+     * shared by the CommandSources
+     */
+    RateLimiter       *rate_limiter;
+    /* traces the time spent reading each command, may be NULL */
+    TraceBuffer       *trace_buffer;
+    /*
+     * the logical connections of each multiplexed connection, a GHashTable
+     * mapping the channel tag to the Connection, only used by our thread
+     */
+    GHashTable        *channels;
 } CommandSource;
 
 #define TYPE_COMMAND_SOURCE              (command_source_get_type   ())
@@ -49,6 +88,8 @@ CommandSource*  command_source_new               (ConnectionManager  *connection
 gint            command_source_on_new_connection (ConnectionManager  *connection_manager,
                                                   Connection         *connection,
                                                   CommandSource      *command_source);
+gboolean        command_source_owns_connection   (CommandSource      *self,
+                                                  Connection         *connection);
 /*
  * The following are private functions. They are exposed here for unit
  * testing. Do not call these from anywhere else.
@@ -56,28 +97,38 @@ gint            command_source_on_new_connection (ConnectionManager  *connection
 gboolean        command_source_on_input_ready    (GInputStream       *socket,
                                                   gpointer            user_data);
 /*
- * Instances of this structure are used to track GSources and their
- * GCancellable objects that have been registered with the
- * GMainContext/Loop. We keep these structures in a GHashTable
- * (socket_to_source_data_map) keyed on the client's GSocket.
- * - When we're notified of a new connection we create a new GSource to
- *   receive a callback when the GSocket associated with the connection is in
- *   the G_IO_IN state.
- * - When we receive a callback for a GSocket that has the G_IO_IN condition
- *   and the peer has closed their connection we use this data (passed to the
- *   callback when the GSource is created and the callback registered) to find
- *   and remove the same structure from the hash table (and free it). This way
- *   when the CommandSource is destroyed we won't have stale GSources hanging
- *   around.
- * - When the CommandSource is destroyed all of the GSources registered with
- *   the GMainContext/Loop must be canceled and freed (see dispose function).
+ * Instances of this structure are used to track the client connections
+ * being watched for input. All connections share a single epoll instance
+ * that's watched by one GSource on the CommandSource GMainContext. Each
+ * epoll event carries a pointer to the source_data_t for the connection so
+ * no lookup is needed to find the Connection when a command arrives.
+ * We keep these structures in a GHashTable (istream_to_source_data_map)
+ * keyed on the client's GInputStream.
+ * - When we're notified of a new connection we add its socket to the epoll
+ *   instance.
+ * - When the peer closes the connection or the connection is paused the
+ *   structure is removed from the hash table. Freeing it removes the socket
+ *   from the epoll instance.
+ * - When the CommandSource is destroyed all of the structures are freed
+ *   (see dispose function).
+ * 'seqpacket' is TRUE for connections using a SOCK_SEQPACKET socket. Their
+ * commands are read one message at a time instead of through the istream.
+ * 'shm' is the shared region of connections using the shared memory
+ * transport. Their commands are read from the command ring and 'doorbell'
+ * is watched along with the socket.
+ * 'mux' is TRUE for seqpacket connections multiplexing logical connections:
+ * each message starts with the tag of the channel it belongs to.
  */
 typedef struct {
     CommandSource *self;
-    GCancellable  *cancellable;
-    GSource       *source;
+    Connection    *connection;
+    GInputStream  *istream;
+    GSocket       *socket;
+    gboolean       seqpacket;
+    gboolean       mux;
+    shm_region_t  *shm;
+    gint           doorbell;
 } source_data_t;
 
-
 G_END_DECLS
 #endif /* COMMAND_SOURCE_H */
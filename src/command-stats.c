@@ -0,0 +1,339 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <string.h>
+
+#include "command-stats.h"
+
+G_DEFINE_TYPE (CommandStats, command_stats, G_TYPE_OBJECT);
+
+static void
+command_stats_init (CommandStats *self)
+{
+    g_mutex_init (&self->mutex);
+    self->table = g_hash_table_new_full (g_direct_hash,
+                                         g_direct_equal,
+                                         NULL,
+                                         g_free);
+    self->rc_table = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            g_free);
+}
+static void
+command_stats_finalize (GObject *object)
+{
+    CommandStats *self = COMMAND_STATS (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    g_clear_pointer (&self->rc_table, g_hash_table_unref);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (command_stats_parent_class)->finalize (object);
+}
+static void
+command_stats_class_init (CommandStatsClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (command_stats_parent_class == NULL)
+        command_stats_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = command_stats_finalize;
+}
+CommandStats*
+command_stats_new (void)
+{
+    return COMMAND_STATS (g_object_new (TYPE_COMMAND_STATS, NULL));
+}
+/*
+ * Get the histograms for the provided command code, creating them if
+ * 'create' is TRUE. The caller must hold the mutex.
+ */
+static command_stats_histogram_t*
+command_stats_lookup (CommandStats *stats,
+                      TPM2_CC       command_code,
+                      gboolean      create)
+{
+    command_stats_histogram_t *histograms;
+
+    histograms = g_hash_table_lookup (stats->table,
+                                      GUINT_TO_POINTER (command_code));
+    if (histograms == NULL && create) {
+        histograms = g_new0 (command_stats_histogram_t, COMMAND_STATS_PHASES);
+        g_hash_table_insert (stats->table,
+                             GUINT_TO_POINTER (command_code),
+                             histograms);
+    }
+    return histograms;
+}
+static void
+command_stats_histogram_add (command_stats_histogram_t *histogram,
+                             gint64                     time_us)
+{
+    guint bucket;
+
+    time_us = MAX (time_us, 0);
+    bucket = time_us == 0 ? 0 : g_bit_storage ((guint64)time_us);
+    bucket = MIN (bucket, COMMAND_STATS_BUCKETS - 1);
+    ++histogram->count;
+    histogram->total_us += time_us;
+    ++histogram->buckets [bucket];
+}
+/*
+ * Add a single sample of 'time_us' microseconds for the given phase.
+ */
+void
+command_stats_add (CommandStats      *stats,
+                   TPM2_CC            command_code,
+                   CommandStatsPhase  phase,
+                   gint64             time_us)
+{
+    command_stats_histogram_t *histograms;
+
+    g_return_if_fail (phase < COMMAND_STATS_PHASES);
+    g_mutex_lock (&stats->mutex);
+    histograms = command_stats_lookup (stats, command_code, TRUE);
+    command_stats_histogram_add (&histograms [phase], time_us);
+    g_mutex_unlock (&stats->mutex);
+}
+/*
+ * Add the phases the ResourceManager measures for one command with a
+ * single lock. 'times' holds COMMAND_STATS_WRITE + 1 monotonic times:
+ * times [phase] is where the phase starts and times [phase + 1] where it
+ * ends. A time of 0 means the command didn't get there, phases that don't
+ * have both ends are skipped.
+ */
+void
+command_stats_add_times (CommandStats  *stats,
+                         TPM2_CC        command_code,
+                         gint64 const  *times)
+{
+    command_stats_histogram_t *histograms;
+    guint phase;
+
+    g_mutex_lock (&stats->mutex);
+    histograms = command_stats_lookup (stats, command_code, TRUE);
+    for (phase = COMMAND_STATS_QUEUE; phase < COMMAND_STATS_WRITE; ++phase) {
+        if (times [phase] != 0 && times [phase + 1] != 0) {
+            command_stats_histogram_add (&histograms [phase],
+                                         times [phase + 1] - times [phase]);
+        }
+    }
+    g_mutex_unlock (&stats->mutex);
+}
+/*
+ * Copy the histogram for the given command code and phase to the caller.
+ * Returns FALSE if no command with that code has been seen.
+ */
+gboolean
+command_stats_get (CommandStats              *stats,
+                   TPM2_CC                    command_code,
+                   CommandStatsPhase          phase,
+                   command_stats_histogram_t *histogram)
+{
+    command_stats_histogram_t *histograms;
+
+    g_return_val_if_fail (phase < COMMAND_STATS_PHASES, FALSE);
+    g_mutex_lock (&stats->mutex);
+    histograms = command_stats_lookup (stats, command_code, FALSE);
+    if (histograms != NULL) {
+        memcpy (histogram, &histograms [phase], sizeof (*histogram));
+    }
+    g_mutex_unlock (&stats->mutex);
+    return histograms != NULL;
+}
+/*
+ * Append a (backend, command code, phase, count, total_us, buckets) tuple
+ * to 'builder' for each phase with samples. The builder must be for
+ * COMMAND_STATS_VARIANT_TYPE.
+ */
+void
+command_stats_build (CommandStats    *stats,
+                     guint            backend,
+                     GVariantBuilder *builder)
+{
+    GHashTableIter iter;
+    gpointer key;
+    command_stats_histogram_t *histograms, *histogram;
+    GVariant *buckets;
+    guint phase;
+
+    g_mutex_lock (&stats->mutex);
+    g_hash_table_iter_init (&iter, stats->table);
+    while (g_hash_table_iter_next (&iter, &key, (gpointer*)&histograms)) {
+        for (phase = 0; phase < COMMAND_STATS_PHASES; ++phase) {
+            histogram = &histograms [phase];
+            if (histogram->count == 0) {
+                continue;
+            }
+            buckets = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                 histogram->buckets,
+                                                 COMMAND_STATS_BUCKETS,
+                                                 sizeof (guint64));
+            g_variant_builder_add (builder,
+                                   "(uuutt@at)",
+                                   backend,
+                                   GPOINTER_TO_UINT (key),
+                                   phase,
+                                   histogram->count,
+                                   histogram->total_us,
+                                   buckets);
+        }
+    }
+    g_mutex_unlock (&stats->mutex);
+}
+/*
+ * Count a response with the given response code. Successful responses
+ * aren't counted here, the histograms have them.
+ */
+void
+command_stats_add_rc (CommandStats *stats,
+                      TSS2_RC       rc)
+{
+    guint64 *count;
+
+    if (rc == TSS2_RC_SUCCESS) {
+        return;
+    }
+    g_mutex_lock (&stats->mutex);
+    count = g_hash_table_lookup (stats->rc_table, GUINT_TO_POINTER (rc));
+    if (count == NULL) {
+        count = g_new0 (guint64, 1);
+        g_hash_table_insert (stats->rc_table, GUINT_TO_POINTER (rc), count);
+    }
+    ++*count;
+    g_mutex_unlock (&stats->mutex);
+}
+void
+command_stats_set_sessions (CommandStats *stats,
+                            guint         sessions)
+{
+    g_atomic_int_set (&stats->sessions, (gint)sessions);
+}
+guint
+command_stats_get_sessions (CommandStats *stats)
+{
+    return (guint)g_atomic_int_get (&stats->sessions);
+}
+/*
+ * Counters wrap around at G_MAXUINT, OpenMetrics scrapers see that as a
+ * reset.
+ */
+void
+command_stats_count (CommandStats        *stats,
+                     CommandStatsCounter  counter)
+{
+    g_return_if_fail (counter < COMMAND_STATS_COUNTERS);
+    g_atomic_int_inc (&stats->counters [counter]);
+}
+guint
+command_stats_get_count (CommandStats        *stats,
+                         CommandStatsCounter  counter)
+{
+    g_return_val_if_fail (counter < COMMAND_STATS_COUNTERS, 0);
+    return (guint)g_atomic_int_get (&stats->counters [counter]);
+}
+/*
+ * Add the length of a lease that ended to the time the TPM was leased.
+ */
+void
+command_stats_add_lease (CommandStats *stats,
+                         gint64        time_us)
+{
+    g_mutex_lock (&stats->mutex);
+    stats->lease_us += MAX (time_us, 0);
+    g_mutex_unlock (&stats->mutex);
+}
+guint64
+command_stats_get_lease_us (CommandStats *stats)
+{
+    guint64 lease_us;
+
+    g_mutex_lock (&stats->mutex);
+    lease_us = stats->lease_us;
+    g_mutex_unlock (&stats->mutex);
+    return lease_us;
+}
+/*
+ * Call 'func' for each phase of each command code with samples.
+ */
+void
+command_stats_foreach (CommandStats     *stats,
+                       CommandStatsFunc  func,
+                       gpointer          user_data)
+{
+    GHashTableIter iter;
+    gpointer key;
+    command_stats_histogram_t *histograms;
+    guint phase;
+
+    g_mutex_lock (&stats->mutex);
+    g_hash_table_iter_init (&iter, stats->table);
+    while (g_hash_table_iter_next (&iter, &key, (gpointer*)&histograms)) {
+        for (phase = 0; phase < COMMAND_STATS_PHASES; ++phase) {
+            if (histograms [phase].count > 0) {
+                func (GPOINTER_TO_UINT (key),
+                      phase,
+                      &histograms [phase],
+                      user_data);
+            }
+        }
+    }
+    g_mutex_unlock (&stats->mutex);
+}
+/*
+ * Call 'func' for each response code counted by command_stats_add_rc.
+ */
+void
+command_stats_foreach_rc (CommandStats       *stats,
+                          CommandStatsRcFunc  func,
+                          gpointer            user_data)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_mutex_lock (&stats->mutex);
+    g_hash_table_iter_init (&iter, stats->rc_table);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        func (GPOINTER_TO_UINT (key), *(guint64*)value, user_data);
+    }
+    g_mutex_unlock (&stats->mutex);
+}
+const gchar*
+command_stats_phase_name (CommandStatsPhase phase)
+{
+    switch (phase) {
+    case COMMAND_STATS_QUEUE:
+        return "queue";
+    case COMMAND_STATS_LOAD:
+        return "load";
+    case COMMAND_STATS_EXEC:
+        return "exec";
+    case COMMAND_STATS_SAVE:
+        return "save";
+    case COMMAND_STATS_WRITE:
+        return "write";
+    default:
+        return "unknown";
+    }
+}
+const gchar*
+command_stats_counter_name (CommandStatsCounter counter)
+{
+    switch (counter) {
+    case COMMAND_STATS_CONTEXT_LOAD:
+        return "load";
+    case COMMAND_STATS_CONTEXT_SAVE:
+        return "save";
+    case COMMAND_STATS_CONTEXT_FLUSH:
+        return "flush";
+    case COMMAND_STATS_RESIDENT_HIT:
+        return "resident_hit";
+    case COMMAND_STATS_REGAP:
+        return "regap";
+    case COMMAND_STATS_LEASE:
+        return "lease";
+    case COMMAND_STATS_LEASE_EXPIRED:
+        return "lease_expired";
+    default:
+        return "unknown";
+    }
+}
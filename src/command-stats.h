@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef COMMAND_STATS_H
+#define COMMAND_STATS_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Histograms have logarithmic buckets: bucket 0 counts samples under 1us,
+ * bucket i counts samples in [2^(i-1), 2^i) us and the last bucket
+ * everything from 2^(COMMAND_STATS_BUCKETS - 2) us (about 4s) up.
+ */
+#define COMMAND_STATS_BUCKETS 24
+/* GVariant type of the statistics built by command_stats_build */
+#define COMMAND_STATS_VARIANT_TYPE "a(uuuttat)"
+
+/*
+ * The phases a command goes through. The first four follow each other in
+ * the ResourceManager thread, each ends where the next starts:
+ * - QUEUE: waiting in the input queue of the ResourceManager
+ * - LOAD: saving, loading and evicting contexts before the command is sent
+ * - EXEC: executing in the TPM, including retries after the RM made room
+ * - SAVE: mapping handles in the response and saving contexts afterwards
+ * WRITE is measured by the ResponseSink: the time from the response being
+ * queued for it to the response being written to the client.
+ */
+typedef enum {
+    COMMAND_STATS_QUEUE,
+    COMMAND_STATS_LOAD,
+    COMMAND_STATS_EXEC,
+    COMMAND_STATS_SAVE,
+    COMMAND_STATS_WRITE,
+    COMMAND_STATS_PHASES,
+} CommandStatsPhase;
+
+/*
+ * Operations the ResourceManager counts, for the TPM and for each client
+ * connection:
+ * - CONTEXT_LOAD / SAVE / FLUSH: successful ContextLoad, ContextSave and
+ *   FlushContext commands it sent, a save and flush counts as one of each
+ * - RESIDENT_HIT: a transient object a command needed was still loaded
+ * - REGAP: a session was reloaded and saved to close the context gap
+ * - LEASE: a lease of the TPM was granted with TSS2_TABRMD_CC_LEASE
+ * - LEASE_EXPIRED: a lease ran out before the client released it
+ */
+typedef enum {
+    COMMAND_STATS_CONTEXT_LOAD,
+    COMMAND_STATS_CONTEXT_SAVE,
+    COMMAND_STATS_CONTEXT_FLUSH,
+    COMMAND_STATS_RESIDENT_HIT,
+    COMMAND_STATS_REGAP,
+    COMMAND_STATS_LEASE,
+    COMMAND_STATS_LEASE_EXPIRED,
+    COMMAND_STATS_COUNTERS,
+} CommandStatsCounter;
+
+typedef struct {
+    guint64           count;
+    guint64           total_us;
+    guint64           buckets [COMMAND_STATS_BUCKETS];
+} command_stats_histogram_t;
+
+/*
+ * Callbacks for command_stats_foreach and command_stats_foreach_rc. They
+ * are called with the mutex held and must not call back in to the
+ * CommandStats.
+ */
+typedef void (*CommandStatsFunc)   (TPM2_CC                          command_code,
+                                    CommandStatsPhase                phase,
+                                    command_stats_histogram_t const *histogram,
+                                    gpointer                         user_data);
+typedef void (*CommandStatsRcFunc) (TSS2_RC                          rc,
+                                    guint64                          count,
+                                    gpointer                         user_data);
+
+typedef struct _CommandStatsClass {
+    GObjectClass      parent;
+} CommandStatsClass;
+
+/*
+ * 'table' maps each command code to an array of COMMAND_STATS_PHASES
+ * histograms and 'rc_table' each response code other than success to the
+ * number of responses with that code. The ResourceManager and the
+ * ResponseSink of a TPM add to them from their threads and the main
+ * thread reads them, hence the mutex. 'sessions' is the number of
+ * sessions the ResourceManager tracks and 'counters' are the counts of
+ * each CommandStatsCounter, those are updated atomically. 'lease_us' is
+ * the time the TPM was leased to a connection, under the mutex.
+ */
+typedef struct _CommandStats {
+    GObject           parent_instance;
+    GMutex            mutex;
+    GHashTable       *table;
+    GHashTable       *rc_table;
+    gint              sessions;
+    gint              counters [COMMAND_STATS_COUNTERS];
+    guint64           lease_us;
+} CommandStats;
+
+#define TYPE_COMMAND_STATS              (command_stats_get_type   ())
+#define COMMAND_STATS(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_COMMAND_STATS, CommandStats))
+#define COMMAND_STATS_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_COMMAND_STATS, CommandStatsClass))
+#define IS_COMMAND_STATS(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_COMMAND_STATS))
+#define IS_COMMAND_STATS_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_COMMAND_STATS))
+#define COMMAND_STATS_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_COMMAND_STATS, CommandStatsClass))
+
+GType            command_stats_get_type    (void);
+CommandStats*    command_stats_new         (void);
+void             command_stats_add         (CommandStats      *stats,
+                                            TPM2_CC            command_code,
+                                            CommandStatsPhase  phase,
+                                            gint64             time_us);
+void             command_stats_add_times   (CommandStats      *stats,
+                                            TPM2_CC            command_code,
+                                            gint64 const      *times);
+gboolean         command_stats_get         (CommandStats      *stats,
+                                            TPM2_CC            command_code,
+                                            CommandStatsPhase  phase,
+                                            command_stats_histogram_t *histogram);
+void             command_stats_build       (CommandStats      *stats,
+                                            guint              backend,
+                                            GVariantBuilder   *builder);
+void             command_stats_add_rc      (CommandStats      *stats,
+                                            TSS2_RC            rc);
+void             command_stats_set_sessions (CommandStats     *stats,
+                                             guint             sessions);
+guint            command_stats_get_sessions (CommandStats     *stats);
+void             command_stats_foreach     (CommandStats      *stats,
+                                            CommandStatsFunc   func,
+                                            gpointer           user_data);
+void             command_stats_foreach_rc  (CommandStats      *stats,
+                                            CommandStatsRcFunc func,
+                                            gpointer           user_data);
+void             command_stats_count       (CommandStats      *stats,
+                                            CommandStatsCounter counter);
+guint            command_stats_get_count   (CommandStats      *stats,
+                                            CommandStatsCounter counter);
+void             command_stats_add_lease   (CommandStats      *stats,
+                                            gint64             time_us);
+guint64          command_stats_get_lease_us (CommandStats     *stats);
+const gchar*     command_stats_phase_name  (CommandStatsPhase  phase);
+const gchar*     command_stats_counter_name (CommandStatsCounter counter);
+
+G_END_DECLS
+#endif /* COMMAND_STATS_H */
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stddef.h>
+#include <string.h>
+
+#include "alloc-stats.h"
+#include "connection-arena.h"
+
+G_DEFINE_TYPE (ConnectionArena, connection_arena, G_TYPE_OBJECT);
+
+/*
+ * A slot knows its arena so a context can be given back without it. While
+ * the slot is on the free list the context holds the next free slot.
+ */
+typedef struct connection_arena_slot {
+    ConnectionArena *arena;
+    union {
+        struct connection_arena_slot *next;
+        TPMS_CONTEXT                  context;
+    } u;
+} connection_arena_slot_t;
+
+#define SLOT_FROM_CONTEXT(ctx) \
+    ((connection_arena_slot_t*)((guint8*)(ctx) - \
+                                offsetof (connection_arena_slot_t, u.context)))
+
+static void
+connection_arena_init (ConnectionArena *self)
+{
+    g_mutex_init (&self->mutex);
+    self->chunks = g_ptr_array_new_with_free_func (g_free);
+}
+/*
+ * GObject finalize function: every slot was given back since each holds
+ * a reference, so the chunks are freed in one go.
+ */
+static void
+connection_arena_finalize (GObject *object)
+{
+    ConnectionArena *self = CONNECTION_ARENA (object);
+
+    g_debug ("%s: freeing %u chunks", __func__, self->chunks->len);
+    g_ptr_array_free (self->chunks, TRUE);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (connection_arena_parent_class)->finalize (object);
+}
+static void
+connection_arena_class_init (ConnectionArenaClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (connection_arena_parent_class == NULL)
+        connection_arena_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = connection_arena_finalize;
+}
+ConnectionArena*
+connection_arena_new (void)
+{
+    return CONNECTION_ARENA (g_object_new (TYPE_CONNECTION_ARENA, NULL));
+}
+/*
+ * Add a chunk of CONNECTION_ARENA_CHUNK_SLOTS slots to the free list. The
+ * caller must hold the mutex.
+ */
+static void
+connection_arena_grow (ConnectionArena *arena)
+{
+    connection_arena_slot_t *chunk;
+    guint i;
+
+    ALLOC_STATS_ADD (ALLOC_STATS_CONNECTION,
+                     CONNECTION_ARENA_CHUNK_SLOTS *
+                     sizeof (connection_arena_slot_t));
+    chunk = g_new (connection_arena_slot_t, CONNECTION_ARENA_CHUNK_SLOTS);
+    for (i = 0; i < CONNECTION_ARENA_CHUNK_SLOTS; ++i) {
+        chunk [i].arena = arena;
+        chunk [i].u.next = arena->free_slots;
+        arena->free_slots = &chunk [i];
+    }
+    g_ptr_array_add (arena->chunks, chunk);
+}
+/*
+ * Get a zeroed TPMS_CONTEXT from the arena. It must be given back with
+ * connection_arena_free, until then it holds a reference to the arena.
+ */
+TPMS_CONTEXT*
+connection_arena_alloc (ConnectionArena *arena)
+{
+    connection_arena_slot_t *slot;
+
+    g_mutex_lock (&arena->mutex);
+    if (arena->free_slots == NULL) {
+        connection_arena_grow (arena);
+    }
+    slot = arena->free_slots;
+    arena->free_slots = slot->u.next;
+    ++arena->slots_used;
+    g_mutex_unlock (&arena->mutex);
+
+    g_object_ref (arena);
+    memset (&slot->u.context, 0, sizeof (slot->u.context));
+    return &slot->u.context;
+}
+/*
+ * Give a context from connection_arena_alloc back to its arena. This
+ * drops the reference the context held, the arena and all of its chunks
+ * are freed if it was the last.
+ */
+void
+connection_arena_free (TPMS_CONTEXT *context)
+{
+    connection_arena_slot_t *slot;
+    ConnectionArena *arena;
+
+    if (context == NULL) {
+        return;
+    }
+    slot = SLOT_FROM_CONTEXT (context);
+    arena = slot->arena;
+    g_mutex_lock (&arena->mutex);
+    slot->u.next = arena->free_slots;
+    arena->free_slots = slot;
+    --arena->slots_used;
+    g_mutex_unlock (&arena->mutex);
+    g_object_unref (arena);
+}
+/*
+ * The number of contexts handed out and not yet given back.
+ */
+guint
+connection_arena_get_used (ConnectionArena *arena)
+{
+    guint used;
+
+    g_mutex_lock (&arena->mutex);
+    used = arena->slots_used;
+    g_mutex_unlock (&arena->mutex);
+    return used;
+}
+/*
+ * The number of chunks allocated, they're only freed with the arena.
+ */
+guint
+connection_arena_get_chunks (ConnectionArena *arena)
+{
+    guint chunks;
+
+    g_mutex_lock (&arena->mutex);
+    chunks = arena->chunks->len;
+    g_mutex_unlock (&arena->mutex);
+    return chunks;
+}
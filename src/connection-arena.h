@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CONNECTION_ARENA_H
+#define CONNECTION_ARENA_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/* slots allocated at a time as the arena grows */
+#define CONNECTION_ARENA_CHUNK_SLOTS 4
+
+/*
+ * The ConnectionArena holds the saved contexts of the transient objects
+ * and sessions of one connection in slots of a few large chunks instead
+ * of in one heap allocation each. A slot given back goes on the free list
+ * for the next context of the connection, and the chunks are only freed,
+ * all at once, when the arena goes away. That way the contexts of the
+ * many short lived connections don't leave holes all over the heap.
+ *
+ * Each slot handed out holds a reference to the arena, so the arena
+ * outlives its Connection as long as entries of the connection hold
+ * contexts, e.g. within the resume grace period. The mutex is needed
+ * since the last reference to an entry may be dropped by any thread.
+ */
+typedef struct _ConnectionArenaClass {
+    GObjectClass      parent;
+} ConnectionArenaClass;
+
+typedef struct _ConnectionArena {
+    GObject           parent_instance;
+    GMutex            mutex;
+    /* base address of each chunk */
+    GPtrArray        *chunks;
+    /* slots that were handed out and given back */
+    gpointer          free_slots;
+    guint             slots_used;
+} ConnectionArena;
+
+#define TYPE_CONNECTION_ARENA              (connection_arena_get_type   ())
+#define CONNECTION_ARENA(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CONNECTION_ARENA, ConnectionArena))
+#define CONNECTION_ARENA_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CONNECTION_ARENA, ConnectionArenaClass))
+#define IS_CONNECTION_ARENA(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CONNECTION_ARENA))
+#define IS_CONNECTION_ARENA_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CONNECTION_ARENA))
+#define CONNECTION_ARENA_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CONNECTION_ARENA, ConnectionArenaClass))
+
+GType            connection_arena_get_type  (void);
+ConnectionArena* connection_arena_new       (void);
+TPMS_CONTEXT*    connection_arena_alloc     (ConnectionArena  *arena);
+void             connection_arena_free      (TPMS_CONTEXT     *context);
+guint            connection_arena_get_used  (ConnectionArena  *arena);
+guint            connection_arena_get_chunks (ConnectionArena *arena);
+
+G_END_DECLS
+#endif /* CONNECTION_ARENA_H */
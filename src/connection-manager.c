@@ -14,7 +14,7 @@
 #include "connection-manager.h"
 #include "util.h"
 
-#define MAX_CONNECTIONS 100
+#define MAX_CONNECTIONS CONNECTION_MANAGER_MAX
 #define MAX_CONNECTIONS_DEFAULT 27
 
 G_DEFINE_TYPE (ConnectionManager, connection_manager, G_TYPE_OBJECT);
@@ -22,6 +22,7 @@ G_DEFINE_TYPE (ConnectionManager, connection_manager, G_TYPE_OBJECT);
 enum {
     SIGNAL_0,
     SIGNAL_NEW_CONNECTION,
+    SIGNAL_CONNECTION_REMOVED,
     N_SIGNALS,
 };
 
@@ -34,6 +35,102 @@ static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
 
 static guint signals [N_SIGNALS] = { 0, };
 
+/*
+ * An immutable copy of the connection tables. It holds a reference to
+ * each Connection so that one found by a lookup stays valid until the
+ * lookup has taken its own reference, even if it's removed meanwhile.
+ */
+typedef struct {
+    GHashTable       *by_istream;
+    GHashTable       *by_id;
+} connection_snapshot_t;
+
+static void
+connection_snapshot_free (gpointer data)
+{
+    connection_snapshot_t *snapshot = (connection_snapshot_t*)data;
+
+    g_hash_table_unref (snapshot->by_id);
+    g_hash_table_unref (snapshot->by_istream);
+    g_free (snapshot);
+}
+static connection_snapshot_t*
+connection_snapshot_new (GHashTable *connection_from_id_table)
+{
+    connection_snapshot_t *snapshot = g_new0 (connection_snapshot_t, 1);
+    GHashTableIter iter;
+    gpointer value;
+    Connection *connection;
+
+    snapshot->by_istream = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL,
+                                                  (GDestroyNotify)g_object_unref);
+    snapshot->by_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+    if (connection_from_id_table == NULL) {
+        return snapshot;
+    }
+    g_hash_table_iter_init (&iter, connection_from_id_table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        connection = CONNECTION (value);
+        g_hash_table_insert (snapshot->by_istream,
+                             connection_key_istream (connection),
+                             g_object_ref (connection));
+        g_hash_table_insert (snapshot->by_id,
+                             connection_key_id (connection),
+                             connection);
+    }
+    return snapshot;
+}
+/*
+ * Replace the snapshot after the tables have changed. Must be called with
+ * the mutex held. Lookups increment 'readers' before loading the snapshot
+ * and the compare and exchange is a full barrier: once it's done a lookup
+ * either shows up in 'readers' or will load the new snapshot. So when no
+ * lookup is in flight none can still be using a retired snapshot.
+ */
+static void
+connection_manager_publish (ConnectionManager *manager)
+{
+    gpointer old;
+
+    do {
+        old = g_atomic_pointer_get (&manager->snapshot);
+    } while (!g_atomic_pointer_compare_and_exchange (
+                 &manager->snapshot,
+                 old,
+                 connection_snapshot_new (manager->connection_from_id_table)));
+    manager->retired = g_slist_prepend (manager->retired, old);
+    if (g_atomic_int_get (&manager->readers) == 0) {
+        g_slist_free_full (manager->retired, connection_snapshot_free);
+        manager->retired = NULL;
+    }
+}
+/*
+ * Look up 'key' in one of the tables in the current snapshot without
+ * taking the mutex. The Connection returned, if any, has had its reference
+ * count incremented.
+ */
+static Connection*
+connection_manager_snapshot_lookup (ConnectionManager *manager,
+                                    gboolean           by_id,
+                                    gconstpointer      key)
+{
+    connection_snapshot_t *snapshot;
+    Connection *connection;
+
+    g_atomic_int_inc (&manager->readers);
+    snapshot = g_atomic_pointer_get (&manager->snapshot);
+    connection = g_hash_table_lookup (by_id ? snapshot->by_id
+                                            : snapshot->by_istream,
+                                      key);
+    if (connection != NULL) {
+        g_object_ref (connection);
+    }
+    g_atomic_int_add (&manager->readers, -1);
+    return connection;
+}
+
 /*
  * GObject property setter.
  */
@@ -110,6 +207,7 @@ connection_manager_init (ConnectionManager *mgr)
                                g_int64_equal,
                                NULL,
                                (GDestroyNotify)g_object_unref);
+    mgr->snapshot = connection_snapshot_new (NULL);
 }
 
 static void
@@ -122,8 +220,11 @@ connection_manager_dispose (GObject *obj)
     if (ret != 0)
         g_warning ("Error locking connection_manager mutex: %s",
                    strerror (errno));
-    g_hash_table_unref (self->connection_from_istream_table);
-    g_hash_table_unref (self->connection_from_id_table);
+    g_clear_pointer (&self->connection_from_istream_table, g_hash_table_unref);
+    g_clear_pointer (&self->connection_from_id_table, g_hash_table_unref);
+    g_clear_pointer (&self->snapshot, connection_snapshot_free);
+    g_slist_free_full (self->retired, connection_snapshot_free);
+    self->retired = NULL;
     ret = pthread_mutex_unlock (&self->mutex);
     if (ret != 0)
         g_error ("Error unlocking connection_manager mutex: %s",
@@ -147,7 +248,9 @@ connection_manager_finalize (GObject *obj)
  * signal invokes callbacks with the new_connection_callback type (see
  * header). This signal is emitted by the connection_manager_insert function
  * which is where we add new Connection objects to those tracked by the
- * ConnectionManager.
+ * ConnectionManager. The 'connection-removed' signal is emitted by
+ * connection_manager_remove once a Connection is no longer tracked. It's
+ * emitted from the thread that removed the Connection.
  */
 static void
 connection_manager_class_init (ConnectionManagerClass *klass)
@@ -171,6 +274,17 @@ connection_manager_class_init (ConnectionManagerClass *klass)
                       G_TYPE_INT,
                       1,
                       TYPE_CONNECTION);
+    signals [SIGNAL_CONNECTION_REMOVED] =
+        g_signal_new ("connection-removed",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_NONE,
+                      1,
+                      TYPE_CONNECTION);
     obj_properties [PROP_MAX_CONNECTIONS] =
         g_param_spec_uint ("max-connections",
                            "max connections",
@@ -212,6 +326,7 @@ connection_manager_insert (ConnectionManager    *manager,
     g_hash_table_insert (manager->connection_from_id_table,
                          connection_key_id (connection),
                          connection);
+    connection_manager_publish (manager);
     ret = pthread_mutex_unlock (&manager->mutex);
     if (ret != 0)
         g_error ("Error unlocking connection_manager mutex: %s",
@@ -228,7 +343,8 @@ connection_manager_insert (ConnectionManager    *manager,
  * Lookup a Connection object from the provided connection fd. This function
  * returns a reference to the Connection object. The reference count for
  * this object is incremented before it is returned and must be decremented
- * by the caller.
+ * by the caller. This is done for every command read so it never waits
+ * for connections being added or removed.
  */
 Connection*
 connection_manager_lookup_istream (ConnectionManager *manager,
@@ -236,15 +352,10 @@ connection_manager_lookup_istream (ConnectionManager *manager,
 {
     Connection *connection;
 
-    pthread_mutex_lock (&manager->mutex);
-    connection = g_hash_table_lookup (manager->connection_from_istream_table,
-                                      istream);
-    if (connection != NULL) {
-        g_object_ref (connection);
-    } else {
+    connection = connection_manager_snapshot_lookup (manager, FALSE, istream);
+    if (connection == NULL) {
         g_warning ("%s returned NULL connection", __func__);
     }
-    pthread_mutex_unlock (&manager->mutex);
 
     return connection;
 }
@@ -260,18 +371,10 @@ connection_manager_lookup_id (ConnectionManager   *manager,
 {
     Connection *connection;
 
-    g_debug ("locking manager mutex");
-    pthread_mutex_lock (&manager->mutex);
-    g_debug ("g_hash_table_lookup: connection_from_id_table");
-    connection = g_hash_table_lookup (manager->connection_from_id_table,
-                                      &id);
-    if (connection != NULL) {
-        g_object_ref (connection);
-    } else {
+    connection = connection_manager_snapshot_lookup (manager, TRUE, &id);
+    if (connection == NULL) {
         g_warning ("connection_manager_lookup_id returned NULL connection");
     }
-    g_debug ("unlocking manager mutex");
-    pthread_mutex_unlock (&manager->mutex);
 
     return connection;
 }
@@ -280,7 +383,14 @@ gboolean
 connection_manager_contains_id (ConnectionManager *manager,
                                 gint64             id)
 {
-    return g_hash_table_contains (manager->connection_from_id_table, &id);
+    Connection *connection;
+
+    connection = connection_manager_snapshot_lookup (manager, TRUE, &id);
+    if (connection == NULL) {
+        return FALSE;
+    }
+    g_object_unref (connection);
+    return TRUE;
 }
 
 gboolean
@@ -290,6 +400,8 @@ connection_manager_remove (ConnectionManager   *manager,
     gboolean ret;
 
     g_debug ("%s: removing Connection", __func__);
+    /* keep the Connection alive for the 'connection-removed' handlers */
+    g_object_ref (connection);
     pthread_mutex_lock (&manager->mutex);
     ret = g_hash_table_remove (manager->connection_from_istream_table,
                                connection_key_istream (connection));
@@ -299,24 +411,142 @@ connection_manager_remove (ConnectionManager   *manager,
                                connection_key_id (connection));
     if (ret != TRUE)
         g_error ("%s: failed to remove Connection", __func__);
+    connection_manager_publish (manager);
     pthread_mutex_unlock (&manager->mutex);
+    g_signal_emit (manager,
+                   signals [SIGNAL_CONNECTION_REMOVED],
+                   0,
+                   connection);
+    g_object_unref (connection);
 
     return ret;
 }
 
+/*
+ * Reading the size of the snapshot is a lookup like the others: a change
+ * made meanwhile could retire and free it if we weren't counted.
+ */
 guint
 connection_manager_size (ConnectionManager   *manager)
 {
-    return g_hash_table_size (manager->connection_from_istream_table);
+    connection_snapshot_t *snapshot;
+    guint size;
+
+    g_atomic_int_inc (&manager->readers);
+    snapshot = g_atomic_pointer_get (&manager->snapshot);
+    size = g_hash_table_size (snapshot->by_id);
+    g_atomic_int_add (&manager->readers, -1);
+    return size;
+}
+
+/*
+ * Get a list of all of the connections, each with its reference count
+ * incremented. Free it with g_list_free_full and g_object_unref.
+ */
+GList*
+connection_manager_get_connections (ConnectionManager *manager)
+{
+    connection_snapshot_t *snapshot;
+    GList *connections, *link;
+
+    g_atomic_int_inc (&manager->readers);
+    snapshot = g_atomic_pointer_get (&manager->snapshot);
+    connections = g_hash_table_get_values (snapshot->by_id);
+    for (link = connections; link != NULL; link = link->next) {
+        g_object_ref (link->data);
+    }
+    g_atomic_int_add (&manager->readers, -1);
+    return connections;
+}
+/*
+ * The limit on connections. It may be changed while connections come and
+ * go, connections over a lowered limit are kept until they close.
+ */
+guint
+connection_manager_get_max (ConnectionManager *manager)
+{
+    return g_atomic_int_get (&manager->max_connections);
+}
+void
+connection_manager_set_max (ConnectionManager *manager,
+                            guint              max_connections)
+{
+    g_atomic_int_set (&manager->max_connections, max_connections);
+}
+/*
+ * The quotas on the connections of one process and of one user, 0 for
+ * none. Like the limit on connections they may be changed at any time and
+ * connections over a lowered quota are kept.
+ */
+void
+connection_manager_set_max_per_pid (ConnectionManager *manager,
+                                    guint              max_per_pid)
+{
+    g_atomic_int_set (&manager->max_per_pid, max_per_pid);
+}
+void
+connection_manager_set_max_per_uid (ConnectionManager *manager,
+                                    guint              max_per_uid)
+{
+    g_atomic_int_set (&manager->max_per_uid, max_per_uid);
 }
+/*
+ * Whether 'count' more connections for the process 'pid' of the user
+ * 'uid' would be over their quotas. A PID of 0 or a UID of
+ * RATE_LIMITER_UID_NONE means the frontend couldn't tell who the client
+ * is and that quota isn't checked. The connections are counted in one
+ * pass over the current snapshot.
+ */
+gboolean
+connection_manager_client_is_full (ConnectionManager *manager,
+                                   guint32            pid,
+                                   guint32            uid,
+                                   guint              count)
+{
+    connection_snapshot_t *snapshot;
+    GHashTableIter iter;
+    gpointer value;
+    Connection *connection;
+    guint max_pid, max_uid, pid_count = 0, uid_count = 0;
 
+    max_pid = pid != 0 ? (guint)g_atomic_int_get (&manager->max_per_pid) : 0;
+    max_uid = uid != RATE_LIMITER_UID_NONE ?
+        (guint)g_atomic_int_get (&manager->max_per_uid) : 0;
+    if (max_pid == 0 && max_uid == 0) {
+        return FALSE;
+    }
+    g_atomic_int_inc (&manager->readers);
+    snapshot = g_atomic_pointer_get (&manager->snapshot);
+    g_hash_table_iter_init (&iter, snapshot->by_id);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        connection = CONNECTION (value);
+        if (connection_get_pid (connection) == pid) {
+            ++pid_count;
+        }
+        if (connection_get_uid (connection) == uid) {
+            ++uid_count;
+        }
+    }
+    g_atomic_int_add (&manager->readers, -1);
+    if (max_pid != 0 && pid_count + count > max_pid) {
+        g_info ("%s: PID %" PRIu32 " has %u of its %u connections",
+                __func__, pid, pid_count, max_pid);
+        return TRUE;
+    }
+    if (max_uid != 0 && uid_count + count > max_uid) {
+        g_info ("%s: UID %" PRIu32 " has %u of its %u connections",
+                __func__, uid, uid_count, max_uid);
+        return TRUE;
+    }
+    return FALSE;
+}
 gboolean
 connection_manager_is_full (ConnectionManager *manager)
 {
     guint table_size;
 
-    table_size = g_hash_table_size (manager->connection_from_istream_table);
-    if (table_size < manager->max_connections) {
+    table_size = connection_manager_size (manager);
+    if (table_size < connection_manager_get_max (manager)) {
         return FALSE;
     } else {
         return TRUE;
@@ -13,18 +13,31 @@
 
 G_BEGIN_DECLS
 
-#define CONNECTION_MANAGER_MAX 100
+#define CONNECTION_MANAGER_MAX 4096
 
 typedef struct _ConnectionManagerClass {
     GObjectClass      parent;
 } ConnectionManagerClass;
 
+/*
+ * The hash tables are only used by the functions changing the set of
+ * connections, under 'mutex'. Every change publishes a new immutable
+ * 'snapshot' of them that lookups read without taking the mutex.
+ * 'readers' counts the lookups in flight, replaced snapshots wait in
+ * 'retired' until a change finds no lookup in flight.
+ */
 typedef struct _ConnectionManager {
     GObject           parent_instance;
     pthread_mutex_t   mutex;
     GHashTable       *connection_from_istream_table;
     GHashTable       *connection_from_id_table;
     guint             max_connections;
+    /* per-client quotas, 0 for none, see connection_manager_client_is_full */
+    guint             max_per_pid;
+    guint             max_per_uid;
+    gpointer          snapshot;
+    gint              readers;
+    GSList           *retired;
 } ConnectionManager;
 
 #define TYPE_CONNECTION_MANAGER              (connection_manager_get_type   ())
@@ -48,6 +61,18 @@ gboolean       connection_manager_contains_id (ConnectionManager  *manager,
                                                gint64              id_in);
 guint          connection_manager_size        (ConnectionManager  *manager);
 gboolean       connection_manager_is_full     (ConnectionManager  *manager);
+guint          connection_manager_get_max     (ConnectionManager  *manager);
+void           connection_manager_set_max     (ConnectionManager  *manager,
+                                               guint               max_connections);
+GList*         connection_manager_get_connections (ConnectionManager *manager);
+void           connection_manager_set_max_per_pid (ConnectionManager *manager,
+                                                   guint              max_per_pid);
+void           connection_manager_set_max_per_uid (ConnectionManager *manager,
+                                                   guint              max_per_uid);
+gboolean       connection_manager_client_is_full (ConnectionManager *manager,
+                                                  guint32            pid,
+                                                  guint32            uid,
+                                                  guint              count);
 
 G_END_DECLS
 #endif /* CONNECTION_MANAGER_H */
@@ -11,7 +11,9 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "alloc-stats.h"
 #include "connection.h"
+#include "tabrmd-defaults.h"
 #include "util.h"
 
 G_DEFINE_TYPE (Connection, connection, G_TYPE_OBJECT);
@@ -21,6 +23,7 @@ enum {
     PROP_ID,
     PROP_IO_STREAM,
     PROP_TRANSIENT_HANDLE_MAP,
+    PROP_PRIORITY,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -48,6 +51,10 @@ connection_set_property (GObject       *object,
         g_object_ref (self->transient_handle_map);
         g_debug ("%s: set transient_handle_map", __func__);
         break;
+    case PROP_PRIORITY:
+        self->priority = g_value_get_uint (value);
+        g_debug ("%s: set priority to %u", __func__, self->priority);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -72,20 +79,25 @@ connection_get_property (GObject     *object,
     case PROP_TRANSIENT_HANDLE_MAP:
         g_value_set_object (value, self->transient_handle_map);
         break;
+    case PROP_PRIORITY:
+        g_value_set_uint (value, self->priority);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
     }
 }
 
-/*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
- */
 static void
 connection_init (Connection *connection)
 {
-    UNUSED_PARAM(connection);
-    /* noop */
+    static gint serial = 0;
+
+    connection->shm_command_fd = -1;
+    connection->shm_response_fd = -1;
+    connection->uid = RATE_LIMITER_UID_NONE;
+    connection->serial = (guint)g_atomic_int_add (&serial, 1) + 1;
+    connection->arena = connection_arena_new ();
 }
 
 static void
@@ -94,7 +106,18 @@ connection_dispose (GObject *obj)
     Connection *connection = CONNECTION (obj);
 
     g_clear_object (&connection->iostream);
+    g_clear_object (&connection->parent);
     g_object_unref (connection->transient_handle_map);
+    g_clear_pointer (&connection->shm, shm_region_unmap);
+    g_clear_object (&connection->arena);
+    if (connection->shm_command_fd >= 0) {
+        close (connection->shm_command_fd);
+        connection->shm_command_fd = -1;
+    }
+    if (connection->shm_response_fd >= 0) {
+        close (connection->shm_response_fd);
+        connection->shm_response_fd = -1;
+    }
 
     G_OBJECT_CLASS (connection_parent_class)->dispose (obj);
 }
@@ -132,6 +155,14 @@ connection_class_init (ConnectionClass *klass)
                              "HandleMap object to map handles to transient object contexts",
                              G_TYPE_OBJECT,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_PRIORITY] =
+        g_param_spec_uint ("priority",
+                           "priority class",
+                           "Priority class used to schedule commands from the connection",
+                           TABRMD_PRIORITY_INTERACTIVE,
+                           TABRMD_PRIORITY_BATCH,
+                           TABRMD_PRIORITY_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -146,6 +177,11 @@ connection_new (GIOStream  *iostream,
                 guint64     id,
                 HandleMap  *transient_handle_map)
 {
+    ALLOC_STATS_ADD (ALLOC_STATS_CONNECTION,
+        sizeof (Connection) +
+        alloc_stats_object_size (iostream) +
+        alloc_stats_object_size (g_io_stream_get_input_stream (iostream)) +
+        alloc_stats_object_size (g_io_stream_get_output_stream (iostream)));
     return CONNECTION (g_object_new (TYPE_CONNECTION,
                                      "id", id,
                                      "iostream", iostream,
@@ -182,3 +218,324 @@ connection_get_trans_map (Connection *connection)
     g_object_ref (connection->transient_handle_map);
     return connection->transient_handle_map;
 }
+/*
+ * Same as connection_get_trans_map but without taking a reference. The
+ * HandleMap is valid for as long as the caller holds the Connection (or
+ * a Tpm2Command / Tpm2Response that holds it).
+ */
+HandleMap*
+connection_peek_trans_map (Connection *connection)
+{
+    return connection->transient_handle_map;
+}
+/*
+ * Return the priority class of the connection. This is one of the
+ * TABRMD_PRIORITY_* values.
+ */
+guint
+connection_get_priority (Connection *connection)
+{
+    return connection->priority;
+}
+/*
+ * The locality the TPM commands from the connection are sent at, 0 until
+ * the client sets another. A logical connection is at the locality of the
+ * connection it's multiplexed over since that's the one clients set it on.
+ */
+void
+connection_set_locality (Connection *connection,
+                         guint8      locality)
+{
+    g_atomic_int_set (&connection->locality, locality);
+}
+guint8
+connection_get_locality (Connection *connection)
+{
+    connection = connection_get_transport (connection);
+    return (guint8)g_atomic_int_get (&connection->locality);
+}
+/*
+ * Mark the connection as closed by the client. This is done by the thread
+ * reading commands from the connection and checked by the RM thread so the
+ * flag is accessed atomically.
+ */
+void
+connection_set_closed (Connection *connection)
+{
+    g_atomic_int_set (&connection->closed, TRUE);
+}
+/*
+ * A logical connection is closed with the connection it's multiplexed
+ * over.
+ */
+gboolean
+connection_is_closed (Connection *connection)
+{
+    if (connection->parent != NULL &&
+        g_atomic_int_get (&connection->parent->closed))
+    {
+        return TRUE;
+    }
+    return g_atomic_int_get (&connection->closed);
+}
+/*
+ * Count the commands from this connection that have been queued but not
+ * yet answered. The thread reading commands increments the count and the
+ * thread writing responses decrements it; both return the new value.
+ * The commands of a logical connection also count against the connection
+ * it's multiplexed over: that's the socket input is paused on.
+ */
+guint
+connection_command_queued (Connection *connection)
+{
+    if (connection->parent != NULL) {
+        connection_command_queued (connection->parent);
+    }
+    return g_atomic_int_add (&connection->queued, 1) + 1;
+}
+void
+connection_command_done (Connection *connection)
+{
+    gint queued;
+
+    if (connection->parent != NULL) {
+        connection_command_done (connection->parent);
+    }
+    do {
+        queued = g_atomic_int_get (&connection->queued);
+        if (queued == 0) {
+            return;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&connection->queued,
+                                                 queued,
+                                                 queued - 1));
+}
+guint
+connection_get_queued (Connection *connection)
+{
+    return g_atomic_int_get (&connection->queued);
+}
+/*
+ * Account for 'bytes' of command or response buffers held for the
+ * connection, negative when they're freed. Like the queued count this is
+ * added to the connection a logical connection is multiplexed over too.
+ */
+void
+connection_mem_add (Connection *connection,
+                    gssize      bytes)
+{
+    if (connection->parent != NULL) {
+        connection_mem_add (connection->parent, bytes);
+    }
+    g_atomic_pointer_add (&connection->mem_bytes, bytes);
+}
+/*
+ * An estimate of the daemon memory the connection uses: the buffers of
+ * its commands and responses that are queued or being processed, and the
+ * saved contexts of the transient objects and sessions the
+ * ResourceManager holds for it as of the last connection_set_resources.
+ */
+gsize
+connection_get_mem (Connection *connection)
+{
+    gssize bytes = (gssize)g_atomic_pointer_get (&connection->mem_bytes);
+
+    return (gsize)MAX (bytes, 0) +
+        (gsize)g_atomic_int_get (&connection->transients) *
+        CONNECTION_MEM_TRANSIENT +
+        (gsize)g_atomic_int_get (&connection->sessions) *
+        CONNECTION_MEM_SESSION;
+}
+/*
+ * Give the connection the shared region and doorbells of the shared memory
+ * transport. The connection takes ownership of the mapping and the fds,
+ * they're released when it's disposed. This must be done before the
+ * connection is handed to the CommandSource.
+ * 'command_fd'  : doorbell rung by the client after writing a command
+ * 'response_fd' : doorbell rung by the daemon after writing a response
+ */
+void
+connection_set_shm (Connection   *connection,
+                    shm_region_t *shm,
+                    gint          command_fd,
+                    gint          response_fd)
+{
+    connection->shm = shm;
+    connection->shm_command_fd = command_fd;
+    connection->shm_response_fd = response_fd;
+}
+shm_region_t*
+connection_get_shm (Connection *connection)
+{
+    return connection->shm;
+}
+gint
+connection_get_shm_command_fd (Connection *connection)
+{
+    return connection->shm_command_fd;
+}
+gint
+connection_get_shm_response_fd (Connection *connection)
+{
+    return connection->shm_response_fd;
+}
+/*
+ * Mark a connection as multiplexing logical connections over its socket.
+ * This must be done before the connection is handed to the CommandSource.
+ */
+void
+connection_set_mux (Connection *connection,
+                    gboolean    mux)
+{
+    connection->mux = mux;
+}
+gboolean
+connection_get_mux (Connection *connection)
+{
+    return connection->mux;
+}
+/*
+ * Create the logical connection for the channel tagged 'channel' on the
+ * multiplexed connection 'parent'. It shares the socket, ID and priority
+ * class of the parent but has a HandleMap of its own, with room for as
+ * many transient objects, so each channel has its own virtual handles and
+ * its own share of sessions. The logical connection holds a reference to
+ * the parent.
+ */
+Connection*
+connection_new_channel (Connection *parent,
+                        guint32     channel)
+{
+    HandleMap *handle_map;
+    Connection *connection;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT,
+                                 parent->transient_handle_map->max_entries);
+    connection = connection_new (parent->iostream, parent->id, handle_map);
+    g_object_unref (handle_map);
+    g_object_set (connection, "priority", parent->priority, NULL);
+    connection->parent = g_object_ref (parent);
+    connection->channel = channel;
+    connection->pid = parent->pid;
+    connection->uid = parent->uid;
+    return connection;
+}
+/*
+ * Get the connection whose socket carries the messages for 'connection':
+ * the parent of a logical connection, the connection itself otherwise.
+ * No reference is taken.
+ */
+Connection*
+connection_get_transport (Connection *connection)
+{
+    return connection->parent != NULL ? connection->parent : connection;
+}
+guint32
+connection_get_channel (Connection *connection)
+{
+    return connection->channel;
+}
+void
+connection_count (Connection          *connection,
+                  CommandStatsCounter  counter)
+{
+    g_return_if_fail (counter < COMMAND_STATS_COUNTERS);
+    g_atomic_int_inc (&connection->counters [counter]);
+}
+guint
+connection_get_count (Connection          *connection,
+                      CommandStatsCounter  counter)
+{
+    g_return_val_if_fail (counter < COMMAND_STATS_COUNTERS, 0);
+    return (guint)g_atomic_int_get (&connection->counters [counter]);
+}
+void
+connection_set_pid (Connection *connection,
+                    guint32     pid)
+{
+    connection->pid = pid;
+}
+guint32
+connection_get_pid (Connection *connection)
+{
+    return connection->pid;
+}
+void
+connection_set_uid (Connection *connection,
+                    guint32     uid)
+{
+    connection->uid = uid;
+}
+guint32
+connection_get_uid (Connection *connection)
+{
+    return connection->uid;
+}
+guint
+connection_get_serial (Connection *connection)
+{
+    return connection->serial;
+}
+void
+connection_set_resume_id (Connection *connection,
+                          guint64     resume_id)
+{
+    connection->resume_id = resume_id;
+}
+guint64
+connection_get_resume_id (Connection *connection)
+{
+    return connection->resume_id;
+}
+/*
+ * The arena for the saved contexts of the connection, NULL once the
+ * connection is disposed. No reference is taken.
+ */
+ConnectionArena*
+connection_peek_arena (Connection *connection)
+{
+    return connection->arena;
+}
+/*
+ * Account for one command executed for the connection. The counts of the
+ * logical connections multiplexed over a socket are added to the
+ * Connection of the socket, that's the one the ConnectionManager lists.
+ */
+void
+connection_note_command (Connection *connection,
+                         gsize       bytes_in,
+                         gsize       bytes_out,
+                         gint64      exec_us)
+{
+    connection = connection_get_transport (connection);
+    g_atomic_pointer_add (&connection->commands, 1);
+    g_atomic_pointer_add (&connection->bytes_in, bytes_in);
+    g_atomic_pointer_add (&connection->bytes_out, bytes_out);
+    g_atomic_pointer_add (&connection->exec_us, MAX (exec_us, 0));
+}
+/*
+ * Publish the number of transient objects and sessions the connection
+ * holds in the ResourceManager. Unlike the counts these are for the
+ * logical connection only.
+ */
+void
+connection_set_resources (Connection *connection,
+                          guint       transients,
+                          guint       sessions)
+{
+    g_atomic_int_set (&connection->transients, (gint)transients);
+    g_atomic_int_set (&connection->sessions, (gint)sessions);
+}
+void
+connection_get_usage (Connection         *connection,
+                      connection_usage_t *usage)
+{
+    usage->serial = connection->serial;
+    usage->pid = connection->pid;
+    usage->commands = (gsize)g_atomic_pointer_get (&connection->commands);
+    usage->bytes_in = (gsize)g_atomic_pointer_get (&connection->bytes_in);
+    usage->bytes_out = (gsize)g_atomic_pointer_get (&connection->bytes_out);
+    usage->exec_us = (gsize)g_atomic_pointer_get (&connection->exec_us);
+    usage->transients = (guint)g_atomic_int_get (&connection->transients);
+    usage->sessions = (guint)g_atomic_int_get (&connection->sessions);
+}
@@ -10,19 +10,98 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "command-stats.h"
+#include "connection-arena.h"
 #include "handle-map.h"
+#include "rate-limiter.h"
+#include "shm-ring.h"
 
 G_BEGIN_DECLS
 
+/*
+ * What connection_get_mem counts for each transient object and each
+ * session the ResourceManager holds for a connection: its entry and
+ * saved context, the client's copy of it for sessions.
+ */
+#define CONNECTION_MEM_TRANSIENT \
+    (sizeof (HandleMapEntry) + sizeof (TPMS_CONTEXT))
+#define CONNECTION_MEM_SESSION (2 * sizeof (TPMS_CONTEXT))
+
 typedef struct _ConnectionClass {
     GObjectClass        parent;
 } ConnectionClass;
 
+/*
+ * The use a client made of the TPM, as reported by the GetConnections
+ * D-Bus method. 'exec_us' is the time its commands spent in the TPM.
+ */
+typedef struct {
+    guint               serial;
+    guint32             pid;
+    guint64             commands;
+    guint64             bytes_in;
+    guint64             bytes_out;
+    guint64             exec_us;
+    guint               transients;
+    guint               sessions;
+} connection_usage_t;
+#define CONNECTION_USAGE_VARIANT_TYPE "a(uuttttuu)"
+
 typedef struct _Connection {
     GObject             parent_instance;
     GIOStream          *iostream;
     guint64             id;
     HandleMap          *transient_handle_map;
+    guint               priority;
+    gint                closed;
+    gint                queued;
+    /* set by the IpcFrontend and read by the Tpm2, so accessed atomically */
+    gint                locality;
+    /* shared memory transport, NULL / -1 for connections not using it */
+    shm_region_t       *shm;
+    gint                shm_command_fd;
+    gint                shm_response_fd;
+    /* messages carry a channel tag, see TABRMD_CONNECTION_FLAG_MUX */
+    gboolean            mux;
+    /*
+     * set for a logical connection multiplexed over the socket of 'parent'
+     * under the tag 'channel'
+     */
+    struct _Connection *parent;
+    guint32             channel;
+    /*
+     * the context operations the ResourceManager did for our commands,
+     * updated atomically
+     */
+    gint                counters [COMMAND_STATS_COUNTERS];
+    /*
+     * Usage accounting: 'serial' numbers connections in the order they
+     * were created and unlike 'id' it's no secret. 'pid' is the client
+     * process if the IpcFrontend knows it, 0 otherwise, and 'uid' the user
+     * it runs as or RATE_LIMITER_UID_NONE. The ResourceManager updates the
+     * rest atomically.
+     */
+    guint               serial;
+    guint32             pid;
+    guint32             uid;
+    gsize               commands;
+    gsize               bytes_in;
+    gsize               bytes_out;
+    gsize               exec_us;
+    gint                transients;
+    gint                sessions;
+    /*
+     * bytes held by the Tpm2Commands and Tpm2Responses of the connection
+     * that are still around, updated atomically
+     */
+    gssize              mem_bytes;
+    /*
+     * the id of a connection closed within the resume grace period whose
+     * objects and sessions this one takes over, 0 if it's a new one
+     */
+    guint64             resume_id;
+    /* the saved contexts of the connection's objects and sessions */
+    ConnectionArena    *arena;
 } Connection;
 
 #define TYPE_CONNECTION              (connection_get_type ())
@@ -40,4 +119,55 @@ gpointer         connection_key_istream  (Connection      *session);
 gpointer         connection_key_id       (Connection      *session);
 GIOStream*       connection_get_iostream (Connection      *connection);
 HandleMap*       connection_get_trans_map(Connection      *session);
+HandleMap*       connection_peek_trans_map (Connection    *connection);
+guint            connection_get_priority (Connection      *connection);
+void             connection_set_locality (Connection      *connection,
+                                          guint8           locality);
+guint8           connection_get_locality (Connection      *connection);
+void             connection_set_closed   (Connection      *connection);
+gboolean         connection_is_closed    (Connection      *connection);
+guint            connection_command_queued (Connection    *connection);
+void             connection_command_done (Connection      *connection);
+guint            connection_get_queued   (Connection      *connection);
+void             connection_mem_add      (Connection      *connection,
+                                          gssize           bytes);
+gsize            connection_get_mem      (Connection      *connection);
+void             connection_set_shm      (Connection      *connection,
+                                          shm_region_t    *shm,
+                                          gint             command_fd,
+                                          gint             response_fd);
+shm_region_t*    connection_get_shm      (Connection      *connection);
+gint             connection_get_shm_command_fd (Connection *connection);
+gint             connection_get_shm_response_fd (Connection *connection);
+void             connection_set_mux      (Connection      *connection,
+                                          gboolean         mux);
+gboolean         connection_get_mux      (Connection      *connection);
+Connection*      connection_new_channel  (Connection      *parent,
+                                          guint32          channel);
+Connection*      connection_get_transport (Connection     *connection);
+guint32          connection_get_channel  (Connection      *connection);
+void             connection_count        (Connection      *connection,
+                                          CommandStatsCounter counter);
+guint            connection_get_count    (Connection      *connection,
+                                          CommandStatsCounter counter);
+void             connection_set_pid      (Connection      *connection,
+                                          guint32          pid);
+guint32          connection_get_pid      (Connection      *connection);
+void             connection_set_uid      (Connection      *connection,
+                                          guint32          uid);
+guint32          connection_get_uid      (Connection      *connection);
+guint            connection_get_serial   (Connection      *connection);
+void             connection_set_resume_id (Connection     *connection,
+                                           guint64         resume_id);
+guint64          connection_get_resume_id (Connection     *connection);
+ConnectionArena* connection_peek_arena   (Connection      *connection);
+void             connection_note_command (Connection      *connection,
+                                          gsize            bytes_in,
+                                          gsize            bytes_out,
+                                          gint64           exec_us);
+void             connection_set_resources (Connection     *connection,
+                                           guint           transients,
+                                           guint           sessions);
+void             connection_get_usage    (Connection      *connection,
+                                          connection_usage_t *usage);
 #endif /* CONNECTION_H */
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "context-store.h"
+
+G_DEFINE_TYPE (ContextStore, context_store, G_TYPE_OBJECT);
+
+static void
+context_store_init (ContextStore *self)
+{
+    g_mutex_init (&self->mutex);
+    self->fd = -1;
+    self->chunks = g_ptr_array_new ();
+    self->free_slots = g_array_new (FALSE, FALSE, sizeof (guint));
+}
+static void
+context_store_finalize (GObject *object)
+{
+    ContextStore *self = CONTEXT_STORE (object);
+    guint i;
+
+    g_debug ("%s", __func__);
+    for (i = 0; i < self->chunks->len; ++i) {
+        munmap (g_ptr_array_index (self->chunks, i), self->chunk_size);
+    }
+    g_ptr_array_free (self->chunks, TRUE);
+    g_array_free (self->free_slots, TRUE);
+    if (self->fd >= 0) {
+        close (self->fd);
+    }
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (context_store_parent_class)->finalize (object);
+}
+static void
+context_store_class_init (ContextStoreClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (context_store_parent_class == NULL)
+        context_store_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = context_store_finalize;
+}
+/*
+ * Create a ContextStore backed by a new file in 'dir' holding up to
+ * 'slots_max' contexts. The file is only readable by its owner and is
+ * unlinked right away. Returns NULL if the file can't be created.
+ */
+ContextStore*
+context_store_new (const gchar *dir,
+                   guint        slots_max)
+{
+    ContextStore *store;
+    gchar *path;
+    gint fd;
+
+    g_return_val_if_fail (dir != NULL, NULL);
+    path = g_build_filename (dir, "tpm2-abrmd-contexts-XXXXXX", NULL);
+    fd = g_mkstemp_full (path, O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning ("%s: failed to create %s: %s", __func__, path,
+                   strerror (errno));
+        g_free (path);
+        return NULL;
+    }
+    g_unlink (path);
+    g_free (path);
+    store = CONTEXT_STORE (g_object_new (TYPE_CONTEXT_STORE, NULL));
+    store->fd = fd;
+    store->slots_max = slots_max;
+    store->slot_size = (sizeof (TPMS_CONTEXT) + 7) & ~(gsize)7;
+    store->chunk_size = store->slot_size * CONTEXT_STORE_CHUNK_SLOTS;
+    store->chunk_size += sysconf (_SC_PAGESIZE) - 1;
+    store->chunk_size -= store->chunk_size % sysconf (_SC_PAGESIZE);
+    g_info ("%s: keeping up to %u contexts in %s", __func__, slots_max, dir);
+    return store;
+}
+/*
+ * Extend the file by a chunk and map it. Called with the mutex held.
+ */
+static gboolean
+context_store_grow (ContextStore *store)
+{
+    off_t offset = (off_t)store->chunks->len * store->chunk_size;
+    gpointer base;
+
+    if (ftruncate (store->fd, offset + store->chunk_size) != 0) {
+        g_warning ("%s: failed to grow the context store: %s", __func__,
+                   strerror (errno));
+        return FALSE;
+    }
+    base = mmap (NULL, store->chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 store->fd, offset);
+    if (base == MAP_FAILED) {
+        g_warning ("%s: failed to map the context store: %s", __func__,
+                   strerror (errno));
+        return FALSE;
+    }
+    g_ptr_array_add (store->chunks, base);
+    return TRUE;
+}
+/*
+ * Take a free slot. Slots given back are reused first, the file only grows
+ * when there are none. Returns CONTEXT_STORE_SLOT_NONE when the store is
+ * full or can't grow, the caller keeps the context on the heap then.
+ */
+guint
+context_store_alloc (ContextStore *store)
+{
+    guint slot = CONTEXT_STORE_SLOT_NONE;
+    guint mapped;
+
+    g_mutex_lock (&store->mutex);
+    if (store->free_slots->len > 0) {
+        slot = g_array_index (store->free_slots, guint,
+                              store->free_slots->len - 1);
+        g_array_set_size (store->free_slots, store->free_slots->len - 1);
+        goto out;
+    }
+    if (store->slots_used >= store->slots_max) {
+        goto out;
+    }
+    mapped = store->chunks->len * CONTEXT_STORE_CHUNK_SLOTS;
+    if (store->slots_used == mapped && !context_store_grow (store)) {
+        goto out;
+    }
+    slot = store->slots_used;
+out:
+    if (slot != CONTEXT_STORE_SLOT_NONE) {
+        ++store->slots_used;
+    }
+    g_mutex_unlock (&store->mutex);
+    return slot;
+}
+/*
+ * The TPMS_CONTEXT in 'slot'. The address stays valid until the slot is
+ * freed.
+ */
+TPMS_CONTEXT*
+context_store_get (ContextStore *store,
+                   guint         slot)
+{
+    guint8 *base;
+
+    g_mutex_lock (&store->mutex);
+    base = g_ptr_array_index (store->chunks, slot / CONTEXT_STORE_CHUNK_SLOTS);
+    g_mutex_unlock (&store->mutex);
+    return (TPMS_CONTEXT*)&base [(slot % CONTEXT_STORE_CHUNK_SLOTS) *
+                                 store->slot_size];
+}
+/*
+ * Give 'slot' back. Its contents are wiped so the next user of the slot
+ * starts from zeros like a heap allocation would.
+ */
+void
+context_store_free (ContextStore *store,
+                    guint         slot)
+{
+    memset (context_store_get (store, slot), 0, sizeof (TPMS_CONTEXT));
+    g_mutex_lock (&store->mutex);
+    g_array_append_val (store->free_slots, slot);
+    --store->slots_used;
+    g_mutex_unlock (&store->mutex);
+}
+/*
+ * The number of slots handed out and not yet freed.
+ */
+guint
+context_store_get_used (ContextStore *store)
+{
+    guint used;
+
+    g_mutex_lock (&store->mutex);
+    used = store->slots_used;
+    g_mutex_unlock (&store->mutex);
+    return used;
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CONTEXT_STORE_H
+#define CONTEXT_STORE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/* slots mapped at a time as the store grows */
+#define CONTEXT_STORE_CHUNK_SLOTS 256
+#define CONTEXT_STORE_SLOT_NONE   G_MAXUINT
+
+/*
+ * The ContextStore holds saved TPMS_CONTEXT structures in slots of a file
+ * mapped into memory instead of on the heap. The file is unlinked as soon
+ * as it's created so nothing is left behind, and since the mapping is
+ * shared the kernel can write the contexts of idle objects out and drop
+ * their pages when memory is short rather than keeping them resident.
+ *
+ * The file grows by CONTEXT_STORE_CHUNK_SLOTS slots at a time, each chunk
+ * is mapped on its own so the slots already handed out never move. The
+ * index of free slots is a stack of slot numbers, a slot lives in chunk
+ * 'slot / CONTEXT_STORE_CHUNK_SLOTS'. The mutex makes the store safe to
+ * share between the ResourceManagers of all TPMs.
+ */
+typedef struct _ContextStoreClass {
+    GObjectClass      parent;
+} ContextStoreClass;
+
+typedef struct _ContextStore {
+    GObject           parent_instance;
+    GMutex            mutex;
+    gint              fd;
+    /* base address of each mapped chunk */
+    GPtrArray        *chunks;
+    /* slots that were handed out and given back */
+    GArray           *free_slots;
+    gsize             slot_size;
+    gsize             chunk_size;
+    guint             slots_max;
+    guint             slots_used;
+} ContextStore;
+
+#define TYPE_CONTEXT_STORE              (context_store_get_type   ())
+#define CONTEXT_STORE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_CONTEXT_STORE, ContextStore))
+#define CONTEXT_STORE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_CONTEXT_STORE, ContextStoreClass))
+#define IS_CONTEXT_STORE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_CONTEXT_STORE))
+#define IS_CONTEXT_STORE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_CONTEXT_STORE))
+#define CONTEXT_STORE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_CONTEXT_STORE, ContextStoreClass))
+
+GType            context_store_get_type    (void);
+ContextStore*    context_store_new         (const gchar      *dir,
+                                            guint             slots_max);
+guint            context_store_alloc       (ContextStore     *store);
+TPMS_CONTEXT*    context_store_get         (ContextStore     *store,
+                                            guint             slot);
+void             context_store_free        (ContextStore     *store,
+                                            guint             slot);
+guint            context_store_get_used    (ContextStore     *store);
+
+G_END_DECLS
+#endif /* CONTEXT_STORE_H */
@@ -15,6 +15,14 @@ G_BEGIN_DECLS
 typedef enum {
     CHECK_CANCEL    = 1 << 0,
     CONNECTION_REMOVED = 1 << 1,
+    /* the connection is reused by a new client, drop what the last one had */
+    CONNECTION_RESET = 1 << 2,
+    /* save the TPM state and stop, another instance takes over */
+    HANDOVER = 1 << 3,
+    /* the connection takes over what a closed one kept, see resume_id */
+    CONNECTION_RESUME = 1 << 4,
+    /* time representative operations on the TPM, see tpm2_calibrate */
+    CALIBRATE = 1 << 5,
 } ControlCode;
 
 typedef struct _ControlMessageClass {
@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+
+#include "control-message.h"
+#include "dispatcher.h"
+#include "source-interface.h"
+#include "tpm2-command.h"
+#include "util.h"
+
+static void dispatcher_sink_interface_init   (gpointer g_iface);
+static void dispatcher_source_interface_init (gpointer g_iface);
+
+G_DEFINE_TYPE_WITH_CODE (
+    Dispatcher,
+    dispatcher,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (TYPE_SINK,
+                           dispatcher_sink_interface_init);
+    G_IMPLEMENT_INTERFACE (TYPE_SOURCE,
+                           dispatcher_source_interface_init);
+    );
+
+static void
+dispatcher_init (Dispatcher *self)
+{
+    g_mutex_init (&self->mutex);
+    self->connections = g_hash_table_new_full (g_direct_hash,
+                                               g_direct_equal,
+                                               g_object_unref,
+                                               NULL);
+}
+static void
+dispatcher_dispose (GObject *object)
+{
+    Dispatcher *self = DISPATCHER (object);
+    guint i;
+
+    for (i = 0; i < self->sink_count; ++i) {
+        g_clear_object (&self->sinks [i]);
+    }
+    self->sink_count = 0;
+    g_clear_pointer (&self->connections, g_hash_table_unref);
+    G_OBJECT_CLASS (dispatcher_parent_class)->dispose (object);
+}
+static void
+dispatcher_finalize (GObject *object)
+{
+    Dispatcher *self = DISPATCHER (object);
+
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (dispatcher_parent_class)->finalize (object);
+}
+static void
+dispatcher_class_init (DispatcherClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (dispatcher_parent_class == NULL)
+        dispatcher_parent_class = g_type_class_peek_parent (klass);
+    object_class->dispose  = dispatcher_dispose;
+    object_class->finalize = dispatcher_finalize;
+}
+Dispatcher*
+dispatcher_new (void)
+{
+    return DISPATCHER (g_object_new (TYPE_DISPATCHER, NULL));
+}
+/*
+ * Implement the 'add_sink' function from the Source interface. Each sink
+ * added is another backend that connections may be assigned to.
+ */
+static void
+dispatcher_add_sink (Source *self,
+                     Sink   *sink)
+{
+    Dispatcher *dispatcher = DISPATCHER (self);
+
+    g_mutex_lock (&dispatcher->mutex);
+    if (dispatcher->sink_count >= TABRMD_BACKENDS_MAX) {
+        g_warning ("%s: Dispatcher already has %u backends, ignoring",
+                   __func__, dispatcher->sink_count);
+    } else {
+        dispatcher->sinks [dispatcher->sink_count++] = g_object_ref (sink);
+        g_debug ("%s: added backend %u", __func__, dispatcher->sink_count - 1);
+    }
+    g_mutex_unlock (&dispatcher->mutex);
+}
+/*
+ * Get the Connection a message belongs to. The returned pointer is only
+ * good while the message is.
+ */
+static Connection*
+dispatcher_message_connection (GObject *obj)
+{
+    Connection *connection = NULL;
+    GObject *object;
+
+    if (IS_TPM2_COMMAND (obj)) {
+        connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+        if (connection != NULL) {
+            /* only the address is used, the command holds a reference */
+            g_object_unref (connection);
+        }
+    } else if (IS_CONTROL_MESSAGE (obj)) {
+        object = control_message_get_object (CONTROL_MESSAGE (obj));
+        if (object != NULL && IS_CONNECTION (object)) {
+            connection = CONNECTION (object);
+        }
+    }
+    return connection;
+}
+/*
+ * Find the backend the connection is assigned to. If it isn't assigned
+ * yet it's assigned to the least loaded backend that isn't failing, the
+ * one with the fewest connections of those that are equally loaded. If
+ * every backend is failing they're all considered, a connection to a
+ * failing TPM is better than none. Returns the index of the backend. The
+ * caller must hold the mutex and there must be at least one backend.
+ */
+static guint
+dispatcher_assign (Dispatcher *self,
+                   Connection *connection)
+{
+    gpointer value;
+    guint64 loads [TABRMD_BACKENDS_MAX] = { 0 };
+    guint i, backend = 0;
+
+    value = g_hash_table_lookup (self->connections, connection);
+    if (value != NULL) {
+        return GPOINTER_TO_UINT (value) - 1;
+    }
+    if (self->load_func != NULL) {
+        for (i = 0; i < self->sink_count; ++i) {
+            loads [i] = self->load_func (i, self->load_data);
+        }
+    }
+    for (i = 1; i < self->sink_count; ++i) {
+        if (loads [i] < loads [backend] ||
+            (loads [i] == loads [backend] &&
+             self->counts [i] < self->counts [backend]))
+        {
+            backend = i;
+        }
+    }
+    if (loads [backend] == DISPATCHER_LOAD_FAILED) {
+        g_warning ("%s: every backend is failing", __func__);
+    }
+    g_hash_table_insert (self->connections,
+                         g_object_ref (connection),
+                         GUINT_TO_POINTER (backend + 1));
+    self->counts [backend]++;
+    g_info ("%s: connection assigned to backend %u with %u connections",
+            __func__, backend, self->counts [backend]);
+
+    return backend;
+}
+/*
+ * Implement the 'enqueue' function from the Sink interface. Messages for a
+ * connection go to the backend the connection is assigned to, assigning
+ * it on first use. The assignment is dropped after the CONNECTION_REMOVED
+ * message for the connection has been passed on. Messages that don't
+ * belong to a connection go to every backend.
+ */
+void
+dispatcher_enqueue (Sink    *sink,
+                    GObject *obj)
+{
+    Dispatcher *self = DISPATCHER (sink);
+    Connection *connection;
+    Sink *target = NULL;
+    guint backend, i;
+
+    connection = dispatcher_message_connection (obj);
+    g_mutex_lock (&self->mutex);
+    if (self->sink_count == 0) {
+        g_warning ("%s: no backends, dropping message", __func__);
+        g_mutex_unlock (&self->mutex);
+        return;
+    }
+    if (connection == NULL) {
+        g_mutex_unlock (&self->mutex);
+        for (i = 0; i < self->sink_count; ++i) {
+            sink_enqueue (self->sinks [i], obj);
+        }
+        return;
+    }
+    if (IS_CONTROL_MESSAGE (obj) &&
+        control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED)
+    {
+        backend = GPOINTER_TO_UINT (g_hash_table_lookup (self->connections,
+                                                         connection));
+        /* a connection that never sent a command has no state anywhere */
+        backend = backend > 0 ? backend - 1 : 0;
+        if (g_hash_table_remove (self->connections, connection)) {
+            self->counts [backend]--;
+        }
+    } else {
+        backend = dispatcher_assign (self, connection);
+    }
+    target = self->sinks [backend];
+    g_mutex_unlock (&self->mutex);
+    sink_enqueue (target, obj);
+}
+/*
+ * Get the Sink for the backend a connection is assigned to. Returns NULL
+ * if the connection hasn't been assigned to a backend yet. The caller
+ * owns the returned reference.
+ */
+Sink*
+dispatcher_get_sink (Dispatcher *dispatcher,
+                     Connection *connection)
+{
+    Sink *sink = NULL;
+    gpointer value;
+
+    g_mutex_lock (&dispatcher->mutex);
+    value = g_hash_table_lookup (dispatcher->connections, connection);
+    if (value != NULL) {
+        sink = g_object_ref (dispatcher->sinks [GPOINTER_TO_UINT (value) - 1]);
+    }
+    g_mutex_unlock (&dispatcher->mutex);
+
+    return sink;
+}
+/*
+ * Get the number of connections assigned to a backend.
+ */
+guint
+dispatcher_get_count (Dispatcher *dispatcher,
+                      guint       backend)
+{
+    guint count = 0;
+
+    g_mutex_lock (&dispatcher->mutex);
+    if (backend < dispatcher->sink_count) {
+        count = dispatcher->counts [backend];
+    }
+    g_mutex_unlock (&dispatcher->mutex);
+
+    return count;
+}
+/*
+ * Set the function reporting the load of the backends. It's run for each
+ * backend whenever a connection is assigned, with the Dispatcher mutex
+ * held, so it must be quick and must not call back into the Dispatcher.
+ */
+void
+dispatcher_set_load_func (Dispatcher         *dispatcher,
+                          DispatcherLoadFunc  load_func,
+                          gpointer            user_data)
+{
+    g_mutex_lock (&dispatcher->mutex);
+    dispatcher->load_func = load_func;
+    dispatcher->load_data = user_data;
+    g_mutex_unlock (&dispatcher->mutex);
+}
+/*
+ * Boilerplate code to register functions with the SinkInterface and
+ * SourceInterface.
+ */
+static void
+dispatcher_sink_interface_init (gpointer g_iface)
+{
+    SinkInterface *sink = (SinkInterface*)g_iface;
+    sink->enqueue = dispatcher_enqueue;
+}
+static void
+dispatcher_source_interface_init (gpointer g_iface)
+{
+    SourceInterface *source = (SourceInterface*)g_iface;
+    source->add_sink = dispatcher_add_sink;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "connection.h"
+#include "sink-interface.h"
+#include "tabrmd-defaults.h"
+
+G_BEGIN_DECLS
+
+/* load reported for a backend that's failing, it gets no new connections */
+#define DISPATCHER_LOAD_FAILED G_MAXUINT64
+
+/*
+ * Get the load of backend 'backend', lower is less loaded, or
+ * DISPATCHER_LOAD_FAILED, see dispatcher_set_load_func.
+ */
+typedef guint64 (*DispatcherLoadFunc) (guint    backend,
+                                       gpointer user_data);
+
+typedef struct _DispatcherClass {
+    GObjectClass      parent;
+} DispatcherClass;
+
+/*
+ * The Dispatcher sits between the CommandSource and the ResourceManagers
+ * of several TPM backends. Each connection is assigned to a backend the
+ * first time a message for it is dispatched and all of its messages go
+ * to the same backend after that.
+ * 'sinks'       : the backend Sinks, in the order they were added
+ * 'counts'      : number of connections assigned to each backend
+ * 'connections' : map from Connection to backend index + 1
+ * 'load_func'   : reports the load of the backends, NULL to only go by
+ *                 the number of connections
+ */
+typedef struct _Dispatcher {
+    GObject           parent_instance;
+    GMutex            mutex;
+    Sink             *sinks [TABRMD_BACKENDS_MAX];
+    guint             counts [TABRMD_BACKENDS_MAX];
+    guint             sink_count;
+    GHashTable       *connections;
+    DispatcherLoadFunc load_func;
+    gpointer          load_data;
+} Dispatcher;
+
+#define TYPE_DISPATCHER              (dispatcher_get_type   ())
+#define DISPATCHER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_DISPATCHER, Dispatcher))
+#define DISPATCHER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_DISPATCHER, DispatcherClass))
+#define IS_DISPATCHER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_DISPATCHER))
+#define IS_DISPATCHER_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_DISPATCHER))
+#define DISPATCHER_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_DISPATCHER, DispatcherClass))
+
+GType            dispatcher_get_type    (void);
+Dispatcher*      dispatcher_new         (void);
+void             dispatcher_enqueue     (Sink             *sink,
+                                         GObject          *obj);
+Sink*            dispatcher_get_sink    (Dispatcher       *dispatcher,
+                                         Connection       *connection);
+guint            dispatcher_get_count   (Dispatcher       *dispatcher,
+                                         guint             backend);
+void             dispatcher_set_load_func (Dispatcher         *dispatcher,
+                                           DispatcherLoadFunc  load_func,
+                                           gpointer            user_data);
+
+G_END_DECLS
+#endif /* DISPATCHER_H */
@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <string.h>
+
+#include "entropy-pool.h"
+#include "util.h"
+
+G_DEFINE_TYPE (EntropyPool, entropy_pool, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_SIZE,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+/*
+ * GObject property getter.
+ */
+static void
+entropy_pool_get_property (GObject    *object,
+                           guint       property_id,
+                           GValue     *value,
+                           GParamSpec *pspec)
+{
+    EntropyPool *self = ENTROPY_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        g_value_set_uint (value, self->size);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+entropy_pool_set_property (GObject        *object,
+                           guint           property_id,
+                           GValue const   *value,
+                           GParamSpec     *pspec)
+{
+    EntropyPool *self = ENTROPY_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        self->size = g_value_get_uint (value);
+        self->bytes = g_malloc0 (self->size);
+        g_debug ("%s: size: %u", __func__, self->size);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+entropy_pool_init (EntropyPool *self)
+{
+    UNUSED_PARAM(self);
+    /* noop */
+}
+/*
+ * GObject finalize function: wipe whatever is left in the pool before
+ * freeing it.
+ */
+static void
+entropy_pool_finalize (GObject *object)
+{
+    EntropyPool *self = ENTROPY_POOL (object);
+
+    g_debug ("%s", __func__);
+    if (self->bytes != NULL) {
+        memset (self->bytes, 0, self->size);
+        g_clear_pointer (&self->bytes, g_free);
+    }
+    G_OBJECT_CLASS (entropy_pool_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+entropy_pool_class_init (EntropyPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (entropy_pool_parent_class == NULL)
+        entropy_pool_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = entropy_pool_finalize;
+    object_class->get_property = entropy_pool_get_property;
+    object_class->set_property = entropy_pool_set_property;
+
+    obj_properties [PROP_SIZE] =
+        g_param_spec_uint ("size",
+                           "pool size",
+                           "number of random bytes the pool holds when full",
+                           0,
+                           ENTROPY_POOL_SIZE_MAX,
+                           ENTROPY_POOL_SIZE_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+EntropyPool*
+entropy_pool_new (guint size)
+{
+    g_debug ("%s with size: %u", __func__, size);
+    return ENTROPY_POOL (g_object_new (TYPE_ENTROPY_POOL,
+                                       "size", size,
+                                       NULL));
+}
+guint
+entropy_pool_get_level (EntropyPool *pool)
+{
+    return pool->level;
+}
+guint
+entropy_pool_get_space (EntropyPool *pool)
+{
+    return pool->size - pool->level;
+}
+/*
+ * The most bytes a GetRandom served from the pool may return: the TPM
+ * never returns more than its largest digest, however many bytes are
+ * asked for, and the pool behaves the same. 0 until the pool has been
+ * filled once.
+ */
+guint
+entropy_pool_get_chunk_max (EntropyPool *pool)
+{
+    return pool->chunk_max;
+}
+/*
+ * Add 'size' bytes just returned by a GetRandom to the pool. What doesn't
+ * fit is dropped.
+ */
+void
+entropy_pool_add (EntropyPool  *pool,
+                  guint8 const *data,
+                  size_t        size)
+{
+    size_t count = MIN (size, entropy_pool_get_space (pool));
+
+    pool->chunk_max = MAX (pool->chunk_max, (guint)size);
+    memcpy (&pool->bytes [pool->level], data, count);
+    pool->level += count;
+}
+/*
+ * Take 'size' bytes from the pool into 'dest' and wipe them from the
+ * pool. Returns FALSE and takes nothing if the pool holds fewer bytes.
+ */
+gboolean
+entropy_pool_take (EntropyPool *pool,
+                   guint8      *dest,
+                   size_t       size)
+{
+    if (size > pool->level) {
+        return FALSE;
+    }
+    pool->level -= size;
+    memcpy (dest, &pool->bytes [pool->level], size);
+    memset (&pool->bytes [pool->level], 0, size);
+    return TRUE;
+}
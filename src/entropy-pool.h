@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ENTROPY_POOL_H
+#define ENTROPY_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define ENTROPY_POOL_SIZE_DEFAULT 0
+#define ENTROPY_POOL_SIZE_MAX     4096
+
+/*
+ * The EntropyPool holds random bytes fetched from the TPM with GetRandom
+ * while the ResourceManager has nothing else to do. Each byte is handed
+ * out once and wiped as it's taken.
+ */
+typedef struct _EntropyPoolClass {
+    GObjectClass      parent;
+} EntropyPoolClass;
+
+typedef struct _EntropyPool {
+    GObject           parent_instance;
+    guint8           *bytes;
+    guint             size;
+    guint             level;
+    /* the most bytes the TPM returned from one GetRandom */
+    guint             chunk_max;
+} EntropyPool;
+
+#define TYPE_ENTROPY_POOL              (entropy_pool_get_type   ())
+#define ENTROPY_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_ENTROPY_POOL, EntropyPool))
+#define ENTROPY_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_ENTROPY_POOL, EntropyPoolClass))
+#define IS_ENTROPY_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_ENTROPY_POOL))
+#define IS_ENTROPY_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_ENTROPY_POOL))
+#define ENTROPY_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_ENTROPY_POOL, EntropyPoolClass))
+
+GType            entropy_pool_get_type     (void);
+EntropyPool*     entropy_pool_new          (guint             size);
+guint            entropy_pool_get_level    (EntropyPool      *pool);
+guint            entropy_pool_get_space    (EntropyPool      *pool);
+guint            entropy_pool_get_chunk_max (EntropyPool     *pool);
+void             entropy_pool_add          (EntropyPool      *pool,
+                                            guint8 const     *data,
+                                            size_t            size);
+gboolean         entropy_pool_take         (EntropyPool      *pool,
+                                            guint8           *dest,
+                                            size_t            size);
+
+G_END_DECLS
+#endif /* ENTROPY_POOL_H */
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include "flight-recorder.h"
+
+G_DEFINE_TYPE (FlightRecorder, flight_recorder, G_TYPE_OBJECT);
+
+static void
+flight_recorder_init (FlightRecorder *self)
+{
+    g_mutex_init (&self->mutex);
+}
+static void
+flight_recorder_finalize (GObject *object)
+{
+    FlightRecorder *self = FLIGHT_RECORDER (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->records, g_free);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (flight_recorder_parent_class)->finalize (object);
+}
+static void
+flight_recorder_class_init (FlightRecorderClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (flight_recorder_parent_class == NULL)
+        flight_recorder_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = flight_recorder_finalize;
+}
+/*
+ * Create a FlightRecorder keeping the last 'size' records, 'size' must
+ * not be 0.
+ */
+FlightRecorder*
+flight_recorder_new (guint size)
+{
+    FlightRecorder *recorder;
+
+    g_return_val_if_fail (size > 0, NULL);
+    recorder = FLIGHT_RECORDER (g_object_new (TYPE_FLIGHT_RECORDER, NULL));
+    recorder->records = g_new0 (flight_record_t, size);
+    recorder->size = size;
+    return recorder;
+}
+/*
+ * Add a record, replacing the oldest one once the recorder is full.
+ */
+void
+flight_recorder_add (FlightRecorder        *recorder,
+                     flight_record_t const *record)
+{
+    g_mutex_lock (&recorder->mutex);
+    memcpy (&recorder->records [recorder->count % recorder->size],
+            record,
+            sizeof (*record));
+    ++recorder->count;
+    g_mutex_unlock (&recorder->mutex);
+}
+/*
+ * Copy the records out, oldest first, so that nothing slow happens with
+ * the ResourceManager locked out. '*total' is the number of records ever
+ * added. The caller frees the copy.
+ */
+static flight_record_t*
+flight_recorder_snapshot (FlightRecorder *recorder,
+                          guint          *count,
+                          guint64        *total)
+{
+    flight_record_t *records;
+    guint64 first, i;
+
+    g_mutex_lock (&recorder->mutex);
+    *total = recorder->count;
+    first = recorder->count > recorder->size ?
+        recorder->count - recorder->size : 0;
+    *count = (guint)(recorder->count - first);
+    records = g_new (flight_record_t, MAX (*count, 1));
+    for (i = first; i < recorder->count; ++i) {
+        records [i - first] = recorder->records [i % recorder->size];
+    }
+    g_mutex_unlock (&recorder->mutex);
+    return records;
+}
+/*
+ * Call 'func' for each record, oldest first. It's called on a copy, the
+ * recorder isn't locked.
+ */
+void
+flight_recorder_foreach (FlightRecorder     *recorder,
+                         FlightRecorderFunc  func,
+                         gpointer            user_data)
+{
+    flight_record_t *records;
+    guint64 total;
+    guint count, i;
+
+    records = flight_recorder_snapshot (recorder, &count, &total);
+    for (i = 0; i < count; ++i) {
+        func (&records [i], user_data);
+    }
+    g_free (records);
+}
+typedef struct {
+    guint            backend;
+    GVariantBuilder *builder;
+} build_data_t;
+static void
+flight_recorder_build_record (flight_record_t const *record,
+                              gpointer               user_data)
+{
+    build_data_t *data = (build_data_t*)user_data;
+
+    g_variant_builder_add (data->builder,
+                           "(uxuu@au@auu)",
+                           data->backend,
+                           record->time,
+                           record->connection,
+                           record->command_code,
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                      record->handles,
+                                                      record->handle_count,
+                                                      sizeof (TPM2_HANDLE)),
+                           g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                      record->phase_us,
+                                                      COMMAND_STATS_WRITE,
+                                                      sizeof (guint32)),
+                           record->rc);
+}
+/*
+ * Append a tuple to 'builder' for each record, oldest first. The builder
+ * must be for FLIGHT_RECORDER_VARIANT_TYPE.
+ */
+void
+flight_recorder_build (FlightRecorder  *recorder,
+                       guint            backend,
+                       GVariantBuilder *builder)
+{
+    build_data_t data = { .backend = backend, .builder = builder, };
+
+    flight_recorder_foreach (recorder, flight_recorder_build_record, &data);
+}
+/*
+ * Format a record on a single line for the log. The caller frees the
+ * string.
+ */
+gchar*
+flight_record_to_string (flight_record_t const *record)
+{
+    GString *line = g_string_new (NULL);
+    GDateTime *time;
+    gchar *stamp;
+    guint i;
+
+    time = g_date_time_new_from_unix_utc (record->time / G_USEC_PER_SEC);
+    stamp = time != NULL ? g_date_time_format (time, "%FT%T") : NULL;
+    g_string_append_printf (line,
+                            "%s.%06" PRId64 "Z connection %u command 0x%08"
+                            PRIx32 " handles",
+                            stamp != NULL ? stamp : "?",
+                            record->time % G_USEC_PER_SEC,
+                            record->connection,
+                            record->command_code);
+    for (i = 0; i < record->handle_count; ++i) {
+        g_string_append_printf (line, " 0x%08" PRIx32, record->handles [i]);
+    }
+    if (record->handle_count == 0) {
+        g_string_append (line, " none");
+    }
+    for (i = 0; i < COMMAND_STATS_WRITE; ++i) {
+        g_string_append_printf (line, " %s %" PRIu32 "us",
+                                command_stats_phase_name (i),
+                                record->phase_us [i]);
+    }
+    g_string_append_printf (line, " rc 0x%08" PRIx32, record->rc);
+    g_free (stamp);
+    if (time != NULL) {
+        g_date_time_unref (time);
+    }
+    return g_string_free (line, FALSE);
+}
+/*
+ * Write the records to the log, oldest first.
+ */
+void
+flight_recorder_dump (FlightRecorder *recorder,
+                      guint           backend)
+{
+    flight_record_t *records;
+    guint64 total;
+    guint count, i;
+    gchar *line;
+
+    records = flight_recorder_snapshot (recorder, &count, &total);
+    g_message ("flight recorder %u: %" G_GUINT64_FORMAT " commands recorded, "
+               "the last %u follow", backend, total, count);
+    for (i = 0; i < count; ++i) {
+        line = flight_record_to_string (&records [i]);
+        g_message ("flight recorder %u: %s", backend, line);
+        g_free (line);
+    }
+    g_free (records);
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "command-stats.h"
+
+G_BEGIN_DECLS
+
+/*
+ * The FlightRecorder keeps the last few commands a ResourceManager
+ * processed so that a latency incident can be looked at after the fact
+ * without running with debug logging. The ResourceManager adds a record
+ * for each command under the mutex, readers copy the records out under
+ * it.
+ */
+#define FLIGHT_RECORDER_HANDLES 3
+/*
+ * GVariant type of the records built by flight_recorder_build:
+ * (backend, time, connection, command code, handles, phase us, rc)
+ */
+#define FLIGHT_RECORDER_VARIANT_TYPE "a(uxuuauauu)"
+
+/*
+ * 'time' is the wall clock time in microseconds since the epoch when the
+ * ResourceManager took the command, 'connection' the serial of the
+ * connection it came from. 'handles' are the handles the client sent,
+ * before they were virtualized. 'phase_us' has the time spent in each of
+ * the phases the ResourceManager measures, see command-stats.h.
+ */
+typedef struct {
+    gint64              time;
+    guint               connection;
+    TPM2_CC             command_code;
+    guint8              handle_count;
+    TPM2_HANDLE         handles [FLIGHT_RECORDER_HANDLES];
+    guint32             phase_us [COMMAND_STATS_WRITE];
+    TSS2_RC             rc;
+} flight_record_t;
+
+typedef void (*FlightRecorderFunc) (flight_record_t const *record,
+                                    gpointer               user_data);
+
+typedef struct _FlightRecorderClass {
+    GObjectClass        parent;
+} FlightRecorderClass;
+
+typedef struct _FlightRecorder {
+    GObject             parent_instance;
+    GMutex              mutex;
+    flight_record_t    *records;
+    guint               size;
+    /* records added so far, the next goes in records [count % size] */
+    guint64             count;
+} FlightRecorder;
+
+#define TYPE_FLIGHT_RECORDER            (flight_recorder_get_type ())
+#define FLIGHT_RECORDER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_FLIGHT_RECORDER, FlightRecorder))
+#define FLIGHT_RECORDER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TYPE_FLIGHT_RECORDER, FlightRecorderClass))
+#define IS_FLIGHT_RECORDER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_FLIGHT_RECORDER))
+#define IS_FLIGHT_RECORDER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TYPE_FLIGHT_RECORDER))
+#define FLIGHT_RECORDER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TYPE_FLIGHT_RECORDER, FlightRecorderClass))
+
+GType           flight_recorder_get_type (void);
+FlightRecorder* flight_recorder_new      (guint                  size);
+void            flight_recorder_add      (FlightRecorder        *recorder,
+                                          flight_record_t const *record);
+void            flight_recorder_foreach  (FlightRecorder        *recorder,
+                                          FlightRecorderFunc     func,
+                                          gpointer               user_data);
+void            flight_recorder_build    (FlightRecorder        *recorder,
+                                          guint                  backend,
+                                          GVariantBuilder       *builder);
+gchar*          flight_record_to_string  (flight_record_t const *record);
+void            flight_recorder_dump     (FlightRecorder        *recorder,
+                                          guint                  backend);
+
+G_END_DECLS
+#endif /* FLIGHT_RECORDER_H */
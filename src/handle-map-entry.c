@@ -5,8 +5,10 @@
  */
 #include <inttypes.h>
 
+#include "alloc-stats.h"
 #include "util.h"
 #include "handle-map-entry.h"
+#include "tpm2-command.h"
 
 G_DEFINE_TYPE (HandleMapEntry, handle_map_entry, G_TYPE_OBJECT);
 
@@ -37,7 +39,7 @@ handle_map_entry_get_property (GObject        *object,
         g_value_set_uint (value, (guint)self->vhandle);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        g_value_set_pointer (value, handle_map_entry_get_context (self));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
@@ -74,17 +76,36 @@ handle_map_entry_set_property (GObject        *object,
 static void
 handle_map_entry_init (HandleMapEntry *entry)
 {
-    UNUSED_PARAM(entry);
-    /* noop */
+    entry->context_slot = CONTEXT_STORE_SLOT_NONE;
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Deallocate all associated resources. The dynamically allocated members
+ * are the saved context, the ContextLoad command made from it, the cached
+ * ReadPublic response and the reference
+ * to the backing entry, which gives up any pin we hold on it. The rest are
+ * static so we then chain up to the parent like a good GObject.
  */
 static void
 handle_map_entry_finalize (GObject *object)
 {
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (object);
+
     g_debug ("%s", __func__);
+    if (entry->context_slot != CONTEXT_STORE_SLOT_NONE) {
+        context_store_free (entry->context_store, entry->context_slot);
+    } else if (entry->context_arena != NULL) {
+        connection_arena_free (entry->context);
+    } else {
+        g_free (entry->context);
+    }
+    g_clear_object (&entry->context_store);
+    g_clear_object (&entry->context_arena);
+    g_clear_pointer (&entry->context_load, g_bytes_unref);
+    g_clear_pointer (&entry->public_cache, g_bytes_unref);
+    if (entry->backing != NULL && entry->pinned) {
+        --entry->backing->pin_count;
+    }
+    g_clear_object (&entry->backing);
     G_OBJECT_CLASS (handle_map_entry_parent_class)->finalize (object);
 }
 /*
@@ -139,10 +160,37 @@ handle_map_entry_new (TPM2_HANDLE phandle,
                                             "phandle", (guint)phandle,
                                             "vhandle", (guint)vhandle,
                                             NULL));
+    ALLOC_STATS_ADD (ALLOC_STATS_OBJECT, sizeof (HandleMapEntry));
     g_debug ("%s: with vhandle: 0x%" PRIx32 " and phandle: 0x%" PRIx32,
              __func__, vhandle, phandle);
     return entry;
 }
+/*
+ * Create an entry for an object shared between connections. The 'backing'
+ * entry holds the physical handle, the saved context and the cached
+ * public area of the object: the accessors for these members of the new
+ * entry go to it. Only the vhandle and the pinned flag are the new
+ * entry's own.
+ */
+HandleMapEntry*
+handle_map_entry_new_shared (TPM2_HANDLE     vhandle,
+                             HandleMapEntry *backing)
+{
+    HandleMapEntry *entry;
+
+    entry = handle_map_entry_new (0, vhandle);
+    entry->backing = g_object_ref (handle_map_entry_get_backing (backing));
+    return entry;
+}
+/*
+ * The entry holding the object 'entry' refers to: its backing entry if the
+ * object is shared, 'entry' itself if not. No reference is taken.
+ */
+HandleMapEntry*
+handle_map_entry_get_backing (HandleMapEntry *entry)
+{
+    return entry->backing != NULL ? entry->backing : entry;
+}
 /*
  * Access the TPMS_CONTEXT member.
  * NOTE: This directly exposes memory from an object instance. The caller
@@ -153,7 +201,81 @@ handle_map_entry_new (TPM2_HANDLE phandle,
 TPMS_CONTEXT*
 handle_map_entry_get_context (HandleMapEntry *entry)
 {
-    return &entry->context;
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+
+    if (backing->context != NULL) {
+        return backing->context;
+    }
+    if (backing->context_store != NULL) {
+        backing->context_slot = context_store_alloc (backing->context_store);
+    }
+    if (backing->context_slot != CONTEXT_STORE_SLOT_NONE) {
+        backing->context = context_store_get (backing->context_store,
+                                              backing->context_slot);
+    } else if (backing->context_arena != NULL) {
+        backing->context = connection_arena_alloc (backing->context_arena);
+    } else {
+        ALLOC_STATS_ADD (ALLOC_STATS_OBJECT, sizeof (TPMS_CONTEXT));
+        backing->context = g_new0 (TPMS_CONTEXT, 1);
+    }
+    return backing->context;
+}
+/*
+ * Get the ContextLoad command for the saved context, ready to send with
+ * tpm2_context_load_command. Since a saved context doesn't change, the
+ * command is made on the first load and kept until the context is saved
+ * again. Returns NULL if the context can't be marshaled. The caller must
+ * free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+handle_map_entry_get_context_load (HandleMapEntry *entry)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+    GBytes *command;
+
+    if (backing->context_load != NULL) {
+        return g_bytes_ref (backing->context_load);
+    }
+    command = tpm2_command_context_load_bytes (
+                  handle_map_entry_get_context (backing));
+    if (command != NULL && backing->context_saved) {
+        ALLOC_STATS_ADD (ALLOC_STATS_OBJECT, g_bytes_get_size (command));
+        backing->context_load = g_bytes_ref (command);
+    }
+    return command;
+}
+/*
+ * Keep the saved context of the entry in 'store'. This only has an effect
+ * until the context is first accessed.
+ */
+void
+handle_map_entry_set_context_store (HandleMapEntry *entry,
+                                    ContextStore   *store)
+{
+    if (entry->context != NULL) {
+        return;
+    }
+    g_clear_object (&entry->context_store);
+    if (store != NULL) {
+        entry->context_store = g_object_ref (store);
+    }
+}
+/*
+ * Keep the saved context of the entry in 'arena' when there's no room for
+ * it in a ContextStore. Like handle_map_entry_set_context_store this only
+ * has an effect until the context is first accessed.
+ */
+void
+handle_map_entry_set_context_arena (HandleMapEntry  *entry,
+                                    ConnectionArena *arena)
+{
+    if (entry->context != NULL) {
+        return;
+    }
+    g_clear_object (&entry->context_arena);
+    if (arena != NULL) {
+        entry->context_arena = g_object_ref (arena);
+    }
 }
 /*
  * Accessor for the physical handle member.
@@ -161,7 +283,7 @@ handle_map_entry_get_context (HandleMapEntry *entry)
 TPM2_HANDLE
 handle_map_entry_get_phandle (HandleMapEntry *entry)
 {
-    return entry->phandle;
+    return handle_map_entry_get_backing (entry)->phandle;
 }
 /*
  * Accessor for the virtual handle member.
@@ -175,5 +297,174 @@ void
 handle_map_entry_set_phandle (HandleMapEntry *entry,
                               TPM2_HANDLE      phandle)
 {
-    entry->phandle = phandle;
+    handle_map_entry_get_backing (entry)->phandle = phandle;
+}
+/*
+ * Accessors for the 'context_saved' member. When set the TPMS_CONTEXT held
+ * by the entry is a valid saved context for the object. The contexts of
+ * transient objects don't change once created so a context saved once can
+ * be loaded again after every flush. Setting it drops the ContextLoad
+ * command made from the previous context.
+ */
+gboolean
+handle_map_entry_get_context_saved (HandleMapEntry *entry)
+{
+    return handle_map_entry_get_backing (entry)->context_saved;
+}
+void
+handle_map_entry_set_context_saved (HandleMapEntry *entry,
+                                    gboolean        saved)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+
+    backing->context_saved = saved;
+    g_clear_pointer (&backing->context_load, g_bytes_unref);
+}
+/*
+ * Accessors for the 'pinned' member. A client pins an object to keep it
+ * resident in the TPM: pinned objects are never evicted to make room for
+ * others. A shared object is pinned as long as one of the entries backed
+ * by it is.
+ */
+gboolean
+handle_map_entry_get_pinned (HandleMapEntry *entry)
+{
+    return entry->pinned || entry->pin_count > 0;
+}
+void
+handle_map_entry_set_pinned (HandleMapEntry *entry,
+                             gboolean        pinned)
+{
+    if (entry->backing != NULL && entry->pinned != pinned) {
+        if (pinned) {
+            ++entry->backing->pin_count;
+        } else {
+            --entry->backing->pin_count;
+        }
+    }
+    entry->pinned = pinned;
+}
+/*
+ * Accessors for the 'parent_uses' member, a score of how often the object
+ * was the parent in commands loading or creating other objects. The
+ * ResourceManager weighs the reload cost of objects by their scores when
+ * it evicts one so that parents stay resident while their children are
+ * loaded, and ages the scores of the objects spared.
+ */
+guint
+handle_map_entry_get_parent_uses (HandleMapEntry *entry)
+{
+    return handle_map_entry_get_backing (entry)->parent_uses;
+}
+void
+handle_map_entry_set_parent_uses (HandleMapEntry *entry,
+                                  guint           uses)
+{
+    handle_map_entry_get_backing (entry)->parent_uses = uses;
+}
+/*
+ * Accessors for the 'uses' member, a score of how often the object was
+ * used by commands lately. The ResourceManager ages it like the parent
+ * score.
+ */
+guint
+handle_map_entry_get_uses (HandleMapEntry *entry)
+{
+    return handle_map_entry_get_backing (entry)->uses;
+}
+void
+handle_map_entry_set_uses (HandleMapEntry *entry,
+                           guint           uses)
+{
+    handle_map_entry_get_backing (entry)->uses = uses;
+}
+/*
+ * Count a use of the object. Unlike the 'uses' score the count doesn't
+ * saturate: taking it returns the uses since it was last taken and starts
+ * it over, for telling the hottest objects apart.
+ */
+void
+handle_map_entry_count_use (HandleMapEntry *entry)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+
+    if (backing->use_count < G_MAXUINT) {
+        ++backing->use_count;
+    }
+}
+guint
+handle_map_entry_take_use_count (HandleMapEntry *entry)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+    guint count = backing->use_count;
+
+    backing->use_count = 0;
+    return count;
+}
+/*
+ * Note that loading the saved context of the object took 'elapsed'
+ * microseconds.
+ */
+void
+handle_map_entry_note_load (HandleMapEntry *entry,
+                            gint64          elapsed)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+
+    backing->load_us = context_load_average (backing->load_us, elapsed);
+}
+/*
+ * The microseconds loading the object again is expected to take, from its
+ * loads so far or the size of its saved context, see context_load_cost.
+ */
+guint64
+handle_map_entry_get_load_cost (HandleMapEntry *entry)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+    gsize size = 0;
+
+    if (backing->context_saved && backing->context != NULL) {
+        size = backing->context->contextBlob.size;
+    }
+    return context_load_cost (backing->load_us, size);
+}
+/*
+ * Accessors for the 'epoch' member, the number of TPM resets the
+ * ResourceManager had seen when the object was created. The object and
+ * its saved context are gone once the TPM is reset again.
+ */
+guint
+handle_map_entry_get_epoch (HandleMapEntry *entry)
+{
+    return handle_map_entry_get_backing (entry)->epoch;
+}
+void
+handle_map_entry_set_epoch (HandleMapEntry *entry,
+                            guint           epoch)
+{
+    handle_map_entry_get_backing (entry)->epoch = epoch;
+}
+/*
+ * Accessors for the cached ReadPublic response. The public area of a
+ * transient object never changes so the response from the first ReadPublic
+ * command can be returned for all later ones. The getter returns a new
+ * reference that the caller must release, or NULL if nothing is cached.
+ * The setter takes its own reference to the GBytes.
+ */
+GBytes*
+handle_map_entry_get_public (HandleMapEntry *entry)
+{
+    entry = handle_map_entry_get_backing (entry);
+    if (entry->public_cache == NULL)
+        return NULL;
+    return g_bytes_ref (entry->public_cache);
+}
+void
+handle_map_entry_set_public (HandleMapEntry *entry,
+                             GBytes         *public_cache)
+{
+    entry = handle_map_entry_get_backing (entry);
+    g_clear_pointer (&entry->public_cache, g_bytes_unref);
+    if (public_cache != NULL)
+        entry->public_cache = g_bytes_ref (public_cache);
 }
@@ -10,6 +10,9 @@
 #include <glib-object.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "connection-arena.h"
+#include "context-store.h"
+
 G_BEGIN_DECLS
 
 typedef struct _HandleMapEntryClass {
@@ -20,7 +23,35 @@ typedef struct _HandleMapEntry {
     GObject           parent_instance;
     TPM2_HANDLE        phandle;
     TPM2_HANDLE        vhandle;
-    TPMS_CONTEXT      context;
+    /*
+     * The saved context, allocated on first use: in a slot of the
+     * ContextStore if the entry has one and it isn't full, from the
+     * ConnectionArena of its connection if it has one, on the heap
+     * otherwise.
+     */
+    TPMS_CONTEXT     *context;
+    ContextStore     *context_store;
+    guint             context_slot;
+    ConnectionArena  *context_arena;
+    gboolean          context_saved;
+    /* ContextLoad command for the saved context, made on its first load */
+    GBytes           *context_load;
+    gboolean          pinned;
+    /* pins held by the entries backed by this one */
+    guint             pin_count;
+    /* how often the object was used as a parent lately */
+    guint             parent_uses;
+    /* how often the object was used lately */
+    guint             uses;
+    /* times the object was used since the count was last taken */
+    guint             use_count;
+    /* average microseconds its ContextLoads took, 0 until it's loaded */
+    guint             load_us;
+    /* TPM resets seen when the object was created */
+    guint             epoch;
+    GBytes           *public_cache;
+    /* the entry holding the shared object this one uses, or NULL */
+    struct _HandleMapEntry *backing;
 } HandleMapEntry;
 
 #define TYPE_HANDLE_MAP_ENTRY              (handle_map_entry_get_type   ())
@@ -33,11 +64,42 @@ typedef struct _HandleMapEntry {
 GType            handle_map_entry_get_type      (void);
 HandleMapEntry*  handle_map_entry_new           (TPM2_HANDLE         phandle,
                                                  TPM2_HANDLE         vhandle);
+HandleMapEntry*  handle_map_entry_new_shared    (TPM2_HANDLE         vhandle,
+                                                 HandleMapEntry    *backing);
+HandleMapEntry*  handle_map_entry_get_backing   (HandleMapEntry    *entry);
 TPM2_HANDLE       handle_map_entry_get_phandle   (HandleMapEntry    *entry);
 TPM2_HANDLE       handle_map_entry_get_vhandle   (HandleMapEntry    *entry);
 TPMS_CONTEXT*    handle_map_entry_get_context   (HandleMapEntry    *entry);
+GBytes*          handle_map_entry_get_context_load (HandleMapEntry *entry);
+void             handle_map_entry_set_context_store (HandleMapEntry *entry,
+                                                     ContextStore   *store);
+void             handle_map_entry_set_context_arena (HandleMapEntry  *entry,
+                                                     ConnectionArena *arena);
 void             handle_map_entry_set_phandle   (HandleMapEntry    *entry,
                                                  TPM2_HANDLE         phandle);
+gboolean         handle_map_entry_get_context_saved (HandleMapEntry *entry);
+void             handle_map_entry_set_context_saved (HandleMapEntry *entry,
+                                                     gboolean        saved);
+gboolean         handle_map_entry_get_pinned    (HandleMapEntry    *entry);
+void             handle_map_entry_set_pinned    (HandleMapEntry    *entry,
+                                                 gboolean           pinned);
+guint            handle_map_entry_get_parent_uses (HandleMapEntry *entry);
+void             handle_map_entry_set_parent_uses (HandleMapEntry *entry,
+                                                   guint           uses);
+guint            handle_map_entry_get_uses      (HandleMapEntry    *entry);
+void             handle_map_entry_set_uses      (HandleMapEntry    *entry,
+                                                 guint              uses);
+void             handle_map_entry_count_use     (HandleMapEntry    *entry);
+guint            handle_map_entry_take_use_count (HandleMapEntry   *entry);
+void             handle_map_entry_note_load     (HandleMapEntry    *entry,
+                                                 gint64             elapsed);
+guint64          handle_map_entry_get_load_cost (HandleMapEntry    *entry);
+guint            handle_map_entry_get_epoch     (HandleMapEntry    *entry);
+void             handle_map_entry_set_epoch     (HandleMapEntry    *entry,
+                                                 guint              epoch);
+GBytes*          handle_map_entry_get_public    (HandleMapEntry    *entry);
+void             handle_map_entry_set_public    (HandleMapEntry    *entry,
+                                                 GBytes            *public_cache);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_ENTRY_H */
@@ -3,9 +3,8 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
-#include <errno.h>
-#include <string.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include "handle-map.h"
 #include "util.h"
@@ -19,6 +18,50 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * The slot a vhandle is looked up in first.
+ */
+static inline guint
+handle_map_home_slot (HandleMap  *map,
+                      TPM2_HANDLE vhandle)
+{
+    return vhandle & (map->slot_count - 1);
+}
+/*
+ * Allocate the slots for a map holding up to 'entries' entries and move
+ * the entries already in the map over. The number of slots is a power of
+ * two at least twice that so the low bits of the vhandle can be used as
+ * index and there's always an empty slot to end a probe. Maps get room
+ * for HANDLE_MAP_ENTRIES_INITIAL entries with their first entry and double
+ * as they fill, up to the 'max_entries' + 1 (see handle_map_is_full) they
+ * may hold: a connection only pays for the objects it has, not for the
+ * limit.
+ */
+static void
+handle_map_alloc_slots (HandleMap *map,
+                        guint      entries)
+{
+    handle_map_slot_t *old = map->slots;
+    guint old_count = map->slot_count, slot_count = 2, mask, i, j;
+
+    while (slot_count < 2 * entries) {
+        slot_count <<= 1;
+    }
+    map->slots = g_new0 (handle_map_slot_t, slot_count);
+    map->slot_count = slot_count;
+    mask = slot_count - 1;
+    for (i = 0; i < old_count; ++i) {
+        if (old [i].vhandle == 0) {
+            continue;
+        }
+        for (j = handle_map_home_slot (map, old [i].vhandle);
+             map->slots [j].vhandle != 0;
+             j = (j + 1) & mask);
+        map->slots [j] = old [i];
+    }
+    g_free (old);
+    map->sorted = g_renew (TPM2_HANDLE, map->sorted, slot_count / 2);
+}
 /*
  * Property getter.
  */
@@ -67,10 +110,9 @@ handle_map_set_property (GObject        *object,
     }
 }
 /*
- * Initialize object. This requires:
- * 1) initializing the mutex that mediate access to the hash tables
- * 2) creating the hash tables
- * 3) initializing the handle_count
+ * Initialize object. The slots are allocated when the first entry is
+ * inserted, most connections never load an object so an empty map is
+ * only the GObject.
  * The handle_count is currently initialized to start allocating handles
  * @ 0xff. This is an arbitrary way we differentiate them from the handles
  * allocated by the TPM.
@@ -79,29 +121,32 @@ static void
 handle_map_init (HandleMap     *map)
 {
     g_debug ("handle_map_init");
-    pthread_mutex_init (&map->mutex, NULL);
-    map->vhandle_to_entry_table =
-        g_hash_table_new_full (g_direct_hash,
-                               g_direct_equal,
-                               NULL,
-                               (GDestroyNotify)g_object_unref);
+    map->slots = NULL;
+    map->slot_count = 0;
+    map->sorted = NULL;
+    map->size = 0;
     map->handle_count = 0xff;
 }
 /*
  * GObject dispose function: release all references to GObjects. Currently
- * this is only the GHashTable mapping vhandles to HandleMapEntry objects.
+ * this is only the HandleMapEntry objects in the slots.
  */
 static void
 handle_map_dispose (GObject *object)
 {
     HandleMap *self = HANDLE_MAP (object);
+    guint i;
 
-    g_clear_pointer (&self->vhandle_to_entry_table, g_hash_table_unref);
+    for (i = 0; i < self->slot_count; ++i) {
+        g_clear_object (&self->slots [i].entry);
+        self->slots [i].vhandle = 0;
+    }
+    self->size = 0;
     G_OBJECT_CLASS (handle_map_parent_class)->dispose (object);
 }
 /*
  * GObject finalize function: release all non-GObject resources. Currently
- * this is the mutex used to lock the GHashTable.
+ * this is the array of slots.
  */
 static void
 handle_map_finalize (GObject *object)
@@ -109,7 +154,8 @@ handle_map_finalize (GObject *object)
     HandleMap *self = HANDLE_MAP (object);
 
     g_debug ("handle_map_finalize");
-    pthread_mutex_destroy (&self->mutex);
+    g_clear_pointer (&self->slots, g_free);
+    g_clear_pointer (&self->sorted, g_free);
     G_OBJECT_CLASS (handle_map_parent_class)->finalize (object);
 }
 /*
@@ -164,22 +210,54 @@ handle_map_new (TPM2_HT handle_type,
                                      NULL));
 }
 /*
- * Lock the mutex that protects the hash table object.
+ * Find the slot holding the entry for 'vhandle' by probing linearly from
+ * its home slot. Since the map is never more than half full the probe
+ * always ends, at the latest on an empty slot.
+ * Returns the index of the slot or -1 if there's no entry for 'vhandle'.
  */
-static inline void
-handle_map_lock (HandleMap *map)
+static gint
+handle_map_find_slot (HandleMap  *map,
+                      TPM2_HANDLE vhandle)
 {
-    if (pthread_mutex_lock (&map->mutex) != 0)
-        g_error ("Error locking HandleMap: %s", strerror (errno));
+    guint mask = map->slot_count - 1;
+    guint i;
+
+    if (vhandle == 0 || map->slot_count == 0) {
+        return -1;
+    }
+    for (i = handle_map_home_slot (map, vhandle);
+         map->slots [i].vhandle != 0;
+         i = (i + 1) & mask)
+    {
+        if (map->slots [i].vhandle == vhandle) {
+            return (gint)i;
+        }
+    }
+    return -1;
 }
 /*
- * Unlock the mutex that protects the hash table object.
+ * Return the index of the first vhandle in 'sorted' that is greater than
+ * or equal to 'vhandle', or 'size' if there's none.
  */
-static inline void
-handle_map_unlock (HandleMap *map)
+static guint
+handle_map_sorted_bound (HandleMap  *map,
+                         TPM2_HANDLE vhandle)
 {
-    if (pthread_mutex_unlock (&map->mutex) != 0)
-        g_error ("Error unlocking HandleMap: %s", strerror (errno));
+    guint low = 0, high = map->size, mid;
+
+    /* the common case: a newly allocated vhandle goes at the end */
+    if (high == 0 || map->sorted [high - 1] < vhandle) {
+        return high;
+    }
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (map->sorted [mid] < vhandle) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 /*
  * Return false if the number of entries in the map is greater than or equal
@@ -188,22 +266,30 @@ handle_map_unlock (HandleMap *map)
 gboolean
 handle_map_is_full (HandleMap *map)
 {
-    guint table_size;
-
-    table_size = g_hash_table_size (map->vhandle_to_entry_table);
-    if (table_size < map->max_entries + 1) {
+    if (map->size < (guint)g_atomic_int_get (&map->max_entries) + 1) {
         return FALSE;
     } else {
         return TRUE;
     }
 }
 /*
- * Insert GObject into the hash table with the key being the provided handle.
+ * Change the limit of a map in use. The map is owned by the thread
+ * serving its connection, the limit is the one field another thread may
+ * write. A lowered limit only refuses new entries.
+ */
+void
+handle_map_set_max_entries (HandleMap *map,
+                            guint      max_entries)
+{
+    g_atomic_int_set (&map->max_entries, max_entries);
+}
+/*
+ * Insert GObject into the map with the key being the provided handle.
  * We take a reference to the object before we insert the object since when
- * it is removed or if the hash table is destroyed the object will be unref'd.
+ * it is removed or if the map is destroyed the object will be unref'd.
  * If a handle provided is 0 we do not insert the entry in the corresponding
  * map.
- * If there is an entry with the given key already in the table we don't insert
+ * If there is an entry with the given key already in the map we don't insert
  * anything, because it would overwrite the original entry.
  */
 gboolean
@@ -211,71 +297,91 @@ handle_map_insert (HandleMap      *map,
                    TPM2_HANDLE     vhandle,
                    HandleMapEntry *entry)
 {
+    guint mask;
+    guint i, pos;
+
     g_debug ("%s: vhandle: 0x%" PRIx32, __func__, vhandle);
-    handle_map_lock (map);
     if (handle_map_is_full (map)) {
         g_warning ("%s: max_entries of %u exceeded", __func__, map->max_entries);
-        handle_map_unlock (map);
         return FALSE;
     }
-    if (entry && vhandle != 0) {
-        TPM2_HANDLE *orig_key;
-        HandleMapEntry *orig_value;
-
-	/* Check if an entry for the key is already in the table */
-        if (!g_hash_table_lookup_extended (map->vhandle_to_entry_table,
-                                           GINT_TO_POINTER (vhandle),
-                                           (gpointer *) &orig_key,
-					   (gpointer *) &orig_value)) {
-            g_object_ref (entry);
-            g_hash_table_insert (map->vhandle_to_entry_table,
-                                 GINT_TO_POINTER (vhandle),
-                                 entry);
-	}
+    if (entry == NULL || vhandle == 0) {
+        return TRUE;
+    }
+    if (map->slot_count == 0) {
+        handle_map_alloc_slots (map, MIN (g_atomic_int_get (&map->max_entries) + 1,
+                                          HANDLE_MAP_ENTRIES_INITIAL));
+    } else if (map->size + 1 > map->slot_count / 2) {
+        handle_map_alloc_slots (map, map->slot_count);
     }
-    handle_map_unlock (map);
+    mask = map->slot_count - 1;
+    for (i = handle_map_home_slot (map, vhandle);
+         map->slots [i].vhandle != 0;
+         i = (i + 1) & mask)
+    {
+        /* Check if an entry for the key is already in the map */
+        if (map->slots [i].vhandle == vhandle) {
+            return TRUE;
+        }
+    }
+    map->slots [i].vhandle = vhandle;
+    map->slots [i].entry = g_object_ref (entry);
+    pos = handle_map_sorted_bound (map, vhandle);
+    memmove (&map->sorted [pos + 1],
+             &map->sorted [pos],
+             (map->size - pos) * sizeof (TPM2_HANDLE));
+    map->sorted [pos] = vhandle;
+    ++map->size;
     return TRUE;
 }
 /*
- * Remove the entry from the hash table associated with the provided handle.
+ * Remove the entry from the map associated with the provided handle.
+ * The entries following it in the same probe sequence are moved back so
+ * that no probe stops at the slot that was emptied before reaching them.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 handle_map_remove (HandleMap *map,
                    TPM2_HANDLE vhandle)
 {
-    gboolean ret;
-
-    handle_map_lock (map);
-    ret = g_hash_table_remove (map->vhandle_to_entry_table,
-                               GINT_TO_POINTER (vhandle));
-    handle_map_unlock (map);
-
-    return ret;
-}
-/*
- * Generic lookup function to find an entry in a GHashTable for the given
- * handle.
- */
-static HandleMapEntry*
-handle_map_lookup (HandleMap     *map,
-                   TPM2_HANDLE     handle,
-                   GHashTable    *table)
-{
-    HandleMapEntry *entry;
-
-    handle_map_lock (map);
-    entry = g_hash_table_lookup (table, GINT_TO_POINTER (handle));
-    if (entry)
-        g_object_ref (entry);
-    handle_map_unlock (map);
+    guint mask = map->slot_count - 1;
+    guint hole, i, home, pos;
+    gint slot;
 
-    return entry;
+    slot = handle_map_find_slot (map, vhandle);
+    if (slot < 0) {
+        return FALSE;
+    }
+    hole = (guint)slot;
+    g_clear_object (&map->slots [hole].entry);
+    map->slots [hole].vhandle = 0;
+    pos = handle_map_sorted_bound (map, vhandle);
+    --map->size;
+    memmove (&map->sorted [pos],
+             &map->sorted [pos + 1],
+             (map->size - pos) * sizeof (TPM2_HANDLE));
+    for (i = (hole + 1) & mask;
+         map->slots [i].vhandle != 0;
+         i = (i + 1) & mask)
+    {
+        home = handle_map_home_slot (map, map->slots [i].vhandle);
+        /* leave the entry if its home slot is cyclically in (hole, i] */
+        if ((hole < i && home > hole && home <= i) ||
+            (hole > i && (home > hole || home <= i)))
+        {
+            continue;
+        }
+        map->slots [hole] = map->slots [i];
+        map->slots [i].vhandle = 0;
+        map->slots [i].entry = NULL;
+        hole = i;
+    }
+    return TRUE;
 }
 /*
- * Look up the GObject associated with the virtual handle in the hash
- * table. The object is not removed from the hash table. The reference
- * count for the object is incremented before it is returned to the caller.
+ * Look up the GObject associated with the virtual handle in the map. The
+ * object is not removed from the map. The reference count for the object
+ * is incremented before it is returned to the caller.
  * The caller must free this reference when they are done with it.
  * NULL is returned if no entry matches the provided handle.
  */
@@ -283,22 +389,21 @@ HandleMapEntry*
 handle_map_vlookup (HandleMap    *map,
                     TPM2_HANDLE    vhandle)
 {
-    return handle_map_lookup (map, vhandle, map->vhandle_to_entry_table);
+    gint slot;
+
+    slot = handle_map_find_slot (map, vhandle);
+    if (slot < 0) {
+        return NULL;
+    }
+    return g_object_ref (map->slots [slot].entry);
 }
 /*
- * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * Simple accessor for the number of entries in the map.
  */
 guint
 handle_map_size (HandleMap *map)
 {
-    guint ret;
-
-    handle_map_lock (map);
-    ret = g_hash_table_size (map->vhandle_to_entry_table);
-    handle_map_unlock (map);
-
-    return ret;
+    return map->size;
 }
 /*
  * Combine the handle_type and the handle_count to create a new handle.
@@ -320,14 +425,25 @@ handle_map_next_vhandle (HandleMap *map)
     ++map->handle_count;
     return handle;
 }
+/*
+ * Call 'callback' with the vhandle and the HandleMapEntry of each entry
+ * in the map like g_hash_table_foreach. The callback must not insert or
+ * remove entries.
+ */
 void
 handle_map_foreach (HandleMap *map,
                     GHFunc     callback,
                     gpointer   user_data)
 {
-    g_hash_table_foreach (map->vhandle_to_entry_table,
-                          callback,
-                          user_data);
+    guint i;
+
+    for (i = 0; i < map->slot_count; ++i) {
+        if (map->slots [i].vhandle != 0) {
+            callback (GUINT_TO_POINTER (map->slots [i].vhandle),
+                      map->slots [i].entry,
+                      user_data);
+        }
+    }
 }
 /*
  * Get a GList containing all keys from the map. These will be returned in no
@@ -336,5 +452,77 @@ handle_map_foreach (HandleMap *map,
 GList*
 handle_map_get_keys (HandleMap *map)
 {
-    return g_hash_table_get_keys (map->vhandle_to_entry_table);
+    GList *keys = NULL;
+    guint i;
+
+    for (i = 0; i < map->slot_count; ++i) {
+        if (map->slots [i].vhandle != 0) {
+            keys = g_list_prepend (keys,
+                                   GUINT_TO_POINTER (map->slots [i].vhandle));
+        }
+    }
+    return keys;
+}
+/*
+ * Move the entries of 'from' into 'map' under the vhandles they have now,
+ * so a client resuming a connection finds its objects where it left them.
+ * The handle_count of 'map' is advanced past the one of 'from' so new
+ * vhandles don't collide with the moved ones. Entries that don't fit are
+ * left in 'from'.
+ * Returns the number of entries moved.
+ */
+guint
+handle_map_move (HandleMap *map,
+                 HandleMap *from)
+{
+    HandleMapEntry *entry;
+    GList *keys, *key;
+    TPM2_HANDLE vhandle;
+    guint count = 0;
+
+    map->handle_count = MAX (map->handle_count, from->handle_count);
+    keys = handle_map_get_keys (from);
+    for (key = keys; key != NULL; key = key->next) {
+        vhandle = GPOINTER_TO_UINT (key->data);
+        if (handle_map_is_full (map)) {
+            g_warning ("%s: map full, %u entries left behind", __func__,
+                       handle_map_size (from));
+            break;
+        }
+        entry = handle_map_vlookup (from, vhandle);
+        if (handle_map_insert (map, vhandle, entry)) {
+            handle_map_remove (from, vhandle);
+            ++count;
+        }
+        g_object_unref (entry);
+    }
+    g_list_free (keys);
+    return count;
+}
+/*
+ * Copy up to 'count' vhandles greater than or equal to 'start' into
+ * 'handles' in ascending order. This is what GetCapability needs to page
+ * through TPM2_CAP_HANDLES without sorting the map each time.
+ * If 'more' isn't NULL it's set to TRUE when there are vhandles left over
+ * that didn't fit in 'handles'.
+ * Returns the number of vhandles copied.
+ */
+guint
+handle_map_get_range (HandleMap   *map,
+                      TPM2_HANDLE  start,
+                      TPM2_HANDLE *handles,
+                      guint        count,
+                      gboolean    *more)
+{
+    guint pos, n;
+
+    pos = handle_map_sorted_bound (map, start);
+    n = MIN (count, map->size - pos);
+    if (n > 0) {
+        memcpy (handles, &map->sorted [pos], n * sizeof (TPM2_HANDLE));
+    }
+    if (more != NULL) {
+        *more = pos + n < map->size;
+    }
+    return n;
 }
@@ -8,7 +8,6 @@
 
 #include <glib.h>
 #include <glib-object.h>
-#include <pthread.h>
 #include <tss2/tss2_tpm2_types.h>
 
 #include "handle-map-entry.h"
@@ -16,18 +15,40 @@
 G_BEGIN_DECLS
 
 #define MAX_ENTRIES_DEFAULT 27
-#define MAX_ENTRIES_MAX     100
+#define MAX_ENTRIES_MAX     4096
+/* entries a HandleMap has room for until it first grows */
+#define HANDLE_MAP_ENTRIES_INITIAL 8
 
 typedef struct _HandleMapClass {
     GObjectClass      parent;
 } HandleMapClass;
 
+typedef struct {
+    TPM2_HANDLE         vhandle;
+    HandleMapEntry     *entry;
+} handle_map_slot_t;
+/*
+ * The entries are kept in an open-addressed array indexed by the low bits
+ * of the vhandle. Virtual handles are allocated in sequence by
+ * handle_map_next_vhandle and the array has at least twice as many slots
+ * as the map holds entries, doubling when it's half full, so a lookup
+ * almost always finds the entry in the first slot it tries. A slot with
+ * a vhandle of 0 is empty. A map that never held an entry has no slots.
+ * 'sorted' holds the vhandles of the 'size' entries in ascending order
+ * for handle_map_get_range. Since vhandles are allocated in ascending
+ * order adding one to it is usually an append.
+ * A HandleMap belongs to the connection it tracks objects for and is only
+ * used by one thread at a time (the ResourceManager serving the
+ * connection) so it has no lock.
+ */
 typedef struct _HandleMap {
     GObject             parent_instance;
-    pthread_mutex_t     mutex;
     TPM2_HT              handle_type;
     TPM2_HANDLE          handle_count;
-    GHashTable         *vhandle_to_entry_table;
+    handle_map_slot_t  *slots;
+    guint               slot_count;
+    TPM2_HANDLE         *sorted;
+    guint               size;
     guint               max_entries;
 } HandleMap;
 
@@ -56,7 +77,16 @@ void             handle_map_foreach      (HandleMap    *map,
                                           GHFunc        callback,
                                           gpointer      user_data);
 gboolean         handle_map_is_full      (HandleMap *map);
+void             handle_map_set_max_entries (HandleMap *map,
+                                             guint      max_entries);
 GList*           handle_map_get_keys     (HandleMap    *map);
+guint            handle_map_move         (HandleMap    *map,
+                                          HandleMap    *from);
+guint            handle_map_get_range    (HandleMap    *map,
+                                          TPM2_HANDLE   start,
+                                          TPM2_HANDLE  *handles,
+                                          guint         count,
+                                          gboolean     *more);
 
 G_END_DECLS
 #endif /* HANDLE_MAP_H */
@@ -0,0 +1,613 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "handle-map.h"
+#include "handover.h"
+#include "tabrmd-defaults.h"
+#include "util.h"
+
+typedef union {
+    handover_header_t     header;
+    handover_connection_t connection;
+    handover_transient_t  transient;
+    handover_session_t    session;
+} handover_message_t;
+
+/*
+ * Create the GSocketService the running daemon takes handover requests
+ * on. A socket left behind at 'path' by a previous instance is replaced,
+ * the new one is only accessible to the user running the daemon. The
+ * caller connects to the 'incoming' signal and starts the service.
+ */
+GSocketService*
+handover_listen (const gchar *path)
+{
+    GSocketService *service;
+    GSocketAddress *address;
+    GError *error = NULL;
+    struct stat st;
+    gboolean ret;
+
+    if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode)) {
+        g_debug ("%s: removing stale socket %s", __func__, path);
+        unlink (path);
+    }
+    service = g_socket_service_new ();
+    address = g_unix_socket_address_new (path);
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (service),
+                                         address,
+                                         G_SOCKET_TYPE_SEQPACKET,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         &error);
+    g_object_unref (address);
+    if (!ret || chmod (path, 0600) != 0) {
+        g_warning ("%s: failed to listen on handover socket %s: %s",
+                   __func__, path,
+                   error != NULL ? error->message : strerror (errno));
+        g_clear_error (&error);
+        g_object_unref (service);
+        return NULL;
+    }
+    return service;
+}
+void
+handover_unlisten (GSocketService *service,
+                   const gchar    *path)
+{
+    g_socket_service_stop (service);
+    g_socket_listener_close (G_SOCKET_LISTENER (service));
+    unlink (path);
+    g_object_unref (service);
+}
+static void
+handover_header_init (handover_header_t *header,
+                      handover_type_t    type)
+{
+    header->magic = HANDOVER_MAGIC;
+    header->version = HANDOVER_VERSION;
+    header->type = type;
+    header->reserved = 0;
+}
+/*
+ * Send one message, 'fd' goes with it as ancillary data unless it's -1.
+ * The fd is duplicated, the caller keeps its own.
+ */
+static gboolean
+handover_send_message (GSocket           *socket,
+                       handover_header_t *header,
+                       gsize              size,
+                       gint               fd)
+{
+    GOutputVector vector = { .buffer = header, .size = size };
+    GSocketControlMessage *message = NULL;
+    GError *error = NULL;
+    gssize ret;
+
+    if (fd >= 0) {
+        message = g_unix_fd_message_new ();
+        if (!g_unix_fd_message_append_fd (G_UNIX_FD_MESSAGE (message),
+                                          fd,
+                                          &error))
+        {
+            g_warning ("%s: failed to pass fd %d: %s", __func__, fd,
+                       error->message);
+            g_error_free (error);
+            g_object_unref (message);
+            return FALSE;
+        }
+    }
+    ret = g_socket_send_message (socket,
+                                 NULL,
+                                 &vector,
+                                 1,
+                                 message != NULL ? &message : NULL,
+                                 message != NULL ? 1 : 0,
+                                 G_SOCKET_MSG_NONE,
+                                 NULL,
+                                 &error);
+    g_clear_object (&message);
+    if (ret != (gssize)size) {
+        g_warning ("%s: failed to send handover message: %s", __func__,
+                   error != NULL ? error->message : "short write");
+        g_clear_error (&error);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Receive one message into 'msg'. If an fd came with it, it's returned
+ * through 'fd', otherwise 'fd' is set to -1. Extra fds are closed.
+ * Returns the size of the message or -1 on error.
+ */
+static gssize
+handover_receive_message (GSocket            *socket,
+                          handover_message_t *msg,
+                          gint               *fd)
+{
+    GInputVector vector = { .buffer = msg, .size = sizeof (*msg) };
+    GSocketControlMessage **messages = NULL;
+    GError *error = NULL;
+    gint num_messages = 0, num_fds = 0, i, j;
+    gint *fds;
+    gssize ret;
+
+    *fd = -1;
+    ret = g_socket_receive_message (socket,
+                                    NULL,
+                                    &vector,
+                                    1,
+                                    &messages,
+                                    &num_messages,
+                                    NULL,
+                                    NULL,
+                                    &error);
+    if (ret < 0) {
+        g_warning ("%s: failed to receive handover message: %s", __func__,
+                   error->message);
+        g_error_free (error);
+    }
+    for (i = 0; i < num_messages; ++i) {
+        if (G_IS_UNIX_FD_MESSAGE (messages [i])) {
+            fds = g_unix_fd_message_steal_fds (G_UNIX_FD_MESSAGE (messages [i]),
+                                               &num_fds);
+            for (j = 0; j < num_fds; ++j) {
+                if (*fd == -1) {
+                    *fd = fds [j];
+                } else {
+                    close (fds [j]);
+                }
+            }
+            g_free (fds);
+        }
+        g_object_unref (messages [i]);
+    }
+    g_free (messages);
+    if (ret >= 0 &&
+        ((gsize)ret < sizeof (handover_header_t) ||
+         msg->header.magic != HANDOVER_MAGIC ||
+         msg->header.version != HANDOVER_VERSION))
+    {
+        g_warning ("%s: bad handover message", __func__);
+        ret = -1;
+    }
+    if (ret < 0 && *fd >= 0) {
+        close (*fd);
+        *fd = -1;
+    }
+    return ret;
+}
+/*
+ * Check a request on a socket accepted by the handover GSocketService.
+ * Only the user running the daemon may take over from it.
+ */
+gboolean
+handover_check_request (GSocket *socket)
+{
+    GCredentials *credentials;
+    GError *error = NULL;
+    handover_message_t msg = { 0 };
+    uid_t uid;
+    gint fd;
+    gssize size;
+
+    g_socket_set_timeout (socket, HANDOVER_TIMEOUT);
+    credentials = g_socket_get_credentials (socket, &error);
+    if (credentials == NULL) {
+        g_warning ("%s: failed to get peer credentials: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+    uid = g_credentials_get_unix_user (credentials, NULL);
+    g_object_unref (credentials);
+    if (uid != geteuid ()) {
+        g_warning ("%s: refusing handover to uid %u", __func__, uid);
+        return FALSE;
+    }
+    size = handover_receive_message (socket, &msg, &fd);
+    if (fd >= 0) {
+        close (fd);
+    }
+    if (size != sizeof (handover_header_t) ||
+        msg.header.type != HANDOVER_REQUEST)
+    {
+        g_warning ("%s: bad handover request", __func__);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Data used while sending the state of one connection. 'connection' is
+ * NULL while the abandoned sessions are sent.
+ */
+typedef struct {
+    GSocket    *socket;
+    Connection *connection;
+    gboolean    failed;
+} handover_send_data_t;
+
+static void
+handover_send_transient (gpointer key,
+                         gpointer value,
+                         gpointer user_data)
+{
+    handover_send_data_t *data = (handover_send_data_t*)user_data;
+    HandleMapEntry *entry = HANDLE_MAP_ENTRY (value);
+    handover_transient_t msg = { 0 };
+    UNUSED_PARAM (key);
+
+    if (data->failed) {
+        return;
+    }
+    if (handle_map_entry_get_phandle (entry) != 0 ||
+        !handle_map_entry_get_context_saved (entry))
+    {
+        g_warning ("%s: transient with vhandle 0x%" PRIx32 " has no saved "
+                   "context, dropping it", __func__,
+                   handle_map_entry_get_vhandle (entry));
+        return;
+    }
+    handover_header_init (&msg.header, HANDOVER_TRANSIENT);
+    msg.vhandle = handle_map_entry_get_vhandle (entry);
+    msg.context = *handle_map_entry_get_context (entry);
+    data->failed = !handover_send_message (data->socket,
+                                           &msg.header,
+                                           sizeof (msg),
+                                           -1);
+}
+/*
+ * Copy a context blob of a SessionEntry into the fixed size buffer of a
+ * HANDOVER_SESSION message. SessionEntry never holds a blob larger than a
+ * TPMS_CONTEXT.
+ */
+static void
+handover_copy_blob (size_buf_t *size_buf,
+                    GBytes     *blob)
+{
+    size_buf->size = g_bytes_get_size (blob);
+    g_assert (size_buf->size <= SIZE_BUF_MAX);
+    if (size_buf->size > 0) {
+        memcpy (size_buf->buf, g_bytes_get_data (blob, NULL), size_buf->size);
+    }
+}
+static void
+handover_send_session (gpointer data_entry,
+                       gpointer user_data)
+{
+    handover_send_data_t *data = (handover_send_data_t*)user_data;
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    SessionEntryStateEnum state = session_entry_get_state (entry);
+    handover_session_t msg = { 0 };
+
+    if (data->failed || entry->connection != data->connection ||
+        (data->connection == NULL &&
+         state != SESSION_ENTRY_SAVED_CLIENT_CLOSED))
+    {
+        return;
+    }
+    if (state == SESSION_ENTRY_LOADED) {
+        g_warning ("%s: session with handle 0x%" PRIx32 " is still loaded, "
+                   "dropping it", __func__, session_entry_get_handle (entry));
+        return;
+    }
+    handover_header_init (&msg.header, HANDOVER_SESSION);
+    msg.handle = session_entry_get_handle (entry);
+    msg.state = state;
+    handover_copy_blob (&msg.context, session_entry_get_context (entry));
+    handover_copy_blob (&msg.context_client,
+                        session_entry_get_context_client (entry));
+    data->failed = !handover_send_message (data->socket,
+                                           &msg.header,
+                                           sizeof (msg),
+                                           -1);
+}
+/*
+ * Send the client connections in 'manager' and the sessions in
+ * 'session_list' to the new instance on 'socket'. The ResourceManager
+ * must have saved every transient object and session and stopped before
+ * this is called. Connections using the shared memory transport can't be
+ * handed over, the caller is expected to have removed them. Multiplexed
+ * connections aren't handed over either: their logical connections only
+ * exist in the CommandSource.
+ */
+gboolean
+handover_send (GSocket           *socket,
+               ConnectionManager *manager,
+               SessionList       *session_list)
+{
+    handover_send_data_t data = { .socket = socket };
+    handover_connection_t msg;
+    handover_header_t end;
+    GList *connections, *link;
+    Connection *connection;
+    HandleMap *handle_map;
+    GSocket *client;
+    guint count = 0;
+
+    connections = connection_manager_get_connections (manager);
+    for (link = connections; link != NULL && !data.failed; link = link->next) {
+        connection = CONNECTION (link->data);
+        if (connection_get_shm (connection) != NULL ||
+            connection_get_mux (connection) ||
+            !G_IS_SOCKET_CONNECTION (connection_get_iostream (connection)))
+        {
+            g_info ("%s: can't hand over connection 0x%" PRIx64, __func__,
+                    connection->id);
+            continue;
+        }
+        client = g_socket_connection_get_socket (
+                     G_SOCKET_CONNECTION (connection_get_iostream (connection)));
+        memset (&msg, 0, sizeof (msg));
+        handover_header_init (&msg.header, HANDOVER_CONNECTION);
+        msg.id = connection->id;
+        msg.priority = connection_get_priority (connection);
+        handle_map = connection_get_trans_map (connection);
+        msg.handle_count = handle_map->handle_count;
+        msg.pid = connection_get_pid (connection);
+        msg.uid = connection_get_uid (connection);
+        if (!handover_send_message (socket,
+                                    &msg.header,
+                                    sizeof (msg),
+                                    g_socket_get_fd (client)))
+        {
+            g_object_unref (handle_map);
+            data.failed = TRUE;
+            break;
+        }
+        data.connection = connection;
+        handle_map_foreach (handle_map, handover_send_transient, &data);
+        g_object_unref (handle_map);
+        session_list_foreach (session_list, handover_send_session, &data);
+        ++count;
+    }
+    g_list_free_full (connections, g_object_unref);
+    data.connection = NULL;
+    if (!data.failed) {
+        session_list_foreach (session_list, handover_send_session, &data);
+    }
+    if (data.failed) {
+        return FALSE;
+    }
+    handover_header_init (&end, HANDOVER_END);
+    if (!handover_send_message (socket, &end, sizeof (end), -1)) {
+        return FALSE;
+    }
+    g_info ("%s: handed over %u connections", __func__, count);
+    return TRUE;
+}
+/*
+ * Connect to the handover socket of a running instance and ask it to hand
+ * over. Returns NULL if there's no instance to take over from.
+ */
+GSocket*
+handover_connect (const gchar *path)
+{
+    GSocket *socket;
+    GSocketAddress *address;
+    handover_header_t request;
+    GError *error = NULL;
+
+    if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+        return NULL;
+    }
+    socket = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                           G_SOCKET_TYPE_SEQPACKET,
+                           G_SOCKET_PROTOCOL_DEFAULT,
+                           &error);
+    if (socket == NULL) {
+        g_warning ("%s: failed to create socket: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        return NULL;
+    }
+    address = g_unix_socket_address_new (path);
+    if (!g_socket_connect (socket, address, NULL, &error)) {
+        g_info ("%s: no instance to take over from at %s: %s", __func__,
+                path, error->message);
+        g_error_free (error);
+        g_object_unref (address);
+        g_object_unref (socket);
+        return NULL;
+    }
+    g_object_unref (address);
+    g_socket_set_timeout (socket, HANDOVER_TIMEOUT);
+    handover_header_init (&request, HANDOVER_REQUEST);
+    if (!handover_send_message (socket, &request, sizeof (request), -1)) {
+        g_object_unref (socket);
+        return NULL;
+    }
+    return socket;
+}
+/*
+ * Create the Connection described by 'msg' around the socket 'fd' we've
+ * been passed. The Connection owns the fd, even on failure.
+ */
+static Connection*
+handover_connection_new (handover_connection_t *msg,
+                         gint                   fd,
+                         guint                  max_trans)
+{
+    GSocket *socket;
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    Connection *connection;
+    GError *error = NULL;
+
+    socket = g_socket_new_from_fd (fd, &error);
+    if (socket == NULL) {
+        g_warning ("%s: bad connection socket: %s", __func__, error->message);
+        g_error_free (error);
+        close (fd);
+        return NULL;
+    }
+    iostream = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+    g_object_unref (socket);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, max_trans);
+    handle_map->handle_count = msg->handle_count;
+    connection = connection_new (iostream, msg->id, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    g_object_set (connection,
+                  "priority", msg->priority <= TABRMD_PRIORITY_BATCH ?
+                                  msg->priority : TABRMD_PRIORITY_DEFAULT,
+                  NULL);
+    connection_set_pid (connection, msg->pid);
+    connection_set_uid (connection, msg->uid);
+    return connection;
+}
+static SessionEntry*
+handover_session_new (handover_session_t *msg,
+                      Connection         *connection)
+{
+    SessionEntry *entry;
+
+    if (msg->context.size > SIZE_BUF_MAX ||
+        msg->context_client.size > SIZE_BUF_MAX ||
+        msg->state == SESSION_ENTRY_LOADED ||
+        msg->state > SESSION_ENTRY_SAVED_CLIENT_CLOSED)
+    {
+        g_warning ("%s: bad session message", __func__);
+        return NULL;
+    }
+    entry = session_entry_new (connection, msg->handle);
+    if (msg->context_client.size > 0) {
+        session_entry_set_context_client (entry,
+                                          msg->context_client.buf,
+                                          msg->context_client.size);
+    }
+    if (msg->context.size > 0) {
+        session_entry_set_context (entry,
+                                   msg->context.buf,
+                                   msg->context.size);
+    }
+    session_entry_set_state (entry, msg->state);
+    return entry;
+}
+/*
+ * Receive the state sent by handover_send. The connections are inserted
+ * into 'manager' as they arrive. The sessions can't be added to a
+ * SessionList before there's a ResourceManager so they're returned in
+ * 'sessions' for the caller.
+ * Returns TRUE once the whole state has been received.
+ */
+gboolean
+handover_receive (GSocket           *socket,
+                  ConnectionManager *manager,
+                  guint              max_trans,
+                  GList            **sessions)
+{
+    handover_message_t msg;
+    Connection *connection = NULL;
+    HandleMap *handle_map;
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    gboolean done = FALSE, ret = FALSE;
+    gssize size;
+    gint fd;
+
+    while (!done) {
+        size = handover_receive_message (socket, &msg, &fd);
+        if (size < 0) {
+            break;
+        }
+        switch (msg.header.type) {
+        case HANDOVER_CONNECTION:
+            g_clear_object (&connection);
+            if (size != sizeof (msg.connection) || fd < 0) {
+                g_warning ("%s: bad connection message", __func__);
+                done = TRUE;
+                break;
+            }
+            connection = handover_connection_new (&msg.connection,
+                                                  fd,
+                                                  max_trans);
+            if (connection != NULL &&
+                connection_manager_insert (manager, connection) != 0)
+            {
+                g_warning ("%s: failed to add connection 0x%" PRIx64,
+                           __func__, msg.connection.id);
+                g_clear_object (&connection);
+            }
+            fd = -1;
+            break;
+        case HANDOVER_TRANSIENT:
+            if (size != sizeof (msg.transient)) {
+                g_warning ("%s: bad transient message", __func__);
+                done = TRUE;
+                break;
+            }
+            if (connection == NULL) {
+                break;
+            }
+            entry = handle_map_entry_new (0, msg.transient.vhandle);
+            *handle_map_entry_get_context (entry) = msg.transient.context;
+            handle_map_entry_set_context_saved (entry, TRUE);
+            handle_map = connection_get_trans_map (connection);
+            handle_map_insert (handle_map, msg.transient.vhandle, entry);
+            g_object_unref (handle_map);
+            g_object_unref (entry);
+            break;
+        case HANDOVER_SESSION:
+            if (size != sizeof (msg.session)) {
+                g_warning ("%s: bad session message", __func__);
+                done = TRUE;
+                break;
+            }
+            if (msg.session.state == SESSION_ENTRY_SAVED_CLIENT_CLOSED) {
+                session = handover_session_new (&msg.session, NULL);
+            } else if (connection != NULL) {
+                session = handover_session_new (&msg.session, connection);
+            } else {
+                break;
+            }
+            if (session != NULL) {
+                *sessions = g_list_append (*sessions, session);
+            }
+            break;
+        case HANDOVER_END:
+            ret = TRUE;
+            done = TRUE;
+            break;
+        default:
+            g_warning ("%s: unexpected handover message type %" PRIu32,
+                       __func__, msg.header.type);
+            done = TRUE;
+            break;
+        }
+        if (fd >= 0) {
+            close (fd);
+        }
+    }
+    g_clear_object (&connection);
+    return ret;
+}
+/*
+ * Wait for the instance we took over from to close the handover socket,
+ * it does so when it exits. Until then it may still have the TPM open.
+ */
+gboolean
+handover_wait_closed (GSocket *socket)
+{
+    gchar buf [sizeof (handover_message_t)];
+    GError *error = NULL;
+    gssize ret;
+
+    do {
+        ret = g_socket_receive (socket, buf, sizeof (buf), NULL, &error);
+    } while (ret > 0);
+    if (ret < 0) {
+        g_warning ("%s: instance we took over from didn't exit: %s",
+                   __func__, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "connection-manager.h"
+#include "session-entry.h"
+#include "session-list.h"
+
+G_BEGIN_DECLS
+
+#define SIZE_BUF_MAX sizeof (TPMS_CONTEXT)
+
+typedef struct size_buf {
+    size_t size;
+    uint8_t buf [SIZE_BUF_MAX];
+} size_buf_t;
+
+/*
+ * Messages exchanged over the handover socket when a new instance of the
+ * daemon takes over from a running one. The new instance connects and
+ * sends a HANDOVER_REQUEST. The running instance saves the state of the
+ * TPM and replies with, for each client connection:
+ * - a HANDOVER_CONNECTION message with the connection socket passed as
+ *   SCM_RIGHTS ancillary data
+ * - a HANDOVER_TRANSIENT message for each transient object it has loaded
+ * - a HANDOVER_SESSION message for each session it owns
+ * followed by a HANDOVER_SESSION message for each abandoned session and
+ * a final HANDOVER_END. It then releases the TPM and exits, which the new
+ * instance sees as the socket being closed. The socket is SOCK_SEQPACKET
+ * so each message is received whole with its fds, both ends are on the
+ * same host so the fields are in host byte order.
+ */
+#define HANDOVER_MAGIC   0x74616268
+#define HANDOVER_VERSION 2
+/* seconds either end waits for the other before giving up */
+#define HANDOVER_TIMEOUT 30
+
+typedef enum {
+    HANDOVER_REQUEST = 1,
+    HANDOVER_CONNECTION,
+    HANDOVER_TRANSIENT,
+    HANDOVER_SESSION,
+    HANDOVER_END,
+} handover_type_t;
+
+typedef struct {
+    guint32           magic;
+    guint32           version;
+    guint32           type;
+    guint32           reserved;
+} handover_header_t;
+
+/*
+ * 'handle_count' is the counter the HandleMap of the connection allocates
+ * virtual handles from so that handles given out after the handover don't
+ * collide with the ones the client already has. 'pid' and 'uid' are the
+ * client credentials the IpcFrontend got when the connection was created,
+ * the socket can't tell them to the new instance.
+ */
+typedef struct {
+    handover_header_t header;
+    guint64           id;
+    guint32           priority;
+    guint32           handle_count;
+    guint32           pid;
+    guint32           uid;
+} handover_connection_t;
+
+typedef struct {
+    handover_header_t header;
+    guint32           vhandle;
+    guint32           reserved;
+    TPMS_CONTEXT      context;
+} handover_transient_t;
+
+/*
+ * Sessions in state SESSION_ENTRY_SAVED_CLIENT_CLOSED are abandoned, all
+ * others belong to the connection sent last.
+ */
+typedef struct {
+    handover_header_t header;
+    guint32           handle;
+    guint32           state;
+    size_buf_t        context;
+    size_buf_t        context_client;
+} handover_session_t;
+
+GSocketService* handover_listen        (const gchar       *path);
+void            handover_unlisten      (GSocketService    *service,
+                                        const gchar       *path);
+gboolean        handover_check_request (GSocket           *socket);
+gboolean        handover_send          (GSocket           *socket,
+                                        ConnectionManager *manager,
+                                        SessionList       *session_list);
+GSocket*        handover_connect       (const gchar       *path);
+gboolean        handover_receive       (GSocket           *socket,
+                                        ConnectionManager *manager,
+                                        guint              max_trans,
+                                        GList            **sessions);
+gboolean        handover_wait_closed   (GSocket           *socket);
+
+G_END_DECLS
+#endif /* HANDOVER_H */
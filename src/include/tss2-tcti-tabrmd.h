@@ -11,10 +11,110 @@ extern "C" {
 #endif
 
 #include <tss2/tss2_tcti.h>
+#include <tss2/tss2_tpm2_types.h>
+
+/*
+ * Vendor specific command handled by the daemon instead of the TPM. The
+ * parameters are the handle of a transient object and a TPMI_YES_NO: YES
+ * pins the object resident in the TPM, NO unpins it. The command has no
+ * sessions and the response no parameters.
+ */
+#define TSS2_TABRMD_CC_PIN ((UINT32)0x20000101)
+/*
+ * Vendor specific command handled by the daemon: the UINT32 parameter is
+ * the number of commands the connection sends next as a group. The daemon
+ * runs them back to back without commands from other connections in
+ * between, so the objects and sessions of the connection are loaded once
+ * for the whole group. The command has no sessions and the response no
+ * parameters. See Tss2_Tcti_Tabrmd_BeginGroup.
+ */
+#define TSS2_TABRMD_CC_GROUP ((UINT32)0x20000102)
+/*
+ * Vendor specific command handled by the daemon: the UINT32 parameter is
+ * how many milliseconds the connection leases the TPM for, 0 ends the
+ * lease. Until the lease ends the daemon runs only the commands of the
+ * connection. The command has no sessions and the response no parameters.
+ * See Tss2_Tcti_Tabrmd_Lease.
+ */
+#define TSS2_TABRMD_CC_LEASE ((UINT32)0x20000103)
+/*
+ * Vendor specific command handled by the daemon: the parameters are a
+ * TPMI_ALG_HASH, a TPMI_RH_HIERARCHY and a UINT32 size followed by that
+ * many bytes of data, up to TSS2_TABRMD_HASH_MAX. The daemon hashes the
+ * data with a hash sequence run back to back on the TPM. The command has
+ * no sessions, the response parameters are those of TPM2_Hash: the
+ * TPM2B_DIGEST and the TPMT_TK_HASHCHECK. See Tss2_Tcti_Tabrmd_Hash.
+ */
+#define TSS2_TABRMD_CC_HASH ((UINT32)0x20000104)
+/* the most data the daemon takes in a command, its 8 KiB less the rest */
+#define TSS2_TABRMD_HASH_MAX (8192 - 20)
+/*
+ * Vendor specific commands handled by the daemon: the parameters are a
+ * TPMI_RH_NV_AUTH, a TPMI_RH_NV_INDEX, the TPM2B_AUTH password of the
+ * first, a UINT16 offset and a UINT16 size, up to TSS2_TABRMD_NV_MAX.
+ * The daemon reads or writes the data with NV_Read or NV_Write commands
+ * run back to back on the TPM, one for each TPM2_PT_NV_BUFFER_MAX bytes.
+ * The commands have no sessions. The data to write follows the size of
+ * TSS2_TABRMD_CC_NV_WRITE, the response of TSS2_TABRMD_CC_NV_READ has a
+ * UINT16 size followed by the data read. See Tss2_Tcti_Tabrmd_NvRead and
+ * Tss2_Tcti_Tabrmd_NvWrite.
+ */
+#define TSS2_TABRMD_CC_NV_READ ((UINT32)0x20000105)
+#define TSS2_TABRMD_CC_NV_WRITE ((UINT32)0x20000106)
+/* the most data the daemon takes in a command, its 8 KiB less the rest */
+#define TSS2_TABRMD_NV_MAX (8192 - 88)
+
+/*
+ * Called by Tss2_Tcti_Tabrmd_Dispatch for each complete response. The
+ * response is only valid during the call. The context is ready for the
+ * next transmit when this is called.
+ */
+typedef void (*TSS2_TCTI_TABRMD_RESPONSE_CB) (TSS2_TCTI_CONTEXT *context,
+                                              const uint8_t *response,
+                                              size_t size,
+                                              void *user_data);
 
 TSS2_RC Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
                                size_t *size,
                                const char *conf);
+TSS2_RC Tss2_Tcti_Tabrmd_SetPipelineDepth (TSS2_TCTI_CONTEXT *context,
+                                           size_t depth);
+TSS2_RC Tss2_Tcti_Tabrmd_GetResumeId (TSS2_TCTI_CONTEXT *context,
+                                      uint64_t *resume_id);
+TSS2_RC Tss2_Tcti_Tabrmd_Preopen (const char *conf,
+                                  size_t count);
+TSS2_RC Tss2_Tcti_Tabrmd_Prefork (const char *conf,
+                                  size_t count);
+void Tss2_Tcti_Tabrmd_PreforkDone (void);
+TSS2_RC Tss2_Tcti_Tabrmd_SetResponseCallback (TSS2_TCTI_CONTEXT *context,
+                                              TSS2_TCTI_TABRMD_RESPONSE_CB callback,
+                                              void *user_data);
+TSS2_RC Tss2_Tcti_Tabrmd_Dispatch (TSS2_TCTI_CONTEXT *context);
+TSS2_RC Tss2_Tcti_Tabrmd_BeginGroup (TSS2_TCTI_CONTEXT *context,
+                                     size_t count);
+TSS2_RC Tss2_Tcti_Tabrmd_Lease (TSS2_TCTI_CONTEXT *context,
+                                uint32_t lease_ms);
+TSS2_RC Tss2_Tcti_Tabrmd_Hash (TSS2_TCTI_CONTEXT *context,
+                               TPMI_ALG_HASH hash_alg,
+                               TPMI_RH_HIERARCHY hierarchy,
+                               const uint8_t *data,
+                               size_t size,
+                               TPM2B_DIGEST *digest,
+                               TPMT_TK_HASHCHECK *validation);
+TSS2_RC Tss2_Tcti_Tabrmd_NvRead (TSS2_TCTI_CONTEXT *context,
+                                 TPMI_RH_NV_AUTH auth_handle,
+                                 TPMI_RH_NV_INDEX nv_index,
+                                 const TPM2B_AUTH *auth,
+                                 uint16_t offset,
+                                 uint8_t *data,
+                                 size_t size);
+TSS2_RC Tss2_Tcti_Tabrmd_NvWrite (TSS2_TCTI_CONTEXT *context,
+                                  TPMI_RH_NV_AUTH auth_handle,
+                                  TPMI_RH_NV_INDEX nv_index,
+                                  const TPM2B_AUTH *auth,
+                                  uint16_t offset,
+                                  const uint8_t *data,
+                                  size_t size);
 
 #ifdef __cplusplus
 }
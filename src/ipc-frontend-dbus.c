@@ -6,6 +6,8 @@
 
 #include <gio/gunixfdlist.h>
 #include <inttypes.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "ipc-frontend-dbus.h"
 #include "tabrmd-defaults.h"
@@ -20,6 +22,7 @@ typedef enum {
     TABRMD_ERROR_ID_GENERATION    = TSS2_RESMGR_RC_GENERAL_FAILURE,
     TABRMD_ERROR_NOT_IMPLEMENTED  = TSS2_RESMGR_RC_NOT_IMPLEMENTED,
     TABRMD_ERROR_NOT_PERMITTED    = TSS2_RESMGR_RC_NOT_PERMITTED,
+    TABRMD_ERROR_BAD_VALUE        = TSS2_RESMGR_RC_BAD_VALUE,
 } TabrmdErrorEnum;
 
 enum {
@@ -29,9 +32,69 @@ enum {
     PROP_CONNECTION_MANAGER,
     PROP_MAX_TRANS,
     PROP_RANDOM,
+    PROP_MAX_WAITING,
+    PROP_WAITING_TIMEOUT,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
+/*
+ * A CreateConnection call waiting for a connection to be removed from the
+ * ConnectionManager. The 'timeout' is the GSource that fails the call if
+ * it has waited too long.
+ */
+typedef struct {
+    IpcFrontendDbus       *self;
+    GDBusMethodInvocation *invocation;
+    guint32                pid;
+    guint32                uid;
+    guint                  priority;
+    guint                  flags;
+    guint64                resume_id;
+    GSource               *timeout;
+} waiting_entry_t;
+/*
+ * The arguments of a method call that are needed once the PID of the
+ * caller is known. Only the ones for the method called are set.
+ */
+typedef struct {
+    guint                  priority;
+    guint                  flags;
+    gint64                 id;
+    guint8                 locality;
+    guint                  count;
+} method_args_t;
+/*
+ * The credentials of a caller kept in the PID cache. The 'uid' is
+ * RATE_LIMITER_UID_NONE if the bus daemon didn't tell us.
+ */
+typedef struct {
+    guint32                pid;
+    guint32                uid;
+} client_creds_t;
+/*
+ * Continuation of a method call once the PID and UID of the caller are
+ * known.
+ */
+typedef void (*PidReadyFunc) (IpcFrontendDbus       *self,
+                              GDBusMethodInvocation *invocation,
+                              guint32                pid,
+                              guint32                uid,
+                              const method_args_t   *args);
+/*
+ * A GetConnectionCredentials call to the bus daemon in flight. It holds
+ * a reference to the IpcFrontendDbus until the reply comes back.
+ */
+typedef struct {
+    IpcFrontendDbus       *self;
+    GDBusMethodInvocation *invocation;
+    gchar                 *sender;
+    PidReadyFunc           func;
+    method_args_t          args;
+} pid_lookup_t;
+
+static void on_connection_removed (ConnectionManager *connection_manager,
+                                   Connection        *connection,
+                                   gpointer           user_data);
 
 static void
 ipc_frontend_dbus_set_property (GObject      *object,
@@ -52,14 +115,27 @@ ipc_frontend_dbus_set_property (GObject      *object,
     case PROP_CONNECTION_MANAGER:
         self->connection_manager = g_value_get_object (value);
         g_object_ref (self->connection_manager);
+        g_signal_connect (self->connection_manager,
+                          "connection-removed",
+                          G_CALLBACK (on_connection_removed),
+                          self);
         break;
     case PROP_MAX_TRANS:
-        self->max_transient_objects = g_value_get_uint (value);
+        g_atomic_int_set (&self->max_transient_objects,
+                          g_value_get_uint (value));
         break;
     case PROP_RANDOM:
         self->random = g_value_get_object (value);
         g_object_ref (self->random);
         break;
+    case PROP_MAX_WAITING:
+        self->max_waiting = g_value_get_uint (value);
+        g_debug ("%s: max-waiting: %u", __func__, self->max_waiting);
+        break;
+    case PROP_WAITING_TIMEOUT:
+        self->waiting_timeout = g_value_get_uint (value);
+        g_debug ("%s: waiting-timeout: %u", __func__, self->waiting_timeout);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -89,6 +165,12 @@ ipc_frontend_dbus_get_property (GObject    *object,
     case PROP_RANDOM:
         g_value_set_object (value, self->random);
         break;
+    case PROP_MAX_WAITING:
+        g_value_set_uint (value, self->max_waiting);
+        break;
+    case PROP_WAITING_TIMEOUT:
+        g_value_set_uint (value, self->waiting_timeout);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -98,16 +180,38 @@ static void
 ipc_frontend_dbus_init (IpcFrontendDbus *self)
 {
     self->dbus_name_acquired = FALSE;
+    g_queue_init (&self->waiting);
+    self->pid_cache = g_hash_table_new_full (g_str_hash,
+                                             g_str_equal,
+                                             g_free,
+                                             g_free);
 }
 /*
  * Dispose method where where we free up references to other objects.
+ * CreateConnection calls still waiting for a connection are failed.
  */
 static void
 ipc_frontend_dbus_dispose (GObject *obj)
 {
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (obj);
+    waiting_entry_t *entry;
 
+    while ((entry = g_queue_pop_head (&self->waiting)) != NULL) {
+        g_source_destroy (entry->timeout);
+        g_dbus_method_invocation_return_error (entry->invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_MAX_CONNECTIONS,
+                                               "Daemon shutting down.");
+        g_free (entry);
+    }
+    if (self->connection_manager != NULL) {
+        g_signal_handlers_disconnect_by_data (self->connection_manager, self);
+    }
     g_clear_object (&self->connection_manager);
+    if (self->dbus_daemon_proxy != NULL) {
+        g_signal_handlers_disconnect_by_data (self->dbus_daemon_proxy, self);
+    }
+    g_clear_object (&self->dbus_daemon_proxy);
     g_clear_object (&self->random);
     g_clear_object (&self->skeleton);
     G_OBJECT_CLASS (ipc_frontend_dbus_parent_class)->dispose (obj);
@@ -121,6 +225,9 @@ ipc_frontend_dbus_finalize (GObject *obj)
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (obj);
 
     g_clear_pointer (&self->bus_name, g_free);
+    g_clear_pointer (&self->pid_cache, g_hash_table_unref);
+    g_clear_pointer (&self->main_loop, g_main_loop_unref);
+    g_clear_pointer (&self->main_context, g_main_context_unref);
     G_OBJECT_CLASS (ipc_frontend_dbus_parent_class)->finalize (obj);
 }
 
@@ -167,13 +274,29 @@ ipc_frontend_dbus_class_init (IpcFrontendDbusClass *klass)
                           1,
                           TABRMD_TRANSIENT_MAX,
                           TABRMD_TRANSIENT_MAX_DEFAULT,
-                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
     obj_properties [PROP_RANDOM] =
         g_param_spec_object ("random",
                              "Random object",
                              "Source of random numbers.",
                              TYPE_RANDOM,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_WAITING] =
+        g_param_spec_uint ("max-waiting",
+                           "maximum waiting calls",
+                           "maximum number of CreateConnection calls waiting for a connection to close",
+                           0,
+                           TABRMD_WAITING_MAX,
+                           TABRMD_WAITING_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_WAITING_TIMEOUT] =
+        g_param_spec_uint ("waiting-timeout",
+                           "waiting timeout",
+                           "milliseconds a CreateConnection call may wait for a connection to close",
+                           1,
+                           TABRMD_WAITING_TIMEOUT_MAX,
+                           TABRMD_WAITING_TIMEOUT_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -199,153 +322,353 @@ ipc_frontend_dbus_new (GBusType           bus_type,
 }
 /* TabrmdSkeleton signal handlers */
 /*
- * Give this function a dbus proxy and invocation object from a method
- * invocation and it will get the PID of the process associated with the
- * invocation. If an error occurs this function returns false.
+ * Remember the PID and UID of the process behind the unique bus name
+ * 'sender'.
+ * Unique names are never reused by the bus daemon so an entry can't go
+ * stale, it's dropped when the name goes away (see on_dbus_daemon_signal).
+ * The cache is bounded: if it's full it's emptied before the new entry
+ * is added.
  */
-static gboolean
-get_pid_from_dbus_invocation (GDBusProxy            *proxy,
-                              GDBusMethodInvocation *invocation,
-                              guint32               *pid)
-{
-    const gchar *name   = NULL;
-    GError      *error  = NULL;
-    GVariant    *result = NULL;
-
-    if (proxy == NULL || invocation == NULL || pid == NULL)
-        return FALSE;
-
-    name = g_dbus_method_invocation_get_sender (invocation);
-    result = g_dbus_proxy_call_sync (G_DBUS_PROXY (proxy),
-                                     "GetConnectionUnixProcessID",
-                                     g_variant_new("(s)", name),
-                                     G_DBUS_CALL_FLAGS_NONE,
-                                     -1,
-                                     NULL,
-                                     &error);
-    if (error) {
-        g_warning ("Unable to get PID for %s: %s", name, error->message);
+static void
+pid_cache_insert (IpcFrontendDbus *self,
+                  const gchar     *sender,
+                  guint32          pid,
+                  guint32          uid)
+{
+    client_creds_t *creds;
+
+    if (g_hash_table_size (self->pid_cache) >= IPC_FRONTEND_DBUS_PID_CACHE_MAX) {
+        g_debug ("%s: PID cache full, flushing", __func__);
+        g_hash_table_remove_all (self->pid_cache);
+    }
+    creds = g_new0 (client_creds_t, 1);
+    creds->pid = pid;
+    creds->uid = uid;
+    g_hash_table_insert (self->pid_cache, g_strdup (sender), creds);
+}
+/*
+ * Callback for the GetConnectionCredentials call made by
+ * lookup_pid_from_invocation. The credentials are cached and the method
+ * call continued, or failed if the bus daemon couldn't tell us the PID.
+ * A bus daemon that doesn't give the UID leaves the client unlimited by
+ * the RateLimiter.
+ */
+static void
+on_get_pid_ready (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+    pid_lookup_t *lookup = (pid_lookup_t*)user_data;
+    GError *error = NULL;
+    GVariant *result, *creds = NULL;
+    guint32 pid = 0, uid = RATE_LIMITER_UID_NONE;
+
+    result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object),
+                                       res,
+                                       &error);
+    if (result != NULL) {
+        creds = g_variant_get_child_value (result, 0);
+        g_variant_unref (result);
+        if (!g_variant_lookup (creds, "ProcessID", "u", &pid)) {
+            g_variant_unref (creds);
+            creds = NULL;
+            g_set_error_literal (&error,
+                                 TABRMD_ERROR,
+                                 TABRMD_ERROR_INTERNAL,
+                                 "no ProcessID in credentials");
+        }
+    }
+    if (creds == NULL) {
+        g_warning ("Unable to get PID for %s: %s", lookup->sender,
+                   error->message);
         g_error_free (error);
-        return FALSE;
+        g_dbus_method_invocation_return_error (lookup->invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_INTERNAL,
+                                               "Failed to get client PID");
     } else {
-        g_variant_get (result, "(u)", pid);
-        g_variant_unref (result);
-        return TRUE;
+        g_variant_lookup (creds, "UnixUserID", "u", &uid);
+        g_variant_unref (creds);
+        pid_cache_insert (lookup->self, lookup->sender, pid, uid);
+        lookup->func (lookup->self,
+                      lookup->invocation,
+                      pid,
+                      uid,
+                      &lookup->args);
     }
+    g_object_unref (lookup->self);
+    g_free (lookup->sender);
+    g_free (lookup);
 }
 /*
- * Generate a random uint64 returned in the id out parameter.
- * Mix this random ID with the PID from the caller. This is obtained
- * through the invocation parameter. Mix the two together using xor and
- * return the result through the id_pid_mix out parameter.
- * NOTE: if an error occurs then a response is sent through the invocation
- * to the client and FALSE is returned to the caller.
- *
- * Returns FALSE on error, TRUE otherwise.
+ * Get the PID and UID of the process that made the method call in
+ * 'invocation' and pass them to 'func' along with the arguments of the
+ * call. Senders we've seen before are answered from the cache. Otherwise
+ * the bus daemon is asked without blocking the main loop, other method
+ * calls are handled while we wait for its reply. If the PID can't be had an error is
+ * returned to the caller through the invocation and 'func' isn't called.
  */
-static gboolean
-generate_id_pid_mix_from_invocation (IpcFrontendDbus        *self,
-                                     GDBusMethodInvocation  *invocation,
-                                     guint64                *id,
-                                     guint64                *id_pid_mix)
-{
-    gboolean pid_ret = FALSE;
-    guint32  pid = 0;
-
-    pid_ret = get_pid_from_dbus_invocation (self->dbus_daemon_proxy,
-                                            invocation,
-                                            &pid);
-    if (pid_ret == TRUE) {
-        *id = random_get_uint64 (self->random);
-        *id_pid_mix = *id ^ pid;
-    } else {
+static void
+lookup_pid_from_invocation (IpcFrontendDbus       *self,
+                            GDBusMethodInvocation *invocation,
+                            PidReadyFunc           func,
+                            const method_args_t   *args)
+{
+    const gchar *sender;
+    pid_lookup_t *lookup;
+    client_creds_t *creds;
+
+    sender = g_dbus_method_invocation_get_sender (invocation);
+    if (self->dbus_daemon_proxy == NULL || sender == NULL) {
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
                                                TABRMD_ERROR_INTERNAL,
                                                "Failed to get client PID");
+        return;
+    }
+    creds = g_hash_table_lookup (self->pid_cache, sender);
+    if (creds != NULL) {
+        func (self, invocation, creds->pid, creds->uid, args);
+        return;
+    }
+    lookup = g_new0 (pid_lookup_t, 1);
+    lookup->self = g_object_ref (self);
+    lookup->invocation = invocation;
+    lookup->sender = g_strdup (sender);
+    lookup->func = func;
+    lookup->args = *args;
+    g_dbus_proxy_call (self->dbus_daemon_proxy,
+                       "GetConnectionCredentials",
+                       g_variant_new ("(s)", sender),
+                       G_DBUS_CALL_FLAGS_NONE,
+                       -1,
+                       NULL,
+                       on_get_pid_ready,
+                       lookup);
+}
+/*
+ * Handler for the 'g-signal' signal from the proxy for the bus daemon.
+ * A unique name that loses its owner is gone for good so it's dropped
+ * from the PID cache.
+ */
+static void
+on_dbus_daemon_signal (GDBusProxy  *proxy,
+                       const gchar *sender_name,
+                       const gchar *signal_name,
+                       GVariant    *parameters,
+                       gpointer     user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    const gchar *name, *old_owner, *new_owner;
+    UNUSED_PARAM(proxy);
+    UNUSED_PARAM(sender_name);
+
+    if (g_strcmp0 (signal_name, "NameOwnerChanged") != 0 ||
+        !g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sss)")))
+    {
+        return;
     }
+    g_variant_get (parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+    if (new_owner [0] == '\0') {
+        g_hash_table_remove (self->pid_cache, name);
+    }
+}
+/*
+ * GSourceFunc invoked when a CreateConnection call has waited for
+ * 'waiting-timeout' milliseconds without a connection being removed. The
+ * call fails the same way it would have without a waiting queue.
+ */
+static gboolean
+waiting_timeout_callback (gpointer user_data)
+{
+    waiting_entry_t *entry = (waiting_entry_t*)user_data;
 
-    return pid_ret;
+    g_debug ("%s: CreateConnection call timed out waiting", __func__);
+    g_queue_remove (&entry->self->waiting, entry);
+    g_dbus_method_invocation_return_error (entry->invocation,
+                                           TABRMD_ERROR,
+                                           TABRMD_ERROR_MAX_CONNECTIONS,
+                                           "MAX_COMMANDS exceeded. Try again later.");
+    g_free (entry);
+
+    return G_SOURCE_REMOVE;
 }
 /*
- * Mix PID into provide id. Returns mixed value in id_pid_mix out parameter.
- * NOTE: if an error occurs then an error response is sent through the
- * invocation to the client and FALSE is returned to the caller
- *
- * Returns FALSE on error, TRUE otherwise.
+ * Attach 'source' to the GMainContext the D-Bus calls are handled on, the
+ * default one before we're connected. The source is returned without a
+ * reference of our own: it's valid until it's destroyed or its callback
+ * returns G_SOURCE_REMOVE.
+ */
+static GSource*
+ipc_frontend_dbus_attach (IpcFrontendDbus *self,
+                          GSource         *source,
+                          GSourceFunc      func,
+                          gpointer         user_data,
+                          GDestroyNotify   notify)
+{
+    g_source_set_callback (source, func, user_data, notify);
+    g_source_attach (source, self->main_context);
+    g_source_unref (source);
+    return source;
+}
+/*
+ * Put a CreateConnection call at the end of the waiting queue. The call is
+ * answered by create_connection once a connection has been removed or by
+ * waiting_timeout_callback. The invocation stays valid until one of them
+ * returns a value or an error through it.
+ */
+static void
+wait_for_connection (IpcFrontendDbus       *self,
+                     GDBusMethodInvocation *invocation,
+                     guint32                pid,
+                     guint32                uid,
+                     guint                  priority,
+                     guint                  flags,
+                     guint64                resume_id)
+{
+    waiting_entry_t *entry = g_new0 (waiting_entry_t, 1);
+    GSource *timeout;
+
+    entry->self = self;
+    entry->invocation = invocation;
+    entry->pid = pid;
+    entry->uid = uid;
+    entry->priority = priority;
+    entry->flags = flags;
+    entry->resume_id = resume_id;
+    timeout = g_timeout_source_new (self->waiting_timeout);
+    entry->timeout = ipc_frontend_dbus_attach (self,
+                                               timeout,
+                                               waiting_timeout_callback,
+                                               entry,
+                                               NULL);
+    g_queue_push_tail (&self->waiting, entry);
+    g_debug ("%s: %u CreateConnection calls waiting", __func__,
+             g_queue_get_length (&self->waiting));
+}
+static void create_connection (IpcFrontendDbus       *self,
+                               GDBusMethodInvocation *invocation,
+                               guint32                pid,
+                               guint32                uid,
+                               guint                  priority,
+                               guint                  flags,
+                               guint64                resume_id);
+/*
+ * GSourceFunc run from our GMainContext after a connection has been
+ * removed. Waiting CreateConnection calls are answered in the order they
+ * arrived for as long as there's room in the ConnectionManager.
  */
 static gboolean
-get_id_pid_mix_from_invocation (GDBusProxy            *proxy,
-                                GDBusMethodInvocation *invocation,
-                                guint64                id,
-                                guint64               *id_pid_mix)
-{
-    guint32 pid = 0;
-    gboolean pid_ret = FALSE;
-
-    g_debug ("get_id_pid_mix_from_invocation");
-    pid_ret = get_pid_from_dbus_invocation (proxy,
-                                            invocation,
-                                            &pid);
-    g_debug ("id 0x%" PRIx64 " pid: 0x%" PRIx32, id, pid);
-    if (pid_ret == TRUE) {
-        *id_pid_mix = id ^ pid;
-        g_debug ("mixed: 0x%" PRIx64, *id_pid_mix);
-    } else {
-        g_dbus_method_invocation_return_error (
-            invocation,
-            TABRMD_ERROR,
-            TABRMD_ERROR_INTERNAL,
-            "Failed to get client PID");
+serve_waiting_callback (gpointer user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    waiting_entry_t *entry;
+
+    while (self->connection_manager != NULL &&
+           !g_queue_is_empty (&self->waiting) &&
+           !connection_manager_is_full (self->connection_manager))
+    {
+        entry = g_queue_pop_head (&self->waiting);
+        g_source_destroy (entry->timeout);
+        create_connection (self,
+                           entry->invocation,
+                           entry->pid,
+                           entry->uid,
+                           entry->priority,
+                           entry->flags,
+                           entry->resume_id);
+        g_free (entry);
     }
 
-    return pid_ret;
+    return G_SOURCE_REMOVE;
+}
+/*
+ * Handler for the 'connection-removed' signal from the ConnectionManager.
+ * This is emitted from the thread removing the connection (the
+ * CommandSource) so the waiting queue is served from the GMainContext
+ * where the D-Bus method calls are handled.
+ */
+static void
+on_connection_removed (ConnectionManager *connection_manager,
+                       Connection        *connection,
+                       gpointer           user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    UNUSED_PARAM(connection_manager);
+    UNUSED_PARAM(connection);
+
+    ipc_frontend_dbus_attach (self,
+                              g_idle_source_new (),
+                              serve_waiting_callback,
+                              g_object_ref (self),
+                              g_object_unref);
 }
 /*
  * This is a signal handler for the handle-create-connection signal from
  * the DBus interface. This signal is triggered by a request from a client
  * to create a new connection with the daemon. This requires a few things
  * be done:
- * - Create a new ID (uint64) for the connection.
+ * - Create a new ID (uint64) for the connection and mix in the 'pid' of
+ *   the caller.
  * - Create a new Connection object.
  * - Build up a dbus response to the client with their connection ID and
  *   FD for the client side of the connection.
  * - Send the response message back to the client.
  * - Insert the new Connection object into the ConnectionManager.
+ * The new Connection is assigned the provided priority class. If the
+ * ConnectionManager is full the call waits for a connection to be removed
+ * as long as there's room in the waiting queue.
+ * A client at its quota of connections, see
+ * connection_manager_client_is_full, is refused without waiting.
+ * 'flags' are the connection flags the client asked for. Only the ones we
+ * support are granted, and they're returned to the client if it called
+ * CreateConnectionWithFlags or ResumeConnection. The Connection itself is
+ * built by ipc_frontend_connection_new.
+ * A 'resume_id' other than 0 is the id of a closed connection whose
+ * objects and sessions the new one takes over, see the 'resume' signal.
  */
-static gboolean
-on_handle_create_connection (TctiTabrmd            *skeleton,
-                             GDBusMethodInvocation *invocation,
-                             gpointer               user_data)
+static void
+create_connection (IpcFrontendDbus       *self,
+                   GDBusMethodInvocation *invocation,
+                   guint32                pid,
+                   guint32                uid,
+                   guint                  priority,
+                   guint                  flags,
+                   guint64                resume_id)
 {
-    IpcFrontendDbus *self = NULL;
-    HandleMap   *handle_map = NULL;
     Connection *connection = NULL;
-    gint client_fd = 0, ret = 0;
-    GIOStream *iostream;
-    GVariant *response, *response_tuple;
+    gint ret = 0;
+    GVariant *response [2], *response_tuple;
     GUnixFDList *fd_list = NULL;
     guint64 id = 0, id_pid_mix = 0;
-    gboolean id_ret = FALSE;
-    UNUSED_PARAM(skeleton);
 
-    self = IPC_FRONTEND_DBUS (user_data);
-    ipc_frontend_init_guard (IPC_FRONTEND (user_data));
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    /* waiting wouldn't help, only the client closing connections does */
+    if (connection_manager_client_is_full (self->connection_manager,
+                                           pid,
+                                           uid,
+                                           1))
+    {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_MAX_CONNECTIONS,
+                                               "Connection quota of the client exceeded.");
+        return;
+    }
     if (connection_manager_is_full (self->connection_manager)) {
+        if (g_queue_get_length (&self->waiting) < self->max_waiting) {
+            wait_for_connection (self, invocation, pid, uid, priority, flags,
+                                 resume_id);
+            return;
+        }
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
                                                TABRMD_ERROR_MAX_CONNECTIONS,
                                                "MAX_COMMANDS exceeded. Try again later.");
-        return TRUE;
-    }
-    id_ret = generate_id_pid_mix_from_invocation (self,
-                                                  invocation,
-                                                  &id,
-                                                  &id_pid_mix);
-    /* error already returned to caller over dbus */
-    if (id_ret == FALSE) {
-        return TRUE;
+        return;
     }
+    id = random_get_uint64 (self->random);
+    id_pid_mix = id ^ pid;
     g_debug ("Creating connection with id: 0x%" PRIx64, id_pid_mix);
     if (connection_manager_contains_id (self->connection_manager,
                                         id_pid_mix)) {
@@ -355,23 +678,27 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
             TABRMD_ERROR,
             TABRMD_ERROR_ID_GENERATION,
             "Failed to allocate connection ID. Try again later.");
-        return TRUE;
+        return;
     }
-    handle_map = handle_map_new (TPM2_HT_TRANSIENT, self->max_transient_objects);
-    if (handle_map == NULL)
-        g_error ("Failed to allocate new HandleMap");
-    iostream = create_connection_iostream (&client_fd);
-    connection = connection_new (iostream, id_pid_mix, handle_map);
-    g_object_unref (handle_map);
-    g_object_unref (iostream);
-    if (connection == NULL)
-        g_error ("Failed to allocate new connection.");
-    g_debug ("Created connection with client FD: %d and id: 0x%" PRIx64,
-             client_fd, id_pid_mix);
+    connection = ipc_frontend_connection_new (id_pid_mix,
+                                              pid,
+                                              uid,
+                                              g_atomic_int_get (&self->max_transient_objects),
+                                              priority,
+                                              &flags,
+                                              &fd_list);
+    connection_set_resume_id (connection, resume_id);
     /* prepare tuple variant for response message */
-    fd_list = g_unix_fd_list_new_from_array (&client_fd, 1);
-    response = g_variant_new_uint64 (id);
-    response_tuple = g_variant_new_tuple (&response, 1);
+    response [0] = g_variant_new_uint64 (id);
+    if (g_strcmp0 (g_dbus_method_invocation_get_method_name (invocation),
+                   TABRMD_DBUS_METHOD_CREATE_CONNECTION_WITH_FLAGS) == 0 ||
+        resume_id != 0)
+    {
+        response [1] = g_variant_new_uint32 (flags);
+        response_tuple = g_variant_new_tuple (response, 2);
+    } else {
+        response_tuple = g_variant_new_tuple (response, 1);
+    }
     /*
      * Issue the callback to notify subscribers that a new connection has
      * been created.
@@ -380,6 +707,14 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
     if (ret != 0) {
         g_warning ("Failed to add new connection to connection_manager.");
     }
+    /* before the client has the socket, so before any of its commands */
+    if (resume_id != 0 &&
+        ipc_frontend_resume_invoke (IPC_FRONTEND (self), connection) !=
+        TSS2_RC_SUCCESS)
+    {
+        g_info ("%s: connections can't be resumed, starting empty",
+                __func__);
+    }
     /* send response */
     g_dbus_method_invocation_return_value_with_unix_fd_list (
         invocation,
@@ -387,9 +722,344 @@ on_handle_create_connection (TctiTabrmd            *skeleton,
         fd_list);
     g_object_unref (fd_list);
     g_object_unref (connection);
+}
+/*
+ * PidReadyFunc continuing the CreateConnection methods.
+ */
+static void
+create_connection_pid_ready (IpcFrontendDbus       *self,
+                             GDBusMethodInvocation *invocation,
+                             guint32                pid,
+                             guint32                uid,
+                             const method_args_t   *args)
+{
+    create_connection (self,
+                       invocation,
+                       pid,
+                       uid,
+                       args->priority,
+                       args->flags,
+                       0);
+}
+/*
+ * Signal handler for the handle-create-connection signal. Connections
+ * created through this method get the default priority class.
+ */
+static gboolean
+on_handle_create_connection (TctiTabrmd            *skeleton,
+                             GDBusMethodInvocation *invocation,
+                             gpointer               user_data)
+{
+    method_args_t args = { .priority = TABRMD_PRIORITY_DEFAULT, };
+    UNUSED_PARAM(skeleton);
 
+    lookup_pid_from_invocation (IPC_FRONTEND_DBUS (user_data),
+                                invocation,
+                                create_connection_pid_ready,
+                                &args);
     return TRUE;
 }
+/*
+ * Signal handler for the handle-create-connection-with-priority signal.
+ * This is the same as CreateConnection but the client chooses the priority
+ * class used to schedule the commands it sends.
+ */
+static gboolean
+on_handle_create_connection_with_priority (TctiTabrmd            *skeleton,
+                                           GDBusMethodInvocation *invocation,
+                                           guint                  priority,
+                                           gpointer               user_data)
+{
+    method_args_t args = { .priority = priority, };
+    UNUSED_PARAM(skeleton);
+
+    if (priority > TABRMD_PRIORITY_BATCH) {
+        g_warning ("%s: invalid priority class: %u", __func__, priority);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_BAD_VALUE,
+                                               "Invalid priority class.");
+        return TRUE;
+    }
+    lookup_pid_from_invocation (IPC_FRONTEND_DBUS (user_data),
+                                invocation,
+                                create_connection_pid_ready,
+                                &args);
+    return TRUE;
+}
+/*
+ * Signal handler for the handle-create-connection-with-flags signal. This
+ * is the same as CreateConnectionWithPriority but the client may also ask
+ * for connection flags, like SOCK_SEQPACKET framing. The reply carries the
+ * flags that were granted so a client can fall back to what's available.
+ */
+static gboolean
+on_handle_create_connection_with_flags (TctiTabrmd            *skeleton,
+                                        GDBusMethodInvocation *invocation,
+                                        guint                  priority,
+                                        guint                  flags,
+                                        gpointer               user_data)
+{
+    method_args_t args = { .priority = priority, .flags = flags, };
+    UNUSED_PARAM(skeleton);
+
+    if (priority > TABRMD_PRIORITY_BATCH) {
+        g_warning ("%s: invalid priority class: %u", __func__, priority);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_BAD_VALUE,
+                                               "Invalid priority class.");
+        return TRUE;
+    }
+    lookup_pid_from_invocation (IPC_FRONTEND_DBUS (user_data),
+                                invocation,
+                                create_connection_pid_ready,
+                                &args);
+    return TRUE;
+}
+/*
+ * PidReadyFunc continuing the ResumeConnection method.
+ */
+static void
+resume_connection_pid_ready (IpcFrontendDbus       *self,
+                             GDBusMethodInvocation *invocation,
+                             guint32                pid,
+                             guint32                uid,
+                             const method_args_t   *args)
+{
+    create_connection (self,
+                       invocation,
+                       pid,
+                       uid,
+                       args->priority,
+                       args->flags,
+                       (guint64)args->id);
+}
+/*
+ * Signal handler for the handle-resume-connection signal. This is the
+ * same as CreateConnectionWithFlags but the new connection takes over the
+ * objects and sessions of the closed connection 'resume_id', the id and
+ * PID mix the daemon knew it by, if it was kept for the caller's user.
+ * The caller's PID doesn't have to be the one of the old connection, a
+ * restarted process resumes what the process before it had.
+ */
+static gboolean
+on_handle_resume_connection (TctiTabrmd            *skeleton,
+                             GDBusMethodInvocation *invocation,
+                             gint64                 resume_id,
+                             guint                  priority,
+                             guint                  flags,
+                             gpointer               user_data)
+{
+    method_args_t args = {
+        .priority = priority,
+        .flags = flags,
+        .id = resume_id,
+    };
+    UNUSED_PARAM(skeleton);
+
+    if (priority > TABRMD_PRIORITY_BATCH || resume_id == 0) {
+        g_warning ("%s: invalid priority class %u or resume id", __func__,
+                   priority);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_BAD_VALUE,
+                                               "Invalid priority class or "
+                                               "resume id.");
+        return TRUE;
+    }
+    lookup_pid_from_invocation (IPC_FRONTEND_DBUS (user_data),
+                                invocation,
+                                resume_connection_pid_ready,
+                                &args);
+    return TRUE;
+}
+/*
+ * PidReadyFunc continuing the CreateConnections method. All 'count'
+ * connections are created or none: the call doesn't wait in the queue
+ * for CreateConnection calls, it fails if the ConnectionManager doesn't
+ * have room for all of them. The reply carries the ids in the order of
+ * the sockets in the fd list. The shared memory transport takes 3 more
+ * fds per connection so it's never granted here.
+ */
+static void
+create_connections_pid_ready (IpcFrontendDbus       *self,
+                              GDBusMethodInvocation *invocation,
+                              guint32                pid,
+                              guint32                uid,
+                              const method_args_t   *args)
+{
+    Connection *connection;
+    GUnixFDList *fd_list, *conn_fd_list = NULL;
+    GVariantBuilder ids;
+    GError *error = NULL;
+    guint64 id, id_pid_mix;
+    guint flags = 0, i;
+    gint fd;
+
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (connection_manager_size (self->connection_manager) + args->count >
+        connection_manager_get_max (self->connection_manager))
+    {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_MAX_CONNECTIONS,
+                                               "MAX_CONNECTIONS exceeded. Try again later.");
+        return;
+    }
+    if (connection_manager_client_is_full (self->connection_manager,
+                                           pid,
+                                           uid,
+                                           args->count))
+    {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_MAX_CONNECTIONS,
+                                               "Connection quota of the client exceeded.");
+        return;
+    }
+    fd_list = g_unix_fd_list_new ();
+    g_variant_builder_init (&ids, G_VARIANT_TYPE ("at"));
+    i = 0;
+    while (i < args->count) {
+        id = random_get_uint64 (self->random);
+        id_pid_mix = id ^ pid;
+        if (connection_manager_contains_id (self->connection_manager,
+                                            id_pid_mix))
+        {
+            g_warning ("ID collision in ConnectionManager: %" PRIu64,
+                       id_pid_mix);
+            continue;
+        }
+        flags = args->flags & ~TABRMD_CONNECTION_FLAG_SHM_RING;
+        connection = ipc_frontend_connection_new (id_pid_mix,
+                                                  pid,
+                                                  uid,
+                                                  g_atomic_int_get (&self->max_transient_objects),
+                                                  args->priority,
+                                                  &flags,
+                                                  &conn_fd_list);
+        fd = g_unix_fd_list_get (conn_fd_list, 0, &error);
+        g_clear_object (&conn_fd_list);
+        if (fd == -1 || g_unix_fd_list_append (fd_list, fd, &error) == -1) {
+            /*
+             * The connections created so far go away once the client ends
+             * of their sockets are closed with 'fd_list'.
+             */
+            g_warning ("%s: failed to pass socket for connection: %s",
+                       __func__, error->message);
+            g_clear_error (&error);
+            if (fd != -1) {
+                close (fd);
+            }
+            g_object_unref (connection);
+            g_variant_builder_clear (&ids);
+            g_object_unref (fd_list);
+            g_dbus_method_invocation_return_error (invocation,
+                                                   TABRMD_ERROR,
+                                                   TABRMD_ERROR_INTERNAL,
+                                                   "Failed to create connections.");
+            return;
+        }
+        close (fd);
+        if (connection_manager_insert (self->connection_manager,
+                                       connection) != 0)
+        {
+            g_warning ("Failed to add new connection to connection_manager.");
+        }
+        g_variant_builder_add (&ids, "t", id);
+        g_object_unref (connection);
+        ++i;
+    }
+    g_debug ("%s: created %u connections", __func__, args->count);
+    g_dbus_method_invocation_return_value_with_unix_fd_list (
+        invocation,
+        g_variant_new ("(atu)", &ids, flags),
+        fd_list);
+    g_object_unref (fd_list);
+}
+/*
+ * Signal handler for the handle-create-connections signal. Clients that
+ * need many connections, like a pool of worker threads, get them in one
+ * round trip instead of one CreateConnectionWithFlags call each.
+ */
+static gboolean
+on_handle_create_connections (TctiTabrmd            *skeleton,
+                              GDBusMethodInvocation *invocation,
+                              guint                  count,
+                              guint                  priority,
+                              guint                  flags,
+                              gpointer               user_data)
+{
+    method_args_t args = {
+        .count = count,
+        .priority = priority,
+        .flags = flags,
+    };
+    UNUSED_PARAM(skeleton);
+
+    if (priority > TABRMD_PRIORITY_BATCH) {
+        g_warning ("%s: invalid priority class: %u", __func__, priority);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_BAD_VALUE,
+                                               "Invalid priority class.");
+        return TRUE;
+    }
+    if (count == 0 || count > TABRMD_CREATE_CONNECTIONS_MAX) {
+        g_warning ("%s: invalid connection count: %u", __func__, count);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_BAD_VALUE,
+                                               "Invalid connection count.");
+        return TRUE;
+    }
+    lookup_pid_from_invocation (IPC_FRONTEND_DBUS (user_data),
+                                invocation,
+                                create_connections_pid_ready,
+                                &args);
+    return TRUE;
+}
+/*
+ * PidReadyFunc continuing the Cancel method.
+ */
+static void
+cancel_pid_ready (IpcFrontendDbus       *self,
+                  GDBusMethodInvocation *invocation,
+                  guint32                pid,
+                  guint32                uid,
+                  const method_args_t   *args)
+{
+    Connection *connection = NULL;
+    guint64   id_pid_mix = args->id ^ pid;
+    TSS2_RC rc;
+    UNUSED_PARAM(uid);
+
+    connection = connection_manager_lookup_id (self->connection_manager,
+                                               id_pid_mix);
+    if (connection == NULL) {
+        g_warning ("no active connection for id_pid_mix: 0x%" PRIx64,
+                   id_pid_mix);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "No connection.");
+        return;
+    }
+    g_info ("%s: canceling command for connection with id_pid_mix: 0x%" PRIx64,
+            __func__, id_pid_mix);
+    /* cancel any existing commands for the connection */
+    rc = ipc_frontend_cancel_invoke (IPC_FRONTEND (self), connection);
+    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "Cancel function not implemented.");
+    } else {
+        tcti_tabrmd_complete_cancel (self->skeleton, invocation, rc);
+    }
+    g_object_unref (connection);
+}
 /*
  * This is a signal handler for the Cancel event emitted by the
  * Tpm2 AccessBroker. It is invoked by a signal generated by a user
@@ -412,43 +1082,111 @@ on_handle_cancel (TctiTabrmd            *skeleton,
                   gpointer               user_data)
 {
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
-    Connection *connection = NULL;
-    guint64   id_pid_mix = 0;
-    gboolean mix_ret = FALSE;
+    method_args_t args = { .id = id, };
     UNUSED_PARAM(skeleton);
 
     g_info ("on_handle_cancel for id 0x%" PRIx64, id);
     ipc_frontend_init_guard (IPC_FRONTEND (self));
-    mix_ret = get_id_pid_mix_from_invocation (self->dbus_daemon_proxy,
-                                              invocation,
-                                              id,
-                                              &id_pid_mix);
-    /* error already sent over dbus */
-    if (mix_ret == FALSE) {
-        return TRUE;
-    }
+    lookup_pid_from_invocation (self, invocation, cancel_pid_ready, &args);
+    return TRUE;
+}
+/*
+ * PidReadyFunc continuing the ResetConnection method.
+ */
+static void
+reset_connection_pid_ready (IpcFrontendDbus       *self,
+                            GDBusMethodInvocation *invocation,
+                            guint32                pid,
+                            guint32                uid,
+                            const method_args_t   *args)
+{
+    Connection *connection = NULL;
+    guint64   id_pid_mix = args->id ^ pid;
+    TSS2_RC rc;
+    UNUSED_PARAM(uid);
+
     connection = connection_manager_lookup_id (self->connection_manager,
                                                id_pid_mix);
     if (connection == NULL) {
-        g_warning ("no active connection for id_pid_mix: 0x%" PRIx64,
-                   id_pid_mix);
+        g_warning ("%s: no active connection for id_pid_mix: 0x%" PRIx64,
+                   __func__, id_pid_mix);
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
                                                TABRMD_ERROR_NOT_PERMITTED,
                                                "No connection.");
-        return TRUE;
+        return;
     }
-    g_info ("%s: canceling command for connection with id_pid_mix: 0x%" PRIx64,
+    g_info ("%s: resetting connection with id_pid_mix: 0x%" PRIx64,
             __func__, id_pid_mix);
-    /* cancel any existing commands for the connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "Cancel function not implemented.");
+    rc = ipc_frontend_reset_invoke (IPC_FRONTEND (self), connection);
+    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "ResetConnection function not implemented.");
+    } else {
+        tcti_tabrmd_complete_reset_connection (self->skeleton, invocation, rc);
+    }
     g_object_unref (connection);
+}
+/*
+ * This is a signal handler for the handle-reset-connection signal from
+ * the Tabrmd DBus interface. A client that kept a connection open after
+ * it was done with it (see the 'reuse' TCTI option) calls this before
+ * handing the connection to a new user in the same process. The PID lookup
+ * means only the process that created the connection can reset it.
+ */
+static gboolean
+on_handle_reset_connection (TctiTabrmd            *skeleton,
+                            GDBusMethodInvocation *invocation,
+                            gint64                 id,
+                            gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    method_args_t args = { .id = id, };
+    UNUSED_PARAM(skeleton);
 
+    g_info ("on_handle_reset_connection for id 0x%" PRIx64, id);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    lookup_pid_from_invocation (self,
+                                invocation,
+                                reset_connection_pid_ready,
+                                &args);
     return TRUE;
 }
+/*
+ * PidReadyFunc continuing the SetLocality method.
+ */
+static void
+set_locality_pid_ready (IpcFrontendDbus       *self,
+                        GDBusMethodInvocation *invocation,
+                        guint32                pid,
+                        guint32                uid,
+                        const method_args_t   *args)
+{
+    Connection *connection = NULL;
+    guint64   id_pid_mix = args->id ^ pid;
+    UNUSED_PARAM(uid);
+
+    connection = connection_manager_lookup_id (self->connection_manager,
+                                               id_pid_mix);
+    if (connection == NULL) {
+        g_warning ("%s: no active connection for id", __func__);
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_PERMITTED,
+                                               "No connection.");
+        return;
+    }
+    /* the commands already queued are sent at the new locality too */
+    g_info ("%s: locality %" PRIu8 " for connection with id_pid_mix: 0x%"
+            PRIx64, __func__, args->locality, id_pid_mix);
+    connection_set_locality (connection, args->locality);
+    tcti_tabrmd_complete_set_locality (self->skeleton,
+                                       invocation,
+                                       TSS2_RC_SUCCESS);
+    g_object_unref (connection);
+}
 /*
  * This is a signal handler for the handle-set-locality signal from the
  * Tabrmd DBus interface. This signal is triggered by a request
@@ -466,38 +1204,214 @@ on_handle_set_locality (TctiTabrmd            *skeleton,
                         gpointer               user_data)
 {
     IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
-    Connection *connection = NULL;
-    guint64   id_pid_mix = 0;
-    gboolean mix_ret = FALSE;
+    method_args_t args = { .id = id, .locality = locality, };
     UNUSED_PARAM(skeleton);
 
     g_info ("on_handle_set_locality for id 0x%" PRIx64, id);
     ipc_frontend_init_guard (IPC_FRONTEND (self));
-    mix_ret = get_id_pid_mix_from_invocation (self->dbus_daemon_proxy,
-                                              invocation,
-                                              id,
-                                              &id_pid_mix);
-    /* error already sent over dbus */
-    if (mix_ret == FALSE) {
+    lookup_pid_from_invocation (self,
+                                invocation,
+                                set_locality_pid_ready,
+                                &args);
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-get-statistics signal from the
+ * Tabrmd DBus interface. The statistics are the latency histograms the
+ * daemon keeps for each TPM and command code, one entry per phase of
+ * the processing of a command:
+ * (backend, command code, phase, count, total us, buckets)
+ * See command-stats.h for the phases and the bucket boundaries. They say
+ * nothing about the connections so any caller may have them.
+ */
+static gboolean
+on_handle_get_statistics (TctiTabrmd            *skeleton,
+                          GDBusMethodInvocation *invocation,
+                          gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariant *statistics;
+
+    g_info ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    statistics = ipc_frontend_get_statistics_invoke (IPC_FRONTEND (self));
+    if (statistics == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "GetStatistics function not implemented.");
         return TRUE;
     }
-    connection = connection_manager_lookup_id (self->connection_manager,
-                                               id_pid_mix);
-    if (connection == NULL) {
-        g_warning ("%s: no active connection for id", __func__);
+    tcti_tabrmd_complete_get_statistics (skeleton, invocation, statistics);
+    g_variant_unref (statistics);
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-get-flight-records signal from
+ * the Tabrmd DBus interface. The records are the last commands each TPM
+ * processed, oldest first:
+ * (backend, time, connection, command code, handles, phase us, rc)
+ * See flight-recorder.h. Connections are identified by their serial.
+ */
+static gboolean
+on_handle_get_flight_records (TctiTabrmd            *skeleton,
+                              GDBusMethodInvocation *invocation,
+                              gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariant *records;
+
+    g_info ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    records = ipc_frontend_get_flight_records_invoke (IPC_FRONTEND (self));
+    if (records == NULL) {
         g_dbus_method_invocation_return_error (invocation,
                                                TABRMD_ERROR,
-                                               TABRMD_ERROR_NOT_PERMITTED,
-                                               "No connection.");
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "GetFlightRecords function not implemented.");
         return TRUE;
     }
-    /* set locality for an existing connection */
-    g_dbus_method_invocation_return_error (invocation,
-                                           TABRMD_ERROR,
-                                           TABRMD_ERROR_NOT_IMPLEMENTED,
-                                           "setLocality function not implemented.");
-    g_object_unref (connection);
+    tcti_tabrmd_complete_get_flight_records (skeleton, invocation, records);
+    g_variant_unref (records);
+    return TRUE;
+}
+/*
+ * Build the reply to the GetConnections method: one
+ * (serial, pid, commands, bytes in, bytes out, exec us, transients,
+ * sessions) tuple for each connection in the ConnectionManager. The
+ * serial is what the metrics label connections with, the id the client
+ * got stays a secret.
+ */
+GVariant*
+ipc_frontend_dbus_build_connections (IpcFrontendDbus *self)
+{
+    GVariantBuilder builder;
+    GList *connections, *entry;
+    connection_usage_t usage;
 
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (CONNECTION_USAGE_VARIANT_TYPE));
+    connections = connection_manager_get_connections (self->connection_manager);
+    for (entry = connections; entry != NULL; entry = entry->next) {
+        connection_get_usage (CONNECTION (entry->data), &usage);
+        g_variant_builder_add (&builder,
+                               "(uuttttuu)",
+                               usage.serial,
+                               usage.pid,
+                               usage.commands,
+                               usage.bytes_in,
+                               usage.bytes_out,
+                               usage.exec_us,
+                               usage.transients,
+                               usage.sessions);
+    }
+    g_list_free_full (connections, g_object_unref);
+    return g_variant_builder_end (&builder);
+}
+/*
+ * This is a signal handler for the handle-get-connections signal from the
+ * Tabrmd DBus interface. It reports what each connected client has used
+ * the TPM for so that an administrator can find the one hogging it.
+ */
+static gboolean
+on_handle_get_connections (TctiTabrmd            *skeleton,
+                           GDBusMethodInvocation *invocation,
+                           gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+
+    g_info ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    tcti_tabrmd_complete_get_connections (skeleton,
+                                          invocation,
+                                          ipc_frontend_dbus_build_connections (self));
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-set-limit signal from the
+ * Tabrmd DBus interface. It changes one of the limits set on the command
+ * line (the 'name' of the option without the dashes) while the daemon
+ * runs, so tuning it doesn't cost the contexts of every client. The bus
+ * policy only lets root call it.
+ */
+static gboolean
+on_handle_set_limit (TctiTabrmd            *skeleton,
+                     GDBusMethodInvocation *invocation,
+                     const gchar           *name,
+                     guint                  value,
+                     gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    TSS2_RC rc;
+
+    g_info ("%s: %s = %u", __func__, name, value);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    rc = ipc_frontend_set_limit_invoke (IPC_FRONTEND (self), name, value);
+    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "SetLimit function not implemented.");
+        return TRUE;
+    }
+    tcti_tabrmd_complete_set_limit (skeleton, invocation, rc);
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-get-calibration signal from the
+ * Tabrmd DBus interface. The reports are what calibrating each TPM
+ * measured, see tpm2_calibrate:
+ * (backend, time, rc, manufacturer, firmware, session context size,
+ *  object context size, us for each operation)
+ * A TPM that wasn't calibrated has a time of 0.
+ */
+static gboolean
+on_handle_get_calibration (TctiTabrmd            *skeleton,
+                           GDBusMethodInvocation *invocation,
+                           gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    GVariant *reports;
+
+    g_info ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    reports = ipc_frontend_get_calibration_invoke (IPC_FRONTEND (self));
+    if (reports == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "GetCalibration function not implemented.");
+        return TRUE;
+    }
+    tcti_tabrmd_complete_get_calibration (skeleton, invocation, reports);
+    g_variant_unref (reports);
+    return TRUE;
+}
+/*
+ * This is a signal handler for the handle-calibrate signal from the
+ * Tabrmd DBus interface. Each TPM is calibrated again between commands,
+ * the reply doesn't wait for it: GetCalibration has the results once the
+ * time in its reports changes. The bus policy only lets root call it.
+ */
+static gboolean
+on_handle_calibrate (TctiTabrmd            *skeleton,
+                     GDBusMethodInvocation *invocation,
+                     gpointer               user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+    TSS2_RC rc;
+
+    g_info ("%s", __func__);
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    rc = ipc_frontend_calibrate_invoke (IPC_FRONTEND (self));
+    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               TABRMD_ERROR,
+                                               TABRMD_ERROR_NOT_IMPLEMENTED,
+                                               "Calibrate function not implemented.");
+        return TRUE;
+    }
+    tcti_tabrmd_complete_calibrate (skeleton, invocation, rc);
     return TRUE;
 }
 /* D-Bus signal handlers */
@@ -521,8 +1435,9 @@ on_bus_acquired (GDBusConnection *connection,
  * 'name' is acquired on the requested bus. It does 3 things:
  * - Obtains a new TctiTabrmd instance and stores a reference in
  *   the 'user_data' parameter (which is a reference to the gmain_data_t.
- * - Register signal handlers for the CreateConnection, Cancel and
- *   SetLocality signals.
+ * - Register signal handlers for the CreateConnection, Cancel,
+ *   ResetConnection, ResumeConnection, SetLocality, GetStatistics,
+ *   GetConnections, GetFlightRecords and SetLimit signals.
  * - Export the TctiTabrmd interface (skeleton) on the DBus
  *   connection.
  */
@@ -545,14 +1460,58 @@ on_name_acquired (GDBusConnection *connection,
                       "handle-create-connection",
                       G_CALLBACK (on_handle_create_connection),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-with-priority",
+                      G_CALLBACK (on_handle_create_connection_with_priority),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connection-with-flags",
+                      G_CALLBACK (on_handle_create_connection_with_flags),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-create-connections",
+                      G_CALLBACK (on_handle_create_connections),
+                      user_data);
     g_signal_connect (self->skeleton,
                       "handle-cancel",
                       G_CALLBACK (on_handle_cancel),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-reset-connection",
+                      G_CALLBACK (on_handle_reset_connection),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-resume-connection",
+                      G_CALLBACK (on_handle_resume_connection),
+                      user_data);
     g_signal_connect (self->skeleton,
                       "handle-set-locality",
                       G_CALLBACK (on_handle_set_locality),
                       user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-statistics",
+                      G_CALLBACK (on_handle_get_statistics),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-connections",
+                      G_CALLBACK (on_handle_get_connections),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-flight-records",
+                      G_CALLBACK (on_handle_get_flight_records),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-set-limit",
+                      G_CALLBACK (on_handle_set_limit),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-get-calibration",
+                      G_CALLBACK (on_handle_get_calibration),
+                      user_data);
+    g_signal_connect (self->skeleton,
+                      "handle-calibrate",
+                      G_CALLBACK (on_handle_calibrate),
+                      user_data);
     ret = g_dbus_interface_skeleton_export (
         G_DBUS_INTERFACE_SKELETON (self->skeleton),
         connection,
@@ -609,8 +1568,13 @@ on_get_dbus_daemon_proxy (GObject      *source_object,
                    "(org.freedesktop.DBus): %s", error->message);
         g_error_free (error);
         self->dbus_daemon_proxy = NULL;
+    } else {
+        g_debug ("Got proxy object for DBus daemon.");
+        g_signal_connect (self->dbus_daemon_proxy,
+                          "g-signal",
+                          G_CALLBACK (on_dbus_daemon_signal),
+                          self);
     }
-    g_debug ("Got proxy object for DBus daemon.");
 
     self->dbus_name_owner_id = g_bus_own_name (self->bus_type,
                                                self->bus_name,
@@ -621,6 +1585,33 @@ on_get_dbus_daemon_proxy (GObject      *source_object,
                                                self,
                                                NULL);
 }
+/*
+ * The thread handling the D-Bus calls. GDBus invokes the callbacks of
+ * asynchronous operations and the handlers of exported objects from the
+ * thread default GMainContext of the thread that set them up, so the
+ * proxy for the bus daemon is requested from here. Everything after that
+ * follows from its callback.
+ */
+static gpointer
+ipc_frontend_dbus_thread (gpointer user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+
+    g_main_context_push_thread_default (self->main_context);
+    g_dbus_proxy_new_for_bus (self->bus_type,
+                              G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                              NULL,
+                              "org.freedesktop.DBus",
+                              "/org/freedesktop/DBus",
+                              "org.freedesktop.DBus",
+                              NULL,
+                              (GAsyncReadyCallback)on_get_dbus_daemon_proxy,
+                              self);
+    g_main_loop_run (self->main_loop);
+    g_main_context_pop_thread_default (self->main_context);
+    g_debug ("%s: done", __func__);
+    return NULL;
+}
 /*
  * This function overrides the ipc_frontend_connect function from the
  * IpcFrontend base class. It causes the IpcFrontendDbus object to connect
@@ -628,7 +1619,10 @@ on_get_dbus_daemon_proxy (GObject      *source_object,
  * provided in the same.
  * This function registers several callbacks with the GDbus machinery. A
  * reference to the IpcFrontendDbus parameter (self) is passed as data to
- * these callbacks.
+ * these callbacks. They're all run on a thread of our own with its own
+ * GMainContext: a storm of CreateConnection calls doesn't delay the
+ * sockets, signals and services on the default GMainContext, and the
+ * client connections are served by the CommandSource threads anyway.
  */
 void
 ipc_frontend_dbus_connect (IpcFrontendDbus *self,
@@ -636,26 +1630,50 @@ ipc_frontend_dbus_connect (IpcFrontendDbus *self,
 {
     IpcFrontend *frontend = IPC_FRONTEND (self);
     g_return_if_fail (IS_IPC_FRONTEND_DBUS (self));
+    g_return_if_fail (self->thread == NULL);
 
     frontend->init_mutex = init_mutex;
-    g_dbus_proxy_new_for_bus (self->bus_type,
-                              G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-                              NULL,
-                              "org.freedesktop.DBus",
-                              "/org/freedesktop/DBus",
-                              "org.freedesktop.DBus",
-                              NULL,
-                              (GAsyncReadyCallback)on_get_dbus_daemon_proxy,
-                              self);
+    if (self->main_context == NULL) {
+        self->main_context = g_main_context_new ();
+        self->main_loop = g_main_loop_new (self->main_context, FALSE);
+    }
+    self->thread = g_thread_new ("ipc-frontend-dbus",
+                                 ipc_frontend_dbus_thread,
+                                 self);
+}
+/*
+ * GSourceFunc giving up the bus name from the D-Bus thread, then stopping
+ * it.
+ */
+static gboolean
+disconnect_callback (gpointer user_data)
+{
+    IpcFrontendDbus *self = IPC_FRONTEND_DBUS (user_data);
+
+    if (self->dbus_name_owner_id != 0) {
+        g_bus_unown_name (self->dbus_name_owner_id);
+        self->dbus_name_owner_id = 0;
+    }
+    g_main_loop_quit (self->main_loop);
+    return G_SOURCE_REMOVE;
 }
 /*
  * This function overrides the ipc_frontend_disconnect function from the
  * IpcFrontend base class. When successfully disconnected this object will
- * emit the 'disconnected' signal.
+ * emit the 'disconnected' signal. No D-Bus call is handled once this
+ * returns.
  */
 void
 ipc_frontend_dbus_disconnect (IpcFrontendDbus *self)
 {
-    g_bus_unown_name (self->dbus_name_owner_id);
+    if (self->thread != NULL) {
+        ipc_frontend_dbus_attach (self,
+                                  g_idle_source_new (),
+                                  disconnect_callback,
+                                  self,
+                                  NULL);
+        g_thread_join (self->thread);
+        self->thread = NULL;
+    }
     IPC_FRONTEND (self)->init_mutex = NULL;
 }
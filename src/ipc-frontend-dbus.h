@@ -18,6 +18,8 @@ G_BEGIN_DECLS
 
 #define IPC_FRONTEND_DBUS_NAME_DEFAULT "com.intel.tss2.Tabrmd"
 #define IPC_FRONTEND_DBUS_TYPE_DEFAULT G_BUS_TYPE_SYSTEM
+/* callers whose PID we remember, see pid_cache_insert */
+#define IPC_FRONTEND_DBUS_PID_CACHE_MAX 256
 
 typedef struct _IpcFrontendDbusClass {
    IpcFrontendClass     parent;
@@ -37,6 +39,20 @@ typedef struct _IpcFrontendDbus
     GDBusProxy        *dbus_daemon_proxy;
     Random            *random;
     TctiTabrmd        *skeleton;
+    /* CreateConnection calls waiting for a free connection slot */
+    GQueue             waiting;
+    guint              max_waiting;
+    guint              waiting_timeout;
+    /* PIDs and UIDs of callers keyed by their unique bus name */
+    GHashTable        *pid_cache;
+    /*
+     * the D-Bus calls are handled on a thread of our own so they don't
+     * hold up the other users of the default GMainContext, NULL until
+     * connected
+     */
+    GMainContext      *main_context;
+    GMainLoop         *main_loop;
+    GThread           *thread;
 } IpcFrontendDbus;
 
 #define TYPE_IPC_FRONTEND_DBUS             (ipc_frontend_dbus_get_type       ())
@@ -55,6 +71,7 @@ IpcFrontendDbus* ipc_frontend_dbus_new        (GBusType           bus_type,
 void             ipc_frontend_dbus_connect    (IpcFrontendDbus   *self,
                                                GMutex            *init_mutex);
 void             ipc_frontend_dbus_disconnect (IpcFrontendDbus   *self);
+GVariant*        ipc_frontend_dbus_build_connections (IpcFrontendDbus *self);
 
 G_END_DECLS
 #endif /* IPC_FRONTEND_DBUS_H */
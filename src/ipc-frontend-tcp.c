@@ -0,0 +1,532 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gunixfdlist.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "ipc-frontend-tcp.h"
+#include "rate-limiter.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-tcp.h"
+#include "tabrmd.h"
+#include "util.h"
+
+G_DEFINE_TYPE (IpcFrontendTcp, ipc_frontend_tcp, TYPE_IPC_FRONTEND);
+
+enum {
+    PROP_0,
+    PROP_ADDRESS,
+    PROP_CERT_FILE,
+    PROP_KEY_FILE,
+    PROP_CA_FILE,
+    PROP_CONNECTION_MANAGER,
+    PROP_MAX_TRANS,
+    PROP_RANDOM,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
+
+static void
+ipc_frontend_tcp_set_property (GObject      *object,
+                               guint         property_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+    IpcFrontendTcp *self = IPC_FRONTEND_TCP (object);
+
+    switch (property_id) {
+    case PROP_ADDRESS:
+        self->address = g_value_dup_string (value);
+        g_debug ("IpcFrontendTcp set address: %s", self->address);
+        break;
+    case PROP_CERT_FILE:
+        self->cert_file = g_value_dup_string (value);
+        break;
+    case PROP_KEY_FILE:
+        self->key_file = g_value_dup_string (value);
+        break;
+    case PROP_CA_FILE:
+        self->ca_file = g_value_dup_string (value);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        self->connection_manager = g_value_get_object (value);
+        g_object_ref (self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        g_atomic_int_set (&self->max_transient_objects,
+                          g_value_get_uint (value));
+        break;
+    case PROP_RANDOM:
+        self->random = g_value_get_object (value);
+        g_object_ref (self->random);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_tcp_get_property (GObject    *object,
+                               guint       property_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+    IpcFrontendTcp *self = IPC_FRONTEND_TCP (object);
+
+    switch (property_id) {
+    case PROP_ADDRESS:
+        g_value_set_string (value, self->address);
+        break;
+    case PROP_CERT_FILE:
+        g_value_set_string (value, self->cert_file);
+        break;
+    case PROP_KEY_FILE:
+        g_value_set_string (value, self->key_file);
+        break;
+    case PROP_CA_FILE:
+        g_value_set_string (value, self->ca_file);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        g_value_set_object (value, self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        g_value_set_uint (value, self->max_transient_objects);
+        break;
+    case PROP_RANDOM:
+        g_value_set_object (value, self->random);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_tcp_init (IpcFrontendTcp *self)
+{
+    UNUSED_PARAM(self);
+}
+/*
+ * Dispose method where where we free up references to other objects.
+ */
+static void
+ipc_frontend_tcp_dispose (GObject *obj)
+{
+    IpcFrontendTcp *self = IPC_FRONTEND_TCP (obj);
+
+    if (self->service != NULL) {
+        ipc_frontend_tcp_disconnect (self);
+    }
+    g_clear_object (&self->connection_manager);
+    g_clear_object (&self->random);
+    g_clear_object (&self->certificate);
+    g_clear_object (&self->database);
+    G_OBJECT_CLASS (ipc_frontend_tcp_parent_class)->dispose (obj);
+}
+static void
+ipc_frontend_tcp_finalize (GObject *obj)
+{
+    IpcFrontendTcp *self = IPC_FRONTEND_TCP (obj);
+
+    g_clear_pointer (&self->address, g_free);
+    g_clear_pointer (&self->cert_file, g_free);
+    g_clear_pointer (&self->key_file, g_free);
+    g_clear_pointer (&self->ca_file, g_free);
+    G_OBJECT_CLASS (ipc_frontend_tcp_parent_class)->finalize (obj);
+}
+static void
+ipc_frontend_tcp_class_init (IpcFrontendTcpClass *klass)
+{
+    GObjectClass    *object_class      = G_OBJECT_CLASS (klass);
+    IpcFrontendClass *ipc_frontend_class = IPC_FRONTEND_CLASS (klass);
+
+    if (ipc_frontend_tcp_parent_class == NULL)
+        ipc_frontend_tcp_parent_class = g_type_class_peek_parent (klass);
+    /* GObject functions */
+    object_class->dispose      = ipc_frontend_tcp_dispose;
+    object_class->finalize     = ipc_frontend_tcp_finalize;
+    object_class->get_property = ipc_frontend_tcp_get_property;
+    object_class->set_property = ipc_frontend_tcp_set_property;
+    /* IpcFrontend functions */
+    ipc_frontend_class->connect    = (IpcFrontendConnect)ipc_frontend_tcp_connect;
+    ipc_frontend_class->disconnect = (IpcFrontendDisconnect)ipc_frontend_tcp_disconnect;
+    obj_properties [PROP_ADDRESS] =
+        g_param_spec_string ("address",
+                             "Address",
+                             "Host and port to listen on for TCP clients",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_CERT_FILE] =
+        g_param_spec_string ("cert-file",
+                             "Certificate file",
+                             "PEM file with the certificate of the daemon",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_KEY_FILE] =
+        g_param_spec_string ("key-file",
+                             "Key file",
+                             "PEM file with the private key of the daemon",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_CA_FILE] =
+        g_param_spec_string ("ca-file",
+                             "CA file",
+                             "PEM file with the CAs client certificates must "
+                             "be signed by",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_CONNECTION_MANAGER] =
+        g_param_spec_object ("connection-manager",
+                             "ConnectionManager object",
+                             "ConnectionManager object for connection",
+                             TYPE_CONNECTION_MANAGER,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_TRANS] =
+        g_param_spec_uint ("max-trans",
+                          "maximum transient objects",
+                          "maximum number of transient objects for the handle map",
+                          1,
+                          TABRMD_TRANSIENT_MAX,
+                          TABRMD_TRANSIENT_MAX_DEFAULT,
+                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_RANDOM] =
+        g_param_spec_object ("random",
+                             "Random object",
+                             "Source of random numbers.",
+                             TYPE_RANDOM,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+
+IpcFrontendTcp*
+ipc_frontend_tcp_new (gchar const       *address,
+                      gchar const       *cert_file,
+                      gchar const       *key_file,
+                      gchar const       *ca_file,
+                      ConnectionManager *connection_manager,
+                      guint              max_trans,
+                      Random            *random)
+{
+    GObject *object = NULL;
+
+    object = g_object_new (TYPE_IPC_FRONTEND_TCP,
+                           "address",            address,
+                           "cert-file",          cert_file,
+                           "key-file",           key_file,
+                           "ca-file",            ca_file,
+                           "connection-manager", connection_manager,
+                           "max-trans",          max_trans,
+                           "random",             random,
+                           NULL);
+    return IPC_FRONTEND_TCP (object);
+}
+/*
+ * Send the reply to a request over 'stream', in network byte order.
+ */
+static gboolean
+send_reply (GIOStream           *stream,
+            tabrmd_unix_reply_t *reply)
+{
+    tabrmd_unix_reply_t reply_be = {
+        .rc = GUINT32_TO_BE (reply->rc),
+        .flags = GUINT32_TO_BE (reply->flags),
+        .id = GUINT64_TO_BE (reply->id),
+    };
+    GError *error = NULL;
+
+    if (!g_output_stream_write_all (g_io_stream_get_output_stream (stream),
+                                    &reply_be,
+                                    sizeof (reply_be),
+                                    NULL,
+                                    NULL,
+                                    &error))
+    {
+        g_warning ("%s: failed to send reply: %s", __func__, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Read the request from a remote client over 'stream', the TLS session,
+ * create its Connection and send back the reply. Like the IpcFrontendUnix
+ * a request made while the ConnectionManager is full is failed straight
+ * away. The client is on another host so there's no PID or UID to go with
+ * the connection, and it can only have stream framing: the other
+ * transports need fds we can't pass. On success '*local' gets our end of
+ * the connection socket for relay_iostreams.
+ * Returns the RC sent back to the client.
+ */
+TSS2_RC
+ipc_frontend_tcp_handle_request (IpcFrontendTcp *self,
+                                 GIOStream      *stream,
+                                 GIOStream     **local)
+{
+    tabrmd_unix_request_t request = { 0 };
+    tabrmd_unix_reply_t reply = { 0 };
+    Connection *connection;
+    GUnixFDList *fd_list = NULL;
+    GSocket *socket;
+    GError *error = NULL;
+    gsize bytes = 0;
+    guint64 id;
+    guint flags;
+    gint fd;
+
+    *local = NULL;
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    if (!g_input_stream_read_all (g_io_stream_get_input_stream (stream),
+                                  &request,
+                                  sizeof (request),
+                                  &bytes,
+                                  NULL,
+                                  &error) ||
+        bytes != sizeof (request) ||
+        GUINT32_FROM_BE (request.magic) != TABRMD_TCP_MAGIC ||
+        GUINT32_FROM_BE (request.version) != TABRMD_TCP_VERSION)
+    {
+        g_warning ("%s: bad request: %s", __func__,
+                   error != NULL ? error->message : "bad header");
+        g_clear_error (&error);
+        reply.rc = TSS2_RESMGR_RC_BAD_VALUE;
+        goto out;
+    }
+    request.priority = GUINT32_FROM_BE (request.priority);
+    request.flags = GUINT32_FROM_BE (request.flags);
+    if (request.priority > TABRMD_PRIORITY_BATCH) {
+        g_warning ("%s: invalid priority class: %" PRIu32, __func__,
+                   request.priority);
+        reply.rc = TSS2_RESMGR_RC_BAD_VALUE;
+        goto out;
+    }
+    if (connection_manager_is_full (self->connection_manager)) {
+        g_debug ("%s: MAX_COMMANDS exceeded", __func__);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        goto out;
+    }
+    id = random_get_uint64 (self->random);
+    if (connection_manager_contains_id (self->connection_manager, id)) {
+        g_warning ("ID collision in ConnectionManager: %" PRIu64, id);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        goto out;
+    }
+    flags = request.flags & ~(TABRMD_CONNECTION_FLAG_SEQPACKET |
+                              TABRMD_CONNECTION_FLAG_SHM_RING);
+    connection = ipc_frontend_connection_new (id,
+                                              0,
+                                              RATE_LIMITER_UID_NONE,
+                                              g_atomic_int_get (&self->max_transient_objects),
+                                              request.priority,
+                                              &flags,
+                                              &fd_list);
+    fd = g_unix_fd_list_get (fd_list, 0, &error);
+    g_object_unref (fd_list);
+    if (fd == -1) {
+        g_warning ("%s: failed to get connection fd: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        g_object_unref (connection);
+        goto out;
+    }
+    if (connection_manager_insert (self->connection_manager, connection) != 0) {
+        g_warning ("Failed to add new connection to connection_manager.");
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        g_object_unref (connection);
+        close (fd);
+        goto out;
+    }
+    reply.rc = TSS2_RC_SUCCESS;
+    reply.flags = flags;
+    reply.id = id;
+    if (!send_reply (stream, &reply)) {
+        connection_manager_remove (self->connection_manager, connection);
+        g_object_unref (connection);
+        close (fd);
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    g_object_unref (connection);
+    socket = g_socket_new_from_fd (fd, NULL);
+    *local = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+    g_object_unref (socket);
+    return reply.rc;
+out:
+    send_reply (stream, &reply);
+    return reply.rc;
+}
+/*
+ * Handler for the 'run' signal from the GThreadedSocketService, run from
+ * a thread of its own for each client. The client gets a few seconds for
+ * the TLS handshake and its request, and has to present a certificate
+ * the CAs in 'ca-file' vouch for. Once the connection is set up the
+ * thread relays for it until it closes. Nagle's algorithm is off: the
+ * relay already sends whatever it has in one go and a command held back
+ * waiting for an ACK is latency the client sees.
+ */
+static gboolean
+on_run (GThreadedSocketService *service,
+        GSocketConnection      *connection,
+        GObject                *source_object,
+        gpointer                user_data)
+{
+    IpcFrontendTcp *self = IPC_FRONTEND_TCP (g_object_ref (user_data));
+    GSocket *socket = g_socket_connection_get_socket (connection);
+    GIOStream *tls = NULL, *local = NULL;
+    GError *error = NULL;
+    UNUSED_PARAM(service);
+    UNUSED_PARAM(source_object);
+
+    g_socket_set_timeout (socket, IPC_FRONTEND_TCP_TIMEOUT);
+    if (!g_socket_set_option (socket, IPPROTO_TCP, TCP_NODELAY, 1, &error)) {
+        g_debug ("%s: failed to set TCP_NODELAY: %s", __func__,
+                 error->message);
+        g_clear_error (&error);
+    }
+    tls = g_tls_server_connection_new (G_IO_STREAM (connection),
+                                       self->certificate,
+                                       &error);
+    if (tls == NULL) {
+        g_warning ("%s: failed to create TLS connection: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        goto out;
+    }
+    g_object_set (tls,
+                  "authentication-mode", G_TLS_AUTHENTICATION_REQUIRED,
+                  NULL);
+    g_tls_connection_set_database (G_TLS_CONNECTION (tls), self->database);
+    if (!g_tls_connection_handshake (G_TLS_CONNECTION (tls), NULL, &error)) {
+        g_warning ("%s: TLS handshake failed: %s", __func__, error->message);
+        g_error_free (error);
+        goto out;
+    }
+    if (ipc_frontend_tcp_handle_request (self, tls, &local) == TSS2_RC_SUCCESS) {
+        g_socket_set_timeout (socket, 0);
+        relay_iostreams (tls, local);
+        g_object_unref (local);
+    }
+out:
+    g_clear_object (&tls);
+    g_object_unref (self);
+    return TRUE;
+}
+/*
+ * Listen on each address 'address' resolves to. Returns the number of
+ * addresses we listen on, 0 with 'error' set if there are none.
+ */
+static guint
+ipc_frontend_tcp_listen (IpcFrontendTcp *self,
+                         GError        **error)
+{
+    GSocketConnectable *connectable;
+    GSocketAddressEnumerator *enumerator;
+    GSocketAddress *address;
+    GError *add_error = NULL;
+    guint count = 0;
+
+    connectable = g_network_address_parse (self->address,
+                                           TABRMD_TCP_PORT_DEFAULT,
+                                           error);
+    if (connectable == NULL) {
+        return 0;
+    }
+    enumerator = g_socket_connectable_enumerate (connectable);
+    while ((address = g_socket_address_enumerator_next (enumerator,
+                                                        NULL,
+                                                        error)) != NULL)
+    {
+        if (g_socket_listener_add_address (G_SOCKET_LISTENER (self->service),
+                                           address,
+                                           G_SOCKET_TYPE_STREAM,
+                                           G_SOCKET_PROTOCOL_TCP,
+                                           NULL,
+                                           NULL,
+                                           &add_error))
+        {
+            ++count;
+        } else {
+            g_warning ("%s: %s", __func__, add_error->message);
+            g_clear_error (&add_error);
+        }
+        g_object_unref (address);
+    }
+    g_object_unref (enumerator);
+    g_object_unref (connectable);
+    if (count > 0) {
+        g_clear_error (error);
+    } else if (error != NULL && *error == NULL) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "no address to listen on");
+    }
+    return count;
+}
+/*
+ * This function overrides the ipc_frontend_connect function from the
+ * IpcFrontend base class. It loads the certificate, key and CAs, binds
+ * the address provided in the constructor and starts accepting
+ * connections. There's a thread for each client so we take no more than
+ * the ConnectionManager does. If any of it fails the 'disconnected'
+ * signal is emitted.
+ */
+void
+ipc_frontend_tcp_connect (IpcFrontendTcp *self,
+                          GMutex         *init_mutex)
+{
+    IpcFrontend *frontend = IPC_FRONTEND (self);
+    GError *error = NULL;
+    g_return_if_fail (IS_IPC_FRONTEND_TCP (self));
+
+    frontend->init_mutex = init_mutex;
+    if (!g_tls_backend_supports_tls (g_tls_backend_get_default ())) {
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "no TLS backend, is glib-networking installed?");
+        goto fail;
+    }
+    self->certificate = g_tls_certificate_new_from_files (self->cert_file,
+                                                          self->key_file,
+                                                          &error);
+    if (self->certificate == NULL) {
+        goto fail;
+    }
+    self->database = g_tls_file_database_new (self->ca_file, &error);
+    if (self->database == NULL) {
+        goto fail;
+    }
+    self->service = g_threaded_socket_service_new (
+        connection_manager_get_max (self->connection_manager));
+    if (ipc_frontend_tcp_listen (self, &error) == 0) {
+        goto fail;
+    }
+    g_signal_connect (self->service,
+                      "run",
+                      G_CALLBACK (on_run),
+                      self);
+    g_socket_service_start (self->service);
+    g_info ("Listening for TCP connections on %s", self->address);
+    return;
+fail:
+    g_critical ("Failed to listen on %s: %s", self->address, error->message);
+    g_clear_error (&error);
+    g_clear_object (&self->service);
+    g_clear_object (&self->certificate);
+    g_clear_object (&self->database);
+    ipc_frontend_disconnected_invoke (frontend);
+}
+/*
+ * This function overrides the ipc_frontend_disconnect function from the
+ * IpcFrontend base class. New connections are no longer accepted.
+ * Connections already set up keep their relay threads until they close.
+ */
+void
+ipc_frontend_tcp_disconnect (IpcFrontendTcp *self)
+{
+    if (self->service != NULL) {
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_signal_handlers_disconnect_by_data (self->service, self);
+        g_clear_object (&self->service);
+    }
+    IPC_FRONTEND (self)->init_mutex = NULL;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef IPC_FRONTEND_TCP_H
+#define IPC_FRONTEND_TCP_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "connection-manager.h"
+#include "ipc-frontend.h"
+#include "random.h"
+
+G_BEGIN_DECLS
+
+/* seconds a client has for the TLS handshake and its request */
+#define IPC_FRONTEND_TCP_TIMEOUT 5
+
+typedef struct _IpcFrontendTcpClass {
+   IpcFrontendClass     parent;
+} IpcFrontendTcpClass;
+
+/*
+ * The IpcFrontendTcp serves tabrmd connections to clients on other hosts
+ * over TCP with mutual TLS: clients must present a certificate signed by
+ * one of the CAs in 'ca-file'. Each client gets a Connection set up like
+ * those of the other frontends, and a thread of the GThreadedSocketService
+ * relays between the TLS session and the local end of the Connection for
+ * as long as it's open. The rest of the daemon can't tell the connection
+ * from a local one.
+ */
+typedef struct _IpcFrontendTcp
+{
+    IpcFrontend        parent_instance;
+    /* data set by GObject properties */
+    gchar             *address;
+    gchar             *cert_file;
+    gchar             *key_file;
+    gchar             *ca_file;
+    ConnectionManager *connection_manager;
+    guint              max_transient_objects;
+    Random            *random;
+    /* private data */
+    GTlsCertificate   *certificate;
+    GTlsDatabase      *database;
+    GSocketService    *service;
+} IpcFrontendTcp;
+
+#define TYPE_IPC_FRONTEND_TCP             (ipc_frontend_tcp_get_type       ())
+#define IPC_FRONTEND_TCP(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_IPC_FRONTEND_TCP, IpcFrontendTcp))
+#define IPC_FRONTEND_TCP_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_IPC_FRONTEND_TCP, IpcFrontendTcpClass))
+#define IS_IPC_FRONTEND_TCP(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_IPC_FRONTEND_TCP))
+#define IS_IPC_FRONTEND_TCP_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_IPC_FRONTEND_TCP))
+#define IPC_FRONTEND_TCP_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_IPC_FRONTEND_TCP, IpcFrontendTcpClass))
+
+GType            ipc_frontend_tcp_get_type   (void);
+IpcFrontendTcp*  ipc_frontend_tcp_new        (gchar const       *address,
+                                              gchar const       *cert_file,
+                                              gchar const       *key_file,
+                                              gchar const       *ca_file,
+                                              ConnectionManager *connection_manager,
+                                              guint              max_trans,
+                                              Random            *random);
+void             ipc_frontend_tcp_connect    (IpcFrontendTcp    *self,
+                                              GMutex            *init_mutex);
+void             ipc_frontend_tcp_disconnect (IpcFrontendTcp    *self);
+TSS2_RC          ipc_frontend_tcp_handle_request (IpcFrontendTcp *self,
+                                              GIOStream         *stream,
+                                              GIOStream        **local);
+
+G_END_DECLS
+#endif /* IPC_FRONTEND_TCP_H */
@@ -0,0 +1,523 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ipc-frontend-unix.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-unix.h"
+#include "tabrmd.h"
+#include "util.h"
+
+G_DEFINE_TYPE (IpcFrontendUnix, ipc_frontend_unix, TYPE_IPC_FRONTEND);
+
+enum {
+    PROP_0,
+    PROP_SOCKET_PATH,
+    PROP_SOCKET_FD,
+    PROP_CONNECTION_MANAGER,
+    PROP_MAX_TRANS,
+    PROP_RANDOM,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties[N_PROPERTIES] = { NULL };
+
+static void
+ipc_frontend_unix_set_property (GObject      *object,
+                                guint         property_id,
+                                const GValue *value,
+                                GParamSpec   *pspec)
+{
+    IpcFrontendUnix *self = IPC_FRONTEND_UNIX (object);
+
+    switch (property_id) {
+    case PROP_SOCKET_PATH:
+        self->socket_path = g_value_dup_string (value);
+        g_debug ("IpcFrontendUnix set socket_path: %s", self->socket_path);
+        break;
+    case PROP_SOCKET_FD:
+        self->socket_fd = g_value_get_int (value);
+        g_debug ("IpcFrontendUnix set socket_fd: %d", self->socket_fd);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        self->connection_manager = g_value_get_object (value);
+        g_object_ref (self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        g_atomic_int_set (&self->max_transient_objects,
+                          g_value_get_uint (value));
+        break;
+    case PROP_RANDOM:
+        self->random = g_value_get_object (value);
+        g_object_ref (self->random);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_unix_get_property (GObject    *object,
+                                guint       property_id,
+                                GValue     *value,
+                                GParamSpec *pspec)
+{
+    IpcFrontendUnix *self = IPC_FRONTEND_UNIX (object);
+
+    switch (property_id) {
+    case PROP_SOCKET_PATH:
+        g_value_set_string (value, self->socket_path);
+        break;
+    case PROP_SOCKET_FD:
+        g_value_set_int (value, self->socket_fd);
+        break;
+    case PROP_CONNECTION_MANAGER:
+        g_value_set_object (value, self->connection_manager);
+        break;
+    case PROP_MAX_TRANS:
+        g_value_set_uint (value, self->max_transient_objects);
+        break;
+    case PROP_RANDOM:
+        g_value_set_object (value, self->random);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+ipc_frontend_unix_init (IpcFrontendUnix *self)
+{
+    self->socket_fd = -1;
+}
+/*
+ * Dispose method where where we free up references to other objects.
+ */
+static void
+ipc_frontend_unix_dispose (GObject *obj)
+{
+    IpcFrontendUnix *self = IPC_FRONTEND_UNIX (obj);
+
+    if (self->service != NULL) {
+        ipc_frontend_unix_disconnect (self);
+    }
+    g_clear_object (&self->connection_manager);
+    g_clear_object (&self->random);
+    G_OBJECT_CLASS (ipc_frontend_unix_parent_class)->dispose (obj);
+}
+static void
+ipc_frontend_unix_finalize (GObject *obj)
+{
+    IpcFrontendUnix *self = IPC_FRONTEND_UNIX (obj);
+
+    g_clear_pointer (&self->socket_path, g_free);
+    G_OBJECT_CLASS (ipc_frontend_unix_parent_class)->finalize (obj);
+}
+static void
+ipc_frontend_unix_class_init (IpcFrontendUnixClass *klass)
+{
+    GObjectClass    *object_class      = G_OBJECT_CLASS (klass);
+    IpcFrontendClass *ipc_frontend_class = IPC_FRONTEND_CLASS (klass);
+
+    if (ipc_frontend_unix_parent_class == NULL)
+        ipc_frontend_unix_parent_class = g_type_class_peek_parent (klass);
+    /* GObject functions */
+    object_class->dispose      = ipc_frontend_unix_dispose;
+    object_class->finalize     = ipc_frontend_unix_finalize;
+    object_class->get_property = ipc_frontend_unix_get_property;
+    object_class->set_property = ipc_frontend_unix_set_property;
+    /* IpcFrontend functions */
+    ipc_frontend_class->connect    = (IpcFrontendConnect)ipc_frontend_unix_connect;
+    ipc_frontend_class->disconnect = (IpcFrontendDisconnect)ipc_frontend_unix_disconnect;
+    obj_properties [PROP_SOCKET_PATH] =
+        g_param_spec_string ("socket-path",
+                             "Socket path",
+                             "Path of the Unix socket clients connect to",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_SOCKET_FD] =
+        g_param_spec_int ("socket-fd",
+                          "Socket fd",
+                          "Listening socket passed by the service manager, "
+                          "used instead of binding 'socket-path'",
+                          -1,
+                          G_MAXINT,
+                          -1,
+                          G_PARAM_READWRITE);
+    obj_properties [PROP_CONNECTION_MANAGER] =
+        g_param_spec_object ("connection-manager",
+                             "ConnectionManager object",
+                             "ConnectionManager object for connection",
+                             TYPE_CONNECTION_MANAGER,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_TRANS] =
+        g_param_spec_uint ("max-trans",
+                          "maximum transient objects",
+                          "maximum number of transient objects for the handle map",
+                          1,
+                          TABRMD_TRANSIENT_MAX,
+                          TABRMD_TRANSIENT_MAX_DEFAULT,
+                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_RANDOM] =
+        g_param_spec_object ("random",
+                             "Random object",
+                             "Source of random numbers.",
+                             TYPE_RANDOM,
+                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+
+IpcFrontendUnix*
+ipc_frontend_unix_new (gchar const       *socket_path,
+                       ConnectionManager *connection_manager,
+                       guint              max_trans,
+                       Random            *random)
+{
+    GObject *object = NULL;
+
+    object = g_object_new (TYPE_IPC_FRONTEND_UNIX,
+                           "socket-path",        socket_path,
+                           "connection-manager", connection_manager,
+                           "max-trans",          max_trans,
+                           "random",             random,
+                           NULL);
+    return IPC_FRONTEND_UNIX (object);
+}
+/*
+ * Send the reply to a request. The fds in 'fd_list', if any, go with it
+ * as ancillary data.
+ */
+static gboolean
+send_reply (GSocket             *socket,
+            tabrmd_unix_reply_t *reply,
+            GUnixFDList         *fd_list)
+{
+    GOutputVector vector = { .buffer = reply, .size = sizeof (*reply) };
+    GSocketControlMessage *message = NULL;
+    GError *error = NULL;
+    gssize ret;
+
+    if (fd_list != NULL) {
+        message = g_unix_fd_message_new_with_fd_list (fd_list);
+    }
+    ret = g_socket_send_message (socket,
+                                 NULL,
+                                 &vector,
+                                 1,
+                                 message != NULL ? &message : NULL,
+                                 message != NULL ? 1 : 0,
+                                 G_SOCKET_MSG_NONE,
+                                 NULL,
+                                 &error);
+    g_clear_object (&message);
+    if (ret != (gssize)sizeof (*reply)) {
+        g_warning ("%s: failed to send reply: %s", __func__,
+                   error != NULL ? error->message : "short write");
+        g_clear_error (&error);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Read the request from a client that has connected to the socket, create
+ * its Connection and send back the reply. 'pid' is the process id of the
+ * client and 'uid' its user, from the credentials of the socket. The PID
+ * is mixed into the
+ * connection id like the D-Bus frontend does. Unlike CreateConnection no
+ * caller waits for a free connection slot: a request made while the
+ * ConnectionManager is full is failed straight away.
+ * Returns the RC sent back to the client.
+ */
+TSS2_RC
+ipc_frontend_unix_handle_request (IpcFrontendUnix *self,
+                                  GSocket         *socket,
+                                  guint32          pid,
+                                  guint32          uid)
+{
+    tabrmd_unix_request_t request = { 0 };
+    tabrmd_unix_reply_t reply = { 0 };
+    Connection *connection;
+    GUnixFDList *fd_list = NULL;
+    GError *error = NULL;
+    guint64 id, id_pid_mix;
+    guint flags;
+    gssize ret;
+
+    ipc_frontend_init_guard (IPC_FRONTEND (self));
+    ret = g_socket_receive (socket,
+                            (gchar*)&request,
+                            sizeof (request),
+                            NULL,
+                            &error);
+    if (ret != (gssize)sizeof (request) ||
+        request.magic != TABRMD_UNIX_MAGIC ||
+        request.version != TABRMD_UNIX_VERSION)
+    {
+        g_warning ("%s: bad request from PID %" PRIu32 ": %s", __func__,
+                   pid, error != NULL ? error->message : "bad header");
+        g_clear_error (&error);
+        reply.rc = TSS2_RESMGR_RC_BAD_VALUE;
+        goto out;
+    }
+    if (request.priority > TABRMD_PRIORITY_BATCH) {
+        g_warning ("%s: invalid priority class: %" PRIu32, __func__,
+                   request.priority);
+        reply.rc = TSS2_RESMGR_RC_BAD_VALUE;
+        goto out;
+    }
+    if (connection_manager_client_is_full (self->connection_manager,
+                                           pid,
+                                           uid,
+                                           1))
+    {
+        g_debug ("%s: connection quota of PID %" PRIu32 " exceeded",
+                 __func__, pid);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        goto out;
+    }
+    if (connection_manager_is_full (self->connection_manager)) {
+        g_debug ("%s: MAX_COMMANDS exceeded", __func__);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        goto out;
+    }
+    id = random_get_uint64 (self->random);
+    id_pid_mix = id ^ pid;
+    if (connection_manager_contains_id (self->connection_manager,
+                                        id_pid_mix)) {
+        g_warning ("ID collision in ConnectionManager: %" PRIu64, id_pid_mix);
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        goto out;
+    }
+    flags = request.flags;
+    connection = ipc_frontend_connection_new (id_pid_mix,
+                                              pid,
+                                              uid,
+                                              g_atomic_int_get (&self->max_transient_objects),
+                                              request.priority,
+                                              &flags,
+                                              &fd_list);
+    if (connection_manager_insert (self->connection_manager, connection) != 0) {
+        g_warning ("Failed to add new connection to connection_manager.");
+        reply.rc = TSS2_RESMGR_RC_GENERAL_FAILURE;
+        g_object_unref (connection);
+        g_clear_object (&fd_list);
+        goto out;
+    }
+    reply.rc = TSS2_RC_SUCCESS;
+    reply.flags = flags;
+    reply.id = id;
+    if (!send_reply (socket, &reply, fd_list)) {
+        connection_manager_remove (self->connection_manager, connection);
+    }
+    g_object_unref (connection);
+    g_object_unref (fd_list);
+    return reply.rc;
+out:
+    send_reply (socket, &reply, NULL);
+    return reply.rc;
+}
+/*
+ * Handler for the 'incoming' signal from the GSocketService, run from the
+ * default GMainContext. The client is identified by the credentials of its
+ * socket (SO_PEERCRED) and is given a short timeout to send its request
+ * since we don't want a client to hold up the main loop. The setup socket
+ * is closed once we return.
+ */
+static gboolean
+on_incoming (GSocketService    *service,
+             GSocketConnection *connection,
+             GObject           *source_object,
+             gpointer           user_data)
+{
+    IpcFrontendUnix *self = IPC_FRONTEND_UNIX (user_data);
+    GSocket *socket;
+    GCredentials *credentials;
+    GError *error = NULL;
+    pid_t pid;
+    uid_t uid;
+    UNUSED_PARAM(service);
+    UNUSED_PARAM(source_object);
+
+    socket = g_socket_connection_get_socket (connection);
+    g_socket_set_timeout (socket, IPC_FRONTEND_UNIX_TIMEOUT);
+    credentials = g_socket_get_credentials (socket, &error);
+    if (credentials == NULL) {
+        g_warning ("%s: failed to get client credentials: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        return TRUE;
+    }
+    pid = g_credentials_get_unix_pid (credentials, &error);
+    if (pid == -1) {
+        g_warning ("%s: failed to get client PID: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        g_object_unref (credentials);
+        return TRUE;
+    }
+    /* -1 if it can't be had, which is RATE_LIMITER_UID_NONE */
+    uid = g_credentials_get_unix_user (credentials, NULL);
+    g_object_unref (credentials);
+    g_debug ("%s: connection from PID %d, UID %d", __func__, pid, (gint)uid);
+    ipc_frontend_unix_handle_request (self,
+                                      socket,
+                                      (guint32)pid,
+                                      (guint32)uid);
+    return TRUE;
+}
+/*
+ * Remove a socket left behind at our path by a previous instance. Only
+ * sockets are removed: anything else there is an error in our
+ * configuration we don't want to paper over.
+ */
+static void
+remove_stale_socket (const gchar *path)
+{
+    struct stat st;
+
+    if (lstat (path, &st) == 0 && S_ISSOCK (st.st_mode)) {
+        g_debug ("%s: removing stale socket %s", __func__, path);
+        unlink (path);
+    }
+}
+/*
+ * Get the listening socket passed to us by systemd socket activation, see
+ * sd_listen_fds(3). We only take the first one. The environment variables
+ * are unset so that processes we start don't take the socket as theirs.
+ * Returns -1 if we weren't socket activated.
+ */
+gint
+ipc_frontend_unix_activation_fd (void)
+{
+    const gchar *listen_pid = g_getenv ("LISTEN_PID");
+    const gchar *listen_fds = g_getenv ("LISTEN_FDS");
+    gint fd = IPC_FRONTEND_UNIX_LISTEN_FDS_START;
+    struct stat st;
+
+    if (listen_pid == NULL || listen_fds == NULL ||
+        g_ascii_strtoull (listen_pid, NULL, 10) != (guint64)getpid () ||
+        g_ascii_strtoull (listen_fds, NULL, 10) < 1)
+    {
+        return -1;
+    }
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+    g_unsetenv ("LISTEN_FDNAMES");
+    if (fstat (fd, &st) != 0 || !S_ISSOCK (st.st_mode)) {
+        g_warning ("%s: fd %d passed by the service manager isn't a socket",
+                   __func__, fd);
+        return -1;
+    }
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+/*
+ * Take the listening socket passed by the service manager. It's already
+ * bound with the ownership and mode from the socket unit so it's used as
+ * is, and it isn't ours to remove when we disconnect.
+ */
+static gboolean
+ipc_frontend_unix_add_activated (IpcFrontendUnix *self,
+                                 GError         **error)
+{
+    GSocket *socket;
+    gboolean ret;
+
+    socket = g_socket_new_from_fd (self->socket_fd, error);
+    if (socket == NULL) {
+        return FALSE;
+    }
+    ret = g_socket_listener_add_socket (G_SOCKET_LISTENER (self->service),
+                                        socket,
+                                        NULL,
+                                        error);
+    g_object_unref (socket);
+    return ret;
+}
+/*
+ * This function overrides the ipc_frontend_connect function from the
+ * IpcFrontend base class. It binds the socket at the path provided in the
+ * constructor and starts accepting connections. Access to the socket is
+ * limited to our user and group, the same callers the D-Bus policy lets
+ * talk to us. With 'socket-fd' set the socket from socket activation is
+ * used instead. If the socket can't be created the 'disconnected' signal
+ * is emitted.
+ */
+void
+ipc_frontend_unix_connect (IpcFrontendUnix *self,
+                           GMutex          *init_mutex)
+{
+    IpcFrontend *frontend = IPC_FRONTEND (self);
+    GSocketAddress *address;
+    GError *error = NULL;
+    gboolean ret;
+    g_return_if_fail (IS_IPC_FRONTEND_UNIX (self));
+
+    frontend->init_mutex = init_mutex;
+    if (self->socket_fd >= 0) {
+        self->service = g_socket_service_new ();
+        if (!ipc_frontend_unix_add_activated (self, &error)) {
+            g_critical ("Failed to listen on activated socket: %s",
+                        error->message);
+            g_clear_error (&error);
+            g_clear_object (&self->service);
+            ipc_frontend_disconnected_invoke (frontend);
+            return;
+        }
+        goto listening;
+    }
+    remove_stale_socket (self->socket_path);
+    address = g_unix_socket_address_new (self->socket_path);
+    self->service = g_socket_service_new ();
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (self->service),
+                                         address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         &error);
+    g_object_unref (address);
+    if (!ret || chmod (self->socket_path, 0660) != 0) {
+        g_critical ("Failed to listen on socket %s: %s", self->socket_path,
+                    error != NULL ? error->message : strerror (errno));
+        g_clear_error (&error);
+        g_clear_object (&self->service);
+        ipc_frontend_disconnected_invoke (frontend);
+        return;
+    }
+listening:
+    g_signal_connect (self->service,
+                      "incoming",
+                      G_CALLBACK (on_incoming),
+                      self);
+    g_socket_service_start (self->service);
+    g_info ("Listening for connections on %s",
+            self->socket_fd >= 0 ? "activated socket" : self->socket_path);
+}
+/*
+ * This function overrides the ipc_frontend_disconnect function from the
+ * IpcFrontend base class. New connections are no longer accepted and the
+ * socket is removed. Connections already set up aren't affected.
+ */
+void
+ipc_frontend_unix_disconnect (IpcFrontendUnix *self)
+{
+    if (self->service != NULL) {
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_signal_handlers_disconnect_by_data (self->service, self);
+        g_clear_object (&self->service);
+        if (self->socket_fd < 0) {
+            unlink (self->socket_path);
+        }
+    }
+    IPC_FRONTEND (self)->init_mutex = NULL;
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef IPC_FRONTEND_UNIX_H
+#define IPC_FRONTEND_UNIX_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "connection-manager.h"
+#include "ipc-frontend.h"
+#include "random.h"
+
+G_BEGIN_DECLS
+
+/* seconds a client has to send its request once it has connected */
+#define IPC_FRONTEND_UNIX_TIMEOUT 1
+/* first fd passed by systemd socket activation, see sd_listen_fds(3) */
+#define IPC_FRONTEND_UNIX_LISTEN_FDS_START 3
+
+typedef struct _IpcFrontendUnixClass {
+   IpcFrontendClass     parent;
+} IpcFrontendUnixClass;
+
+typedef struct _IpcFrontendUnix
+{
+    IpcFrontend        parent_instance;
+    /* data set by GObject properties */
+    gchar             *socket_path;
+    gint               socket_fd;
+    ConnectionManager *connection_manager;
+    guint              max_transient_objects;
+    Random            *random;
+    /* private data */
+    GSocketService    *service;
+} IpcFrontendUnix;
+
+#define TYPE_IPC_FRONTEND_UNIX             (ipc_frontend_unix_get_type       ())
+#define IPC_FRONTEND_UNIX(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_IPC_FRONTEND_UNIX, IpcFrontendUnix))
+#define IPC_FRONTEND_UNIX_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_IPC_FRONTEND_UNIX, IpcFrontendUnixClass))
+#define IS_IPC_FRONTEND_UNIX(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_IPC_FRONTEND_UNIX))
+#define IS_IPC_FRONTEND_UNIX_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_IPC_FRONTEND_UNIX))
+#define IPC_FRONTEND_UNIX_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_IPC_FRONTEND_UNIX, IpcFrontendUnixClass))
+
+GType            ipc_frontend_unix_get_type   (void);
+IpcFrontendUnix* ipc_frontend_unix_new        (gchar const       *socket_path,
+                                               ConnectionManager *connection_manager,
+                                               guint              max_trans,
+                                               Random            *random);
+void             ipc_frontend_unix_connect    (IpcFrontendUnix   *self,
+                                               GMutex            *init_mutex);
+void             ipc_frontend_unix_disconnect (IpcFrontendUnix   *self);
+TSS2_RC          ipc_frontend_unix_handle_request (IpcFrontendUnix *self,
+                                               GSocket           *socket,
+                                               guint32            pid,
+                                               guint32            uid);
+gint             ipc_frontend_unix_activation_fd (void);
+
+G_END_DECLS
+#endif /* IPC_FRONTEND_UNIX_H */
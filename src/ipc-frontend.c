@@ -4,8 +4,16 @@
  * All rights reserved.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include "tabrmd.h"
+#include "tabrmd-defaults.h"
+#include "shm-ring.h"
 #include "util.h"
 #include "ipc-frontend.h"
 
@@ -14,6 +22,14 @@ G_DEFINE_ABSTRACT_TYPE (IpcFrontend, ipc_frontend, G_TYPE_OBJECT);
 enum {
     SIGNAL_0,
     SIGNAL_DISCONNECTED,
+    SIGNAL_CANCEL,
+    SIGNAL_RESET,
+    SIGNAL_RESUME,
+    SIGNAL_GET_STATISTICS,
+    SIGNAL_GET_FLIGHT_RECORDS,
+    SIGNAL_SET_LIMIT,
+    SIGNAL_GET_CALIBRATION,
+    SIGNAL_CALIBRATE,
     N_SIGNALS,
 };
 static guint signals [N_SIGNALS] = { 0 };
@@ -44,6 +60,126 @@ ipc_frontend_class_init (IpcFrontendClass *klass)
                       G_TYPE_NONE,
                       0,
                       NULL);
+    /*
+     * Emitted when a client asks for the commands it has sent to be
+     * canceled. The handler returns a TSS2_RC for the client.
+     */
+    signals [SIGNAL_CANCEL] =
+        g_signal_new ("cancel",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      1,
+                      TYPE_CONNECTION);
+    /*
+     * Emitted when a client takes over a connection kept open by an
+     * earlier client in the same process. The handler returns a TSS2_RC
+     * for the client.
+     */
+    signals [SIGNAL_RESET] =
+        g_signal_new ("reset",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      1,
+                      TYPE_CONNECTION);
+    /*
+     * Emitted when a new connection is created to take over the objects
+     * and sessions of a closed one, before the client gets it. The
+     * handler returns a TSS2_RC for the client.
+     */
+    signals [SIGNAL_RESUME] =
+        g_signal_new ("resume",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      1,
+                      TYPE_CONNECTION);
+    /*
+     * Emitted when a client asks for the command latency histograms. The
+     * handler returns a GVariant of type COMMAND_STATS_VARIANT_TYPE.
+     */
+    signals [SIGNAL_GET_STATISTICS] =
+        g_signal_new ("get-statistics",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_VARIANT,
+                      0);
+    /*
+     * Emitted when a client asks for the flight recorder of each TPM. The
+     * handler returns a GVariant of type FLIGHT_RECORDER_VARIANT_TYPE.
+     */
+    signals [SIGNAL_GET_FLIGHT_RECORDS] =
+        g_signal_new ("get-flight-records",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_VARIANT,
+                      0);
+    /*
+     * Emitted when an administrator changes one of the limits the daemon
+     * was started with. The arguments are the name of the option setting
+     * the limit and its new value, the handler returns a TSS2_RC.
+     */
+    signals [SIGNAL_SET_LIMIT] =
+        g_signal_new ("set-limit",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      2,
+                      G_TYPE_STRING,
+                      G_TYPE_UINT);
+    /*
+     * Emitted when a client asks for what calibrating each TPM measured.
+     * The handler returns a GVariant of type TPM2_PROFILE_VARIANT_TYPE.
+     */
+    signals [SIGNAL_GET_CALIBRATION] =
+        g_signal_new ("get-calibration",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_VARIANT,
+                      0);
+    /*
+     * Emitted when an administrator asks for each TPM to be calibrated
+     * again. The handler returns a TSS2_RC.
+     */
+    signals [SIGNAL_CALIBRATE] =
+        g_signal_new ("calibrate",
+                      G_TYPE_FROM_CLASS (object_class),
+                      G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE | G_SIGNAL_NO_HOOKS,
+                      0,
+                      g_signal_accumulator_first_wins,
+                      NULL,
+                      NULL,
+                      G_TYPE_UINT,
+                      0);
 }
 /*
  * The init_mutex is not meant to be held for any length of time. It's only
@@ -92,3 +228,302 @@ ipc_frontend_disconnected_invoke (IpcFrontend *ipc_frontend)
                    signals [SIGNAL_DISCONNECTED],
                    0);
 }
+/*
+ * Emit the 'cancel' signal for the provided connection and return the RC
+ * from the handler. If nobody handles the signal the cancel request can't
+ * be honored.
+ */
+TSS2_RC
+ipc_frontend_cancel_invoke (IpcFrontend *ipc_frontend,
+                            Connection  *connection)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_CANCEL],
+                                       0,
+                                       FALSE))
+    {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_CANCEL],
+                   0,
+                   connection,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'reset' signal for the provided connection and return the RC
+ * from the handler. Like 'cancel', nobody handling the signal means the
+ * connection can't be reset.
+ */
+TSS2_RC
+ipc_frontend_reset_invoke (IpcFrontend *ipc_frontend,
+                           Connection  *connection)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_RESET],
+                                       0,
+                                       FALSE))
+    {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_RESET],
+                   0,
+                   connection,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'resume' signal for the provided connection and return the RC
+ * from the handler. Nobody handling the signal means connections can't
+ * be resumed.
+ */
+TSS2_RC
+ipc_frontend_resume_invoke (IpcFrontend *ipc_frontend,
+                            Connection  *connection)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_RESUME],
+                                       0,
+                                       FALSE))
+    {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_RESUME],
+                   0,
+                   connection,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'get-statistics' signal and return the GVariant from the
+ * handler. The caller owns the reference. NULL is returned if nobody
+ * handles the signal.
+ */
+GVariant*
+ipc_frontend_get_statistics_invoke (IpcFrontend *ipc_frontend)
+{
+    GVariant *statistics = NULL;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_GET_STATISTICS],
+                                       0,
+                                       FALSE))
+    {
+        return NULL;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_GET_STATISTICS],
+                   0,
+                   &statistics);
+    return statistics;
+}
+/*
+ * Emit the 'get-flight-records' signal, like
+ * ipc_frontend_get_statistics_invoke.
+ */
+GVariant*
+ipc_frontend_get_flight_records_invoke (IpcFrontend *ipc_frontend)
+{
+    GVariant *records = NULL;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_GET_FLIGHT_RECORDS],
+                                       0,
+                                       FALSE))
+    {
+        return NULL;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_GET_FLIGHT_RECORDS],
+                   0,
+                   &records);
+    return records;
+}
+/*
+ * Set up the shared memory transport for a connection: a memfd backing the
+ * command and response rings and a doorbell for each direction. The
+ * connection keeps the mapping and its own end of the doorbells. Returns
+ * the GUnixFDList passed to the client, holding 'client_fd' followed by
+ * the memfd and the command / response doorbells, or NULL if any of it
+ * couldn't be created. The connection then only uses its socket.
+ */
+static GUnixFDList*
+create_shm_transport (Connection *connection,
+                      gint        client_fd)
+{
+    shm_region_t *region;
+    gint fds [4] = { client_fd, -1, -1, -1 };
+    gint command_fd, response_fd;
+    size_t i;
+
+    region = shm_region_create (&fds [1]);
+    if (region == NULL) {
+        return NULL;
+    }
+    command_fd = shm_doorbell_new ();
+    response_fd = shm_doorbell_new ();
+    if (command_fd >= 0 && response_fd >= 0) {
+        fds [2] = fcntl (command_fd, F_DUPFD_CLOEXEC, 0);
+        fds [3] = fcntl (response_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (fds [2] == -1 || fds [3] == -1) {
+        g_warning ("%s: failed to create doorbells: %s", __func__,
+                   strerror (errno));
+        for (i = 1; i < G_N_ELEMENTS (fds); ++i) {
+            if (fds [i] >= 0) {
+                close (fds [i]);
+            }
+        }
+        if (command_fd >= 0) {
+            close (command_fd);
+        }
+        if (response_fd >= 0) {
+            close (response_fd);
+        }
+        shm_region_unmap (region);
+        return NULL;
+    }
+    connection_set_shm (connection, region, command_fd, response_fd);
+    return g_unix_fd_list_new_from_array (fds, G_N_ELEMENTS (fds));
+}
+/*
+ * Create the Connection for a new client. This is shared by the
+ * IpcFrontends so a connection looks the same to the rest of the daemon
+ * however it was set up. 'flags' are the connection flags the client asked
+ * for: on return it holds the ones that were granted. 'pid' is the client
+ * process, 0 if it isn't known, and 'uid' its user, RATE_LIMITER_UID_NONE
+ * if it isn't known. The fds to pass to the client are returned through 'fd_list': the client end of the
+ * connection socket followed, if the shared memory transport was granted,
+ * by the fds for it. The caller owns both the Connection and the list.
+ */
+Connection*
+ipc_frontend_connection_new (guint64       id,
+                             guint32       pid,
+                             guint32       uid,
+                             guint         max_trans,
+                             guint         priority,
+                             guint        *flags,
+                             GUnixFDList **fd_list)
+{
+    HandleMap *handle_map;
+    Connection *connection;
+    GIOStream *iostream;
+    gint client_fd = 0;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, max_trans);
+    if (handle_map == NULL)
+        g_error ("Failed to allocate new HandleMap");
+    *flags &= TABRMD_CONNECTION_FLAGS_SUPPORTED;
+    if (!(*flags & TABRMD_CONNECTION_FLAG_SEQPACKET) ||
+        (*flags & TABRMD_CONNECTION_FLAG_SHM_RING))
+    {
+        *flags &= ~TABRMD_CONNECTION_FLAG_MUX;
+    }
+    iostream = create_connection_iostream_type (
+                   &client_fd,
+                   (*flags & TABRMD_CONNECTION_FLAG_SEQPACKET) ?
+                       SOCK_SEQPACKET : SOCK_STREAM);
+    connection = connection_new (iostream, id, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    if (connection == NULL)
+        g_error ("Failed to allocate new connection.");
+    g_object_set (connection, "priority", priority, NULL);
+    connection_set_pid (connection, pid);
+    connection_set_uid (connection, uid);
+    connection_set_mux (connection,
+                        (*flags & TABRMD_CONNECTION_FLAG_MUX) != 0);
+    *fd_list = NULL;
+    if (*flags & TABRMD_CONNECTION_FLAG_SHM_RING) {
+        *fd_list = create_shm_transport (connection, client_fd);
+        if (*fd_list == NULL) {
+            *flags &= ~TABRMD_CONNECTION_FLAG_SHM_RING;
+        }
+    }
+    if (*fd_list == NULL) {
+        *fd_list = g_unix_fd_list_new_from_array (&client_fd, 1);
+    }
+    g_debug ("Created connection with client FD: %d, id: 0x%" PRIx64
+             ", priority: %u and flags: 0x%x", client_fd, id, priority,
+             *flags);
+    return connection;
+}
+/*
+ * Emit the 'set-limit' signal and return the RC from the handler, like
+ * ipc_frontend_cancel_invoke.
+ */
+TSS2_RC
+ipc_frontend_set_limit_invoke (IpcFrontend *ipc_frontend,
+                               const gchar *name,
+                               guint        value)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_SET_LIMIT],
+                                       0,
+                                       FALSE))
+    {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_SET_LIMIT],
+                   0,
+                   name,
+                   value,
+                   &rc);
+    return rc;
+}
+/*
+ * Emit the 'get-calibration' signal, like
+ * ipc_frontend_get_statistics_invoke.
+ */
+GVariant*
+ipc_frontend_get_calibration_invoke (IpcFrontend *ipc_frontend)
+{
+    GVariant *reports = NULL;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_GET_CALIBRATION],
+                                       0,
+                                       FALSE))
+    {
+        return NULL;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_GET_CALIBRATION],
+                   0,
+                   &reports);
+    return reports;
+}
+/*
+ * Emit the 'calibrate' signal. TSS2_RESMGR_RC_NOT_IMPLEMENTED is returned
+ * if nobody handles it.
+ */
+TSS2_RC
+ipc_frontend_calibrate_invoke (IpcFrontend *ipc_frontend)
+{
+    guint rc = TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+
+    if (!g_signal_has_handler_pending (ipc_frontend,
+                                       signals [SIGNAL_CALIBRATE],
+                                       0,
+                                       FALSE))
+    {
+        return rc;
+    }
+    g_signal_emit (ipc_frontend,
+                   signals [SIGNAL_CALIBRATE],
+                   0,
+                   &rc);
+    return rc;
+}
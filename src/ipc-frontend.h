@@ -7,6 +7,8 @@
 #define IPC_FRONTEND_H
 
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
+#include <tss2/tss2_tpm2_types.h>
 
 #include "connection.h"
 
@@ -43,6 +45,26 @@ void                ipc_frontend_connect               (IpcFrontend  *self,
 void                ipc_frontend_disconnect            (IpcFrontend  *self);
 void                ipc_frontend_disconnected_invoke   (IpcFrontend  *self);
 void                ipc_frontend_init_guard            (IpcFrontend  *self);
+TSS2_RC             ipc_frontend_cancel_invoke         (IpcFrontend  *self,
+                                                        Connection   *connection);
+TSS2_RC             ipc_frontend_reset_invoke          (IpcFrontend  *self,
+                                                        Connection   *connection);
+TSS2_RC             ipc_frontend_resume_invoke         (IpcFrontend  *self,
+                                                        Connection   *connection);
+GVariant*           ipc_frontend_get_statistics_invoke (IpcFrontend  *self);
+GVariant*           ipc_frontend_get_flight_records_invoke (IpcFrontend *self);
+TSS2_RC             ipc_frontend_set_limit_invoke      (IpcFrontend  *self,
+                                                        const gchar  *name,
+                                                        guint         value);
+GVariant*           ipc_frontend_get_calibration_invoke (IpcFrontend *self);
+TSS2_RC             ipc_frontend_calibrate_invoke      (IpcFrontend  *self);
+Connection*         ipc_frontend_connection_new        (guint64       id,
+                                                        guint32       pid,
+                                                        guint32       uid,
+                                                        guint         max_trans,
+                                                        guint         priority,
+                                                        guint        *flags,
+                                                        GUnixFDList **fd_list);
 
 G_END_DECLS
 #endif /* IPC_FRONTEND_H */
@@ -0,0 +1,354 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "key-pool.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_DEFINE_TYPE (KeyPool, key_pool, G_TYPE_OBJECT);
+
+/*
+ * A template: the key of the Create command, the command itself, the
+ * number of keys to keep pooled for it and the responses holding them.
+ */
+typedef struct {
+    GBytes         *key;
+    GBytes         *command;
+    guint           size;
+    GQueue         *responses;
+} key_pool_template_t;
+
+static void
+key_pool_template_free (gpointer data)
+{
+    key_pool_template_t *template = (key_pool_template_t*)data;
+
+    g_clear_pointer (&template->key, g_bytes_unref);
+    g_clear_pointer (&template->command, g_bytes_unref);
+    g_queue_free_full (template->responses, (GDestroyNotify)g_bytes_unref);
+    g_free (template);
+}
+static void
+key_pool_init (KeyPool *self)
+{
+    self->templates = g_ptr_array_new_with_free_func (key_pool_template_free);
+}
+/*
+ * GObject finalize function: release the templates and the pooled keys.
+ */
+static void
+key_pool_finalize (GObject *object)
+{
+    KeyPool *self = KEY_POOL (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->templates, g_ptr_array_unref);
+    G_OBJECT_CLASS (key_pool_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers.
+ */
+static void
+key_pool_class_init (KeyPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (key_pool_parent_class == NULL)
+        key_pool_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = key_pool_finalize;
+}
+KeyPool*
+key_pool_new (void)
+{
+    g_debug ("%s", __func__);
+    return KEY_POOL (g_object_new (TYPE_KEY_POOL, NULL));
+}
+/*
+ * Read the templates from the file at 'path': each group is a Create
+ * command in hex with the number of keys to pool for it. Returns NULL if
+ * the file can't be read or any template in it is bad.
+ */
+KeyPool*
+key_pool_load (const gchar *path)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    GError *error = NULL;
+    KeyPool *pool = NULL;
+    GBytes *command;
+    gchar **groups = NULL, *hex;
+    gint size;
+    gsize i;
+
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error)) {
+        g_warning ("%s: failed to read %s: %s", __func__, path,
+                   error->message);
+        g_error_free (error);
+        goto out;
+    }
+    pool = key_pool_new ();
+    groups = g_key_file_get_groups (key_file, NULL);
+    for (i = 0; groups [i] != NULL; ++i) {
+        hex = g_key_file_get_string (key_file,
+                                     groups [i],
+                                     KEY_POOL_KEY_COMMAND,
+                                     &error);
+        if (hex == NULL) {
+            g_warning ("%s: [%s] in %s: %s", __func__, groups [i], path,
+                       error->message);
+            g_error_free (error);
+            g_clear_object (&pool);
+            goto out;
+        }
+        command = parse_command_hex (hex);
+        g_free (hex);
+        size = KEY_POOL_SIZE_DEFAULT;
+        if (g_key_file_has_key (key_file, groups [i], KEY_POOL_KEY_SIZE,
+                                NULL))
+        {
+            size = g_key_file_get_integer (key_file,
+                                           groups [i],
+                                           KEY_POOL_KEY_SIZE,
+                                           NULL);
+        }
+        if (command == NULL || size <= 0 || size > KEY_POOL_SIZE_MAX ||
+            !key_pool_add_template (pool, command, (guint)size))
+        {
+            g_warning ("%s: [%s] in %s isn't a Create that can be pooled "
+                       "with a size from 1 to %d", __func__, groups [i],
+                       path, KEY_POOL_SIZE_MAX);
+            g_clear_pointer (&command, g_bytes_unref);
+            g_clear_object (&pool);
+            goto out;
+        }
+        g_bytes_unref (command);
+    }
+    g_info ("%s: %u key templates from %s", __func__, pool->templates->len,
+            path);
+out:
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+    return pool;
+}
+/*
+ * Generate the key identifying the key a Create command creates: the
+ * whole command after the header, parent, auths, sensitive data and
+ * public area. Only a Create under a persistent parent authorized by
+ * passwords can be answered from the pool: a transient parent's handle
+ * tells nothing about the key behind it and a session makes each command
+ * different. A Create with creationPCR is refused as well since its
+ * creation data would hold the PCR values of when the key was pooled.
+ * This function returns NULL if the key can't come from the pool. The
+ * caller must free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+key_pool_key (Tpm2Command *command)
+{
+    TPM2B_SENSITIVE_CREATE in_sensitive = { 0 };
+    TPM2B_PUBLIC in_public = { 0 };
+    TPM2B_DATA outside_info = { 0 };
+    TPML_PCR_SELECTION creation_pcr = { 0 };
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset;
+    TSS2_RC rc;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_Create ||
+        tpm2_command_get_handle_count (command) != 1 ||
+        tpm2_command_get_handle (command, 0) >> TPM2_HR_SHIFT !=
+        TPM2_HT_PERSISTENT ||
+        !tpm2_command_has_auths (command) ||
+        tpm2_command_has_session_auths (command) ||
+        tpm2_command_get_params_offset (command) == 0)
+    {
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    rc = Tss2_MU_TPM2B_SENSITIVE_CREATE_Unmarshal (buf, size, &offset,
+                                                   &in_sensitive);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal (buf, size, &offset, &in_public);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_DATA_Unmarshal (buf, size, &offset,
+                                           &outside_info);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPML_PCR_SELECTION_Unmarshal (buf, size, &offset,
+                                                   &creation_pcr);
+    }
+    memset (&in_sensitive, 0, sizeof (in_sensitive));
+    if (rc != TSS2_RC_SUCCESS || offset != size ||
+        creation_pcr.count != 0)
+    {
+        g_debug ("%s: Create can't come from the pool", __func__);
+        return NULL;
+    }
+    return g_bytes_new (buf + TPM_HEADER_SIZE, size - TPM_HEADER_SIZE);
+}
+/*
+ * Find the template for 'key'. Returns NULL if there's none.
+ */
+static key_pool_template_t*
+key_pool_find (KeyPool *pool,
+               GBytes  *key)
+{
+    key_pool_template_t *template;
+    guint i;
+
+    for (i = 0; i < pool->templates->len; ++i) {
+        template = g_ptr_array_index (pool->templates, i);
+        if (g_bytes_equal (template->key, key)) {
+            return template;
+        }
+    }
+    return NULL;
+}
+/*
+ * Add the Create command in 'command' to the templates, with room for
+ * 'size' keys. FALSE is returned if the command can't be pooled or is a
+ * template already.
+ */
+gboolean
+key_pool_add_template (KeyPool *pool,
+                       GBytes  *command,
+                       guint    size)
+{
+    key_pool_template_t *template;
+    Tpm2Command *parsed;
+    GBytes *key;
+    gsize buf_size;
+    guint8 *buf;
+
+    buf = g_bytes_unref_to_data (g_bytes_ref (command), &buf_size);
+    parsed = tpm2_command_new (NULL, buf, buf_size, KEY_POOL_CREATE_ATTRS);
+    key = key_pool_key (parsed);
+    g_object_unref (parsed);
+    if (key == NULL || key_pool_find (pool, key) != NULL) {
+        g_clear_pointer (&key, g_bytes_unref);
+        return FALSE;
+    }
+    template = g_new0 (key_pool_template_t, 1);
+    template->key = key;
+    template->command = g_bytes_ref (command);
+    template->size = size;
+    template->responses = g_queue_new ();
+    g_ptr_array_add (pool->templates, template);
+    return TRUE;
+}
+/*
+ * Create a copy of the Create command of the first template with room for
+ * another key, not associated with any connection. Its key is returned
+ * through 'key'. The caller must release both references. NULL is
+ * returned if the pool is full.
+ */
+Tpm2Command*
+key_pool_template_command (KeyPool  *pool,
+                           GBytes  **key)
+{
+    key_pool_template_t *template;
+    guint8 *buf;
+    gsize size;
+    guint i;
+
+    for (i = 0; i < pool->templates->len; ++i) {
+        template = g_ptr_array_index (pool->templates, i);
+        if (g_queue_get_length (template->responses) < template->size) {
+            break;
+        }
+    }
+    if (i == pool->templates->len) {
+        return NULL;
+    }
+    size = g_bytes_get_size (template->command);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (template->command, NULL), size);
+    *key = g_bytes_ref (template->key);
+    return tpm2_command_new (NULL, buf, size, KEY_POOL_CREATE_ATTRS);
+}
+/*
+ * Add the 'response' the TPM sent for the Create command of the template
+ * with the provided key to the pool. Nothing is added and FALSE is
+ * returned if there's no such template or it has no room left.
+ */
+gboolean
+key_pool_add (KeyPool *pool,
+              GBytes  *key,
+              GBytes  *response)
+{
+    key_pool_template_t *template;
+
+    template = key_pool_find (pool, key);
+    if (template == NULL ||
+        g_queue_get_length (template->responses) >= template->size)
+    {
+        return FALSE;
+    }
+    g_queue_push_tail (template->responses, g_bytes_ref (response));
+    return TRUE;
+}
+/*
+ * Take the oldest pooled key for the provided key out of the pool: the
+ * response to the Create command that created it. The caller must release
+ * the reference. NULL is returned if no key is pooled for it.
+ */
+GBytes*
+key_pool_take (KeyPool *pool,
+               GBytes  *key)
+{
+    key_pool_template_t *template;
+
+    template = key_pool_find (pool, key);
+    if (template == NULL) {
+        return NULL;
+    }
+    return g_queue_pop_head (template->responses);
+}
+/*
+ * Drop all pooled keys, keeping the templates. This is for when the
+ * parents may have changed and the pooled keys may no longer load.
+ */
+void
+key_pool_forget (KeyPool *pool)
+{
+    key_pool_template_t *template;
+    GBytes *response;
+    guint i;
+
+    for (i = 0; i < pool->templates->len; ++i) {
+        template = g_ptr_array_index (pool->templates, i);
+        while ((response = g_queue_pop_head (template->responses)) != NULL) {
+            g_bytes_unref (response);
+        }
+    }
+}
+/*
+ * The number of pooled keys and the number more the pool has room for,
+ * over all templates.
+ */
+guint
+key_pool_get_level (KeyPool *pool)
+{
+    key_pool_template_t *template;
+    guint i, level = 0;
+
+    for (i = 0; i < pool->templates->len; ++i) {
+        template = g_ptr_array_index (pool->templates, i);
+        level += g_queue_get_length (template->responses);
+    }
+    return level;
+}
+guint
+key_pool_get_space (KeyPool *pool)
+{
+    key_pool_template_t *template;
+    guint i, space = 0;
+
+    for (i = 0; i < pool->templates->len; ++i) {
+        template = g_ptr_array_index (pool->templates, i);
+        space += template->size - g_queue_get_length (template->responses);
+    }
+    return space;
+}
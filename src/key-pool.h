@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef KEY_POOL_H
+#define KEY_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define KEY_POOL_SIZE_DEFAULT 1
+#define KEY_POOL_SIZE_MAX     16
+#define KEY_POOL_KEY_COMMAND  "command"
+#define KEY_POOL_KEY_SIZE     "size"
+/* TPMA_CC for Create: one handle, the parent */
+#define KEY_POOL_CREATE_ATTRS 0x02000153
+
+/*
+ * The KeyPool holds keys created by the ResourceManager while it has
+ * nothing else to do, from a set of configured Create commands, the
+ * 'templates'. A Create identical to one of the templates, same parent,
+ * sensitive data and public area, is answered with the response the TPM
+ * sent for one of the pooled keys. The response holds the whole key,
+ * private part wrapped by the parent, so nothing is kept in the TPM and
+ * each pooled key is handed out once.
+ */
+typedef struct _KeyPoolClass {
+    GObjectClass      parent;
+} KeyPoolClass;
+
+typedef struct _KeyPool {
+    GObject           parent_instance;
+    GPtrArray        *templates;
+} KeyPool;
+
+#define TYPE_KEY_POOL              (key_pool_get_type   ())
+#define KEY_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_KEY_POOL, KeyPool))
+#define KEY_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_KEY_POOL, KeyPoolClass))
+#define IS_KEY_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_KEY_POOL))
+#define IS_KEY_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_KEY_POOL))
+#define KEY_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_KEY_POOL, KeyPoolClass))
+
+GType            key_pool_get_type         (void);
+KeyPool*         key_pool_new              (void);
+KeyPool*         key_pool_load             (const gchar      *path);
+GBytes*          key_pool_key              (Tpm2Command      *command);
+gboolean         key_pool_add_template     (KeyPool          *pool,
+                                            GBytes           *command,
+                                            guint             size);
+Tpm2Command*     key_pool_template_command (KeyPool          *pool,
+                                            GBytes          **key);
+gboolean         key_pool_add              (KeyPool          *pool,
+                                            GBytes           *key,
+                                            GBytes           *response);
+GBytes*          key_pool_take             (KeyPool          *pool,
+                                            GBytes           *key);
+void             key_pool_forget           (KeyPool          *pool);
+guint            key_pool_get_level        (KeyPool          *pool);
+guint            key_pool_get_space        (KeyPool          *pool);
+
+G_END_DECLS
+#endif /* KEY_POOL_H */
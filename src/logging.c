@@ -4,48 +4,235 @@
  * All rights reserved.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include "util.h"
 #include "logging.h"
 
-/**
- * This function that implements the GLogFunc prototype. It is intended
- * for use as a log handler function for glib logging.
+/*
+ * The ring the syslog logger drains, 'logger_thread' is NULL while
+ * messages are written synchronously.
  */
+static log_ring_t log_ring;
+static GThread *logger_thread = NULL;
+static gint logger_running = 0;
+static gint logger_sleeping = 0;
+static GMutex logger_mutex;
+static GCond logger_cond;
+
 void
-syslog_log_handler (const char     *log_domain,
-                    GLogLevelFlags  log_level,
-                    const char     *message,
-                    gpointer        log_config_list)
+log_ring_init (log_ring_t *ring)
 {
-    UNUSED_PARAM(log_domain);
-    UNUSED_PARAM(log_config_list);
+    guint i;
+
+    for (i = 0; i < LOG_RING_SIZE; ++i) {
+        g_atomic_int_set (&ring->slots [i].sequence, (gint)i);
+    }
+    g_atomic_int_set (&ring->head, 0);
+    ring->tail = 0;
+    g_atomic_int_set (&ring->dropped, 0);
+}
+/*
+ * Copy a message in to the ring without taking a lock. Any thread may
+ * call this. Returns FALSE and counts the message as dropped if the ring
+ * is full.
+ */
+gboolean
+log_ring_push (log_ring_t *ring,
+               gint        priority,
+               const char *message)
+{
+    log_slot_t *slot;
+    guint pos, sequence;
+
+    pos = (guint)g_atomic_int_get (&ring->head);
+    for (;;) {
+        slot = &ring->slots [pos % LOG_RING_SIZE];
+        sequence = (guint)g_atomic_int_get (&slot->sequence);
+        if (sequence == pos) {
+            if (g_atomic_int_compare_and_exchange (&ring->head,
+                                                   (gint)pos,
+                                                   (gint)(pos + 1)))
+            {
+                break;
+            }
+            pos = (guint)g_atomic_int_get (&ring->head);
+        } else if ((gint)(sequence - pos) < 0) {
+            /* still holding the message from LOG_RING_SIZE pushes ago */
+            g_atomic_int_inc (&ring->dropped);
+            return FALSE;
+        } else {
+            pos = (guint)g_atomic_int_get (&ring->head);
+        }
+    }
+    slot->priority = priority;
+    g_strlcpy (slot->message, message, LOG_MESSAGE_MAX);
+    g_atomic_int_set (&slot->sequence, (gint)(pos + 1));
+    return TRUE;
+}
+/*
+ * Take the oldest message from the ring. Only one thread may call this.
+ * 'message' must have room for LOG_MESSAGE_MAX characters. Returns FALSE
+ * if the ring is empty.
+ */
+gboolean
+log_ring_pop (log_ring_t *ring,
+              gint       *priority,
+              gchar      *message)
+{
+    guint pos = (guint)ring->tail;
+    log_slot_t *slot = &ring->slots [pos % LOG_RING_SIZE];
+
+    if ((guint)g_atomic_int_get (&slot->sequence) != pos + 1) {
+        return FALSE;
+    }
+    *priority = slot->priority;
+    memcpy (message, slot->message, LOG_MESSAGE_MAX);
+    g_atomic_int_set (&slot->sequence, (gint)(pos + LOG_RING_SIZE));
+    ring->tail = (gint)(pos + 1);
+    return TRUE;
+}
+guint
+logging_get_dropped (void)
+{
+    return (guint)g_atomic_int_get (&log_ring.dropped);
+}
+/*
+ * The logger thread writes the messages from the ring to syslog and
+ * reports the ones that were dropped. It only sleeps once the ring is
+ * empty, producers seeing 'logger_sleeping' wake it up. The timeout
+ * covers the report of messages dropped while it sleeps.
+ */
+static gpointer
+logger_thread_func (gpointer data)
+{
+    gchar message [LOG_MESSAGE_MAX];
+    guint reported = 0, dropped;
+    gint priority;
+    log_slot_t *slot;
+    UNUSED_PARAM(data);
+
+    for (;;) {
+        while (log_ring_pop (&log_ring, &priority, message)) {
+            syslog (priority, "%s", message);
+        }
+        dropped = logging_get_dropped ();
+        if (dropped != reported) {
+            syslog (LOG_WARNING, "%u log messages dropped", dropped - reported);
+            reported = dropped;
+        }
+        if (!g_atomic_int_get (&logger_running)) {
+            break;
+        }
+        slot = &log_ring.slots [(guint)log_ring.tail % LOG_RING_SIZE];
+        g_mutex_lock (&logger_mutex);
+        g_atomic_int_set (&logger_sleeping, 1);
+        if ((guint)g_atomic_int_get (&slot->sequence) != (guint)log_ring.tail + 1 &&
+            g_atomic_int_get (&logger_running))
+        {
+            g_cond_wait_until (&logger_cond,
+                               &logger_mutex,
+                               g_get_monotonic_time () + G_TIME_SPAN_SECOND);
+        }
+        g_atomic_int_set (&logger_sleeping, 0);
+        g_mutex_unlock (&logger_mutex);
+    }
+    return NULL;
+}
+static void
+logger_wake (void)
+{
+    if (g_atomic_int_get (&logger_sleeping)) {
+        g_mutex_lock (&logger_mutex);
+        g_cond_signal (&logger_cond);
+        g_mutex_unlock (&logger_mutex);
+    }
+}
+/*
+ * Start the logger thread, from then on syslog_log_handler queues the
+ * messages.
+ */
+void
+logging_start (void)
+{
+    if (logger_thread != NULL) {
+        return;
+    }
+    log_ring_init (&log_ring);
+    g_atomic_int_set (&logger_running, 1);
+    logger_thread = g_thread_new ("logger", logger_thread_func, NULL);
+}
+/*
+ * Write out the messages still queued and join the logger thread. The
+ * messages logged after this are written synchronously.
+ */
+void
+logging_stop (void)
+{
+    gchar message [LOG_MESSAGE_MAX];
+    gint priority;
 
+    if (logger_thread == NULL) {
+        return;
+    }
+    g_mutex_lock (&logger_mutex);
+    g_atomic_int_set (&logger_running, 0);
+    g_cond_signal (&logger_cond);
+    g_mutex_unlock (&logger_mutex);
+    g_thread_join (logger_thread);
+    logger_thread = NULL;
+    /* anything that raced with the thread exiting */
+    while (log_ring_pop (&log_ring, &priority, message)) {
+        syslog (priority, "%s", message);
+    }
+}
+static int
+log_level_to_priority (GLogLevelFlags log_level)
+{
     switch (log_level) {
     case G_LOG_FLAG_FATAL:
-        syslog (LOG_ALERT, "%s", message);
-        break;
+        return LOG_ALERT;
     case G_LOG_LEVEL_ERROR:
-        syslog (LOG_ERR, "%s", message);
-        break;
+        return LOG_ERR;
     case G_LOG_LEVEL_CRITICAL:
-        syslog (LOG_CRIT, "%s", message);
-        break;
+        return LOG_CRIT;
     case G_LOG_LEVEL_WARNING:
-        syslog (LOG_WARNING, "%s", message);
-        break;
+        return LOG_WARNING;
     case G_LOG_LEVEL_MESSAGE:
-        syslog (LOG_NOTICE, "%s", message);
-        break;
+        return LOG_NOTICE;
     case G_LOG_LEVEL_INFO:
-        syslog (LOG_INFO, "%s", message);
-        break;
+        return LOG_INFO;
     case G_LOG_LEVEL_DEBUG:
-        syslog (LOG_DEBUG, "%s", message);
-        break;
+        return LOG_DEBUG;
     default:
-        syslog (LOG_INFO, "%s", message);
+        return LOG_INFO;
+    }
+}
+/**
+ * This function that implements the GLogFunc prototype. It is intended
+ * for use as a log handler function for glib logging. Once the logger
+ * thread is running messages are queued for it, except for errors and
+ * fatal messages: glib aborts right after logging those.
+ */
+void
+syslog_log_handler (const char     *log_domain,
+                    GLogLevelFlags  log_level,
+                    const char     *message,
+                    gpointer        log_config_list)
+{
+    int priority = log_level_to_priority (log_level);
+    UNUSED_PARAM(log_domain);
+    UNUSED_PARAM(log_config_list);
+
+    if (!(log_level & (G_LOG_FLAG_FATAL | G_LOG_LEVEL_ERROR)) &&
+        g_atomic_int_get (&logger_running))
+    {
+        if (log_ring_push (&log_ring, priority, message)) {
+            logger_wake ();
+        }
+        return;
     }
+    syslog (priority, "%s", message);
 }
 /*
  * The G_MESSAGES_DEBUG environment variable is a space separated list of
@@ -84,6 +271,7 @@ set_logger (gchar *name)
                            G_LOG_FLAG_RECURSION,
                            syslog_log_handler,
                            NULL);
+        logging_start ();
         return 0;
     } else if (g_strcmp0 (name, "stdout") == 0) {
         /* stdout is the default for g_log, nothing to do but return 0 */
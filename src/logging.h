@@ -12,6 +12,7 @@
 #define tabrmd_critical(fmt, ...) \
     do { \
         g_critical (fmt, ##__VA_ARGS__); \
+        logging_stop (); \
         exit (EXIT_FAILURE); \
     } while (0)
 
@@ -20,6 +21,38 @@
 #define LOG_LEVEL_ALL     (LOG_LEVEL_DEFAULT | G_LOG_LEVEL_MESSAGE | \
                            G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)
 
+/*
+ * The syslog logger hands messages to a thread of its own through a
+ * bounded ring so that a backlogged syslog never holds up the thread
+ * logging. Producers claim a slot with a compare and swap of 'head' and
+ * publish it by bumping the 'sequence' of the slot, the logger thread is
+ * the only consumer. When the ring is full the message is dropped and
+ * counted. Messages longer than LOG_MESSAGE_MAX are truncated.
+ */
+#define LOG_RING_SIZE   256
+#define LOG_MESSAGE_MAX 512
+typedef struct {
+    gint                sequence;
+    gint                priority;
+    gchar               message [LOG_MESSAGE_MAX];
+} log_slot_t;
+typedef struct {
+    log_slot_t          slots [LOG_RING_SIZE];
+    gint                head;
+    gint                tail;
+    gint                dropped;
+} log_ring_t;
+
+void     log_ring_init   (log_ring_t     *ring);
+gboolean log_ring_push   (log_ring_t     *ring,
+                          gint            priority,
+                          const char     *message);
+gboolean log_ring_pop    (log_ring_t     *ring,
+                          gint           *priority,
+                          gchar          *message);
+guint    logging_get_dropped (void);
+void     logging_start   (void);
+void     logging_stop    (void);
 void
 syslog_log_handler (const char     *log_domain,
                     GLogLevelFlags  log_level,
@@ -10,10 +10,57 @@
 #include <string.h>
 
 #include "message-queue.h"
+#include "probes.h"
 #include "util.h"
 
 G_DEFINE_TYPE (MessageQueue, message_queue, G_TYPE_OBJECT);
 
+/*
+ * A share groups the flows of a fair MessageQueue that divide the time of
+ * the consumer between them, see message_queue_set_share_func.
+ * 'flows'   : the flows of the share that hold messages
+ * 'weight'  : the weight of the share
+ * 'vtime'   : the time charged to the share divided by its weight
+ * 'pending' : the estimated time of the messages dequeued and not yet
+ *             charged, divided by the weight
+ */
+typedef struct {
+    guint     flows;
+    guint     weight;
+    gdouble   vtime;
+    gdouble   pending;
+} message_queue_share_t;
+/*
+ * A flow is the sub-queue holding the messages with the same key in a fair
+ * MessageQueue. A flow only exists while it holds messages and is then on
+ * the list of active flows.
+ * 'deficit' : the cost this flow may still spend this round
+ * 'granted' : the quantum has been added to 'deficit' for the current turn
+ * 'class'   : the priority class of the flow
+ * 'waiting' : time the flow started waiting for its turn
+ * 'share'   : the share the flow belongs to, NULL if none
+ */
+typedef struct {
+    gpointer  key;
+    guint     class;
+    GQueue   *messages;
+    guint     deficit;
+    gboolean  granted;
+    gint64    waiting;
+    message_queue_share_t *share;
+} message_queue_flow_t;
+
+static void
+message_queue_flow_free (gpointer data)
+{
+    message_queue_flow_t *flow = (message_queue_flow_t*)data;
+
+    if (flow->share != NULL) {
+        --flow->share->flows;
+    }
+    g_queue_free_full (flow->messages, g_object_unref);
+    g_free (flow);
+}
 /**
  * The init function is a noop but it's required by the G_DEFINE_TYPE
  * macro.
@@ -21,20 +68,56 @@ G_DEFINE_TYPE (MessageQueue, message_queue, G_TYPE_OBJECT);
 static void
 message_queue_init (MessageQueue *self)
 {
+    size_t i;
+
     self->queue = g_async_queue_new_full (g_object_unref);
+    g_mutex_init (&self->mutex);
+    g_cond_init (&self->cond);
+    self->flows = g_hash_table_new_full (g_direct_hash,
+                                         g_direct_equal,
+                                         NULL,
+                                         message_queue_flow_free);
+    self->shares = g_hash_table_new_full (g_direct_hash,
+                                          g_direct_equal,
+                                          NULL,
+                                          g_free);
+    for (i = 0; i < MESSAGE_QUEUE_CLASSES; ++i) {
+        self->active_flows [i] = g_queue_new ();
+    }
+    self->urgent = g_queue_new ();
 }
 /*
  * To finalize the MessageQueue we need only to unref the internal
- * GAsyncQueue object.
+ * GAsyncQueue object and free the flows of a fair queue.
  */
 static void
 message_queue_dispose (GObject *obj)
 {
     MessageQueue *message_queue = MESSAGE_QUEUE (obj);
+    size_t i;
 
     g_clear_pointer (&message_queue->queue, g_async_queue_unref);
+    for (i = 0; i < MESSAGE_QUEUE_CLASSES; ++i) {
+        g_clear_pointer (&message_queue->active_flows [i], g_queue_free);
+    }
+    if (message_queue->urgent != NULL) {
+        g_queue_free_full (message_queue->urgent, g_object_unref);
+        message_queue->urgent = NULL;
+    }
+    /* the flows point to their share */
+    g_clear_pointer (&message_queue->flows, g_hash_table_unref);
+    g_clear_pointer (&message_queue->shares, g_hash_table_unref);
     G_OBJECT_CLASS (message_queue_parent_class)->dispose (obj);
 }
+static void
+message_queue_finalize (GObject *obj)
+{
+    MessageQueue *message_queue = MESSAGE_QUEUE (obj);
+
+    g_mutex_clear (&message_queue->mutex);
+    g_cond_clear (&message_queue->cond);
+    G_OBJECT_CLASS (message_queue_parent_class)->finalize (obj);
+}
 /**
  * Boilerplate GObject class init with custom dispose function.
  */
@@ -44,6 +127,7 @@ message_queue_class_init (MessageQueueClass *klass)
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
 
     object_class->dispose = message_queue_dispose;
+    object_class->finalize = message_queue_finalize;
 }
 /**
  * Allocate a new message_queue_t object.
@@ -56,19 +140,504 @@ message_queue_new ()
 {
     return MESSAGE_QUEUE (g_object_new (TYPE_MESSAGE_QUEUE, NULL));
 }
+/*
+ * Allocate a new MessageQueue that dequeues messages fairly between flows
+ * instead of in FIFO order. Messages are assigned to a flow by 'key_func'
+ * and the flows are served by deficit round robin: each flow may dequeue
+ * messages worth 'quantum' (as computed by 'cost_func') per turn before the
+ * next flow gets its turn. Messages in the same flow stay in FIFO order.
+ */
+MessageQueue*
+message_queue_new_fair (MessageQueueKeyFunc  key_func,
+                        MessageQueueCostFunc cost_func,
+                        guint                quantum)
+{
+    MessageQueue *message_queue;
+
+    g_assert (key_func != NULL);
+    message_queue = message_queue_new ();
+    message_queue->key_func = key_func;
+    message_queue->cost_func = cost_func;
+    message_queue->quantum = MAX (quantum, 1);
+
+    return message_queue;
+}
+/*
+ * Assign the flows of a fair MessageQueue to priority classes using
+ * 'class_func'. Flows in class 0 are always served first. The remaining
+ * classes are served in order of priority too, but a class that has been
+ * passed over 'share' times in a row while it had messages waiting gets
+ * the next turn. Each lower priority class is thus guaranteed roughly
+ * 1 / (share + 1) of the dequeues when there's contention, and no more.
+ * A 'share' of 0 disables this and lower classes may starve.
+ * This must be called before any messages are enqueued.
+ */
+void
+message_queue_set_class_func (MessageQueue          *message_queue,
+                              MessageQueueClassFunc  class_func,
+                              guint                  share)
+{
+    g_assert (message_queue->key_func != NULL);
+    message_queue->class_func = class_func;
+    message_queue->class_share = share;
+}
+/*
+ * Order the turns of the flows in each class by expected execution time,
+ * see message_queue_fair_pick_turn. 'estimate_func' returns the expected
+ * time in microseconds to process a message and is passed 'user_data'.
+ * This must be called before any messages are enqueued.
+ */
+void
+message_queue_set_estimate_func (MessageQueue             *message_queue,
+                                 MessageQueueEstimateFunc  estimate_func,
+                                 gpointer                  user_data)
+{
+    g_assert (message_queue->key_func != NULL);
+    message_queue->estimate_func = estimate_func;
+    message_queue->estimate_data = user_data;
+}
+/*
+ * Divide the time of the consumer between shares of flows in proportion
+ * to their weights. 'share_func' maps a message to its share when its
+ * flow is created, and the consumer reports the time each message took
+ * with message_queue_charge. Within a priority class the turn goes to a
+ * flow of the share with the least time charged per unit of weight, the
+ * order of the flows of that share is kept. This only matters while
+ * several shares have messages: a share that's idle doesn't hold on to its
+ * part, and once it has messages again it starts from the time of the
+ * busy shares rather than from the time it saved up while idle. Messages
+ * outside of any share, like control messages, go first.
+ * This must be called before any messages are enqueued.
+ */
+void
+message_queue_set_share_func (MessageQueue          *message_queue,
+                              MessageQueueShareFunc  share_func,
+                              gpointer               user_data)
+{
+    g_assert (message_queue->key_func != NULL);
+    message_queue->share_func = share_func;
+    message_queue->share_data = user_data;
+}
+/*
+ * Give the messages 'urgent_func' returns TRUE for a lane of their own
+ * that is dequeued before any flow, whatever its class, share or turn.
+ * This is for control messages that let the consumer drop work, like the
+ * removal of a connection. A message only takes the lane if no message
+ * with its key is queued in a flow, so the messages with the same key
+ * still come out in the order they were enqueued.
+ * This must be called before any messages are enqueued.
+ */
+void
+message_queue_set_urgent_func (MessageQueue           *message_queue,
+                               MessageQueueUrgentFunc  urgent_func)
+{
+    g_assert (message_queue->key_func != NULL);
+    message_queue->urgent_func = urgent_func;
+}
+/*
+ * GHRFunc forgetting the shares that are idle and that have no time to
+ * make up. The caller must hold the mutex.
+ */
+static gboolean
+message_queue_share_is_idle (gpointer key,
+                             gpointer value,
+                             gpointer user_data)
+{
+    message_queue_share_t *share = (message_queue_share_t*)value;
+    MessageQueue *message_queue = MESSAGE_QUEUE (user_data);
+    UNUSED_PARAM(key);
+
+    return share->flows == 0 && share->vtime <= message_queue->vclock;
+}
+/*
+ * Get the share for the new flow of 'object', creating it if necessary.
+ * A share that was idle catches up with the virtual clock. Returns NULL
+ * if the message belongs to no share. The caller must hold the mutex.
+ */
+static message_queue_share_t*
+message_queue_share_get (MessageQueue *message_queue,
+                         GObject      *object)
+{
+    message_queue_share_t *share;
+    guint32 id;
+    guint weight = 1;
+
+    if (message_queue->share_func == NULL ||
+        !message_queue->share_func (object,
+                                    &id,
+                                    &weight,
+                                    message_queue->share_data))
+    {
+        return NULL;
+    }
+    share = g_hash_table_lookup (message_queue->shares, GUINT_TO_POINTER (id));
+    if (share == NULL) {
+        if (g_hash_table_size (message_queue->shares) >= MESSAGE_QUEUE_SHARES_MAX) {
+            g_hash_table_foreach_remove (message_queue->shares,
+                                         message_queue_share_is_idle,
+                                         message_queue);
+        }
+        share = g_new0 (message_queue_share_t, 1);
+        g_hash_table_insert (message_queue->shares,
+                             GUINT_TO_POINTER (id),
+                             share);
+    }
+    share->weight = MAX (weight, 1);
+    if (share->flows == 0) {
+        share->vtime = MAX (share->vtime, message_queue->vclock);
+        share->pending = 0;
+    }
+    ++share->flows;
+    return share;
+}
+/*
+ * The virtual time a share is served in order of, with the time of the
+ * messages it has been given and that haven't been charged yet.
+ */
+static gdouble
+message_queue_share_time (message_queue_share_t *share)
+{
+    return share->vtime + share->pending;
+}
+/*
+ * Add a message to the tail of its flow, creating the flow if necessary.
+ * New flows go to the tail of the list of active flows. The caller must
+ * hold the mutex.
+ */
+static void
+message_queue_fair_push (MessageQueue *message_queue,
+                         GObject      *object)
+{
+    message_queue_flow_t *flow;
+    gpointer key;
+
+    key = message_queue->key_func (object);
+    flow = g_hash_table_lookup (message_queue->flows, key);
+    if (flow == NULL &&
+        message_queue->urgent_func != NULL &&
+        message_queue->urgent_func (object))
+    {
+        g_queue_push_tail (message_queue->urgent, object);
+        ++message_queue->length;
+        return;
+    }
+    if (flow == NULL) {
+        flow = g_new0 (message_queue_flow_t, 1);
+        flow->key = key;
+        flow->messages = g_queue_new ();
+        flow->waiting = g_get_monotonic_time ();
+        flow->share = message_queue_share_get (message_queue, object);
+        if (message_queue->class_func != NULL) {
+            flow->class = MIN (message_queue->class_func (object),
+                               MESSAGE_QUEUE_CLASSES - 1);
+        }
+        g_hash_table_insert (message_queue->flows, key, flow);
+        g_queue_push_tail (message_queue->active_flows [flow->class], flow);
+    }
+    g_queue_push_tail (flow->messages, object);
+    ++message_queue->length;
+}
+/*
+ * Returns TRUE if neither the urgent lane nor any flow in any class has
+ * messages. The caller must hold the mutex.
+ */
+static gboolean
+message_queue_fair_is_empty (MessageQueue *message_queue)
+{
+    size_t i;
+
+    if (!g_queue_is_empty (message_queue->urgent)) {
+        return FALSE;
+    }
+    for (i = 0; i < MESSAGE_QUEUE_CLASSES; ++i) {
+        if (!g_queue_is_empty (message_queue->active_flows [i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+/*
+ * Select the priority class that is dequeued from next. Class 0 has strict
+ * priority. Otherwise the highest priority class with messages is chosen
+ * unless a lower one has been passed over 'class_share' times. The skip
+ * count of every waiting class with lower priority than the one selected
+ * is incremented. The caller must hold the mutex and the queue must not be
+ * empty.
+ */
+static GQueue*
+message_queue_fair_select (MessageQueue *message_queue)
+{
+    size_t i, selected = MESSAGE_QUEUE_CLASSES;
+
+    if (!g_queue_is_empty (message_queue->active_flows [0])) {
+        return message_queue->active_flows [0];
+    }
+    for (i = 1; i < MESSAGE_QUEUE_CLASSES; ++i) {
+        if (g_queue_is_empty (message_queue->active_flows [i])) {
+            continue;
+        }
+        if (selected == MESSAGE_QUEUE_CLASSES ||
+            (message_queue->class_share > 0 &&
+             message_queue->skipped [i] >= message_queue->class_share))
+        {
+            selected = i;
+        }
+    }
+    g_assert (selected < MESSAGE_QUEUE_CLASSES);
+    message_queue->skipped [selected] = 0;
+    for (i = selected + 1; i < MESSAGE_QUEUE_CLASSES; ++i) {
+        if (!g_queue_is_empty (message_queue->active_flows [i])) {
+            message_queue->skipped [i]++;
+        }
+    }
+    return message_queue->active_flows [selected];
+}
+/*
+ * The share whose flows get the next turn among 'active_flows': none if a
+ * flow outside of the shares is waiting, else the one with the least
+ * virtual time. The caller must hold the mutex.
+ */
+static message_queue_share_t*
+message_queue_fair_pick_share (GQueue *active_flows)
+{
+    message_queue_flow_t *flow;
+    message_queue_share_t *best = NULL;
+    GList *link;
+
+    for (link = active_flows->head; link != NULL; link = link->next) {
+        flow = (message_queue_flow_t*)link->data;
+        if (flow->share == NULL) {
+            return NULL;
+        }
+        if (best == NULL ||
+            message_queue_share_time (flow->share) <
+            message_queue_share_time (best))
+        {
+            best = flow->share;
+        }
+    }
+    return best;
+}
+/*
+ * Move the flow that should get the next turn to the head of the list of
+ * active flows. Only the flows in 'share' are considered, which is all of
+ * them without shares. Without an estimate function this is the first
+ * one. Otherwise it's the flow with the highest response ratio:
+ * (waiting time + expected time) / expected time, where the expected time
+ * is the estimate for the message at the head of the flow. Short jobs are
+ * favored but the ratio of every flow grows while it waits so long jobs
+ * can't starve. The caller must hold the mutex.
+ */
+static void
+message_queue_fair_pick_turn (MessageQueue          *message_queue,
+                              GQueue                *active_flows,
+                              message_queue_share_t *share)
+{
+    message_queue_flow_t *flow;
+    GList *link, *best = NULL;
+    gdouble ratio, best_ratio = 0;
+    gint64 now = g_get_monotonic_time ();
+    guint64 estimate;
+
+    for (link = active_flows->head; link != NULL; link = link->next) {
+        flow = (message_queue_flow_t*)link->data;
+        if (flow->share != share) {
+            continue;
+        }
+        if (message_queue->estimate_func == NULL) {
+            best = link;
+            break;
+        }
+        estimate = message_queue->estimate_func (
+            g_queue_peek_head (flow->messages),
+            message_queue->estimate_data);
+        estimate = MAX (estimate, 1);
+        ratio = (gdouble)(now - flow->waiting + estimate) / estimate;
+        if (best == NULL || ratio > best_ratio) {
+            best = link;
+            best_ratio = ratio;
+        }
+    }
+    if (best != NULL && best != active_flows->head) {
+        g_queue_unlink (active_flows, best);
+        g_queue_push_head_link (active_flows, best);
+    }
+}
+/*
+ * Account for 'obj' being dequeued from 'flow': its share is served in
+ * the order of the time it's expected to take until the consumer charges
+ * the time it took. The caller must hold the mutex.
+ */
+static void
+message_queue_fair_note_pop (MessageQueue         *message_queue,
+                             message_queue_flow_t *flow,
+                             GObject              *obj)
+{
+    message_queue_share_t *share = flow->share;
+
+    if (share == NULL) {
+        return;
+    }
+    message_queue->vclock = MAX (message_queue->vclock, share->vtime);
+    if (message_queue->estimate_func != NULL) {
+        share->pending += (gdouble)message_queue->estimate_func (
+                              obj,
+                              message_queue->estimate_data) / share->weight;
+    }
+}
+/*
+ * Charge the share of 'obj' for the 'cost_us' microseconds the consumer
+ * spent on it, see message_queue_set_share_func. This replaces the
+ * estimate the share was given for it when it was dequeued.
+ */
+void
+message_queue_charge (MessageQueue *message_queue,
+                      GObject      *obj,
+                      guint64       cost_us)
+{
+    message_queue_share_t *share;
+    guint32 id;
+    guint weight = 1;
+    gdouble estimate = 0;
+
+    g_assert (message_queue != NULL);
+    if (message_queue->share_func == NULL ||
+        !message_queue->share_func (obj,
+                                    &id,
+                                    &weight,
+                                    message_queue->share_data))
+    {
+        return;
+    }
+    if (message_queue->estimate_func != NULL) {
+        estimate = message_queue->estimate_func (obj,
+                                                 message_queue->estimate_data);
+    }
+    g_mutex_lock (&message_queue->mutex);
+    share = g_hash_table_lookup (message_queue->shares, GUINT_TO_POINTER (id));
+    if (share != NULL) {
+        share->pending = MAX (share->pending - estimate / share->weight, 0);
+        share->vtime += (gdouble)cost_us / share->weight;
+    }
+    g_mutex_unlock (&message_queue->mutex);
+}
+/*
+ * Take the next message from the active flows by deficit round robin. The
+ * flow at the head of the list gets its quantum once per turn and keeps
+ * the turn while it can pay for its next message. Otherwise it goes to the
+ * tail of the list. If an estimate function or shares are set the order
+ * of the turns is picked by message_queue_fair_pick_turn instead, among the
+ * flows of the share picked by message_queue_fair_pick_share. A flow that
+ * runs out of messages is removed and its deficit is lost. Messages in
+ * the urgent lane go before all of this. The caller must hold the mutex
+ * and the queue must not be empty.
+ */
+static GObject*
+message_queue_fair_pop (MessageQueue *message_queue)
+{
+    message_queue_flow_t *flow;
+    GQueue *active_flows;
+    GObject *obj;
+    guint cost;
+
+    if (!g_queue_is_empty (message_queue->urgent)) {
+        --message_queue->length;
+        return g_queue_pop_head (message_queue->urgent);
+    }
+    active_flows = message_queue_fair_select (message_queue);
+    for (;;) {
+        flow = g_queue_peek_head (active_flows);
+        if (!flow->granted &&
+            (message_queue->estimate_func != NULL ||
+             message_queue->share_func != NULL))
+        {
+            message_queue_fair_pick_turn (
+                message_queue,
+                active_flows,
+                message_queue_fair_pick_share (active_flows));
+            flow = g_queue_peek_head (active_flows);
+        }
+        obj = g_queue_peek_head (flow->messages);
+        cost = message_queue->cost_func != NULL ?
+            message_queue->cost_func (obj) : 1;
+        if (!flow->granted) {
+            flow->deficit += message_queue->quantum;
+            flow->granted = TRUE;
+        }
+        if (flow->deficit >= cost) {
+            break;
+        }
+        flow->granted = FALSE;
+        flow->waiting = g_get_monotonic_time ();
+        g_queue_push_tail (active_flows, g_queue_pop_head (active_flows));
+    }
+    g_queue_pop_head (flow->messages);
+    --message_queue->length;
+    flow->deficit -= cost;
+    message_queue_fair_note_pop (message_queue, flow, obj);
+    if (g_queue_is_empty (flow->messages)) {
+        g_queue_pop_head (active_flows);
+        g_hash_table_remove (message_queue->flows, flow->key);
+    }
+
+    return obj;
+}
+/*
+ * Raise the high-water mark to 'length' if it's below it.
+ */
+static void
+message_queue_note_length (MessageQueue *message_queue,
+                           gint          length)
+{
+    gint high_water;
+
+    do {
+        high_water = g_atomic_int_get (&message_queue->high_water);
+        if (length <= high_water) {
+            return;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&message_queue->high_water,
+                                                 high_water,
+                                                 length));
+}
 /**
  * Enqueue a blob in the blob_queue_t.
  * This function is a thin wrapper around the GQueue. When we enqueue blobs
  * we push them to the head of the queue.
+ * A fair queue has a single consumer that only waits while the queue is
+ * empty, so the condition is only signaled when the first message arrives.
+ * Producers that add to a non-empty queue don't make a futex call, unless
+ * the consumer waits for the key of their message.
  */
 void
 message_queue_enqueue (MessageQueue  *message_queue,
                        GObject       *object)
 {
+    gboolean was_empty, wanted = FALSE;
+    gpointer key;
+
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
+    TABRMD_PROBE2 (queue_enqueue, message_queue, object);
     g_object_ref (object);
-    g_async_queue_push (message_queue->queue, object);
+    if (message_queue->key_func == NULL) {
+        g_async_queue_push (message_queue->queue, object);
+        message_queue_note_length (message_queue,
+                                   g_async_queue_length (message_queue->queue));
+        return;
+    }
+    g_mutex_lock (&message_queue->mutex);
+    was_empty = message_queue_fair_is_empty (message_queue);
+    if (message_queue->waiting_for_key) {
+        key = message_queue->key_func (object);
+        wanted = key == message_queue->waiting_key || key == NULL;
+    }
+    message_queue_fair_push (message_queue, object);
+    message_queue_note_length (message_queue, (gint)message_queue->length);
+    if (was_empty || wanted) {
+        g_cond_signal (&message_queue->cond);
+    }
+    g_mutex_unlock (&message_queue->mutex);
 }
 /**
  * Dequeue a blob from the blob_queue_t.
@@ -82,6 +651,315 @@ message_queue_dequeue (MessageQueue *message_queue)
 
     g_assert (message_queue != NULL);
     g_debug ("%s", __func__);
-    obj = g_async_queue_pop (message_queue->queue);
+    if (message_queue->key_func == NULL) {
+        obj = g_async_queue_pop (message_queue->queue);
+        TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+        return obj;
+    }
+    g_mutex_lock (&message_queue->mutex);
+    while (message_queue_fair_is_empty (message_queue)) {
+        g_cond_wait (&message_queue->cond, &message_queue->mutex);
+    }
+    obj = message_queue_fair_pop (message_queue);
+    g_mutex_unlock (&message_queue->mutex);
+    TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
     return obj;
 }
+/**
+ * Dequeue a blob from the blob_queue_t, waiting at most 'timeout'
+ * microseconds for one to arrive. Returns NULL if the timeout expires
+ * before a blob is available.
+ */
+GObject*
+message_queue_timeout_dequeue (MessageQueue *message_queue,
+                               guint64       timeout)
+{
+    GObject *obj = NULL;
+    gint64 end_time;
+
+    g_assert (message_queue != NULL);
+    g_debug ("%s", __func__);
+    if (message_queue->key_func == NULL) {
+        obj = g_async_queue_timeout_pop (message_queue->queue, timeout);
+        goto out;
+    }
+    end_time = g_get_monotonic_time () + timeout;
+    g_mutex_lock (&message_queue->mutex);
+    while (message_queue_fair_is_empty (message_queue)) {
+        if (!g_cond_wait_until (&message_queue->cond,
+                                &message_queue->mutex,
+                                end_time))
+        {
+            break;
+        }
+    }
+    if (!message_queue_fair_is_empty (message_queue)) {
+        obj = message_queue_fair_pop (message_queue);
+    }
+    g_mutex_unlock (&message_queue->mutex);
+out:
+    if (obj != NULL) {
+        TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+    }
+    return obj;
+}
+/*
+ * Dequeue up to 'max' messages in to the 'objs' array, waiting at most
+ * 'timeout' microseconds for the first one to arrive. A 'timeout' of -1
+ * waits forever. The messages are taken in the same order that repeated
+ * calls to message_queue_dequeue would return them, but the queue is
+ * locked once for the whole batch. Returns the number of messages
+ * dequeued, which is 0 only if the timeout expired. The caller owns a
+ * reference to each message returned.
+ */
+static guint
+message_queue_dequeue_batch_until (MessageQueue *message_queue,
+                                   GObject     **objs,
+                                   guint         max,
+                                   gint64        timeout)
+{
+    gint64 end_time = 0;
+    guint count = 0, i;
+
+    g_assert (message_queue != NULL);
+    g_assert (objs != NULL && max > 0);
+    if (message_queue->key_func == NULL) {
+        g_async_queue_lock (message_queue->queue);
+        if (timeout < 0) {
+            objs [count++] = g_async_queue_pop_unlocked (message_queue->queue);
+        } else {
+            objs [count] = g_async_queue_timeout_pop_unlocked (message_queue->queue,
+                                                               timeout);
+            if (objs [count] != NULL) {
+                ++count;
+            }
+        }
+        while (count > 0 && count < max) {
+            objs [count] = g_async_queue_try_pop_unlocked (message_queue->queue);
+            if (objs [count] == NULL) {
+                break;
+            }
+            ++count;
+        }
+        g_async_queue_unlock (message_queue->queue);
+        goto out;
+    }
+    if (timeout >= 0) {
+        end_time = g_get_monotonic_time () + timeout;
+    }
+    g_mutex_lock (&message_queue->mutex);
+    while (message_queue_fair_is_empty (message_queue)) {
+        if (timeout < 0) {
+            g_cond_wait (&message_queue->cond, &message_queue->mutex);
+        } else if (!g_cond_wait_until (&message_queue->cond,
+                                       &message_queue->mutex,
+                                       end_time))
+        {
+            break;
+        }
+    }
+    while (count < max && !message_queue_fair_is_empty (message_queue)) {
+        objs [count++] = message_queue_fair_pop (message_queue);
+    }
+    g_mutex_unlock (&message_queue->mutex);
+out:
+    g_debug ("%s: dequeued %u messages", __func__, count);
+    for (i = 0; i < count; ++i) {
+        TABRMD_PROBE2 (queue_dequeue, message_queue, objs [i]);
+    }
+    return count;
+}
+/*
+ * Block until at least one message is available then dequeue as many as
+ * 'max' of them. See message_queue_dequeue_batch_until.
+ */
+guint
+message_queue_dequeue_batch (MessageQueue *message_queue,
+                             GObject     **objs,
+                             guint         max)
+{
+    return message_queue_dequeue_batch_until (message_queue, objs, max, -1);
+}
+/*
+ * Like message_queue_dequeue_batch but returns 0 if no message arrives in
+ * 'timeout' microseconds.
+ */
+guint
+message_queue_timeout_dequeue_batch (MessageQueue *message_queue,
+                                     GObject     **objs,
+                                     guint         max,
+                                     guint64       timeout)
+{
+    return message_queue_dequeue_batch_until (message_queue,
+                                              objs,
+                                              max,
+                                              MIN (timeout, G_MAXINT64));
+}
+/*
+ * Pop the head of the urgent lane if it has the NULL key or 'key', else
+ * the head of the NULL flow or of the flow for 'key', NULL if none has
+ * messages. The caller must hold the mutex.
+ */
+static GObject*
+message_queue_fair_pop_key (MessageQueue *message_queue,
+                            gpointer      key)
+{
+    message_queue_flow_t *flow;
+    GObject *obj;
+    GList *link;
+
+    for (link = message_queue->urgent->head; link != NULL; link = link->next) {
+        obj = G_OBJECT (link->data);
+        if (message_queue->key_func (obj) == NULL ||
+            message_queue->key_func (obj) == key)
+        {
+            g_queue_delete_link (message_queue->urgent, link);
+            --message_queue->length;
+            return obj;
+        }
+    }
+    flow = g_hash_table_lookup (message_queue->flows, NULL);
+    if (flow == NULL) {
+        flow = g_hash_table_lookup (message_queue->flows, key);
+    }
+    if (flow == NULL) {
+        return NULL;
+    }
+    obj = g_queue_pop_head (flow->messages);
+    --message_queue->length;
+    message_queue_fair_note_pop (message_queue, flow, obj);
+    if (g_queue_is_empty (flow->messages)) {
+        g_queue_remove (message_queue->active_flows [flow->class], flow);
+        g_hash_table_remove (message_queue->flows, flow->key);
+    }
+    return obj;
+}
+/*
+ * Take the oldest message with the provided key from a fair MessageQueue
+ * out of turn, waiting at most 'timeout' microseconds for one to arrive.
+ * Messages with the NULL key, the ones that belong to no flow, are taken
+ * as well and first so that they can't be held up by a consumer waiting
+ * on a single flow. Returns NULL if the timeout expires first. This is for
+ * a consumer that has to serve one flow exclusively for a while, the turns
+ * of the other flows are left as they are.
+ */
+GObject*
+message_queue_timeout_dequeue_key (MessageQueue *message_queue,
+                                   gpointer      key,
+                                   guint64       timeout)
+{
+    GObject *obj;
+    gint64 end_time;
+
+    g_assert (message_queue != NULL);
+    g_assert (message_queue->key_func != NULL);
+    end_time = g_get_monotonic_time () + MIN (timeout, G_MAXINT64 / 2);
+    g_mutex_lock (&message_queue->mutex);
+    message_queue->waiting_key = key;
+    message_queue->waiting_for_key = TRUE;
+    while ((obj = message_queue_fair_pop_key (message_queue, key)) == NULL) {
+        if (!g_cond_wait_until (&message_queue->cond,
+                                &message_queue->mutex,
+                                end_time))
+        {
+            obj = message_queue_fair_pop_key (message_queue, key);
+            break;
+        }
+    }
+    message_queue->waiting_for_key = FALSE;
+    message_queue->waiting_key = NULL;
+    g_mutex_unlock (&message_queue->mutex);
+    if (obj != NULL) {
+        TABRMD_PROBE2 (queue_dequeue, message_queue, obj);
+    }
+    return obj;
+}
+/*
+ * Drop the messages queued with the provided key from a fair MessageQueue.
+ * This is used to discard work that's no longer wanted, like the commands
+ * from a connection that has been closed. If 'filter' is provided only the
+ * messages it returns TRUE for are dropped. It's invoked with the queue
+ * locked and must not call back in to the MessageQueue. Returns the number
+ * of messages dropped. FIFO queues don't know the key of their messages
+ * and this always returns 0 for them.
+ */
+guint
+message_queue_remove_key (MessageQueue           *message_queue,
+                          gpointer                key,
+                          MessageQueueFilterFunc  filter,
+                          gpointer                user_data)
+{
+    message_queue_flow_t *flow;
+    GList *link, *next;
+    guint count = 0;
+
+    g_assert (message_queue != NULL);
+    if (message_queue->key_func == NULL) {
+        return 0;
+    }
+    g_mutex_lock (&message_queue->mutex);
+    for (link = message_queue->urgent->head; link != NULL; link = next) {
+        next = link->next;
+        if (message_queue->key_func (G_OBJECT (link->data)) == key &&
+            (filter == NULL || filter (G_OBJECT (link->data), user_data)))
+        {
+            g_object_unref (link->data);
+            g_queue_delete_link (message_queue->urgent, link);
+            --message_queue->length;
+            ++count;
+        }
+    }
+    flow = g_hash_table_lookup (message_queue->flows, key);
+    if (flow == NULL) {
+        goto out;
+    }
+    for (link = flow->messages->head; link != NULL; link = next) {
+        next = link->next;
+        if (filter == NULL || filter (G_OBJECT (link->data), user_data)) {
+            g_object_unref (link->data);
+            g_queue_delete_link (flow->messages, link);
+            --message_queue->length;
+            ++count;
+        }
+    }
+    if (g_queue_is_empty (flow->messages)) {
+        g_queue_remove (message_queue->active_flows [flow->class], flow);
+        g_hash_table_remove (message_queue->flows, key);
+    }
+out:
+    g_mutex_unlock (&message_queue->mutex);
+    g_debug ("%s: dropped %u messages", __func__, count);
+    return count;
+}
+/*
+ * Returns the number of messages waiting in the queue. The queue may have
+ * changed by the time the caller looks at the result, this is meant for
+ * statistics.
+ */
+guint
+message_queue_get_length (MessageQueue *message_queue)
+{
+    guint length;
+    gint async_length;
+
+    g_assert (message_queue != NULL);
+    if (message_queue->key_func == NULL) {
+        /* negative while consumers are waiting on an empty queue */
+        async_length = g_async_queue_length (message_queue->queue);
+        return async_length > 0 ? (guint)async_length : 0;
+    }
+    g_mutex_lock (&message_queue->mutex);
+    length = message_queue->length;
+    g_mutex_unlock (&message_queue->mutex);
+    return length;
+}
+/*
+ * Returns the most messages the queue has held at once since it was
+ * created.
+ */
+guint
+message_queue_get_high_water (MessageQueue *message_queue)
+{
+    g_assert (message_queue != NULL);
+    return (guint)g_atomic_int_get (&message_queue->high_water);
+}
@@ -15,9 +15,88 @@ typedef struct _MessageQueueClass {
     GObjectClass parent;
 } MessageQueueClass;
 
+/*
+ * Callbacks used by a fair MessageQueue. The key function maps a message
+ * to the flow it belongs to, typically the Connection it came from. The
+ * cost function returns the cost of dispatching a message. If no cost
+ * function is provided each message costs 1.
+ */
+typedef gpointer (*MessageQueueKeyFunc)  (GObject *obj);
+typedef guint    (*MessageQueueCostFunc) (GObject *obj);
+/*
+ * Optional callback used by a fair MessageQueue to assign the flow of a
+ * message to a priority class when the flow is created. Class 0 is the
+ * highest priority. Values beyond the last class are clamped to it.
+ */
+#define MESSAGE_QUEUE_CLASSES 3
+typedef guint    (*MessageQueueClassFunc) (GObject *obj);
+/*
+ * Optional callback returning the expected time in microseconds needed to
+ * process a message. Used to order the turns of flows in a fair queue.
+ */
+typedef guint64  (*MessageQueueEstimateFunc) (GObject  *obj,
+                                              gpointer  user_data);
+/*
+ * Optional callback mapping a message to the share its flow belongs to,
+ * see message_queue_set_share_func. It sets 'share' to the id of the share
+ * and 'weight' to its weight. Returns FALSE for messages outside of any
+ * share.
+ */
+typedef gboolean (*MessageQueueShareFunc) (GObject  *obj,
+                                           guint32  *share,
+                                           guint    *weight,
+                                           gpointer  user_data);
+/* shares remembered before the idle ones are forgotten */
+#define MESSAGE_QUEUE_SHARES_MAX 1024
+/*
+ * Optional callback selecting the messages of a fair MessageQueue that
+ * take the urgent lane, see message_queue_set_urgent_func.
+ */
+typedef gboolean (*MessageQueueUrgentFunc) (GObject *obj);
+/*
+ * Callback used to select the messages removed from a fair queue. Returns
+ * TRUE if the message should be removed.
+ */
+typedef gboolean (*MessageQueueFilterFunc) (GObject  *obj,
+                                            gpointer  user_data);
+
 typedef struct _MessageQueue {
     GObject       parent_instance;
     GAsyncQueue  *queue;
+    /* state for the fair queuing mode, unused by FIFO queues */
+    GMutex        mutex;
+    GCond         cond;
+    GHashTable   *flows;
+    GQueue       *active_flows [MESSAGE_QUEUE_CLASSES];
+    guint         skipped [MESSAGE_QUEUE_CLASSES];
+    guint         quantum;
+    guint         class_share;
+    MessageQueueKeyFunc   key_func;
+    MessageQueueCostFunc  cost_func;
+    MessageQueueClassFunc class_func;
+    MessageQueueEstimateFunc estimate_func;
+    gpointer              estimate_data;
+    MessageQueueShareFunc share_func;
+    gpointer              share_data;
+    /* messages dequeued before those of any flow, in FIFO order */
+    MessageQueueUrgentFunc urgent_func;
+    GQueue       *urgent;
+    /*
+     * the message_queue_share_t for each share id, and the virtual time of
+     * the last share served that shares becoming busy start from
+     */
+    GHashTable   *shares;
+    gdouble       vclock;
+    /* messages in a fair queue, under the mutex */
+    guint         length;
+    /*
+     * the key message_queue_timeout_dequeue_key waits for, the consumer
+     * is woken when a message with this key or the NULL key arrives
+     */
+    gpointer      waiting_key;
+    gboolean      waiting_for_key;
+    /* the most messages the queue has held at once, updated atomically */
+    gint          high_water;
 } MessageQueue;
 
 #define TYPE_MESSAGE_QUEUE           (message_queue_get_type             ())
@@ -29,9 +108,44 @@ typedef struct _MessageQueue {
 
 GType           message_queue_get_type     (void);
 MessageQueue*   message_queue_new          (void);
+MessageQueue*   message_queue_new_fair     (MessageQueueKeyFunc  key_func,
+                                            MessageQueueCostFunc cost_func,
+                                            guint                quantum);
+void        message_queue_set_class_func   (MessageQueue          *message_queue,
+                                            MessageQueueClassFunc  class_func,
+                                            guint                  share);
+void        message_queue_set_estimate_func (MessageQueue             *message_queue,
+                                             MessageQueueEstimateFunc  estimate_func,
+                                             gpointer                  user_data);
+void        message_queue_set_share_func (MessageQueue          *message_queue,
+                                          MessageQueueShareFunc  share_func,
+                                          gpointer               user_data);
+void        message_queue_set_urgent_func  (MessageQueue           *message_queue,
+                                            MessageQueueUrgentFunc  urgent_func);
+void        message_queue_charge           (MessageQueue   *message_queue,
+                                            GObject        *obj,
+                                            guint64         cost_us);
 void        message_queue_enqueue          (MessageQueue   *message_queue,
                                             GObject        *obj);
 GObject*    message_queue_dequeue          (MessageQueue   *message_queue);
+GObject*    message_queue_timeout_dequeue  (MessageQueue   *message_queue,
+                                            guint64         timeout);
+guint       message_queue_dequeue_batch    (MessageQueue   *message_queue,
+                                            GObject       **objs,
+                                            guint           max);
+guint       message_queue_timeout_dequeue_batch (MessageQueue *message_queue,
+                                                 GObject     **objs,
+                                                 guint         max,
+                                                 guint64       timeout);
+GObject*    message_queue_timeout_dequeue_key (MessageQueue *message_queue,
+                                               gpointer      key,
+                                               guint64       timeout);
+guint       message_queue_remove_key       (MessageQueue   *message_queue,
+                                            gpointer        key,
+                                            MessageQueueFilterFunc filter,
+                                            gpointer        user_data);
+guint       message_queue_get_length       (MessageQueue   *message_queue);
+guint       message_queue_get_high_water   (MessageQueue   *message_queue);
 
 G_END_DECLS
 #endif /* MESSAGE_QUEUE_H */
@@ -0,0 +1,576 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#if defined(HAVE_MALLINFO2)
+#include <malloc.h>
+#endif
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gio/gunixsocketaddress.h>
+
+#include "alloc-stats.h"
+#include "logging.h"
+#include "metrics.h"
+
+#define METRICS_DURATION "tabrmd_command_duration_seconds"
+
+typedef struct {
+    GString          *out;
+    guint             backend;
+} metrics_format_data_t;
+/*
+ * A request being served: 'response' is written once the end of the
+ * request headers has been read or 'request' is full.
+ */
+typedef struct {
+    GSocketConnection *connection;
+    GString           *response;
+    guint8             request [METRICS_REQUEST_MAX];
+    gsize              received;
+} metrics_request_t;
+
+static void
+metrics_family (GString     *out,
+                const gchar *name,
+                const gchar *type,
+                const gchar *unit,
+                const gchar *help)
+{
+    g_string_append_printf (out, "# TYPE %s %s\n", name, type);
+    if (unit != NULL) {
+        g_string_append_printf (out, "# UNIT %s %s\n", name, unit);
+    }
+    g_string_append_printf (out, "# HELP %s %s\n", name, help);
+}
+/*
+ * Append a duration in seconds without going through a double, the
+ * output doesn't depend on the locale.
+ */
+static void
+metrics_append_seconds (GString *out,
+                        guint64  time_us)
+{
+    g_string_append_printf (out,
+                            "%" G_GUINT64_FORMAT ".%06" G_GUINT64_FORMAT,
+                            time_us / G_USEC_PER_SEC,
+                            time_us % G_USEC_PER_SEC);
+}
+/*
+ * CommandStatsFunc writing one histogram. All but the last bucket of a
+ * command_stats_histogram_t have an upper bound of 2^i us, the buckets of
+ * an OpenMetrics histogram are cumulative.
+ */
+static void
+metrics_format_histogram (TPM2_CC                          command_code,
+                          CommandStatsPhase                phase,
+                          command_stats_histogram_t const *histogram,
+                          gpointer                         user_data)
+{
+    metrics_format_data_t *data = (metrics_format_data_t*)user_data;
+    gchar *labels;
+    guint64 cumulative = 0;
+    guint i;
+
+    labels = g_strdup_printf ("backend=\"%u\",command=\"0x%08" PRIx32 "\","
+                              "phase=\"%s\"",
+                              data->backend,
+                              command_code,
+                              command_stats_phase_name (phase));
+    for (i = 0; i < COMMAND_STATS_BUCKETS - 1; ++i) {
+        cumulative += histogram->buckets [i];
+        g_string_append_printf (data->out,
+                                METRICS_DURATION "_bucket{%s,le=\"",
+                                labels);
+        metrics_append_seconds (data->out, G_GUINT64_CONSTANT (1) << i);
+        g_string_append_printf (data->out,
+                                "\"} %" G_GUINT64_FORMAT "\n",
+                                cumulative);
+    }
+    g_string_append_printf (data->out,
+                            METRICS_DURATION "_bucket{%s,le=\"+Inf\"} %"
+                            G_GUINT64_FORMAT "\n"
+                            METRICS_DURATION "_count{%s} %"
+                            G_GUINT64_FORMAT "\n"
+                            METRICS_DURATION "_sum{%s} ",
+                            labels, histogram->count,
+                            labels, histogram->count,
+                            labels);
+    metrics_append_seconds (data->out, histogram->total_us);
+    g_string_append_c (data->out, '\n');
+    g_free (labels);
+}
+static void
+metrics_format_rc (TSS2_RC  rc,
+                   guint64  count,
+                   gpointer user_data)
+{
+    metrics_format_data_t *data = (metrics_format_data_t*)user_data;
+
+    g_string_append_printf (data->out,
+                            "tabrmd_tpm_errors_total{backend=\"%u\","
+                            "rc=\"0x%08" PRIx32 "\"} %" G_GUINT64_FORMAT "\n",
+                            data->backend,
+                            rc,
+                            count);
+}
+/*
+ * The counters of each backend, then of each connection, for one
+ * CommandStatsCounter or for the context operations when 'counter' is
+ * COMMAND_STATS_COUNTERS.
+ */
+static void
+metrics_format_counters (GString                 *out,
+                         const gchar             *name,
+                         const gchar             *help,
+                         CommandStatsCounter      counter,
+                         metrics_backend_t const *backends,
+                         guint                    count,
+                         GList                   *connections)
+{
+    CommandStatsCounter first = counter, last = counter, i;
+    gchar *connection_name;
+    GList *link;
+    Connection *connection;
+    guint backend;
+
+    if (counter == COMMAND_STATS_COUNTERS) {
+        first = COMMAND_STATS_CONTEXT_LOAD;
+        last = COMMAND_STATS_CONTEXT_FLUSH;
+    }
+    metrics_family (out, name, "counter", NULL, help);
+    for (backend = 0; backend < count; ++backend) {
+        if (backends [backend].stats == NULL) {
+            continue;
+        }
+        for (i = first; i <= last; ++i) {
+            g_string_append_printf (out,
+                                    "%s_total{backend=\"%u\"",
+                                    name,
+                                    backend);
+            if (counter == COMMAND_STATS_COUNTERS) {
+                g_string_append_printf (out, ",operation=\"%s\"",
+                                        command_stats_counter_name (i));
+            }
+            g_string_append_printf (out,
+                                    "} %u\n",
+                                    command_stats_get_count (
+                                        backends [backend].stats, i));
+        }
+    }
+    connection_name = g_strdup_printf ("tabrmd_connection_%s",
+                                       name + strlen ("tabrmd_"));
+    metrics_family (out, connection_name, "counter", NULL, help);
+    for (link = connections; link != NULL; link = link->next) {
+        connection = CONNECTION (link->data);
+        for (i = first; i <= last; ++i) {
+            g_string_append_printf (out,
+                                    "%s_total{connection=\"%u\"",
+                                    connection_name,
+                                    connection_get_serial (connection));
+            if (counter == COMMAND_STATS_COUNTERS) {
+                g_string_append_printf (out, ",operation=\"%s\"",
+                                        command_stats_counter_name (i));
+            }
+            g_string_append_printf (out, "} %u\n",
+                                    connection_get_count (connection, i));
+        }
+    }
+    g_free (connection_name);
+}
+/*
+ * The memory the daemon uses: its resident set from /proc, and with
+ * mallinfo2 what the allocator has handed out and what it keeps free.
+ * Freed memory that stays free in the heap shows fragmentation rather
+ * than a leak.
+ */
+static void
+metrics_format_memory (GString *out)
+{
+    gchar *statm = NULL, **fields = NULL;
+#if defined(HAVE_MALLINFO2)
+    struct mallinfo2 info;
+#endif
+
+    metrics_family (out, "process_resident_memory_bytes", "gauge", "bytes",
+                    "Resident memory size of the daemon.");
+    if (g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL)) {
+        fields = g_strsplit (statm, " ", 3);
+        if (fields [0] != NULL && fields [1] != NULL) {
+            g_string_append_printf (out,
+                                    "process_resident_memory_bytes %"
+                                    G_GUINT64_FORMAT "\n",
+                                    g_ascii_strtoull (fields [1], NULL, 10) *
+                                    (guint64)sysconf (_SC_PAGESIZE));
+        }
+        g_strfreev (fields);
+        g_free (statm);
+    }
+#if defined(HAVE_MALLINFO2)
+    info = mallinfo2 ();
+    metrics_family (out, "tabrmd_heap_bytes", "gauge", "bytes",
+                    "Memory the allocator has handed out and holds free.");
+    g_string_append_printf (out,
+                            "tabrmd_heap_bytes{state=\"allocated\"} %"
+                            G_GSIZE_FORMAT "\n"
+                            "tabrmd_heap_bytes{state=\"free\"} %"
+                            G_GSIZE_FORMAT "\n",
+                            info.uordblks + info.hblkhd,
+                            info.fordblks);
+#endif
+}
+#ifdef ENABLE_ALLOC_STATS
+static void
+metrics_format_alloc_stats (GString *out)
+{
+    gsize allocations [ALLOC_STATS_SUBSYSTEMS], bytes [ALLOC_STATS_SUBSYSTEMS];
+    guint i;
+
+    for (i = 0; i < ALLOC_STATS_SUBSYSTEMS; ++i) {
+        alloc_stats_get (i, &allocations [i], &bytes [i]);
+    }
+    metrics_family (out, "tabrmd_allocations", "counter", NULL,
+                    "Heap allocations made by each subsystem.");
+    for (i = 0; i < ALLOC_STATS_SUBSYSTEMS; ++i) {
+        g_string_append_printf (out,
+                                "tabrmd_allocations_total{subsystem=\"%s\"} %"
+                                G_GSIZE_FORMAT "\n",
+                                alloc_stats_name (i),
+                                allocations [i]);
+    }
+    metrics_family (out, "tabrmd_allocated_bytes", "counter", "bytes",
+                    "Bytes of the heap allocations made by each subsystem.");
+    for (i = 0; i < ALLOC_STATS_SUBSYSTEMS; ++i) {
+        g_string_append_printf (out,
+                                "tabrmd_allocated_bytes_total{subsystem=\"%s\"} %"
+                                G_GSIZE_FORMAT "\n",
+                                alloc_stats_name (i),
+                                bytes [i]);
+    }
+}
+#endif
+/*
+ * Append the OpenMetrics text exposition of the statistics of 'count'
+ * backends and of the client Connections in the list 'connections' to
+ * 'out'. The samples of each metric family have to be together so each
+ * family loops over the backends.
+ */
+void
+metrics_format (GString                 *out,
+                metrics_backend_t const *backends,
+                guint                    count,
+                GList                   *connections)
+{
+    metrics_format_data_t data = { .out = out };
+    guint i;
+
+    metrics_family (out, METRICS_DURATION, "histogram", "seconds",
+                    "Time commands spent in each phase of processing.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].stats != NULL) {
+            data.backend = i;
+            command_stats_foreach (backends [i].stats,
+                                   metrics_format_histogram,
+                                   &data);
+        }
+    }
+    metrics_family (out, "tabrmd_tpm_errors", "counter", NULL,
+                    "Responses with a response code other than success.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].stats != NULL) {
+            data.backend = i;
+            command_stats_foreach_rc (backends [i].stats,
+                                      metrics_format_rc,
+                                      &data);
+        }
+    }
+    metrics_format_counters (out,
+                             "tabrmd_context_operations",
+                             "Contexts loaded, saved and flushed by the resource manager.",
+                             COMMAND_STATS_COUNTERS,
+                             backends, count, connections);
+    metrics_format_counters (out,
+                             "tabrmd_resident_hits",
+                             "Transient objects a command needed that were still loaded.",
+                             COMMAND_STATS_RESIDENT_HIT,
+                             backends, count, connections);
+    metrics_format_counters (out,
+                             "tabrmd_regaps",
+                             "Sessions reloaded and saved to close the context gap.",
+                             COMMAND_STATS_REGAP,
+                             backends, count, connections);
+    metrics_format_counters (out,
+                             "tabrmd_leases",
+                             "Leases of the TPM granted to a connection.",
+                             COMMAND_STATS_LEASE,
+                             backends, count, connections);
+    metrics_format_counters (out,
+                             "tabrmd_leases_expired",
+                             "Leases that ran out before the connection released them.",
+                             COMMAND_STATS_LEASE_EXPIRED,
+                             backends, count, connections);
+    metrics_family (out, "tabrmd_lease_seconds", "counter", "seconds",
+                    "Time the TPM served a single connection under a lease.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].stats != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_lease_seconds_total{backend=\"%u\"} ",
+                                    i);
+            metrics_append_seconds (out,
+                                    command_stats_get_lease_us (backends [i].stats));
+            g_string_append_c (out, '\n');
+        }
+    }
+    metrics_family (out, "tabrmd_queue_depth", "gauge", NULL,
+                    "Messages waiting for the resource manager and the response sink.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].resmgr_queue != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_queue_depth{backend=\"%u\","
+                                    "queue=\"resource_manager\"} %u\n",
+                                    i,
+                                    message_queue_get_length (backends [i].resmgr_queue));
+        }
+        if (backends [i].sink_queue != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_queue_depth{backend=\"%u\","
+                                    "queue=\"response_sink\"} %u\n",
+                                    i,
+                                    message_queue_get_length (backends [i].sink_queue));
+        }
+    }
+    metrics_family (out, "tabrmd_queue_depth_max", "gauge", NULL,
+                    "The most messages each queue has held at once.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].resmgr_queue != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_queue_depth_max{backend=\"%u\","
+                                    "queue=\"resource_manager\"} %u\n",
+                                    i,
+                                    message_queue_get_high_water (backends [i].resmgr_queue));
+        }
+        if (backends [i].sink_queue != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_queue_depth_max{backend=\"%u\","
+                                    "queue=\"response_sink\"} %u\n",
+                                    i,
+                                    message_queue_get_high_water (backends [i].sink_queue));
+        }
+    }
+    metrics_family (out, "tabrmd_tpm_busy_seconds", "counter", "seconds",
+                    "Time the TPM spent on commands and context operations.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].tpm2 != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_tpm_busy_seconds_total{backend=\"%u\"} ",
+                                    i);
+            metrics_append_seconds (out, tpm2_get_busy_us (backends [i].tpm2));
+            g_string_append_c (out, '\n');
+        }
+    }
+    metrics_family (out, "tabrmd_tpm_timeouts", "counter", NULL,
+                    "Commands canceled because the TPM took too long.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].tpm2 != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_tpm_timeouts_total{backend=\"%u\"} %u\n",
+                                    i,
+                                    tpm2_get_timeouts (backends [i].tpm2));
+        }
+    }
+    metrics_family (out, "tabrmd_sessions", "gauge", NULL,
+                    "Sessions tracked by the resource manager, abandoned ones included.");
+    for (i = 0; i < count; ++i) {
+        if (backends [i].stats != NULL) {
+            g_string_append_printf (out,
+                                    "tabrmd_sessions{backend=\"%u\"} %u\n",
+                                    i,
+                                    command_stats_get_sessions (backends [i].stats));
+        }
+    }
+    metrics_family (out, "tabrmd_connections", "gauge", NULL,
+                    "Active client connections.");
+    g_string_append_printf (out, "tabrmd_connections %u\n",
+                            g_list_length (connections));
+    metrics_family (out, "tabrmd_log_messages_dropped", "counter", NULL,
+                    "Messages the syslog logger dropped because its queue was full.");
+    g_string_append_printf (out, "tabrmd_log_messages_dropped_total %u\n",
+                            logging_get_dropped ());
+    metrics_format_memory (out);
+#ifdef ENABLE_ALLOC_STATS
+    metrics_format_alloc_stats (out);
+#endif
+    g_string_append (out, "# EOF\n");
+}
+/*
+ * Create the GSocketService for the metrics listener. 'address' is either
+ * the path of a Unix socket or a TCP port on the loopback interface.
+ * The caller connects to the "incoming" signal and starts the service.
+ */
+GSocketService*
+metrics_listen (const gchar *address)
+{
+    GSocketService *service;
+    GSocketAddress *socket_address;
+    GError *error = NULL;
+    struct stat st;
+    gchar *end = NULL;
+    guint64 port;
+    gboolean ret;
+
+    if (address [0] == '/') {
+        if (lstat (address, &st) == 0 && S_ISSOCK (st.st_mode)) {
+            g_debug ("%s: removing stale socket %s", __func__, address);
+            unlink (address);
+        }
+        socket_address = g_unix_socket_address_new (address);
+    } else {
+        port = g_ascii_strtoull (address, &end, 10);
+        if (end == address || *end != '\0' || port == 0 || port > G_MAXUINT16) {
+            g_warning ("%s: metrics address is neither a path nor a port: %s",
+                       __func__, address);
+            return NULL;
+        }
+        socket_address = g_inet_socket_address_new_from_string ("127.0.0.1",
+                                                                (guint)port);
+    }
+    service = g_socket_service_new ();
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (service),
+                                         socket_address,
+                                         G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_DEFAULT,
+                                         NULL,
+                                         NULL,
+                                         &error);
+    g_object_unref (socket_address);
+    if (!ret) {
+        g_warning ("%s: failed to listen for metrics on %s: %s",
+                   __func__, address, error->message);
+        g_clear_error (&error);
+        g_object_unref (service);
+        return NULL;
+    }
+    g_info ("%s: serving metrics on %s", __func__, address);
+    return service;
+}
+void
+metrics_unlisten (GSocketService *service,
+                  const gchar    *address)
+{
+    g_socket_service_stop (service);
+    g_socket_listener_close (G_SOCKET_LISTENER (service));
+    if (address [0] == '/') {
+        unlink (address);
+    }
+    g_object_unref (service);
+}
+static void
+metrics_request_free (metrics_request_t *request)
+{
+    g_io_stream_close (G_IO_STREAM (request->connection), NULL, NULL);
+    g_object_unref (request->connection);
+    g_string_free (request->response, TRUE);
+    g_free (request);
+}
+static void
+on_metrics_written (GObject      *source_object,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+    metrics_request_t *request = (metrics_request_t*)user_data;
+    GError *error = NULL;
+
+    if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
+                                           result,
+                                           NULL,
+                                           &error))
+    {
+        g_debug ("%s: failed to write metrics: %s", __func__, error->message);
+        g_error_free (error);
+    }
+    metrics_request_free (request);
+}
+static void
+metrics_read_request (metrics_request_t *request);
+/*
+ * The response is only written once the whole request has been read:
+ * closing a TCP socket with unread data resets the connection and the
+ * scraper may lose the response.
+ */
+static void
+on_metrics_request_read (GObject      *source_object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+    metrics_request_t *request = (metrics_request_t*)user_data;
+    GError *error = NULL;
+    gssize size;
+
+    size = g_input_stream_read_finish (G_INPUT_STREAM (source_object),
+                                       result,
+                                       &error);
+    if (size <= 0) {
+        g_debug ("%s: no metrics request: %s", __func__,
+                 error != NULL ? error->message : "connection closed");
+        g_clear_error (&error);
+        metrics_request_free (request);
+        return;
+    }
+    request->received += size;
+    if (g_strstr_len ((gchar*)request->request,
+                      request->received,
+                      "\r\n\r\n") == NULL &&
+        request->received < sizeof (request->request))
+    {
+        metrics_read_request (request);
+        return;
+    }
+    g_output_stream_write_all_async (
+        g_io_stream_get_output_stream (G_IO_STREAM (request->connection)),
+        request->response->str,
+        request->response->len,
+        G_PRIORITY_DEFAULT,
+        NULL,
+        on_metrics_written,
+        request);
+}
+static void
+metrics_read_request (metrics_request_t *request)
+{
+    g_input_stream_read_async (
+        g_io_stream_get_input_stream (G_IO_STREAM (request->connection)),
+        &request->request [request->received],
+        sizeof (request->request) - request->received,
+        G_PRIORITY_DEFAULT,
+        NULL,
+        on_metrics_request_read,
+        request);
+}
+/*
+ * Send 'body' to the scraper on 'connection' once it has sent its request.
+ * This takes ownership of 'body'. Reading and writing is asynchronous so
+ * a slow scraper doesn't hold up the main loop and the socket timeout
+ * gets rid of one that never finishes.
+ */
+void
+metrics_respond (GSocketConnection *connection,
+                 GString           *body)
+{
+    metrics_request_t *request;
+
+    request = g_new0 (metrics_request_t, 1);
+    request->connection = g_object_ref (connection);
+    request->response = g_string_new (NULL);
+    g_string_printf (request->response,
+                     "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: " METRICS_CONTENT_TYPE "\r\n"
+                     "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     body->len);
+    g_string_append_len (request->response, body->str, body->len);
+    g_string_free (body, TRUE);
+    g_socket_set_timeout (g_socket_connection_get_socket (connection),
+                          METRICS_TIMEOUT);
+    metrics_read_request (request);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "command-stats.h"
+#include "connection.h"
+#include "message-queue.h"
+#include "tpm2.h"
+
+G_BEGIN_DECLS
+
+/*
+ * The metrics listener serves the statistics of the daemon as OpenMetrics
+ * text to anything connecting to it, over HTTP/1.0 so that Prometheus can
+ * scrape it directly. It listens on a Unix socket if the address is a
+ * path, on that TCP port of the loopback interface otherwise. Every
+ * request gets the same page whatever the path asked for.
+ */
+#define METRICS_CONTENT_TYPE \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+/* seconds a scraper has to send its request and read the response */
+#define METRICS_TIMEOUT 10
+/* the part of a request that is read, anything beyond it is ignored */
+#define METRICS_REQUEST_MAX 4096
+
+/*
+ * What the metrics of one TPM backend are read from. Any of the pointers
+ * may be NULL, the metrics that come from it are left out then.
+ */
+typedef struct {
+    CommandStats     *stats;
+    MessageQueue     *resmgr_queue;
+    MessageQueue     *sink_queue;
+    Tpm2             *tpm2;
+} metrics_backend_t;
+
+void            metrics_format    (GString                 *out,
+                                   metrics_backend_t const *backends,
+                                   guint                    count,
+                                   GList                   *connections);
+GSocketService* metrics_listen    (const gchar             *address);
+void            metrics_unlisten  (GSocketService          *service,
+                                   const gchar             *address);
+void            metrics_respond   (GSocketConnection       *connection,
+                                   GString                 *body);
+
+G_END_DECLS
+#endif /* METRICS_H */
@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "nv-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_DEFINE_TYPE (NvCache, nv_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+/*
+ * GObject property getter.
+ */
+static void
+nv_cache_get_property (GObject    *object,
+                       guint       property_id,
+                       GValue     *value,
+                       GParamSpec *pspec)
+{
+    NvCache *self = NV_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+nv_cache_set_property (GObject        *object,
+                       guint           property_id,
+                       GValue const   *value,
+                       GParamSpec     *pspec)
+{
+    NvCache *self = NV_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+nv_cache_init (NvCache *self)
+{
+    self->table = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)g_bytes_unref);
+    self->immutable = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+/*
+ * GObject finalize function: release the GHashTables and with them all
+ * of the cached responses.
+ */
+static void
+nv_cache_finalize (GObject *object)
+{
+    NvCache *self = NV_CACHE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    g_clear_pointer (&self->immutable, g_hash_table_unref);
+    G_OBJECT_CLASS (nv_cache_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+nv_cache_class_init (NvCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (nv_cache_parent_class == NULL)
+        nv_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = nv_cache_finalize;
+    object_class->get_property = nv_cache_get_property;
+    object_class->set_property = nv_cache_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max number of entries",
+                           "maximum number of cached NV_Read responses",
+                           0,
+                           NV_CACHE_MAX,
+                           NV_CACHE_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+NvCache*
+nv_cache_new (guint max_entries)
+{
+    g_debug ("%s with max_entries: %u", __func__, max_entries);
+    return NV_CACHE (g_object_new (TYPE_NV_CACHE,
+                                   "max-entries", max_entries,
+                                   NULL));
+}
+/* the key is the command after the header: authHandle, nvIndex, ... */
+#define NV_CACHE_KEY_INDEX_OFFSET sizeof (TPM2_HANDLE)
+/*
+ * Data passed to nv_cache_auth_callback through tpm2_command_foreach_auth.
+ */
+typedef struct {
+    Tpm2Command *command;
+    gboolean     cacheable;
+} nv_cache_auth_data_t;
+/*
+ * GFunc invoked for each authorization in an NV_Read command. Only plain
+ * password authorizations leave the response identical each time the
+ * command is executed. Anything else marks the command as not cacheable.
+ */
+static void
+nv_cache_auth_callback (gpointer authorization,
+                        gpointer user_data)
+{
+    size_t offset = *(size_t*)authorization;
+    nv_cache_auth_data_t *data = (nv_cache_auth_data_t*)user_data;
+
+    if (tpm2_command_get_auth_handle (data->command, offset) != TPM2_RS_PW ||
+        tpm2_command_get_auth_attrs (data->command, offset) &
+        TPMA_SESSION_AUDIT)
+    {
+        data->cacheable = FALSE;
+    }
+}
+/*
+ * Generate the key used to cache the response to the provided NV_Read
+ * command: everything after the header, handles, authorization area and
+ * parameters. The TPM already checked the password in an identical
+ * command, so answering it from the cache doesn't skip an authorization
+ * check.
+ * This function returns NULL if the command can't be cached, i.e. if it's
+ * authorized by anything other than a plain password. The caller must
+ * free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+nv_cache_key (Tpm2Command *command)
+{
+    nv_cache_auth_data_t auth_data = {
+        .command = command,
+        .cacheable = TRUE,
+    };
+    guint32 size = tpm2_command_get_size (command);
+
+    if (tpm2_command_get_code (command) != TPM2_CC_NV_Read ||
+        !tpm2_command_has_auths (command) ||
+        tpm2_command_get_params_offset (command) == 0 ||
+        size <= TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE))
+    {
+        return NULL;
+    }
+    tpm2_command_foreach_auth (command, nv_cache_auth_callback, &auth_data);
+    if (!auth_data.cacheable) {
+        g_debug ("%s: NV_Read auths prevent caching", __func__);
+        return NULL;
+    }
+    return g_bytes_new (tpm2_command_get_buffer (command) + TPM_HEADER_SIZE,
+                        size - TPM_HEADER_SIZE);
+}
+/*
+ * The NV index a key from nv_cache_key is for.
+ */
+static TPM2_HANDLE
+nv_cache_key_index (GBytes *key)
+{
+    guint8 const *data = g_bytes_get_data (key, NULL);
+    TPM2_HANDLE nv_index;
+
+    memcpy (&nv_index, data + NV_CACHE_KEY_INDEX_OFFSET, sizeof (nv_index));
+    return GUINT32_FROM_BE (nv_index);
+}
+/*
+ * Return TRUE if an NV index with the provided attributes can't change
+ * until it's undefined, its auth value is changed or the TPM is started
+ * again: it has been written and write-locked, and reading it doesn't
+ * take a policy session, whose outcome depends on the TPM state.
+ */
+gboolean
+nv_cache_is_immutable (TPMA_NV attributes)
+{
+    return (attributes & TPMA_NV_WRITTEN) &&
+        (attributes & TPMA_NV_WRITELOCKED) &&
+        !(attributes & (TPMA_NV_POLICYREAD | TPMA_NV_READLOCKED));
+}
+/*
+ * Take note of the attributes of an NV index from the NV_ReadPublic
+ * response in 'buffer'. NV_Read responses for the index are cached from
+ * now on if it's immutable and forgotten if it's not.
+ */
+void
+nv_cache_add_public (NvCache      *cache,
+                     guint8 const *buffer,
+                     size_t        size)
+{
+    TPM2B_NV_PUBLIC nv_public = { 0 };
+    TPM2_ST tag;
+    size_t offset = 0;
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPM2_ST_Unmarshal (buffer, size, &offset, &tag);
+    if (rc != TSS2_RC_SUCCESS) {
+        return;
+    }
+    offset = TPM_HEADER_SIZE;
+    /* the parameterSize in front of the parameters of a response with an
+     * auth area */
+    if (tag == TPM2_ST_SESSIONS) {
+        offset += sizeof (UINT32);
+    }
+    rc = Tss2_MU_TPM2B_NV_PUBLIC_Unmarshal (buffer, size, &offset,
+                                            &nv_public);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_debug ("%s: failed to parse NV_ReadPublic response", __func__);
+        return;
+    }
+    if (nv_cache_is_immutable (nv_public.nvPublic.attributes)) {
+        g_debug ("%s: NV index 0x%08" PRIx32 " is immutable", __func__,
+                 nv_public.nvPublic.nvIndex);
+        g_hash_table_add (cache->immutable,
+                          GUINT_TO_POINTER (nv_public.nvPublic.nvIndex));
+    } else {
+        nv_cache_forget (cache, nv_public.nvPublic.nvIndex);
+    }
+}
+/*
+ * Add the response to the NV_Read command with the provided key to the
+ * cache. Nothing is added and FALSE is returned if the NV index isn't
+ * known to be immutable or if the cache is full.
+ */
+gboolean
+nv_cache_insert (NvCache *cache,
+                 GBytes  *key,
+                 GBytes  *response)
+{
+    if (!g_hash_table_contains (cache->immutable,
+                                GUINT_TO_POINTER (nv_cache_key_index (key))))
+    {
+        return FALSE;
+    }
+    if (g_hash_table_size (cache->table) >= cache->max_entries &&
+        !g_hash_table_contains (cache->table, key))
+    {
+        g_debug ("%s: cache is full", __func__);
+        return FALSE;
+    }
+    g_hash_table_replace (cache->table,
+                          g_bytes_ref (key),
+                          g_bytes_ref (response));
+    return TRUE;
+}
+/*
+ * Look up the response cached under 'key'. Returns a new reference to
+ * the response, or NULL if there is none.
+ */
+GBytes*
+nv_cache_lookup (NvCache *cache,
+                 GBytes  *key)
+{
+    GBytes *response;
+
+    response = g_hash_table_lookup (cache->table, key);
+    return response != NULL ? g_bytes_ref (response) : NULL;
+}
+/*
+ * GHRFunc selecting the cached responses for the NV index in 'user_data'.
+ */
+static gboolean
+nv_cache_match_index (gpointer key,
+                      gpointer value,
+                      gpointer user_data)
+{
+    UNUSED_PARAM (value);
+
+    return nv_cache_key_index ((GBytes*)key) == GPOINTER_TO_UINT (user_data);
+}
+/*
+ * Drop the cached responses for 'nv_index' and what we know about it.
+ */
+void
+nv_cache_forget (NvCache     *cache,
+                 TPM2_HANDLE  nv_index)
+{
+    guint count;
+
+    g_hash_table_remove (cache->immutable, GUINT_TO_POINTER (nv_index));
+    count = g_hash_table_foreach_remove (cache->table,
+                                         nv_cache_match_index,
+                                         GUINT_TO_POINTER (nv_index));
+    if (count > 0) {
+        g_debug ("%s: dropped %u cached NV_Read responses for 0x%08" PRIx32,
+                 __func__, count, nv_index);
+    }
+}
+/*
+ * Drop whatever the provided command may make stale, whatever its
+ * response code. Commands on an NV index drop what's cached for it,
+ * Startup may clear TPMA_NV_WRITELOCKED, and commands that change the
+ * hierarchy auth values or undefine indices drop everything.
+ */
+void
+nv_cache_invalidate (NvCache     *cache,
+                     Tpm2Command *command)
+{
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_NV_Write:
+    case TPM2_CC_NV_Increment:
+    case TPM2_CC_NV_Extend:
+    case TPM2_CC_NV_SetBits:
+    case TPM2_CC_NV_WriteLock:
+    case TPM2_CC_NV_ReadLock:
+    case TPM2_CC_NV_UndefineSpace:
+        nv_cache_forget (cache, tpm2_command_get_handle (command, 1));
+        break;
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+    case TPM2_CC_NV_ChangeAuth:
+        nv_cache_forget (cache, tpm2_command_get_handle (command, 0));
+        break;
+    case TPM2_CC_Startup:
+    case TPM2_CC_Clear:
+    case TPM2_CC_HierarchyControl:
+    case TPM2_CC_HierarchyChangeAuth:
+        nv_cache_clear (cache);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Drop all cached responses and everything we know about NV indices.
+ */
+void
+nv_cache_clear (NvCache *cache)
+{
+    if (g_hash_table_size (cache->table) > 0) {
+        g_debug ("%s: dropping %u cached NV_Read responses", __func__,
+                 g_hash_table_size (cache->table));
+    }
+    g_hash_table_remove_all (cache->table);
+    g_hash_table_remove_all (cache->immutable);
+}
+guint
+nv_cache_size (NvCache *cache)
+{
+    return g_hash_table_size (cache->table);
+}
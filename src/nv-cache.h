@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef NV_CACHE_H
+#define NV_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define NV_CACHE_MAX_DEFAULT 0
+#define NV_CACHE_MAX         64
+
+/*
+ * The NvCache holds the responses to NV_Read commands for NV indices that
+ * can't change: written, write-locked and readable without a policy. The
+ * indices are learned from the NV_ReadPublic responses seen by the
+ * ResourceManager, an NV_Read is only cached once its index is known to
+ * be immutable.
+ */
+typedef struct _NvCacheClass {
+    GObjectClass      parent;
+} NvCacheClass;
+
+typedef struct _NvCache {
+    GObject           parent_instance;
+    GHashTable       *table;
+    GHashTable       *immutable;
+    guint             max_entries;
+} NvCache;
+
+#define TYPE_NV_CACHE              (nv_cache_get_type   ())
+#define NV_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_NV_CACHE, NvCache))
+#define NV_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_NV_CACHE, NvCacheClass))
+#define IS_NV_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_NV_CACHE))
+#define IS_NV_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_NV_CACHE))
+#define NV_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_NV_CACHE, NvCacheClass))
+
+GType            nv_cache_get_type        (void);
+NvCache*         nv_cache_new             (guint             max_entries);
+GBytes*          nv_cache_key             (Tpm2Command      *command);
+gboolean         nv_cache_is_immutable    (TPMA_NV           attributes);
+void             nv_cache_add_public      (NvCache          *cache,
+                                           guint8 const     *buffer,
+                                           size_t            size);
+gboolean         nv_cache_insert          (NvCache          *cache,
+                                           GBytes           *key,
+                                           GBytes           *response);
+GBytes*          nv_cache_lookup          (NvCache          *cache,
+                                           GBytes           *key);
+void             nv_cache_invalidate      (NvCache          *cache,
+                                           Tpm2Command      *command);
+void             nv_cache_forget          (NvCache          *cache,
+                                           TPM2_HANDLE       nv_index);
+void             nv_cache_clear           (NvCache          *cache);
+guint            nv_cache_size            (NvCache          *cache);
+
+G_END_DECLS
+#endif /* NV_CACHE_H */
@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+
+#include "object-share.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_DEFINE_TYPE (ObjectShare, object_share, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * A shared object: the key of the Load command that loaded it, NULL once
+ * the key is forgotten, the response to that command and the number of
+ * HandleMapEntry objects backed by it.
+ */
+typedef struct {
+    GBytes         *key;
+    HandleMapEntry *object;
+    GBytes         *response;
+    guint           users;
+} object_share_entry_t;
+
+static void
+object_share_entry_free (gpointer data)
+{
+    object_share_entry_t *entry = (object_share_entry_t*)data;
+
+    g_clear_pointer (&entry->key, g_bytes_unref);
+    g_clear_pointer (&entry->response, g_bytes_unref);
+    g_clear_object (&entry->object);
+    g_free (entry);
+}
+/*
+ * GObject property getter.
+ */
+static void
+object_share_get_property (GObject    *object,
+                           guint       property_id,
+                           GValue     *value,
+                           GParamSpec *pspec)
+{
+    ObjectShare *self = OBJECT_SHARE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+object_share_set_property (GObject        *object,
+                           guint           property_id,
+                           GValue const   *value,
+                           GParamSpec     *pspec)
+{
+    ObjectShare *self = OBJECT_SHARE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * The 'objects' table owns the entries, the 'keys' table only points at
+ * the ones whose key hasn't been forgotten.
+ */
+static void
+object_share_init (ObjectShare *self)
+{
+    self->keys = g_hash_table_new (g_bytes_hash, g_bytes_equal);
+    self->objects = g_hash_table_new_full (g_direct_hash,
+                                           g_direct_equal,
+                                           NULL,
+                                           object_share_entry_free);
+}
+/*
+ * GObject finalize function: release the GHashTables and with them the
+ * references to the shared objects.
+ */
+static void
+object_share_finalize (GObject *object)
+{
+    ObjectShare *self = OBJECT_SHARE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->keys, g_hash_table_unref);
+    g_clear_pointer (&self->objects, g_hash_table_unref);
+    G_OBJECT_CLASS (object_share_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+object_share_class_init (ObjectShareClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (object_share_parent_class == NULL)
+        object_share_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = object_share_finalize;
+    object_class->get_property = object_share_get_property;
+    object_class->set_property = object_share_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max number of entries",
+                           "maximum number of shared objects",
+                           0,
+                           OBJECT_SHARE_MAX,
+                           OBJECT_SHARE_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+ObjectShare*
+object_share_new (guint max_entries)
+{
+    g_debug ("%s with max_entries: %u", __func__, max_entries);
+    return OBJECT_SHARE (g_object_new (TYPE_OBJECT_SHARE,
+                                       "max-entries", max_entries,
+                                       NULL));
+}
+/*
+ * Generate the key identifying the object a Load command loads:
+ * everything after the header, that is the parent handle, the
+ * authorization area and the inPrivate and inPublic parameters. The name
+ * of the object is the digest of inPublic so objects with the same key
+ * have the same name and parent.
+ * Only Load commands under a persistent parent authorized with plain
+ * passwords are shared: a vhandle doesn't identify a parent across
+ * connections, and with a password the TPM already checked the
+ * authorization in an identical command.
+ * This function returns NULL if the object can't be shared. The caller
+ * must free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+object_share_key (Tpm2Command *command)
+{
+    guint32 size = tpm2_command_get_size (command);
+
+    if (tpm2_command_get_code (command) != TPM2_CC_Load ||
+        tpm2_command_get_handle_count (command) != 1 ||
+        tpm2_command_get_handle (command, 0) >> TPM2_HR_SHIFT !=
+        TPM2_HT_PERSISTENT ||
+        !tpm2_command_has_auths (command) ||
+        tpm2_command_has_session_auths (command) ||
+        tpm2_command_get_params_offset (command) == 0)
+    {
+        return NULL;
+    }
+    return g_bytes_new (tpm2_command_get_buffer (command) + TPM_HEADER_SIZE,
+                        size - TPM_HEADER_SIZE);
+}
+/*
+ * Share the object loaded by the Load command with the provided key. The
+ * 'object' holds its physical handle and context and the 'response' is
+ * what the TPM returned for the command. The caller is the first user of
+ * the object. Nothing is added and FALSE is returned if the key is
+ * already shared or if the share is full.
+ */
+gboolean
+object_share_insert (ObjectShare    *share,
+                     GBytes         *key,
+                     HandleMapEntry *object,
+                     GBytes         *response)
+{
+    object_share_entry_t *entry;
+
+    if (g_hash_table_contains (share->keys, key) ||
+        g_hash_table_size (share->objects) >= share->max_entries)
+    {
+        return FALSE;
+    }
+    entry = g_new0 (object_share_entry_t, 1);
+    entry->key = g_bytes_ref (key);
+    entry->object = g_object_ref (object);
+    entry->response = g_bytes_ref (response);
+    entry->users = 1;
+    g_hash_table_insert (share->objects, object, entry);
+    g_hash_table_insert (share->keys, entry->key, entry);
+    return TRUE;
+}
+/*
+ * Find the shared object for the provided key and add a user to it. The
+ * response to the Load command that loaded it is returned through
+ * 'response'. The caller must release both references. NULL is returned
+ * if no object is shared for the key.
+ */
+HandleMapEntry*
+object_share_lookup (ObjectShare  *share,
+                     GBytes       *key,
+                     GBytes      **response)
+{
+    object_share_entry_t *entry;
+
+    entry = g_hash_table_lookup (share->keys, key);
+    if (entry == NULL) {
+        return NULL;
+    }
+    ++entry->users;
+    *response = g_bytes_ref (entry->response);
+    return g_object_ref (entry->object);
+}
+/*
+ * Drop a user of the shared object. Returns TRUE if that was the last
+ * user: the object isn't shared anymore and the caller must flush it.
+ */
+gboolean
+object_share_release (ObjectShare    *share,
+                      HandleMapEntry *object)
+{
+    object_share_entry_t *entry;
+
+    entry = g_hash_table_lookup (share->objects, object);
+    if (entry == NULL) {
+        g_warning ("%s: object isn't shared", __func__);
+        return FALSE;
+    }
+    if (--entry->users > 0) {
+        return FALSE;
+    }
+    if (entry->key != NULL) {
+        g_hash_table_remove (share->keys, entry->key);
+    }
+    g_hash_table_remove (share->objects, object);
+    return TRUE;
+}
+/*
+ * Stop sharing the objects with new users, those using them already keep
+ * them until they're released.
+ */
+void
+object_share_forget (ObjectShare *share)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_remove_all (share->keys);
+    g_hash_table_iter_init (&iter, share->objects);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        g_clear_pointer (&((object_share_entry_t*)value)->key,
+                         g_bytes_unref);
+    }
+}
+/*
+ * Return TRUE if a successful command with the provided code may change
+ * what a Load command under a persistent parent loads: the persistent
+ * objects are evicted, or replaced, or the hierarchies they're in change.
+ */
+gboolean
+object_share_invalidates (TPM2_CC command_code)
+{
+    switch (command_code) {
+    case TPM2_CC_EvictControl:
+    case TPM2_CC_Clear:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_HierarchyControl:
+    case TPM2_CC_Startup:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * The number of shared objects, including those no longer shared with new
+ * users.
+ */
+guint
+object_share_size (ObjectShare *share)
+{
+    return g_hash_table_size (share->objects);
+}
+/*
+ * A list of the shared objects, including those no longer shared with new
+ * users. The caller must free it with g_list_free_full and
+ * g_object_unref.
+ */
+GList*
+object_share_objects (ObjectShare *share)
+{
+    GList *objects = g_hash_table_get_keys (share->objects);
+
+    g_list_foreach (objects, (GFunc)g_object_ref, NULL);
+    return objects;
+}
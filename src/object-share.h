@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef OBJECT_SHARE_H
+#define OBJECT_SHARE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "handle-map-entry.h"
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define OBJECT_SHARE_MAX_DEFAULT 0
+#define OBJECT_SHARE_MAX         64
+
+/*
+ * The ObjectShare tracks the transient objects loaded by a Load command
+ * that other connections may use instead of loading their own copy. Each
+ * shared object is a HandleMapEntry that isn't in any HandleMap: the
+ * entries in the HandleMaps of the connections using it are backed by it
+ * (see handle_map_entry_new_shared), and it's kept until the last of them
+ * is released.
+ */
+typedef struct _ObjectShareClass {
+    GObjectClass      parent;
+} ObjectShareClass;
+
+typedef struct _ObjectShare {
+    GObject           parent_instance;
+    GHashTable       *keys;
+    GHashTable       *objects;
+    guint             max_entries;
+} ObjectShare;
+
+#define TYPE_OBJECT_SHARE              (object_share_get_type   ())
+#define OBJECT_SHARE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_OBJECT_SHARE, ObjectShare))
+#define OBJECT_SHARE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_OBJECT_SHARE, ObjectShareClass))
+#define IS_OBJECT_SHARE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_OBJECT_SHARE))
+#define IS_OBJECT_SHARE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_OBJECT_SHARE))
+#define OBJECT_SHARE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_OBJECT_SHARE, ObjectShareClass))
+
+GType            object_share_get_type    (void);
+ObjectShare*     object_share_new         (guint             max_entries);
+GBytes*          object_share_key         (Tpm2Command      *command);
+gboolean         object_share_insert      (ObjectShare      *share,
+                                           GBytes           *key,
+                                           HandleMapEntry   *object,
+                                           GBytes           *response);
+HandleMapEntry*  object_share_lookup      (ObjectShare      *share,
+                                           GBytes           *key,
+                                           GBytes          **response);
+gboolean         object_share_release     (ObjectShare      *share,
+                                           HandleMapEntry   *object);
+void             object_share_forget      (ObjectShare      *share);
+gboolean         object_share_invalidates (TPM2_CC           command_code);
+guint            object_share_size        (ObjectShare      *share);
+GList*           object_share_objects     (ObjectShare      *share);
+
+G_END_DECLS
+#endif /* OBJECT_SHARE_H */
@@ -0,0 +1,470 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "pcapng-writer.h"
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define IPPROTO_TCP_NUMBER 6
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT  1
+#define SHB_USERAPPL 4
+#define IF_TSRESOL   9
+#define EPB_FLAGS    2
+/* the direction bits of epb_flags, seen from the daemon */
+#define EPB_INBOUND  1
+#define EPB_OUTBOUND 2
+/* 127.0.0.1, the clients are 10.x.y.z from the serial of their connection */
+#define SERVER_ADDRESS 0x7f000001
+#define CLIENT_NETWORK 0x0a000000
+
+G_DEFINE_TYPE (PcapngWriter, pcapng_writer, G_TYPE_OBJECT);
+
+static void
+pcapng_writer_init (PcapngWriter *self)
+{
+    self->streams = g_hash_table_new_full (g_direct_hash,
+                                           g_direct_equal,
+                                           NULL,
+                                           g_free);
+}
+static void
+pcapng_writer_finalize (GObject *object)
+{
+    PcapngWriter *self = PCAPNG_WRITER (object);
+
+    g_debug ("%s", __func__);
+    if (self->file != NULL) {
+        g_info ("%s: wrote %" PRIu64 " packets to %s, rotated %u times",
+                __func__, self->packets, self->path, self->rotations);
+        fclose (self->file);
+    }
+    g_hash_table_unref (self->streams);
+    g_free (self->path);
+    G_OBJECT_CLASS (pcapng_writer_parent_class)->finalize (object);
+}
+static void
+pcapng_writer_class_init (PcapngWriterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (pcapng_writer_parent_class == NULL)
+        pcapng_writer_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = pcapng_writer_finalize;
+}
+/*
+ * The blocks are written in host byte order, the byte order magic of the
+ * section header tells readers which one it is. The packets inside are in
+ * network byte order like on the wire.
+ */
+static void
+append_u16 (GByteArray *block,
+            guint16     value)
+{
+    g_byte_array_append (block, (guint8*)&value, sizeof (value));
+}
+static void
+append_u32 (GByteArray *block,
+            guint32     value)
+{
+    g_byte_array_append (block, (guint8*)&value, sizeof (value));
+}
+static void
+append_padded (GByteArray   *block,
+               guint8 const *data,
+               gsize         size)
+{
+    static const guint8 zeros [4] = { 0 };
+
+    if (size > 0) {
+        g_byte_array_append (block, data, size);
+    }
+    if (size % 4 != 0) {
+        g_byte_array_append (block, zeros, 4 - size % 4);
+    }
+}
+static void
+append_option (GByteArray   *block,
+               guint16       code,
+               guint8 const *data,
+               guint16       size)
+{
+    append_u16 (block, code);
+    append_u16 (block, size);
+    append_padded (block, data, size);
+}
+static GByteArray*
+block_new (guint32 type)
+{
+    GByteArray *block = g_byte_array_new ();
+
+    append_u32 (block, type);
+    /* the total length, set by block_finish */
+    append_u32 (block, 0);
+    return block;
+}
+/*
+ * End the options of 'block' and set its total length at both ends.
+ */
+static void
+block_finish (GByteArray *block)
+{
+    guint32 length;
+
+    append_option (block, OPT_ENDOFOPT, NULL, 0);
+    length = block->len + sizeof (length);
+    memcpy (&block->data [4], &length, sizeof (length));
+    append_u32 (block, length);
+}
+static void
+put_be16 (guint8  *dest,
+          guint16  value)
+{
+    value = GUINT16_TO_BE (value);
+    memcpy (dest, &value, sizeof (value));
+}
+static void
+put_be32 (guint8  *dest,
+          guint32  value)
+{
+    value = GUINT32_TO_BE (value);
+    memcpy (dest, &value, sizeof (value));
+}
+/*
+ * Add 'data' to the one's complement 'sum' of the internet checksum.
+ */
+static guint32
+checksum_add (guint32       sum,
+              guint8 const *data,
+              gsize         size)
+{
+    gsize i;
+
+    for (i = 0; i + 1 < size; i += 2) {
+        sum += (data [i] << 8) | data [i + 1];
+    }
+    if (size % 2 != 0) {
+        sum += data [size - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+/*
+ * Build the IPv4 packet carrying 'payload' in the TCP stream of
+ * 'connection', from the daemon if 'response' is set and to it otherwise,
+ * and move the sequence number of the sender past it.
+ */
+static GByteArray*
+packet_new (pcapng_stream_t *stream,
+            guint            connection,
+            gboolean         response,
+            guint8           flags,
+            guint8 const    *payload,
+            gsize            size)
+{
+    GByteArray *packet;
+    guint8 *ip, *tcp, pseudo [12];
+    guint32 client = CLIENT_NETWORK | (connection & 0xffffff), sum;
+    guint32 *seq = response ? &stream->server_seq : &stream->client_seq;
+    guint32 *ack = response ? &stream->client_seq : &stream->server_seq;
+
+    packet = g_byte_array_sized_new (PCAPNG_PACKET_HEADERS_SIZE + size);
+    g_byte_array_set_size (packet, PCAPNG_PACKET_HEADERS_SIZE);
+    memset (packet->data, 0, PCAPNG_PACKET_HEADERS_SIZE);
+    if (size > 0) {
+        g_byte_array_append (packet, payload, size);
+    }
+    ip = packet->data;
+    tcp = packet->data + 20;
+
+    ip [0] = 0x45;
+    put_be16 (&ip [2], packet->len);
+    /* don't fragment */
+    ip [6] = 0x40;
+    ip [8] = 64;
+    ip [9] = IPPROTO_TCP_NUMBER;
+    put_be32 (&ip [12], response ? SERVER_ADDRESS : client);
+    put_be32 (&ip [16], response ? client : SERVER_ADDRESS);
+    put_be16 (&ip [10], ~checksum_add (0, ip, 20) & 0xffff);
+
+    put_be16 (&tcp [0], response ? PCAPNG_SERVER_PORT : PCAPNG_CLIENT_PORT);
+    put_be16 (&tcp [2], response ? PCAPNG_CLIENT_PORT : PCAPNG_SERVER_PORT);
+    put_be32 (&tcp [4], *seq);
+    put_be32 (&tcp [8], (flags & TCP_ACK) ? *ack : 0);
+    tcp [12] = 5 << 4;
+    tcp [13] = flags;
+    put_be16 (&tcp [14], G_MAXUINT16);
+    memcpy (&pseudo [0], &ip [12], 8);
+    pseudo [8] = 0;
+    pseudo [9] = IPPROTO_TCP_NUMBER;
+    put_be16 (&pseudo [10], packet->len - 20);
+    sum = checksum_add (0, pseudo, sizeof (pseudo));
+    sum = checksum_add (sum, tcp, packet->len - 20);
+    put_be16 (&tcp [16], ~sum & 0xffff);
+
+    *seq += size + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+    return packet;
+}
+static gboolean pcapng_writer_open (PcapngWriter *self);
+/*
+ * Start a new file once the current one would grow past the maximum. The
+ * current file goes to '<path>.old', the one there before is lost.
+ */
+static void
+pcapng_writer_rotate (PcapngWriter *self)
+{
+    gchar *old_path = g_strconcat (self->path, PCAPNG_OLD_SUFFIX, NULL);
+
+    g_debug ("%s: %s holds %" G_GSIZE_FORMAT " bytes, moving it to %s",
+             __func__, self->path, self->size, old_path);
+    fclose (self->file);
+    self->file = NULL;
+    if (g_rename (self->path, old_path) != 0) {
+        g_warning ("%s: failed to rename %s to %s: %s", __func__,
+                   self->path, old_path, strerror (errno));
+    }
+    g_free (old_path);
+    if (pcapng_writer_open (self)) {
+        ++self->rotations;
+    }
+}
+/*
+ * Write 'block' to the file. Capturing stops at the first write error,
+ * like recording: Wireshark can't read past a partial block.
+ */
+static gboolean
+pcapng_writer_write_block (PcapngWriter *self,
+                           GByteArray   *block)
+{
+    if (self->file != NULL &&
+        self->max_size > 0 &&
+        self->file_packets > 0 &&
+        self->size + block->len > self->max_size)
+    {
+        pcapng_writer_rotate (self);
+    }
+    if (self->file == NULL) {
+        return FALSE;
+    }
+    if (fwrite (block->data, block->len, 1, self->file) != 1 ||
+        fflush (self->file) != 0)
+    {
+        g_warning ("%s: failed to write to %s, capture stopped after %"
+                   PRIu64 " packets", __func__, self->path, self->packets);
+        fclose (self->file);
+        self->file = NULL;
+        return FALSE;
+    }
+    self->size += block->len;
+    return TRUE;
+}
+/*
+ * Create the file at 'path', replacing any file that's there, and write
+ * the section header and the one interface. Like the recordings the file
+ * holds authorization values, so only the owner may read it.
+ */
+static gboolean
+pcapng_writer_open (PcapngWriter *self)
+{
+    static const guint8 tsresol = 6;
+    const gchar *application = "tpm2-abrmd";
+    GByteArray *block;
+    FILE *file;
+    gint fd;
+
+    fd = g_open (self->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning ("%s: failed to create %s: %s", __func__, self->path,
+                   strerror (errno));
+        return FALSE;
+    }
+    file = fdopen (fd, "w");
+    if (file == NULL) {
+        g_warning ("%s: fdopen failed for %s: %s", __func__, self->path,
+                   strerror (errno));
+        close (fd);
+        return FALSE;
+    }
+    self->file = file;
+    self->size = 0;
+    self->file_packets = 0;
+
+    block = block_new (PCAPNG_BLOCK_SECTION_HEADER);
+    append_u32 (block, PCAPNG_BYTE_ORDER_MAGIC);
+    append_u16 (block, 1);
+    append_u16 (block, 0);
+    /* the length of the section isn't known */
+    append_u32 (block, G_MAXUINT32);
+    append_u32 (block, G_MAXUINT32);
+    append_option (block, SHB_USERAPPL, (guint8 const*)application,
+                   strlen (application));
+    block_finish (block);
+    pcapng_writer_write_block (self, block);
+    g_byte_array_unref (block);
+
+    block = block_new (PCAPNG_BLOCK_INTERFACE);
+    append_u16 (block, PCAPNG_LINKTYPE_IPV4);
+    append_u16 (block, 0);
+    /* no snap length */
+    append_u32 (block, 0);
+    append_option (block, IF_TSRESOL, &tsresol, sizeof (tsresol));
+    block_finish (block);
+    pcapng_writer_write_block (self, block);
+    g_byte_array_unref (block);
+
+    return self->file != NULL;
+}
+/*
+ * Write one packet of the stream of 'connection' as an enhanced packet
+ * block, with the serial in its comment and its direction in its flags.
+ */
+static void
+pcapng_writer_write_packet (PcapngWriter    *self,
+                            pcapng_stream_t *stream,
+                            guint            connection,
+                            gboolean         response,
+                            guint8           flags,
+                            guint8 const    *payload,
+                            gsize            size)
+{
+    GByteArray *packet, *block;
+    guint64 now = g_get_real_time ();
+    guint32 direction = response ? EPB_OUTBOUND : EPB_INBOUND;
+    gchar *comment;
+
+    packet = packet_new (stream, connection, response, flags, payload, size);
+    comment = g_strdup_printf ("connection %u", connection);
+    block = block_new (PCAPNG_BLOCK_ENHANCED_PACKET);
+    /* the interface */
+    append_u32 (block, 0);
+    append_u32 (block, (guint32)(now >> 32));
+    append_u32 (block, (guint32)now);
+    append_u32 (block, packet->len);
+    append_u32 (block, packet->len);
+    append_padded (block, packet->data, packet->len);
+    append_option (block, OPT_COMMENT, (guint8 const*)comment,
+                   strlen (comment));
+    append_option (block, EPB_FLAGS, (guint8 const*)&direction,
+                   sizeof (direction));
+    block_finish (block);
+    if (pcapng_writer_write_block (self, block)) {
+        ++self->packets;
+        ++self->file_packets;
+    }
+    g_byte_array_unref (block);
+    g_byte_array_unref (packet);
+    g_free (comment);
+}
+/*
+ * Get the stream of 'connection', opening it with a handshake the first
+ * time the connection is seen so Wireshark follows it from the start.
+ */
+static pcapng_stream_t*
+pcapng_writer_stream (PcapngWriter *self,
+                      guint         connection)
+{
+    pcapng_stream_t *stream;
+
+    stream = g_hash_table_lookup (self->streams, GUINT_TO_POINTER (connection));
+    if (stream != NULL) {
+        return stream;
+    }
+    stream = g_new0 (pcapng_stream_t, 1);
+    g_hash_table_insert (self->streams, GUINT_TO_POINTER (connection), stream);
+    pcapng_writer_write_packet (self, stream, connection, FALSE,
+                                TCP_SYN, NULL, 0);
+    pcapng_writer_write_packet (self, stream, connection, TRUE,
+                                TCP_SYN | TCP_ACK, NULL, 0);
+    return stream;
+}
+/*
+ * Create a PcapngWriter capturing to a new file at 'path', keeping it
+ * under 'max_size' bytes, 0 for no limit. Returns NULL if the file can't
+ * be created.
+ */
+PcapngWriter*
+pcapng_writer_new (const gchar *path,
+                   gsize        max_size)
+{
+    PcapngWriter *writer;
+
+    g_return_val_if_fail (path != NULL, NULL);
+    writer = PCAPNG_WRITER (g_object_new (TYPE_PCAPNG_WRITER, NULL));
+    writer->path = g_strdup (path);
+    writer->max_size = max_size;
+    if (!pcapng_writer_open (writer)) {
+        g_object_unref (writer);
+        return NULL;
+    }
+    g_info ("%s: capturing commands to %s", __func__, path);
+    return writer;
+}
+/*
+ * Write the command or the 'response' 'data' of the connection with serial
+ * 'connection'. A command goes in a TPM_SEND_COMMAND of the simulator, at
+ * locality 0, and a response is followed by the simulator's status.
+ */
+void
+pcapng_writer_add (PcapngWriter *writer,
+                   guint         connection,
+                   gboolean      response,
+                   guint8 const *data,
+                   size_t        size)
+{
+    pcapng_stream_t *stream;
+    GByteArray *payload;
+    guint8 head [9] = { 0 };
+
+    if (writer->file == NULL) {
+        return;
+    }
+    stream = pcapng_writer_stream (writer, connection);
+    payload = g_byte_array_sized_new (sizeof (head) + size + 4);
+    if (response) {
+        put_be32 (&head [0], size);
+        g_byte_array_append (payload, head, 4);
+        g_byte_array_append (payload, data, size);
+        put_be32 (&head [0], 0);
+        g_byte_array_append (payload, head, 4);
+    } else {
+        put_be32 (&head [0], PCAPNG_TPM_SEND_COMMAND);
+        head [4] = 0;
+        put_be32 (&head [5], size);
+        g_byte_array_append (payload, head, sizeof (head));
+        g_byte_array_append (payload, data, size);
+    }
+    pcapng_writer_write_packet (writer, stream, connection, response,
+                                TCP_PSH | TCP_ACK, payload->data,
+                                payload->len);
+    g_byte_array_unref (payload);
+}
+/*
+ * End the stream of the connection with serial 'connection' with a FIN
+ * from the client, if anything was captured for it.
+ */
+void
+pcapng_writer_close (PcapngWriter *writer,
+                     guint         connection)
+{
+    pcapng_stream_t *stream;
+
+    stream = g_hash_table_lookup (writer->streams,
+                                  GUINT_TO_POINTER (connection));
+    if (stream == NULL) {
+        return;
+    }
+    pcapng_writer_write_packet (writer, stream, connection, FALSE,
+                                TCP_FIN | TCP_ACK, NULL, 0);
+    g_hash_table_remove (writer->streams, GUINT_TO_POINTER (connection));
+}
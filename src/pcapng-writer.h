@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PCAPNG_WRITER_H
+#define PCAPNG_WRITER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The PcapngWriter writes the commands and responses of every connection
+ * to a pcap-ng file for Wireshark and its TPM 2.0 dissector. Each message
+ * is a packet of a made up TCP stream between the client and the port of
+ * the Microsoft simulator, framed the way the simulator reads and writes
+ * them so the dissector decodes the commands and responses. Each
+ * connection gets its own client address, made of its serial, and its
+ * packets carry the serial in their comment. The time of the packets is
+ * the wall clock in microseconds.
+ *
+ * The file works like a flight recorder: once it would grow past
+ * 'max_size' it's renamed to '<path>.old', replacing an earlier one, and
+ * a new file is started, so at most twice 'max_size' are kept on disk.
+ * The writer isn't locked, the CommandRecorder feeding it is.
+ */
+#define PCAPNG_BLOCK_SECTION_HEADER     0x0a0d0d0a
+#define PCAPNG_BLOCK_INTERFACE          0x00000001
+#define PCAPNG_BLOCK_ENHANCED_PACKET    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC         0x1a2b3c4d
+#define PCAPNG_LINKTYPE_IPV4            228
+/* the TCP port of the simulator's TPM commands and its command code */
+#define PCAPNG_SERVER_PORT              2321
+#define PCAPNG_CLIENT_PORT              49152
+#define PCAPNG_TPM_SEND_COMMAND         8
+/* the IPv4 and TCP headers in front of each message */
+#define PCAPNG_PACKET_HEADERS_SIZE      (20 + 20)
+#define PCAPNG_OLD_SUFFIX               ".old"
+
+typedef struct {
+    guint32  client_seq;
+    guint32  server_seq;
+} pcapng_stream_t;
+
+typedef struct _PcapngWriterClass {
+    GObjectClass        parent;
+} PcapngWriterClass;
+
+typedef struct _PcapngWriter {
+    GObject             parent_instance;
+    FILE               *file;
+    gchar              *path;
+    gsize               max_size;
+    /* the size of the current file */
+    gsize               size;
+    guint64             packets;
+    /* the packets in the current file */
+    guint64             file_packets;
+    guint               rotations;
+    /* pcapng_stream_t of each connection by serial */
+    GHashTable         *streams;
+} PcapngWriter;
+
+#define TYPE_PCAPNG_WRITER            (pcapng_writer_get_type ())
+#define PCAPNG_WRITER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_PCAPNG_WRITER, PcapngWriter))
+#define PCAPNG_WRITER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TYPE_PCAPNG_WRITER, PcapngWriterClass))
+#define IS_PCAPNG_WRITER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_PCAPNG_WRITER))
+#define IS_PCAPNG_WRITER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TYPE_PCAPNG_WRITER))
+#define PCAPNG_WRITER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TYPE_PCAPNG_WRITER, PcapngWriterClass))
+
+GType            pcapng_writer_get_type    (void);
+PcapngWriter*    pcapng_writer_new         (const gchar            *path,
+                                            gsize                   max_size);
+void             pcapng_writer_add         (PcapngWriter           *writer,
+                                            guint                   connection,
+                                            gboolean                response,
+                                            guint8 const           *data,
+                                            size_t                  size);
+void             pcapng_writer_close       (PcapngWriter           *writer,
+                                            guint                   connection);
+
+G_END_DECLS
+#endif /* PCAPNG_WRITER_H */
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "pcr-cache.h"
+
+G_DEFINE_TYPE (PcrCache, pcr_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+/*
+ * GObject property getter.
+ */
+static void
+pcr_cache_get_property (GObject    *object,
+                        guint       property_id,
+                        GValue     *value,
+                        GParamSpec *pspec)
+{
+    PcrCache *self = PCR_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+pcr_cache_set_property (GObject        *object,
+                        guint           property_id,
+                        GValue const   *value,
+                        GParamSpec     *pspec)
+{
+    PcrCache *self = PCR_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+pcr_cache_init (PcrCache *self)
+{
+    self->table = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)g_bytes_unref);
+}
+/*
+ * GObject finalize function: release the GHashTable and with it all of
+ * the cached responses.
+ */
+static void
+pcr_cache_finalize (GObject *object)
+{
+    PcrCache *self = PCR_CACHE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    G_OBJECT_CLASS (pcr_cache_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+pcr_cache_class_init (PcrCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (pcr_cache_parent_class == NULL)
+        pcr_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = pcr_cache_finalize;
+    object_class->get_property = pcr_cache_get_property;
+    object_class->set_property = pcr_cache_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max number of entries",
+                           "maximum number of cached PCR_Read responses",
+                           0,
+                           PCR_CACHE_MAX,
+                           PCR_CACHE_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+PcrCache*
+pcr_cache_new (guint max_entries)
+{
+    g_debug ("%s with max_entries: %u", __func__, max_entries);
+    return PCR_CACHE (g_object_new (TYPE_PCR_CACHE,
+                                    "max-entries", max_entries,
+                                    NULL));
+}
+/*
+ * Generate the key used to cache the response to the provided PCR_Read
+ * command: its parameter area, the PCR selection. Only PCR_Read commands
+ * without sessions are cached, an audit session makes each response
+ * different.
+ * This function returns NULL if the command can't be cached. The caller
+ * must free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+pcr_cache_key (Tpm2Command *command)
+{
+    size_t offset;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_PCR_Read ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    if (offset == 0 || offset >= tpm2_command_get_size (command)) {
+        return NULL;
+    }
+    return g_bytes_new (tpm2_command_get_buffer (command) + offset,
+                        tpm2_command_get_size (command) - offset);
+}
+/*
+ * Return TRUE if executing the command with the provided command code may
+ * change the value of a PCR, the set of PCR banks or the
+ * pcrUpdateCounter: the responses in the cache are stale after it.
+ */
+gboolean
+pcr_cache_invalidates (TPM2_CC command_code)
+{
+    switch (command_code) {
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_PCR_Event:
+    case TPM2_CC_PCR_Reset:
+    case TPM2_CC_PCR_Allocate:
+    case TPM2_CC_SequenceComplete:
+    case TPM2_CC_EventSequenceComplete:
+    case TPM2_CC_Startup:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * Add the response to the PCR_Read command with the provided key to the
+ * cache. If the cache is full FALSE is returned and nothing is added.
+ */
+gboolean
+pcr_cache_insert (PcrCache *cache,
+                  GBytes   *key,
+                  GBytes   *response)
+{
+    if (g_hash_table_size (cache->table) >= cache->max_entries &&
+        !g_hash_table_contains (cache->table, key))
+    {
+        g_debug ("%s: cache is full", __func__);
+        return FALSE;
+    }
+    g_hash_table_replace (cache->table,
+                          g_bytes_ref (key),
+                          g_bytes_ref (response));
+    return TRUE;
+}
+/*
+ * Look up the response cached under 'key'. Returns a new reference to
+ * the response, or NULL if there is none.
+ */
+GBytes*
+pcr_cache_lookup (PcrCache *cache,
+                  GBytes   *key)
+{
+    GBytes *response;
+
+    response = g_hash_table_lookup (cache->table, key);
+    return response != NULL ? g_bytes_ref (response) : NULL;
+}
+/*
+ * Drop all cached responses. This must be done once any command that
+ * pcr_cache_invalidates is true for has been sent to the TPM.
+ */
+void
+pcr_cache_clear (PcrCache *cache)
+{
+    if (g_hash_table_size (cache->table) > 0) {
+        g_debug ("%s: dropping %u cached PCR_Read responses", __func__,
+                 g_hash_table_size (cache->table));
+        g_hash_table_remove_all (cache->table);
+    }
+}
+guint
+pcr_cache_size (PcrCache *cache)
+{
+    return g_hash_table_size (cache->table);
+}
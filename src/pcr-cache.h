@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PCR_CACHE_H
+#define PCR_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define PCR_CACHE_MAX_DEFAULT 0
+#define PCR_CACHE_MAX         64
+
+/*
+ * The PcrCache holds the responses to PCR_Read commands, keyed by the PCR
+ * selection they asked for. Every change to a PCR, in any bank, changes
+ * the pcrUpdateCounter that each response carries, so the whole cache is
+ * dropped by any command that may change a PCR rather than only the
+ * entries for the PCRs it touches.
+ */
+typedef struct _PcrCacheClass {
+    GObjectClass      parent;
+} PcrCacheClass;
+
+typedef struct _PcrCache {
+    GObject           parent_instance;
+    GHashTable       *table;
+    guint             max_entries;
+} PcrCache;
+
+#define TYPE_PCR_CACHE              (pcr_cache_get_type   ())
+#define PCR_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_PCR_CACHE, PcrCache))
+#define PCR_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_PCR_CACHE, PcrCacheClass))
+#define IS_PCR_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_PCR_CACHE))
+#define IS_PCR_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_PCR_CACHE))
+#define PCR_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_PCR_CACHE, PcrCacheClass))
+
+GType            pcr_cache_get_type        (void);
+PcrCache*        pcr_cache_new             (guint             max_entries);
+GBytes*          pcr_cache_key             (Tpm2Command      *command);
+gboolean         pcr_cache_invalidates     (TPM2_CC           command_code);
+gboolean         pcr_cache_insert          (PcrCache         *cache,
+                                            GBytes           *key,
+                                            GBytes           *response);
+GBytes*          pcr_cache_lookup          (PcrCache         *cache,
+                                            GBytes           *key);
+void             pcr_cache_clear           (PcrCache         *cache);
+guint            pcr_cache_size            (PcrCache         *cache);
+
+G_END_DECLS
+#endif /* PCR_CACHE_H */
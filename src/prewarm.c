@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gunixfdlist.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipc-frontend.h"
+#include "prewarm.h"
+#include "rate-limiter.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * Decode the hex in 'hex' into a command buffer, ignoring whitespace.
+ * Returns NULL unless it's a whole CreatePrimary or Load command.
+ */
+GBytes*
+prewarm_parse_command (const gchar *hex)
+{
+    GBytes *command;
+    TPM2_CC code;
+
+    command = parse_command_hex (hex);
+    if (command == NULL) {
+        return NULL;
+    }
+    code = get_command_code ((uint8_t*)g_bytes_get_data (command, NULL));
+    if (code != TPM2_CC_CreatePrimary && code != TPM2_CC_Load) {
+        g_warning ("%s: command code 0x%" PRIx32 " isn't CreatePrimary or "
+                   "Load", __func__, code);
+        g_bytes_unref (command);
+        return NULL;
+    }
+    return command;
+}
+/*
+ * Read the commands from the file at 'path'. Returns NULL if the file
+ * can't be read or any command in it is bad.
+ */
+prewarm_t*
+prewarm_load (const gchar *path)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    GError *error = NULL;
+    prewarm_t *prewarm = NULL;
+    GPtrArray *commands;
+    GBytes *command;
+    gchar **groups = NULL, *hex;
+    gsize i;
+
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error)) {
+        g_warning ("%s: failed to read %s: %s", __func__, path,
+                   error->message);
+        g_error_free (error);
+        goto out;
+    }
+    commands = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+    groups = g_key_file_get_groups (key_file, NULL);
+    for (i = 0; groups [i] != NULL; ++i) {
+        hex = g_key_file_get_string (key_file,
+                                     groups [i],
+                                     PREWARM_KEY_COMMAND,
+                                     &error);
+        if (hex == NULL) {
+            g_warning ("%s: [%s] in %s: %s", __func__, groups [i], path,
+                       error->message);
+            g_error_free (error);
+            g_ptr_array_unref (commands);
+            goto out;
+        }
+        command = prewarm_parse_command (hex);
+        g_free (hex);
+        if (command == NULL) {
+            g_warning ("%s: [%s] in %s has a bad command", __func__,
+                       groups [i], path);
+            g_ptr_array_unref (commands);
+            goto out;
+        }
+        g_ptr_array_add (commands, command);
+    }
+    prewarm = g_new0 (prewarm_t, 1);
+    prewarm->commands = commands;
+    g_info ("%s: %u commands to prewarm from %s", __func__, commands->len,
+            path);
+out:
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+    return prewarm;
+}
+/*
+ * Send 'buf' through 'client' and read the response. Returns the response
+ * code, TSS2_RESMGR_RC_GENERAL_FAILURE if the connection failed. The
+ * response handle is returned through 'handle' if there's one.
+ */
+static TSS2_RC
+prewarm_send (GIOStream     *client,
+              guint8 const  *buf,
+              size_t         size,
+              TPM2_HANDLE   *handle)
+{
+    guint8 *response;
+    size_t response_size;
+    TSS2_RC rc;
+
+    if (write_all (g_io_stream_get_output_stream (client), buf, size) !=
+        (ssize_t)size)
+    {
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    response = read_tpm_buffer_alloc (g_io_stream_get_input_stream (client),
+                                      &response_size);
+    if (response == NULL) {
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    rc = get_response_code (response);
+    if (handle != NULL && rc == TSS2_RC_SUCCESS &&
+        response_size >= TPM_HEADER_SIZE + sizeof (*handle))
+    {
+        memcpy (handle, response + TPM_HEADER_SIZE, sizeof (*handle));
+        *handle = GUINT32_FROM_BE (*handle);
+    }
+    util_buf_put (response, response_size);
+    return rc;
+}
+/*
+ * Send the commands through the connection whose client end 'client' is,
+ * one at a time, flushing the primary objects created. Returns the number
+ * of commands that succeeded.
+ */
+guint
+prewarm_run (GIOStream *client,
+             GPtrArray *commands)
+{
+    GBytes *command;
+    guint8 flush [TPM_HEADER_SIZE + sizeof (TPM2_HANDLE)];
+    guint8 const *buf;
+    TPM2_HANDLE handle;
+    guint32 value;
+    gsize size;
+    guint i, warmed = 0;
+    TSS2_RC rc;
+
+    for (i = 0; i < commands->len; ++i) {
+        command = g_ptr_array_index (commands, i);
+        buf = g_bytes_get_data (command, &size);
+        handle = 0;
+        rc = prewarm_send (client, buf, size, &handle);
+        g_info ("%s: command %u with code 0x%" PRIx32 " got RC 0x%" PRIx32,
+                __func__, i, get_command_code ((uint8_t*)buf), rc);
+        if (rc == TSS2_RESMGR_RC_GENERAL_FAILURE) {
+            break;
+        } else if (rc != TSS2_RC_SUCCESS) {
+            continue;
+        }
+        ++warmed;
+        if (get_command_code ((uint8_t*)buf) != TPM2_CC_CreatePrimary ||
+            handle == 0)
+        {
+            continue;
+        }
+        tpm2_header_init (flush,
+                          sizeof (flush),
+                          TPM2_ST_NO_SESSIONS,
+                          sizeof (flush),
+                          TPM2_CC_FlushContext);
+        value = GUINT32_TO_BE (handle);
+        memcpy (flush + TPM_HEADER_SIZE, &value, sizeof (value));
+        prewarm_send (client, flush, sizeof (flush), NULL);
+    }
+    return warmed;
+}
+/*
+ * Thread sending the commands through each connection in turn. A
+ * connection is assigned to a backend when its first command is
+ * dispatched, going through them one after the other spreads them over
+ * the backends.
+ */
+static gpointer
+prewarm_thread (gpointer user_data)
+{
+    prewarm_t *prewarm = (prewarm_t*)user_data;
+    guint i, warmed;
+
+    for (i = 0; i < prewarm->client_count; ++i) {
+        warmed = prewarm_run (prewarm->clients [i], prewarm->commands);
+        g_info ("%s: %u of %u commands prewarmed on connection %u",
+                __func__, warmed, prewarm->commands->len, i);
+    }
+    return NULL;
+}
+/*
+ * Create a connection for each of the 'backends' TPMs and start sending
+ * the commands through them. The connections are added to 'manager' like
+ * a client's would be so the CommandSources read from them, 'max_trans'
+ * is the number of transient objects each may hold.
+ */
+gboolean
+prewarm_start (prewarm_t         *prewarm,
+               ConnectionManager *manager,
+               Random            *random,
+               guint              max_trans,
+               guint              backends)
+{
+    Connection *connection;
+    GUnixFDList *fd_list = NULL;
+    GSocket *socket;
+    guint64 id;
+    guint flags, i;
+    gint fd;
+
+    for (i = 0; i < backends && i < TABRMD_BACKENDS_MAX; ++i) {
+        id = random_get_uint64 (random);
+        if (connection_manager_contains_id (manager, id)) {
+            g_warning ("%s: ID collision in ConnectionManager", __func__);
+            return FALSE;
+        }
+        flags = 0;
+        connection = ipc_frontend_connection_new (id,
+                                                  0,
+                                                  RATE_LIMITER_UID_NONE,
+                                                  max_trans,
+                                                  TABRMD_PRIORITY_BATCH,
+                                                  &flags,
+                                                  &fd_list);
+        fd = g_unix_fd_list_get (fd_list, 0, NULL);
+        g_clear_object (&fd_list);
+        if (connection_manager_insert (manager, connection) != 0) {
+            g_warning ("%s: failed to add prewarm connection", __func__);
+            g_object_unref (connection);
+            close (fd);
+            return FALSE;
+        }
+        g_object_unref (connection);
+        socket = g_socket_new_from_fd (fd, NULL);
+        if (socket == NULL) {
+            close (fd);
+            return FALSE;
+        }
+        prewarm->clients [prewarm->client_count++] =
+            G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+        g_object_unref (socket);
+    }
+    prewarm->thread = g_thread_new ("tpm2-prewarm", prewarm_thread, prewarm);
+    return TRUE;
+}
+/*
+ * Stop sending commands and close the connections. The thread waiting for
+ * a response is woken up by shutting the sockets down.
+ */
+void
+prewarm_free (prewarm_t *prewarm)
+{
+    GSocket *socket;
+    guint i;
+
+    if (prewarm == NULL) {
+        return;
+    }
+    for (i = 0; i < prewarm->client_count; ++i) {
+        socket = g_socket_connection_get_socket (
+            G_SOCKET_CONNECTION (prewarm->clients [i]));
+        g_socket_shutdown (socket, TRUE, TRUE, NULL);
+    }
+    if (prewarm->thread != NULL) {
+        g_thread_join (prewarm->thread);
+    }
+    for (i = 0; i < prewarm->client_count; ++i) {
+        g_object_unref (prewarm->clients [i]);
+    }
+    g_ptr_array_unref (prewarm->commands);
+    g_free (prewarm);
+}
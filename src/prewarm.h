@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PREWARM_H
+#define PREWARM_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "connection-manager.h"
+#include "random.h"
+#include "tabrmd-defaults.h"
+
+G_BEGIN_DECLS
+
+/*
+ * The CreatePrimary and Load commands listed in the --prewarm file are
+ * sent once the daemon is up, through a connection of its own for each
+ * TPM backend, so the primary object cache and the ObjectShare already
+ * hold their objects when the first clients send the same commands. The
+ * file is a GKeyFile with a group for each command, its 'command' key
+ * holding the whole command buffer in hex:
+ *
+ *   [srk]
+ *   command=80020000004300000131...
+ *
+ * The caches are keyed on the command bytes so these must be the exact
+ * commands the clients send. The connections have the batch priority so
+ * the commands wait behind the clients', and they stay open until the
+ * daemon exits: the objects shared from them live as long as a connection
+ * uses them. Primary objects are flushed once created, their context
+ * stays in the cache.
+ */
+#define PREWARM_KEY_COMMAND "command"
+
+typedef struct {
+    /* the command buffers, GBytes */
+    GPtrArray              *commands;
+    /* the client end of the connection to each backend */
+    GIOStream              *clients [TABRMD_BACKENDS_MAX];
+    guint                   client_count;
+    GThread                *thread;
+} prewarm_t;
+
+GBytes*      prewarm_parse_command (const gchar        *hex);
+prewarm_t*   prewarm_load          (const gchar        *path);
+gboolean     prewarm_start         (prewarm_t          *prewarm,
+                                    ConnectionManager  *manager,
+                                    Random             *random,
+                                    guint               max_trans,
+                                    guint               backends);
+guint        prewarm_run           (GIOStream          *client,
+                                    GPtrArray          *commands);
+void         prewarm_free          (prewarm_t          *prewarm);
+
+G_END_DECLS
+#endif /* PREWARM_H */
@@ -0,0 +1,312 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "primary-cache.h"
+#include "util.h"
+
+G_DEFINE_TYPE (PrimaryCache, primary_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Each entry in the cache holds the saved context of the primary object
+ * and the response from the CreatePrimary command that created it.
+ */
+typedef struct {
+    TPMS_CONTEXT context;
+    GBytes      *response;
+} primary_cache_entry_t;
+
+static void
+primary_cache_entry_free (gpointer data)
+{
+    primary_cache_entry_t *entry = (primary_cache_entry_t*)data;
+
+    g_bytes_unref (entry->response);
+    g_free (entry);
+}
+/*
+ * GObject property getter.
+ */
+static void
+primary_cache_get_property (GObject    *object,
+                            guint       property_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+    PrimaryCache *self = PRIMARY_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+primary_cache_set_property (GObject        *object,
+                            guint           property_id,
+                            GValue const   *value,
+                            GParamSpec     *pspec)
+{
+    PrimaryCache *self = PRIMARY_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+primary_cache_init (PrimaryCache *self)
+{
+    self->table = g_hash_table_new_full (g_str_hash,
+                                         g_str_equal,
+                                         g_free,
+                                         primary_cache_entry_free);
+}
+/*
+ * GObject finalize function: release the GHashTable and with it all of
+ * the cached entries.
+ */
+static void
+primary_cache_finalize (GObject *object)
+{
+    PrimaryCache *self = PRIMARY_CACHE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    G_OBJECT_CLASS (primary_cache_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+primary_cache_class_init (PrimaryCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (primary_cache_parent_class == NULL)
+        primary_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = primary_cache_finalize;
+    object_class->get_property = primary_cache_get_property;
+    object_class->set_property = primary_cache_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max number of entries",
+                           "maximum number of cached primary objects",
+                           0,
+                           PRIMARY_CACHE_MAX,
+                           PRIMARY_CACHE_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+PrimaryCache*
+primary_cache_new (guint max_entries)
+{
+    g_debug ("%s with max_entries: %u", __func__, max_entries);
+    return PRIMARY_CACHE (g_object_new (TYPE_PRIMARY_CACHE,
+                                        "max-entries", max_entries,
+                                        NULL));
+}
+/*
+ * State used while iterating over the authorizations in a CreatePrimary
+ * command.
+ */
+typedef struct {
+    Tpm2Command *command;
+    gboolean     cacheable;
+} primary_cache_auth_data_t;
+/*
+ * GFunc invoked for each authorization in a CreatePrimary command. Only
+ * plain password authorizations leave the response identical each time the
+ * command is executed. Anything else marks the command as not cacheable.
+ */
+static void
+primary_cache_auth_callback (gpointer authorization,
+                             gpointer user_data)
+{
+    size_t offset = *(size_t*)authorization;
+    primary_cache_auth_data_t *data = (primary_cache_auth_data_t*)user_data;
+    TPMA_SESSION attrs;
+
+    attrs = tpm2_command_get_auth_attrs (data->command, offset);
+    if (tpm2_command_get_auth_handle (data->command, offset) != TPM2_RS_PW ||
+        attrs & (TPMA_SESSION_AUDIT | TPMA_SESSION_DECRYPT |
+                 TPMA_SESSION_ENCRYPT))
+    {
+        data->cacheable = FALSE;
+    }
+}
+/*
+ * Generate the key used to cache the primary object created by the
+ * provided CreatePrimary command. The key is made up of the hierarchy,
+ * the locality of the connection and a SHA256 digest of the whole command
+ * buffer: identical commands create identical primary objects. The
+ * locality is in the creationData of the response and the ticket that
+ * comes with it, commands sent at different localities don't share them.
+ * This function returns NULL if the response to the command can't be
+ * reused, i.e. if it's authorized by anything other than a plain password
+ * or if the creation data depends on the current PCR values.
+ * The caller must free the returned string with g_free.
+ */
+gchar*
+primary_cache_key (Tpm2Command *command)
+{
+    TPM2B_SENSITIVE_CREATE in_sensitive = { 0 };
+    TPM2B_PUBLIC in_public = { 0 };
+    TPM2B_DATA outside_info = { 0 };
+    TPML_PCR_SELECTION creation_pcr = { 0 };
+    primary_cache_auth_data_t auth_data = {
+        .command = command,
+        .cacheable = TRUE,
+    };
+    guint8 *buffer = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t offset;
+    Connection *connection;
+    guint8 locality = 0;
+    gchar *digest, *key;
+    TSS2_RC rc;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_CreatePrimary ||
+        !tpm2_command_has_auths (command))
+    {
+        return NULL;
+    }
+    tpm2_command_foreach_auth (command,
+                               primary_cache_auth_callback,
+                               &auth_data);
+    if (!auth_data.cacheable) {
+        g_debug ("%s: CreatePrimary auths prevent caching", __func__);
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    if (offset == 0) {
+        return NULL;
+    }
+    rc = Tss2_MU_TPM2B_SENSITIVE_CREATE_Unmarshal (buffer, size, &offset,
+                                                   &in_sensitive);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal (buffer, size, &offset,
+                                             &in_public);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_DATA_Unmarshal (buffer, size, &offset,
+                                           &outside_info);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPML_PCR_SELECTION_Unmarshal (buffer, size, &offset,
+                                                   &creation_pcr);
+    }
+    if (rc != TSS2_RC_SUCCESS || offset != size) {
+        g_debug ("%s: failed to parse CreatePrimary parameters", __func__);
+        return NULL;
+    }
+    if (creation_pcr.count != 0) {
+        g_debug ("%s: CreatePrimary with creationPCR not cached", __func__);
+        return NULL;
+    }
+
+    connection = tpm2_command_peek_connection (command);
+    if (connection != NULL) {
+        locality = connection_get_locality (connection);
+    }
+    digest = g_compute_checksum_for_data (G_CHECKSUM_SHA256, buffer, size);
+    key = g_strdup_printf ("%08" PRIx32 "-%02" PRIx8 "-%s",
+                           tpm2_command_get_handle (command, 0),
+                           locality,
+                           digest);
+    g_free (digest);
+
+    return key;
+}
+/*
+ * Add the saved context of a primary object and the CreatePrimary response
+ * that created it to the cache. If the cache is full FALSE is returned and
+ * nothing is added.
+ */
+gboolean
+primary_cache_insert (PrimaryCache *cache,
+                      gchar const  *key,
+                      TPMS_CONTEXT *context,
+                      GBytes       *response)
+{
+    primary_cache_entry_t *entry;
+
+    if (g_hash_table_size (cache->table) >= cache->max_entries) {
+        g_debug ("%s: cache is full", __func__);
+        return FALSE;
+    }
+    entry = g_new0 (primary_cache_entry_t, 1);
+    memcpy (&entry->context, context, sizeof (entry->context));
+    entry->response = g_bytes_ref (response);
+    g_hash_table_replace (cache->table, g_strdup (key), entry);
+
+    return TRUE;
+}
+/*
+ * Look up the primary object cached under 'key'. If found the context is
+ * copied to 'context', a new reference to the response is returned through
+ * 'response' and the function returns TRUE.
+ */
+gboolean
+primary_cache_lookup (PrimaryCache *cache,
+                      gchar const  *key,
+                      TPMS_CONTEXT *context,
+                      GBytes      **response)
+{
+    primary_cache_entry_t *entry;
+
+    entry = g_hash_table_lookup (cache->table, key);
+    if (entry == NULL) {
+        return FALSE;
+    }
+    memcpy (context, &entry->context, sizeof (*context));
+    *response = g_bytes_ref (entry->response);
+
+    return TRUE;
+}
+gboolean
+primary_cache_remove (PrimaryCache *cache,
+                      gchar const  *key)
+{
+    return g_hash_table_remove (cache->table, key);
+}
+/*
+ * Drop all cached primary objects. This must be done whenever the seed of
+ * a hierarchy changes since the primary objects from the cache can no
+ * longer be loaded.
+ */
+void
+primary_cache_clear (PrimaryCache *cache)
+{
+    g_debug ("%s: dropping %u cached primary objects", __func__,
+             g_hash_table_size (cache->table));
+    g_hash_table_remove_all (cache->table);
+}
+guint
+primary_cache_size (PrimaryCache *cache)
+{
+    return g_hash_table_size (cache->table);
+}
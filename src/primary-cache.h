@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PRIMARY_CACHE_H
+#define PRIMARY_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define PRIMARY_CACHE_MAX_DEFAULT 0
+#define PRIMARY_CACHE_MAX         16
+
+typedef struct _PrimaryCacheClass {
+    GObjectClass      parent;
+} PrimaryCacheClass;
+
+typedef struct _PrimaryCache {
+    GObject           parent_instance;
+    GHashTable       *table;
+    guint             max_entries;
+} PrimaryCache;
+
+#define TYPE_PRIMARY_CACHE              (primary_cache_get_type   ())
+#define PRIMARY_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_PRIMARY_CACHE, PrimaryCache))
+#define PRIMARY_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_PRIMARY_CACHE, PrimaryCacheClass))
+#define IS_PRIMARY_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_PRIMARY_CACHE))
+#define IS_PRIMARY_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_PRIMARY_CACHE))
+#define PRIMARY_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_PRIMARY_CACHE, PrimaryCacheClass))
+
+GType            primary_cache_get_type    (void);
+PrimaryCache*    primary_cache_new         (guint             max_entries);
+gchar*           primary_cache_key         (Tpm2Command      *command);
+gboolean         primary_cache_insert      (PrimaryCache     *cache,
+                                            gchar const      *key,
+                                            TPMS_CONTEXT     *context,
+                                            GBytes           *response);
+gboolean         primary_cache_lookup      (PrimaryCache     *cache,
+                                            gchar const      *key,
+                                            TPMS_CONTEXT     *context,
+                                            GBytes          **response);
+gboolean         primary_cache_remove      (PrimaryCache     *cache,
+                                            gchar const      *key);
+void             primary_cache_clear       (PrimaryCache     *cache);
+guint            primary_cache_size        (PrimaryCache     *cache);
+
+G_END_DECLS
+#endif /* PRIMARY_CACHE_H */
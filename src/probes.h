@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes for SystemTap and bpftrace, in the 'tabrmd' provider.
+ * They're compiled in with --enable-usdt: each one is a nop in the code
+ * and a note in the ELF file that the tracer patches when it attaches.
+ * Otherwise the macros expand to nothing and their arguments are never
+ * evaluated. The probes and their arguments:
+ *   command_read     (connection, command code, size)
+ *   queue_enqueue    (queue, message)
+ *   queue_dequeue    (queue, message)
+ *   tpm_send         (connection, command code, size)
+ *   tpm_return       (connection, command code, rc)
+ *   context_load     (handle, rc)
+ *   context_save     (handle, rc)
+ *   context_flush    (handle, rc)
+ *   response_write   (connection, command code, size)
+ * The connection and the queue are the addresses of the objects, they're
+ * only good for telling them apart. The handle of context_load is the one
+ * the TPM assigned, it's 0 if the load failed.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define TABRMD_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2 (tabrmd, name, a1, a2)
+#define TABRMD_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3 (tabrmd, name, a1, a2, a3)
+#else
+#define TABRMD_PROBE2(name, a1, a2)
+#define TABRMD_PROBE3(name, a1, a2, a3)
+#endif
+
+#endif /* PROBES_H */
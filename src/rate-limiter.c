@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "rate-limiter.h"
+#include "util.h"
+
+G_DEFINE_TYPE (RateLimiter, rate_limiter, G_TYPE_OBJECT);
+
+static void
+rate_limiter_init (RateLimiter *self)
+{
+    g_mutex_init (&self->mutex);
+    self->buckets = g_hash_table_new_full (g_direct_hash,
+                                           g_direct_equal,
+                                           NULL,
+                                           g_free);
+}
+static void
+rate_limiter_finalize (GObject *object)
+{
+    RateLimiter *self = RATE_LIMITER (object);
+
+    g_debug ("%s", __func__);
+    g_hash_table_unref (self->buckets);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (rate_limiter_parent_class)->finalize (object);
+}
+static void
+rate_limiter_class_init (RateLimiterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (rate_limiter_parent_class == NULL)
+        rate_limiter_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = rate_limiter_finalize;
+}
+/*
+ * Create a RateLimiter letting each user send 'rate' commands a second,
+ * 0 for no limit.
+ */
+RateLimiter*
+rate_limiter_new (guint rate)
+{
+    RateLimiter *limiter;
+
+    limiter = RATE_LIMITER (g_object_new (TYPE_RATE_LIMITER, NULL));
+    limiter->rate = rate;
+    return limiter;
+}
+/*
+ * Change the rate. Buckets holding more than a second's worth of the new
+ * rate are cut down the next time they're filled.
+ */
+void
+rate_limiter_set_rate (RateLimiter *limiter,
+                       guint        rate)
+{
+    g_atomic_int_set (&limiter->rate, rate);
+}
+guint
+rate_limiter_get_rate (RateLimiter *limiter)
+{
+    return (guint)g_atomic_int_get (&limiter->rate);
+}
+/*
+ * Fill 'bucket' with the tokens earned since it was last filled at 'now',
+ * the monotonic time in microseconds.
+ */
+static void
+rate_bucket_fill (rate_bucket_t *bucket,
+                  guint          rate,
+                  gint64         now)
+{
+    if (now > bucket->last) {
+        bucket->tokens += (gdouble)(now - bucket->last) * rate /
+                          G_USEC_PER_SEC;
+        bucket->last = now;
+    }
+    bucket->tokens = MIN (bucket->tokens, (gdouble)rate);
+}
+/*
+ * GHRFunc dropping the buckets that have filled up again: the users
+ * haven't sent anything for a second and a new bucket is the same.
+ */
+static gboolean
+rate_bucket_is_full (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+    rate_bucket_t *bucket = (rate_bucket_t*)value;
+    gint64 *args = (gint64*)user_data;
+    UNUSED_PARAM(key);
+
+    rate_bucket_fill (bucket, (guint)args [0], args [1]);
+    return bucket->tokens >= (gdouble)args [0];
+}
+/*
+ * The number of microseconds from 'now' until user 'uid' may send its
+ * next command, 0 if it may send it right away. Commands of clients whose
+ * user isn't known aren't limited.
+ */
+gint64
+rate_limiter_wait (RateLimiter *limiter,
+                   guint32      uid,
+                   gint64       now)
+{
+    rate_bucket_t *bucket;
+    guint rate = rate_limiter_get_rate (limiter);
+    gint64 wait = 0, args [2] = { rate, now };
+
+    if (rate == 0 || uid == RATE_LIMITER_UID_NONE) {
+        return 0;
+    }
+    g_mutex_lock (&limiter->mutex);
+    bucket = g_hash_table_lookup (limiter->buckets, GUINT_TO_POINTER (uid));
+    if (bucket == NULL) {
+        if (g_hash_table_size (limiter->buckets) >= RATE_LIMITER_UIDS_MAX) {
+            g_hash_table_foreach_remove (limiter->buckets,
+                                         rate_bucket_is_full,
+                                         args);
+        }
+        bucket = g_new0 (rate_bucket_t, 1);
+        bucket->tokens = rate;
+        bucket->last = now;
+        g_hash_table_insert (limiter->buckets, GUINT_TO_POINTER (uid), bucket);
+    } else {
+        rate_bucket_fill (bucket, rate, now);
+    }
+    /* rounded up so the token is there once the wait is over */
+    if (bucket->tokens < 1.0) {
+        wait = (gint64)((1.0 - bucket->tokens) * G_USEC_PER_SEC / rate) + 1;
+    }
+    g_mutex_unlock (&limiter->mutex);
+    return wait;
+}
+/*
+ * Take a token from the bucket of user 'uid' for a command it sent. This
+ * follows a call to rate_limiter_wait that let the command through.
+ */
+void
+rate_limiter_take (RateLimiter *limiter,
+                   guint32      uid)
+{
+    rate_bucket_t *bucket;
+
+    if (rate_limiter_get_rate (limiter) == 0) {
+        return;
+    }
+    g_mutex_lock (&limiter->mutex);
+    bucket = g_hash_table_lookup (limiter->buckets, GUINT_TO_POINTER (uid));
+    if (bucket != NULL) {
+        bucket->tokens -= 1.0;
+    }
+    g_mutex_unlock (&limiter->mutex);
+}
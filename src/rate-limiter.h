@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/* the UID of a client we couldn't get the credentials of */
+#define RATE_LIMITER_UID_NONE G_MAXUINT32
+/* users tracked before the ones with a full bucket are forgotten */
+#define RATE_LIMITER_UIDS_MAX 1024
+
+/*
+ * The RateLimiter keeps a token bucket for each user the clients run as.
+ * A bucket fills at 'rate' commands a second up to one second's worth and
+ * each command read takes a token from the bucket of its user, so a user
+ * may send a burst of 'rate' commands and 'rate' a second after that no
+ * matter how many connections it opens. A 'rate' of 0 disables the limit.
+ * Buckets are made for a user when it sends its first command, the mutex
+ * makes the RateLimiter safe to share between the CommandSources.
+ */
+typedef struct {
+    gdouble           tokens;
+    gint64            last;
+} rate_bucket_t;
+
+typedef struct _RateLimiterClass {
+    GObjectClass      parent;
+} RateLimiterClass;
+
+typedef struct _RateLimiter {
+    GObject           parent_instance;
+    GMutex            mutex;
+    /* read without the mutex to skip it while the limit is off */
+    guint             rate;
+    /* GHashTable mapping a UID to its rate_bucket_t */
+    GHashTable       *buckets;
+} RateLimiter;
+
+#define TYPE_RATE_LIMITER              (rate_limiter_get_type   ())
+#define RATE_LIMITER(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_RATE_LIMITER, RateLimiter))
+#define RATE_LIMITER_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_RATE_LIMITER, RateLimiterClass))
+#define IS_RATE_LIMITER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_RATE_LIMITER))
+#define IS_RATE_LIMITER_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_RATE_LIMITER))
+#define RATE_LIMITER_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_RATE_LIMITER, RateLimiterClass))
+
+GType            rate_limiter_get_type     (void);
+RateLimiter*     rate_limiter_new          (guint             rate);
+void             rate_limiter_set_rate     (RateLimiter      *limiter,
+                                            guint             rate);
+guint            rate_limiter_get_rate     (RateLimiter      *limiter);
+gint64           rate_limiter_wait         (RateLimiter      *limiter,
+                                            guint32           uid,
+                                            gint64            now);
+void             rate_limiter_take         (RateLimiter      *limiter,
+                                            guint32           uid);
+
+G_END_DECLS
+#endif /* RATE_LIMITER_H */
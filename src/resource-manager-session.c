@@ -2,6 +2,7 @@
 #include <glib.h>
 #include <inttypes.h>
 
+#include "probes.h"
 #include "tpm2.h"
 #include "resource-manager.h"
 #include "resource-manager-session.h"
@@ -24,17 +25,21 @@ load_session (ResourceManager *resmgr,
 {
     Tpm2Command *cmd = NULL;
     Tpm2Response *resp = NULL;
-    size_buf_t *size_buf = NULL;
+    GBytes *context;
+    gint64 start;
     TSS2_RC rc = TSS2_RC_SUCCESS;
 
-    size_buf = session_entry_get_context (entry);
-    cmd = tpm2_command_new_context_load (size_buf->buf, size_buf->size);
+    context = session_entry_get_context (entry);
+    cmd = tpm2_command_new_context_load (
+              (uint8_t*)g_bytes_get_data (context, NULL),
+              g_bytes_get_size (context));
     if (cmd == NULL) {
         g_critical ("%s: failed to allcoate ContextLoad Tpm2Command",
                     __func__);
         resp = tpm2_response_new_rc (NULL, TSS2_RESMGR_RC_GENERAL_FAILURE);
         goto out;
     }
+    start = g_get_monotonic_time ();
     resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_critical ("%s: TCTI failed while loading session context from "
@@ -43,12 +48,19 @@ load_session (ResourceManager *resmgr,
         goto out;
     }
     rc = tpm2_response_get_code (resp);
+    /* sessions keep their handle when they're loaded back */
+    TABRMD_PROBE2 (context_load,
+                   rc == TSS2_RC_SUCCESS ? session_entry_get_handle (entry) : 0,
+                   rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: failed to ContextLoad SessionEntry, got RC 0x%"
                    PRIx32, __func__, rc);
         goto out;
     }
+    session_entry_note_load (entry, g_get_monotonic_time () - start);
+    resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_LOAD);
     session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    resource_manager_note_loaded_session (resmgr, entry);
 out:
     g_clear_object (&cmd);
     return resp;
@@ -78,6 +90,7 @@ flush_session (ResourceManager *resmgr,
                    __func__, handle, rc);
         return FALSE;
     }
+    resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
     return TRUE;
 }
 /*
@@ -116,15 +129,19 @@ save_session (ResourceManager *resmgr,
         goto out;
     }
     rc = tpm2_response_get_code (resp);
+    TABRMD_PROBE2 (context_save, session_entry_get_handle (entry), rc);
     if (rc != TSS2_RC_SUCCESS) {
         g_info ("%s: failed to ContextSave SessionEntry, got RC 0x%" PRIx32,
                 __func__, rc);
         goto out;
     }
+    resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_SAVE);
     session_entry_set_context (entry,
                                &tpm2_response_get_buffer (resp)[TPM_HEADER_SIZE],
                                tpm2_response_get_size (resp) - TPM_HEADER_SIZE);
     session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    resource_manager_note_sequence (resmgr,
+                                    session_entry_get_sequence (entry));
 out:
     g_clear_object (&cmd);
     return resp;
@@ -133,7 +150,10 @@ out:
  * This function will send the required commands in order to bring a
  * session back into the gap interval. This means loading and saving
  * the associated context. If the SessionEntry is not saved then this
- * function is a no-op.
+ * function is a no-op. save_session leaves the SessionEntry in state
+ * SESSION_ENTRY_SAVED_RM so the state it was in is put back once it's
+ * saved again: a session saved by the client must still be abandoned,
+ * not flushed, when its connection is closed.
  */
 gboolean
 regap_session (ResourceManager *resmgr,
@@ -169,6 +189,9 @@ regap_session (ResourceManager *resmgr,
                         tpm2_response_get_code (resp));
             flush_session (resmgr, entry);
             ret = FALSE;
+        } else {
+            session_entry_set_state (entry, state);
+            resource_manager_count (resmgr, COMMAND_STATS_REGAP);
         }
     }
 out:
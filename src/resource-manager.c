@@ -21,15 +21,88 @@
 #include "sink-interface.h"
 #include "source-interface.h"
 #include "tabrmd.h"
+#include "tabrmd-defaults.h"
+#include "tcti.h"
 #include "tpm2-header.h"
 #include "tpm2-command.h"
 #include "tpm2-response.h"
+#include "tss2-tcti-tabrmd.h"
 #include "util.h"
 
 #define MAX_ABANDONED 4
+/*
+ * Transient objects are left loaded in the TPM between commands. This is
+ * the number of them we allow to stay resident before the least recently
+ * used are saved and flushed when the TPM doesn't report its capacity
+ * through TPM2_PT_HR_TRANSIENT_MIN. Every TPM2 implementation is required
+ * to have room for at least 3 loaded objects.
+ */
+#define MAX_RESIDENT_TRANSIENTS 3
+/*
+ * Sessions are also left loaded between commands. This is the number of
+ * sessions we allow to be loaded at once when the TPM doesn't report
+ * TPM2_PT_HR_LOADED_MIN. Like transient objects, every TPM2 implementation
+ * must have room for at least 3 loaded sessions.
+ */
+#define MAX_LOADED_SESSIONS 3
+/*
+ * The TPM2 spec allows for at most 3 sessions in the auth area of a command.
+ */
+#define MAX_COMMAND_SESSIONS 3
+/*
+ * A command uses at most two transient objects, or one and the object it
+ * creates. Clients can't pin objects into these slots.
+ */
+#define TRANSIENTS_UNPINNED_MIN 2
+/*
+ * The most a parent's score goes up to. Halved each time it's spared, a
+ * parent no longer used is evicted after being spared a few times.
+ */
+#define PARENT_USES_MAX 8
+/*
+ * The most the score of how often an object or a session was used goes
+ * up to, aged the same way.
+ */
+#define USES_MAX 8
+/*
+ * The smallest TPM2_PT_CONTEXT_GAP_MAX allowed by the spec. Used when the
+ * TPM doesn't report the property.
+ */
+#define CONTEXT_GAP_MAX_DEFAULT UINT8_MAX
+/*
+ * Saved sessions are re-gapped during idle time once the distance between
+ * their context sequence and the TPM context counter reaches this fraction
+ * of the maximum gap.
+ */
+#define REGAP_THRESHOLD(gap_max) ((gap_max) / 2)
+/*
+ * Time in microseconds the RM thread waits for a message before doing
+ * deferred context maintenance.
+ */
+#define IDLE_TIMEOUT_US (100 * G_TIME_SPAN_MILLISECOND)
+/*
+ * Number of commands a connection may have processed in a row before the
+ * RM moves on to the next connection with queued commands.
+ */
+#define SCHEDULER_QUANTUM 4
+/*
+ * While commands from normal priority connections are waiting, commands
+ * from batch connections are processed once for this many normal ones.
+ */
+#define SCHEDULER_BATCH_SHARE 8
+/*
+ * Commands using a transient object that was lost when the TPM was reset
+ * are answered with the RM layer version of what the TPM says for an
+ * object that isn't loaded, for the position 'n' of its handle.
+ */
+#define RC_CONTEXT_LOST(n) RM_RC (TPM2_RC_REFERENCE_H0 + (n))
+#define RC_IS_CONTEXT_LOST(rc) \
+    ((rc) >= RC_CONTEXT_LOST (0) && \
+     (rc) < RC_CONTEXT_LOST (TPM2_COMMAND_MAX_HANDLES))
 
 static void resource_manager_sink_interface_init   (gpointer g_iface);
 static void resource_manager_source_interface_init (gpointer g_iface);
+gboolean flush_session_callback (SessionEntry *entry, gpointer data);
 
 G_DEFINE_TYPE_WITH_CODE (
     ResourceManager,
@@ -48,9 +121,354 @@ enum {
     PROP_SINK,
     PROP_TPM2,
     PROP_SESSION_LIST,
+    PROP_PRIMARY_CACHE,
+    PROP_PCR_CACHE,
+    PROP_CAP_CACHE,
+    PROP_NV_CACHE,
+    PROP_TEST_CACHE,
+    PROP_ENTROPY_POOL,
+    PROP_OBJECT_SHARE,
+    PROP_SESSION_POOL,
+    PROP_KEY_POOL,
+    PROP_CONTEXT_STORE,
+    PROP_KERNEL_RM,
+    PROP_COMMAND_STATS,
+    PROP_FLIGHT_RECORDER,
+    PROP_TRACE_BUFFER,
+    PROP_SLOW_COMMAND_MS,
+    PROP_STATS_SEGMENT,
+    PROP_STATS_BACKEND,
+    PROP_PIN_MAX,
+    PROP_LEASE_MAX_MS,
+    PROP_RESUME_MS,
+    PROP_CALIBRATE,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * Return TRUE if the object of 'entry' was promoted to a persistent
+ * handle, see resource_manager_promote.
+ */
+static gboolean
+transient_is_promoted (HandleMapEntry *entry)
+{
+    return handle_map_entry_get_phandle (entry) >> TPM2_HR_SHIFT ==
+        TPM2_HT_PERSISTENT;
+}
+/*
+ * Move the provided HandleMapEntry to the head of the list of transient
+ * objects resident in the TPM, marking it as the most recently used. If the
+ * entry isn't in the list already the list takes a reference to it. The
+ * list holds the backing entries of shared objects, once for all users.
+ * Promoted objects take no transient slot and are never in the list.
+ */
+static void
+resource_manager_touch_transient (ResourceManager *resmgr,
+                                  HandleMapEntry  *entry)
+{
+    GList *link;
+
+    entry = handle_map_entry_get_backing (entry);
+    if (transient_is_promoted (entry)) {
+        return;
+    }
+    link = g_queue_find (resmgr->transient_lru, entry);
+    if (link != NULL) {
+        g_queue_unlink (resmgr->transient_lru, link);
+        g_queue_push_head_link (resmgr->transient_lru, link);
+    } else {
+        g_queue_push_head (resmgr->transient_lru, g_object_ref (entry));
+    }
+}
+/*
+ * A version of resource_manager_touch_transient with the appropriate
+ * prototype for use with the GSList 'foreach' iterator. Entries that are
+ * not currently loaded in the TPM are skipped.
+ */
+static void
+resource_manager_touch_transient_callback (gpointer data_entry,
+                                           gpointer data_resmgr)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
+    HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (data_entry);
+
+    if (handle_map_entry_get_phandle (entry) != 0) {
+        resource_manager_touch_transient (resmgr, entry);
+    }
+}
+/*
+ * Remove the provided HandleMapEntry from the list of resident transient
+ * objects, dropping the reference held by the list.
+ */
+static void
+resource_manager_forget_transient (ResourceManager *resmgr,
+                                   HandleMapEntry  *entry)
+{
+    entry = handle_map_entry_get_backing (entry);
+    if (g_queue_remove (resmgr->transient_lru, entry)) {
+        g_object_unref (entry);
+    }
+}
+/*
+ * Return TRUE if one of the entries in 'slist' is, or is backed by, the
+ * entry from the list of resident transients 'entry'.
+ */
+static gboolean
+transient_slist_holds (GSList         *slist,
+                       HandleMapEntry *entry)
+{
+    for (; slist != NULL; slist = slist->next) {
+        if (handle_map_entry_get_backing (HANDLE_MAP_ENTRY (slist->data)) ==
+            entry)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * Return TRUE if the resident transient 'entry' may be evicted: it's not
+ * in the 'pinned' list of entries in use by the command being processed
+ * and it's not pinned by its client.
+ */
+static gboolean
+transient_evictable (HandleMapEntry *entry,
+                     GSList         *pinned)
+{
+    return !transient_slist_holds (pinned, entry) &&
+        !handle_map_entry_get_pinned (entry);
+}
+/*
+ * Queue 'handle' to be flushed from the TPM by
+ * resource_manager_flush_deferred. This is for the objects and sessions of
+ * a connection that went away: nothing refers to them any more, only the
+ * room they take in the TPM matters, so flushing them can wait for a
+ * moment the other clients aren't held up by it.
+ */
+static void
+resource_manager_defer_flush (ResourceManager *resmgr,
+                              TPM2_HANDLE      handle,
+                              gboolean         loaded)
+{
+    resource_manager_flush_t flush = { .handle = handle, .loaded = loaded };
+
+    g_array_append_val (resmgr->flush_queue, flush);
+    if ((handle >> TPM2_HR_SHIFT) == TPM2_HT_TRANSIENT) {
+        ++resmgr->flush_transients;
+    } else if (loaded) {
+        ++resmgr->flush_sessions;
+    }
+}
+/*
+ * Flush up to 'max' of the handles queued by resource_manager_defer_flush,
+ * oldest first. The flushes are counted for the TPM only, the connection
+ * is gone. Returns the number of handles taken off the queue.
+ */
+guint
+resource_manager_flush_deferred (ResourceManager *resmgr,
+                                 guint            max)
+{
+    resource_manager_flush_t *flush;
+    guint count, i;
+    TSS2_RC rc;
+
+    count = MIN (max, resmgr->flush_queue->len);
+    for (i = 0; i < count; ++i) {
+        flush = &g_array_index (resmgr->flush_queue,
+                                resource_manager_flush_t,
+                                i);
+        if ((flush->handle >> TPM2_HR_SHIFT) == TPM2_HT_TRANSIENT) {
+            --resmgr->flush_transients;
+        } else if (flush->loaded) {
+            --resmgr->flush_sessions;
+        }
+        rc = tpm2_context_flush (resmgr->tpm2, flush->handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to flush 0x%" PRIx32 ": 0x%" PRIx32,
+                       __func__, flush->handle, rc);
+        } else {
+            ++resmgr->stats_swaps [COMMAND_STATS_CONTEXT_FLUSH];
+            if (resmgr->command_stats != NULL) {
+                command_stats_count (resmgr->command_stats,
+                                     COMMAND_STATS_CONTEXT_FLUSH);
+            }
+        }
+    }
+    if (count > 0) {
+        g_array_remove_range (resmgr->flush_queue, 0, count);
+        g_debug ("%s: flushed %u handles, %u left", __func__, count,
+                 resmgr->flush_queue->len);
+    }
+    return count;
+}
+/*
+ * The expected cost in microseconds of evicting the resident transient
+ * 'entry': the time loading it again takes, weighted by how likely it is
+ * to be needed again from how often it was used, and used as a parent,
+ * lately. Every object evicted frees the same room, one object, so the
+ * cheapest object goes first.
+ */
+static guint64
+transient_evict_cost (HandleMapEntry *entry)
+{
+    return (1 + (guint64)handle_map_entry_get_uses (entry) +
+            handle_map_entry_get_parent_uses (entry)) *
+        handle_map_entry_get_load_cost (entry);
+}
+/*
+ * Evict transient objects from the TPM until there's room for 'needed'
+ * more objects to be loaded. Entries in the 'pinned' list are in use by
+ * the command being processed and entries pinned by their client are
+ * never evicted. Of the rest the one with the lowest expected reload cost
+ * goes first, see transient_evict_cost, the least recently used of those.
+ * The entries used less recently than the one evicted have their scores
+ * halved so that an object no longer used is evicted eventually, however
+ * costly it is to load. Evicted entries have their context saved and
+ * their physical handle set to 0 so that they're reloaded the next time
+ * they're used. The objects of closed connections still waiting to be
+ * flushed are flushed first if they take the room. Returns the number of
+ * entries evicted.
+ */
+guint
+resource_manager_evict_transients (ResourceManager *resmgr,
+                                   guint            needed,
+                                   GSList          *pinned)
+{
+    GList *link, *victim;
+    HandleMapEntry *entry;
+    guint64 cost, victim_cost = 0;
+    guint  length, evicted = 0;
+
+    if (resmgr->flush_transients > 0 &&
+        g_queue_get_length (resmgr->transient_lru) + needed +
+        resmgr->flush_transients > resmgr->transient_max)
+    {
+        resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    }
+    while (g_queue_get_length (resmgr->transient_lru) + needed >
+           resmgr->transient_max)
+    {
+        victim = NULL;
+        for (link = g_queue_peek_tail_link (resmgr->transient_lru);
+             link != NULL;
+             link = link->prev)
+        {
+            if (!transient_evictable (HANDLE_MAP_ENTRY (link->data), pinned)) {
+                continue;
+            }
+            cost = transient_evict_cost (HANDLE_MAP_ENTRY (link->data));
+            if (victim == NULL || cost < victim_cost) {
+                victim = link;
+                victim_cost = cost;
+            }
+        }
+        if (victim == NULL) {
+            break;
+        }
+        for (link = g_queue_peek_tail_link (resmgr->transient_lru);
+             link != victim;
+             link = link->prev)
+        {
+            entry = HANDLE_MAP_ENTRY (link->data);
+            handle_map_entry_set_parent_uses (
+                entry, handle_map_entry_get_parent_uses (entry) / 2);
+            handle_map_entry_set_uses (entry,
+                                       handle_map_entry_get_uses (entry) / 2);
+        }
+        entry = HANDLE_MAP_ENTRY (victim->data);
+        g_debug ("%s: evicting transient with vhandle 0x%" PRIx32
+                 ", expected reload cost %" PRIu64 " us", __func__,
+                 handle_map_entry_get_vhandle (entry), victim_cost);
+        length = g_queue_get_length (resmgr->transient_lru);
+        resource_manager_flushsave_context (entry, resmgr);
+        if (g_queue_get_length (resmgr->transient_lru) < length) {
+            ++evicted;
+        } else {
+            break;
+        }
+    }
+
+    return evicted;
+}
+/*
+ * Add an instant for a context load, save or flush to the trace, for the
+ * command being processed if there's one.
+ */
+static void
+resource_manager_trace_swap (ResourceManager     *resmgr,
+                             CommandStatsCounter  counter)
+{
+    static const TraceEvent events [] = {
+        [COMMAND_STATS_CONTEXT_LOAD]  = TRACE_CONTEXT_LOAD,
+        [COMMAND_STATS_CONTEXT_SAVE]  = TRACE_CONTEXT_SAVE,
+        [COMMAND_STATS_CONTEXT_FLUSH] = TRACE_CONTEXT_FLUSH,
+    };
+    guint serial = 0;
+    TPM2_CC command_code = 0;
+
+    if (resmgr->processing != NULL) {
+        serial = connection_get_serial (resmgr->processing);
+        command_code = resmgr->processing_code;
+    }
+    trace_buffer_instant (resmgr->trace_buffer,
+                          events [counter],
+                          serial,
+                          command_code);
+}
+/*
+ * Count an operation for the TPM and for the connection of the command
+ * being processed, if any.
+ */
+void
+resource_manager_count (ResourceManager     *resmgr,
+                        CommandStatsCounter  counter)
+{
+    if (resmgr->command_stats != NULL) {
+        command_stats_count (resmgr->command_stats, counter);
+    }
+    if (resmgr->processing != NULL) {
+        connection_count (resmgr->processing, counter);
+    }
+    ++resmgr->stats_swaps [counter];
+    switch (counter) {
+    case COMMAND_STATS_CONTEXT_LOAD:
+    case COMMAND_STATS_CONTEXT_SAVE:
+    case COMMAND_STATS_CONTEXT_FLUSH:
+        ++resmgr->processing_swaps;
+        if (resmgr->trace_buffer != NULL) {
+            resource_manager_trace_swap (resmgr, counter);
+        }
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Load the saved context of the transient object in 'entry' with the
+ * ContextLoad command kept by the entry, timing it for the reload cost of
+ * the entry. The new physical handle is returned through 'phandle'.
+ */
+static TSS2_RC
+resource_manager_load_entry (ResourceManager *resmgr,
+                             HandleMapEntry  *entry,
+                             TPM2_HANDLE     *phandle)
+{
+    GBytes *context_load;
+    gint64 start;
+    TSS2_RC rc;
+
+    context_load = handle_map_entry_get_context_load (entry);
+    if (context_load == NULL) {
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    start = g_get_monotonic_time ();
+    rc = tpm2_context_load_command (resmgr->tpm2, context_load, phandle);
+    g_bytes_unref (context_load);
+    if (rc == TSS2_RC_SUCCESS) {
+        handle_map_entry_note_load (entry, g_get_monotonic_time () - start);
+    }
+    return rc;
+}
 /*
  * This is a helper function that does everything required to convert
  * a virtual handle to a physical one in a Tpm2Command object.
@@ -66,27 +484,132 @@ resource_manager_virt_to_phys (ResourceManager *resmgr,
                                guint8           handle_number)
 {
     TPM2_HANDLE    phandle = 0;
-    TPMS_CONTEXT *context;
     TSS2_RC       rc = TSS2_RC_SUCCESS;
+    guint         uses;
 
-    context = handle_map_entry_get_context (entry);
+    if (handle_map_entry_get_epoch (entry) != resmgr->reset_epoch) {
+        g_info ("%s: object with vhandle 0x%" PRIx32 " was lost when the "
+                "TPM was reset", __func__, handle_map_entry_get_vhandle (entry));
+        return RC_CONTEXT_LOST (handle_number);
+    }
+    uses = handle_map_entry_get_uses (entry);
+    handle_map_entry_set_uses (entry, MIN (uses + 1, USES_MAX));
+    handle_map_entry_count_use (entry);
     if (handle_map_entry_get_phandle(entry)) {
         phandle = handle_map_entry_get_phandle(entry);
         g_debug ("remembered phandle: 0x%" PRIx32, phandle);
         tpm2_command_set_handle (command, phandle, handle_number);
+        resource_manager_touch_transient (resmgr, entry);
+        resource_manager_count (resmgr, COMMAND_STATS_RESIDENT_HIT);
         return TSS2_RC_SUCCESS;
     }
 
-    rc = tpm2_context_load (resmgr->tpm2, context, &phandle);
+    rc = resource_manager_load_entry (resmgr, entry, &phandle);
     g_debug ("loaded phandle: 0x%" PRIx32, phandle);
     if (rc == TSS2_RC_SUCCESS) {
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_LOAD);
         handle_map_entry_set_phandle (entry, phandle);
         tpm2_command_set_handle (command, phandle, handle_number);
+        resource_manager_touch_transient (resmgr, entry);
     } else {
         g_warning ("Failed to load context: 0x%" PRIx32, rc);
+        if (resource_manager_check_reset (resmgr)) {
+            rc = RC_CONTEXT_LOST (handle_number);
+        }
     }
     return rc;
 }
+/*
+ * Return TRUE for the commands that take the parent of the object they
+ * load or create as their first handle.
+ */
+static gboolean
+command_has_parent (TPM2_CC command_code)
+{
+    switch (command_code) {
+    case TPM2_CC_Load:
+    case TPM2_CC_Create:
+    case TPM2_CC_CreateLoaded:
+    case TPM2_CC_Import:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * Drop the HandleMapEntry objects looked up ahead of time for the next
+ * command.
+ */
+static void
+resource_manager_prepared_clear (ResourceManager *resmgr)
+{
+    guint i;
+
+    for (i = 0; i < TPM2_COMMAND_MAX_HANDLES; ++i) {
+        g_clear_object (&resmgr->prepared_entries [i]);
+    }
+    g_clear_object (&resmgr->prepared);
+}
+/*
+ * Look up the HandleMapEntry for each transient handle of the provided
+ * command, the next one to be processed, while the TPM executes the
+ * current one. This is skipped when both commands are from the same
+ * connection: the response to the current command may change what the
+ * next one's handles map to. Commands from other connections can't, the
+ * handle maps are per connection and control messages are never looked
+ * ahead of.
+ */
+static void
+resource_manager_prepare (ResourceManager *resmgr,
+                          Tpm2Command     *command)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t i, handle_count = TPM2_COMMAND_MAX_HANDLES;
+    Connection *connection;
+    HandleMap *map;
+
+    if (resmgr->prepared == command) {
+        return;
+    }
+    resource_manager_prepared_clear (resmgr);
+    connection = tpm2_command_peek_connection (command);
+    if (connection == NULL || connection == resmgr->processing ||
+        !tpm2_command_get_handles (command, handles, &handle_count))
+    {
+        return;
+    }
+    map = connection_peek_trans_map (connection);
+    for (i = 0; i < handle_count; ++i) {
+        if (handles [i] >> TPM2_HR_SHIFT == TPM2_HT_TRANSIENT) {
+            resmgr->prepared_entries [i] = handle_map_vlookup (map,
+                                                               handles [i]);
+        }
+    }
+    resmgr->prepared = g_object_ref (command);
+    g_debug ("%s: looked up %zu handles ahead for command 0x%" PRIx32,
+             __func__, handle_count, tpm2_command_get_code (command));
+}
+/*
+ * Take the HandleMapEntry looked up ahead of time for the handle at the
+ * provided index of the command. Returns NULL if there isn't one, the
+ * caller then does the lookup.
+ */
+static HandleMapEntry*
+resource_manager_prepared_take (ResourceManager *resmgr,
+                                Tpm2Command     *command,
+                                guint8           handle_index)
+{
+    HandleMapEntry *entry;
+
+    if (resmgr->prepared != command ||
+        handle_index >= TPM2_COMMAND_MAX_HANDLES)
+    {
+        return NULL;
+    }
+    entry = resmgr->prepared_entries [handle_index];
+    resmgr->prepared_entries [handle_index] = NULL;
+    return entry;
+}
 TSS2_RC
 resource_manager_load_transient (ResourceManager  *resmgr,
                                  Tpm2Command      *command,
@@ -96,30 +619,53 @@ resource_manager_load_transient (ResourceManager  *resmgr,
 {
     HandleMap    *map;
     HandleMapEntry *entry;
-    Connection  *connection;
+    guint         uses;
     TSS2_RC       rc = TSS2_RC_SUCCESS;
 
     g_debug ("processing TPM2_HT_TRANSIENT: 0x%" PRIx32, handle);
-    connection = tpm2_command_get_connection (command);
-    map = connection_get_trans_map (connection);
-    g_object_unref (connection);
+    map = connection_peek_trans_map (tpm2_command_peek_connection (command));
     g_debug ("handle 0x%" PRIx32 " is virtual TPM2_HT_TRANSIENT, "
              "loading", handle);
     /* we don't unref the entry since we're adding it to the entry_slist below */
-    entry = handle_map_vlookup (map, handle);
+    entry = resource_manager_prepared_take (resmgr, command, handle_index);
+    if (entry == NULL) {
+        entry = handle_map_vlookup (map, handle);
+    }
     if (entry) {
         g_debug ("mapped virtual handle 0x%" PRIx32 " to entry", handle);
     } else {
         g_warning ("No HandleMapEntry for vhandle: 0x%" PRIx32, handle);
         goto out;
     }
+    if (handle_index == 0 &&
+        command_has_parent (tpm2_command_get_code (command)))
+    {
+        uses = handle_map_entry_get_parent_uses (entry);
+        handle_map_entry_set_parent_uses (entry,
+                                          MIN (uses + 1, PARENT_USES_MAX));
+    }
+    /* make room for the object unless it's still resident in the TPM */
+    if (handle_map_entry_get_phandle (entry) == 0) {
+        resource_manager_evict_transients (resmgr, 1, *entry_slist);
+    }
     rc = resource_manager_virt_to_phys (resmgr, command, entry, handle_index);
+    if (rc == TPM2_RC_OBJECT_MEMORY &&
+        resource_manager_evict_transients (resmgr,
+                                           resmgr->transient_max,
+                                           *entry_slist) > 0)
+    {
+        g_debug ("%s: TPM out of object memory, retrying", __func__);
+        rc = resource_manager_virt_to_phys (resmgr,
+                                            command,
+                                            entry,
+                                            handle_index);
+    }
     if (rc != TSS2_RC_SUCCESS) {
+        g_object_unref (entry);
         goto out;
     }
     *entry_slist = g_slist_prepend (*entry_slist, entry);
 out:
-    g_object_unref (map);
     return rc;
 }
 /*
@@ -218,29 +764,44 @@ resource_manager_load_session_from_handle (ResourceManager *resmgr,
                    "match. Refusing to load.", __func__);
         goto out;
     }
+    session_entry_set_uses (session_entry,
+                            MIN (session_entry_get_uses (session_entry) + 1,
+                                 USES_MAX));
     session_entry_state = session_entry_get_state (session_entry);
-    if (session_entry_state != SESSION_ENTRY_SAVED_RM) {
-        g_warning ("%s: Handle in handle area references SessionEntry "
-                   "for session in state \"%s\". Must be in state: "
-                   "SESSION_ENTRY_SAVED_RM for us manage it, ignoring.",
-                   __func__, session_entry_state_to_str (session_entry_state));
-        goto out;
-    }
-    response = load_session (resmgr, session_entry);
-    rc = tpm2_response_get_code (response);
-    if (rc != TSS2_RC_SUCCESS) {
-        if (handle_rc (resmgr, rc) != TRUE) {
-            g_warning ("Failed to load context for session with handle "
-                       "0x%08" PRIx32 " RC: 0x%" PRIx32, handle, rc);
-            flush_session (resmgr, session_entry);
-            goto out;
-        }
+    switch (session_entry_state) {
+    case SESSION_ENTRY_LOADED:
+        g_debug ("%s: SessionEntry with handle 0x%08" PRIx32 " is still "
+                 "loaded", __func__, handle);
+        break;
+    case SESSION_ENTRY_SAVED_RM:
         response = load_session (resmgr, session_entry);
         rc = tpm2_response_get_code (response);
         if (rc != TSS2_RC_SUCCESS) {
-            flush_session (resmgr, session_entry);
-            goto out;
+            if (handle_rc (resmgr, rc) != TRUE) {
+                g_warning ("Failed to load context for session with handle "
+                           "0x%08" PRIx32 " RC: 0x%" PRIx32, handle, rc);
+                flush_session (resmgr, session_entry);
+                goto out;
+            }
+            g_clear_object (&response);
+            response = load_session (resmgr, session_entry);
+            rc = tpm2_response_get_code (response);
+            if (rc != TSS2_RC_SUCCESS) {
+                /* after a reset the session is gone with all the others */
+                if (!resource_manager_check_reset (resmgr)) {
+                    flush_session (resmgr, session_entry);
+                }
+                goto out;
+            }
         }
+        break;
+    default:
+        g_warning ("%s: Handle in handle area references SessionEntry "
+                   "for session in state \"%s\". Must be in state: "
+                   "SESSION_ENTRY_SAVED_RM or SESSION_ENTRY_LOADED for us "
+                   "manage it, ignoring.",
+                   __func__, session_entry_state_to_str (session_entry_state));
+        goto out;
     }
     if (will_flush) {
         g_debug ("%s: will_flush: removing SessionEntry from SessionList",
@@ -262,7 +823,6 @@ void
 resource_manager_load_auth_callback (gpointer auth_offset_ptr,
                                      gpointer user_data)
 {
-    Connection *connection = NULL;
     TPM2_HANDLE handle;
     auth_callback_data_t *data = (auth_callback_data_t*)user_data;
     TPMA_SESSION attrs;
@@ -277,30 +837,31 @@ resource_manager_load_auth_callback (gpointer auth_offset_ptr,
         if (attrs & TPMA_SESSION_CONTINUESESSION) {
             will_flush = FALSE;
         }
-        connection = tpm2_command_get_connection (data->command);
-        resource_manager_load_session_from_handle (data->resmgr,
-                                                   connection,
-                                                   handle,
-                                                   will_flush);
+        resource_manager_load_session_from_handle (
+            data->resmgr,
+            tpm2_command_peek_connection (data->command),
+            handle,
+            will_flush);
         break;
     default:
         g_debug ("not loading object with handle: 0x%08" PRIx32 " from "
                  "command auth area: not a session", handle);
         break;
     }
-    g_clear_object (&connection);
 }
 /*
  * This function operates on the provided command. It iterates over each
  * handle in the commands handle area. For each relevant handle it loads
- * the related context and fixes up the handles in the command.
+ * the related context and fixes up the handles in the command. It stops
+ * at the first transient object lost in a TPM reset, returning the RC to
+ * answer the command with.
  */
 TSS2_RC
 resource_manager_load_handles (ResourceManager *resmgr,
                                Tpm2Command     *command,
                                GSList         **loaded_transients)
 {
-    Connection *connection = NULL;
+    Connection *connection;
     TSS2_RC       rc = TSS2_RC_SUCCESS;
     TPM2_HANDLE    handles[TPM2_COMMAND_MAX_HANDLES] = { 0, };
     size_t        i, handle_count = TPM2_COMMAND_MAX_HANDLES;
@@ -311,6 +872,7 @@ resource_manager_load_handles (ResourceManager *resmgr,
         g_warning ("%s: received NULL parameter.", __func__);
         return RM_RC (TSS2_BASE_RC_GENERAL_FAILURE);
     }
+    connection = tpm2_command_peek_connection (command);
     handle_ret = tpm2_command_get_handles (command, handles, &handle_count);
     if (handle_ret == FALSE) {
         g_error ("Unable to get handles from command");
@@ -326,12 +888,14 @@ resource_manager_load_handles (ResourceManager *resmgr,
                                                   loaded_transients,
                                                   handles [i],
                                                   i);
+            if (RC_IS_CONTEXT_LOST (rc)) {
+                return rc;
+            }
             break;
         case TPM2_HT_HMAC_SESSION:
         case TPM2_HT_POLICY_SESSION:
             g_debug ("processing TPM2_HT_HMAC_SESSION or "
                      "TPM2_HT_POLICY_SESSION: 0x%" PRIx32, handles [i]);
-            connection = tpm2_command_get_connection (command);
             rc = resource_manager_load_session_from_handle (resmgr,
                                                             connection,
                                                             handles [i],
@@ -342,7 +906,6 @@ resource_manager_load_handles (ResourceManager *resmgr,
         }
     }
     g_debug ("%s: end", __func__);
-    g_clear_object (&connection);
 
     return rc;
 }
@@ -350,7 +913,10 @@ resource_manager_load_handles (ResourceManager *resmgr,
  * Remove the context associated with the provided HandleMapEntry
  * from the TPM. Only handles in the TRANSIENT range will be flushed.
  * Any entry with a context that's flushed will have the physical handle
- * to 0.
+ * to 0 and will be dropped from the list of resident transient objects.
+ * The context of a transient object is only saved the first time it's
+ * flushed. After that the saved context is still good and so we just flush
+ * the object.
  */
 void
 resource_manager_flushsave_context (gpointer data_entry,
@@ -374,15 +940,28 @@ resource_manager_flushsave_context (gpointer data_entry,
                 handle_map_entry_get_vhandle (entry));
             break;
         }
-        g_debug ("%s: handle is transient, saving context", __func__);
-        context = handle_map_entry_get_context (entry);
-        rc = tpm2_context_saveflush (resmgr->tpm2,
-                                              phandle,
-                                              context);
+        if (handle_map_entry_get_context_saved (entry)) {
+            g_debug ("%s: handle is transient with saved context, flushing",
+                     __func__);
+            rc = tpm2_context_flush (resmgr->tpm2, phandle);
+        } else {
+            g_debug ("%s: handle is transient, saving context", __func__);
+            context = handle_map_entry_get_context (entry);
+            rc = tpm2_context_saveflush (resmgr->tpm2,
+                                                  phandle,
+                                                  context);
+            if (rc == TSS2_RC_SUCCESS) {
+                resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_SAVE);
+                handle_map_entry_set_context_saved (entry, TRUE);
+                resource_manager_note_sequence (resmgr, context->sequence);
+            }
+        }
         if (rc == TSS2_RC_SUCCESS) {
+            resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
             handle_map_entry_set_phandle (entry, 0);
+            resource_manager_forget_transient (resmgr, entry);
         } else {
-            g_warning ("%s: tpm2_context_saveflush failed for "
+            g_warning ("%s: failed to flush context for "
                        "handle: 0x%" PRIx32 " rc: 0x%" PRIx32,
                        __func__, phandle, rc);
         }
@@ -430,61 +1009,391 @@ out:
     g_clear_object (&resp);
     return;
 }
-static void
-dump_command (Tpm2Command *command)
+/*
+ * Remember that the provided session was just loaded into the TPM. Before
+ * each command the RM only looks at the sessions it loaded, not at every
+ * session in the SessionList, so the cost of deciding what to save
+ * depends on the number of loaded sessions alone.
+ */
+void
+resource_manager_note_loaded_session (ResourceManager *resmgr,
+                                      SessionEntry    *entry)
 {
-    g_assert (command != NULL);
-    g_debug ("Tpm2Command");
-    g_debug_bytes (tpm2_command_get_buffer (command),
-                   tpm2_command_get_size (command),
-                   16,
-                   4);
-    g_debug_tpma_cc (tpm2_command_get_attributes (command));
+    if (g_slist_find (resmgr->loaded_sessions, entry) == NULL) {
+        resmgr->loaded_sessions = g_slist_prepend (resmgr->loaded_sessions,
+                                                   g_object_ref (entry));
+    }
 }
+/*
+ * GFunc used to pick up loaded sessions that were added to the SessionList
+ * by someone other than the RM.
+ */
 static void
-dump_response (Tpm2Response *response)
+loaded_session_scan_callback (gpointer data_entry,
+                              gpointer data_resmgr)
 {
-    g_assert (response != NULL);
-    g_debug ("Tpm2Response");
-    g_debug_bytes (tpm2_response_get_buffer (response),
-                   tpm2_response_get_size (response),
-                   16,
-                   4);
-    g_debug_tpma_cc (tpm2_response_get_attributes (response));
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+
+    if (session_entry_get_state (entry) == SESSION_ENTRY_LOADED) {
+        resource_manager_note_loaded_session (RESOURCE_MANAGER (data_resmgr),
+                                              entry);
+    }
 }
 /*
- * This function performs the special processing required when a client
- * attempts to save a session context. In short: handling the context gap /
- * contextCounter roll over is the only reason we have to get involved. To do
- * this we must be able to load and save every active session from oldest to
- * newest. This is discussed in detail in section 30.5 from part 1 of the TPM2
- * spec.
- *
- * The recommended algorithm for doing this is documented in one of the TSS2 specs.
+ * Call 'func' for each session that's loaded in the TPM. Sessions that
+ * were saved, flushed or removed from the SessionList since they were
+ * loaded are dropped from 'loaded_sessions' first. Only if entries were
+ * inserted into the SessionList since the last call is the whole list
+ * scanned for loaded sessions: the RM notes the sessions it creates and
+ * loads itself, anything else is rare.
+ * 'func' is called on a copy of the list, it may save or flush sessions.
  */
-Tpm2Response*
-resource_manager_save_context_session (ResourceManager *resmgr,
-                                       Tpm2Command *command)
+static void
+resource_manager_foreach_loaded_session (ResourceManager *resmgr,
+                                         GFunc            func,
+                                         gpointer         user_data)
 {
-    Connection *conn_cmd = NULL, *conn_entry = NULL;
-    SessionEntry *entry = NULL;
-    Tpm2Response *response = NULL;
-    TPM2_HANDLE handle = 0;
+    SessionEntry *entry, *listed;
+    GSList *link, *next, *loaded;
+    guint64 inserts = session_list_get_inserts (resmgr->session_list);
 
-    handle = tpm2_command_get_handle (command, 0);
-    g_debug ("save_context for session handle: 0x%" PRIx32, handle);
-    entry = session_list_lookup_handle (resmgr->session_list, handle);
+    if (inserts != resmgr->loaded_inserts) {
+        resmgr->loaded_inserts = inserts;
+        session_list_foreach (resmgr->session_list,
+                              loaded_session_scan_callback,
+                              resmgr);
+    }
+    for (link = resmgr->loaded_sessions; link != NULL; link = next) {
+        next = link->next;
+        entry = SESSION_ENTRY (link->data);
+        listed = session_list_lookup_handle (resmgr->session_list,
+                                             session_entry_get_handle (entry));
+        if (listed != entry ||
+            session_entry_get_state (entry) != SESSION_ENTRY_LOADED)
+        {
+            resmgr->loaded_sessions =
+                g_slist_delete_link (resmgr->loaded_sessions, link);
+            g_object_unref (entry);
+        }
+        g_clear_object (&listed);
+    }
+    loaded = g_slist_copy_deep (resmgr->loaded_sessions,
+                                (GCopyFunc)g_object_ref,
+                                NULL);
+    g_slist_foreach (loaded, func, user_data);
+    g_slist_free_full (loaded, g_object_unref);
+}
+/*
+ * This structure is used to keep state while deciding which of the loaded
+ * sessions must be saved before a command can be processed.
+ * 'command'     : the Tpm2Command about to be processed
+ * 'connection'  : the Connection associated with 'command'
+ * 'handles'     : the session handles referenced by 'command'
+ * 'count'       : the number of handles in 'handles'
+ * 'loaded'      : number of sessions owned by 'connection' that are loaded
+ * 'ref_loaded'  : number of sessions referenced by 'command' that are loaded
+ * 'pressure'    : when set loaded sessions of 'connection' not referenced
+ *   by 'command' are saved to make room in the TPM
+ * 'force'       : when set all of them are saved, otherwise only 'excess'
+ * 'spare'       : the sessions of 'connection' that could be saved, of
+ *   which the cheapest 'excess' are, see session_evict_cost
+ */
+typedef struct {
+    ResourceManager *resmgr;
+    Tpm2Command     *command;
+    Connection      *connection;
+    TPM2_HANDLE      handles [TPM2_COMMAND_MAX_HANDLES + MAX_COMMAND_SESSIONS];
+    size_t           count;
+    guint            loaded;
+    guint            ref_loaded;
+    gboolean         pressure;
+    gboolean         force;
+    guint            excess;
+    GPtrArray       *spare;
+} session_save_data_t;
+static void
+session_save_add_handle (session_save_data_t *data,
+                         TPM2_HANDLE          handle)
+{
+    switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        if (data->count < G_N_ELEMENTS (data->handles)) {
+            data->handles [data->count++] = handle;
+        }
+        break;
+    default:
+        break;
+    }
+}
+static void
+session_save_auth_callback (gpointer auth_offset_ptr,
+                            gpointer user_data)
+{
+    session_save_data_t *data = (session_save_data_t*)user_data;
+    size_t auth_offset = *(size_t*)auth_offset_ptr;
+
+    session_save_add_handle (data,
+                             tpm2_command_get_auth_handle (data->command,
+                                                           auth_offset));
+}
+static gboolean
+session_save_is_referenced (session_save_data_t *data,
+                            TPM2_HANDLE          handle)
+{
+    size_t i;
+
+    for (i = 0; i < data->count; ++i) {
+        if (data->handles [i] == handle) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * GFunc used to count the loaded sessions that belong to the connection
+ * associated with the command being processed.
+ */
+static void
+session_count_loaded_callback (gpointer data_entry,
+                               gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    session_save_data_t *data = (session_save_data_t*)user_data;
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_LOADED ||
+        entry->connection != data->connection)
+    {
+        return;
+    }
+    ++data->loaded;
+    if (session_save_is_referenced (data, session_entry_get_handle (entry))) {
+        ++data->ref_loaded;
+    }
+}
+/*
+ * GFunc used to save loaded sessions that must not stay loaded while the
+ * command is processed: sessions owned by other connections are always
+ * saved, unreferenced sessions owned by this connection only when we're
+ * short on room. Unless all of those are to be saved they're collected
+ * in 'spare' for session_save_spare to pick from.
+ */
+static void
+session_save_unused_callback (gpointer data_entry,
+                              gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    session_save_data_t *data = (session_save_data_t*)user_data;
+
+    if (session_entry_get_state (entry) != SESSION_ENTRY_LOADED) {
+        return;
+    }
+    if (entry->connection == data->connection) {
+        if (!data->pressure ||
+            session_save_is_referenced (data, session_entry_get_handle (entry)))
+        {
+            return;
+        }
+        if (!data->force) {
+            g_ptr_array_add (data->spare, g_object_ref (entry));
+            return;
+        }
+    }
+    g_debug ("%s: saving SessionEntry with handle 0x%08" PRIx32, __func__,
+             session_entry_get_handle (entry));
+    save_session_callback (entry, data->resmgr);
+}
+/*
+ * The expected cost in microseconds of saving the loaded session 'entry':
+ * the time loading it again takes, weighted by how often the connection
+ * used it lately, like transient_evict_cost for objects.
+ */
+static guint64
+session_evict_cost (SessionEntry *entry)
+{
+    return (1 + (guint64)session_entry_get_uses (entry)) *
+        session_entry_get_load_cost (entry);
+}
+static gint
+session_evict_cost_compare (gconstpointer a,
+                            gconstpointer b)
+{
+    guint64 cost_a = session_evict_cost (*(SessionEntry**)a);
+    guint64 cost_b = session_evict_cost (*(SessionEntry**)b);
+
+    return cost_a < cost_b ? -1 : cost_a > cost_b;
+}
+/*
+ * Save the 'excess' sessions of the 'spare' ones with the lowest expected
+ * reload cost to make room for the command. The sessions spared have
+ * their score halved so that a session no longer used is saved
+ * eventually.
+ */
+static void
+session_save_spare (session_save_data_t *data)
+{
+    SessionEntry *entry;
+    guint i;
+
+    g_ptr_array_sort (data->spare, session_evict_cost_compare);
+    for (i = 0; i < data->spare->len; ++i) {
+        entry = SESSION_ENTRY (g_ptr_array_index (data->spare, i));
+        if (i < data->excess) {
+            g_debug ("%s: saving SessionEntry with handle 0x%08" PRIx32
+                     ", expected reload cost %" PRIu64 " us", __func__,
+                     session_entry_get_handle (entry),
+                     session_evict_cost (entry));
+            save_session_callback (entry, data->resmgr);
+        } else {
+            session_entry_set_uses (entry, session_entry_get_uses (entry) / 2);
+        }
+    }
+}
+/*
+ * Sessions are left loaded after the command that used them. Before the
+ * next command is processed we save the sessions that can't stay loaded:
+ * - those belonging to a different connection, so that a connection can
+ *   never use a session it doesn't own
+ * - those not referenced by the command if loading the sessions that the
+ *   command needs would exceed the number of sessions we allow to be
+ *   loaded, as many as it takes and the cheapest to load again first, or
+ *   all of them if 'force' is set
+ * The RM remembers the connection that sent the last command (the 'owner').
+ * Only the owner can have sessions loaded and so while commands keep
+ * coming from the owner and don't need any sessions there's nothing to do.
+ */
+void
+resource_manager_save_sessions (ResourceManager *resmgr,
+                                Tpm2Command     *command,
+                                gboolean         force)
+{
+    session_save_data_t data = {
+        .resmgr = resmgr,
+        .command = command,
+        .pressure = force,
+        .force = force,
+    };
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t i, handle_count = TPM2_COMMAND_MAX_HANDLES;
+    guint needed;
+
+    data.connection = tpm2_command_peek_connection (command);
+    if (tpm2_command_get_handles (command, handles, &handle_count)) {
+        for (i = 0; i < handle_count; ++i) {
+            session_save_add_handle (&data, handles [i]);
+        }
+    }
+    if (tpm2_command_has_session_auths (command)) {
+        tpm2_command_foreach_auth (command,
+                                   session_save_auth_callback,
+                                   &data);
+    }
+    if (data.connection == resmgr->owner && !force && data.count == 0 &&
+        tpm2_command_get_code (command) != TPM2_CC_StartAuthSession)
+    {
+        g_debug ("%s: command from owner needs no sessions", __func__);
+        goto out;
+    }
+    resource_manager_foreach_loaded_session (resmgr,
+                                             session_count_loaded_callback,
+                                             &data);
+    needed = data.count - data.ref_loaded;
+    if (tpm2_command_get_code (command) == TPM2_CC_StartAuthSession) {
+        ++needed;
+    }
+    if (resmgr->flush_sessions > 0 &&
+        data.loaded + needed + resmgr->flush_sessions > resmgr->session_max)
+    {
+        resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    }
+    if (data.loaded + needed > resmgr->session_max) {
+        g_debug ("%s: %u sessions loaded, %u needed: saving unused sessions",
+                 __func__, data.loaded, needed);
+        data.pressure = TRUE;
+        data.excess = data.loaded + needed - resmgr->session_max;
+    }
+    data.spare = g_ptr_array_new_with_free_func (g_object_unref);
+    resource_manager_foreach_loaded_session (resmgr,
+                                             session_save_unused_callback,
+                                             &data);
+    session_save_spare (&data);
+    g_ptr_array_unref (data.spare);
+out:
+    if (resmgr->owner != data.connection) {
+        g_debug ("%s: connection now owns the loaded sessions", __func__);
+        g_clear_object (&resmgr->owner);
+        resmgr->owner = g_object_ref (data.connection);
+    }
+}
+static void
+dump_command (Tpm2Command *command)
+{
+    g_assert (command != NULL);
+    if (!util_debug_enabled ()) {
+        return;
+    }
+    g_debug ("Tpm2Command");
+    g_debug_bytes (tpm2_command_get_buffer (command),
+                   tpm2_command_get_size (command),
+                   16,
+                   4);
+    g_debug_tpma_cc (tpm2_command_get_attributes (command));
+}
+static void
+dump_response (Tpm2Response *response)
+{
+    g_assert (response != NULL);
+    if (!util_debug_enabled ()) {
+        return;
+    }
+    g_debug ("Tpm2Response");
+    g_debug_bytes (tpm2_response_get_buffer (response),
+                   tpm2_response_get_size (response),
+                   16,
+                   4);
+    g_debug_tpma_cc (tpm2_response_get_attributes (response));
+}
+/*
+ * This function performs the special processing required when a client
+ * attempts to save a session context. In short: handling the context gap /
+ * contextCounter roll over is the only reason we have to get involved. To do
+ * this we must be able to load and save every active session from oldest to
+ * newest. This is discussed in detail in section 30.5 from part 1 of the TPM2
+ * spec.
+ *
+ * The recommended algorithm for doing this is documented in one of the TSS2 specs.
+ */
+Tpm2Response*
+resource_manager_save_context_session (ResourceManager *resmgr,
+                                       Tpm2Command *command)
+{
+    Connection *conn_cmd = NULL, *conn_entry = NULL;
+    SessionEntry *entry = NULL;
+    Tpm2Response *response = NULL;
+    TPM2_HANDLE handle = 0;
+
+    handle = tpm2_command_get_handle (command, 0);
+    g_debug ("save_context for session handle: 0x%" PRIx32, handle);
+    entry = session_list_lookup_handle (resmgr->session_list, handle);
     if (entry == NULL) {
         g_warning ("Client attempting to save unknown session.");
         goto out;
     }
     /* the lookup function should check this for us? */
-    conn_cmd = tpm2_command_get_connection (command);
+    conn_cmd = tpm2_command_peek_connection (command);
     conn_entry = session_entry_get_connection (entry);
     if (conn_cmd != conn_entry) {
         g_warning ("%s: session belongs to a different connection", __func__);
         goto out;
     }
+    /* sessions are left loaded, the saved context must be current */
+    if (session_entry_get_state (entry) == SESSION_ENTRY_LOADED) {
+        save_session_callback (entry, resmgr);
+        if (session_entry_get_state (entry) != SESSION_ENTRY_SAVED_RM) {
+            g_warning ("%s: failed to save loaded session", __func__);
+            goto out;
+        }
+    }
     session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
     response = tpm2_response_new_context_save (conn_cmd, entry);
     g_debug ("%s: Tpm2Response from TPM2_ContextSave", __func__);
@@ -492,11 +1401,68 @@ resource_manager_save_context_session (ResourceManager *resmgr,
                    tpm2_response_get_size (response),
                    16, 4);
 out:
-    g_clear_object (&conn_cmd);
     g_clear_object (&conn_entry);
     g_clear_object (&entry);
     return response;
 }
+/*
+ * The TPM can't save the context of a persistent object: a ContextSave
+ * of a vhandle whose object was promoted is answered with the context
+ * saved when it was promoted, of the transient object it was then. NULL
+ * is returned for the other vhandles, their objects are loaded for the
+ * TPM to save.
+ */
+static Tpm2Response*
+resource_manager_save_context_promoted (ResourceManager *resmgr,
+                                        Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    Tpm2Response *response = NULL;
+    HandleMapEntry *entry;
+    size_t size = TPM_HEADER_SIZE + sizeof (TPMS_CONTEXT);
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buf;
+    TSS2_RC rc;
+
+    if (resmgr->promote_max == 0) {
+        return NULL;
+    }
+    entry = handle_map_vlookup (connection_peek_trans_map (connection),
+                                tpm2_command_get_handle (command, 0));
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (!transient_is_promoted (entry) ||
+        !handle_map_entry_get_context_saved (entry))
+    {
+        goto out;
+    }
+    buf = g_malloc0 (size);
+    rc = Tss2_MU_TPMS_CONTEXT_Marshal (handle_map_entry_get_context (entry),
+                                       buf,
+                                       size,
+                                       &offset);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_header_init (buf,
+                               size,
+                               TPM2_ST_NO_SESSIONS,
+                               offset,
+                               TSS2_RC_SUCCESS);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to build ContextSave response: 0x%" PRIx32,
+                   __func__, rc);
+        g_free (buf);
+        goto out;
+    }
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  offset,
+                                  tpm2_command_get_attributes (command));
+out:
+    g_object_unref (entry);
+    return response;
+}
 /*
  * This function performs the special processing associated with the
  * TPM2_ContextSave command. How much we can "virtualize of this command
@@ -504,13 +1470,8 @@ out:
  * actually *want* to do.
  *
  * Transient objects that are tracked by the RM require no special handling.
- * It's possible that the whole of this command could be virtualized: When a
- * command is received all transient objects have been saved and flushed. The
- * saved context held by the RM could very well be returned to the caller
- * with no interaction with the TPM. This would however require that the RM
- * marshal the context object into the response buffer. This is less easy
- * than it should be and so we suffer the inefficiency to keep the RM code
- * more simple. Simple in this case means no special handling.
+ * The object is loaded (or is still resident) like it would be for any other
+ * command and the TPM produces the context for the caller.
  *
  * Session objects are handled much in the same way with a specific caveat:
  * A session can be either loaded or saved. Unlike a transient object saving
@@ -532,6 +1493,8 @@ resource_manager_save_context (ResourceManager *resmgr,
     case TPM2_HT_HMAC_SESSION:
     case TPM2_HT_POLICY_SESSION:
         return resource_manager_save_context_session (resmgr, command);
+    case TPM2_HT_TRANSIENT:
+        return resource_manager_save_context_promoted (resmgr, command);
     default:
         g_debug ("save_context: not virtualizing TPM2_CC_ContextSave for "
                  "handles: 0x%08" PRIx32, handle);
@@ -572,7 +1535,7 @@ resource_manager_load_context_session (ResourceManager *resmgr,
         g_debug ("%s: Tpm2Command contains unknown TPMS_CONTEXT.", __func__);
         goto out;
     }
-    conn_cmd = tpm2_command_get_connection (command);
+    conn_cmd = tpm2_command_peek_connection (command);
     conn_entry = session_entry_get_connection (entry);
     if (conn_cmd != conn_entry) {
         if (!session_list_claim (resmgr->session_list, entry, conn_cmd)) {
@@ -585,7 +1548,6 @@ resource_manager_load_context_session (ResourceManager *resmgr,
     response = tpm2_response_new_context_load (conn_cmd, entry);
 out:
     g_debug ("%s: returning Tpm2Response", __func__);
-    g_clear_object (&conn_cmd);
     g_clear_object (&conn_entry);
     g_clear_object (&entry);
     return response;
@@ -627,120 +1589,596 @@ resource_manager_load_context (ResourceManager *resmgr,
     return NULL;
 }
 /*
- * This function performs the special processing associated with the
- * TPM2_FlushContext command. How much we can "virtualize" of this command
- * depends on the parameters / handle type.
- *
- * Transient objects that are tracked by the RM (stored in the transient
- * HandleMap in the Connection object) then we can simply delete the mapping
- * since transient objects are always saved / flushed after each command is
- * processed. So for this handle type we just delete the mapping, create a
- * Tpm2Response object and return it to the caller.
- *
- * Session objects are not so simple. Sessions cannot be flushed after each
- * use. The TPM will only allow us to save the context as it must maintain
- * some internal tracking information. So when the caller wishes to flush a
- * session context we must remove the entry tracking the mapping between
- * session and connection from the session_slist (if any exists). The comman
- * must then be passed to the TPM as well. We return NULL here to let the
- * caller know.
+ * The persistent handles or NV space in the TPM changed: drop the cached
+ * list of persistent handles and the cached TPM2_PT_VAR properties that
+ * count them.
  */
-Tpm2Response*
-resource_manager_flush_context (ResourceManager *resmgr,
-                                Tpm2Command     *command)
+static void
+resource_manager_persistent_changed (ResourceManager *resmgr)
 {
-    Connection     *connection;
-    HandleMap      *map;
-    HandleMapEntry *entry;
-    Tpm2Response   *response = NULL;
-    TPM2_HANDLE      handle;
-    TPM2_HT          handle_type;
-    TSS2_RC         rc;
-
-    if (tpm2_command_get_code (command) != TPM2_CC_FlushContext) {
-        g_warning ("resource_manager_flush_context with wrong command");
-        return NULL;
+    g_clear_pointer (&resmgr->persistent_handles, g_array_unref);
+    if (resmgr->cap_cache != NULL) {
+        cap_cache_clear (resmgr->cap_cache);
     }
-    rc = tpm2_command_get_flush_handle (command, &handle);
+}
+/*
+ * TRUE if 'handle' is in the persistent handles we promote shared objects
+ * to, whatever the promote_max budget is.
+ */
+static gboolean
+handle_is_promoted (TPM2_HANDLE handle)
+{
+    return handle >= RESOURCE_MANAGER_PROMOTE_BASE &&
+        handle < RESOURCE_MANAGER_PROMOTE_BASE + RESOURCE_MANAGER_PROMOTE_MAX;
+}
+/*
+ * Evict the promoted object in 'slot' from NV. Its vhandles go back to
+ * the transient object in the context saved when it was promoted, which
+ * is loaded the next time it's used.
+ */
+static void
+resource_manager_demote (ResourceManager *resmgr,
+                         guint            slot)
+{
+    HandleMapEntry *entry = resmgr->promoted [slot];
+    TPM2_HANDLE persistent = RESOURCE_MANAGER_PROMOTE_BASE + slot;
+    TSS2_RC rc;
+
+    g_debug ("%s: evicting promoted object 0x%" PRIx32, __func__,
+             persistent);
+    rc = tpm2_evict_control (resmgr->tpm2,
+                             &resmgr->promote_auth,
+                             persistent,
+                             persistent);
     if (rc != TSS2_RC_SUCCESS) {
-        connection = tpm2_command_get_connection (command);
-        response = tpm2_response_new_rc (connection, rc);
-        g_object_unref (connection);
-        goto out;
+        g_warning ("%s: failed to evict promoted object 0x%" PRIx32
+                   ", rc: 0x%" PRIx32, __func__, persistent, rc);
     }
-    g_debug ("resource_manager_flush_context handle: 0x%" PRIx32, handle);
-    handle_type = handle >> TPM2_HR_SHIFT;
-    switch (handle_type) {
-    case TPM2_HT_TRANSIENT:
-        g_debug ("handle is TPM2_HT_TRANSIENT, virtualizing");
-        connection = tpm2_command_get_connection (command);
-        map = connection_get_trans_map (connection);
-        entry = handle_map_vlookup (map, handle);
-        if (entry != NULL) {
-            handle_map_remove (map, handle);
-            g_object_unref (entry);
-            rc = TSS2_RC_SUCCESS;
-        } else {
-            /*
-             * If the handle doesn't map to a HandleMapEntry then it's not one
-             * that we're managing and so we can't flush it. Return an error
-             * indicating that error is related to a handle, that it's a parameter
-             * and that it's the first parameter.
-             */
-            rc = RM_RC (TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1);
-        }
-        g_object_unref (map);
-        response = tpm2_response_new_rc (connection, rc);
-        g_object_unref (connection);
-        break;
-    case TPM2_HT_HMAC_SESSION:
-    case TPM2_HT_POLICY_SESSION:
-        g_debug ("%s: handle 0x%08" PRIx32 "is a session, removing from "
-                 "SessionList", __func__, handle);
-        session_list_remove_handle (resmgr->session_list, handle);
-        break;
+    if (handle_map_entry_get_phandle (entry) == persistent) {
+        handle_map_entry_set_phandle (entry, 0);
     }
-
-out:
-    return response;
+    g_clear_object (&resmgr->promoted [slot]);
+    resource_manager_persistent_changed (resmgr);
 }
 /*
- * Ensure that executing the provided command will not exceed any of the
- * per-connection quotas enforced by the RM. This is currently limited to
- * transient objects and sessions.
+ * Evict every promoted object from NV: before the TPM is handed over or
+ * let go of, and when it was reset and they're no use anymore.
  */
-TSS2_RC
-resource_manager_quota_check (ResourceManager *resmgr,
-                              Tpm2Command     *command)
+void
+resource_manager_demote_all (ResourceManager *resmgr)
 {
-    HandleMap   *handle_map = NULL;
-    Connection  *connection = NULL;
-    TSS2_RC      rc = TSS2_RC_SUCCESS;
+    guint i;
 
-    switch (tpm2_command_get_code (command)) {
-    /* These commands load transient objects. */
-    case TPM2_CC_CreatePrimary:
-    case TPM2_CC_Load:
-    case TPM2_CC_LoadExternal:
-        connection = tpm2_command_get_connection (command);
-        handle_map = connection_get_trans_map (connection);
-        if (handle_map_is_full (handle_map)) {
-            g_info ("%s: Connection has exceeded transient object limit",
-                    __func__);
-            rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+    for (i = 0; i < resmgr->promote_max; ++i) {
+        if (resmgr->promoted [i] != NULL) {
+            resource_manager_demote (resmgr, i);
         }
-        break;
-    /* These commands create sessions. */
-    case TPM2_CC_StartAuthSession:
-        connection = tpm2_command_get_connection (command);
+    }
+}
+/*
+ * Return the slot of the promoted object 'entry', promote_max if it
+ * isn't promoted.
+ */
+static guint
+resource_manager_promoted_slot (ResourceManager *resmgr,
+                                HandleMapEntry  *entry)
+{
+    guint i;
+
+    for (i = 0; i < resmgr->promote_max; ++i) {
+        if (resmgr->promoted [i] == entry) {
+            break;
+        }
+    }
+    return i;
+}
+/*
+ * Evict the objects a daemon that didn't shut down cleanly left in our
+ * persistent handles, the whole range whatever our budget is now.
+ */
+static void
+resource_manager_promote_sweep (ResourceManager *resmgr)
+{
+    GArray *handles;
+    TPM2_HANDLE handle;
+    guint i;
+
+    handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    if (tpm2_get_handles (resmgr->tpm2, TPM2_HT_PERSISTENT, handles) ==
+        TSS2_RC_SUCCESS)
+    {
+        for (i = 0; i < handles->len; ++i) {
+            handle = g_array_index (handles, TPM2_HANDLE, i);
+            if (!handle_is_promoted (handle)) {
+                continue;
+            }
+            g_info ("%s: evicting promoted object 0x%" PRIx32 " left "
+                    "behind", __func__, handle);
+            tpm2_evict_control (resmgr->tpm2,
+                                &resmgr->promote_auth,
+                                handle,
+                                handle);
+        }
+    }
+    g_array_unref (handles);
+    resource_manager_persistent_changed (resmgr);
+}
+/*
+ * Make the shared object 'entry' persistent in 'slot' with EvictControl.
+ * The object is loaded if it isn't resident and its context is saved if
+ * it wasn't before, then the transient copy is flushed: the vhandles
+ * backed by it map to the persistent handle from now on, it's never
+ * evicted or loaded again. Returns FALSE if the object can't be promoted,
+ * it's left as it was.
+ */
+static gboolean
+resource_manager_promote_entry (ResourceManager *resmgr,
+                                HandleMapEntry  *entry,
+                                guint            slot)
+{
+    TPM2_HANDLE persistent = RESOURCE_MANAGER_PROMOTE_BASE + slot;
+    TPM2_HANDLE phandle = handle_map_entry_get_phandle (entry);
+    TPMS_CONTEXT *context;
+    TSS2_RC rc;
+
+    if (phandle == 0) {
+        resource_manager_evict_transients (resmgr, 1, NULL);
+        rc = resource_manager_load_entry (resmgr, entry, &phandle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to load object to promote, rc: 0x%"
+                       PRIx32, __func__, rc);
+            return FALSE;
+        }
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_LOAD);
+        handle_map_entry_set_phandle (entry, phandle);
+        resource_manager_touch_transient (resmgr, entry);
+    }
+    if (!handle_map_entry_get_context_saved (entry)) {
+        context = handle_map_entry_get_context (entry);
+        rc = tpm2_context_save (resmgr->tpm2, phandle, context);
+        if (rc != TSS2_RC_SUCCESS) {
+            return FALSE;
+        }
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_SAVE);
+        handle_map_entry_set_context_saved (entry, TRUE);
+        resource_manager_note_sequence (resmgr, context->sequence);
+    }
+    rc = tpm2_evict_control (resmgr->tpm2,
+                             &resmgr->promote_auth,
+                             phandle,
+                             persistent);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to make object 0x%" PRIx32 " persistent as "
+                   "0x%" PRIx32 ", rc: 0x%" PRIx32, __func__, phandle,
+                   persistent, rc);
+        return FALSE;
+    }
+    resource_manager_persistent_changed (resmgr);
+    rc = tpm2_context_flush (resmgr->tpm2, phandle);
+    if (rc == TSS2_RC_SUCCESS) {
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
+    } else {
+        g_warning ("%s: failed to flush promoted object 0x%" PRIx32
+                   ", rc: 0x%" PRIx32, __func__, phandle, rc);
+    }
+    resource_manager_forget_transient (resmgr, entry);
+    handle_map_entry_set_phandle (entry, persistent);
+    resmgr->promoted [slot] = g_object_ref (entry);
+    g_info ("%s: promoted shared object to 0x%" PRIx32, __func__,
+            persistent);
+    return TRUE;
+}
+/*
+ * A shared object that may be promoted and how often it was used in the
+ * last interval.
+ */
+typedef struct {
+    HandleMapEntry *entry;
+    guint           count;
+} promote_candidate_t;
+
+static gint
+promote_candidate_compare (gconstpointer a,
+                           gconstpointer b)
+{
+    const promote_candidate_t *cand_a = a, *cand_b = b;
+
+    if (cand_a->count == cand_b->count) {
+        return 0;
+    }
+    return cand_a->count < cand_b->count ? 1 : -1;
+}
+/*
+ * Review the shared objects by how often they were used since the last
+ * review. Promoted objects used less than half of
+ * RESOURCE_MANAGER_PROMOTE_USES times are evicted from NV. Then those
+ * used at least that often are promoted, the hottest first, while there
+ * are free slots, a promoted object being evicted to make room for one
+ * used more than twice as often. Objects left from before a TPM reset
+ * are never promoted. Returns the number of objects promoted.
+ */
+guint
+resource_manager_promote (ResourceManager *resmgr)
+{
+    promote_candidate_t candidate;
+    guint counts [RESOURCE_MANAGER_PROMOTE_MAX] = { 0, };
+    HandleMapEntry *entry;
+    GArray *candidates;
+    GList *objects, *link;
+    guint i, j, slot, promoted = 0;
+
+    resmgr->promote_next = g_get_monotonic_time () +
+        RESOURCE_MANAGER_PROMOTE_INTERVAL_US;
+    if (resmgr->promote_max == 0 || resmgr->object_share == NULL) {
+        return 0;
+    }
+    for (i = 0; i < resmgr->promote_max; ++i) {
+        if (resmgr->promoted [i] == NULL) {
+            continue;
+        }
+        counts [i] = handle_map_entry_take_use_count (resmgr->promoted [i]);
+        if (counts [i] < RESOURCE_MANAGER_PROMOTE_USES / 2) {
+            resource_manager_demote (resmgr, i);
+        }
+    }
+    candidates = g_array_new (FALSE, FALSE, sizeof (promote_candidate_t));
+    objects = object_share_objects (resmgr->object_share);
+    for (link = objects; link != NULL; link = link->next) {
+        entry = HANDLE_MAP_ENTRY (link->data);
+        if (transient_is_promoted (entry)) {
+            continue;
+        }
+        candidate.entry = entry;
+        candidate.count = handle_map_entry_take_use_count (entry);
+        if (candidate.count >= RESOURCE_MANAGER_PROMOTE_USES &&
+            handle_map_entry_get_epoch (entry) == resmgr->reset_epoch)
+        {
+            g_array_append_val (candidates, candidate);
+        }
+    }
+    g_array_sort (candidates, promote_candidate_compare);
+    for (i = 0; i < candidates->len; ++i) {
+        candidate = g_array_index (candidates, promote_candidate_t, i);
+        slot = resource_manager_promoted_slot (resmgr, NULL);
+        if (slot == resmgr->promote_max) {
+            /* no free slot, the coldest promoted object may give way */
+            for (slot = 0, j = 1; j < resmgr->promote_max; ++j) {
+                if (counts [j] < counts [slot]) {
+                    slot = j;
+                }
+            }
+            if (candidate.count <= 2 * (guint64)counts [slot]) {
+                break;
+            }
+            resource_manager_demote (resmgr, slot);
+        }
+        if (!resource_manager_promote_entry (resmgr, candidate.entry, slot)) {
+            break;
+        }
+        counts [slot] = candidate.count;
+        ++promoted;
+    }
+    g_array_free (candidates, TRUE);
+    g_list_free_full (objects, g_object_unref);
+    return promoted;
+}
+/*
+ * Promote up to 'max' of the hottest shared objects with the owner
+ * password 'auth', NULL for the empty one. This must be set before the
+ * thread starts, the objects left by an earlier run are evicted then.
+ */
+void
+resource_manager_set_promotion (ResourceManager  *resmgr,
+                                guint             max,
+                                const TPM2B_AUTH *auth)
+{
+    resmgr->promote_max = MIN (max, RESOURCE_MANAGER_PROMOTE_MAX);
+    memset (&resmgr->promote_auth, 0, sizeof (resmgr->promote_auth));
+    if (auth != NULL) {
+        resmgr->promote_auth = *auth;
+    }
+}
+/*
+ * Give up the use the provided entry makes of the shared object backing
+ * it. The last user to let go flushes the object if it's resident, or
+ * evicts it from NV if it was promoted.
+ */
+static void
+resource_manager_object_share_release (ResourceManager *resmgr,
+                                       HandleMapEntry  *entry)
+{
+    HandleMapEntry *backing = handle_map_entry_get_backing (entry);
+    TPM2_HANDLE phandle;
+    guint slot;
+    TSS2_RC rc;
+
+    if (backing == entry || resmgr->object_share == NULL ||
+        !object_share_release (resmgr->object_share, backing))
+    {
+        return;
+    }
+    phandle = handle_map_entry_get_phandle (backing);
+    g_debug ("%s: last user gone for shared object with phandle 0x%" PRIx32,
+             __func__, phandle);
+    slot = resource_manager_promoted_slot (resmgr, backing);
+    if (slot < resmgr->promote_max) {
+        resource_manager_demote (resmgr, slot);
+    } else if (phandle != 0) {
+        rc = tpm2_context_flush (resmgr->tpm2, phandle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to flush shared object 0x%" PRIx32
+                       ", rc: 0x%" PRIx32, __func__, phandle, rc);
+        } else {
+            resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
+        }
+        handle_map_entry_set_phandle (backing, 0);
+        resource_manager_forget_transient (resmgr, backing);
+    }
+}
+/*
+ * GHFunc releasing the shared objects used by the entries of a HandleMap.
+ */
+static void
+object_share_release_callback (gpointer key,
+                               gpointer value,
+                               gpointer user_data)
+{
+    UNUSED_PARAM (key);
+
+    resource_manager_object_share_release (RESOURCE_MANAGER (user_data),
+                                           HANDLE_MAP_ENTRY (value));
+}
+/*
+ * Answer a Load command with an object another connection already loaded
+ * from the same parent and blob. The connection gets a new vhandle backed
+ * by the shared object and a copy of the response the TPM gave to the
+ * first Load, so the object is neither loaded again nor does it take
+ * another slot in the TPM.
+ * If sharing is disabled, the object can't be shared or isn't shared yet,
+ * NULL is returned and the command must be sent to the TPM.
+ */
+Tpm2Response*
+resource_manager_object_share_load (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    Tpm2Response *response = NULL;
+    HandleMapEntry *backing, *entry;
+    HandleMap *map;
+    GBytes *key, *cached = NULL;
+    TPM2_HANDLE vhandle;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->object_share == NULL) {
+        return NULL;
+    }
+    key = object_share_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    backing = object_share_lookup (resmgr->object_share, key, &cached);
+    g_bytes_unref (key);
+    if (backing == NULL) {
+        return NULL;
+    }
+    map = connection_peek_trans_map (connection);
+    vhandle = handle_map_next_vhandle (map);
+    if (vhandle == 0) {
+        g_warning ("%s: no vhandle left for the shared object", __func__);
+        object_share_release (resmgr->object_share, backing);
+        goto out;
+    }
+    entry = handle_map_entry_new_shared (vhandle, backing);
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (entry);
+    if (handle_map_entry_get_phandle (backing) != 0) {
+        resource_manager_touch_transient (resmgr, backing);
+    }
+    g_debug ("%s: vhandle 0x%" PRIx32 " shares the object with phandle 0x%"
+             PRIx32, __func__, vhandle, handle_map_entry_get_phandle (backing));
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    tpm2_response_set_handle (response, vhandle);
+out:
+    g_bytes_unref (cached);
+    g_object_unref (backing);
+    return response;
+}
+/*
+ * Keep the ObjectShare in step with the commands sent to the TPM. The
+ * object from a successful Load that can be shared is moved to a backing
+ * entry that the connection's new entry, and those of the connections
+ * loading it later, refer to. Commands that may change the persistent
+ * parents stop the sharing of the objects loaded so far.
+ * This must be called once the phandle in the response is replaced by a
+ * vhandle, the entry in 'transient_slist' for the new object is replaced
+ * by the one backed by the shared object.
+ */
+void
+resource_manager_object_share_update (ResourceManager *resmgr,
+                                      Tpm2Command     *command,
+                                      Tpm2Response    *response,
+                                      GSList         **transient_slist)
+{
+    HandleMapEntry *entry, *backing, *shared;
+    HandleMap *map;
+    GSList *link;
+    GBytes *key, *bytes;
+    TPM2_HANDLE vhandle;
+
+    if (resmgr->object_share == NULL ||
+        tpm2_response_get_code (response) != TSS2_RC_SUCCESS)
+    {
+        return;
+    }
+    if (object_share_invalidates (tpm2_command_get_code (command))) {
+        object_share_forget (resmgr->object_share);
+        return;
+    }
+    key = object_share_key (command);
+    if (key == NULL) {
+        return;
+    }
+    map = connection_peek_trans_map (tpm2_command_peek_connection (command));
+    vhandle = tpm2_response_get_handle (response);
+    entry = handle_map_vlookup (map, vhandle);
+    if (entry == NULL) {
+        g_bytes_unref (key);
+        return;
+    }
+    backing = handle_map_entry_new (handle_map_entry_get_phandle (entry), 0);
+    handle_map_entry_set_context_store (backing, resmgr->context_store);
+    handle_map_entry_set_epoch (backing, handle_map_entry_get_epoch (entry));
+    bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    if (object_share_insert (resmgr->object_share, key, backing, bytes)) {
+        g_debug ("%s: sharing the object loaded as vhandle 0x%" PRIx32,
+                 __func__, vhandle);
+        shared = handle_map_entry_new_shared (vhandle, backing);
+        resource_manager_forget_transient (resmgr, entry);
+        handle_map_remove (map, vhandle);
+        handle_map_insert (map, vhandle, shared);
+        link = g_slist_find (*transient_slist, entry);
+        if (link != NULL) {
+            g_object_unref (entry);
+            link->data = g_object_ref (shared);
+        }
+        resource_manager_touch_transient (resmgr, backing);
+        g_object_unref (shared);
+    }
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+    g_object_unref (backing);
+    g_object_unref (entry);
+}
+/*
+ * This function performs the special processing associated with the
+ * TPM2_FlushContext command. How much we can "virtualize" of this command
+ * depends on the parameters / handle type.
+ *
+ * Transient objects that are tracked by the RM (stored in the transient
+ * HandleMap in the Connection object) may still be resident in the TPM. If
+ * so we flush the object, then we delete the mapping, create a Tpm2Response
+ * object and return it to the caller.
+ *
+ * Session objects are not so simple. Sessions cannot be flushed after each
+ * use. The TPM will only allow us to save the context as it must maintain
+ * some internal tracking information. So when the caller wishes to flush a
+ * session context we must remove the entry tracking the mapping between
+ * session and connection from the session_slist (if any exists). The comman
+ * must then be passed to the TPM as well. We return NULL here to let the
+ * caller know.
+ */
+Tpm2Response*
+resource_manager_flush_context (ResourceManager *resmgr,
+                                Tpm2Command     *command)
+{
+    Connection     *connection;
+    HandleMap      *map;
+    HandleMapEntry *entry;
+    Tpm2Response   *response = NULL;
+    TPM2_HANDLE      handle;
+    TPM2_HT          handle_type;
+    TSS2_RC         rc;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_FlushContext) {
+        g_warning ("resource_manager_flush_context with wrong command");
+        return NULL;
+    }
+    rc = tpm2_command_get_flush_handle (command, &handle);
+    connection = tpm2_command_peek_connection (command);
+    if (rc != TSS2_RC_SUCCESS) {
+        response = tpm2_response_new_rc (connection, rc);
+        goto out;
+    }
+    g_debug ("resource_manager_flush_context handle: 0x%" PRIx32, handle);
+    handle_type = handle >> TPM2_HR_SHIFT;
+    switch (handle_type) {
+    case TPM2_HT_TRANSIENT:
+        g_debug ("handle is TPM2_HT_TRANSIENT, virtualizing");
+        map = connection_peek_trans_map (connection);
+        entry = handle_map_vlookup (map, handle);
+        if (entry != NULL) {
+            /* a shared object is only flushed by its last user */
+            if (handle_map_entry_get_backing (entry) != entry) {
+                resource_manager_object_share_release (resmgr, entry);
+            } else if (handle_map_entry_get_phandle (entry) != 0) {
+                /* the object may still be resident in the TPM */
+                rc = tpm2_context_flush (resmgr->tpm2,
+                                         handle_map_entry_get_phandle (entry));
+                if (rc != TSS2_RC_SUCCESS) {
+                    g_warning ("%s: failed to flush resident transient "
+                               "0x%" PRIx32 ", rc: 0x%" PRIx32, __func__,
+                               handle_map_entry_get_phandle (entry), rc);
+                } else {
+                    resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
+                }
+                handle_map_entry_set_phandle (entry, 0);
+                resource_manager_forget_transient (resmgr, entry);
+            }
+            handle_map_entry_set_public (entry, NULL);
+            handle_map_remove (map, handle);
+            g_object_unref (entry);
+            rc = TSS2_RC_SUCCESS;
+        } else {
+            /*
+             * If the handle doesn't map to a HandleMapEntry then it's not one
+             * that we're managing and so we can't flush it. Return an error
+             * indicating that error is related to a handle, that it's a parameter
+             * and that it's the first parameter.
+             */
+            rc = RM_RC (TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1);
+        }
+        response = tpm2_response_new_rc (connection, rc);
+        break;
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        g_debug ("%s: handle 0x%08" PRIx32 "is a session, removing from "
+                 "SessionList", __func__, handle);
+        session_list_remove_handle (resmgr->session_list, handle);
+        break;
+    }
+
+out:
+    return response;
+}
+/*
+ * Ensure that executing the provided command will not exceed any of the
+ * per-connection quotas enforced by the RM. This is currently limited to
+ * transient objects and sessions.
+ */
+TSS2_RC
+resource_manager_quota_check (ResourceManager *resmgr,
+                              Tpm2Command     *command)
+{
+    Connection  *connection = tpm2_command_peek_connection (command);
+    TSS2_RC      rc = TSS2_RC_SUCCESS;
+
+    switch (tpm2_command_get_code (command)) {
+    /* These commands load transient objects. */
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_Load:
+    case TPM2_CC_LoadExternal:
+        if (handle_map_is_full (connection_peek_trans_map (connection))) {
+            g_info ("%s: Connection has exceeded transient object limit",
+                    __func__);
+            rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+        }
+        break;
+    /* These commands create sessions. */
+    case TPM2_CC_StartAuthSession:
         if (session_list_is_full (resmgr->session_list, connection)) {
             g_info ("%s: Connectionhas exceeded session limit", __func__);
             rc = TSS2_RESMGR_RC_SESSION_MEMORY;
         }
         break;
     }
-    g_clear_object (&connection);
-    g_clear_object (&handle_map);
 
     return rc;
 }
@@ -755,7 +2193,7 @@ remove_entry_from_handle_map (gpointer data_entry,
 {
     HandleMapEntry  *entry       = HANDLE_MAP_ENTRY (data_entry);
     Connection      *connection  = CONNECTION (data_connection);
-    HandleMap       *map         = connection_get_trans_map (connection);
+    HandleMap       *map         = connection_peek_trans_map (connection);
     TPM2_HANDLE       handle      = handle_map_entry_get_vhandle (entry);
     TPM2_HT           handle_type = 0;
 
@@ -774,7 +2212,10 @@ remove_entry_from_handle_map (gpointer data_entry,
 /*
  * This function handles the required post-processing on the HandleMapEntry
  * objects in the GSList that represent objects loaded into the TPM as part of
- * executing a command.
+ * executing a command. These objects are left loaded and become the most
+ * recently used in the list of resident transients. Only once there are
+ * more resident transients than we allow are the least recently used saved
+ * and flushed.
  */
 void
 post_process_loaded_transients (ResourceManager  *resmgr,
@@ -782,91 +2223,40 @@ post_process_loaded_transients (ResourceManager  *resmgr,
                                 Connection       *connection,
                                 TPMA_CC           command_attrs)
 {
-    /* if flushed bit is clear we need to flush & save contexts */
+    GSList *entry;
+
+    /* sequence objects change with each update, drop saved contexts */
+    if ((command_attrs & TPMA_CC_COMMANDINDEX_MASK) == TPM2_CC_SequenceUpdate) {
+        for (entry = *transient_slist; entry != NULL; entry = entry->next) {
+            handle_map_entry_set_context_saved (HANDLE_MAP_ENTRY (entry->data),
+                                                FALSE);
+        }
+    }
+    /* if flushed bit is clear the objects stay resident */
     if (!(command_attrs & TPMA_CC_FLUSHED)) {
-        g_debug ("flushsave_context for %" PRIu32 " entries",
+        g_debug ("marking %" PRIu32 " entries as recently used",
                  g_slist_length (*transient_slist));
         g_slist_foreach (*transient_slist,
-                        resource_manager_flushsave_context,
-                        resmgr);
+                         resource_manager_touch_transient_callback,
+                         resmgr);
+        resource_manager_evict_transients (resmgr, 0, NULL);
     } else {
         /*
          * if flushed bit is set the transient object entry has been flushed
          * and so we just remove it
          */
         g_debug ("TPMA_CC flushed bit set");
+        for (entry = *transient_slist; entry != NULL; entry = entry->next) {
+            handle_map_entry_set_phandle (HANDLE_MAP_ENTRY (entry->data), 0);
+            resource_manager_forget_transient (resmgr,
+                                               HANDLE_MAP_ENTRY (entry->data));
+        }
         g_slist_foreach (*transient_slist,
                          remove_entry_from_handle_map,
                          connection);
     }
     g_slist_free_full (*transient_slist, g_object_unref);
 }
-/*
- * This structure is used to keep state while iterating over a list of
- * TPM2_HANDLES.
- * 'cap_data'    : this parameter is used to collect the list of handles that
- *   we want as well as the number of handles in the structure
- * 'max_count'   : is the maximum number of handles to return
- * 'more_data'   : once max_count handles have been collected this variable
- *   tells the caller whether additional handles would have been returned had
- *   max_count been larger
- * 'start_handle': is the numerically smallest handle that should be collected
- *   into cap_data.
- */
-typedef struct {
-    TPMS_CAPABILITY_DATA *cap_data;
-    size_t                max_count;
-    gboolean              more_data;
-    TPM2_HANDLE            start_handle;
-} vhandle_iterator_state_t;
-/*
- * This callback function is invoked as part of iterating over a list of
- * handles. The first parameter is an entry from the collection being
- * traversed. The second is a reference to a vhandle_iterator_state_t
- * structure.
- * This structure is used to maintain state while iterating over the
- * collection.
- */
-void
-vhandle_iterator_callback (gpointer entry,
-                           gpointer data)
-{
-    TPM2_HANDLE                vhandle  = (uintptr_t)entry;
-    vhandle_iterator_state_t *state    = (vhandle_iterator_state_t*)data;
-    TPMS_CAPABILITY_DATA     *cap_data = state->cap_data;
-
-    /* if vhandle is numerically smaller than the start value just return */
-    if (vhandle < state->start_handle) {
-        return;
-    }
-    g_debug ("vhandle_iterator_callback with max_count: %zu and count: %"
-             PRIu32, state->max_count, cap_data->data.handles.count);
-    /* if we've collected max_count handles set 'more_data' and return */
-    if (!(cap_data->data.handles.count < state->max_count)) {
-        state->more_data = TRUE;
-        return;
-    }
-    cap_data->data.handles.handle [cap_data->data.handles.count] = vhandle;
-    ++cap_data->data.handles.count;
-}
-/*
- * This is a GCompareFunc used to sort a list of TPM2_HANDLES.
- */
-int
-handle_compare (gconstpointer a,
-                gconstpointer b)
-{
-    TPM2_HANDLE handle_a = (uintptr_t)a;
-    TPM2_HANDLE handle_b = (uintptr_t)b;
-
-    if (handle_a < handle_b) {
-        return -1;
-    } else if (handle_a > handle_b) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
 /*
  * The get_cap_transient function populates a TPMS_CAPABILITY_DATA structure
  * with the handles in the provided HandleMap 'map'. The 'prop' parameter
@@ -882,29 +2272,132 @@ get_cap_handles (HandleMap            *map,
                  UINT32                count,
                  TPMS_CAPABILITY_DATA *cap_data)
 {
-    GList *vhandle_list;
-    vhandle_iterator_state_t state = {
-        .cap_data     = cap_data,
-        .max_count    = count,
-        .more_data    = FALSE,
-        .start_handle = prop,
-    };
+    gboolean more_data = FALSE;
+    size_t i;
 
     cap_data->capability = TPM2_CAP_HANDLES;
-    cap_data->data.handles.count = 0;
-
-    vhandle_list = handle_map_get_keys (map);
-    vhandle_list = g_list_sort (vhandle_list, handle_compare);
-    g_list_foreach (vhandle_list, vhandle_iterator_callback, &state);
+    cap_data->data.handles.count =
+        handle_map_get_range (map,
+                              prop,
+                              cap_data->data.handles.handle,
+                              MIN (count, TPM2_MAX_CAP_HANDLES),
+                              &more_data);
 
-    g_debug ("iterating over %" PRIu32 " vhandles from g_list_foreach",
+    g_debug ("collected %" PRIu32 " vhandles from HandleMap",
              cap_data->data.handles.count);
-    size_t i;
     for (i = 0; i < cap_data->data.handles.count; ++i) {
         g_debug ("  vhandle: 0x%" PRIx32, cap_data->data.handles.handle [i]);
     }
 
-    return state.more_data;
+    return more_data;
+}
+/*
+ * Return the cached list of the handles of type 'handle_type' in the TPM,
+ * asking the TPM for it if it isn't cached. Only persistent handles and
+ * NV indices are cached, the handles of promoted objects are left out.
+ * Returns NULL if the handles of this type aren't cached or on failure. No
+ * reference is taken on the GArray.
+ */
+static GArray*
+resource_manager_handle_list (ResourceManager *resmgr,
+                              TPM2_HT          handle_type)
+{
+    GArray **list;
+    TPM2_HANDLE handle;
+    TSS2_RC rc;
+    guint i;
+
+    switch (handle_type) {
+    case TPM2_HT_PERSISTENT:
+        list = &resmgr->persistent_handles;
+        break;
+    case TPM2_HT_NV_INDEX:
+        list = &resmgr->nv_handles;
+        break;
+    default:
+        return NULL;
+    }
+    if (*list != NULL) {
+        return *list;
+    }
+    *list = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    rc = tpm2_get_handles (resmgr->tpm2, handle_type, *list);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to get handles of type 0x%" PRIx32 ": 0x%"
+                   PRIx32, __func__, handle_type, rc);
+        g_clear_pointer (list, g_array_unref);
+        return NULL;
+    }
+    /* The objects we promoted are reached through the connections' vhandles. */
+    if (handle_type == TPM2_HT_PERSISTENT) {
+        for (i = (*list)->len; i > 0; --i) {
+            handle = g_array_index (*list, TPM2_HANDLE, i - 1);
+            if (handle_is_promoted (handle)) {
+                g_array_remove_index (*list, i - 1);
+            }
+        }
+    }
+    g_debug ("%s: cached %u handles of type 0x%" PRIx32, __func__,
+             (*list)->len, handle_type);
+    return *list;
+}
+/*
+ * Drop the cached lists of handles that 'command' may have changed:
+ * EvictControl makes and removes persistent objects, the NV_DefineSpace
+ * and NV_UndefineSpace commands NV indices. Clearing or resetting the TPM,
+ * or changing the primary seeds may remove either.
+ */
+void
+resource_manager_handle_list_update (ResourceManager *resmgr,
+                                     Tpm2Command     *command)
+{
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_EvictControl:
+        g_clear_pointer (&resmgr->persistent_handles, g_array_unref);
+        break;
+    case TPM2_CC_NV_DefineSpace:
+    case TPM2_CC_NV_UndefineSpace:
+    case TPM2_CC_NV_UndefineSpaceSpecial:
+        g_clear_pointer (&resmgr->nv_handles, g_array_unref);
+        break;
+    case TPM2_CC_Clear:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_Startup:
+        g_clear_pointer (&resmgr->persistent_handles, g_array_unref);
+        g_clear_pointer (&resmgr->nv_handles, g_array_unref);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Populate a TPMS_CAPABILITY_DATA structure from the sorted list of
+ * handles 'handles' as the TPM would: at most 'count' handles, no fewer
+ * than 'prop'. Returns TRUE when more handles are present.
+ */
+gboolean
+get_cap_handles_list (GArray               *handles,
+                      TPM2_HANDLE           prop,
+                      UINT32                count,
+                      TPMS_CAPABILITY_DATA *cap_data)
+{
+    guint i;
+
+    cap_data->capability = TPM2_CAP_HANDLES;
+    cap_data->data.handles.count = 0;
+    count = MIN (count, TPM2_MAX_CAP_HANDLES);
+    for (i = 0; i < handles->len; ++i) {
+        if (g_array_index (handles, TPM2_HANDLE, i) < prop) {
+            continue;
+        }
+        if (cap_data->data.handles.count == count) {
+            return TRUE;
+        }
+        cap_data->data.handles.handle [cap_data->data.handles.count++] =
+            g_array_index (handles, TPM2_HANDLE, i);
+    }
+    return FALSE;
 }
 /*
  * These macros are used to set fields in a Tpm2Response buffer that we
@@ -963,13 +2456,48 @@ build_cap_handles_response (TPMS_CAPABILITY_DATA *cap_data,
 
     return buf;
 }
+/*
+ * Some of the values reported by the TPM in response to a GetCapability
+ * command must be modified before they're returned to the client.
+ * Specifically, in the case of the TPM2_PT_CONTEXT_GAP_MAX property, we
+ * overrite the value since the ResourceManager handles the context gap.
+ */
+void
+cap_data_post_process (TPMS_CAPABILITY_DATA *cap_data)
+{
+    size_t i;
+
+    g_debug ("%s: capability 0x%" PRIx32, __func__, cap_data->capability);
+    switch (cap_data->capability) {
+    case TPM2_CAP_TPM_PROPERTIES:
+        for (i = 0; i < cap_data->data.tpmProperties.count; ++i) {
+            g_debug ("%s: property 0x%" PRIx32 ", value 0x%" PRIx32,
+                     __func__,
+                     cap_data->data.tpmProperties.tpmProperty [i].property,
+                     cap_data->data.tpmProperties.tpmProperty [i].value);
+            switch (cap_data->data.tpmProperties.tpmProperty [i].property) {
+            case TPM2_PT_CONTEXT_GAP_MAX:
+                g_debug ("%s: changing TPM2_PT_CONTEXT_GAP_MAX, from 0x%"
+                         PRIx32 " to UINT32_MAX: 0x%" PRIx32, __func__,
+                         cap_data->data.tpmProperties.tpmProperty [i].value,
+                         UINT32_MAX);
+                cap_data->data.tpmProperties.tpmProperty [i].value = UINT32_MAX;
+                break;
+            default:
+                break;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
 /*
  * In cases where the GetCapability command isn't fully virtualized we may
  * need to perform some 'post processing' of the results returned from the
- * TPM2 device. Specifically, in the case of the TPM2_PT_CONTEXT_GAP_MAX
- * property, we overrite the value in the response body. This function
- * manually unmarshals the response, iterates over the values modifying
- * them if necessary and then marshals them back into the Tpm2Response.
+ * TPM2 device. This function manually unmarshals the response, modifies
+ * the values as necessary and then marshals them back into the
+ * Tpm2Response.
  */
 TSS2_RC
 get_cap_post_process (Tpm2Response *resp)
@@ -982,7 +2510,6 @@ get_cap_post_process (Tpm2Response *resp)
     uint8_t *buf = tpm2_response_get_buffer (resp);
     size_t buf_size = tpm2_response_get_size (resp);
     size_t offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO);
-    size_t i;
 
     rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (buf,
                                                  buf_size,
@@ -992,30 +2519,7 @@ get_cap_post_process (Tpm2Response *resp)
         g_warning ("%s: Failed to unmarshal TPMS_CAPABILITY_DATA", __func__);
         return rc;
     }
-    g_debug ("%s: capability 0x%" PRIx32, __func__, cap_data.capability);
-    switch (cap_data.capability) {
-    case TPM2_CAP_TPM_PROPERTIES:
-        for (i = 0; i < cap_data.data.tpmProperties.count; ++i) {
-            g_debug ("%s: property 0x%" PRIx32 ", value 0x%" PRIx32,
-                     __func__,
-                     cap_data.data.tpmProperties.tpmProperty [i].property,
-                     cap_data.data.tpmProperties.tpmProperty [i].value);
-            switch (cap_data.data.tpmProperties.tpmProperty [i].property) {
-            case TPM2_PT_CONTEXT_GAP_MAX:
-                g_debug ("%s: changing TPM2_PT_CONTEXT_GAP_MAX, from 0x%"
-                         PRIx32 " to UINT32_MAX: 0x%" PRIx32, __func__,
-                         cap_data.data.tpmProperties.tpmProperty [i].value,
-                         UINT32_MAX);
-                cap_data.data.tpmProperties.tpmProperty [i].value = UINT32_MAX;
-                break;
-            default:
-                break;
-            }
-        }
-        break;
-    default:
-        break;
-    }
+    cap_data_post_process (&cap_data);
     offset = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO);
     rc = Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data,
                                                buf,
@@ -1027,6 +2531,184 @@ get_cap_post_process (Tpm2Response *resp)
     }
     return rc;
 }
+/*
+ * Helper functions used to iterate over the entries in a fixed capability
+ * snapshot without caring about which member of the TPMU_CAPABILITIES union
+ * holds them. Only the capabilities returned by tpm2_get_fixed_capability
+ * are handled.
+ */
+static UINT32
+cap_fixed_count (TPMS_CAPABILITY_DATA *cap_data)
+{
+    switch (cap_data->capability) {
+    case TPM2_CAP_ALGS:
+        return cap_data->data.algorithms.count;
+    case TPM2_CAP_COMMANDS:
+        return cap_data->data.command.count;
+    case TPM2_CAP_ECC_CURVES:
+        return cap_data->data.eccCurves.count;
+    case TPM2_CAP_TPM_PROPERTIES:
+        return cap_data->data.tpmProperties.count;
+    default:
+        return 0;
+    }
+}
+static UINT32
+cap_fixed_key (TPMS_CAPABILITY_DATA *cap_data,
+               UINT32                i)
+{
+    switch (cap_data->capability) {
+    case TPM2_CAP_ALGS:
+        return cap_data->data.algorithms.algProperties [i].alg;
+    case TPM2_CAP_COMMANDS:
+        return cap_data->data.command.commandAttributes [i] &
+            (TPMA_CC_COMMANDINDEX_MASK | TPMA_CC_V);
+    case TPM2_CAP_ECC_CURVES:
+        return cap_data->data.eccCurves.eccCurves [i];
+    case TPM2_CAP_TPM_PROPERTIES:
+        return cap_data->data.tpmProperties.tpmProperty [i].property;
+    default:
+        return 0;
+    }
+}
+static void
+cap_fixed_append (TPMS_CAPABILITY_DATA *dst,
+                  TPMS_CAPABILITY_DATA *src,
+                  UINT32                i)
+{
+    switch (src->capability) {
+    case TPM2_CAP_ALGS:
+        dst->data.algorithms.algProperties [dst->data.algorithms.count++] =
+            src->data.algorithms.algProperties [i];
+        break;
+    case TPM2_CAP_COMMANDS:
+        dst->data.command.commandAttributes [dst->data.command.count++] =
+            src->data.command.commandAttributes [i];
+        break;
+    case TPM2_CAP_ECC_CURVES:
+        dst->data.eccCurves.eccCurves [dst->data.eccCurves.count++] =
+            src->data.eccCurves.eccCurves [i];
+        break;
+    case TPM2_CAP_TPM_PROPERTIES:
+        dst->data.tpmProperties.tpmProperty [dst->data.tpmProperties.count++] =
+            src->data.tpmProperties.tpmProperty [i];
+        break;
+    default:
+        break;
+    }
+}
+static UINT32
+cap_fixed_max (TPM2_CAP cap)
+{
+    switch (cap) {
+    case TPM2_CAP_ALGS:
+        return TPM2_MAX_CAP_ALGS;
+    case TPM2_CAP_COMMANDS:
+        return TPM2_MAX_CAP_CC;
+    case TPM2_CAP_ECC_CURVES:
+        return TPM2_MAX_ECC_CURVES;
+    case TPM2_CAP_TPM_PROPERTIES:
+        return TPM2_MAX_TPM_PROPERTIES;
+    default:
+        return 0;
+    }
+}
+/*
+ * Answer a GetCapability query for one of the fixed capabilities from the
+ * snapshot taken by the Tpm2 object at startup. The entries that the TPM
+ * would return for the given 'prop' and 'count' are copied to 'cap_data'
+ * and 'more_data' is set accordingly. Entries in the snapshot are in
+ * ascending order as required by the spec.
+ * For TPM2_CAP_TPM_PROPERTIES only the TPM2_PT_FIXED group is answered.
+ * We stop at the end of the group and set 'more_data' so the client will
+ * ask the TPM for the TPM2_PT_VAR group.
+ * If there's no complete snapshot for the capability FALSE is returned and
+ * the caller must send the command to the TPM.
+ */
+gboolean
+get_cap_fixed (Tpm2                 *tpm2,
+               TPM2_CAP              cap,
+               UINT32                prop,
+               UINT32                count,
+               TPMS_CAPABILITY_DATA *cap_data,
+               TPMI_YES_NO          *more_data)
+{
+    TPMS_CAPABILITY_DATA *fixed;
+    UINT32 i, key, entries;
+
+    if (cap == TPM2_CAP_TPM_PROPERTIES && prop >= TPM2_PT_VAR) {
+        return FALSE;
+    }
+    fixed = tpm2_get_fixed_capability (tpm2, cap);
+    if (fixed == NULL) {
+        g_debug ("%s: no snapshot for capability 0x%" PRIx32, __func__, cap);
+        return FALSE;
+    }
+
+    memset (cap_data, 0, sizeof (*cap_data));
+    cap_data->capability = cap;
+    *more_data = TPM2_NO;
+    count = MIN (count, cap_fixed_max (cap));
+    entries = cap_fixed_count (fixed);
+    for (i = 0; i < entries; ++i) {
+        key = cap_fixed_key (fixed, i);
+        if (key < prop) {
+            continue;
+        }
+        if (cap == TPM2_CAP_TPM_PROPERTIES && key >= TPM2_PT_VAR) {
+            break;
+        }
+        if (cap_fixed_count (cap_data) == count) {
+            *more_data = TPM2_YES;
+            break;
+        }
+        cap_fixed_append (cap_data, fixed, i);
+    }
+    if (cap == TPM2_CAP_TPM_PROPERTIES) {
+        *more_data = TPM2_YES;
+        cap_data_post_process (cap_data);
+    }
+
+    return TRUE;
+}
+/*
+ * Build a Tpm2Response for the GetCapability command from the provided
+ * TPMS_CAPABILITY_DATA and TPMI_YES_NO response parameters.
+ */
+Tpm2Response*
+build_cap_response (Connection           *connection,
+                    TPMA_CC               attributes,
+                    TPMS_CAPABILITY_DATA *cap_data,
+                    TPMI_YES_NO           more_data)
+{
+    TSS2_RC rc;
+    uint8_t *buf;
+    size_t offset = TPM_HEADER_SIZE;
+    size_t buf_size = TPM_HEADER_SIZE + sizeof (TPMI_YES_NO) +
+        sizeof (TPMS_CAPABILITY_DATA);
+
+    buf = calloc (1, buf_size);
+    if (buf == NULL) {
+        tabrmd_critical ("failed to allocate buffer for capability response");
+    }
+    rc = Tss2_MU_TPMI_YES_NO_Marshal (more_data, buf, buf_size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_MU_TPMI_YES_NO_Marshal", rc);
+        free (buf);
+        return NULL;
+    }
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (cap_data, buf, buf_size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_MU_TPMS_CAPABILITY_DATA_Marshal", rc);
+        free (buf);
+        return NULL;
+    }
+    set_response_tag (buf, TPM2_ST_NO_SESSIONS);
+    set_response_size (buf, offset);
+    set_response_code (buf, TSS2_RC_SUCCESS);
+
+    return tpm2_response_new (connection, buf, offset, attributes);
+}
 /*
  * This function takes a Tpm2Command and the associated connection object
  * as parameters. The Tpm2Command *must* have the 'code' attribute set to
@@ -1047,7 +2729,9 @@ get_cap_gen_response (ResourceManager *resmgr,
     Connection *connection = NULL;
     HandleMap *map;
     TPMS_CAPABILITY_DATA cap_data = { .capability = cap };
+    GArray *handles;
     gboolean more_data = FALSE;
+    TPMI_YES_NO more_fixed = TPM2_NO;
     uint8_t *resp_buf;
     Tpm2Response *response = NULL;
 
@@ -1060,10 +2744,28 @@ get_cap_gen_response (ResourceManager *resmgr,
         switch (handle_type) {
         case TPM2_HT_TRANSIENT:
             g_debug ("%s: TPM2_CAP_HANDLES && TPM2_HT_TRANSIENT", __func__);
-            connection = tpm2_command_get_connection (command);
-            map = connection_get_trans_map (connection);
+            connection = tpm2_command_peek_connection (command);
+            map = connection_peek_trans_map (connection);
             more_data = get_cap_handles (map,  prop, prop_count, &cap_data);
-            g_object_unref (map);
+            resp_buf = build_cap_handles_response (&cap_data, more_data);
+            response = tpm2_response_new (connection,
+                                          resp_buf,
+                                          CAP_RESP_SIZE (&cap_data),
+                                          tpm2_command_get_attributes (command));
+            break;
+        case TPM2_HT_PERSISTENT:
+        case TPM2_HT_NV_INDEX:
+            handles = resource_manager_handle_list (resmgr, handle_type);
+            if (handles == NULL) {
+                break;
+            }
+            g_debug ("%s: TPM2_CAP_HANDLES for handle type 0x%" PRIx32
+                     " from cache", __func__, handle_type);
+            connection = tpm2_command_peek_connection (command);
+            more_data = get_cap_handles_list (handles,
+                                              prop,
+                                              prop_count,
+                                              &cap_data);
             resp_buf = build_cap_handles_response (&cap_data, more_data);
             response = tpm2_response_new (connection,
                                           resp_buf,
@@ -1076,6 +2778,28 @@ get_cap_gen_response (ResourceManager *resmgr,
             break;
         }
         break;
+    case TPM2_CAP_ALGS:
+    case TPM2_CAP_COMMANDS:
+    case TPM2_CAP_ECC_CURVES:
+    case TPM2_CAP_TPM_PROPERTIES:
+        if (get_cap_fixed (resmgr->tpm2,
+                           cap,
+                           prop,
+                           prop_count,
+                           &cap_data,
+                           &more_fixed))
+        {
+            g_debug ("%s: cap 0x%" PRIx32 " answered from snapshot",
+                     __func__, cap);
+            connection = tpm2_command_peek_connection (command);
+            response = build_cap_response (connection,
+                                           tpm2_command_get_attributes (command),
+                                           &cap_data,
+                                           more_fixed);
+        } else {
+            response = resource_manager_cap_cache_lookup (resmgr, command);
+        }
+        break;
     default:
         g_debug ("%s: cap 0x%" PRIx32 " not handled", __func__, cap);
         break;
@@ -1083,108 +2807,1529 @@ get_cap_gen_response (ResourceManager *resmgr,
 
     if (response == NULL) {
         response = tpm2_send_command (resmgr->tpm2, command, &rc);
-        if (response != NULL && rc == TSS2_RC_SUCCESS) {
-            get_cap_post_process (response);
+        if (response != NULL && rc == TSS2_RC_SUCCESS &&
+            tpm2_response_get_code (response) == TSS2_RC_SUCCESS)
+        {
+            resource_manager_cap_cache_update (resmgr, command, response);
+            /* the ResponseSink does this while we send the next command */
+            tpm2_response_set_post_process (response, get_cap_post_process);
         }
     }
 
-    g_clear_object (&connection);
     return response;
 }
 /*
- * If the provided command is something that the ResourceManager "virtualizes"
- * then this function will do so and return a Tpm2Response object that will be
- * returned to the same connection. If the command isn't something that we
- * virtualize then we just return NULL.
- *
- * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
- * do not result in the command being executed by the TPM. This makes
- * handling the context gap unnecessary for these commands.
+ * Check and answer what we can of a command before it's queued for the
+ * ResourceManager. This runs on the thread of the CommandSource that read
+ * the command so it must not touch anything the ResourceManager thread
+ * changes: the handle maps, the session list and the caches are out. What
+ * is left is the command itself and the snapshot of the fixed
+ * capabilities in 'tpm2', which may be NULL to skip them.
+ * Commands with a bad tag, a command code the TPM doesn't implement or a
+ * handle or auth area that overruns the buffer are answered with an RM
+ * error response, GetCapability for a fixed capability from the snapshot.
+ * NULL is returned for commands the ResourceManager has to process.
+ * The attributes come from the CommandAttrs so a command without any
+ * isn't one the TPM knows, only our vendor commands are let through.
  */
 Tpm2Response*
-command_special_processing (ResourceManager *resmgr,
-                            Tpm2Command     *command)
+command_preprocess (Tpm2        *tpm2,
+                    Tpm2Command *command)
 {
-    Tpm2Response *response   = NULL;
+    Connection *connection = tpm2_command_peek_connection (command);
+    TPMI_ST_COMMAND_TAG tag = tpm2_command_get_tag (command);
+    TPMS_CAPABILITY_DATA cap_data = { 0 };
+    TPMI_YES_NO more_data = TPM2_NO;
+    size_t handles_end;
 
-    switch (tpm2_command_get_code (command)) {
-    case TPM2_CC_FlushContext:
-        g_debug ("processing TPM2_CC_FlushContext");
-        response = resource_manager_flush_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextSave:
-        g_debug ("processing TPM2_CC_ContextSave");
-        response = resource_manager_save_context (resmgr, command);
-        break;
-    case TPM2_CC_ContextLoad:
-        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
-        response = resource_manager_load_context (resmgr, command);
-        break;
-    case TPM2_CC_GetCapability:
-        if (!tpm2_command_has_auths(command)) {
-            g_debug ("processing TPM2_CC_GetCapability");
-            response = get_cap_gen_response (resmgr, command);
+    if (tag != TPM2_ST_NO_SESSIONS && tag != TPM2_ST_SESSIONS) {
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_BAD_TAG));
+    }
+    if (tpm2_command_get_attributes (command) == 0 &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_PIN &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_GROUP &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_LEASE &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_HASH &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_NV_READ &&
+        tpm2_command_get_code (command) != TSS2_TABRMD_CC_NV_WRITE)
+    {
+        g_debug ("%s: command 0x%" PRIx32 " not implemented", __func__,
+                 tpm2_command_get_code (command));
+        return tpm2_response_new_rc (connection,
+                                     RM_RC (TPM2_RC_COMMAND_CODE));
+    }
+    handles_end = TPM_HEADER_SIZE +
+        tpm2_command_get_handle_count (command) * sizeof (TPM2_HANDLE);
+    if (handles_end > tpm2_command_get_size (command)) {
+        g_debug ("%s: command 0x%" PRIx32 " too short for its handles",
+                 __func__, tpm2_command_get_code (command));
+        return tpm2_response_new_rc (connection,
+                                     RM_RC (TPM2_RC_COMMAND_SIZE));
+    }
+    if (tag == TPM2_ST_SESSIONS &&
+        tpm2_command_get_params_offset (command) == 0)
+    {
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_AUTHSIZE));
+    }
+    if (tpm2 == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_GetCapability ||
+        tpm2_command_has_auths (command))
+    {
+        return NULL;
+    }
+    switch (tpm2_command_get_cap (command)) {
+    case TPM2_CAP_ALGS:
+    case TPM2_CAP_COMMANDS:
+    case TPM2_CAP_ECC_CURVES:
+    case TPM2_CAP_TPM_PROPERTIES:
+        if (get_cap_fixed (tpm2,
+                           tpm2_command_get_cap (command),
+                           tpm2_command_get_prop (command),
+                           tpm2_command_get_prop_count (command),
+                           &cap_data,
+                           &more_data))
+        {
+            return build_cap_response (connection,
+                                       tpm2_command_get_attributes (command),
+                                       &cap_data,
+                                       more_data);
         }
         break;
     default:
         break;
     }
-
-    return response;
+    return NULL;
 }
 /*
- * This function creates a mapping from the transient physical to a virtual
- * handle in the provided response object. This mapping is then added to
- * the transient HandleMap for the associated connection, as well as the
- * list of currently loaded transient objects.
+ * Look up the HandleMapEntry for the vhandle in a ReadPublic command. We
+ * only cache and answer ReadPublic commands without sessions: audit and
+ * encrypt sessions make each response unique. The caller must release the
+ * reference to the returned HandleMapEntry.
  */
-void
-create_context_mapping_transient (ResourceManager  *resmgr,
-                                  Tpm2Response     *response,
-                                  GSList          **loaded_transient_slist)
+static HandleMapEntry*
+read_public_entry (Tpm2Command *command)
 {
-    HandleMap      *handle_map;
-    HandleMapEntry *handle_entry;
-    TPM2_HANDLE      phandle, vhandle;
-    Connection     *connection;
-    UNUSED_PARAM(resmgr);
+    HandleMap *map;
+    HandleMapEntry *entry;
+    TPM2_HANDLE handle;
 
-    g_debug ("create_context_mapping_transient");
-    phandle = tpm2_response_get_handle (response);
-    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
-    connection = tpm2_response_get_connection (response);
-    handle_map = connection_get_trans_map (connection);
-    g_object_unref (connection);
-    vhandle = handle_map_next_vhandle (handle_map);
-    if (vhandle == 0) {
-        g_error ("vhandle rolled over!");
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        return NULL;
     }
-    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
-    handle_entry = handle_map_entry_new (phandle, vhandle);
-    if (handle_entry == NULL) {
-        g_warning ("failed to create new HandleMapEntry for handle 0x%"
-                   PRIx32, phandle);
+    handle = tpm2_command_get_handle (command, 0);
+    if (handle >> TPM2_HR_SHIFT != TPM2_HT_TRANSIENT) {
+        return NULL;
     }
-    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
-                                               handle_entry);
-    handle_map_insert (handle_map, vhandle, handle_entry);
-    g_object_unref (handle_map);
-    tpm2_response_set_handle (response, vhandle);
+    map = connection_peek_trans_map (tpm2_command_peek_connection (command));
+    entry = handle_map_vlookup (map, handle);
+
+    return entry;
 }
 /*
- * This function after a Tpm2Command is sent to the TPM and:
- * - we receive a Tpm2Response object with a handle in the response buffers
- *   handle area
- * - the handle is a session handle
- * Since there's a handle in the response handle area the caller is being
- * returned a new handle after a context was successfully created or loaded.
- * So we know that the response is to one of two possible commands:
- * - a session being loaded by a call to LoadContext
- * - a session was newly created by a call to StartAuthSession
- * We differentiate between these two situations as follows:
- * - A call to 'LoadContext' implies that the session already exists and so
- *   it must already be in the session_list.
- *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
+ * Answer a ReadPublic command for a virtualized transient object from the
+ * response cached on its HandleMapEntry. This saves us loading the object
+ * just to read its public area. If there's no cached response NULL is
+ * returned and the command is sent to the TPM as usual.
+ */
+Tpm2Response*
+resource_manager_read_public (ResourceManager *resmgr,
+                              Tpm2Command     *command)
+{
+    HandleMapEntry *entry;
+    GBytes *cached;
+    Tpm2Response *response;
+    guint8 *buf;
+    gsize size;
+
+    UNUSED_PARAM(resmgr);
+    entry = read_public_entry (command);
+    if (entry == NULL) {
+        return NULL;
+    }
+    cached = handle_map_entry_get_public (entry);
+    g_object_unref (entry);
+    if (cached == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: answering TPM2_CC_ReadPublic for vhandle 0x%" PRIx32
+             " from cache", __func__, tpm2_command_get_handle (command, 0));
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    g_bytes_unref (cached);
+    response = tpm2_response_new (tpm2_command_peek_connection (command),
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+
+    return response;
+}
+/*
+ * Cache the response to a successful ReadPublic command on the
+ * HandleMapEntry of the object it was sent for. By the time we get the
+ * response the handle in the command buffer has been replaced by the
+ * phandle so the caller must supply the entry. The cache lives as long as
+ * the HandleMapEntry and so is dropped when the vhandle is flushed.
+ */
+void
+resource_manager_cache_public (ResourceManager *resmgr,
+                               Tpm2Command     *command,
+                               Tpm2Response    *response,
+                               HandleMapEntry  *entry)
+{
+    GBytes *bytes;
+
+    UNUSED_PARAM(resmgr);
+    if (tpm2_command_get_code (command) != TPM2_CC_ReadPublic ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_response_get_code (response) != TSS2_RC_SUCCESS ||
+        tpm2_response_get_tag (response) != TPM2_ST_NO_SESSIONS)
+    {
+        return;
+    }
+    g_debug ("%s: caching TPM2_CC_ReadPublic response for vhandle 0x%"
+             PRIx32, __func__, handle_map_entry_get_vhandle (entry));
+    bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    handle_map_entry_set_public (entry, bytes);
+    g_bytes_unref (bytes);
+}
+/*
+ * Satisfy a CreatePrimary command from the primary object cache. If the
+ * command matches a cached primary object we load its saved context and
+ * return a copy of the cached response with the new phandle in the handle
+ * area. The caller then maps the phandle to a vhandle just like it would
+ * for a response from the TPM.
+ * If the cache is disabled, the command isn't cacheable or the cached
+ * context fails to load, NULL is returned and the command must be sent to
+ * the TPM.
+ */
+Tpm2Response*
+resource_manager_primary_cache_load (ResourceManager *resmgr,
+                                     Tpm2Command     *command)
+{
+    Tpm2Response *response = NULL;
+    TPMS_CONTEXT context = { 0 };
+    TPM2_HANDLE phandle = 0;
+    GBytes *cached = NULL;
+    gchar *key;
+    guint8 *buf;
+    gsize size;
+    TSS2_RC rc;
+
+    if (resmgr->primary_cache == NULL ||
+        tpm2_command_get_code (command) != TPM2_CC_CreatePrimary)
+    {
+        return NULL;
+    }
+    key = primary_cache_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    if (!primary_cache_lookup (resmgr->primary_cache, key, &context, &cached)) {
+        g_debug ("%s: no cached primary for key %s", __func__, key);
+        goto out;
+    }
+    rc = tpm2_context_load (resmgr->tpm2, &context, &phandle);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Failed to load cached primary context", rc);
+        primary_cache_remove (resmgr->primary_cache, key);
+        goto out;
+    }
+    resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_LOAD);
+    g_debug ("%s: loaded cached primary for key %s as phandle 0x%" PRIx32,
+             __func__, key, phandle);
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    response = tpm2_response_new (tpm2_command_peek_connection (command),
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    tpm2_response_set_handle (response, phandle);
+out:
+    g_clear_pointer (&cached, g_bytes_unref);
+    g_free (key);
+    return response;
+}
+/*
+ * Keep the primary object cache in step with the commands sent to the TPM.
+ * A successful CreatePrimary adds the new primary object to the cache: we
+ * save its context without flushing it, the object stays resident for the
+ * connection that created it. Commands that change a hierarchy seed
+ * invalidate all cached primary objects, as do those that change the
+ * authValue or enable state of a hierarchy: the key only covers the
+ * password in the CreatePrimary command, the cached object must not
+ * outlive the hierarchy authorization it was created under.
+ * This must be called before the phandle in the response is replaced by a
+ * vhandle.
+ */
+void
+resource_manager_primary_cache_update (ResourceManager *resmgr,
+                                       Tpm2Command     *command,
+                                       Tpm2Response    *response)
+{
+    TPMS_CONTEXT context = { 0 };
+    GBytes *bytes;
+    gchar *key;
+    TSS2_RC rc;
+
+    if (resmgr->primary_cache == NULL ||
+        tpm2_response_get_code (response) != TSS2_RC_SUCCESS)
+    {
+        return;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_Clear:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_HierarchyChangeAuth:
+    case TPM2_CC_HierarchyControl:
+        primary_cache_clear (resmgr->primary_cache);
+        break;
+    case TPM2_CC_CreatePrimary:
+        key = primary_cache_key (command);
+        if (key == NULL) {
+            break;
+        }
+        rc = tpm2_context_save (resmgr->tpm2,
+                                tpm2_response_get_handle (response),
+                                &context);
+        if (rc == TSS2_RC_SUCCESS) {
+            resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_SAVE);
+            resource_manager_note_sequence (resmgr, context.sequence);
+            bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                                 tpm2_response_get_size (response));
+            if (primary_cache_insert (resmgr->primary_cache,
+                                      key,
+                                      &context,
+                                      bytes))
+            {
+                g_debug ("%s: cached primary with key %s", __func__, key);
+            }
+            g_bytes_unref (bytes);
+        } else {
+            RC_WARN ("Failed to save context of new primary", rc);
+        }
+        g_free (key);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Answer a PCR_Read command with the response the TPM gave to an earlier
+ * one for the same PCRs, if nothing has changed a PCR since.
+ * If the cache is disabled, the command isn't cacheable or there is no
+ * response cached for it, NULL is returned and the command must be sent
+ * to the TPM.
+ */
+Tpm2Response*
+resource_manager_pcr_cache_lookup (ResourceManager *resmgr,
+                                   Tpm2Command     *command)
+{
+    Tpm2Response *response;
+    GBytes *key, *cached;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->pcr_cache == NULL) {
+        return NULL;
+    }
+    key = pcr_cache_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    cached = pcr_cache_lookup (resmgr->pcr_cache, key);
+    g_bytes_unref (key);
+    if (cached == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: answering PCR_Read from the cache", __func__);
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    g_bytes_unref (cached);
+    response = tpm2_response_new (tpm2_command_peek_connection (command),
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    return response;
+}
+/*
+ * Keep the PCR cache in step with the commands sent to the TPM. Commands
+ * that may change a PCR drop everything cached whatever their response
+ * code, a successful PCR_Read adds its response.
+ */
+void
+resource_manager_pcr_cache_update (ResourceManager *resmgr,
+                                   Tpm2Command     *command,
+                                   Tpm2Response    *response)
+{
+    GBytes *key, *bytes;
+
+    if (resmgr->pcr_cache == NULL) {
+        return;
+    }
+    if (pcr_cache_invalidates (tpm2_command_get_code (command))) {
+        pcr_cache_clear (resmgr->pcr_cache);
+        return;
+    }
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        return;
+    }
+    key = pcr_cache_key (command);
+    if (key == NULL) {
+        return;
+    }
+    bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    pcr_cache_insert (resmgr->pcr_cache, key, bytes);
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+}
+/*
+ * Answer a GetCapability query for the variable TPM properties with the
+ * response the TPM gave to an identical one, if it's recent enough and
+ * nothing known to change the properties has been sent since.
+ * If the cache is disabled, the command isn't cacheable or there is no
+ * fresh response cached for it, NULL is returned and the command must be
+ * sent to the TPM.
+ */
+Tpm2Response*
+resource_manager_cap_cache_lookup (ResourceManager *resmgr,
+                                   Tpm2Command     *command)
+{
+    Tpm2Response *response;
+    GBytes *key, *cached;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->cap_cache == NULL) {
+        return NULL;
+    }
+    key = cap_cache_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    cached = cap_cache_lookup (resmgr->cap_cache,
+                               key,
+                               g_get_monotonic_time ());
+    g_bytes_unref (key);
+    if (cached == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: answering GetCapability from the cache", __func__);
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    g_bytes_unref (cached);
+    response = tpm2_response_new (tpm2_command_peek_connection (command),
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    tpm2_response_set_post_process (response, get_cap_post_process);
+    return response;
+}
+/*
+ * Keep the GetCapability cache in step with the commands sent to the TPM.
+ * Commands that may change the variable properties drop everything
+ * cached, a successful query for them adds its response.
+ */
+void
+resource_manager_cap_cache_update (ResourceManager *resmgr,
+                                   Tpm2Command     *command,
+                                   Tpm2Response    *response)
+{
+    GBytes *key, *bytes;
+
+    if (resmgr->cap_cache == NULL) {
+        return;
+    }
+    if (cap_cache_invalidates (tpm2_command_get_code (command),
+                               tpm2_response_get_code (response)))
+    {
+        cap_cache_clear (resmgr->cap_cache);
+        return;
+    }
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        return;
+    }
+    key = cap_cache_key (command);
+    if (key == NULL) {
+        return;
+    }
+    bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    cap_cache_insert (resmgr->cap_cache, key, bytes, g_get_monotonic_time ());
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+}
+/*
+ * Answer an NV_Read command with the response the TPM gave to an
+ * identical one, if the NV index is immutable.
+ * If the cache is disabled, the command isn't cacheable or there is no
+ * response cached for it, NULL is returned and the command must be sent
+ * to the TPM.
+ */
+Tpm2Response*
+resource_manager_nv_cache_lookup (ResourceManager *resmgr,
+                                  Tpm2Command     *command)
+{
+    Tpm2Response *response;
+    GBytes *key, *cached;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->nv_cache == NULL) {
+        return NULL;
+    }
+    key = nv_cache_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    cached = nv_cache_lookup (resmgr->nv_cache, key);
+    g_bytes_unref (key);
+    if (cached == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: answering NV_Read from the cache", __func__);
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    g_bytes_unref (cached);
+    response = tpm2_response_new (tpm2_command_peek_connection (command),
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+    return response;
+}
+/*
+ * Keep the NV cache in step with the commands sent to the TPM. Commands
+ * that may change an NV index or its authorization drop what's cached for
+ * it whatever their response code. A successful NV_ReadPublic tells us if
+ * the index is immutable, a successful NV_Read for such an index adds its
+ * response.
+ */
+void
+resource_manager_nv_cache_update (ResourceManager *resmgr,
+                                  Tpm2Command     *command,
+                                  Tpm2Response    *response)
+{
+    GBytes *key, *bytes;
+
+    if (resmgr->nv_cache == NULL) {
+        return;
+    }
+    nv_cache_invalidate (resmgr->nv_cache, command);
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS) {
+        return;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_NV_ReadPublic:
+        nv_cache_add_public (resmgr->nv_cache,
+                             tpm2_response_get_buffer (response),
+                             tpm2_response_get_size (response));
+        break;
+    case TPM2_CC_NV_Read:
+        key = nv_cache_key (command);
+        if (key == NULL) {
+            break;
+        }
+        bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                             tpm2_response_get_size (response));
+        nv_cache_insert (resmgr->nv_cache, key, bytes);
+        g_bytes_unref (bytes);
+        g_bytes_unref (key);
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Answer a TestParms or GetTestResult command with the response the TPM
+ * gave to an identical one since it was started.
+ * If the cache is disabled or there is no response cached for the
+ * command, NULL is returned and the command must be sent to the TPM.
+ */
+Tpm2Response*
+resource_manager_test_cache_lookup (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    GBytes *cached;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->test_cache == NULL) {
+        return NULL;
+    }
+    cached = test_cache_lookup (resmgr->test_cache, command);
+    if (cached == NULL) {
+        return NULL;
+    }
+    g_debug ("%s: answering 0x%" PRIx32 " from the cache", __func__,
+             tpm2_command_get_code (command));
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    g_bytes_unref (cached);
+    return tpm2_response_new (tpm2_command_peek_connection (command),
+                              buf,
+                              size,
+                              tpm2_command_get_attributes (command));
+}
+/*
+ * Keep the test cache in step with the commands sent to the TPM, see
+ * test_cache_update.
+ */
+void
+resource_manager_test_cache_update (ResourceManager *resmgr,
+                                    Tpm2Command     *command,
+                                    Tpm2Response    *response)
+{
+    if (resmgr->test_cache == NULL) {
+        return;
+    }
+    test_cache_update (resmgr->test_cache, command, response);
+}
+/*
+ * Answer a GetRandom command without sessions from the entropy pool. As
+ * the TPM does, no more bytes than its largest digest are returned.
+ * If the pool is disabled, the command has sessions or the pool doesn't
+ * hold enough bytes, NULL is returned and the command must be sent to the
+ * TPM.
+ */
+Tpm2Response*
+resource_manager_entropy_pool_take (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    UINT16 requested;
+    size_t offset = TPM_HEADER_SIZE, size;
+    guint8 *buf;
+    TSS2_RC rc;
+
+    if (resmgr->entropy_pool == NULL ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    rc = Tss2_MU_UINT16_Unmarshal (tpm2_command_get_buffer (command),
+                                   tpm2_command_get_size (command),
+                                   &offset,
+                                   &requested);
+    if (rc != TSS2_RC_SUCCESS ||
+        offset != tpm2_command_get_size (command))
+    {
+        return NULL;
+    }
+    requested = MIN (requested,
+                     entropy_pool_get_chunk_max (resmgr->entropy_pool));
+    if (requested == 0 ||
+        requested > entropy_pool_get_level (resmgr->entropy_pool))
+    {
+        g_debug ("%s: GetRandom not served from the pool", __func__);
+        return NULL;
+    }
+    size = TPM_HEADER_SIZE + sizeof (UINT16) + requested;
+    buf = g_malloc0 (size);
+    offset = TPM_HEADER_SIZE;
+    Tss2_MU_UINT16_Marshal (requested, buf, size, &offset);
+    entropy_pool_take (resmgr->entropy_pool, &buf [offset], requested);
+    tpm2_header_init (buf, size, TPM2_ST_NO_SESSIONS, size, TSS2_RC_SUCCESS);
+    g_debug ("%s: served %" PRIu16 " bytes, %u left in pool", __func__,
+             requested, entropy_pool_get_level (resmgr->entropy_pool));
+    return tpm2_response_new (tpm2_command_peek_connection (command),
+                              buf,
+                              size,
+                              tpm2_command_get_attributes (command));
+}
+/*
+ * Top up the entropy pool with GetRandom, one TPM sized chunk at a time.
+ * This is idle work: we stop as soon as a message is waiting in the input
+ * queue so that a new command waits for at most one GetRandom.
+ * Returns the number of bytes added.
+ */
+guint
+resource_manager_entropy_pool_fill (ResourceManager *resmgr)
+{
+    TPM2B_DIGEST random;
+    guint level, added;
+    TSS2_RC rc;
+
+    if (resmgr->entropy_pool == NULL) {
+        return 0;
+    }
+    level = entropy_pool_get_level (resmgr->entropy_pool);
+    while (entropy_pool_get_space (resmgr->entropy_pool) > 0 &&
+           message_queue_get_length (resmgr->in_queue) == 0)
+    {
+        random.size = 0;
+        rc = tpm2_get_random (resmgr->tpm2,
+                              MIN (entropy_pool_get_space (resmgr->entropy_pool),
+                                   sizeof (random.buffer)),
+                              &random);
+        if (rc != TSS2_RC_SUCCESS || random.size == 0) {
+            break;
+        }
+        entropy_pool_add (resmgr->entropy_pool, random.buffer, random.size);
+    }
+    memset (&random, 0, sizeof (random));
+    added = entropy_pool_get_level (resmgr->entropy_pool) - level;
+    if (added > 0) {
+        g_debug ("%s: added %u bytes to pool", __func__, added);
+    }
+    return added;
+}
+/*
+ * Start the StartAuthSession command from 'command' with a session from
+ * the session pool, using the response the TPM sent when the session was
+ * started. The session is handed to the connection of the command as if
+ * the TPM had just started it.
+ * If the pool is disabled, the session can't come from the pool or none
+ * is pooled, NULL is returned and the command must be sent to the TPM. In
+ * the last case the command becomes the one the pool is refilled with.
+ */
+Tpm2Response*
+resource_manager_session_pool_take (ResourceManager *resmgr,
+                                    Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    Tpm2Response *response = NULL;
+    SessionEntry *entry;
+    GBytes *key, *cached = NULL;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->session_pool == NULL) {
+        return NULL;
+    }
+    key = session_pool_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    entry = session_pool_take (resmgr->session_pool, key, &cached);
+    if (entry == NULL) {
+        g_debug ("%s: no pooled session, refilling with this command",
+                 __func__);
+        session_pool_set_template (resmgr->session_pool, key, command);
+        g_bytes_unref (key);
+        return NULL;
+    }
+    g_bytes_unref (key);
+    session_entry_set_connection (entry, connection);
+    if (!session_list_insert (resmgr->session_list, entry)) {
+        g_warning ("%s: failed to add pooled session to SessionList",
+                   __func__);
+        if (tpm2_context_flush (resmgr->tpm2,
+                                session_entry_get_handle (entry)) ==
+            TSS2_RC_SUCCESS)
+        {
+            resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
+        }
+        goto out;
+    }
+    g_debug ("%s: session 0x%08" PRIx32 " from the pool, %u left", __func__,
+             session_entry_get_handle (entry),
+             session_pool_get_level (resmgr->session_pool));
+    size = g_bytes_get_size (cached);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (cached, NULL), size);
+    response = tpm2_response_new (connection,
+                                  buf,
+                                  size,
+                                  tpm2_command_get_attributes (command));
+out:
+    g_bytes_unref (cached);
+    g_object_unref (entry);
+    return response;
+}
+/*
+ * GFunc counting loaded sessions.
+ */
+static void
+count_loaded_callback (gpointer data_entry,
+                       gpointer user_data)
+{
+    UNUSED_PARAM(data_entry);
+    ++*(guint*)user_data;
+}
+/*
+ * Start a session with the template command of the session pool and save
+ * it. The TPM's response is returned through 'response'. Returns the saved
+ * session or NULL on failure, the caller must release both references.
+ */
+static SessionEntry*
+session_pool_start (ResourceManager *resmgr,
+                    Tpm2Command     *command,
+                    GBytes         **response)
+{
+    Tpm2Response *started, *saved;
+    SessionEntry *entry = NULL;
+    TPM2_HANDLE handle;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    started = tpm2_send_command (resmgr->tpm2, command, &rc);
+    if (rc != TSS2_RC_SUCCESS || started == NULL ||
+        tpm2_response_get_code (started) != TSS2_RC_SUCCESS ||
+        !tpm2_response_has_handle (started))
+    {
+        g_warning ("%s: failed to start session for the pool", __func__);
+        goto out;
+    }
+    handle = tpm2_response_get_handle (started);
+    entry = session_entry_new (NULL, handle);
+    session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    saved = save_session (resmgr, entry);
+    if (tpm2_response_get_code (saved) != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to save pooled session 0x%08" PRIx32,
+                   __func__, handle);
+        tpm2_context_flush (resmgr->tpm2, handle);
+        g_clear_object (&entry);
+    } else {
+        *response = g_bytes_new (tpm2_response_get_buffer (started),
+                                 tpm2_response_get_size (started));
+    }
+    g_clear_object (&saved);
+out:
+    g_clear_object (&started);
+    return entry;
+}
+/*
+ * Top up the session pool with sessions started from its template command,
+ * one at a time. Pooled sessions getting close to the context gap are
+ * flushed first since re-gapping them would cost as much as starting new
+ * ones. This is idle work: we stop as soon as a message is waiting in the
+ * input queue, and we only start a session while a session slot is free.
+ * Returns the number of sessions added.
+ */
+guint
+resource_manager_session_pool_fill (ResourceManager *resmgr)
+{
+    SessionEntry *entry;
+    Tpm2Command *command;
+    GBytes *key = NULL, *response = NULL;
+    guint loaded, added = 0;
+
+    if (resmgr->session_pool == NULL) {
+        return 0;
+    }
+    while (resmgr->context_counter >= REGAP_THRESHOLD (resmgr->gap_max) &&
+           (entry = session_pool_take_stale (resmgr->session_pool,
+                                             resmgr->context_counter -
+                                             REGAP_THRESHOLD (resmgr->gap_max))) != NULL)
+    {
+        g_debug ("%s: flushing stale pooled session 0x%08" PRIx32, __func__,
+                 session_entry_get_handle (entry));
+        if (tpm2_context_flush (resmgr->tpm2,
+                                session_entry_get_handle (entry)) ==
+            TSS2_RC_SUCCESS)
+        {
+            resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_FLUSH);
+        }
+        g_object_unref (entry);
+    }
+    while (session_pool_get_space (resmgr->session_pool) > 0 &&
+           message_queue_get_length (resmgr->in_queue) == 0)
+    {
+        loaded = 0;
+        resource_manager_foreach_loaded_session (resmgr,
+                                                 count_loaded_callback,
+                                                 &loaded);
+        if (loaded >= resmgr->session_max) {
+            break;
+        }
+        command = session_pool_template_command (resmgr->session_pool, &key);
+        if (command == NULL) {
+            break;
+        }
+        entry = session_pool_start (resmgr, command, &response);
+        g_object_unref (command);
+        if (entry == NULL) {
+            g_clear_pointer (&key, g_bytes_unref);
+            break;
+        }
+        session_pool_add (resmgr->session_pool, key, entry, response);
+        g_clear_pointer (&key, g_bytes_unref);
+        g_clear_pointer (&response, g_bytes_unref);
+        g_object_unref (entry);
+        ++added;
+    }
+    if (added > 0) {
+        g_debug ("%s: added %u sessions to pool", __func__, added);
+    }
+    return added;
+}
+/*
+ * Answer a Create command with a key from the key pool, using the
+ * response the TPM sent when the key was created. The key is handed out
+ * once, the next identical Create gets another one.
+ * If the pool is disabled, the key can't come from the pool or none is
+ * pooled for the command, NULL is returned and the command must be sent
+ * to the TPM.
+ */
+Tpm2Response*
+resource_manager_key_pool_take (ResourceManager *resmgr,
+                                Tpm2Command     *command)
+{
+    GBytes *key, *cached;
+    guint8 *buf;
+    gsize size;
+
+    if (resmgr->key_pool == NULL) {
+        return NULL;
+    }
+    key = key_pool_key (command);
+    if (key == NULL) {
+        return NULL;
+    }
+    cached = key_pool_take (resmgr->key_pool, key);
+    g_bytes_unref (key);
+    if (cached == NULL) {
+        g_debug ("%s: no pooled key for this Create", __func__);
+        return NULL;
+    }
+    g_debug ("%s: key from the pool, %u left", __func__,
+             key_pool_get_level (resmgr->key_pool));
+    buf = g_bytes_unref_to_data (cached, &size);
+    return tpm2_response_new (tpm2_command_peek_connection (command),
+                              buf,
+                              size,
+                              tpm2_command_get_attributes (command));
+}
+/*
+ * Top up the key pool with keys created from its templates, one at a time.
+ * This is idle work: we stop as soon as a message is waiting in the input
+ * queue. A key may take the TPM seconds to create so a new command may
+ * wait that long, this is the price of the pool. The parents of the
+ * templates are persistent so the commands go to the TPM unchanged.
+ * Returns the number of keys added.
+ */
+guint
+resource_manager_key_pool_fill (ResourceManager *resmgr)
+{
+    Tpm2Command *command;
+    Tpm2Response *created;
+    GBytes *key = NULL, *response;
+    guint added = 0;
+    TSS2_RC rc;
+
+    if (resmgr->key_pool == NULL) {
+        return 0;
+    }
+    while (message_queue_get_length (resmgr->in_queue) == 0 &&
+           (command = key_pool_template_command (resmgr->key_pool,
+                                                 &key)) != NULL)
+    {
+        rc = TSS2_RC_SUCCESS;
+        created = tpm2_send_command (resmgr->tpm2, command, &rc);
+        g_object_unref (command);
+        if (rc != TSS2_RC_SUCCESS || created == NULL ||
+            tpm2_response_get_code (created) != TSS2_RC_SUCCESS)
+        {
+            g_debug ("%s: failed to create a key for the pool, RC: 0x%"
+                     PRIx32, __func__,
+                     created != NULL ? tpm2_response_get_code (created) : rc);
+            g_clear_object (&created);
+            g_clear_pointer (&key, g_bytes_unref);
+            break;
+        }
+        response = g_bytes_new (tpm2_response_get_buffer (created),
+                                tpm2_response_get_size (created));
+        key_pool_add (resmgr->key_pool, key, response);
+        g_bytes_unref (response);
+        g_clear_pointer (&key, g_bytes_unref);
+        g_object_unref (created);
+        ++added;
+    }
+    if (added > 0) {
+        g_debug ("%s: added %u keys to pool", __func__, added);
+    }
+    return added;
+}
+/*
+ * GHFunc counting the pinned entries in a HandleMap.
+ */
+static void
+count_pinned_callback (gpointer key,
+                       gpointer value,
+                       gpointer user_data)
+{
+    guint *count = (guint*)user_data;
+    UNUSED_PARAM (key);
+
+    if (handle_map_entry_get_pinned (HANDLE_MAP_ENTRY (value))) {
+        ++*count;
+    }
+}
+/*
+ * Pin or unpin a transient object of the connection as asked by the
+ * TSS2_TABRMD_CC_PIN vendor command. A pinned object is loaded now if it
+ * isn't resident and is then never evicted to make room for others. Each
+ * connection may pin pin_max of its objects and all connections together
+ * must leave TRANSIENTS_UNPINNED_MIN slots unpinned so that every command
+ * can still have its objects loaded. The response is always created here,
+ * the command is never sent to the TPM.
+ */
+Tpm2Response*
+resource_manager_pin_transient (ResourceManager *resmgr,
+                                Tpm2Command     *command)
+{
+    Connection     *connection = tpm2_command_peek_connection (command);
+    HandleMap      *map = connection_peek_trans_map (connection);
+    HandleMapEntry *entry = NULL;
+    TPM2_HANDLE     handle, phandle = 0;
+    TPMI_YES_NO     pin = TPM2_NO;
+    size_t          offset = TPM_HEADER_SIZE;
+    guint           count = 0, limit;
+    GList          *link;
+    TSS2_RC         rc;
+
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        rc = RM_RC (TPM2_RC_BAD_TAG);
+        goto out;
+    }
+    rc = Tss2_MU_TPM2_HANDLE_Unmarshal (tpm2_command_get_buffer (command),
+                                        tpm2_command_get_size (command),
+                                        &offset,
+                                        &handle);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT8_Unmarshal (tpm2_command_get_buffer (command),
+                                      tpm2_command_get_size (command),
+                                      &offset,
+                                      &pin);
+    }
+    if (rc != TSS2_RC_SUCCESS ||
+        offset != tpm2_command_get_size (command))
+    {
+        rc = RM_RC (TPM2_RC_COMMAND_SIZE);
+        goto out;
+    }
+    if (pin != TPM2_YES && pin != TPM2_NO) {
+        rc = RM_RC (TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_2);
+        goto out;
+    }
+    entry = handle_map_vlookup (map, handle);
+    if (entry == NULL) {
+        rc = RM_RC (TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1);
+        goto out;
+    }
+    if (pin == TPM2_NO || handle_map_entry_get_pinned (entry)) {
+        g_debug ("%s: %s vhandle 0x%" PRIx32, __func__,
+                 pin == TPM2_YES ? "pinned" : "unpinned", handle);
+        handle_map_entry_set_pinned (entry, pin == TPM2_YES);
+        goto out;
+    }
+    if (resmgr->pin_max == 0) {
+        rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+        goto out;
+    }
+    handle_map_foreach (map, count_pinned_callback, &count);
+    if (count >= resmgr->pin_max) {
+        g_info ("%s: connection has pinned %u objects already", __func__,
+                count);
+        rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+        goto out;
+    }
+    count = 0;
+    for (link = g_queue_peek_head_link (resmgr->transient_lru);
+         link != NULL;
+         link = link->next)
+    {
+        if (handle_map_entry_get_pinned (HANDLE_MAP_ENTRY (link->data))) {
+            ++count;
+        }
+    }
+    limit = resmgr->transient_max > TRANSIENTS_UNPINNED_MIN ?
+        resmgr->transient_max - TRANSIENTS_UNPINNED_MIN : 0;
+    if (count >= limit) {
+        g_info ("%s: %u objects pinned, no more slots to pin", __func__,
+                count);
+        rc = TSS2_RESMGR_RC_OBJECT_MEMORY;
+        goto out;
+    }
+    if (handle_map_entry_get_phandle (entry) == 0) {
+        resource_manager_evict_transients (resmgr, 1, NULL);
+        rc = resource_manager_load_entry (resmgr, entry, &phandle);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("%s: failed to load context: 0x%" PRIx32, __func__,
+                       rc);
+            goto out;
+        }
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_LOAD);
+        handle_map_entry_set_phandle (entry, phandle);
+    }
+    resource_manager_touch_transient (resmgr, entry);
+    handle_map_entry_set_pinned (entry, TRUE);
+    g_debug ("%s: pinned vhandle 0x%" PRIx32, __func__, handle);
+out:
+    g_clear_object (&entry);
+    return tpm2_response_new_rc (connection, rc);
+}
+/*
+ * End the group or lease running, if any. The length of a lease is added
+ * to the statistics.
+ */
+static void
+resource_manager_end_group (ResourceManager *resmgr)
+{
+    if (resmgr->lease_end != 0 && resmgr->command_stats != NULL) {
+        command_stats_add_lease (resmgr->command_stats,
+                                 g_get_monotonic_time () -
+                                 resmgr->lease_start);
+    }
+    g_clear_object (&resmgr->group_owner);
+    resmgr->group_left = 0;
+    resmgr->lease_start = 0;
+    resmgr->lease_end = 0;
+}
+/*
+ * Start a group of commands as asked by the TSS2_TABRMD_CC_GROUP vendor
+ * command: the next 'count' commands of the connection are run by
+ * resource_manager_run_group before anything from the other connections.
+ * A group started while one is running replaces it, one started under a
+ * lease changes nothing since the lease keeps the commands together
+ * already. Like the pin command it's answered here, the TPM never sees it.
+ */
+Tpm2Response*
+resource_manager_begin_group (ResourceManager *resmgr,
+                              Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    size_t      offset = TPM_HEADER_SIZE;
+    UINT32      count = 0;
+    TSS2_RC     rc;
+
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        rc = RM_RC (TPM2_RC_BAD_TAG);
+        goto out;
+    }
+    rc = Tss2_MU_UINT32_Unmarshal (tpm2_command_get_buffer (command),
+                                   tpm2_command_get_size (command),
+                                   &offset,
+                                   &count);
+    if (rc != TSS2_RC_SUCCESS ||
+        offset != tpm2_command_get_size (command))
+    {
+        rc = RM_RC (TPM2_RC_COMMAND_SIZE);
+        goto out;
+    }
+    if (count == 0 || count > TABRMD_GROUP_MAX) {
+        rc = RM_RC (TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_1);
+        goto out;
+    }
+    if (resmgr->lease_end != 0) {
+        goto out;
+    }
+    g_debug ("%s: grouping the next %" PRIu32 " commands of connection %p",
+             __func__, count, (gpointer)connection);
+    g_clear_object (&resmgr->group_owner);
+    resmgr->group_owner = g_object_ref (connection);
+    resmgr->group_left = count;
+out:
+    return tpm2_response_new_rc (connection, rc);
+}
+/*
+ * Take or give back a lease of the TPM as asked by the TSS2_TABRMD_CC_LEASE
+ * vendor command. Its UINT32 parameter is the length of the lease in
+ * milliseconds, 0 gives the lease back. While a connection holds a lease
+ * resource_manager_run_group serves it alone, its objects and sessions
+ * stay resident since no other connection's commands need the room. A
+ * lease is a group without a count: it ends when it runs out, when the
+ * client gives it back or when the connection goes away. A lease asked
+ * for while one is held extends it, but no lease lasts longer than
+ * lease_max_ms from when it started. Only the connection running the
+ * current group or lease may take, extend or give back a lease, the
+ * others get TSS2_RESMGR_RC_NOT_PERMITTED.
+ */
+Tpm2Response*
+resource_manager_lease (ResourceManager *resmgr,
+                        Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    size_t      offset = TPM_HEADER_SIZE;
+    UINT32      lease_ms = 0;
+    gint64      now;
+    TSS2_RC     rc;
+
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        rc = RM_RC (TPM2_RC_BAD_TAG);
+        goto out;
+    }
+    rc = Tss2_MU_UINT32_Unmarshal (tpm2_command_get_buffer (command),
+                                   tpm2_command_get_size (command),
+                                   &offset,
+                                   &lease_ms);
+    if (rc != TSS2_RC_SUCCESS ||
+        offset != tpm2_command_get_size (command))
+    {
+        rc = RM_RC (TPM2_RC_COMMAND_SIZE);
+        goto out;
+    }
+    if (resmgr->group_owner != NULL && resmgr->group_owner != connection) {
+        g_debug ("%s: connection %p doesn't hold the TPM", __func__,
+                 (gpointer)connection);
+        rc = TSS2_RESMGR_RC_NOT_PERMITTED;
+        goto out;
+    }
+    if (lease_ms == 0) {
+        if (resmgr->lease_end != 0) {
+            g_debug ("%s: connection %p gave its lease back", __func__,
+                     (gpointer)connection);
+            resource_manager_end_group (resmgr);
+        }
+        goto out;
+    }
+    if (resmgr->lease_max_ms == 0) {
+        g_debug ("%s: leases are disabled", __func__);
+        rc = RM_RC (TPM2_RC_DISABLED);
+        goto out;
+    }
+    now = g_get_monotonic_time ();
+    if (resmgr->lease_end == 0) {
+        g_clear_object (&resmgr->group_owner);
+        resmgr->group_owner = g_object_ref (connection);
+        resmgr->group_left = 0;
+        resmgr->lease_start = now;
+        if (resmgr->command_stats != NULL) {
+            command_stats_count (resmgr->command_stats, COMMAND_STATS_LEASE);
+        }
+        connection_count (connection, COMMAND_STATS_LEASE);
+    }
+    resmgr->lease_end = MIN (now + (gint64)lease_ms * G_TIME_SPAN_MILLISECOND,
+                             resmgr->lease_start +
+                             (gint64)resmgr->lease_max_ms *
+                             G_TIME_SPAN_MILLISECOND);
+    g_debug ("%s: connection %p holds the TPM for %" G_GINT64_FORMAT "ms",
+             __func__, (gpointer)connection,
+             (resmgr->lease_end - now) / G_TIME_SPAN_MILLISECOND);
+out:
+    return tpm2_response_new_rc (connection, rc);
+}
+G_STATIC_ASSERT (TPM_HEADER_SIZE + sizeof (TPMI_ALG_HASH) +
+                 sizeof (TPMI_RH_HIERARCHY) + sizeof (UINT32) +
+                 TSS2_TABRMD_HASH_MAX == UTIL_BUF_MAX);
+/*
+ * Hash the data of the TSS2_TABRMD_CC_HASH vendor command with a hash
+ * sequence, see tpm2_hash_sequence. That saves the client a round trip
+ * for each chunk of TPM2_PT_INPUT_BUFFER bytes and the context swaps that
+ * come with having other connections' commands between them. The
+ * response has the parameters of a TPM2_Hash response.
+ */
+Tpm2Response*
+resource_manager_hash (ResourceManager *resmgr,
+                       Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    guint8 *buf = tpm2_command_get_buffer (command), *response_buf;
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = TPM_HEADER_SIZE, response_size;
+    TPMI_ALG_HASH hash_alg = TPM2_ALG_NULL;
+    TPMI_RH_HIERARCHY hierarchy = TPM2_RH_NULL;
+    UINT32 data_size = 0;
+    TPM2B_DIGEST digest = { 0, };
+    TPMT_TK_HASHCHECK validation = { 0, };
+    TSS2_RC rc;
+
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_BAD_TAG));
+    }
+    rc = Tss2_MU_UINT16_Unmarshal (buf, size, &offset, &hash_alg);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &hierarchy);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &data_size);
+    }
+    if (rc != TSS2_RC_SUCCESS || data_size != size - offset) {
+        return tpm2_response_new_rc (connection,
+                                     RM_RC (TPM2_RC_COMMAND_SIZE));
+    }
+    g_debug ("%s: hashing %" PRIu32 " bytes with alg 0x%" PRIx16,
+             __func__, data_size, hash_alg);
+    /* the sequence object takes a slot */
+    resource_manager_evict_transients (resmgr, 1, NULL);
+    tpm2_set_executing (resmgr->tpm2, connection);
+    rc = tpm2_hash_sequence (resmgr->tpm2,
+                             hash_alg,
+                             hierarchy,
+                             &buf [offset],
+                             data_size,
+                             &digest,
+                             &validation);
+    tpm2_set_executing (resmgr->tpm2, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        return tpm2_response_new_rc (connection, rc);
+    }
+    response_size = TPM_HEADER_SIZE + sizeof (digest) + sizeof (validation);
+    response_buf = g_malloc0 (response_size);
+    offset = TPM_HEADER_SIZE;
+    rc = Tss2_MU_TPM2B_DIGEST_Marshal (&digest,
+                                       response_buf,
+                                       response_size,
+                                       &offset);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPMT_TK_HASHCHECK_Marshal (&validation,
+                                                response_buf,
+                                                response_size,
+                                                &offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_header_init (response_buf,
+                               response_size,
+                               TPM2_ST_NO_SESSIONS,
+                               offset,
+                               TSS2_RC_SUCCESS);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (response_buf);
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_FAILURE));
+    }
+    return tpm2_response_new (connection,
+                              response_buf,
+                              offset,
+                              tpm2_command_get_attributes (command));
+}
+G_STATIC_ASSERT (TPM_HEADER_SIZE + sizeof (TPMI_RH_NV_AUTH) +
+                 sizeof (TPMI_RH_NV_INDEX) + sizeof (TPM2B_AUTH) +
+                 2 * sizeof (UINT16) + TSS2_TABRMD_NV_MAX == UTIL_BUF_MAX);
+/*
+ * Read or write NV as asked by the TSS2_TABRMD_CC_NV_READ and
+ * TSS2_TABRMD_CC_NV_WRITE vendor commands, see tpm2_nv_read and
+ * tpm2_nv_write. Like resource_manager_hash this saves the client a round
+ * trip for each TPM2_PT_NV_BUFFER_MAX bytes and keeps other connections'
+ * commands from getting between the chunks. NV indices aren't virtualized
+ * so the handles go to the TPM as they are.
+ */
+Tpm2Response*
+resource_manager_nv (ResourceManager *resmgr,
+                     Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    guint8 *buf = tpm2_command_get_buffer (command), *response_buf = NULL;
+    size_t size = tpm2_command_get_size (command);
+    size_t offset = TPM_HEADER_SIZE, response_size;
+    gboolean write = tpm2_command_get_code (command) ==
+        TSS2_TABRMD_CC_NV_WRITE;
+    TPMI_RH_NV_AUTH auth_handle = 0;
+    TPMI_RH_NV_INDEX nv_index = 0;
+    TPM2B_AUTH auth = { 0, };
+    UINT16 nv_offset = 0, data_size = 0;
+    TSS2_RC rc;
+
+    if (tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS) {
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_BAD_TAG));
+    }
+    rc = Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &auth_handle);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Unmarshal (buf, size, &offset, &nv_index);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_AUTH_Unmarshal (buf, size, &offset, &auth);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Unmarshal (buf, size, &offset, &nv_offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Unmarshal (buf, size, &offset, &data_size);
+    }
+    if (rc != TSS2_RC_SUCCESS ||
+        size - offset != (write ? data_size : 0) ||
+        data_size > TSS2_TABRMD_NV_MAX)
+    {
+        return tpm2_response_new_rc (connection,
+                                     RM_RC (TPM2_RC_COMMAND_SIZE));
+    }
+    g_debug ("%s: %s %" PRIu16 " bytes at %" PRIu16 " of NV index 0x%"
+             PRIx32, __func__, write ? "writing" : "reading", data_size,
+             nv_offset, nv_index);
+    tpm2_set_executing (resmgr->tpm2, connection);
+    if (write) {
+        rc = tpm2_nv_write (resmgr->tpm2,
+                            auth_handle,
+                            nv_index,
+                            &auth,
+                            nv_offset,
+                            data_size,
+                            &buf [offset]);
+    } else {
+        response_size = TPM_HEADER_SIZE + sizeof (UINT16) + data_size;
+        response_buf = g_malloc0 (response_size);
+        rc = tpm2_nv_read (resmgr->tpm2,
+                           auth_handle,
+                           nv_index,
+                           &auth,
+                           nv_offset,
+                           data_size,
+                           &response_buf [TPM_HEADER_SIZE + sizeof (UINT16)]);
+    }
+    tpm2_set_executing (resmgr->tpm2, NULL);
+    if (rc != TSS2_RC_SUCCESS || write) {
+        g_free (response_buf);
+        return tpm2_response_new_rc (connection, rc);
+    }
+    offset = TPM_HEADER_SIZE;
+    rc = Tss2_MU_UINT16_Marshal (data_size,
+                                 response_buf,
+                                 response_size,
+                                 &offset);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_header_init (response_buf,
+                               response_size,
+                               TPM2_ST_NO_SESSIONS,
+                               response_size,
+                               TSS2_RC_SUCCESS);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (response_buf);
+        return tpm2_response_new_rc (connection, RM_RC (TPM2_RC_FAILURE));
+    }
+    return tpm2_response_new (connection,
+                              response_buf,
+                              response_size,
+                              tpm2_command_get_attributes (command));
+}
+/*
+ * If the provided command is something that the ResourceManager "virtualizes"
+ * then this function will do so and return a Tpm2Response object that will be
+ * returned to the same connection. If the command isn't something that we
+ * virtualize then we just return NULL.
+ *
+ * NOTE: Both the ContextSave and ContextLoad commands, when sent by clients,
+ * do not result in the command being executed by the TPM. This makes
+ * handling the context gap unnecessary for these commands.
+ */
+Tpm2Response*
+command_special_processing (ResourceManager *resmgr,
+                            Tpm2Command     *command)
+{
+    Tpm2Response *response   = NULL;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_FlushContext:
+        g_debug ("processing TPM2_CC_FlushContext");
+        response = resource_manager_flush_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextSave:
+        g_debug ("processing TPM2_CC_ContextSave");
+        response = resource_manager_save_context (resmgr, command);
+        break;
+    case TPM2_CC_ContextLoad:
+        g_debug ("%s: processing TPM2_CC_ContextLoad", __func__);
+        response = resource_manager_load_context (resmgr, command);
+        break;
+    case TPM2_CC_GetCapability:
+        if (!tpm2_command_has_auths(command)) {
+            g_debug ("processing TPM2_CC_GetCapability");
+            response = get_cap_gen_response (resmgr, command);
+        }
+        break;
+    case TPM2_CC_ReadPublic:
+        g_debug ("%s: processing TPM2_CC_ReadPublic", __func__);
+        response = resource_manager_read_public (resmgr, command);
+        break;
+    case TPM2_CC_PCR_Read:
+        response = resource_manager_pcr_cache_lookup (resmgr, command);
+        break;
+    case TPM2_CC_NV_Read:
+        response = resource_manager_nv_cache_lookup (resmgr, command);
+        break;
+    case TPM2_CC_TestParms:
+    case TPM2_CC_GetTestResult:
+        response = resource_manager_test_cache_lookup (resmgr, command);
+        break;
+    case TPM2_CC_GetRandom:
+        response = resource_manager_entropy_pool_take (resmgr, command);
+        break;
+    case TPM2_CC_Load:
+        response = resource_manager_object_share_load (resmgr, command);
+        break;
+    case TPM2_CC_StartAuthSession:
+        response = resource_manager_session_pool_take (resmgr, command);
+        break;
+    case TPM2_CC_Create:
+        response = resource_manager_key_pool_take (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_PIN:
+        g_debug ("%s: processing TSS2_TABRMD_CC_PIN", __func__);
+        response = resource_manager_pin_transient (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_GROUP:
+        g_debug ("%s: processing TSS2_TABRMD_CC_GROUP", __func__);
+        response = resource_manager_begin_group (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_LEASE:
+        g_debug ("%s: processing TSS2_TABRMD_CC_LEASE", __func__);
+        response = resource_manager_lease (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_HASH:
+        g_debug ("%s: processing TSS2_TABRMD_CC_HASH", __func__);
+        response = resource_manager_hash (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_NV_READ:
+    case TSS2_TABRMD_CC_NV_WRITE:
+        g_debug ("%s: processing TSS2_TABRMD_CC_NV_READ/WRITE", __func__);
+        response = resource_manager_nv (resmgr, command);
+        break;
+    default:
+        break;
+    }
+
+    return response;
+}
+/*
+ * This function creates a mapping from the transient physical to a virtual
+ * handle in the provided response object. This mapping is then added to
+ * the transient HandleMap for the associated connection, as well as the
+ * list of currently loaded transient objects.
+ */
+void
+create_context_mapping_transient (ResourceManager  *resmgr,
+                                  Tpm2Response     *response,
+                                  GSList          **loaded_transient_slist)
+{
+    Connection     *connection = tpm2_response_peek_connection (response);
+    HandleMap      *handle_map;
+    HandleMapEntry *handle_entry;
+    TPM2_HANDLE      phandle, vhandle;
+
+    g_debug ("create_context_mapping_transient");
+    phandle = tpm2_response_get_handle (response);
+    g_debug ("  physical handle: 0x%08" PRIx32, phandle);
+    handle_map = connection_peek_trans_map (connection);
+    vhandle = handle_map_next_vhandle (handle_map);
+    if (vhandle == 0) {
+        g_error ("vhandle rolled over!");
+    }
+    g_debug ("  vhandle:0x%08" PRIx32, vhandle);
+    handle_entry = handle_map_entry_new (phandle, vhandle);
+    if (handle_entry == NULL) {
+        g_warning ("failed to create new HandleMapEntry for handle 0x%"
+                   PRIx32, phandle);
+    }
+    handle_map_entry_set_context_store (handle_entry, resmgr->context_store);
+    handle_map_entry_set_context_arena (handle_entry,
+                                        connection_peek_arena (connection));
+    handle_map_entry_set_epoch (handle_entry, resmgr->reset_epoch);
+    *loaded_transient_slist = g_slist_prepend (*loaded_transient_slist,
+                                               handle_entry);
+    handle_map_insert (handle_map, vhandle, handle_entry);
+    resource_manager_touch_transient (resmgr, handle_entry);
+    tpm2_response_set_handle (response, vhandle);
+}
+/*
+ * This function after a Tpm2Command is sent to the TPM and:
+ * - we receive a Tpm2Response object with a handle in the response buffers
+ *   handle area
+ * - the handle is a session handle
+ * Since there's a handle in the response handle area the caller is being
+ * returned a new handle after a context was successfully created or loaded.
+ * So we know that the response is to one of two possible commands:
+ * - a session being loaded by a call to LoadContext
+ * - a session was newly created by a call to StartAuthSession
+ * We differentiate between these two situations as follows:
+ * - A call to 'LoadContext' implies that the session already exists and so
+ *   it must already be in the session_list.
+ *   - If it's in the session_list *AND NOT* in the abandoned_session_queue
  *     then the caller is just loading a context they already own and so we
  *     set the session state to SAVED_RM and add the session to the list of
  *     loaded sessions.
@@ -1200,239 +4345,1783 @@ create_context_mapping_transient (ResourceManager  *resmgr,
  * NOTE: If the response doesn't indicate 'success' then we just ignore it
  * since there's nothing useful that we can do.
  */
-void
-create_context_mapping_session (ResourceManager *resmgr,
-                                Tpm2Response    *response,
-                                TPM2_HANDLE      handle)
+void
+create_context_mapping_session (ResourceManager *resmgr,
+                                Tpm2Response    *response,
+                                TPM2_HANDLE      handle)
+{
+    SessionEntry *entry = NULL;
+    Connection   *conn_resp = NULL, *conn_entry = NULL;
+
+    entry = session_list_lookup_handle (resmgr->session_list, handle);
+    conn_resp = tpm2_response_peek_connection (response);
+    if (entry != NULL) {
+        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
+        conn_entry = session_entry_get_connection (entry);
+        if (conn_resp != conn_entry) {
+            g_warning ("%s: connections do not match!", __func__);
+        }
+    } else {
+        g_debug ("%s: handle is a session, creating entry for SessionList "
+                 "and SessionList", __func__);
+        entry = session_entry_new (conn_resp, handle);
+        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+        if (session_list_insert (resmgr->session_list, entry)) {
+            resource_manager_note_loaded_session (resmgr, entry);
+        }
+    }
+    g_clear_object (&conn_entry);
+    g_clear_object (&entry);
+}
+/*
+ * Each Tpm2Response object can have at most one handle in it.
+ * This function assumes that the handle in the parameter Tpm2Response
+ * object is the handle assigned by the TPM. Depending on the type of the
+ * handle we do to possible things:
+ * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
+ * allocates a new HandleMapEntry to map the virtual handle to a
+ * TPMS_CONTEXT structure when processing future commands associated
+ * with the same connection. This HandleMapEntry is inserted into the
+ * handle map for the connection. It is also added to the list of loaded
+ * transient objects so that it can be saved / flushed by the typical code
+ * path.
+ * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
+ * new session_entry_t object, populate the connection field with the
+ * connection associated with the response object, and set the savedHandle
+ * field. We then add this entry to the list of sessions we're tracking
+ * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ */
+void
+resource_manager_create_context_mapping (ResourceManager  *resmgr,
+                                         Tpm2Response     *response,
+                                         GSList          **loaded_transient_slist)
+{
+    TPM2_HANDLE       handle;
+
+    g_debug ("%s", __func__);
+    if (!tpm2_response_has_handle (response)) {
+        g_debug ("response has no handles");
+        return;
+    }
+    handle = tpm2_response_get_handle (response);
+    switch (handle >> TPM2_HR_SHIFT) {
+    case TPM2_HT_TRANSIENT:
+        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+        break;
+    case TPM2_HT_HMAC_SESSION:
+    case TPM2_HT_POLICY_SESSION:
+        create_context_mapping_session (resmgr, response, handle);
+        break;
+    default:
+        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
+        break;
+    }
+}
+/*
+ * Returns TRUE for the response codes telling us to send the command again
+ * as is: the TPM was busy, is testing itself or has put the command aside.
+ */
+static gboolean
+rc_is_retry (TSS2_RC rc)
+{
+    switch (rc) {
+    case TPM2_RC_RETRY:
+    case TPM2_RC_YIELDED:
+    case TPM2_RC_TESTING:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+/*
+ * Send the command, regapping the sessions and sending it again if the TPM
+ * hits the context gap. Commands the TPM asks us to retry are sent again
+ * with a growing delay in between, the objects and sessions they use stay
+ * loaded meanwhile. The client only gets the retry code once we give up,
+ * or right away if it has gone away.
+ */
+Tpm2Response*
+send_command_handle_rc (ResourceManager *resmgr,
+                        Tpm2Command *cmd)
+{
+    regap_session_data_t data = {
+        .resmgr = resmgr,
+        .ret = TRUE,
+    };
+    Tpm2Response *resp = NULL;
+    Connection *connection = tpm2_command_peek_connection (cmd);
+    gulong delay = RESOURCE_MANAGER_RETRY_DELAY_FIRST_US;
+    guint retries;
+    TSS2_RC rc;
+
+    /* Send command and create response object. */
+    resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+    rc = tpm2_response_get_code (resp);
+    /*
+     * The TPM was reset and nobody started it since. Once it's started
+     * commands that don't use objects or sessions from before can go
+     * again.
+     */
+    if (rc == TPM2_RC_INITIALIZE &&
+        tpm2_command_get_code (cmd) != TPM2_CC_Startup &&
+        resource_manager_check_reset (resmgr) &&
+        tpm2_command_get_handle_count (cmd) == 0 &&
+        !tpm2_command_has_session_auths (cmd))
+    {
+        g_debug ("%s: TPM started again, resending", __func__);
+        g_clear_object (&resp);
+        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+        rc = tpm2_response_get_code (resp);
+    }
+    if (rc == TPM2_RC_CONTEXT_GAP) {
+        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
+        session_list_foreach (resmgr->session_list,
+                              regap_session_callback,
+                              &data);
+        g_clear_object (&resp);
+        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+        rc = tpm2_response_get_code (resp);
+    }
+    for (retries = 0;
+         retries < RESOURCE_MANAGER_RETRY_MAX && rc_is_retry (rc) &&
+         (connection == NULL || !connection_is_closed (connection));
+         ++retries)
+    {
+        g_debug ("%s: RC 0x%" PRIx32 ", retrying in %lu us", __func__,
+                 rc, delay);
+        g_usleep (delay);
+        delay = MIN (delay * 2, RESOURCE_MANAGER_RETRY_DELAY_MAX_US);
+        g_clear_object (&resp);
+        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+        rc = tpm2_response_get_code (resp);
+    }
+    if (rc_is_retry (rc)) {
+        g_info ("%s: RC 0x%" PRIx32 " after %u retries, giving up",
+                __func__, rc, retries);
+    }
+    return resp;
+}
+/*
+ * Account for a command in the usage of its connection, 'times' are the
+ * ones collected for the latency histograms.
+ */
+static void
+resource_manager_note_usage (ResourceManager *resmgr,
+                             Connection      *connection,
+                             Tpm2Command     *command,
+                             size_t           response_size,
+                             gint64 const    *times,
+                             gboolean         passthrough)
+{
+    gint64 exec_us = 0;
+
+    if (connection == NULL) {
+        return;
+    }
+    if (times [COMMAND_STATS_EXEC] != 0 && times [COMMAND_STATS_SAVE] != 0) {
+        exec_us = times [COMMAND_STATS_SAVE] - times [COMMAND_STATS_EXEC];
+    }
+    connection_note_command (connection,
+                             tpm2_command_get_size (command),
+                             response_size,
+                             exec_us);
+    if (resmgr->uid_weights != NULL) {
+        message_queue_charge (resmgr->in_queue,
+                              G_OBJECT (command),
+                              (guint64)MAX (exec_us, 0));
+    }
+    /* it can't have changed the objects and sessions of the connection */
+    if (passthrough) {
+        return;
+    }
+    connection_set_resources (connection,
+                              handle_map_size (connection_peek_trans_map (connection)),
+                              session_list_connection_count (resmgr->session_list,
+                                                             connection));
+}
+/*
+ * Fill in what the FlightRecorder keeps about a command before we
+ * process it: the handles are virtualized on the way to the TPM.
+ */
+static void
+resource_manager_record_start (flight_record_t *record,
+                               Connection      *connection,
+                               Tpm2Command     *command)
+{
+    guint8 i;
+
+    record->time = g_get_real_time ();
+    record->connection = connection != NULL ?
+        connection_get_serial (connection) : 0;
+    record->command_code = tpm2_command_get_code (command);
+    record->handle_count = MIN (tpm2_command_get_handle_count (command),
+                                FLIGHT_RECORDER_HANDLES);
+    for (i = 0; i < record->handle_count; ++i) {
+        record->handles [i] = tpm2_command_get_handle (command, i);
+    }
+}
+/*
+ * Phases that don't have both ends were skipped, they're recorded as 0.
+ */
+static void
+resource_manager_record_times (flight_record_t *record,
+                               gint64 const    *times)
+{
+    guint phase;
+
+    for (phase = COMMAND_STATS_QUEUE; phase < COMMAND_STATS_WRITE; ++phase) {
+        if (times [phase] != 0 && times [phase + 1] != 0) {
+            record->phase_us [phase] =
+                (guint32)MIN (MAX (times [phase + 1] - times [phase], 0),
+                              G_MAXUINT32);
+        }
+    }
+}
+/*
+ * Add a span for each phase the command went through to the trace. The
+ * WRITE phase is traced by the ResponseSink.
+ */
+static void
+resource_manager_trace_times (ResourceManager *resmgr,
+                              Connection      *connection,
+                              Tpm2Command     *command,
+                              gint64 const    *times)
+{
+    static const TraceEvent events [COMMAND_STATS_WRITE] = {
+        [COMMAND_STATS_QUEUE] = TRACE_QUEUE,
+        [COMMAND_STATS_LOAD]  = TRACE_LOAD,
+        [COMMAND_STATS_EXEC]  = TRACE_EXEC,
+        [COMMAND_STATS_SAVE]  = TRACE_SAVE,
+    };
+    guint phase, serial = connection != NULL ?
+        connection_get_serial (connection) : 0;
+
+    for (phase = COMMAND_STATS_QUEUE; phase < COMMAND_STATS_WRITE; ++phase) {
+        if (times [phase + 1] != 0) {
+            trace_buffer_add (resmgr->trace_buffer,
+                              events [phase],
+                              times [phase],
+                              times [phase + 1],
+                              serial,
+                              tpm2_command_get_code (command));
+        }
+    }
+}
+/*
+ * Log a command that took longer than slow_command_ms through the daemon
+ * or in the TPM, with where its time went. 'times' are the ones collected
+ * for the latency histograms.
+ */
+static void
+resource_manager_note_slow (ResourceManager *resmgr,
+                            Connection      *connection,
+                            Tpm2Command     *command,
+                            TSS2_RC          rc,
+                            gint64 const    *times)
+{
+    gint64 phase_us [COMMAND_STATS_WRITE] = { 0, };
+    gint64 total_us = 0, limit_us;
+    guint phase;
+
+    limit_us = (gint64)resmgr->slow_command_ms * 1000;
+    for (phase = COMMAND_STATS_QUEUE; phase < COMMAND_STATS_WRITE; ++phase) {
+        if (times [phase] != 0 && times [phase + 1] != 0) {
+            phase_us [phase] = times [phase + 1] - times [phase];
+        }
+    }
+    if (times [COMMAND_STATS_QUEUE] != 0 && times [COMMAND_STATS_WRITE] != 0) {
+        total_us = times [COMMAND_STATS_WRITE] - times [COMMAND_STATS_QUEUE];
+    }
+    if (total_us <= limit_us && phase_us [COMMAND_STATS_EXEC] <= limit_us) {
+        return;
+    }
+    g_warning ("slow command 0x%08" PRIx32 " from connection %u pid %" PRIu32
+               ": %" PRId64 "us total, queue %" PRId64 "us load %" PRId64
+               "us exec %" PRId64 "us save %" PRId64 "us, %u context "
+               "swaps, rc 0x%08" PRIx32,
+               tpm2_command_get_code (command),
+               connection != NULL ? connection_get_serial (connection) : 0,
+               connection != NULL ? connection_get_pid (connection) : 0,
+               total_us,
+               phase_us [COMMAND_STATS_QUEUE],
+               phase_us [COMMAND_STATS_LOAD],
+               phase_us [COMMAND_STATS_EXEC],
+               phase_us [COMMAND_STATS_SAVE],
+               resmgr->processing_swaps,
+               rc);
+}
+/*
+ * Publish our counters and gauges, and the usage of 'connection', in the
+ * statistics segment after processing a command. 'times' are the ones
+ * collected for the latency histograms. A record another writer holds is
+ * skipped: it holds totals, so the next command puts it right.
+ */
+G_STATIC_ASSERT (STATS_SEGMENT_BUCKETS == COMMAND_STATS_BUCKETS);
+static void
+resource_manager_publish_stats (ResourceManager *resmgr,
+                                Connection      *connection,
+                                gint64 const    *times)
+{
+    stats_segment_backend_t *backend;
+    stats_segment_connection_t *slot;
+    connection_usage_t usage = { 0, };
+    gint64 exec_us = 0;
+
+    backend = &resmgr->stats_segment->backend [resmgr->stats_backend];
+    if (times [COMMAND_STATS_EXEC] != 0 && times [COMMAND_STATS_SAVE] != 0) {
+        exec_us = times [COMMAND_STATS_SAVE] - times [COMMAND_STATS_EXEC];
+    }
+    if (stats_segment_write_begin (&backend->seq)) {
+        backend->in_use = 1;
+        ++backend->commands;
+        backend->exec_us += (guint64)MAX (exec_us, 0);
+        if (times [COMMAND_STATS_QUEUE] != 0) {
+            stats_segment_latency_add (backend,
+                                       times [COMMAND_STATS_WRITE] -
+                                       times [COMMAND_STATS_QUEUE]);
+        }
+        backend->context_loads =
+            resmgr->stats_swaps [COMMAND_STATS_CONTEXT_LOAD];
+        backend->context_saves =
+            resmgr->stats_swaps [COMMAND_STATS_CONTEXT_SAVE];
+        backend->context_flushes =
+            resmgr->stats_swaps [COMMAND_STATS_CONTEXT_FLUSH];
+        backend->queued = message_queue_get_length (resmgr->in_queue);
+        backend->flushes_queued = resmgr->flush_queue->len;
+        backend->resident = g_queue_get_length (resmgr->transient_lru);
+        backend->sessions = session_list_size (resmgr->session_list);
+        stats_segment_write_end (&backend->seq);
+    }
+    if (connection == NULL) {
+        return;
+    }
+    connection_get_usage (connection, &usage);
+    slot = stats_segment_connection (resmgr->stats_segment, usage.serial);
+    if (!stats_segment_write_begin (&slot->seq)) {
+        return;
+    }
+    slot->serial = usage.serial;
+    slot->backend = resmgr->stats_backend;
+    slot->pid = usage.pid;
+    slot->uid = connection_get_uid (connection);
+    slot->transients = usage.transients;
+    slot->sessions = usage.sessions;
+    slot->commands = usage.commands;
+    slot->bytes_in = usage.bytes_in;
+    slot->bytes_out = usage.bytes_out;
+    slot->exec_us = usage.exec_us;
+    slot->context_loads = connection_get_count (connection,
+                                                COMMAND_STATS_CONTEXT_LOAD);
+    slot->context_saves = connection_get_count (connection,
+                                                COMMAND_STATS_CONTEXT_SAVE);
+    stats_segment_write_end (&slot->seq);
+}
+/*
+ * Free the slot of a removed connection in the statistics segment, unless
+ * another connection took it over since.
+ */
+static void
+resource_manager_unpublish_connection (ResourceManager *resmgr,
+                                       Connection      *connection)
+{
+    stats_segment_connection_t *slot;
+    guint serial = connection_get_serial (connection);
+
+    slot = stats_segment_connection (resmgr->stats_segment, serial);
+    if (slot->serial != serial || !stats_segment_write_begin (&slot->seq)) {
+        return;
+    }
+    memset ((guint8*)slot + sizeof (slot->seq),
+            0,
+            sizeof (*slot) - sizeof (slot->seq));
+    stats_segment_write_end (&slot->seq);
+}
+/*
+ * Get the Tpm2 'connection' has on the kernel resource manager, opening a
+ * TCTI on the device the first time. The kernel keeps the objects and
+ * sessions of each open file apart and swaps them for us. Returns NULL if
+ * the device can't be opened.
+ */
+static Tpm2*
+resource_manager_kernel_tpm2 (ResourceManager *resmgr,
+                              Connection      *connection)
+{
+    Tpm2 *tpm2;
+    Tcti *tcti;
+    gchar *conf;
+
+    tpm2 = g_hash_table_lookup (resmgr->kernel_tpms, connection);
+    if (tpm2 != NULL) {
+        return tpm2;
+    }
+    conf = g_strdup_printf ("device:%s", resmgr->kernel_rm);
+    tcti = tcti_new_from_conf (conf);
+    g_free (conf);
+    if (tcti == NULL) {
+        g_warning ("%s: failed to open %s for connection %u", __func__,
+                   resmgr->kernel_rm, connection_get_serial (connection));
+        return NULL;
+    }
+    tpm2 = tpm2_new (tcti);
+    g_object_unref (tcti);
+    tpm2_set_timeout_scale (tpm2,
+                            g_atomic_int_get (&resmgr->tpm2->timeout_scale));
+    g_mutex_lock (&resmgr->kernel_tpms_mutex);
+    g_hash_table_insert (resmgr->kernel_tpms, g_object_ref (connection), tpm2);
+    g_mutex_unlock (&resmgr->kernel_tpms_mutex);
+    g_debug ("%s: opened %s for connection %u", __func__, resmgr->kernel_rm,
+             connection_get_serial (connection));
+    return tpm2;
+}
+/*
+ * Process a command from a connection on the kernel resource manager. The
+ * handles and sessions go to the kernel as they are, only the scheduling
+ * vendor commands and the caches that don't depend on what a connection
+ * has loaded are left to us. Pinning needs our virtual handles.
+ */
+static Tpm2Response*
+resource_manager_kernel_process (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    Tpm2Response *response = NULL;
+    Tpm2 *tpm2;
+    TSS2_RC rc;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_PCR_Read:
+    case TPM2_CC_NV_Read:
+    case TPM2_CC_GetRandom:
+    case TSS2_TABRMD_CC_GROUP:
+    case TSS2_TABRMD_CC_LEASE:
+    case TSS2_TABRMD_CC_HASH:
+    case TSS2_TABRMD_CC_NV_READ:
+    case TSS2_TABRMD_CC_NV_WRITE:
+        response = command_special_processing (resmgr, command);
+        break;
+    case TSS2_TABRMD_CC_PIN:
+        response = tpm2_response_new_rc (connection,
+                                         TSS2_RESMGR_RC_NOT_IMPLEMENTED);
+        break;
+    default:
+        break;
+    }
+    if (response != NULL) {
+        return response;
+    }
+    tpm2 = resource_manager_kernel_tpm2 (resmgr, connection);
+    if (tpm2 == NULL) {
+        return tpm2_response_new_rc (connection,
+                                     TSS2_RESMGR_RC_GENERAL_FAILURE);
+    }
+    response = tpm2_send_command (tpm2, command, &rc);
+    resource_manager_pcr_cache_update (resmgr, command, response);
+    resource_manager_nv_cache_update (resmgr, command, response);
+    resource_manager_test_cache_update (resmgr, command, response);
+    return response;
+}
+/*
+ * Whether 'command' can skip the quota checks, the virtualization and the
+ * session bookkeeping and go straight to the TPM: the CommandAttrs found
+ * it has no handles, it has no sessions, and it isn't one of the commands
+ * the caches in use answer.
+ */
+static gboolean
+resource_manager_is_passthrough (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    if (!tpm2_command_is_passthrough (command) ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return FALSE;
+    }
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_GetRandom:
+        return resmgr->entropy_pool == NULL;
+    case TPM2_CC_PCR_Read:
+        return resmgr->pcr_cache == NULL;
+    case TPM2_CC_TestParms:
+    case TPM2_CC_GetTestResult:
+        return resmgr->test_cache == NULL;
+    default:
+        return TRUE;
+    }
+}
+typedef struct {
+    HandleMapEntry *backing;
+    gboolean        found;
+} promoted_share_data_t;
+/*
+ * GHFunc looking for an entry of a HandleMap that shares the backing
+ * entry in the promoted_share_data_t.
+ */
+static void
+promoted_share_callback (gpointer key,
+                         gpointer value,
+                         gpointer user_data)
+{
+    promoted_share_data_t *data = (promoted_share_data_t*)user_data;
+    UNUSED_PARAM (key);
+
+    if (handle_map_entry_get_backing (HANDLE_MAP_ENTRY (value)) ==
+        data->backing)
+    {
+        data->found = TRUE;
+    }
+}
+/*
+ * TRUE if 'connection' holds a share of the object promoted to the
+ * persistent handle 'handle'.
+ */
+static gboolean
+resource_manager_holds_promoted (ResourceManager *resmgr,
+                                 Connection      *connection,
+                                 TPM2_HANDLE      handle)
+{
+    promoted_share_data_t data = {
+        .backing = resmgr->promoted [handle - RESOURCE_MANAGER_PROMOTE_BASE],
+        .found = FALSE,
+    };
+
+    if (data.backing == NULL) {
+        return FALSE;
+    }
+    handle_map_foreach (connection_peek_trans_map (connection),
+                        promoted_share_callback,
+                        &data);
+    return data.found;
+}
+/*
+ * The persistent handles of promoted objects belong to the connections
+ * sharing them, they use them through their vhandles. Refuse a command
+ * from any other connection that names one in its handle area, or as the
+ * persistentHandle of EvictControl.
+ */
+TSS2_RC
+resource_manager_promoted_check (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    Connection *connection = tpm2_command_peek_connection (command);
+    TPM2_HANDLE handle;
+    size_t offset;
+    guint8 i;
+
+    for (i = 0; i < tpm2_command_get_handle_count (command); ++i) {
+        handle = tpm2_command_get_handle (command, i);
+        if (handle_is_promoted (handle) &&
+            !resource_manager_holds_promoted (resmgr, connection, handle))
+        {
+            g_info ("%s: connection %p doesn't share promoted object 0x%"
+                    PRIx32, __func__, (gpointer)connection, handle);
+            return RM_RC (TPM2_RC_HANDLE + TPM2_RC_H + TPM2_RC_1 * (i + 1));
+        }
+    }
+    if (tpm2_command_get_code (command) != TPM2_CC_EvictControl) {
+        return TSS2_RC_SUCCESS;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    if (offset == 0 ||
+        Tss2_MU_TPM2_HANDLE_Unmarshal (tpm2_command_get_buffer (command),
+                                       tpm2_command_get_size (command),
+                                       &offset,
+                                       &handle) != TSS2_RC_SUCCESS)
+    {
+        return TSS2_RC_SUCCESS;
+    }
+    if (handle_is_promoted (handle)) {
+        g_info ("%s: connection %p can't evict to promoted handle 0x%"
+                PRIx32, __func__, (gpointer)connection, handle);
+        return RM_RC (TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_1);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+/**
+ * This function is invoked in response to the receipt of a Tpm2Command.
+ * This is the place where we send the command buffer out to the TPM
+ * through the Tpm2 which will eventually get it to the TPM for us.
+ * The Tpm2 will send us back a Tpm2Response that we send back to
+ * the client by way of our Sink object. The flow is roughly:
+ * - Receive the Tpm2Command as a parameter
+ * - Load all virtualized objects required by the command.
+ * - Send the Tpm2Command out through the Tpm2.
+ * - Receive the response from the Tpm2.
+ * - Virtualize the new objects created by the command & referenced in the
+ *   response.
+ * - Enqueue the response back out to the processing pipeline through the
+ *   Sink object.
+ * - Evict the least recently used transient objects if more are resident
+ *   in the TPM than we allow.
+ * Sessions used by the command are left loaded. They're saved before a
+ * later command if it comes from a different connection or if there isn't
+ * room to load the sessions it needs. Commands that need none of this are
+ * sent right away, see resource_manager_is_passthrough.
+ */
+void
+resource_manager_process_tpm2_command (ResourceManager   *resmgr,
+                                       Tpm2Command       *command)
+{
+    Connection    *connection;
+    Tpm2Response   *response;
+    TSS2_RC         rc = TSS2_RC_SUCCESS;
+    GSList         *transient_slist = NULL;
+    TPMA_CC         command_attrs;
+    gint64          times [COMMAND_STATS_WRITE + 1] = { 0, };
+    gboolean        timed;
+    size_t          response_size;
+    flight_record_t record = { 0, };
+    gboolean        passthrough = FALSE;
+
+    command_attrs = tpm2_command_get_attributes (command);
+    g_debug ("%s", __func__);
+    dump_command (command);
+    /* The Connection is held by the command for as long as we run. */
+    connection = tpm2_command_peek_connection (command);
+    /* Nobody is waiting for the response if the client has gone away. */
+    if (connection != NULL && connection_is_closed (connection)) {
+        g_debug ("%s: dropping command from closed connection", __func__);
+        return;
+    }
+    timed = resmgr->command_stats != NULL ||
+        resmgr->flight_recorder != NULL ||
+        resmgr->trace_buffer != NULL ||
+        resmgr->stats_segment != NULL ||
+        resmgr->slow_command_ms > 0;
+    if (timed) {
+        times [COMMAND_STATS_QUEUE] = tpm2_command_get_time_queued (command);
+        times [COMMAND_STATS_LOAD] = g_get_monotonic_time ();
+    }
+    if (resmgr->flight_recorder != NULL) {
+        resource_manager_record_start (&record, connection, command);
+    }
+    resmgr->processing = connection;
+    resmgr->processing_code = tpm2_command_get_code (command);
+    resmgr->processing_swaps = 0;
+    /* The CommandSource answered it already. */
+    response = tpm2_command_take_response (command);
+    if (response != NULL) {
+        goto send_response;
+    }
+    if (connection != NULL) {
+        rc = resource_manager_promoted_check (resmgr, command);
+        if (rc != TSS2_RC_SUCCESS) {
+            response = tpm2_response_new_rc (connection, rc);
+            goto send_response;
+        }
+    }
+    /* The kernel does the swapping for connections of its own. */
+    if (resmgr->kernel_rm != NULL && connection != NULL) {
+        passthrough = TRUE;
+        times [COMMAND_STATS_EXEC] = g_get_monotonic_time ();
+        response = resource_manager_kernel_process (resmgr, command);
+        dump_response (response);
+        times [COMMAND_STATS_SAVE] = g_get_monotonic_time ();
+        goto send_response;
+    }
+    if (resource_manager_is_passthrough (resmgr, command)) {
+        passthrough = TRUE;
+        times [COMMAND_STATS_EXEC] = g_get_monotonic_time ();
+        response = send_command_handle_rc (resmgr, command);
+        dump_response (response);
+        /* SelfTest and the firmware upgrade commands have no handles */
+        resource_manager_test_cache_update (resmgr, command, response);
+        times [COMMAND_STATS_SAVE] = g_get_monotonic_time ();
+        goto send_response;
+    }
+    /*
+     * If executing the command would exceed a per connection quota. This
+     * can't be checked before the command is queued: the commands queued
+     * ahead of it may load or flush objects and sessions.
+     */
+    rc = resource_manager_quota_check (resmgr, command);
+    if (rc != TSS2_RC_SUCCESS) {
+        response = tpm2_response_new_rc (connection, rc);
+        goto send_response;
+    }
+    /* Do command-specific processing. */
+    response = command_special_processing (resmgr, command);
+    if (response != NULL) {
+        goto send_response;
+    }
+    /* Save the loaded sessions that can't stay loaded for this command. */
+    resource_manager_save_sessions (resmgr, command, FALSE);
+    /* Load objects associated with the handles in the command handle area. */
+    if (tpm2_command_get_handle_count (command) > 0) {
+        rc = resource_manager_load_handles (resmgr,
+                                            command,
+                                            &transient_slist);
+        if (RC_IS_CONTEXT_LOST (rc)) {
+            response = tpm2_response_new_rc (connection, rc);
+            goto send_response;
+        }
+    }
+    /* Load the sessions in the auth area, passwords need nothing. */
+    if (tpm2_command_has_session_auths (command)) {
+        g_info ("%s, Processing auths for command", __func__);
+        auth_callback_data_t auth_callback_data = {
+            .resmgr = resmgr,
+            .command = command,
+        };
+        tpm2_command_foreach_auth (command,
+                                   resource_manager_load_auth_callback,
+                                   &auth_callback_data);
+    }
+    /* Make room for the transient object this command will create. */
+    if ((command_attrs & TPMA_CC_RHANDLE) &&
+        tpm2_command_get_code (command) != TPM2_CC_StartAuthSession)
+    {
+        resource_manager_evict_transients (resmgr, 1, transient_slist);
+    }
+    /* Loading a cached primary object counts as executing the command. */
+    times [COMMAND_STATS_EXEC] = g_get_monotonic_time ();
+    /* Use a cached primary object if we have one. */
+    response = resource_manager_primary_cache_load (resmgr, command);
+    if (response != NULL) {
+        goto map_response;
+    }
+    /* Send command and create response object. */
+    response = send_command_handle_rc (resmgr, command);
+    if (tpm2_response_get_code (response) == TPM2_RC_OBJECT_MEMORY &&
+        resource_manager_evict_transients (resmgr,
+                                           resmgr->transient_max,
+                                           transient_slist) > 0)
+    {
+        g_debug ("%s: TPM out of object memory, retrying", __func__);
+        g_clear_object (&response);
+        response = send_command_handle_rc (resmgr, command);
+    }
+    if (tpm2_response_get_code (response) == TPM2_RC_SESSION_MEMORY) {
+        g_debug ("%s: TPM out of session memory, retrying", __func__);
+        resource_manager_save_sessions (resmgr, command, TRUE);
+        g_clear_object (&response);
+        response = send_command_handle_rc (resmgr, command);
+    }
+    if (tpm2_response_get_code (response) == TPM2_RC_SESSION_HANDLES &&
+        (resource_manager_flush_deferred (resmgr, G_MAXUINT) > 0 ||
+         session_list_drop_abandoned (resmgr->session_list,
+                                      flush_session_callback,
+                                      resmgr)))
+    {
+        g_debug ("%s: TPM out of session handles, retrying", __func__);
+        g_clear_object (&response);
+        response = send_command_handle_rc (resmgr, command);
+    }
+    dump_response (response);
+    resource_manager_primary_cache_update (resmgr, command, response);
+    resource_manager_pcr_cache_update (resmgr, command, response);
+    resource_manager_cap_cache_update (resmgr, command, response);
+    resource_manager_nv_cache_update (resmgr, command, response);
+    resource_manager_test_cache_update (resmgr, command, response);
+    resource_manager_handle_list_update (resmgr, command);
+    if (tpm2_command_get_code (command) == TPM2_CC_Startup &&
+        tpm2_response_get_code (response) == TSS2_RC_SUCCESS)
+    {
+        resource_manager_check_reset (resmgr);
+    }
+    if (tpm2_command_get_code (command) == TPM2_CC_ReadPublic &&
+        transient_slist != NULL)
+    {
+        resource_manager_cache_public (resmgr,
+                                       command,
+                                       response,
+                                       HANDLE_MAP_ENTRY (transient_slist->data));
+    }
+map_response:
+    times [COMMAND_STATS_SAVE] = g_get_monotonic_time ();
+    /* transform virtualized handles in Tpm2Response if necessary */
+    resource_manager_create_context_mapping (resmgr,
+                                             response,
+                                             &transient_slist);
+    resource_manager_object_share_update (resmgr,
+                                          command,
+                                          response,
+                                          &transient_slist);
+    if (resmgr->key_pool != NULL &&
+        tpm2_response_get_code (response) == TSS2_RC_SUCCESS &&
+        object_share_invalidates (tpm2_command_get_code (command)))
+    {
+        key_pool_forget (resmgr->key_pool);
+    }
+send_response:
+    if (resmgr->command_stats != NULL || resmgr->trace_buffer != NULL) {
+        tpm2_response_set_queued (response,
+                                  tpm2_command_get_code (command),
+                                  g_get_monotonic_time ());
+        command_stats_add_rc (resmgr->command_stats,
+                              tpm2_response_get_code (response));
+    }
+    response_size = tpm2_response_get_size (response);
+    record.rc = tpm2_response_get_code (response);
+    sink_enqueue (resmgr->sink, G_OBJECT (response));
+    g_object_unref (response);
+    if (!passthrough) {
+        post_process_loaded_transients (resmgr,
+                                        &transient_slist,
+                                        connection,
+                                        command_attrs);
+    }
+    resource_manager_note_usage (resmgr,
+                                 connection,
+                                 command,
+                                 response_size,
+                                 times,
+                                 passthrough);
+    if (timed) {
+        times [COMMAND_STATS_WRITE] = g_get_monotonic_time ();
+    }
+    if (resmgr->command_stats != NULL) {
+        command_stats_add_times (resmgr->command_stats,
+                                 tpm2_command_get_code (command),
+                                 times);
+    }
+    if (resmgr->flight_recorder != NULL) {
+        resource_manager_record_times (&record, times);
+        flight_recorder_add (resmgr->flight_recorder, &record);
+    }
+    if (resmgr->trace_buffer != NULL) {
+        resource_manager_trace_times (resmgr, connection, command, times);
+    }
+    if (resmgr->slow_command_ms > 0) {
+        resource_manager_note_slow (resmgr,
+                                    connection,
+                                    command,
+                                    record.rc,
+                                    times);
+    }
+    if (resmgr->stats_segment != NULL) {
+        resource_manager_publish_stats (resmgr, connection, times);
+    }
+    resmgr->processing = NULL;
+    return;
+}
+/*
+ * Ask the Tpm2 whether the TPM was reset since we last looked and drop
+ * everything we had in it if so. This is only worth the round trip to the
+ * TPM when there's a hint: a Startup command from a client went through
+ * or a context we saved failed to load. Returns TRUE if the TPM was reset.
+ */
+gboolean
+resource_manager_check_reset (ResourceManager *resmgr)
+{
+    if (!tpm2_check_reset (resmgr->tpm2)) {
+        return FALSE;
+    }
+    resource_manager_tpm_reset (resmgr);
+    return TRUE;
+}
+/*
+ * The TPM was reset: the objects and sessions it held are gone and none
+ * of the contexts saved before can be loaded. Rather than find that out
+ * one failed ContextLoad at a time they're all dropped at once. The
+ * sessions are removed from the SessionList, the TPM answers commands
+ * still using one as it would for any session it doesn't know. The
+ * transient objects stay in the HandleMaps until their connections flush
+ * them, but moving to a new epoch makes the commands using them fail with
+ * RC_CONTEXT_LOST without going to the TPM. The caches of objects and
+ * sessions in the TPM and of PCR values go too. Promoted objects outlive
+ * the reset but none of their users can use them anymore, they're
+ * evicted from NV.
+ */
+void
+resource_manager_tpm_reset (ResourceManager *resmgr)
+{
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    guint transients, sessions;
+
+    ++resmgr->reset_epoch;
+    resource_manager_demote_all (resmgr);
+    g_array_set_size (resmgr->flush_queue, 0);
+    resmgr->flush_transients = 0;
+    resmgr->flush_sessions = 0;
+    transients = g_queue_get_length (resmgr->transient_lru);
+    while ((entry = g_queue_pop_head (resmgr->transient_lru)) != NULL) {
+        handle_map_entry_set_phandle (entry, 0);
+        g_object_unref (entry);
+    }
+    g_slist_free_full (resmgr->loaded_sessions, g_object_unref);
+    resmgr->loaded_sessions = NULL;
+    sessions = session_list_clear (resmgr->session_list);
+    if (resmgr->session_pool != NULL) {
+        while ((session = session_pool_take_stale (resmgr->session_pool,
+                                                   G_MAXUINT64)) != NULL)
+        {
+            g_object_unref (session);
+        }
+    }
+    if (resmgr->object_share != NULL) {
+        object_share_forget (resmgr->object_share);
+    }
+    if (resmgr->primary_cache != NULL) {
+        primary_cache_clear (resmgr->primary_cache);
+    }
+    if (resmgr->pcr_cache != NULL) {
+        pcr_cache_clear (resmgr->pcr_cache);
+    }
+    if (resmgr->cap_cache != NULL) {
+        cap_cache_clear (resmgr->cap_cache);
+    }
+    if (resmgr->test_cache != NULL) {
+        test_cache_clear (resmgr->test_cache);
+    }
+    /* the TPM starts counting saved contexts from scratch */
+    resmgr->context_counter = 0;
+    g_info ("%s: TPM was reset, dropped %u resident objects and %u sessions",
+            __func__, transients, sessions);
+}
+static void
+resource_manager_parked_free (gpointer data)
+{
+    resource_manager_parked_t *parked = (resource_manager_parked_t*)data;
+
+    g_clear_object (&parked->connection);
+    g_free (parked);
+}
+/*
+ * This function is invoked instead of resource_manager_remove_connection
+ * for a closed connection when there's a resume grace period. A
+ * connection without objects or sessions is removed as usual. Otherwise its
+ * objects and sessions stay as they are, they're swapped out like those
+ * of any idle connection if the room is needed, until a client resumes
+ * it or the grace period is over.
+ * Returns TRUE if the connection was kept, FALSE if the caller has to
+ * remove it.
+ */
+gboolean
+resource_manager_park_connection (ResourceManager *resmgr,
+                                  Connection      *connection)
+{
+    resource_manager_parked_t *parked;
+
+    if (resmgr->resume_ms == 0 ||
+        connection_get_transport (connection) != connection)
+    {
+        return FALSE;
+    }
+    if (handle_map_size (connection_peek_trans_map (connection)) == 0 &&
+        session_list_connection_count (resmgr->session_list, connection) == 0 &&
+        !g_hash_table_contains (resmgr->kernel_tpms, connection))
+    {
+        return FALSE;
+    }
+    if (g_queue_get_length (resmgr->parked) >= RESOURCE_MANAGER_PARKED_MAX) {
+        parked = g_queue_pop_head (resmgr->parked);
+        g_info ("%s: too many connections kept, removing the oldest",
+                __func__);
+        resource_manager_remove_connection (resmgr, parked->connection);
+        resource_manager_parked_free (parked);
+    }
+    parked = g_new0 (resource_manager_parked_t, 1);
+    parked->connection = g_object_ref (connection);
+    parked->expires = g_get_monotonic_time () +
+                      (gint64)resmgr->resume_ms * G_TIME_SPAN_MILLISECOND;
+    g_queue_push_tail (resmgr->parked, parked);
+    g_info ("%s: keeping closed connection for %u ms", __func__,
+            resmgr->resume_ms);
+    return TRUE;
+}
+/*
+ * This function is invoked for a new connection created to resume a
+ * closed one. The kept connection with the id the client passed and the
+ * same user hands its virtual handles, sessions and, with --kernel-rm,
+ * its file on the device over to the new connection. The client sees
+ * the same handles it had before.
+ * Returns TRUE if a connection was resumed.
+ */
+gboolean
+resource_manager_resume_connection (ResourceManager *resmgr,
+                                    Connection      *connection)
+{
+    resource_manager_parked_t *parked = NULL;
+    Tpm2 *tpm2;
+    GList *link;
+    guint64 resume_id = connection_get_resume_id (connection);
+    guint handles, sessions;
+
+    for (link = g_queue_peek_head_link (resmgr->parked);
+         link != NULL;
+         link = link->next)
+    {
+        parked = (resource_manager_parked_t*)link->data;
+        if (parked->connection->id == resume_id &&
+            connection_get_uid (parked->connection) ==
+            connection_get_uid (connection))
+        {
+            break;
+        }
+    }
+    if (link == NULL) {
+        g_info ("%s: no closed connection to resume, starting empty",
+                __func__);
+        return FALSE;
+    }
+    g_queue_delete_link (resmgr->parked, link);
+    handles = handle_map_move (connection_peek_trans_map (connection),
+                               connection_peek_trans_map (parked->connection));
+    sessions = session_list_move_connection (resmgr->session_list,
+                                             parked->connection,
+                                             connection);
+    tpm2 = g_hash_table_lookup (resmgr->kernel_tpms, parked->connection);
+    if (tpm2 != NULL) {
+        g_mutex_lock (&resmgr->kernel_tpms_mutex);
+        g_hash_table_insert (resmgr->kernel_tpms,
+                             g_object_ref (connection),
+                             g_object_ref (tpm2));
+        g_hash_table_remove (resmgr->kernel_tpms, parked->connection);
+        g_mutex_unlock (&resmgr->kernel_tpms_mutex);
+    }
+    if (resmgr->owner == parked->connection) {
+        g_clear_object (&resmgr->owner);
+        resmgr->owner = g_object_ref (connection);
+    }
+    g_info ("%s: resumed connection with %u virtual handles and %u "
+            "sessions", __func__, handles, sessions);
+    /* anything left behind goes the way of a removed connection */
+    resource_manager_remove_connection (resmgr, parked->connection);
+    resource_manager_parked_free (parked);
+    return TRUE;
+}
+/*
+ * Microseconds until the oldest kept connection expires, at least one.
+ */
+static gint64
+resource_manager_parked_wait (ResourceManager *resmgr)
+{
+    resource_manager_parked_t *parked = g_queue_peek_head (resmgr->parked);
+
+    return MAX (parked->expires - g_get_monotonic_time (), 1);
+}
+/*
+ * Remove the kept connections whose grace period is over at 'now', in
+ * monotonic time.
+ * Returns the number of connections removed.
+ */
+guint
+resource_manager_expire_parked (ResourceManager *resmgr,
+                                gint64           now)
+{
+    resource_manager_parked_t *parked;
+    guint count = 0;
+
+    while ((parked = g_queue_peek_head (resmgr->parked)) != NULL &&
+           parked->expires <= now)
+    {
+        g_queue_pop_head (resmgr->parked);
+        g_debug ("%s: grace period over, removing connection", __func__);
+        resource_manager_queue_removal (resmgr, parked->connection);
+        resource_manager_parked_free (parked);
+        ++count;
+    }
+    resource_manager_remove_pending (resmgr);
+    return count;
+}
+/*
+ * Get the TPM ready for another instance of the daemon to take over: the
+ * context of every transient object and session is saved and nothing we
+ * loaded is left in the TPM. The saved contexts stay in the HandleMaps and
+ * the SessionList to be handed over.
+ */
+void
+resource_manager_handover (ResourceManager *resmgr)
+{
+    GList *entries;
+
+    /* the other instance can't know the closed connections we kept */
+    resource_manager_expire_parked (resmgr, G_MAXINT64);
+    resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    /* the other instance gets the promoted objects back as transients */
+    resource_manager_demote_all (resmgr);
+    /* pinned objects too, the list changes as they're flushed */
+    entries = g_list_copy_deep (g_queue_peek_head_link (resmgr->transient_lru),
+                                (GCopyFunc)g_object_ref,
+                                NULL);
+    g_list_foreach (entries, resource_manager_flushsave_context, resmgr);
+    g_list_free_full (entries, g_object_unref);
+    session_list_foreach (resmgr->session_list,
+                          save_session_callback,
+                          resmgr);
+    g_clear_object (&resmgr->owner);
+}
+/*
+ * Time representative operations on the TPM to seed the cost estimates,
+ * see tpm2_calibrate. What closed connections left is flushed and an
+ * object evicted if need be to make room for the objects calibrating
+ * loads, it's done between commands so it doesn't get in their way.
+ */
+void
+resource_manager_calibrate (ResourceManager *resmgr)
+{
+    TSS2_RC rc;
+
+    resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    resource_manager_evict_transients (resmgr, 1, NULL);
+    rc = tpm2_calibrate (resmgr->tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: calibrating the TPM failed: 0x%" PRIx32,
+                   __func__, rc);
+    }
+}
+/*
+ * Return FALSE to terminate main thread.
+ */
+gboolean
+resource_manager_process_control (ResourceManager *resmgr,
+                                  ControlMessage *msg)
+{
+    ControlCode code = control_message_get_code (msg);
+    Connection *conn;
+
+    g_debug ("%s", __func__);
+    switch (code) {
+    case CHECK_CANCEL:
+        sink_enqueue (resmgr->sink, G_OBJECT (msg));
+        return FALSE;
+    case CONNECTION_REMOVED:
+        conn = CONNECTION (control_message_get_object (msg));
+        g_debug ("%s: received CONNECTION_REMOVED message for connection",
+                 __func__);
+        if (!resource_manager_park_connection (resmgr, conn)) {
+            resource_manager_queue_removal (resmgr, conn);
+        }
+        sink_enqueue (resmgr->sink, G_OBJECT (msg));
+        return TRUE;
+    case CONNECTION_RESUME:
+        conn = CONNECTION (control_message_get_object (msg));
+        g_debug ("%s: received CONNECTION_RESUME message for connection",
+                 __func__);
+        resource_manager_resume_connection (resmgr, conn);
+        return TRUE;
+    case CONNECTION_RESET:
+        conn = CONNECTION (control_message_get_object (msg));
+        g_debug ("%s: received CONNECTION_RESET message for connection",
+                 __func__);
+        resource_manager_reset_connection (resmgr, conn);
+        return TRUE;
+    case CALIBRATE:
+        resource_manager_calibrate (resmgr);
+        return TRUE;
+    case HANDOVER:
+        g_debug ("%s: received HANDOVER message", __func__);
+        g_clear_object (&resmgr->handover);
+        resmgr->handover = g_object_ref (msg);
+        return TRUE;
+    default:
+        g_warning ("%s: Unknown control code: %d ... ignoring",
+                   __func__, code);
+        return TRUE;
+    }
+}
+/*
+ * GFunc used to save the context of a resident transient object without
+ * flushing it. Once the context is saved the object can later be evicted
+ * with just a FlushContext.
+ */
+static void
+idle_save_transient_callback (gpointer data_entry,
+                              gpointer data_resmgr)
 {
-    SessionEntry *entry = NULL;
-    Connection   *conn_resp = NULL, *conn_entry = NULL;
+    ResourceManager *resmgr = RESOURCE_MANAGER (data_resmgr);
+    HandleMapEntry  *entry  = HANDLE_MAP_ENTRY (data_entry);
+    TPM2_HANDLE      phandle = handle_map_entry_get_phandle (entry);
+    TSS2_RC          rc;
 
-    entry = session_list_lookup_handle (resmgr->session_list, handle);
-    conn_resp = tpm2_response_get_connection (response);
-    if (entry != NULL) {
-        g_debug ("%s: got SessionEntry that's in the SessionList", __func__);
-        conn_entry = session_entry_get_connection (entry);
-        if (conn_resp != conn_entry) {
-            g_warning ("%s: connections do not match!", __func__);
-        }
+    if (phandle == 0 || handle_map_entry_get_context_saved (entry)) {
+        return;
+    }
+    g_debug ("%s: saving context for resident transient 0x%" PRIx32,
+             __func__, phandle);
+    rc = tpm2_context_save (resmgr->tpm2,
+                            phandle,
+                            handle_map_entry_get_context (entry));
+    if (rc == TSS2_RC_SUCCESS) {
+        resource_manager_count (resmgr, COMMAND_STATS_CONTEXT_SAVE);
+        handle_map_entry_set_context_saved (entry, TRUE);
+        resource_manager_note_sequence (resmgr,
+                                        handle_map_entry_get_context (entry)->sequence);
     } else {
-        g_debug ("%s: handle is a session, creating entry for SessionList "
-                 "and SessionList", __func__);
-        entry = session_entry_new (conn_resp, handle);
-        session_entry_set_state (entry, SESSION_ENTRY_LOADED);
-        session_list_insert (resmgr->session_list, entry);
+        g_warning ("%s: failed to save context for handle 0x%" PRIx32
+                   " rc: 0x%" PRIx32, __func__, phandle, rc);
     }
-    g_clear_object (&conn_resp);
-    g_clear_object (&conn_entry);
-    g_clear_object (&entry);
 }
 /*
- * Each Tpm2Response object can have at most one handle in it.
- * This function assumes that the handle in the parameter Tpm2Response
- * object is the handle assigned by the TPM. Depending on the type of the
- * handle we do to possible things:
- * For TPM2_HT_TRANSIENT handles we create a new virtual handle and
- * allocates a new HandleMapEntry to map the virtual handle to a
- * TPMS_CONTEXT structure when processing future commands associated
- * with the same connection. This HandleMapEntry is inserted into the
- * handle map for the connection. It is also added to the list of loaded
- * transient objects so that it can be saved / flushed by the typical code
- * path.
- * For TPM2_HT_HMAC_SESSION or TPM2_HT_POLICY_SESSION handles we create a
- * new session_entry_t object, populate the connection field with the
- * connection associated with the response object, and set the savedHandle
- * field. We then add this entry to the list of sessions we're tracking
- * (session_slist) and the list of loaded sessions (loaded_session_slist).
+ * Record the sequence from a context that was just saved. The TPM assigns
+ * each saved context the current value of its context counter so the
+ * largest sequence we've seen tracks the counter.
  */
 void
-resource_manager_create_context_mapping (ResourceManager  *resmgr,
-                                         Tpm2Response     *response,
-                                         GSList          **loaded_transient_slist)
+resource_manager_note_sequence (ResourceManager *resmgr,
+                                guint64          sequence)
 {
-    TPM2_HANDLE       handle;
+    if (sequence > resmgr->context_counter) {
+        resmgr->context_counter = sequence;
+    }
+}
+/*
+ * This structure is used to collect the saved sessions that are getting
+ * close to the context gap limit.
+ */
+typedef struct {
+    ResourceManager *resmgr;
+    GSList          *stale;
+    guint            loaded;
+} regap_collect_data_t;
+static void
+regap_collect_callback (gpointer data_entry,
+                        gpointer user_data)
+{
+    SessionEntry *entry = SESSION_ENTRY (data_entry);
+    regap_collect_data_t *data = (regap_collect_data_t*)user_data;
+    ResourceManager *resmgr = data->resmgr;
+    guint64 sequence;
 
-    g_debug ("%s", __func__);
-    if (!tpm2_response_has_handle (response)) {
-        g_debug ("response has no handles");
+    switch (session_entry_get_state (entry)) {
+    case SESSION_ENTRY_LOADED:
+        ++data->loaded;
+        return;
+    case SESSION_ENTRY_SAVED_RM:
+    case SESSION_ENTRY_SAVED_CLIENT:
+    case SESSION_ENTRY_SAVED_CLIENT_CLOSED:
+        sequence = session_entry_get_sequence (entry);
+        if (sequence != 0 && sequence <= resmgr->context_counter &&
+            resmgr->context_counter - sequence >= REGAP_THRESHOLD (resmgr->gap_max))
+        {
+            data->stale = g_slist_prepend (data->stale, g_object_ref (entry));
+        }
+        return;
+    default:
         return;
     }
-    handle = tpm2_response_get_handle (response);
+}
+static gint
+regap_sequence_compare (gconstpointer a,
+                        gconstpointer b)
+{
+    guint64 seq_a = session_entry_get_sequence (SESSION_ENTRY (a));
+    guint64 seq_b = session_entry_get_sequence (SESSION_ENTRY (b));
+
+    return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+/*
+ * Refresh saved sessions before the TPM context gap is hit. Any saved
+ * session whose context sequence trails the context counter by
+ * REGAP_THRESHOLD or more is loaded & saved again, oldest first. This
+ * requires a free session slot in the TPM, so if the loaded sessions fill
+ * the TPM we do nothing and rely on handling TPM2_RC_CONTEXT_GAP instead.
+ * Returns the number of sessions re-gapped.
+ */
+guint
+resource_manager_regap_sessions (ResourceManager *resmgr)
+{
+    regap_collect_data_t data = {
+        .resmgr = resmgr,
+    };
+    GSList *entry;
+    guint regapped = 0;
+
+    session_list_foreach (resmgr->session_list,
+                          regap_collect_callback,
+                          &data);
+    if (data.stale == NULL) {
+        return 0;
+    }
+    if (data.loaded >= resmgr->session_max) {
+        g_debug ("%s: no free session slot, not re-gapping", __func__);
+        goto out;
+    }
+    data.stale = g_slist_sort (data.stale, regap_sequence_compare);
+    for (entry = data.stale; entry != NULL; entry = entry->next) {
+        g_debug ("%s: re-gapping session 0x%08" PRIx32, __func__,
+                 session_entry_get_handle (SESSION_ENTRY (entry->data)));
+        if (!regap_session (resmgr, SESSION_ENTRY (entry->data))) {
+            g_warning ("%s: failed to re-gap session", __func__);
+            break;
+        }
+        ++regapped;
+    }
+out:
+    g_slist_free_full (data.stale, g_object_unref);
+    return regapped;
+}
+/*
+ * This function is invoked by the RM thread when no message has arrived
+ * for IDLE_TIMEOUT_US. It does work that would otherwise be done on the
+ * critical path of a later command: resident transient objects that have
+ * never been saved have their context saved now, so that evicting them
+ * later is just a FlushContext. The objects themselves stay resident since
+ * the most likely next command is from the connection that owns them.
+ * Saved sessions that are close to the context gap limit are re-gapped,
+ * and the entropy pool, the session pool and the key pool are topped up.
+ * Whatever closed connections left in the TPM is flushed first.
+ */
+void
+resource_manager_idle (ResourceManager *resmgr)
+{
+    resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    g_debug ("%s: %u resident transients", __func__,
+             g_queue_get_length (resmgr->transient_lru));
+    g_queue_foreach (resmgr->transient_lru,
+                     idle_save_transient_callback,
+                     resmgr);
+    resource_manager_regap_sessions (resmgr);
+    resource_manager_entropy_pool_fill (resmgr);
+    resource_manager_session_pool_fill (resmgr);
+    resource_manager_key_pool_fill (resmgr);
+}
+/*
+ * Returns TRUE if the object or session with the provided handle from the
+ * provided command is loaded in the TPM right now: using it costs no
+ * ContextLoad.
+ */
+static gboolean
+resource_manager_handle_is_resident (ResourceManager *resmgr,
+                                     Tpm2Command     *command,
+                                     TPM2_HANDLE      handle)
+{
+    HandleMap *map;
+    HandleMapEntry *entry;
+    SessionEntry *session_entry;
+    gboolean resident = FALSE;
+
     switch (handle >> TPM2_HR_SHIFT) {
     case TPM2_HT_TRANSIENT:
-        create_context_mapping_transient (resmgr, response, loaded_transient_slist);
+        map = connection_peek_trans_map (tpm2_command_peek_connection (command));
+        entry = handle_map_vlookup (map, handle);
+        if (entry != NULL) {
+            resident = handle_map_entry_get_phandle (entry) != 0;
+            g_object_unref (entry);
+        }
         break;
     case TPM2_HT_HMAC_SESSION:
     case TPM2_HT_POLICY_SESSION:
-        create_context_mapping_session (resmgr, response, handle);
+        session_entry = session_list_lookup_handle (resmgr->session_list,
+                                                    handle);
+        if (session_entry != NULL) {
+            resident = session_entry_get_state (session_entry) ==
+                SESSION_ENTRY_LOADED;
+            g_object_unref (session_entry);
+        }
         break;
     default:
-        g_debug ("  not creating context for handle: 0x%08" PRIx32, handle);
         break;
     }
+
+    return resident;
 }
-Tpm2Response*
-send_command_handle_rc (ResourceManager *resmgr,
-                        Tpm2Command *cmd)
+typedef struct {
+    ResourceManager *resmgr;
+    Tpm2Command *command;
+    guint resident;
+} resident_count_data_t;
+/*
+ * GFunc invoked for each authorization in a command to count the sessions
+ * that are loaded.
+ */
+static void
+resident_count_auth_callback (gpointer auth_offset_ptr,
+                              gpointer user_data)
 {
-    regap_session_data_t data = {
+    resident_count_data_t *data = (resident_count_data_t*)user_data;
+    size_t offset = *(size_t*)auth_offset_ptr;
+    TPM2_HANDLE handle;
+
+    handle = tpm2_command_get_auth_handle (data->command, offset);
+    if (resource_manager_handle_is_resident (data->resmgr,
+                                             data->command,
+                                             handle))
+    {
+        ++data->resident;
+    }
+}
+/*
+ * Count the objects and sessions referenced by a command, in the handle
+ * area or the authorization area, that are currently loaded in the TPM.
+ */
+static guint
+resource_manager_count_resident (ResourceManager *resmgr,
+                                 Tpm2Command     *command)
+{
+    TPM2_HANDLE handles [TPM2_COMMAND_MAX_HANDLES] = { 0, };
+    size_t i, handle_count = TPM2_COMMAND_MAX_HANDLES;
+    resident_count_data_t data = {
         .resmgr = resmgr,
-        .ret = TRUE,
+        .command = command,
+        .resident = 0,
     };
-    Tpm2Response *resp = NULL;
-    TSS2_RC rc;
 
-    /* Send command and create response object. */
-    resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
-    rc = tpm2_response_get_code (resp);
-    if (rc == TPM2_RC_CONTEXT_GAP) {
-        g_debug ("%s: handling TPM2_RC_CONTEXT_GAP", __func__);
-        session_list_foreach (resmgr->session_list,
-                              regap_session_callback,
-                              &data);
-        g_clear_object (&resp);
-        resp = tpm2_send_command (resmgr->tpm2, cmd, &rc);
+    if (resource_manager_message_key (G_OBJECT (command)) == NULL) {
+        return 0;
     }
-    return resp;
+    if (tpm2_command_get_handles (command, handles, &handle_count)) {
+        for (i = 0; i < handle_count; ++i) {
+            if (resource_manager_handle_is_resident (resmgr,
+                                                     command,
+                                                     handles [i]))
+            {
+                ++data.resident;
+            }
+        }
+    }
+    if (tpm2_command_has_session_auths (command)) {
+        tpm2_command_foreach_auth (command,
+                                   resident_count_auth_callback,
+                                   &data);
+    }
+
+    return data.resident;
 }
-/**
- * This function is invoked in response to the receipt of a Tpm2Command.
- * This is the place where we send the command buffer out to the TPM
- * through the Tpm2 which will eventually get it to the TPM for us.
- * The Tpm2 will send us back a Tpm2Response that we send back to
- * the client by way of our Sink object. The flow is roughly:
- * - Receive the Tpm2Command as a parameter
- * - Load all virtualized objects required by the command.
- * - Send the Tpm2Command out through the Tpm2.
- * - Receive the response from the Tpm2.
- * - Virtualize the new objects created by the command & referenced in the
- *   response.
- * - Enqueue the response back out to the processing pipeline through the
- *   Sink object.
- * - Flush all objects loaded for the command or as part of executing the
- *   command..
+/*
+ * Reorder the commands in a batch taken from the input queue to reduce
+ * the number of context loads and saves needed to execute them. Commands
+ * from the same connection are grouped so that the connection's objects
+ * and sessions are loaded once for the group, and the groups are ordered
+ * so that the connection whose next command has the most objects and
+ * sessions still resident runs first. Before that the groups are ordered
+ * by locality, the one the TPM is at first, so each locality is switched
+ * to at most once per batch. Commands from a connection keep their order
+ * and no command is moved across a control message. The batch is small so
+ * this only reorders within the window the fair input queue has already
+ * picked.
  */
 void
-resource_manager_process_tpm2_command (ResourceManager   *resmgr,
-                                       Tpm2Command       *command)
+resource_manager_plan_batch (ResourceManager *resmgr,
+                             GObject        **objs,
+                             guint            count)
 {
-    Connection    *connection;
-    Tpm2Response   *response;
-    TSS2_RC         rc = TSS2_RC_SUCCESS;
-    GSList         *transient_slist = NULL;
-    TPMA_CC         command_attrs;
+    GObject **planned;
+    gpointer *conns, conn;
+    guint *scores, *ranks, start, end, nconns, i, j, k, score, rank;
+    guint8 locality;
 
-    command_attrs = tpm2_command_get_attributes (command);
-    g_debug ("%s", __func__);
-    dump_command (command);
-    connection = tpm2_command_get_connection (command);
-    /* If executing the command would exceed a per connection quota */
-    rc = resource_manager_quota_check (resmgr, command);
-    if (rc != TSS2_RC_SUCCESS) {
-        response = tpm2_response_new_rc (connection, rc);
-        goto send_response;
+    if (count < 2) {
+        return;
     }
-    /* Do command-specific processing. */
-    response = command_special_processing (resmgr, command);
-    if (response != NULL) {
-        goto send_response;
+    planned = g_new0 (GObject*, count);
+    conns = g_new0 (gpointer, count);
+    scores = g_new0 (guint, count);
+    ranks = g_new0 (guint, count);
+    for (start = 0; start < count; start = end + 1) {
+        for (end = start;
+             end < count && IS_TPM2_COMMAND (objs [end]);
+             ++end);
+        /* distinct connections in the segment in order of first command */
+        nconns = 0;
+        for (i = start; i < end; ++i) {
+            conn = resource_manager_message_key (objs [i]);
+            for (j = 0; j < nconns && conns [j] != conn; ++j);
+            if (j < nconns) {
+                continue;
+            }
+            score = resource_manager_count_resident (resmgr,
+                                                     TPM2_COMMAND (objs [i]));
+            locality = conn != NULL ?
+                connection_get_locality (CONNECTION (conn)) : 0;
+            rank = locality == tpm2_get_locality (resmgr->tpm2) ?
+                0 : (guint)locality + 1;
+            /* insertion sort on locality then score, stable for equal ones */
+            for (k = nconns;
+                 k > 0 && (ranks [k - 1] > rank ||
+                           (ranks [k - 1] == rank && scores [k - 1] < score));
+                 --k)
+            {
+                conns [k] = conns [k - 1];
+                scores [k] = scores [k - 1];
+                ranks [k] = ranks [k - 1];
+            }
+            conns [k] = conn;
+            scores [k] = score;
+            ranks [k] = rank;
+            ++nconns;
+        }
+        if (nconns < 2) {
+            continue;
+        }
+        k = 0;
+        for (j = 0; j < nconns; ++j) {
+            for (i = start; i < end; ++i) {
+                if (resource_manager_message_key (objs [i]) == conns [j]) {
+                    planned [k++] = objs [i];
+                }
+            }
+        }
+        memcpy (&objs [start], planned, k * sizeof (GObject*));
+        g_debug ("%s: planned %u commands from %u connections", __func__,
+                 k, nconns);
     }
-    /* Load objects associated with the handles in the command handle area. */
-    if (tpm2_command_get_handle_count (command) > 0) {
-        resource_manager_load_handles (resmgr,
-                                       command,
-                                       &transient_slist);
+    g_free (ranks);
+    g_free (scores);
+    g_free (conns);
+    g_free (planned);
+}
+/*
+ * Run by the Tpm2 while the TPM executes a command for us. Once the
+ * command is the last of its batch the next batch is taken from the input
+ * queue, that way the dequeue is off the path between two TPM commands.
+ * The objects the next command uses are then looked up, loading them is
+ * left for when the TPM is free: commands to the TPM are one at a time.
+ */
+static void
+resource_manager_tpm_wait (gpointer data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data);
+    GObject *next;
+
+    if (resmgr->batch_remaining == 0 && resmgr->lookahead_count == 0 &&
+        resmgr->group_owner == NULL)
+    {
+        resmgr->lookahead_count =
+            message_queue_timeout_dequeue_batch (resmgr->in_queue,
+                                                 resmgr->lookahead,
+                                                 RESOURCE_MANAGER_BATCH_MAX,
+                                                 0);
     }
-    /* Load objets associated with the authorizations in the command. */
-    if (tpm2_command_has_auths (command)) {
-        g_info ("%s, Processing auths for command", __func__);
-        auth_callback_data_t auth_callback_data = {
-            .resmgr = resmgr,
-            .command = command,
-        };
-        tpm2_command_foreach_auth (command,
-                                   resource_manager_load_auth_callback,
-                                   &auth_callback_data);
+    next = resmgr->batch_next;
+    if (next == NULL && resmgr->lookahead_count > 0) {
+        next = resmgr->lookahead [0];
+    }
+    if (next != NULL && IS_TPM2_COMMAND (next)) {
+        resource_manager_prepare (resmgr, TPM2_COMMAND (next));
     }
-    /* Send command and create response object. */
-    response = send_command_handle_rc (resmgr, command);
-    dump_response (response);
-    /* transform virtualized handles in Tpm2Response if necessary */
-    resource_manager_create_context_mapping (resmgr,
-                                             response,
-                                             &transient_slist);
-send_response:
-    sink_enqueue (resmgr->sink, G_OBJECT (response));
-    g_object_unref (response);
-    /* save contexts that were previously loaded */
-    session_list_foreach (resmgr->session_list,
-                          save_session_callback,
-                          resmgr);
-    post_process_loaded_transients (resmgr, &transient_slist, connection, command_attrs);
-    g_object_unref (connection);
-    return;
 }
 /*
- * Return FALSE to terminate main thread.
+ * Process a message taken from the input queue. A command from the owner
+ * of the running group counts toward the group, which ends with its last
+ * command or a control message for the owner's connection. A few of the
+ * handles closed connections left in the TPM are flushed after each
+ * message. Returns FALSE once the thread is told to stop.
  */
-gboolean
-resource_manager_process_control (ResourceManager *resmgr,
-                                  ControlMessage *msg)
+static gboolean
+resource_manager_process_message (ResourceManager *resmgr,
+                                  GObject         *obj)
 {
-    ControlCode code = control_message_get_code (msg);
-    Connection *conn;
+    gboolean ret = TRUE;
 
-    g_debug ("%s", __func__);
-    switch (code) {
-    case CHECK_CANCEL:
-        sink_enqueue (resmgr->sink, G_OBJECT (msg));
-        return FALSE;
-    case CONNECTION_REMOVED:
-        conn = CONNECTION (control_message_get_object (msg));
-        g_debug ("%s: received CONNECTION_REMOVED message for connection",
-                 __func__);
-        resource_manager_remove_connection (resmgr, conn);
-        sink_enqueue (resmgr->sink, G_OBJECT (msg));
-        return TRUE;
-    default:
-        g_warning ("%s: Unknown control code: %d ... ignoring",
-                   __func__, code);
-        return TRUE;
+    if (resmgr->group_owner != NULL &&
+        resource_manager_message_key (obj) == resmgr->group_owner)
+    {
+        if (IS_TPM2_COMMAND (obj)) {
+            if (resmgr->lease_end == 0) {
+                --resmgr->group_left;
+            }
+        } else {
+            resource_manager_end_group (resmgr);
+        }
+    }
+    if (IS_TPM2_COMMAND (obj)) {
+        resource_manager_remove_pending (resmgr);
+        resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
+    } else if (IS_CONTROL_MESSAGE (obj)) {
+        ret = resource_manager_process_control (resmgr,
+                                                CONTROL_MESSAGE (obj));
+    }
+    if (resmgr->group_owner != NULL && resmgr->lease_end == 0 &&
+        resmgr->group_left == 0)
+    {
+        resource_manager_end_group (resmgr);
+    }
+    resource_manager_flush_deferred (resmgr,
+                                     RESOURCE_MANAGER_FLUSHES_PER_MESSAGE);
+    return ret;
+}
+/*
+ * End the lease running out now, the client didn't give it back in time.
+ */
+static void
+resource_manager_lease_expired (ResourceManager *resmgr)
+{
+    g_info ("%s: the lease of connection %p ran out", __func__,
+            (gpointer)resmgr->group_owner);
+    if (resmgr->command_stats != NULL) {
+        command_stats_count (resmgr->command_stats,
+                             COMMAND_STATS_LEASE_EXPIRED);
+    }
+    connection_count (resmgr->group_owner, COMMAND_STATS_LEASE_EXPIRED);
+    resource_manager_end_group (resmgr);
+}
+/*
+ * Run the commands of the group started by the last message processed
+ * before anything else. The group's commands still in 'objs' after
+ * 'start' are taken out of the array first, the rest are waited for on
+ * the input queue, out of the turn of the connection. Waiting for them
+ * stops the lookahead, the next command of the group is what the TPM runs
+ * next. A connection that takes longer than TABRMD_GROUP_WAIT_MS to send
+ * its next command loses the rest of its group so a stalled client can't
+ * hold the TPM. Under a lease the connection is waited for until the
+ * lease runs out instead. Messages that belong to no connection aren't
+ * held up by the group. Returns FALSE once the thread is told to stop.
+ */
+gboolean
+resource_manager_run_group (ResourceManager *resmgr,
+                            GObject        **objs,
+                            guint            start,
+                            guint           *count)
+{
+    GObject *obj;
+    gboolean ret = TRUE;
+    gint64 wait_us;
+    guint i;
+
+    resmgr->batch_next = NULL;
+    while (ret && resmgr->group_owner != NULL) {
+        wait_us = TABRMD_GROUP_WAIT_MS * G_TIME_SPAN_MILLISECOND;
+        if (resmgr->lease_end != 0) {
+            wait_us = resmgr->lease_end - g_get_monotonic_time ();
+        }
+        if (wait_us <= 0) {
+            resource_manager_lease_expired (resmgr);
+            break;
+        }
+        obj = NULL;
+        for (i = start; i < *count; ++i) {
+            if (resource_manager_message_key (objs [i]) ==
+                resmgr->group_owner)
+            {
+                obj = objs [i];
+                memmove (&objs [i],
+                         &objs [i + 1],
+                         (*count - i - 1) * sizeof (GObject*));
+                objs [--*count] = NULL;
+                break;
+            }
+        }
+        if (obj == NULL) {
+            obj = message_queue_timeout_dequeue_key (resmgr->in_queue,
+                                                     resmgr->group_owner,
+                                                     wait_us);
+        }
+        if (obj == NULL && resmgr->lease_end != 0) {
+            resource_manager_lease_expired (resmgr);
+            break;
+        }
+        if (obj == NULL) {
+            g_info ("%s: no command in %ums, ending the group with %u "
+                    "commands left", __func__, TABRMD_GROUP_WAIT_MS,
+                    resmgr->group_left);
+            resource_manager_end_group (resmgr);
+            break;
+        }
+        if (resmgr->prepared != NULL && G_OBJECT (resmgr->prepared) != obj) {
+            resource_manager_prepared_clear (resmgr);
+        }
+        ret = resource_manager_process_message (resmgr, obj);
+        g_object_unref (obj);
     }
+    return ret;
 }
 /**
  * This function acts as a thread. It simply:
  * - Blocks on the in_queue. Then wakes up and
- * - Dequeues a message from the in_queue.
- * - Processes the message (depending on TYPE)
+ * - Dequeues up to RESOURCE_MANAGER_BATCH_MAX messages from the in_queue.
+ * - Processes the messages (depending on TYPE)
  * - Does it all over again.
+ * If no message arrives for IDLE_TIMEOUT_US we do deferred maintenance
+ * work once, then block until the next message. Messages left in a batch
+ * after the thread is told to stop are dropped.
+ * A HANDOVER message only takes effect once the queue is empty: the
+ * commands that were queued before it still get their responses.
  */
 gpointer
 resource_manager_thread (gpointer data)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (data);
-    GObject         *obj = NULL;
+    GObject         *objs [RESOURCE_MANAGER_BATCH_MAX] = { NULL, };
     gboolean done = FALSE;
+    guint count, i;
 
     g_debug ("resource_manager_thread start");
+    /*
+     * Only this thread uses the TPM from here on, it lets the startup
+     * users that are still around have it between batches.
+     */
+    tpm2_acquire (resmgr->tpm2);
+    tpm2_set_wait_func (resmgr->tpm2, resource_manager_tpm_wait, resmgr);
+    /* what TPM resets are told apart from */
+    tpm2_check_reset (resmgr->tpm2);
+    if (resmgr->calibrate) {
+        resource_manager_calibrate (resmgr);
+    }
+    if (resmgr->promote_max > 0) {
+        resource_manager_promote_sweep (resmgr);
+        resmgr->promote_next = g_get_monotonic_time () +
+            RESOURCE_MANAGER_PROMOTE_INTERVAL_US;
+    }
     while (!done) {
-        obj = message_queue_dequeue (resmgr->in_queue);
-        g_debug ("%s: message_queue_dequeue got obj", __func__);
-        if (obj == NULL) {
-            g_debug ("%s: dequeued a null object", __func__);
+        tpm2_yield (resmgr->tpm2);
+        if (resmgr->lookahead_count > 0) {
+            count = resmgr->lookahead_count;
+            memcpy (objs, resmgr->lookahead, count * sizeof (GObject*));
+            resmgr->lookahead_count = 0;
+        } else {
+            count = message_queue_timeout_dequeue_batch (resmgr->in_queue,
+                                                         objs,
+                                                         RESOURCE_MANAGER_BATCH_MAX,
+                                                         IDLE_TIMEOUT_US);
+        }
+        if (count == 0 && resmgr->handover != NULL) {
+            resource_manager_handover (resmgr);
+            sink_enqueue (resmgr->sink, G_OBJECT (resmgr->handover));
+            g_clear_object (&resmgr->handover);
             break;
         }
-        if (IS_TPM2_COMMAND (obj)) {
-            resource_manager_process_tpm2_command (resmgr, TPM2_COMMAND (obj));
-        } else if (IS_CONTROL_MESSAGE (obj)) {
-            gboolean ret =
-                resource_manager_process_control (resmgr, CONTROL_MESSAGE (obj));
-            if (ret == FALSE) {
+        if (count == 0) {
+            resource_manager_idle (resmgr);
+            resource_manager_expire_parked (resmgr, g_get_monotonic_time ());
+            if (g_queue_is_empty (resmgr->parked)) {
+                count = message_queue_dequeue_batch (resmgr->in_queue,
+                                                     objs,
+                                                     RESOURCE_MANAGER_BATCH_MAX);
+            } else {
+                /* wake up when the oldest kept connection expires */
+                count = message_queue_timeout_dequeue_batch (resmgr->in_queue,
+                                                             objs,
+                                                             RESOURCE_MANAGER_BATCH_MAX,
+                                                             resource_manager_parked_wait (resmgr));
+            }
+        }
+        g_debug ("%s: message_queue_dequeue_batch got %u objs",
+                 __func__, count);
+        resource_manager_plan_batch (resmgr, objs, count);
+        for (i = 0; i < count; ++i) {
+            resmgr->batch_remaining = count - i - 1;
+            resmgr->batch_next = i + 1 < count ? objs [i + 1] : NULL;
+            if (resmgr->prepared != NULL &&
+                G_OBJECT (resmgr->prepared) != objs [i])
+            {
+                resource_manager_prepared_clear (resmgr);
+            }
+            if (done) {
+                /* stop requested earlier in this batch */
+            } else if (!resource_manager_process_message (resmgr, objs [i])) {
                 done = TRUE;
             }
+            g_clear_object (&objs [i]);
+            if (!done && resmgr->group_owner != NULL) {
+                done = !resource_manager_run_group (resmgr, objs, i + 1, &count);
+            }
         }
-        g_object_unref (obj);
+        if (resmgr->command_stats != NULL) {
+            command_stats_set_sessions (resmgr->command_stats,
+                                        session_list_size (resmgr->session_list));
+        }
+        resource_manager_remove_pending (resmgr);
+        resource_manager_expire_parked (resmgr, g_get_monotonic_time ());
+        if (resmgr->promote_max > 0 &&
+            g_get_monotonic_time () >= resmgr->promote_next)
+        {
+            resource_manager_promote (resmgr);
+        }
+    }
+    for (i = 0; i < resmgr->lookahead_count; ++i) {
+        g_clear_object (&resmgr->lookahead [i]);
     }
+    resmgr->lookahead_count = 0;
+    resmgr->batch_next = NULL;
+    resource_manager_end_group (resmgr);
+    resource_manager_prepared_clear (resmgr);
+    resource_manager_remove_pending (resmgr);
+    resource_manager_flush_deferred (resmgr, G_MAXUINT);
+    resource_manager_demote_all (resmgr);
+    tpm2_set_wait_func (resmgr->tpm2, NULL, NULL);
+    tpm2_release (resmgr->tpm2);
 
     return NULL;
 }
@@ -1452,16 +6141,111 @@ resource_manager_unblock (Thread *self)
 /**
  * Implement the 'enqueue' function from the Sink interface. This is how
  * new messages / commands get into the Tpm2.
+ * When a connection is removed the commands it still has queued are
+ * dropped before the CONNECTION_REMOVED message is queued: the client
+ * won't read the responses so there's no point in executing them.
  */
 void
 resource_manager_enqueue (Sink        *sink,
                           GObject     *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (sink);
+    guint dropped;
 
     g_debug ("%s", __func__);
+    if (IS_CONTROL_MESSAGE (obj) &&
+        control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED)
+    {
+        dropped = message_queue_remove_key (resmgr->in_queue,
+                                            resource_manager_message_key (obj),
+                                            NULL,
+                                            NULL);
+        if (dropped > 0) {
+            g_info ("%s: dropped %u commands queued by closed connection",
+                    __func__, dropped);
+        }
+    }
+    if ((resmgr->command_stats != NULL ||
+         resmgr->flight_recorder != NULL ||
+         resmgr->trace_buffer != NULL ||
+         resmgr->stats_segment != NULL ||
+         resmgr->slow_command_ms > 0) &&
+        IS_TPM2_COMMAND (obj))
+    {
+        tpm2_command_set_time_queued (TPM2_COMMAND (obj),
+                                      g_get_monotonic_time ());
+    }
     message_queue_enqueue (resmgr->in_queue, obj);
 }
+/*
+ * MessageQueueFilterFunc used to take the Tpm2Commands that are being
+ * canceled out of the input queue. Control messages are left alone. The
+ * commands are collected in the GSList passed through 'user_data' since
+ * the responses can't be sent while the queue is locked.
+ */
+static gboolean
+resource_manager_cancel_filter (GObject  *obj,
+                                gpointer  user_data)
+{
+    GSList **canceled = (GSList**)user_data;
+
+    if (!IS_TPM2_COMMAND (obj)) {
+        return FALSE;
+    }
+    *canceled = g_slist_prepend (*canceled, g_object_ref (obj));
+    return TRUE;
+}
+/*
+ * Cancel the commands from the provided connection. This is called from
+ * the IPC frontend, not the RM thread. Commands still in the input queue
+ * are removed and answered with TPM2_RC_CANCELED right away. If none are
+ * queued but a command from the connection is being executed, the TPM is
+ * asked to cancel it through the TCTI, see tpm2_cancel. With --kernel-rm
+ * that's the TCTI the connection has on the kernel resource manager, the
+ * commands we answer ourselves go to ours. Otherwise there's nothing left
+ * to cancel: the response is already on its way to the client.
+ */
+TSS2_RC
+resource_manager_cancel (ResourceManager *resmgr,
+                         Connection      *connection)
+{
+    GSList *canceled = NULL, *item;
+    Tpm2Response *response;
+    Tpm2 *tpm2 = NULL;
+    guint count;
+    TSS2_RC rc;
+
+    count = message_queue_remove_key (resmgr->in_queue,
+                                      connection,
+                                      resource_manager_cancel_filter,
+                                      &canceled);
+    for (item = canceled; item != NULL; item = item->next) {
+        response = tpm2_response_new_rc (connection, TPM2_RC_CANCELED);
+        sink_enqueue (resmgr->sink, G_OBJECT (response));
+        g_object_unref (response);
+    }
+    g_slist_free_full (canceled, g_object_unref);
+    if (count > 0) {
+        g_info ("%s: canceled %u queued commands", __func__, count);
+        return TSS2_RC_SUCCESS;
+    }
+    rc = tpm2_cancel (resmgr->tpm2, connection);
+    if (resmgr->kernel_rm != NULL) {
+        g_mutex_lock (&resmgr->kernel_tpms_mutex);
+        tpm2 = g_hash_table_lookup (resmgr->kernel_tpms, connection);
+        if (tpm2 != NULL) {
+            g_object_ref (tpm2);
+        }
+        g_mutex_unlock (&resmgr->kernel_tpms_mutex);
+    }
+    if (tpm2 != NULL) {
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tpm2_cancel (tpm2, connection);
+        }
+        g_object_unref (tpm2);
+    }
+    return rc;
+}
 /**
  * Implement the 'add_sink' function from the SourceInterface. This adds a
  * reference to an object that implements the SinkInterface to this objects
@@ -1515,6 +6299,83 @@ resource_manager_set_property (GObject        *object,
     case PROP_SESSION_LIST:
         resmgr->session_list = SESSION_LIST (g_value_dup_object (value));
         break;
+    case PROP_PRIMARY_CACHE:
+        g_clear_object (&resmgr->primary_cache);
+        resmgr->primary_cache = g_value_dup_object (value);
+        break;
+    case PROP_PCR_CACHE:
+        g_clear_object (&resmgr->pcr_cache);
+        resmgr->pcr_cache = g_value_dup_object (value);
+        break;
+    case PROP_CAP_CACHE:
+        g_clear_object (&resmgr->cap_cache);
+        resmgr->cap_cache = g_value_dup_object (value);
+        break;
+    case PROP_NV_CACHE:
+        g_clear_object (&resmgr->nv_cache);
+        resmgr->nv_cache = g_value_dup_object (value);
+        break;
+    case PROP_TEST_CACHE:
+        g_clear_object (&resmgr->test_cache);
+        resmgr->test_cache = g_value_dup_object (value);
+        break;
+    case PROP_ENTROPY_POOL:
+        g_clear_object (&resmgr->entropy_pool);
+        resmgr->entropy_pool = g_value_dup_object (value);
+        break;
+    case PROP_OBJECT_SHARE:
+        g_clear_object (&resmgr->object_share);
+        resmgr->object_share = g_value_dup_object (value);
+        break;
+    case PROP_SESSION_POOL:
+        g_clear_object (&resmgr->session_pool);
+        resmgr->session_pool = g_value_dup_object (value);
+        break;
+    case PROP_KEY_POOL:
+        g_clear_object (&resmgr->key_pool);
+        resmgr->key_pool = g_value_dup_object (value);
+        break;
+    case PROP_CONTEXT_STORE:
+        g_clear_object (&resmgr->context_store);
+        resmgr->context_store = g_value_dup_object (value);
+        break;
+    case PROP_KERNEL_RM:
+        g_free (resmgr->kernel_rm);
+        resmgr->kernel_rm = g_value_dup_string (value);
+        break;
+    case PROP_COMMAND_STATS:
+        g_clear_object (&resmgr->command_stats);
+        resmgr->command_stats = g_value_dup_object (value);
+        break;
+    case PROP_FLIGHT_RECORDER:
+        g_clear_object (&resmgr->flight_recorder);
+        resmgr->flight_recorder = g_value_dup_object (value);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_clear_object (&resmgr->trace_buffer);
+        resmgr->trace_buffer = g_value_dup_object (value);
+        break;
+    case PROP_SLOW_COMMAND_MS:
+        resmgr->slow_command_ms = g_value_get_uint (value);
+        break;
+    case PROP_STATS_SEGMENT:
+        resmgr->stats_segment = g_value_get_pointer (value);
+        break;
+    case PROP_STATS_BACKEND:
+        resmgr->stats_backend = g_value_get_uint (value);
+        break;
+    case PROP_PIN_MAX:
+        resmgr->pin_max = g_value_get_uint (value);
+        break;
+    case PROP_LEASE_MAX_MS:
+        resmgr->lease_max_ms = g_value_get_uint (value);
+        break;
+    case PROP_RESUME_MS:
+        resmgr->resume_ms = g_value_get_uint (value);
+        break;
+    case PROP_CALIBRATE:
+        resmgr->calibrate = g_value_get_boolean (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1545,6 +6406,69 @@ resource_manager_get_property (GObject     *object,
     case PROP_SESSION_LIST:
         g_value_set_object (value, resmgr->session_list);
         break;
+    case PROP_PRIMARY_CACHE:
+        g_value_set_object (value, resmgr->primary_cache);
+        break;
+    case PROP_PCR_CACHE:
+        g_value_set_object (value, resmgr->pcr_cache);
+        break;
+    case PROP_CAP_CACHE:
+        g_value_set_object (value, resmgr->cap_cache);
+        break;
+    case PROP_NV_CACHE:
+        g_value_set_object (value, resmgr->nv_cache);
+        break;
+    case PROP_TEST_CACHE:
+        g_value_set_object (value, resmgr->test_cache);
+        break;
+    case PROP_ENTROPY_POOL:
+        g_value_set_object (value, resmgr->entropy_pool);
+        break;
+    case PROP_OBJECT_SHARE:
+        g_value_set_object (value, resmgr->object_share);
+        break;
+    case PROP_SESSION_POOL:
+        g_value_set_object (value, resmgr->session_pool);
+        break;
+    case PROP_KEY_POOL:
+        g_value_set_object (value, resmgr->key_pool);
+        break;
+    case PROP_CONTEXT_STORE:
+        g_value_set_object (value, resmgr->context_store);
+        break;
+    case PROP_KERNEL_RM:
+        g_value_set_string (value, resmgr->kernel_rm);
+        break;
+    case PROP_COMMAND_STATS:
+        g_value_set_object (value, resmgr->command_stats);
+        break;
+    case PROP_FLIGHT_RECORDER:
+        g_value_set_object (value, resmgr->flight_recorder);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_value_set_object (value, resmgr->trace_buffer);
+        break;
+    case PROP_SLOW_COMMAND_MS:
+        g_value_set_uint (value, resmgr->slow_command_ms);
+        break;
+    case PROP_STATS_SEGMENT:
+        g_value_set_pointer (value, resmgr->stats_segment);
+        break;
+    case PROP_STATS_BACKEND:
+        g_value_set_uint (value, resmgr->stats_backend);
+        break;
+    case PROP_PIN_MAX:
+        g_value_set_uint (value, resmgr->pin_max);
+        break;
+    case PROP_LEASE_MAX_MS:
+        g_value_set_uint (value, resmgr->lease_max_ms);
+        break;
+    case PROP_RESUME_MS:
+        g_value_set_uint (value, resmgr->resume_ms);
+        break;
+    case PROP_CALIBRATE:
+        g_value_set_boolean (value, resmgr->calibrate);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -1558,22 +6482,87 @@ resource_manager_dispose (GObject *obj)
 {
     ResourceManager *resmgr = RESOURCE_MANAGER (obj);
     Thread *thread = THREAD (obj);
+    guint i;
 
     g_debug ("%s", __func__);
     if (resmgr == NULL)
         g_error ("%s: passed NULL parameter", __func__);
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel thread first", __func__);
+    for (i = 0; i < RESOURCE_MANAGER_PROMOTE_MAX; ++i) {
+        g_clear_object (&resmgr->promoted [i]);
+    }
+    memset (&resmgr->promote_auth, 0, sizeof (resmgr->promote_auth));
     g_clear_object (&resmgr->in_queue);
     g_clear_object (&resmgr->sink);
     g_clear_object (&resmgr->tpm2);
     g_clear_object (&resmgr->session_list);
+    g_clear_object (&resmgr->owner);
+    g_slist_free_full (resmgr->loaded_sessions, g_object_unref);
+    resmgr->loaded_sessions = NULL;
+    g_clear_object (&resmgr->primary_cache);
+    g_clear_object (&resmgr->pcr_cache);
+    g_clear_object (&resmgr->cap_cache);
+    g_clear_object (&resmgr->nv_cache);
+    g_clear_object (&resmgr->test_cache);
+    g_clear_object (&resmgr->entropy_pool);
+    g_clear_object (&resmgr->object_share);
+    g_clear_object (&resmgr->session_pool);
+    g_clear_object (&resmgr->key_pool);
+    g_clear_object (&resmgr->context_store);
+    g_clear_pointer (&resmgr->kernel_rm, g_free);
+    g_mutex_lock (&resmgr->kernel_tpms_mutex);
+    g_clear_pointer (&resmgr->kernel_tpms, g_hash_table_unref);
+    g_mutex_unlock (&resmgr->kernel_tpms_mutex);
+    g_clear_pointer (&resmgr->persistent_handles, g_array_unref);
+    g_clear_pointer (&resmgr->nv_handles, g_array_unref);
+    g_clear_object (&resmgr->command_stats);
+    g_clear_object (&resmgr->flight_recorder);
+    g_clear_object (&resmgr->trace_buffer);
+    g_clear_object (&resmgr->handover);
+    g_clear_object (&resmgr->group_owner);
+    while (resmgr->lookahead_count > 0) {
+        g_clear_object (&resmgr->lookahead [--resmgr->lookahead_count]);
+    }
+    resource_manager_prepared_clear (resmgr);
+    if (resmgr->transient_lru != NULL) {
+        g_queue_free_full (resmgr->transient_lru, g_object_unref);
+        resmgr->transient_lru = NULL;
+    }
+    g_clear_pointer (&resmgr->flush_queue, g_array_unref);
+    g_clear_pointer (&resmgr->removals, g_ptr_array_unref);
+    g_clear_pointer (&resmgr->uid_weights, g_hash_table_unref);
+    if (resmgr->parked != NULL) {
+        g_queue_free_full (resmgr->parked, resource_manager_parked_free);
+        resmgr->parked = NULL;
+    }
     G_OBJECT_CLASS (resource_manager_parent_class)->dispose (obj);
 }
 static void
+resource_manager_finalize (GObject *obj)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (obj);
+
+    g_mutex_clear (&resmgr->kernel_tpms_mutex);
+    G_OBJECT_CLASS (resource_manager_parent_class)->finalize (obj);
+}
+static void
 resource_manager_init (ResourceManager *manager)
 {
-    UNUSED_PARAM (manager);
+    manager->transient_lru = g_queue_new ();
+    manager->flush_queue = g_array_new (FALSE,
+                                        FALSE,
+                                        sizeof (resource_manager_flush_t));
+    manager->transient_max = MAX_RESIDENT_TRANSIENTS;
+    manager->session_max = MAX_LOADED_SESSIONS;
+    manager->gap_max = CONTEXT_GAP_MAX_DEFAULT;
+    manager->kernel_tpms = g_hash_table_new_full (g_direct_hash,
+                                                  g_direct_equal,
+                                                  g_object_unref,
+                                                  g_object_unref);
+    g_mutex_init (&manager->kernel_tpms_mutex);
+    manager->parked = g_queue_new ();
+    manager->removals = g_ptr_array_new_with_free_func (g_object_unref);
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -1590,6 +6579,7 @@ resource_manager_class_init (ResourceManagerClass *klass)
     if (resource_manager_parent_class == NULL)
         resource_manager_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose = resource_manager_dispose;
+    object_class->finalize = resource_manager_finalize;
     object_class->get_property = resource_manager_get_property;
     object_class->set_property = resource_manager_set_property;
     thread_class->thread_run     = resource_manager_thread;
@@ -1619,6 +6609,160 @@ resource_manager_class_init (ResourceManagerClass *klass)
                              "Data structure to hold session tracking data",
                              TYPE_SESSION_LIST,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_PRIMARY_CACHE] =
+        g_param_spec_object ("primary-cache",
+                             "PrimaryCache object",
+                             "Cache of primary objects, NULL when disabled",
+                             TYPE_PRIMARY_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_PCR_CACHE] =
+        g_param_spec_object ("pcr-cache",
+                             "PcrCache object",
+                             "Cache of PCR_Read responses, NULL when disabled",
+                             TYPE_PCR_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_CAP_CACHE] =
+        g_param_spec_object ("cap-cache",
+                             "CapCache object",
+                             "Cache of GetCapability responses for the "
+                             "variable TPM properties, NULL when disabled",
+                             TYPE_CAP_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_NV_CACHE] =
+        g_param_spec_object ("nv-cache",
+                             "NvCache object",
+                             "Cache of NV_Read responses, NULL when disabled",
+                             TYPE_NV_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_TEST_CACHE] =
+        g_param_spec_object ("test-cache",
+                             "TestCache object",
+                             "Cache of TestParms and GetTestResult responses, NULL when disabled",
+                             TYPE_TEST_CACHE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_ENTROPY_POOL] =
+        g_param_spec_object ("entropy-pool",
+                             "EntropyPool object",
+                             "Random bytes for GetRandom, NULL when disabled",
+                             TYPE_ENTROPY_POOL,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_OBJECT_SHARE] =
+        g_param_spec_object ("object-share",
+                             "ObjectShare object",
+                             "Objects loaded once for all connections, "
+                             "NULL when disabled",
+                             TYPE_OBJECT_SHARE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_SESSION_POOL] =
+        g_param_spec_object ("session-pool",
+                             "SessionPool object",
+                             "HMAC sessions started when idle, NULL when "
+                             "disabled",
+                             TYPE_SESSION_POOL,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_KEY_POOL] =
+        g_param_spec_object ("key-pool",
+                             "KeyPool object",
+                             "keys from Create made when idle, NULL when "
+                             "disabled",
+                             TYPE_KEY_POOL,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_CONTEXT_STORE] =
+        g_param_spec_object ("context-store",
+                             "ContextStore object",
+                             "File backed store for the saved contexts of "
+                             "transient objects, NULL to keep them on the "
+                             "heap",
+                             TYPE_CONTEXT_STORE,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_KERNEL_RM] =
+        g_param_spec_string ("kernel-rm",
+                             "Kernel resource manager",
+                             "Device of the kernel resource manager each "
+                             "connection gets its own TCTI on, NULL to swap "
+                             "contexts in the daemon",
+                             NULL,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_COMMAND_STATS] =
+        g_param_spec_object ("command-stats",
+                             "CommandStats object",
+                             "Latency histograms for processed commands, "
+                             "NULL when not kept",
+                             TYPE_COMMAND_STATS,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_FLIGHT_RECORDER] =
+        g_param_spec_object ("flight-recorder",
+                             "FlightRecorder object",
+                             "Record of the last commands processed, "
+                             "NULL when not kept",
+                             TYPE_FLIGHT_RECORDER,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_TRACE_BUFFER] =
+        g_param_spec_object ("trace-buffer",
+                             "TraceBuffer object",
+                             "Spans of the phases of the commands processed "
+                             "and the context swaps, NULL when not traced",
+                             TYPE_TRACE_BUFFER,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_SLOW_COMMAND_MS] =
+        g_param_spec_uint ("slow-command-ms",
+                           "Slow command threshold",
+                           "Commands taking longer than this many "
+                           "milliseconds are logged, 0 for none",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_STATS_SEGMENT] =
+        g_param_spec_pointer ("stats-segment",
+                              "Statistics segment",
+                              "stats_segment_t to publish the counters and "
+                              "gauges in, NULL for none",
+                              G_PARAM_READWRITE);
+    obj_properties [PROP_STATS_BACKEND] =
+        g_param_spec_uint ("stats-backend",
+                           "Backend in the statistics segment",
+                           "Index of the backend record we publish in",
+                           0,
+                           STATS_SEGMENT_BACKENDS - 1,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_PIN_MAX] =
+        g_param_spec_uint ("pin-max",
+                           "Pinned objects per connection",
+                           "Transient objects each connection may pin "
+                           "resident in the TPM, 0 for none",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_LEASE_MAX_MS] =
+        g_param_spec_uint ("lease-max-ms",
+                           "Longest lease",
+                           "Milliseconds a connection may lease the TPM "
+                           "for, 0 for no leases",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_RESUME_MS] =
+        g_param_spec_uint ("resume-ms",
+                           "Resume grace period",
+                           "Milliseconds the objects and sessions of a "
+                           "closed connection are kept for a client to "
+                           "resume it, 0 to remove them right away",
+                           0,
+                           G_MAXUINT,
+                           0,
+                           G_PARAM_READWRITE);
+    obj_properties [PROP_CALIBRATE] =
+        g_param_spec_boolean ("calibrate",
+                              "Calibrate the TPM",
+                              "Time representative operations on the TPM "
+                              "when the thread starts to seed the cost "
+                              "estimates",
+                              FALSE,
+                              G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -1651,13 +6795,33 @@ flush_session_callback (SessionEntry *entry,
 {
     return flush_session (RESOURCE_MANAGER (data), entry);
 }
+/*
+ * A PruneFunc for the sessions abandoned by removed connections: like
+ * flush_session_callback but the FlushContext is deferred, see
+ * resource_manager_defer_flush, so a storm of closing clients doesn't
+ * turn into a storm of flushes ahead of the commands of the others.
+ */
+static gboolean
+defer_flush_session_callback (SessionEntry *entry,
+                              gpointer      data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (data);
+
+    resource_manager_defer_flush (resmgr,
+                                  session_entry_get_handle (entry),
+                                  FALSE);
+    session_list_remove (resmgr->session_list, entry);
+    return TRUE;
+}
 /*
  * This structure is used to pass required data into the
- * connection_close_session_callback function.
+ * connection_close_session_callback function. The sessions abandoned are
+ * counted so the abandoned queue is pruned once they're all in it.
  */
 typedef struct {
     Connection *connection;
     ResourceManager *resource_manager;
+    guint abandoned;
 } connection_close_data_t;
 /*
  * This is a callback function invoked foreach SessionEntry in the SessionList
@@ -1669,10 +6833,10 @@ typedef struct {
  * - take a reference to the SessionEntry
  * - remove SessionEntry from session list
  * - change state to SESSION_ENTRY_SAVED_CLIENT_CLOSED
- * - "prune" other abandoned sessions
  * - add SessionEntry to queue of abandoned sessions
- * If session is in state SESSION_ENTRY_SAVED_RM:
- * - flush session from TPM
+ * - count it, the caller "prunes" the abandoned queue
+ * If session is in state SESSION_ENTRY_SAVED_RM or SESSION_ENTRY_LOADED:
+ * - queue the session to be flushed from the TPM
  * - remove SessionEntry from session list
  * If session is in any other state
  * - panic
@@ -1687,7 +6851,6 @@ connection_close_session_callback (gpointer data,
     Connection *connection = callback_data->connection;
     ResourceManager *resource_manager = callback_data->resource_manager;
     TPM2_HANDLE handle;
-    TSS2_RC rc;
 
     g_debug ("%s", __func__);
     if (session_entry->connection != connection) {
@@ -1703,17 +6866,14 @@ connection_close_session_callback (gpointer data,
         session_list_abandon_handle (resource_manager->session_list,
                                      connection,
                                      handle);
-        session_list_prune_abandoned (resource_manager->session_list,
-                                      flush_session_callback,
-                                      resource_manager);
+        ++callback_data->abandoned;
         break;
     case SESSION_ENTRY_SAVED_RM:
+    case SESSION_ENTRY_LOADED:
         g_debug ("%s: flushing.", __func__);
-        rc = tpm2_context_flush (resource_manager->tpm2,
-                                          handle);
-        if (rc != TSS2_RC_SUCCESS) {
-            g_warning ("%s: failed to flush context", __func__);
-        }
+        resource_manager_defer_flush (resource_manager,
+                                      handle,
+                                      session_state == SESSION_ENTRY_LOADED);
         session_list_remove (resource_manager->session_list,
                              session_entry);
         break;
@@ -1724,26 +6884,371 @@ connection_close_session_callback (gpointer data,
         break;
     }
 }
+/*
+ * A GHFunc adding the HandleMapEntry 'value' to the set 'user_data'.
+ */
+static void
+transient_set_add_callback (gpointer key,
+                            gpointer value,
+                            gpointer user_data)
+{
+    UNUSED_PARAM (key);
+
+    g_hash_table_add ((GHashTable*)user_data, value);
+}
+/*
+ * Queue all transient objects in the set 'entries' that are still
+ * resident in the TPM to be flushed, in a single pass over the resident
+ * list however many connections they belong to. Their saved contexts are
+ * of no use once the connection is gone so there's no need to save them.
+ */
+static void
+resource_manager_flush_connection_transients (ResourceManager *resmgr,
+                                              GHashTable      *entries)
+{
+    HandleMapEntry *entry;
+    GList          *link, *next;
+
+    if (g_hash_table_size (entries) == 0) {
+        return;
+    }
+    for (link = g_queue_peek_head_link (resmgr->transient_lru);
+         link != NULL;
+         link = next)
+    {
+        next = link->next;
+        entry = HANDLE_MAP_ENTRY (link->data);
+        if (g_hash_table_contains (entries, entry)) {
+            g_debug ("%s: flushing resident transient 0x%" PRIx32, __func__,
+                     handle_map_entry_get_phandle (entry));
+            resource_manager_defer_flush (resmgr,
+                                          handle_map_entry_get_phandle (entry),
+                                          TRUE);
+            handle_map_entry_set_phandle (entry, 0);
+            g_queue_delete_link (resmgr->transient_lru, link);
+            g_object_unref (entry);
+        }
+    }
+}
+/*
+ * Remove the 'count' connections in 'connections' together: all of their
+ * sessions and resident transient objects are dropped from our lists in
+ * one pass over the abandoned queue and the resident list. The
+ * FlushContext commands are deferred, see resource_manager_defer_flush,
+ * so clients closing with many objects loaded don't hold up the commands
+ * of the others.
+ */
+void
+resource_manager_remove_connections (ResourceManager *resmgr,
+                                     Connection     **connections,
+                                     guint            count)
+{
+    connection_close_data_t connection_close_data = {
+        .resource_manager = resmgr,
+        .abandoned = 0,
+    };
+    GHashTable *entries;
+    guint i;
+
+    if (count == 0) {
+        return;
+    }
+    g_info ("%s: removing %u connections", __func__, count);
+    entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < count; ++i) {
+        connection_close_data.connection = connections [i];
+        session_list_foreach_connection (resmgr->session_list,
+                                         connections [i],
+                                         connection_close_session_callback,
+                                         &connection_close_data);
+        handle_map_foreach (connection_peek_trans_map (connections [i]),
+                            object_share_release_callback,
+                            resmgr);
+        handle_map_foreach (connection_peek_trans_map (connections [i]),
+                            transient_set_add_callback,
+                            entries);
+        /* closing its file makes the kernel flush what it had loaded */
+        g_mutex_lock (&resmgr->kernel_tpms_mutex);
+        g_hash_table_remove (resmgr->kernel_tpms, connections [i]);
+        g_mutex_unlock (&resmgr->kernel_tpms_mutex);
+        if (resmgr->owner == connections [i]) {
+            g_clear_object (&resmgr->owner);
+        }
+        if (resmgr->stats_segment != NULL) {
+            resource_manager_unpublish_connection (resmgr, connections [i]);
+        }
+    }
+    /* each call takes at most one session past the limit off the queue */
+    for (i = 0; i < connection_close_data.abandoned; ++i) {
+        session_list_prune_abandoned (resmgr->session_list,
+                                      defer_flush_session_callback,
+                                      resmgr);
+    }
+    resource_manager_flush_connection_transients (resmgr, entries);
+    g_hash_table_unref (entries);
+    g_debug ("%s: done", __func__);
+}
 /*
  * This function is invoked when a connection is removed from the
  * ConnectionManager. This is if how we know a connection has been closed.
  * When a connection is removed, we need to remove all associated sessions
- * from the TPM.
+ * and resident transient objects from the TPM, see
+ * resource_manager_remove_connections.
  */
 void
 resource_manager_remove_connection (ResourceManager *resource_manager,
                                     Connection *connection)
 {
-    connection_close_data_t connection_close_data = {
-        .connection = connection,
-        .resource_manager = resource_manager,
-    };
+    resource_manager_remove_connections (resource_manager, &connection, 1);
+}
+/*
+ * Remove 'connection' with the other connections closed since the last
+ * call to resource_manager_remove_pending. Removals pile up while the
+ * ConnectionManager reports clients going away, e.g. when a service with
+ * many connections restarts, and are done in one go before the next
+ * command runs.
+ */
+void
+resource_manager_queue_removal (ResourceManager *resmgr,
+                                Connection      *connection)
+{
+    g_ptr_array_add (resmgr->removals, g_object_ref (connection));
+}
+/*
+ * Remove the connections queued by resource_manager_queue_removal.
+ * Returns the number of connections removed.
+ */
+guint
+resource_manager_remove_pending (ResourceManager *resmgr)
+{
+    guint count = resmgr->removals->len;
 
-    g_info ("%s: flushing session contexts", __func__);
-    session_list_foreach (resource_manager->session_list,
-                          connection_close_session_callback,
-                          &connection_close_data);
-    g_debug ("%s: done", __func__);
+    if (count == 0) {
+        return 0;
+    }
+    resource_manager_remove_connections (resmgr,
+                                         (Connection**)resmgr->removals->pdata,
+                                         count);
+    g_ptr_array_set_size (resmgr->removals, 0);
+    return count;
+}
+/*
+ * This function is invoked when a client hands a connection it kept open
+ * over to a new client (the ResetConnection method). Everything the
+ * previous client had is dropped like it is when the connection is
+ * removed, including the saved contexts of its transient objects, so the
+ * new client starts with an empty set of virtual handles.
+ */
+void
+resource_manager_reset_connection (ResourceManager *resmgr,
+                                   Connection      *connection)
+{
+    HandleMap *map;
+    GList *keys, *item;
+
+    resource_manager_remove_connection (resmgr, connection);
+    map = connection_peek_trans_map (connection);
+    keys = handle_map_get_keys (map);
+    for (item = keys; item != NULL; item = item->next) {
+        handle_map_remove (map, GPOINTER_TO_UINT (item->data));
+    }
+    g_debug ("%s: dropped %u virtual handles", __func__,
+             g_list_length (keys));
+    g_list_free (keys);
+}
+/*
+ * Size the limits on resident transient objects and loaded sessions from
+ * the capacity reported by the TPM:
+ * - TPM2_PT_HR_TRANSIENT_MIN: the number of transient objects the TPM is
+ *   guaranteed to be able to hold at the same time
+ * - TPM2_PT_HR_LOADED_MIN: the same for loaded sessions
+ * - TPM2_PT_ACTIVE_SESSIONS_MAX: the total number of sessions, loaded or
+ *   saved, so no more than this many can ever be loaded either
+ * - TPM2_PT_CONTEXT_GAP_MAX: the largest distance allowed between the
+ *   oldest saved session and the context counter
+ * If the TPM can't tell us (the fixed properties aren't available) we keep
+ * the defaults set in the instance init function, which are the minimums
+ * required by the spec.
+ */
+void
+resource_manager_init_limits (ResourceManager *resmgr)
+{
+    guint32 value;
+
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_HR_TRANSIENT_MIN,
+                                 &value) == TSS2_RC_SUCCESS && value > 0)
+    {
+        resmgr->transient_max = value;
+    }
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_HR_LOADED_MIN,
+                                 &value) == TSS2_RC_SUCCESS && value > 0)
+    {
+        resmgr->session_max = value;
+    }
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_ACTIVE_SESSIONS_MAX,
+                                 &value) == TSS2_RC_SUCCESS && value > 0)
+    {
+        resmgr->session_max = MIN (resmgr->session_max, value);
+    }
+    if (tpm2_get_fixed_property (resmgr->tpm2,
+                                 TPM2_PT_CONTEXT_GAP_MAX,
+                                 &value) == TSS2_RC_SUCCESS && value > 0)
+    {
+        resmgr->gap_max = value;
+    }
+    g_info ("%s: up to %u transient objects and %u sessions will be kept "
+            "loaded", __func__, resmgr->transient_max, resmgr->session_max);
+}
+/*
+ * MessageQueueKeyFunc used to schedule the messages in the RM input queue
+ * fairly between connections: Tpm2Commands are keyed on the Connection
+ * that sent them. CONNECTION_REMOVED messages are keyed on the Connection
+ * being removed so they're processed after the commands already queued by
+ * that connection. All other messages share the NULL key.
+ */
+gpointer
+resource_manager_message_key (GObject *obj)
+{
+    GObject *object;
+
+    if (IS_TPM2_COMMAND (obj)) {
+        /* only the address is used, the command holds a reference */
+        return tpm2_command_peek_connection (TPM2_COMMAND (obj));
+    }
+    if (IS_CONTROL_MESSAGE (obj)) {
+        object = control_message_get_object (CONTROL_MESSAGE (obj));
+        if (object != NULL && IS_CONNECTION (object)) {
+            return object;
+        }
+    }
+    return NULL;
+}
+/*
+ * MessageQueueClassFunc mapping the messages in the RM input queue to the
+ * priority class of the Connection they're keyed on. Messages that aren't
+ * associated with a Connection like CHECK_CANCEL get the highest priority.
+ */
+guint
+resource_manager_message_class (GObject *obj)
+{
+    gpointer key = resource_manager_message_key (obj);
+
+    if (key == NULL) {
+        return TABRMD_PRIORITY_INTERACTIVE;
+    }
+    return connection_get_priority (CONNECTION (key));
+}
+/*
+ * MessageQueueUrgentFunc for the RM input queue: CONNECTION_REMOVED and
+ * CHECK_CANCEL don't wait behind the commands of other connections. The
+ * commands queued by a connection being removed have already been dropped
+ * by resource_manager_enqueue, so its state is cleaned up right away.
+ */
+gboolean
+resource_manager_message_urgent (GObject *obj)
+{
+    ControlCode code;
+
+    if (!IS_CONTROL_MESSAGE (obj)) {
+        return FALSE;
+    }
+    code = control_message_get_code (CONTROL_MESSAGE (obj));
+    return code == CONNECTION_REMOVED || code == CHECK_CANCEL;
+}
+/*
+ * MessageQueueEstimateFunc for the RM input queue: the expected execution
+ * time of a Tpm2Command is the running average the Tpm2 keeps for its
+ * command code. Control messages don't touch the TPM.
+ */
+guint64
+resource_manager_message_estimate (GObject  *obj,
+                                   gpointer  user_data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (user_data);
+
+    if (IS_TPM2_COMMAND (obj)) {
+        return tpm2_get_exec_estimate (resmgr->tpm2,
+                                       tpm2_command_get_code (TPM2_COMMAND (obj)));
+    }
+    return 1;
+}
+/*
+ * MessageQueueShareFunc for the RM input queue once the TPM time is shared
+ * out by UID: the commands of a connection belong to the share of the
+ * user it runs as, weighted as given with --uid-weight. Control messages
+ * belong to no share.
+ */
+gboolean
+resource_manager_message_share (GObject  *obj,
+                                guint32  *share,
+                                guint    *weight,
+                                gpointer  user_data)
+{
+    ResourceManager *resmgr = RESOURCE_MANAGER (user_data);
+    gpointer key = resource_manager_message_key (obj);
+
+    if (key == NULL || !IS_TPM2_COMMAND (obj)) {
+        return FALSE;
+    }
+    *share = connection_get_uid (CONNECTION (key));
+    *weight = GPOINTER_TO_UINT (g_hash_table_lookup (resmgr->uid_weights,
+                                                     GUINT_TO_POINTER (*share)));
+    if (*weight == 0) {
+        *weight = TABRMD_UID_WEIGHT_DEFAULT;
+    }
+    return TRUE;
+}
+/*
+ * Parse the UID:WEIGHT pairs given with --uid-weight into a GHashTable
+ * mapping each UID to its weight. Returns NULL if a pair is malformed or
+ * its weight is out of range.
+ */
+GHashTable*
+resource_manager_parse_uid_weights (gchar * const *specs)
+{
+    GHashTable *weights;
+    guint64 uid, weight;
+    gchar *end;
+    guint i;
+
+    weights = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; specs [i] != NULL; ++i) {
+        uid = g_ascii_strtoull (specs [i], &end, 10);
+        if (end == specs [i] || *end != ':' || uid >= RATE_LIMITER_UID_NONE) {
+            goto bad;
+        }
+        weight = g_ascii_strtoull (end + 1, &end, 10);
+        if (*end != '\0' || weight == 0 || weight > TABRMD_UID_WEIGHT_MAX) {
+            goto bad;
+        }
+        g_hash_table_insert (weights,
+                             GUINT_TO_POINTER ((guint)uid),
+                             GUINT_TO_POINTER ((guint)weight));
+    }
+    return weights;
+bad:
+    g_warning ("%s: bad UID weight \"%s\"", __func__, specs [i]);
+    g_hash_table_unref (weights);
+    return NULL;
+}
+/*
+ * Share the TPM time out between the users the clients run as in
+ * proportion to 'weights', see message_queue_set_share_func. The TPM time
+ * of each command is charged to its user once it's done. This must be
+ * called before the first connection is created.
+ */
+void
+resource_manager_set_uid_weights (ResourceManager *resmgr,
+                                  GHashTable      *weights)
+{
+    g_clear_pointer (&resmgr->uid_weights, g_hash_table_unref);
+    resmgr->uid_weights = g_hash_table_ref (weights);
+    message_queue_set_share_func (resmgr->in_queue,
+                                  resource_manager_message_share,
+                                  resmgr);
 }
 /**
  * Create new ResourceManager object.
@@ -1752,12 +7257,25 @@ ResourceManager*
 resource_manager_new (Tpm2    *tpm2,
                       SessionList     *session_list)
 {
+    ResourceManager *resmgr;
+
     if (tpm2 == NULL)
         g_error ("resource_manager_new passed NULL Tpm2");
-    MessageQueue *queue = message_queue_new ();
-    return RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
-                                           "queue-in",        queue,
-                                           "tpm2", tpm2,
-                                           "session-list",    session_list,
-                                           NULL));
+    MessageQueue *queue = message_queue_new_fair (resource_manager_message_key,
+                                                  NULL,
+                                                  SCHEDULER_QUANTUM);
+    message_queue_set_class_func (queue,
+                                  resource_manager_message_class,
+                                  SCHEDULER_BATCH_SHARE);
+    message_queue_set_urgent_func (queue, resource_manager_message_urgent);
+    resmgr = RESOURCE_MANAGER (g_object_new (TYPE_RESOURCE_MANAGER,
+                                             "queue-in",        queue,
+                                             "tpm2", tpm2,
+                                             "session-list",    session_list,
+                                             NULL));
+    message_queue_set_estimate_func (queue,
+                                     resource_manager_message_estimate,
+                                     resmgr);
+    resource_manager_init_limits (resmgr);
+    return resmgr;
 }
@@ -12,14 +12,86 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "tpm2.h"
+#include "cap-cache.h"
+#include "command-stats.h"
 #include "connection-manager.h"
+#include "control-message.h"
+#include "flight-recorder.h"
+#include "key-pool.h"
 #include "message-queue.h"
+#include "context-store.h"
+#include "entropy-pool.h"
+#include "nv-cache.h"
+#include "object-share.h"
+#include "pcr-cache.h"
+#include "primary-cache.h"
 #include "session-list.h"
+#include "session-pool.h"
 #include "sink-interface.h"
+#include "stats-segment.h"
+#include "test-cache.h"
 #include "thread.h"
+#include "trace-buffer.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Maximum number of messages the RM thread takes from its input queue per
+ * wakeup. Messages that arrive while a batch is processed are scheduled
+ * with the next batch so this is kept small.
+ */
+#define RESOURCE_MANAGER_BATCH_MAX 4
+/*
+ * Commands the TPM answers with TPM2_RC_RETRY, TPM2_RC_YIELDED or
+ * TPM2_RC_TESTING are sent again up to this many times, waiting twice as
+ * long before each retry starting from the first delay up to the last.
+ */
+#define RESOURCE_MANAGER_RETRY_MAX 8
+#define RESOURCE_MANAGER_RETRY_DELAY_FIRST_US 500
+#define RESOURCE_MANAGER_RETRY_DELAY_MAX_US (100 * 1000)
+/*
+ * Handles left behind by a closed connection that are flushed from the
+ * TPM after each message the RM thread processes. The rest wait for the
+ * RM to be idle or to need the room.
+ */
+#define RESOURCE_MANAGER_FLUSHES_PER_MESSAGE 1
+/*
+ * Closed connections kept for a client to resume with --resume-ms. Once
+ * there are this many the oldest is dropped to make room.
+ */
+#define RESOURCE_MANAGER_PARKED_MAX 16
+/*
+ * Shared objects can be made persistent with --promote-max, at most this
+ * many, the one in slot 'i' at RESOURCE_MANAGER_PROMOTE_BASE + i: a range
+ * at the top of the owner's persistent handles that must be left to us.
+ * Once every interval those used at least RESOURCE_MANAGER_PROMOTE_USES
+ * times in it are promoted, the hottest first, and promoted ones used
+ * less than half as often are evicted from NV again.
+ */
+#define RESOURCE_MANAGER_PROMOTE_MAX 16
+#define RESOURCE_MANAGER_PROMOTE_BASE 0x817f0000
+#define RESOURCE_MANAGER_PROMOTE_INTERVAL_US (10 * G_USEC_PER_SEC)
+#define RESOURCE_MANAGER_PROMOTE_USES 64
+
+/*
+ * An object or session of a closed connection waiting to be flushed from
+ * the TPM, 'loaded' if it takes one of the TPM's slots for loaded
+ * contexts rather than only a session handle.
+ */
+typedef struct {
+    TPM2_HANDLE       handle;
+    gboolean          loaded;
+} resource_manager_flush_t;
+
+/*
+ * A closed connection whose objects and sessions are kept until
+ * 'expires', in monotonic time, for a new connection to take over.
+ */
+typedef struct {
+    Connection       *connection;
+    gint64            expires;
+} resource_manager_parked_t;
+
 typedef struct _ResourceManagerClass {
     ThreadClass      parent;
 } ResourceManagerClass;
@@ -30,6 +102,145 @@ typedef struct _ResourceManager {
     MessageQueue     *in_queue;
     Sink             *sink;
     SessionList      *session_list;
+    /*
+     * the sessions we loaded, saved or removed ones are pruned when the
+     * list is walked, and the SessionList inserts it has seen
+     */
+    GSList           *loaded_sessions;
+    guint64           loaded_inserts;
+    GQueue           *transient_lru;
+    /*
+     * resource_manager_flush_t for each handle waiting to be flushed, and
+     * how many of them are transient objects and loaded sessions
+     */
+    GArray           *flush_queue;
+    guint             flush_transients;
+    guint             flush_sessions;
+    guint             transient_max;
+    guint             session_max;
+    Connection       *owner;
+    guint64           context_counter;
+    /* TPM resets seen, see resource_manager_tpm_reset */
+    guint             reset_epoch;
+    guint32           gap_max;
+    PrimaryCache     *primary_cache;
+    /* PCR_Read responses, NULL when disabled */
+    PcrCache         *pcr_cache;
+    /* GetCapability responses for TPM2_PT_VAR, NULL when disabled */
+    CapCache         *cap_cache;
+    /* NV_Read responses for immutable NV indices, NULL when disabled */
+    NvCache          *nv_cache;
+    /* TestParms and GetTestResult responses, NULL when disabled */
+    TestCache        *test_cache;
+    /* random bytes for GetRandom, refilled when idle, NULL when disabled */
+    EntropyPool      *entropy_pool;
+    /* objects from Load shared between connections, NULL when disabled */
+    ObjectShare      *object_share;
+    /* HMAC sessions started when idle, NULL when disabled */
+    SessionPool      *session_pool;
+    /* keys from Create made when idle, NULL when disabled */
+    KeyPool          *key_pool;
+    /* where the contexts of transient objects are kept, NULL for the heap */
+    ContextStore     *context_store;
+    /*
+     * the kernel resource manager device with --kernel-rm, NULL if we
+     * swap contexts ourselves, and the Tpm2 each connection has on it.
+     * The table is only changed by the RM thread, under the
+     * kernel_tpms_mutex since resource_manager_cancel looks in it.
+     */
+    gchar            *kernel_rm;
+    GHashTable       *kernel_tpms;
+    GMutex            kernel_tpms_mutex;
+    /*
+     * the persistent handles and NV indices in the TPM for GetCapability,
+     * NULL until asked for and after a command that may change them
+     */
+    GArray           *persistent_handles;
+    GArray           *nv_handles;
+    /* HANDOVER message waiting for the input queue to drain */
+    ControlMessage   *handover;
+    /* latency histograms for the commands we process, NULL if not kept */
+    CommandStats     *command_stats;
+    /* the last commands we processed, NULL if not kept */
+    FlightRecorder   *flight_recorder;
+    /* spans of the phases and the context swaps, NULL if not traced */
+    TraceBuffer      *trace_buffer;
+    /* commands taking longer than this are logged, 0 if not */
+    guint             slow_command_ms;
+    /*
+     * the statistics segment we publish our counters and gauges in, NULL
+     * if there's none, and the backend record in it that's ours, plus the
+     * context swaps done so far for it
+     */
+    stats_segment_t  *stats_segment;
+    guint             stats_backend;
+    guint64           stats_swaps [COMMAND_STATS_COUNTERS];
+    /* calibrate the TPM when the thread starts, see tpm2_calibrate */
+    gboolean          calibrate;
+    /* transient objects each connection may pin resident, 0 if none */
+    guint             pin_max;
+    /* milliseconds a connection may lease the TPM for, 0 if none */
+    guint             lease_max_ms;
+    /*
+     * milliseconds a closed connection is kept for a client to resume it,
+     * 0 if they're removed right away, and the ones kept, oldest first
+     */
+    guint             resume_ms;
+    GQueue           *parked;
+    /*
+     * closed connections waiting to be removed together before the next
+     * command, see resource_manager_queue_removal
+     */
+    GPtrArray        *removals;
+    /*
+     * the connection of the command being processed, it's charged for the
+     * context operations done for that command
+     */
+    Connection       *processing;
+    TPM2_CC           processing_code;
+    /* contexts loaded, saved and flushed for the command being processed */
+    guint             processing_swaps;
+    /*
+     * commands left in the batch after the one being processed and the
+     * next batch, taken while the TPM executes the last one
+     */
+    guint             batch_remaining;
+    GObject          *lookahead [RESOURCE_MANAGER_BATCH_MAX];
+    guint             lookahead_count;
+    /*
+     * the next message to process, the command looked up ahead of time
+     * and the HandleMapEntry for each of its transient handles
+     */
+    GObject          *batch_next;
+    Tpm2Command      *prepared;
+    HandleMapEntry   *prepared_entries [TPM2_COMMAND_MAX_HANDLES];
+    /*
+     * the connection that asked for its next commands to run as a group
+     * with TSS2_TABRMD_CC_GROUP and how many of them are still to come
+     */
+    Connection       *group_owner;
+    guint             group_left;
+    /*
+     * when the group owner's lease from TSS2_TABRMD_CC_LEASE started and
+     * when it runs out, in monotonic time, 0 if the group isn't a lease
+     */
+    gint64            lease_start;
+    gint64            lease_end;
+    /*
+     * the shared objects made persistent, NULL for the free slots of the
+     * 'promote_max' we may use, 0 if none, the owner password for
+     * EvictControl and when the promoted objects are next reviewed, in
+     * monotonic time
+     */
+    HandleMapEntry   *promoted [RESOURCE_MANAGER_PROMOTE_MAX];
+    guint             promote_max;
+    TPM2B_AUTH        promote_auth;
+    gint64            promote_next;
+    /*
+     * the weight of the share of TPM time of each UID given one with
+     * --uid-weight, NULL if the TPM time isn't shared out by UID
+     */
+    GHashTable       *uid_weights;
 } ResourceManager;
 
 #define TYPE_RESOURCE_MANAGER              (resource_manager_get_type ())
@@ -42,6 +253,25 @@ typedef struct _ResourceManager {
 GType                 resource_manager_get_type       (void);
 ResourceManager*      resource_manager_new            (Tpm2 *tpm2,
                                                        SessionList  *session_list);
+gpointer              resource_manager_message_key    (GObject *obj);
+guint                 resource_manager_message_class  (GObject *obj);
+gboolean              resource_manager_message_urgent (GObject *obj);
+guint64               resource_manager_message_estimate (GObject  *obj,
+                                                         gpointer  user_data);
+gboolean              resource_manager_message_share  (GObject  *obj,
+                                                       guint32  *share,
+                                                       guint    *weight,
+                                                       gpointer  user_data);
+GHashTable*           resource_manager_parse_uid_weights (gchar * const *specs);
+void                  resource_manager_set_uid_weights (ResourceManager *resmgr,
+                                                        GHashTable      *weights);
+void                  resource_manager_set_promotion (ResourceManager  *resmgr,
+                                                      guint             max,
+                                                      const TPM2B_AUTH *auth);
+guint                 resource_manager_promote       (ResourceManager *resmgr);
+void                  resource_manager_demote_all    (ResourceManager *resmgr);
+TSS2_RC               resource_manager_promoted_check (ResourceManager *resmgr,
+                                                       Tpm2Command     *command);
 void                  resource_manager_process_tpm2_command (ResourceManager   *resmgr,
                                                              Tpm2Command       *command);
 void                  resource_manager_flushsave_context (gpointer              entry,
@@ -53,10 +283,126 @@ TSS2_RC               resource_manager_virt_to_phys      (ResourceManager *resmg
                                                           Tpm2Command     *command,
                                                           HandleMapEntry  *entry,
                                                           guint8           handle_number);
+void                  resource_manager_init_limits    (ResourceManager *resmgr);
+TSS2_RC               resource_manager_cancel         (ResourceManager *resmgr,
+                                                       Connection      *connection);
+void                  resource_manager_calibrate (ResourceManager *resmgr);
+guint                 resource_manager_evict_transients (ResourceManager *resmgr,
+                                                         guint            needed,
+                                                         GSList          *pinned);
+void                  resource_manager_note_sequence  (ResourceManager *resmgr,
+                                                       guint64          sequence);
+guint                 resource_manager_regap_sessions (ResourceManager *resmgr);
+void                  resource_manager_plan_batch     (ResourceManager *resmgr,
+                                                       GObject        **objs,
+                                                       guint            count);
+void                  resource_manager_idle           (ResourceManager *resmgr);
+void                  resource_manager_count          (ResourceManager *resmgr,
+                                                       CommandStatsCounter counter);
+Tpm2Response*         resource_manager_read_public    (ResourceManager *resmgr,
+                                                       Tpm2Command     *command);
+void                  resource_manager_cache_public   (ResourceManager *resmgr,
+                                                       Tpm2Command     *command,
+                                                       Tpm2Response    *response,
+                                                       HandleMapEntry  *entry);
+Tpm2Response*         resource_manager_primary_cache_load (ResourceManager *resmgr,
+                                                           Tpm2Command     *command);
+void                  resource_manager_primary_cache_update (ResourceManager *resmgr,
+                                                             Tpm2Command     *command,
+                                                             Tpm2Response    *response);
+Tpm2Response*         resource_manager_pcr_cache_lookup (ResourceManager *resmgr,
+                                                         Tpm2Command     *command);
+void                  resource_manager_pcr_cache_update (ResourceManager *resmgr,
+                                                         Tpm2Command     *command,
+                                                         Tpm2Response    *response);
+Tpm2Response*         resource_manager_cap_cache_lookup (ResourceManager *resmgr,
+                                                         Tpm2Command     *command);
+void                  resource_manager_cap_cache_update (ResourceManager *resmgr,
+                                                         Tpm2Command     *command,
+                                                         Tpm2Response    *response);
+Tpm2Response*         resource_manager_nv_cache_lookup  (ResourceManager *resmgr,
+                                                         Tpm2Command     *command);
+void                  resource_manager_nv_cache_update  (ResourceManager *resmgr,
+                                                         Tpm2Command     *command,
+                                                         Tpm2Response    *response);
+Tpm2Response*         resource_manager_test_cache_lookup (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+void                  resource_manager_test_cache_update (ResourceManager *resmgr,
+                                                          Tpm2Command     *command,
+                                                          Tpm2Response    *response);
+Tpm2Response*         resource_manager_entropy_pool_take (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+guint                 resource_manager_entropy_pool_fill (ResourceManager *resmgr);
+Tpm2Response*         resource_manager_pin_transient (ResourceManager *resmgr,
+                                                      Tpm2Command     *command);
+Tpm2Response*         resource_manager_begin_group   (ResourceManager *resmgr,
+                                                      Tpm2Command     *command);
+Tpm2Response*         resource_manager_lease         (ResourceManager *resmgr,
+                                                      Tpm2Command     *command);
+Tpm2Response*         resource_manager_hash          (ResourceManager *resmgr,
+                                                      Tpm2Command     *command);
+Tpm2Response*         resource_manager_nv            (ResourceManager *resmgr,
+                                                      Tpm2Command     *command);
+guint                 resource_manager_flush_deferred (ResourceManager *resmgr,
+                                                       guint            max);
+gboolean              resource_manager_run_group     (ResourceManager *resmgr,
+                                                      GObject        **objs,
+                                                      guint            start,
+                                                      guint           *count);
+Tpm2Response*         resource_manager_object_share_load (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+void                  resource_manager_object_share_update (ResourceManager *resmgr,
+                                                            Tpm2Command     *command,
+                                                            Tpm2Response    *response,
+                                                            GSList         **transient_slist);
+void                  resource_manager_handle_list_update (ResourceManager *resmgr,
+                                                           Tpm2Command     *command);
+Tpm2Response*         resource_manager_session_pool_take (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+guint                 resource_manager_session_pool_fill (ResourceManager *resmgr);
+Tpm2Response*         resource_manager_key_pool_take     (ResourceManager *resmgr,
+                                                          Tpm2Command     *command);
+guint                 resource_manager_key_pool_fill     (ResourceManager *resmgr);
+void                  resource_manager_note_loaded_session (ResourceManager *resmgr,
+                                                            SessionEntry    *entry);
 void                  resource_manager_enqueue           (Sink            *sink,
                                                           GObject         *obj);
+void                  resource_manager_reset_connection (ResourceManager *resmgr,
+                                                         Connection      *connection);
+void                  resource_manager_handover       (ResourceManager *resmgr);
+gboolean              resource_manager_check_reset    (ResourceManager *resmgr);
+void                  resource_manager_tpm_reset      (ResourceManager *resmgr);
 void                  resource_manager_remove_connection (ResourceManager *resource_manager,
                                                           Connection      *connection);
+void                  resource_manager_remove_connections (ResourceManager *resmgr,
+                                                           Connection     **connections,
+                                                           guint            count);
+void                  resource_manager_queue_removal  (ResourceManager *resmgr,
+                                                       Connection      *connection);
+guint                 resource_manager_remove_pending (ResourceManager *resmgr);
+gboolean              resource_manager_park_connection (ResourceManager *resmgr,
+                                                        Connection      *connection);
+gboolean              resource_manager_resume_connection (ResourceManager *resmgr,
+                                                          Connection      *connection);
+guint                 resource_manager_expire_parked  (ResourceManager *resmgr,
+                                                       gint64           now);
 TSS2_RC               get_cap_post_process (Tpm2Response *resp);
+void                  cap_data_post_process (TPMS_CAPABILITY_DATA *cap_data);
+gboolean              get_cap_fixed (Tpm2                 *tpm2,
+                                     TPM2_CAP              cap,
+                                     UINT32                prop,
+                                     UINT32                count,
+                                     TPMS_CAPABILITY_DATA *cap_data,
+                                     TPMI_YES_NO          *more_data);
+gboolean              get_cap_handles_list (GArray               *handles,
+                                            TPM2_HANDLE           prop,
+                                            UINT32                count,
+                                            TPMS_CAPABILITY_DATA *cap_data);
+Tpm2Response*         command_preprocess (Tpm2                 *tpm2,
+                                          Tpm2Command          *command);
+Tpm2Response*         build_cap_response (Connection           *connection,
+                                          TPMA_CC               attributes,
+                                          TPMS_CAPABILITY_DATA *cap_data,
+                                          TPMI_YES_NO           more_data);
 G_END_DECLS
 #endif /* RESOURCE_MANAGER_H */
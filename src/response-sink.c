@@ -4,18 +4,55 @@
  * All rights reserved.
  */
 #include <errno.h>
+#include <gio/gio.h>
 #include <glib.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <string.h>
 
 #include "connection.h"
 #include "sink-interface.h"
 #include "response-sink.h"
 #include "control-message.h"
+#include "probes.h"
+#include "shm-ring.h"
+#include "tabrmd-defaults.h"
+#include "tpm2-header.h"
 #include "tpm2-response.h"
 #include "util.h"
 
 #define RESPONSE_SINK_TIMEOUT 1e6
+/*
+ * Maximum number of responses the ResponseSink thread takes from its
+ * input queue per wakeup.
+ */
+#define RESPONSE_SINK_BATCH_MAX 16
+/*
+ * While responses are waiting for a client socket to become writable the
+ * ResponseSink thread wakes up this often (in microseconds) to retry them.
+ */
+#define RESPONSE_SINK_FLUSH_INTERVAL_US 1000
+/* how long pending responses are given to be written before a handover */
+#define RESPONSE_SINK_DRAIN_US G_USEC_PER_SEC
+
+/*
+ * Responses for a connection that couldn't be written without blocking.
+ * 'offset' is the number of bytes of the response at the head of the
+ * queue that have already been written and 'bytes' is the number of bytes
+ * still to be written for all responses in the queue.
+ */
+typedef struct {
+    Connection *connection;
+    GQueue      responses;
+    gsize       offset;
+    gsize       bytes;
+} outbound_t;
+
+typedef enum {
+    SEND_DONE,
+    SEND_BLOCKED,
+    SEND_FAILED,
+} send_result_t;
 
 static void response_sink_sink_interface_init   (gpointer g_iface);
 
@@ -30,6 +67,10 @@ G_DEFINE_TYPE_WITH_CODE (
 enum {
     PROP_0,
     PROP_IN_QUEUE,
+    PROP_MAX_OUTBOUND,
+    PROP_COMMAND_STATS,
+    PROP_COMMAND_RECORDER,
+    PROP_TRACE_BUFFER,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -66,6 +107,22 @@ response_sink_set_property (GObject        *object,
         g_debug ("  setting PROP_IN_QUEUE");
         self->in_queue = g_value_get_object (value);
         break;
+    case PROP_MAX_OUTBOUND:
+        self->max_outbound = g_value_get_uint (value);
+        g_debug ("  setting PROP_MAX_OUTBOUND to %u", self->max_outbound);
+        break;
+    case PROP_COMMAND_STATS:
+        g_clear_object (&self->command_stats);
+        self->command_stats = g_value_dup_object (value);
+        break;
+    case PROP_COMMAND_RECORDER:
+        g_clear_object (&self->command_recorder);
+        self->command_recorder = g_value_dup_object (value);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_clear_object (&self->trace_buffer);
+        self->trace_buffer = g_value_dup_object (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -86,6 +143,18 @@ response_sink_get_property (GObject     *object,
     case PROP_IN_QUEUE:
         g_value_set_object (value, self->in_queue);
         break;
+    case PROP_MAX_OUTBOUND:
+        g_value_set_uint (value, self->max_outbound);
+        break;
+    case PROP_COMMAND_STATS:
+        g_value_set_object (value, self->command_stats);
+        break;
+    case PROP_COMMAND_RECORDER:
+        g_value_set_object (value, self->command_recorder);
+        break;
+    case PROP_TRACE_BUFFER:
+        g_value_set_object (value, self->trace_buffer);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
         break;
@@ -105,14 +174,88 @@ response_sink_dispose (GObject *obj)
     if (thread->thread_id != 0)
         g_error ("%s: thread running, cancel first", __func__);
     g_clear_object (&sink->in_queue);
+    g_clear_pointer (&sink->outbound, g_hash_table_unref);
+    g_clear_object (&sink->command_stats);
+    g_clear_object (&sink->command_recorder);
+    g_clear_object (&sink->trace_buffer);
     G_OBJECT_CLASS (response_sink_parent_class)->dispose (obj);
 }
 void* response_sink_thread (void *data);
+/*
+ * Add the time from the ResourceManager queueing the response to it being
+ * written out to the latency histograms and the trace. This is called
+ * once the last byte of the response is handed to the client.
+ */
 static void
-response_sink_init (ResponseSink *response)
+response_sink_note_written (ResponseSink *sink,
+                            Tpm2Response *response)
 {
-    UNUSED_PARAM(response);
-    /* noop */
+    Connection *connection;
+    gint64 queued = tpm2_response_get_time_queued (response), now;
+
+    TABRMD_PROBE3 (response_write,
+                   tpm2_response_peek_connection (response),
+                   tpm2_response_get_command_code (response),
+                   tpm2_response_get_size (response));
+
+    if (queued == 0) {
+        return;
+    }
+    now = g_get_monotonic_time ();
+    if (sink->trace_buffer != NULL) {
+        connection = tpm2_response_peek_connection (response);
+        trace_buffer_add (sink->trace_buffer,
+                          TRACE_WRITE,
+                          queued,
+                          now,
+                          connection != NULL ?
+                              connection_get_serial (connection) : 0,
+                          tpm2_response_get_command_code (response));
+    }
+    if (sink->command_stats != NULL) {
+        command_stats_add (sink->command_stats,
+                           tpm2_response_get_command_code (response),
+                           COMMAND_STATS_WRITE,
+                           now - queued);
+    }
+}
+/*
+ * Count a response as answered for the connection it belongs to, which is
+ * a logical connection for responses on a multiplexed connection, and
+ * drop it.
+ */
+static void
+response_done (Tpm2Response *response)
+{
+    Connection *connection = tpm2_response_get_connection (response);
+
+    connection_command_done (connection);
+    g_object_unref (connection);
+    g_object_unref (response);
+}
+/*
+ * Drop the responses still waiting to be written for a connection. They
+ * count as answered so the connection's queued count stays balanced.
+ */
+static void
+outbound_free (gpointer data)
+{
+    outbound_t *outbound = (outbound_t*)data;
+    Tpm2Response *response;
+
+    while ((response = g_queue_pop_head (&outbound->responses)) != NULL) {
+        response_done (response);
+    }
+    g_object_unref (outbound->connection);
+    g_free (outbound);
+}
+static void
+response_sink_init (ResponseSink *sink)
+{
+    sink->outbound = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            outbound_free);
 }
 static void
 response_sink_unblock (Thread *self)
@@ -152,6 +295,37 @@ response_sink_class_init (ResponseSinkClass *klass)
                              "Input MessageQueue.",
                              G_TYPE_OBJECT,
                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_MAX_OUTBOUND] =
+        g_param_spec_uint ("max-outbound",
+                           "maximum outbound bytes",
+                           "Maximum number of response bytes a connection "
+                           "may have waiting to be written before it's "
+                           "disconnected",
+                           TPM_HEADER_SIZE,
+                           G_MAXUINT,
+                           RESPONSE_SINK_OUTBOUND_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT);
+    obj_properties [PROP_COMMAND_STATS] =
+        g_param_spec_object ("command-stats",
+                             "CommandStats object",
+                             "Latency histograms to add the time taken to "
+                             "write responses to, NULL when not kept",
+                             TYPE_COMMAND_STATS,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_COMMAND_RECORDER] =
+        g_param_spec_object ("command-recorder",
+                             "CommandRecorder",
+                             "CommandRecorder the responses are written to, "
+                             "NULL when not recording",
+                             TYPE_COMMAND_RECORDER,
+                             G_PARAM_READWRITE);
+    obj_properties [PROP_TRACE_BUFFER] =
+        g_param_spec_object ("trace-buffer",
+                             "TraceBuffer",
+                             "TraceBuffer the time taken to write responses "
+                             "is traced to, NULL when not tracing",
+                             TYPE_TRACE_BUFFER,
+                             G_PARAM_READWRITE);
     g_object_class_install_properties (object_class,
                                        N_PROPERTIES,
                                        obj_properties);
@@ -176,22 +350,310 @@ response_sink_new ()
                                            NULL));
 }
 
-ssize_t
-response_sink_process_response (Tpm2Response *response)
+/*
+ * Get the GSocket behind a Connection. Returns NULL if the Connection
+ * isn't backed by a socket.
+ */
+static GSocket*
+response_sink_connection_socket (Connection *connection)
+{
+    GIOStream *iostream = connection_get_iostream (connection);
+
+    if (!G_IS_SOCKET_CONNECTION (iostream)) {
+        return NULL;
+    }
+    return g_socket_connection_get_socket (G_SOCKET_CONNECTION (iostream));
+}
+/*
+ * Write as much of 'buffer' past '*offset' to the socket as it takes
+ * without blocking. '*offset' is advanced past the bytes written.
+ */
+static send_result_t
+response_sink_send (GSocket      *socket,
+                    const guint8 *buffer,
+                    gsize         size,
+                    gsize        *offset)
+{
+    GError *error = NULL;
+    gssize written;
+
+    while (*offset < size) {
+        written = g_socket_send_with_blocking (socket,
+                                               (const gchar*)&buffer [*offset],
+                                               size - *offset,
+                                               FALSE,
+                                               NULL,
+                                               &error);
+        if (written < 0) {
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_clear_error (&error);
+                return SEND_BLOCKED;
+            }
+            g_warning ("%s: failed to write to socket: %s",
+                       __func__, error->message);
+            g_clear_error (&error);
+            return SEND_FAILED;
+        }
+        g_debug ("%s: wrote %zd bytes to socket", __func__, written);
+        *offset += (gsize)written;
+    }
+    return SEND_DONE;
+}
+/*
+ * Write a response for 'connection' to 'socket' like response_sink_send.
+ * A response on a logical connection goes out as a single message
+ * prefixed with the tag of its channel: the socket of a multiplexed
+ * connection is a SOCK_SEQPACKET socket so the message is written whole
+ * or not at all.
+ */
+static send_result_t
+response_sink_send_response (GSocket      *socket,
+                             Connection   *connection,
+                             const guint8 *buffer,
+                             gsize         size,
+                             gsize        *offset)
+{
+    guint8 frame [TABRMD_CHANNEL_TAG_SIZE + UTIL_BUF_MAX];
+    guint32 tag = GUINT32_TO_BE (connection_get_channel (connection));
+    gsize frame_offset = 0;
+    send_result_t ret;
+
+    if (connection->parent == NULL) {
+        return response_sink_send (socket, buffer, size, offset);
+    }
+    if (size > UTIL_BUF_MAX) {
+        g_warning ("%s: response of %zu bytes is too large", __func__, size);
+        return SEND_FAILED;
+    }
+    memcpy (frame, &tag, sizeof (tag));
+    memcpy (&frame [TABRMD_CHANNEL_TAG_SIZE], buffer, size);
+    ret = response_sink_send (socket,
+                              frame,
+                              TABRMD_CHANNEL_TAG_SIZE + size,
+                              &frame_offset);
+    if (ret == SEND_DONE) {
+        *offset = size;
+    }
+    return ret;
+}
+/*
+ * A connection whose client isn't reading its responses would make us
+ * buffer without bound. Once it's over the limit we stop trying: the
+ * socket is shut down so the client sees the connection close and the
+ * CommandSource cleans it up like any other disconnect.
+ */
+static void
+response_sink_disconnect (ResponseSink *sink,
+                          outbound_t   *outbound)
+{
+    GSocket *socket = response_sink_connection_socket (outbound->connection);
+    GError *error = NULL;
+
+    g_warning ("%s: connection 0x%" PRIxPTR " has %zu response bytes "
+               "pending, more than the maximum of %u, disconnecting",
+               __func__, (uintptr_t)outbound->connection, outbound->bytes,
+               sink->max_outbound);
+    connection_set_closed (outbound->connection);
+    if (!g_socket_shutdown (socket, TRUE, TRUE, &error)) {
+        g_warning ("%s: failed to shut down socket: %s",
+                   __func__, error->message);
+        g_clear_error (&error);
+    }
+    g_hash_table_remove (sink->outbound, outbound->connection);
+}
+/*
+ * Write a response to the response ring of a connection using the shared
+ * memory transport and ring its doorbell. A client pipelining no more
+ * commands than TABRMD_PIPELINE_MAX always has room in the ring: one that
+ * doesn't is shut down like a connection over its outbound limit.
+ */
+static void
+response_sink_write_shm (Connection   *connection,
+                         const guint8 *buffer,
+                         guint32       size)
 {
-    ssize_t      written = 0;
-    guint32      size    = tpm2_response_get_size (response);
-    guint8      *buffer  = tpm2_response_get_buffer (response);
+    GSocket *socket;
+    GError *error = NULL;
+
+    if (shm_ring_write (&connection_get_shm (connection)->response,
+                        buffer,
+                        size))
+    {
+        shm_doorbell_ring (connection_get_shm_response_fd (connection));
+        return;
+    }
+    g_warning ("%s: no room in response ring for connection 0x%" PRIxPTR
+               ", disconnecting", __func__, (uintptr_t)connection);
+    connection_set_closed (connection);
+    socket = response_sink_connection_socket (connection);
+    if (socket != NULL && !g_socket_shutdown (socket, TRUE, TRUE, &error)) {
+        g_warning ("%s: failed to shut down socket: %s",
+                   __func__, error->message);
+        g_clear_error (&error);
+    }
+}
+/*
+ * Write a response to its client without blocking. If the client socket
+ * can't take all of it, or older responses for the same connection are
+ * still waiting, the response is queued for the connection and written by
+ * response_sink_flush once the socket is writable. This keeps one client
+ * that's slow to read from holding up the responses to everyone else.
+ * Connections using the shared memory transport get their responses
+ * through their response ring instead. Any post processing the RM left to
+ * us is done first.
+ */
+void
+response_sink_process_response (ResponseSink *sink,
+                                Tpm2Response *response)
+{
+    guint32      size;
+    guint8      *buffer;
     Connection  *connection = tpm2_response_get_connection (response);
-    GIOStream   *iostream = connection_get_iostream (connection);
-    GOutputStream *ostream = g_io_stream_get_output_stream (iostream);
+    Connection  *transport = connection_get_transport (connection);
+    outbound_t  *outbound;
+    GSocket     *socket;
+    gsize        offset = 0;
 
+    tpm2_response_post_process (response);
+    size = tpm2_response_get_size (response);
+    buffer = tpm2_response_get_buffer (response);
     g_debug ("%s: writing 0x%x bytes", __func__, size);
     g_debug_bytes (buffer, size, 16, 4);
-    written = write_all (ostream, buffer, size);
+    if (sink->command_recorder != NULL) {
+        command_recorder_add (sink->command_recorder,
+                              COMMAND_RECORD_RESPONSE,
+                              connection_get_serial (connection),
+                              buffer,
+                              size);
+    }
+    if (connection_get_shm (connection) != NULL) {
+        response_sink_write_shm (connection, buffer, size);
+        goto done;
+    }
+    /* responses on logical connections queue up behind their socket */
+    outbound = g_hash_table_lookup (sink->outbound, transport);
+    if (outbound == NULL) {
+        socket = response_sink_connection_socket (connection);
+        if (socket == NULL) {
+            write_all (g_io_stream_get_output_stream (
+                           connection_get_iostream (connection)),
+                       buffer,
+                       size);
+            goto done;
+        }
+        if (response_sink_send_response (socket,
+                                         connection,
+                                         buffer,
+                                         size,
+                                         &offset) != SEND_BLOCKED)
+        {
+            goto done;
+        }
+        g_debug ("%s: socket for connection 0x%" PRIxPTR " would block, "
+                 "queueing %zu bytes", __func__, (uintptr_t)transport,
+                 size - offset);
+        outbound = g_new0 (outbound_t, 1);
+        outbound->connection = g_object_ref (transport);
+        outbound->offset = offset;
+        g_queue_init (&outbound->responses);
+        g_hash_table_insert (sink->outbound, transport, outbound);
+    }
+    g_queue_push_tail (&outbound->responses, g_object_ref (response));
+    outbound->bytes += size - offset;
+    if (outbound->bytes > sink->max_outbound) {
+        response_sink_disconnect (sink, outbound);
+    }
     g_object_unref (connection);
+    return;
+done:
+    response_sink_note_written (sink, response);
+    connection_command_done (connection);
+    g_object_unref (connection);
+}
+/*
+ * Write the queued responses for each connection whose socket is writable
+ * until the socket would block again. Connections with nothing left to
+ * write, and those whose socket failed, are dropped from the table.
+ */
+void
+response_sink_flush (ResponseSink *sink)
+{
+    GHashTableIter iter;
+    outbound_t *outbound;
+    Tpm2Response *response;
+    Connection *connection;
+    GSocket *socket;
+    GIOCondition cond;
+    send_result_t ret;
+    gsize before;
+
+    g_hash_table_iter_init (&iter, sink->outbound);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer*)&outbound)) {
+        socket = response_sink_connection_socket (outbound->connection);
+        cond = g_socket_condition_check (socket, G_IO_OUT | G_IO_ERR | G_IO_HUP);
+        if (cond & (G_IO_ERR | G_IO_HUP)) {
+            g_debug ("%s: socket for connection 0x%" PRIxPTR " hung up, "
+                     "dropping %zu response bytes", __func__,
+                     (uintptr_t)outbound->connection, outbound->bytes);
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+        if (!(cond & G_IO_OUT)) {
+            continue;
+        }
+        ret = SEND_DONE;
+        while ((response = g_queue_peek_head (&outbound->responses)) != NULL) {
+            before = outbound->offset;
+            connection = tpm2_response_get_connection (response);
+            ret = response_sink_send_response (socket,
+                                               connection,
+                                               tpm2_response_get_buffer (response),
+                                               tpm2_response_get_size (response),
+                                               &outbound->offset);
+            g_object_unref (connection);
+            outbound->bytes -= outbound->offset - before;
+            if (ret != SEND_DONE) {
+                break;
+            }
+            g_queue_pop_head (&outbound->responses);
+            outbound->offset = 0;
+            response_sink_note_written (sink, response);
+            response_done (response);
+        }
+        if (ret == SEND_FAILED || g_queue_is_empty (&outbound->responses)) {
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+/*
+ * Get the number of connections with responses waiting to be written.
+ */
+guint
+response_sink_get_pending (ResponseSink *sink)
+{
+    return g_hash_table_size (sink->outbound);
+}
+/*
+ * Write out the responses still waiting before the connections are handed
+ * over. A client that isn't reading gets RESPONSE_SINK_DRAIN_US to catch
+ * up, after that whatever it hasn't read is lost.
+ */
+static void
+response_sink_drain (ResponseSink *sink)
+{
+    gint64 deadline = g_get_monotonic_time () + RESPONSE_SINK_DRAIN_US;
 
-    return written;
+    response_sink_flush (sink);
+    while (g_hash_table_size (sink->outbound) > 0 &&
+           g_get_monotonic_time () < deadline)
+    {
+        g_usleep (RESPONSE_SINK_FLUSH_INTERVAL_US);
+        response_sink_flush (sink);
+    }
+    if (g_hash_table_size (sink->outbound) > 0) {
+        g_warning ("%s: dropping responses for %u connections", __func__,
+                   g_hash_table_size (sink->outbound));
+    }
 }
 
 gboolean
@@ -200,7 +662,6 @@ response_sink_process_control (ResponseSink *sink,
 {
     ControlCode code = control_message_get_code (msg);
 
-    UNUSED_PARAM (sink);
     g_debug ("%s", __func__);
     switch (code) {
     case CHECK_CANCEL:
@@ -208,9 +669,16 @@ response_sink_process_control (ResponseSink *sink,
                  __func__);
         return FALSE;
     case CONNECTION_REMOVED:
-        g_debug ("%s: Received CONNECTION_REMOVED message, nothing to do.",
-                 __func__);
+        g_debug ("%s: Received CONNECTION_REMOVED message, dropping "
+                 "responses still waiting for the connection.", __func__);
+        g_hash_table_remove (sink->outbound,
+                             control_message_get_object (msg));
         return TRUE;
+    case HANDOVER:
+        g_debug ("%s: Received HANDOVER control code, writing pending "
+                 "responses and terminating.", __func__);
+        response_sink_drain (sink);
+        return FALSE;
     default:
         g_warning ("%s: Unknown control code: %d ... ignoring",
                    __func__, code);
@@ -222,22 +690,42 @@ void*
 response_sink_thread (void *data)
 {
     ResponseSink *sink = RESPONSE_SINK (data);
-    GObject *obj;
+    GObject *objs [RESPONSE_SINK_BATCH_MAX] = { NULL, };
     gboolean done = FALSE;
+    guint count, i;
 
     while (!done) {
-        g_debug ("%s: blocking on input queue", __func__);
-        obj = message_queue_dequeue (sink->in_queue);
-        if (IS_TPM2_RESPONSE (obj)) {
-            response_sink_process_response (TPM2_RESPONSE (obj));
-        } else if (IS_CONTROL_MESSAGE (obj)) {
-            gboolean ret =
-                response_sink_process_control (sink, CONTROL_MESSAGE (obj));
-            if (ret == FALSE) {
-                done = TRUE;
+        if (g_hash_table_size (sink->outbound) == 0) {
+            g_debug ("%s: blocking on input queue", __func__);
+            count = message_queue_dequeue_batch (sink->in_queue,
+                                                 objs,
+                                                 RESPONSE_SINK_BATCH_MAX);
+        } else {
+            count = message_queue_timeout_dequeue_batch (
+                        sink->in_queue,
+                        objs,
+                        RESPONSE_SINK_BATCH_MAX,
+                        RESPONSE_SINK_FLUSH_INTERVAL_US);
+        }
+        for (i = 0; i < count; ++i) {
+            if (done) {
+                /* stop requested earlier in this batch */
+            } else if (IS_TPM2_RESPONSE (objs [i])) {
+                response_sink_process_response (sink,
+                                                TPM2_RESPONSE (objs [i]));
+            } else if (IS_CONTROL_MESSAGE (objs [i])) {
+                gboolean ret =
+                    response_sink_process_control (sink,
+                                                   CONTROL_MESSAGE (objs [i]));
+                if (ret == FALSE) {
+                    done = TRUE;
+                }
             }
+            g_clear_object (&objs [i]);
+        }
+        if (!done) {
+            response_sink_flush (sink);
         }
-        g_object_unref (obj);
     }
 
     return NULL;
@@ -10,11 +10,22 @@
 #include <glib-object.h>
 #include <pthread.h>
 
+#include "command-recorder.h"
+#include "command-stats.h"
+#include "control-message.h"
 #include "message-queue.h"
 #include "thread.h"
+#include "tpm2-response.h"
+#include "trace-buffer.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Default for the number of response bytes a connection may have waiting
+ * to be written before the ResponseSink gives up on it and disconnects it.
+ */
+#define RESPONSE_SINK_OUTBOUND_MAX_DEFAULT (256 * 1024)
+
 typedef struct _ResponseSinkClass {
     ThreadClass       parent;
 } ResponseSinkClass;
@@ -27,6 +38,14 @@ typedef struct _ResponseSinkClass {
 typedef struct _ResponseSink {
     Thread             parent_instance;
     MessageQueue      *in_queue;
+    GHashTable        *outbound;
+    guint              max_outbound;
+    /* latency histograms of the ResourceManager feeding us, may be NULL */
+    CommandStats      *command_stats;
+    /* records the responses as they're written, may be NULL */
+    CommandRecorder   *command_recorder;
+    /* traces the time taken to write each response, may be NULL */
+    TraceBuffer       *trace_buffer;
 } ResponseSink;
 
 #define TYPE_RESPONSE_SINK              (response_sink_get_type ())
@@ -38,6 +57,12 @@ typedef struct _ResponseSink {
 
 GType               response_sink_get_type    (void);
 ResponseSink*       response_sink_new         (void);
+void                response_sink_process_response (ResponseSink *sink,
+                                                    Tpm2Response *response);
+gboolean            response_sink_process_control  (ResponseSink   *sink,
+                                                    ControlMessage *msg);
+void                response_sink_flush       (ResponseSink     *sink);
+guint               response_sink_get_pending (ResponseSink     *sink);
 
 G_END_DECLS
 #endif /* RESPONSE_SINK_H */
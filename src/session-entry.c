@@ -9,6 +9,7 @@
 
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
 #include "tpm2-header.h"
 #include "util.h"
 #include "session-entry.h"
@@ -24,6 +25,8 @@ enum {
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/* the empty blob every SessionEntry starts out with */
+static GBytes *session_entry_empty_blob = NULL;
 /*
  * GObject property getter.
  */
@@ -40,7 +43,7 @@ session_entry_get_property (GObject        *object,
         g_value_set_pointer (value, self->connection);
         break;
     case PROP_CONTEXT:
-        g_value_set_pointer (value, &self->context);
+        g_value_set_boxed (value, self->context);
         break;
     case PROP_HANDLE:
         g_value_set_uint (value, session_entry_get_handle (self));
@@ -65,8 +68,11 @@ session_entry_set_property (GObject        *object,
 
     switch (property_id) {
     case PROP_CONNECTION:
-        self->connection = CONNECTION (g_value_get_pointer (value));
-        g_object_ref (self->connection);
+        self->connection = g_value_get_pointer (value);
+        /* abandoned sessions have no connection */
+        if (self->connection != NULL) {
+            g_object_ref (self->connection);
+        }
         break;
     case PROP_CONTEXT:
         g_error ("Cannot set context property.");
@@ -82,17 +88,17 @@ session_entry_set_property (GObject        *object,
     }
 }
 /*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
+ * Both context blobs start out as the shared empty blob so that they're
+ * never NULL.
  */
 static void
 session_entry_init (SessionEntry *entry)
 {
-    UNUSED_PARAM(entry);
-    /* noop */
+    entry->context = g_bytes_ref (session_entry_empty_blob);
+    entry->context_client = g_bytes_ref (session_entry_empty_blob);
 }
 /*
- * Deallocate all associated resources. All are static so we just chain
- * up to the parent like a good GObject.
+ * Drop the reference to the Connection and to the context blobs.
  */
 static void
 session_entry_dispose (GObject *object)
@@ -101,6 +107,8 @@ session_entry_dispose (GObject *object)
 
     g_debug ("%s", __func__);
     g_clear_object (&entry->connection);
+    g_clear_pointer (&entry->context, g_bytes_unref);
+    g_clear_pointer (&entry->context_client, g_bytes_unref);
     G_OBJECT_CLASS (session_entry_parent_class)->dispose (object);
 }
 /*
@@ -116,6 +124,7 @@ session_entry_class_init (SessionEntryClass *klass)
     object_class->dispose = session_entry_dispose;
     object_class->get_property = session_entry_get_property;
     object_class->set_property = session_entry_set_property;
+    session_entry_empty_blob = g_bytes_new (NULL, 0);
 
     obj_properties [PROP_CONNECTION] = 
         g_param_spec_pointer ("connection",
@@ -123,10 +132,11 @@ session_entry_class_init (SessionEntryClass *klass)
                               "Associated Connection.",
                               G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_CONTEXT] =
-        g_param_spec_pointer ("context",
-                              "TPMS_CONTEXT",
-                              "Context blob from TPM.",
-                              G_PARAM_READABLE);
+        g_param_spec_boxed ("context",
+                            "TPMS_CONTEXT",
+                            "Context blob from TPM.",
+                            G_TYPE_BYTES,
+                            G_PARAM_READABLE);
     obj_properties [PROP_HANDLE] =
         g_param_spec_uint ("handle",
                            "TPM2_HANDLE",
@@ -154,27 +164,29 @@ session_entry_new (Connection *connection,
                    TPM2_HANDLE  handle)
 {
     g_debug ("%s", __func__);
+    ALLOC_STATS_ADD (ALLOC_STATS_SESSION, sizeof (SessionEntry));
     return SESSION_ENTRY (g_object_new (TYPE_SESSION_ENTRY,
                                         "connection", connection,
                                         "handle", handle,
                                         NULL));
 }
 /*
- * Access the 'context' member.
- * NOTE: This directly exposes memory from an object instance. The caller
- * must be sure to hold a reference to this object to keep it from being
- * garbage collected while the caller is accessing the context structure.
+ * Access the 'context' member. The GBytes is never NULL but is empty until
+ * a context has been set.
+ * NOTE: No reference is taken on the GBytes returned. The caller must take
+ * its own if it needs the blob to outlive the next call to
+ * session_entry_set_context or the SessionEntry itself.
  * Further this object provides no thread safety ... yet.
  */
-size_buf_t*
+GBytes*
 session_entry_get_context (SessionEntry *entry)
 {
-    return &entry->context;
+    return entry->context;
 }
-size_buf_t*
+GBytes*
 session_entry_get_context_client (SessionEntry *entry)
 {
-    return &entry->context_client;
+    return entry->context_client;
 }
 /*
  * Access the Connection associated with this SessionEntry. The reference
@@ -221,27 +233,117 @@ session_entry_set_state (SessionEntry *entry,
     }
     entry->state = state;
 }
+/*
+ * Return a blob holding 'buf': a new reference to 'other' if it holds the
+ * same bytes, a new blob otherwise. This is how 'context' and
+ * 'context_client' come to share one buffer while they're identical. The
+ * buffer of a new blob comes from the arena of the entry's connection, if
+ * it still has one, so the contexts of a connection sit side by side.
+ */
+static GBytes*
+session_entry_blob_new (SessionEntry  *entry,
+                        GBytes        *other,
+                        const uint8_t *buf,
+                        size_t         size)
+{
+    ConnectionArena *arena = NULL;
+    TPMS_CONTEXT *context;
+
+    if (size != 0 &&
+        g_bytes_get_size (other) == size &&
+        memcmp (g_bytes_get_data (other, NULL), buf, size) == 0)
+    {
+        return g_bytes_ref (other);
+    }
+    if (entry->connection != NULL) {
+        arena = connection_peek_arena (entry->connection);
+    }
+    if (arena == NULL || size == 0) {
+        ALLOC_STATS_ADD (ALLOC_STATS_SESSION, size);
+        return g_bytes_new (buf, size);
+    }
+    context = connection_arena_alloc (arena);
+    memcpy (context, buf, size);
+    return g_bytes_new_with_free_func (context,
+                                       size,
+                                       (GDestroyNotify)connection_arena_free,
+                                       context);
+}
 /*
  * Set the contents of the 'context' blob. This blob holds the TPMS_CONTEXT
  * in its marshalled form (ready to be sent to the TPM in the body of a
- * ContextLoad command). We also copy this same blob to the 'context_client'
- * blob (the TPMS_CONTEXT that we expose to clients) if it has not yet been
- * initialized.
+ * ContextLoad command). The same blob becomes the 'context_client' blob
+ * (the TPMS_CONTEXT that we expose to clients) if it has not yet been
+ * initialized. If the new blob is identical to 'context_client' the two
+ * share one buffer.
  */
 void
 session_entry_set_context (SessionEntry *entry,
                            uint8_t *buf,
                            size_t size)
 {
-    assert (entry != NULL && buf != NULL && size <= SIZE_BUF_MAX);
+    GBytes *context;
+
+    assert (entry != NULL && buf != NULL && size <= sizeof (TPMS_CONTEXT));
 
-    memcpy (entry->context.buf, buf, size);
-    entry->context.size = size;
-    if (entry->context_client.size == 0) {
-        memcpy (entry->context_client.buf, buf, size);
-        entry->context_client.size = size;
+    context = session_entry_blob_new (entry, entry->context_client, buf, size);
+    g_bytes_unref (entry->context);
+    entry->context = context;
+    if (g_bytes_get_size (entry->context_client) == 0) {
+        g_bytes_unref (entry->context_client);
+        entry->context_client = g_bytes_ref (entry->context);
     }
 }
+/*
+ * Set the contents of the 'context_client' blob. This is only needed when
+ * the client copy isn't the first context set, e.g. when the SessionEntry
+ * is recreated from a saved state. Like session_entry_set_context it
+ * shares the buffer of 'context' when the two are identical.
+ */
+void
+session_entry_set_context_client (SessionEntry *entry,
+                                  uint8_t *buf,
+                                  size_t size)
+{
+    GBytes *context_client;
+
+    assert (entry != NULL && buf != NULL && size <= sizeof (TPMS_CONTEXT));
+
+    context_client = session_entry_blob_new (entry, entry->context, buf,
+                                             size);
+    g_bytes_unref (entry->context_client);
+    entry->context_client = context_client;
+}
+/*
+ * Get the 'sequence' field from the TPMS_CONTEXT saved by the RM. This is
+ * the value of the TPM context counter when the session was last saved.
+ * If the RM holds no saved context for the session we return 0.
+ */
+guint64
+session_entry_get_sequence (SessionEntry *entry)
+{
+    guint64 sequence = 0;
+    size_t offset = 0;
+    const uint8_t *buf;
+    gsize size;
+    TSS2_RC rc;
+
+    assert (entry != NULL);
+    buf = g_bytes_get_data (entry->context, &size);
+    if (size == 0) {
+        return 0;
+    }
+    rc = Tss2_MU_UINT64_Unmarshal (buf,
+                                   size,
+                                   &offset,
+                                   &sequence);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to unmarshal sequence from context, "
+                   "rc: 0x%" PRIx32, __func__, rc);
+        return 0;
+    }
+    return sequence;
+}
 /*
  * When the connection is set the previous connection, if there was one, must
  * have its reference count decremented and the internal pointer NULLed.
@@ -335,6 +437,54 @@ session_entry_abandon (SessionEntry *entry)
 {
     g_clear_object (&entry->connection);
     entry->state = SESSION_ENTRY_SAVED_CLIENT_CLOSED;
+    entry->abandoned_time = g_get_monotonic_time ();
+}
+/*
+ * Microseconds since the entry was abandoned, 0 if it never was.
+ */
+gint64
+session_entry_get_abandoned_age (SessionEntry *entry)
+{
+    if (entry->abandoned_time == 0) {
+        return 0;
+    }
+    return g_get_monotonic_time () - entry->abandoned_time;
+}
+/*
+ * Accessors for the 'uses' member, a score of how often commands used the
+ * session lately. The ResourceManager ages it when it spares the session.
+ */
+guint
+session_entry_get_uses (SessionEntry *entry)
+{
+    return entry->uses;
+}
+void
+session_entry_set_uses (SessionEntry *entry,
+                        guint         uses)
+{
+    entry->uses = uses;
+}
+/*
+ * Note that loading the context of the session took 'elapsed'
+ * microseconds.
+ */
+void
+session_entry_note_load (SessionEntry *entry,
+                         gint64        elapsed)
+{
+    entry->load_us = context_load_average (entry->load_us, elapsed);
+}
+/*
+ * The microseconds loading the session again is expected to take, from
+ * its loads so far or the size of its saved context, see
+ * context_load_cost.
+ */
+guint64
+session_entry_get_load_cost (SessionEntry *entry)
+{
+    return context_load_cost (entry->load_us,
+                              g_bytes_get_size (entry->context));
 }
 /*
  * This function is used to compare the context_client field the TPMS_CONTEXT
@@ -349,9 +499,13 @@ session_entry_compare_on_context_client (SessionEntry *entry,
                                          uint8_t *buf,
                                          size_t size)
 {
-    size_buf_t *size_buf = NULL;
+    const uint8_t *client;
+    gsize client_size;
 
-    g_assert (size <= SIZE_BUF_MAX);
-    size_buf = session_entry_get_context_client (entry);
-    return memcmp (size_buf->buf, buf, size);
+    client = g_bytes_get_data (session_entry_get_context_client (entry),
+                               &client_size);
+    if (client_size != size) {
+        return client_size < size ? -1 : 1;
+    }
+    return memcmp (client, buf, size);
 }
@@ -15,24 +15,38 @@
 
 G_BEGIN_DECLS
 
-#define SIZE_BUF_MAX sizeof (TPMS_CONTEXT)
-
-typedef struct size_buf {
-    size_t size;
-    uint8_t buf [SIZE_BUF_MAX];
-} size_buf_t;
-
 typedef struct _SessionEntryClass {
     GObjectClass      parent;
 } SessionEntryClass;
 
+/*
+ * 'context' and 'context_client' hold the marshalled TPMS_CONTEXT blobs
+ * in buffers of their actual size. They start out as the same empty blob
+ * and 'context_client' refers to the same blob as 'context' for as long as
+ * the two are identical.
+ */
 typedef struct _SessionEntry {
     GObject                parent_instance;
     Connection            *connection;
     SessionEntryStateEnum  state;
     TPM2_HANDLE            handle;
-    size_buf_t             context;
-    size_buf_t             context_client;
+    GBytes                *context;
+    GBytes                *context_client;
+    /* monotonic time the owning connection went away, 0 until then */
+    gint64                 abandoned_time;
+    /* how often commands used the session lately */
+    guint                  uses;
+    /* average microseconds its ContextLoads took, 0 until it's loaded */
+    guint                  load_us;
+    /*
+     * Links owned by the SessionList holding the entry: one for the queue
+     * of abandoned sessions and one for the queue of sessions of the
+     * connection that owns the entry. A link's 'data' points back at the
+     * entry while it's in the queue and is NULL otherwise, so the entry
+     * can be moved between queues without searching for it.
+     */
+    GList                  abandoned_link;
+    GList                  connection_link;
 } SessionEntry;
 
 #define TYPE_SESSION_ENTRY              (session_entry_get_type   ())
@@ -45,13 +59,17 @@ typedef struct _SessionEntry {
 GType            session_entry_get_type        (void);
 SessionEntry*    session_entry_new             (Connection        *connection,
                                                 TPM2_HANDLE         handle);
-size_buf_t*      session_entry_get_context_client (SessionEntry *entry);
+GBytes*          session_entry_get_context_client (SessionEntry *entry);
 Connection*      session_entry_get_connection  (SessionEntry      *entry);
 TPM2_HANDLE       session_entry_get_handle      (SessionEntry      *entry);
-size_buf_t*      session_entry_get_context     (SessionEntry      *entry);
+GBytes*          session_entry_get_context     (SessionEntry      *entry);
 void             session_entry_set_context     (SessionEntry      *entry,
                                                 uint8_t           *buf,
                                                 size_t             size);
+void             session_entry_set_context_client (SessionEntry   *entry,
+                                                   uint8_t        *buf,
+                                                   size_t          size);
+guint64          session_entry_get_sequence    (SessionEntry      *entry);
 SessionEntryStateEnum session_entry_get_state  (SessionEntry      *entry);
 void             session_entry_set_connection  (SessionEntry      *entry,
                                                 Connection        *connection);
@@ -67,6 +85,13 @@ gint session_entry_compare_on_context_client (SessionEntry *entry,
                                               uint8_t *buf,
                                               size_t size);
 void session_entry_abandon (SessionEntry *entry);
+gint64 session_entry_get_abandoned_age (SessionEntry *entry);
+guint session_entry_get_uses (SessionEntry *entry);
+void session_entry_set_uses (SessionEntry *entry,
+                             guint         uses);
+void session_entry_note_load (SessionEntry *entry,
+                              gint64        elapsed);
+guint64 session_entry_get_load_cost (SessionEntry *entry);
 
 G_END_DECLS
 #endif /* SESSION_ENTRY_H */
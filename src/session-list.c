@@ -65,34 +65,67 @@ session_list_set_property (GObject        *object,
         break;
     }
 }
+/*
+ * Take all of the links embedded in SessionEntry objects off the queue
+ * without freeing them, then free the queue.
+ */
+static void
+session_list_queue_free_links (GQueue *queue)
+{
+    GList *link;
+
+    while ((link = g_queue_pop_head_link (queue)) != NULL) {
+        link->data = NULL;
+    }
+    g_queue_free (queue);
+}
+/*
+ * GDestroyNotify for the GQueues in 'connection_table'. The entries are
+ * owned by 'entry_queue'.
+ */
+static void
+session_list_bucket_free (gpointer data)
+{
+    session_list_queue_free_links ((GQueue*)data);
+}
 /*
  * Initialize object.
- * GQueue for 'abandoned_queue' must be explicitly created.
- * GList for 'session_entry_list' does not.
+ * The GQueues and GHashTables must be explicitly created. Neither hash
+ * table holds a reference to the entries or connections: the entries are
+ * owned by 'entry_queue' and each entry holds a reference to its
+ * connection for as long as it is in the connection's bucket.
  */
 static void
 session_list_init (SessionList     *list)
 {
     g_debug ("session_list_init");
     list->abandoned_queue = g_queue_new ();
-    list->session_entry_list = NULL;
+    list->entry_queue = g_queue_new ();
+    list->handle_table = g_hash_table_new (g_direct_hash, g_direct_equal);
+    list->connection_table = g_hash_table_new_full (g_direct_hash,
+                                                    g_direct_equal,
+                                                    NULL,
+                                                    session_list_bucket_free);
 }
 /*
- * GObject dispose function: unref all SessionEntry objects in the internal
- * GSList and unref the list itself. NULL the pointer to the internal list
- * as well.
+ * GObject dispose function: drop the indexes then unref all SessionEntry
+ * objects in the internal GQueue and free the queue itself. NULL the
+ * pointers as well since dispose may be called more than once.
  */
 static void
 session_list_dispose (GObject *object)
 {
     SessionList *self = SESSION_LIST (object);
 
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_queue_free (self->abandoned_queue);
-    self->abandoned_queue = NULL;
-    g_list_free_full (self->session_entry_list, g_object_unref);
-    self->session_entry_list = NULL;
+    g_debug ("%s: SessionList with %u entries", __func__,
+             self->entry_queue != NULL ? self->entry_queue->length : 0);
+    g_clear_pointer (&self->abandoned_queue, session_list_queue_free_links);
+    g_clear_pointer (&self->handle_table, g_hash_table_destroy);
+    g_clear_pointer (&self->connection_table, g_hash_table_destroy);
+    if (self->entry_queue != NULL) {
+        g_queue_free_full (self->entry_queue, g_object_unref);
+        self->entry_queue = NULL;
+    }
     G_OBJECT_CLASS (session_list_parent_class)->dispose (object);
 }
 /*
@@ -101,11 +134,7 @@ session_list_dispose (GObject *object)
 static void
 session_list_finalize (GObject *object)
 {
-    SessionList *self = SESSION_LIST (object);
-
-    g_debug ("%s: SessionList with %" PRIu32 " entries", __func__,
-             g_list_length (self->session_entry_list));
-    g_list_free_full (self->session_entry_list, g_object_unref);
+    g_debug ("%s", __func__);
     G_OBJECT_CLASS (session_list_parent_class)->finalize (object);
 }
 /*
@@ -158,6 +187,102 @@ session_list_new (guint  max_per_conn,
                                        "max-per-connection", max_per_conn,
                                        NULL));
 }
+/*
+ * Add the entry to the bucket of the connection that currently owns it.
+ * Entries without a connection aren't in any bucket.
+ */
+static void
+session_list_bucket_add (SessionList  *list,
+                         SessionEntry *entry)
+{
+    GQueue *bucket;
+
+    if (entry->connection == NULL) {
+        return;
+    }
+    bucket = g_hash_table_lookup (list->connection_table, entry->connection);
+    if (bucket == NULL) {
+        bucket = g_queue_new ();
+        g_hash_table_insert (list->connection_table,
+                             entry->connection,
+                             bucket);
+    }
+    entry->connection_link.data = entry;
+    g_queue_push_tail_link (bucket, &entry->connection_link);
+}
+/*
+ * Remove the entry from the bucket of the connection that currently owns
+ * it. This must be called before the connection of the entry changes. The
+ * bucket is dropped once it's empty so that the table never has a key for
+ * a connection no entry holds a reference to.
+ */
+static void
+session_list_bucket_remove (SessionList  *list,
+                            SessionEntry *entry)
+{
+    GQueue *bucket;
+
+    if (entry->connection == NULL || entry->connection_link.data == NULL) {
+        return;
+    }
+    bucket = g_hash_table_lookup (list->connection_table, entry->connection);
+    if (bucket == NULL) {
+        return;
+    }
+    g_queue_unlink (bucket, &entry->connection_link);
+    entry->connection_link.data = NULL;
+    if (g_queue_is_empty (bucket)) {
+        g_hash_table_remove (list->connection_table, entry->connection);
+    }
+}
+/*
+ * The most recently abandoned entry is at the head of 'abandoned_queue'
+ * and the pruning takes from the tail.
+ */
+static void
+session_list_abandoned_add (SessionList  *list,
+                            SessionEntry *entry)
+{
+    entry->abandoned_link.data = entry;
+    g_queue_push_head_link (list->abandoned_queue, &entry->abandoned_link);
+}
+static void
+session_list_abandoned_remove (SessionList  *list,
+                               SessionEntry *entry)
+{
+    if (entry->abandoned_link.data == NULL) {
+        return;
+    }
+    g_queue_unlink (list->abandoned_queue, &entry->abandoned_link);
+    entry->abandoned_link.data = NULL;
+}
+/*
+ * Add the entry to 'entry_queue' and the handle index. Handles are unique
+ * while the TPM has the session so a second entry with the same handle is
+ * refused.
+ */
+static gboolean
+session_list_add (SessionList  *list,
+                  SessionEntry *entry)
+{
+    TPM2_HANDLE handle = session_entry_get_handle (entry);
+
+    if (g_hash_table_contains (list->handle_table,
+                               GUINT_TO_POINTER (handle)))
+    {
+        g_warning ("%s: SessionList already has handle 0x%08" PRIx32,
+                   __func__, handle);
+        return FALSE;
+    }
+    g_object_ref (entry);
+    g_queue_push_tail (list->entry_queue, entry);
+    g_hash_table_insert (list->handle_table,
+                         GUINT_TO_POINTER (handle),
+                         g_queue_peek_tail_link (list->entry_queue));
+    ++list->inserts;
+
+    return TRUE;
+}
 /*
  * Insert GObject into the session list. We take a reference to the object
  * before we insert the object. When it is removed or if the SessionList
@@ -175,69 +300,122 @@ session_list_insert (SessionList      *list,
                     list->max_per_connection);
         return FALSE;
     }
-    g_object_ref (entry);
-    list->session_entry_list = g_list_append (list->session_entry_list,
-                                                 entry);
+    if (!session_list_add (list, entry)) {
+        return FALSE;
+    }
+    session_list_bucket_add (list, entry);
 
     return TRUE;
 }
-static gboolean
-session_list_remove_custom (SessionList  *list,
-                            gconstpointer data,
-                            GCompareFunc  func)
+/*
+ * Add a SessionEntry that no connection owns to the list and to the queue
+ * of abandoned sessions, like session_list_abandon_handle does for one
+ * that was owned. Used when the session comes from another instance of
+ * the daemon.
+ */
+void
+session_list_insert_abandoned (SessionList  *list,
+                               SessionEntry *entry)
 {
-    GList       *list_entry;
-    SessionEntry *entry_data;
-
-    list_entry = g_list_find_custom (list->session_entry_list, data, func);
-    if (list_entry == NULL) {
-        return FALSE;
+    if (list == NULL || entry == NULL) {
+        g_error ("%s passed NULL parameter", __func__);
+    }
+    session_entry_abandon (entry);
+    if (session_list_add (list, entry)) {
+        session_list_abandoned_add (list, entry);
     }
-    entry_data = SESSION_ENTRY (list_entry->data);
-    list->session_entry_list = g_list_remove_link (list->session_entry_list,
-                                                     list_entry);
-    g_object_unref (entry_data);
+}
+/*
+ * Take the entry at the given link out of all of the containers and drop
+ * the reference the SessionList held.
+ */
+static void
+session_list_remove_link (SessionList *list,
+                          GList       *link)
+{
+    SessionEntry *entry = SESSION_ENTRY (link->data);
 
-    return TRUE;
+    g_hash_table_remove (list->handle_table,
+                         GUINT_TO_POINTER (session_entry_get_handle (entry)));
+    session_list_bucket_remove (list, entry);
+    session_list_abandoned_remove (list, entry);
+    g_queue_delete_link (list->entry_queue, link);
+    g_object_unref (entry);
 }
 /*
- * Remove the entry from the GList. The SessionList assumes that since the
- * entry is in the container it must hold a reference to the object and so
- * upon successful removal 
+ * Remove the entry with the given handle from the SessionList. The
+ * SessionList assumes that since the entry is in the container it must
+ * hold a reference to the object and so upon successful removal the
+ * reference is dropped.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_handle (SessionList      *list,
                             TPM2_HANDLE        handle)
 {
-    return session_list_remove_custom (list,
-                                       &handle,
-                                       session_entry_compare_on_handle);
+    GList *link;
+
+    link = g_hash_table_lookup (list->handle_table,
+                                GUINT_TO_POINTER (handle));
+    if (link == NULL) {
+        return FALSE;
+    }
+    session_list_remove_link (list, link);
+
+    return TRUE;
 }
 /*
+ * Remove the oldest entry owned by the provided connection.
  * Returns TRUE on success, FALSE on failure.
  */
 gboolean
 session_list_remove_connection (SessionList      *list,
                                 Connection       *connection)
 {
-    return session_list_remove_custom (list,
-                                       connection,
-                                       session_entry_compare_on_connection);
+    GQueue *bucket;
+
+    bucket = g_hash_table_lookup (list->connection_table, connection);
+    if (bucket == NULL) {
+        return FALSE;
+    }
+    return session_list_remove_handle (list,
+        session_entry_get_handle (SESSION_ENTRY (g_queue_peek_head (bucket))));
+}
+/*
+ * Remove every entry from the SessionList, abandoned ones included.
+ * Returns the number of entries removed.
+ */
+guint
+session_list_clear (SessionList *list)
+{
+    guint count = 0;
+
+    while (!g_queue_is_empty (list->entry_queue)) {
+        session_list_remove_link (list,
+                                  g_queue_peek_head_link (list->entry_queue));
+        ++count;
+    }
+    return count;
 }
 /*
- * This function is a thin wrapper around the g_list_remove function. Pass it
- * a SessionEntry. It will find it in the list and remove the associated entry
- * and then unref it (to account for the SessionList no longer holding a
- * reference).
+ * Pass this function a SessionEntry. It will find it in the list through
+ * the handle index and remove the associated entry and then unref it (to
+ * account for the SessionList no longer holding a reference).
  */
 void
 session_list_remove (SessionList   *list,
                      SessionEntry  *entry)
 {
+    GList *link;
+
     g_debug ("%s", __func__);
-    list->session_entry_list = g_list_remove (list->session_entry_list, entry);
-    g_object_unref (entry);
+    link = g_hash_table_lookup (list->handle_table,
+        GUINT_TO_POINTER (session_entry_get_handle (entry)));
+    if (link == NULL || link->data != entry) {
+        g_warning ("%s: SessionEntry isn't in the SessionList", __func__);
+        return;
+    }
+    session_list_remove_link (list, link);
 }
 
 /*
@@ -252,9 +430,8 @@ session_list_lookup_handle (SessionList   *list,
 {
     GList *list_entry;
 
-    list_entry = g_list_find_custom (list->session_entry_list,
-                                      &handle,
-                                      session_entry_compare_on_handle);
+    list_entry = g_hash_table_lookup (list->handle_table,
+                                      GUINT_TO_POINTER (handle));
     if (list_entry != NULL) {
         g_object_ref (list_entry->data);
         return SESSION_ENTRY (list_entry->data);
@@ -294,7 +471,7 @@ session_list_lookup_context_client (SessionList *list,
         .buf = buf,
     };
 
-    list_entry = g_list_find_custom (list->session_entry_list,
+    list_entry = g_queue_find_custom (list->entry_queue,
                                      &size_buf_ptr,
                                      session_list_compare_context);
     if (list_entry != NULL) {
@@ -306,41 +483,20 @@ session_list_lookup_context_client (SessionList *list,
 }
 /*
  * Simple wrapper around the function that reports the number of entries in
- * the hash table.
+ * the queue.
  */
 guint
 session_list_size (SessionList *list)
 {
-    guint ret;
-
-    ret = g_list_length (list->session_entry_list);
-
-    return ret;
+    return g_queue_get_length (list->entry_queue);
 }
 /*
- * Structure used to hold data needed to count SessionEntry objects associated
- * with a given connection.
- */
-typedef struct {
-    Connection *connection;
-    size_t      count;
-} connection_count_data_t;
-/*
- * Callback function used to count the number of SessionEntry objects in the
- * list associated with a given connection.
+ * Returns the number of entries added to the list since it was created.
  */
-static void
-session_list_connection_counter (gpointer data,
-                                 gpointer user_data)
+guint64
+session_list_get_inserts (SessionList *list)
 {
-    SessionEntry *entry = SESSION_ENTRY (data);
-    Connection *conn = session_entry_get_connection (entry);
-    connection_count_data_t *count_data = (connection_count_data_t*)user_data;
-
-    if (count_data->connection == conn) {
-        ++count_data->count;
-    }
-    g_clear_object (&conn);
+    return list->inserts;
 }
 /*
  * Returns the number of entries associated with the provided connection.
@@ -349,13 +505,13 @@ size_t
 session_list_connection_count (SessionList *list,
                                Connection  *connection)
 {
-    connection_count_data_t count_data = {
-        .connection = connection,
-        .count = 0,
-    };
+    GQueue *bucket;
 
-    session_list_foreach (list, session_list_connection_counter, &count_data);
-    return count_data.count;
+    if (connection == NULL) {
+        return 0;
+    }
+    bucket = g_hash_table_lookup (list->connection_table, connection);
+    return bucket != NULL ? g_queue_get_length (bucket) : 0;
 }
 /*
  * Return false if the number of entries in the list is greater than or equal
@@ -370,7 +526,7 @@ session_list_is_full (SessionList *session_list,
 
     session_count = session_list_connection_count (session_list,
                                                    connection);
-    if (session_count >= session_list->max_per_connection) {
+    if (session_count >= g_atomic_int_get (&session_list->max_per_connection)) {
         g_info ("%s: Connection has exceeded session limit", __func__);
         ret = TRUE;
     } else {
@@ -379,16 +535,40 @@ session_list_is_full (SessionList *session_list,
     return ret;
 }
 /*
+ * Call 'func' on each entry in the order they were inserted. It is safe
+ * for 'func' to remove the entry it has been passed from the list.
  */
 void
 session_list_foreach (SessionList *list,
                       GFunc        func,
                       gpointer     user_data)
 {
-    g_list_foreach (list->session_entry_list,
+    g_queue_foreach (list->entry_queue,
                      func,
                      user_data);
 }
+/*
+ * Call 'func' on each entry owned by the provided connection. The bucket
+ * is copied first since 'func' may remove, abandon or flush the entry it
+ * has been passed and so change the bucket as we go.
+ */
+void
+session_list_foreach_connection (SessionList *list,
+                                 Connection  *connection,
+                                 GFunc        func,
+                                 gpointer     user_data)
+{
+    GQueue *bucket;
+    GList *entries;
+
+    bucket = g_hash_table_lookup (list->connection_table, connection);
+    if (bucket == NULL) {
+        return;
+    }
+    entries = g_list_copy_deep (bucket->head, (GCopyFunc)g_object_ref, NULL);
+    g_list_foreach (entries, func, user_data);
+    g_list_free_full (entries, g_object_unref);
+}
 /*
  * Find the associated SessionEntry in the list.
  * Check that the SessionEntry has the same
@@ -412,8 +592,9 @@ session_list_abandon_handle (SessionList *list,
         g_clear_object (&entry);
         return FALSE;
     }
+    session_list_bucket_remove (list, entry);
     session_entry_abandon (entry);
-    g_queue_push_head (list->abandoned_queue, entry);
+    session_list_abandoned_add (list, entry);
     g_clear_object (&entry);
 
     return TRUE;
@@ -426,7 +607,7 @@ session_list_abandon_handle (SessionList *list,
  *   connection with the object.
  * - If the SessionEntry has been saved BY THE CLIENT then it will *not* be
  *   in the 'abandoned_queue'. In this case we find the SessionEntry in the
- *   'session_entry_list' and change the connection.
+ *   'entry_queue' and change the connection.
  */
 gboolean
 session_list_claim (SessionList *list,
@@ -435,27 +616,74 @@ session_list_claim (SessionList *list,
 {
     GList *link = NULL;
 
-    link = g_queue_find (list->abandoned_queue, entry);
-    if (link != NULL) {
-        g_assert (link->data == entry);
-        g_debug ("%s: GQueue of abandoned sessions does not contain "
-                 "SessionEntry", __func__);
+    if (entry->abandoned_link.data != NULL) {
+        g_debug ("%s: SessionEntry found in GQueue of abandoned sessions, "
+                 "abandoned %" PRId64 "ms ago", __func__,
+                 session_entry_get_abandoned_age (entry) / 1000);
+        session_list_abandoned_remove (list, entry);
         session_entry_set_state (entry, SESSION_ENTRY_LOADED);
         session_entry_set_connection (entry, connection);
-        g_queue_remove (list->abandoned_queue, link->data);
+        session_list_bucket_add (list, entry);
         return TRUE;
     }
-    link = g_list_find (list->session_entry_list, entry);
-    if (link != NULL) {
-        g_assert (link->data == entry);
+    link = g_hash_table_lookup (list->handle_table,
+        GUINT_TO_POINTER (session_entry_get_handle (entry)));
+    if (link != NULL && link->data == entry) {
         g_debug ("%s: SessionEntry found in SessionList", __func__);
         session_entry_set_state (entry, SESSION_ENTRY_LOADED);
-        session_entry_set_connection (entry, connection);
+        if (entry->connection != connection) {
+            session_list_bucket_remove (list, entry);
+            session_entry_set_connection (entry, connection);
+            session_list_bucket_add (list, entry);
+        }
     } else {
         return FALSE;
     }
     return TRUE;
 }
+/*
+ * Hand every entry owned by 'from' over to 'to', for a connection that
+ * resumes another one. The entries keep their state.
+ * Returns the number of entries moved.
+ */
+guint
+session_list_move_connection (SessionList *list,
+                              Connection  *from,
+                              Connection  *to)
+{
+    SessionEntry *entry;
+    GQueue *bucket;
+    guint count = 0;
+
+    if (from == to) {
+        return 0;
+    }
+    while ((bucket = g_hash_table_lookup (list->connection_table, from)) != NULL) {
+        entry = SESSION_ENTRY (g_queue_peek_head (bucket));
+        session_list_bucket_remove (list, entry);
+        session_entry_set_connection (entry, to);
+        session_list_bucket_add (list, entry);
+        ++count;
+    }
+    return count;
+}
+/*
+ * Change the limits while the SessionList is in use, for the SetLimit
+ * D-Bus method. They're checked on the next insert or prune, sessions
+ * over a lowered limit stay until they go away on their own.
+ */
+void
+session_list_set_max_per_connection (SessionList *list,
+                                     guint        max_per_conn)
+{
+    g_atomic_int_set (&list->max_per_connection, max_per_conn);
+}
+void
+session_list_set_max_abandoned (SessionList *list,
+                                guint        max_abandoned)
+{
+    g_atomic_int_set (&list->max_abandoned, max_abandoned);
+}
 /*
  * Remove oldest from abandoned queue and call the caller provided function
  * on it.
@@ -466,20 +694,57 @@ session_list_prune_abandoned (SessionList *list,
                               gpointer data)
 {
     SessionEntry *entry = NULL;
+    GList *link;
     gboolean ret = FALSE;
 
-    if (g_queue_get_length (list->abandoned_queue) <= list->max_abandoned) {
+    if (g_queue_get_length (list->abandoned_queue) <=
+        (guint)g_atomic_int_get (&list->max_abandoned))
+    {
         g_debug ("%s: abandoned_queue has not exceeded 'max_abandoned', "
                  "nothing to do.", __func__);
         return TRUE;
     }
-    entry = g_queue_pop_tail (list->abandoned_queue);
-    if (entry == NULL) {
+    link = g_queue_pop_tail_link (list->abandoned_queue);
+    if (link == NULL) {
         g_debug ("%s: Abandoned queue is empty.", __func__);
         return TRUE;
     }
+    entry = SESSION_ENTRY (link->data);
+    link->data = NULL;
+    g_debug ("%s: pruning session 0x%08" PRIx32 " abandoned %" PRId64
+             "ms ago", __func__, session_entry_get_handle (entry),
+             session_entry_get_abandoned_age (entry) / 1000);
     g_object_ref (entry);
     ret = func (entry, data);
     g_clear_object (&entry);
     return ret;
 }
+/*
+ * Remove the oldest abandoned entry whether or not there are more than
+ * 'max_abandoned' of them and call 'func' on it. This is for when the TPM
+ * has no room left for another session. Returns FALSE if there was no
+ * abandoned entry, the result of 'func' otherwise.
+ */
+gboolean
+session_list_drop_abandoned (SessionList *list,
+                             PruneFunc    func,
+                             gpointer     data)
+{
+    SessionEntry *entry;
+    GList *link;
+    gboolean ret;
+
+    link = g_queue_pop_tail_link (list->abandoned_queue);
+    if (link == NULL) {
+        return FALSE;
+    }
+    entry = SESSION_ENTRY (g_object_ref (link->data));
+    link->data = NULL;
+    g_info ("%s: dropping session 0x%08" PRIx32 " abandoned %" PRId64
+            "ms ago to make room in the TPM", __func__,
+            session_entry_get_handle (entry),
+            session_entry_get_abandoned_age (entry) / 1000);
+    ret = func (entry, data);
+    g_object_unref (entry);
+    return ret;
+}
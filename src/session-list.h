@@ -16,8 +16,13 @@
 
 G_BEGIN_DECLS
 
-#define SESSION_LIST_MAX_ABANDONED_MAX 4
-#define SESSION_LIST_MAX_ABANDONED_DEFAULT SESSION_LIST_MAX_ABANDONED_MAX
+/*
+ * Abandoned sessions stay saved in the TPM, which only has room for so
+ * many. When it runs out the oldest abandoned session is flushed to make
+ * room, see session_list_drop_abandoned.
+ */
+#define SESSION_LIST_MAX_ABANDONED_MAX 64
+#define SESSION_LIST_MAX_ABANDONED_DEFAULT 4
 
 #define SESSION_LIST_MAX_ENTRIES_DEFAULT 4
 #define SESSION_LIST_MAX_ENTRIES_MAX     64
@@ -28,12 +33,27 @@ typedef struct _SessionListClass {
     GObjectClass      parent;
 } SessionListClass;
 
+/*
+ * 'entry_queue' holds a reference to each SessionEntry in the order they
+ * were inserted. 'handle_table' maps the handle of each entry to its link
+ * in 'entry_queue' and 'connection_table' maps each Connection to a GQueue
+ * of the entries it owns, so that neither lookups nor the per-connection
+ * quota check have to walk every session. Abandoned entries have no
+ * connection and are only in 'entry_queue' and 'abandoned_queue'. The
+ * links in 'abandoned_queue' and in the per-connection GQueues are the
+ * ones embedded in the SessionEntry so they are never freed with the
+ * queues. 'inserts' counts the entries ever added, so that users can tell
+ * whether entries were added since they last looked.
+ */
 typedef struct _SessionList {
     GObject             parent_instance;
     GQueue             *abandoned_queue;
     guint               max_abandoned;
     guint               max_per_connection;
-    GList              *session_entry_list;
+    GQueue             *entry_queue;
+    GHashTable         *handle_table;
+    GHashTable         *connection_table;
+    guint64             inserts;
 } SessionList;
 
 #define TYPE_SESSION_LIST              (session_list_get_type   ())
@@ -48,6 +68,8 @@ SessionList*   session_list_new               (guint             max_per_conn,
                                                guint             max_abandoned);
 gboolean       session_list_insert            (SessionList      *list,
                                                SessionEntry     *entry);
+void           session_list_insert_abandoned  (SessionList      *list,
+                                               SessionEntry     *entry);
 SessionEntry*  session_list_lookup_handle     (SessionList      *list,
                                               TPM2_HANDLE        handle);
 SessionEntry*  session_list_lookup_context_client (SessionList *list,
@@ -59,13 +81,19 @@ gint           session_list_remove_connection (SessionList      *list,
                                                Connection       *connection);
 void           session_list_remove            (SessionList      *list,
                                                SessionEntry     *entry);
+guint          session_list_clear             (SessionList      *list);
 guint          session_list_size              (SessionList      *list);
+guint64        session_list_get_inserts       (SessionList      *list);
 gboolean       session_list_is_full           (SessionList      *list,
                                                Connection       *connection);
 void           session_list_prettyprint       (SessionList      *list);
 void           session_list_foreach           (SessionList      *list,
                                                GFunc             func,
                                                gpointer          user_data);
+void           session_list_foreach_connection (SessionList     *list,
+                                                Connection      *connection,
+                                                GFunc            func,
+                                                gpointer         user_data);
 size_t         session_list_connection_count  (SessionList      *list,
                                                Connection       *connection);
 gboolean       session_list_abandon_handle    (SessionList      *list,
@@ -74,9 +102,19 @@ gboolean       session_list_abandon_handle    (SessionList      *list,
 gboolean       session_list_claim             (SessionList      *list,
                                                SessionEntry     *entry,
                                                Connection       *connection);
+guint          session_list_move_connection   (SessionList      *list,
+                                               Connection       *from,
+                                               Connection       *to);
+void           session_list_set_max_per_connection (SessionList *list,
+                                                    guint        max_per_conn);
+void           session_list_set_max_abandoned (SessionList      *list,
+                                               guint             max_abandoned);
 gboolean       session_list_prune_abandoned   (SessionList      *list,
                                                PruneFunc         func,
                                                gpointer          data);
+gboolean       session_list_drop_abandoned    (SessionList      *list,
+                                               PruneFunc         func,
+                                               gpointer          data);
 
 G_END_DECLS
 #endif /* SESSION_LIST_H */
@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "session-pool.h"
+#include "util.h"
+
+G_DEFINE_TYPE (SessionPool, session_pool, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_SIZE,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+/*
+ * A pooled session: the key of the StartAuthSession it was started with,
+ * the saved session and the response the TPM sent for it.
+ */
+typedef struct {
+    GBytes         *key;
+    SessionEntry   *entry;
+    GBytes         *response;
+} session_pool_entry_t;
+
+static void
+session_pool_entry_free (gpointer data)
+{
+    session_pool_entry_t *pooled = (session_pool_entry_t*)data;
+
+    g_clear_pointer (&pooled->key, g_bytes_unref);
+    g_clear_pointer (&pooled->response, g_bytes_unref);
+    g_clear_object (&pooled->entry);
+    g_free (pooled);
+}
+/*
+ * GObject property getter.
+ */
+static void
+session_pool_get_property (GObject    *object,
+                           guint       property_id,
+                           GValue     *value,
+                           GParamSpec *pspec)
+{
+    SessionPool *self = SESSION_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        g_value_set_uint (value, self->size);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+session_pool_set_property (GObject        *object,
+                           guint           property_id,
+                           GValue const   *value,
+                           GParamSpec     *pspec)
+{
+    SessionPool *self = SESSION_POOL (object);
+
+    switch (property_id) {
+    case PROP_SIZE:
+        self->size = g_value_get_uint (value);
+        g_debug ("%s: size: %u", __func__, self->size);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+session_pool_init (SessionPool *self)
+{
+    self->sessions = g_queue_new ();
+}
+/*
+ * GObject finalize function: release the pooled sessions and the template.
+ * The sessions themselves are left in the TPM, like all others they go
+ * when the TPM is reset.
+ */
+static void
+session_pool_finalize (GObject *object)
+{
+    SessionPool *self = SESSION_POOL (object);
+
+    g_debug ("%s", __func__);
+    g_queue_free_full (self->sessions, session_pool_entry_free);
+    self->sessions = NULL;
+    g_clear_pointer (&self->template_key, g_bytes_unref);
+    g_clear_pointer (&self->template_command, g_bytes_unref);
+    G_OBJECT_CLASS (session_pool_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+session_pool_class_init (SessionPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (session_pool_parent_class == NULL)
+        session_pool_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = session_pool_finalize;
+    object_class->get_property = session_pool_get_property;
+    object_class->set_property = session_pool_set_property;
+
+    obj_properties [PROP_SIZE] =
+        g_param_spec_uint ("size",
+                           "pool size",
+                           "maximum number of pooled sessions",
+                           0,
+                           SESSION_POOL_SIZE_MAX,
+                           SESSION_POOL_SIZE_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+SessionPool*
+session_pool_new (guint size)
+{
+    g_debug ("%s with size: %u", __func__, size);
+    return SESSION_POOL (g_object_new (TYPE_SESSION_POOL,
+                                       "size", size,
+                                       NULL));
+}
+/*
+ * Generate the key identifying the kind of session a StartAuthSession
+ * command starts: its parameters with the bytes of nonceCaller left out.
+ * Without a salt or a bind object the session key is empty, so nonceCaller
+ * plays no part in what the session computes later and any session of the
+ * same type, symmetric algorithm, hash and nonce size will do. Only the
+ * size of nonceCaller is kept since it sets the size of the nonces.
+ * Only HMAC sessions started without sessions, salt or bind are pooled.
+ * This function returns NULL if the session can't come from the pool. The
+ * caller must free the returned GBytes with g_bytes_unref.
+ */
+GBytes*
+session_pool_key (Tpm2Command *command)
+{
+    guint8 *buf = tpm2_command_get_buffer (command);
+    size_t size = tpm2_command_get_size (command);
+    size_t params, offset, nonce_end;
+    TPM2B_NONCE nonce_caller = { 0, };
+    TPM2B_ENCRYPTED_SECRET salt = { 0, };
+    TPM2_SE session_type;
+    GByteArray *key;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_StartAuthSession ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS ||
+        tpm2_command_get_handle_count (command) != 2 ||
+        tpm2_command_get_handle (command, 0) != TPM2_RH_NULL ||
+        tpm2_command_get_handle (command, 1) != TPM2_RH_NULL)
+    {
+        return NULL;
+    }
+    params = offset = tpm2_command_get_params_offset (command);
+    if (offset == 0 ||
+        Tss2_MU_TPM2B_NONCE_Unmarshal (buf, size, &offset, &nonce_caller) !=
+        TSS2_RC_SUCCESS)
+    {
+        return NULL;
+    }
+    nonce_end = offset;
+    if (Tss2_MU_TPM2B_ENCRYPTED_SECRET_Unmarshal (buf, size, &offset,
+                                                  &salt) != TSS2_RC_SUCCESS ||
+        salt.size != 0 ||
+        Tss2_MU_TPM2_SE_Unmarshal (buf, size, &offset, &session_type) !=
+        TSS2_RC_SUCCESS ||
+        session_type != TPM2_SE_HMAC)
+    {
+        return NULL;
+    }
+    key = g_byte_array_sized_new (sizeof (UINT16) + size - nonce_end);
+    g_byte_array_append (key, &buf [params], sizeof (UINT16));
+    g_byte_array_append (key, &buf [nonce_end], size - nonce_end);
+    return g_byte_array_free_to_bytes (key);
+}
+/*
+ * Make the provided StartAuthSession command, with its key, the one new
+ * sessions are started with.
+ */
+void
+session_pool_set_template (SessionPool *pool,
+                           GBytes      *key,
+                           Tpm2Command *command)
+{
+    g_clear_pointer (&pool->template_key, g_bytes_unref);
+    g_clear_pointer (&pool->template_command, g_bytes_unref);
+    pool->template_key = g_bytes_ref (key);
+    pool->template_command = g_bytes_new (tpm2_command_get_buffer (command),
+                                          tpm2_command_get_size (command));
+    pool->template_attrs = tpm2_command_get_attributes (command);
+}
+/*
+ * Create a copy of the StartAuthSession command to start pooled sessions
+ * with, not associated with any connection. Its key is returned through
+ * 'key'. The caller must release both references. NULL is returned if no
+ * template has been set.
+ */
+Tpm2Command*
+session_pool_template_command (SessionPool  *pool,
+                               GBytes      **key)
+{
+    guint8 *buf;
+    gsize size;
+
+    if (pool->template_command == NULL) {
+        return NULL;
+    }
+    size = g_bytes_get_size (pool->template_command);
+    buf = g_malloc (size);
+    memcpy (buf, g_bytes_get_data (pool->template_command, NULL), size);
+    *key = g_bytes_ref (pool->template_key);
+    return tpm2_command_new (NULL, buf, size, pool->template_attrs);
+}
+/*
+ * Add the saved session 'entry' started by a StartAuthSession command with
+ * the provided key to the pool. The 'response' is what the TPM returned
+ * for the command. Nothing is added and FALSE is returned if the pool is
+ * full.
+ */
+gboolean
+session_pool_add (SessionPool  *pool,
+                  GBytes       *key,
+                  SessionEntry *entry,
+                  GBytes       *response)
+{
+    session_pool_entry_t *pooled;
+
+    if (session_pool_get_space (pool) == 0) {
+        return FALSE;
+    }
+    pooled = g_new0 (session_pool_entry_t, 1);
+    pooled->key = g_bytes_ref (key);
+    pooled->entry = g_object_ref (entry);
+    pooled->response = g_bytes_ref (response);
+    g_queue_push_tail (pool->sessions, pooled);
+    return TRUE;
+}
+/*
+ * Take the oldest pooled session for the provided key out of the pool. The
+ * response to the StartAuthSession that started it is returned through
+ * 'response'. The caller must release both references. NULL is returned
+ * if no session for the key is pooled.
+ */
+SessionEntry*
+session_pool_take (SessionPool  *pool,
+                   GBytes       *key,
+                   GBytes      **response)
+{
+    session_pool_entry_t *pooled;
+    SessionEntry *entry;
+    GList *link;
+
+    for (link = g_queue_peek_head_link (pool->sessions);
+         link != NULL;
+         link = link->next)
+    {
+        pooled = (session_pool_entry_t*)link->data;
+        if (g_bytes_equal (pooled->key, key)) {
+            break;
+        }
+    }
+    if (link == NULL) {
+        return NULL;
+    }
+    g_queue_delete_link (pool->sessions, link);
+    entry = g_steal_pointer (&pooled->entry);
+    *response = g_steal_pointer (&pooled->response);
+    session_pool_entry_free (pooled);
+    return entry;
+}
+/*
+ * Take the first pooled session saved with a context sequence of at most
+ * 'sequence' out of the pool, whatever its key. This is how the caller
+ * gets rid of sessions that would hit the context gap. The caller must
+ * release the reference. NULL is returned if no session is that old.
+ */
+SessionEntry*
+session_pool_take_stale (SessionPool *pool,
+                         guint64      sequence)
+{
+    session_pool_entry_t *pooled;
+    SessionEntry *entry;
+    GList *link;
+
+    for (link = g_queue_peek_head_link (pool->sessions);
+         link != NULL;
+         link = link->next)
+    {
+        pooled = (session_pool_entry_t*)link->data;
+        if (session_entry_get_sequence (pooled->entry) <= sequence) {
+            break;
+        }
+    }
+    if (link == NULL) {
+        return NULL;
+    }
+    g_queue_delete_link (pool->sessions, link);
+    entry = g_steal_pointer (&pooled->entry);
+    session_pool_entry_free (pooled);
+    return entry;
+}
+/*
+ * The number of pooled sessions and the number more the pool has room
+ * for.
+ */
+guint
+session_pool_get_level (SessionPool *pool)
+{
+    return g_queue_get_length (pool->sessions);
+}
+guint
+session_pool_get_space (SessionPool *pool)
+{
+    return pool->size - MIN (pool->size, session_pool_get_level (pool));
+}
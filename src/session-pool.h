@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SESSION_POOL_H
+#define SESSION_POOL_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "session-entry.h"
+#include "tpm2-command.h"
+
+G_BEGIN_DECLS
+
+#define SESSION_POOL_SIZE_DEFAULT 0
+#define SESSION_POOL_SIZE_MAX     16
+
+/*
+ * The SessionPool holds unsalted, unbound HMAC sessions started by the
+ * ResourceManager while it has nothing else to do. A later StartAuthSession
+ * asking for the same kind of session gets one of them from the pool along
+ * with the response the TPM sent when it was started. The sessions are
+ * saved while pooled so they take no session slot in the TPM. Sessions are
+ * started from the last StartAuthSession the pool couldn't answer, the
+ * 'template'.
+ */
+typedef struct _SessionPoolClass {
+    GObjectClass      parent;
+} SessionPoolClass;
+
+typedef struct _SessionPool {
+    GObject           parent_instance;
+    GQueue           *sessions;
+    guint             size;
+    GBytes           *template_key;
+    GBytes           *template_command;
+    TPMA_CC           template_attrs;
+} SessionPool;
+
+#define TYPE_SESSION_POOL              (session_pool_get_type   ())
+#define SESSION_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_SESSION_POOL, SessionPool))
+#define SESSION_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_SESSION_POOL, SessionPoolClass))
+#define IS_SESSION_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_SESSION_POOL))
+#define IS_SESSION_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_SESSION_POOL))
+#define SESSION_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_SESSION_POOL, SessionPoolClass))
+
+GType            session_pool_get_type     (void);
+SessionPool*     session_pool_new          (guint             size);
+GBytes*          session_pool_key          (Tpm2Command      *command);
+void             session_pool_set_template (SessionPool      *pool,
+                                            GBytes           *key,
+                                            Tpm2Command      *command);
+Tpm2Command*     session_pool_template_command (SessionPool  *pool,
+                                                GBytes      **key);
+gboolean         session_pool_add          (SessionPool      *pool,
+                                            GBytes           *key,
+                                            SessionEntry     *entry,
+                                            GBytes           *response);
+SessionEntry*    session_pool_take         (SessionPool      *pool,
+                                            GBytes           *key,
+                                            GBytes          **response);
+SessionEntry*    session_pool_take_stale   (SessionPool      *pool,
+                                            guint64           sequence);
+guint            session_pool_get_level    (SessionPool      *pool);
+guint            session_pool_get_space    (SessionPool      *pool);
+
+G_END_DECLS
+#endif /* SESSION_POOL_H */
@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "shm-ring.h"
+#include "tabrmd-defaults.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+G_STATIC_ASSERT ((SHM_RING_SIZE & (SHM_RING_SIZE - 1)) == 0);
+G_STATIC_ASSERT (SHM_RING_SIZE >= TABRMD_PIPELINE_MAX * TPM2_MAX_RESPONSE_SIZE);
+
+/*
+ * Copy 'size' bytes between 'buf' and the ring starting at byte 'pos' of
+ * the ring, wrapping around its end.
+ */
+static void
+shm_ring_copy_out (shm_ring_t *ring,
+                   guint32     pos,
+                   guint8     *buf,
+                   size_t      size)
+{
+    size_t offset = pos & (SHM_RING_SIZE - 1);
+    size_t first = MIN (size, SHM_RING_SIZE - offset);
+
+    memcpy (buf, &ring->data [offset], first);
+    memcpy (&buf [first], ring->data, size - first);
+}
+static void
+shm_ring_copy_in (shm_ring_t   *ring,
+                  guint32       pos,
+                  const guint8 *buf,
+                  size_t        size)
+{
+    size_t offset = pos & (SHM_RING_SIZE - 1);
+    size_t first = MIN (size, SHM_RING_SIZE - offset);
+
+    memcpy (&ring->data [offset], buf, first);
+    memcpy (ring->data, &buf [first], size - first);
+}
+/*
+ * Get the number of bytes in the ring. The other side of the ring may be a
+ * process we don't trust: if the counters are more than a ring apart the
+ * ring is corrupt and FALSE is returned.
+ */
+static gboolean
+shm_ring_used (shm_ring_t *ring,
+               guint32    *head,
+               guint32    *tail,
+               guint32    *used)
+{
+    *head = (guint32)g_atomic_int_get (&ring->head);
+    *tail = (guint32)g_atomic_int_get (&ring->tail);
+    *used = *head - *tail;
+    if (*used > SHM_RING_SIZE) {
+        g_warning ("%s: ring counters are corrupt, head: %" PRIu32
+                   " tail: %" PRIu32, __func__, *head, *tail);
+        return FALSE;
+    }
+    return TRUE;
+}
+/*
+ * Write a command or response to the ring. Returns FALSE if there isn't
+ * room for all of it, nothing is written in that case.
+ */
+gboolean
+shm_ring_write (shm_ring_t   *ring,
+                const guint8 *buf,
+                size_t        size)
+{
+    guint32 head, tail, used;
+
+    if (!shm_ring_used (ring, &head, &tail, &used)) {
+        return FALSE;
+    }
+    if (size > SHM_RING_SIZE - used) {
+        g_debug ("%s: no room for %zu bytes, %" PRIu32 " in use",
+                 __func__, size, used);
+        return FALSE;
+    }
+    shm_ring_copy_in (ring, head, buf, size);
+    /* publish the data only once all of it is in the ring */
+    g_atomic_int_set (&ring->head, (gint)(head + size));
+    return TRUE;
+}
+/*
+ * Get the size of the command or response at the front of the ring.
+ * Returns 0 if there's no complete one in the ring yet and -1 if the ring
+ * is corrupt or the header at the front is bogus.
+ */
+gssize
+shm_ring_next_size (shm_ring_t *ring)
+{
+    guint8 header [TPM_HEADER_SIZE];
+    guint32 head, tail, used, size;
+
+    if (!shm_ring_used (ring, &head, &tail, &used)) {
+        return -1;
+    }
+    if (used < TPM_HEADER_SIZE) {
+        return 0;
+    }
+    shm_ring_copy_out (ring, tail, header, TPM_HEADER_SIZE);
+    size = get_command_size (header);
+    if (size < TPM_HEADER_SIZE || size > SHM_RING_SIZE) {
+        g_warning ("%s: bad size in header: %" PRIu32, __func__, size);
+        return -1;
+    }
+    if (used < size) {
+        return 0;
+    }
+    return size;
+}
+/*
+ * Take the command or response at the front of the ring. 'size' is what
+ * shm_ring_next_size returned. The ring may have been changed under us
+ * since then so the header we copied out is checked again before the data
+ * is consumed.
+ */
+gboolean
+shm_ring_read (shm_ring_t *ring,
+               guint8     *buf,
+               size_t      size)
+{
+    guint32 head, tail, used;
+
+    if (size < TPM_HEADER_SIZE ||
+        !shm_ring_used (ring, &head, &tail, &used) ||
+        used < size)
+    {
+        return FALSE;
+    }
+    shm_ring_copy_out (ring, tail, buf, size);
+    if (get_command_size (buf) != size) {
+        g_warning ("%s: header changed while reading from ring", __func__);
+        return FALSE;
+    }
+    g_atomic_int_set (&ring->tail, (gint)(tail + size));
+    return TRUE;
+}
+gboolean
+shm_ring_is_empty (shm_ring_t *ring)
+{
+    return g_atomic_int_get (&ring->head) == g_atomic_int_get (&ring->tail);
+}
+#if defined(SHM_RING_SUPPORTED)
+static shm_region_t*
+shm_region_mmap (gint fd)
+{
+    void *addr;
+
+    addr = mmap (NULL,
+                 sizeof (shm_region_t),
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED,
+                 fd,
+                 0);
+    if (addr == MAP_FAILED) {
+        g_warning ("%s: mmap failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    return (shm_region_t*)addr;
+}
+#endif
+/*
+ * Create a new shared region backed by a memfd. The fd is returned
+ * through 'fd' so it can be passed to the client. The size of the memfd
+ * is sealed: a client can't shrink it under the daemon's mapping.
+ * Returns NULL if the shared memory transport isn't supported or the
+ * region couldn't be created.
+ */
+shm_region_t*
+shm_region_create (gint *fd)
+{
+#if defined(SHM_RING_SUPPORTED)
+    shm_region_t *region;
+
+    *fd = memfd_create ("tabrmd-shm-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd == -1) {
+        g_warning ("%s: memfd_create failed: %s", __func__, strerror (errno));
+        return NULL;
+    }
+    if (ftruncate (*fd, sizeof (shm_region_t)) == -1 ||
+        fcntl (*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        g_warning ("%s: failed to size memfd: %s", __func__, strerror (errno));
+        goto fail;
+    }
+    region = shm_region_mmap (*fd);
+    if (region == NULL) {
+        goto fail;
+    }
+    region->magic = SHM_REGION_MAGIC;
+    region->version = SHM_REGION_VERSION;
+    return region;
+fail:
+    close (*fd);
+    *fd = -1;
+    return NULL;
+#else
+    g_debug ("%s: shared memory transport not supported", __func__);
+    *fd = -1;
+    return NULL;
+#endif
+}
+/*
+ * Map a shared region created by the daemon. Returns NULL if it can't be
+ * mapped or isn't a region we know how to use.
+ */
+shm_region_t*
+shm_region_map (gint fd)
+{
+#if defined(SHM_RING_SUPPORTED)
+    shm_region_t *region;
+    struct stat st;
+
+    if (fstat (fd, &st) == -1 || (size_t)st.st_size < sizeof (shm_region_t)) {
+        g_warning ("%s: shared region is too small", __func__);
+        return NULL;
+    }
+    region = shm_region_mmap (fd);
+    if (region == NULL) {
+        return NULL;
+    }
+    if (region->magic != SHM_REGION_MAGIC ||
+        region->version != SHM_REGION_VERSION)
+    {
+        g_warning ("%s: unknown shared region magic 0x%" PRIx32
+                   " version %" PRIu32, __func__, region->magic,
+                   region->version);
+        shm_region_unmap (region);
+        return NULL;
+    }
+    return region;
+#else
+    UNUSED_PARAM(fd);
+    return NULL;
+#endif
+}
+void
+shm_region_unmap (shm_region_t *region)
+{
+    if (region != NULL) {
+        munmap (region, sizeof (shm_region_t));
+    }
+}
+/*
+ * Doorbells are non-blocking eventfds. Ringing one wakes up whoever is
+ * polling it, clearing it resets the count so the next ring is seen.
+ */
+gint
+shm_doorbell_new (void)
+{
+#if defined(SHM_RING_SUPPORTED)
+    gint fd;
+
+    fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1) {
+        g_warning ("%s: eventfd failed: %s", __func__, strerror (errno));
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+gboolean
+shm_doorbell_ring (gint fd)
+{
+    guint64 value = 1;
+    ssize_t ret;
+
+    ret = TABRMD_ERRNO_EINTR_RETRY (write (fd, &value, sizeof (value)));
+    /* a full counter will still wake up the other side */
+    if (ret == -1 && errno != EAGAIN) {
+        g_debug ("%s: failed to write doorbell: %s", __func__,
+                 strerror (errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+void
+shm_doorbell_clear (gint fd)
+{
+    guint64 value;
+
+    TABRMD_ERRNO_EINTR_RETRY (read (fd, &value, sizeof (value)));
+}
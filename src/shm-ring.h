@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+#define SHM_RING_SUPPORTED 1
+#endif
+
+#define SHM_REGION_MAGIC   0x74616272
+#define SHM_REGION_VERSION 1
+/*
+ * Bytes in each ring. This must be a power of 2 large enough to hold the
+ * largest command or response for every command a client may pipeline.
+ */
+#define SHM_RING_SIZE (128 * 1024)
+
+/*
+ * A single producer / single consumer byte ring in memory shared by the
+ * daemon and a client. TPM commands and responses are written to it back
+ * to back: the size field in each header says where the next one starts.
+ * 'head' counts the bytes written by the producer and 'tail' the bytes
+ * taken by the consumer. Both only ever grow (modulo 2^32) and each is
+ * written by one side only, so they're accessed atomically and no lock
+ * is needed.
+ */
+typedef struct {
+    gint              head;
+    gint              tail;
+    guint8            data [SHM_RING_SIZE];
+} shm_ring_t;
+
+/*
+ * The shared region behind a connection using the shared memory
+ * transport. Commands go from the client to the daemon through 'command'
+ * and responses come back through 'response'. Each side writes an eventfd
+ * (the doorbell) after writing to a ring so the other side doesn't have
+ * to poll the ring.
+ */
+typedef struct {
+    guint32           magic;
+    guint32           version;
+    shm_ring_t        command;
+    shm_ring_t        response;
+} shm_region_t;
+
+shm_region_t*  shm_region_create      (gint             *fd);
+shm_region_t*  shm_region_map         (gint              fd);
+void           shm_region_unmap       (shm_region_t     *region);
+gboolean       shm_ring_write         (shm_ring_t       *ring,
+                                       const guint8     *buf,
+                                       size_t            size);
+gssize         shm_ring_next_size     (shm_ring_t       *ring);
+gboolean       shm_ring_read          (shm_ring_t       *ring,
+                                       guint8           *buf,
+                                       size_t            size);
+gboolean       shm_ring_is_empty      (shm_ring_t       *ring);
+gint           shm_doorbell_new       (void);
+gboolean       shm_doorbell_ring      (gint              fd);
+void           shm_doorbell_clear     (gint              fd);
+
+G_END_DECLS
+#endif /* SHM_RING_H */
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "stats-segment.h"
+
+/*
+ * Create the statistics segment at 'path', replacing any file left there,
+ * and map it shared. The file is readable by its owner and group only: it
+ * shows the processes and users of the clients. Returns NULL if the file
+ * can't be created or mapped.
+ */
+stats_segment_t*
+stats_segment_create (const gchar *path)
+{
+    stats_segment_t *segment;
+    gint fd;
+
+    g_unlink (path);
+    fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        g_warning ("%s: failed to create %s: %s", __func__, path,
+                   strerror (errno));
+        return NULL;
+    }
+    if (ftruncate (fd, sizeof (stats_segment_t)) != 0) {
+        g_warning ("%s: failed to size %s: %s", __func__, path,
+                   strerror (errno));
+        close (fd);
+        g_unlink (path);
+        return NULL;
+    }
+    segment = mmap (NULL, sizeof (stats_segment_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    close (fd);
+    if (segment == MAP_FAILED) {
+        g_warning ("%s: failed to map %s: %s", __func__, path,
+                   strerror (errno));
+        g_unlink (path);
+        return NULL;
+    }
+    segment->version = STATS_SEGMENT_VERSION;
+    segment->size = sizeof (stats_segment_t);
+    segment->pid = (guint32)getpid ();
+    segment->start_time = g_get_real_time ();
+    /* readers check the magic last */
+    g_atomic_int_set ((gint*)&segment->magic, STATS_SEGMENT_MAGIC);
+    return segment;
+}
+/*
+ * Map the statistics segment at 'path' read-only. Returns NULL if it
+ * can't be mapped or isn't a segment of this version.
+ */
+stats_segment_t*
+stats_segment_open (const gchar *path)
+{
+    stats_segment_t *segment;
+    struct stat buf;
+    gint fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        g_warning ("%s: failed to open %s: %s", __func__, path,
+                   strerror (errno));
+        return NULL;
+    }
+    if (fstat (fd, &buf) != 0 || buf.st_size < (off_t)sizeof (stats_segment_t)) {
+        g_warning ("%s: %s is too small for a statistics segment",
+                   __func__, path);
+        close (fd);
+        return NULL;
+    }
+    segment = mmap (NULL, sizeof (stats_segment_t), PROT_READ, MAP_SHARED,
+                    fd, 0);
+    close (fd);
+    if (segment == MAP_FAILED) {
+        g_warning ("%s: failed to map %s: %s", __func__, path,
+                   strerror (errno));
+        return NULL;
+    }
+    if ((guint32)g_atomic_int_get ((gint*)&segment->magic) !=
+        STATS_SEGMENT_MAGIC ||
+        segment->version != STATS_SEGMENT_VERSION ||
+        segment->size != sizeof (stats_segment_t))
+    {
+        g_warning ("%s: %s isn't a version %u statistics segment",
+                   __func__, path, STATS_SEGMENT_VERSION);
+        stats_segment_unmap (segment);
+        return NULL;
+    }
+    return segment;
+}
+void
+stats_segment_unmap (stats_segment_t *segment)
+{
+    if (segment != NULL) {
+        munmap (segment, sizeof (stats_segment_t));
+    }
+}
+/*
+ * Start writing the record with the sequence number 'seq'. Returns FALSE
+ * if another writer is at it, the update must be skipped then.
+ */
+gboolean
+stats_segment_write_begin (gint *seq)
+{
+    gint old = g_atomic_int_get (seq);
+
+    if (old & 1) {
+        return FALSE;
+    }
+    return g_atomic_int_compare_and_exchange (seq, old, old + 1);
+}
+void
+stats_segment_write_end (gint *seq)
+{
+    g_atomic_int_inc (seq);
+}
+/*
+ * Copy the 'size' bytes of 'record', whose sequence number is 'seq', to
+ * 'copy'. Returns FALSE if no consistent copy was made in
+ * STATS_SEGMENT_READ_TRIES tries.
+ */
+gboolean
+stats_segment_read (const gint    *seq,
+                    gconstpointer  record,
+                    gpointer       copy,
+                    gsize          size)
+{
+    gint before;
+    guint i;
+
+    for (i = 0; i < STATS_SEGMENT_READ_TRIES; ++i) {
+        before = g_atomic_int_get (seq);
+        if (before & 1) {
+            continue;
+        }
+        memcpy (copy, record, size);
+        if (g_atomic_int_get (seq) == before) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+/*
+ * The slot of the connection with the provided serial number.
+ */
+stats_segment_connection_t*
+stats_segment_connection (stats_segment_t *segment,
+                          guint            serial)
+{
+    return &segment->connection [serial % STATS_SEGMENT_CONNECTIONS];
+}
+/*
+ * Count a command that took 'time_us' microseconds in the latency
+ * histogram of 'backend', which must be held for writing.
+ */
+void
+stats_segment_latency_add (stats_segment_backend_t *backend,
+                           gint64                   time_us)
+{
+    guint bucket;
+
+    time_us = MAX (time_us, 0);
+    bucket = time_us == 0 ? 0 : g_bit_storage ((guint64)time_us);
+    bucket = MIN (bucket, STATS_SEGMENT_BUCKETS - 1);
+    ++backend->latency [bucket];
+    backend->latency_us += (guint64)time_us;
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef STATS_SEGMENT_H
+#define STATS_SEGMENT_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define STATS_SEGMENT_MAGIC       0x74616273
+#define STATS_SEGMENT_VERSION     1
+#define STATS_SEGMENT_BACKENDS    8
+/* connections are kept in slot 'serial % STATS_SEGMENT_CONNECTIONS' */
+#define STATS_SEGMENT_CONNECTIONS 256
+/* the latency histogram has the buckets of COMMAND_STATS_BUCKETS */
+#define STATS_SEGMENT_BUCKETS     24
+/* times a reader tries to get a consistent copy of a record */
+#define STATS_SEGMENT_READ_TRIES  64
+
+/*
+ * The statistics segment is a file the daemon maps shared and writes its
+ * counters and gauges to as it goes, so tools like tabrmd-top can watch
+ * it by mapping the file read-only instead of polling over D-Bus. Nothing
+ * in it is locked: each record has a sequence number that's odd while the
+ * record is being written. A writer makes it odd with a compare and swap
+ * and gives up the update if another writer has it, since every record
+ * holds totals the next update puts right. A reader copies the record and
+ * uses the copy if the sequence number was the same even number before
+ * and after.
+ *
+ * Each backend is written only by its ResourceManager thread. 'latency'
+ * counts the commands by the time from being queued for the
+ * ResourceManager to their response being handed to the ResponseSink, in
+ * the logarithmic buckets of the CommandStats histograms. The queue
+ * depths are those of when the last command was done.
+ */
+typedef struct {
+    gint              seq;
+    guint32           in_use;
+    guint64           commands;
+    guint64           exec_us;
+    guint64           latency_us;
+    guint64           latency [STATS_SEGMENT_BUCKETS];
+    guint64           context_loads;
+    guint64           context_saves;
+    guint64           context_flushes;
+    guint32           queued;
+    guint32           flushes_queued;
+    guint32           resident;
+    guint32           sessions;
+} stats_segment_backend_t;
+
+/*
+ * The usage of one client connection, as in connection_usage_t. A slot
+ * whose 'serial' is 0 is free: a connection takes its slot from whatever
+ * connection had it before, should they collide.
+ */
+typedef struct {
+    gint              seq;
+    guint32           serial;
+    guint32           backend;
+    guint32           pid;
+    guint32           uid;
+    guint32           transients;
+    guint32           sessions;
+    guint32           reserved;
+    guint64           commands;
+    guint64           bytes_in;
+    guint64           bytes_out;
+    guint64           exec_us;
+    guint64           context_loads;
+    guint64           context_saves;
+} stats_segment_connection_t;
+
+typedef struct {
+    guint32           magic;
+    guint32           version;
+    guint32           size;
+    guint32           backends;
+    /* the daemon and when it started, in microseconds of wall clock */
+    guint32           pid;
+    guint32           reserved;
+    gint64            start_time;
+    stats_segment_backend_t    backend [STATS_SEGMENT_BACKENDS];
+    stats_segment_connection_t connection [STATS_SEGMENT_CONNECTIONS];
+} stats_segment_t;
+
+stats_segment_t* stats_segment_create      (const gchar            *path);
+stats_segment_t* stats_segment_open        (const gchar            *path);
+void             stats_segment_unmap       (stats_segment_t        *segment);
+gboolean         stats_segment_write_begin (gint                   *seq);
+void             stats_segment_write_end   (gint                   *seq);
+gboolean         stats_segment_read        (const gint             *seq,
+                                            gconstpointer           record,
+                                            gpointer                copy,
+                                            gsize                   size);
+stats_segment_connection_t*
+                 stats_segment_connection  (stats_segment_t        *segment,
+                                            guint                   serial);
+void             stats_segment_latency_add (stats_segment_backend_t *backend,
+                                            gint64                  time_us);
+
+G_END_DECLS
+#endif /* STATS_SEGMENT_H */
@@ -5,19 +5,175 @@
 #ifndef TABRMD_DEFAULTS_H
 #define TABRMD_DEFAULTS_H
 
+/* maximum number of TPM backends, one per --tcti option */
+#define TABRMD_BACKENDS_MAX 8
+/*
+ * Flags a client may ask for through CreateConnectionWithFlags. The daemon
+ * replies with the flags it granted, unknown ones are never granted.
+ * SEQPACKET: the connection uses a SOCK_SEQPACKET socket carrying one TPM
+ *   command / response per message instead of a byte stream
+ * SHM_RING: commands and responses are exchanged through rings in a memfd
+ *   shared with the daemon, with an eventfd doorbell for each direction.
+ *   The memfd and doorbells are passed after the socket fd.
+ * MUX: the socket carries any number of logical connections, each with
+ *   its own virtual handles and sessions. Every message starts with a
+ *   TABRMD_CHANNEL_TAG_SIZE byte channel tag in big endian followed by
+ *   the TPM command or response. A logical connection is created by the
+ *   first command with its tag and closed by a message with just the tag.
+ *   Only granted together with SEQPACKET and without SHM_RING.
+ */
+#define TABRMD_CONNECTION_FLAG_SEQPACKET (1 << 0)
+#define TABRMD_CONNECTION_FLAG_SHM_RING  (1 << 1)
+#define TABRMD_CONNECTION_FLAG_MUX       (1 << 2)
+#define TABRMD_CONNECTION_FLAGS_SUPPORTED \
+    (TABRMD_CONNECTION_FLAG_SEQPACKET | TABRMD_CONNECTION_FLAG_SHM_RING | \
+     TABRMD_CONNECTION_FLAG_MUX)
+#define TABRMD_CHANNEL_TAG_SIZE 4
+/* logical connections a multiplexed connection may have open at once */
+#define TABRMD_CHANNELS_MAX 1024
 #define TABRMD_CONNECTIONS_MAX_DEFAULT 27
-#define TABRMD_CONNECTION_MAX 100
+#define TABRMD_CONNECTION_MAX 4096
+/* connections one process or one user may have, 0 for no quota */
+#define TABRMD_CONNECTIONS_PID_MAX_DEFAULT 0
+#define TABRMD_CONNECTIONS_UID_MAX_DEFAULT 0
 #define TABRMD_DBUS_NAME_DEFAULT "com.intel.tss2.Tabrmd"
 #define TABRMD_DBUS_TYPE_DEFAULT G_BUS_TYPE_SYSTEM
 #define TABRMD_DBUS_PATH "/com/intel/tss2/Tabrmd/Tcti"
 #define TABRMD_DBUS_METHOD_CREATE_CONNECTION "CreateConnection"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_WITH_PRIORITY \
+    "CreateConnectionWithPriority"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTION_WITH_FLAGS \
+    "CreateConnectionWithFlags"
+#define TABRMD_DBUS_METHOD_CREATE_CONNECTIONS "CreateConnections"
 #define TABRMD_DBUS_METHOD_CANCEL "Cancel"
+#define TABRMD_DBUS_METHOD_RESUME_CONNECTION "ResumeConnection"
+/* connections a client may ask for with one CreateConnections call */
+#define TABRMD_CREATE_CONNECTIONS_MAX 32
 #define TABRMD_ERROR tabrmd_error_quark ()
 #define TABRMD_ENTROPY_SRC_DEFAULT "/dev/urandom"
+/* commands each TPM's flight recorder keeps, 0 disables it */
+#define TABRMD_FLIGHT_RECORDER_DEFAULT 64
+#define TABRMD_FLIGHT_RECORDER_MAX 4096
+/* spans kept in memory for --trace */
+#define TABRMD_TRACE_SPANS_DEFAULT 65536
+#define TABRMD_TRACE_SPANS_MAX (16 * 1024 * 1024)
+/* milliseconds a command may take before it's logged, 0 disables it */
+#define TABRMD_SLOW_COMMAND_DEFAULT 0
+#define TABRMD_SLOW_COMMAND_MAX 3600000
+/* where tabrmd-top looks for the segment published with --stats-segment */
+#define TABRMD_STATS_SEGMENT_DEFAULT "/dev/shm/tpm2-abrmd-stats"
+/* seconds between the screens of tabrmd-top */
+#define TABRMD_TOP_DELAY_DEFAULT 2
+#define TABRMD_PRIMARY_CACHE_DEFAULT 0
+#define TABRMD_PRIMARY_CACHE_MAX 16
+#define TABRMD_PCR_CACHE_DEFAULT 0
+#define TABRMD_PCR_CACHE_MAX 64
+/* milliseconds GetCapability responses for TPM2_PT_VAR are kept, 0 disables */
+#define TABRMD_CAP_CACHE_DEFAULT 0
+#define TABRMD_CAP_CACHE_MAX 10000
+#define TABRMD_NV_CACHE_DEFAULT 0
+#define TABRMD_NV_CACHE_MAX 64
+/* TestParms responses cached, GetTestResult is cached alongside them */
+#define TABRMD_TEST_CACHE_DEFAULT 0
+#define TABRMD_TEST_CACHE_MAX 256
+/* objects from Load each TPM shares between connections, 0 disables it */
+#define TABRMD_OBJECT_SHARE_DEFAULT 0
+#define TABRMD_OBJECT_SHARE_MAX 64
+/*
+ * shared objects each TPM may make persistent, 0 disables it, the
+ * maximum is RESOURCE_MANAGER_PROMOTE_MAX
+ */
+#define TABRMD_PROMOTE_DEFAULT 0
+#define TABRMD_PROMOTE_MAX 16
+/* random bytes each TPM's GetRandom pool holds, 0 disables it */
+#define TABRMD_ENTROPY_POOL_DEFAULT 0
+#define TABRMD_ENTROPY_POOL_MAX 4096
+/* HMAC sessions each TPM's session pool holds, 0 disables it */
+#define TABRMD_SESSION_POOL_DEFAULT 0
+#define TABRMD_SESSION_POOL_MAX 16
+/*
+ * Priority classes a client may request for its connection. Commands from
+ * interactive connections are always processed first, batch connections
+ * only get a bounded share of the TPM while other commands are waiting.
+ */
+/*
+ * commands a client may have in flight on one connection with the
+ * Tss2_Tcti_Tabrmd_SetPipelineDepth extension, no more than the daemon
+ * reads ahead by default
+ */
+#define TABRMD_PIPELINE_MAX TABRMD_QUEUED_MAX_DEFAULT
+/*
+ * commands a client may group with Tss2_Tcti_Tabrmd_BeginGroup, and the
+ * milliseconds the daemon waits for the next one before it gives the TPM
+ * to the other connections
+ */
+#define TABRMD_GROUP_MAX 64
+#define TABRMD_GROUP_WAIT_MS 20
+/* milliseconds a connection may lease the TPM for, 0 disables leases */
+#define TABRMD_LEASE_MAX_DEFAULT 0
+#define TABRMD_LEASE_MAX 60000
+/*
+ * milliseconds the objects and sessions of a closed connection are kept
+ * for a client to resume it, 0 removes them right away
+ */
+#define TABRMD_RESUME_DEFAULT 0
+#define TABRMD_RESUME_MAX 60000
+/* MiB a capture file grows to before a new one is started, 0 for no limit */
+#define TABRMD_CAPTURE_MAX_DEFAULT 64
+#define TABRMD_CAPTURE_MAX 65536
+/* microseconds the TCTI may spin for a response before blocking in poll */
+#define TABRMD_BUSY_POLL_MAX 100000
+#define TABRMD_PRIORITY_INTERACTIVE 0
+#define TABRMD_PRIORITY_NORMAL 1
+#define TABRMD_PRIORITY_BATCH 2
+#define TABRMD_PRIORITY_DEFAULT TABRMD_PRIORITY_NORMAL
+/* commands a connection may have queued before it's no longer read from */
+#define TABRMD_QUEUED_MAX_DEFAULT 32
+#define TABRMD_QUEUED_MAX 1024
+/* KiB of daemon memory a connection may use before commands are refused */
+#define TABRMD_CONNECTION_MEMORY_DEFAULT 0
+#define TABRMD_CONNECTION_MEMORY_MAX (1024 * 1024)
+/* commands a second the clients of a user may send, 0 for no limit */
+#define TABRMD_UID_RATE_DEFAULT 0
+#define TABRMD_UID_RATE_MAX 100000
+/* weight of the share of TPM time of the users not given one */
+#define TABRMD_UID_WEIGHT_DEFAULT 1
+#define TABRMD_UID_WEIGHT_MAX 1000
+/* threads reading commands from client connections */
+#define TABRMD_READERS_DEFAULT 1
+#define TABRMD_READERS_MAX 16
+/*
+ * scheduling of the ResourceManager threads: SCHED_FIFO priority, 0 for
+ * the default policy, else the nice value
+ */
+#define TABRMD_RM_FIFO_MAX 99
+#define TABRMD_RM_NICE_MIN (-20)
+#define TABRMD_RM_NICE_MAX 19
 #define TABRMD_SESSIONS_MAX_DEFAULT 4
 #define TABRMD_SESSIONS_MAX 64
+/* saved sessions kept after their connection closes for another to load */
+#define TABRMD_ABANDONED_MAX_DEFAULT 4
+#define TABRMD_ABANDONED_MAX 64
 #define TABRMD_TCTI_CONF_DEFAULT "device:/dev/tpm0"
+/*
+ * commands the TPM takes longer than this many times their usual time
+ * for, and longer than the TCG timing guidance allows, are canceled, 0
+ * disables it
+ */
+#define TABRMD_TPM_TIMEOUT_SCALE_DEFAULT 8
+#define TABRMD_TPM_TIMEOUT_SCALE_MAX 1000
 #define TABRMD_TRANSIENT_MAX_DEFAULT 27
-#define TABRMD_TRANSIENT_MAX 100
+#define TABRMD_TRANSIENT_MAX 4096
+/* transient objects a connection may pin resident, 0 disables pinning */
+#define TABRMD_PINNED_MAX_DEFAULT 0
+#define TABRMD_PINNED_MAX 16
+/*
+ * CreateConnection calls that may wait for a connection to close while
+ * max-connections is reached and how long each one may wait.
+ */
+#define TABRMD_WAITING_MAX_DEFAULT 16
+#define TABRMD_WAITING_MAX 256
+#define TABRMD_WAITING_TIMEOUT_DEFAULT 5000
+#define TABRMD_WAITING_TIMEOUT_MAX 60000
 
 #endif
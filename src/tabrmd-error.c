@@ -24,6 +24,10 @@ static const GDBusErrorEntry tabrmd_error_entries[] = {
         .error_code      = TSS2_RESMGR_RC_NOT_PERMITTED,
         .dbus_error_name = "com.intel.tss2.Tabrmd.Error.NotPermitted",
     },
+    {
+        .error_code      = TSS2_RESMGR_RC_BAD_VALUE,
+        .dbus_error_name = "com.intel.tss2.Tabrmd.Error.BadValue",
+    },
 };
 
 /*
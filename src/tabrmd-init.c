@@ -1,7 +1,10 @@
 #include <glib-unix.h>
+#include <errno.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sysexits.h>
 
 #include <tss2/tss2_tctildr.h>
@@ -10,9 +13,15 @@
 
 #include "tpm2.h"
 #include "command-source.h"
+#include "control-message.h"
+#include "dispatcher.h"
+#include "handover.h"
 #include "logging.h"
+#include "metrics.h"
 #include "ipc-frontend.h"
 #include "ipc-frontend-dbus.h"
+#include "ipc-frontend-unix.h"
+#include "ipc-frontend-tcp.h"
 #include "random.h"
 #include "resource-manager.h"
 #include "response-sink.h"
@@ -20,6 +29,8 @@
 #include "tabrmd-init.h"
 #include "tabrmd-options.h"
 #include "tabrmd.h"
+#include "tcti-libtpms.h"
+#include "tcti-null.h"
 #include "util.h"
 
 /*
@@ -46,6 +57,45 @@ signal_handler (gpointer user_data)
 
     return G_SOURCE_CONTINUE;
 }
+/*
+ * SIGUSR1 handler: log the flight recorder of each backend. It runs on
+ * the main thread like gmain_data_cleanup, the backends stay put.
+ */
+static gboolean
+flight_recorder_signal_handler (gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+    FlightRecorder *recorder;
+    guint i;
+
+    if (!g_atomic_int_get (&data->ready)) {
+        g_info ("%s: not ready, no flight records", __func__);
+        return G_SOURCE_CONTINUE;
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        recorder = data->resource_managers [i]->flight_recorder;
+        if (recorder != NULL) {
+            flight_recorder_dump (recorder, i);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+/*
+ * SIGUSR2 handler: write the trace out. The spans stay in the buffer so
+ * each trace written has the latest ones.
+ */
+static gboolean
+trace_signal_handler (gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+
+    if (data->trace_buffer == NULL) {
+        g_info ("%s: not tracing, see --trace", __func__);
+        return G_SOURCE_CONTINUE;
+    }
+    trace_buffer_write (data->trace_buffer);
+    return G_SOURCE_CONTINUE;
+}
 
 /*
  * This function is a callback invoked by the IpcFrontend object
@@ -64,11 +114,382 @@ on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
     if (data->loop)
         main_loop_quit (data->loop);
 }
+/*
+ * Callback handling the 'cancel' event emitted by the IpcFrontend when a
+ * client asks for its commands to be canceled. The ResourceManager of the
+ * backend serving the connection does the work. A connection that hasn't
+ * been assigned to a backend by the Dispatcher has nothing to cancel.
+ */
+TSS2_RC
+on_ipc_frontend_cancel (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data)
+{
+    Sink *sink;
+    TSS2_RC rc;
+    UNUSED_PARAM(ipc_frontend);
+
+    if (!g_atomic_int_get (&data->ready) || data->backend_count == 0) {
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    if (data->dispatcher == NULL) {
+        return resource_manager_cancel (data->resource_managers [0],
+                                        connection);
+    }
+    sink = dispatcher_get_sink (data->dispatcher, connection);
+    if (sink == NULL) {
+        return TSS2_RC_SUCCESS;
+    }
+    rc = resource_manager_cancel (RESOURCE_MANAGER (sink), connection);
+    g_object_unref (sink);
+    return rc;
+}
+/*
+ * Callback handling the 'reset' event emitted by the IpcFrontend when a
+ * client takes over an idle connection. The reset travels down the
+ * pipeline as a ControlMessage so that it's ordered with the commands the
+ * new client sends on the connection: the ResourceManager drops whatever
+ * the previous client left before it sees any of them.
+ */
+TSS2_RC
+on_ipc_frontend_reset (IpcFrontend  *ipc_frontend,
+                       Connection   *connection,
+                       gmain_data_t *data)
+{
+    ControlMessage *msg;
+    Sink *sink;
+    UNUSED_PARAM(ipc_frontend);
+
+    if (!g_atomic_int_get (&data->ready) || data->backend_count == 0) {
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    if (data->dispatcher != NULL) {
+        sink = SINK (data->dispatcher);
+    } else {
+        sink = SINK (data->resource_managers [0]);
+    }
+    msg = control_message_new_with_object (CONNECTION_RESET,
+                                           G_OBJECT (connection));
+    sink_enqueue (sink, G_OBJECT (msg));
+    g_object_unref (msg);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Callback handling the 'resume' event emitted by the IpcFrontend when a
+ * client creates a connection to take over a closed one. It's enqueued
+ * before the client can send a command, so the ResourceManager hands the
+ * objects and sessions over before it sees any. Connections are only
+ * kept with a single backend.
+ */
+TSS2_RC
+on_ipc_frontend_resume (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data)
+{
+    ControlMessage *msg;
+    UNUSED_PARAM(ipc_frontend);
+
+    if (!g_atomic_int_get (&data->ready) || data->backend_count != 1 ||
+        data->options.resume_ms == 0)
+    {
+        return TSS2_RESMGR_RC_NOT_IMPLEMENTED;
+    }
+    msg = control_message_new_with_object (CONNECTION_RESUME,
+                                           G_OBJECT (connection));
+    sink_enqueue (SINK (data->resource_managers [0]), G_OBJECT (msg));
+    g_object_unref (msg);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Callback handling the 'get-statistics' event emitted by the IpcFrontend:
+ * gather the latency histograms of each backend. Before the pipeline is
+ * running there are none. This runs on the thread of the IpcFrontendDbus,
+ * which gmain_data_cleanup stops before the backends, so they can't go
+ * away under us.
+ */
+GVariant*
+on_ipc_frontend_get_statistics (IpcFrontend  *ipc_frontend,
+                                gmain_data_t *data)
+{
+    GVariantBuilder builder;
+    CommandStats *stats;
+    guint i;
+    UNUSED_PARAM(ipc_frontend);
+
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (COMMAND_STATS_VARIANT_TYPE));
+    if (g_atomic_int_get (&data->ready)) {
+        for (i = 0; i < data->backend_count; ++i) {
+            stats = data->resource_managers [i]->command_stats;
+            if (stats != NULL) {
+                command_stats_build (stats, i, &builder);
+            }
+        }
+    }
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Callback handling the 'get-flight-records' event emitted by the
+ * IpcFrontend. Like on_ipc_frontend_get_statistics it runs on the thread
+ * of the IpcFrontendDbus.
+ */
+GVariant*
+on_ipc_frontend_get_flight_records (IpcFrontend  *ipc_frontend,
+                                    gmain_data_t *data)
+{
+    GVariantBuilder builder;
+    FlightRecorder *recorder;
+    guint i;
+    UNUSED_PARAM(ipc_frontend);
+
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (FLIGHT_RECORDER_VARIANT_TYPE));
+    if (g_atomic_int_get (&data->ready)) {
+        for (i = 0; i < data->backend_count; ++i) {
+            recorder = data->resource_managers [i]->flight_recorder;
+            if (recorder != NULL) {
+                flight_recorder_build (recorder, i, &builder);
+            }
+        }
+    }
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Callback handling the 'get-calibration' event emitted by the
+ * IpcFrontend: the last calibration of each backend's TPM. Like
+ * on_ipc_frontend_get_statistics it runs on the thread of the
+ * IpcFrontendDbus.
+ */
+GVariant*
+on_ipc_frontend_get_calibration (IpcFrontend  *ipc_frontend,
+                                 gmain_data_t *data)
+{
+    GVariantBuilder builder;
+    tpm2_profile_t profile;
+    guint i;
+    UNUSED_PARAM(ipc_frontend);
+
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (TPM2_PROFILE_VARIANT_TYPE));
+    if (g_atomic_int_get (&data->ready)) {
+        for (i = 0; i < data->backend_count; ++i) {
+            tpm2_get_profile (data->resource_managers [i]->tpm2, &profile);
+            tpm2_profile_build (&profile, i, &builder);
+        }
+    }
+    return g_variant_builder_end (&builder);
+}
+/*
+ * Callback handling the 'calibrate' event emitted by the IpcFrontend:
+ * each ResourceManager calibrates its TPM once it's done with the
+ * commands queued before.
+ */
+TSS2_RC
+on_ipc_frontend_calibrate (IpcFrontend  *ipc_frontend,
+                           gmain_data_t *data)
+{
+    ControlMessage *msg;
+    guint i;
+    UNUSED_PARAM(ipc_frontend);
+
+    if (!g_atomic_int_get (&data->ready)) {
+        g_info ("%s: not ready, can't calibrate", __func__);
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        msg = control_message_new (CALIBRATE);
+        sink_enqueue (SINK (data->resource_managers [i]), G_OBJECT (msg));
+        g_object_unref (msg);
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Callback serving the metrics to a scraper connecting to the metrics
+ * listener. This runs on the main thread like gmain_data_cleanup so the
+ * backends can't go away under us.
+ */
+static gboolean
+on_metrics_incoming (GSocketService    *service,
+                     GSocketConnection *connection,
+                     GObject           *source_object,
+                     gmain_data_t      *data)
+{
+    metrics_backend_t backends [TABRMD_BACKENDS_MAX] = { { 0, }, };
+    GString *body = g_string_new (NULL);
+    GList *connections = NULL;
+    guint i, count = 0;
+    UNUSED_PARAM(service);
+    UNUSED_PARAM(source_object);
+
+    if (g_atomic_int_get (&data->ready)) {
+        count = data->backend_count;
+        for (i = 0; i < count; ++i) {
+            backends [i].stats = data->resource_managers [i]->command_stats;
+            backends [i].resmgr_queue = data->resource_managers [i]->in_queue;
+            backends [i].sink_queue = data->response_sinks [i]->in_queue;
+            backends [i].tpm2 = data->resource_managers [i]->tpm2;
+        }
+        connections = connection_manager_get_connections (
+            data->command_sources [0]->connection_manager);
+    }
+    metrics_format (body, backends, count, connections);
+    g_list_free_full (connections, g_object_unref);
+    metrics_respond (connection, body);
+    return TRUE;
+}
+/*
+ * Stop the pipeline of the single backend so that its state can be handed
+ * over: the IpcFrontends stop creating connections and the CommandSources
+ * stop reading from them. Connections using shared memory can't be handed
+ * over so they're removed like the client had closed them. The HANDOVER
+ * ControlMessage goes in last: the ResourceManager processes the commands
+ * already queued, saves everything it has loaded in the TPM and stops,
+ * the ResponseSink stops once the responses are sent.
+ */
+static void
+handover_quiesce (gmain_data_t      *data,
+                  ConnectionManager *manager)
+{
+    Sink *sink = SINK (data->resource_managers [0]);
+    ControlMessage *msg;
+    Connection *connection;
+    GList *connections, *link;
+    guint i;
+
+    g_atomic_int_set (&data->ready, FALSE);
+    if (data->ipc_frontend != NULL) {
+        ipc_frontend_disconnect (data->ipc_frontend);
+        g_clear_object (&data->ipc_frontend);
+    }
+    if (data->ipc_frontend_unix != NULL) {
+        ipc_frontend_disconnect (data->ipc_frontend_unix);
+        g_clear_object (&data->ipc_frontend_unix);
+    }
+    if (data->ipc_frontend_tcp != NULL) {
+        ipc_frontend_disconnect (data->ipc_frontend_tcp);
+        g_clear_object (&data->ipc_frontend_tcp);
+    }
+    for (i = 0; i < data->reader_count; ++i) {
+        thread_cancel (THREAD (data->command_sources [i]));
+        thread_join (THREAD (data->command_sources [i]));
+    }
+    connections = connection_manager_get_connections (manager);
+    for (link = connections; link != NULL; link = link->next) {
+        connection = CONNECTION (link->data);
+        if (connection_get_shm (connection) == NULL) {
+            continue;
+        }
+        g_info ("%s: closing shm connection 0x%" PRIx64, __func__,
+                connection->id);
+        connection_set_closed (connection);
+        connection_manager_remove (manager, connection);
+        msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                               G_OBJECT (connection));
+        sink_enqueue (sink, G_OBJECT (msg));
+        g_object_unref (msg);
+    }
+    g_list_free_full (connections, g_object_unref);
+    msg = control_message_new (HANDOVER);
+    sink_enqueue (sink, G_OBJECT (msg));
+    g_object_unref (msg);
+    thread_join (THREAD (data->resource_managers [0]));
+    thread_join (THREAD (data->response_sinks [0]));
+}
+/*
+ * Callback handling a new instance connecting to the handover socket. We
+ * stop serving, send it the client connections and the state of the TPM
+ * and shut down. The socket to the new instance is closed last, after
+ * the TPM: that's how it knows the TPM is free.
+ * Only a single backend can be handed over.
+ */
+static gboolean
+on_handover_incoming (GSocketService    *service,
+                      GSocketConnection *connection,
+                      GObject           *source_object,
+                      gmain_data_t      *data)
+{
+    GSocket *socket = g_socket_connection_get_socket (connection);
+    ConnectionManager *manager;
+    UNUSED_PARAM(service);
+    UNUSED_PARAM(source_object);
+
+    if (!g_atomic_int_get (&data->ready) ||
+        data->backend_count != 1 ||
+        data->dispatcher != NULL ||
+        data->handover_peer != NULL)
+    {
+        g_warning ("%s: handover not possible", __func__);
+        return TRUE;
+    }
+    if (!handover_check_request (socket)) {
+        return TRUE;
+    }
+    g_info ("%s: handing over to a new instance", __func__);
+    manager = g_object_ref (data->command_sources [0]->connection_manager);
+    handover_quiesce (data, manager);
+    if (!handover_send (socket,
+                        manager,
+                        data->resource_managers [0]->session_list))
+    {
+        g_warning ("%s: failed to hand over, client connections are lost",
+                   __func__);
+    }
+    g_object_unref (manager);
+    data->handover_peer = g_object_ref (connection);
+    data->ipc_disconnected = FALSE;
+    main_loop_quit (data->loop);
+    return TRUE;
+}
+/*
+ * Take over the client connections and the state of the TPM from the
+ * instance listening on the handover socket, if there is one. This has to
+ * happen before the IpcFrontends are connected: the other instance gives
+ * up its D-Bus name and Unix socket while handing over. Once the state is
+ * received we wait for the other instance to exit and release the TPM.
+ */
+static void
+init_takeover (gmain_data_t      *data,
+               ConnectionManager *manager)
+{
+    GSocket *socket;
+
+    if (data->options.tcti_confs != NULL &&
+        g_strv_length (data->options.tcti_confs) > 1)
+    {
+        g_warning ("%s: handover is only supported with a single TPM",
+                   __func__);
+        return;
+    }
+    socket = handover_connect (data->options.handover_path);
+    if (socket == NULL) {
+        return;
+    }
+    /* whatever we got is in use by clients, don't flush it */
+    data->took_over = TRUE;
+    if (!handover_receive (socket,
+                           manager,
+                           data->options.max_transients,
+                           &data->handover_sessions))
+    {
+        g_warning ("%s: handover incomplete, some client state is lost",
+                   __func__);
+    }
+    if (!handover_wait_closed (socket)) {
+        g_warning ("%s: the instance we took over from hasn't exited",
+                   __func__);
+    }
+    g_object_unref (socket);
+}
+/*
+ * Threads stopped for a handover have been joined already.
+ */
 static void
 thread_cleanup (Thread **thread)
 {
-    thread_cancel (*thread);
-    thread_join (*thread);
+    if ((*thread)->thread_id != 0) {
+        thread_cancel (*thread);
+        thread_join (*thread);
+    }
     g_clear_object (thread);
 }
 void
@@ -76,70 +497,665 @@ gmain_data_cleanup (gmain_data_t *data)
 {
     g_debug ("%s", __func__);
     Thread* thread;
+    guint i;
 
-    if (data->command_source != NULL) {
-        thread = THREAD (data->command_source);
-        thread_cleanup (&thread);
-    }
-    if (data->resource_manager != NULL) {
-        thread = THREAD (data->resource_manager);
-        thread_cleanup (&thread);
-    }
-    if (data->response_sink != NULL) {
-        thread = THREAD (data->response_sink);
-        thread_cleanup (&thread);
+    if (data->metrics_service != NULL) {
+        metrics_unlisten (data->metrics_service,
+                          data->options.metrics_address);
+        data->metrics_service = NULL;
     }
+    g_clear_pointer (&data->prewarm, prewarm_free);
+    /* the D-Bus calls are handled on a thread that uses the backends */
     if (data->ipc_frontend != NULL) {
         ipc_frontend_disconnect (data->ipc_frontend);
         g_clear_object (&data->ipc_frontend);
     }
+    for (i = 0; i < data->reader_count; ++i) {
+        if (data->command_sources [i] != NULL) {
+            thread = THREAD (data->command_sources [i]);
+            thread_cleanup (&thread);
+            data->command_sources [i] = NULL;
+        }
+    }
+    data->reader_count = 0;
+    for (i = 0; i < data->backend_count; ++i) {
+        if (data->resource_managers [i] != NULL) {
+            thread = THREAD (data->resource_managers [i]);
+            thread_cleanup (&thread);
+            data->resource_managers [i] = NULL;
+        }
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        if (data->response_sinks [i] != NULL) {
+            thread = THREAD (data->response_sinks [i]);
+            thread_cleanup (&thread);
+            data->response_sinks [i] = NULL;
+        }
+    }
+    data->backend_count = 0;
+    g_clear_object (&data->dispatcher);
+    if (data->ipc_frontend_unix != NULL) {
+        ipc_frontend_disconnect (data->ipc_frontend_unix);
+        g_clear_object (&data->ipc_frontend_unix);
+    }
+    if (data->ipc_frontend_tcp != NULL) {
+        ipc_frontend_disconnect (data->ipc_frontend_tcp);
+        g_clear_object (&data->ipc_frontend_tcp);
+    }
     if (data->random != NULL) {
         g_clear_object (&data->random);
     }
+    g_clear_object (&data->command_recorder);
+    if (data->trace_buffer != NULL) {
+        trace_buffer_write (data->trace_buffer);
+        g_clear_object (&data->trace_buffer);
+    }
+    if (data->stats_segment != NULL) {
+        g_unlink (data->options.stats_segment_path);
+        g_clear_pointer (&data->stats_segment, stats_segment_unmap);
+    }
+    g_clear_object (&data->context_store);
+    g_clear_object (&data->rate_limiter);
+    memset (&data->owner_auth, 0, sizeof (data->owner_auth));
     if (data->loop != NULL) {
         main_loop_quit (data->loop);
     }
     if (data->tpm2) {
         g_clear_object (&data->tpm2);
     }
+    if (data->handover_service != NULL) {
+        handover_unlisten (data->handover_service,
+                           data->options.handover_path);
+        data->handover_service = NULL;
+    }
+    g_list_free_full (data->handover_sessions, g_object_unref);
+    data->handover_sessions = NULL;
+    /* the TPM is closed, let the instance taking over have it */
+    g_clear_object (&data->handover_peer);
 
     tabrmd_options_free(&data->options);
 }
+/*
+ * Data passed to the thread verifying the capability cache of a Tpm2.
+ */
+typedef struct {
+    Tpm2  *tpm2;
+    gchar *path;
+    gchar *key;
+} cache_verify_data_t;
+/*
+ * Thread function checking the capability cache that a Tpm2 was
+ * initialized from against the TPM, off the startup path.
+ */
+static gpointer
+cache_verify_thread_func (gpointer user_data)
+{
+    cache_verify_data_t *data = (cache_verify_data_t*)user_data;
+
+    tpm2_cache_verify (data->tpm2, data->path, data->key);
+    g_object_unref (data->tpm2);
+    g_free (data->path);
+    g_free (data->key);
+    g_free (data);
+    return NULL;
+}
+/*
+ * Get the path of the capability cache file for the TPM behind
+ * 'tcti_conf' in the directory 'cache_dir'. Each TCTI conf gets its own
+ * file, the conf itself is the key checked when loading it.
+ */
+static gchar*
+cache_path_for_conf (const gchar *cache_dir,
+                     const gchar *tcti_conf)
+{
+    gchar *checksum, *name, *path;
+
+    checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256,
+                                              tcti_conf,
+                                              -1);
+    name = g_strdup_printf ("tpm2-caps-%s", checksum);
+    path = g_build_filename (cache_dir, name, NULL);
+    g_free (checksum);
+    g_free (name);
+    return path;
+}
+/*
+ * Read the owner password from the file at 'path' into 'auth', a trailing
+ * newline isn't part of it. Returns FALSE if the file can't be read or
+ * the password is too long.
+ */
+static gboolean
+owner_auth_load (const gchar *path,
+                 TPM2B_AUTH  *auth)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gsize size;
+
+    if (!g_file_get_contents (path, &contents, &size, &error)) {
+        g_warning ("%s: failed to read %s: %s", __func__, path,
+                   error->message);
+        g_clear_error (&error);
+        return FALSE;
+    }
+    if (size > 0 && contents [size - 1] == '\n') {
+        --size;
+    }
+    if (size > sizeof (auth->buffer)) {
+        g_warning ("%s: the password in %s is longer than %zu bytes",
+                   __func__, path, sizeof (auth->buffer));
+    } else {
+        auth->size = (UINT16)size;
+        memcpy (auth->buffer, contents, size);
+    }
+    memset (contents, 0, size);
+    g_free (contents);
+    return auth->size == size;
+}
+/*
+ * Create the objects for one TPM backend: the TCTI and Tpm2 for the TPM
+ * described by 'tcti_conf' and the ResourceManager and ResponseSink that
+ * serve it. The state of the TPM is verified before anything else is
+ * created. If 'command_attrs' isn't NULL it's initialized from this TPM.
+ * With a cache directory the fixed TPM data is read from the cache if
+ * there is one, and checked against the TPM on a separate thread.
+ * The new objects are stored at index 'data->backend_count' which is
+ * incremented once both exist. Returns 0 on success and an exit code
+ * otherwise.
+ */
+/*
+ * Pin 'thread' to the CPUs in 'list' when it's started, NULL leaves it
+ * free to run anywhere.
+ */
+static void
+init_thread_cpus (Thread      *thread,
+                  gchar const *list)
+{
+    cpu_set_t cpus;
+
+    if (list != NULL && thread_parse_cpus (list, &cpus)) {
+        thread_set_cpus (thread, &cpus);
+    }
+}
+/*
+ * DispatcherLoadFunc for the backends: commands waiting in the queue of
+ * the ResourceManager count for 10 each, plus the tenths of the last
+ * sample period the TPM was busy, so a backend whose TPM is always busy
+ * weighs like one with a command waiting. A backend whose TCTI keeps
+ * failing or timing out is reported as failed and gets new connections
+ * again once a command gets through.
+ */
+static guint64
+backend_load (guint    backend,
+              gpointer user_data)
+{
+    gmain_data_t *data = (gmain_data_t*)user_data;
+    ResourceManager *resmgr = data->resource_managers [backend];
+    backend_load_t *load = &data->backend_loads [backend];
+    gint64 now = g_get_monotonic_time ();
+    guint64 busy_us;
+
+    if (tpm2_is_failing (resmgr->tpm2)) {
+        return DISPATCHER_LOAD_FAILED;
+    }
+    if (now - load->sampled_at >= BACKEND_LOAD_SAMPLE_US) {
+        busy_us = tpm2_get_busy_us (resmgr->tpm2);
+        if (load->sampled_at != 0) {
+            load->busy_tenths = MIN ((busy_us - load->busy_us) * 10 /
+                                     (guint64)(now - load->sampled_at), 10);
+        }
+        load->sampled_at = now;
+        load->busy_us = busy_us;
+    }
+    return (guint64)message_queue_get_length (resmgr->in_queue) * 10 +
+        load->busy_tenths;
+}
+static gint
+init_backend (gmain_data_t *data,
+              const gchar  *tcti_conf,
+              CommandAttrs *command_attrs)
+{
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    gint ret;
+    SessionList *session_list;
+    PrimaryCache *primary_cache;
+    PcrCache *pcr_cache;
+    CapCache *cap_cache;
+    NvCache *nv_cache;
+    TestCache *test_cache;
+    ObjectShare *object_share;
+    EntropyPool *entropy_pool;
+    SessionPool *session_pool;
+    KeyPool *key_pool;
+    CommandStats *command_stats;
+    FlightRecorder *flight_recorder;
+    GHashTable *uid_weights;
+    Tcti *tcti = NULL;
+    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    cache_verify_data_t *verify_data;
+    SessionEntry *entry;
+    GList *link;
+    const gchar *cache_key = tcti_conf != NULL ? tcti_conf : "";
+    gchar *cache_path = NULL;
+    guint i = data->backend_count;
+
+    if (tcti_null_conf_matches (tcti_conf)) {
+        g_info ("%s: using the null TCTI, commands never reach a TPM",
+                __func__);
+        tcti_ctx = tcti_null_new ();
+    } else if (tcti_libtpms_conf_matches (tcti_conf)) {
+        g_info ("%s: using the libtpms TCTI, commands run in the daemon",
+                __func__);
+        rc = tcti_libtpms_new (tcti_conf, &tcti_ctx);
+    } else {
+        rc = Tss2_TctiLdr_Initialize (tcti_conf, &tcti_ctx);
+    }
+    if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
+        g_critical ("%s: failed to create TCTI with conf \"%s\", got RC: 0x%x",
+                    __func__, tcti_conf, rc);
+        return EX_IOERR;
+    }
+    tcti = tcti_new (tcti_ctx);
+    if (!tcti_null_is_context (tcti_ctx) &&
+        !tcti_libtpms_is_context (tcti_ctx))
+    {
+        tcti_set_conf (tcti, tcti_conf);
+    }
+    data->tpm2 = tpm2_new (tcti);
+    tpm2_set_timeout_scale (data->tpm2, data->options.tpm_timeout_scale);
+    g_clear_object (&tcti);
+    if (data->options.cache_dir != NULL) {
+        cache_path = cache_path_for_conf (data->options.cache_dir, cache_key);
+        tpm2_cache_load (data->tpm2, cache_path, cache_key);
+    }
+    rc = tpm2_init_tpm (data->tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("failed to initialize Tpm2: 0x%" PRIx32, rc);
+        g_free (cache_path);
+        return EX_UNAVAILABLE;
+    }
+    rc = tpm2_init_caps_fixed (data->tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("failed to capture fixed TPM capabilities: 0x%" PRIx32
+                   ", GetCapability queries will go to the TPM", rc);
+    }
+    if (cache_path != NULL && data->tpm2->from_cache) {
+        verify_data = g_malloc0 (sizeof (*verify_data));
+        verify_data->tpm2 = g_object_ref (data->tpm2);
+        verify_data->path = cache_path;
+        verify_data->key = g_strdup (cache_key);
+        g_thread_unref (g_thread_new ("tpm2-cache-verify",
+                                      cache_verify_thread_func,
+                                      verify_data));
+    } else if (cache_path != NULL) {
+        if (rc == TSS2_RC_SUCCESS) {
+            tpm2_cache_save (data->tpm2, cache_path, cache_key);
+        }
+        g_free (cache_path);
+    }
+    if (data->options.flush_all && data->took_over) {
+        g_info ("%s: not flushing the TPM, it holds client state we took over",
+                __func__);
+    } else if (data->options.flush_all) {
+        tpm2_flush_all_context (data->tpm2);
+    }
+    if (command_attrs != NULL) {
+        ret = command_attrs_init_tpm (command_attrs, data->tpm2);
+        if (ret != 0) {
+            g_critical ("%s: failed to initialize CommandAttribute object",
+                        __func__);
+            return EX_UNAVAILABLE;
+        }
+    }
+    session_list = session_list_new (data->options.max_sessions,
+                                     data->options.max_abandoned);
+    for (link = data->handover_sessions; link != NULL; link = link->next) {
+        entry = SESSION_ENTRY (link->data);
+        if (session_entry_get_state (entry) ==
+            SESSION_ENTRY_SAVED_CLIENT_CLOSED)
+        {
+            session_list_insert_abandoned (session_list, entry);
+        } else if (!session_list_insert (session_list, entry)) {
+            g_warning ("%s: failed to restore session 0x%08" PRIx32,
+                       __func__, entry->handle);
+        }
+    }
+    g_list_free_full (data->handover_sessions, g_object_unref);
+    data->handover_sessions = NULL;
+    data->resource_managers [i] = resource_manager_new (data->tpm2,
+                                                        session_list);
+    g_clear_object (&session_list);
+    if (data->options.max_primaries > 0) {
+        primary_cache = primary_cache_new (data->options.max_primaries);
+        g_object_set (data->resource_managers [i],
+                      "primary-cache", primary_cache,
+                      NULL);
+        g_clear_object (&primary_cache);
+    }
+    if (data->options.max_pcr_reads > 0) {
+        pcr_cache = pcr_cache_new (data->options.max_pcr_reads);
+        g_object_set (data->resource_managers [i],
+                      "pcr-cache", pcr_cache,
+                      NULL);
+        g_clear_object (&pcr_cache);
+    }
+    if (data->options.cap_cache_ms > 0) {
+        cap_cache = cap_cache_new (data->options.cap_cache_ms);
+        g_object_set (data->resource_managers [i],
+                      "cap-cache", cap_cache,
+                      NULL);
+        g_clear_object (&cap_cache);
+    }
+    if (data->options.max_nv_reads > 0) {
+        nv_cache = nv_cache_new (data->options.max_nv_reads);
+        g_object_set (data->resource_managers [i],
+                      "nv-cache", nv_cache,
+                      NULL);
+        g_clear_object (&nv_cache);
+    }
+    if (data->options.max_tests > 0) {
+        test_cache = test_cache_new (data->options.max_tests);
+        g_object_set (data->resource_managers [i],
+                      "test-cache", test_cache,
+                      NULL);
+        g_clear_object (&test_cache);
+    }
+    if (data->options.max_shared > 0) {
+        object_share = object_share_new (data->options.max_shared);
+        g_object_set (data->resource_managers [i],
+                      "object-share", object_share,
+                      NULL);
+        g_clear_object (&object_share);
+    }
+    if (data->options.promote_max > 0) {
+        resource_manager_set_promotion (data->resource_managers [i],
+                                        data->options.promote_max,
+                                        &data->owner_auth);
+    }
+    if (data->options.entropy_pool > 0) {
+        entropy_pool = entropy_pool_new (data->options.entropy_pool);
+        g_object_set (data->resource_managers [i],
+                      "entropy-pool", entropy_pool,
+                      NULL);
+        g_clear_object (&entropy_pool);
+    }
+    if (data->options.session_pool > 0) {
+        session_pool = session_pool_new (data->options.session_pool);
+        g_object_set (data->resource_managers [i],
+                      "session-pool", session_pool,
+                      NULL);
+        g_clear_object (&session_pool);
+    }
+    if (data->options.key_pool_path != NULL) {
+        key_pool = key_pool_load (data->options.key_pool_path);
+        if (key_pool == NULL) {
+            g_critical ("%s: failed to read the key pool file %s", __func__,
+                        data->options.key_pool_path);
+            return EX_CONFIG;
+        }
+        g_object_set (data->resource_managers [i],
+                      "key-pool", key_pool,
+                      NULL);
+        g_clear_object (&key_pool);
+    }
+    data->response_sinks [i] = response_sink_new ();
+    command_stats = command_stats_new ();
+    g_object_set (data->resource_managers [i],
+                  "command-stats", command_stats,
+                  NULL);
+    g_object_set (data->response_sinks [i],
+                  "command-stats", command_stats,
+                  "command-recorder", data->command_recorder,
+                  "trace-buffer", data->trace_buffer,
+                  NULL);
+    g_clear_object (&command_stats);
+    if (data->options.flight_records > 0) {
+        flight_recorder = flight_recorder_new (data->options.flight_records);
+        g_object_set (data->resource_managers [i],
+                      "flight-recorder", flight_recorder,
+                      NULL);
+        g_clear_object (&flight_recorder);
+    }
+    g_object_set (data->resource_managers [i],
+                  "trace-buffer", data->trace_buffer,
+                  "slow-command-ms", data->options.slow_command_ms,
+                  "pin-max", data->options.max_pinned,
+                  "lease-max-ms", data->options.max_lease_ms,
+                  "resume-ms", data->options.resume_ms,
+                  "context-store", data->context_store,
+                  "kernel-rm", data->options.kernel_rm,
+                  "stats-segment", data->stats_segment,
+                  "stats-backend", i,
+                  "calibrate", data->options.calibrate,
+                  NULL);
+    if (data->stats_segment != NULL) {
+        data->stats_segment->backends = i + 1;
+    }
+    if (data->options.uid_weights != NULL) {
+        uid_weights = resource_manager_parse_uid_weights (
+                          data->options.uid_weights);
+        resource_manager_set_uid_weights (data->resource_managers [i],
+                                          uid_weights);
+        g_hash_table_unref (uid_weights);
+    }
+    data->backend_count++;
+    g_clear_object (&data->tpm2);
+    g_info ("%s: backend %u using TCTI \"%s\"", __func__, i,
+            tcti_conf != NULL ? tcti_conf : "default");
+    if (data->options.kernel_rm != NULL) {
+        g_info ("%s: connections get their own file on %s", __func__,
+                data->options.kernel_rm);
+    }
+
+    return 0;
+}
+/*
+ * Each connection holds two sockets in the daemon. Raise the soft limit
+ * on open files so that max-connections of them fit with some room to
+ * spare, as far as the hard limit allows.
+ */
+static void
+init_fd_limit (guint max_connections)
+{
+    struct rlimit limit;
+    rlim_t needed = (rlim_t)max_connections * 2 + 64;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("failed to get RLIMIT_NOFILE: %s", strerror (errno));
+        return;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur >= needed) {
+        return;
+    }
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+        g_warning ("RLIMIT_NOFILE hard limit %" PRIu64 " is too low for "
+                   "%u connections", (guint64)limit.rlim_max,
+                   max_connections);
+        needed = limit.rlim_max;
+    }
+    limit.rlim_cur = needed;
+    if (setrlimit (RLIMIT_NOFILE, &limit) != 0) {
+        g_warning ("failed to raise RLIMIT_NOFILE to %" PRIu64 ": %s",
+                   (guint64)needed, strerror (errno));
+    }
+}
+/*
+ * The limits the SetLimit D-Bus method may change, named like the options
+ * setting them at startup and with the same bounds.
+ */
+typedef struct {
+    const gchar *name;
+    guint        min;
+    guint        max;
+} limit_range_t;
+static const limit_range_t limit_ranges [] = {
+    { "max-connections",   1, TABRMD_CONNECTION_MAX },
+    { "max-connections-per-pid", 0, TABRMD_CONNECTION_MAX },
+    { "max-connections-per-uid", 0, TABRMD_CONNECTION_MAX },
+    { "max-sessions",      1, TABRMD_SESSIONS_MAX },
+    { "max-abandoned",     0, TABRMD_ABANDONED_MAX },
+    { "max-transients",    1, TABRMD_TRANSIENT_MAX },
+    { "max-pinned",        0, TABRMD_PINNED_MAX },
+    { "max-queued",        0, TABRMD_QUEUED_MAX },
+    { "max-memory",        0, TABRMD_CONNECTION_MEMORY_MAX },
+    { "uid-rate",          0, TABRMD_UID_RATE_MAX },
+    { "max-waiting",       0, TABRMD_WAITING_MAX },
+    { "slow-command-ms",   0, TABRMD_SLOW_COMMAND_MAX },
+    { "tpm-timeout-scale", 0, TABRMD_TPM_TIMEOUT_SCALE_MAX },
+    { "max-lease-ms",      0, TABRMD_LEASE_MAX },
+};
+/*
+ * GFunc changing the transient object limit of a connection in use.
+ */
+static void
+set_connection_max_transients (gpointer data_connection,
+                               gpointer data_max)
+{
+    Connection *connection = CONNECTION (data_connection);
+
+    handle_map_set_max_entries (connection_get_trans_map (connection),
+                                GPOINTER_TO_UINT (data_max));
+}
+/*
+ * Callback handling the 'set-limit' event emitted by the IpcFrontend. It
+ * runs on the thread of the IpcFrontendDbus like
+ * on_ipc_frontend_get_statistics. The limits are read without a lock by
+ * the threads enforcing them so a new value is taken up by the next
+ * check: raising a limit lets more in right away, lowering one refuses
+ * what's over it from then on but takes nothing away from the clients.
+ * The limits of the connections that exist are changed along with the
+ * one new connections get.
+ */
+TSS2_RC
+on_ipc_frontend_set_limit (IpcFrontend  *ipc_frontend,
+                           const gchar  *name,
+                           guint         value,
+                           gmain_data_t *data)
+{
+    ConnectionManager *manager;
+    GList *connections;
+    ResourceManager *resmgr;
+    guint i;
+    UNUSED_PARAM(ipc_frontend);
+
+    for (i = 0; i < G_N_ELEMENTS (limit_ranges); ++i) {
+        if (g_strcmp0 (name, limit_ranges [i].name) == 0) {
+            break;
+        }
+    }
+    if (i == G_N_ELEMENTS (limit_ranges)) {
+        g_warning ("%s: no limit named \"%s\"", __func__, name);
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    if (value < limit_ranges [i].min || value > limit_ranges [i].max) {
+        g_warning ("%s: %s must be between %u and %u", __func__, name,
+                   limit_ranges [i].min, limit_ranges [i].max);
+        return TSS2_RESMGR_RC_BAD_VALUE;
+    }
+    if (!g_atomic_int_get (&data->ready)) {
+        g_info ("%s: not ready, can't change %s", __func__, name);
+        return TSS2_RESMGR_RC_GENERAL_FAILURE;
+    }
+    g_info ("%s: setting %s to %u", __func__, name, value);
+    manager = data->command_sources [0]->connection_manager;
+    if (g_strcmp0 (name, "max-connections") == 0) {
+        init_fd_limit (value);
+        connection_manager_set_max (manager, value);
+    } else if (g_strcmp0 (name, "max-connections-per-pid") == 0) {
+        connection_manager_set_max_per_pid (manager, value);
+    } else if (g_strcmp0 (name, "max-connections-per-uid") == 0) {
+        connection_manager_set_max_per_uid (manager, value);
+    } else if (g_strcmp0 (name, "max-transients") == 0) {
+        g_object_set (data->ipc_frontend, "max-trans", value, NULL);
+        if (data->ipc_frontend_unix != NULL) {
+            g_object_set (data->ipc_frontend_unix, "max-trans", value, NULL);
+        }
+        if (data->ipc_frontend_tcp != NULL) {
+            g_object_set (data->ipc_frontend_tcp, "max-trans", value, NULL);
+        }
+        connections = connection_manager_get_connections (manager);
+        g_list_foreach (connections,
+                        set_connection_max_transients,
+                        GUINT_TO_POINTER (value));
+        g_list_free_full (connections, g_object_unref);
+    } else if (g_strcmp0 (name, "max-queued") == 0 ||
+               g_strcmp0 (name, "max-memory") == 0)
+    {
+        for (i = 0; i < data->reader_count; ++i) {
+            g_object_set (data->command_sources [i], name, value, NULL);
+        }
+    } else if (g_strcmp0 (name, "max-waiting") == 0) {
+        g_object_set (data->ipc_frontend, name, value, NULL);
+    } else if (g_strcmp0 (name, "uid-rate") == 0) {
+        rate_limiter_set_rate (data->rate_limiter, value);
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        resmgr = data->resource_managers [i];
+        if (g_strcmp0 (name, "max-sessions") == 0) {
+            session_list_set_max_per_connection (resmgr->session_list, value);
+        } else if (g_strcmp0 (name, "max-abandoned") == 0) {
+            session_list_set_max_abandoned (resmgr->session_list, value);
+        } else if (g_strcmp0 (name, "max-pinned") == 0) {
+            g_object_set (resmgr, "pin-max", value, NULL);
+        } else if (g_strcmp0 (name, "max-lease-ms") == 0) {
+            g_object_set (resmgr, "lease-max-ms", value, NULL);
+        } else if (g_strcmp0 (name, "slow-command-ms") == 0) {
+            g_object_set (resmgr, name, value, NULL);
+        } else if (g_strcmp0 (name, "tpm-timeout-scale") == 0) {
+            tpm2_set_timeout_scale (resmgr->tpm2, value);
+        }
+    }
+    return TSS2_RC_SUCCESS;
+}
 /*
  * This function initializes and configures all of the long-lived objects
  * in the tabrmd system. It is invoked on a thread separate from the main
- * thread as a way to get the main thread listening for connections on
- * DBus as quickly as possible. Any incoming DBus requests will block
- * on the 'init_mutex' until this thread completes but they won't be
- * timing etc. This function does X things:
+ * thread as a way to get the IpcFrontends listening for connections as
+ * quickly as possible. Incoming requests to create connections
+ * only block on the 'init_mutex' until the CommandSources exist: TPM
+ * initialization runs while the D-Bus name is acquired and clients are
+ * connecting. This function does X things:
  * - Locks the init_mutex.
  * - Registers a handler for UNIX signals for SIGINT and SIGTERM.
  * - Seeds the RNG state from an entropy source.
- * - Creates the ConnectionManager.
- * - Creates the TCTI instance used by the Tab.
- * - Creates an tpm2 and verify the current state of the TPM.
- * - Creates and wires up the objects that make up the TPM command
- *   processing pipeline.
- * - Starts all of the threads in the command processing pipeline.
+ * - Creates the ConnectionManager and the CommandSources.
+ * - With --handover, takes over the client connections and TPM state from
+ *   the instance we replace.
+ * - Sets up the IpcFrontends, taking the Unix socket from systemd if we
+ *   were socket activated.
  * - Unlocks the init_mutex.
+ * - Creates a TCTI, Tpm2, ResourceManager and ResponseSink for each TPM
+ *   backend, verifying the current state of each TPM.
+ * - Wires up the objects that make up the TPM command processing
+ *   pipeline. With several backends a Dispatcher assigns each connection
+ *   to one of them.
+ * - Starts all of the threads in the command processing pipeline.
+ * - With --handover, listens for the instance that will replace us.
+ * - With --metrics, listens for scrapers.
+ * The command attributes used to parse commands come from the first TPM.
+ * Commands sent on connections created before the pipeline is running
+ * wait in their sockets: the CommandSources are watching them already but
+ * only start reading once their threads are started.
  */
 gpointer
 init_thread_func (gpointer user_data)
 {
     gmain_data_t *data = (gmain_data_t*)user_data;
     gint ret;
-    TSS2_RC rc;
-    CommandAttrs *command_attrs;
+    CommandAttrs *command_attrs = NULL;
     ConnectionManager *connection_manager = NULL;
-    SessionList *session_list;
-    Tcti *tcti = NULL;
-    TSS2_TCTI_CONTEXT *tcti_ctx = NULL;
+    PcapngWriter *capture = NULL;
+    gboolean locked = TRUE;
+    gint activation_fd;
+    guint i, backends;
 
     g_info ("init_thread_func start");
     g_mutex_lock (&data->init_mutex);
     /* Setup program signals */
     if (g_unix_signal_add(SIGINT, signal_handler, data->loop) <= 0 ||
-        g_unix_signal_add(SIGTERM, signal_handler, data->loop) <= 0)
+        g_unix_signal_add(SIGTERM, signal_handler, data->loop) <= 0 ||
+        g_unix_signal_add(SIGUSR1, flight_recorder_signal_handler, data) <= 0 ||
+        g_unix_signal_add(SIGUSR2, trace_signal_handler, data) <= 0)
     {
         g_critical ("failed to setup signal handlers");
         ret = EX_OSERR;
@@ -155,7 +1171,132 @@ init_thread_func (gpointer user_data)
         goto err_out;
     }
 
+    if (data->options.capture_path != NULL) {
+        capture = pcapng_writer_new (data->options.capture_path,
+                                     (gsize)data->options.capture_max_mb *
+                                     1024 * 1024);
+        if (capture == NULL) {
+            g_critical ("failed to create capture %s",
+                        data->options.capture_path);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    if (data->options.record_path != NULL || capture != NULL) {
+        data->command_recorder =
+            command_recorder_new_full (data->options.record_path, capture);
+        g_clear_object (&capture);
+        if (data->command_recorder == NULL) {
+            g_critical ("failed to create command recording %s",
+                        data->options.record_path);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    if (data->options.trace_path != NULL) {
+        data->trace_buffer = trace_buffer_new (data->options.trace_path,
+                                               data->options.trace_spans);
+        g_info ("tracing the last %u spans to %s on SIGUSR2",
+                data->options.trace_spans, data->options.trace_path);
+    }
+    if (data->options.stats_segment_path != NULL) {
+        data->stats_segment =
+            stats_segment_create (data->options.stats_segment_path);
+        if (data->stats_segment == NULL) {
+            g_critical ("failed to create the statistics segment %s",
+                        data->options.stats_segment_path);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+        g_info ("publishing statistics in %s",
+                data->options.stats_segment_path);
+    }
+    /*
+     * Objects and sessions we keep in the TPM for clients are in our
+     * context, the connections on the kernel resource manager can't see
+     * them.
+     */
+    if (data->options.kernel_rm != NULL &&
+        (data->options.max_primaries > 0 || data->options.max_shared > 0 ||
+         data->options.session_pool > 0 ||
+         data->options.key_pool_path != NULL ||
+         data->options.prewarm_path != NULL))
+    {
+        g_warning ("--primary-cache, --object-share, --session-pool, "
+                   "--key-pool and --prewarm are ignored with --kernel-rm");
+        data->options.max_primaries = 0;
+        data->options.max_shared = 0;
+        data->options.promote_max = 0;
+        data->options.session_pool = 0;
+        g_clear_pointer (&data->options.key_pool_path, g_free);
+        g_clear_pointer (&data->options.prewarm_path, g_free);
+    }
+    if (data->options.promote_max > 0 &&
+        data->options.owner_auth_path != NULL &&
+        !owner_auth_load (data->options.owner_auth_path, &data->owner_auth))
+    {
+        g_critical ("failed to read the owner password from %s",
+                    data->options.owner_auth_path);
+        ret = EX_CONFIG;
+        goto err_out;
+    }
+    if (data->options.prewarm_path != NULL) {
+        data->prewarm = prewarm_load (data->options.prewarm_path);
+        if (data->prewarm == NULL) {
+            g_critical ("failed to read the prewarm file %s",
+                        data->options.prewarm_path);
+            ret = EX_CONFIG;
+            goto err_out;
+        }
+        if (data->options.max_primaries == 0 && data->options.max_shared == 0) {
+            g_warning ("prewarming without --primary-cache or --object-share "
+                       "keeps nothing");
+        }
+    }
+    if (data->options.context_store_dir != NULL) {
+        data->context_store =
+            context_store_new (data->options.context_store_dir,
+                               data->options.max_connections *
+                               data->options.max_transients);
+        if (data->context_store == NULL) {
+            g_critical ("failed to create the context store in %s",
+                        data->options.context_store_dir);
+            ret = EX_CANTCREAT;
+            goto err_out;
+        }
+    }
+    init_fd_limit (data->options.max_connections);
     connection_manager = connection_manager_new(data->options.max_connections);
+    connection_manager_set_max_per_pid (connection_manager,
+                                        data->options.max_connections_pid);
+    connection_manager_set_max_per_uid (connection_manager,
+                                        data->options.max_connections_uid);
+    /*
+     * Each CommandSource reads the connections whose ID hashes to its
+     * shard, all of them feed the same Sink. They have to exist before
+     * the first connection is created to be notified about it. The
+     * CommandAttrs are filled in from the TPM later on.
+     */
+    command_attrs = command_attrs_new ();
+    /* made even without a limit so one can be set with SetLimit */
+    data->rate_limiter = rate_limiter_new (data->options.uid_rate);
+    for (i = 0; i < data->options.readers && i < TABRMD_READERS_MAX; ++i) {
+        data->command_sources [i] =
+            command_source_new (connection_manager, command_attrs);
+        g_object_set (data->command_sources [i],
+                      "max-queued", data->options.max_queued,
+                      "max-memory", data->options.max_memory,
+                      "shard", i,
+                      "shard-count", data->options.readers,
+                      "command-recorder", data->command_recorder,
+                      "rate-limiter", data->rate_limiter,
+                      "trace-buffer", data->trace_buffer,
+                      NULL);
+        data->reader_count++;
+    }
+    if (data->options.handover_path != NULL) {
+        init_takeover (data, connection_manager);
+    }
     /* setup IpcFrontend */
     data->ipc_frontend =
         IPC_FRONTEND (ipc_frontend_dbus_new (data->options.bus,
@@ -163,93 +1304,235 @@ init_thread_func (gpointer user_data)
                                              connection_manager,
                                              data->options.max_transients,
                                              data->random));
+    g_object_set (data->ipc_frontend,
+                  "max-waiting", data->options.max_waiting,
+                  NULL);
     g_signal_connect (data->ipc_frontend,
                       "disconnected",
                       (GCallback) on_ipc_frontend_disconnect,
                       data);
+    g_signal_connect (data->ipc_frontend,
+                      "cancel",
+                      (GCallback) on_ipc_frontend_cancel,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "reset",
+                      (GCallback) on_ipc_frontend_reset,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "resume",
+                      (GCallback) on_ipc_frontend_resume,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "get-statistics",
+                      (GCallback) on_ipc_frontend_get_statistics,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "get-flight-records",
+                      (GCallback) on_ipc_frontend_get_flight_records,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "set-limit",
+                      (GCallback) on_ipc_frontend_set_limit,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "get-calibration",
+                      (GCallback) on_ipc_frontend_get_calibration,
+                      data);
+    g_signal_connect (data->ipc_frontend,
+                      "calibrate",
+                      (GCallback) on_ipc_frontend_calibrate,
+                      data);
     ipc_frontend_connect (data->ipc_frontend,
                           &data->init_mutex);
-
-    rc = Tss2_TctiLdr_Initialize (data->options.tcti_conf, &tcti_ctx);
-    if (rc != TSS2_RC_SUCCESS || tcti_ctx == NULL) {
-        g_critical ("%s: failed to create TCTI with conf \"%s\", got RC: 0x%x",
-                    __func__, data->options.tcti_conf, rc);
-        ret = EX_IOERR;
-        goto err_out;
-    }
-    tcti = tcti_new (tcti_ctx);
-    data->tpm2 = tpm2_new (tcti);
-    g_clear_object (&tcti);
-    rc = tpm2_init_tpm (data->tpm2);
-    if (rc != TSS2_RC_SUCCESS) {
-        ret = EX_UNAVAILABLE;
-        g_critical ("failed to initialize Tpm2: 0x%" PRIx32, rc);
-        goto err_out;
+    activation_fd = ipc_frontend_unix_activation_fd ();
+    if (data->options.socket_path != NULL || activation_fd >= 0) {
+        data->ipc_frontend_unix =
+            IPC_FRONTEND (ipc_frontend_unix_new (data->options.socket_path,
+                                                 connection_manager,
+                                                 data->options.max_transients,
+                                                 data->random));
+        g_object_set (data->ipc_frontend_unix,
+                      "socket-fd", activation_fd,
+                      NULL);
+        g_signal_connect (data->ipc_frontend_unix,
+                          "disconnected",
+                          (GCallback) on_ipc_frontend_disconnect,
+                          data);
+        g_signal_connect (data->ipc_frontend_unix,
+                          "cancel",
+                          (GCallback) on_ipc_frontend_cancel,
+                          data);
+        g_signal_connect (data->ipc_frontend_unix,
+                          "reset",
+                          (GCallback) on_ipc_frontend_reset,
+                          data);
+        ipc_frontend_connect (data->ipc_frontend_unix,
+                              &data->init_mutex);
     }
-    if (data->options.flush_all) {
-        tpm2_flush_all_context (data->tpm2);
+    if (data->options.tcp_address != NULL) {
+        data->ipc_frontend_tcp =
+            IPC_FRONTEND (ipc_frontend_tcp_new (data->options.tcp_address,
+                                                data->options.tls_cert_file,
+                                                data->options.tls_key_file,
+                                                data->options.tls_ca_file,
+                                                connection_manager,
+                                                data->options.max_transients,
+                                                data->random));
+        g_signal_connect (data->ipc_frontend_tcp,
+                          "disconnected",
+                          (GCallback) on_ipc_frontend_disconnect,
+                          data);
+        g_signal_connect (data->ipc_frontend_tcp,
+                          "cancel",
+                          (GCallback) on_ipc_frontend_cancel,
+                          data);
+        g_signal_connect (data->ipc_frontend_tcp,
+                          "reset",
+                          (GCallback) on_ipc_frontend_reset,
+                          data);
+        ipc_frontend_connect (data->ipc_frontend_tcp,
+                              &data->init_mutex);
     }
+    g_clear_object (&connection_manager);
+    /* clients may create connections from here on */
+    g_mutex_unlock (&data->init_mutex);
+    locked = FALSE;
+
     /*
      * Instantiate and the objects that make up the TPM command processing
-     * pipeline.
+     * pipeline. A NULL list of TCTI confs gets the TCTI loader defaults.
      */
-    command_attrs = command_attrs_new ();
-    ret = command_attrs_init_tpm (command_attrs, data->tpm2);
-    if (ret != 0) {
-        g_critical ("%s: failed to initialize CommandAttribute object", __func__);
-        ret = EX_UNAVAILABLE;
-        goto err_out;
+    backends = data->options.tcti_confs != NULL ?
+        MIN (g_strv_length (data->options.tcti_confs), TABRMD_BACKENDS_MAX) : 1;
+    for (i = 0; i < backends; ++i) {
+        ret = init_backend (data,
+                            data->options.tcti_confs != NULL ?
+                                data->options.tcti_confs [i] : NULL,
+                            i == 0 ? command_attrs : NULL);
+        if (ret != 0) {
+            goto err_out;
+        }
     }
 
-    data->command_source =
-        command_source_new (connection_manager, command_attrs);
-    g_object_unref (connection_manager);
-    session_list = session_list_new (data->options.max_sessions,
-                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
-    data->resource_manager = resource_manager_new (data->tpm2,
-                                                   session_list);
-    g_clear_object (&session_list);
-    data->response_sink = response_sink_new ();
-    g_object_unref (command_attrs);
-    g_clear_object (&data->tpm2);
+    g_clear_object (&command_attrs);
     /*
      * Wire up the TPM command processing pipeline. TPM command buffers
-     * flow from the CommandSource, to the Tab then finally back to the
-     * caller through the ResponseSink.
+     * flow from the CommandSources, to the Tab then finally back to the
+     * caller through the ResponseSink. With several backends the
+     * CommandSources feed the Dispatcher which feeds the ResourceManagers.
      */
-    source_add_sink (SOURCE (data->command_source),
-                     SINK   (data->resource_manager));
-    source_add_sink (SOURCE (data->resource_manager),
-                     SINK   (data->response_sink));
+    if (data->backend_count > 1) {
+        data->dispatcher = dispatcher_new ();
+        dispatcher_set_load_func (data->dispatcher, backend_load, data);
+        for (i = 0; i < data->reader_count; ++i) {
+            source_add_sink (SOURCE (data->command_sources [i]),
+                             SINK   (data->dispatcher));
+        }
+        for (i = 0; i < data->backend_count; ++i) {
+            source_add_sink (SOURCE (data->dispatcher),
+                             SINK   (data->resource_managers [i]));
+        }
+    } else {
+        /*
+         * With a single TPM the CommandSources answer GetCapability for
+         * the fixed capabilities themselves, they can't tell which TPM a
+         * command goes to when there are several.
+         */
+        for (i = 0; i < data->reader_count; ++i) {
+            source_add_sink (SOURCE (data->command_sources [i]),
+                             SINK   (data->resource_managers [0]));
+            g_object_set (data->command_sources [i],
+                          "tpm2", data->tpm2,
+                          NULL);
+        }
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        source_add_sink (SOURCE (data->resource_managers [i]),
+                         SINK   (data->response_sinks [i]));
+    }
     /*
-     * Start the TPM command processing pipeline.
+     * Start the TPM command processing pipeline. The CPU lists were
+     * checked by parse_opts.
      */
-    ret = thread_start (THREAD (data->command_source));
-    if (ret != 0) {
-        g_critical ("failed to start connection_source");
-        ret = EX_OSERR;
-        goto err_out;
+    for (i = 0; i < data->reader_count; ++i) {
+        init_thread_cpus (THREAD (data->command_sources [i]),
+                          data->options.reader_cpus);
     }
-    ret = thread_start (THREAD (data->resource_manager));
-    if (ret != 0) {
-        g_critical ("failed to start ResourceManager: %s", strerror (errno));
-        ret = EX_OSERR;
-        goto err_out;
+    for (i = 0; i < data->backend_count; ++i) {
+        init_thread_cpus (THREAD (data->resource_managers [i]),
+                          data->options.rm_cpus);
+        thread_set_sched (THREAD (data->resource_managers [i]),
+                          data->options.rm_fifo,
+                          data->options.rm_nice);
+        init_thread_cpus (THREAD (data->response_sinks [i]),
+                          data->options.sink_cpus);
     }
-    ret = thread_start (THREAD (data->response_sink));
-    if (ret != 0) {
-        g_critical ("failed to start response_source");
-        ret = EX_OSERR;
-        goto err_out;
+    for (i = 0; i < data->reader_count; ++i) {
+        ret = thread_start (THREAD (data->command_sources [i]));
+        if (ret != 0) {
+            g_critical ("failed to start connection_source");
+            ret = EX_OSERR;
+            goto err_out;
+        }
+    }
+    for (i = 0; i < data->backend_count; ++i) {
+        ret = thread_start (THREAD (data->resource_managers [i]));
+        if (ret != 0) {
+            g_critical ("failed to start ResourceManager: %s", strerror (errno));
+            ret = EX_OSERR;
+            goto err_out;
+        }
+        ret = thread_start (THREAD (data->response_sinks [i]));
+        if (ret != 0) {
+            g_critical ("failed to start response_source");
+            ret = EX_OSERR;
+            goto err_out;
+        }
     }
 
-    g_mutex_unlock (&data->init_mutex);
+    g_atomic_int_set (&data->ready, TRUE);
+    if (data->prewarm != NULL &&
+        !prewarm_start (data->prewarm,
+                        data->command_sources [0]->connection_manager,
+                        data->random,
+                        data->options.max_transients,
+                        data->backend_count))
+    {
+        g_warning ("failed to start prewarming, the caches fill as clients "
+                   "use them");
+    }
+    /* the next instance takes over from us through the handover socket */
+    if (data->options.handover_path != NULL) {
+        data->handover_service = handover_listen (data->options.handover_path);
+        if (data->handover_service != NULL) {
+            g_signal_connect (data->handover_service,
+                              "incoming",
+                              (GCallback) on_handover_incoming,
+                              data);
+            g_socket_service_start (data->handover_service);
+        }
+    }
+    if (data->options.metrics_address != NULL) {
+        data->metrics_service = metrics_listen (data->options.metrics_address);
+        if (data->metrics_service != NULL) {
+            g_signal_connect (data->metrics_service,
+                              "incoming",
+                              (GCallback) on_metrics_incoming,
+                              data);
+            g_socket_service_start (data->metrics_service);
+        }
+    }
     g_info ("init_thread_func done");
 
     return GINT_TO_POINTER (0);
 
 err_out:
-    g_mutex_unlock (&data->init_mutex);
+    g_clear_object (&command_attrs);
+    g_clear_object (&connection_manager);
+    if (locked) {
+        g_mutex_unlock (&data->init_mutex);
+    }
     g_debug ("%s: calling gmain_data_cleanup", __func__);
     gmain_data_cleanup (data);
     return GINT_TO_POINTER (ret);
@@ -2,14 +2,35 @@
 #define TABRMD_INIT_H
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "tpm2.h"
+#include "command-recorder.h"
 #include "command-source.h"
+#include "context-store.h"
+#include "dispatcher.h"
 #include "ipc-frontend.h"
+#include "prewarm.h"
 #include "random.h"
+#include "rate-limiter.h"
 #include "resource-manager.h"
 #include "response-sink.h"
+#include "stats-segment.h"
 #include "tabrmd-options.h"
+#include "trace-buffer.h"
+
+/*
+ * How busy the TPM of a backend was over the last sample period, for the
+ * Dispatcher. Only touched by backend_load, which runs with the
+ * Dispatcher mutex held.
+ */
+typedef struct {
+    gint64                  sampled_at;
+    guint64                 busy_us;
+    guint                   busy_tenths;
+} backend_load_t;
+/* the TPM busy time is sampled at most this often, in microseconds */
+#define BACKEND_LOAD_SAMPLE_US (100 * G_TIME_SPAN_MILLISECOND)
 
 /*
  * Structure to hold data that we pass to the gmain loop as 'user_data'.
@@ -20,13 +41,53 @@ typedef struct gmain_data {
     tabrmd_options_t        options;
     GMainLoop              *loop;
     Tpm2                   *tpm2;
-    ResourceManager        *resource_manager;
-    CommandSource          *command_source;
+    /* the CommandSources reading client connections, one per thread */
+    CommandSource          *command_sources [TABRMD_READERS_MAX];
+    guint                   reader_count;
     Random                 *random;
-    ResponseSink           *response_sink;
+    /* one ResourceManager and ResponseSink for each TPM backend */
+    ResourceManager        *resource_managers [TABRMD_BACKENDS_MAX];
+    ResponseSink           *response_sinks [TABRMD_BACKENDS_MAX];
+    guint                   backend_count;
+    backend_load_t          backend_loads [TABRMD_BACKENDS_MAX];
+    Dispatcher             *dispatcher;
     GMutex                  init_mutex;
     IpcFrontend            *ipc_frontend;
+    /*
+     * set up connections without D-Bus, with --socket or when started
+     * through socket activation
+     */
+    IpcFrontend            *ipc_frontend_unix;
+    /* serve clients on other hosts over TCP with mutual TLS, with --tcp */
+    IpcFrontend            *ipc_frontend_tcp;
     gboolean                ipc_disconnected;
+    /* set once the TPM command processing pipeline is running */
+    gint                    ready;
+    /*
+     * warm restart with --handover: the service a new instance takes over
+     * through, the connection to that instance which is closed last on
+     * exit, and the sessions received when we took over ourselves
+     */
+    GSocketService         *handover_service;
+    GSocketConnection      *handover_peer;
+    GList                  *handover_sessions;
+    gboolean                took_over;
+    /* serves the statistics to scrapers with --metrics */
+    GSocketService         *metrics_service;
+    /* writes the command streams to a file with --record */
+    CommandRecorder        *command_recorder;
+    /* keeps the spans of the commands going through with --trace */
+    TraceBuffer            *trace_buffer;
+    /* the counters and gauges tabrmd-top shows with --stats-segment */
+    stats_segment_t        *stats_segment;
+    /* the connections filling the caches at startup with --prewarm */
+    prewarm_t              *prewarm;
+    /* keeps the contexts of transient objects with --context-store */
+    ContextStore           *context_store;
+    /* limits the commands of each user with --uid-rate */
+    RateLimiter            *rate_limiter;
+    /* the owner password for --promote-max, from --owner-auth-file */
+    TPM2B_AUTH              owner_auth;
 } gmain_data_t;
 
 gpointer
@@ -36,5 +97,34 @@ gmain_data_cleanup (gmain_data_t *data);
 void
 on_ipc_frontend_disconnect (IpcFrontend *ipc_frontend,
                             gmain_data_t *data);
+TSS2_RC
+on_ipc_frontend_cancel (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data);
+TSS2_RC
+on_ipc_frontend_reset (IpcFrontend  *ipc_frontend,
+                       Connection   *connection,
+                       gmain_data_t *data);
+TSS2_RC
+on_ipc_frontend_resume (IpcFrontend  *ipc_frontend,
+                        Connection   *connection,
+                        gmain_data_t *data);
+GVariant*
+on_ipc_frontend_get_statistics (IpcFrontend  *ipc_frontend,
+                                gmain_data_t *data);
+GVariant*
+on_ipc_frontend_get_flight_records (IpcFrontend  *ipc_frontend,
+                                    gmain_data_t *data);
+TSS2_RC
+on_ipc_frontend_set_limit (IpcFrontend  *ipc_frontend,
+                           const gchar  *name,
+                           guint         value,
+                           gmain_data_t *data);
+GVariant*
+on_ipc_frontend_get_calibration (IpcFrontend  *ipc_frontend,
+                                 gmain_data_t *data);
+TSS2_RC
+on_ipc_frontend_calibrate (IpcFrontend  *ipc_frontend,
+                           gmain_data_t *data);
 
 #endif /* TABRMD_INIT_H */
@@ -8,7 +8,9 @@
 #include <string.h>
 
 #include "logging.h"
+#include "resource-manager.h"
 #include "tabrmd-options.h"
+#include "thread.h"
 #include "util.h"
 
 /* work around older glib versions missing this symbol */
@@ -54,8 +56,29 @@ tabrmd_options_free(tabrmd_options_t *opts)
     g_assert(opts);
 
     g_clear_pointer(&opts->dbus_name, g_free);
+    g_clear_pointer(&opts->socket_path, g_free);
+    g_clear_pointer(&opts->tcp_address, g_free);
+    g_clear_pointer(&opts->tls_cert_file, g_free);
+    g_clear_pointer(&opts->tls_key_file, g_free);
+    g_clear_pointer(&opts->tls_ca_file, g_free);
     g_clear_pointer(&opts->prng_seed_file, g_free);
-    g_clear_pointer(&opts->tcti_conf, g_free);
+    g_clear_pointer(&opts->cache_dir, g_free);
+    g_clear_pointer(&opts->handover_path, g_free);
+    g_clear_pointer(&opts->metrics_address, g_free);
+    g_clear_pointer(&opts->record_path, g_free);
+    g_clear_pointer(&opts->capture_path, g_free);
+    g_clear_pointer(&opts->trace_path, g_free);
+    g_clear_pointer(&opts->stats_segment_path, g_free);
+    g_clear_pointer(&opts->prewarm_path, g_free);
+    g_clear_pointer(&opts->key_pool_path, g_free);
+    g_clear_pointer(&opts->owner_auth_path, g_free);
+    g_clear_pointer(&opts->context_store_dir, g_free);
+    g_clear_pointer(&opts->kernel_rm, g_free);
+    g_clear_pointer(&opts->reader_cpus, g_free);
+    g_clear_pointer(&opts->rm_cpus, g_free);
+    g_clear_pointer(&opts->sink_cpus, g_free);
+    g_clear_pointer(&opts->uid_weights, g_strfreev);
+    g_clear_pointer(&opts->tcti_confs, g_strfreev);
 }
 
 /**
@@ -77,6 +100,9 @@ parse_opts (gint argc,
     GOptionContext *ctx;
     GError *err = NULL;
     gboolean session_bus = FALSE;
+    cpu_set_t cpus;
+    GHashTable *weights;
+    guint i;
 
     GOptionEntry entries[] = {
         { "dbus-name", 'n', 0, G_OPTION_ARG_STRING, &options->dbus_name,
@@ -86,21 +112,207 @@ parse_opts (gint argc,
           "The name of desired logger, stdout is default.", "[stdout|syslog]"},
         { "session", 's', 0, G_OPTION_ARG_NONE, &session_bus,
           "Connect to the session bus (system bus is default).", NULL },
+        { "socket", 'u', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->socket_path,
+          "Also accept connections on this Unix socket, without D-Bus.",
+          "path" },
+        { "tcp", 'O', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->tcp_address,
+          "Also accept connections from other hosts over TCP with mutual "
+          "TLS on this address.", "host[:port]" },
+        { "tls-cert", 'x', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->tls_cert_file,
+          "PEM certificate of the daemon for --tcp.", "path" },
+        { "tls-key", 'y', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->tls_key_file,
+          "PEM private key of the daemon for --tcp.", "path" },
+        { "tls-ca", 'z', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->tls_ca_file,
+          "PEM CA certificates --tcp clients must be signed by.", "path" },
         { "flush-all", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
           &options->flush_all,
           "Flush all objects and sessions from TPM on startup.", NULL },
+        { "calibrate", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &options->calibrate,
+          "Time a few representative operations on each TPM at startup to "
+          "seed the cost estimates.", NULL },
         { "max-connections", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_connections, "Maximum number of client connections.",
           NULL },
+        { "max-connections-per-pid", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_connections_pid,
+          "Maximum number of connections of one client process, 0 for no "
+          "limit.", NULL },
+        { "max-connections-per-uid", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_connections_uid,
+          "Maximum number of connections of the clients of one user, 0 for "
+          "no limit.", NULL },
         { "max-sessions", 'e', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_sessions,
           "Maximum number of sessions per connection.", NULL },
+        { "max-abandoned", 'B', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_abandoned,
+          "Maximum number of saved sessions kept after their connection "
+          "closes.", NULL },
         { "max-transients", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
           &options->max_transients,
           "Maximum number of loaded transient objects per client.", NULL },
+        { "max-pinned", 'K', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_pinned,
+          "Maximum number of transient objects each client may pin "
+          "resident, 0 disables pinning.", NULL },
+        { "primary-cache", 'p', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_primaries,
+          "Number of primary objects to cache, 0 disables the cache.", NULL },
+        { "pcr-cache", 'P', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_pcr_reads,
+          "Number of PCR_Read responses to cache, 0 disables the cache.",
+          NULL },
+        { "cap-cache-ms", 'V', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->cap_cache_ms,
+          "Milliseconds to cache GetCapability responses for the variable "
+          "TPM properties, 0 disables the cache.", NULL },
+        { "nv-cache", 'N', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_nv_reads,
+          "Number of NV_Read responses for immutable NV indices to cache, "
+          "0 disables the cache.", NULL },
+        { "test-cache", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_tests,
+          "Number of TestParms responses to cache along with GetTestResult, "
+          "0 disables the cache.", NULL },
+        { "object-share", 'L', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_shared,
+          "Number of objects from Load to share between clients, 0 "
+          "disables sharing.", NULL },
+        { "promote-max", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->promote_max,
+          "Number of the most used shared objects to make persistent, 0 "
+          "disables it.", NULL },
+        { "owner-auth-file", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->owner_auth_path,
+          "Read the owner password for --promote-max from this file.",
+          "path" },
+        { "entropy-pool", 'G', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->entropy_pool,
+          "Random bytes to fetch from the TPM when idle for GetRandom, "
+          "0 disables the pool.", NULL },
+        { "session-pool", 'A', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->session_pool,
+          "Unsalted, unbound HMAC sessions to start when idle for "
+          "StartAuthSession, 0 disables the pool.", NULL },
+        { "flight-recorder", 'F', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->flight_records,
+          "Number of recent commands to keep for SIGUSR1, 0 disables it.",
+          NULL },
+        { "slow-command-ms", 'S', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->slow_command_ms,
+          "Log commands taking longer than this many milliseconds, 0 "
+          "disables it.", NULL },
+        { "tpm-timeout-scale", 'T', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->tpm_timeout_scale,
+          "Cancel commands the TPM takes this many times longer than usual "
+          "for, 0 disables it.", NULL },
+        { "max-lease-ms", 'E', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_lease_ms,
+          "Longest a client may lease the TPM for in milliseconds, 0 "
+          "disables leases.", NULL },
+        { "resume-ms", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->resume_ms,
+          "Keep the objects and sessions of a closed connection this many "
+          "milliseconds for a client to resume it, 0 disables it.", NULL },
+        { "max-queued", 'q', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_queued,
+          "Maximum number of queued commands per connection, 0 for no limit.",
+          NULL },
+        { "max-memory", 'W', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_memory,
+          "KiB of daemon memory each connection may use before its commands "
+          "are refused, 0 for no limit.", NULL },
+        { "uid-rate", 'Q', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->uid_rate,
+          "Commands a second the clients of each user may send, 0 for no "
+          "limit.", NULL },
+        { "uid-weight", 'k', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY,
+          &options->uid_weights,
+          "Share of the TPM time of a user as UID:WEIGHT, may be given more "
+          "than once.", "UID:WEIGHT" },
+        { "max-waiting", 'w', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->max_waiting,
+          "Maximum number of clients waiting for a connection, 0 to disable.",
+          NULL },
+        { "readers", 'j', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->readers,
+          "Number of threads reading commands from client connections.",
+          NULL },
+        { "reader-cpus", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->reader_cpus,
+          "Run the threads reading commands on these CPUs.", "0-3,6" },
+        { "rm-cpus", 'U', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->rm_cpus,
+          "Run the threads sending commands to the TPM on these CPUs.",
+          "0-3,6" },
+        { "sink-cpus", 'Y', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->sink_cpus,
+          "Run the threads writing responses on these CPUs.", "0-3,6" },
+        { "rm-fifo", 'Z', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->rm_fifo,
+          "Run the threads sending commands to the TPM under SCHED_FIFO "
+          "at this priority, 0 for the default policy.", NULL },
+        { "rm-nice", 'I', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->rm_nice,
+          "Nice value for the threads sending commands to the TPM.", NULL },
         { "prng-seed-file", 'g', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
           &options->prng_seed_file, "File to read seed value for PRNG",
           options->prng_seed_file },
+        { "cache-dir", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->cache_dir,
+          "Cache the fixed TPM capabilities in this directory.", "path" },
+        { "handover", 'H', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->handover_path,
+          "Take over from the instance listening on this socket, then listen on it.",
+          "path" },
+        { "metrics", 'M', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &options->metrics_address,
+          "Serve OpenMetrics on this Unix socket or localhost TCP port.",
+          "path|port" },
+        { "record", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->record_path,
+          "Record the commands and responses of all connections to this file.",
+          "path" },
+        { "capture", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->capture_path,
+          "Capture the commands and responses of all connections to this "
+          "pcap-ng file.", "path" },
+        { "capture-max-mb", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->capture_max_mb,
+          "Start a new capture file once it reaches this many MiB.", NULL },
+        { "trace", 'J', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->trace_path,
+          "Trace the commands going through the daemon, written to this "
+          "file as Chrome trace JSON on SIGUSR2 and on exit.", "path" },
+        { "trace-spans", 'b', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &options->trace_spans,
+          "Number of recent spans to keep for --trace.", NULL },
+        { "stats-segment", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->stats_segment_path,
+          "Publish the statistics in a file at this path for tabrmd-top "
+          "to map.", "path" },
+        { "prewarm", 'a', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->prewarm_path,
+          "Send the CreatePrimary and Load commands in this file at startup "
+          "to fill the primary cache and the object share.", "path" },
+        { "key-pool", 'D', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->key_pool_path,
+          "Create keys from the Create commands in this file while the TPM "
+          "is idle and answer matching Create commands with them.", "path" },
+        { "context-store", 'X', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->context_store_dir,
+          "Keep the saved contexts of transient objects in a file in this "
+          "directory rather than in memory.", "path" },
+        { "kernel-rm", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+          &options->kernel_rm,
+          "Give each connection its own file on this kernel resource "
+          "manager device, which swaps the contexts for it.", "path" },
         { "version", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
           show_version, "Show version string", NULL },
         { "allow-root", 'o', 0, G_OPTION_ARG_NONE,
@@ -110,15 +322,14 @@ parse_opts (gint argc,
             .long_name       = "tcti",
             .short_name      = 't',
             .flags           = G_OPTION_FLAG_NONE,
-            .arg             = G_OPTION_ARG_STRING,
-            .arg_data        = &options->tcti_conf,
-            .description     = "TCTI configuration string. See tpm2-abrmd (8) for search rules.",
+            .arg             = G_OPTION_ARG_STRING_ARRAY,
+            .arg_data        = &options->tcti_confs,
+            .description     = "TCTI configuration string. See tpm2-abrmd (8) for search rules. Repeat for each TPM to serve.",
             .arg_description = "tcti-conf",
         },
         { NULL, '\0', 0, 0, NULL, NULL, NULL },
     };
 
-    g_debug ("tcti_conf before: \"%s\"", options->tcti_conf);
 
     ctx = g_option_context_new (" - TPM2 software stack Access Broker Daemon (tabrmd)");
     g_option_context_add_main_entries (ctx, entries, NULL);
@@ -135,7 +346,10 @@ parse_opts (gint argc,
      */
     SET_STR_IF_NULL(options->dbus_name, TABRMD_DBUS_NAME_DEFAULT);
     SET_STR_IF_NULL(options->prng_seed_file, TABRMD_ENTROPY_SRC_DEFAULT);
-    SET_STR_IF_NULL(options->tcti_conf, TABRMD_TCTI_CONF_DEFAULT);
+    if (options->tcti_confs == NULL) {
+        gchar *tcti_confs_default [] = { TABRMD_TCTI_CONF_DEFAULT, NULL };
+        options->tcti_confs = g_strdupv (tcti_confs_default);
+    }
     SET_STR_IF_NULL(logger_name, "stdout");
 
     /* select the bus type, default to G_BUS_TYPE_SESSION */
@@ -155,11 +369,23 @@ parse_opts (gint argc,
                     "and %d", TABRMD_CONNECTION_MAX);
         goto error;
     }
+    if (options->max_connections_pid > TABRMD_CONNECTION_MAX ||
+        options->max_connections_uid > TABRMD_CONNECTION_MAX)
+    {
+        g_critical ("max-connections-per-pid and max-connections-per-uid "
+                    "must be between 0 and %d", TABRMD_CONNECTION_MAX);
+        goto error;
+    }
     if (options->max_sessions < 1 ||
-        options->max_sessions > TABRMD_SESSIONS_MAX_DEFAULT)
+        options->max_sessions > TABRMD_SESSIONS_MAX)
     {
         g_critical ("max-sessions must be between 1 and %d",
-                    TABRMD_SESSIONS_MAX_DEFAULT);
+                    TABRMD_SESSIONS_MAX);
+        goto error;
+    }
+    if (options->max_abandoned > TABRMD_ABANDONED_MAX) {
+        g_critical ("max-abandoned must be between 0 and %d",
+                    TABRMD_ABANDONED_MAX);
         goto error;
     }
     if (options->max_transients < 1 ||
@@ -169,7 +395,185 @@ parse_opts (gint argc,
                     TABRMD_TRANSIENT_MAX);
         goto error;
     }
-    g_debug ("tcti_conf after: \"%s\"", options->tcti_conf);
+    if (options->max_pinned > TABRMD_PINNED_MAX) {
+        g_critical ("max-pinned parameter must be between 0 and %d",
+                    TABRMD_PINNED_MAX);
+        goto error;
+    }
+    if (options->max_primaries > TABRMD_PRIMARY_CACHE_MAX) {
+        g_critical ("primary-cache parameter must be between 0 and %d",
+                    TABRMD_PRIMARY_CACHE_MAX);
+        goto error;
+    }
+    if (options->max_pcr_reads > TABRMD_PCR_CACHE_MAX) {
+        g_critical ("pcr-cache parameter must be between 0 and %d",
+                    TABRMD_PCR_CACHE_MAX);
+        goto error;
+    }
+    if (options->cap_cache_ms > TABRMD_CAP_CACHE_MAX) {
+        g_critical ("cap-cache-ms parameter must be between 0 and %d",
+                    TABRMD_CAP_CACHE_MAX);
+        goto error;
+    }
+    if (options->max_nv_reads > TABRMD_NV_CACHE_MAX) {
+        g_critical ("nv-cache parameter must be between 0 and %d",
+                    TABRMD_NV_CACHE_MAX);
+        goto error;
+    }
+    if (options->max_tests > TABRMD_TEST_CACHE_MAX) {
+        g_critical ("test-cache parameter must be between 0 and %d",
+                    TABRMD_TEST_CACHE_MAX);
+        goto error;
+    }
+    if (options->max_shared > TABRMD_OBJECT_SHARE_MAX) {
+        g_critical ("object-share parameter must be between 0 and %d",
+                    TABRMD_OBJECT_SHARE_MAX);
+        goto error;
+    }
+    if (options->promote_max > TABRMD_PROMOTE_MAX) {
+        g_critical ("promote-max parameter must be between 0 and %d",
+                    TABRMD_PROMOTE_MAX);
+        goto error;
+    }
+    if (options->promote_max > 0 && options->max_shared == 0) {
+        g_critical ("promote-max parameter needs object-share");
+        goto error;
+    }
+    if (options->entropy_pool > TABRMD_ENTROPY_POOL_MAX) {
+        g_critical ("entropy-pool parameter must be between 0 and %d",
+                    TABRMD_ENTROPY_POOL_MAX);
+        goto error;
+    }
+    if (options->session_pool > TABRMD_SESSION_POOL_MAX) {
+        g_critical ("session-pool parameter must be between 0 and %d",
+                    TABRMD_SESSION_POOL_MAX);
+        goto error;
+    }
+    if (options->flight_records > TABRMD_FLIGHT_RECORDER_MAX) {
+        g_critical ("flight-recorder parameter must be between 0 and %d",
+                    TABRMD_FLIGHT_RECORDER_MAX);
+        goto error;
+    }
+    if (options->trace_spans < 1 ||
+        options->trace_spans > TABRMD_TRACE_SPANS_MAX)
+    {
+        g_critical ("trace-spans parameter must be between 1 and %d",
+                    TABRMD_TRACE_SPANS_MAX);
+        goto error;
+    }
+    if (options->slow_command_ms > TABRMD_SLOW_COMMAND_MAX) {
+        g_critical ("slow-command-ms parameter must be between 0 and %d",
+                    TABRMD_SLOW_COMMAND_MAX);
+        goto error;
+    }
+    if (options->tpm_timeout_scale > TABRMD_TPM_TIMEOUT_SCALE_MAX) {
+        g_critical ("tpm-timeout-scale parameter must be between 0 and %d",
+                    TABRMD_TPM_TIMEOUT_SCALE_MAX);
+        goto error;
+    }
+    if (options->max_lease_ms > TABRMD_LEASE_MAX) {
+        g_critical ("max-lease-ms parameter must be between 0 and %d",
+                    TABRMD_LEASE_MAX);
+        goto error;
+    }
+    if (options->resume_ms > TABRMD_RESUME_MAX) {
+        g_critical ("resume-ms parameter must be between 0 and %d",
+                    TABRMD_RESUME_MAX);
+        goto error;
+    }
+    if (options->capture_max_mb > TABRMD_CAPTURE_MAX) {
+        g_critical ("capture-max-mb parameter must be between 0 and %d",
+                    TABRMD_CAPTURE_MAX);
+        goto error;
+    }
+    if (options->max_queued > TABRMD_QUEUED_MAX) {
+        g_critical ("max-queued parameter must be between 0 and %d",
+                    TABRMD_QUEUED_MAX);
+        goto error;
+    }
+    if (options->max_memory > TABRMD_CONNECTION_MEMORY_MAX) {
+        g_critical ("max-memory parameter must be between 0 and %d",
+                    TABRMD_CONNECTION_MEMORY_MAX);
+        goto error;
+    }
+    if (options->uid_rate > TABRMD_UID_RATE_MAX) {
+        g_critical ("uid-rate parameter must be between 0 and %d",
+                    TABRMD_UID_RATE_MAX);
+        goto error;
+    }
+    if (options->uid_weights != NULL) {
+        weights = resource_manager_parse_uid_weights (options->uid_weights);
+        if (weights == NULL) {
+            g_critical ("uid-weight parameter must be a UID and a weight "
+                        "between 1 and %d separated by a colon, like 1000:4",
+                        TABRMD_UID_WEIGHT_MAX);
+            goto error;
+        }
+        g_hash_table_unref (weights);
+    }
+    if (options->tcp_address != NULL &&
+        (options->tls_cert_file == NULL || options->tls_key_file == NULL ||
+         options->tls_ca_file == NULL))
+    {
+        g_critical ("tcp parameter needs tls-cert, tls-key and tls-ca");
+        goto error;
+    }
+    if (options->max_waiting > TABRMD_WAITING_MAX) {
+        g_critical ("max-waiting parameter must be between 0 and %d",
+                    TABRMD_WAITING_MAX);
+        goto error;
+    }
+    if (options->readers < 1 || options->readers > TABRMD_READERS_MAX) {
+        g_critical ("readers parameter must be between 1 and %d",
+                    TABRMD_READERS_MAX);
+        goto error;
+    }
+    if (options->rm_fifo > TABRMD_RM_FIFO_MAX) {
+        g_critical ("rm-fifo parameter must be between 0 and %d",
+                    TABRMD_RM_FIFO_MAX);
+        goto error;
+    }
+    if (options->rm_nice < TABRMD_RM_NICE_MIN ||
+        options->rm_nice > TABRMD_RM_NICE_MAX)
+    {
+        g_critical ("rm-nice parameter must be between %d and %d",
+                    TABRMD_RM_NICE_MIN, TABRMD_RM_NICE_MAX);
+        goto error;
+    }
+    if ((options->reader_cpus != NULL &&
+         !thread_parse_cpus (options->reader_cpus, &cpus)) ||
+        (options->rm_cpus != NULL &&
+         !thread_parse_cpus (options->rm_cpus, &cpus)) ||
+        (options->sink_cpus != NULL &&
+         !thread_parse_cpus (options->sink_cpus, &cpus)))
+    {
+        g_critical ("CPU lists must be CPU numbers or ranges separated by "
+                    "commas, like 0-3,6");
+        goto error;
+    }
+    if (g_strv_length (options->tcti_confs) > TABRMD_BACKENDS_MAX) {
+        g_critical ("tcti parameter may be given at most %d times",
+                    TABRMD_BACKENDS_MAX);
+        goto error;
+    }
+    /* the device is one TPM, what clients load is in files only we have */
+    if (options->kernel_rm != NULL &&
+        (g_strv_length (options->tcti_confs) > 1 ||
+         options->handover_path != NULL))
+    {
+        g_critical ("kernel-rm parameter can't be used with several tcti "
+                    "parameters or with handover");
+        goto error;
+    }
+    /* a resumed connection has to land on the backend that kept the old one */
+    if (options->resume_ms > 0 && g_strv_length (options->tcti_confs) > 1) {
+        g_critical ("resume-ms parameter can't be used with several tcti "
+                    "parameters");
+        goto error;
+    }
+    for (i = 0; options->tcti_confs [i] != NULL; ++i) {
+        g_debug ("tcti_conf %u: \"%s\"", i, options->tcti_confs [i]);
+    }
     return TRUE;
 
 error:
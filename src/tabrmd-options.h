@@ -12,25 +12,122 @@
 #define TABRMD_OPTIONS_INIT_DEFAULT { \
     .bus = (GBusType)TABRMD_DBUS_TYPE_DEFAULT, \
     .flush_all = FALSE, \
+    .calibrate = FALSE, \
     .max_connections = TABRMD_CONNECTIONS_MAX_DEFAULT, \
+    .max_connections_pid = TABRMD_CONNECTIONS_PID_MAX_DEFAULT, \
+    .max_connections_uid = TABRMD_CONNECTIONS_UID_MAX_DEFAULT, \
     .max_transients = TABRMD_TRANSIENT_MAX_DEFAULT, \
+    .max_pinned = TABRMD_PINNED_MAX_DEFAULT, \
     .max_sessions = TABRMD_SESSIONS_MAX_DEFAULT, \
+    .max_abandoned = TABRMD_ABANDONED_MAX_DEFAULT, \
+    .max_primaries = TABRMD_PRIMARY_CACHE_DEFAULT, \
+    .max_pcr_reads = TABRMD_PCR_CACHE_DEFAULT, \
+    .cap_cache_ms = TABRMD_CAP_CACHE_DEFAULT, \
+    .max_nv_reads = TABRMD_NV_CACHE_DEFAULT, \
+    .max_tests = TABRMD_TEST_CACHE_DEFAULT, \
+    .max_shared = TABRMD_OBJECT_SHARE_DEFAULT, \
+    .promote_max = TABRMD_PROMOTE_DEFAULT, \
+    .entropy_pool = TABRMD_ENTROPY_POOL_DEFAULT, \
+    .session_pool = TABRMD_SESSION_POOL_DEFAULT, \
+    .flight_records = TABRMD_FLIGHT_RECORDER_DEFAULT, \
+    .trace_spans = TABRMD_TRACE_SPANS_DEFAULT, \
+    .slow_command_ms = TABRMD_SLOW_COMMAND_DEFAULT, \
+    .tpm_timeout_scale = TABRMD_TPM_TIMEOUT_SCALE_DEFAULT, \
+    .max_lease_ms = TABRMD_LEASE_MAX_DEFAULT, \
+    .resume_ms = TABRMD_RESUME_DEFAULT, \
+    .capture_max_mb = TABRMD_CAPTURE_MAX_DEFAULT, \
+    .max_queued = TABRMD_QUEUED_MAX_DEFAULT, \
+    .max_memory = TABRMD_CONNECTION_MEMORY_DEFAULT, \
+    .uid_rate = TABRMD_UID_RATE_DEFAULT, \
+    .max_waiting = TABRMD_WAITING_MAX_DEFAULT, \
+    .readers = TABRMD_READERS_DEFAULT, \
+    .rm_fifo = 0, \
+    .rm_nice = 0, \
     .dbus_name = NULL, \
+    .socket_path = NULL, \
+    .tcp_address = NULL, \
+    .tls_cert_file = NULL, \
+    .tls_key_file = NULL, \
+    .tls_ca_file = NULL, \
     .prng_seed_file = NULL, \
+    .cache_dir = NULL, \
+    .handover_path = NULL, \
+    .metrics_address = NULL, \
+    .record_path = NULL, \
+    .capture_path = NULL, \
+    .trace_path = NULL, \
+    .stats_segment_path = NULL, \
+    .prewarm_path = NULL, \
+    .key_pool_path = NULL, \
+    .owner_auth_path = NULL, \
+    .context_store_dir = NULL, \
+    .kernel_rm = NULL, \
+    .reader_cpus = NULL, \
+    .rm_cpus = NULL, \
+    .sink_cpus = NULL, \
     .allow_root = FALSE, \
-    .tcti_conf = NULL, \
+    .tcti_confs = NULL, \
 }
 
 typedef struct tabrmd_options {
     GBusType        bus;
     gboolean        flush_all;
+    gboolean        calibrate;
     guint           max_connections;
+    guint           max_connections_pid;
+    guint           max_connections_uid;
     guint           max_transients;
+    guint           max_pinned;
     guint           max_sessions;
+    guint           max_abandoned;
+    guint           max_primaries;
+    guint           max_pcr_reads;
+    guint           cap_cache_ms;
+    guint           max_nv_reads;
+    guint           max_tests;
+    guint           max_shared;
+    guint           promote_max;
+    guint           entropy_pool;
+    guint           session_pool;
+    guint           flight_records;
+    guint           trace_spans;
+    guint           slow_command_ms;
+    guint           tpm_timeout_scale;
+    guint           max_lease_ms;
+    guint           resume_ms;
+    guint           capture_max_mb;
+    guint           max_queued;
+    guint           max_memory;
+    guint           uid_rate;
+    guint           max_waiting;
+    guint           readers;
+    guint           rm_fifo;
+    gint            rm_nice;
     gchar          *dbus_name;
+    gchar          *socket_path;
+    gchar          *tcp_address;
+    gchar          *tls_cert_file;
+    gchar          *tls_key_file;
+    gchar          *tls_ca_file;
     gchar          *prng_seed_file;
+    gchar          *cache_dir;
+    gchar          *handover_path;
+    gchar          *metrics_address;
+    gchar          *record_path;
+    gchar          *capture_path;
+    gchar          *trace_path;
+    gchar          *stats_segment_path;
+    gchar          *prewarm_path;
+    gchar          *key_pool_path;
+    gchar          *owner_auth_path;
+    gchar          *context_store_dir;
+    gchar          *kernel_rm;
+    gchar          *reader_cpus;
+    gchar          *rm_cpus;
+    gchar          *sink_cpus;
+    gchar         **uid_weights;
     gboolean        allow_root;
-    gchar          *tcti_conf;
+    gchar         **tcti_confs;
 } tabrmd_options_t;
 
 gboolean
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TABRMD_TCP_H
+#define TABRMD_TCP_H
+
+#include "tabrmd-unix.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Setting up a connection through the IpcFrontendTcp takes the same
+ * request and reply as the IpcFrontendUnix, see tabrmd-unix.h, sent over
+ * the TLS session once the handshake is done. The ends may be on hosts of
+ * different byte order so the fields are big-endian. No fds can go with
+ * the reply: once it's sent the TLS session itself carries the commands
+ * and responses of the connection, framed like a stream socket.
+ */
+#define TABRMD_TCP_MAGIC   0x74616274
+#define TABRMD_TCP_VERSION 1
+/* the port we listen on if the address doesn't have one */
+#define TABRMD_TCP_PORT_DEFAULT 2325
+
+G_END_DECLS
+#endif /* TABRMD_TCP_H */
@@ -0,0 +1,297 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "stats-segment.h"
+#include "tabrmd-defaults.h"
+
+/*
+ * tabrmd-top shows what the daemon publishes with --stats-segment: for
+ * each TPM the commands, context swaps and flushes per second, its queue
+ * depths and the median and 99th percentile latency of its commands, then
+ * the connections by the commands they sent per second. Rates are over
+ * the delay between two screens. The segment is mapped again for each
+ * screen so a restarted daemon is picked up.
+ */
+typedef struct {
+    gint64                     time;
+    guint32                    pid;
+    guint                      backends;
+    stats_segment_backend_t    backend [STATS_SEGMENT_BACKENDS];
+    stats_segment_connection_t connection [STATS_SEGMENT_CONNECTIONS];
+} top_snapshot_t;
+
+typedef struct {
+    const stats_segment_connection_t *now;
+    gdouble                           commands;
+    gdouble                           bytes_in;
+    gdouble                           bytes_out;
+    gdouble                           tpm_share;
+    gdouble                           swaps;
+} top_row_t;
+
+static gchar *segment_path = NULL;
+static gint delay = TABRMD_TOP_DELAY_DEFAULT;
+static gint iterations = 0;
+
+static GOptionEntry entries [] = {
+    { "segment", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME,
+      &segment_path,
+      "The statistics segment of the daemon, by default "
+      TABRMD_STATS_SEGMENT_DEFAULT ".", "path" },
+    { "delay", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &delay,
+      "Seconds between screens.", NULL },
+    { "iterations", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &iterations,
+      "Exit after this many screens, 0 to go on until interrupted.", NULL },
+    { NULL },
+};
+/*
+ * Take a consistent copy of every record of the segment at 'path'.
+ * Records that are being written on every try are left zeroed.
+ */
+static gboolean
+top_snapshot (const gchar    *path,
+              top_snapshot_t *snapshot)
+{
+    stats_segment_t *segment;
+    guint i;
+
+    memset (snapshot, 0, sizeof (*snapshot));
+    segment = stats_segment_open (path);
+    if (segment == NULL) {
+        return FALSE;
+    }
+    snapshot->time = g_get_monotonic_time ();
+    snapshot->pid = segment->pid;
+    snapshot->backends = MIN (segment->backends, STATS_SEGMENT_BACKENDS);
+    for (i = 0; i < snapshot->backends; ++i) {
+        stats_segment_read (&segment->backend [i].seq,
+                            &segment->backend [i],
+                            &snapshot->backend [i],
+                            sizeof (snapshot->backend [i]));
+    }
+    for (i = 0; i < STATS_SEGMENT_CONNECTIONS; ++i) {
+        stats_segment_read (&segment->connection [i].seq,
+                            &segment->connection [i],
+                            &snapshot->connection [i],
+                            sizeof (snapshot->connection [i]));
+    }
+    stats_segment_unmap (segment);
+    return TRUE;
+}
+/*
+ * The upper bound in microseconds of the latency bucket holding the
+ * 'percent' percentile of the commands counted between two snapshots.
+ */
+static guint64
+top_percentile (const stats_segment_backend_t *now,
+                const stats_segment_backend_t *before,
+                guint                          percent)
+{
+    guint64 counts [STATS_SEGMENT_BUCKETS], total = 0, seen = 0;
+    guint i;
+
+    for (i = 0; i < STATS_SEGMENT_BUCKETS; ++i) {
+        counts [i] = now->latency [i] - before->latency [i];
+        total += counts [i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (i = 0; i < STATS_SEGMENT_BUCKETS; ++i) {
+        seen += counts [i];
+        if (seen * 100 >= total * percent) {
+            break;
+        }
+    }
+    return i == 0 ? 0 : G_GUINT64_CONSTANT (1) << i;
+}
+static gdouble
+top_rate (guint64 now,
+          guint64 before,
+          gdouble seconds)
+{
+    return now >= before ? (gdouble)(now - before) / seconds : 0;
+}
+static gint
+top_row_compare (gconstpointer a,
+                 gconstpointer b)
+{
+    const top_row_t *row_a = a, *row_b = b;
+
+    if (row_a->commands != row_b->commands) {
+        return row_a->commands < row_b->commands ? 1 : -1;
+    }
+    return row_a->now->serial < row_b->now->serial ? -1 : 1;
+}
+static void
+top_print_backends (const top_snapshot_t *now,
+                    const top_snapshot_t *before,
+                    gdouble               seconds)
+{
+    const stats_segment_backend_t *cur, *prev;
+    guint i;
+
+    g_print ("%-3s %9s %8s %8s %8s %6s %7s %8s %6s %9s %9s\n",
+             "TPM", "CMD/s", "LOAD/s", "SAVE/s", "FLUSH/s", "QUEUE",
+             "FLUSHQ", "RESIDENT", "SESS", "P50us", "P99us");
+    for (i = 0; i < now->backends; ++i) {
+        cur = &now->backend [i];
+        prev = &before->backend [i];
+        if (!cur->in_use) {
+            continue;
+        }
+        g_print ("%-3u %9.1f %8.1f %8.1f %8.1f %6" PRIu32 " %7" PRIu32
+                 " %8" PRIu32 " %6" PRIu32 " %9" PRIu64 " %9" PRIu64 "\n",
+                 i,
+                 top_rate (cur->commands, prev->commands, seconds),
+                 top_rate (cur->context_loads, prev->context_loads, seconds),
+                 top_rate (cur->context_saves, prev->context_saves, seconds),
+                 top_rate (cur->context_flushes, prev->context_flushes,
+                           seconds),
+                 cur->queued,
+                 cur->flushes_queued,
+                 cur->resident,
+                 cur->sessions,
+                 top_percentile (cur, prev, 50),
+                 top_percentile (cur, prev, 99));
+    }
+}
+/*
+ * A connection's rates are against the same connection in the earlier
+ * snapshot, those that weren't in it yet start from nothing.
+ */
+static void
+top_print_connections (const top_snapshot_t *now,
+                       const top_snapshot_t *before,
+                       gdouble               seconds)
+{
+    static const stats_segment_connection_t none = { 0, };
+    const stats_segment_connection_t *cur, *prev;
+    top_row_t rows [STATS_SEGMENT_CONNECTIONS];
+    guint i, count = 0;
+
+    for (i = 0; i < STATS_SEGMENT_CONNECTIONS; ++i) {
+        cur = &now->connection [i];
+        if (cur->serial == 0) {
+            continue;
+        }
+        prev = before->connection [i].serial == cur->serial ?
+            &before->connection [i] : &none;
+        rows [count].now = cur;
+        rows [count].commands = top_rate (cur->commands, prev->commands,
+                                          seconds);
+        rows [count].bytes_in = top_rate (cur->bytes_in, prev->bytes_in,
+                                          seconds);
+        rows [count].bytes_out = top_rate (cur->bytes_out, prev->bytes_out,
+                                           seconds);
+        rows [count].tpm_share = top_rate (cur->exec_us, prev->exec_us,
+                                           seconds) / 10000;
+        rows [count].swaps = top_rate (cur->context_loads +
+                                           cur->context_saves,
+                                       prev->context_loads +
+                                           prev->context_saves,
+                                       seconds);
+        ++count;
+    }
+    qsort (rows, count, sizeof (rows [0]), top_row_compare);
+    g_print ("\n%-8s %-3s %7s %7s %9s %10s %10s %6s %5s %5s %8s\n",
+             "SERIAL", "TPM", "PID", "UID", "CMD/s", "IN/s", "OUT/s",
+             "TPM%", "TRANS", "SESS", "SWAPS/s");
+    for (i = 0; i < count; ++i) {
+        cur = rows [i].now;
+        g_print ("%-8" PRIu32 " %-3" PRIu32 " %7" PRIu32 " %7" PRIu32
+                 " %9.1f %10.0f %10.0f %6.1f %5" PRIu32 " %5" PRIu32
+                 " %8.1f\n",
+                 cur->serial,
+                 cur->backend,
+                 cur->pid,
+                 cur->uid,
+                 rows [i].commands,
+                 rows [i].bytes_in,
+                 rows [i].bytes_out,
+                 rows [i].tpm_share,
+                 cur->transients,
+                 cur->sessions,
+                 rows [i].swaps);
+    }
+}
+static void
+top_print (const gchar          *path,
+           const top_snapshot_t *now,
+           const top_snapshot_t *before)
+{
+    gdouble seconds;
+
+    if (isatty (STDOUT_FILENO)) {
+        g_print ("\033[H\033[2J");
+    }
+    seconds = (gdouble)(now->time - before->time) / G_USEC_PER_SEC;
+    seconds = MAX (seconds, 0.001);
+    g_print ("tpm2-abrmd pid %" PRIu32 "%s, %u TPMs, %s\n\n",
+             now->pid,
+             kill ((pid_t)now->pid, 0) != 0 && errno == ESRCH ?
+                 " (gone)" : "",
+             now->backends,
+             path);
+    /* the daemon was restarted, the counters started over */
+    if (before->pid != now->pid) {
+        before = now;
+    }
+    top_print_backends (now, before, seconds);
+    top_print_connections (now, before, seconds);
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    top_snapshot_t *now, *before, *tmp;
+    const gchar *path;
+    gint i, ret = 0;
+
+    ctx = g_option_context_new (" - show the statistics of tpm2-abrmd");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+        g_printerr ("%s\n", err->message);
+        g_clear_error (&err);
+        g_option_context_free (ctx);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free (ctx);
+    if (delay < 1 || iterations < 0) {
+        g_printerr ("--delay must be at least 1 and --iterations at "
+                    "least 0\n");
+        return EXIT_FAILURE;
+    }
+    path = segment_path != NULL ? segment_path : TABRMD_STATS_SEGMENT_DEFAULT;
+    now = g_new (top_snapshot_t, 1);
+    before = g_new (top_snapshot_t, 1);
+    if (!top_snapshot (path, before)) {
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+    for (i = 0; iterations == 0 || i < iterations; ++i) {
+        sleep ((guint)delay);
+        if (!top_snapshot (path, now)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+        top_print (path, now, before);
+        tmp = before;
+        before = now;
+        now = tmp;
+    }
+out:
+    g_free (now);
+    g_free (before);
+    g_free (segment_path);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TABRMD_UNIX_H
+#define TABRMD_UNIX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Messages exchanged with the IpcFrontendUnix to set up a connection
+ * without going through D-Bus. Both ends are on the same host so the
+ * fields are in host byte order. The client sends one request after
+ * connecting to the socket and gets one reply back. A successful reply
+ * carries the same fds as the D-Bus CreateConnectionWithFlags method as
+ * SCM_RIGHTS ancillary data: the connection socket, followed by the
+ * shared memory transport if it was granted. The setup socket is closed
+ * by the daemon once the reply has been sent.
+ */
+#define TABRMD_UNIX_MAGIC   0x74616273
+#define TABRMD_UNIX_VERSION 1
+
+typedef struct {
+    guint32           magic;
+    guint32           version;
+    guint32           priority;
+    guint32           flags;
+} tabrmd_unix_request_t;
+
+/*
+ * 'rc' is a TSS2_RC from the RESMGR layer, the other fields are only
+ * valid if it's TSS2_RC_SUCCESS. 'flags' are the connection flags granted
+ * and 'id' identifies the connection like the id from CreateConnection.
+ */
+typedef struct {
+    guint32           rc;
+    guint32           flags;
+    guint64           id;
+} tabrmd_unix_reply_t;
+
+G_END_DECLS
+#endif /* TABRMD_UNIX_H */
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <tss2/tss2_tpm2_types.h>
 
+#include "logging.h"
 #include "tabrmd-options.h"
 #include "tabrmd-init.h"
 #include "tabrmd.h"
@@ -66,5 +67,6 @@ main (int argc, char *argv[])
     }
 out:
     gmain_data_cleanup (&gmain_data);
+    logging_stop ();
     return ret;
 }
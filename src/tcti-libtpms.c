@@ -0,0 +1,415 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#ifdef HAVE_LIBTPMS
+#include <libtpms/tpm_error.h>
+#include <libtpms/tpm_library.h>
+#include <libtpms/tpm_memory.h>
+#endif
+
+#include "tcti-libtpms.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#ifdef HAVE_LIBTPMS
+
+typedef enum {
+    TCTI_LIBTPMS_SEND,
+    TCTI_LIBTPMS_RECEIVE,
+} tcti_libtpms_state_t;
+
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 v2;
+    tcti_libtpms_state_t state;
+    /* directory the NV state is kept in, NULL to keep it in 'blobs' */
+    gchar            *state_dir;
+    /* GHashTable mapping the name of each NV state blob to its GBytes */
+    GHashTable       *blobs;
+    uint8_t           locality;
+    /* TPMLIB_Process may write to the command so it gets a copy */
+    uint8_t           command [TPM2_MAX_COMMAND_SIZE];
+    /* allocated and grown by TPMLIB_Process */
+    unsigned char    *response;
+    uint32_t          response_size;
+    uint32_t          response_buf_size;
+} TCTI_LIBTPMS_CONTEXT;
+
+/* libtpms has one TPM per process, this is the context that owns it */
+static TCTI_LIBTPMS_CONTEXT *tcti_libtpms_owner = NULL;
+
+static TPM_RESULT
+tcti_libtpms_nvram_init (void)
+{
+    return TPM_SUCCESS;
+}
+/*
+ * libtpms callback loading the NV state blob 'name' into a buffer it
+ * frees itself. TPM_RETRY tells it there's no such blob yet, which is
+ * how a new TPM is manufactured.
+ */
+static TPM_RESULT
+tcti_libtpms_nvram_loaddata (unsigned char **data,
+                             uint32_t       *length,
+                             uint32_t        tpm_number,
+                             const char     *name)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_owner;
+    GError *error = NULL;
+    GBytes *blob;
+    gchar *path, *contents;
+    gsize size;
+    UNUSED_PARAM(tpm_number);
+
+    if (libtpms->state_dir == NULL) {
+        blob = g_hash_table_lookup (libtpms->blobs, name);
+        if (blob == NULL) {
+            return TPM_RETRY;
+        }
+        contents = g_bytes_unref_to_data (g_bytes_ref (blob), &size);
+    } else {
+        path = g_build_filename (libtpms->state_dir, name, NULL);
+        if (!g_file_get_contents (path, &contents, &size, &error)) {
+            g_free (path);
+            if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+                g_clear_error (&error);
+                return TPM_RETRY;
+            }
+            g_warning ("%s: failed to load \"%s\": %s", __func__, name,
+                       error->message);
+            g_clear_error (&error);
+            return TPM_FAIL;
+        }
+        g_free (path);
+    }
+    *data = malloc (size);
+    if (*data == NULL) {
+        g_free (contents);
+        return TPM_SIZE;
+    }
+    memcpy (*data, contents, size);
+    *length = (uint32_t)size;
+    g_free (contents);
+    return TPM_SUCCESS;
+}
+static TPM_RESULT
+tcti_libtpms_nvram_storedata (const unsigned char *data,
+                              uint32_t             length,
+                              uint32_t             tpm_number,
+                              const char          *name)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_owner;
+    GError *error = NULL;
+    gchar *path;
+    gboolean ret;
+    UNUSED_PARAM(tpm_number);
+
+    if (libtpms->state_dir == NULL) {
+        g_hash_table_replace (libtpms->blobs,
+                              g_strdup (name),
+                              g_bytes_new (data, length));
+        return TPM_SUCCESS;
+    }
+    path = g_build_filename (libtpms->state_dir, name, NULL);
+    ret = g_file_set_contents (path, (const gchar*)data, length, &error);
+    g_free (path);
+    if (!ret) {
+        g_warning ("%s: failed to store \"%s\": %s", __func__, name,
+                   error->message);
+        g_clear_error (&error);
+        return TPM_FAIL;
+    }
+    return TPM_SUCCESS;
+}
+static TPM_RESULT
+tcti_libtpms_nvram_deletename (uint32_t    tpm_number,
+                               const char *name,
+                               TPM_BOOL    must_exist)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_owner;
+    gboolean existed;
+    gchar *path;
+    UNUSED_PARAM(tpm_number);
+
+    if (libtpms->state_dir == NULL) {
+        existed = g_hash_table_remove (libtpms->blobs, name);
+    } else {
+        path = g_build_filename (libtpms->state_dir, name, NULL);
+        existed = g_unlink (path) == 0;
+        g_free (path);
+    }
+    return existed || !must_exist ? TPM_SUCCESS : TPM_FAIL;
+}
+static TPM_RESULT
+tcti_libtpms_io_init (void)
+{
+    return TPM_SUCCESS;
+}
+static TPM_RESULT
+tcti_libtpms_io_getlocality (TPM_MODIFIER_INDICATOR *locality,
+                             uint32_t                tpm_number)
+{
+    UNUSED_PARAM(tpm_number);
+
+    *locality = tcti_libtpms_owner->locality;
+    return TPM_SUCCESS;
+}
+static TPM_RESULT
+tcti_libtpms_io_getphysicalpresence (TPM_BOOL *physical_presence,
+                                     uint32_t  tpm_number)
+{
+    UNUSED_PARAM(tpm_number);
+
+    *physical_presence = FALSE;
+    return TPM_SUCCESS;
+}
+static struct libtpms_callbacks tcti_libtpms_callbacks = {
+    .sizeOfStruct               = sizeof (struct libtpms_callbacks),
+    .tpm_nvram_init             = tcti_libtpms_nvram_init,
+    .tpm_nvram_loaddata         = tcti_libtpms_nvram_loaddata,
+    .tpm_nvram_storedata        = tcti_libtpms_nvram_storedata,
+    .tpm_nvram_deletename       = tcti_libtpms_nvram_deletename,
+    .tpm_io_init                = tcti_libtpms_io_init,
+    .tpm_io_getlocality         = tcti_libtpms_io_getlocality,
+    .tpm_io_getphysicalpresence = tcti_libtpms_io_getphysicalpresence,
+};
+static TCTI_LIBTPMS_CONTEXT*
+tcti_libtpms_context_cast (TSS2_TCTI_CONTEXT *context)
+{
+    if (!tcti_libtpms_is_context (context)) {
+        return NULL;
+    }
+    return (TCTI_LIBTPMS_CONTEXT*)context;
+}
+static TSS2_RC
+tcti_libtpms_transmit (TSS2_TCTI_CONTEXT *context,
+                       size_t             size,
+                       uint8_t const     *command)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_context_cast (context);
+    TPM_RESULT result;
+
+    if (libtpms == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (command == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (libtpms->state != TCTI_LIBTPMS_SEND) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (size < TPM_HEADER_SIZE ||
+        size > sizeof (libtpms->command) ||
+        size != get_command_size ((uint8_t*)command))
+    {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    memcpy (libtpms->command, command, size);
+    result = TPMLIB_Process (&libtpms->response,
+                             &libtpms->response_size,
+                             &libtpms->response_buf_size,
+                             libtpms->command,
+                             (uint32_t)size);
+    if (result != TPM_SUCCESS) {
+        g_warning ("%s: TPMLIB_Process failed: 0x%" PRIx32, __func__,
+                   (uint32_t)result);
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    libtpms->state = TCTI_LIBTPMS_RECEIVE;
+
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_libtpms_receive (TSS2_TCTI_CONTEXT *context,
+                      size_t            *size,
+                      uint8_t           *response,
+                      int32_t            timeout)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_context_cast (context);
+
+    UNUSED_PARAM (timeout);
+
+    if (libtpms == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (size == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (libtpms->state != TCTI_LIBTPMS_RECEIVE) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (response == NULL) {
+        *size = libtpms->response_size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < libtpms->response_size) {
+        *size = libtpms->response_size;
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    memcpy (response, libtpms->response, libtpms->response_size);
+    *size = libtpms->response_size;
+    libtpms->state = TCTI_LIBTPMS_SEND;
+
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_libtpms_cancel (TSS2_TCTI_CONTEXT *context)
+{
+    if (tcti_libtpms_context_cast (context) == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    /* commands finish in transmit, there's nothing to cancel */
+    return TSS2_TCTI_RC_BAD_SEQUENCE;
+}
+static TSS2_RC
+tcti_libtpms_set_locality (TSS2_TCTI_CONTEXT *context,
+                           uint8_t            locality)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_context_cast (context);
+
+    if (libtpms == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    libtpms->locality = locality;
+    return TSS2_RC_SUCCESS;
+}
+static void
+tcti_libtpms_finalize (TSS2_TCTI_CONTEXT *context)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms = tcti_libtpms_context_cast (context);
+
+    if (libtpms == NULL) {
+        return;
+    }
+    TPMLIB_Terminate ();
+    TPM_Free (libtpms->response);
+    g_clear_pointer (&libtpms->blobs, g_hash_table_unref);
+    g_clear_pointer (&libtpms->state_dir, g_free);
+    g_atomic_pointer_compare_and_exchange (&tcti_libtpms_owner, libtpms, NULL);
+    memset (libtpms, 0, sizeof (*libtpms));
+}
+/*
+ * Only "libtpms" and "libtpms:" followed by the state directory select
+ * the libtpms TCTI.
+ */
+gboolean
+tcti_libtpms_conf_matches (const gchar *conf)
+{
+    if (conf == NULL) {
+        return FALSE;
+    }
+    return g_strcmp0 (conf, TCTI_LIBTPMS_NAME) == 0 ||
+           g_str_has_prefix (conf, TCTI_LIBTPMS_NAME ":");
+}
+/*
+ * Allocate a libtpms TCTI context for 'conf' and power on the TPM in it.
+ * The context must be freed with tcti_libtpms_free. This fails if another
+ * one exists, libtpms only holds one TPM.
+ */
+TSS2_RC
+tcti_libtpms_new (const gchar        *conf,
+                  TSS2_TCTI_CONTEXT **context)
+{
+    TCTI_LIBTPMS_CONTEXT *libtpms;
+    const gchar *state_dir;
+    TPM_RESULT result;
+
+    libtpms = g_malloc0 (sizeof (TCTI_LIBTPMS_CONTEXT));
+    if (!g_atomic_pointer_compare_and_exchange (&tcti_libtpms_owner,
+                                                NULL,
+                                                libtpms))
+    {
+        g_warning ("%s: libtpms is already in use", __func__);
+        g_free (libtpms);
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    state_dir = strchr (conf, ':');
+    if (state_dir != NULL && state_dir [1] != '\0') {
+        libtpms->state_dir = g_strdup (state_dir + 1);
+    }
+    libtpms->blobs = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify)g_bytes_unref);
+    TSS2_TCTI_MAGIC (libtpms) = TCTI_LIBTPMS_MAGIC;
+    TSS2_TCTI_VERSION (libtpms) = 2;
+    TSS2_TCTI_TRANSMIT (libtpms) = tcti_libtpms_transmit;
+    TSS2_TCTI_RECEIVE (libtpms) = tcti_libtpms_receive;
+    TSS2_TCTI_FINALIZE (libtpms) = tcti_libtpms_finalize;
+    TSS2_TCTI_CANCEL (libtpms) = tcti_libtpms_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES (libtpms) = NULL;
+    TSS2_TCTI_SET_LOCALITY (libtpms) = tcti_libtpms_set_locality;
+    TSS2_TCTI_MAKE_STICKY (libtpms) = NULL;
+    libtpms->state = TCTI_LIBTPMS_SEND;
+
+    result = TPMLIB_ChooseTPMVersion (TPMLIB_TPM_VERSION_2);
+    if (result == TPM_SUCCESS) {
+        result = TPMLIB_RegisterCallbacks (&tcti_libtpms_callbacks);
+    }
+    if (result == TPM_SUCCESS) {
+        result = TPMLIB_MainInit ();
+    }
+    if (result != TPM_SUCCESS) {
+        g_warning ("%s: failed to start the libtpms TPM: 0x%" PRIx32,
+                   __func__, (uint32_t)result);
+        g_hash_table_unref (libtpms->blobs);
+        g_free (libtpms->state_dir);
+        g_atomic_pointer_set (&tcti_libtpms_owner, NULL);
+        g_free (libtpms);
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    g_debug ("%s: libtpms TCTI at 0x%" PRIxPTR " with state in %s",
+             __func__, (uintptr_t)libtpms,
+             libtpms->state_dir != NULL ? libtpms->state_dir : "memory");
+    *context = (TSS2_TCTI_CONTEXT*)libtpms;
+
+    return TSS2_RC_SUCCESS;
+}
+
+#else /* HAVE_LIBTPMS */
+
+gboolean
+tcti_libtpms_conf_matches (const gchar *conf)
+{
+    UNUSED_PARAM (conf);
+    return FALSE;
+}
+TSS2_RC
+tcti_libtpms_new (const gchar        *conf,
+                  TSS2_TCTI_CONTEXT **context)
+{
+    UNUSED_PARAM (conf);
+    UNUSED_PARAM (context);
+    g_warning ("%s: built without libtpms", __func__);
+    return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+
+#endif /* HAVE_LIBTPMS */
+
+/*
+ * Returns TRUE if 'context' was created by tcti_libtpms_new.
+ */
+gboolean
+tcti_libtpms_is_context (TSS2_TCTI_CONTEXT *context)
+{
+    return context != NULL && TSS2_TCTI_MAGIC (context) == TCTI_LIBTPMS_MAGIC;
+}
+/*
+ * Finalize and free the libtpms TCTI context in 'context', which powers
+ * off its TPM, and set it to NULL.
+ */
+void
+tcti_libtpms_free (TSS2_TCTI_CONTEXT **context)
+{
+    if (context == NULL || *context == NULL) {
+        return;
+    }
+    g_debug ("%s: libtpms TCTI at 0x%" PRIxPTR, __func__,
+             (uintptr_t)*context);
+    Tss2_Tcti_Finalize (*context);
+    g_clear_pointer (context, g_free);
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TCTI_LIBTPMS_H
+#define TCTI_LIBTPMS_H
+
+#include <glib.h>
+#include <tss2/tss2_tcti.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The libtpms TCTI runs a software TPM from libtpms in the daemon: each
+ * command is executed by TPMLIB_Process on the thread that transmits it,
+ * without the socket round-trip to a simulator process. It's selected
+ * with the TCTI conf "libtpms", or "libtpms:DIR" to keep the NV state of
+ * the TPM in files in DIR across restarts rather than in memory. libtpms
+ * holds a single TPM per process so only one context may exist at a time.
+ * It's only built with --enable-libtpms, without it the conf goes to the
+ * TCTI loader like any other.
+ */
+#define TCTI_LIBTPMS_NAME  "libtpms"
+#define TCTI_LIBTPMS_MAGIC 0x6c6962746d707374ULL
+
+gboolean           tcti_libtpms_conf_matches (const gchar        *conf);
+TSS2_RC            tcti_libtpms_new          (const gchar        *conf,
+                                              TSS2_TCTI_CONTEXT **context);
+gboolean           tcti_libtpms_is_context   (TSS2_TCTI_CONTEXT  *context);
+void               tcti_libtpms_free         (TSS2_TCTI_CONTEXT **context);
+
+G_END_DECLS
+#endif /* TCTI_LIBTPMS_H */
@@ -0,0 +1,747 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+
+#include <tss2/tss2_mu.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-null.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/* the most sessions a command may have */
+#define TCTI_NULL_SESSIONS_MAX 3
+/*
+ * The TPMA_CC with the command code 'cc' that takes 'handles' handles,
+ * with any other attributes in 'flags'.
+ */
+#define TCTI_NULL_CC(cc, handles, flags) \
+    ((TPMA_CC)(cc) | ((TPMA_CC)(handles) << TPMA_CC_CHANDLES_SHIFT) | (flags))
+
+typedef enum {
+    TCTI_NULL_SEND,
+    TCTI_NULL_RECEIVE,
+} tcti_null_state_t;
+
+typedef struct {
+    TSS2_TCTI_CONTEXT_COMMON_V2 v2;
+    tcti_null_state_t state;
+    /* counters the made up handles and context sequence numbers come from */
+    guint32           objects;
+    guint32           sessions;
+    guint64           sequence;
+    size_t            response_size;
+    uint8_t           response [TPM2_MAX_RESPONSE_SIZE];
+} TCTI_NULL_CONTEXT;
+
+/*
+ * The commands the null TPM implements, in the order of their command
+ * code. This is what it reports for TPM2_CAP_COMMANDS so the daemon turns
+ * away anything else before it gets here. The number of handles and the
+ * response handle must be right: the sessions of a command are found
+ * behind its handles and the response handle is made up from it.
+ */
+static const TPMA_CC tcti_null_commands [] = {
+    TCTI_NULL_CC (TPM2_CC_EvictControl,        2, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_NV_UndefineSpace,    2, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_Clear,               1, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_HierarchyChangeAuth, 1, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_NV_DefineSpace,      1, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_CreatePrimary,       1, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_NV_Write,            2, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_PCR_Reset,           1, 0),
+    TCTI_NULL_CC (TPM2_CC_SequenceComplete,    1, TPMA_CC_FLUSHED),
+    TCTI_NULL_CC (TPM2_CC_SelfTest,            0, 0),
+    TCTI_NULL_CC (TPM2_CC_Startup,             0, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_Shutdown,            0, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_StirRandom,          0, TPMA_CC_NV),
+    TCTI_NULL_CC (TPM2_CC_Certify,             2, 0),
+    TCTI_NULL_CC (TPM2_CC_NV_Read,             2, 0),
+    TCTI_NULL_CC (TPM2_CC_ObjectChangeAuth,    2, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicySecret,        2, 0),
+    TCTI_NULL_CC (TPM2_CC_Create,              1, 0),
+    TCTI_NULL_CC (TPM2_CC_HMAC,                1, 0),
+    TCTI_NULL_CC (TPM2_CC_Load,                1, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_Quote,               1, 0),
+    TCTI_NULL_CC (TPM2_CC_RSA_Decrypt,         1, 0),
+    TCTI_NULL_CC (TPM2_CC_HMAC_Start,          1, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_SequenceUpdate,      1, 0),
+    TCTI_NULL_CC (TPM2_CC_Sign,                1, 0),
+    TCTI_NULL_CC (TPM2_CC_Unseal,              1, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicySigned,        2, 0),
+    TCTI_NULL_CC (TPM2_CC_ContextLoad,         0, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_ContextSave,         1, 0),
+    TCTI_NULL_CC (TPM2_CC_ECDH_KeyGen,         1, 0),
+    TCTI_NULL_CC (TPM2_CC_FlushContext,        0, 0),
+    TCTI_NULL_CC (TPM2_CC_LoadExternal,        0, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_NV_ReadPublic,       1, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyAuthValue,     1, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyCommandCode,   1, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyOR,            1, 0),
+    TCTI_NULL_CC (TPM2_CC_ReadPublic,          1, 0),
+    TCTI_NULL_CC (TPM2_CC_RSA_Encrypt,         1, 0),
+    TCTI_NULL_CC (TPM2_CC_StartAuthSession,    2, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_VerifySignature,     1, 0),
+    TCTI_NULL_CC (TPM2_CC_GetCapability,       0, 0),
+    TCTI_NULL_CC (TPM2_CC_GetRandom,           0, 0),
+    TCTI_NULL_CC (TPM2_CC_GetTestResult,       0, 0),
+    TCTI_NULL_CC (TPM2_CC_Hash,                0, 0),
+    TCTI_NULL_CC (TPM2_CC_PCR_Read,            0, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyPCR,           1, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyRestart,       1, 0),
+    TCTI_NULL_CC (TPM2_CC_ReadClock,           0, 0),
+    TCTI_NULL_CC (TPM2_CC_PCR_Extend,          1, 0),
+    TCTI_NULL_CC (TPM2_CC_HashSequenceStart,   0, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_PolicyGetDigest,     1, 0),
+    TCTI_NULL_CC (TPM2_CC_TestParms,           0, 0),
+    TCTI_NULL_CC (TPM2_CC_PolicyPassword,      1, 0),
+    TCTI_NULL_CC (TPM2_CC_CreateLoaded,        1, TPMA_CC_RHANDLE),
+    TCTI_NULL_CC (TPM2_CC_EncryptDecrypt2,     1, 0),
+};
+/*
+ * The fixed properties of the null TPM in the order of the property. The
+ * limits on loaded objects and sessions are those of a small TPM so the
+ * ResourceManager does all of its usual work.
+ */
+static const TPMS_TAGGED_PROPERTY tcti_null_properties [] = {
+    { TPM2_PT_FAMILY_INDICATOR,    0x322e3000, },                 /* "2.0" */
+    { TPM2_PT_LEVEL,               0, },
+    { TPM2_PT_REVISION,            138, },
+    { TPM2_PT_MANUFACTURER,        0x4e554c4c, },                /* "NULL" */
+    { TPM2_PT_INPUT_BUFFER,        1024, },
+    { TPM2_PT_HR_TRANSIENT_MIN,    3, },
+    { TPM2_PT_HR_PERSISTENT_MIN,   7, },
+    { TPM2_PT_HR_LOADED_MIN,       3, },
+    { TPM2_PT_ACTIVE_SESSIONS_MAX, 64, },
+    { TPM2_PT_PCR_COUNT,           24, },
+    { TPM2_PT_CONTEXT_GAP_MAX,     0xffff, },
+    { TPM2_PT_MAX_COMMAND_SIZE,    TPM2_MAX_COMMAND_SIZE, },
+    { TPM2_PT_MAX_RESPONSE_SIZE,   TPM2_MAX_RESPONSE_SIZE, },
+    { TPM2_PT_MAX_DIGEST,          sizeof (TPMU_HA), },
+    { TPM2_PT_TOTAL_COMMANDS,      G_N_ELEMENTS (tcti_null_commands), },
+};
+/*
+ * Returns TRUE if 'conf' selects the null TCTI.
+ */
+gboolean
+tcti_null_conf_matches (const gchar *conf)
+{
+    if (conf == NULL) {
+        return FALSE;
+    }
+    return g_strcmp0 (conf, TCTI_NULL_NAME) == 0 ||
+           g_str_has_prefix (conf, TCTI_NULL_NAME ":");
+}
+/*
+ * Returns the TPMA_CC of the command 'cc' or 0 if the null TPM doesn't
+ * implement it.
+ */
+static TPMA_CC
+tcti_null_lookup (TPM2_CC cc)
+{
+    guint low = 0, high = G_N_ELEMENTS (tcti_null_commands), mid;
+    TPM2_CC mid_cc;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        mid_cc = tcti_null_commands [mid] & TPMA_CC_COMMANDINDEX_MASK;
+        if (mid_cc == cc) {
+            return tcti_null_commands [mid];
+        } else if (mid_cc < cc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return 0;
+}
+/*
+ * Write 'count' empty TPM2Bs to 'buf'.
+ */
+static TSS2_RC
+tcti_null_put_empty (uint8_t *buf,
+                     size_t   size,
+                     size_t  *offset,
+                     guint    count)
+{
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    while (count-- > 0 && rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Marshal (0, buf, size, offset);
+    }
+    return rc;
+}
+/*
+ * Write a ticket with the tag 'tag' for the NULL hierarchy to 'buf'.
+ */
+static TSS2_RC
+tcti_null_put_ticket (uint8_t *buf,
+                      size_t   size,
+                      size_t  *offset,
+                      TPM2_ST  tag)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPM2_ST_Marshal (tag, buf, size, offset);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Marshal (TPM2_RH_NULL, buf, size, offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tcti_null_put_empty (buf, size, offset, 1);
+    }
+    return rc;
+}
+/*
+ * Skip the TPM2B_SENSITIVE_CREATE at 'offset' in 'command' and copy the
+ * TPM2B_PUBLIC that follows it to 'buf'. This is how the commands that
+ * create objects start, the public area of the new object is the one the
+ * caller asked for.
+ */
+static TSS2_RC
+tcti_null_put_public (const uint8_t *command,
+                      size_t         size,
+                      size_t         offset,
+                      uint8_t       *buf,
+                      size_t         buf_size,
+                      size_t        *buf_offset)
+{
+    UINT16 sensitive_size, public_size;
+    size_t public_offset;
+
+    if (Tss2_MU_UINT16_Unmarshal (command, size, &offset,
+                                  &sensitive_size) != TSS2_RC_SUCCESS ||
+        sensitive_size > size - offset)
+    {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    offset += sensitive_size;
+    public_offset = offset;
+    if (Tss2_MU_UINT16_Unmarshal (command, size, &offset,
+                                  &public_size) != TSS2_RC_SUCCESS ||
+        public_size > size - offset)
+    {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    if (sizeof (UINT16) + public_size > buf_size - *buf_offset) {
+        return TPM2_RC_SIZE;
+    }
+    memcpy (&buf [*buf_offset], &command [public_offset],
+            sizeof (UINT16) + public_size);
+    *buf_offset += sizeof (UINT16) + public_size;
+    return TSS2_RC_SUCCESS;
+}
+static TPM2_HANDLE
+tcti_null_next_object (TCTI_NULL_CONTEXT *null)
+{
+    return TPM2_HR_TRANSIENT | (null->objects++ & TPM2_HR_HANDLE_MASK);
+}
+static TPM2_HANDLE
+tcti_null_next_session (TCTI_NULL_CONTEXT *null,
+                        TPM2_SE            type)
+{
+    return (type == TPM2_SE_HMAC ? TPM2_HR_HMAC_SESSION :
+                                   TPM2_HR_POLICY_SESSION) |
+           (null->sessions++ & TPM2_HR_HANDLE_MASK);
+}
+/*
+ * Answer TPM2_GetCapability from the tables above. Capabilities the null
+ * TPM knows nothing about come back as empty lists.
+ */
+static TSS2_RC
+tcti_null_get_capability (const uint8_t *command,
+                          size_t         size,
+                          size_t        *offset,
+                          uint8_t       *buf,
+                          size_t        *buf_offset)
+{
+    TPMS_CAPABILITY_DATA cap_data = { 0, };
+    TPMI_YES_NO more = TPM2_NO;
+    UINT32 property, count;
+    TPMA_CC attrs;
+    guint i;
+
+    if (Tss2_MU_UINT32_Unmarshal (command, size, offset,
+                                  &cap_data.capability) != TSS2_RC_SUCCESS ||
+        Tss2_MU_UINT32_Unmarshal (command, size, offset,
+                                  &property) != TSS2_RC_SUCCESS ||
+        Tss2_MU_UINT32_Unmarshal (command, size, offset,
+                                  &count) != TSS2_RC_SUCCESS)
+    {
+        return TPM2_RC_INSUFFICIENT;
+    }
+    switch (cap_data.capability) {
+    case TPM2_CAP_TPM_PROPERTIES:
+        count = MIN (count, TPM2_MAX_TPM_PROPERTIES);
+        for (i = 0; i < G_N_ELEMENTS (tcti_null_properties); ++i) {
+            if (tcti_null_properties [i].property < property) {
+                continue;
+            }
+            if (cap_data.data.tpmProperties.count == count) {
+                more = TPM2_YES;
+                break;
+            }
+            cap_data.data.tpmProperties.tpmProperty [
+                cap_data.data.tpmProperties.count++] = tcti_null_properties [i];
+        }
+        break;
+    case TPM2_CAP_COMMANDS:
+        count = MIN (count, TPM2_MAX_CAP_CC);
+        for (i = 0; i < G_N_ELEMENTS (tcti_null_commands); ++i) {
+            attrs = tcti_null_commands [i];
+            if ((attrs & TPMA_CC_COMMANDINDEX_MASK) < property) {
+                continue;
+            }
+            if (cap_data.data.command.count == count) {
+                more = TPM2_YES;
+                break;
+            }
+            cap_data.data.command.commandAttributes [
+                cap_data.data.command.count++] = attrs;
+        }
+        break;
+    default:
+        break;
+    }
+    if (Tss2_MU_UINT8_Marshal (more,
+                               buf,
+                               TPM2_MAX_RESPONSE_SIZE,
+                               buf_offset) != TSS2_RC_SUCCESS ||
+        Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data,
+                                              buf,
+                                              TPM2_MAX_RESPONSE_SIZE,
+                                              buf_offset) != TSS2_RC_SUCCESS)
+    {
+        /* only a capability that doesn't exist can't be marshalled */
+        return TPM2_RC_VALUE + TPM2_RC_P + TPM2_RC_1;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Write the response parameters of the command 'cc' to 'buf' at
+ * 'buf_offset' and set 'handle' to the response handle if there is one.
+ * The parameters of the command start at 'offset' in 'command'. Only the
+ * commands that the daemon or the benchmark look at the response of get
+ * anything but an empty parameter area, new objects get back the public
+ * area they were created with. Returns a TPM2_RC.
+ */
+static TSS2_RC
+tcti_null_parameters (TCTI_NULL_CONTEXT *null,
+                      TPM2_CC            cc,
+                      const uint8_t     *command,
+                      size_t             size,
+                      size_t             offset,
+                      TPM2_HANDLE       *handle,
+                      size_t            *buf_offset)
+{
+    uint8_t *buf = null->response;
+    size_t buf_size = sizeof (null->response);
+    size_t handle_offset = TPM_HEADER_SIZE;
+    TPM2B_NONCE nonce = { 0, };
+    TPM2B_ENCRYPTED_SECRET salt;
+    TPM2B_DIGEST digest = { 0, };
+    TPMS_CONTEXT context = { 0, };
+    TPMS_TIME_INFO time_info = { 0, };
+    TPM2B_MAX_NV_BUFFER nv_data;
+    TPM2_SE session_type;
+    UINT16 bytes;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    switch (cc) {
+    case TPM2_CC_Create:
+        /* outPrivate */
+        rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        /* fall through */
+    case TPM2_CC_CreatePrimary:
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_null_put_public (command, size, offset,
+                                       buf, buf_size, buf_offset);
+        }
+        /* creationData and creationHash */
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_null_put_empty (buf, buf_size, buf_offset, 2);
+        }
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_null_put_ticket (buf, buf_size, buf_offset,
+                                       TPM2_ST_CREATION);
+        }
+        if (rc == TSS2_RC_SUCCESS && cc == TPM2_CC_CreatePrimary) {
+            *handle = tcti_null_next_object (null);
+            /* name */
+            rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        }
+        break;
+    case TPM2_CC_CreateLoaded:
+        *handle = tcti_null_next_object (null);
+        /* outPrivate, outPublic and name */
+        rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_null_put_public (command, size, offset,
+                                       buf, buf_size, buf_offset);
+        }
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        }
+        break;
+    case TPM2_CC_Load:
+    case TPM2_CC_LoadExternal:
+        *handle = tcti_null_next_object (null);
+        rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        break;
+    case TPM2_CC_HMAC_Start:
+    case TPM2_CC_HashSequenceStart:
+        *handle = tcti_null_next_object (null);
+        break;
+    case TPM2_CC_StartAuthSession:
+        if (Tss2_MU_TPM2B_NONCE_Unmarshal (command, size, &offset,
+                                           &nonce) != TSS2_RC_SUCCESS ||
+            Tss2_MU_TPM2B_ENCRYPTED_SECRET_Unmarshal (command, size, &offset,
+                                                      &salt) != TSS2_RC_SUCCESS ||
+            Tss2_MU_UINT8_Unmarshal (command, size, &offset,
+                                     &session_type) != TSS2_RC_SUCCESS)
+        {
+            return TPM2_RC_INSUFFICIENT;
+        }
+        *handle = tcti_null_next_session (null, session_type);
+        /* nonceTPM is as big as nonceCaller */
+        memset (nonce.buffer, 0, nonce.size);
+        rc = Tss2_MU_TPM2B_NONCE_Marshal (&nonce, buf, buf_size, buf_offset);
+        break;
+    case TPM2_CC_ContextSave:
+        rc = Tss2_MU_TPM2_HANDLE_Unmarshal (command, size, &handle_offset,
+                                            &context.savedHandle);
+        if (rc != TSS2_RC_SUCCESS) {
+            return TPM2_RC_INSUFFICIENT;
+        }
+        if (context.savedHandle >> TPM2_HR_SHIFT == TPM2_HT_TRANSIENT) {
+            context.savedHandle = TPM2_HR_TRANSIENT;
+        }
+        context.sequence = ++null->sequence;
+        context.hierarchy = TPM2_RH_OWNER;
+        rc = Tss2_MU_TPMS_CONTEXT_Marshal (&context, buf, buf_size, buf_offset);
+        break;
+    case TPM2_CC_ContextLoad:
+        rc = Tss2_MU_TPMS_CONTEXT_Unmarshal (command, size, &offset, &context);
+        if (rc != TSS2_RC_SUCCESS) {
+            return TPM2_RC_INSUFFICIENT;
+        }
+        switch (context.savedHandle >> TPM2_HR_SHIFT) {
+        case TPM2_HT_HMAC_SESSION:
+        case TPM2_HT_POLICY_SESSION:
+            *handle = context.savedHandle;
+            break;
+        default:
+            *handle = tcti_null_next_object (null);
+            break;
+        }
+        break;
+    case TPM2_CC_GetCapability:
+        rc = tcti_null_get_capability (command, size, &offset,
+                                       buf, buf_offset);
+        break;
+    case TPM2_CC_GetRandom:
+        rc = Tss2_MU_UINT16_Unmarshal (command, size, &offset, &bytes);
+        if (rc != TSS2_RC_SUCCESS) {
+            return TPM2_RC_INSUFFICIENT;
+        }
+        digest.size = MIN (bytes, sizeof (digest.buffer));
+        rc = Tss2_MU_TPM2B_DIGEST_Marshal (&digest, buf, buf_size, buf_offset);
+        break;
+    case TPM2_CC_NV_Read:
+        /* as many bytes as asked for, the offset doesn't matter */
+        rc = Tss2_MU_UINT16_Unmarshal (command, size, &offset, &bytes);
+        if (rc != TSS2_RC_SUCCESS) {
+            return TPM2_RC_INSUFFICIENT;
+        }
+        nv_data.size = MIN (bytes, sizeof (nv_data.buffer));
+        memset (nv_data.buffer, 0, nv_data.size);
+        rc = Tss2_MU_TPM2B_MAX_NV_BUFFER_Marshal (&nv_data, buf, buf_size,
+                                                  buf_offset);
+        break;
+    case TPM2_CC_PCR_Read:
+        /* pcrUpdateCounter, pcrSelectionOut and pcrValues */
+        rc = Tss2_MU_UINT32_Marshal (0, buf, buf_size, buf_offset);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = Tss2_MU_UINT32_Marshal (0, buf, buf_size, buf_offset);
+        }
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = Tss2_MU_UINT32_Marshal (0, buf, buf_size, buf_offset);
+        }
+        break;
+    case TPM2_CC_ReadClock:
+        /* a TPM that was never reset */
+        time_info.clockInfo.safe = TPM2_YES;
+        rc = Tss2_MU_TPMS_TIME_INFO_Marshal (&time_info, buf, buf_size,
+                                             buf_offset);
+        break;
+    case TPM2_CC_Sign:
+        rc = Tss2_MU_UINT16_Marshal (TPM2_ALG_NULL, buf, buf_size, buf_offset);
+        break;
+    case TPM2_CC_VerifySignature:
+        rc = tcti_null_put_ticket (buf, buf_size, buf_offset,
+                                   TPM2_ST_VERIFIED);
+        break;
+    case TPM2_CC_PolicyGetDigest:
+        rc = tcti_null_put_empty (buf, buf_size, buf_offset, 1);
+        break;
+    default:
+        break;
+    }
+    if (rc != TSS2_RC_SUCCESS && rc >> TSS2_RC_LAYER_SHIFT != 0) {
+        /* a TSS2_RC from the marshalling isn't something a TPM returns */
+        g_warning ("%s: failed to marshal response to command 0x%" PRIx32
+                   ": 0x%" PRIx32, __func__, cc, rc);
+        rc = TPM2_RC_FAILURE;
+    }
+    return rc;
+}
+/*
+ * Replace the response with one that carries only the response code 'rc'.
+ */
+static void
+tcti_null_respond_rc (TCTI_NULL_CONTEXT *null,
+                      TSS2_RC            rc)
+{
+    tpm2_header_init (null->response,
+                      sizeof (null->response),
+                      TPM2_ST_NO_SESSIONS,
+                      TPM_HEADER_SIZE,
+                      rc);
+    null->response_size = TPM_HEADER_SIZE;
+}
+/*
+ * Build the response to 'command' in the response buffer. A command with
+ * sessions gets a response with an empty response auth for each of them
+ * that keeps the session alive if the command asked for it.
+ */
+static void
+tcti_null_respond (TCTI_NULL_CONTEXT *null,
+                   const uint8_t     *command,
+                   size_t             size)
+{
+    TPM2_CC cc = get_command_code ((uint8_t*)command);
+    TPMA_CC attrs = tcti_null_lookup (cc);
+    TPMI_ST_COMMAND_TAG tag = get_command_tag ((uint8_t*)command);
+    TPMA_SESSION session_attrs [TCTI_NULL_SESSIONS_MAX];
+    TPMS_AUTH_COMMAND auth;
+    TPM2_HANDLE handle = 0;
+    UINT32 auth_size;
+    size_t offset, auth_end, out, params_start, param_size_offset = 0;
+    guint sessions = 0, i;
+    TSS2_RC rc;
+
+    if (attrs == 0) {
+        tcti_null_respond_rc (null, TPM2_RC_COMMAND_CODE);
+        return;
+    }
+    offset = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) *
+        ((attrs & TPMA_CC_CHANDLES_MASK) >> TPMA_CC_CHANDLES_SHIFT);
+    if (tag == TPM2_ST_SESSIONS) {
+        if (Tss2_MU_UINT32_Unmarshal (command, size, &offset,
+                                      &auth_size) != TSS2_RC_SUCCESS ||
+            auth_size > size - offset)
+        {
+            tcti_null_respond_rc (null, TPM2_RC_AUTHSIZE);
+            return;
+        }
+        auth_end = offset + auth_size;
+        while (offset < auth_end) {
+            if (sessions == TCTI_NULL_SESSIONS_MAX ||
+                Tss2_MU_TPMS_AUTH_COMMAND_Unmarshal (command, auth_end, &offset,
+                                                     &auth) != TSS2_RC_SUCCESS)
+            {
+                tcti_null_respond_rc (null, TPM2_RC_AUTHSIZE);
+                return;
+            }
+            session_attrs [sessions++] = auth.sessionAttributes;
+        }
+    } else if (offset > size) {
+        tcti_null_respond_rc (null, TPM2_RC_INSUFFICIENT);
+        return;
+    }
+
+    out = TPM_HEADER_SIZE;
+    if (attrs & TPMA_CC_RHANDLE) {
+        out += sizeof (TPM2_HANDLE);
+    }
+    if (tag == TPM2_ST_SESSIONS) {
+        param_size_offset = out;
+        out += sizeof (UINT32);
+    }
+    params_start = out;
+    rc = tcti_null_parameters (null, cc, command, size, offset, &handle, &out);
+    if (rc != TSS2_RC_SUCCESS) {
+        tcti_null_respond_rc (null, rc);
+        return;
+    }
+    if (attrs & TPMA_CC_RHANDLE) {
+        offset = TPM_HEADER_SIZE;
+        Tss2_MU_TPM2_HANDLE_Marshal (handle, null->response,
+                                     sizeof (null->response), &offset);
+    }
+    if (tag == TPM2_ST_SESSIONS) {
+        Tss2_MU_UINT32_Marshal (out - params_start, null->response,
+                                sizeof (null->response), &param_size_offset);
+        for (i = 0; i < sessions; ++i) {
+            /* nonceTPM, sessionAttributes and hmac */
+            tcti_null_put_empty (null->response, sizeof (null->response),
+                                 &out, 1);
+            Tss2_MU_TPMA_SESSION_Marshal (session_attrs [i] &
+                                              TPMA_SESSION_CONTINUESESSION,
+                                          null->response,
+                                          sizeof (null->response),
+                                          &out);
+            tcti_null_put_empty (null->response, sizeof (null->response),
+                                 &out, 1);
+        }
+    }
+    tpm2_header_init (null->response,
+                      sizeof (null->response),
+                      tag == TPM2_ST_SESSIONS ? TPM2_ST_SESSIONS :
+                                                TPM2_ST_NO_SESSIONS,
+                      out,
+                      TSS2_RC_SUCCESS);
+    null->response_size = out;
+}
+static TCTI_NULL_CONTEXT*
+tcti_null_context_cast (TSS2_TCTI_CONTEXT *context)
+{
+    if (!tcti_null_is_context (context)) {
+        return NULL;
+    }
+    return (TCTI_NULL_CONTEXT*)context;
+}
+static TSS2_RC
+tcti_null_transmit (TSS2_TCTI_CONTEXT *context,
+                    size_t             size,
+                    uint8_t const     *command)
+{
+    TCTI_NULL_CONTEXT *null = tcti_null_context_cast (context);
+
+    if (null == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (command == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (null->state != TCTI_NULL_SEND) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (size < TPM_HEADER_SIZE ||
+        size != get_command_size ((uint8_t*)command))
+    {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    tcti_null_respond (null, command, size);
+    null->state = TCTI_NULL_RECEIVE;
+
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_null_receive (TSS2_TCTI_CONTEXT *context,
+                   size_t            *size,
+                   uint8_t           *response,
+                   int32_t            timeout)
+{
+    TCTI_NULL_CONTEXT *null = tcti_null_context_cast (context);
+
+    UNUSED_PARAM (timeout);
+
+    if (null == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (size == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (null->state != TCTI_NULL_RECEIVE) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (response == NULL) {
+        *size = null->response_size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < null->response_size) {
+        *size = null->response_size;
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    memcpy (response, null->response, null->response_size);
+    *size = null->response_size;
+    null->state = TCTI_NULL_SEND;
+
+    return TSS2_RC_SUCCESS;
+}
+static TSS2_RC
+tcti_null_cancel (TSS2_TCTI_CONTEXT *context)
+{
+    TCTI_NULL_CONTEXT *null = tcti_null_context_cast (context);
+
+    if (null == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    /* commands finish as soon as they're sent, there's nothing to cancel */
+    return TSS2_TCTI_RC_BAD_SEQUENCE;
+}
+static TSS2_RC
+tcti_null_set_locality (TSS2_TCTI_CONTEXT *context,
+                        uint8_t            locality)
+{
+    UNUSED_PARAM (locality);
+
+    if (tcti_null_context_cast (context) == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    return TSS2_RC_SUCCESS;
+}
+static void
+tcti_null_finalize (TSS2_TCTI_CONTEXT *context)
+{
+    TCTI_NULL_CONTEXT *null = tcti_null_context_cast (context);
+
+    if (null != NULL) {
+        memset (null, 0, sizeof (*null));
+    }
+}
+/*
+ * Allocate and initialize a null TCTI context. It must be freed with
+ * tcti_null_free.
+ */
+TSS2_TCTI_CONTEXT*
+tcti_null_new (void)
+{
+    TCTI_NULL_CONTEXT *null = g_malloc0 (sizeof (TCTI_NULL_CONTEXT));
+
+    g_debug ("%s: null TCTI at 0x%" PRIxPTR, __func__, (uintptr_t)null);
+    TSS2_TCTI_MAGIC (null) = TCTI_NULL_MAGIC;
+    TSS2_TCTI_VERSION (null) = 2;
+    TSS2_TCTI_TRANSMIT (null) = tcti_null_transmit;
+    TSS2_TCTI_RECEIVE (null) = tcti_null_receive;
+    TSS2_TCTI_FINALIZE (null) = tcti_null_finalize;
+    TSS2_TCTI_CANCEL (null) = tcti_null_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES (null) = NULL;
+    TSS2_TCTI_SET_LOCALITY (null) = tcti_null_set_locality;
+    TSS2_TCTI_MAKE_STICKY (null) = NULL;
+    null->state = TCTI_NULL_SEND;
+
+    return (TSS2_TCTI_CONTEXT*)null;
+}
+/*
+ * Returns TRUE if 'context' was created by tcti_null_new.
+ */
+gboolean
+tcti_null_is_context (TSS2_TCTI_CONTEXT *context)
+{
+    return context != NULL && TSS2_TCTI_MAGIC (context) == TCTI_NULL_MAGIC;
+}
+/*
+ * Finalize and free the null TCTI context in 'context' and set it to
+ * NULL.
+ */
+void
+tcti_null_free (TSS2_TCTI_CONTEXT **context)
+{
+    if (context == NULL || *context == NULL) {
+        return;
+    }
+    g_debug ("%s: null TCTI at 0x%" PRIxPTR, __func__, (uintptr_t)*context);
+    Tss2_Tcti_Finalize (*context);
+    g_clear_pointer (context, g_free);
+}
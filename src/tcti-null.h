@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TCTI_NULL_H
+#define TCTI_NULL_H
+
+#include <glib.h>
+#include <tss2/tss2_tcti.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The null TCTI is a TPM that isn't there: every command is answered as
+ * soon as it's transmitted with a canned response that's just well formed
+ * enough for the daemon and the usual clients to get on with the next
+ * one. Handles are made up for the commands that create objects and
+ * sessions and for TPM2_ContextLoad, TPM2_ContextSave gets a fake context.
+ * It's selected with the TCTI conf "null" (anything after a ':' is
+ * ignored) and exists to measure the overhead of the daemon itself.
+ */
+#define TCTI_NULL_NAME  "null"
+#define TCTI_NULL_MAGIC 0x6e756c6c74637469ULL
+
+gboolean           tcti_null_conf_matches   (const gchar        *conf);
+TSS2_TCTI_CONTEXT* tcti_null_new            (void);
+gboolean           tcti_null_is_context     (TSS2_TCTI_CONTEXT  *context);
+void               tcti_null_free           (TSS2_TCTI_CONTEXT **context);
+
+G_END_DECLS
+#endif /* TCTI_NULL_H */
@@ -10,9 +10,11 @@
 #include <pthread.h>
 #include <tss2/tss2_tcti.h>
 
+#include "shm-ring.h"
 #include "tabrmd-defaults.h"
 #include "tabrmd-generated.h"
 #include "tpm2-header.h"
+#include "tss2-tcti-tabrmd.h"
 #include "util.h"
 
 #define TSS2_TCTI_TABRMD_MAGIC 0x1c8e03ff00db0f92
@@ -20,22 +22,26 @@
 
 #define TSS2_TCTI_TABRMD_ID(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->id
-#define TSS2_TCTI_TABRMD_IOSTREAM(context) \
-    G_IO_STREAM (TSS2_TCTI_TABRMD_SOCK_CONNECT (context))
 #define TSS2_TCTI_TABRMD_PROXY(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->proxy
 #define TSS2_TCTI_TABRMD_HEADER(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->header
 #define TSS2_TCTI_TABRMD_STATE(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->state
+#define TSS2_TCTI_TABRMD_PENDING(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->pending
+#define TSS2_TCTI_TABRMD_PIPELINE_DEPTH(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->pipeline_depth
+#define TSS2_TCTI_TABRMD_SEQPACKET(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->seqpacket
+#define TSS2_TCTI_TABRMD_SHM(context) \
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->shm
 
 /*
- * Macros for accessing the internals of the I/O stream. These are helpers
- * for getting at the underlying GSocket and raw fds that we need to
- * implement polling etc.
+ * Macros for accessing the internals of the socket connection. The
+ * GSocketConnection is only kept to own the socket, commands and responses
+ * go through the raw fd.
  */
-#define TSS2_TCTI_TABRMD_ISTREAM(context) \
-    g_io_stream_get_input_stream (TSS2_TCTI_TABRMD_IOSTREAM(context))
 #define TSS2_TCTI_TABRMD_SOCK_CONNECT(context) \
     ((TSS2_TCTI_TABRMD_CONTEXT*)context)->sock_connect
 #define TSS2_TCTI_TABRMD_SOCKET(context) \
@@ -68,6 +74,35 @@
  *     setLocality: produces TSS2_TCTI_RC_BAD_SEQUENCE
  *   FINAL:
  *     all function calls produce TSS2_TCTI_RC_BAD_SEQUENCE
+ *
+ * With Tss2_Tcti_Tabrmd_SetPipelineDepth the caller may opt in to having
+ * up to 'pipeline_depth' commands in flight. 'pending' counts the commands
+ * transmitted but not yet received. In the RECEIVE state transmit then
+ * succeeds while 'pending' is below the depth, and a successful receive
+ * only goes back to TRANSMIT once 'pending' drops to 0. The daemon answers
+ * the commands from a connection in the order they were sent.
+ *
+ * Connections using the shared memory transport have 'shm' set. Commands
+ * and responses then go through its rings instead of the socket, with
+ * 'shm_command_fd' and 'shm_response_fd' as the doorbells for each
+ * direction. The state machine is the same.
+ *
+ * Connections to a daemon on another host go through a TLS session over
+ * TCP. The socket is then one end of a socket pair and 'tls_relay' the
+ * thread relaying between its other end and the session, so reads and
+ * writes work the same as for a local daemon.
+ *
+ * Contexts initialized with 'reuse' keep the bus and connection parameters
+ * they were created with so that finalize can hand an idle connection to
+ * the process-wide pool, see tcti_tabrmd_pool_put. Contexts with
+ * 'prefork' set claimed a connection created by Tss2_Tcti_Tabrmd_Prefork
+ * in a parent process and only get their D-Bus proxy once they need it.
+ *
+ * With a response callback set through Tss2_Tcti_Tabrmd_SetResponseCallback
+ * responses are only received by Tss2_Tcti_Tabrmd_Dispatch. Over the
+ * socket it reads whatever is available into 'async_buf', which holds
+ * 'async_fill' bytes of responses not complete yet, and hands each
+ * complete one to 'async_cb'.
  */
 typedef enum {
     TABRMD_STATE_FINAL,
@@ -90,16 +125,77 @@ typedef struct {
     tcti_tabrmd_state_t            state;
     size_t                         index;
     uint8_t                        header_buf [TPM_HEADER_SIZE];
+    size_t                         pending;
+    size_t                         pipeline_depth;
+    gboolean                       seqpacket;
+    shm_region_t                  *shm;
+    gint                           shm_command_fd;
+    gint                           shm_response_fd;
+    gboolean                       reuse;
+    gboolean                       prefork;
+    GBusType                       bus_type;
+    gchar                         *bus_name;
+    guint32                        priority;
+    guint32                        flags;
+    guint32                        busy_poll_us;
+    GThread                       *tls_relay;
+    TSS2_TCTI_TABRMD_RESPONSE_CB   async_cb;
+    void                          *async_data;
+    uint8_t                       *async_buf;
+    size_t                         async_fill;
 } TSS2_TCTI_TABRMD_CONTEXT;
 
+/* the most idle connections a process keeps for reuse */
+#define TABRMD_REUSE_POOL_MAX 4
+/* the most connections Tss2_Tcti_Tabrmd_Prefork creates */
+#define TABRMD_PREFORK_MAX 1024
+/* room for a response being read plus the start of the next ones */
+#define TABRMD_ASYNC_BUF_SIZE (2 * TPM2_MAX_RESPONSE_SIZE)
+
 #define TABRMD_CONF_INIT_DEFAULT { \
     .bus_name = TABRMD_DBUS_NAME_DEFAULT, \
     .bus_type = TABRMD_DBUS_TYPE_DEFAULT, \
+    .socket_path = NULL, \
+    .priority = TABRMD_PRIORITY_DEFAULT, \
+    .flags = 0, \
+    .reuse = FALSE, \
+    .prefork = FALSE, \
+    .busy_poll_us = 0, \
+    .resume_id = 0, \
+    .tcp_address = NULL, \
+    .tls_cert = NULL, \
+    .tls_key = NULL, \
+    .tls_ca = NULL, \
 }
 
+/*
+ * 'flags' are the TABRMD_CONNECTION_FLAG_* values we ask the daemon for
+ * when creating the connection. If 'socket_path' is set the connection is
+ * set up through the daemon's Unix socket instead of D-Bus. With 'reuse'
+ * the D-Bus proxy and idle connections are shared within the process.
+ * With 'prefork' the connection is claimed from those a parent process
+ * created with Tss2_Tcti_Tabrmd_Prefork if there are any left.
+ * 'busy_poll_us' is how long receive spins before blocking in poll.
+ * With 'resume_id' set the connection takes over the objects and sessions
+ * of the closed connection it came from, see Tss2_Tcti_Tabrmd_GetResumeId.
+ * With 'tcp_address' set the connection is made to a daemon on another
+ * host over TCP with mutual TLS, using the PEM files 'tls_cert', 'tls_key'
+ * and 'tls_ca'.
+ */
 typedef struct {
     const char *bus_name;
     GBusType bus_type;
+    const char *socket_path;
+    guint32 priority;
+    guint32 flags;
+    gboolean reuse;
+    gboolean prefork;
+    guint32 busy_poll_us;
+    guint64 resume_id;
+    const char *tcp_address;
+    const char *tls_cert;
+    const char *tls_key;
+    const char *tls_ca;
 } tabrmd_conf_t;
 
 /*
@@ -109,6 +205,12 @@ typedef struct {
  */
 const TSS2_TCTI_INFO* Tss2_Tcti_Info (void);
 GBusType tabrmd_bus_type_from_str (const char* const bus_type);
+gboolean tabrmd_priority_from_str (const char* const priority,
+                                   guint32 *value);
+gboolean tabrmd_busy_poll_from_str (const char* const busy_poll,
+                                    guint32 *value);
+gboolean tabrmd_resume_id_from_str (const char* const resume,
+                                    guint64 *value);
 TSS2_RC tabrmd_kv_callback (const key_value_t *key_value,
                             gpointer user_data);
 TSS2_RC tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
@@ -126,6 +228,22 @@ TSS2_RC tss2_tcti_tabrmd_get_poll_handles (TSS2_TCTI_CONTEXT *context,
 TSS2_RC tss2_tcti_tabrmd_set_locality (TSS2_TCTI_CONTEXT *context,
                                        guint8 locality);
 int tcti_tabrmd_poll (int fd, int32_t timeout);
+int tcti_tabrmd_busy_poll (int fd, int32_t timeout, guint32 busy_poll_us);
+TSS2_RC tcti_tabrmd_receive_seqpacket (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                                       size_t *size,
+                                       uint8_t *response,
+                                       int32_t timeout);
+TSS2_RC tcti_tabrmd_connect_unix (TSS2_TCTI_CONTEXT *context,
+                                  const char *path,
+                                  guint32 priority,
+                                  guint32 flags);
+TSS2_RC tcti_tabrmd_receive_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                                 size_t *size,
+                                 uint8_t *response,
+                                 int32_t timeout);
+gboolean tcti_tabrmd_pool_put (TSS2_TCTI_TABRMD_CONTEXT *ctx);
+TSS2_RC tcti_tabrmd_pool_take (TSS2_TCTI_TABRMD_CONTEXT *ctx);
+void tcti_tabrmd_pool_clear (void);
 TSS2_RC tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
                           uint8_t *buf,
                           size_t size,
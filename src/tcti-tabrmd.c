@@ -7,19 +7,100 @@
 #include <fcntl.h>
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
 #include <glib.h>
 #include <inttypes.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <tss2/tss2_mu.h>
 #include <tss2/tss2_tpm2_types.h>
 
 #include "tabrmd.h"
+#include "tabrmd-tcp.h"
+#include "tabrmd-unix.h"
 #include "tss2-tcti-tabrmd.h"
 #include "tcti-tabrmd-priv.h"
 #include "tpm2-header.h"
 #include "util.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * Transmit a command through the command ring of the shared memory
+ * transport. The daemon splits the ring into commands using the size in
+ * their headers so it must match the size of the buffer. With no more
+ * commands in flight than TABRMD_PIPELINE_MAX the ring only fills up if
+ * the daemon has stopped reading from this connection for a while.
+ */
+static TSS2_RC
+tcti_tabrmd_transmit_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                          size_t size,
+                          const uint8_t *command)
+{
+    if (size < TPM_HEADER_SIZE ||
+        get_command_size ((uint8_t*)command) != size)
+    {
+        g_debug ("%s: command size doesn't match its header", __func__);
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (!shm_ring_write (&ctx->shm->command, command, size)) {
+        g_debug ("%s: no room in command ring", __func__);
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (!shm_doorbell_ring (ctx->shm_command_fd)) {
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+    ctx->pending++;
+    ctx->state = TABRMD_STATE_RECEIVE;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Write all 'size' bytes from 'buf' to the connected socket 'fd'. This
+ * goes straight to send () rather than through the GIO streams of the
+ * GSocketConnection: GIO is only used to set the connection up, every
+ * command after that is one system call. The socket is non-blocking so
+ * when its send buffer is full we wait for it to drain. Returns the number
+ * of bytes written, or -1 with errno set.
+ */
+static ssize_t
+tcti_tabrmd_send_all (int fd,
+                      const uint8_t *buf,
+                      size_t size)
+{
+    struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+    size_t written_total = 0;
+    ssize_t written;
+
+    while (written_total < size) {
+        written = TABRMD_ERRNO_EINTR_RETRY (send (fd,
+                                                  &buf [written_total],
+                                                  size - written_total,
+                                                  MSG_NOSIGNAL));
+        if (written > 0) {
+            written_total += (size_t)written;
+            continue;
+        }
+        if (written == 0) {
+            break;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (TABRMD_ERRNO_EINTR_RETRY (poll (&pollfd, 1, -1)) == -1) {
+            return -1;
+        }
+    }
+    return (ssize_t)written_total;
+}
 TSS2_RC
 tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
                            size_t             size,
@@ -27,7 +108,6 @@ tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
 {
     ssize_t write_ret;
     TSS2_RC tss2_ret = TSS2_RC_SUCCESS;
-    GOutputStream *ostream;
 
     g_debug ("tss2_tcti_tabrmd_transmit");
     if (context == NULL || command == NULL) {
@@ -40,26 +120,36 @@ tss2_tcti_tabrmd_transmit (TSS2_TCTI_CONTEXT *context,
         TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT &&
+        !(TSS2_TCTI_TABRMD_STATE (context) == TABRMD_STATE_RECEIVE &&
+          TSS2_TCTI_TABRMD_PENDING (context) <
+          TSS2_TCTI_TABRMD_PIPELINE_DEPTH (context)))
+    {
         return TSS2_TCTI_RC_BAD_SEQUENCE;
     }
     g_debug_bytes (command, size, 16, 4);
-    ostream = g_io_stream_get_output_stream (TSS2_TCTI_TABRMD_IOSTREAM (context));
-    g_debug ("%s: blocking write on ostream", __func__);
-    write_ret = write_all (ostream, command, size);
-    /* should switch on possible errors to translate to TSS2 error codes */
+    if (TSS2_TCTI_TABRMD_SHM (context) != NULL) {
+        return tcti_tabrmd_transmit_shm ((TSS2_TCTI_TABRMD_CONTEXT*)context,
+                                         size,
+                                         command);
+    }
+    g_debug ("%s: blocking send on socket", __func__);
+    write_ret = tcti_tabrmd_send_all (TSS2_TCTI_TABRMD_FD (context),
+                                      command,
+                                      size);
     switch (write_ret) {
     case -1:
-        g_debug ("tss2_tcti_tabrmd_transmit: error writing to pipe: %s",
+        g_debug ("tss2_tcti_tabrmd_transmit: error writing to socket: %s",
                  strerror (errno));
         tss2_ret = TSS2_TCTI_RC_IO_ERROR;
         break;
     case 0:
-        g_debug ("tss2_tcti_tabrmd_transmit: EOF returned writing to pipe");
+        g_debug ("tss2_tcti_tabrmd_transmit: EOF returned writing to socket");
         tss2_ret = TSS2_TCTI_RC_NO_CONNECTION;
         break;
     default:
         if (write_ret == (ssize_t) size) {
+            TSS2_TCTI_TABRMD_PENDING (context)++;
             TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_RECEIVE;
         } else {
             g_debug ("tss2_tcti_tabrmd_transmit: short write");
@@ -86,6 +176,9 @@ errno_to_tcti_rc (int error_number)
 #endif
         return TSS2_TCTI_RC_TRY_AGAIN;
     case EIO:
+    case ECONNRESET:
+    case ENOTCONN:
+    case EPIPE:
         return TSS2_TCTI_RC_IO_ERROR;
     default:
         g_debug ("mapping errno %d with message \"%s\" to "
@@ -94,35 +187,6 @@ errno_to_tcti_rc (int error_number)
         return TSS2_TCTI_RC_GENERAL_FAILURE;
     }
 }
-/*
- * This function maps GError code values to TCTI RCs.
- */
-static TSS2_RC
-gerror_code_to_tcti_rc (int error_number)
-{
-    switch (error_number) {
-    case -1:
-        return TSS2_TCTI_RC_NO_CONNECTION;
-    case G_IO_ERROR_WOULD_BLOCK:
-        return TSS2_TCTI_RC_TRY_AGAIN;
-    case G_IO_ERROR_FAILED:
-    case G_IO_ERROR_HOST_UNREACHABLE:
-    case G_IO_ERROR_NETWORK_UNREACHABLE:
-#if G_IO_ERROR_BROKEN_PIPE != G_IO_ERROR_CONNECTION_CLOSED
-    case G_IO_ERROR_CONNECTION_CLOSED:
-#endif
-#if GLIB_MAJOR_VERSION == 2 && GLIB_MINOR_VERSION >= 44
-    case G_IO_ERROR_NOT_CONNECTED:
-#endif
-        return TSS2_TCTI_RC_IO_ERROR;
-    default:
-        g_debug ("mapping errno %d with message \"%s\" to "
-                 "TSS2_TCTI_RC_GENERAL_FAILURE",
-                 error_number, strerror (error_number));
-        return TSS2_TCTI_RC_GENERAL_FAILURE;
-    }
-}
-
 #if defined(__FreeBSD__)
 #ifndef POLLRDHUP
 #define POLLRDHUP 0x0
@@ -175,6 +239,43 @@ tcti_tabrmd_poll (int        fd,
         return 0;
     }
 }
+/*
+ * Like tcti_tabrmd_poll but check the FD without blocking for up to
+ * 'busy_poll_us' microseconds first: the response to a fast command is
+ * then picked up without waiting for the scheduler to wake us. Whatever
+ * is left of 'timeout' after spinning goes to tcti_tabrmd_poll.
+ */
+int
+tcti_tabrmd_busy_poll (int        fd,
+                       int32_t    timeout,
+                       guint32    busy_poll_us)
+{
+    struct pollfd pollfd = {
+        .fd = fd,
+        .events = POLLIN | POLLPRI | POLLRDHUP,
+    };
+    gint64 start, spent;
+    int ret;
+
+    if (busy_poll_us == 0 || timeout == 0) {
+        return tcti_tabrmd_poll (fd, timeout);
+    }
+    start = g_get_monotonic_time ();
+    do {
+        ret = TABRMD_ERRNO_EINTR_RETRY (poll (&pollfd, 1, 0));
+        if (ret != 0) {
+            return ret == -1 ? errno : 0;
+        }
+        spent = g_get_monotonic_time () - start;
+    } while (spent < busy_poll_us &&
+             (timeout < 0 || spent < (gint64)timeout * 1000));
+    g_debug ("%s: nothing after spinning for %" PRId64 " us",
+             __func__, spent);
+    if (timeout > 0) {
+        timeout = MAX (timeout - (int32_t)(spent / 1000), 0);
+    }
+    return tcti_tabrmd_poll (fd, timeout);
+}
 /*
  * Read as much of the requested data as possible into the provided buffer.
  * If the read would block, return TSS2_TCTI_RC_TRY_AGAIN (a short read will
@@ -187,11 +288,11 @@ tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
                   size_t size,
                   int32_t timeout)
 {
-    GError *error = NULL;
+    int fd = TSS2_TCTI_TABRMD_FD (ctx);
     ssize_t num_read;
     int ret;
 
-    ret = tcti_tabrmd_poll (TSS2_TCTI_TABRMD_FD (ctx), timeout);
+    ret = tcti_tabrmd_busy_poll (fd, timeout, ctx->busy_poll_us);
     switch (ret) {
     case -1:
         return TSS2_TCTI_RC_TRY_AGAIN;
@@ -201,22 +302,19 @@ tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
         return errno_to_tcti_rc (ret);
     }
 
-    num_read = g_input_stream_read (TSS2_TCTI_TABRMD_ISTREAM (ctx),
-                                    (gchar*)&buf [ctx->index],
-                                    size,
-                                    NULL,
-                                    &error);
+    num_read = TABRMD_ERRNO_EINTR_RETRY (recv (fd,
+                                               &buf [ctx->index],
+                                               size,
+                                               MSG_DONTWAIT));
     switch (num_read) {
     case 0:
         g_debug ("read produced EOF");
         return TSS2_TCTI_RC_NO_CONNECTION;
     case -1:
-        g_assert (error != NULL);
-        g_warning ("%s: read on istream produced error: %s", __func__,
-                   error->message);
-        ret = error->code;
-        g_error_free (error);
-        return gerror_code_to_tcti_rc (ret);
+        ret = errno;
+        g_warning ("%s: recv on socket produced error: %s", __func__,
+                   strerror (ret));
+        return errno_to_tcti_rc (ret);
     default:
         g_debug ("successfully read %zd bytes", num_read);
         g_debug_bytes (&buf [ctx->index], num_read, 16, 4);
@@ -230,6 +328,250 @@ tcti_tabrmd_read (TSS2_TCTI_TABRMD_CONTEXT *ctx,
         }
     }
 }
+/*
+ * Parse the response header once all of it has been read into the
+ * header_buf. Returns FALSE if the size field can't be right.
+ */
+static gboolean
+tcti_tabrmd_parse_header (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    ctx->header.tag  = get_response_tag  (ctx->header_buf);
+    ctx->header.size = get_response_size (ctx->header_buf);
+    ctx->header.code = get_response_code (ctx->header_buf);
+    return ctx->header.size >= TPM_HEADER_SIZE;
+}
+/*
+ * Fast path for the common case where the response is already waiting on
+ * the socket when the caller asks for it: read header and body with a
+ * single non-blocking recv straight into the caller's buffer. The buffer
+ * must be able to hold any response the daemon may send since we can't
+ * know the size of this one before reading it, and no other response may
+ * be in flight behind it or we could read the start of that one too.
+ * Returns:
+ *   TSS2_RC_SUCCESS when the whole response was read
+ *   TSS2_TCTI_RC_TRY_AGAIN when none or only part of it was available,
+ *     the caller must get the rest the slow way
+ *   anything else on error
+ */
+static TSS2_RC
+tcti_tabrmd_receive_fast (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                          uint8_t *response,
+                          size_t size)
+{
+    ssize_t num_read;
+
+    num_read = TABRMD_ERRNO_EINTR_RETRY (recv (TSS2_TCTI_TABRMD_FD (ctx),
+                                               response,
+                                               size,
+                                               MSG_DONTWAIT));
+    switch (num_read) {
+    case -1:
+        g_debug ("%s: recv produced errno %d: %s", __func__, errno,
+                 strerror (errno));
+        return errno_to_tcti_rc (errno);
+    case 0:
+        g_debug ("%s: recv produced EOF", __func__);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    default:
+        g_debug ("%s: recv got %zd bytes", __func__, num_read);
+        g_debug_bytes (response, num_read, 16, 4);
+    }
+    memcpy (ctx->header_buf, response, MIN ((size_t)num_read, TPM_HEADER_SIZE));
+    ctx->index = num_read;
+    if (ctx->index < TPM_HEADER_SIZE) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    if (!tcti_tabrmd_parse_header (ctx) || ctx->index > ctx->header.size) {
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    if (ctx->index < ctx->header.size) {
+        return TSS2_TCTI_RC_TRY_AGAIN;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Bookkeeping once a whole response has been received. The state goes back
+ * to TRANSMIT unless more pipelined responses are due.
+ */
+static void
+tcti_tabrmd_receive_done (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    ctx->index = 0;
+    if (ctx->pending > 0) {
+        ctx->pending--;
+    }
+    if (ctx->pending == 0) {
+        ctx->state = TABRMD_STATE_TRANSMIT;
+    }
+}
+/*
+ * Receive a response over a SOCK_SEQPACKET connection. Each message is one
+ * whole response so there are no partial reads to keep track of: the
+ * header is peeked to learn the size of the response, then the message is
+ * read in one go. A NULL 'response' only queries the size, the message
+ * stays queued for the next call.
+ */
+TSS2_RC
+tcti_tabrmd_receive_seqpacket (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                               size_t *size,
+                               uint8_t *response,
+                               int32_t timeout)
+{
+    int fd = TSS2_TCTI_TABRMD_FD (ctx);
+    ssize_t num_read;
+    int ret;
+
+    num_read = TABRMD_ERRNO_EINTR_RETRY (recv (fd,
+                                               ctx->header_buf,
+                                               TPM_HEADER_SIZE,
+                                               MSG_PEEK | MSG_DONTWAIT));
+    if (num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ret = tcti_tabrmd_busy_poll (fd, timeout, ctx->busy_poll_us);
+        switch (ret) {
+        case -1:
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        case 0:
+            break;
+        default:
+            return errno_to_tcti_rc (ret);
+        }
+        num_read = TABRMD_ERRNO_EINTR_RETRY (recv (fd,
+                                                   ctx->header_buf,
+                                                   TPM_HEADER_SIZE,
+                                                   MSG_PEEK | MSG_DONTWAIT));
+    }
+    switch (num_read) {
+    case -1:
+        g_debug ("%s: recv produced errno %d: %s", __func__, errno,
+                 strerror (errno));
+        return errno_to_tcti_rc (errno);
+    case 0:
+        g_debug ("%s: recv produced EOF", __func__);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    if (num_read < TPM_HEADER_SIZE || !tcti_tabrmd_parse_header (ctx)) {
+        goto malformed;
+    }
+    if (response == NULL) {
+        *size = ctx->header.size;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < ctx->header.size) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    num_read = TABRMD_ERRNO_EINTR_RETRY (recv (fd,
+                                               response,
+                                               ctx->header.size,
+                                               MSG_DONTWAIT | MSG_TRUNC));
+    if (num_read == -1) {
+        g_debug ("%s: recv produced errno %d: %s", __func__, errno,
+                 strerror (errno));
+        return errno_to_tcti_rc (errno);
+    }
+    if ((size_t)num_read != ctx->header.size) {
+        g_warning ("%s: message is %zd bytes but the response header size "
+                   "is %" PRIu32, __func__, num_read, ctx->header.size);
+        ctx->pending = 0;
+        ctx->state = TABRMD_STATE_TRANSMIT;
+        return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    g_debug_bytes (response, num_read, 16, 4);
+    *size = num_read;
+    tcti_tabrmd_receive_done (ctx);
+    return TSS2_RC_SUCCESS;
+malformed:
+    /* drop the bad message so it isn't seen again */
+    TABRMD_ERRNO_EINTR_RETRY (recv (fd, ctx->header_buf, 0, MSG_DONTWAIT));
+    ctx->pending = 0;
+    ctx->state = TABRMD_STATE_TRANSMIT;
+    return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+}
+/*
+ * Receive a response through the response ring of the shared memory
+ * transport. If there's no response in the ring we wait for the daemon to
+ * ring the doorbell, or for the socket to be closed. The doorbell is
+ * cleared before the ring is checked again so a response written in
+ * between still wakes us up. A NULL 'response' only queries the size, the
+ * response stays in the ring for the next call.
+ */
+TSS2_RC
+tcti_tabrmd_receive_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                         size_t *size,
+                         uint8_t *response,
+                         int32_t timeout)
+{
+    shm_ring_t *ring = &ctx->shm->response;
+    struct pollfd pollfds [] = {
+        {
+            .fd = ctx->shm_response_fd,
+            .events = POLLIN,
+        },
+        {
+            .fd = TSS2_TCTI_TABRMD_FD (ctx),
+            .events = POLLIN | POLLRDHUP,
+        },
+    };
+    gssize next;
+    gint64 start;
+    int ret;
+
+    next = shm_ring_next_size (ring);
+    if (next == 0) {
+        shm_doorbell_clear (ctx->shm_response_fd);
+        next = shm_ring_next_size (ring);
+    }
+    /* the ring is in memory, spinning on it doesn't take a syscall */
+    if (next == 0 && ctx->busy_poll_us != 0 && timeout != 0) {
+        start = g_get_monotonic_time ();
+        do {
+            next = shm_ring_next_size (ring);
+        } while (next == 0 &&
+                 g_get_monotonic_time () - start < ctx->busy_poll_us);
+    }
+    if (next == 0) {
+        ret = TABRMD_ERRNO_EINTR_RETRY (poll (pollfds,
+                                              G_N_ELEMENTS (pollfds),
+                                              timeout));
+        switch (ret) {
+        case -1:
+            g_debug ("%s: poll produced errno %d: %s", __func__, errno,
+                     strerror (errno));
+            return errno_to_tcti_rc (errno);
+        case 0:
+            g_debug ("%s: poll timed out after %" PRId32 " milliseconds",
+                     __func__, timeout);
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        }
+        next = shm_ring_next_size (ring);
+        if (next == 0 && pollfds [1].revents != 0) {
+            g_debug ("%s: daemon closed the connection", __func__);
+            return TSS2_TCTI_RC_NO_CONNECTION;
+        } else if (next == 0) {
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        }
+    }
+    if (next < 0) {
+        goto malformed;
+    }
+    if (response == NULL) {
+        *size = next;
+        return TSS2_RC_SUCCESS;
+    }
+    if (*size < (size_t)next) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    if (!shm_ring_read (ring, response, next)) {
+        goto malformed;
+    }
+    g_debug_bytes (response, next, 16, 4);
+    *size = next;
+    tcti_tabrmd_receive_done (ctx);
+    return TSS2_RC_SUCCESS;
+malformed:
+    ctx->pending = 0;
+    ctx->state = TABRMD_STATE_TRANSMIT;
+    return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+}
 /*
  * This is the receive function that is exposed to clients through the TCTI
  * API.
@@ -254,7 +596,10 @@ tss2_tcti_tabrmd_receive (TSS2_TCTI_CONTEXT *context,
         TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
         return TSS2_TCTI_RC_BAD_CONTEXT;
     }
-    if (tabrmd_ctx->state != TABRMD_STATE_RECEIVE) {
+    /* responses go to the callback once one is set */
+    if (tabrmd_ctx->state != TABRMD_STATE_RECEIVE ||
+        tabrmd_ctx->async_cb != NULL)
+    {
         return TSS2_TCTI_RC_BAD_SEQUENCE;
     }
     if (timeout < TSS2_TCTI_TIMEOUT_BLOCK) {
@@ -267,6 +612,37 @@ tss2_tcti_tabrmd_receive (TSS2_TCTI_CONTEXT *context,
     if (response != NULL && *size < TPM_HEADER_SIZE) {
         return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
     }
+    if (tabrmd_ctx->shm != NULL) {
+        return tcti_tabrmd_receive_shm (tabrmd_ctx, size, response, timeout);
+    }
+    if (tabrmd_ctx->seqpacket) {
+        return tcti_tabrmd_receive_seqpacket (tabrmd_ctx, size, response,
+                                              timeout);
+    }
+    /*
+     * Nothing has been read yet and the caller's buffer is big enough for
+     * any response: try to get all of it in one go. If it isn't all there
+     * yet we fall back to polling for the rest below.
+     */
+    if (tabrmd_ctx->index == 0 && response != NULL &&
+        *size >= TPM2_MAX_RESPONSE_SIZE && tabrmd_ctx->pending <= 1)
+    {
+        rc = tcti_tabrmd_receive_fast (tabrmd_ctx, response, *size);
+        switch (rc) {
+        case TSS2_RC_SUCCESS:
+            goto out;
+        case TSS2_TCTI_RC_TRY_AGAIN:
+            rc = TSS2_RC_SUCCESS;
+            break;
+        case TSS2_TCTI_RC_MALFORMED_RESPONSE:
+            tabrmd_ctx->index = 0;
+            tabrmd_ctx->pending = 0;
+            tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
+            return rc;
+        default:
+            return rc;
+        }
+    }
     /* make sure we've got the response header */
     if (tabrmd_ctx->index < TPM_HEADER_SIZE) {
         rc = tcti_tabrmd_read (tabrmd_ctx,
@@ -275,14 +651,12 @@ tss2_tcti_tabrmd_receive (TSS2_TCTI_CONTEXT *context,
                                timeout);
         if (rc != TSS2_RC_SUCCESS)
             return rc;
-        if (tabrmd_ctx->index == TPM_HEADER_SIZE) {
-            tabrmd_ctx->header.tag  = get_response_tag  (tabrmd_ctx->header_buf);
-            tabrmd_ctx->header.size = get_response_size (tabrmd_ctx->header_buf);
-            tabrmd_ctx->header.code = get_response_code (tabrmd_ctx->header_buf);
-            if (tabrmd_ctx->header.size < TPM_HEADER_SIZE) {
-                tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
-                return TSS2_TCTI_RC_MALFORMED_RESPONSE;
-            }
+        if (tabrmd_ctx->index == TPM_HEADER_SIZE &&
+            !tcti_tabrmd_parse_header (tabrmd_ctx))
+        {
+            tabrmd_ctx->pending = 0;
+            tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
         }
     }
     /* if response is NULL, caller is querying size, we know size isn't NULL */
@@ -306,94 +680,675 @@ tss2_tcti_tabrmd_receive (TSS2_TCTI_CONTEXT *context,
                            timeout);
 out:
     if (rc == TSS2_RC_SUCCESS) {
-        /* We got all the bytes we asked for, reset the index & state: done */
+        /* We got all the bytes we asked for: done */
         *size = tabrmd_ctx->index;
-        tabrmd_ctx->index = 0;
-        tabrmd_ctx->state = TABRMD_STATE_TRANSMIT;
+        tcti_tabrmd_receive_done (tabrmd_ctx);
     }
     return rc;
 }
 
-void
-tss2_tcti_tabrmd_finalize (TSS2_TCTI_CONTEXT *context)
+/*
+ * Hand the complete responses at the start of 'async_buf' to the callback
+ * and move what's left of the buffer to its start. The context state is
+ * updated before each call so the callback may transmit the next command.
+ * Stops early if the callback clears itself.
+ */
+static TSS2_RC
+tcti_tabrmd_dispatch_buffered (TSS2_TCTI_TABRMD_CONTEXT *ctx)
 {
-    g_debug ("tss2_tcti_tabrmd_finalize");
-    if (context == NULL) {
-        g_warning ("Invalid parameter");
-        return;
+    size_t offset = 0;
+    uint32_t size;
+
+    while (ctx->async_cb != NULL &&
+           ctx->async_fill - offset >= TPM_HEADER_SIZE)
+    {
+        size = get_response_size (&ctx->async_buf [offset]);
+        if (size < TPM_HEADER_SIZE || size > TPM2_MAX_RESPONSE_SIZE) {
+            g_warning ("%s: bad response size %" PRIu32, __func__, size);
+            ctx->async_fill = 0;
+            ctx->pending = 0;
+            ctx->state = TABRMD_STATE_TRANSMIT;
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+        }
+        if (ctx->async_fill - offset < size) {
+            break;
+        }
+        g_debug_bytes (&ctx->async_buf [offset], size, 16, 4);
+        tcti_tabrmd_receive_done (ctx);
+        ctx->async_cb ((TSS2_TCTI_CONTEXT*)ctx,
+                       &ctx->async_buf [offset],
+                       size,
+                       ctx->async_data);
+        offset += size;
     }
-    TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_FINAL;
-    g_clear_object (&TSS2_TCTI_TABRMD_SOCK_CONNECT (context));
-    g_clear_object (&TSS2_TCTI_TABRMD_PROXY (context));
+    if (offset > 0) {
+        memmove (ctx->async_buf,
+                 &ctx->async_buf [offset],
+                 ctx->async_fill - offset);
+        ctx->async_fill -= offset;
+    }
+    return TSS2_RC_SUCCESS;
 }
-
-TSS2_RC
-tss2_tcti_tabrmd_cancel (TSS2_TCTI_CONTEXT *context)
+/*
+ * Read everything the socket has for us without waiting and dispatch the
+ * complete responses. recv is called until it would block so there's no
+ * need to poll first: the caller's event loop already told us the socket
+ * is readable. A response split across reads stays in the buffer until
+ * the rest shows up. Over a SOCK_SEQPACKET connection each message must
+ * be a whole response.
+ */
+static TSS2_RC
+tcti_tabrmd_dispatch_socket (TSS2_TCTI_TABRMD_CONTEXT *ctx)
 {
-    TSS2_RC ret = TSS2_RC_SUCCESS;
-    GError *error = NULL;
-    gboolean cancel_ret;
+    int fd = TSS2_TCTI_TABRMD_FD (ctx);
+    ssize_t num_read;
+    TSS2_RC rc;
 
-    if (context == NULL) {
-        return TSS2_TCTI_RC_BAD_CONTEXT;
-    }
-    g_info("tss2_tcti_tabrmd_cancel: id 0x%" PRIx64,
-           TSS2_TCTI_TABRMD_ID (context));
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_RECEIVE) {
-        return TSS2_TCTI_RC_BAD_SEQUENCE;
-    }
-    cancel_ret = tcti_tabrmd_call_cancel_sync (
-                     TSS2_TCTI_TABRMD_PROXY (context),
-                     TSS2_TCTI_TABRMD_ID (context),
-                     &ret,
-                     NULL,
-                     &error);
-    if (cancel_ret == FALSE) {
-        g_warning ("cancel command failed with error code: 0x%" PRIx32
-                   ", messag: %s", error->code, error->message);
-        ret = error->code;
-        g_error_free (error);
+    while (ctx->async_cb != NULL) {
+        num_read = TABRMD_ERRNO_EINTR_RETRY (recv (fd,
+            &ctx->async_buf [ctx->async_fill],
+            TABRMD_ASYNC_BUF_SIZE - ctx->async_fill,
+            MSG_DONTWAIT));
+        switch (num_read) {
+        case -1:
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return TSS2_RC_SUCCESS;
+            }
+            g_debug ("%s: recv produced errno %d: %s", __func__, errno,
+                     strerror (errno));
+            return errno_to_tcti_rc (errno);
+        case 0:
+            g_debug ("%s: recv produced EOF", __func__);
+            return TSS2_TCTI_RC_NO_CONNECTION;
+        }
+        ctx->async_fill += num_read;
+        rc = tcti_tabrmd_dispatch_buffered (ctx);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        if (ctx->seqpacket && ctx->async_fill != 0) {
+            g_warning ("%s: message doesn't hold a whole response", __func__);
+            ctx->async_fill = 0;
+            ctx->pending = 0;
+            ctx->state = TABRMD_STATE_TRANSMIT;
+            return TSS2_TCTI_RC_MALFORMED_RESPONSE;
+        }
     }
-
-    return ret;
+    return TSS2_RC_SUCCESS;
 }
-
-TSS2_RC
-tss2_tcti_tabrmd_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
-                                   TSS2_TCTI_POLL_HANDLE *handles,
-                                   size_t                *num_handles)
+/*
+ * The shared memory transport already has whole responses in its ring,
+ * dispatch those until the ring is empty.
+ */
+static TSS2_RC
+tcti_tabrmd_dispatch_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx)
 {
-    if (context == NULL) {
-        return TSS2_TCTI_RC_BAD_CONTEXT;
-    }
-    if (num_handles == NULL) {
-        return TSS2_TCTI_RC_BAD_REFERENCE;
-    }
-    if (handles != NULL && *num_handles < 1) {
-        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
-    }
-    *num_handles = 1;
-    if (handles != NULL) {
-        handles [0].fd = TSS2_TCTI_TABRMD_FD (context);
+    size_t size;
+    TSS2_RC rc;
+
+    while (ctx->async_cb != NULL && ctx->state == TABRMD_STATE_RECEIVE) {
+        size = TABRMD_ASYNC_BUF_SIZE;
+        rc = tcti_tabrmd_receive_shm (ctx, &size, ctx->async_buf, 0);
+        if (rc == TSS2_TCTI_RC_TRY_AGAIN) {
+            break;
+        } else if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        ctx->async_cb ((TSS2_TCTI_CONTEXT*)ctx,
+                       ctx->async_buf,
+                       size,
+                       ctx->async_data);
     }
     return TSS2_RC_SUCCESS;
 }
 
-TSS2_RC
-tss2_tcti_tabrmd_set_locality (TSS2_TCTI_CONTEXT *context,
-                               guint8             locality)
+/*
+ * Release the shared region and doorbells of the shared memory transport.
+ */
+static void
+tcti_tabrmd_shm_free (TSS2_TCTI_TABRMD_CONTEXT *ctx)
 {
-    gboolean status;
-    TSS2_RC ret = TSS2_RC_SUCCESS;
-    GError *error = NULL;
-
-    if (context == NULL) {
-        return TSS2_TCTI_RC_BAD_CONTEXT;
+    g_clear_pointer (&ctx->shm, shm_region_unmap);
+    if (ctx->shm_command_fd >= 0) {
+        close (ctx->shm_command_fd);
+        ctx->shm_command_fd = -1;
     }
-    g_info ("tss2_tcti_tabrmd_set_locality: id 0x%" PRIx64,
-            TSS2_TCTI_TABRMD_ID (context));
-    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
-        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    if (ctx->shm_response_fd >= 0) {
+        close (ctx->shm_response_fd);
+        ctx->shm_response_fd = -1;
+    }
+}
+/*
+ * Process-wide pool of D-Bus proxies and, for contexts initialized with
+ * 'reuse=yes', idle connections. Creating the D-Bus proxy and a connection
+ * each take a few round trips to the bus and the daemon, which adds up for
+ * programs that initialize and finalize a context for every operation.
+ * The proxy for a bus type and name is only created once by whichever
+ * context needs it first and kept in 'pool_proxies' for the life of the
+ * process, so initializing a context after that costs only the
+ * CreateConnection call. The interface has no properties or signals so
+ * the proxy doesn't ask the bus for either. With 'reuse' finalize also
+ * keeps an idle connection open in 'pool_idle' instead of closing it. The next context initialized with the same
+ * parameters takes it over once the daemon has reset it through the
+ * ResetConnection method, which drops whatever the previous user left
+ * behind (virtual handles, sessions).
+ *
+ * Tss2_Tcti_Tabrmd_Preopen fills the pool up front with connections
+ * created through one CreateConnections call. These are 'fresh': nobody
+ * used them yet so there's nothing to reset.
+ *
+ * Connections using the shared memory transport aren't pooled. The pool
+ * belongs to the process that filled it: a child after fork starts over
+ * with an empty one and its own connection to the bus.
+ */
+typedef struct {
+    GBusType           bus_type;
+    gchar             *bus_name;
+    TctiTabrmd        *proxy;
+} tcti_tabrmd_proxy_entry_t;
+
+typedef struct {
+    GBusType           bus_type;
+    gchar             *bus_name;
+    guint32            priority;
+    guint32            flags;
+    guint64            id;
+    gboolean           seqpacket;
+    gboolean           fresh;
+    GSocketConnection *sock_connect;
+} tcti_tabrmd_idle_entry_t;
+
+#define TCTI_TABRMD_PROXY_FLAGS \
+    (G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES | \
+     G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS)
+
+static GMutex pool_mutex;
+static GSList *pool_proxies = NULL;
+static GSList *pool_idle = NULL;
+static pid_t pool_pid = 0;
+static gboolean pool_forked = FALSE;
+
+static void
+tcti_tabrmd_proxy_entry_free (gpointer data)
+{
+    tcti_tabrmd_proxy_entry_t *entry = (tcti_tabrmd_proxy_entry_t*)data;
+
+    g_clear_object (&entry->proxy);
+    g_free (entry->bus_name);
+    g_free (entry);
+}
+static void
+tcti_tabrmd_idle_entry_free (gpointer data)
+{
+    tcti_tabrmd_idle_entry_t *entry = (tcti_tabrmd_idle_entry_t*)data;
+
+    g_clear_object (&entry->sock_connect);
+    g_free (entry->bus_name);
+    g_free (entry);
+}
+/*
+ * Must be called with 'pool_mutex' held. The proxies and sockets in the
+ * pool of a parent process are still in use by the parent so in a child
+ * we forget about them without releasing anything.
+ */
+static void
+tcti_tabrmd_pool_check_pid (void)
+{
+    pid_t pid = getpid ();
+
+    if (pool_pid != pid) {
+        g_clear_pointer (&pool_proxies, g_slist_free);
+        g_clear_pointer (&pool_idle, g_slist_free);
+        if (pool_pid != 0) {
+            pool_forked = TRUE;
+        }
+        pool_pid = pid;
+    }
+}
+/*
+ * Create the proxy for 'bus_type' and 'bus_name'. Normally the proxy uses
+ * the shared GDBusConnection for the bus that GIO keeps per process. In a
+ * child after fork that connection is the parent's and its worker thread
+ * didn't survive the fork, so the child gets a private connection to the
+ * bus instead.
+ */
+static TctiTabrmd*
+tcti_tabrmd_proxy_new (GBusType      bus_type,
+                       const gchar  *bus_name,
+                       GError      **error)
+{
+    GDBusConnection *connection;
+    TctiTabrmd *proxy;
+    gchar *address;
+
+    if (!pool_forked) {
+        return tcti_tabrmd_proxy_new_for_bus_sync (bus_type,
+                                                   TCTI_TABRMD_PROXY_FLAGS,
+                                                   bus_name,
+                                                   TABRMD_DBUS_PATH,
+                                                   NULL,
+                                                   error);
+    }
+    address = g_dbus_address_get_for_bus_sync (bus_type, NULL, error);
+    if (address == NULL) {
+        return NULL;
+    }
+    connection = g_dbus_connection_new_for_address_sync (address,
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+        NULL,
+        NULL,
+        error);
+    g_free (address);
+    if (connection == NULL) {
+        return NULL;
+    }
+    proxy = tcti_tabrmd_proxy_new_sync (connection,
+                                        TCTI_TABRMD_PROXY_FLAGS,
+                                        bus_name,
+                                        TABRMD_DBUS_PATH,
+                                        NULL,
+                                        error);
+    g_object_unref (connection);
+    return proxy;
+}
+/*
+ * Drop everything in the pool.
+ */
+void
+tcti_tabrmd_pool_clear (void)
+{
+    g_mutex_lock (&pool_mutex);
+    tcti_tabrmd_pool_check_pid ();
+    g_slist_free_full (pool_idle, tcti_tabrmd_idle_entry_free);
+    pool_idle = NULL;
+    g_slist_free_full (pool_proxies, tcti_tabrmd_proxy_entry_free);
+    pool_proxies = NULL;
+    g_mutex_unlock (&pool_mutex);
+}
+/*
+ * Hand the connection of a context being finalized to the pool. This is
+ * only possible for contexts with 'reuse' set that aren't in the middle
+ * of a command and when the pool has room. The connection is taken from
+ * the context if this function returns TRUE.
+ */
+gboolean
+tcti_tabrmd_pool_put (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    tcti_tabrmd_idle_entry_t *entry;
+
+    if (!ctx->reuse ||
+        ctx->state != TABRMD_STATE_TRANSMIT ||
+        ctx->shm != NULL ||
+        ctx->proxy == NULL ||
+        ctx->sock_connect == NULL)
+    {
+        return FALSE;
+    }
+    g_mutex_lock (&pool_mutex);
+    tcti_tabrmd_pool_check_pid ();
+    if (g_slist_length (pool_idle) >= TABRMD_REUSE_POOL_MAX) {
+        g_mutex_unlock (&pool_mutex);
+        return FALSE;
+    }
+    entry = g_new0 (tcti_tabrmd_idle_entry_t, 1);
+    entry->bus_type = ctx->bus_type;
+    entry->bus_name = g_strdup (ctx->bus_name);
+    entry->priority = ctx->priority;
+    entry->flags = ctx->flags;
+    entry->id = ctx->id;
+    entry->seqpacket = ctx->seqpacket;
+    entry->sock_connect = ctx->sock_connect;
+    ctx->sock_connect = NULL;
+    pool_idle = g_slist_prepend (pool_idle, entry);
+    g_mutex_unlock (&pool_mutex);
+    g_debug ("%s: keeping connection with id 0x%" PRIx64 " for reuse",
+             __func__, entry->id);
+    return TRUE;
+}
+/*
+ * Get the proxy for the bus of 'ctx' from the pool, creating it if this
+ * is the first context for the bus. The pool keeps its own reference.
+ */
+static TSS2_RC
+tcti_tabrmd_pool_get_proxy (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    tcti_tabrmd_proxy_entry_t *entry;
+    GError *error = NULL;
+    GSList *item;
+
+    g_mutex_lock (&pool_mutex);
+    tcti_tabrmd_pool_check_pid ();
+    for (item = pool_proxies; item != NULL; item = item->next) {
+        entry = (tcti_tabrmd_proxy_entry_t*)item->data;
+        if (entry->bus_type == ctx->bus_type &&
+            g_strcmp0 (entry->bus_name, ctx->bus_name) == 0)
+        {
+            ctx->proxy = g_object_ref (entry->proxy);
+            g_mutex_unlock (&pool_mutex);
+            return TSS2_RC_SUCCESS;
+        }
+    }
+    ctx->proxy = tcti_tabrmd_proxy_new (ctx->bus_type, ctx->bus_name, &error);
+    if (ctx->proxy == NULL) {
+        g_mutex_unlock (&pool_mutex);
+        g_critical ("failed to allocate dbus proxy object: %s", error->message);
+        g_error_free (error);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    entry = g_new0 (tcti_tabrmd_proxy_entry_t, 1);
+    entry->bus_type = ctx->bus_type;
+    entry->bus_name = g_strdup (ctx->bus_name);
+    entry->proxy = g_object_ref (ctx->proxy);
+    pool_proxies = g_slist_prepend (pool_proxies, entry);
+    g_mutex_unlock (&pool_mutex);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Remove an idle connection created with the same parameters as 'ctx'
+ * from the pool. Returns NULL if there's none.
+ */
+static tcti_tabrmd_idle_entry_t*
+tcti_tabrmd_pool_take_idle (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    tcti_tabrmd_idle_entry_t *entry = NULL;
+    GSList *item;
+
+    g_mutex_lock (&pool_mutex);
+    tcti_tabrmd_pool_check_pid ();
+    for (item = pool_idle; item != NULL; item = item->next) {
+        entry = (tcti_tabrmd_idle_entry_t*)item->data;
+        if (entry->bus_type == ctx->bus_type &&
+            entry->priority == ctx->priority &&
+            entry->flags == ctx->flags &&
+            g_strcmp0 (entry->bus_name, ctx->bus_name) == 0)
+        {
+            pool_idle = g_slist_delete_link (pool_idle, item);
+            g_mutex_unlock (&pool_mutex);
+            return entry;
+        }
+    }
+    g_mutex_unlock (&pool_mutex);
+    return NULL;
+}
+/*
+ * An idle connection must have nothing to read: if the daemon closed it
+ * or sent something we didn't ask for it's of no use.
+ */
+static gboolean
+tcti_tabrmd_idle_is_usable (tcti_tabrmd_idle_entry_t *entry)
+{
+    GSocket *sock = g_socket_connection_get_socket (entry->sock_connect);
+    struct pollfd pollfd = {
+        .fd = g_socket_get_fd (sock),
+        .events = POLLIN | POLLRDHUP,
+    };
+
+    return poll (&pollfd, 1, 0) == 0;
+}
+/*
+ * Set up the proxy for a context with 'reuse' set and try to take over an
+ * idle connection from the pool, asking the daemon to reset it first.
+ * Idle connections that can't be reset are closed. Returns
+ * TSS2_RC_SUCCESS with no connection in 'ctx' if there was none to take,
+ * the caller then creates one as usual.
+ */
+TSS2_RC
+tcti_tabrmd_pool_take (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    tcti_tabrmd_idle_entry_t *entry;
+    GError *error = NULL;
+    gboolean call_ret;
+    TSS2_RC rc;
+
+    rc = tcti_tabrmd_pool_get_proxy (ctx);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    while ((entry = tcti_tabrmd_pool_take_idle (ctx)) != NULL) {
+        if (!tcti_tabrmd_idle_is_usable (entry)) {
+            g_debug ("%s: idle connection with id 0x%" PRIx64 " is stale",
+                     __func__, entry->id);
+            tcti_tabrmd_idle_entry_free (entry);
+            continue;
+        }
+        if (entry->fresh) {
+            goto take;
+        }
+        call_ret = tcti_tabrmd_call_reset_connection_sync (ctx->proxy,
+                                                           entry->id,
+                                                           &rc,
+                                                           NULL,
+                                                           &error);
+        if (call_ret == FALSE) {
+            g_debug ("%s: ResetConnection failed: %s", __func__,
+                     error->message);
+            g_clear_error (&error);
+            tcti_tabrmd_idle_entry_free (entry);
+            continue;
+        }
+        if (rc != TSS2_RC_SUCCESS) {
+            g_debug ("%s: ResetConnection returned 0x%" PRIx32, __func__, rc);
+            tcti_tabrmd_idle_entry_free (entry);
+            continue;
+        }
+take:
+        ctx->id = entry->id;
+        ctx->seqpacket = entry->seqpacket;
+        ctx->sock_connect = entry->sock_connect;
+        entry->sock_connect = NULL;
+        tcti_tabrmd_idle_entry_free (entry);
+        g_debug ("%s: reusing connection with id 0x%" PRIx64, __func__,
+                 ctx->id);
+        break;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Connections created by Tss2_Tcti_Tabrmd_Prefork for the children of a
+ * prefork server. The set lives in an anonymous shared mapping so that
+ * every process forked from the parent sees the same 'claimed' flags: a
+ * child initializing a context with 'prefork=yes' takes the first slot
+ * nobody claimed yet with an atomic compare and exchange, no D-Bus call
+ * is involved. Only 'claimed' is ever written after the set is created.
+ * The fds themselves are inherited through fork, so a process consumes
+ * its copy of the set with the first claim: it keeps the fd it claimed
+ * and closes all others.
+ */
+typedef struct {
+    gint               claimed;
+    gint               fd;
+    guint64            id;
+    gboolean           seqpacket;
+} tcti_tabrmd_prefork_slot_t;
+
+typedef struct {
+    gsize                      size;
+    gsize                      count;
+    tcti_tabrmd_prefork_slot_t slots [];
+} tcti_tabrmd_prefork_t;
+
+static tcti_tabrmd_prefork_t *prefork_set = NULL;
+
+/*
+ * Close the fds in 'set' except the one in slot 'keep' and unmap it.
+ */
+static void
+tcti_tabrmd_prefork_free (tcti_tabrmd_prefork_t *set,
+                          gsize                  keep)
+{
+    gsize i;
+
+    for (i = 0; i < set->count; ++i) {
+        if (i != keep) {
+            close (set->slots [i].fd);
+        }
+    }
+    munmap (set, set->size);
+}
+/*
+ * Claim a connection from the prefork set inherited by this process for
+ * 'ctx'. Returns FALSE if there's no set or all of its connections were
+ * claimed already, the caller then creates a connection the usual way.
+ */
+static gboolean
+tcti_tabrmd_prefork_claim (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    tcti_tabrmd_prefork_t *set;
+    tcti_tabrmd_prefork_slot_t *slot = NULL;
+    GError *error = NULL;
+    GSocket *sock;
+    gsize i;
+
+    g_mutex_lock (&pool_mutex);
+    set = prefork_set;
+    prefork_set = NULL;
+    g_mutex_unlock (&pool_mutex);
+    if (set == NULL) {
+        return FALSE;
+    }
+    for (i = 0; i < set->count; ++i) {
+        if (g_atomic_int_compare_and_exchange (&set->slots [i].claimed, 0, 1)) {
+            slot = &set->slots [i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        g_info ("%s: all %zu preforked connections are claimed", __func__,
+                set->count);
+        tcti_tabrmd_prefork_free (set, G_MAXSIZE);
+        return FALSE;
+    }
+    sock = g_socket_new_from_fd (slot->fd, &error);
+    if (sock == NULL) {
+        g_warning ("%s: failed to create socket for preforked connection: %s",
+                   __func__, error->message);
+        g_error_free (error);
+        tcti_tabrmd_prefork_free (set, G_MAXSIZE);
+        return FALSE;
+    }
+    ctx->sock_connect = g_socket_connection_factory_create_connection (sock);
+    g_object_unref (sock);
+    ctx->id = slot->id;
+    ctx->seqpacket = slot->seqpacket;
+    ctx->prefork = TRUE;
+    g_debug ("%s: claimed preforked connection with id 0x%" PRIx64, __func__,
+             ctx->id);
+    tcti_tabrmd_prefork_free (set, i);
+    return TRUE;
+}
+/*
+ * The D-Bus proxy of 'ctx'. Contexts that claimed a preforked connection
+ * only get one, from the pool, once they need it for Cancel or
+ * SetLocality. Connections set up through the Unix socket have none and
+ * NULL is returned.
+ */
+static TctiTabrmd*
+tcti_tabrmd_get_proxy (TSS2_TCTI_TABRMD_CONTEXT *ctx)
+{
+    if (ctx->proxy == NULL && ctx->prefork) {
+        tcti_tabrmd_pool_get_proxy (ctx);
+    }
+    return ctx->proxy;
+}
+void
+tss2_tcti_tabrmd_finalize (TSS2_TCTI_CONTEXT *context)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+
+    g_debug ("tss2_tcti_tabrmd_finalize");
+    if (context == NULL) {
+        g_warning ("Invalid parameter");
+        return;
+    }
+    tcti_tabrmd_pool_put (ctx);
+    TSS2_TCTI_TABRMD_STATE (context) = TABRMD_STATE_FINAL;
+    tcti_tabrmd_shm_free (ctx);
+    g_clear_object (&TSS2_TCTI_TABRMD_SOCK_CONNECT (context));
+    /* closing our end of the socket pair ends the relay */
+    g_clear_pointer (&ctx->tls_relay, g_thread_join);
+    g_clear_object (&TSS2_TCTI_TABRMD_PROXY (context));
+    g_clear_pointer (&ctx->bus_name, g_free);
+    g_clear_pointer (&ctx->async_buf, g_free);
+}
+
+TSS2_RC
+tss2_tcti_tabrmd_cancel (TSS2_TCTI_CONTEXT *context)
+{
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    GError *error = NULL;
+    gboolean cancel_ret;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    g_info("tss2_tcti_tabrmd_cancel: id 0x%" PRIx64,
+           TSS2_TCTI_TABRMD_ID (context));
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_RECEIVE) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    /* connections set up through the Unix socket have no D-Bus proxy */
+    if (tcti_tabrmd_get_proxy ((TSS2_TCTI_TABRMD_CONTEXT*)context) == NULL) {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+    }
+    cancel_ret = tcti_tabrmd_call_cancel_sync (
+                     TSS2_TCTI_TABRMD_PROXY (context),
+                     TSS2_TCTI_TABRMD_ID (context),
+                     &ret,
+                     NULL,
+                     &error);
+    if (cancel_ret == FALSE) {
+        g_warning ("cancel command failed with error code: 0x%" PRIx32
+                   ", messag: %s", error->code, error->message);
+        ret = error->code;
+        g_error_free (error);
+    }
+
+    return ret;
+}
+
+TSS2_RC
+tss2_tcti_tabrmd_get_poll_handles (TSS2_TCTI_CONTEXT     *context,
+                                   TSS2_TCTI_POLL_HANDLE *handles,
+                                   size_t                *num_handles)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (num_handles == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (handles != NULL && *num_handles < 1) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+    *num_handles = 1;
+    if (handles != NULL && TSS2_TCTI_TABRMD_SHM (context) != NULL) {
+        /* responses are announced by the doorbell, not the socket */
+        handles [0].fd = ((TSS2_TCTI_TABRMD_CONTEXT*)context)->shm_response_fd;
+    } else if (handles != NULL) {
+        handles [0].fd = TSS2_TCTI_TABRMD_FD (context);
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_RC
+tss2_tcti_tabrmd_set_locality (TSS2_TCTI_CONTEXT *context,
+                               guint8             locality)
+{
+    gboolean status;
+    TSS2_RC ret = TSS2_RC_SUCCESS;
+    GError *error = NULL;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    g_info ("tss2_tcti_tabrmd_set_locality: id 0x%" PRIx64,
+            TSS2_TCTI_TABRMD_ID (context));
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (tcti_tabrmd_get_proxy ((TSS2_TCTI_TABRMD_CONTEXT*)context) == NULL) {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
     }
     status = tcti_tabrmd_call_set_locality_sync (
                  TSS2_TCTI_TABRMD_PROXY (context),
@@ -424,6 +1379,9 @@ init_tcti_data (TSS2_TCTI_CONTEXT *context)
     TSS2_TCTI_MAGIC (context)            = TSS2_TCTI_TABRMD_MAGIC;
     TSS2_TCTI_VERSION (context)          = TSS2_TCTI_TABRMD_VERSION;
     TSS2_TCTI_TABRMD_STATE (context)     = TABRMD_STATE_TRANSMIT;
+    TSS2_TCTI_TABRMD_PIPELINE_DEPTH (context) = 1;
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->shm_command_fd = -1;
+    ((TSS2_TCTI_TABRMD_CONTEXT*)context)->shm_response_fd = -1;
     TSS2_TCTI_TRANSMIT (context)         = tss2_tcti_tabrmd_transmit;
     TSS2_TCTI_RECEIVE (context)          = tss2_tcti_tabrmd_receive;
     TSS2_TCTI_FINALIZE (context)         = tss2_tcti_tabrmd_finalize;
@@ -432,17 +1390,58 @@ init_tcti_data (TSS2_TCTI_CONTEXT *context)
     TSS2_TCTI_SET_LOCALITY (context)     = tss2_tcti_tabrmd_set_locality;
 }
 
+/*
+ * Connections with the default priority are created with the original
+ * CreateConnection method so that we can still talk to daemons that don't
+ * support priority classes. Connection flags are asked for through
+ * CreateConnectionWithFlags. If the daemon doesn't know that method we
+ * fall back to the others and no flags are granted. The flags the daemon
+ * granted are returned through 'out_flags'.
+ */
 static gboolean
 tcti_tabrmd_call_create_connection_sync_fdlist (TctiTabrmd     *proxy,
+                                                guint32         priority,
+                                                guint32         flags,
                                                 guint64        *out_id,
+                                                guint32        *out_flags,
                                                 GUnixFDList   **out_fd_list,
                                                 GCancellable   *cancellable,
                                                 GError        **error)
 {
     GVariant *_ret;
+    const gchar *method = TABRMD_DBUS_METHOD_CREATE_CONNECTION;
+    GVariant *parameters = NULL;
+
+    *out_flags = 0;
+    if (flags != 0) {
+        _ret = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (proxy),
+            TABRMD_DBUS_METHOD_CREATE_CONNECTION_WITH_FLAGS,
+            g_variant_new ("(uu)", priority, flags),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            out_fd_list,
+            cancellable,
+            error);
+        if (_ret != NULL) {
+            g_variant_get (_ret, "(tu)", out_id, out_flags);
+            g_variant_unref (_ret);
+            return TRUE;
+        }
+        if (!g_error_matches (*error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+            return FALSE;
+        }
+        g_debug ("%s: daemon doesn't support connection flags: %s",
+                 __func__, (*error)->message);
+        g_clear_error (error);
+    }
+    if (priority != TABRMD_PRIORITY_DEFAULT) {
+        method = TABRMD_DBUS_METHOD_CREATE_CONNECTION_WITH_PRIORITY;
+        parameters = g_variant_new ("(u)", priority);
+    }
     _ret = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (proxy),
-        "CreateConnection",
-        NULL,
+        method,
+        parameters,
         G_DBUS_CALL_FLAGS_NONE,
         -1,
         NULL,
@@ -474,6 +1473,26 @@ static const bus_name_type_entry_t bus_name_type_map[] = {
     },
 };
 #define BUS_NAME_TYPE_MAP_LENGTH (sizeof (bus_name_type_map) / sizeof (bus_name_type_entry_t))
+
+typedef struct {
+    char *name;
+    guint32 priority;
+} priority_entry_t;
+
+static const priority_entry_t priority_map[] = {
+    {
+        .name = "interactive",
+        .priority = TABRMD_PRIORITY_INTERACTIVE,
+    },
+    {
+        .name = "normal",
+        .priority = TABRMD_PRIORITY_NORMAL,
+    },
+    {
+        .name = "batch",
+        .priority = TABRMD_PRIORITY_BATCH,
+    },
+};
 GBusType
 tabrmd_bus_type_from_str (const char* const bus_type)
 {
@@ -491,6 +1510,64 @@ tabrmd_bus_type_from_str (const char* const bus_type)
     g_debug ("no match for bus_type string %s", bus_type);
     return G_BUS_TYPE_NONE;
 }
+/*
+ * Map the name of a connection priority class to its value. Returns FALSE
+ * if the name doesn't match any class.
+ */
+gboolean
+tabrmd_priority_from_str (const char* const priority,
+                          guint32 *value)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS (priority_map); ++i) {
+        if (strcmp (priority_map [i].name, priority) == 0) {
+            *value = priority_map [i].priority;
+            return TRUE;
+        }
+    }
+    g_debug ("no match for priority string %s", priority);
+    return FALSE;
+}
+/*
+ * Parse the microseconds to spin for before blocking in poll. Returns
+ * FALSE unless 'busy_poll' is a number up to TABRMD_BUSY_POLL_MAX.
+ */
+gboolean
+tabrmd_busy_poll_from_str (const char* const busy_poll,
+                           guint32 *value)
+{
+    gchar *end = NULL;
+    guint64 us;
+
+    us = g_ascii_strtoull (busy_poll, &end, 10);
+    if (end == busy_poll || *end != '\0' || us > TABRMD_BUSY_POLL_MAX) {
+        g_debug ("bad busy_poll value %s", busy_poll);
+        return FALSE;
+    }
+    *value = (guint32)us;
+    return TRUE;
+}
+/*
+ * Parse the resume id of a closed connection, as printed in hex by
+ * Tss2_Tcti_Tabrmd_GetResumeId. Returns FALSE unless 'resume' is a
+ * non-zero number.
+ */
+gboolean
+tabrmd_resume_id_from_str (const char* const resume,
+                           guint64 *value)
+{
+    gchar *end = NULL;
+    guint64 id;
+
+    id = g_ascii_strtoull (resume, &end, 0);
+    if (end == resume || *end != '\0' || id == 0) {
+        g_debug ("bad resume value %s", resume);
+        return FALSE;
+    }
+    *value = id;
+    return TRUE;
+}
 
 TSS2_RC
 tabrmd_kv_callback (const key_value_t *key_value,
@@ -512,69 +1589,521 @@ tabrmd_kv_callback (const key_value_t *key_value,
             return TSS2_TCTI_RC_BAD_VALUE;
         }
         return TSS2_RC_SUCCESS;
-    } else {
-        return TSS2_TCTI_RC_BAD_VALUE;
-    }
-}
+    } else if (strcmp (key_value->key, "socket") == 0) {
+        tabrmd_conf->socket_path = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "priority") == 0) {
+        if (!tabrmd_priority_from_str (key_value->value,
+                                       &tabrmd_conf->priority))
+        {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "transport") == 0) {
+        if (strcmp (key_value->value, "shm") == 0) {
+            tabrmd_conf->flags |= TABRMD_CONNECTION_FLAG_SHM_RING;
+        } else if (strcmp (key_value->value, "socket") == 0) {
+            tabrmd_conf->flags &= ~TABRMD_CONNECTION_FLAG_SHM_RING;
+        } else {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "reuse") == 0) {
+        if (strcmp (key_value->value, "yes") == 0) {
+            tabrmd_conf->reuse = TRUE;
+        } else if (strcmp (key_value->value, "no") == 0) {
+            tabrmd_conf->reuse = FALSE;
+        } else {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "prefork") == 0) {
+        if (strcmp (key_value->value, "yes") == 0) {
+            tabrmd_conf->prefork = TRUE;
+        } else if (strcmp (key_value->value, "no") == 0) {
+            tabrmd_conf->prefork = FALSE;
+        } else {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "framing") == 0) {
+        if (strcmp (key_value->value, "seqpacket") == 0) {
+            tabrmd_conf->flags |= TABRMD_CONNECTION_FLAG_SEQPACKET;
+        } else if (strcmp (key_value->value, "stream") == 0) {
+            tabrmd_conf->flags &= ~TABRMD_CONNECTION_FLAG_SEQPACKET;
+        } else {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "tcp") == 0) {
+        tabrmd_conf->tcp_address = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "tls_cert") == 0) {
+        tabrmd_conf->tls_cert = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "tls_key") == 0) {
+        tabrmd_conf->tls_key = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "tls_ca") == 0) {
+        tabrmd_conf->tls_ca = key_value->value;
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "resume") == 0) {
+        if (!tabrmd_resume_id_from_str (key_value->value,
+                                        &tabrmd_conf->resume_id))
+        {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else if (strcmp (key_value->key, "busy_poll") == 0) {
+        if (!tabrmd_busy_poll_from_str (key_value->value,
+                                        &tabrmd_conf->busy_poll_us))
+        {
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+        return TSS2_RC_SUCCESS;
+    } else {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+}
+
+/*
+ * Map the shared region of a connection granted the shared memory
+ * transport and take the doorbells. These follow the socket in 'fd_list':
+ * the memfd, then the command and response doorbells. The memfd isn't
+ * needed once it's mapped.
+ */
+static TSS2_RC
+tcti_tabrmd_connect_shm (TSS2_TCTI_TABRMD_CONTEXT *ctx,
+                         GUnixFDList *fd_list)
+{
+    GError *error = NULL;
+    gint shm_fd;
 
+    shm_fd = g_unix_fd_list_get (fd_list, 1, &error);
+    if (shm_fd == -1) {
+        goto fail;
+    }
+    ctx->shm = shm_region_map (shm_fd);
+    close (shm_fd);
+    if (ctx->shm == NULL) {
+        g_critical ("unable to map shared region from daemon");
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    ctx->shm_command_fd = g_unix_fd_list_get (fd_list, 2, &error);
+    if (ctx->shm_command_fd == -1) {
+        goto fail;
+    }
+    ctx->shm_response_fd = g_unix_fd_list_get (fd_list, 3, &error);
+    if (ctx->shm_response_fd == -1) {
+        goto fail;
+    }
+    g_debug ("%s: connection uses the shared memory transport", __func__);
+    return TSS2_RC_SUCCESS;
+fail:
+    g_critical ("unable to get shared memory handles from GUnixFDList: %s",
+                error->message);
+    g_error_free (error);
+    tcti_tabrmd_shm_free (ctx);
+    return TSS2_TCTI_RC_GENERAL_FAILURE;
+}
+/*
+ * Take the connection the daemon created for us: the socket is the first
+ * fd in 'fd_list', followed by the handles for the shared memory transport
+ * if the daemon granted it. 'id' and 'granted' are the connection id and
+ * flags from the daemon's reply.
+ */
+static TSS2_RC
+tcti_tabrmd_connect_fds (TSS2_TCTI_CONTEXT *context,
+                         guint64            id,
+                         guint32            granted,
+                         GUnixFDList       *fd_list)
+{
+    GError *error = NULL;
+    GSocket *sock = NULL;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    if (fd_list == NULL) {
+        g_critical ("call to CreateConnection returned a NULL GUnixFDList");
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    gint num_handles = g_unix_fd_list_get_length (fd_list);
+    gint num_expected = (granted & TABRMD_CONNECTION_FLAG_SHM_RING) ? 4 : 1;
+    if (num_handles != num_expected) {
+        g_critical ("CreateConnection expected to return %d handles, received %d",
+                    num_expected, num_handles);
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    gint fd = g_unix_fd_list_get (fd_list, 0, &error);
+    if (fd == -1) {
+        g_critical ("unable to get receive handle from GUnixFDList: %s",
+                    error->message);
+        g_error_free (error);
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    sock = g_socket_new_from_fd (fd, NULL);
+    TSS2_TCTI_TABRMD_SOCK_CONNECT (context) = \
+        g_socket_connection_factory_create_connection (sock);
+    TSS2_TCTI_TABRMD_ID (context) = id;
+    TSS2_TCTI_TABRMD_SEQPACKET (context) =
+        (granted & TABRMD_CONNECTION_FLAG_SEQPACKET) != 0;
+    g_debug ("%s: connection uses %s framing", __func__,
+             TSS2_TCTI_TABRMD_SEQPACKET (context) ? "seqpacket" : "stream");
+    if (granted & TABRMD_CONNECTION_FLAG_SHM_RING) {
+        rc = tcti_tabrmd_connect_shm ((TSS2_TCTI_TABRMD_CONTEXT*)context,
+                                      fd_list);
+    }
+    g_clear_object (&sock);
+    return rc;
+}
 /*
  * Establish a connection with the daemon. This includes calling the
  * CreateConnection dbus method, extracting the file descriptor used for
  * sending commands and receiving responses, and extracting the connection
- * ID used when sending commands over the dbus interface.
+ * ID used when sending commands over the dbus interface. The connection is
+ * created with the provided priority class and connection flags, if the
+ * daemon grants them.
  *
  * The proxy object in the context structure must be created / valid before
  * calling this function.
  */
 TSS2_RC
-tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context)
+tcti_tabrmd_connect (TSS2_TCTI_CONTEXT *context,
+                     guint32            priority,
+                     guint32            flags)
 {
     GError *error = NULL;
-    GSocket *sock = NULL;
     GUnixFDList *fd_list = NULL;
     gboolean call_ret;
     guint64 id;
-    TSS2_RC rc = TSS2_RC_SUCCESS;
+    guint32 granted;
+    TSS2_RC rc;
 
     call_ret = tcti_tabrmd_call_create_connection_sync_fdlist (
         TSS2_TCTI_TABRMD_PROXY (context),
+        priority,
+        flags,
         &id,
+        &granted,
         &fd_list,
         NULL,
         &error);
     if (call_ret == FALSE) {
         g_warning ("Failed to create connection with service: %s",
                  error->message);
-        rc = TSS2_TCTI_RC_NO_CONNECTION;
+        g_clear_error (&error);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    rc = tcti_tabrmd_connect_fds (context, id, granted, fd_list);
+    g_clear_object (&fd_list);
+    return rc;
+}
+/*
+ * Establish a connection with the daemon that takes over the objects and
+ * sessions of the closed connection 'resume_id', through the
+ * ResumeConnection method. The daemon starts the connection empty if it
+ * hasn't kept that one. A daemon that doesn't know the method gets a
+ * CreateConnection call instead.
+ */
+static TSS2_RC
+tcti_tabrmd_resume (TSS2_TCTI_CONTEXT *context,
+                    guint64            resume_id,
+                    guint32            priority,
+                    guint32            flags)
+{
+    GError *error = NULL;
+    GUnixFDList *fd_list = NULL;
+    GVariant *ret;
+    guint64 id;
+    guint32 granted;
+    TSS2_RC rc;
+
+    ret = g_dbus_proxy_call_with_unix_fd_list_sync (
+        G_DBUS_PROXY (TSS2_TCTI_TABRMD_PROXY (context)),
+        TABRMD_DBUS_METHOD_RESUME_CONNECTION,
+        g_variant_new ("(tuu)", resume_id, priority, flags),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        &fd_list,
+        NULL,
+        &error);
+    if (ret == NULL) {
+        if (!g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+            g_warning ("Failed to resume connection with service: %s",
+                       error->message);
+            g_clear_error (&error);
+            return TSS2_TCTI_RC_NO_CONNECTION;
+        }
+        g_debug ("%s: daemon doesn't support resuming connections: %s",
+                 __func__, error->message);
+        g_clear_error (&error);
+        return tcti_tabrmd_connect (context, priority, flags);
+    }
+    g_variant_get (ret, "(tu)", &id, &granted);
+    g_variant_unref (ret);
+    rc = tcti_tabrmd_connect_fds (context, id, granted, fd_list);
+    g_clear_object (&fd_list);
+    return rc;
+}
+/*
+ * Establish a connection with the daemon through the Unix socket at 'path'
+ * instead of D-Bus. We send one request and get back a reply with the same
+ * fds as CreateConnectionWithFlags. No D-Bus proxy is created for these
+ * connections so the Cancel and SetLocality methods aren't available.
+ */
+TSS2_RC
+tcti_tabrmd_connect_unix (TSS2_TCTI_CONTEXT *context,
+                          const char        *path,
+                          guint32            priority,
+                          guint32            flags)
+{
+    tabrmd_unix_request_t request = {
+        .magic = TABRMD_UNIX_MAGIC,
+        .version = TABRMD_UNIX_VERSION,
+        .priority = priority,
+        .flags = flags,
+    };
+    tabrmd_unix_reply_t reply = { 0 };
+    GInputVector vector = { .buffer = &reply, .size = sizeof (reply) };
+    GSocketControlMessage **messages = NULL;
+    GUnixFDList *fd_list = NULL;
+    GSocketAddress *address;
+    GSocket *sock;
+    GError *error = NULL;
+    gint num_messages = 0, i;
+    gboolean call_ret;
+    gssize ret;
+    TSS2_RC rc = TSS2_TCTI_RC_NO_CONNECTION;
+
+    sock = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                         G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_DEFAULT,
+                         &error);
+    if (sock == NULL) {
         goto out;
     }
-    if (fd_list == NULL) {
-        g_critical ("call to CreateConnection returned a NULL GUnixFDList");
-        rc = TSS2_TCTI_RC_NO_CONNECTION;
+    address = g_unix_socket_address_new (path);
+    call_ret = g_socket_connect (sock, address, NULL, &error);
+    g_object_unref (address);
+    if (!call_ret ||
+        g_socket_send (sock,
+                       (const gchar*)&request,
+                       sizeof (request),
+                       NULL,
+                       &error) != (gssize)sizeof (request))
+    {
         goto out;
     }
-    gint num_handles = g_unix_fd_list_get_length (fd_list);
-    if (num_handles != 1) {
-        g_critical ("CreateConnection expected to return 1 handles, received %d",
-                    num_handles);
-        rc = TSS2_TCTI_RC_GENERAL_FAILURE;
+    ret = g_socket_receive_message (sock,
+                                    NULL,
+                                    &vector,
+                                    1,
+                                    &messages,
+                                    &num_messages,
+                                    NULL,
+                                    NULL,
+                                    &error);
+    for (i = 0; i < num_messages; ++i) {
+        if (fd_list == NULL && G_IS_UNIX_FD_MESSAGE (messages [i])) {
+            fd_list = g_object_ref (
+                g_unix_fd_message_get_fd_list (G_UNIX_FD_MESSAGE (messages [i])));
+        }
+        g_object_unref (messages [i]);
+    }
+    g_free (messages);
+    if (ret != (gssize)sizeof (reply)) {
         goto out;
     }
-    gint fd = g_unix_fd_list_get (fd_list, 0, &error);
-    if (fd == -1) {
-        g_critical ("unable to get receive handle from GUnixFDList: %s",
-                    error->message);
+    if (reply.rc != TSS2_RC_SUCCESS) {
+        g_warning ("daemon refused connection on %s: 0x%" PRIx32,
+                   path, reply.rc);
+        rc = reply.rc;
+        goto out;
+    }
+    rc = tcti_tabrmd_connect_fds (context, reply.id, reply.flags, fd_list);
+out:
+    if (error != NULL) {
+        g_warning ("Failed to create connection through %s: %s", path,
+                   error->message);
+        g_error_free (error);
+    }
+    g_clear_object (&fd_list);
+    g_clear_object (&sock);
+    return rc;
+}
+/*
+ * Thread function relaying between the TLS session and our end of the
+ * socket pair until one of them closes, see relay_iostreams.
+ */
+static gpointer
+tcti_tabrmd_tls_relay (gpointer user_data)
+{
+    GIOStream **streams = (GIOStream**)user_data;
+
+    relay_iostreams (streams [0], streams [1]);
+    g_object_unref (streams [0]);
+    g_object_unref (streams [1]);
+    g_free (streams);
+    return NULL;
+}
+/*
+ * Open a TLS session with the server at 'address' over TCP and check it
+ * against the CAs in 'ca_file', presenting the certificate and key in
+ * 'cert_file' and 'key_file' since the daemon wants to know who we are.
+ */
+static GIOStream*
+tcti_tabrmd_tls_open (const char *address,
+                      const char *cert_file,
+                      const char *key_file,
+                      const char *ca_file,
+                      GError    **error)
+{
+    GSocketClient *client;
+    GSocketConnection *connection;
+    GSocketConnectable *identity = NULL;
+    GTlsCertificate *certificate = NULL;
+    GTlsDatabase *database = NULL;
+    GIOStream *tls = NULL;
+
+    certificate = g_tls_certificate_new_from_files (cert_file,
+                                                    key_file,
+                                                    error);
+    if (certificate == NULL) {
+        return NULL;
+    }
+    database = g_tls_file_database_new (ca_file, error);
+    if (database == NULL) {
+        g_object_unref (certificate);
+        return NULL;
+    }
+    client = g_socket_client_new ();
+    connection = g_socket_client_connect_to_host (client,
+                                                  address,
+                                                  TABRMD_TCP_PORT_DEFAULT,
+                                                  NULL,
+                                                  error);
+    g_object_unref (client);
+    if (connection == NULL) {
+        goto out;
+    }
+    /* the relay writes whatever it has, don't hold commands back */
+    g_socket_set_option (g_socket_connection_get_socket (connection),
+                         IPPROTO_TCP,
+                         TCP_NODELAY,
+                         1,
+                         NULL);
+    identity = g_network_address_parse (address,
+                                        TABRMD_TCP_PORT_DEFAULT,
+                                        error);
+    if (identity != NULL) {
+        tls = g_tls_client_connection_new (G_IO_STREAM (connection),
+                                           identity,
+                                           error);
+    }
+    g_object_unref (connection);
+    if (tls == NULL) {
+        goto out;
+    }
+    g_tls_connection_set_certificate (G_TLS_CONNECTION (tls), certificate);
+    g_tls_connection_set_database (G_TLS_CONNECTION (tls), database);
+    if (!g_tls_connection_handshake (G_TLS_CONNECTION (tls), NULL, error)) {
+        g_clear_object (&tls);
+    }
+out:
+    g_clear_object (&identity);
+    g_object_unref (certificate);
+    g_object_unref (database);
+    return tls;
+}
+/*
+ * Establish a connection with a daemon on another host through its TCP
+ * frontend. Once the TLS session is up we send the same request as
+ * tcti_tabrmd_connect_unix, in network byte order, and the session
+ * carries the commands and responses from then on. A thread relays
+ * between the session and a socket pair so the rest of the TCTI doesn't
+ * need to know. Only stream framing over the socket is possible, and like
+ * the Unix socket there's no D-Bus proxy for Cancel and SetLocality.
+ */
+static TSS2_RC
+tcti_tabrmd_connect_tcp (TSS2_TCTI_CONTEXT   *context,
+                         const tabrmd_conf_t *tabrmd_conf)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    tabrmd_unix_request_t request = {
+        .magic = GUINT32_TO_BE (TABRMD_TCP_MAGIC),
+        .version = GUINT32_TO_BE (TABRMD_TCP_VERSION),
+        .priority = GUINT32_TO_BE (tabrmd_conf->priority),
+        .flags = GUINT32_TO_BE (tabrmd_conf->flags &
+                                ~(TABRMD_CONNECTION_FLAG_SEQPACKET |
+                                  TABRMD_CONNECTION_FLAG_SHM_RING)),
+    };
+    tabrmd_unix_reply_t reply = { 0 };
+    GIOStream *tls, **streams;
+    GSocket *sock;
+    GError *error = NULL;
+    gsize bytes = 0;
+    gint fds [2];
+    TSS2_RC rc = TSS2_TCTI_RC_NO_CONNECTION;
+
+    if (tabrmd_conf->tls_cert == NULL || tabrmd_conf->tls_key == NULL ||
+        tabrmd_conf->tls_ca == NULL)
+    {
+        g_warning ("the tcp key needs tls_cert, tls_key and tls_ca");
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    tls = tcti_tabrmd_tls_open (tabrmd_conf->tcp_address,
+                                tabrmd_conf->tls_cert,
+                                tabrmd_conf->tls_key,
+                                tabrmd_conf->tls_ca,
+                                &error);
+    if (tls == NULL ||
+        !g_output_stream_write_all (g_io_stream_get_output_stream (tls),
+                                    &request,
+                                    sizeof (request),
+                                    NULL,
+                                    NULL,
+                                    &error) ||
+        !g_input_stream_read_all (g_io_stream_get_input_stream (tls),
+                                  &reply,
+                                  sizeof (reply),
+                                  &bytes,
+                                  NULL,
+                                  &error) ||
+        bytes != sizeof (reply))
+    {
+        goto out;
+    }
+    if (GUINT32_FROM_BE (reply.rc) != TSS2_RC_SUCCESS) {
+        rc = GUINT32_FROM_BE (reply.rc);
+        g_warning ("daemon refused connection on %s: 0x%" PRIx32,
+                   tabrmd_conf->tcp_address, rc);
+        goto out;
+    }
+    if (create_socket_pair (&fds [0], &fds [1], SOCK_CLOEXEC) == -1) {
+        g_warning ("failed to create socket pair: %s", strerror (errno));
         rc = TSS2_TCTI_RC_GENERAL_FAILURE;
         goto out;
     }
-    sock = g_socket_new_from_fd (fd, NULL);
-    TSS2_TCTI_TABRMD_SOCK_CONNECT (context) = \
+    sock = g_socket_new_from_fd (fds [0], NULL);
+    TSS2_TCTI_TABRMD_SOCK_CONNECT (context) =
         g_socket_connection_factory_create_connection (sock);
-    TSS2_TCTI_TABRMD_ID (context) = id;
+    g_object_unref (sock);
+    sock = g_socket_new_from_fd (fds [1], NULL);
+    streams = g_new (GIOStream*, 2);
+    streams [0] = g_object_ref (tls);
+    streams [1] = G_IO_STREAM (g_socket_connection_factory_create_connection (sock));
+    g_object_unref (sock);
+    ctx->tls_relay = g_thread_new ("tabrmd-tls", tcti_tabrmd_tls_relay, streams);
+    TSS2_TCTI_TABRMD_ID (context) = GUINT64_FROM_BE (reply.id);
+    TSS2_TCTI_TABRMD_SEQPACKET (context) = FALSE;
+    rc = TSS2_RC_SUCCESS;
 out:
-    g_clear_error (&error);
-    g_clear_object (&sock);
-    g_clear_object (&fd_list);
+    if (error != NULL) {
+        g_warning ("Failed to create connection through %s: %s",
+                   tabrmd_conf->tcp_address, error->message);
+        g_error_free (error);
+    }
+    g_clear_object (&tls);
     return rc;
 }
 
@@ -582,16 +2111,53 @@ out:
  * The longest configuration string we'll take. Each dbus name can be 255
  * characters long (see dbus spec). The bus_types that we support are
  * 'system' or 'session' (255 + 7 = 262). 'bus_type=' and 'bus_name=' are
- * each another 9 characters for a total of 280.
+ * each another 9 characters for a total of 280. The longest priority class
+ * is 'interactive' which with 'priority=' and the separator adds another 21.
+ * 'framing=seqpacket' and its separator add another 18, 'transport=socket'
+ * and its separator another 17. A Unix socket path is at most 107
+ * characters, with 'socket=' and its separator that's another 115.
+ * 'reuse=yes' and its separator add 10 and 'prefork=yes' with its
+ * separator another 12. A host and port take up to 261 characters, with
+ * 'tcp=' and its separator 266. Allowing 255 for each of the TLS files,
+ * 'tls_cert=', 'tls_key=' and 'tls_ca=' with their separators make up the
+ * last 792.
+ */
+#define CONF_STRING_MAX 1531
+/*
+ * Parse the configuration string 'conf' into 'tabrmd_conf'. The strings
+ * in 'tabrmd_conf' point into '*conf_copy' which the caller must free,
+ * also on failure.
  */
-#define CONF_STRING_MAX 280
+static TSS2_RC
+tcti_tabrmd_conf_parse (const char    *conf,
+                        char         **conf_copy,
+                        tabrmd_conf_t *tabrmd_conf)
+{
+    size_t conf_len;
+
+    *conf_copy = NULL;
+    if (conf == NULL) {
+        return TSS2_RC_SUCCESS;
+    }
+    conf_len = strlen (conf);
+    if (conf_len > CONF_STRING_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    *conf_copy = g_strdup (conf);
+    if (*conf_copy == NULL) {
+        g_critical ("Failed to duplicate config string: %s", strerror (errno));
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    return parse_key_value_string (*conf_copy,
+                                   tabrmd_kv_callback,
+                                   tabrmd_conf);
+}
 TSS2_RC
 Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
                        size_t            *size,
                        const char        *conf)
 {
-    GError *error = NULL;
-    size_t conf_len;
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
     char *conf_copy = NULL;
     TSS2_RC rc;
     tabrmd_conf_t tabrmd_conf = TABRMD_CONF_INIT_DEFAULT;
@@ -603,49 +2169,849 @@ Tss2_Tcti_Tabrmd_Init (TSS2_TCTI_CONTEXT *context,
     if (size == NULL) {
         return TSS2_TCTI_RC_BAD_VALUE;
     }
-    if (conf != NULL) {
-        conf_len = strlen (conf);
-        if (conf_len > CONF_STRING_MAX) {
-            return TSS2_TCTI_RC_BAD_VALUE;
+    rc = tcti_tabrmd_conf_parse (conf, &conf_copy, &tabrmd_conf);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    /* Register dbus error mapping for tabrmd. Gets us RCs from Gerror codes */
+    TABRMD_ERROR;
+    init_tcti_data (context);
+    ctx->busy_poll_us = tabrmd_conf.busy_poll_us;
+    if (tabrmd_conf.tcp_address != NULL) {
+        rc = tcti_tabrmd_connect_tcp (context, &tabrmd_conf);
+        goto connected;
+    }
+    if (tabrmd_conf.socket_path != NULL) {
+        rc = tcti_tabrmd_connect_unix (context,
+                                       tabrmd_conf.socket_path,
+                                       tabrmd_conf.priority,
+                                       tabrmd_conf.flags);
+        goto connected;
+    }
+    ctx->bus_type = tabrmd_conf.bus_type;
+    ctx->bus_name = g_strdup (tabrmd_conf.bus_name);
+    if (tabrmd_conf.resume_id != 0) {
+        rc = tcti_tabrmd_pool_get_proxy (ctx);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = tcti_tabrmd_resume (context,
+                                     tabrmd_conf.resume_id,
+                                     tabrmd_conf.priority,
+                                     tabrmd_conf.flags);
         }
-        conf_copy = g_strdup (conf);
-        if (conf_copy == NULL) {
-            g_critical ("Failed to duplicate config string: %s", strerror (errno));
-            return TSS2_TCTI_RC_GENERAL_FAILURE;
+        goto connected;
+    }
+    if (tabrmd_conf.prefork && tcti_tabrmd_prefork_claim (ctx)) {
+        rc = TSS2_RC_SUCCESS;
+        goto connected;
+    }
+    if (tabrmd_conf.reuse) {
+        ctx->reuse = TRUE;
+        ctx->priority = tabrmd_conf.priority;
+        ctx->flags = tabrmd_conf.flags;
+        rc = tcti_tabrmd_pool_take (ctx);
+        if (rc == TSS2_RC_SUCCESS && ctx->sock_connect == NULL) {
+            rc = tcti_tabrmd_connect (context,
+                                      tabrmd_conf.priority,
+                                      tabrmd_conf.flags);
         }
-        rc = parse_key_value_string (conf_copy,
-                                     tabrmd_kv_callback,
-                                     &tabrmd_conf);
+        goto connected;
+    }
+    rc = tcti_tabrmd_pool_get_proxy (ctx);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto connected;
+    }
+    rc = tcti_tabrmd_connect (context,
+                              tabrmd_conf.priority,
+                              tabrmd_conf.flags);
+connected:
+    if (rc == TSS2_RC_SUCCESS) {
+        g_debug ("initialized tabrmd TCTI context with id: 0x%" PRIx64,
+                 TSS2_TCTI_TABRMD_ID (context));
+    } else {
+        g_clear_pointer (&ctx->bus_name, g_free);
+    }
+out:
+    g_clear_pointer (&conf_copy, g_free);
+
+    return rc;
+}
+
+/*
+ * Create 'count' connections with one CreateConnections call. On success
+ * '*fd_list' holds a client fd for each id in the array '*ids' and
+ * '*granted' the connection flags the daemon granted, the caller owns
+ * both.
+ */
+static TSS2_RC
+tcti_tabrmd_create_connections (TctiTabrmd   *proxy,
+                                gsize         count,
+                                guint32       priority,
+                                guint32       flags,
+                                GUnixFDList **fd_list,
+                                GVariant    **ids,
+                                guint32      *granted)
+{
+    GVariant *ret;
+    GError *error = NULL;
+    gsize num_ids;
+
+    ret = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (proxy),
+        TABRMD_DBUS_METHOD_CREATE_CONNECTIONS,
+        g_variant_new ("(uuu)", (guint32)count, priority, flags),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        fd_list,
+        NULL,
+        &error);
+    if (ret == NULL) {
+        g_warning ("Failed to create connections with service: %s",
+                   error->message);
+        if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+            g_error_free (error);
+            return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+        }
+        g_error_free (error);
+        return TSS2_TCTI_RC_NO_CONNECTION;
+    }
+    g_variant_get (ret, "(@atu)", ids, granted);
+    g_variant_unref (ret);
+    num_ids = g_variant_n_children (*ids);
+    if (*fd_list == NULL ||
+        g_unix_fd_list_get_length (*fd_list) != (gint)num_ids)
+    {
+        g_critical ("CreateConnections returned %zu ids but not as many "
+                    "handles", num_ids);
+        g_clear_pointer (ids, g_variant_unref);
+        g_clear_object (fd_list);
+        return TSS2_TCTI_RC_GENERAL_FAILURE;
+    }
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Create 'count' connections with one CreateConnections call and keep
+ * them in the pool for contexts initialized with the same 'conf', which
+ * must include 'reuse=yes'. A process with a pool of worker threads can
+ * do this once at startup so that every worker initializing its context
+ * takes a connection from the pool instead of making its own round trip
+ * to the daemon.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_Preopen (const char *conf,
+                          size_t      count)
+{
+    TSS2_TCTI_TABRMD_CONTEXT ctx;
+    tcti_tabrmd_idle_entry_t *entry;
+    tabrmd_conf_t tabrmd_conf = TABRMD_CONF_INIT_DEFAULT;
+    GUnixFDList *fd_list = NULL;
+    GVariant *ids = NULL;
+    GSocket *sock;
+    char *conf_copy = NULL;
+    guint32 granted;
+    gsize i, num_ids;
+    gint fd;
+    TSS2_RC rc;
+
+    if (count == 0 || count > TABRMD_CREATE_CONNECTIONS_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    /* only the proxy and bus parameters of this context are used */
+    init_tcti_data ((TSS2_TCTI_CONTEXT*)&ctx);
+    rc = tcti_tabrmd_conf_parse (conf, &conf_copy, &tabrmd_conf);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    if (!tabrmd_conf.reuse || tabrmd_conf.socket_path != NULL ||
+        tabrmd_conf.tcp_address != NULL)
+    {
+        rc = TSS2_TCTI_RC_BAD_VALUE;
+        goto out;
+    }
+    TABRMD_ERROR;
+    ctx.bus_type = tabrmd_conf.bus_type;
+    ctx.bus_name = g_strdup (tabrmd_conf.bus_name);
+    rc = tcti_tabrmd_pool_get_proxy (&ctx);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    rc = tcti_tabrmd_create_connections (ctx.proxy,
+                                         count,
+                                         tabrmd_conf.priority,
+                                         tabrmd_conf.flags,
+                                         &fd_list,
+                                         &ids,
+                                         &granted);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    num_ids = g_variant_n_children (ids);
+    g_mutex_lock (&pool_mutex);
+    tcti_tabrmd_pool_check_pid ();
+    for (i = 0; i < num_ids; ++i) {
+        fd = g_unix_fd_list_get (fd_list, i, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        sock = g_socket_new_from_fd (fd, NULL);
+        entry = g_new0 (tcti_tabrmd_idle_entry_t, 1);
+        entry->bus_type = tabrmd_conf.bus_type;
+        entry->bus_name = g_strdup (tabrmd_conf.bus_name);
+        entry->priority = tabrmd_conf.priority;
+        entry->flags = tabrmd_conf.flags;
+        g_variant_get_child (ids, i, "t", &entry->id);
+        entry->seqpacket = (granted & TABRMD_CONNECTION_FLAG_SEQPACKET) != 0;
+        entry->fresh = TRUE;
+        entry->sock_connect = g_socket_connection_factory_create_connection (sock);
+        g_object_unref (sock);
+        pool_idle = g_slist_prepend (pool_idle, entry);
+    }
+    g_mutex_unlock (&pool_mutex);
+    g_debug ("%s: preopened %zu connections", __func__, num_ids);
+out:
+    g_clear_object (&ctx.proxy);
+    g_clear_pointer (&ctx.bus_name, g_free);
+    g_clear_pointer (&ids, g_variant_unref);
+    g_clear_object (&fd_list);
+    g_clear_pointer (&conf_copy, g_free);
+    return rc;
+}
+/*
+ * Create 'count' connections for the children of a prefork server. The
+ * parent calls this before it forks its workers, each child then
+ * initializes its context with 'prefork=yes' and takes one of these
+ * connections without a round trip to the bus or the daemon. Connections
+ * are created TABRMD_CREATE_CONNECTIONS_MAX at a time, without the shared
+ * memory transport. A process has one set of preforked connections at a
+ * time, Tss2_Tcti_Tabrmd_PreforkDone releases it.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_Prefork (const char *conf,
+                          size_t      count)
+{
+    TSS2_TCTI_TABRMD_CONTEXT ctx;
+    tabrmd_conf_t tabrmd_conf = TABRMD_CONF_INIT_DEFAULT;
+    tcti_tabrmd_prefork_t *set = NULL;
+    tcti_tabrmd_prefork_slot_t *slot;
+    GUnixFDList *fd_list = NULL;
+    GVariant *ids = NULL;
+    char *conf_copy = NULL;
+    guint32 flags, granted;
+    gsize i, batch, num_ids, size;
+    gboolean busy;
+    gint fd;
+    TSS2_RC rc;
+
+    if (count == 0 || count > TABRMD_PREFORK_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    /* only the proxy and bus parameters of this context are used */
+    init_tcti_data ((TSS2_TCTI_CONTEXT*)&ctx);
+    rc = tcti_tabrmd_conf_parse (conf, &conf_copy, &tabrmd_conf);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    if (tabrmd_conf.socket_path != NULL || tabrmd_conf.tcp_address != NULL) {
+        rc = TSS2_TCTI_RC_BAD_VALUE;
+        goto out;
+    }
+    g_mutex_lock (&pool_mutex);
+    busy = prefork_set != NULL;
+    g_mutex_unlock (&pool_mutex);
+    if (busy) {
+        rc = TSS2_TCTI_RC_BAD_SEQUENCE;
+        goto out;
+    }
+    TABRMD_ERROR;
+    ctx.bus_type = tabrmd_conf.bus_type;
+    ctx.bus_name = g_strdup (tabrmd_conf.bus_name);
+    rc = tcti_tabrmd_pool_get_proxy (&ctx);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    size = sizeof (tcti_tabrmd_prefork_t) +
+        count * sizeof (tcti_tabrmd_prefork_slot_t);
+    set = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (set == MAP_FAILED) {
+        g_warning ("%s: failed to map prefork set: %s", __func__,
+                   strerror (errno));
+        set = NULL;
+        rc = TSS2_TCTI_RC_MEMORY;
+        goto out;
+    }
+    set->size = size;
+    flags = tabrmd_conf.flags & ~TABRMD_CONNECTION_FLAG_SHM_RING;
+    while (set->count < count) {
+        batch = MIN (count - set->count, TABRMD_CREATE_CONNECTIONS_MAX);
+        rc = tcti_tabrmd_create_connections (ctx.proxy,
+                                             batch,
+                                             tabrmd_conf.priority,
+                                             flags,
+                                             &fd_list,
+                                             &ids,
+                                             &granted);
         if (rc != TSS2_RC_SUCCESS) {
             goto out;
         }
+        num_ids = g_variant_n_children (ids);
+        for (i = 0; i < num_ids && set->count < count; ++i) {
+            fd = g_unix_fd_list_get (fd_list, i, NULL);
+            if (fd == -1) {
+                continue;
+            }
+            slot = &set->slots [set->count++];
+            slot->fd = fd;
+            g_variant_get_child (ids, i, "t", &slot->id);
+            slot->seqpacket = (granted & TABRMD_CONNECTION_FLAG_SEQPACKET) != 0;
+        }
+        g_clear_pointer (&ids, g_variant_unref);
+        g_clear_object (&fd_list);
+        /* the daemon hit its connection limit */
+        if (num_ids < batch) {
+            break;
+        }
     }
-    /* Register dbus error mapping for tabrmd. Gets us RCs from Gerror codes */
-    TABRMD_ERROR;
-    init_tcti_data (context);
-    TSS2_TCTI_TABRMD_PROXY (context) =
-        tcti_tabrmd_proxy_new_for_bus_sync (tabrmd_conf.bus_type,
-                                            G_DBUS_PROXY_FLAGS_NONE,
-                                            tabrmd_conf.bus_name,
-                                            TABRMD_DBUS_PATH,
-                                            NULL,
-                                            &error);
-    if (TSS2_TCTI_TABRMD_PROXY (context) == NULL) {
-        g_critical ("failed to allocate dbus proxy object: %s", error->message);
+    if (set->count == 0) {
         rc = TSS2_TCTI_RC_NO_CONNECTION;
         goto out;
     }
-    rc = tcti_tabrmd_connect (context);
-    if (rc == TSS2_RC_SUCCESS) {
-        g_debug ("initialized tabrmd TCTI context with id: 0x%" PRIx64,
-                 TSS2_TCTI_TABRMD_ID (context));
+    g_debug ("%s: preforked %zu of %zu connections", __func__, set->count,
+             count);
+    g_mutex_lock (&pool_mutex);
+    if (prefork_set == NULL) {
+        prefork_set = set;
+        set = NULL;
+    } else {
+        rc = TSS2_TCTI_RC_BAD_SEQUENCE;
     }
+    g_mutex_unlock (&pool_mutex);
 out:
+    if (set != NULL) {
+        tcti_tabrmd_prefork_free (set, G_MAXSIZE);
+    }
+    g_clear_object (&ctx.proxy);
+    g_clear_pointer (&ctx.bus_name, g_free);
     g_clear_pointer (&conf_copy, g_free);
-    g_clear_error (&error);
+    return rc;
+}
+/*
+ * Close this process's copies of the connections made by
+ * Tss2_Tcti_Tabrmd_Prefork. The parent calls this once it has forked its
+ * workers: the daemon only notices a worker going away once no process
+ * holds its connection open anymore.
+ */
+void
+Tss2_Tcti_Tabrmd_PreforkDone (void)
+{
+    tcti_tabrmd_prefork_t *set;
+
+    g_mutex_lock (&pool_mutex);
+    set = prefork_set;
+    prefork_set = NULL;
+    g_mutex_unlock (&pool_mutex);
+    if (set != NULL) {
+        tcti_tabrmd_prefork_free (set, G_MAXSIZE);
+    }
+}
+
+/*
+ * Get the id a new process passes with the 'resume' conf key to take over
+ * the objects and sessions of this connection once it's closed, if the
+ * daemon keeps them (its --resume-ms option). Only connections made
+ * through D-Bus can be resumed.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_GetResumeId (TSS2_TCTI_CONTEXT *context,
+                              uint64_t          *resume_id)
+{
+    if (context == NULL || resume_id == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    /* the daemon knows the connection by the id mixed with our PID */
+    *resume_id = TSS2_TCTI_TABRMD_ID (context) ^ (guint64)getpid ();
+    return TSS2_RC_SUCCESS;
+}
 
+/*
+ * Opt in to transmitting up to 'depth' commands before receiving their
+ * responses. The responses are received in the order the commands were
+ * transmitted. A depth of 1 is the strict transmit / receive sequence the
+ * TCTI spec prescribes and is the default. The depth can only be changed
+ * while no command is in flight.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_SetPipelineDepth (TSS2_TCTI_CONTEXT *context,
+                                   size_t             depth)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (depth == 0 || depth > TABRMD_PIPELINE_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (TSS2_TCTI_TABRMD_STATE (context) != TABRMD_STATE_TRANSMIT) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    g_debug ("%s: id 0x%" PRIx64 " pipeline depth %zu", __func__,
+             TSS2_TCTI_TABRMD_ID (context), depth);
+    TSS2_TCTI_TABRMD_PIPELINE_DEPTH (context) = depth;
+    return TSS2_RC_SUCCESS;
+}
+
+/*
+ * Have responses delivered to 'callback' by Tss2_Tcti_Tabrmd_Dispatch
+ * instead of being received with the TCTI receive function, which returns
+ * TSS2_TCTI_RC_BAD_SEQUENCE while a callback is set. Meant for clients
+ * running an event loop: they watch the handle from get_poll_handles and
+ * call Tss2_Tcti_Tabrmd_Dispatch when it's readable. A NULL 'callback'
+ * goes back to the receive function, which is only possible while no
+ * partial response is buffered.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_SetResponseCallback (TSS2_TCTI_CONTEXT            *context,
+                                      TSS2_TCTI_TABRMD_RESPONSE_CB  callback,
+                                      void                         *user_data)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    /* a response is half way through the receive function or the buffer */
+    if (ctx->index != 0 || ctx->async_fill != 0) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (callback != NULL && ctx->async_buf == NULL) {
+        ctx->async_buf = g_malloc (TABRMD_ASYNC_BUF_SIZE);
+    }
+    ctx->async_cb = callback;
+    ctx->async_data = user_data;
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Read the responses available on the connection of 'context' without
+ * blocking and call the response callback for each complete one. Partial
+ * responses are kept until the rest arrives with a later call. Returns
+ * TSS2_RC_SUCCESS once there's nothing more to read, or the error that
+ * stopped the dispatch.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_Dispatch (TSS2_TCTI_CONTEXT *context)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (ctx->async_cb == NULL || ctx->state == TABRMD_STATE_FINAL) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (ctx->shm != NULL) {
+        return tcti_tabrmd_dispatch_shm (ctx);
+    }
+    return tcti_tabrmd_dispatch_socket (ctx);
+}
+/*
+ * Send the vendor command 'command_code' handled by the daemon with its
+ * UINT32 'param' and wait for the response, which has no parameters. It
+ * can only be sent while no command is in flight and without a response
+ * callback. Returns the response code of the command.
+ */
+static TSS2_RC
+tabrmd_vendor_command (TSS2_TCTI_CONTEXT *context,
+                       UINT32             command_code,
+                       UINT32             param)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    uint8_t command [TPM_HEADER_SIZE + sizeof (UINT32)];
+    uint8_t response [TPM_HEADER_SIZE];
+    size_t size = sizeof (response);
+    UINT32 param_be;
+    TSS2_RC rc;
+
+    if (ctx->state != TABRMD_STATE_TRANSMIT || ctx->async_cb != NULL) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    rc = tpm2_header_init (command,
+                           sizeof (command),
+                           TPM2_ST_NO_SESSIONS,
+                           sizeof (command),
+                           command_code);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    param_be = htobe32 (param);
+    memcpy (&command [TPM_HEADER_SIZE], &param_be, sizeof (param_be));
+    rc = tss2_tcti_tabrmd_transmit (context, sizeof (command), command);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = tss2_tcti_tabrmd_receive (context,
+                                   &size,
+                                   response,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return get_response_code (response);
+}
+/*
+ * Have the next 'count' commands transmitted on 'context' run as a group:
+ * the daemon doesn't run commands from other connections until they're
+ * done, so a chain like StartAuthSession, PolicyPCR, Unseal and
+ * FlushContext or a loop of signings only has the contexts of the
+ * connection swapped in once. The commands may be pipelined. The group
+ * ends early if the next command takes longer than TABRMD_GROUP_WAIT_MS
+ * to arrive. This sends the TSS2_TABRMD_CC_GROUP command and waits for
+ * its response so it can only be called while no command is in flight and
+ * without a response callback.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_BeginGroup (TSS2_TCTI_CONTEXT *context,
+                             size_t             count)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (count == 0 || count > TABRMD_GROUP_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    g_debug ("%s: id 0x%" PRIx64 " grouping %zu commands", __func__,
+             TSS2_TCTI_TABRMD_ID (context), count);
+    return tabrmd_vendor_command (context,
+                                  TSS2_TABRMD_CC_GROUP,
+                                  (UINT32)count);
+}
+/*
+ * Lease the TPM for 'lease_ms' milliseconds: until the lease runs out the
+ * daemon runs only the commands sent on 'context', the objects and
+ * sessions of the connection stay loaded however long the client takes
+ * between commands. The daemon cuts the lease to its --max-lease-ms and
+ * refuses it with TPM2_RC_DISABLED if leases are off. Asking again while
+ * the lease is held extends it up to that limit, a 'lease_ms' of 0 gives
+ * it back and the lease ends when the connection is closed. Like
+ * Tss2_Tcti_Tabrmd_BeginGroup this waits for the daemon's response.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_Lease (TSS2_TCTI_CONTEXT *context,
+                        uint32_t           lease_ms)
+{
+    if (context == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    g_debug ("%s: id 0x%" PRIx64 " leasing the TPM for %" PRIu32 "ms",
+             __func__, TSS2_TCTI_TABRMD_ID (context), lease_ms);
+    return tabrmd_vendor_command (context, TSS2_TABRMD_CC_LEASE, lease_ms);
+}
+/*
+ * Hash 'size' bytes of 'data' on the TPM in one round trip: the daemon
+ * runs the HashSequenceStart, SequenceUpdate and SequenceComplete commands
+ * back to back. The results are those of TPM2_Hash, 'validation' is the
+ * ticket for 'hierarchy'. Up to TSS2_TABRMD_HASH_MAX bytes can be hashed
+ * at once. Like Tss2_Tcti_Tabrmd_BeginGroup this waits for the daemon's
+ * response. Returns the response code of the command.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_Hash (TSS2_TCTI_CONTEXT *context,
+                       TPMI_ALG_HASH      hash_alg,
+                       TPMI_RH_HIERARCHY  hierarchy,
+                       const uint8_t     *data,
+                       size_t             size,
+                       TPM2B_DIGEST      *digest,
+                       TPMT_TK_HASHCHECK *validation)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    uint8_t response [TPM_HEADER_SIZE + sizeof (TPM2B_DIGEST) +
+                      sizeof (TPMT_TK_HASHCHECK)];
+    uint8_t *command;
+    size_t command_size, offset = TPM_HEADER_SIZE;
+    size_t response_size = sizeof (response);
+    TSS2_RC rc;
+
+    if (context == NULL || digest == NULL || validation == NULL ||
+        (data == NULL && size > 0))
+    {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (size > TSS2_TABRMD_HASH_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (ctx->state != TABRMD_STATE_TRANSMIT || ctx->async_cb != NULL) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    command_size = TPM_HEADER_SIZE + sizeof (hash_alg) + sizeof (hierarchy) +
+        sizeof (UINT32) + size;
+    command = g_malloc (command_size);
+    rc = tpm2_header_init (command,
+                           command_size,
+                           TPM2_ST_NO_SESSIONS,
+                           command_size,
+                           TSS2_TABRMD_CC_HASH);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Marshal (hash_alg, command, command_size, &offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Marshal (hierarchy, command, command_size, &offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Marshal ((UINT32)size,
+                                     command,
+                                     command_size,
+                                     &offset);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (command);
+        return rc;
+    }
+    if (size > 0) {
+        memcpy (&command [offset], data, size);
+    }
+    g_debug ("%s: id 0x%" PRIx64 " hashing %zu bytes", __func__,
+             TSS2_TCTI_TABRMD_ID (context), size);
+    rc = tss2_tcti_tabrmd_transmit (context, command_size, command);
+    g_free (command);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = tss2_tcti_tabrmd_receive (context,
+                                   &response_size,
+                                   response,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = get_response_code (response);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    offset = TPM_HEADER_SIZE;
+    rc = Tss2_MU_TPM2B_DIGEST_Unmarshal (response,
+                                         response_size,
+                                         &offset,
+                                         digest);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPMT_TK_HASHCHECK_Unmarshal (response,
+                                                  response_size,
+                                                  &offset,
+                                                  validation);
+    }
+    return rc;
+}
+/*
+ * Send the TSS2_TABRMD_CC_NV_READ or TSS2_TABRMD_CC_NV_WRITE command
+ * 'command_code' for 'size' bytes at 'offset' of 'nv_index', with the
+ * 'size' bytes of 'data' after them for a write, and wait for the
+ * response in 'response'. Returns the response code of the command.
+ */
+static TSS2_RC
+tabrmd_nv_command (TSS2_TCTI_CONTEXT *context,
+                   UINT32             command_code,
+                   TPMI_RH_NV_AUTH    auth_handle,
+                   TPMI_RH_NV_INDEX   nv_index,
+                   const TPM2B_AUTH  *auth,
+                   uint16_t           offset,
+                   const uint8_t     *data,
+                   size_t             size,
+                   uint8_t           *response,
+                   size_t            *response_size)
+{
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)context;
+    TPM2B_AUTH empty = { 0, };
+    uint8_t *command;
+    size_t command_size, command_offset = TPM_HEADER_SIZE;
+    TSS2_RC rc;
+
+    if (TSS2_TCTI_MAGIC (context) != TSS2_TCTI_TABRMD_MAGIC ||
+        TSS2_TCTI_VERSION (context) != TSS2_TCTI_TABRMD_VERSION) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+    if (size > TSS2_TABRMD_NV_MAX) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+    if (ctx->state != TABRMD_STATE_TRANSMIT || ctx->async_cb != NULL) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+    if (auth == NULL) {
+        auth = &empty;
+    }
+    command_size = TPM_HEADER_SIZE + sizeof (auth_handle) +
+        sizeof (nv_index) + sizeof (auth->size) + auth->size +
+        2 * sizeof (UINT16) + (data != NULL ? size : 0);
+    command = g_malloc (command_size);
+    rc = tpm2_header_init (command,
+                           command_size,
+                           TPM2_ST_NO_SESSIONS,
+                           command_size,
+                           command_code);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Marshal (auth_handle,
+                                     command,
+                                     command_size,
+                                     &command_offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT32_Marshal (nv_index,
+                                     command,
+                                     command_size,
+                                     &command_offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPM2B_AUTH_Marshal (auth,
+                                         command,
+                                         command_size,
+                                         &command_offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Marshal (offset,
+                                     command,
+                                     command_size,
+                                     &command_offset);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Marshal ((UINT16)size,
+                                     command,
+                                     command_size,
+                                     &command_offset);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_free (command);
+        return rc;
+    }
+    if (data != NULL && size > 0) {
+        memcpy (&command [command_offset], data, size);
+    }
+    g_debug ("%s: id 0x%" PRIx64 " %s %zu bytes of NV index 0x%" PRIx32,
+             __func__, TSS2_TCTI_TABRMD_ID (context),
+             data != NULL ? "writing" : "reading", size, nv_index);
+    rc = tss2_tcti_tabrmd_transmit (context, command_size, command);
+    g_free (command);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = tss2_tcti_tabrmd_receive (context,
+                                   response_size,
+                                   response,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return get_response_code (response);
+}
+/*
+ * Read 'size' bytes at 'offset' of NV index 'nv_index' into 'data',
+ * authorized by 'auth_handle' with the password 'auth' (NULL for none).
+ * The daemon splits the read into TPM2_PT_NV_BUFFER_MAX sized NV_Read
+ * commands run back to back, so up to TSS2_TABRMD_NV_MAX bytes take one
+ * round trip. Like Tss2_Tcti_Tabrmd_Hash this waits for the response.
+ * Returns the response code of the command.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_NvRead (TSS2_TCTI_CONTEXT *context,
+                         TPMI_RH_NV_AUTH    auth_handle,
+                         TPMI_RH_NV_INDEX   nv_index,
+                         const TPM2B_AUTH  *auth,
+                         uint16_t           offset,
+                         uint8_t           *data,
+                         size_t             size)
+{
+    uint8_t *response;
+    size_t response_size = TPM_HEADER_SIZE + sizeof (UINT16) + size;
+    size_t response_offset = TPM_HEADER_SIZE;
+    UINT16 read_size = 0;
+    TSS2_RC rc;
+
+    if (context == NULL || (data == NULL && size > 0)) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    response = g_malloc (response_size);
+    rc = tabrmd_nv_command (context,
+                            TSS2_TABRMD_CC_NV_READ,
+                            auth_handle,
+                            nv_index,
+                            auth,
+                            offset,
+                            NULL,
+                            size,
+                            response,
+                            &response_size);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_UINT16_Unmarshal (response,
+                                       response_size,
+                                       &response_offset,
+                                       &read_size);
+    }
+    if (rc == TSS2_RC_SUCCESS &&
+        (read_size != size || response_size - response_offset != size))
+    {
+        rc = TSS2_TCTI_RC_MALFORMED_RESPONSE;
+    }
+    if (rc == TSS2_RC_SUCCESS && size > 0) {
+        memcpy (data, &response [response_offset], size);
+    }
+    g_free (response);
     return rc;
 }
+/*
+ * Write the 'size' bytes of 'data' at 'offset' of NV index 'nv_index',
+ * authorized by 'auth_handle' with the password 'auth' (NULL for none).
+ * The daemon splits the write into TPM2_PT_NV_BUFFER_MAX sized NV_Write
+ * commands run back to back. A write failing half way leaves the chunks
+ * before it written. Returns the response code of the command.
+ */
+TSS2_RC
+Tss2_Tcti_Tabrmd_NvWrite (TSS2_TCTI_CONTEXT *context,
+                          TPMI_RH_NV_AUTH    auth_handle,
+                          TPMI_RH_NV_INDEX   nv_index,
+                          const TPM2B_AUTH  *auth,
+                          uint16_t           offset,
+                          const uint8_t     *data,
+                          size_t             size)
+{
+    uint8_t response [TPM_HEADER_SIZE];
+    size_t response_size = sizeof (response);
+
+    if (context == NULL || data == NULL) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+    return tabrmd_nv_command (context,
+                              TSS2_TABRMD_CC_NV_WRITE,
+                              auth_handle,
+                              nv_index,
+                              auth,
+                              offset,
+                              data,
+                              size,
+                              response,
+                              &response_size);
+}
 
 /* public info structure */
 static const TSS2_TCTI_INFO tss2_tcti_info = {
@@ -655,7 +3021,10 @@ static const TSS2_TCTI_INFO tss2_tcti_info = {
     .config_help = "This conf string is a series of key / value pairs " \
         "where keys and values are separated by the '=' character and " \
         "each pair is separated by the ',' character. Valid keys are " \
-        "\"bus_name\" and \"bus_type\".",
+        "\"bus_name\", \"bus_type\", \"socket\", \"tcp\", " \
+        "\"tls_cert\", \"tls_key\", \"tls_ca\", \"priority\", " \
+        "\"framing\", \"transport\", \"busy_poll\", \"reuse\" and " \
+        "\"prefork\".",
     .init = Tss2_Tcti_Tabrmd_Init,
 };
 
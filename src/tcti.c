@@ -8,6 +8,8 @@
 #include <tss2/tss2_tctildr.h>
 
 #include "tcti.h"
+#include "tcti-libtpms.h"
+#include "tcti-null.h"
 #include "util.h"
 
 G_DEFINE_TYPE (Tcti, tcti, G_TYPE_OBJECT);
@@ -65,7 +67,11 @@ tcti_dispose (GObject *object)
 {
     Tcti *self = TCTI (object);
 
-    if (self->tcti_context) {
+    if (tcti_null_is_context (self->tcti_context)) {
+        tcti_null_free (&self->tcti_context);
+    } else if (tcti_libtpms_is_context (self->tcti_context)) {
+        tcti_libtpms_free (&self->tcti_context);
+    } else if (self->tcti_context) {
         Tss2_TctiLdr_Finalize (&self->tcti_context);
     }
     G_OBJECT_CLASS (tcti_parent_class)->dispose (object);
@@ -73,6 +79,9 @@ tcti_dispose (GObject *object)
 static void
 tcti_finalize (GObject *object)
 {
+    Tcti *self = TCTI (object);
+
+    g_free (self->conf);
     G_OBJECT_CLASS (tcti_parent_class)->finalize (object);
 }
 
@@ -109,12 +118,80 @@ tcti_new (TSS2_TCTI_CONTEXT *tcti_context)
                                "tcti-context", tcti_context,
                                NULL));
 }
+/*
+ * Load a TSS2_TCTI_CONTEXT with 'conf' through the TCTI loader, the Tcti
+ * wrapping it can be reset. Returns NULL if the TCTI can't be loaded.
+ */
+Tcti*
+tcti_new_from_conf (const gchar *conf)
+{
+    TSS2_TCTI_CONTEXT *tcti_context = NULL;
+    Tcti *tcti;
+    TSS2_RC rc;
+
+    rc = Tss2_TctiLdr_Initialize (conf, &tcti_context);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_TctiLdr_Initialize", rc);
+        return NULL;
+    }
+    tcti = tcti_new (tcti_context);
+    tcti_set_conf (tcti, conf);
+    return tcti;
+}
 
 TSS2_TCTI_CONTEXT*
 tcti_peek_context (Tcti *self)
 {
     return self->tcti_context;
 }
+/*
+ * Remember that the TSS2_TCTI_CONTEXT came from the TCTI loader with
+ * 'conf', NULL for the default, so that tcti_reset can load it again.
+ */
+void
+tcti_set_conf (Tcti        *self,
+               const gchar *conf)
+{
+    g_free (self->conf);
+    self->conf = g_strdup (conf);
+    self->resettable = TRUE;
+}
+/*
+ * Replace the TSS2_TCTI_CONTEXT with a new one from the same conf, to get
+ * the TCTI out of whatever state a TPM that stopped answering left it in.
+ * The new context is loaded while the old one is still open, if that fails
+ * the old one is closed first for TCTIs that only allow one user of the
+ * device. If that fails too there's no context left and every call fails
+ * until a later reset succeeds. A TCTI we didn't load can't be reset.
+ * Nothing else may use the TCTI meanwhile, that includes tcti_cancel:
+ * Tpm2 serializes the two with its cancel_mutex.
+ */
+TSS2_RC
+tcti_reset (Tcti *self)
+{
+    TSS2_TCTI_CONTEXT *tcti_context = NULL;
+    TSS2_RC rc;
+
+    if (!self->resettable) {
+        return TSS2_TCTI_RC_NOT_IMPLEMENTED;
+    }
+    rc = Tss2_TctiLdr_Initialize (self->conf, &tcti_context);
+    if (rc == TSS2_RC_SUCCESS && self->tcti_context != NULL) {
+        Tss2_TctiLdr_Finalize (&self->tcti_context);
+    } else if (rc != TSS2_RC_SUCCESS) {
+        if (self->tcti_context != NULL) {
+            Tss2_TctiLdr_Finalize (&self->tcti_context);
+        }
+        rc = Tss2_TctiLdr_Initialize (self->conf, &tcti_context);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_TctiLdr_Initialize", rc);
+        self->tcti_context = NULL;
+        return rc;
+    }
+    self->tcti_context = tcti_context;
+    return TSS2_RC_SUCCESS;
+}
 /**
  * The rest of these functions are just wrappers around the macros provided
  * by the TSS for calling the TCTI functions. There's no implementation for
@@ -148,9 +225,41 @@ tcti_receive (Tcti      *self,
                             size,
                             response,
                             timeout);
-    if (rc != TSS2_RC_SUCCESS) {
+    /* with a timeout this only means no response yet */
+    if (rc != TSS2_RC_SUCCESS && rc != TSS2_TCTI_RC_TRY_AGAIN) {
         RC_WARN ("Tss2_Tcti_Receive", rc);
     }
 
     return rc;
 }
+TSS2_RC
+tcti_set_locality (Tcti    *self,
+                   uint8_t  locality)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_SetLocality (self->tcti_context, locality);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Tcti_SetLocality", rc);
+    }
+
+    return rc;
+}
+/*
+ * Ask the TCTI to cancel the command currently being executed by the TPM.
+ * Unlike the other functions this one is expected to be called while
+ * another thread is waiting in tcti_receive, but never while another
+ * thread is in tcti_reset.
+ */
+TSS2_RC
+tcti_cancel (Tcti *self)
+{
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Cancel (self->tcti_context);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Tcti_Cancel", rc);
+    }
+
+    return rc;
+}
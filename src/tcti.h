@@ -21,6 +21,9 @@ struct _TctiClass {
 struct _Tcti {
     GObject             parent;
     TSS2_TCTI_CONTEXT  *tcti_context;
+    /* the conf the context was loaded with, only set if it can be reset */
+    gchar              *conf;
+    gboolean            resettable;
 };
 
 #define TYPE_TCTI             (tcti_get_type ())
@@ -32,6 +35,7 @@ struct _Tcti {
 
 GType               tcti_get_type        (void);
 Tcti*               tcti_new             (TSS2_TCTI_CONTEXT *ctx);
+Tcti*               tcti_new_from_conf   (const gchar     *conf);
 TSS2_RC             tcti_transmit        (Tcti            *self,
                                           size_t           size,
                                           uint8_t         *command);
@@ -43,6 +47,9 @@ TSS2_RC             tcti_cancel          (Tcti            *self);
 TSS2_RC             tcti_set_locality    (Tcti            *self,
                                           uint8_t          locality);
 TSS2_TCTI_CONTEXT*  tcti_peek_context    (Tcti            *self);
+void                tcti_set_conf        (Tcti            *self,
+                                          const gchar     *conf);
+TSS2_RC             tcti_reset           (Tcti            *self);
 
 G_END_DECLS
 #endif /* TCTI_H */
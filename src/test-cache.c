@@ -0,0 +1,297 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <string.h>
+
+#include "test-cache.h"
+#include "tpm2-header.h"
+
+G_DEFINE_TYPE (TestCache, test_cache, G_TYPE_OBJECT);
+
+enum {
+    PROP_0,
+    PROP_MAX_ENTRIES,
+    N_PROPERTIES
+};
+static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
+
+/*
+ * GObject property getter.
+ */
+static void
+test_cache_get_property (GObject    *object,
+                         guint       property_id,
+                         GValue     *value,
+                         GParamSpec *pspec)
+{
+    TestCache *self = TEST_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        g_value_set_uint (value, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+/*
+ * GObject property setter.
+ */
+static void
+test_cache_set_property (GObject        *object,
+                         guint           property_id,
+                         GValue const   *value,
+                         GParamSpec     *pspec)
+{
+    TestCache *self = TEST_CACHE (object);
+
+    switch (property_id) {
+    case PROP_MAX_ENTRIES:
+        self->max_entries = g_value_get_uint (value);
+        g_debug ("%s: max-entries: %u", __func__, self->max_entries);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+        break;
+    }
+}
+static void
+test_cache_init (TestCache *self)
+{
+    self->table = g_hash_table_new_full (g_bytes_hash,
+                                         g_bytes_equal,
+                                         (GDestroyNotify)g_bytes_unref,
+                                         (GDestroyNotify)g_bytes_unref);
+}
+/*
+ * GObject finalize function: release the GHashTable and with it all of
+ * the cached responses.
+ */
+static void
+test_cache_finalize (GObject *object)
+{
+    TestCache *self = TEST_CACHE (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->table, g_hash_table_unref);
+    g_clear_pointer (&self->test_result, g_bytes_unref);
+    G_OBJECT_CLASS (test_cache_parent_class)->finalize (object);
+}
+/*
+ * boiler-plate GObject class init function. Registers function pointers
+ * and properties.
+ */
+static void
+test_cache_class_init (TestCacheClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (test_cache_parent_class == NULL)
+        test_cache_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize     = test_cache_finalize;
+    object_class->get_property = test_cache_get_property;
+    object_class->set_property = test_cache_set_property;
+
+    obj_properties [PROP_MAX_ENTRIES] =
+        g_param_spec_uint ("max-entries",
+                           "max number of entries",
+                           "maximum number of cached TestParms responses",
+                           0,
+                           TEST_CACHE_MAX,
+                           TEST_CACHE_MAX_DEFAULT,
+                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    g_object_class_install_properties (object_class,
+                                       N_PROPERTIES,
+                                       obj_properties);
+}
+TestCache*
+test_cache_new (guint max_entries)
+{
+    g_debug ("%s with max_entries: %u", __func__, max_entries);
+    return TEST_CACHE (g_object_new (TYPE_TEST_CACHE,
+                                     "max-entries", max_entries,
+                                     NULL));
+}
+/*
+ * Return TRUE for the commands the cache may answer.
+ */
+gboolean
+test_cache_answers (TPM2_CC command_code)
+{
+    return command_code == TPM2_CC_TestParms ||
+        command_code == TPM2_CC_GetTestResult;
+}
+/*
+ * Generate the key used to cache the response to the provided TestParms
+ * command: its parameter area, the TPMT_PUBLIC_PARMS tested. Only
+ * commands without sessions are cached, an audit session makes each
+ * response different.
+ * This function returns NULL if the command can't be cached. The caller
+ * must free the returned GBytes with g_bytes_unref.
+ */
+static GBytes*
+test_cache_key (Tpm2Command *command)
+{
+    size_t offset;
+
+    if (tpm2_command_get_code (command) != TPM2_CC_TestParms ||
+        tpm2_command_get_tag (command) != TPM2_ST_NO_SESSIONS)
+    {
+        return NULL;
+    }
+    offset = tpm2_command_get_params_offset (command);
+    if (offset == 0 || offset >= tpm2_command_get_size (command)) {
+        return NULL;
+    }
+    return g_bytes_new (tpm2_command_get_buffer (command) + offset,
+                        tpm2_command_get_size (command) - offset);
+}
+/*
+ * Return TRUE if the TestParms response code 'rc' is an answer the TPM
+ * gives every time for the parameters: success, or a format one error
+ * pointing at the parameter it doesn't support. Warnings and format zero
+ * errors, like a TPM in failure mode or not started, are about its
+ * state at the time.
+ */
+static gboolean
+test_parms_rc_cacheable (TSS2_RC rc)
+{
+    return rc == TSS2_RC_SUCCESS ||
+        ((rc & TSS2_RC_LAYER_MASK) == TSS2_TPM_RC_LAYER &&
+         (rc & TPM2_RC_FMT1) != 0);
+}
+/*
+ * Return TRUE if the GetTestResult response in 'response' reports the
+ * self-test completed successfully. The response is the outData
+ * TPM2B_MAX_BUFFER followed by the testResult TPM2_RC.
+ */
+static gboolean
+test_result_complete (Tpm2Response *response)
+{
+    guint8 *buf = tpm2_response_get_buffer (response);
+    guint32 size = tpm2_response_get_size (response);
+    guint16 data_size;
+    guint32 result;
+
+    if (tpm2_response_get_code (response) != TSS2_RC_SUCCESS ||
+        size < TPM_HEADER_SIZE + sizeof (data_size))
+    {
+        return FALSE;
+    }
+    memcpy (&data_size, buf + TPM_HEADER_SIZE, sizeof (data_size));
+    data_size = GUINT16_FROM_BE (data_size);
+    if (size != TPM_HEADER_SIZE + sizeof (data_size) + data_size +
+        sizeof (result))
+    {
+        return FALSE;
+    }
+    memcpy (&result, buf + size - sizeof (result), sizeof (result));
+    return GUINT32_FROM_BE (result) == TPM2_RC_SUCCESS;
+}
+/*
+ * Look up the response cached for 'command'. Returns a new reference to
+ * the response, or NULL if there is none and the command must be sent to
+ * the TPM.
+ */
+GBytes*
+test_cache_lookup (TestCache   *cache,
+                   Tpm2Command *command)
+{
+    GBytes *key, *response = NULL;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_TestParms:
+        key = test_cache_key (command);
+        if (key != NULL) {
+            response = g_hash_table_lookup (cache->table, key);
+            g_bytes_unref (key);
+        }
+        break;
+    case TPM2_CC_GetTestResult:
+        if (tpm2_command_get_tag (command) == TPM2_ST_NO_SESSIONS) {
+            response = cache->test_result;
+        }
+        break;
+    default:
+        break;
+    }
+    return response != NULL ? g_bytes_ref (response) : NULL;
+}
+/*
+ * Keep the cache in step with the commands sent to the TPM. Starting the
+ * TPM, upgrading its firmware and commands that run the self-test drop
+ * what they make stale, a cacheable TestParms or GetTestResult response
+ * is added. TestParms responses aren't added once the cache is full.
+ */
+void
+test_cache_update (TestCache    *cache,
+                   Tpm2Command  *command,
+                   Tpm2Response *response)
+{
+    GBytes *key, *bytes;
+
+    switch (tpm2_command_get_code (command)) {
+    case TPM2_CC_Startup:
+    case TPM2_CC_FieldUpgradeStart:
+    case TPM2_CC_FieldUpgradeData:
+        test_cache_clear (cache);
+        break;
+    case TPM2_CC_SelfTest:
+    case TPM2_CC_IncrementalSelfTest:
+        g_clear_pointer (&cache->test_result, g_bytes_unref);
+        break;
+    case TPM2_CC_TestParms:
+        if (!test_parms_rc_cacheable (tpm2_response_get_code (response))) {
+            break;
+        }
+        key = test_cache_key (command);
+        if (key == NULL) {
+            break;
+        }
+        if (g_hash_table_size (cache->table) < cache->max_entries ||
+            g_hash_table_contains (cache->table, key))
+        {
+            bytes = g_bytes_new (tpm2_response_get_buffer (response),
+                                 tpm2_response_get_size (response));
+            g_hash_table_replace (cache->table, g_bytes_ref (key), bytes);
+        } else {
+            g_debug ("%s: cache is full", __func__);
+        }
+        g_bytes_unref (key);
+        break;
+    case TPM2_CC_GetTestResult:
+        if (tpm2_command_get_tag (command) == TPM2_ST_NO_SESSIONS &&
+            test_result_complete (response))
+        {
+            g_clear_pointer (&cache->test_result, g_bytes_unref);
+            cache->test_result =
+                g_bytes_new (tpm2_response_get_buffer (response),
+                             tpm2_response_get_size (response));
+        }
+        break;
+    default:
+        break;
+    }
+}
+/*
+ * Drop all cached responses. This must be done once the TPM was started
+ * again, after a reset the firmware may have changed.
+ */
+void
+test_cache_clear (TestCache *cache)
+{
+    if (g_hash_table_size (cache->table) > 0 || cache->test_result != NULL) {
+        g_debug ("%s: dropping %u cached TestParms responses", __func__,
+                 g_hash_table_size (cache->table));
+        g_hash_table_remove_all (cache->table);
+        g_clear_pointer (&cache->test_result, g_bytes_unref);
+    }
+}
+/*
+ * The number of responses cached, GetTestResult included.
+ */
+guint
+test_cache_size (TestCache *cache)
+{
+    return g_hash_table_size (cache->table) +
+        (cache->test_result != NULL ? 1 : 0);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TEST_CACHE_H
+#define TEST_CACHE_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tpm2-command.h"
+#include "tpm2-response.h"
+
+G_BEGIN_DECLS
+
+#define TEST_CACHE_MAX_DEFAULT 16
+#define TEST_CACHE_MAX         256
+
+/*
+ * The TestCache holds the responses to TestParms commands, keyed by the
+ * parameters they test, and the response to GetTestResult once the
+ * self-test has completed. What the TPM supports only changes with its
+ * firmware, so the responses stay valid until the TPM is started again or
+ * its firmware is upgraded. Only the answers a TPM gives every time are
+ * kept: success, or an error about a parameter for the parameters it
+ * doesn't support, never a warning or a failure.
+ */
+typedef struct _TestCacheClass {
+    GObjectClass      parent;
+} TestCacheClass;
+
+typedef struct _TestCache {
+    GObject           parent_instance;
+    GHashTable       *table;
+    guint             max_entries;
+    GBytes           *test_result;
+} TestCache;
+
+#define TYPE_TEST_CACHE              (test_cache_get_type   ())
+#define TEST_CACHE(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj),   TYPE_TEST_CACHE, TestCache))
+#define TEST_CACHE_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST    ((klass), TYPE_TEST_CACHE, TestCacheClass))
+#define IS_TEST_CACHE(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj),   TYPE_TEST_CACHE))
+#define IS_TEST_CACHE_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE    ((klass), TYPE_TEST_CACHE))
+#define TEST_CACHE_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS  ((obj),   TYPE_TEST_CACHE, TestCacheClass))
+
+GType            test_cache_get_type       (void);
+TestCache*       test_cache_new            (guint             max_entries);
+gboolean         test_cache_answers        (TPM2_CC           command_code);
+GBytes*          test_cache_lookup         (TestCache        *cache,
+                                            Tpm2Command      *command);
+void             test_cache_update         (TestCache        *cache,
+                                            Tpm2Command      *command,
+                                            Tpm2Response     *response);
+void             test_cache_clear          (TestCache        *cache);
+guint            test_cache_size           (TestCache        *cache);
+
+G_END_DECLS
+#endif /* TEST_CACHE_H */
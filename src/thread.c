@@ -3,6 +3,11 @@
  * Copyright (c) 2017, Intel Corporation
  * All rights reserved.
  */
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "thread.h"
@@ -21,17 +26,125 @@ thread_class_init (ThreadClass *klass)
     klass->thread_run = NULL;
 }
 
+/*
+ * Pin the thread to 'cpus' when it's started. NULL lets it run anywhere.
+ */
+void
+thread_set_cpus (Thread          *self,
+                 cpu_set_t const *cpus)
+{
+    if (cpus == NULL) {
+        self->has_cpus = FALSE;
+        return;
+    }
+    self->cpus = *cpus;
+    self->has_cpus = TRUE;
+}
+/*
+ * Run the thread under SCHED_FIFO at 'fifo_priority' or, if that's 0,
+ * with the nice value 'nice' once it's started.
+ */
+void
+thread_set_sched (Thread *self,
+                  gint    fifo_priority,
+                  gint    nice)
+{
+    self->fifo_priority = fifo_priority;
+    self->nice = nice;
+}
+/*
+ * Parse a list of CPUs like "0-3,6" into 'cpus'. Returns FALSE if the
+ * list is malformed or names a CPU we can't represent.
+ */
+gboolean
+thread_parse_cpus (gchar const *list,
+                   cpu_set_t   *cpus)
+{
+    gchar **ranges, *start, *end;
+    guint64 first, last, cpu;
+    gboolean ret = TRUE;
+    guint i;
+
+    CPU_ZERO (cpus);
+    ranges = g_strsplit (list, ",", -1);
+    for (i = 0; ranges [i] != NULL && ret; ++i) {
+        first = g_ascii_strtoull (ranges [i], &end, 10);
+        last = first;
+        if (end != ranges [i] && *end == '-') {
+            start = end + 1;
+            last = g_ascii_strtoull (start, &end, 10);
+        } else {
+            start = ranges [i];
+        }
+        if (end == start || *end != '\0' || first > last ||
+            last >= CPU_SETSIZE)
+        {
+            g_warning ("%s: bad CPU range \"%s\"", __func__, ranges [i]);
+            ret = FALSE;
+            break;
+        }
+        for (cpu = first; cpu <= last; ++cpu) {
+            CPU_SET (cpu, cpus);
+        }
+    }
+    if (i == 0) {
+        ret = FALSE;
+    }
+    g_strfreev (ranges);
+    return ret;
+}
+/*
+ * The nice value is per thread on Linux but can only be set from the
+ * thread itself, so it's done here before running the thread_run function
+ * of the derived class.
+ */
+static void*
+thread_main (void *data)
+{
+    Thread *self = THREAD (data);
+
+    if (self->fifo_priority == 0 && self->nice != 0 &&
+        setpriority (PRIO_PROCESS, (id_t)syscall (SYS_gettid), self->nice) != 0)
+    {
+        g_warning ("%s: failed to set nice value %d: %s", __func__,
+                   self->nice, strerror (errno));
+    }
+    return THREAD_GET_CLASS (self)->thread_run (self);
+}
+/*
+ * Start the thread with the CPUs and scheduling policy set. Without the
+ * privileges for SCHED_FIFO the thread is started with the default policy
+ * instead of not at all.
+ */
 gint
 thread_start (Thread *self)
 {
+    pthread_attr_t attr;
+    struct sched_param param = { .sched_priority = self->fifo_priority };
+    gint ret;
+
     if (self->thread_id != 0) {
         g_warning ("thread running");
         return -1;
     }
-    return pthread_create (&self->thread_id,
-                           NULL,
-                           THREAD_GET_CLASS (self)->thread_run,
-                           self);
+    pthread_attr_init (&attr);
+    if (self->has_cpus) {
+        pthread_attr_setaffinity_np (&attr, sizeof (self->cpus), &self->cpus);
+    }
+    if (self->fifo_priority != 0) {
+        pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+        pthread_attr_setschedparam (&attr, &param);
+    }
+    ret = pthread_create (&self->thread_id, &attr, thread_main, self);
+    if (ret == EPERM && self->fifo_priority != 0) {
+        g_warning ("%s: not permitted to use SCHED_FIFO, starting thread "
+                   "with the default policy", __func__);
+        pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create (&self->thread_id, &attr, thread_main, self);
+    }
+    pthread_attr_destroy (&attr);
+    return ret;
 }
 
 void
@@ -7,6 +7,8 @@
 #define THREAD_INTERFACE_H
 
 #include <glib-object.h>
+#include <pthread.h>
+#include <sched.h>
 
 G_BEGIN_DECLS
 
@@ -25,6 +27,15 @@ struct _ThreadClass {
 struct _Thread {
     GObject     parent;
     pthread_t   thread_id;
+    /*
+     * Scheduling applied when the thread is started: the CPUs it may run
+     * on if 'has_cpus' is set, SCHED_FIFO at 'fifo_priority' if that's
+     * not 0 and the nice value 'nice' otherwise.
+     */
+    cpu_set_t   cpus;
+    gboolean    has_cpus;
+    gint        fifo_priority;
+    gint        nice;
 };
 
 #define TYPE_THREAD             (thread_get_type ())
@@ -38,6 +49,13 @@ GType           thread_get_type     (void);
 void            thread_cancel       (Thread            *self);
 gint            thread_join         (Thread            *self);
 gint            thread_start        (Thread            *self);
+void            thread_set_cpus     (Thread            *self,
+                                     cpu_set_t const   *cpus);
+void            thread_set_sched    (Thread            *self,
+                                     gint               fifo_priority,
+                                     gint               nice);
+gboolean        thread_parse_cpus   (gchar const       *list,
+                                     cpu_set_t         *cpus);
 
 G_END_DECLS
 #endif /* THREAD_INTERFACE_H */
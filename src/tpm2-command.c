@@ -10,6 +10,7 @@
 #include <tss2/tss2_tpm2_types.h>
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
 #include "util.h"
@@ -108,6 +109,7 @@ enum {
     PROP_SESSION,
     PROP_BUFFER,
     PROP_BUFFER_SIZE,
+    PROP_BUFFER_POOLED,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -136,6 +138,9 @@ tpm2_command_set_property (GObject        *object,
     case PROP_BUFFER_SIZE:
         self->buffer_size = g_value_get_uint (value);
         break;
+    case PROP_BUFFER_POOLED:
+        self->buffer_pooled = g_value_get_boolean (value);
+        break;
     case PROP_SESSION:
         if (self->connection != NULL) {
             g_warning ("  connection already set");
@@ -172,6 +177,9 @@ tpm2_command_get_property (GObject     *object,
     case PROP_BUFFER_SIZE:
         g_value_set_uint (value, self->buffer_size);
         break;
+    case PROP_BUFFER_POOLED:
+        g_value_set_boolean (value, self->buffer_pooled);
+        break;
     case PROP_SESSION:
         g_value_set_object (value, self->connection);
         break;
@@ -185,12 +193,18 @@ tpm2_command_dispose (GObject *obj)
 {
     Tpm2Command *cmd = TPM2_COMMAND (obj);
 
+    if (cmd->connection != NULL && cmd->mem_charged > 0) {
+        connection_mem_add (cmd->connection, -(gssize)cmd->mem_charged);
+        cmd->mem_charged = 0;
+    }
     g_clear_object (&cmd->connection);
+    g_clear_object (&cmd->response);
     G_OBJECT_CLASS (tpm2_command_parent_class)->dispose (obj);
 }
 /**
  * override the parent finalize method so we can free the data associated with
- * the DataMessage instance.
+ * the DataMessage instance. Buffers from the buffer pool are given back to
+ * it.
  */
 static void
 tpm2_command_finalize (GObject *obj)
@@ -198,7 +212,12 @@ tpm2_command_finalize (GObject *obj)
     Tpm2Command *cmd = TPM2_COMMAND (obj);
 
     g_debug ("tpm2_command_finalize");
-    g_clear_pointer (&cmd->buffer, g_free);
+    if (cmd->buffer_pooled) {
+        util_buf_put (cmd->buffer, cmd->buffer_size);
+        cmd->buffer = NULL;
+    } else {
+        g_clear_pointer (&cmd->buffer, g_free);
+    }
     G_OBJECT_CLASS (tpm2_command_parent_class)->finalize (obj);
 }
 static void
@@ -244,6 +263,12 @@ tpm2_command_class_init (Tpm2CommandClass *klass)
                            UTIL_BUF_MAX,
                            0,
                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_BUFFER_POOLED] =
+        g_param_spec_boolean ("buffer-pooled",
+                              "buffer from pool",
+                              "buffer was taken from the buffer pool",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_SESSION] =
         g_param_spec_object ("connection",
                              "Session object",
@@ -254,8 +279,91 @@ tpm2_command_class_init (Tpm2CommandClass *klass)
                                        N_PROPERTIES,
                                        obj_properties);
 }
+/*
+ * Walk the handle and authorization areas of the command buffer once and
+ * record where things are. The handle values and the auths themselves are
+ * still read from the buffer since the RM rewrites the handles in place.
+ * Nothing is logged here: the accessors warn about a bad buffer when
+ * something actually asks for the part that's bad.
+ */
+static void
+tpm2_command_parse (Tpm2Command *command)
+{
+    size_t offset, end;
+
+    command->handle_count = (guint8)((command->attributes &
+                                      TPMA_CC_CHANDLES_MASK) >>
+                                     TPMA_CC_CHANDLES_SHIFT);
+    if (command->buffer == NULL ||
+        command->buffer_size < TPM_HEADER_SIZE ||
+        !tpm2_command_has_auths (command) ||
+        AUTH_AREA_SIZE_END_OFFSET (command) > command->buffer_size)
+    {
+        return;
+    }
+    command->auths_size = AUTH_AREA_GET_SIZE (command);
+    end = AUTH_AREA_END_OFFSET (command);
+    if (end > command->buffer_size) {
+        return;
+    }
+    for (offset = AUTH_AREA_FIRST_OFFSET (command);
+         offset < end;
+         offset = AUTH_AUTH_BUF_END_OFFSET (command, offset))
+    {
+        if (command->auth_count == TPM2_COMMAND_MAX_AUTHS ||
+            AUTH_NONCE_SIZE_END_OFFSET (offset) > end ||
+            AUTH_AUTH_SIZE_END_OFFSET (command, offset) > end ||
+            AUTH_AUTH_BUF_END_OFFSET (command, offset) > end)
+        {
+            command->auth_count = 0;
+            command->session_auth_count = 0;
+            return;
+        }
+        command->auth_offsets [command->auth_count++] = offset;
+        switch (AUTH_GET_HANDLE (command, offset) >> TPM2_HR_SHIFT) {
+        case TPM2_HT_HMAC_SESSION:
+        case TPM2_HT_POLICY_SESSION:
+            ++command->session_auth_count;
+            break;
+        default:
+            break;
+        }
+    }
+    command->auths_end = end;
+}
+/*
+ * Every command, including the ContextSave / ContextLoad / FlushContext
+ * the RM creates internally, goes through this. The fields are set
+ * directly like ControlMessage does rather than as construct properties:
+ * passing them to g_object_new costs a GValue and a set_property call
+ * each. The properties are still there for g_object_get.
+ */
+static Tpm2Command*
+tpm2_command_new_full (Connection *connection,
+                       guint8     *buffer,
+                       size_t      size,
+                       TPMA_CC     attributes,
+                       gboolean    pooled)
+{
+    Tpm2Command *command;
+
+    command = TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND, NULL));
+    command->attributes = attributes;
+    command->buffer = buffer;
+    command->buffer_size = size;
+    command->buffer_pooled = pooled;
+    ALLOC_STATS_ADD (ALLOC_STATS_COMMAND,
+                     sizeof (Tpm2Command) + (pooled ? 0 : size));
+    if (connection != NULL) {
+        command->connection = g_object_ref (connection);
+        command->mem_charged = size;
+        connection_mem_add (connection, size);
+    }
+    tpm2_command_parse (command);
+    return command;
+}
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Boilerplate constructor.
  */
 Tpm2Command*
 tpm2_command_new (Connection     *connection,
@@ -263,12 +371,20 @@ tpm2_command_new (Connection     *connection,
                   size_t           size,
                   TPMA_CC          attributes)
 {
-    return TPM2_COMMAND (g_object_new (TYPE_TPM2_COMMAND,
-                                       "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", size,
-                                       "connection", connection,
-                                       NULL));
+    return tpm2_command_new_full (connection, buffer, size, attributes, FALSE);
+}
+/*
+ * Same as tpm2_command_new but for a buffer taken from the buffer pool
+ * with util_buf_get. The buffer is given back to the pool when the
+ * Tpm2Command is finalized.
+ */
+Tpm2Command*
+tpm2_command_new_pooled (Connection     *connection,
+                         guint8         *buffer,
+                         size_t          size,
+                         TPMA_CC         attributes)
+{
+    return tpm2_command_new_full (connection, buffer, size, attributes, TRUE);
 }
 #define CONTEXT_SAVE_CMD_SIZE (TPM_HEADER_SIZE + sizeof (TPM2_HANDLE))
 Tpm2Command*
@@ -322,6 +438,34 @@ tpm2_command_new_context_load (uint8_t *buf,
     /* TPMA_CC here is hard coded to the appropriate value for ContextLoad */
     return tpm2_command_new (NULL, buf_tmp, size_new, 0x10000161);
 }
+/*
+ * Marshal 'context' into the buffer of a ContextLoad command, ready to be
+ * sent as is by tpm2_context_load_command. Returns NULL if the context
+ * can't be marshaled. The caller must free the returned GBytes with
+ * g_bytes_unref.
+ */
+GBytes*
+tpm2_command_context_load_bytes (TPMS_CONTEXT *context)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPMS_CONTEXT);
+    size_t offset = TPM_HEADER_SIZE;
+    uint8_t *buf = g_malloc (size);
+    TSS2_RC rc;
+
+    rc = Tss2_MU_TPMS_CONTEXT_Marshal (context, buf, size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to marshal TPMS_CONTEXT: 0x%" PRIx32,
+                   __func__, rc);
+        g_free (buf);
+        return NULL;
+    }
+    tpm2_header_init (buf,
+                      offset,
+                      TPM2_ST_NO_SESSIONS,
+                      offset,
+                      TPM2_CC_ContextLoad);
+    return g_bytes_new_take (g_realloc (buf, offset), offset);
+}
 /* Simple "getter" to expose the attributes associated with the command. */
 TPMA_CC
 tpm2_command_get_attributes (Tpm2Command *command)
@@ -371,19 +515,78 @@ tpm2_command_get_connection (Tpm2Command *command)
     }
     return command->connection;
 }
+/*
+ * Same as tpm2_command_get_connection but without taking a reference. The
+ * Connection is valid for as long as the caller holds the Tpm2Command.
+ */
+Connection*
+tpm2_command_peek_connection (Tpm2Command *command)
+{
+    return command->connection;
+}
+/*
+ * The ResourceManager notes when the command went into its input queue
+ * so that it can tell how long the command waited there.
+ */
+gint64
+tpm2_command_get_time_queued (Tpm2Command *command)
+{
+    return command->time_queued;
+}
+void
+tpm2_command_set_time_queued (Tpm2Command *command,
+                              gint64       time)
+{
+    command->time_queued = time;
+}
+/*
+ * Whether the command can go to the TPM without the ResourceManager
+ * virtualizing anything, see command_attrs_is_passthrough.
+ */
+gboolean
+tpm2_command_is_passthrough (Tpm2Command *command)
+{
+    return command->passthrough;
+}
+void
+tpm2_command_set_passthrough (Tpm2Command *command,
+                              gboolean     passthrough)
+{
+    command->passthrough = passthrough;
+}
+/*
+ * A command that can be answered without the TPM may get its response
+ * before it's queued for the ResourceManager. The ResourceManager takes
+ * it and sends it on in place of processing the command, that way the
+ * responses to a connection still go out in the order of its commands.
+ * The caller owns the reference to the returned Tpm2Response.
+ */
+void
+tpm2_command_set_response (Tpm2Command  *command,
+                           Tpm2Response *response)
+{
+    g_clear_object (&command->response);
+    if (response != NULL) {
+        command->response = g_object_ref (response);
+    }
+}
+Tpm2Response*
+tpm2_command_take_response (Tpm2Command *command)
+{
+    Tpm2Response *response = command->response;
+
+    command->response = NULL;
+    return response;
+}
 /* Return the number of handles in the command. */
 guint8
 tpm2_command_get_handle_count (Tpm2Command *command)
 {
-    g_debug ("tpm2_command_get_handle_count");
-    uint32_t tmp;
-
     if (command == NULL) {
         g_warning ("tpm2_command_get_handle_count received NULL parameter");
         return 0;
     }
-    tmp = tpm2_command_get_attributes (command);
-    return (guint8)((tmp & TPMA_CC_CHANDLES_MASK) >> TPMA_CC_CHANDLES_SHIFT);
+    return command->handle_count;
 }
 /*
  * Simple function to access handles in the provided Tpm2Command. The
@@ -450,15 +653,17 @@ tpm2_command_get_handles (Tpm2Command *command,
         g_warning ("tpm2_command_get_handles passed NULL parameter");
         return FALSE;
     }
-    real_count = tpm2_command_get_handle_count (command);
+    real_count = command->handle_count;
     if (real_count > *count) {
         g_warning ("tpm2_command_get_handles passed insufficient handle array");
         return FALSE;
     }
 
     for (i = 0; i < real_count; ++i) {
-        handles[i] = tpm2_command_get_handle (command, i);
-
+        if (HANDLE_END_OFFSET (i) > command->buffer_size) {
+            break;
+        }
+        handles[i] = be32toh (HANDLE_GET (command->buffer, i));
         if (handles[i] == 0) {
             /* no more handles could be extracted */
             break;
@@ -589,6 +794,20 @@ tpm2_command_has_auths (Tpm2Command *command)
         return TRUE;
     }
 }
+/*
+ * Returns TRUE if any auth in the command uses an HMAC or policy session,
+ * FALSE if the command has no auths or only passwords: there's no
+ * session to load for it. A malformed auth area counts as having
+ * sessions so that it goes down the path that reports it.
+ */
+gboolean
+tpm2_command_has_session_auths (Tpm2Command *command)
+{
+    if (!tpm2_command_has_auths (command)) {
+        return FALSE;
+    }
+    return command->auths_end == 0 || command->session_auth_count > 0;
+}
 /*
  * When provided with a Tpm2Command with auths in the auth area this function
  * will return the total size of the auth area.
@@ -596,8 +815,6 @@ tpm2_command_has_auths (Tpm2Command *command)
 UINT32
 tpm2_command_get_auths_size (Tpm2Command *command)
 {
-    size_t auth_size_end;
-
     if (command == NULL) {
         g_warning ("tpm2_command_get_auths_size passed NULL parameter");
         return 0;
@@ -606,16 +823,35 @@ tpm2_command_get_auths_size (Tpm2Command *command)
         g_warning ("%s: Tpm2Command has no auths", __func__);
         return 0;
     }
-    auth_size_end = AUTH_AREA_SIZE_END_OFFSET (command);
-    g_debug ("%s: auth_size_end: %zu", __func__, auth_size_end);
-    g_debug ("%s: buffer_size: %zu", __func__, command->buffer_size);
     if (AUTH_AREA_SIZE_END_OFFSET (command) > command->buffer_size) {
         g_warning ("%s reading size of auth area would overrun command buffer."
                    " Returning 0", __func__);
         return 0;
     }
 
-    return AUTH_AREA_GET_SIZE (command);
+    return command->auths_size;
+}
+/*
+ * Get the offset of the parameter area in the command buffer. For commands
+ * with sessions this is just past the end of the authorization area,
+ * otherwise it's just past the handle area. If the authorization area
+ * would overrun the command buffer then 0 is returned.
+ */
+size_t
+tpm2_command_get_params_offset (Tpm2Command *command)
+{
+    if (command == NULL) {
+        g_warning ("%s passed NULL parameter", __func__);
+        return 0;
+    }
+    if (!tpm2_command_has_auths (command)) {
+        return AUTH_AREA_OFFSET (command);
+    }
+    if (command->auths_end == 0) {
+        g_warning ("%s: auth area overruns command buffer", __func__);
+        return 0;
+    }
+    return command->auths_end;
 }
 /*
  * This function extracts the authorization handle from the entry in the
@@ -664,29 +900,23 @@ tpm2_command_foreach_auth (Tpm2Command *command,
                            GFunc        callback,
                            gpointer     user_data)
 {
-    size_t   offset;
+    guint8 i;
 
     if (command == NULL || callback == NULL) {
         g_warning ("%s passed NULL parameter", __func__);
         return FALSE;
     }
-
-    if (AUTH_AREA_FIRST_OFFSET (command) > command->buffer_size) {
-        g_warning ("%s: auth area begins after end of buffer", __func__);
-        return FALSE;
+    if (!tpm2_command_has_auths (command)) {
+        return TRUE;
     }
-
-    if (AUTH_AREA_END_OFFSET (command) > command->buffer_size) {
-        g_warning ("%s: command buffer size insufficient to iterate all auths",
+    if (command->auths_end == 0) {
+        g_warning ("%s: auth area overruns command buffer or is malformed",
                    __func__);
         return FALSE;
     }
 
-    for (offset =  AUTH_AREA_FIRST_OFFSET (command);
-         offset <  AUTH_AREA_END_OFFSET (command);
-         offset = AUTH_AUTH_BUF_END_OFFSET   (command, offset))
-    {
-        size_t offset_tmp = offset;
+    for (i = 0; i < command->auth_count; ++i) {
+        size_t offset_tmp = command->auth_offsets [i];
         callback (&offset_tmp, user_data);
     }
 
@@ -10,9 +10,13 @@
 #include <tss2/tss2_tpm2_types.h>
 
 #include "connection.h"
+#include "tpm2-response.h"
 
 G_BEGIN_DECLS
 
+/* a command carries at most 3 authorizations (MAX_SESSION_NUM) */
+#define TPM2_COMMAND_MAX_AUTHS       3
+
 typedef struct _Tpm2CommandClass {
     GObjectClass    parent;
 } Tpm2CommandClass;
@@ -23,6 +27,28 @@ typedef struct _Tpm2Command {
     Connection     *connection;
     guint8         *buffer;
     size_t          buffer_size;
+    gboolean        buffer_pooled;
+    /* bytes counted against the connection, see connection_mem_add */
+    size_t          mem_charged;
+    /*
+     * Layout of the handle and authorization areas, parsed once when the
+     * command is created. 'auths_end' is the offset just past the auth
+     * area, 0 if the auth area overruns the buffer or is malformed.
+     * 'session_auth_count' is the number of auths that use an HMAC or
+     * policy session, the others are passwords.
+     */
+    guint8          handle_count;
+    guint8          auth_count;
+    guint8          session_auth_count;
+    UINT32          auths_size;
+    size_t          auths_end;
+    size_t          auth_offsets [TPM2_COMMAND_MAX_AUTHS];
+    /* monotonic time the command was queued for the ResourceManager */
+    gint64          time_queued;
+    /* response resolved before the command reached the ResourceManager */
+    Tpm2Response   *response;
+    /* the CommandAttrs found the command needs no virtualization */
+    gboolean        passthrough;
 } Tpm2Command;
 
 #include "command-attrs.h"
@@ -41,9 +67,14 @@ Tpm2Command*          tpm2_command_new             (Connection      *connection,
                                                     guint8           *buffer,
                                                     size_t            size,
                                                     TPMA_CC           attrs);
+Tpm2Command*          tpm2_command_new_pooled      (Connection      *connection,
+                                                    guint8           *buffer,
+                                                    size_t            size,
+                                                    TPMA_CC           attrs);
 Tpm2Command*          tpm2_command_new_context_save (TPM2_HANDLE);
 Tpm2Command*          tpm2_command_new_context_load (uint8_t *buf,
                                                      size_t size);
+GBytes*               tpm2_command_context_load_bytes (TPMS_CONTEXT *context);
 TPMA_CC               tpm2_command_get_attributes  (Tpm2Command      *command);
 TPMA_SESSION          tpm2_command_get_auth_attrs  (Tpm2Command      *command,
                                                     size_t            auth_offset);
@@ -65,11 +96,23 @@ TSS2_RC                tpm2_command_get_flush_handle (Tpm2Command     *command,
 guint32               tpm2_command_get_size        (Tpm2Command      *command);
 TPMI_ST_COMMAND_TAG   tpm2_command_get_tag         (Tpm2Command      *command);
 Connection*           tpm2_command_get_connection  (Tpm2Command      *command);
+gint64                tpm2_command_get_time_queued (Tpm2Command      *command);
+void                  tpm2_command_set_time_queued (Tpm2Command      *command,
+                                                    gint64            time);
+Connection*           tpm2_command_peek_connection (Tpm2Command      *command);
+gboolean              tpm2_command_is_passthrough  (Tpm2Command      *command);
+void                  tpm2_command_set_passthrough (Tpm2Command      *command,
+                                                    gboolean          passthrough);
+void                  tpm2_command_set_response    (Tpm2Command      *command,
+                                                    Tpm2Response     *response);
+Tpm2Response*         tpm2_command_take_response   (Tpm2Command      *command);
 TPM2_CAP               tpm2_command_get_cap         (Tpm2Command      *command);
 UINT32                tpm2_command_get_prop        (Tpm2Command      *command);
 UINT32                tpm2_command_get_prop_count  (Tpm2Command      *command);
 gboolean              tpm2_command_has_auths       (Tpm2Command      *command);
+gboolean              tpm2_command_has_session_auths (Tpm2Command    *command);
 UINT32                tpm2_command_get_auths_size  (Tpm2Command      *command);
+size_t                tpm2_command_get_params_offset (Tpm2Command    *command);
 gboolean              tpm2_command_foreach_auth    (Tpm2Command      *command,
                                                     GFunc             func,
                                                     gpointer          user_data);
@@ -10,6 +10,7 @@
 #include <tss2/tss2_tpm2_types.h>
 #include <tss2/tss2_mu.h>
 
+#include "alloc-stats.h"
 #include "tpm2-header.h"
 #include "tpm2-response.h"
 #include "util.h"
@@ -34,6 +35,7 @@ enum {
     PROP_SESSION,
     PROP_BUFFER,
     PROP_BUFFER_SIZE,
+    PROP_BUFFER_POOLED,
     N_PROPERTIES
 };
 static GParamSpec *obj_properties [N_PROPERTIES] = { NULL, };
@@ -62,6 +64,9 @@ tpm2_response_set_property (GObject        *object,
     case PROP_BUFFER_SIZE:
         self->buffer_size = g_value_get_uint (value);
         break;
+    case PROP_BUFFER_POOLED:
+        self->buffer_pooled = g_value_get_boolean (value);
+        break;
     case PROP_SESSION:
         if (self->connection != NULL) {
             g_warning ("  connection already set");
@@ -98,6 +103,9 @@ tpm2_response_get_property (GObject     *object,
     case PROP_BUFFER_SIZE:
         g_value_set_uint (value, self->buffer_size);
         break;
+    case PROP_BUFFER_POOLED:
+        g_value_set_boolean (value, self->buffer_pooled);
+        break;
     case PROP_SESSION:
         g_value_set_object (value, self->connection);
         break;
@@ -111,12 +119,17 @@ tpm2_response_dispose (GObject *obj)
 {
     Tpm2Response *self = TPM2_RESPONSE (obj);
 
+    if (self->connection != NULL && self->mem_charged > 0) {
+        connection_mem_add (self->connection, -(gssize)self->mem_charged);
+        self->mem_charged = 0;
+    }
     g_clear_object (&self->connection);
     G_OBJECT_CLASS (tpm2_response_parent_class)->dispose (obj);
 }
 /**
  * override the parent finalize method so we can free the data associated with
- * the DataMessage instance.
+ * the DataMessage instance. Buffers from the buffer pool are given back to
+ * it.
  */
 static void
 tpm2_response_finalize (GObject *obj)
@@ -124,7 +137,12 @@ tpm2_response_finalize (GObject *obj)
     Tpm2Response *self = TPM2_RESPONSE (obj);
 
     g_debug ("tpm2_response_finalize");
-    g_clear_pointer (&self->buffer, g_free);
+    if (self->buffer_pooled) {
+        util_buf_put (self->buffer, self->buffer_size);
+        self->buffer = NULL;
+    } else {
+        g_clear_pointer (&self->buffer, g_free);
+    }
     G_OBJECT_CLASS (tpm2_response_parent_class)->finalize (obj);
 }
 static void
@@ -170,6 +188,12 @@ tpm2_response_class_init (Tpm2ResponseClass *klass)
                            UTIL_BUF_MAX,
                            0,
                            G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
+    obj_properties [PROP_BUFFER_POOLED] =
+        g_param_spec_boolean ("buffer-pooled",
+                              "buffer from pool",
+                              "buffer was taken from the buffer pool",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY);
     obj_properties [PROP_SESSION] =
         g_param_spec_object ("connection",
                              "Connection object",
@@ -180,8 +204,35 @@ tpm2_response_class_init (Tpm2ResponseClass *klass)
                                        N_PROPERTIES,
                                        obj_properties);
 }
+/*
+ * Set the fields directly rather than through construct properties, see
+ * tpm2_command_new_full.
+ */
+static Tpm2Response*
+tpm2_response_new_full (Connection *connection,
+                        guint8     *buffer,
+                        size_t      buffer_size,
+                        TPMA_CC     attributes,
+                        gboolean    pooled)
+{
+    Tpm2Response *response;
+
+    response = TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE, NULL));
+    response->attributes = attributes;
+    response->buffer = buffer;
+    response->buffer_size = buffer_size;
+    response->buffer_pooled = pooled;
+    ALLOC_STATS_ADD (ALLOC_STATS_RESPONSE,
+                     sizeof (Tpm2Response) + (pooled ? 0 : buffer_size));
+    if (connection != NULL) {
+        response->connection = g_object_ref (connection);
+        response->mem_charged = buffer_size;
+        connection_mem_add (connection, buffer_size);
+    }
+    return response;
+}
 /**
- * Boilerplate constructor, but some GObject properties would be nice.
+ * Boilerplate constructor.
  */
 Tpm2Response*
 tpm2_response_new (Connection     *connection,
@@ -189,12 +240,28 @@ tpm2_response_new (Connection     *connection,
                    size_t           buffer_size,
                    TPMA_CC          attributes)
 {
-    return TPM2_RESPONSE (g_object_new (TYPE_TPM2_RESPONSE,
-                                        "attributes", attributes,
-                                       "buffer",  buffer,
-                                       "buffer-size", buffer_size,
-                                       "connection", connection,
-                                       NULL));
+    return tpm2_response_new_full (connection,
+                                   buffer,
+                                   buffer_size,
+                                   attributes,
+                                   FALSE);
+}
+/*
+ * Same as tpm2_response_new but for a buffer taken from the buffer pool
+ * with util_buf_get. The buffer is given back to the pool when the
+ * Tpm2Response is finalized.
+ */
+Tpm2Response*
+tpm2_response_new_pooled (Connection     *connection,
+                          guint8         *buffer,
+                          size_t          buffer_size,
+                          TPMA_CC         attributes)
+{
+    return tpm2_response_new_full (connection,
+                                   buffer,
+                                   buffer_size,
+                                   attributes,
+                                   TRUE);
 }
 
 void
@@ -275,26 +342,30 @@ tpm2_response_new_context_save (Connection *connection,
                                 SessionEntry *entry)
 {
     Tpm2Response *response = NULL;
-    size_buf_t *size_buf;
+    const uint8_t *context;
+    gsize context_size;
     /* allocate buffer be large enough to hold TPM2_ContextSave response */
     uint8_t *buf;
     TSS2_RC rc;
 
-    size_buf = session_entry_get_context_client (entry);
-    buf = g_malloc0 (TPM_HEADER_SIZE + size_buf->size);
-    memcpy (&buf[TPM_HEADER_SIZE], size_buf->buf, size_buf->size);
+    context = g_bytes_get_data (session_entry_get_context_client (entry),
+                                &context_size);
+    buf = g_malloc0 (TPM_HEADER_SIZE + context_size);
+    if (context_size > 0) {
+        memcpy (&buf[TPM_HEADER_SIZE], context, context_size);
+    }
     /* offset now has size of response */
     rc = tpm2_header_init (buf,
-                           TPM_HEADER_SIZE + size_buf->size,
+                           TPM_HEADER_SIZE + context_size,
                            TPM2_ST_NO_SESSIONS,
-                           TPM_HEADER_SIZE + size_buf->size,
+                           TPM_HEADER_SIZE + context_size,
                            TSS2_RC_SUCCESS);
     if (rc != TSS2_RC_SUCCESS) {
         g_warning ("%s: Failed to initialize header: 0x%" PRIx32,
                    __func__, rc);
         goto out;
     }
-    response = tpm2_response_new (connection, buf, TPM_HEADER_SIZE + size_buf->size, 0x02000162);
+    response = tpm2_response_new (connection, buf, TPM_HEADER_SIZE + context_size, 0x02000162);
 out:
     if (response == NULL) {
         g_free (buf);
@@ -351,6 +422,38 @@ tpm2_response_get_connection (Tpm2Response *response)
     }
     return response->connection;
 }
+/*
+ * Same as tpm2_response_get_connection but without taking a reference. The
+ * Connection is valid for as long as the caller holds the Tpm2Response.
+ */
+Connection*
+tpm2_response_peek_connection (Tpm2Response *response)
+{
+    return response->connection;
+}
+/*
+ * The ResourceManager records the command a response answers and when it
+ * queued the response so the ResponseSink can tell how long the response
+ * took to be written.
+ */
+void
+tpm2_response_set_queued (Tpm2Response *response,
+                          TPM2_CC       command_code,
+                          gint64        time)
+{
+    response->command_code = command_code;
+    response->time_queued = time;
+}
+gint64
+tpm2_response_get_time_queued (Tpm2Response *response)
+{
+    return response->time_queued;
+}
+TPM2_CC
+tpm2_response_get_command_code (Tpm2Response *response)
+{
+    return response->command_code;
+}
 /*
  * Return the number of handles in the response. For a response to contain
  * a handle it must:
@@ -418,3 +521,29 @@ tpm2_response_get_handle_type (Tpm2Response *response)
      */
     return (TPM2_HT)(tpm2_response_get_handle (response) >> TPM2_HR_SHIFT);
 }
+/*
+ * The ResourceManager leaves rewriting a response buffer without the TPM
+ * to the ResponseSink thread: 'func' is called on the response by
+ * tpm2_response_post_process just before it's written to the client, so
+ * the RM can get on with the next command.
+ */
+void
+tpm2_response_set_post_process (Tpm2Response     *response,
+                                Tpm2ResponseFunc  func)
+{
+    response->post_process = func;
+}
+/*
+ * Run the post processing function set for the response, if any, once.
+ */
+TSS2_RC
+tpm2_response_post_process (Tpm2Response *response)
+{
+    Tpm2ResponseFunc func = response->post_process;
+
+    if (func == NULL) {
+        return TSS2_RC_SUCCESS;
+    }
+    response->post_process = NULL;
+    return func (response);
+}
@@ -19,13 +19,30 @@ typedef struct _Tpm2ResponseClass {
     GObjectClass    parent;
 } Tpm2ResponseClass;
 
-typedef struct _Tpm2Response {
+typedef struct _Tpm2Response Tpm2Response;
+typedef TSS2_RC (*Tpm2ResponseFunc) (Tpm2Response *response);
+
+struct _Tpm2Response {
     GObject         parent_instance;
     Connection     *connection;
     guint8         *buffer;
     size_t          buffer_size;
+    gboolean        buffer_pooled;
+    /* bytes counted against the connection, see connection_mem_add */
+    size_t          mem_charged;
     TPMA_CC         attributes;
-} Tpm2Response;
+    /*
+     * command the response answers and the monotonic time the RM queued
+     * it for the ResponseSink, 0 for responses the RM didn't send
+     */
+    TPM2_CC         command_code;
+    gint64          time_queued;
+    /*
+     * work on the response buffer that doesn't need the TPM, left to the
+     * ResponseSink thread
+     */
+    Tpm2ResponseFunc post_process;
+};
 
 #define TPM_RESPONSE_HEADER_SIZE (sizeof (TPM2_ST) + sizeof (UINT32) + sizeof (TPM2_RC))
 
@@ -41,6 +58,10 @@ Tpm2Response*       tpm2_response_new           (Connection      *connection,
                                                  guint8          *buffer,
                                                  size_t           buffer_size,
                                                  TPMA_CC          attributes);
+Tpm2Response*       tpm2_response_new_pooled    (Connection      *connection,
+                                                 guint8          *buffer,
+                                                 size_t           buffer_size,
+                                                 TPMA_CC          attributes);
 Tpm2Response*       tpm2_response_new_rc        (Connection      *connection,
                                                  TSS2_RC           rc);
 Tpm2Response* tpm2_response_new_context_save (Connection *connection,
@@ -56,8 +77,17 @@ gboolean            tpm2_response_has_handle    (Tpm2Response    *response);
 guint32             tpm2_response_get_size      (Tpm2Response    *response);
 TPM2_ST              tpm2_response_get_tag       (Tpm2Response    *response);
 Connection*         tpm2_response_get_connection (Tpm2Response    *response);
+Connection*         tpm2_response_peek_connection (Tpm2Response   *response);
+gint64              tpm2_response_get_time_queued (Tpm2Response   *response);
+TPM2_CC             tpm2_response_get_command_code (Tpm2Response  *response);
+void                tpm2_response_set_queued    (Tpm2Response    *response,
+                                                 TPM2_CC          command_code,
+                                                 gint64           time);
 void                tpm2_response_set_handle    (Tpm2Response    *response,
                                                  TPM2_HANDLE       handle);
+void                tpm2_response_set_post_process (Tpm2Response *response,
+                                                    Tpm2ResponseFunc func);
+TSS2_RC             tpm2_response_post_process  (Tpm2Response    *response);
 
 G_END_DECLS
 
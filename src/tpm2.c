@@ -8,8 +8,10 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
+#include <tss2/tss2_mu.h>
 #include <tss2/tss2_rc.h>
 
+#include "probes.h"
 #include "tabrmd.h"
 
 #include "tpm2.h"
@@ -93,14 +95,31 @@ tpm2_dispose (GObject *obj)
     g_clear_object (&self->tcti);
     G_OBJECT_CLASS (tpm2_parent_class)->dispose (obj);
 }
+static void
+tpm2_finalize (GObject *obj)
+{
+    Tpm2 *self = TPM2 (obj);
+
+    g_clear_pointer (&self->exec_time, g_hash_table_unref);
+    g_clear_pointer (&self->recv_buffer, g_free);
+    g_mutex_clear (&self->exec_time_mutex);
+    g_mutex_clear (&self->owner_mutex);
+    g_mutex_clear (&self->cancel_mutex);
+    g_cond_clear (&self->owner_cond);
+    G_OBJECT_CLASS (tpm2_parent_class)->finalize (obj);
+}
 /*
- * G_DEFINE_TYPE requires an instance init even though we don't use it.
+ * Instance init: create the table of command execution time estimates and
+ * the lock for handing the TSS2_SYS_CONTEXT between threads.
  */
 static void
 tpm2_init (Tpm2 *tpm2)
 {
-    UNUSED_PARAM(tpm2);
-    /* noop */
+    g_mutex_init (&tpm2->exec_time_mutex);
+    g_mutex_init (&tpm2->owner_mutex);
+    g_mutex_init (&tpm2->cancel_mutex);
+    g_cond_init (&tpm2->owner_cond);
+    tpm2->exec_time = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 /**
  * GObject class initialization function. This function boils down to:
@@ -116,6 +135,7 @@ tpm2_class_init (Tpm2Class *klass)
     if (tpm2_parent_class == NULL)
         tpm2_parent_class = g_type_class_peek_parent (klass);
     object_class->dispose      = tpm2_dispose;
+    object_class->finalize     = tpm2_finalize;
     object_class->get_property = tpm2_get_property;
     object_class->set_property = tpm2_set_property;
 
@@ -185,74 +205,122 @@ tpm2_send_tpm_startup (Tpm2 *tpm2)
 
     return rc;
 }
+/*
+ * Wait until nobody owns the TSS2_SYS_CONTEXT and take it for the calling
+ * thread. Must be called with the owner_mutex held.
+ */
+static void
+tpm2_acquire_locked (Tpm2 *tpm2)
+{
+    g_atomic_int_inc (&tpm2->waiting);
+    while (tpm2->owner != NULL) {
+        g_cond_wait (&tpm2->owner_cond, &tpm2->owner_mutex);
+    }
+    g_atomic_int_add (&tpm2->waiting, -1);
+    g_atomic_pointer_set (&tpm2->owner, g_thread_self ());
+}
+/*
+ * Make the calling thread the owner of the TSS2_SYS_CONTEXT until it calls
+ * tpm2_release. The owner doesn't take any lock in tpm2_lock and
+ * tpm2_unlock, other threads calling tpm2_lock wait for the owner to let
+ * them have it at its next tpm2_lock or tpm2_yield. The ResourceManager
+ * thread owns its Tpm2 for as long as it runs, the users at startup lock
+ * it for each use before that.
+ */
+void
+tpm2_acquire (Tpm2 *tpm2)
+{
+    assert (tpm2 != NULL);
+
+    g_mutex_lock (&tpm2->owner_mutex);
+    tpm2_acquire_locked (tpm2);
+    g_mutex_unlock (&tpm2->owner_mutex);
+}
+void
+tpm2_release (Tpm2 *tpm2)
+{
+    assert (tpm2 != NULL);
+
+    g_mutex_lock (&tpm2->owner_mutex);
+    g_atomic_pointer_set (&tpm2->owner, NULL);
+    g_cond_broadcast (&tpm2->owner_cond);
+    g_mutex_unlock (&tpm2->owner_mutex);
+}
+/*
+ * Called by the owner between uses of the TSS2_SYS_CONTEXT: if other
+ * threads are waiting for it they get it first, then the owner takes it
+ * back. With nobody waiting this is a single atomic read.
+ */
+void
+tpm2_yield (Tpm2 *tpm2)
+{
+    assert (tpm2 != NULL);
+
+    if (g_atomic_int_get (&tpm2->waiting) == 0) {
+        return;
+    }
+    g_mutex_lock (&tpm2->owner_mutex);
+    g_atomic_pointer_set (&tpm2->owner, NULL);
+    g_cond_broadcast (&tpm2->owner_cond);
+    while (tpm2->waiting > 0 || tpm2->owner != NULL) {
+        g_cond_wait (&tpm2->owner_cond, &tpm2->owner_mutex);
+    }
+    g_atomic_pointer_set (&tpm2->owner, g_thread_self ());
+    g_mutex_unlock (&tpm2->owner_mutex);
+}
 /**
- * This is a very thin wrapper around the mutex mediating access to the
- * TSS2_SYS_CONTEXT. It locks the mutex.
- *
- * NOTE: Any errors locking the mutex are fatal and will cause the program
- * to halt.
+ * Get exclusive use of the TSS2_SYS_CONTEXT. The thread owning the Tpm2
+ * already has it, others wait for the owner to yield it. Only the owner
+ * may read 'owner' and find itself there, so it needs no lock.
  */
 void
 tpm2_lock (Tpm2 *tpm2)
 {
-    gint error;
-
     assert (tpm2 != NULL);
 
-    error = pthread_mutex_lock (&tpm2->sapi_mutex);
-    if (error != 0) {
-        switch (error) {
-        case EINVAL:
-            g_error ("Tpm2: attempted to lock uninitialized mutex");
-            break;
-        default:
-            g_error ("Tpm2: unknown error attempting to lock SAPI "
-                     "mutex: 0x%x", error);
-            break;
-        }
+    if (g_atomic_pointer_get (&tpm2->owner) == g_thread_self ()) {
+        tpm2_yield (tpm2);
+    } else {
+        tpm2_acquire (tpm2);
+        tpm2->borrowed = TRUE;
     }
+    tpm2->locked_at = g_get_monotonic_time ();
 }
 /**
- * This is a very thin wrapper around the mutex mediating access to the
- * TSS2_SYS_CONTEXT. It unlocks the mutex.
- *
- * NOTE: Any errors locking the mutex are fatal and will cause the program
- * to halt.
+ * Done with the TSS2_SYS_CONTEXT for now. Threads that only had it for
+ * this use give it back.
  */
 void
 tpm2_unlock (Tpm2 *tpm2)
 {
-    gint error;
+    gint64 held_us;
 
     assert (tpm2 != NULL);
 
-    error= pthread_mutex_unlock (&tpm2->sapi_mutex);
-    if (error != 0) {
-        switch (error) {
-        case EINVAL:
-            g_error ("Tpm2: attempted to unlock uninitialized mutex");
-            break;
-        default:
-            g_error ("Tpm2: unknown error attempting to unlock SAPI "
-                     "mutex: 0x%x", error);
-            break;
-        }
+    held_us = g_get_monotonic_time () - tpm2->locked_at;
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    tpm2->busy_us += MAX (held_us, 0);
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+    if (tpm2->borrowed) {
+        tpm2->borrowed = FALSE;
+        tpm2_release (tpm2);
     }
 }
 /**
  * Query the TPM for fixed (TPM2_PT_FIXED) TPM properties.
  * This function is intended for internal use only. The caller MUST
- * hold the sapi_mutex lock before calling.
+ * hold the Tpm2 lock before calling.
  */
 TSS2_RC
 tpm2_get_tpm_properties_fixed (TSS2_SYS_CONTEXT     *sapi_context,
-                                        TPMS_CAPABILITY_DATA *capability_data)
+                                        TPMS_CAPABILITY_DATA *capability_data,
+                                        TPMI_YES_NO          *more_data)
 {
     TSS2_RC          rc;
-    TPMI_YES_NO      more_data;
 
     assert (sapi_context != NULL);
     assert (capability_data != NULL);
+    assert (more_data != NULL);
 
     g_debug ("tpm2_get_tpm_properties_fixed");
     rc = Tss2_Sys_GetCapability (sapi_context,
@@ -262,7 +330,7 @@ tpm2_get_tpm_properties_fixed (TSS2_SYS_CONTEXT     *sapi_context,
                                  TPM2_PT_FIXED,
                                  /* get all properties in the group */
                                  TPM2_MAX_TPM_PROPERTIES,
-                                 &more_data,
+                                 more_data,
                                  capability_data,
                                  NULL);
     if (rc != TSS2_RC_SUCCESS) {
@@ -331,40 +399,206 @@ tpm2_get_max_response (Tpm2 *tpm2,
                                              value);
 }
 /*
- * Get a response buffer from the TPM. Return the TSS2_RC through the
- * 'rc' parameter. Returns a buffer (that must be freed by the caller)
- * containing the response from the TPM. Determine the size of the buffer
- * by reading the size field from the TPM command header.
+ * Run the Tpm2WaitFunc at most every 'TPM2_RECEIVE_POLL_MS' while the TPM
+ * executes a command. It must not use the Tpm2: the commands sent to the
+ * TPM stay strictly one at a time. It's only run on the thread owning the
+ * Tpm2 since that's the one it was set up for.
+ */
+void
+tpm2_set_wait_func (Tpm2         *tpm2,
+                    Tpm2WaitFunc  func,
+                    gpointer      user_data)
+{
+    assert (tpm2 != NULL);
+
+    tpm2->wait_func = func;
+    tpm2->wait_data = user_data;
+}
+static int32_t
+tpm2_receive_timeout (Tpm2 *tpm2)
+{
+    if (tpm2->wait_func == NULL || tpm2->receive_blocking ||
+        tpm2->borrowed ||
+        g_atomic_pointer_get (&tpm2->owner) != g_thread_self ())
+    {
+        return TSS2_TCTI_TIMEOUT_BLOCK;
+    }
+    return TPM2_RECEIVE_POLL_MS;
+}
+guint8
+tpm2_get_locality (Tpm2 *tpm2)
+{
+    assert (tpm2 != NULL);
+
+    return tpm2->locality;
+}
+/*
+ * Have the TCTI send the next commands at the provided locality. The TCTI
+ * is only asked when the locality changes. The caller must hold the lock.
  */
 static TSS2_RC
-tpm2_get_response (Tpm2 *tpm2,
-                            uint8_t     **buffer,
-                            size_t       *buffer_size)
+tpm2_switch_locality (Tpm2   *tpm2,
+                      guint8  locality)
+{
+    TSS2_RC rc;
+
+    if (locality == tpm2->locality) {
+        return TSS2_RC_SUCCESS;
+    }
+    g_debug ("%s: locality %" PRIu8 " to %" PRIu8, __func__,
+             tpm2->locality, locality);
+    rc = tcti_set_locality (tpm2->tcti, locality);
+    if (rc == TSS2_RC_SUCCESS) {
+        tpm2->locality = locality;
+    }
+    return rc;
+}
+/*
+ * Load a new TCTI context after the TPM stopped answering and a SAPI
+ * context to go with it. The old SAPI context is kept if the TCTI can't
+ * be reset. The caller must hold the lock. The TCTI context is replaced
+ * under the cancel_mutex as well: tpm2_cancel is called from other
+ * threads and must not use the context being finalized.
+ */
+static void
+tpm2_reset_tcti (Tpm2 *tpm2)
+{
+    TSS2_SYS_CONTEXT *sapi_context = NULL;
+    TSS2_RC rc;
+
+    g_mutex_lock (&tpm2->cancel_mutex);
+    rc = tcti_reset (tpm2->tcti);
+    g_mutex_unlock (&tpm2->cancel_mutex);
+    if (rc == TSS2_TCTI_RC_NOT_IMPLEMENTED) {
+        g_info ("%s: TCTI can't be reset, keeping it", __func__);
+        return;
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        sapi_context = sapi_context_init (tpm2->tcti);
+    }
+    if (tpm2->sapi_context != NULL) {
+        Tss2_Sys_Finalize (tpm2->sapi_context);
+        g_free (tpm2->sapi_context);
+    }
+    tpm2->sapi_context = sapi_context;
+    tpm2->locality = 0;
+    tpm2->receive_blocking = FALSE;
+    if (sapi_context == NULL) {
+        g_critical ("%s: failed to reset the TCTI, commands will fail until "
+                    "it can be", __func__);
+    } else {
+        g_info ("%s: TCTI reset", __func__);
+    }
+}
+/*
+ * The TPM hasn't answered the command it executes by its deadline. It's
+ * asked to cancel the command and has TPM2_CANCEL_GRACE_MS to answer,
+ * most likely with TPM2_RC_CANCELED; the response is passed on if it does.
+ * If it doesn't the TCTI is reset so the next command starts from a clean
+ * slate and the command gets TPM2_RC_CANCELED from the RM layer.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_handle_timeout (Tpm2    *tpm2,
+                     size_t  *buffer_size,
+                     guint32  max_size)
+{
+    TSS2_RC rc;
+
+    g_atomic_int_inc (&tpm2->timeouts);
+    tcti_cancel (tpm2->tcti);
+    *buffer_size = max_size;
+    rc = tcti_receive (tpm2->tcti,
+                       buffer_size,
+                       tpm2->recv_buffer,
+                       TPM2_CANCEL_GRACE_MS);
+    if (rc == TSS2_RC_SUCCESS) {
+        g_info ("%s: TPM answered the cancel", __func__);
+        return rc;
+    }
+    g_warning ("%s: TPM didn't answer the cancel in %u ms, resetting the "
+               "TCTI", __func__, TPM2_CANCEL_GRACE_MS);
+    tpm2_reset_tcti (tpm2);
+    return RM_RC (TPM2_RC_CANCELED);
+}
+/*
+ * Receive a response from the TPM into the receive buffer kept by the
+ * Tpm2 object, sized for the maximum response. The size received is
+ * returned through 'buffer_size', the response is only valid until the
+ * next command is sent.
+ * With a Tpm2WaitFunc the TCTI is polled and the function run between
+ * polls until the response is there, or until the monotonic time
+ * 'deadline' if it isn't 0.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_receive (Tpm2   *tpm2,
+              gint64  deadline,
+              size_t *buffer_size)
 {
     TSS2_RC rc;
     guint32 max_size;
 
     assert (tpm2 != NULL);
-    assert (buffer != NULL);
     assert (buffer_size != NULL);
 
     rc = tpm2_get_max_response (tpm2, &max_size);
     if (rc != TSS2_RC_SUCCESS)
         return rc;
 
-    *buffer = calloc (1, max_size);
-    if (*buffer == NULL) {
-        g_warning ("failed to allocate buffer for Tpm2Response: %s",
-                   strerror (errno));
-        return RM_RC (TPM2_RC_MEMORY);
+    if (tpm2->recv_buffer_size < max_size) {
+        g_free (tpm2->recv_buffer);
+        tpm2->recv_buffer = g_malloc (max_size);
+        tpm2->recv_buffer_size = max_size;
     }
-    *buffer_size = max_size;
-    rc = tcti_receive (tpm2->tcti, buffer_size, *buffer, TSS2_TCTI_TIMEOUT_BLOCK);
+    do {
+        *buffer_size = max_size;
+        rc = tcti_receive (tpm2->tcti,
+                           buffer_size,
+                           tpm2->recv_buffer,
+                           tpm2_receive_timeout (tpm2));
+        if (rc == TSS2_TCTI_RC_TRY_AGAIN && deadline != 0 &&
+            g_get_monotonic_time () >= deadline)
+        {
+            rc = tpm2_handle_timeout (tpm2, buffer_size, max_size);
+        } else if (rc == TSS2_TCTI_RC_TRY_AGAIN && tpm2->wait_func != NULL) {
+            tpm2->wait_func (tpm2->wait_data);
+        } else if (rc == TSS2_TCTI_RC_BAD_VALUE &&
+                   tpm2_receive_timeout (tpm2) != TSS2_TCTI_TIMEOUT_BLOCK)
+        {
+            g_info ("%s: TCTI doesn't take a receive timeout, blocking",
+                    __func__);
+            tpm2->receive_blocking = TRUE;
+            rc = TSS2_TCTI_RC_TRY_AGAIN;
+        }
+    } while (rc == TSS2_TCTI_RC_TRY_AGAIN);
+
+    return rc;
+}
+/*
+ * Get a response buffer from the TPM. Return the TSS2_RC through the
+ * 'rc' parameter. Returns a buffer from the buffer pool (that must be given
+ * back with util_buf_put by the caller) containing the response from the
+ * TPM. The response is received with tpm2_receive so only the bytes
+ * actually received are copied.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_get_response (Tpm2 *tpm2,
+                            gint64        deadline,
+                            uint8_t     **buffer,
+                            size_t       *buffer_size)
+{
+    TSS2_RC rc;
+
+    assert (buffer != NULL);
+
+    rc = tpm2_receive (tpm2, deadline, buffer_size);
     if (rc != TSS2_RC_SUCCESS) {
-        free (*buffer);
         return rc;
     }
-    *buffer = realloc (*buffer, *buffer_size);
+    *buffer = util_buf_get (*buffer_size);
+    memcpy (*buffer, tpm2->recv_buffer, *buffer_size);
 
     return rc;
 }
@@ -372,7 +606,8 @@ tpm2_get_response (Tpm2 *tpm2,
  * In the most simple case the caller will want to send just a single
  * command represented by a Tpm2Command object. The response is passed
  * back as the return value. The response code from the TCTI (not the TPM)
- * is returned through the 'rc' out parameter.
+ * is returned through the 'rc' out parameter. Commands from a connection
+ * are sent at the locality of the connection.
  * The caller MUST NOT hold the lock when calling. This function will take
  * the lock for itself.
  * Additionally this function *WILL ONLY* return a NULL Tpm2Response
@@ -386,9 +621,10 @@ tpm2_send_command (Tpm2  *tpm2,
                             TSS2_RC       *rc)
 {
     Tpm2Response   *response = NULL;
-    Connection     *connection = NULL;
+    Connection     *connection;
     guint8         *buffer = NULL;
     size_t          buffer_size = 0;
+    gint64          start, deadline = 0;
 
     g_debug (__func__);
     assert (tpm2 != NULL);
@@ -396,32 +632,257 @@ tpm2_send_command (Tpm2  *tpm2,
     assert (rc != NULL);
 
     tpm2_lock (tpm2);
+    if (tpm2->sapi_context == NULL) {
+        tpm2_reset_tcti (tpm2);
+    }
+    connection = tpm2_command_peek_connection (command);
+    if (connection != NULL) {
+        *rc = tpm2_switch_locality (tpm2, connection_get_locality (connection));
+        if (*rc != TSS2_RC_SUCCESS) {
+            goto unlock_out;
+        }
+    }
+    TABRMD_PROBE3 (tpm_send,
+                   tpm2_command_peek_connection (command),
+                   tpm2_command_get_code (command),
+                   tpm2_command_get_size (command));
+    start = g_get_monotonic_time ();
+    /* only a client's own command may be canceled, see tpm2_cancel */
+    if (connection != NULL) {
+        tpm2_set_executing (tpm2, connection);
+    }
     *rc = tcti_transmit (tpm2->tcti,
                          tpm2_command_get_size (command),
                          tpm2_command_get_buffer (command));
-    if (*rc != TSS2_RC_SUCCESS)
+    if (*rc != TSS2_RC_SUCCESS) {
+        tpm2_set_executing (tpm2, NULL);
         goto unlock_out;
-    *rc = tpm2_get_response (tpm2, &buffer, &buffer_size);
+    }
+    if (g_atomic_int_get (&tpm2->timeout_scale) > 0 &&
+        tpm2_receive_timeout (tpm2) != TSS2_TCTI_TIMEOUT_BLOCK)
+    {
+        deadline = start + tpm2_get_timeout_us (tpm2,
+                                                tpm2_command_get_code (command));
+    }
+    *rc = tpm2_get_response (tpm2, deadline, &buffer, &buffer_size);
+    tpm2_set_executing (tpm2, NULL);
     if (*rc != TSS2_RC_SUCCESS) {
         goto unlock_out;
     }
+    TABRMD_PROBE3 (tpm_return,
+                   tpm2_command_peek_connection (command),
+                   tpm2_command_get_code (command),
+                   buffer_size >= TPM_HEADER_SIZE ?
+                   get_response_code (buffer) : TSS2_RC_SUCCESS);
+    g_atomic_int_set (&tpm2->failures, 0);
     tpm2_unlock (tpm2);
-    connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new (connection,
-                                  buffer,
-                                  buffer_size,
-                                  tpm2_command_get_attributes (command));
-    g_clear_object (&connection);
+    tpm2_note_exec_time (tpm2,
+                         tpm2_command_get_code (command),
+                         g_get_monotonic_time () - start);
+    response = tpm2_response_new_pooled (tpm2_command_peek_connection (command),
+                                         buffer,
+                                         buffer_size,
+                                         tpm2_command_get_attributes (command));
     return response;
 
 unlock_out:
+    TABRMD_PROBE3 (tpm_return,
+                   tpm2_command_peek_connection (command),
+                   tpm2_command_get_code (command),
+                   *rc);
+    g_atomic_int_inc (&tpm2->failures);
     tpm2_unlock (tpm2);
-    if (!connection)
-        connection = tpm2_command_get_connection (command);
-    response = tpm2_response_new_rc (connection, *rc);
-    g_object_unref (connection);
+    response = tpm2_response_new_rc (tpm2_command_peek_connection (command),
+                                     *rc);
     return response;
 }
+/*
+ * Record what the TPM is about to execute commands for, the Connection
+ * for a command from a client, and NULL once it's done. tpm2_cancel only
+ * cancels a command while it's still being executed for the same 'tag'.
+ * tpm2_send_command does this itself around the commands of clients.
+ * Callers only do it for the commands we send on behalf of a client, like
+ * those of the hash sequence and NV vendor commands, never for our own.
+ */
+void
+tpm2_set_executing (Tpm2          *tpm2,
+                    gconstpointer  tag)
+{
+    g_mutex_lock (&tpm2->cancel_mutex);
+    tpm2->executing = tag;
+    g_mutex_unlock (&tpm2->cancel_mutex);
+}
+/*
+ * Cancel the command currently being executed by the TPM if it's being
+ * executed for 'tag', see tpm2_set_executing. This doesn't take the SAPI
+ * lock since that's held by the thread waiting for the response to the
+ * command being canceled. The check and the cancel are done under the
+ * cancel_mutex: the command can't complete and the next one start in
+ * between.
+ */
+TSS2_RC
+tpm2_cancel (Tpm2          *tpm2,
+             gconstpointer  tag)
+{
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    g_mutex_lock (&tpm2->cancel_mutex);
+    if (tag != NULL && tpm2->executing == tag) {
+        g_debug ("%s: canceling command", __func__);
+        rc = tcti_cancel (tpm2->tcti);
+    } else {
+        g_debug ("%s: no command to cancel", __func__);
+    }
+    g_mutex_unlock (&tpm2->cancel_mutex);
+    return rc;
+}
+/*
+ * Add a sample to the execution time estimate for the provided command
+ * code. Estimates are kept in microseconds and saturate at G_MAXUINT32.
+ */
+void
+tpm2_note_exec_time (Tpm2    *tpm2,
+                     TPM2_CC  command_code,
+                     guint64  time_us)
+{
+    gpointer value;
+    gint64 estimate;
+
+    time_us = MIN (time_us, G_MAXUINT32);
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    if (g_hash_table_lookup_extended (tpm2->exec_time,
+                                      GUINT_TO_POINTER (command_code),
+                                      NULL,
+                                      &value))
+    {
+        estimate = GPOINTER_TO_UINT (value);
+        estimate += ((gint64)time_us - estimate) / (1 << EXEC_TIME_EWMA_SHIFT);
+    } else {
+        estimate = time_us;
+    }
+    g_hash_table_insert (tpm2->exec_time,
+                         GUINT_TO_POINTER (command_code),
+                         GUINT_TO_POINTER ((guint)estimate));
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+}
+/*
+ * Returns the time in microseconds the TPM has been in use, for the
+ * utilization metric: we hold the Tpm2 lock only around exchanges with
+ * the TPM.
+ */
+guint64
+tpm2_get_busy_us (Tpm2 *tpm2)
+{
+    guint64 busy_us;
+
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    busy_us = tpm2->busy_us;
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+    return busy_us;
+}
+/*
+ * Get the expected execution time in microseconds for the provided command
+ * code. EXEC_TIME_DEFAULT_US is returned for commands that haven't been
+ * executed yet.
+ */
+guint64
+tpm2_get_exec_estimate (Tpm2    *tpm2,
+                        TPM2_CC  command_code)
+{
+    gpointer value;
+    guint64 estimate = EXEC_TIME_DEFAULT_US;
+
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    if (g_hash_table_lookup_extended (tpm2->exec_time,
+                                      GUINT_TO_POINTER (command_code),
+                                      NULL,
+                                      &value))
+    {
+        estimate = GPOINTER_TO_UINT (value);
+    }
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+
+    return estimate;
+}
+/*
+ * Commands taking longer than 'scale' times their usual time, and longer
+ * than the time for their class, are canceled. 0 lets commands take as
+ * long as they take. Only commands sent by the owner of the Tpm2 while it
+ * polls the TCTI can time out.
+ */
+void
+tpm2_set_timeout_scale (Tpm2  *tpm2,
+                        guint  scale)
+{
+    assert (tpm2 != NULL);
+
+    g_atomic_int_set (&tpm2->timeout_scale, scale);
+}
+/*
+ * The class of the command from the TCG timing guidance, as its duration
+ * in milliseconds.
+ */
+static guint
+tpm2_command_duration_ms (TPM2_CC command_code)
+{
+    switch (command_code) {
+    case TPM2_CC_Startup:
+    case TPM2_CC_ContextLoad:
+    case TPM2_CC_ContextSave:
+    case TPM2_CC_FlushContext:
+    case TPM2_CC_PCR_Read:
+    case TPM2_CC_ReadClock:
+        return TPM2_DURATION_SHORT_MS;
+    case TPM2_CC_GetCapability:
+    case TPM2_CC_PCR_Extend:
+    case TPM2_CC_ReadPublic:
+        return TPM2_DURATION_MEDIUM_MS;
+    case TPM2_CC_Create:
+    case TPM2_CC_CreateLoaded:
+    case TPM2_CC_CreatePrimary:
+    case TPM2_CC_ChangeEPS:
+    case TPM2_CC_ChangePPS:
+    case TPM2_CC_Clear:
+    case TPM2_CC_SelfTest:
+        return TPM2_DURATION_LONG_LONG_MS;
+    default:
+        return TPM2_DURATION_LONG_MS;
+    }
+}
+/*
+ * How long the TPM may take for a command before it's canceled, in
+ * microseconds: the duration of its class or its usual time times the
+ * timeout scale, whichever is longer.
+ */
+guint64
+tpm2_get_timeout_us (Tpm2    *tpm2,
+                     TPM2_CC  command_code)
+{
+    guint64 timeout;
+
+    timeout = MAX (tpm2_command_duration_ms (command_code),
+                   TPM2_TIMEOUT_MIN_MS) * G_TIME_SPAN_MILLISECOND;
+    return MAX (timeout,
+                tpm2_get_exec_estimate (tpm2, command_code) *
+                (guint)g_atomic_int_get (&tpm2->timeout_scale));
+}
+/*
+ * The number of commands that timed out, for the metrics.
+ */
+guint
+tpm2_get_timeouts (Tpm2 *tpm2)
+{
+    return g_atomic_int_get (&tpm2->timeouts);
+}
+/*
+ * TRUE once the TCTI failed TPM2_FAILURES_MAX commands in a row, or the
+ * TPM has them time out. The next command that gets through clears it.
+ */
+gboolean
+tpm2_is_failing (Tpm2 *tpm2)
+{
+    return (guint)g_atomic_int_get (&tpm2->failures) >= TPM2_FAILURES_MAX;
+}
 /**
  * Create new TPM access tpm2 (TPM2) object. This includes
  * using the provided TCTI to send the TPM the startup command and
@@ -454,156 +915,1288 @@ TSS2_RC
 tpm2_init_tpm (Tpm2 *tpm2)
 {
     TSS2_RC rc;
+    TPMI_YES_NO more_data = TPM2_YES;
+    TPML_TAGGED_TPM_PROPERTY *props;
 
     g_debug (__func__);
     assert (tpm2 != NULL);
 
     if (tpm2->initialized)
         return TSS2_RC_SUCCESS;
-    pthread_mutex_init (&tpm2->sapi_mutex, NULL);
     rc = tpm2_send_tpm_startup (tpm2);
     if (rc != TSS2_RC_SUCCESS)
         goto out;
+    if (tpm2->from_cache) {
+        tpm2->initialized = true;
+        goto out;
+    }
     rc = tpm2_get_tpm_properties_fixed (tpm2->sapi_context,
-                                                 &tpm2->properties_fixed);
+                                                 &tpm2->properties_fixed,
+                                                 &more_data);
     if (rc != TSS2_RC_SUCCESS)
         goto out;
+    /*
+     * The fixed property group is only usable as a snapshot if the TPM
+     * returned all of it: either there's nothing more to get or the
+     * response already spilled over into the TPM2_PT_VAR group.
+     */
+    props = &tpm2->properties_fixed.data.tpmProperties;
+    if (more_data == TPM2_NO ||
+        (props->count > 0 &&
+         props->tpmProperty [props->count - 1].property >= TPM2_PT_VAR))
+    {
+        tpm2->caps_fixed |= CAP_FIXED_BIT (TPM2_CAP_TPM_PROPERTIES);
+    }
     tpm2->initialized = true;
 out:
     return rc;
 }
 /*
- * Query the TPM for the current number of loaded transient objects.
+ * Query the TPM for a single capability and store the result in the
+ * 'cap_data' parameter. If the TPM returned the whole capability in one
+ * response the bit for this capability is set in the 'caps_fixed' mask.
+ * The caller MUST hold the Tpm2 lock before calling.
  */
- TSS2_RC
-tpm2_get_trans_object_count (Tpm2 *tpm2,
-                                      uint32_t     *count)
+static TSS2_RC
+tpm2_get_cap_snapshot (Tpm2                 *tpm2,
+                       TPM2_CAP              cap,
+                       UINT32                first,
+                       UINT32                count,
+                       TPMS_CAPABILITY_DATA *cap_data,
+                       guint32              *caps_fixed)
 {
-    TSS2_RC rc = TSS2_RC_SUCCESS;
-    TSS2_SYS_CONTEXT *sapi_context;
-    TPMI_YES_NO more_data;
-    TPMS_CAPABILITY_DATA capability_data = { 0, };
-
-    assert (tpm2 != NULL);
-    assert (count != NULL);
+    TSS2_RC rc;
+    TPMI_YES_NO more_data = TPM2_YES;
 
-    sapi_context = tpm2_lock_sapi (tpm2);
-    /*
-     * GCC gets confused by the TPM2_TRANSIENT_FIRST constant being used for
-     * the 4th parameter. It assumes that it's a signed type which causes
-     * -Wsign-conversion to complain. Casting to UINT32 is all we can do.
-     */
-    rc = Tss2_Sys_GetCapability (sapi_context,
+    rc = Tss2_Sys_GetCapability (tpm2->sapi_context,
                                  NULL,
-                                 TPM2_CAP_HANDLES,
-                                 (UINT32)TPM2_TRANSIENT_FIRST,
-                                 TPM2_TRANSIENT_LAST - TPM2_TRANSIENT_FIRST,
+                                 cap,
+                                 first,
+                                 count,
                                  &more_data,
-                                 &capability_data,
+                                 cap_data,
                                  NULL);
     if (rc != TSS2_RC_SUCCESS) {
         RC_WARN ("Tss2_Sys_GetCapability", rc);
-        goto out;
+        return rc;
+    }
+    if (cap_data->capability != cap) {
+        g_warning ("%s: GetCapability returned wrong capability: 0x%"
+                   PRIx32, __func__, cap_data->capability);
+        return TSS2_RESMGR_RC_INTERNAL_ERROR;
+    }
+    if (more_data == TPM2_NO) {
+        *caps_fixed |= CAP_FIXED_BIT (cap);
+    } else {
+        g_info ("%s: capability 0x%" PRIx32 " doesn't fit in a single "
+                "response, not caching it", __func__, cap);
     }
-    *count = capability_data.data.handles.count;
-out:
-    tpm2_unlock (tpm2);
     return rc;
 }
+/*
+ * Take a snapshot of the capabilities that can't change while the TPM is
+ * running: the supported algorithms, commands and ECC curves. The
+ * ResourceManager uses these to answer GetCapability queries without a
+ * round-trip to the TPM. A failure here isn't fatal: capabilities that we
+ * failed to capture are simply passed through to the TPM.
+ */
 TSS2_RC
-tpm2_context_load (Tpm2 *tpm2,
-                            TPMS_CONTEXT *context,
-                            TPM2_HANDLE   *handle)
+tpm2_init_caps_fixed (Tpm2 *tpm2)
 {
-    TSS2_RC           rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc, rc_tmp;
 
     assert (tpm2 != NULL);
-    assert (context != NULL);
-    assert (handle != NULL);
 
-    sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextLoad (sapi_context, context, handle);
-    tpm2_unlock (tpm2);
-    if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextLoad", rc);
+    if (tpm2->from_cache) {
+        return TSS2_RC_SUCCESS;
+    }
+    tpm2_lock (tpm2);
+    rc = tpm2_get_cap_snapshot (tpm2,
+                                TPM2_CAP_ALGS,
+                                TPM2_ALG_FIRST,
+                                TPM2_MAX_CAP_ALGS,
+                                &tpm2->algorithms,
+                                &tpm2->caps_fixed);
+    rc_tmp = tpm2_get_cap_snapshot (tpm2,
+                                    TPM2_CAP_COMMANDS,
+                                    TPM2_CC_FIRST,
+                                    TPM2_MAX_CAP_CC,
+                                    &tpm2->commands,
+                                    &tpm2->caps_fixed);
+    if (rc_tmp != TSS2_RC_SUCCESS) {
+        rc = rc_tmp;
+    }
+    rc_tmp = tpm2_get_cap_snapshot (tpm2,
+                                    TPM2_CAP_ECC_CURVES,
+                                    TPM2_ECC_NONE,
+                                    TPM2_MAX_ECC_CURVES,
+                                    &tpm2->ecc_curves,
+                                    &tpm2->caps_fixed);
+    if (rc_tmp != TSS2_RC_SUCCESS) {
+        rc = rc_tmp;
     }
+    tpm2_unlock (tpm2);
 
     return rc;
 }
 /*
- * This function is a simple wrapper around the TPM2_ContextSave command.
- * It will save the context associated with the provided handle, returning
- * the TPMS_CONTEXT to the caller. The response code returned will be
- * TSS2_RC_SUCCESS or an RC indicating failure from the TPM.
+ * Layout of the capability cache file: this header, followed by the
+ * 'key_size' bytes of the key. The data is only ever read back on the
+ * host that wrote it so it's stored in host byte order as is.
  */
-TSS2_RC
-tpm2_context_save (Tpm2 *tpm2,
-                            TPM2_HANDLE    handle,
-                            TPMS_CONTEXT *context)
+typedef struct {
+    guint32                 magic;
+    guint32                 version;
+    guint32                 size;
+    guint32                 key_size;
+    guint32                 caps_fixed;
+    TPMS_CAPABILITY_DATA    properties_fixed;
+    TPMS_CAPABILITY_DATA    algorithms;
+    TPMS_CAPABILITY_DATA    commands;
+    TPMS_CAPABILITY_DATA    ecc_curves;
+} tpm2_cache_t;
+/*
+ * Fill in the capability cache for 'tpm2' from the file at 'path'. The
+ * cache is only used if it was written by the same version of tabrmd for
+ * the same 'key', usually the TCTI conf of the TPM. Once loaded the
+ * queries for the fixed properties and capabilities are skipped by
+ * tpm2_init_tpm and tpm2_init_caps_fixed, tpm2_cache_verify should be
+ * called once the daemon is up to check the cache against the TPM.
+ * Returns TRUE if the cache was loaded.
+ */
+gboolean
+tpm2_cache_load (Tpm2        *tpm2,
+                 const gchar *path,
+                 const gchar *key)
 {
-    TSS2_RC rc;
-    TSS2_SYS_CONTEXT *sapi_context;
+    tpm2_cache_t *cache;
+    gchar *contents = NULL;
+    gsize size = 0, key_size = strlen (key);
+    GError *error = NULL;
+    gboolean ret = FALSE;
 
     assert (tpm2 != NULL);
-    assert (context != NULL);
+    assert (path != NULL);
+    assert (key != NULL);
 
-    g_debug ("tpm2_context_save: handle 0x%08" PRIx32, handle);
-    sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
-    if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextSave", rc);
+    if (!g_file_get_contents (path, &contents, &size, &error)) {
+        g_debug ("%s: no capability cache: %s", __func__, error->message);
+        g_error_free (error);
+        return FALSE;
     }
-    tpm2_unlock (tpm2);
-
-    return rc;
+    cache = (tpm2_cache_t*)contents;
+    if (size != sizeof (*cache) + key_size ||
+        cache->magic != TPM2_CACHE_MAGIC ||
+        cache->version != TPM2_CACHE_VERSION ||
+        cache->size != sizeof (*cache) ||
+        cache->key_size != key_size ||
+        memcmp (&contents [sizeof (*cache)], key, key_size) != 0)
+    {
+        g_info ("%s: capability cache %s doesn't match, ignoring it",
+                __func__, path);
+        goto out;
+    }
+    tpm2->properties_fixed = cache->properties_fixed;
+    tpm2->algorithms = cache->algorithms;
+    tpm2->commands = cache->commands;
+    tpm2->ecc_curves = cache->ecc_curves;
+    tpm2->caps_fixed = cache->caps_fixed;
+    tpm2->from_cache = TRUE;
+    g_info ("%s: using capability cache %s", __func__, path);
+    ret = TRUE;
+out:
+    g_free (contents);
+    return ret;
 }
 /*
- * This function is a simple wrapper around the TPM2_FlushContext command.
+ * Write 'data' to the cache file at 'path' under 'key', filling in the
+ * header fields. The file is replaced atomically.
  */
-TSS2_RC
-tpm2_context_flush (Tpm2 *tpm2,
-                             TPM2_HANDLE    handle)
+static gboolean
+tpm2_cache_write (tpm2_cache_t *data,
+                  const gchar  *path,
+                  const gchar  *key)
 {
-    TSS2_RC rc;
+    GByteArray *array;
+    GError *error = NULL;
+    gboolean ret;
+
+    data->magic = TPM2_CACHE_MAGIC;
+    data->version = TPM2_CACHE_VERSION;
+    data->size = sizeof (*data);
+    data->key_size = strlen (key);
+    array = g_byte_array_sized_new (sizeof (*data) + data->key_size);
+    g_byte_array_append (array, (guint8*)data, sizeof (*data));
+    g_byte_array_append (array, (const guint8*)key, data->key_size);
+    ret = g_file_set_contents (path,
+                               (const gchar*)array->data,
+                               array->len,
+                               &error);
+    if (!ret) {
+        g_warning ("%s: failed to write capability cache: %s", __func__,
+                   error->message);
+        g_error_free (error);
+    }
+    g_byte_array_free (array, TRUE);
+    return ret;
+}
+/*
+ * Write the properties and capabilities captured from the TPM by
+ * tpm2_init_tpm and tpm2_init_caps_fixed to the cache file at 'path'.
+ */
+gboolean
+tpm2_cache_save (Tpm2        *tpm2,
+                 const gchar *path,
+                 const gchar *key)
+{
+    tpm2_cache_t cache = { 0, };
+
+    assert (tpm2 != NULL);
+    assert (path != NULL);
+    assert (key != NULL);
+
+    cache.caps_fixed = tpm2->caps_fixed;
+    cache.properties_fixed = tpm2->properties_fixed;
+    cache.algorithms = tpm2->algorithms;
+    cache.commands = tpm2->commands;
+    cache.ecc_curves = tpm2->ecc_curves;
+    return tpm2_cache_write (&cache, path, key);
+}
+/*
+ * Check the data loaded by tpm2_cache_load against the TPM. This runs
+ * the queries skipped at startup, so it's meant to be called in the
+ * background once the daemon is serving clients. If the TPM disagrees
+ * with the cache, the cache file is rewritten and we stop answering
+ * GetCapability from the snapshot. Other users of the cached data, like
+ * the command attributes, keep it until the daemon is restarted.
+ * Returns TRUE if the cache matched.
+ */
+gboolean
+tpm2_cache_verify (Tpm2        *tpm2,
+                   const gchar *path,
+                   const gchar *key)
+{
+    tpm2_cache_t live = { 0, };
+    TPML_TAGGED_TPM_PROPERTY *props = &live.properties_fixed.data.tpmProperties;
+    TPMI_YES_NO more_data = TPM2_YES;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (path != NULL);
+    assert (key != NULL);
+
+    if (!tpm2->from_cache) {
+        return TRUE;
+    }
+    tpm2_lock (tpm2);
+    rc = tpm2_get_tpm_properties_fixed (tpm2->sapi_context,
+                                        &live.properties_fixed,
+                                        &more_data);
+    if (rc == TSS2_RC_SUCCESS &&
+        (more_data == TPM2_NO ||
+         (props->count > 0 &&
+          props->tpmProperty [props->count - 1].property >= TPM2_PT_VAR)))
+    {
+        live.caps_fixed |= CAP_FIXED_BIT (TPM2_CAP_TPM_PROPERTIES);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_get_cap_snapshot (tpm2,
+                                    TPM2_CAP_ALGS,
+                                    TPM2_ALG_FIRST,
+                                    TPM2_MAX_CAP_ALGS,
+                                    &live.algorithms,
+                                    &live.caps_fixed);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_get_cap_snapshot (tpm2,
+                                    TPM2_CAP_COMMANDS,
+                                    TPM2_CC_FIRST,
+                                    TPM2_MAX_CAP_CC,
+                                    &live.commands,
+                                    &live.caps_fixed);
+    }
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_get_cap_snapshot (tpm2,
+                                    TPM2_CAP_ECC_CURVES,
+                                    TPM2_ECC_NONE,
+                                    TPM2_MAX_ECC_CURVES,
+                                    &live.ecc_curves,
+                                    &live.caps_fixed);
+    }
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("%s: failed to query the TPM, can't verify the "
+                   "capability cache: 0x%" PRIx32, __func__, rc);
+        return FALSE;
+    }
+    if (live.caps_fixed == tpm2->caps_fixed &&
+        memcmp (&live.properties_fixed,
+                &tpm2->properties_fixed,
+                sizeof (live.properties_fixed)) == 0 &&
+        memcmp (&live.algorithms,
+                &tpm2->algorithms,
+                sizeof (live.algorithms)) == 0 &&
+        memcmp (&live.commands,
+                &tpm2->commands,
+                sizeof (live.commands)) == 0 &&
+        memcmp (&live.ecc_curves,
+                &tpm2->ecc_curves,
+                sizeof (live.ecc_curves)) == 0)
+    {
+        g_debug ("%s: capability cache %s is up to date", __func__, path);
+        return TRUE;
+    }
+    g_warning ("%s: capability cache %s is stale, the TPM manufacturer, "
+               "firmware or configuration changed. Restart the daemon to "
+               "use the new data.", __func__, path);
+    g_atomic_int_set ((gint*)&tpm2->caps_fixed, 0);
+    tpm2_cache_write (&live, path, key);
+    return FALSE;
+}
+/*
+ * Get the snapshot of a fixed capability taken at startup. If we don't
+ * have a complete snapshot of the requested capability NULL is returned
+ * and the caller must get the data from the TPM.
+ */
+TPMS_CAPABILITY_DATA*
+tpm2_get_fixed_capability (Tpm2    *tpm2,
+                           TPM2_CAP cap)
+{
+    assert (tpm2 != NULL);
+
+    if (cap > TPM2_CAP_ECC_CURVES || !(tpm2->caps_fixed & CAP_FIXED_BIT (cap)))
+        return NULL;
+
+    switch (cap) {
+    case TPM2_CAP_ALGS:
+        return &tpm2->algorithms;
+    case TPM2_CAP_COMMANDS:
+        return &tpm2->commands;
+    case TPM2_CAP_ECC_CURVES:
+        return &tpm2->ecc_curves;
+    case TPM2_CAP_TPM_PROPERTIES:
+        return &tpm2->properties_fixed;
+    default:
+        return NULL;
+    }
+}
+/*
+ * Query the TPM for the current number of loaded transient objects.
+ */
+ TSS2_RC
+tpm2_get_trans_object_count (Tpm2 *tpm2,
+                                      uint32_t     *count)
+{
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPMI_YES_NO more_data;
+    TPMS_CAPABILITY_DATA capability_data = { 0, };
+
+    assert (tpm2 != NULL);
+    assert (count != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    /*
+     * GCC gets confused by the TPM2_TRANSIENT_FIRST constant being used for
+     * the 4th parameter. It assumes that it's a signed type which causes
+     * -Wsign-conversion to complain. Casting to UINT32 is all we can do.
+     */
+    rc = Tss2_Sys_GetCapability (sapi_context,
+                                 NULL,
+                                 TPM2_CAP_HANDLES,
+                                 (UINT32)TPM2_TRANSIENT_FIRST,
+                                 TPM2_TRANSIENT_LAST - TPM2_TRANSIENT_FIRST,
+                                 &more_data,
+                                 &capability_data,
+                                 NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_GetCapability", rc);
+        goto out;
+    }
+    *count = capability_data.data.handles.count;
+out:
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Query the TPM for all of the handles of the provided type, appending
+ * them to the 'handles' array of TPM2_HANDLE in ascending order. The TPM
+ * returns a bounded number of handles at a time so we keep asking for the
+ * handles after the last one until it says there are no more.
+ */
+TSS2_RC
+tpm2_get_handles (Tpm2    *tpm2,
+                  TPM2_HT  handle_type,
+                  GArray  *handles)
+{
+    TSS2_RC rc = TSS2_RC_SUCCESS;
     TSS2_SYS_CONTEXT *sapi_context;
+    TPMI_YES_NO more_data;
+    TPMS_CAPABILITY_DATA capability_data;
+    TPM2_HANDLE first = (TPM2_HANDLE)handle_type << TPM2_HR_SHIFT;
+    UINT32 count;
 
     assert (tpm2 != NULL);
+    assert (handles != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    do {
+        more_data = TPM2_NO;
+        memset (&capability_data, 0, sizeof (capability_data));
+        rc = Tss2_Sys_GetCapability (sapi_context,
+                                     NULL,
+                                     TPM2_CAP_HANDLES,
+                                     first,
+                                     TPM2_MAX_CAP_HANDLES,
+                                     &more_data,
+                                     &capability_data,
+                                     NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            RC_WARN ("Tss2_Sys_GetCapability", rc);
+            goto out;
+        }
+        count = MIN (capability_data.data.handles.count,
+                     TPM2_MAX_CAP_HANDLES);
+        if (count == 0) {
+            break;
+        }
+        g_array_append_vals (handles,
+                             capability_data.data.handles.handle,
+                             count);
+        first = capability_data.data.handles.handle [count - 1] + 1;
+    } while (more_data == TPM2_YES);
+out:
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Send the context management command in 'command' and check the response
+ * with a fixed layout: the header followed by 'params_size' bytes, any
+ * number of them for CONTEXT_PARAMS_ANY, or the header alone on failure.
+ * The response is left in the receive buffer, its size is returned
+ * through 'response_size'. This is how ContextLoad, ContextSave and
+ * FlushContext go to the TPM: their commands are fixed or come ready to
+ * send, so there's nothing for SAPI to do but marshal them again.
+ * Returns the TCTI or TPM response code, TSS2_SYS_RC_MALFORMED_RESPONSE if
+ * the response doesn't have the layout.
+ * The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_context_command (Tpm2    *tpm2,
+                      uint8_t *command,
+                      size_t   params_size,
+                      size_t  *response_size)
+{
+    TPM2_CC code = get_command_code (command);
+    gint64 start, deadline = 0;
+    TSS2_RC rc;
+
+    if (tpm2->sapi_context == NULL) {
+        tpm2_reset_tcti (tpm2);
+    }
+    start = g_get_monotonic_time ();
+    rc = tcti_transmit (tpm2->tcti, get_command_size (command), command);
+    if (rc == TSS2_RC_SUCCESS) {
+        if (g_atomic_int_get (&tpm2->timeout_scale) > 0 &&
+            tpm2_receive_timeout (tpm2) != TSS2_TCTI_TIMEOUT_BLOCK)
+        {
+            deadline = start + tpm2_get_timeout_us (tpm2, code);
+        }
+        rc = tpm2_receive (tpm2, deadline, response_size);
+    }
+    if (rc != TSS2_RC_SUCCESS) {
+        g_atomic_int_inc (&tpm2->failures);
+        return rc;
+    }
+    g_atomic_int_set (&tpm2->failures, 0);
+    tpm2_note_exec_time (tpm2, code, g_get_monotonic_time () - start);
+    if (*response_size < TPM_HEADER_SIZE ||
+        get_response_size (tpm2->recv_buffer) != *response_size)
+    {
+        return TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+    rc = get_response_code (tpm2->recv_buffer);
+    if (rc == TSS2_RC_SUCCESS && params_size != CONTEXT_PARAMS_ANY &&
+        *response_size != TPM_HEADER_SIZE + params_size)
+    {
+        return TSS2_SYS_RC_MALFORMED_RESPONSE;
+    }
+    return rc;
+}
+/*
+ * Fill 'command' with the fixed ContextSave or FlushContext command for
+ * 'handle'.
+ */
+static void
+tpm2_context_handle_command (uint8_t      command [CONTEXT_HANDLE_CMD_SIZE],
+                             TPM2_CC      code,
+                             TPM2_HANDLE  handle)
+{
+    handle = htobe32 (handle);
+    tpm2_header_init (command,
+                      CONTEXT_HANDLE_CMD_SIZE,
+                      TPM2_ST_NO_SESSIONS,
+                      CONTEXT_HANDLE_CMD_SIZE,
+                      code);
+    memcpy (&command [TPM_HEADER_SIZE], &handle, sizeof (handle));
+}
+/*
+ * Load a saved context with the ContextLoad command in 'command', as made
+ * by tpm2_command_context_load_bytes. The handle of the loaded object or
+ * session is returned through 'handle'.
+ */
+TSS2_RC
+tpm2_context_load_command (Tpm2        *tpm2,
+                           GBytes      *command,
+                           TPM2_HANDLE *handle)
+{
+    size_t size;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (command != NULL);
+    assert (handle != NULL);
+
+    tpm2_lock (tpm2);
+    rc = tpm2_context_command (tpm2,
+                               (uint8_t*)g_bytes_get_data (command, NULL),
+                               sizeof (TPM2_HANDLE),
+                               &size);
+    if (rc == TSS2_RC_SUCCESS) {
+        memcpy (handle, &tpm2->recv_buffer [TPM_HEADER_SIZE],
+                sizeof (*handle));
+        *handle = be32toh (*handle);
+    }
+    TABRMD_PROBE2 (context_load,
+                   rc == TSS2_RC_SUCCESS ? *handle : 0,
+                   rc);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("ContextLoad", rc);
+    }
+
+    return rc;
+}
+/*
+ * Load the saved context in 'context'. Callers loading the same context
+ * over and over should keep the command from
+ * tpm2_command_context_load_bytes and use tpm2_context_load_command.
+ */
+TSS2_RC
+tpm2_context_load (Tpm2 *tpm2,
+                            TPMS_CONTEXT *context,
+                            TPM2_HANDLE   *handle)
+{
+    GBytes *command;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (context != NULL);
+    assert (handle != NULL);
+
+    command = tpm2_command_context_load_bytes (context);
+    if (command == NULL) {
+        return TSS2_SYS_RC_BAD_VALUE;
+    }
+    rc = tpm2_context_load_command (tpm2, command, handle);
+    g_bytes_unref (command);
+
+    return rc;
+}
+/*
+ * Save the context of 'handle' into 'context'. The caller must hold the
+ * lock.
+ */
+static TSS2_RC
+tpm2_context_save_unlocked (Tpm2         *tpm2,
+                            TPM2_HANDLE   handle,
+                            TPMS_CONTEXT *context)
+{
+    uint8_t command [CONTEXT_HANDLE_CMD_SIZE];
+    size_t size, offset = TPM_HEADER_SIZE;
+    TSS2_RC rc;
+
+    g_debug ("tpm2_context_save: handle 0x%08" PRIx32, handle);
+    tpm2_context_handle_command (command, TPM2_CC_ContextSave, handle);
+    rc = tpm2_context_command (tpm2, command, CONTEXT_PARAMS_ANY, &size);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_MU_TPMS_CONTEXT_Unmarshal (tpm2->recv_buffer,
+                                             size,
+                                             &offset,
+                                             context);
+        if (rc == TSS2_RC_SUCCESS && offset != size) {
+            rc = TSS2_SYS_RC_MALFORMED_RESPONSE;
+        }
+    }
+    TABRMD_PROBE2 (context_save, handle, rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("ContextSave", rc);
+    }
+    return rc;
+}
+/*
+ * Flush 'handle' from the TPM. The caller must hold the lock.
+ */
+static TSS2_RC
+tpm2_context_flush_unlocked (Tpm2        *tpm2,
+                             TPM2_HANDLE  handle)
+{
+    uint8_t command [CONTEXT_HANDLE_CMD_SIZE];
+    size_t size;
+    TSS2_RC rc;
 
     g_debug ("tpm2_context_flush: handle 0x%08" PRIx32, handle);
+    tpm2_context_handle_command (command, TPM2_CC_FlushContext, handle);
+    rc = tpm2_context_command (tpm2, command, 0, &size);
+    TABRMD_PROBE2 (context_flush, handle, rc);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("FlushContext", rc);
+    }
+    return rc;
+}
+/*
+ * This function is a simple wrapper around the TPM2_ContextSave command.
+ * It will save the context associated with the provided handle, returning
+ * the TPMS_CONTEXT to the caller. The response code returned will be
+ * TSS2_RC_SUCCESS or an RC indicating failure from the TPM.
+ */
+TSS2_RC
+tpm2_context_save (Tpm2 *tpm2,
+                            TPM2_HANDLE    handle,
+                            TPMS_CONTEXT *context)
+{
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (context != NULL);
+
+    tpm2_lock (tpm2);
+    rc = tpm2_context_save_unlocked (tpm2, handle, context);
+    tpm2_unlock (tpm2);
+
+    return rc;
+}
+/*
+ * This function is a simple wrapper around the TPM2_FlushContext command.
+ */
+TSS2_RC
+tpm2_context_flush (Tpm2 *tpm2,
+                             TPM2_HANDLE    handle)
+{
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+
+    tpm2_lock (tpm2);
+    rc = tpm2_context_flush_unlocked (tpm2, handle);
+    tpm2_unlock (tpm2);
+
+    return rc;
+}
+/*
+ * Find out whether the TPM was reset since we last looked. The resetCount
+ * in the clock info goes up with every TPM Reset, the first call only
+ * takes note of it. A TPM that was reset and not started since answers
+ * TPM2_RC_INITIALIZE, it's sent TPM2_Startup(CLEAR) here and counts as
+ * reset too. Returns TRUE if the TPM was reset, FALSE if not or if there's
+ * no telling.
+ */
+gboolean
+tpm2_check_reset (Tpm2 *tpm2)
+{
+    TPMS_TIME_INFO time_info = { 0 };
+    TSS2_SYS_CONTEXT *sapi_context;
+    gboolean reset = FALSE;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_ReadClock (sapi_context, NULL, &time_info, NULL);
+    if (rc == TPM2_RC_INITIALIZE) {
+        g_info ("%s: TPM needs TPM2_Startup, sending it", __func__);
+        reset = TRUE;
+        rc = Tss2_Sys_Startup (sapi_context, TPM2_SU_CLEAR);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = Tss2_Sys_ReadClock (sapi_context, NULL, &time_info, NULL);
+        }
+    }
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_ReadClock", rc);
+        return reset;
+    }
+    if (tpm2->reset_count_known &&
+        time_info.clockInfo.resetCount != tpm2->reset_count)
+    {
+        g_info ("%s: TPM resetCount changed from %" PRIu32 " to %" PRIu32,
+                __func__, tpm2->reset_count, time_info.clockInfo.resetCount);
+        reset = TRUE;
+    }
+    tpm2->reset_count = time_info.clockInfo.resetCount;
+    tpm2->reset_count_known = TRUE;
+
+    return reset;
+}
+/*
+ * This function is a simple wrapper around the TPM2_GetRandom command.
+ * The TPM may return fewer bytes than asked for.
+ */
+TSS2_RC
+tpm2_get_random (Tpm2         *tpm2,
+                 UINT16        size,
+                 TPM2B_DIGEST *random)
+{
+    TSS2_RC rc;
+    TSS2_SYS_CONTEXT *sapi_context;
+
+    assert (tpm2 != NULL);
+    assert (random != NULL);
+
     sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_FlushContext (sapi_context, handle);
+    rc = Tss2_Sys_GetRandom (sapi_context, NULL, size, random, NULL);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_FlushContext", rc);
+        RC_WARN ("Tss2_Sys_GetRandom", rc);
     }
     tpm2_unlock (tpm2);
 
     return rc;
 }
+/*
+ * Hash 'size' bytes of 'data' with a hash sequence: HashSequenceStart, a
+ * SequenceUpdate for each TPM2_PT_INPUT_BUFFER sized chunk and
+ * SequenceComplete with the last one. The Tpm2 stays locked from start to
+ * end so nothing gets in between. The sequence is flushed if it fails
+ * half way. The TPM must have room for the sequence object.
+ */
 TSS2_RC
-tpm2_context_saveflush (Tpm2 *tpm2,
-                                 TPM2_HANDLE    handle,
-                                 TPMS_CONTEXT *context)
+tpm2_hash_sequence (Tpm2              *tpm2,
+                    TPMI_ALG_HASH      hash_alg,
+                    TPMI_RH_HIERARCHY  hierarchy,
+                    const guint8      *data,
+                    size_t             size,
+                    TPM2B_DIGEST      *digest,
+                    TPMT_TK_HASHCHECK *validation)
 {
-    TSS2_RC           rc;
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, }},
+    };
+    TPM2B_AUTH auth = { 0, };
+    TPM2B_MAX_BUFFER chunk = { 0, };
+    TPMI_DH_OBJECT handle = 0;
     TSS2_SYS_CONTEXT *sapi_context;
+    guint32 chunk_max = 0;
+    size_t offset = 0;
+    TSS2_RC rc;
 
     assert (tpm2 != NULL);
-    assert (context != NULL);
+    assert (digest != NULL && validation != NULL);
 
-    g_debug ("tpm2_context_save: handle 0x%" PRIx32, handle);
+    if (tpm2_get_fixed_property (tpm2,
+                                 TPM2_PT_INPUT_BUFFER,
+                                 &chunk_max) != TSS2_RC_SUCCESS ||
+        chunk_max == 0 || chunk_max > sizeof (chunk.buffer))
+    {
+        chunk_max = sizeof (chunk.buffer);
+    }
     sapi_context = tpm2_lock_sapi (tpm2);
-    rc = Tss2_Sys_ContextSave (sapi_context, handle, context);
+    rc = Tss2_Sys_HashSequenceStart (sapi_context,
+                                     NULL,
+                                     &auth,
+                                     hash_alg,
+                                     &handle,
+                                     NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_HashSequenceStart", rc);
+        goto out;
+    }
+    /* the last chunk goes with SequenceComplete */
+    while (size - offset > chunk_max) {
+        chunk.size = chunk_max;
+        memcpy (chunk.buffer, &data [offset], chunk_max);
+        offset += chunk_max;
+        rc = Tss2_Sys_SequenceUpdate (sapi_context,
+                                      handle,
+                                      &auths,
+                                      &chunk,
+                                      NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            RC_WARN ("Tss2_Sys_SequenceUpdate", rc);
+            goto flush;
+        }
+    }
+    chunk.size = size - offset;
+    memcpy (chunk.buffer, &data [offset], chunk.size);
+    rc = Tss2_Sys_SequenceComplete (sapi_context,
+                                    handle,
+                                    &auths,
+                                    &chunk,
+                                    hierarchy,
+                                    digest,
+                                    validation,
+                                    NULL);
+    if (rc == TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    RC_WARN ("Tss2_Sys_SequenceComplete", rc);
+flush:
+    /* the client can't cancel the cleanup */
+    tpm2_set_executing (tpm2, NULL);
+    Tss2_Sys_FlushContext (sapi_context, handle);
+out:
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Microseconds since 'start', for the profile.
+ */
+static guint32
+tpm2_profile_elapsed (gint64 start)
+{
+    return (guint32)CLAMP (g_get_monotonic_time () - start, 0, G_MAXUINT32);
+}
+/*
+ * Start an HMAC session bound to nothing, timed as
+ * TPM2_PROFILE_SESSION_START.
+ */
+static TSS2_RC
+tpm2_profile_start_session (Tpm2           *tpm2,
+                            tpm2_profile_t *profile,
+                            TPM2_HANDLE    *handle)
+{
+    TPM2B_NONCE nonce_caller = { .size = 16, };
+    TPM2B_NONCE nonce_tpm = { 0, };
+    TPM2B_ENCRYPTED_SECRET salt = { 0, };
+    TPMT_SYM_DEF symmetric = { .algorithm = TPM2_ALG_NULL, };
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start;
+    TSS2_RC rc;
+
+    sapi_context = tpm2_lock_sapi (tpm2);
+    start = g_get_monotonic_time ();
+    rc = Tss2_Sys_StartAuthSession (sapi_context,
+                                    TPM2_RH_NULL,
+                                    TPM2_RH_NULL,
+                                    NULL,
+                                    &nonce_caller,
+                                    &salt,
+                                    TPM2_SE_HMAC,
+                                    &symmetric,
+                                    TPM2_ALG_SHA256,
+                                    handle,
+                                    &nonce_tpm,
+                                    NULL);
+    profile->op_us [TPM2_PROFILE_SESSION_START] = tpm2_profile_elapsed (start);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_StartAuthSession", rc);
+        return rc;
+    }
+    tpm2_note_exec_time (tpm2,
+                         TPM2_CC_StartAuthSession,
+                         profile->op_us [TPM2_PROFILE_SESSION_START]);
+    return TSS2_RC_SUCCESS;
+}
+/*
+ * Time the ContextSave, ContextLoad and FlushContext of 'handle', an
+ * object or a session, as the three operations from 'first'. The context
+ * is flushed whatever fails. Returns the size of the saved context
+ * through 'size'.
+ */
+static TSS2_RC
+tpm2_profile_swap (Tpm2           *tpm2,
+                   tpm2_profile_t *profile,
+                   Tpm2ProfileOp   first,
+                   TPM2_HANDLE     handle,
+                   guint32        *size)
+{
+    TPMS_CONTEXT context = { 0, };
+    gint64 start;
+    TSS2_RC rc;
+
+    start = g_get_monotonic_time ();
+    rc = tpm2_context_save (tpm2, handle, &context);
+    profile->op_us [first] = tpm2_profile_elapsed (start);
+    if (rc != TSS2_RC_SUCCESS) {
+        tpm2_context_flush (tpm2, handle);
+        return rc;
+    }
+    *size = context.contextBlob.size;
+    /* a saved session stays in the TPM, a saved object needs flushing */
+    if ((handle >> TPM2_HR_SHIFT) == TPM2_HT_TRANSIENT) {
+        rc = tpm2_context_flush (tpm2, handle);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+    }
+    start = g_get_monotonic_time ();
+    rc = tpm2_context_load (tpm2, &context, &handle);
+    profile->op_us [first + 1] = tpm2_profile_elapsed (start);
+    if (rc != TSS2_RC_SUCCESS) {
+        if ((handle >> TPM2_HR_SHIFT) != TPM2_HT_TRANSIENT) {
+            tpm2_context_flush (tpm2, handle);
+        }
+        return rc;
+    }
+    start = g_get_monotonic_time ();
+    rc = tpm2_context_flush (tpm2, handle);
+    profile->op_us [first + 2] = tpm2_profile_elapsed (start);
+    return rc;
+}
+/*
+ * Fit the model of untimed ContextLoads to the loads of the session and
+ * the object: a base time plus a time per KiB of context. If the object
+ * context, the larger, didn't take longer to load the fit says nothing
+ * about the time per KiB and the default model is scaled to the loads
+ * instead.
+ */
+static void
+tpm2_profile_seed_load_model (const tpm2_profile_t *profile)
+{
+    guint64 small_us = profile->op_us [TPM2_PROFILE_SESSION_LOAD];
+    guint64 large_us = profile->op_us [TPM2_PROFILE_OBJECT_LOAD];
+    guint64 small_size = profile->session_size;
+    guint64 large_size = profile->object_size;
+    guint64 per_kib, base, estimate;
+
+    if (small_size > large_size) {
+        small_us = profile->op_us [TPM2_PROFILE_OBJECT_LOAD];
+        large_us = profile->op_us [TPM2_PROFILE_SESSION_LOAD];
+        small_size = profile->object_size;
+        large_size = profile->session_size;
+    }
+    if (large_size > small_size && large_us > small_us) {
+        per_kib = (large_us - small_us) * 1024 / (large_size - small_size);
+        base = small_size * per_kib / 1024;
+        if (base < small_us) {
+            context_load_set_model ((guint)(small_us - base), (guint)per_kib);
+            return;
+        }
+    }
+    estimate = 2 * CONTEXT_LOAD_US_BASE +
+        (small_size + large_size) * CONTEXT_LOAD_US_PER_BYTE;
+    context_load_set_model (
+        (guint)MAX (CONTEXT_LOAD_US_BASE * (small_us + large_us) / estimate, 1),
+        (guint)(CONTEXT_LOAD_US_PER_BYTE * 1024 * (small_us + large_us) /
+                estimate));
+}
+/*
+ * Time a small set of representative operations on the TPM, each once,
+ * so the estimates the scheduler and the eviction policy go by fit this
+ * TPM from the first command: the execution time estimates of the
+ * commands timed are set from them, see tpm2_note_exec_time, and the
+ * loads of contexts not yet loaded are estimated from the session and
+ * object loads, see context_load_set_model. The TPM needs room for a
+ * session and an object. The results are kept for tpm2_get_profile.
+ * Returns the first failure, the loads are only used if all went well.
+ */
+TSS2_RC
+tpm2_calibrate (Tpm2 *tpm2)
+{
+    tpm2_profile_t profile = { .time = g_get_real_time (), };
+    TPMT_TK_HASHCHECK validation = { 0, };
+    TPM2B_DIGEST digest = { 0, };
+    TPM2B_AUTH auth = { 0, };
+    TSS2_SYS_CONTEXT *sapi_context;
+    guint8 *data;
+    TPM2_HANDLE handle = 0;
+    gint64 start;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+
+    tpm2_get_fixed_property (tpm2, TPM2_PT_MANUFACTURER,
+                             &profile.manufacturer);
+    tpm2_get_fixed_property (tpm2, TPM2_PT_FIRMWARE_VERSION_1,
+                             &profile.firmware);
+    start = g_get_monotonic_time ();
+    rc = tpm2_get_random (tpm2, TPM2_PROFILE_RANDOM_SIZE, &digest);
+    profile.op_us [TPM2_PROFILE_GET_RANDOM] = tpm2_profile_elapsed (start);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_ContextSave", rc);
         goto out;
     }
-    g_debug ("tpm2_context_flush: handle 0x%" PRIx32, handle);
-    rc = Tss2_Sys_FlushContext (sapi_context, handle);
+    tpm2_note_exec_time (tpm2,
+                         TPM2_CC_GetRandom,
+                         profile.op_us [TPM2_PROFILE_GET_RANDOM]);
+    data = g_malloc0 (TPM2_PROFILE_HASH_SIZE);
+    start = g_get_monotonic_time ();
+    rc = tpm2_hash_sequence (tpm2,
+                             TPM2_ALG_SHA256,
+                             TPM2_RH_NULL,
+                             data,
+                             TPM2_PROFILE_HASH_SIZE,
+                             &digest,
+                             &validation);
+    profile.op_us [TPM2_PROFILE_HASH] = tpm2_profile_elapsed (start);
+    g_free (data);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    rc = tpm2_profile_start_session (tpm2, &profile, &handle);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    rc = tpm2_profile_swap (tpm2,
+                            &profile,
+                            TPM2_PROFILE_SESSION_SAVE,
+                            handle,
+                            &profile.session_size);
+    if (rc != TSS2_RC_SUCCESS) {
+        goto out;
+    }
+    /* a hash sequence is the cheapest object to make */
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_HashSequenceStart (sapi_context,
+                                     NULL,
+                                     &auth,
+                                     TPM2_ALG_SHA256,
+                                     &handle,
+                                     NULL);
+    tpm2_unlock (tpm2);
     if (rc != TSS2_RC_SUCCESS) {
-        RC_WARN ("Tss2_Sys_FlushContext", rc);
+        RC_WARN ("Tss2_Sys_HashSequenceStart", rc);
+        goto out;
+    }
+    rc = tpm2_profile_swap (tpm2,
+                            &profile,
+                            TPM2_PROFILE_OBJECT_SAVE,
+                            handle,
+                            &profile.object_size);
+    if (rc == TSS2_RC_SUCCESS) {
+        tpm2_profile_seed_load_model (&profile);
     }
 out:
+    profile.rc = rc;
+    g_info ("%s: rc 0x%" PRIx32 ", GetRandom %" PRIu32 "us, hash %" PRIu32
+            "us, session load %" PRIu32 "us, object load %" PRIu32 "us",
+            __func__, rc,
+            profile.op_us [TPM2_PROFILE_GET_RANDOM],
+            profile.op_us [TPM2_PROFILE_HASH],
+            profile.op_us [TPM2_PROFILE_SESSION_LOAD],
+            profile.op_us [TPM2_PROFILE_OBJECT_LOAD]);
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    tpm2->profile = profile;
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+    return rc;
+}
+/*
+ * Copy the results of the last tpm2_calibrate, its 'time' is 0 if there
+ * was none.
+ */
+void
+tpm2_get_profile (Tpm2           *tpm2,
+                  tpm2_profile_t *profile)
+{
+    assert (tpm2 != NULL);
+    assert (profile != NULL);
+
+    g_mutex_lock (&tpm2->exec_time_mutex);
+    *profile = tpm2->profile;
+    g_mutex_unlock (&tpm2->exec_time_mutex);
+}
+/*
+ * Add the report for 'profile' of the TPM of 'backend' to 'builder', of
+ * type TPM2_PROFILE_VARIANT_TYPE.
+ */
+void
+tpm2_profile_build (const tpm2_profile_t *profile,
+                    guint                 backend,
+                    GVariantBuilder      *builder)
+{
+    GVariantBuilder ops;
+    guint i;
+
+    g_variant_builder_init (&ops, G_VARIANT_TYPE ("au"));
+    for (i = 0; i < TPM2_PROFILE_OPS; ++i) {
+        g_variant_builder_add (&ops, "u", profile->op_us [i]);
+    }
+    g_variant_builder_add (builder,
+                           "(uxuuuuuau)",
+                           backend,
+                           profile->time,
+                           profile->rc,
+                           profile->manufacturer,
+                           profile->firmware,
+                           profile->session_size,
+                           profile->object_size,
+                           &ops);
+}
+/*
+ * The largest chunk NV_Read and NV_Write take: TPM2_PT_NV_BUFFER_MAX, or
+ * the size of a TPM2B_MAX_NV_BUFFER if the TPM doesn't tell.
+ */
+static guint32
+tpm2_nv_chunk_max (Tpm2 *tpm2)
+{
+    guint32 chunk_max = 0;
+
+    if (tpm2_get_fixed_property (tpm2,
+                                 TPM2_PT_NV_BUFFER_MAX,
+                                 &chunk_max) != TSS2_RC_SUCCESS ||
+        chunk_max == 0 || chunk_max > TPM2_MAX_NV_BUFFER_SIZE)
+    {
+        chunk_max = TPM2_MAX_NV_BUFFER_SIZE;
+    }
+    return chunk_max;
+}
+/*
+ * Read 'size' bytes at 'offset' of NV index 'nv_index' into 'data' with
+ * an NV_Read for each TPM2_PT_NV_BUFFER_MAX sized chunk, authorized by
+ * 'auth_handle' with the password 'auth'. The Tpm2 stays locked from the
+ * first chunk to the last so nothing gets in between.
+ */
+TSS2_RC
+tpm2_nv_read (Tpm2              *tpm2,
+              TPMI_RH_NV_AUTH    auth_handle,
+              TPMI_RH_NV_INDEX   nv_index,
+              const TPM2B_AUTH  *auth,
+              UINT16             offset,
+              UINT16             size,
+              guint8            *data)
+{
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, .hmac = *auth, }},
+    };
+    TPM2B_MAX_NV_BUFFER chunk = { 0, };
+    TSS2_SYS_CONTEXT *sapi_context;
+    guint32 chunk_max;
+    UINT16 done = 0;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    assert (tpm2 != NULL);
+    assert (auth != NULL && (data != NULL || size == 0));
+
+    chunk_max = tpm2_nv_chunk_max (tpm2);
+    sapi_context = tpm2_lock_sapi (tpm2);
+    while (done < size) {
+        rc = Tss2_Sys_NV_Read (sapi_context,
+                               auth_handle,
+                               nv_index,
+                               &auths,
+                               MIN (size - done, chunk_max),
+                               offset + done,
+                               &chunk,
+                               NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            RC_WARN ("Tss2_Sys_NV_Read", rc);
+            break;
+        }
+        if (chunk.size == 0 || chunk.size > size - done) {
+            g_warning ("%s: NV_Read returned %" PRIu16 " bytes of %" PRIu16,
+                       __func__, chunk.size, (UINT16)(size - done));
+            rc = RM_RC (TPM2_RC_FAILURE);
+            break;
+        }
+        memcpy (&data [done], chunk.buffer, chunk.size);
+        done += chunk.size;
+    }
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Write the 'size' bytes of 'data' at 'offset' of NV index 'nv_index'
+ * with an NV_Write for each TPM2_PT_NV_BUFFER_MAX sized chunk, authorized
+ * by 'auth_handle' with the password 'auth'. As with tpm2_nv_read the
+ * Tpm2 stays locked throughout. A write failing half way leaves the
+ * chunks before it written.
+ */
+TSS2_RC
+tpm2_nv_write (Tpm2              *tpm2,
+               TPMI_RH_NV_AUTH    auth_handle,
+               TPMI_RH_NV_INDEX   nv_index,
+               const TPM2B_AUTH  *auth,
+               UINT16             offset,
+               UINT16             size,
+               const guint8      *data)
+{
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, .hmac = *auth, }},
+    };
+    TPM2B_MAX_NV_BUFFER chunk = { 0, };
+    TSS2_SYS_CONTEXT *sapi_context;
+    guint32 chunk_max;
+    UINT16 done = 0;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    assert (tpm2 != NULL);
+    assert (auth != NULL && (data != NULL || size == 0));
+
+    chunk_max = tpm2_nv_chunk_max (tpm2);
+    sapi_context = tpm2_lock_sapi (tpm2);
+    while (done < size) {
+        chunk.size = MIN (size - done, chunk_max);
+        memcpy (chunk.buffer, &data [done], chunk.size);
+        rc = Tss2_Sys_NV_Write (sapi_context,
+                                auth_handle,
+                                nv_index,
+                                &auths,
+                                &chunk,
+                                offset + done,
+                                NULL);
+        if (rc != TSS2_RC_SUCCESS) {
+            RC_WARN ("Tss2_Sys_NV_Write", rc);
+            break;
+        }
+        done += chunk.size;
+    }
+    tpm2_unlock (tpm2);
+    return rc;
+}
+/*
+ * Make the transient object 'handle' persistent as 'persistent' with
+ * EvictControl, or evict the persistent object if 'handle' is
+ * 'persistent', authorized by the owner hierarchy with the password
+ * 'auth'.
+ */
+TSS2_RC
+tpm2_evict_control (Tpm2               *tpm2,
+                    const TPM2B_AUTH   *auth,
+                    TPMI_DH_OBJECT      handle,
+                    TPMI_DH_PERSISTENT  persistent)
+{
+    TSS2L_SYS_AUTH_COMMAND auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, .hmac = *auth, }},
+    };
+    TSS2_SYS_CONTEXT *sapi_context;
+    TSS2_RC rc;
+
+    assert (tpm2 != NULL);
+    assert (auth != NULL);
+
+    g_debug ("%s: handle 0x%08" PRIx32 " persistent 0x%08" PRIx32,
+             __func__, handle, persistent);
+    sapi_context = tpm2_lock_sapi (tpm2);
+    rc = Tss2_Sys_EvictControl (sapi_context,
+                                TPM2_RH_OWNER,
+                                handle,
+                                &auths,
+                                persistent,
+                                NULL);
+    tpm2_unlock (tpm2);
+    if (rc != TSS2_RC_SUCCESS) {
+        RC_WARN ("Tss2_Sys_EvictControl", rc);
+    }
+    return rc;
+}
+TSS2_RC
+tpm2_context_saveflush (Tpm2 *tpm2,
+                                 TPM2_HANDLE    handle,
+                                 TPMS_CONTEXT *context)
+{
+    TSS2_RC           rc;
+
+    assert (tpm2 != NULL);
+    assert (context != NULL);
+
+    tpm2_lock (tpm2);
+    rc = tpm2_context_save_unlocked (tpm2, handle, context);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = tpm2_context_flush_unlocked (tpm2, handle);
+    }
     tpm2_unlock (tpm2);
     return rc;
 }
@@ -693,6 +2286,15 @@ tpm2_get_command_attrs (Tpm2 *tpm2,
     assert (count != NULL);
     assert (attrs != NULL);
 
+    /* the snapshot of the commands capability has the same data */
+    if (tpm2->caps_fixed & CAP_FIXED_BIT (TPM2_CAP_COMMANDS)) {
+        *count = tpm2->commands.data.command.count;
+        *attrs = g_malloc0 (*count * sizeof (TPMA_CC));
+        memcpy (*attrs,
+                tpm2->commands.data.command.commandAttributes,
+                *count * sizeof (TPMA_CC));
+        return TSS2_RC_SUCCESS;
+    }
     sys_ctx = tpm2_lock_sapi (tpm2);
     rc = Tss2_Sys_GetCapability (sys_ctx,
                                  NULL,
@@ -12,21 +12,171 @@
 #include <tss2/tss2_sys.h>
 
 #include "tcti.h"
+#include "tpm2-header.h"
 #include "tpm2-response.h"
 
 G_BEGIN_DECLS
 
+/*
+ * Bit in the Tpm2 'caps_fixed' mask recording that we've got a complete
+ * snapshot of the given capability.
+ */
+#define CAP_FIXED_BIT(cap) (1 << (cap))
+/*
+ * The execution time of each command code is tracked as an exponentially
+ * weighted moving average: each new sample is weighted 1 / 2^SHIFT. Until
+ * a command code has been seen its estimate is the default.
+ */
+#define EXEC_TIME_EWMA_SHIFT 3
+#define EXEC_TIME_DEFAULT_US 1000
+/* identifies the capability cache file written by tpm2_cache_save */
+#define TPM2_CACHE_MAGIC   0x74706d63
+#define TPM2_CACHE_VERSION 1
+
+/*
+ * While waiting for a response the Tpm2 polls the TCTI at this interval
+ * and runs its Tpm2WaitFunc in between.
+ */
+#define TPM2_RECEIVE_POLL_MS 10
+/*
+ * The longest the TPM should take for a command of each class, in
+ * milliseconds: the durations of the PC Client Platform TPM Profile, and
+ * for commands generating keys, which it leaves open, what the Linux TPM
+ * driver allows. A command gets the time for its class or its usual time
+ * times the timeout scale, whichever is longer, but no less than the
+ * minimum. Once a command timed out the TPM has the grace period to answer
+ * the cancel.
+ */
+#define TPM2_DURATION_SHORT_MS     20
+#define TPM2_DURATION_MEDIUM_MS    750
+#define TPM2_DURATION_LONG_MS      2000
+#define TPM2_DURATION_LONG_LONG_MS 300000
+#define TPM2_TIMEOUT_MIN_MS        200
+#define TPM2_CANCEL_GRACE_MS       2000
+/* commands failing in a row before the TPM is reported as failing */
+#define TPM2_FAILURES_MAX          3
+/*
+ * The operations tpm2_calibrate times, each once: GetRandom of
+ * TPM2_PROFILE_RANDOM_SIZE bytes, a hash sequence over
+ * TPM2_PROFILE_HASH_SIZE bytes, and the ContextSave, ContextLoad and
+ * FlushContext of an HMAC session and of a sequence object.
+ */
+typedef enum {
+    TPM2_PROFILE_GET_RANDOM,
+    TPM2_PROFILE_HASH,
+    TPM2_PROFILE_SESSION_START,
+    TPM2_PROFILE_SESSION_SAVE,
+    TPM2_PROFILE_SESSION_LOAD,
+    TPM2_PROFILE_SESSION_FLUSH,
+    TPM2_PROFILE_OBJECT_SAVE,
+    TPM2_PROFILE_OBJECT_LOAD,
+    TPM2_PROFILE_OBJECT_FLUSH,
+    TPM2_PROFILE_OPS,
+} Tpm2ProfileOp;
+#define TPM2_PROFILE_RANDOM_SIZE 32
+#define TPM2_PROFILE_HASH_SIZE   1024
+/*
+ * GVariant type of the reports built by tpm2_profile_build:
+ * (backend, time, rc, manufacturer, firmware, session context size,
+ *  object context size, us for each Tpm2ProfileOp)
+ */
+#define TPM2_PROFILE_VARIANT_TYPE "a(uxuuuuuau)"
+/*
+ * What tpm2_calibrate measured. 'time' is the wall clock time in
+ * microseconds since the epoch of the run, 0 if there was none, 'rc' the
+ * first failure, after which the operations left are 0. The manufacturer
+ * and firmware version tell the TPM models apart.
+ */
+typedef struct {
+    gint64                  time;
+    TSS2_RC                 rc;
+    guint32                 manufacturer;
+    guint32                 firmware;
+    guint32                 session_size;
+    guint32                 object_size;
+    guint32                 op_us [TPM2_PROFILE_OPS];
+} tpm2_profile_t;
+/*
+ * ContextSave and FlushContext are a header and a handle. The parameters
+ * of a ContextSave response are a TPMS_CONTEXT of any size.
+ */
+#define CONTEXT_HANDLE_CMD_SIZE    (TPM_HEADER_SIZE + sizeof (TPM2_HANDLE))
+#define CONTEXT_PARAMS_ANY         G_MAXSIZE
+
+typedef void (*Tpm2WaitFunc) (gpointer user_data);
+
 typedef struct _Tpm2Class {
     GObjectClass      parent;
 } Tpm2Class;
 
 typedef struct _Tpm2 {
     GObject                 parent_instance;
-    pthread_mutex_t         sapi_mutex;
+    /*
+     * The thread using the TSS2_SYS_CONTEXT, see tpm2_acquire. 'waiting'
+     * counts the threads waiting for it, both are changed under the
+     * owner_mutex. 'borrowed' is set by a thread that only has it until
+     * its tpm2_unlock.
+     */
+    GMutex                  owner_mutex;
+    GCond                   owner_cond;
+    gpointer                owner;
+    gint                    waiting;
+    gboolean                borrowed;
     TSS2_SYS_CONTEXT       *sapi_context;
     Tcti                   *tcti;
+    /*
+     * what the TPM is executing a command for, see tpm2_set_executing,
+     * under the cancel_mutex so a cancel can't reach the next command.
+     * The TCTI context is only reset under it too.
+     */
+    GMutex                  cancel_mutex;
+    gconstpointer           executing;
     TPMS_CAPABILITY_DATA    properties_fixed;
+    TPMS_CAPABILITY_DATA    algorithms;
+    TPMS_CAPABILITY_DATA    commands;
+    TPMS_CAPABILITY_DATA    ecc_curves;
+    guint32                 caps_fixed;
+    /* the fixed data above was loaded from the capability cache */
+    gboolean                from_cache;
     gboolean                initialized;
+    GMutex                  exec_time_mutex;
+    GHashTable             *exec_time;
+    /*
+     * time the TSS2_SYS_CONTEXT has been locked, which is when the TPM is
+     * busy, under the exec_time_mutex. 'locked_at' is only used by the
+     * thread that has it locked.
+     */
+    guint64                 busy_us;
+    gint64                  locked_at;
+    /*
+     * run by the owner while the TPM executes a command, NULL to block in
+     * the TCTI. 'receive_blocking' is set once the TCTI has refused a
+     * receive timeout.
+     */
+    Tpm2WaitFunc            wait_func;
+    gpointer                wait_data;
+    gboolean                receive_blocking;
+    /* the locality the TCTI sends commands at, changed with the lock held */
+    guint8                  locality;
+    /* responses are received here before being copied to a pooled buffer */
+    guint8                 *recv_buffer;
+    size_t                  recv_buffer_size;
+    /*
+     * commands taking more than 'timeout_scale' times their usual time are
+     * canceled, 0 if they may take forever, and the count of those
+     */
+    guint                   timeout_scale;
+    guint                   timeouts;
+    /*
+     * commands in a row the TCTI failed to send or get a response for,
+     * a backend is taken out of rotation at TPM2_FAILURES_MAX
+     */
+    guint                   failures;
+    /* the resetCount seen by tpm2_check_reset, once it got one */
+    UINT32                  reset_count;
+    gboolean                reset_count_known;
+    /* the last tpm2_calibrate, under the exec_time_mutex */
+    tpm2_profile_t          profile;
 } Tpm2;
 
 #include "tpm2-command.h"
@@ -41,18 +191,65 @@ typedef struct _Tpm2 {
 GType tpm2_get_type (void);
 Tpm2* tpm2_new (Tcti *tcti);
 TSS2_RC tpm2_init_tpm (Tpm2 *tpm2);
+void tpm2_acquire (Tpm2 *tpm2);
+void tpm2_release (Tpm2 *tpm2);
+void tpm2_yield (Tpm2 *tpm2);
+void tpm2_set_wait_func (Tpm2 *tpm2, Tpm2WaitFunc func, gpointer user_data);
+guint8 tpm2_get_locality (Tpm2 *tpm2);
 void tpm2_lock (Tpm2 *tpm2);
 void tpm2_unlock (Tpm2 *tpm2);
 Tpm2Response* tpm2_send_command (Tpm2 *tpm2,
                                  Tpm2Command *command,
                                  TSS2_RC *rc);
 TSS2_RC tpm2_get_max_response (Tpm2 *tpm2, guint32 *value);
+void tpm2_set_executing (Tpm2 *tpm2, gconstpointer tag);
+TSS2_RC tpm2_cancel (Tpm2 *tpm2, gconstpointer tag);
+void tpm2_note_exec_time (Tpm2 *tpm2, TPM2_CC command_code, guint64 time_us);
+guint64 tpm2_get_busy_us (Tpm2 *tpm2);
+guint64 tpm2_get_exec_estimate (Tpm2 *tpm2, TPM2_CC command_code);
+void tpm2_set_timeout_scale (Tpm2 *tpm2, guint scale);
+guint64 tpm2_get_timeout_us (Tpm2 *tpm2, TPM2_CC command_code);
+guint tpm2_get_timeouts (Tpm2 *tpm2);
+gboolean tpm2_is_failing (Tpm2 *tpm2);
+TSS2_RC tpm2_get_fixed_property (Tpm2 *tpm2,
+                                 TPM2_PT property,
+                                 guint32 *value);
 TSS2_SYS_CONTEXT* tpm2_lock_sapi (Tpm2 *tpm2);
 TSS2_RC tpm2_get_trans_object_count (Tpm2 *tpm2, uint32_t *count);
+TSS2_RC tpm2_get_handles (Tpm2 *tpm2, TPM2_HT handle_type, GArray *handles);
 TSS2_RC tpm2_context_load (Tpm2 *tpm2,
                            TPMS_CONTEXT *context,
                            TPM2_HANDLE *handle);
+TSS2_RC tpm2_context_load_command (Tpm2 *tpm2,
+                                   GBytes *command,
+                                   TPM2_HANDLE *handle);
 TSS2_RC tpm2_context_flush (Tpm2 *tpm2, TPM2_HANDLE handle);
+TSS2_RC tpm2_get_random (Tpm2 *tpm2, UINT16 size, TPM2B_DIGEST *random);
+TSS2_RC tpm2_hash_sequence (Tpm2 *tpm2,
+                            TPMI_ALG_HASH hash_alg,
+                            TPMI_RH_HIERARCHY hierarchy,
+                            const guint8 *data,
+                            size_t size,
+                            TPM2B_DIGEST *digest,
+                            TPMT_TK_HASHCHECK *validation);
+TSS2_RC tpm2_nv_read (Tpm2 *tpm2,
+                      TPMI_RH_NV_AUTH auth_handle,
+                      TPMI_RH_NV_INDEX nv_index,
+                      const TPM2B_AUTH *auth,
+                      UINT16 offset,
+                      UINT16 size,
+                      guint8 *data);
+TSS2_RC tpm2_nv_write (Tpm2 *tpm2,
+                       TPMI_RH_NV_AUTH auth_handle,
+                       TPMI_RH_NV_INDEX nv_index,
+                       const TPM2B_AUTH *auth,
+                       UINT16 offset,
+                       UINT16 size,
+                       const guint8 *data);
+TSS2_RC tpm2_evict_control (Tpm2 *tpm2,
+                            const TPM2B_AUTH *auth,
+                            TPMI_DH_OBJECT handle,
+                            TPMI_DH_PERSISTENT persistent);
 TSS2_RC tpm2_context_saveflush (Tpm2 *tpm2,
                                 TPM2_HANDLE handle,
                                 TPMS_CONTEXT *context);
@@ -61,12 +258,23 @@ TSS2_RC tpm2_context_save (Tpm2 *tpm2,
                            TPMS_CONTEXT *context);
 void tpm2_flush_all_context (Tpm2 *tpm2);
 TSS2_RC tpm2_send_tpm_startup (Tpm2 *tpm2);
+gboolean tpm2_check_reset (Tpm2 *tpm2);
 TSS2_SYS_CONTEXT* sapi_context_init (Tcti *tcti);
 TSS2_RC tpm2_flush_all_unlocked (Tpm2 *tpm2,
                                  TSS2_SYS_CONTEXT *sapi_context,
                                  TPM2_RH first,
                                  TPM2_RH last);
+TSS2_RC tpm2_init_caps_fixed (Tpm2 *tpm2);
+TPMS_CAPABILITY_DATA* tpm2_get_fixed_capability (Tpm2 *tpm2, TPM2_CAP cap);
 TSS2_RC tpm2_get_command_attrs (Tpm2 *tpm2, UINT32 *count, TPMA_CC **attrs);
+gboolean tpm2_cache_load (Tpm2 *tpm2, const gchar *path, const gchar *key);
+gboolean tpm2_cache_save (Tpm2 *tpm2, const gchar *path, const gchar *key);
+gboolean tpm2_cache_verify (Tpm2 *tpm2, const gchar *path, const gchar *key);
+TSS2_RC tpm2_calibrate (Tpm2 *tpm2);
+void tpm2_get_profile (Tpm2 *tpm2, tpm2_profile_t *profile);
+void tpm2_profile_build (const tpm2_profile_t *profile,
+                         guint backend,
+                         GVariantBuilder *builder);
 
 G_END_DECLS
 
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <inttypes.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace-buffer.h"
+
+G_DEFINE_TYPE (TraceBuffer, trace_buffer, G_TYPE_OBJECT);
+
+/* the name and category of each TraceEvent in the JSON */
+static const gchar *trace_names [TRACE_EVENTS] = {
+    [TRACE_READ]          = "read",
+    [TRACE_QUEUE]         = "queue",
+    [TRACE_LOAD]          = "load",
+    [TRACE_EXEC]          = "exec",
+    [TRACE_SAVE]          = "save",
+    [TRACE_WRITE]         = "write",
+    [TRACE_CONTEXT_LOAD]  = "ContextLoad",
+    [TRACE_CONTEXT_SAVE]  = "ContextSave",
+    [TRACE_CONTEXT_FLUSH] = "FlushContext",
+};
+static const gchar *trace_categories [TRACE_EVENTS] = {
+    [TRACE_READ]          = "source",
+    [TRACE_QUEUE]         = "resmgr",
+    [TRACE_LOAD]          = "resmgr",
+    [TRACE_EXEC]          = "resmgr",
+    [TRACE_SAVE]          = "resmgr",
+    [TRACE_WRITE]         = "sink",
+    [TRACE_CONTEXT_LOAD]  = "swap",
+    [TRACE_CONTEXT_SAVE]  = "swap",
+    [TRACE_CONTEXT_FLUSH] = "swap",
+};
+
+static void
+trace_buffer_init (TraceBuffer *self)
+{
+    g_mutex_init (&self->mutex);
+}
+static void
+trace_buffer_finalize (GObject *object)
+{
+    TraceBuffer *self = TRACE_BUFFER (object);
+
+    g_debug ("%s", __func__);
+    g_clear_pointer (&self->spans, g_free);
+    g_clear_pointer (&self->path, g_free);
+    g_mutex_clear (&self->mutex);
+    G_OBJECT_CLASS (trace_buffer_parent_class)->finalize (object);
+}
+static void
+trace_buffer_class_init (TraceBufferClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    if (trace_buffer_parent_class == NULL)
+        trace_buffer_parent_class = g_type_class_peek_parent (klass);
+    object_class->finalize = trace_buffer_finalize;
+}
+/*
+ * Create a TraceBuffer keeping the last 'size' spans and writing them to
+ * 'path', 'size' must not be 0.
+ */
+TraceBuffer*
+trace_buffer_new (const gchar *path,
+                  guint        size)
+{
+    TraceBuffer *buffer;
+
+    g_return_val_if_fail (path != NULL && size > 0, NULL);
+    buffer = TRACE_BUFFER (g_object_new (TYPE_TRACE_BUFFER, NULL));
+    buffer->path = g_strdup (path);
+    buffer->spans = g_new0 (trace_span_t, size);
+    buffer->size = size;
+    return buffer;
+}
+/*
+ * Add a span of 'event' from 'start' to 'end' for a command from the
+ * connection with serial 'connection', replacing the oldest span once the
+ * buffer is full. Spans the caller didn't time, with a 'start' of 0 or
+ * ending before they start, are skipped.
+ */
+void
+trace_buffer_add (TraceBuffer *buffer,
+                  TraceEvent   event,
+                  gint64       start,
+                  gint64       end,
+                  guint        connection,
+                  TPM2_CC      command_code)
+{
+    trace_span_t *span;
+
+    if (start == 0 || end < start) {
+        return;
+    }
+    g_mutex_lock (&buffer->mutex);
+    span = &buffer->spans [buffer->count % buffer->size];
+    span->event = event;
+    span->tid = (guint)syscall (SYS_gettid);
+    span->start = start;
+    span->end = end;
+    span->connection = connection;
+    span->command_code = command_code;
+    ++buffer->count;
+    g_mutex_unlock (&buffer->mutex);
+}
+/*
+ * Add an instant of 'event' happening now.
+ */
+void
+trace_buffer_instant (TraceBuffer *buffer,
+                      TraceEvent   event,
+                      guint        connection,
+                      TPM2_CC      command_code)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    trace_buffer_add (buffer, event, now, now, connection, command_code);
+}
+/*
+ * Build the Chrome trace JSON for the spans in the buffer, oldest first.
+ * The spans are copied out under the mutex so nothing slow happens with
+ * the pipeline threads locked out. The caller frees the string.
+ */
+gchar*
+trace_buffer_to_json (TraceBuffer *buffer)
+{
+    trace_span_t *spans, *span;
+    GString *json;
+    guint64 first, i;
+    guint count;
+    gint pid = (gint)getpid ();
+
+    g_mutex_lock (&buffer->mutex);
+    first = buffer->count > buffer->size ? buffer->count - buffer->size : 0;
+    count = (guint)(buffer->count - first);
+    spans = g_new (trace_span_t, MAX (count, 1));
+    for (i = first; i < buffer->count; ++i) {
+        memcpy (&spans [i - first],
+                &buffer->spans [i % buffer->size],
+                sizeof (*spans));
+    }
+    g_mutex_unlock (&buffer->mutex);
+
+    json = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (i = 0; i < count; ++i) {
+        span = &spans [i];
+        g_string_append_printf (json,
+                                "%s{\"name\":\"%s\",\"cat\":\"%s\",",
+                                i > 0 ? ",\n" : "\n",
+                                trace_names [span->event],
+                                trace_categories [span->event]);
+        if (span->event >= TRACE_CONTEXT_LOAD) {
+            g_string_append (json, "\"ph\":\"i\",\"s\":\"t\",");
+        } else {
+            g_string_append_printf (json,
+                                    "\"ph\":\"X\",\"dur\":%" PRId64 ",",
+                                    span->end - span->start);
+        }
+        g_string_append_printf (json,
+                                "\"pid\":%d,\"tid\":%u,\"ts\":%" PRId64 ","
+                                "\"args\":{\"connection\":%u,"
+                                "\"command\":\"0x%" PRIx32 "\"}}",
+                                pid,
+                                span->tid,
+                                span->start,
+                                span->connection,
+                                span->command_code);
+    }
+    g_string_append (json, "\n]}\n");
+    g_free (spans);
+    return g_string_free (json, FALSE);
+}
+/*
+ * Write the spans in the buffer to its file, replacing what an earlier
+ * call wrote. The spans stay in the buffer.
+ */
+gboolean
+trace_buffer_write (TraceBuffer *buffer)
+{
+    GError *error = NULL;
+    gchar *json;
+    gboolean ret;
+
+    json = trace_buffer_to_json (buffer);
+    ret = g_file_set_contents (buffer->path, json, -1, &error);
+    if (ret) {
+        g_info ("%s: wrote trace to %s", __func__, buffer->path);
+    } else {
+        g_warning ("%s: failed to write trace to %s: %s", __func__,
+                   buffer->path, error->message);
+        g_error_free (error);
+    }
+    g_free (json);
+    return ret;
+}
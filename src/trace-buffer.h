@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include <glib.h>
+#include <glib-object.h>
+#include <tss2/tss2_tpm2_types.h>
+
+G_BEGIN_DECLS
+
+/*
+ * The TraceBuffer keeps the last few spans of the commands going through
+ * the pipeline so their timeline can be looked at in a trace viewer like
+ * Perfetto or chrome://tracing. The CommandSources add a span for reading
+ * each command, the ResourceManagers one for each phase they measure and
+ * an instant for each context swap, the ResponseSinks one for writing the
+ * response. Spans from all threads go to the one buffer under the mutex,
+ * trace_buffer_write writes them out in the Chrome trace JSON format.
+ */
+typedef enum {
+    TRACE_READ,
+    TRACE_QUEUE,
+    TRACE_LOAD,
+    TRACE_EXEC,
+    TRACE_SAVE,
+    TRACE_WRITE,
+    /* instants rather than spans */
+    TRACE_CONTEXT_LOAD,
+    TRACE_CONTEXT_SAVE,
+    TRACE_CONTEXT_FLUSH,
+    TRACE_EVENTS,
+} TraceEvent;
+
+/*
+ * 'start' and 'end' are monotonic times in microseconds, the same for an
+ * instant. 'tid' is the kernel ID of the thread that added the span.
+ */
+typedef struct {
+    TraceEvent          event;
+    guint               tid;
+    gint64              start;
+    gint64              end;
+    guint               connection;
+    TPM2_CC             command_code;
+} trace_span_t;
+
+typedef struct _TraceBufferClass {
+    GObjectClass        parent;
+} TraceBufferClass;
+
+typedef struct _TraceBuffer {
+    GObject             parent_instance;
+    GMutex              mutex;
+    gchar              *path;
+    trace_span_t       *spans;
+    guint               size;
+    /* spans added so far, the next goes in spans [count % size] */
+    guint64             count;
+} TraceBuffer;
+
+#define TYPE_TRACE_BUFFER            (trace_buffer_get_type ())
+#define TRACE_BUFFER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_TRACE_BUFFER, TraceBuffer))
+#define TRACE_BUFFER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), TYPE_TRACE_BUFFER, TraceBufferClass))
+#define IS_TRACE_BUFFER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_TRACE_BUFFER))
+#define IS_TRACE_BUFFER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), TYPE_TRACE_BUFFER))
+#define TRACE_BUFFER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), TYPE_TRACE_BUFFER, TraceBufferClass))
+
+GType           trace_buffer_get_type  (void);
+TraceBuffer*    trace_buffer_new       (const gchar  *path,
+                                        guint         size);
+void            trace_buffer_add       (TraceBuffer  *buffer,
+                                        TraceEvent    event,
+                                        gint64        start,
+                                        gint64        end,
+                                        guint         connection,
+                                        TPM2_CC       command_code);
+void            trace_buffer_instant   (TraceBuffer  *buffer,
+                                        TraceEvent    event,
+                                        guint         connection,
+                                        TPM2_CC       command_code);
+gchar*          trace_buffer_to_json   (TraceBuffer  *buffer);
+gboolean        trace_buffer_write     (TraceBuffer  *buffer);
+
+G_END_DECLS
+#endif /* TRACE_BUFFER_H */
@@ -16,10 +16,26 @@
 
 #include <tss2/tss2_tpm2_types.h>
 
+#include "alloc-stats.h"
 #include "random.h"
 #include "util.h"
 #include "tpm2-header.h"
 
+/* -1 until util_debug_init has looked at the environment */
+gint util_debug_state = -1;
+/*
+ * Work out whether debug messages are wanted, see util_debug_enabled.
+ * Tests call this again after changing the environment.
+ */
+gboolean
+util_debug_init (void)
+{
+    const gchar *domains = g_getenv ("G_MESSAGES_DEBUG");
+    gboolean enabled = domains != NULL && domains [0] != '\0';
+
+    g_atomic_int_set (&util_debug_state, enabled);
+    return enabled;
+}
 /**
  * This is a wrapper around g_debug to dump a binary buffer in a human
  * readable format. Since g_debug appends a new line to each string that
@@ -40,6 +56,9 @@ g_debug_bytes (uint8_t const *byte_array,
     char  line [MAX_LINE_LENGTH] = { 0 };
     char  *line_position = NULL;
 
+    if (!util_debug_enabled ()) {
+        return;
+    }
     if (line_length > MAX_LINE_LENGTH) {
         g_warning ("g_debug_bytes: MAX_LINE_LENGTH exceeded");
         return;
@@ -204,71 +223,204 @@ read_tpm_buffer (GInputStream             *istream,
     /* Now that we have the header, we know the whole buffer size. Get it. */
     return read_data (istream, index, buf, size - *index);
 }
+/*
+ * Free buffers of the buffer pool. Each size class is a list threaded
+ * through the first bytes of the free buffers themselves. Buffers are
+ * taken by the CommandSource thread and given back by whichever thread
+ * drops the last reference to the Tpm2Command so the pool is locked.
+ */
+typedef struct util_buf_free {
+    struct util_buf_free *next;
+} util_buf_free_t;
+
+G_LOCK_DEFINE_STATIC (util_buf_pool);
+static util_buf_free_t *util_buf_pool [UTIL_BUF_CLASSES] = { NULL, };
+static guint util_buf_pool_count [UTIL_BUF_CLASSES] = { 0, };
+/*
+ * Get the size class for a buffer of 'size' bytes. UTIL_BUF_CLASSES is
+ * returned for sizes beyond UTIL_BUF_MAX, these aren't pooled.
+ */
+static guint
+util_buf_class (size_t size)
+{
+    guint class = 0;
+
+    while (class < UTIL_BUF_CLASSES && ((size_t)UTIL_BUF_SIZE << class) < size) {
+        ++class;
+    }
+    return class;
+}
+/*
+ * Get a buffer of at least 'size' bytes from the buffer pool. The buffer
+ * isn't zeroed. It must be given back with util_buf_put with the same
+ * 'size' or freed with g_free.
+ */
+uint8_t*
+util_buf_get (size_t size)
+{
+    util_buf_free_t *buf = NULL;
+    guint class = util_buf_class (size);
+
+    if (class == UTIL_BUF_CLASSES) {
+        ALLOC_STATS_ADD (ALLOC_STATS_BUFFER, size);
+        return g_malloc (size);
+    }
+    G_LOCK (util_buf_pool);
+    buf = util_buf_pool [class];
+    if (buf != NULL) {
+        util_buf_pool [class] = buf->next;
+        util_buf_pool_count [class]--;
+    }
+    G_UNLOCK (util_buf_pool);
+    if (buf == NULL) {
+        ALLOC_STATS_ADD (ALLOC_STATS_BUFFER, (size_t)UTIL_BUF_SIZE << class);
+        buf = g_malloc ((size_t)UTIL_BUF_SIZE << class);
+    }
+    return (uint8_t*)buf;
+}
+/*
+ * Give a buffer obtained from util_buf_get back to the buffer pool. The
+ * buffer is freed if its size class already holds UTIL_BUF_POOL_DEPTH
+ * free buffers.
+ */
+void
+util_buf_put (uint8_t *buf,
+              size_t   size)
+{
+    util_buf_free_t *entry = (util_buf_free_t*)buf;
+    guint class = util_buf_class (size);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (class < UTIL_BUF_CLASSES) {
+        G_LOCK (util_buf_pool);
+        if (util_buf_pool_count [class] < UTIL_BUF_POOL_DEPTH) {
+            entry->next = util_buf_pool [class];
+            util_buf_pool [class] = entry;
+            util_buf_pool_count [class]++;
+            entry = NULL;
+        }
+        G_UNLOCK (util_buf_pool);
+    }
+    g_free (entry);
+}
 /*
  * This fucntion is a wrapper around the read_tpm_buffer function above. It
  * adds the memory allocation logic necessary to create the buffer to hold
- * the TPM command / response buffer.
+ * the TPM command / response buffer. The header is read first so that the
+ * buffer can be taken from the buffer pool at its final size.
  * Returns NULL on error, and a pointer to the allocated buffer on success.
  *   The size of the allocated buffer is returned through the *buf_size
- *   parameter on success.
+ *   parameter on success. The buffer must be given back with util_buf_put.
  */
 uint8_t*
 read_tpm_buffer_alloc (GInputStream *istream,
                        size_t       *buf_size)
 {
-    uint8_t *buf = NULL;
-    size_t   size_tmp = TPM_HEADER_SIZE, index = 0;
+    uint8_t header [TPM_HEADER_SIZE], *buf = NULL;
+    size_t   size, index = 0;
     int ret = 0;
 
     if (istream == NULL || buf_size == NULL) {
         g_warning ("%s: got null parameter", __func__);
         return NULL;
     }
-    do {
-        buf = g_realloc (buf, size_tmp);
-        ret = read_tpm_buffer (istream, &index, buf, size_tmp);
-        switch (ret) {
-        case EPROTO:
-            size_tmp = get_command_size (buf);
-            if (size_tmp < TPM_HEADER_SIZE || size_tmp > UTIL_BUF_MAX) {
-                g_warning ("%s: tpm buffer size is ouside of acceptable bounds: %zd",
-                           __func__, size_tmp);
-                goto err_out;
-            }
-            break;
-        case 0:
-            /* done */
-            break;
-        default:
-            goto err_out;
+    ret = read_data (istream, &index, header, TPM_HEADER_SIZE);
+    if (ret != 0) {
+        return NULL;
+    }
+    size = get_command_size (header);
+    if (size < TPM_HEADER_SIZE || size > UTIL_BUF_MAX) {
+        g_warning ("%s: tpm buffer size is ouside of acceptable bounds: %zd",
+                   __func__, size);
+        return NULL;
+    }
+    buf = util_buf_get (size);
+    memcpy (buf, header, TPM_HEADER_SIZE);
+    if (size > TPM_HEADER_SIZE) {
+        ret = read_data (istream, &index, buf, size - index);
+        if (ret != 0) {
+            g_debug ("%s: err_out freeing buffer", __func__);
+            util_buf_put (buf, size);
+            return NULL;
         }
-    } while (ret == EPROTO);
+    }
     g_debug ("%s: read TPM buffer of size: %zd", __func__, index);
     g_debug_bytes (buf, index, 16, 4);
-    *buf_size = size_tmp;
+    *buf_size = size;
     return buf;
-err_out:
-    g_debug ("%s: err_out freeing buffer", __func__);
-    if (buf != NULL) {
-        g_free (buf);
+}
+/*
+ * Read a TPM command from a SOCK_SEQPACKET socket. Each message carries
+ * exactly one command so it's read with a single receive, no framing
+ * required. The message must be exactly as long as the size in its
+ * header says.
+ * Returns NULL on EOF or error, and a pointer to a buffer from the buffer
+ * pool on success. The size of the buffer is returned through *buf_size.
+ * The buffer must be given back with util_buf_put.
+ */
+uint8_t*
+read_tpm_packet_alloc (GSocket *socket,
+                       size_t  *buf_size)
+{
+    uint8_t packet [UTIL_BUF_MAX], *buf;
+    GError *error = NULL;
+    gssize num_read;
+    size_t size;
+
+    if (socket == NULL || buf_size == NULL) {
+        g_warning ("%s: got null parameter", __func__);
+        return NULL;
     }
-    return NULL;
+    num_read = g_socket_receive (socket,
+                                 (gchar*)packet,
+                                 sizeof (packet),
+                                 NULL,
+                                 &error);
+    if (num_read < 0) {
+        g_warning ("%s: receive on socket produced error: %s", __func__,
+                   error->message);
+        g_error_free (error);
+        return NULL;
+    } else if (num_read == 0) {
+        g_debug ("%s: receive produced EOF", __func__);
+        return NULL;
+    } else if (num_read < TPM_HEADER_SIZE) {
+        g_warning ("%s: message of %zd bytes is too short for a TPM "
+                   "command", __func__, num_read);
+        return NULL;
+    }
+    size = get_command_size (packet);
+    if (size != (size_t)num_read) {
+        g_warning ("%s: message is %zd bytes but the command header size "
+                   "is %zu", __func__, num_read, size);
+        return NULL;
+    }
+    buf = util_buf_get (size);
+    memcpy (buf, packet, size);
+    g_debug ("%s: read TPM buffer of size: %zu", __func__, size);
+    g_debug_bytes (buf, size, 16, 4);
+    *buf_size = size;
+    return buf;
 }
 /*
  * Create a GSocket for use by the daemon for communicating with the client.
  * The client end of the socket is returned through the client_fd
- * parameter.
+ * parameter. 'type' is the socket type: SOCK_STREAM or SOCK_SEQPACKET.
  */
 GIOStream*
-create_connection_iostream (int *client_fd)
+create_connection_iostream_type (int *client_fd,
+                                 int  type)
 {
     GIOStream *iostream;
     GSocket *sock;
     int server_fd, ret;
 
-    ret = create_socket_pair (client_fd,
-                              &server_fd,
-                              SOCK_CLOEXEC | SOCK_NONBLOCK);
+    ret = create_socket_pair_type (client_fd,
+                                   &server_fd,
+                                   type,
+                                   SOCK_CLOEXEC | SOCK_NONBLOCK);
     if (ret == -1) {
         g_error ("CreateConnection failed to make fd pair %s", strerror (errno));
     }
@@ -277,18 +429,75 @@ create_connection_iostream (int *client_fd)
     g_object_unref (sock);
     return iostream;
 }
+static void
+relay_done (GObject      *source_object,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+    GMainLoop *loop = (GMainLoop*)user_data;
+    GError *error = NULL;
+    UNUSED_PARAM(source_object);
+
+    if (!g_io_stream_splice_finish (result, &error)) {
+        g_debug ("%s: relay ended: %s", __func__, error->message);
+        g_error_free (error);
+    }
+    g_main_loop_quit (loop);
+}
+/*
+ * Relay the data from 'remote' to 'local' and back until either end
+ * closes, then close both. This joins a TLS session to a connection
+ * socket: closing one end is how the other learns the peer went away.
+ * Each direction forwards everything a read gets in one write, so
+ * commands or responses that are pipelined go out in as few TLS records
+ * and TCP segments as they're ready in. This blocks the calling thread,
+ * the relay runs from a GMainContext of its own.
+ */
+void
+relay_iostreams (GIOStream *remote,
+                 GIOStream *local)
+{
+    GMainContext *context;
+    GMainLoop *loop;
+
+    context = g_main_context_new ();
+    loop = g_main_loop_new (context, FALSE);
+    g_main_context_push_thread_default (context);
+    g_io_stream_splice_async (remote,
+                              local,
+                              G_IO_STREAM_SPLICE_CLOSE_STREAM1 |
+                              G_IO_STREAM_SPLICE_CLOSE_STREAM2,
+                              G_PRIORITY_DEFAULT,
+                              NULL,
+                              relay_done,
+                              loop);
+    g_main_loop_run (loop);
+    g_main_context_pop_thread_default (context);
+    g_main_loop_unref (loop);
+    g_main_context_unref (context);
+}
+/*
+ * Create a stream GSocket for use by the daemon for communicating with the
+ * client. See create_connection_iostream_type.
+ */
+GIOStream*
+create_connection_iostream (int *client_fd)
+{
+    return create_connection_iostream_type (client_fd, SOCK_STREAM);
+}
 /*
- * Create a socket and return the fds for both ends of the communication
- * channel.
+ * Create a socket of the provided type and return the fds for both ends
+ * of the communication channel.
  */
 int
-create_socket_pair (int *fd_a,
-                    int *fd_b,
-                    int  flags)
+create_socket_pair_type (int *fd_a,
+                         int *fd_b,
+                         int  type,
+                         int  flags)
 {
     int ret, fds[2] = { 0, };
 
-    ret = socketpair (PF_LOCAL, SOCK_STREAM | flags, 0, fds);
+    ret = socketpair (PF_LOCAL, type | flags, 0, fds);
     if (ret == -1) {
         g_warning ("%s: failed to create socket pair with errno: %d",
                    __func__, errno);
@@ -298,10 +507,24 @@ create_socket_pair (int *fd_a,
     *fd_b = fds [1];
     return 0;
 }
+/*
+ * Create a stream socket and return the fds for both ends of the
+ * communication channel.
+ */
+int
+create_socket_pair (int *fd_a,
+                    int *fd_b,
+                    int  flags)
+{
+    return create_socket_pair_type (fd_a, fd_b, SOCK_STREAM, flags);
+}
 /* pretty print */
 void
 g_debug_tpma_cc (TPMA_CC tpma_cc)
 {
+    if (!util_debug_enabled ()) {
+        return;
+    }
     g_debug ("TPMA_CC: 0x%08" PRIx32, tpma_cc);
     g_debug ("  commandIndex: 0x%" PRIx16, (tpma_cc & TPMA_CC_COMMANDINDEX_MASK) >> TPMA_CC_COMMANDINDEX_SHIFT);
     g_debug ("  reserved1:    0x%" PRIx8, (tpma_cc & TPMA_CC_RESERVED1_MASK));
@@ -375,3 +598,98 @@ parse_key_value_string (char *kv_str,
 out:
     return rc;
 }
+/*
+ * Decode the hex in 'hex' into a command buffer, ignoring whitespace.
+ * Returns NULL unless it's a whole TPM command, its size matching the one
+ * in its header. The caller must free the returned GBytes with
+ * g_bytes_unref.
+ */
+GBytes*
+parse_command_hex (const gchar *hex)
+{
+    GByteArray *bytes = g_byte_array_new ();
+    gint high = -1, value;
+    guint8 byte;
+
+    for (; *hex != '\0'; ++hex) {
+        if (g_ascii_isspace (*hex)) {
+            continue;
+        }
+        value = g_ascii_xdigit_value (*hex);
+        if (value < 0) {
+            g_warning ("%s: '%c' isn't a hex digit", __func__, *hex);
+            goto err_out;
+        }
+        if (high < 0) {
+            high = value;
+        } else {
+            byte = (guint8)(high << 4 | value);
+            g_byte_array_append (bytes, &byte, 1);
+            high = -1;
+        }
+    }
+    if (high >= 0 || bytes->len < TPM_HEADER_SIZE ||
+        get_command_size (bytes->data) != bytes->len)
+    {
+        g_warning ("%s: not a whole TPM command", __func__);
+        goto err_out;
+    }
+    return g_byte_array_free_to_bytes (bytes);
+err_out:
+    g_byte_array_unref (bytes);
+    return NULL;
+}
+/*
+ * Add the 'elapsed' microseconds of a ContextLoad to the running average
+ * 'load_us', 0 if none was timed yet. Recent loads weigh more so the
+ * average follows the TPM getting busier. Never returns 0.
+ */
+guint
+context_load_average (guint  load_us,
+                      gint64 elapsed)
+{
+    elapsed = CLAMP (elapsed, 1, G_MAXUINT);
+    if (load_us == 0) {
+        return (guint)elapsed;
+    }
+    return MAX ((guint)(((guint64)load_us * 3 + (guint64)elapsed) / 4), 1);
+}
+/*
+ * The model context_load_cost estimates untimed loads with, until
+ * context_load_set_model replaces it with the one a TPM was measured to
+ * follow. The time per byte is kept per KiB to keep the fraction.
+ */
+static gint load_base_us = CONTEXT_LOAD_US_BASE;
+static gint load_us_per_kib = CONTEXT_LOAD_US_PER_BYTE * 1024;
+/*
+ * Estimate the loads of contexts that weren't loaded yet as taking
+ * 'base_us' plus 'us_per_kib' for each KiB of the context. With several
+ * TPMs the last one calibrated sets the model, loads once timed are
+ * costed by their own time anyway.
+ */
+void
+context_load_set_model (guint base_us,
+                        guint us_per_kib)
+{
+    g_atomic_int_set (&load_base_us, (gint)MIN (base_us, G_MAXINT));
+    g_atomic_int_set (&load_us_per_kib, (gint)MIN (us_per_kib, G_MAXINT));
+}
+/*
+ * The cost in microseconds of loading a context again: the average time
+ * its loads took if it was loaded before, an estimate from the 'size' of
+ * the saved context if it was saved and from a context of 1 KiB, typical
+ * of a key, otherwise.
+ */
+guint64
+context_load_cost (guint load_us,
+                   gsize size)
+{
+    if (load_us > 0) {
+        return load_us;
+    }
+    if (size == 0) {
+        size = 1024;
+    }
+    return (guint64)g_atomic_int_get (&load_base_us) +
+        (guint64)size * (guint64)g_atomic_int_get (&load_us_per_kib) / 1024;
+}
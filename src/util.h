@@ -19,6 +19,29 @@
 /* Use to suppress "unused variable" warnings: */
 #define UNUSED_VAR(p) ((void)(p))
 
+/*
+ * Debug output is on if G_MESSAGES_DEBUG is set to anything when the
+ * first message is logged, that's a superset of when glib prints it.
+ * Otherwise g_debug doesn't evaluate its arguments and the hex dumps
+ * return before formatting anything. Configuring with
+ * --disable-debug-log compiles the messages out altogether.
+ */
+extern gint util_debug_state;
+gboolean util_debug_init (void);
+#ifdef DISABLE_DEBUG_LOG
+#define util_debug_enabled() FALSE
+#else
+#define util_debug_enabled() \
+    (G_LIKELY (g_atomic_int_get (&util_debug_state) >= 0) ? \
+     g_atomic_int_get (&util_debug_state) : util_debug_init ())
+#endif
+#undef g_debug
+#define g_debug(...) \
+    G_STMT_START { \
+        if (util_debug_enabled ()) \
+            g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, __VA_ARGS__); \
+    } G_STMT_END
+
 /* Used to suppress scan-build NULL dereference warnings: */
 #ifdef SCANBUILD
 #define ASSERT_NON_NULL(x) assert_non_null(x); \
@@ -47,8 +70,21 @@
 #define UTIL_BUF_SIZE 1024
 /* stop allocating at BUF_MAX */
 #define UTIL_BUF_MAX  8*UTIL_BUF_SIZE
+/* pooled buffers come in UTIL_BUF_SIZE doubling up to UTIL_BUF_MAX */
+#define UTIL_BUF_CLASSES 4
+/* free buffers kept in each size class of the pool */
+#define UTIL_BUF_POOL_DEPTH 16
 
 #define prop_str(val) val ? "set" : "clear"
+/*
+ * The time in microseconds a ContextLoad is expected to take before one
+ * was timed. The TPM decrypts and checks the whole blob so it grows with
+ * the size of the context: large RSA keys cost more than ECC ones.
+ */
+#define CONTEXT_LOAD_US_BASE     2000
+#define CONTEXT_LOAD_US_PER_BYTE 8
+#define CONTEXT_LOAD_US_DEFAULT  (CONTEXT_LOAD_US_BASE + \
+                                  1024 * CONTEXT_LOAD_US_PER_BYTE)
 
 /*
  * Print warning message for a given response code.
@@ -92,17 +128,37 @@ int         read_tpm_buffer                 (GInputStream     *istream,
                                              size_t            buf_size);
 uint8_t*    read_tpm_buffer_alloc           (GInputStream     *istream,
                                              size_t           *buf_size);
+uint8_t*    read_tpm_packet_alloc           (GSocket          *socket,
+                                             size_t           *buf_size);
+uint8_t*    util_buf_get                    (size_t            size);
+void        util_buf_put                    (uint8_t          *buf,
+                                             size_t            size);
 void        g_debug_bytes                   (uint8_t const    *byte_array,
                                              size_t            array_size,
                                              size_t            width,
                                              size_t            indent);
 GIOStream*  create_connection_iostream      (int              *client_fd);
+void        relay_iostreams                 (GIOStream        *remote,
+                                             GIOStream        *local);
+GIOStream*  create_connection_iostream_type (int              *client_fd,
+                                             int               type);
 int         create_socket_pair              (int              *fd_a,
                                              int              *fd_b,
                                              int               flags);
+int         create_socket_pair_type         (int              *fd_a,
+                                             int              *fd_b,
+                                             int               type,
+                                             int               flags);
 void        g_debug_tpma_cc                 (TPMA_CC           tpma_cc);
 TSS2_RC     parse_key_value_string (char *kv_str,
                                     KeyValueFunc callback,
                                     gpointer user_data);
+GBytes*     parse_command_hex               (const gchar      *hex);
+guint       context_load_average            (guint             load_us,
+                                             gint64            elapsed);
+guint64     context_load_cost               (guint             load_us,
+                                             gsize             size);
+void        context_load_set_model          (guint             base_us,
+                                             guint             us_per_kib);
 
 #endif /* UTIL_H */
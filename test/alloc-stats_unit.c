@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib-object.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "alloc-stats.h"
+#include "util.h"
+
+/*
+ * Each allocation counted adds one to the allocations of its subsystem
+ * and its size to the bytes, the other subsystems are left alone.
+ */
+static void
+alloc_stats_add_test (void **state)
+{
+    gsize allocations, bytes, other_allocations, other_bytes;
+    gsize after_allocations, after_bytes;
+    UNUSED_PARAM (state);
+
+    alloc_stats_get (ALLOC_STATS_COMMAND, &allocations, &bytes);
+    alloc_stats_get (ALLOC_STATS_SESSION, &other_allocations, &other_bytes);
+    alloc_stats_add (ALLOC_STATS_COMMAND, 100);
+    alloc_stats_add (ALLOC_STATS_COMMAND, 28);
+    alloc_stats_get (ALLOC_STATS_COMMAND, &after_allocations, &after_bytes);
+    assert_int_equal (after_allocations, allocations + 2);
+    assert_int_equal (after_bytes, bytes + 128);
+    alloc_stats_get (ALLOC_STATS_SESSION, &after_allocations, &after_bytes);
+    assert_int_equal (after_allocations, other_allocations);
+    assert_int_equal (after_bytes, other_bytes);
+}
+static void
+alloc_stats_name_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_string_equal (alloc_stats_name (ALLOC_STATS_BUFFER), "buffer");
+    assert_string_equal (alloc_stats_name (ALLOC_STATS_CONNECTION),
+                         "connection");
+}
+static void
+alloc_stats_object_size_test (void **state)
+{
+    GObject *object;
+    UNUSED_PARAM (state);
+
+    assert_int_equal (alloc_stats_object_size (NULL), 0);
+    object = g_object_new (G_TYPE_OBJECT, NULL);
+    assert_int_equal (alloc_stats_object_size (object), sizeof (GObject));
+    g_object_unref (object);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (alloc_stats_add_test),
+        cmocka_unit_test (alloc_stats_name_test),
+        cmocka_unit_test (alloc_stats_object_size_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
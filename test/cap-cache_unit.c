@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "cap-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define TTL_MS 10
+#define NOW    G_USEC_PER_SEC
+
+typedef struct {
+    CapCache *cache;
+} test_data_t;
+
+static int
+cap_cache_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->cache = cap_cache_new (TTL_MS);
+    *state = data;
+    return 0;
+}
+static int
+cap_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+/*
+ * Build a GetCapability command with the provided tag asking for 'count'
+ * entries of capability 'cap' from 'prop' on.
+ */
+static Tpm2Command*
+get_cap_command_new (TPMI_ST_COMMAND_TAG tag,
+                     TPM2_CAP            cap,
+                     UINT32              prop,
+                     UINT32              count)
+{
+    size_t size = TPM2_MAX_COMMAND_SIZE, offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+
+    assert_int_equal (Tss2_MU_UINT32_Marshal (cap, buffer, size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (prop, buffer, size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (count, buffer, size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, tag, offset,
+                                        TPM2_CC_GetCapability),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, offset, TPM2_CC_GetCapability);
+}
+static void
+cap_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_CAP_CACHE (data->cache));
+    assert_int_equal (cap_cache_size (data->cache), 0);
+}
+/*
+ * Queries for the same variable properties get the same key, queries for
+ * other ones get different keys. The fixed properties, other capabilities
+ * and queries with sessions aren't cached.
+ */
+static void
+cap_cache_key_test (void **state)
+{
+    Tpm2Command *commands [6];
+    GBytes *key_a, *key_b, *key_c;
+    guint i;
+    UNUSED_PARAM(state);
+
+    commands [0] = get_cap_command_new (TPM2_ST_NO_SESSIONS,
+                                        TPM2_CAP_TPM_PROPERTIES,
+                                        TPM2_PT_VAR,
+                                        TPM2_MAX_TPM_PROPERTIES);
+    commands [1] = get_cap_command_new (TPM2_ST_NO_SESSIONS,
+                                        TPM2_CAP_TPM_PROPERTIES,
+                                        TPM2_PT_VAR,
+                                        TPM2_MAX_TPM_PROPERTIES);
+    commands [2] = get_cap_command_new (TPM2_ST_NO_SESSIONS,
+                                        TPM2_CAP_TPM_PROPERTIES,
+                                        TPM2_PT_HR_LOADED_AVAIL,
+                                        1);
+    commands [3] = get_cap_command_new (TPM2_ST_NO_SESSIONS,
+                                        TPM2_CAP_TPM_PROPERTIES,
+                                        TPM2_PT_FIXED,
+                                        TPM2_MAX_TPM_PROPERTIES);
+    commands [4] = get_cap_command_new (TPM2_ST_NO_SESSIONS,
+                                        TPM2_CAP_PCRS,
+                                        TPM2_PT_VAR,
+                                        1);
+    commands [5] = get_cap_command_new (TPM2_ST_SESSIONS,
+                                        TPM2_CAP_TPM_PROPERTIES,
+                                        TPM2_PT_VAR,
+                                        TPM2_MAX_TPM_PROPERTIES);
+    key_a = cap_cache_key (commands [0]);
+    key_b = cap_cache_key (commands [1]);
+    key_c = cap_cache_key (commands [2]);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_true (g_bytes_equal (key_a, key_b));
+    assert_false (g_bytes_equal (key_a, key_c));
+    assert_null (cap_cache_key (commands [3]));
+    assert_null (cap_cache_key (commands [4]));
+    assert_null (cap_cache_key (commands [5]));
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    for (i = 0; i < G_N_ELEMENTS (commands); ++i) {
+        g_object_unref (commands [i]);
+    }
+}
+/*
+ * The commands that change the variable properties drop the cache, and
+ * so does a failed authorization whatever the command. Other commands
+ * and errors leave it.
+ */
+static void
+cap_cache_invalidates_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_true (cap_cache_invalidates (TPM2_CC_Startup, TSS2_RC_SUCCESS));
+    assert_true (cap_cache_invalidates (TPM2_CC_HierarchyControl,
+                                        TSS2_RC_SUCCESS));
+    assert_true (cap_cache_invalidates (TPM2_CC_Clear, TSS2_RC_SUCCESS));
+    assert_true (cap_cache_invalidates (TPM2_CC_NV_DefineSpace,
+                                        TSS2_RC_SUCCESS));
+    assert_true (cap_cache_invalidates (TPM2_CC_Unseal,
+                                        TPM2_RC_AUTH_FAIL + TPM2_RC_S +
+                                        TPM2_RC_1));
+    assert_true (cap_cache_invalidates (TPM2_CC_Sign,
+                                        TPM2_RC_BAD_AUTH + TPM2_RC_S +
+                                        TPM2_RC_1));
+    assert_false (cap_cache_invalidates (TPM2_CC_GetCapability,
+                                         TSS2_RC_SUCCESS));
+    assert_false (cap_cache_invalidates (TPM2_CC_Unseal,
+                                         TPM2_RC_LOCKOUT));
+    assert_false (cap_cache_invalidates (TPM2_CC_Sign,
+                                         TPM2_RC_HANDLE + TPM2_RC_H +
+                                         TPM2_RC_1));
+}
+/*
+ * Insert an entry and look it up until it expires, then fill the cache
+ * and check that a new key is only added once an entry has expired.
+ * Clearing the cache drops everything.
+ */
+static void
+cap_cache_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gint64 ttl = TTL_MS * G_TIME_SPAN_MILLISECOND;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    GBytes *keys [CAP_CACHE_MAX + 1], *bytes, *bytes_out;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (keys); ++i) {
+        keys [i] = g_bytes_new (&i, sizeof (i));
+    }
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (cap_cache_insert (data->cache, keys [0], bytes, NOW));
+    bytes_out = cap_cache_lookup (data->cache, keys [0], NOW + ttl - 1);
+    assert_non_null (bytes_out);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+    assert_null (cap_cache_lookup (data->cache, keys [1], NOW));
+    assert_null (cap_cache_lookup (data->cache, keys [0], NOW + ttl));
+    assert_int_equal (cap_cache_size (data->cache), 0);
+
+    assert_true (cap_cache_insert (data->cache, keys [0], bytes, NOW));
+    for (i = 1; i < CAP_CACHE_MAX; ++i) {
+        assert_true (cap_cache_insert (data->cache, keys [i], bytes,
+                                       NOW + ttl));
+    }
+    assert_false (cap_cache_insert (data->cache, keys [CAP_CACHE_MAX], bytes,
+                                    NOW + ttl - 1));
+    assert_true (cap_cache_insert (data->cache, keys [CAP_CACHE_MAX], bytes,
+                                   NOW + ttl));
+    assert_int_equal (cap_cache_size (data->cache), CAP_CACHE_MAX);
+    cap_cache_clear (data->cache);
+    assert_int_equal (cap_cache_size (data->cache), 0);
+    assert_null (cap_cache_lookup (data->cache, keys [1], NOW + ttl));
+    g_bytes_unref (bytes);
+    for (i = 0; i < G_N_ELEMENTS (keys); ++i) {
+        g_bytes_unref (keys [i]);
+    }
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (cap_cache_type_test,
+                                         cap_cache_setup,
+                                         cap_cache_teardown),
+        cmocka_unit_test (cap_cache_key_test),
+        cmocka_unit_test (cap_cache_invalidates_test),
+        cmocka_unit_test_setup_teardown (cap_cache_insert_lookup_test,
+                                         cap_cache_setup,
+                                         cap_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
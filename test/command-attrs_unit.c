@@ -180,6 +180,66 @@ command_attrs_from_cc_fail_test (void **state)
                                        TPM2_CC_EvictControl);
     assert_int_equal (ret_attrs, 0);
 }
+/*
+ * Vendor commands are outside the direct-indexed table. They're found by
+ * the full command code, vendor bit included.
+ */
+static void
+command_attrs_from_cc_vendor_test (void **state)
+{
+    test_data_t *data = *state;
+    TPMA_CC      vendor_attrs = TPMA_CC_V | 0x1234 | 0x02000000;
+    TPMA_CC      command_attributes [2] = { TPM2_CC_Startup, vendor_attrs };
+    gint         ret;
+
+    will_return (__wrap_tpm2_get_command_attrs, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_get_command_attrs, 2);
+    will_return (__wrap_tpm2_get_command_attrs, command_attributes);
+    ret = command_attrs_init_tpm (data->command_attrs, data->tpm2);
+    assert_int_equal (ret, 0);
+    assert_int_equal (data->command_attrs->other_count, 1);
+
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPM2_CC_Startup),
+                      TPM2_CC_Startup);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs,
+                                             TPMA_CC_V | 0x1234),
+                      vendor_attrs);
+    assert_int_equal (command_attrs_from_cc (data->command_attrs, 0x1234), 0);
+}
+/*
+ * Commands without handles in the command or the response pass through,
+ * GetRandom does, ReadPublic with its handle doesn't and neither does
+ * Startup. Commands the TPM doesn't implement never do.
+ */
+static void
+command_attrs_is_passthrough_test (void **state)
+{
+    test_data_t *data = *state;
+    TPMA_CC      command_attributes [3] = {
+        TPM2_CC_GetRandom,
+        TPM2_CC_ReadPublic | (1 << TPMA_CC_CHANDLES_SHIFT),
+        TPM2_CC_Startup,
+    };
+    gint         ret;
+
+    will_return (__wrap_tpm2_get_command_attrs, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_get_command_attrs, 3);
+    will_return (__wrap_tpm2_get_command_attrs, command_attributes);
+    ret = command_attrs_init_tpm (data->command_attrs, data->tpm2);
+    assert_int_equal (ret, 0);
+
+    assert_true (command_attrs_is_passthrough (data->command_attrs,
+                                               TPM2_CC_GetRandom));
+    assert_false (command_attrs_is_passthrough (data->command_attrs,
+                                                TPM2_CC_ReadPublic));
+    assert_false (command_attrs_is_passthrough (data->command_attrs,
+                                                TPM2_CC_Startup));
+    assert_false (command_attrs_is_passthrough (data->command_attrs,
+                                                TPM2_CC_Hash));
+    assert_false (command_attrs_is_passthrough (data->command_attrs,
+                                                TPMA_CC_V | 0x1234));
+}
 gint
 main (void)
 {
@@ -199,6 +259,12 @@ main (void)
         cmocka_unit_test_setup_teardown (command_attrs_from_cc_fail_test,
                                          command_attrs_init_tpm_setup,
                                          command_attrs_teardown),
+        cmocka_unit_test_setup_teardown (command_attrs_from_cc_vendor_test,
+                                         command_attrs_setup,
+                                         command_attrs_teardown),
+        cmocka_unit_test_setup_teardown (command_attrs_is_passthrough_test,
+                                         command_attrs_setup,
+                                         command_attrs_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-recorder.h"
+#include "util.h"
+
+typedef struct {
+    gchar *dir;
+    gchar *path;
+} test_data_t;
+
+static int
+command_recorder_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->dir = g_dir_make_tmp ("command-recorder-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "recording", NULL);
+    *state = data;
+    return 0;
+}
+static int
+command_recorder_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    free (data);
+    return 0;
+}
+/*
+ * What's recorded reads back in order, with the times never going
+ * backwards. Only the owner may read the file.
+ */
+static void
+command_recorder_round_trip_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+                          0x00, 0x00, 0x01, 0x7b, 0x00, 0x10, };
+    guint8 response [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                           0x00, 0x00, 0x00, 0x00, };
+    CommandRecorder *recorder;
+    command_record_t record;
+    GStatBuf buf;
+    FILE *file;
+
+    recorder = command_recorder_new (data->path);
+    assert_non_null (recorder);
+    command_recorder_add (recorder, COMMAND_RECORD_COMMAND, 7,
+                          command, sizeof (command));
+    command_recorder_add (recorder, COMMAND_RECORD_RESPONSE, 7,
+                          response, sizeof (response));
+    command_recorder_add (recorder, COMMAND_RECORD_CLOSE, 7, NULL, 0);
+    assert_int_equal (recorder->records, 3);
+    g_object_unref (recorder);
+
+    assert_int_equal (g_stat (data->path, &buf), 0);
+    assert_int_equal (buf.st_mode & 0777, 0600);
+    file = fopen (data->path, "r");
+    assert_non_null (file);
+    assert_true (command_record_read_header (file));
+
+    assert_int_equal (command_record_read (file, &record), 1);
+    assert_int_equal (record.type, COMMAND_RECORD_COMMAND);
+    assert_int_equal (record.connection, 7);
+    assert_int_equal (record.size, sizeof (command));
+    assert_memory_equal (record.data, command, sizeof (command));
+    g_free (record.data);
+
+    assert_int_equal (command_record_read (file, &record), 1);
+    assert_int_equal (record.type, COMMAND_RECORD_RESPONSE);
+    assert_int_equal (record.size, sizeof (response));
+    assert_memory_equal (record.data, response, sizeof (response));
+    g_free (record.data);
+
+    assert_int_equal (command_record_read (file, &record), 1);
+    assert_int_equal (record.type, COMMAND_RECORD_CLOSE);
+    assert_int_equal (record.size, 0);
+    assert_null (record.data);
+
+    assert_int_equal (command_record_read (file, &record), 0);
+    fclose (file);
+}
+/*
+ * A file that doesn't start with the header isn't a recording, and one
+ * that ends in the middle of a record is truncated.
+ */
+static void
+command_recorder_corrupt_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandRecorder *recorder;
+    command_record_t record;
+    guint8 command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                          0x00, 0x00, 0x01, 0x7b, };
+    gchar *contents;
+    gsize length;
+    FILE *file;
+
+    assert_true (g_file_set_contents (data->path, "TABRMDXX\0\0\0\1", 12,
+                                      NULL));
+    file = fopen (data->path, "r");
+    assert_false (command_record_read_header (file));
+    fclose (file);
+
+    recorder = command_recorder_new (data->path);
+    command_recorder_add (recorder, COMMAND_RECORD_COMMAND, 1,
+                          command, sizeof (command));
+    g_object_unref (recorder);
+    assert_true (g_file_get_contents (data->path, &contents, &length, NULL));
+    assert_true (g_file_set_contents (data->path, contents, length - 1, NULL));
+    g_free (contents);
+    file = fopen (data->path, "r");
+    assert_true (command_record_read_header (file));
+    assert_int_equal (command_record_read (file, &record), -1);
+    assert_null (record.data);
+    fclose (file);
+}
+/*
+ * No recorder without a file to write to.
+ */
+static void
+command_recorder_bad_path_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_null (command_recorder_new ("/nonexistent/dir/recording"));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (command_recorder_round_trip_test,
+                                         command_recorder_setup,
+                                         command_recorder_teardown),
+        cmocka_unit_test_setup_teardown (command_recorder_corrupt_test,
+                                         command_recorder_setup,
+                                         command_recorder_teardown),
+        cmocka_unit_test (command_recorder_bad_path_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
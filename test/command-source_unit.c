@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <setjmp.h>
@@ -23,6 +24,7 @@
 #include "source-interface.h"
 #include "command-attrs.h"
 #include "command-source.h"
+#include "control-message.h"
 #include "tabrmd-defaults.h"
 #include "tpm2-command.h"
 #include "util.h"
@@ -45,15 +47,6 @@ __wrap_command_attrs_from_cc (CommandAttrs *attrs,
     UNUSED_PARAM(command_code);
     return (TPMA_CC)mock_type (UINT32);
 }
-Connection*
-__wrap_connection_manager_lookup_istream (ConnectionManager *manager,
-                                          GInputStream      *istream)
-{
-    UNUSED_PARAM(manager);
-    UNUSED_PARAM(istream);
-    g_debug ("%s", __func__);
-    return CONNECTION (mock_ptr_type (GObject*));
-}
 gint
 __wrap_connection_manager_remove      (ConnectionManager  *manager,
                                        Connection         *connection)
@@ -72,7 +65,7 @@ __wrap_read_tpm_buffer_alloc (GSocket   *socket,
     UNUSED_PARAM(socket);
 
     g_debug ("%s", __func__);
-    buf_dst = g_malloc0 (size);
+    buf_dst = util_buf_get (size);
     memcpy (buf_dst, buf_src, size);
     *buf_size = size;
 
@@ -94,9 +87,7 @@ __wrap_sink_enqueue (Sink     *sink,
 /*
  * This wrap function allows us to gain access to the data that will be
  * passed to the source callback registered by the CommandSource object when
- * a new Connection is added. Without this callback it's not possible to get
- * access to the source_data_t structure created by the CommandSource insert
- * function which is required for us to simulate the callback function.
+ * a paused Connection is set up to be resumed.
  */
 void
 __wrap_g_source_set_callback (GSource *source,
@@ -217,7 +208,6 @@ static void
 command_source_connection_insert_test (void **state)
 {
     struct source_test_data *data = (struct source_test_data*)*state;
-    source_data_t *source_data;
     CommandSource *source = data->source;
     GIOStream     *iostream;
     HandleMap     *handle_map;
@@ -232,7 +222,6 @@ command_source_connection_insert_test (void **state)
     g_object_unref (iostream);
     /* starts the main loop in the CommandSource */
     ret = thread_start(THREAD (source));
-    will_return (__wrap_g_source_set_callback, &source_data);
     assert_int_equal (ret, 0);
     /* normally a callback from the connection manager but we fake it here */
     sleep (1);
@@ -270,6 +259,7 @@ command_source_on_io_ready_success_test (void **state)
     HandleMap   *handle_map;
     Connection *connection;
     Tpm2Command *command_out;
+    source_data_t source_data = { .self = data->source, };
     gint client_fd;
     guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x17,
                           0x0,  0x0,  0x01, 0x7a, 0x0,  0x0,
@@ -281,8 +271,7 @@ command_source_on_io_ready_success_test (void **state)
     connection = connection_new (iostream, 0, handle_map);
     g_object_unref (handle_map);
     g_object_unref (iostream);
-        /* prime wraps */
-    will_return (__wrap_connection_manager_lookup_istream, connection);
+    source_data.connection = connection;
 
     /* setup read of tpm buffer */
     will_return (__wrap_read_tpm_buffer_alloc, data_in);
@@ -292,20 +281,21 @@ command_source_on_io_ready_success_test (void **state)
 
     will_return (__wrap_sink_enqueue, &command_out);
 
-    command_source_on_input_ready (NULL, data->source);
+    command_source_on_input_ready (NULL, &source_data);
 
     assert_memory_equal (tpm2_command_get_buffer (command_out),
                          data_in,
                          sizeof (data_in));
     g_object_unref (command_out);
+    g_object_unref (connection);
 }
 /*
  * This tests the CommandSource on_io_ready function for situations where
  * the GSocket associated with a client connection is closed. This causes
  * the attempt to read data from the socket to return an error indicating
- * that the socket was closed. In this case the function should return a
- * value telling GLib to remove the GSource from the main loop. Additionally
- * the data held internally by the CommandSource must be freed.
+ * that the socket was closed. In this case the function should return
+ * G_SOURCE_REMOVE and the socket is no longer watched. Additionally the
+ * data held internally by the CommandSource must be freed.
  */
 static void
 command_source_on_io_ready_eof_test (void **state)
@@ -313,6 +303,7 @@ command_source_on_io_ready_eof_test (void **state)
     struct source_test_data *data = (struct source_test_data*)*state;
     source_data_t *source_data;
     GIOStream   *iostream;
+    GInputStream *istream;
     HandleMap   *handle_map;
     Connection *connection;
     ControlMessage *msg;
@@ -325,19 +316,226 @@ command_source_on_io_ready_eof_test (void **state)
     g_object_unref (handle_map);
     g_object_unref (iostream);
         /* prime wraps */
-    will_return (__wrap_g_source_set_callback, &source_data);
-    will_return (__wrap_connection_manager_lookup_istream, connection);
     will_return (__wrap_read_tpm_buffer_alloc, NULL);
     will_return (__wrap_read_tpm_buffer_alloc, 0);
     will_return (__wrap_sink_enqueue, &msg);
     will_return (__wrap_connection_manager_remove, TRUE);
 
     command_source_on_new_connection (data->manager, connection, data->source);
-    ret = command_source_on_input_ready (g_io_stream_get_input_stream (connection->iostream), source_data);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    source_data = g_hash_table_lookup (data->source->istream_to_source_data_map,
+                                       istream);
+    assert_non_null (source_data);
+    assert_ptr_equal (source_data->connection, connection);
+    ret = command_source_on_input_ready (istream, source_data);
     assert_int_equal (ret, G_SOURCE_REMOVE);
     hash_table_size = g_hash_table_size (data->source->istream_to_source_data_map);
     assert_int_equal (hash_table_size, 0);
     g_object_unref (msg);
+    g_object_unref (connection);
+}
+/*
+ * A connection that reaches the limit on queued commands is no longer
+ * watched for input: on_io_ready removes the data for the connection from
+ * the epoll instance and leaves a timeout source behind to resume it later.
+ */
+static void
+command_source_on_io_ready_max_queued_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data, *resume_data;
+    GIOStream   *iostream;
+    GInputStream *istream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x0a,
+                          0x0,  0x0,  0x01, 0x7a };
+
+    g_object_set (data->source, "max-queued", 1, NULL);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    will_return (__wrap_read_tpm_buffer_alloc, data_in);
+    will_return (__wrap_read_tpm_buffer_alloc, sizeof (data_in));
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+    will_return (__wrap_g_source_set_callback, &resume_data);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    source_data = g_hash_table_lookup (data->source->istream_to_source_data_map,
+                                       istream);
+    assert_non_null (source_data);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_int_equal (g_hash_table_size (data->source->istream_to_source_data_map),
+                      0);
+    assert_int_equal (connection_get_queued (connection), 1);
+    connection_command_done (connection);
+    assert_int_equal (connection_get_queued (connection), 0);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+}
+/*
+ * A connection whose user is over its rate isn't read from: on_io_ready
+ * leaves the command in the socket, stops watching the connection and
+ * sets up a timeout source to resume it once the user is back under it.
+ */
+static void
+command_source_on_io_ready_rate_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data, *resume_data;
+    RateLimiter *limiter;
+    GIOStream   *iostream;
+    GInputStream *istream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    Tpm2Command *command_out;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0x80, 0x01, 0x0,  0x0,  0x0,  0x0a,
+                          0x0,  0x0,  0x01, 0x7a };
+
+    limiter = rate_limiter_new (1);
+    g_object_set (data->source, "rate-limiter", limiter, NULL);
+    g_object_unref (limiter);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    connection_set_uid (connection, 1000);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    will_return (__wrap_read_tpm_buffer_alloc, data_in);
+    will_return (__wrap_read_tpm_buffer_alloc, sizeof (data_in));
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+    will_return (__wrap_g_source_set_callback, &resume_data);
+
+    command_source_on_new_connection (data->manager, connection, data->source);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    source_data = g_hash_table_lookup (data->source->istream_to_source_data_map,
+                                       istream);
+    assert_non_null (source_data);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+    assert_int_equal (connection_get_queued (connection), 1);
+    /* the burst of one command is used up, the next one isn't read */
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_REMOVE);
+    assert_int_equal (g_hash_table_size (data->source->istream_to_source_data_map),
+                      0);
+    assert_int_equal (connection_get_queued (connection), 1);
+    connection_command_done (connection);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+}
+/*
+ * With two shards every connection is read by exactly one of the
+ * CommandSources. The other one doesn't watch it.
+ */
+static void
+command_source_shard_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    CommandSource *other;
+    GIOStream   *iostream;
+    HandleMap   *handle_map;
+    Connection *connection;
+    gint client_fd;
+    gint64 id;
+
+    other = command_source_new (data->manager, data->command_attrs);
+    g_object_set (data->source, "shard", 0, "shard-count", 2, NULL);
+    g_object_set (other, "shard", 1, "shard-count", 2, NULL);
+    for (id = 0; id < 8; ++id) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client_fd);
+        connection = connection_new (iostream, id, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+        assert_true (command_source_owns_connection (data->source, connection) !=
+                     command_source_owns_connection (other, connection));
+        command_source_on_new_connection (data->manager, connection, data->source);
+        command_source_on_new_connection (data->manager, connection, other);
+        g_object_unref (connection);
+    }
+    assert_int_equal (g_hash_table_size (data->source->istream_to_source_data_map) +
+                      g_hash_table_size (other->istream_to_source_data_map),
+                      8);
+    g_object_unref (other);
+}
+/*
+ * Commands on a multiplexed connection go to the logical connection for
+ * their channel, created by the first command with the tag. A message with
+ * only the tag closes the channel.
+ */
+static void
+command_source_on_io_ready_mux_test (void **state)
+{
+    struct source_test_data *data = (struct source_test_data*)*state;
+    source_data_t *source_data;
+    GIOStream   *iostream;
+    GInputStream *istream;
+    HandleMap   *handle_map;
+    Connection *connection, *channel;
+    Tpm2Command *command_out;
+    ControlMessage *msg;
+    gint client_fd;
+    gboolean ret;
+    guint8 data_in [] = { 0x0,  0x0,  0x0,  0x2a,
+                          0x80, 0x01, 0x0,  0x0,  0x0,  0x0a,
+                          0x0,  0x0,  0x01, 0x7a };
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream_type (&client_fd, SOCK_SEQPACKET);
+    connection = connection_new (iostream, 0, handle_map);
+    connection_set_mux (connection, TRUE);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    command_source_on_new_connection (data->manager, connection, data->source);
+    istream = g_io_stream_get_input_stream (connection->iostream);
+    source_data = g_hash_table_lookup (data->source->istream_to_source_data_map,
+                                       istream);
+    assert_non_null (source_data);
+    assert_true (source_data->mux);
+
+    assert_int_equal (write (client_fd, data_in, sizeof (data_in)),
+                      sizeof (data_in));
+    will_return (__wrap_command_attrs_from_cc, 0);
+    will_return (__wrap_sink_enqueue, &command_out);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+    assert_memory_equal (tpm2_command_get_buffer (command_out),
+                         &data_in [TABRMD_CHANNEL_TAG_SIZE],
+                         sizeof (data_in) - TABRMD_CHANNEL_TAG_SIZE);
+    channel = tpm2_command_get_connection (command_out);
+    assert_ptr_not_equal (channel, connection);
+    assert_ptr_equal (connection_get_transport (channel), connection);
+    assert_int_equal (connection_get_channel (channel), 0x2a);
+    assert_int_equal (connection_get_queued (channel), 1);
+    assert_int_equal (connection_get_queued (connection), 1);
+
+    assert_int_equal (write (client_fd, data_in, TABRMD_CHANNEL_TAG_SIZE),
+                      TABRMD_CHANNEL_TAG_SIZE);
+    will_return (__wrap_sink_enqueue, &msg);
+    ret = command_source_on_input_ready (istream, source_data);
+    assert_int_equal (ret, G_SOURCE_CONTINUE);
+    assert_int_equal (control_message_get_code (msg), CONNECTION_REMOVED);
+    assert_ptr_equal (control_message_get_object (msg), channel);
+    assert_true (connection_is_closed (channel));
+    assert_false (connection_is_closed (connection));
+
+    g_object_unref (msg);
+    g_object_unref (channel);
+    g_object_unref (command_out);
+    g_object_unref (connection);
+    close (client_fd);
 }
 /* command_source_connection_test end */
 int
@@ -356,9 +554,21 @@ main (void)
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_success_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_max_queued_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_rate_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
         cmocka_unit_test_setup_teardown (command_source_on_io_ready_eof_test,
                                          command_source_connection_setup,
                                          command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_shard_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
+        cmocka_unit_test_setup_teardown (command_source_on_io_ready_mux_test,
+                                         command_source_connection_setup,
+                                         command_source_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-stats.h"
+
+typedef struct {
+    CommandStats *stats;
+} test_data_t;
+
+static int
+command_stats_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->stats = command_stats_new ();
+    *state = data;
+    return 0;
+}
+static int
+command_stats_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->stats);
+    free (data);
+    return 0;
+}
+/*
+ * Samples land in the logarithmic bucket for their duration, anything
+ * beyond the last boundary in the last bucket.
+ */
+static void
+command_stats_add_buckets_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    command_stats_histogram_t histogram;
+
+    assert_false (command_stats_get (data->stats,
+                                     TPM2_CC_Load,
+                                     COMMAND_STATS_WRITE,
+                                     &histogram));
+    command_stats_add (data->stats, TPM2_CC_Load, COMMAND_STATS_WRITE, 0);
+    command_stats_add (data->stats, TPM2_CC_Load, COMMAND_STATS_WRITE, 1);
+    command_stats_add (data->stats, TPM2_CC_Load, COMMAND_STATS_WRITE, 3);
+    command_stats_add (data->stats, TPM2_CC_Load, COMMAND_STATS_WRITE, 1000);
+    command_stats_add (data->stats,
+                       TPM2_CC_Load,
+                       COMMAND_STATS_WRITE,
+                       G_GINT64_CONSTANT (1) << 40);
+    assert_true (command_stats_get (data->stats,
+                                    TPM2_CC_Load,
+                                    COMMAND_STATS_WRITE,
+                                    &histogram));
+    assert_int_equal (histogram.count, 5);
+    assert_int_equal (histogram.total_us,
+                      1004 + (G_GUINT64_CONSTANT (1) << 40));
+    assert_int_equal (histogram.buckets [0], 1);
+    assert_int_equal (histogram.buckets [1], 1);
+    assert_int_equal (histogram.buckets [2], 1);
+    /* 512 <= 1000 < 1024 */
+    assert_int_equal (histogram.buckets [10], 1);
+    assert_int_equal (histogram.buckets [COMMAND_STATS_BUCKETS - 1], 1);
+}
+/*
+ * Phases the command didn't get to have a time of 0 and are skipped, so
+ * is the phase leading up to them.
+ */
+static void
+command_stats_add_times_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    command_stats_histogram_t histogram;
+    gint64 times [COMMAND_STATS_WRITE + 1] = {
+        [COMMAND_STATS_QUEUE] = 100,
+        [COMMAND_STATS_LOAD]  = 150,
+        [COMMAND_STATS_EXEC]  = 0,
+        [COMMAND_STATS_SAVE]  = 400,
+        [COMMAND_STATS_WRITE] = 450,
+    };
+
+    command_stats_add_times (data->stats, TPM2_CC_Sign, times);
+    assert_true (command_stats_get (data->stats,
+                                    TPM2_CC_Sign,
+                                    COMMAND_STATS_QUEUE,
+                                    &histogram));
+    assert_int_equal (histogram.count, 1);
+    assert_int_equal (histogram.total_us, 50);
+    command_stats_get (data->stats,
+                       TPM2_CC_Sign,
+                       COMMAND_STATS_LOAD,
+                       &histogram);
+    assert_int_equal (histogram.count, 0);
+    command_stats_get (data->stats,
+                       TPM2_CC_Sign,
+                       COMMAND_STATS_EXEC,
+                       &histogram);
+    assert_int_equal (histogram.count, 0);
+    command_stats_get (data->stats,
+                       TPM2_CC_Sign,
+                       COMMAND_STATS_SAVE,
+                       &histogram);
+    assert_int_equal (histogram.count, 1);
+    assert_int_equal (histogram.total_us, 50);
+}
+/*
+ * Only the phases with samples make it into the GVariant.
+ */
+static void
+command_stats_build_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GVariantBuilder builder;
+    GVariant *statistics, *child, *buckets;
+    guint32 backend, command_code, phase;
+    guint64 count, total;
+    gsize n_buckets;
+
+    command_stats_add (data->stats, TPM2_CC_Sign, COMMAND_STATS_EXEC, 5);
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (COMMAND_STATS_VARIANT_TYPE));
+    command_stats_build (data->stats, 1, &builder);
+    statistics = g_variant_ref_sink (g_variant_builder_end (&builder));
+    assert_int_equal (g_variant_n_children (statistics), 1);
+    child = g_variant_get_child_value (statistics, 0);
+    g_variant_get (child,
+                   "(uuutt@at)",
+                   &backend,
+                   &command_code,
+                   &phase,
+                   &count,
+                   &total,
+                   &buckets);
+    assert_int_equal (backend, 1);
+    assert_int_equal (command_code, TPM2_CC_Sign);
+    assert_int_equal (phase, COMMAND_STATS_EXEC);
+    assert_int_equal (count, 1);
+    assert_int_equal (total, 5);
+    g_variant_get_fixed_array (buckets, &n_buckets, sizeof (guint64));
+    assert_int_equal (n_buckets, COMMAND_STATS_BUCKETS);
+    g_variant_unref (buckets);
+    g_variant_unref (child);
+    g_variant_unref (statistics);
+}
+static void
+count_rc_callback (TSS2_RC  rc,
+                   guint64  count,
+                   gpointer user_data)
+{
+    g_hash_table_insert ((GHashTable*)user_data,
+                         GUINT_TO_POINTER (rc),
+                         GUINT_TO_POINTER ((guint)count));
+}
+/*
+ * Only responses with an error code are counted, per code.
+ */
+static void
+command_stats_add_rc_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GHashTable *counts = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    command_stats_add_rc (data->stats, TSS2_RC_SUCCESS);
+    command_stats_add_rc (data->stats, TPM2_RC_HANDLE);
+    command_stats_add_rc (data->stats, TPM2_RC_HANDLE);
+    command_stats_add_rc (data->stats, TPM2_RC_RETRY);
+    command_stats_foreach_rc (data->stats, count_rc_callback, counts);
+    assert_int_equal (g_hash_table_size (counts), 2);
+    assert_int_equal (GPOINTER_TO_UINT (g_hash_table_lookup (counts,
+                          GUINT_TO_POINTER (TPM2_RC_HANDLE))), 2);
+    assert_int_equal (GPOINTER_TO_UINT (g_hash_table_lookup (counts,
+                          GUINT_TO_POINTER (TPM2_RC_RETRY))), 1);
+    g_hash_table_unref (counts);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (command_stats_add_buckets_test,
+                                         command_stats_setup,
+                                         command_stats_teardown),
+        cmocka_unit_test_setup_teardown (command_stats_add_times_test,
+                                         command_stats_setup,
+                                         command_stats_teardown),
+        cmocka_unit_test_setup_teardown (command_stats_build_test,
+                                         command_stats_setup,
+                                         command_stats_teardown),
+        cmocka_unit_test_setup_teardown (command_stats_add_rc_test,
+                                         command_stats_setup,
+                                         command_stats_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
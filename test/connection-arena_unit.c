@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "connection-arena.h"
+#include "handle-map-entry.h"
+#include "util.h"
+
+#define CONTEXTS (CONNECTION_ARENA_CHUNK_SLOTS + 1)
+
+typedef struct {
+    ConnectionArena *arena;
+} test_data_t;
+
+static int
+connection_arena_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->arena = connection_arena_new ();
+    assert_non_null (data->arena);
+    *state = data;
+    return 0;
+}
+static int
+connection_arena_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->arena);
+    free (data);
+    return 0;
+}
+static void
+connection_arena_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_CONNECTION_ARENA (data->arena));
+    assert_int_equal (connection_arena_get_used (data->arena), 0);
+    assert_int_equal (connection_arena_get_chunks (data->arena), 0);
+}
+/*
+ * Allocate past the first chunk: each context keeps what's written to it.
+ * A context given back comes out again wiped, without a new chunk.
+ */
+static void
+connection_arena_alloc_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPMS_CONTEXT *contexts [CONTEXTS], *context;
+    guint i;
+
+    for (i = 0; i < CONTEXTS; ++i) {
+        contexts [i] = connection_arena_alloc (data->arena);
+        assert_non_null (contexts [i]);
+        assert_int_equal (contexts [i]->sequence, 0);
+        contexts [i]->sequence = i + 1;
+    }
+    assert_int_equal (connection_arena_get_used (data->arena), CONTEXTS);
+    assert_int_equal (connection_arena_get_chunks (data->arena), 2);
+    for (i = 0; i < CONTEXTS; ++i) {
+        assert_int_equal (contexts [i]->sequence, i + 1);
+    }
+
+    connection_arena_free (contexts [0]);
+    assert_int_equal (connection_arena_get_used (data->arena), CONTEXTS - 1);
+    context = connection_arena_alloc (data->arena);
+    assert_ptr_equal (context, contexts [0]);
+    assert_int_equal (context->sequence, 0);
+    assert_int_equal (connection_arena_get_chunks (data->arena), 2);
+    for (i = 0; i < CONTEXTS; ++i) {
+        connection_arena_free (contexts [i]);
+    }
+    assert_int_equal (connection_arena_get_used (data->arena), 0);
+}
+/*
+ * A HandleMapEntry with an arena keeps its context there and the arena
+ * lives on until the entry gives it back.
+ */
+static void
+connection_arena_entry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ConnectionArena *arena = data->arena;
+    HandleMapEntry *entry;
+    TPMS_CONTEXT *context;
+
+    entry = handle_map_entry_new (0x80000000, 0x80ffffff);
+    handle_map_entry_set_context_arena (entry, arena);
+    context = handle_map_entry_get_context (entry);
+    assert_non_null (context);
+    assert_int_equal (connection_arena_get_used (arena), 1);
+
+    g_object_add_weak_pointer (G_OBJECT (arena), (gpointer*)&arena);
+    g_clear_object (&data->arena);
+    assert_non_null (arena);
+    g_object_unref (entry);
+    assert_null (arena);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (connection_arena_type_test,
+                                         connection_arena_setup,
+                                         connection_arena_teardown),
+        cmocka_unit_test_setup_teardown (connection_arena_alloc_test,
+                                         connection_arena_setup,
+                                         connection_arena_teardown),
+        cmocka_unit_test_setup_teardown (connection_arena_entry_test,
+                                         connection_arena_setup,
+                                         connection_arena_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -134,6 +134,121 @@ connection_manager_remove_test (void **state)
     assert_true (ret_bool);
 }
 
+static void
+connection_removed_callback (ConnectionManager *manager,
+                             Connection        *connection,
+                             gpointer           user_data)
+{
+    UNUSED_PARAM(manager);
+
+    assert_non_null (connection);
+    ++*(guint*)user_data;
+}
+/*
+ * Removing a Connection emits the 'connection-removed' signal once.
+ */
+static void
+connection_manager_remove_signal_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *connection = NULL;
+    GIOStream *iostream;
+    HandleMap   *handle_map = NULL;
+    gint client_fd;
+    guint removed = 0;
+
+    g_signal_connect (manager,
+                      "connection-removed",
+                      G_CALLBACK (connection_removed_callback),
+                      &removed);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 6, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    assert_int_equal (connection_manager_insert (manager, connection), 0);
+    assert_int_equal (removed, 0);
+    assert_true (connection_manager_remove (manager, connection));
+    assert_int_equal (removed, 1);
+    g_object_unref (connection);
+}
+
+/*
+ * A snapshot replaced while a lookup is in flight is kept until a later
+ * change finds no lookup in flight, and a removed Connection stays out of
+ * lookups straight away.
+ */
+static void
+connection_manager_retired_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *connection = NULL;
+    GIOStream *iostream;
+    HandleMap   *handle_map = NULL;
+    gint client_fd;
+    gint64 id;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 7, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    id = *(gint64*)connection_key_id (connection);
+    assert_int_equal (connection_manager_insert (manager, connection), 0);
+    assert_null (manager->retired);
+    assert_true (connection_manager_contains_id (manager, id));
+
+    manager->readers = 1;
+    assert_true (connection_manager_remove (manager, connection));
+    assert_non_null (manager->retired);
+    manager->readers = 0;
+    assert_false (connection_manager_contains_id (manager, id));
+    assert_int_equal (connection_manager_size (manager), 0);
+
+    assert_int_equal (connection_manager_insert (manager, connection), 0);
+    assert_null (manager->retired);
+    g_object_unref (connection);
+}
+/*
+ * A client is over its quota once it has as many connections as the
+ * quota allows, or would be with the connections it asks for. Clients
+ * the frontend couldn't identify have no quota.
+ */
+static void
+connection_manager_client_quota_test (void **state)
+{
+    ConnectionManager *manager = CONNECTION_MANAGER (*state);
+    Connection *connection = NULL;
+    GIOStream *iostream;
+    HandleMap   *handle_map = NULL;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 9, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    connection_set_pid (connection, 100);
+    connection_set_uid (connection, 1000);
+    assert_int_equal (connection_manager_insert (manager, connection), 0);
+    assert_false (connection_manager_client_is_full (manager, 100, 1000, 1));
+
+    connection_manager_set_max_per_pid (manager, 2);
+    assert_false (connection_manager_client_is_full (manager, 100, 1000, 1));
+    assert_true (connection_manager_client_is_full (manager, 100, 1000, 2));
+    assert_false (connection_manager_client_is_full (manager, 0, 1000, 2));
+    assert_false (connection_manager_client_is_full (manager, 101, 1000, 2));
+
+    connection_manager_set_max_per_uid (manager, 1);
+    assert_true (connection_manager_client_is_full (manager, 101, 1000, 1));
+    assert_false (connection_manager_client_is_full (manager,
+                                                     101,
+                                                     RATE_LIMITER_UID_NONE,
+                                                     1));
+    assert_false (connection_manager_client_is_full (manager, 101, 1001, 1));
+    g_object_unref (connection);
+}
+
 int
 main(void)
 {
@@ -151,6 +266,15 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_manager_remove_test,
                                          connection_manager_setup,
                                          connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_remove_signal_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_retired_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
+        cmocka_unit_test_setup_teardown (connection_manager_client_quota_test,
+                                         connection_manager_setup,
+                                         connection_manager_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
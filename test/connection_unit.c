@@ -18,6 +18,8 @@
 #include <cmocka.h>
 
 #include "connection.h"
+#include "tpm2-command.h"
+#include "tabrmd-defaults.h"
 #include "util.h"
 
 typedef struct connection_test_data {
@@ -127,6 +129,156 @@ connection_key_id_test (void **state)
     key = (guint64*)connection_key_id (connection);
     assert_int_equal (connection->id, *key);
 }
+/*
+ * New connections get the default priority class, which can be changed
+ * through the "priority" property.
+ */
+static void
+connection_priority_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+
+    assert_int_equal (connection_get_priority (data->connection),
+                      TABRMD_PRIORITY_DEFAULT);
+    g_object_set (data->connection, "priority", TABRMD_PRIORITY_BATCH, NULL);
+    assert_int_equal (connection_get_priority (data->connection),
+                      TABRMD_PRIORITY_BATCH);
+}
+/*
+ * New connections are at locality 0 until one is set. A logical connection
+ * is at the locality of its parent.
+ */
+static void
+connection_locality_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *channel;
+
+    assert_int_equal (connection_get_locality (data->connection), 0);
+    channel = connection_new_channel (data->connection, 3);
+    connection_set_locality (data->connection, 3);
+    assert_int_equal (connection_get_locality (data->connection), 3);
+    assert_int_equal (connection_get_locality (channel), 3);
+    g_object_unref (channel);
+}
+/*
+ * The count of queued commands goes up and down with each command and
+ * response, and never below 0.
+ */
+static void
+connection_queued_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+
+    assert_int_equal (connection_get_queued (data->connection), 0);
+    assert_int_equal (connection_command_queued (data->connection), 1);
+    assert_int_equal (connection_command_queued (data->connection), 2);
+    connection_command_done (data->connection);
+    connection_command_done (data->connection);
+    connection_command_done (data->connection);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+}
+/*
+ * The memory of a connection counts the buffers of its commands for as
+ * long as they're around, on its parent too for a logical connection, and
+ * the resources the ResourceManager holds for it.
+ */
+static void
+connection_mem_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *channel;
+    Tpm2Command *command;
+
+    assert_int_equal (connection_get_mem (data->connection), 0);
+    channel = connection_new_channel (data->connection, 3);
+    command = tpm2_command_new (channel, g_malloc0 (64), 64, (TPMA_CC){ 0 });
+    assert_int_equal (connection_get_mem (channel), 64);
+    assert_int_equal (connection_get_mem (data->connection), 64);
+    g_object_unref (command);
+    assert_int_equal (connection_get_mem (channel), 0);
+    assert_int_equal (connection_get_mem (data->connection), 0);
+    connection_set_resources (channel, 2, 1);
+    assert_int_equal (connection_get_mem (channel),
+                      2 * CONNECTION_MEM_TRANSIENT + CONNECTION_MEM_SESSION);
+    g_object_unref (channel);
+}
+/*
+ * A logical connection shares the socket, ID and priority of its parent
+ * but has a HandleMap of its own. Its queued commands count against the
+ * parent, and it's closed once the parent is.
+ */
+static void
+connection_channel_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    Connection *channel;
+    HandleMap *map, *parent_map;
+
+    g_object_set (data->connection, "priority", TABRMD_PRIORITY_BATCH, NULL);
+    channel = connection_new_channel (data->connection, 7);
+    assert_ptr_equal (connection_get_transport (channel), data->connection);
+    assert_ptr_equal (connection_get_transport (data->connection),
+                      data->connection);
+    assert_int_equal (connection_get_channel (channel), 7);
+    assert_ptr_equal (connection_get_iostream (channel),
+                      connection_get_iostream (data->connection));
+    assert_int_equal (channel->id, data->connection->id);
+    assert_int_equal (connection_get_priority (channel),
+                      TABRMD_PRIORITY_BATCH);
+    map = connection_get_trans_map (channel);
+    parent_map = connection_get_trans_map (data->connection);
+    assert_ptr_not_equal (map, parent_map);
+    assert_int_equal (map->max_entries, parent_map->max_entries);
+    g_object_unref (map);
+    g_object_unref (parent_map);
+
+    connection_command_queued (channel);
+    assert_int_equal (connection_get_queued (channel), 1);
+    assert_int_equal (connection_get_queued (data->connection), 1);
+    connection_command_done (channel);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+
+    assert_false (connection_is_closed (channel));
+    connection_set_closed (data->connection);
+    assert_true (connection_is_closed (channel));
+    g_object_unref (channel);
+}
+/*
+ * Commands of a logical connection are accounted to its parent, the
+ * resources it holds aren't. Serials grow and the pid is inherited.
+ */
+static void
+connection_usage_test (void **state)
+{
+    connection_test_data_t *data = (connection_test_data_t*)*state;
+    connection_usage_t usage;
+    Connection *channel;
+
+    connection_set_pid (data->connection, 1234);
+    channel = connection_new_channel (data->connection, 1);
+    assert_true (connection_get_serial (channel) >
+                 connection_get_serial (data->connection));
+    assert_int_equal (connection_get_pid (channel), 1234);
+
+    connection_note_command (data->connection, 10, 20, 300);
+    connection_note_command (channel, 1, 2, -1);
+    connection_set_resources (channel, 2, 1);
+    connection_get_usage (data->connection, &usage);
+    assert_int_equal (usage.serial, connection_get_serial (data->connection));
+    assert_int_equal (usage.pid, 1234);
+    assert_int_equal (usage.commands, 2);
+    assert_int_equal (usage.bytes_in, 11);
+    assert_int_equal (usage.bytes_out, 22);
+    assert_int_equal (usage.exec_us, 300);
+    assert_int_equal (usage.transients, 0);
+    assert_int_equal (usage.sessions, 0);
+    connection_get_usage (channel, &usage);
+    assert_int_equal (usage.commands, 0);
+    assert_int_equal (usage.transients, 2);
+    assert_int_equal (usage.sessions, 1);
+    g_object_unref (channel);
+}
 
 /* connection_client_to_server_test begin
  * This test creates a connection and communicates with it as though the pipes
@@ -174,6 +326,24 @@ main(void)
         cmocka_unit_test_setup_teardown (connection_key_id_test,
                                          connection_setup,
                                          connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_priority_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_locality_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_queued_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_mem_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_channel_test,
+                                         connection_setup,
+                                         connection_teardown),
+        cmocka_unit_test_setup_teardown (connection_usage_test,
+                                         connection_setup,
+                                         connection_teardown),
         cmocka_unit_test_setup_teardown (connection_client_to_server_test,
                                          connection_setup,
                                          connection_teardown),
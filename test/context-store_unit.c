@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "context-store.h"
+#include "handle-map-entry.h"
+#include "util.h"
+
+#define SLOTS_MAX (CONTEXT_STORE_CHUNK_SLOTS + 2)
+
+typedef struct {
+    ContextStore *store;
+} test_data_t;
+
+static int
+context_store_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->store = context_store_new (g_get_tmp_dir (), SLOTS_MAX);
+    assert_non_null (data->store);
+    *state = data;
+    return 0;
+}
+static int
+context_store_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->store);
+    free (data);
+    return 0;
+}
+static void
+context_store_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_CONTEXT_STORE (data->store));
+    assert_int_equal (context_store_get_used (data->store), 0);
+}
+/*
+ * Fill the store past the first chunk: each slot keeps what's written to
+ * it and allocations fail once the store is full. A freed slot comes back
+ * wiped on the next allocation.
+ */
+static void
+context_store_alloc_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPMS_CONTEXT *context;
+    guint i, slot;
+
+    for (i = 0; i < SLOTS_MAX; ++i) {
+        slot = context_store_alloc (data->store);
+        assert_int_equal (slot, i);
+        context = context_store_get (data->store, slot);
+        assert_int_equal (context->sequence, 0);
+        context->sequence = i + 1;
+    }
+    assert_int_equal (context_store_alloc (data->store),
+                      CONTEXT_STORE_SLOT_NONE);
+    assert_int_equal (context_store_get_used (data->store), SLOTS_MAX);
+    for (i = 0; i < SLOTS_MAX; ++i) {
+        context = context_store_get (data->store, i);
+        assert_int_equal (context->sequence, i + 1);
+    }
+
+    context_store_free (data->store, CONTEXT_STORE_CHUNK_SLOTS);
+    assert_int_equal (context_store_get_used (data->store), SLOTS_MAX - 1);
+    slot = context_store_alloc (data->store);
+    assert_int_equal (slot, CONTEXT_STORE_CHUNK_SLOTS);
+    assert_int_equal (context_store_get (data->store, slot)->sequence, 0);
+}
+/*
+ * A HandleMapEntry with a store keeps its context in a slot and gives the
+ * slot back when it goes away, a shared entry uses the slot of its
+ * backing entry.
+ */
+static void
+context_store_entry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry, *shared;
+    TPMS_CONTEXT *context;
+
+    entry = handle_map_entry_new (0x80000000, 0x80ffffff);
+    handle_map_entry_set_context_store (entry, data->store);
+    context = handle_map_entry_get_context (entry);
+    assert_ptr_equal (context, context_store_get (data->store, 0));
+    assert_int_equal (context_store_get_used (data->store), 1);
+    shared = handle_map_entry_new_shared (0x80fffffe, entry);
+    assert_ptr_equal (handle_map_entry_get_context (shared), context);
+    assert_int_equal (context_store_get_used (data->store), 1);
+    g_object_unref (shared);
+    g_object_unref (entry);
+    assert_int_equal (context_store_get_used (data->store), 0);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (context_store_type_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_alloc_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+        cmocka_unit_test_setup_teardown (context_store_entry_test,
+                                         context_store_setup,
+                                         context_store_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,219 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "control-message.h"
+#include "dispatcher.h"
+#include "response-sink.h"
+#include "source-interface.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * The backends in these tests are ResponseSinks: their thread is never
+ * started so the messages dispatched to them stay in their input queue.
+ */
+#define BACKENDS 2
+typedef struct {
+    Dispatcher   *dispatcher;
+    ResponseSink *sinks [BACKENDS];
+    Connection   *connections [3];
+    GIOStream    *iostreams [3];
+} test_data_t;
+
+static int
+dispatcher_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    HandleMap *map;
+    gint client_fd;
+    size_t i;
+
+    data->dispatcher = dispatcher_new ();
+    for (i = 0; i < BACKENDS; ++i) {
+        data->sinks [i] = response_sink_new ();
+        source_add_sink (SOURCE (data->dispatcher), SINK (data->sinks [i]));
+    }
+    for (i = 0; i < 3; ++i) {
+        map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        data->iostreams [i] = create_connection_iostream (&client_fd);
+        data->connections [i] = connection_new (data->iostreams [i], i, map);
+        g_object_unref (map);
+    }
+    *state = data;
+    return 0;
+}
+static int
+dispatcher_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    size_t i;
+
+    g_clear_object (&data->dispatcher);
+    for (i = 0; i < BACKENDS; ++i) {
+        g_clear_object (&data->sinks [i]);
+    }
+    for (i = 0; i < 3; ++i) {
+        g_clear_object (&data->connections [i]);
+        g_clear_object (&data->iostreams [i]);
+    }
+    free (data);
+    return 0;
+}
+/*
+ * Dispatch a header-only command from the provided connection.
+ */
+static void
+dispatch_command (Dispatcher *dispatcher,
+                  Connection *connection)
+{
+    Tpm2Command *command;
+
+    command = tpm2_command_new (connection,
+                                calloc (1, TPM_HEADER_SIZE),
+                                TPM_HEADER_SIZE,
+                                (TPMA_CC){ 0, });
+    sink_enqueue (SINK (dispatcher), G_OBJECT (command));
+    g_object_unref (command);
+}
+/*
+ * Check that the next message queued for the provided backend belongs to
+ * the provided connection (none if NULL).
+ */
+static void
+backend_check (ResponseSink *sink,
+               Connection   *connection)
+{
+    GObject *obj;
+    Connection *obj_connection;
+
+    obj = message_queue_timeout_dequeue (sink->in_queue, 1000);
+    if (connection == NULL) {
+        assert_null (obj);
+        return;
+    }
+    assert_non_null (obj);
+    if (IS_TPM2_COMMAND (obj)) {
+        obj_connection = tpm2_command_get_connection (TPM2_COMMAND (obj));
+        assert_ptr_equal (obj_connection, connection);
+        g_object_unref (obj_connection);
+    } else {
+        assert_ptr_equal (control_message_get_object (CONTROL_MESSAGE (obj)),
+                          connection);
+    }
+    g_object_unref (obj);
+}
+/*
+ * Connections are assigned to the backend with the fewest connections and
+ * stay there. Once a connection is removed its backend has room again.
+ */
+static void
+dispatcher_assign_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+    Sink *sink;
+
+    dispatch_command (data->dispatcher, data->connections [0]);
+    dispatch_command (data->dispatcher, data->connections [1]);
+    dispatch_command (data->dispatcher, data->connections [0]);
+    backend_check (data->sinks [0], data->connections [0]);
+    backend_check (data->sinks [0], data->connections [0]);
+    backend_check (data->sinks [0], NULL);
+    backend_check (data->sinks [1], data->connections [1]);
+    backend_check (data->sinks [1], NULL);
+    assert_int_equal (dispatcher_get_count (data->dispatcher, 0), 1);
+    assert_int_equal (dispatcher_get_count (data->dispatcher, 1), 1);
+    sink = dispatcher_get_sink (data->dispatcher, data->connections [1]);
+    assert_ptr_equal (sink, data->sinks [1]);
+    g_object_unref (sink);
+
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connections [0]));
+    sink_enqueue (SINK (data->dispatcher), G_OBJECT (msg));
+    g_object_unref (msg);
+    backend_check (data->sinks [0], data->connections [0]);
+    assert_int_equal (dispatcher_get_count (data->dispatcher, 0), 0);
+    assert_null (dispatcher_get_sink (data->dispatcher, data->connections [0]));
+
+    dispatch_command (data->dispatcher, data->connections [2]);
+    backend_check (data->sinks [0], data->connections [2]);
+    backend_check (data->sinks [1], NULL);
+}
+/*
+ * DispatcherLoadFunc reporting the loads from an array of BACKENDS.
+ */
+static guint64
+load_func (guint    backend,
+           gpointer user_data)
+{
+    guint64 *loads = (guint64*)user_data;
+
+    assert_true (backend < BACKENDS);
+    return loads [backend];
+}
+/*
+ * With a load function connections go to the least loaded backend no
+ * matter how many connections it has, not to a failing one, and to any
+ * backend when they're all failing.
+ */
+static void
+dispatcher_load_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint64 loads [BACKENDS] = { 20, 3 };
+
+    dispatcher_set_load_func (data->dispatcher, load_func, loads);
+    dispatch_command (data->dispatcher, data->connections [0]);
+    backend_check (data->sinks [1], data->connections [0]);
+
+    dispatch_command (data->dispatcher, data->connections [1]);
+    backend_check (data->sinks [1], data->connections [1]);
+    assert_int_equal (dispatcher_get_count (data->dispatcher, 1), 2);
+
+    loads [0] = DISPATCHER_LOAD_FAILED;
+    loads [1] = DISPATCHER_LOAD_FAILED;
+    dispatch_command (data->dispatcher, data->connections [2]);
+    backend_check (data->sinks [0], data->connections [2]);
+    backend_check (data->sinks [1], NULL);
+}
+/*
+ * Messages that don't belong to a connection go to every backend.
+ */
+static void
+dispatcher_broadcast_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+    GObject *obj;
+    size_t i;
+
+    msg = control_message_new (CHECK_CANCEL);
+    sink_enqueue (SINK (data->dispatcher), G_OBJECT (msg));
+    for (i = 0; i < BACKENDS; ++i) {
+        obj = message_queue_timeout_dequeue (data->sinks [i]->in_queue, 1000);
+        assert_ptr_equal (obj, msg);
+        g_object_unref (obj);
+    }
+    g_object_unref (msg);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (dispatcher_assign_test,
+                                         dispatcher_setup,
+                                         dispatcher_teardown),
+        cmocka_unit_test_setup_teardown (dispatcher_load_test,
+                                         dispatcher_setup,
+                                         dispatcher_teardown),
+        cmocka_unit_test_setup_teardown (dispatcher_broadcast_test,
+                                         dispatcher_setup,
+                                         dispatcher_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "entropy-pool.h"
+#include "util.h"
+
+#define POOL_SIZE 48
+
+typedef struct {
+    EntropyPool *pool;
+} test_data_t;
+
+static int
+entropy_pool_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->pool = entropy_pool_new (POOL_SIZE);
+    *state = data;
+    return 0;
+}
+static int
+entropy_pool_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->pool);
+    free (data);
+    return 0;
+}
+static void
+entropy_pool_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_ENTROPY_POOL (data->pool));
+    assert_int_equal (entropy_pool_get_level (data->pool), 0);
+    assert_int_equal (entropy_pool_get_space (data->pool), POOL_SIZE);
+    assert_int_equal (entropy_pool_get_chunk_max (data->pool), 0);
+}
+/*
+ * Bytes added beyond the size of the pool are dropped, the largest chunk
+ * added is remembered.
+ */
+static void
+entropy_pool_add_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 chunk [32];
+
+    memset (chunk, 0xa5, sizeof (chunk));
+    entropy_pool_add (data->pool, chunk, sizeof (chunk));
+    assert_int_equal (entropy_pool_get_level (data->pool), 32);
+    assert_int_equal (entropy_pool_get_chunk_max (data->pool), 32);
+    entropy_pool_add (data->pool, chunk, sizeof (chunk));
+    assert_int_equal (entropy_pool_get_level (data->pool), POOL_SIZE);
+    assert_int_equal (entropy_pool_get_space (data->pool), 0);
+    entropy_pool_add (data->pool, chunk, 16);
+    assert_int_equal (entropy_pool_get_level (data->pool), POOL_SIZE);
+    assert_int_equal (entropy_pool_get_chunk_max (data->pool), 32);
+}
+/*
+ * Every byte added is taken once: taking all of the pool in pieces gets
+ * back each byte that went in, and nothing is left after.
+ */
+static void
+entropy_pool_take_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 chunk [POOL_SIZE], taken [POOL_SIZE] = { 0 };
+    guint i, count [256] = { 0 };
+
+    for (i = 0; i < POOL_SIZE; ++i) {
+        chunk [i] = (guint8)(i + 1);
+    }
+    entropy_pool_add (data->pool, chunk, sizeof (chunk));
+    assert_true (entropy_pool_take (data->pool, &taken [0], 16));
+    assert_true (entropy_pool_take (data->pool, &taken [16], 16));
+    assert_int_equal (entropy_pool_get_level (data->pool), 16);
+    assert_false (entropy_pool_take (data->pool, &taken [32], 17));
+    assert_int_equal (entropy_pool_get_level (data->pool), 16);
+    assert_true (entropy_pool_take (data->pool, &taken [32], 16));
+    assert_int_equal (entropy_pool_get_level (data->pool), 0);
+    assert_false (entropy_pool_take (data->pool, taken, 1));
+
+    for (i = 0; i < POOL_SIZE; ++i) {
+        ++count [taken [i]];
+    }
+    for (i = 0; i < POOL_SIZE; ++i) {
+        assert_int_equal (count [chunk [i]], 1);
+    }
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (entropy_pool_type_test,
+                                         entropy_pool_setup,
+                                         entropy_pool_teardown),
+        cmocka_unit_test_setup_teardown (entropy_pool_add_test,
+                                         entropy_pool_setup,
+                                         entropy_pool_teardown),
+        cmocka_unit_test_setup_teardown (entropy_pool_take_test,
+                                         entropy_pool_setup,
+                                         entropy_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
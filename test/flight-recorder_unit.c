@@ -0,0 +1,166 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "flight-recorder.h"
+#include "util.h"
+
+typedef struct {
+    FlightRecorder *recorder;
+} test_data_t;
+
+static int
+flight_recorder_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->recorder = flight_recorder_new (3);
+    *state = data;
+    return 0;
+}
+static int
+flight_recorder_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->recorder);
+    free (data);
+    return 0;
+}
+static void
+flight_recorder_add_n (FlightRecorder *recorder,
+                       guint           n)
+{
+    flight_record_t record = { 0, };
+    guint i;
+
+    for (i = 0; i < n; ++i) {
+        record.connection = i;
+        flight_recorder_add (recorder, &record);
+    }
+}
+static void
+collect_callback (flight_record_t const *record,
+                  gpointer               user_data)
+{
+    g_array_append_val ((GArray*)user_data, record->connection);
+}
+/*
+ * Only the last 'size' records are kept, and they come out oldest first.
+ */
+static void
+flight_recorder_wrap_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    GArray *seen = g_array_new (FALSE, FALSE, sizeof (guint));
+
+    flight_recorder_add_n (data->recorder, 2);
+    flight_recorder_foreach (data->recorder, collect_callback, seen);
+    assert_int_equal (seen->len, 2);
+    assert_int_equal (g_array_index (seen, guint, 0), 0);
+    assert_int_equal (g_array_index (seen, guint, 1), 1);
+
+    g_array_set_size (seen, 0);
+    flight_recorder_add_n (data->recorder, 5);
+    flight_recorder_foreach (data->recorder, collect_callback, seen);
+    assert_int_equal (seen->len, 3);
+    assert_int_equal (g_array_index (seen, guint, 0), 2);
+    assert_int_equal (g_array_index (seen, guint, 1), 3);
+    assert_int_equal (g_array_index (seen, guint, 2), 4);
+    g_array_unref (seen);
+}
+/*
+ * Each record becomes a tuple with only the handles the command had.
+ */
+static void
+flight_recorder_build_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    flight_record_t record = {
+        .time = 1500000,
+        .connection = 4,
+        .command_code = TPM2_CC_Sign,
+        .handle_count = 1,
+        .handles = { 0x80ffffff, },
+        .phase_us = { 1, 2, 3, 4, },
+        .rc = TPM2_RC_HANDLE,
+    };
+    GVariantBuilder builder;
+    GVariant *records, *child, *handles, *phases;
+    guint32 backend, connection, command_code, rc;
+    gint64 time;
+    guint32 const *values;
+    gsize n_values;
+
+    flight_recorder_add (data->recorder, &record);
+    g_variant_builder_init (&builder,
+                            G_VARIANT_TYPE (FLIGHT_RECORDER_VARIANT_TYPE));
+    flight_recorder_build (data->recorder, 1, &builder);
+    records = g_variant_ref_sink (g_variant_builder_end (&builder));
+    assert_int_equal (g_variant_n_children (records), 1);
+    child = g_variant_get_child_value (records, 0);
+    g_variant_get (child,
+                   "(uxuu@au@auu)",
+                   &backend,
+                   &time,
+                   &connection,
+                   &command_code,
+                   &handles,
+                   &phases,
+                   &rc);
+    assert_int_equal (backend, 1);
+    assert_int_equal (time, 1500000);
+    assert_int_equal (connection, 4);
+    assert_int_equal (command_code, TPM2_CC_Sign);
+    assert_int_equal (rc, TPM2_RC_HANDLE);
+    values = g_variant_get_fixed_array (handles, &n_values, sizeof (guint32));
+    assert_int_equal (n_values, 1);
+    assert_int_equal (values [0], 0x80ffffff);
+    values = g_variant_get_fixed_array (phases, &n_values, sizeof (guint32));
+    assert_int_equal (n_values, COMMAND_STATS_WRITE);
+    assert_int_equal (values [COMMAND_STATS_SAVE], 4);
+    g_variant_unref (handles);
+    g_variant_unref (phases);
+    g_variant_unref (child);
+    g_variant_unref (records);
+}
+/*
+ * The log line has the UTC time, the handles and each phase.
+ */
+static void
+flight_record_to_string_test (void **state)
+{
+    flight_record_t record = {
+        .time = 1500000,
+        .connection = 4,
+        .command_code = TPM2_CC_Sign,
+        .phase_us = { 1, 2, 3, 4, },
+    };
+    gchar *line;
+    UNUSED_PARAM(state);
+
+    line = flight_record_to_string (&record);
+    assert_string_equal (line,
+                         "1970-01-01T00:00:01.500000Z connection 4 command "
+                         "0x0000015d handles none queue 1us load 2us "
+                         "exec 3us save 4us rc 0x00000000");
+    g_free (line);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (flight_recorder_wrap_test,
+                                         flight_recorder_setup,
+                                         flight_recorder_teardown),
+        cmocka_unit_test_setup_teardown (flight_recorder_build_test,
+                                         flight_recorder_setup,
+                                         flight_recorder_teardown),
+        cmocka_unit_test (flight_record_to_string_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
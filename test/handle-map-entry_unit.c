@@ -85,6 +85,156 @@ handle_map_entry_get_vhandle_test (void **state)
     assert_int_equal (VHANDLE,
                       handle_map_entry_get_vhandle (data->handle_map_entry));
 }
+/*
+ * A newly created entry has no saved context. Once set, the 'context_saved'
+ * flag should be returned by the accessor.
+ */
+static void
+handle_map_entry_context_saved_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_false (handle_map_entry_get_context_saved (data->handle_map_entry));
+    handle_map_entry_set_context_saved (data->handle_map_entry, TRUE);
+    assert_true (handle_map_entry_get_context_saved (data->handle_map_entry));
+}
+/*
+ * A newly created entry isn't pinned, the accessor returns what was set.
+ */
+static void
+handle_map_entry_pinned_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_false (handle_map_entry_get_pinned (data->handle_map_entry));
+    handle_map_entry_set_pinned (data->handle_map_entry, TRUE);
+    assert_true (handle_map_entry_get_pinned (data->handle_map_entry));
+    handle_map_entry_set_pinned (data->handle_map_entry, FALSE);
+    assert_false (handle_map_entry_get_pinned (data->handle_map_entry));
+}
+/*
+ * Until the object is loaded its reload cost is estimated, from the size
+ * of its context once it's saved, then it's the average of its loads with
+ * the recent ones weighing more.
+ */
+static void
+handle_map_entry_load_cost_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry = data->handle_map_entry;
+
+    assert_int_equal (handle_map_entry_get_load_cost (entry),
+                      CONTEXT_LOAD_US_DEFAULT);
+    handle_map_entry_get_context (entry)->contextBlob.size = 1500;
+    handle_map_entry_set_context_saved (entry, TRUE);
+    assert_int_equal (handle_map_entry_get_load_cost (entry),
+                      CONTEXT_LOAD_US_BASE + 1500 * CONTEXT_LOAD_US_PER_BYTE);
+    handle_map_entry_note_load (entry, 4000);
+    assert_int_equal (handle_map_entry_get_load_cost (entry), 4000);
+    handle_map_entry_note_load (entry, 8000);
+    assert_int_equal (handle_map_entry_get_load_cost (entry), 5000);
+}
+/*
+ * Once a TPM was calibrated the estimate follows its model, loads that
+ * were timed still cost what they took.
+ */
+static void
+handle_map_entry_load_model_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry = data->handle_map_entry;
+
+    context_load_set_model (500, 2048);
+    assert_int_equal (handle_map_entry_get_load_cost (entry), 500 + 2048);
+    handle_map_entry_get_context (entry)->contextBlob.size = 1536;
+    handle_map_entry_set_context_saved (entry, TRUE);
+    assert_int_equal (handle_map_entry_get_load_cost (entry), 500 + 3072);
+    handle_map_entry_note_load (entry, 4000);
+    assert_int_equal (handle_map_entry_get_load_cost (entry), 4000);
+    context_load_set_model (CONTEXT_LOAD_US_BASE,
+                            CONTEXT_LOAD_US_PER_BYTE * 1024);
+}
+/*
+ * A freshly created HandleMapEntry has no cached ReadPublic response. Once
+ * set the same bytes should be returned by the accessor and setting NULL
+ * should drop them.
+ */
+static void
+handle_map_entry_public_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 buf [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00 };
+    GBytes *bytes, *cached;
+
+    assert_null (handle_map_entry_get_public (data->handle_map_entry));
+    bytes = g_bytes_new (buf, sizeof (buf));
+    handle_map_entry_set_public (data->handle_map_entry, bytes);
+    cached = handle_map_entry_get_public (data->handle_map_entry);
+    assert_true (g_bytes_equal (bytes, cached));
+    g_bytes_unref (cached);
+    g_bytes_unref (bytes);
+    handle_map_entry_set_public (data->handle_map_entry, NULL);
+    assert_null (handle_map_entry_get_public (data->handle_map_entry));
+}
+/*
+ * An entry sharing the object of another keeps its own vhandle and
+ * forwards everything else to the backing entry. Pinning it pins the
+ * backing until it's unpinned or goes away.
+ */
+static void
+handle_map_entry_shared_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 buf [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00 };
+    HandleMapEntry *shared;
+    GBytes *bytes, *cached;
+
+    shared = handle_map_entry_new_shared (VHANDLE + 1, data->handle_map_entry);
+    assert_ptr_equal (handle_map_entry_get_backing (shared),
+                      data->handle_map_entry);
+    assert_ptr_equal (handle_map_entry_get_backing (data->handle_map_entry),
+                      data->handle_map_entry);
+    assert_int_equal (handle_map_entry_get_vhandle (shared), VHANDLE + 1);
+    assert_int_equal (handle_map_entry_get_phandle (shared), PHANDLE);
+    handle_map_entry_set_phandle (shared, PHANDLE + 1);
+    assert_int_equal (handle_map_entry_get_phandle (data->handle_map_entry),
+                      PHANDLE + 1);
+
+    bytes = g_bytes_new (buf, sizeof (buf));
+    handle_map_entry_set_public (data->handle_map_entry, bytes);
+    cached = handle_map_entry_get_public (shared);
+    assert_true (g_bytes_equal (bytes, cached));
+    g_bytes_unref (cached);
+    g_bytes_unref (bytes);
+
+    handle_map_entry_set_pinned (shared, TRUE);
+    assert_true (handle_map_entry_get_pinned (shared));
+    assert_true (handle_map_entry_get_pinned (data->handle_map_entry));
+    handle_map_entry_set_pinned (shared, FALSE);
+    assert_false (handle_map_entry_get_pinned (data->handle_map_entry));
+    handle_map_entry_set_pinned (shared, TRUE);
+    g_object_unref (shared);
+    assert_false (handle_map_entry_get_pinned (data->handle_map_entry));
+}
+/*
+ * Uses are counted on the backing entry and taking the count starts it
+ * over.
+ */
+static void
+handle_map_entry_use_count_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *shared;
+
+    shared = handle_map_entry_new_shared (VHANDLE + 1, data->handle_map_entry);
+    handle_map_entry_count_use (data->handle_map_entry);
+    handle_map_entry_count_use (shared);
+    handle_map_entry_count_use (shared);
+    assert_int_equal (handle_map_entry_take_use_count (data->handle_map_entry),
+                      3);
+    assert_int_equal (handle_map_entry_take_use_count (shared), 0);
+    g_object_unref (shared);
+}
 
 gint
 main (void)
@@ -99,6 +249,27 @@ main (void)
         cmocka_unit_test_setup_teardown (handle_map_entry_get_vhandle_test,
                                          handle_map_entry_setup,
                                          handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_context_saved_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_pinned_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_load_cost_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_load_model_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_public_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_shared_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_entry_use_count_test,
+                                         handle_map_entry_setup,
+                                         handle_map_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -135,6 +135,195 @@ handle_map_next_vhandle_test (void **state)
     handle2 = handle_map_next_vhandle (data->map);
     assert_true (handle2 != handle1);
 }
+/*
+ * Insert entries whose vhandles share a home slot, remove the first and
+ * check that the ones probed past it are still found. Then fill the map
+ * and check that it refuses more entries.
+ */
+static void
+handle_map_collision_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle;
+    GList *keys;
+    guint i, slot_count = 0;
+
+    /* the slots are allocated with the first entry */
+    assert_int_equal (data->map->slot_count, 0);
+    assert_null (handle_map_vlookup (data->map, VHANDLE));
+    for (i = 0; i < 3; ++i) {
+        vhandle = VHANDLE + i * slot_count;
+        entry = handle_map_entry_new (PHANDLE, vhandle);
+        assert_true (handle_map_insert (data->map, vhandle, entry));
+        g_object_unref (entry);
+        slot_count = data->map->slot_count;
+    }
+    assert_int_equal (handle_map_size (data->map), 3);
+    assert_true (handle_map_remove (data->map, VHANDLE));
+    assert_false (handle_map_remove (data->map, VHANDLE));
+    assert_null (handle_map_vlookup (data->map, VHANDLE));
+    for (i = 1; i < 3; ++i) {
+        vhandle = VHANDLE + i * slot_count;
+        entry = handle_map_vlookup (data->map, vhandle);
+        assert_non_null (entry);
+        assert_int_equal (handle_map_entry_get_vhandle (entry), vhandle);
+        g_object_unref (entry);
+    }
+
+    while (!handle_map_is_full (data->map)) {
+        vhandle = handle_map_next_vhandle (data->map);
+        entry = handle_map_entry_new (PHANDLE, vhandle);
+        assert_true (handle_map_insert (data->map, vhandle, entry));
+        g_object_unref (entry);
+    }
+    assert_int_equal (handle_map_size (data->map), MAX_ENTRIES_DEFAULT + 1);
+    vhandle = handle_map_next_vhandle (data->map);
+    entry = handle_map_entry_new (PHANDLE, vhandle);
+    assert_false (handle_map_insert (data->map, vhandle, entry));
+    g_object_unref (entry);
+    keys = handle_map_get_keys (data->map);
+    assert_int_equal (g_list_length (keys), MAX_ENTRIES_DEFAULT + 1);
+    g_list_free (keys);
+}
+/*
+ * Raising the limit of a full map makes room, lowering it below the size
+ * of the map keeps the entries but refuses new ones.
+ */
+static void
+handle_map_set_max_entries_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle;
+
+    while (!handle_map_is_full (data->map)) {
+        vhandle = handle_map_next_vhandle (data->map);
+        entry = handle_map_entry_new (PHANDLE, vhandle);
+        assert_true (handle_map_insert (data->map, vhandle, entry));
+        g_object_unref (entry);
+    }
+    handle_map_set_max_entries (data->map, MAX_ENTRIES_DEFAULT + 1);
+    vhandle = handle_map_next_vhandle (data->map);
+    entry = handle_map_entry_new (PHANDLE, vhandle);
+    assert_true (handle_map_insert (data->map, vhandle, entry));
+    g_object_unref (entry);
+    assert_int_equal (handle_map_size (data->map), MAX_ENTRIES_DEFAULT + 2);
+
+    handle_map_set_max_entries (data->map, 1);
+    vhandle = handle_map_next_vhandle (data->map);
+    entry = handle_map_entry_new (PHANDLE, vhandle);
+    assert_false (handle_map_insert (data->map, vhandle, entry));
+    g_object_unref (entry);
+    assert_int_equal (handle_map_size (data->map), MAX_ENTRIES_DEFAULT + 2);
+}
+/*
+ * Insert vhandles out of order and page through them two at a time like
+ * GetCapability does.
+ */
+static void
+handle_map_get_range_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2_HANDLE vhandles [] = { 0x80000103, 0x80000101, 0x80000104,
+                                0x80000100, 0x80000102 };
+    TPM2_HANDLE handles [2];
+    HandleMapEntry *entry;
+    gboolean more;
+    guint i, n;
+
+    for (i = 0; i < G_N_ELEMENTS (vhandles); ++i) {
+        entry = handle_map_entry_new (PHANDLE, vhandles [i]);
+        handle_map_insert (data->map, vhandles [i], entry);
+        g_object_unref (entry);
+    }
+    handle_map_remove (data->map, 0x80000102);
+
+    n = handle_map_get_range (data->map, 0x80000000, handles, 2, &more);
+    assert_int_equal (n, 2);
+    assert_int_equal (handles [0], 0x80000100);
+    assert_int_equal (handles [1], 0x80000101);
+    assert_true (more);
+    n = handle_map_get_range (data->map, handles [1] + 1, handles, 2, &more);
+    assert_int_equal (n, 2);
+    assert_int_equal (handles [0], 0x80000103);
+    assert_int_equal (handles [1], 0x80000104);
+    assert_false (more);
+    n = handle_map_get_range (data->map, handles [1] + 1, handles, 2, &more);
+    assert_int_equal (n, 0);
+    assert_false (more);
+}
+/*
+ * A map for many entries starts small and grows as it's filled. Entries
+ * that collided before it grew are still found after, in order.
+ */
+static void
+handle_map_grow_test (void **state)
+{
+    HandleMap *map;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle, handles [4];
+    guint i, slot_count;
+    UNUSED_PARAM(state);
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_MAX);
+    slot_count = 0;
+    for (i = 0; i < 2; ++i) {
+        vhandle = VHANDLE + i * slot_count;
+        entry = handle_map_entry_new (PHANDLE, vhandle);
+        assert_true (handle_map_insert (map, vhandle, entry));
+        g_object_unref (entry);
+        slot_count = map->slot_count;
+    }
+    assert_true (slot_count < 2 * (MAX_ENTRIES_MAX + 1));
+    for (i = 0; i < 4 * HANDLE_MAP_ENTRIES_INITIAL; ++i) {
+        vhandle = handle_map_next_vhandle (map);
+        entry = handle_map_entry_new (PHANDLE, vhandle);
+        assert_true (handle_map_insert (map, vhandle, entry));
+        g_object_unref (entry);
+    }
+    assert_true (map->slot_count > slot_count);
+    assert_int_equal (handle_map_size (map), 4 * HANDLE_MAP_ENTRIES_INITIAL + 2);
+    for (i = 0; i < 2; ++i) {
+        entry = handle_map_vlookup (map, VHANDLE + i * slot_count);
+        assert_non_null (entry);
+        g_object_unref (entry);
+    }
+    assert_int_equal (handle_map_get_range (map, 0, handles, 4, NULL), 4);
+    for (i = 1; i < 4; ++i) {
+        assert_true (handles [i - 1] < handles [i]);
+    }
+    g_object_unref (map);
+}
+/*
+ * Moved entries keep their vhandles and the vhandles handed out after
+ * the move don't collide with them.
+ */
+static void
+handle_map_move_test (void **state)
+{
+    HandleMap *map, *from;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle;
+    UNUSED_PARAM(state);
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    from = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    vhandle = handle_map_next_vhandle (from);
+    entry = handle_map_entry_new (PHANDLE, vhandle);
+    assert_true (handle_map_insert (from, vhandle, entry));
+    g_object_unref (entry);
+
+    assert_int_equal (handle_map_move (map, from), 1);
+    assert_int_equal (handle_map_size (from), 0);
+    entry = handle_map_vlookup (map, vhandle);
+    assert_non_null (entry);
+    assert_int_equal (handle_map_entry_get_phandle (entry), PHANDLE);
+    g_object_unref (entry);
+    assert_true (handle_map_next_vhandle (map) > vhandle);
+    g_object_unref (from);
+    g_object_unref (map);
+}
 int
 main(void)
 {
@@ -154,6 +343,17 @@ main(void)
         cmocka_unit_test_setup_teardown (handle_map_next_vhandle_test,
                                          handle_map_setup_with_entry,
                                          handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_collision_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_set_max_entries_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test_setup_teardown (handle_map_get_range_test,
+                                         handle_map_setup_base,
+                                         handle_map_teardown),
+        cmocka_unit_test (handle_map_grow_test),
+        cmocka_unit_test (handle_map_move_test),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,201 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "connection.h"
+#include "connection-manager.h"
+#include "handle-map.h"
+#include "handle-map-entry.h"
+#include "handover.h"
+#include "session-entry.h"
+#include "session-list.h"
+#include "tabrmd-defaults.h"
+#include "util.h"
+
+#define CONNECTION_ID   0x1234
+#define VHANDLE         0x80ff0001
+#define SAVED_HANDLE    0x80000002
+#define HANDLE_COUNT    7
+#define SESSION_HANDLE  0x02000000
+#define ABANDONED_HANDLE 0x02000001
+
+typedef struct {
+    ConnectionManager *manager_old;
+    ConnectionManager *manager_new;
+    SessionList       *session_list;
+    GSocket           *socket_send;
+    GSocket           *socket_recv;
+    GList             *sessions;
+    gint               client_fd;
+} test_data_t;
+
+/*
+ * Set up the state of the instance handing over: one connection with a
+ * saved transient object and a saved session, plus an abandoned session.
+ * The two instances talk over a SOCK_SEQPACKET pair.
+ */
+static int
+handover_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    Connection *connection;
+    HandleMap *handle_map;
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    GIOStream *iostream;
+    gint fd_send, fd_recv, ret;
+
+    data->manager_old = connection_manager_new (TABRMD_CONNECTIONS_MAX_DEFAULT);
+    data->manager_new = connection_manager_new (TABRMD_CONNECTIONS_MAX_DEFAULT);
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    handle_map->handle_count = HANDLE_COUNT;
+    iostream = create_connection_iostream (&data->client_fd);
+    connection = connection_new (iostream, CONNECTION_ID, handle_map);
+    g_object_unref (iostream);
+    g_object_set (connection, "priority", TABRMD_PRIORITY_BATCH, NULL);
+    connection_set_pid (connection, 1234);
+    connection_set_uid (connection, 1000);
+    entry = handle_map_entry_new (0, VHANDLE);
+    handle_map_entry_get_context (entry)->savedHandle = SAVED_HANDLE;
+    handle_map_entry_set_context_saved (entry, TRUE);
+    handle_map_insert (handle_map, VHANDLE, entry);
+    g_object_unref (entry);
+    g_object_unref (handle_map);
+    ret = connection_manager_insert (data->manager_old, connection);
+    assert_int_equal (ret, 0);
+
+    data->session_list = session_list_new (TABRMD_SESSIONS_MAX_DEFAULT,
+                                           SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    session = session_entry_new (connection, SESSION_HANDLE);
+    session_entry_set_state (session, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (data->session_list, session);
+    g_object_unref (session);
+    session = session_entry_new (NULL, ABANDONED_HANDLE);
+    session_list_insert_abandoned (data->session_list, session);
+    g_object_unref (session);
+    g_object_unref (connection);
+
+    ret = create_socket_pair_type (&fd_send,
+                                   &fd_recv,
+                                   SOCK_SEQPACKET,
+                                   SOCK_CLOEXEC);
+    assert_int_equal (ret, 0);
+    data->socket_send = g_socket_new_from_fd (fd_send, NULL);
+    data->socket_recv = g_socket_new_from_fd (fd_recv, NULL);
+    assert_non_null (data->socket_send);
+    assert_non_null (data->socket_recv);
+
+    *state = data;
+    return 0;
+}
+static int
+handover_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_list_free_full (data->sessions, g_object_unref);
+    g_clear_object (&data->socket_send);
+    g_clear_object (&data->socket_recv);
+    g_clear_object (&data->session_list);
+    g_clear_object (&data->manager_old);
+    g_clear_object (&data->manager_new);
+    close (data->client_fd);
+    free (data);
+    return 0;
+}
+/*
+ * Hand the state over and check that the connection, its transient object
+ * and both sessions come out the other end.
+ */
+static void
+handover_send_receive_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *connection;
+    HandleMap *handle_map;
+    HandleMapEntry *entry;
+    SessionEntry *session;
+    gboolean ret;
+
+    ret = handover_send (data->socket_send,
+                         data->manager_old,
+                         data->session_list);
+    assert_true (ret);
+    ret = handover_receive (data->socket_recv,
+                            data->manager_new,
+                            MAX_ENTRIES_DEFAULT,
+                            &data->sessions);
+    assert_true (ret);
+
+    connection = connection_manager_lookup_id (data->manager_new,
+                                               CONNECTION_ID);
+    assert_non_null (connection);
+    assert_int_equal (connection_get_priority (connection),
+                      TABRMD_PRIORITY_BATCH);
+    assert_int_equal (connection_get_pid (connection), 1234);
+    assert_int_equal (connection_get_uid (connection), 1000);
+    handle_map = connection_get_trans_map (connection);
+    assert_int_equal (handle_map->handle_count, HANDLE_COUNT);
+    entry = handle_map_vlookup (handle_map, VHANDLE);
+    assert_non_null (entry);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    assert_true (handle_map_entry_get_context_saved (entry));
+    assert_int_equal (handle_map_entry_get_context (entry)->savedHandle,
+                      SAVED_HANDLE);
+    g_object_unref (entry);
+    g_object_unref (handle_map);
+
+    assert_int_equal (g_list_length (data->sessions), 2);
+    session = SESSION_ENTRY (data->sessions->data);
+    assert_int_equal (session_entry_get_handle (session), SESSION_HANDLE);
+    assert_int_equal (session_entry_get_state (session),
+                      SESSION_ENTRY_SAVED_RM);
+    assert_ptr_equal (session_entry_get_connection (session), connection);
+    session = SESSION_ENTRY (data->sessions->next->data);
+    assert_int_equal (session_entry_get_handle (session), ABANDONED_HANDLE);
+    assert_int_equal (session_entry_get_state (session),
+                      SESSION_ENTRY_SAVED_CLIENT_CLOSED);
+    assert_null (session_entry_get_connection (session));
+    g_object_unref (connection);
+}
+/*
+ * The instance handing over goes away before it's done: whatever arrived
+ * is kept but the handover isn't complete.
+ */
+static void
+handover_receive_truncated_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gboolean ret;
+
+    g_clear_object (&data->socket_send);
+    ret = handover_receive (data->socket_recv,
+                            data->manager_new,
+                            MAX_ENTRIES_DEFAULT,
+                            &data->sessions);
+    assert_false (ret);
+    assert_int_equal (connection_manager_size (data->manager_new), 0);
+    assert_null (data->sessions);
+    assert_true (handover_wait_closed (data->socket_recv));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (handover_send_receive_test,
+                                         handover_setup,
+                                         handover_teardown),
+        cmocka_unit_test_setup_teardown (handover_receive_truncated_test,
+                                         handover_setup,
+                                         handover_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -52,7 +52,7 @@ tcti_tabrmd_init (const char *conf)
  * This function allocates memory for the SAPI context and returns it to the
  * caller. This memory must be freed by the caller.
  */
-static TSS2_SYS_CONTEXT*
+TSS2_SYS_CONTEXT*
 sapi_init_from_tcti_ctx (TSS2_TCTI_CONTEXT *tcti_ctx)
 {
     TSS2_SYS_CONTEXT *sapi_ctx;
@@ -17,6 +17,7 @@
  */
 TSS2_TCTI_CONTEXT*    tcti_init_from_opts (test_opts_t        *options);
 TSS2_SYS_CONTEXT*     sapi_init_from_opts (test_opts_t        *options);
+TSS2_SYS_CONTEXT*     sapi_init_from_tcti_ctx (TSS2_TCTI_CONTEXT *tcti_ctx);
 void                  sapi_teardown_full  (TSS2_SYS_CONTEXT   *sapi_context);
 
 void                  tcti_free_from_opts (test_opts_t        *options,
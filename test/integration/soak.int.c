@@ -0,0 +1,697 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Soak test: several connections run a random mix of sessions, transient
+ * objects, context saves and loads and disconnects for --duration seconds.
+ * Sessions are handed from one connection to the next by saving them and
+ * disconnecting, and connections are sometimes closed with objects still
+ * loaded, so the daemon's cleanup paths get as much use as the commands.
+ *
+ * Every --interval seconds the throughput, the p50 and p99 latency of the
+ * operations, the RSS of the daemon and the objects, sessions and
+ * connections it holds are recorded. The last two come from the statistics
+ * segment (see --stats-segment), whose path int-test-setup.sh passes in
+ * TABRMD_TEST_STATS_SEGMENT. Once the first --warmup samples are dropped
+ * the rest are split in halves and the test fails if the second half is
+ * worse than the first: throughput or p99 latency more than --tolerance
+ * percent off, or the RSS or the counts staying above the highest the
+ * first half saw for the whole of the second half. Slow leaks and
+ * degradation only show up over hours: the default duration keeps the
+ * test short enough for 'make check', run it with TABRMD_TEST_SOAK_DURATION
+ * set or --duration to soak for real. With --bench the samples are
+ * reported but not checked.
+ *
+ * NOTE: this test can't and doesn't use the main.c driver from the
+ * integration test harness since it needs several connections.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "context-util.h"
+#include "stats-segment.h"
+#include "test-options.h"
+#include "tpm2-struct-init.h"
+
+#define ENV_SOAK_DURATION "TABRMD_TEST_SOAK_DURATION"
+#define ENV_STATS_SEGMENT "TABRMD_TEST_STATS_SEGMENT"
+
+#define WORKERS_DEFAULT   4
+#define DURATION_DEFAULT  60
+#define INTERVAL_DEFAULT  5
+#define WARMUP_DEFAULT    2
+#define TOLERANCE_DEFAULT 25
+#define RSS_SLACK_DEFAULT 1024
+/* fewer samples than this after the warmup are reported but not checked */
+#define SAMPLES_MIN       4
+/*
+ * Sessions saved by a connection that then closed, waiting for another to
+ * load them. Kept under the daemon's default max-abandoned so none of them
+ * is flushed before it's loaded.
+ */
+#define HANDOFF_MAX       2
+
+typedef enum {
+    OP_SESSION,
+    OP_SEQUENCE,
+    OP_ADOPT,
+    OP_DISCONNECT,
+    OPS,
+} soak_op_t;
+/*
+ * Relative frequency of each operation. Keys aren't created: the time RSA
+ * key generation takes varies too much for the latencies to be compared.
+ */
+static const guint op_weights [OPS] = {
+    [OP_SESSION]    = 30,
+    [OP_SEQUENCE]   = 40,
+    [OP_ADOPT]      = 15,
+    [OP_DISCONNECT] = 15,
+};
+
+typedef struct {
+    test_opts_t  test_opts;
+    guint        workers;
+    guint        duration;
+    guint        interval;
+    guint        warmup;
+    guint        tolerance;
+    guint        rss_slack;
+    guint        seed;
+    gboolean     bench;
+    gint         stop;
+    /* latencies of the operations done since the last sample */
+    GMutex       mutex;
+    GArray      *latencies;
+    guint64      errors;
+    /*
+     * sessions handed over, and the room taken for them from being saved
+     * until they're loaded again
+     */
+    GQueue       handoff;
+    guint        handoff_taken;
+} soak_config_t;
+
+typedef struct {
+    soak_config_t *config;
+    guint          index;
+} soak_worker_t;
+
+typedef struct {
+    gdouble      ops_per_sec;
+    gint64       p50;
+    gint64       p99;
+    /* -1 when not known */
+    gint64       rss_kib;
+    gint64       objects;
+    gint64       connections;
+} soak_sample_t;
+
+/*
+ * Start a policy session, save it, load it again and flush it.
+ */
+static TSS2_RC
+op_session (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPMS_CONTEXT context = TPMS_CONTEXT_ZERO_INIT;
+    TPMI_SH_AUTH_SESSION session = 0, loaded = 0;
+    TSS2_RC rc;
+
+    rc = start_auth_session (sapi_context, &session);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = Tss2_Sys_ContextSave (sapi_context, session, &context);
+    if (rc != TSS2_RC_SUCCESS) {
+        flush_context (sapi_context, session);
+        return rc;
+    }
+    rc = Tss2_Sys_ContextLoad (sapi_context, &context, &loaded);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return flush_context (sapi_context, loaded);
+}
+/*
+ * Start a hash sequence, a transient object that's cheap to make, save
+ * it, load the saved context as a second object and flush both. Some are
+ * left for the daemon to flush when the connection closes.
+ */
+static TSS2_RC
+op_sequence (TSS2_SYS_CONTEXT *sapi_context,
+             gboolean          leave)
+{
+    TPMS_CONTEXT context = TPMS_CONTEXT_ZERO_INIT;
+    TPM2B_AUTH auth = { .size = 0, };
+    TPMI_DH_OBJECT sequence = 0, loaded = 0;
+    TSS2_RC rc;
+
+    rc = Tss2_Sys_HashSequenceStart (sapi_context,
+                                     NULL,
+                                     &auth,
+                                     TPM2_ALG_SHA256,
+                                     &sequence,
+                                     NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = Tss2_Sys_ContextSave (sapi_context, sequence, &context);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_Sys_ContextLoad (sapi_context, &context, &loaded);
+    }
+    if (leave && rc == TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    if (loaded != 0) {
+        flush_context (sapi_context, loaded);
+    }
+    flush_context (sapi_context, sequence);
+    return rc;
+}
+/*
+ * Load a session another connection saved before it closed and flush it.
+ * Nothing to do if none is waiting.
+ */
+static TSS2_RC
+op_adopt (soak_config_t    *config,
+          TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPMS_CONTEXT *context;
+    TPMI_SH_AUTH_SESSION loaded = 0;
+    TSS2_RC rc;
+
+    g_mutex_lock (&config->mutex);
+    context = g_queue_pop_head (&config->handoff);
+    g_mutex_unlock (&config->mutex);
+    if (context == NULL) {
+        return TSS2_RC_SUCCESS;
+    }
+    rc = Tss2_Sys_ContextLoad (sapi_context, context, &loaded);
+    g_free (context);
+    g_mutex_lock (&config->mutex);
+    --config->handoff_taken;
+    g_mutex_unlock (&config->mutex);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return flush_context (sapi_context, loaded);
+}
+/*
+ * Close the connection and open a new one. If there's room a session is
+ * saved first for another connection to adopt, it's only handed over once
+ * the connection is closed: a session can't be loaded by a connection
+ * while the one that saved it is open. Sometimes objects are left loaded.
+ */
+static TSS2_RC
+op_disconnect (soak_config_t     *config,
+               TSS2_SYS_CONTEXT **sapi_context,
+               GRand             *rand)
+{
+    TPMS_CONTEXT *context = NULL;
+    TPMI_SH_AUTH_SESSION session = 0;
+    gboolean handoff;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    g_mutex_lock (&config->mutex);
+    handoff = config->handoff_taken < HANDOFF_MAX;
+    if (handoff) {
+        ++config->handoff_taken;
+    }
+    g_mutex_unlock (&config->mutex);
+    if (handoff) {
+        rc = start_auth_session (*sapi_context, &session);
+        if (rc == TSS2_RC_SUCCESS) {
+            context = g_new0 (TPMS_CONTEXT, 1);
+            rc = Tss2_Sys_ContextSave (*sapi_context, session, context);
+        }
+        if (rc != TSS2_RC_SUCCESS) {
+            g_clear_pointer (&context, g_free);
+        }
+    }
+    if (rc == TSS2_RC_SUCCESS && g_rand_boolean (rand)) {
+        rc = op_sequence (*sapi_context, TRUE);
+    }
+    sapi_teardown_full (*sapi_context);
+    g_mutex_lock (&config->mutex);
+    if (context != NULL) {
+        g_queue_push_tail (&config->handoff, context);
+    } else if (handoff) {
+        --config->handoff_taken;
+    }
+    g_mutex_unlock (&config->mutex);
+    *sapi_context = sapi_init_from_opts (&config->test_opts);
+    return rc;
+}
+static soak_op_t
+soak_pick_op (GRand *rand)
+{
+    guint total = 0, pick, i;
+
+    for (i = 0; i < OPS; ++i) {
+        total += op_weights [i];
+    }
+    pick = (guint)g_rand_int_range (rand, 0, (gint32)total);
+    for (i = 0; i + 1 < OPS && pick >= op_weights [i]; ++i) {
+        pick -= op_weights [i];
+    }
+    return (soak_op_t)i;
+}
+static gpointer
+soak_worker_func (gpointer user_data)
+{
+    soak_worker_t *worker = (soak_worker_t*)user_data;
+    soak_config_t *config = worker->config;
+    TSS2_SYS_CONTEXT *sapi_context;
+    GRand *rand;
+    gint64 start, elapsed;
+    TSS2_RC rc;
+
+    rand = g_rand_new_with_seed (config->seed + worker->index);
+    sapi_context = sapi_init_from_opts (&config->test_opts);
+    while (sapi_context != NULL && !g_atomic_int_get (&config->stop)) {
+        start = g_get_monotonic_time ();
+        switch (soak_pick_op (rand)) {
+        case OP_SESSION:
+            rc = op_session (sapi_context);
+            break;
+        case OP_SEQUENCE:
+            rc = op_sequence (sapi_context, FALSE);
+            break;
+        case OP_ADOPT:
+            rc = op_adopt (config, sapi_context);
+            break;
+        default:
+            rc = op_disconnect (config, &sapi_context, rand);
+            break;
+        }
+        elapsed = g_get_monotonic_time () - start;
+        g_mutex_lock (&config->mutex);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("worker %u: operation failed: 0x%" PRIx32,
+                       worker->index, rc);
+            ++config->errors;
+        } else {
+            g_array_append_val (config->latencies, elapsed);
+        }
+        g_mutex_unlock (&config->mutex);
+    }
+    if (sapi_context == NULL) {
+        g_warning ("worker %u: failed to connect to tabrmd", worker->index);
+        g_mutex_lock (&config->mutex);
+        ++config->errors;
+        g_mutex_unlock (&config->mutex);
+    } else {
+        sapi_teardown_full (sapi_context);
+    }
+    g_rand_free (rand);
+    return NULL;
+}
+static gint
+compare_samples (gconstpointer a,
+                 gconstpointer b)
+{
+    gint64 sample_a = *(gint64 const*)a, sample_b = *(gint64 const*)b;
+
+    return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+/*
+ * The sample below which 'per_mille' thousandths of the samples fall,
+ * nearest rank. The samples are sorted.
+ */
+static gint64
+percentile (GArray *samples,
+            guint   per_mille)
+{
+    guint rank;
+
+    if (samples->len == 0) {
+        return 0;
+    }
+    g_array_sort (samples, compare_samples);
+    rank = (guint)(((guint64)samples->len * per_mille + 999) / 1000);
+    rank = CLAMP (rank, 1, samples->len);
+    return g_array_index (samples, gint64, rank - 1);
+}
+/*
+ * The resident set of process 'pid' in KiB, -1 if /proc doesn't tell.
+ */
+static gint64
+process_rss_kib (guint32 pid)
+{
+    gchar *path, *contents = NULL, *line;
+    gint64 rss = -1;
+
+    path = g_strdup_printf ("/proc/%" PRIu32 "/status", pid);
+    if (g_file_get_contents (path, &contents, NULL, NULL)) {
+        line = g_strstr_len (contents, -1, "\nVmRSS:");
+        if (line != NULL) {
+            rss = g_ascii_strtoll (line + sizeof ("\nVmRSS:") - 1, NULL, 10);
+        }
+    }
+    g_free (contents);
+    g_free (path);
+    return rss;
+}
+/*
+ * What the daemon holds according to its statistics segment: its RSS, the
+ * transient objects and sessions of all TPMs together and the connections
+ * open. Left at -1 without a segment.
+ */
+static void
+soak_sample_daemon (const gchar   *segment_path,
+                    soak_sample_t *sample)
+{
+    stats_segment_t *segment;
+    stats_segment_backend_t backend;
+    stats_segment_connection_t connection;
+    guint i;
+
+    sample->rss_kib = -1;
+    sample->objects = -1;
+    sample->connections = -1;
+    if (segment_path == NULL) {
+        return;
+    }
+    segment = stats_segment_open (segment_path);
+    if (segment == NULL) {
+        return;
+    }
+    sample->rss_kib = process_rss_kib (segment->pid);
+    sample->objects = 0;
+    sample->connections = 0;
+    for (i = 0; i < MIN (segment->backends, STATS_SEGMENT_BACKENDS); ++i) {
+        if (stats_segment_read (&segment->backend [i].seq,
+                                &segment->backend [i],
+                                &backend,
+                                sizeof (backend)))
+        {
+            sample->objects += backend.resident + backend.sessions;
+        }
+    }
+    for (i = 0; i < STATS_SEGMENT_CONNECTIONS; ++i) {
+        if (stats_segment_read (&segment->connection [i].seq,
+                                &segment->connection [i],
+                                &connection,
+                                sizeof (connection)) &&
+            connection.serial != 0)
+        {
+            ++sample->connections;
+        }
+    }
+    stats_segment_unmap (segment);
+}
+/*
+ * Take the sample of the 'seconds' since the last one.
+ */
+static void
+soak_sample (soak_config_t *config,
+             const gchar   *segment_path,
+             gdouble        seconds,
+             soak_sample_t *sample)
+{
+    GArray *latencies;
+
+    g_mutex_lock (&config->mutex);
+    latencies = config->latencies;
+    config->latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+    g_mutex_unlock (&config->mutex);
+    sample->ops_per_sec = (gdouble)latencies->len / MAX (seconds, 0.001);
+    sample->p50 = percentile (latencies, 500);
+    sample->p99 = percentile (latencies, 990);
+    g_array_unref (latencies);
+    soak_sample_daemon (segment_path, sample);
+}
+typedef enum {
+    GAUGE_RSS,
+    GAUGE_OBJECTS,
+    GAUGE_CONNECTIONS,
+} soak_gauge_t;
+static gint64
+sample_gauge (const soak_sample_t *sample,
+              soak_gauge_t         gauge)
+{
+    switch (gauge) {
+    case GAUGE_RSS:
+        return sample->rss_kib;
+    case GAUGE_OBJECTS:
+        return sample->objects;
+    default:
+        return sample->connections;
+    }
+}
+/*
+ * A gauge is drifting up if it stays above the highest the first half saw
+ * by more than 'slack' for the whole of the second half. Gauges that
+ * weren't known are never drifting.
+ */
+static gboolean
+gauge_drifts (const soak_sample_t *samples,
+              guint                count,
+              soak_gauge_t         gauge,
+              gint64               slack)
+{
+    gint64 first_max = G_MININT64, second_min = G_MAXINT64, value;
+    guint i;
+
+    for (i = 0; i < count; ++i) {
+        value = sample_gauge (&samples [i], gauge);
+        if (value < 0) {
+            return FALSE;
+        }
+        if (i < count / 2) {
+            first_max = MAX (first_max, value);
+        } else {
+            second_min = MIN (second_min, value);
+        }
+    }
+    return second_min > first_max + slack;
+}
+/*
+ * Compare the second half of the samples after the warmup with the first.
+ * Returns FALSE if anything drifted.
+ */
+static gboolean
+soak_check (const soak_config_t *config,
+            const soak_sample_t *samples,
+            guint                count)
+{
+    gdouble ops [2] = { 0, }, p99 [2] = { 0, }, slack;
+    gboolean ok = TRUE;
+    guint i, half = count / 2;
+
+    for (i = 0; i < count; ++i) {
+        ops [i >= half] += samples [i].ops_per_sec;
+        p99 [i >= half] += (gdouble)samples [i].p99;
+    }
+    ops [0] /= half;
+    p99 [0] /= half;
+    ops [1] /= count - half;
+    p99 [1] /= count - half;
+    printf ("first half %.1f ops/s p99 %.0f us, second half %.1f ops/s "
+            "p99 %.0f us\n", ops [0], p99 [0], ops [1], p99 [1]);
+    slack = (gdouble)config->tolerance / 100;
+    if (ops [1] < ops [0] * (1 - slack)) {
+        g_warning ("throughput dropped by more than %u%%", config->tolerance);
+        ok = FALSE;
+    }
+    if (p99 [1] > p99 [0] * (1 + slack)) {
+        g_warning ("p99 latency grew by more than %u%%", config->tolerance);
+        ok = FALSE;
+    }
+    if (gauge_drifts (samples,
+                      count,
+                      GAUGE_RSS,
+                      config->rss_slack))
+    {
+        g_warning ("daemon RSS kept growing");
+        ok = FALSE;
+    }
+    if (gauge_drifts (samples,
+                      count,
+                      GAUGE_OBJECTS,
+                      0))
+    {
+        g_warning ("objects and sessions held by the daemon kept growing");
+        ok = FALSE;
+    }
+    if (gauge_drifts (samples,
+                      count,
+                      GAUGE_CONNECTIONS,
+                      0))
+    {
+        g_warning ("connections held by the daemon kept growing");
+        ok = FALSE;
+    }
+    return ok;
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    soak_config_t config = {
+        .test_opts = TEST_OPTS_DEFAULT_INIT,
+        .workers = WORKERS_DEFAULT,
+        .duration = DURATION_DEFAULT,
+        .interval = INTERVAL_DEFAULT,
+        .warmup = WARMUP_DEFAULT,
+        .tolerance = TOLERANCE_DEFAULT,
+        .rss_slack = RSS_SLACK_DEFAULT,
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    TSS2_SYS_CONTEXT *sapi_context;
+    soak_worker_t *workers;
+    GThread **threads;
+    GArray *samples;
+    soak_sample_t sample;
+    const gchar *segment_path, *env;
+    gint64 end, last, now;
+    guint i;
+    TSS2_RC rc;
+    int ret = 0;
+    GOptionEntry entries [] = {
+        { "workers", 'w', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.workers, "Connections running the mix of operations.",
+          NULL },
+        { "duration", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.duration, "Seconds to run for, by default "
+          ENV_SOAK_DURATION " or 60.", NULL },
+        { "interval", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.interval, "Seconds between two samples.", NULL },
+        { "warmup", 'u', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.warmup, "Samples dropped before checking for drift.",
+          NULL },
+        { "tolerance", 't', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.tolerance, "Percent the throughput and p99 latency may "
+          "get worse by.", NULL },
+        { "rss-slack", 'r', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.rss_slack, "KiB the daemon RSS may grow by.", NULL },
+        { "seed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.seed, "Seed of the random mix, by default the time.",
+          NULL },
+        { "bench", 'B', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &config.bench, "Report the samples without checking them.",
+          NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    env = g_getenv (ENV_SOAK_DURATION);
+    if (env != NULL) {
+        config.duration = (guint)g_ascii_strtoull (env, NULL, 10);
+    }
+    context = g_option_context_new (" - soak the daemon with a random mix "
+                                    "of operations");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_critical ("failed to parse options: %s", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 2;
+    }
+    g_option_context_free (context);
+    if (config.workers == 0 || config.duration == 0 || config.interval == 0) {
+        g_critical ("workers, duration and interval must be greater than 0");
+        return 2;
+    }
+    if (config.seed == 0) {
+        config.seed = (guint)g_get_real_time ();
+    }
+    get_test_opts_from_env (&config.test_opts);
+    if (sanity_check_test_opts (&config.test_opts) != 0) {
+        exit (1);
+    }
+    segment_path = g_getenv (ENV_STATS_SEGMENT);
+    if (segment_path == NULL) {
+        g_info ("no " ENV_STATS_SEGMENT ", only throughput and latency are "
+                "checked");
+    }
+    sapi_context = sapi_init_from_opts (&config.test_opts);
+    if (sapi_context == NULL) {
+        exit (1);
+    }
+    rc = Tss2_Sys_Startup (sapi_context, TPM2_SU_CLEAR);
+    if (rc != TSS2_RC_SUCCESS && rc != TPM2_RC_INITIALIZE) {
+        g_error ("TPM Startup FAILED! Response Code : 0x%x", rc);
+    }
+    sapi_teardown_full (sapi_context);
+    printf ("%u workers for %u s, seed %u\n", config.workers,
+            config.duration, config.seed);
+
+    g_mutex_init (&config.mutex);
+    g_queue_init (&config.handoff);
+    config.latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+    samples = g_array_new (FALSE, FALSE, sizeof (soak_sample_t));
+    workers = g_new0 (soak_worker_t, config.workers);
+    threads = g_new0 (GThread*, config.workers);
+    for (i = 0; i < config.workers; ++i) {
+        workers [i].config = &config;
+        workers [i].index = i;
+        threads [i] = g_thread_new (NULL, soak_worker_func, &workers [i]);
+    }
+    last = g_get_monotonic_time ();
+    end = last + (gint64)config.duration * G_USEC_PER_SEC;
+    while (last < end) {
+        g_usleep (MIN ((gint64)config.interval * G_USEC_PER_SEC, end - last));
+        now = g_get_monotonic_time ();
+        soak_sample (&config,
+                     segment_path,
+                     (gdouble)(now - last) / G_USEC_PER_SEC,
+                     &sample);
+        last = now;
+        g_array_append_val (samples, sample);
+        printf ("sample %u: %.1f ops/s, p50 %" G_GINT64_FORMAT " us, p99 %"
+                G_GINT64_FORMAT " us, RSS %" G_GINT64_FORMAT " KiB, %"
+                G_GINT64_FORMAT " objects, %" G_GINT64_FORMAT
+                " connections\n",
+                samples->len,
+                sample.ops_per_sec,
+                sample.p50,
+                sample.p99,
+                sample.rss_kib,
+                sample.objects,
+                sample.connections);
+        fflush (stdout);
+    }
+    g_atomic_int_set (&config.stop, TRUE);
+    for (i = 0; i < config.workers; ++i) {
+        g_thread_join (threads [i]);
+    }
+    g_free (threads);
+    g_free (workers);
+
+    if (config.errors > 0) {
+        g_warning ("%" G_GUINT64_FORMAT " operations failed", config.errors);
+        ret = 1;
+    }
+    /* the last sample may cover a short interval, it isn't checked */
+    if (samples->len > 0) {
+        g_array_set_size (samples, samples->len - 1);
+    }
+    if (samples->len < config.warmup + SAMPLES_MIN) {
+        printf ("%u samples after the warmup, too few to check for drift\n",
+                samples->len > config.warmup ? samples->len - config.warmup
+                                             : 0);
+    } else if (!config.bench &&
+               !soak_check (&config,
+                            &g_array_index (samples,
+                                            soak_sample_t,
+                                            config.warmup),
+                            samples->len - config.warmup))
+    {
+        ret = 1;
+    }
+    g_array_unref (samples);
+    g_array_unref (config.latencies);
+    g_queue_foreach (&config.handoff, (GFunc)g_free, NULL);
+    g_queue_clear (&config.handoff);
+    g_mutex_clear (&config.mutex);
+
+    sapi_context = sapi_init_from_opts (&config.test_opts);
+    if (sapi_context == NULL) {
+        exit (1);
+    }
+    clean_up_all (sapi_context);
+    sapi_teardown_full (sapi_context);
+    return ret;
+}
@@ -0,0 +1,334 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * One latency sensitive connection sends PCR_Read over and over while
+ * several background connections keep the TPM busy with CreatePrimary
+ * and Create. The p99 latency of the PCR_Read has to stay under a bound:
+ * by default the time it takes to wait for one expensive command of every
+ * background connection and then some, which is what processing commands
+ * in the order they arrive guarantees. A scheduler that favours cheap
+ * commands should get well under that, --p99-max sets a tighter bound.
+ *
+ * With --bench the latencies are reported but not checked.
+ *
+ * NOTE: this test can't and doesn't use the main.c driver from the
+ * integration test harness since it needs several connections.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "context-util.h"
+#include "test-options.h"
+#include "tpm2-struct-init.h"
+
+#define BACKGROUND_DEFAULT 3
+#define DURATION_DEFAULT 10
+/* foreground commands timed before the background connections start */
+#define IDLE_SAMPLES 50
+/* times the expensive commands are timed on their own */
+#define EXPENSIVE_SAMPLES 3
+/* the bound is this many times what waiting in order would take */
+#define BOUND_SLACK 2
+
+typedef struct {
+    test_opts_t  test_opts;
+    guint        background;
+    guint        duration;
+    guint        p99_max;
+    gboolean     bench;
+    gint         stop;
+} contention_config_t;
+
+typedef struct {
+    contention_config_t *config;
+    guint                index;
+    guint                cycles;
+    guint                errors;
+    gint                 started;
+} background_t;
+
+static TSS2_RC
+pcr_read (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPML_PCR_SELECTION selection = {
+        .count = 1,
+        .pcrSelections = {{
+            .hash = TPM2_ALG_SHA256,
+            .sizeofSelect = 3,
+            .pcrSelect = { 0x01, 0x00, 0x00 },
+        }},
+    };
+    TPML_PCR_SELECTION selection_out;
+    TPML_DIGEST values;
+    UINT32 update_counter;
+
+    return Tss2_Sys_PCR_Read (sapi_context,
+                              NULL,
+                              &selection,
+                              &update_counter,
+                              &selection_out,
+                              &values,
+                              NULL);
+}
+/*
+ * A CreatePrimary and a Create under it, the primary is flushed after.
+ * The time each took is returned through 'primary_us' and 'create_us'.
+ */
+static TSS2_RC
+expensive_cycle (TSS2_SYS_CONTEXT *sapi_context,
+                 gint64           *primary_us,
+                 gint64           *create_us)
+{
+    TPM2B_PRIVATE out_private = TPM2B_PRIVATE_STATIC_INIT;
+    TPM2B_PUBLIC out_public = TPM2B_PUBLIC_ZERO_INIT;
+    TPM2_HANDLE primary = 0;
+    gint64 start, created;
+    TSS2_RC rc;
+
+    start = g_get_monotonic_time ();
+    rc = create_primary (sapi_context, &primary);
+    created = g_get_monotonic_time ();
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = create_key (sapi_context, primary, &out_private, &out_public);
+        flush_context (sapi_context, primary);
+    }
+    *primary_us = created - start;
+    *create_us = g_get_monotonic_time () - created;
+    return rc;
+}
+static gpointer
+background_func (gpointer user_data)
+{
+    background_t *background = (background_t*)user_data;
+    test_opts_t test_opts = background->config->test_opts;
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 primary_us, create_us;
+
+    sapi_context = sapi_init_from_opts (&test_opts);
+    if (sapi_context == NULL) {
+        g_warning ("background %u: failed to connect to tabrmd",
+                   background->index);
+        ++background->errors;
+        g_atomic_int_set (&background->started, TRUE);
+        return NULL;
+    }
+    while (!g_atomic_int_get (&background->config->stop)) {
+        if (expensive_cycle (sapi_context, &primary_us, &create_us) !=
+            TSS2_RC_SUCCESS)
+        {
+            ++background->errors;
+        } else {
+            ++background->cycles;
+        }
+        g_atomic_int_set (&background->started, TRUE);
+    }
+    sapi_teardown_full (sapi_context);
+    return NULL;
+}
+static gint
+compare_samples (gconstpointer a,
+                 gconstpointer b)
+{
+    gint64 sample_a = *(gint64 const*)a, sample_b = *(gint64 const*)b;
+
+    return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+/*
+ * The sample below which 'per_mille' thousandths of the samples fall,
+ * nearest rank. The samples are sorted.
+ */
+static gint64
+percentile (GArray *samples,
+            guint   per_mille)
+{
+    guint rank;
+
+    g_array_sort (samples, compare_samples);
+    rank = (guint)(((guint64)samples->len * per_mille + 999) / 1000);
+    rank = CLAMP (rank, 1, samples->len);
+    return g_array_index (samples, gint64, rank - 1);
+}
+/*
+ * Time PCR_Read on 'sapi_context' until 'count' samples are taken or the
+ * deadline passes, whichever is first. Returns FALSE on the first error.
+ */
+static gboolean
+foreground_run (TSS2_SYS_CONTEXT *sapi_context,
+                GArray           *samples,
+                guint             count,
+                gint64            deadline)
+{
+    gint64 start, end;
+    TSS2_RC rc;
+
+    do {
+        start = g_get_monotonic_time ();
+        rc = pcr_read (sapi_context);
+        end = g_get_monotonic_time ();
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("PCR_Read failed: 0x%" PRIx32, rc);
+            return FALSE;
+        }
+        end -= start;
+        g_array_append_val (samples, end);
+    } while (samples->len < count && g_get_monotonic_time () < deadline);
+    return TRUE;
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    contention_config_t config = {
+        .test_opts = TEST_OPTS_DEFAULT_INIT,
+        .background = BACKGROUND_DEFAULT,
+        .duration = DURATION_DEFAULT,
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    TSS2_SYS_CONTEXT *sapi_context;
+    background_t *backgrounds;
+    GThread **threads;
+    GArray *idle, *contended;
+    gint64 primary_us, create_us, expensive_us = 0, idle_p99, p99, bound;
+    guint i, cycles = 0, errors = 0;
+    gboolean started;
+    TSS2_RC rc;
+    int ret = 0;
+    GOptionEntry entries [] = {
+        { "background", 'b', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.background, "Connections sending CreatePrimary and "
+          "Create.", NULL },
+        { "duration", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.duration, "Seconds the foreground connection sends "
+          "PCR_Read for under contention.", NULL },
+        { "p99-max", 'p', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.p99_max, "Bound on the p99 latency of PCR_Read under "
+          "contention in microseconds, instead of the one waiting in "
+          "order gives.", NULL },
+        { "bench", 'B', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &config.bench, "Report the latencies without checking them.",
+          NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    context = g_option_context_new (" - PCR_Read tail latency under "
+                                    "contention");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_critical ("failed to parse options: %s", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 2;
+    }
+    g_option_context_free (context);
+    if (config.background == 0 || config.duration == 0) {
+        g_critical ("background and duration must be greater than 0");
+        return 2;
+    }
+    get_test_opts_from_env (&config.test_opts);
+    if (sanity_check_test_opts (&config.test_opts) != 0) {
+        exit (1);
+    }
+    sapi_context = sapi_init_from_opts (&config.test_opts);
+    if (sapi_context == NULL) {
+        exit (1);
+    }
+    rc = Tss2_Sys_Startup (sapi_context, TPM2_SU_CLEAR);
+    if (rc != TSS2_RC_SUCCESS && rc != TPM2_RC_INITIALIZE) {
+        g_error ("TPM Startup FAILED! Response Code : 0x%x", rc);
+    }
+
+    /* what the commands cost without anything else going on */
+    idle = g_array_new (FALSE, FALSE, sizeof (gint64));
+    contended = g_array_new (FALSE, FALSE, sizeof (gint64));
+    if (!foreground_run (sapi_context, idle, IDLE_SAMPLES, G_MAXINT64)) {
+        exit (1);
+    }
+    idle_p99 = percentile (idle, 990);
+    for (i = 0; i < EXPENSIVE_SAMPLES; ++i) {
+        rc = expensive_cycle (sapi_context, &primary_us, &create_us);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_error ("CreatePrimary / Create failed: 0x%" PRIx32, rc);
+        }
+        expensive_us = MAX (expensive_us, MAX (primary_us, create_us));
+    }
+
+    backgrounds = g_new0 (background_t, config.background);
+    threads = g_new0 (GThread*, config.background);
+    for (i = 0; i < config.background; ++i) {
+        backgrounds [i].config = &config;
+        backgrounds [i].index = i;
+        threads [i] = g_thread_new (NULL, background_func, &backgrounds [i]);
+    }
+    /* only time the foreground once every background connection is busy */
+    do {
+        g_usleep (G_USEC_PER_SEC / 100);
+        started = TRUE;
+        for (i = 0; i < config.background; ++i) {
+            started = started && g_atomic_int_get (&backgrounds [i].started);
+        }
+    } while (!started);
+    if (!foreground_run (sapi_context,
+                         contended,
+                         G_MAXUINT,
+                         g_get_monotonic_time () +
+                         config.duration * G_USEC_PER_SEC))
+    {
+        ret = 1;
+    }
+    g_atomic_int_set (&config.stop, TRUE);
+    for (i = 0; i < config.background; ++i) {
+        g_thread_join (threads [i]);
+        cycles += backgrounds [i].cycles;
+        errors += backgrounds [i].errors;
+    }
+    g_free (threads);
+    g_free (backgrounds);
+
+    /*
+     * Commands processed in the order they arrive make PCR_Read wait for
+     * at most the command the TPM is busy with and one from each of the
+     * other background connections.
+     */
+    bound = config.p99_max > 0 ? (gint64)config.p99_max :
+        BOUND_SLACK * (idle_p99 + (gint64)config.background * expensive_us);
+    printf ("idle PCR_Read p99 %" G_GINT64_FORMAT " us, slowest "
+            "CreatePrimary / Create %" G_GINT64_FORMAT " us\n",
+            idle_p99, expensive_us);
+    if (contended->len > 0) {
+        p99 = percentile (contended, 990);
+        printf ("%u background connections, %u cycles, %u errors\n",
+                config.background, cycles, errors);
+        printf ("PCR_Read under contention: %u samples, p50 %"
+                G_GINT64_FORMAT " us, p99 %" G_GINT64_FORMAT " us, max %"
+                G_GINT64_FORMAT " us, bound %" G_GINT64_FORMAT " us\n",
+                contended->len,
+                percentile (contended, 500),
+                p99,
+                g_array_index (contended, gint64, contended->len - 1),
+                bound);
+        if (!config.bench && p99 > bound) {
+            g_warning ("PCR_Read p99 of %" G_GINT64_FORMAT " us is over "
+                       "the bound of %" G_GINT64_FORMAT " us",
+                       p99, bound);
+            ret = 1;
+        }
+    }
+    if (errors > 0) {
+        g_warning ("%u background cycles failed", errors);
+        ret = 1;
+    }
+    g_array_unref (idle);
+    g_array_unref (contended);
+    sapi_teardown_full (sapi_context);
+
+    sapi_context = sapi_init_from_opts (&config.test_opts);
+    if (sapi_context == NULL) {
+        exit (1);
+    }
+    clean_up_all (sapi_context);
+    sapi_teardown_full (sapi_context);
+    return ret;
+}
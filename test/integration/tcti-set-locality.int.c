@@ -14,7 +14,9 @@
 #define ENV_NUM_KEYS "TABRMD_TEST_NUM_KEYS"
 
 /*
- * This is a test program to exercise the TCTI set locality command.
+ * This is a test program to exercise the TCTI set locality command. The
+ * locality is set for the connection and a command is sent at it, then
+ * the connection goes back to locality 0.
  */
 int
 test_invoke (TSS2_SYS_CONTEXT *sapi_context)
@@ -29,13 +31,24 @@ test_invoke (TSS2_SYS_CONTEXT *sapi_context)
     }
     g_info ("invoking tss2_tcti_tabrmd_set_locality");
     rc = Tss2_Tcti_SetLocality (tcti_context, 1);
-    if (rc == TSS2_RESMGR_RC_NOT_IMPLEMENTED) {
-        g_info ("tss2_tcti_tabrmd_set_locality failed as expected: 0x%" PRIx32,
-                rc);
-        return 0;
-    } else {
+    if (rc != TSS2_RC_SUCCESS) {
         g_critical ("tss2_tcti_tabrmd_set_locality returned unexpected rc: 0x%"
                     PRIx32, rc);
         return 1;
     }
+    /* a TCTI to the TPM may not support localities, answering with its RC */
+    rc = Tss2_Sys_SelfTest (sapi_context, NULL, TPM2_NO, NULL);
+    g_info ("Tss2_Sys_SelfTest at locality 1 returned rc: 0x%" PRIx32, rc);
+    rc = Tss2_Tcti_SetLocality (tcti_context, 0);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("tss2_tcti_tabrmd_set_locality returned unexpected rc: 0x%"
+                    PRIx32, rc);
+        return 1;
+    }
+    rc = Tss2_Sys_SelfTest (sapi_context, NULL, TPM2_NO, NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("Tss2_Sys_SelfTest at locality 0 failed: 0x%" PRIx32, rc);
+        return 1;
+    }
+    return 0;
 }
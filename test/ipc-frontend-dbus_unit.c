@@ -10,6 +10,7 @@
 #include <cmocka.h>
 
 #include "ipc-frontend-dbus.h"
+#include "tabrmd-defaults.h"
 #include "util.h"
 
 static int
@@ -62,6 +63,91 @@ ipc_frontend_dbus_type_test (void **state)
     assert_true (IS_IPC_FRONTEND (*state));
     assert_true (IS_IPC_FRONTEND_DBUS (*state));
 }
+/*
+ * The waiting queue for CreateConnection calls gets the defaults from
+ * tabrmd-defaults.h and starts out empty.
+ */
+static void
+ipc_frontend_dbus_waiting_test (void **state)
+{
+    IpcFrontendDbus *ipc_frontend_dbus = IPC_FRONTEND_DBUS (*state);
+    guint max_waiting = 0, waiting_timeout = 0;
+
+    g_object_get (ipc_frontend_dbus,
+                  "max-waiting", &max_waiting,
+                  "waiting-timeout", &waiting_timeout,
+                  NULL);
+    assert_int_equal (max_waiting, TABRMD_WAITING_MAX_DEFAULT);
+    assert_int_equal (waiting_timeout, TABRMD_WAITING_TIMEOUT_DEFAULT);
+    assert_true (g_queue_is_empty (&ipc_frontend_dbus->waiting));
+    g_object_set (ipc_frontend_dbus, "max-waiting", 0, NULL);
+    assert_int_equal (ipc_frontend_dbus->max_waiting, 0);
+}
+/*
+ * Nobody has called us yet so there are no PIDs cached.
+ */
+static void
+ipc_frontend_dbus_pid_cache_test (void **state)
+{
+    IpcFrontendDbus *ipc_frontend_dbus = IPC_FRONTEND_DBUS (*state);
+
+    assert_non_null (ipc_frontend_dbus->pid_cache);
+    assert_int_equal (g_hash_table_size (ipc_frontend_dbus->pid_cache), 0);
+}
+/*
+ * GetConnections reports each connection in the ConnectionManager by its
+ * serial and never by its id.
+ */
+static void
+ipc_frontend_dbus_build_connections_test (void **state)
+{
+    IpcFrontendDbus *ipc_frontend_dbus = IPC_FRONTEND_DBUS (*state);
+    HandleMap *handle_map;
+    Connection *connection;
+    GIOStream *iostream;
+    GVariant *connections;
+    guint32 serial, pid, transients, sessions;
+    guint64 commands, bytes_in, bytes_out, exec_us;
+    gint client_fd;
+
+    connections = ipc_frontend_dbus_build_connections (ipc_frontend_dbus);
+    g_variant_ref_sink (connections);
+    assert_int_equal (g_variant_n_children (connections), 0);
+    g_variant_unref (connections);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, 10);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0xdeadbeef, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    connection_set_pid (connection, 42);
+    connection_note_command (connection, 10, 20, 30);
+    connection_manager_insert (ipc_frontend_dbus->connection_manager,
+                               connection);
+
+    connections = ipc_frontend_dbus_build_connections (ipc_frontend_dbus);
+    g_variant_ref_sink (connections);
+    assert_int_equal (g_variant_n_children (connections), 1);
+    g_variant_get_child (connections,
+                         0,
+                         "(uuttttuu)",
+                         &serial,
+                         &pid,
+                         &commands,
+                         &bytes_in,
+                         &bytes_out,
+                         &exec_us,
+                         &transients,
+                         &sessions);
+    assert_int_equal (serial, connection_get_serial (connection));
+    assert_int_equal (pid, 42);
+    assert_int_equal (commands, 1);
+    assert_int_equal (bytes_in, 10);
+    assert_int_equal (bytes_out, 20);
+    assert_int_equal (exec_us, 30);
+    g_variant_unref (connections);
+    g_object_unref (connection);
+}
 gint
 main (void)
 {
@@ -69,6 +155,15 @@ main (void)
         cmocka_unit_test_setup_teardown (ipc_frontend_dbus_type_test,
                                          ipc_frontend_dbus_setup,
                                          ipc_frontend_dbus_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_dbus_waiting_test,
+                                         ipc_frontend_dbus_setup,
+                                         ipc_frontend_dbus_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_dbus_pid_cache_test,
+                                         ipc_frontend_dbus_setup,
+                                         ipc_frontend_dbus_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_dbus_build_connections_test,
+                                         ipc_frontend_dbus_setup,
+                                         ipc_frontend_dbus_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -0,0 +1,249 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ipc-frontend-tcp.h"
+#include "rate-limiter.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-tcp.h"
+#include "tabrmd.h"
+#include "util.h"
+
+#define MAX_CONNECTIONS 1
+
+typedef struct {
+    IpcFrontendTcp    *frontend;
+    ConnectionManager *manager;
+    GSocket           *client;
+    GIOStream         *server;
+} test_data_t;
+
+/*
+ * A GIOStream for the end of a new socket pair, the other end in '*fd'.
+ */
+static GIOStream*
+stream_pair (gint *fd)
+{
+    GSocket *socket;
+    GIOStream *stream;
+    gint fds [2];
+
+    assert_int_equal (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    socket = g_socket_new_from_fd (fds [1], NULL);
+    stream = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+    g_object_unref (socket);
+    *fd = fds [0];
+    return stream;
+}
+static int
+ipc_frontend_tcp_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    Random *random;
+    gint fd;
+
+    random = random_new ();
+    assert_int_equal (random_seed_from_file (random, "/dev/urandom"), 0);
+    data->manager = connection_manager_new (MAX_CONNECTIONS);
+    data->frontend = ipc_frontend_tcp_new ("localhost",
+                                           "cert.pem",
+                                           "key.pem",
+                                           "ca.pem",
+                                           data->manager,
+                                           TABRMD_TRANSIENT_MAX_DEFAULT,
+                                           random);
+    g_object_unref (random);
+    /* stands in for the TLS session */
+    data->server = stream_pair (&fd);
+    data->client = g_socket_new_from_fd (fd, NULL);
+    *state = data;
+    return 0;
+}
+static int
+ipc_frontend_tcp_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->client);
+    g_clear_object (&data->server);
+    g_clear_object (&data->frontend);
+    g_clear_object (&data->manager);
+    free (data);
+    return 0;
+}
+/*
+ * Send a request from the client end in network byte order and have the
+ * frontend handle it. Returns the reply read back by the client in host
+ * byte order, 'local' gets the daemon's end of the connection.
+ */
+static tabrmd_unix_reply_t
+request_connection (test_data_t  *data,
+                    guint32       magic,
+                    guint32       flags,
+                    GIOStream   **local)
+{
+    tabrmd_unix_request_t request = {
+        .magic = GUINT32_TO_BE (magic),
+        .version = GUINT32_TO_BE (TABRMD_TCP_VERSION),
+        .priority = GUINT32_TO_BE (TABRMD_PRIORITY_DEFAULT),
+        .flags = GUINT32_TO_BE (flags),
+    };
+    tabrmd_unix_reply_t reply = { 0 };
+    TSS2_RC rc;
+
+    assert_int_equal (g_socket_send (data->client,
+                                     (const gchar*)&request,
+                                     sizeof (request),
+                                     NULL,
+                                     NULL),
+                      sizeof (request));
+    rc = ipc_frontend_tcp_handle_request (data->frontend,
+                                          data->server,
+                                          local);
+    assert_int_equal (g_socket_receive (data->client,
+                                        (gchar*)&reply,
+                                        sizeof (reply),
+                                        NULL,
+                                        NULL),
+                      sizeof (reply));
+    reply.rc = GUINT32_FROM_BE (reply.rc);
+    reply.flags = GUINT32_FROM_BE (reply.flags);
+    reply.id = GUINT64_FROM_BE (reply.id);
+    assert_int_equal (reply.rc, rc);
+    return reply;
+}
+static void
+ipc_frontend_tcp_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_IPC_FRONTEND (data->frontend));
+    assert_true (IS_IPC_FRONTEND_TCP (data->frontend));
+}
+/*
+ * A good request gets a connection in the ConnectionManager and our end
+ * of its socket back. The fds the seqpacket and shared memory transports
+ * need can't go to another host, so those flags aren't granted, and the
+ * connection has no UID.
+ */
+static void
+ipc_frontend_tcp_request_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GIOStream *local = NULL;
+    Connection *connection;
+
+    reply = request_connection (data,
+                                TABRMD_TCP_MAGIC,
+                                TABRMD_CONNECTION_FLAG_SEQPACKET |
+                                TABRMD_CONNECTION_FLAG_SHM_RING,
+                                &local);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    assert_int_equal (reply.flags, 0);
+    assert_non_null (local);
+    assert_int_equal (connection_manager_size (data->manager), 1);
+    connection = connection_manager_lookup_id (data->manager, reply.id);
+    assert_non_null (connection);
+    assert_int_equal (connection_get_uid (connection), RATE_LIMITER_UID_NONE);
+    g_object_unref (connection);
+    g_object_unref (local);
+}
+/*
+ * Requests that aren't ours, including those for the Unix socket, are
+ * refused and no connection is created.
+ */
+static void
+ipc_frontend_tcp_bad_magic_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GIOStream *local = NULL;
+
+    reply = request_connection (data, TABRMD_UNIX_MAGIC, 0, &local);
+    assert_int_equal (reply.rc, TSS2_RESMGR_RC_BAD_VALUE);
+    assert_null (local);
+    assert_int_equal (connection_manager_size (data->manager), 0);
+}
+/*
+ * Like the Unix socket a request made while the ConnectionManager is full
+ * fails straight away.
+ */
+static void
+ipc_frontend_tcp_full_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GIOStream *local = NULL;
+
+    reply = request_connection (data, TABRMD_TCP_MAGIC, 0, &local);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    g_clear_object (&local);
+    reply = request_connection (data, TABRMD_TCP_MAGIC, 0, &local);
+    assert_int_equal (reply.rc, TSS2_RESMGR_RC_GENERAL_FAILURE);
+    assert_null (local);
+    assert_int_equal (connection_manager_size (data->manager),
+                      MAX_CONNECTIONS);
+}
+static gpointer
+relay_thread (gpointer user_data)
+{
+    GIOStream **streams = (GIOStream**)user_data;
+
+    relay_iostreams (streams [0], streams [1]);
+    return NULL;
+}
+/*
+ * The relay passes data both ways and ends once one side closes, closing
+ * the other.
+ */
+static void
+ipc_frontend_tcp_relay_test (void **state)
+{
+    GIOStream *streams [2];
+    GThread *thread;
+    gint remote, local;
+    gchar buf [4] = { 0, };
+    UNUSED_PARAM (state);
+
+    streams [0] = stream_pair (&remote);
+    streams [1] = stream_pair (&local);
+    thread = g_thread_new ("relay", relay_thread, streams);
+    assert_int_equal (write (remote, "cmd", 3), 3);
+    assert_int_equal (read (local, buf, sizeof (buf)), 3);
+    assert_string_equal (buf, "cmd");
+    assert_int_equal (write (local, "rsp", 3), 3);
+    assert_int_equal (read (remote, buf, sizeof (buf)), 3);
+    assert_string_equal (buf, "rsp");
+    close (remote);
+    assert_int_equal (read (local, buf, sizeof (buf)), 0);
+    g_thread_join (thread);
+    close (local);
+    g_object_unref (streams [0]);
+    g_object_unref (streams [1]);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (ipc_frontend_tcp_type_test,
+                                         ipc_frontend_tcp_setup,
+                                         ipc_frontend_tcp_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_tcp_request_test,
+                                         ipc_frontend_tcp_setup,
+                                         ipc_frontend_tcp_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_tcp_bad_magic_test,
+                                         ipc_frontend_tcp_setup,
+                                         ipc_frontend_tcp_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_tcp_full_test,
+                                         ipc_frontend_tcp_setup,
+                                         ipc_frontend_tcp_teardown),
+        cmocka_unit_test (ipc_frontend_tcp_relay_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <gio/gunixfdmessage.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "ipc-frontend-unix.h"
+#include "tabrmd-defaults.h"
+#include "tabrmd-unix.h"
+#include "tabrmd.h"
+#include "util.h"
+
+#define MAX_CONNECTIONS 1
+
+typedef struct {
+    IpcFrontendUnix   *frontend;
+    ConnectionManager *manager;
+    GSocket           *client;
+    GSocket           *server;
+} test_data_t;
+
+static int
+ipc_frontend_unix_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    Random *random;
+    gint fds [2];
+
+    random = random_new ();
+    assert_int_equal (random_seed_from_file (random, "/dev/urandom"), 0);
+    data->manager = connection_manager_new (MAX_CONNECTIONS);
+    data->frontend = ipc_frontend_unix_new ("/tmp/tabrmd-unit.sock",
+                                            data->manager,
+                                            TABRMD_TRANSIENT_MAX_DEFAULT,
+                                            random);
+    g_object_unref (random);
+    assert_int_equal (socketpair (AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    data->client = g_socket_new_from_fd (fds [0], NULL);
+    data->server = g_socket_new_from_fd (fds [1], NULL);
+    *state = data;
+    return 0;
+}
+static int
+ipc_frontend_unix_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->client);
+    g_clear_object (&data->server);
+    g_clear_object (&data->frontend);
+    g_clear_object (&data->manager);
+    free (data);
+    return 0;
+}
+/*
+ * Send a request from the client end and have the frontend handle it.
+ * Returns the reply read back by the client, 'fd_list' gets the fds that
+ * came with it, if any.
+ */
+static tabrmd_unix_reply_t
+request_connection (test_data_t  *data,
+                    guint32       magic,
+                    guint32       flags,
+                    GUnixFDList **fd_list)
+{
+    tabrmd_unix_request_t request = {
+        .magic = magic,
+        .version = TABRMD_UNIX_VERSION,
+        .priority = TABRMD_PRIORITY_DEFAULT,
+        .flags = flags,
+    };
+    tabrmd_unix_reply_t reply = { 0 };
+    GInputVector vector = { .buffer = &reply, .size = sizeof (reply) };
+    GSocketControlMessage **messages = NULL;
+    gint num_messages = 0, i;
+    TSS2_RC rc;
+
+    assert_int_equal (g_socket_send (data->client,
+                                     (const gchar*)&request,
+                                     sizeof (request),
+                                     NULL,
+                                     NULL),
+                      sizeof (request));
+    rc = ipc_frontend_unix_handle_request (data->frontend,
+                                           data->server,
+                                           1,
+                                           1000);
+    assert_int_equal (g_socket_receive_message (data->client,
+                                                NULL,
+                                                &vector,
+                                                1,
+                                                &messages,
+                                                &num_messages,
+                                                NULL,
+                                                NULL,
+                                                NULL),
+                      sizeof (reply));
+    assert_int_equal (reply.rc, rc);
+    *fd_list = NULL;
+    for (i = 0; i < num_messages; ++i) {
+        if (G_IS_UNIX_FD_MESSAGE (messages [i])) {
+            *fd_list = g_object_ref (
+                g_unix_fd_message_get_fd_list (G_UNIX_FD_MESSAGE (messages [i])));
+        }
+        g_object_unref (messages [i]);
+    }
+    g_free (messages);
+    return reply;
+}
+static void
+ipc_frontend_unix_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_IPC_FRONTEND (data->frontend));
+    assert_true (IS_IPC_FRONTEND_UNIX (data->frontend));
+}
+/*
+ * A good request gets a connection in the ConnectionManager and its
+ * socket back. The connection id is mixed with the PID of the caller, the
+ * connection is tagged with its UID and unknown flags aren't granted.
+ */
+static void
+ipc_frontend_unix_request_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GUnixFDList *fd_list = NULL;
+    Connection *connection;
+
+    reply = request_connection (data,
+                                TABRMD_UNIX_MAGIC,
+                                TABRMD_CONNECTION_FLAG_SEQPACKET | (1 << 30),
+                                &fd_list);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    assert_int_equal (reply.flags, TABRMD_CONNECTION_FLAG_SEQPACKET);
+    assert_non_null (fd_list);
+    assert_int_equal (g_unix_fd_list_get_length (fd_list), 1);
+    assert_int_equal (connection_manager_size (data->manager), 1);
+    assert_true (connection_manager_contains_id (data->manager, reply.id ^ 1));
+    connection = connection_manager_lookup_id (data->manager, reply.id ^ 1);
+    assert_int_equal (connection_get_uid (connection), 1000);
+    g_object_unref (connection);
+    g_object_unref (fd_list);
+}
+/*
+ * Multiplexing is granted on a SOCK_SEQPACKET connection.
+ */
+static void
+ipc_frontend_unix_request_mux_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GUnixFDList *fd_list = NULL;
+
+    reply = request_connection (data,
+                                TABRMD_UNIX_MAGIC,
+                                TABRMD_CONNECTION_FLAG_SEQPACKET |
+                                TABRMD_CONNECTION_FLAG_MUX,
+                                &fd_list);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    assert_int_equal (reply.flags, TABRMD_CONNECTION_FLAG_SEQPACKET |
+                                   TABRMD_CONNECTION_FLAG_MUX);
+    assert_int_equal (connection_manager_size (data->manager), 1);
+    g_object_unref (fd_list);
+}
+/*
+ * A byte stream can't carry the channel tags: multiplexing isn't granted
+ * without SOCK_SEQPACKET.
+ */
+static void
+ipc_frontend_unix_request_mux_stream_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GUnixFDList *fd_list = NULL;
+
+    reply = request_connection (data,
+                                TABRMD_UNIX_MAGIC,
+                                TABRMD_CONNECTION_FLAG_MUX,
+                                &fd_list);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    assert_int_equal (reply.flags, 0);
+    g_object_unref (fd_list);
+}
+/*
+ * Requests that aren't ours are refused and no connection is created.
+ */
+static void
+ipc_frontend_unix_bad_magic_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GUnixFDList *fd_list = NULL;
+
+    reply = request_connection (data, 0xdeadbeef, 0, &fd_list);
+    assert_int_equal (reply.rc, TSS2_RESMGR_RC_BAD_VALUE);
+    assert_null (fd_list);
+    assert_int_equal (connection_manager_size (data->manager), 0);
+}
+/*
+ * There's no waiting queue behind the socket: a request made while the
+ * ConnectionManager is full fails straight away.
+ */
+static void
+ipc_frontend_unix_full_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    tabrmd_unix_reply_t reply;
+    GUnixFDList *fd_list = NULL;
+
+    reply = request_connection (data, TABRMD_UNIX_MAGIC, 0, &fd_list);
+    assert_int_equal (reply.rc, TSS2_RC_SUCCESS);
+    g_clear_object (&fd_list);
+    reply = request_connection (data, TABRMD_UNIX_MAGIC, 0, &fd_list);
+    assert_int_equal (reply.rc, TSS2_RESMGR_RC_GENERAL_FAILURE);
+    assert_null (fd_list);
+    assert_int_equal (connection_manager_size (data->manager),
+                      MAX_CONNECTIONS);
+}
+/*
+ * Without the LISTEN_* environment from systemd, or with one meant for
+ * another process, there's no activated socket to use.
+ */
+static void
+ipc_frontend_unix_activation_fd_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+    assert_int_equal (ipc_frontend_unix_activation_fd (), -1);
+    g_setenv ("LISTEN_PID", "1", TRUE);
+    g_setenv ("LISTEN_FDS", "1", TRUE);
+    assert_int_equal (ipc_frontend_unix_activation_fd (), -1);
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_type_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_request_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_request_mux_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_request_mux_stream_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_bad_magic_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test_setup_teardown (ipc_frontend_unix_full_test,
+                                         ipc_frontend_unix_setup,
+                                         ipc_frontend_unix_teardown),
+        cmocka_unit_test (ipc_frontend_unix_activation_fd_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "key-pool.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/*
+ * Create under the persistent parent 0x81000001 with a password auth, an
+ * empty sensitive area and a keyedhash public area. The parent handle,
+ * the auth handle and creationPCR are the arguments.
+ */
+#define CREATE_HEX(size, parent, auth, pcrs) \
+    "8002" size "00000153" parent "00000009" auth "0000 01 0000" \
+    "0004 0000 0000" \
+    "000e 0008 000b 00040072 0000 0010 0000" \
+    "0000" pcrs
+#define CREATE_OK      CREATE_HEX ("00000037", "81000001", "40000009", \
+                                   "00000000")
+#define CREATE_OTHER   CREATE_HEX ("00000037", "81000002", "40000009", \
+                                   "00000000")
+#define CREATE_TRANS   CREATE_HEX ("00000037", "80000001", "40000009", \
+                                   "00000000")
+#define CREATE_HMAC    CREATE_HEX ("00000037", "81000001", "02000000", \
+                                   "00000000")
+#define CREATE_PCRS    CREATE_HEX ("0000003d", "81000001", "40000009", \
+                                   "00000001 000b 03 000000")
+#define CREATE_PRIMARY "8001 0000000e 00000131 40000001"
+#define RESPONSE_HEX   "8002 0000000e 00000000 00000000"
+
+typedef struct {
+    KeyPool *pool;
+    GBytes  *command;
+    GBytes  *key;
+} test_data_t;
+
+/*
+ * Parse the hex in 'hex' into a Create command.
+ */
+static Tpm2Command*
+create_from_hex (const gchar *hex)
+{
+    GBytes *bytes = parse_command_hex (hex);
+    guint8 *buf;
+    gsize size;
+
+    assert_non_null (bytes);
+    buf = g_bytes_unref_to_data (bytes, &size);
+    return tpm2_command_new (NULL, buf, size, KEY_POOL_CREATE_ATTRS);
+}
+static int
+key_pool_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    Tpm2Command *command;
+
+    data->pool = key_pool_new ();
+    data->command = parse_command_hex (CREATE_OK);
+    command = create_from_hex (CREATE_OK);
+    data->key = key_pool_key (command);
+    g_object_unref (command);
+    assert_true (key_pool_add_template (data->pool, data->command, 2));
+    *state = data;
+    return 0;
+}
+static int
+key_pool_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->pool);
+    g_clear_pointer (&data->command, g_bytes_unref);
+    g_clear_pointer (&data->key, g_bytes_unref);
+    free (data);
+    return 0;
+}
+/*
+ * The key is the command after the header. A transient parent, an HMAC
+ * session, creationPCR or a command other than Create make it NULL.
+ */
+static void
+key_pool_key_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    gsize size;
+
+    assert_non_null (data->key);
+    size = g_bytes_get_size (data->command);
+    assert_int_equal (g_bytes_get_size (data->key), size - TPM_HEADER_SIZE);
+    assert_memory_equal (g_bytes_get_data (data->key, NULL),
+                         (guint8*)g_bytes_get_data (data->command, NULL) +
+                         TPM_HEADER_SIZE,
+                         size - TPM_HEADER_SIZE);
+
+    command = create_from_hex (CREATE_TRANS);
+    assert_null (key_pool_key (command));
+    g_object_unref (command);
+    command = create_from_hex (CREATE_HMAC);
+    assert_null (key_pool_key (command));
+    g_object_unref (command);
+    command = create_from_hex (CREATE_PCRS);
+    assert_null (key_pool_key (command));
+    g_object_unref (command);
+    command = create_from_hex (CREATE_PRIMARY);
+    assert_null (key_pool_key (command));
+    g_object_unref (command);
+}
+/*
+ * The template command is a copy of the configured one. Keys are taken
+ * oldest first, once each, and a template holds no more than its size.
+ */
+static void
+key_pool_take_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    GBytes *key = NULL, *first, *second, *taken;
+
+    assert_int_equal (key_pool_get_space (data->pool), 2);
+    command = key_pool_template_command (data->pool, &key);
+    assert_non_null (command);
+    assert_true (g_bytes_equal (key, data->key));
+    assert_int_equal (tpm2_command_get_size (command),
+                      g_bytes_get_size (data->command));
+    g_object_unref (command);
+
+    first = parse_command_hex (RESPONSE_HEX);
+    second = parse_command_hex (RESPONSE_HEX);
+    assert_true (key_pool_add (data->pool, key, first));
+    assert_true (key_pool_add (data->pool, key, second));
+    assert_false (key_pool_add (data->pool, key, first));
+    assert_int_equal (key_pool_get_level (data->pool), 2);
+    assert_int_equal (key_pool_get_space (data->pool), 0);
+    assert_null (key_pool_template_command (data->pool, &key));
+
+    taken = key_pool_take (data->pool, key);
+    assert_ptr_equal (taken, first);
+    g_bytes_unref (taken);
+    taken = key_pool_take (data->pool, key);
+    assert_ptr_equal (taken, second);
+    g_bytes_unref (taken);
+    assert_null (key_pool_take (data->pool, key));
+    assert_int_equal (key_pool_get_space (data->pool), 2);
+
+    g_bytes_unref (first);
+    g_bytes_unref (second);
+    g_bytes_unref (key);
+}
+/*
+ * A template is added once and keys for other Create commands aren't
+ * pooled. Forgetting drops the keys but keeps the templates.
+ */
+static void
+key_pool_forget_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    GBytes *other, *other_key, *response;
+
+    assert_false (key_pool_add_template (data->pool, data->command, 1));
+    other = parse_command_hex (CREATE_OTHER);
+    command = create_from_hex (CREATE_OTHER);
+    other_key = key_pool_key (command);
+    g_object_unref (command);
+    response = parse_command_hex (RESPONSE_HEX);
+    assert_false (key_pool_add (data->pool, other_key, response));
+    assert_null (key_pool_take (data->pool, other_key));
+
+    assert_true (key_pool_add_template (data->pool, other, 1));
+    assert_true (key_pool_add (data->pool, other_key, response));
+    assert_true (key_pool_add (data->pool, data->key, response));
+    assert_int_equal (key_pool_get_level (data->pool), 2);
+    key_pool_forget (data->pool);
+    assert_int_equal (key_pool_get_level (data->pool), 0);
+    assert_int_equal (key_pool_get_space (data->pool), 3);
+
+    g_bytes_unref (response);
+    g_bytes_unref (other_key);
+    g_bytes_unref (other);
+}
+/*
+ * Write 'contents' to a new file and read it as a key pool file.
+ */
+static KeyPool*
+load_contents (const gchar *contents)
+{
+    KeyPool *pool;
+    gchar *path;
+    gint fd;
+
+    fd = g_file_open_tmp ("key-pool-XXXXXX", &path, NULL);
+    assert_true (fd >= 0);
+    close (fd);
+    assert_true (g_file_set_contents (path, contents, -1, NULL));
+    pool = key_pool_load (path);
+    g_unlink (path);
+    g_free (path);
+    return pool;
+}
+/*
+ * Each group is a template with room for 'size' keys, one by default. A
+ * group without a command, with a command that can't be pooled or with a
+ * size out of range fails the whole file.
+ */
+static void
+key_pool_load_test (void **state)
+{
+    KeyPool *pool;
+    UNUSED_PARAM (state);
+
+    pool = load_contents ("[rsa]\ncommand=" CREATE_OK "\nsize=4\n"
+                          "[other]\ncommand=" CREATE_OTHER "\n");
+    assert_non_null (pool);
+    assert_int_equal (pool->templates->len, 2);
+    assert_int_equal (key_pool_get_space (pool), 5);
+    g_object_unref (pool);
+
+    assert_null (load_contents ("[rsa]\nsize=4\n"));
+    assert_null (load_contents ("[rsa]\ncommand=" CREATE_TRANS "\n"));
+    assert_null (load_contents ("[rsa]\ncommand=" CREATE_OK "\nsize=0\n"));
+    assert_null (load_contents ("[rsa]\ncommand=" CREATE_OK "\nsize=17\n"));
+    assert_null (load_contents ("[rsa]\ncommand=" CREATE_OK "\n"
+                                "[again]\ncommand=" CREATE_OK "\n"));
+    assert_null (load_contents ("not a key file"));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (key_pool_key_test,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test_setup_teardown (key_pool_take_test,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test_setup_teardown (key_pool_forget_test,
+                                         key_pool_setup,
+                                         key_pool_teardown),
+        cmocka_unit_test (key_pool_load_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
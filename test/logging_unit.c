@@ -5,6 +5,7 @@
  */
 #include <glib.h>
 #include <stdlib.h>
+#include <syslog.h>
 
 #include <setjmp.h>
 #include <string.h>
@@ -81,6 +82,7 @@ logging_set_logger_syslog_test (void **state)
     assert_int_equal (set_logger ("syslog"), 0);
 }
 
+static gint syslog_calls = 0;
 void
 __wrap_syslog (int priority,
                const char *format,
@@ -88,6 +90,7 @@ __wrap_syslog (int priority,
 {
     UNUSED_PARAM(priority);
     UNUSED_PARAM(format);
+    g_atomic_int_inc (&syslog_calls);
     return;
 }
 
@@ -170,6 +173,82 @@ logging_syslog_log_handler_default_test (void **state)
                         "foo",
                         NULL);
 }
+/*
+ * Messages come out of the ring in the order they went in, with their
+ * priority, and once it's full they're dropped and counted.
+ */
+static void
+logging_log_ring_test (void **state)
+{
+    log_ring_t *ring = g_new0 (log_ring_t, 1);
+    gchar message [LOG_MESSAGE_MAX], *expected;
+    gint priority, i;
+    UNUSED_PARAM(state);
+
+    log_ring_init (ring);
+    assert_false (log_ring_pop (ring, &priority, message));
+    for (i = 0; i < LOG_RING_SIZE; ++i) {
+        expected = g_strdup_printf ("message %d", i);
+        assert_true (log_ring_push (ring, i % 8, expected));
+        g_free (expected);
+    }
+    assert_false (log_ring_push (ring, LOG_WARNING, "dropped"));
+    assert_int_equal (g_atomic_int_get (&ring->dropped), 1);
+    for (i = 0; i < LOG_RING_SIZE; ++i) {
+        expected = g_strdup_printf ("message %d", i);
+        assert_true (log_ring_pop (ring, &priority, message));
+        assert_int_equal (priority, i % 8);
+        assert_string_equal (message, expected);
+        g_free (expected);
+        /* the slot is free again */
+        assert_true (log_ring_push (ring, LOG_INFO, "again"));
+    }
+    assert_true (log_ring_pop (ring, &priority, message));
+    assert_string_equal (message, "again");
+    g_free (ring);
+}
+/*
+ * Messages longer than a slot are cut short.
+ */
+static void
+logging_log_ring_truncate_test (void **state)
+{
+    log_ring_t *ring = g_new0 (log_ring_t, 1);
+    gchar message [LOG_MESSAGE_MAX], *longer;
+    gint priority;
+    UNUSED_PARAM(state);
+
+    longer = g_strnfill (LOG_MESSAGE_MAX * 2, 'x');
+    log_ring_init (ring);
+    assert_true (log_ring_push (ring, LOG_INFO, longer));
+    assert_true (log_ring_pop (ring, &priority, message));
+    assert_int_equal (strlen (message), LOG_MESSAGE_MAX - 1);
+    g_free (longer);
+    g_free (ring);
+}
+/*
+ * The logger thread writes everything queued before it's stopped, errors
+ * are written right away.
+ */
+static void
+logging_start_stop_test (void **state)
+{
+    gint i;
+    UNUSED_PARAM(state);
+
+    logging_stop ();
+    logging_start ();
+    g_atomic_int_set (&syslog_calls, 0);
+    syslog_log_handler ("domain", G_LOG_LEVEL_ERROR, "error", NULL);
+    assert_int_equal (g_atomic_int_get (&syslog_calls), 1);
+    for (i = 0; i < 10; ++i) {
+        syslog_log_handler ("domain", G_LOG_LEVEL_WARNING, "warning", NULL);
+    }
+    logging_stop ();
+    assert_int_equal (g_atomic_int_get (&syslog_calls), 11);
+    syslog_log_handler ("domain", G_LOG_LEVEL_WARNING, "warning", NULL);
+    assert_int_equal (g_atomic_int_get (&syslog_calls), 12);
+}
 int
 main (void)
 {
@@ -188,6 +267,9 @@ main (void)
         cmocka_unit_test (logging_syslog_log_handler_info_test),
         cmocka_unit_test (logging_syslog_log_handler_debug_test),
         cmocka_unit_test (logging_syslog_log_handler_default_test),
+        cmocka_unit_test (logging_log_ring_test),
+        cmocka_unit_test (logging_log_ring_truncate_test),
+        cmocka_unit_test (logging_start_stop_test),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -110,6 +110,60 @@ message_queue_dequeue_order_test (void **state)
     g_object_unref (obj_1);
     g_object_unref (obj_2);
 }
+/*
+ * Dequeue with a timeout from an empty queue: we should get NULL back once
+ * the timeout expires. Then enqueue an object and make sure the same call
+ * returns it.
+ */
+static void
+message_queue_timeout_dequeue_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msg = control_message_new (CHECK_CANCEL);
+    GObject *obj;
+
+    obj = message_queue_timeout_dequeue (data->queue, 1000);
+    assert_null (obj);
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    obj = message_queue_timeout_dequeue (data->queue, 1000);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    g_object_unref (msg);
+}
+/*
+ * Queue 3 messages and dequeue them in a batch of at most 2: we get the
+ * first 2 in order, then the last one, then nothing once the timeout
+ * expires.
+ */
+static void
+message_queue_dequeue_batch_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    ControlMessage *msgs [3];
+    GObject *objs [2] = { NULL, };
+    size_t i;
+
+    for (i = 0; i < 3; ++i) {
+        msgs [i] = control_message_new (CHECK_CANCEL);
+        message_queue_enqueue (data->queue, G_OBJECT (msgs [i]));
+    }
+    assert_int_equal (message_queue_dequeue_batch (data->queue, objs, 2), 2);
+    assert_ptr_equal (objs [0], msgs [0]);
+    assert_ptr_equal (objs [1], msgs [1]);
+    g_object_unref (objs [0]);
+    g_object_unref (objs [1]);
+    assert_int_equal (message_queue_timeout_dequeue_batch (data->queue,
+                                                           objs, 2, 1000),
+                      1);
+    assert_ptr_equal (objs [0], msgs [2]);
+    g_object_unref (objs [0]);
+    assert_int_equal (message_queue_timeout_dequeue_batch (data->queue,
+                                                           objs, 2, 1000),
+                      0);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (msgs [i]);
+    }
+}
 /*
  * This function is used in the thread_unblock_test function as the thread
  * that blocks on the MessageQueue waiting for a message.
@@ -146,6 +200,481 @@ message_queue_thread_unblock_test (void **state)
     assert_int_equal (ret, 0);
 }
 
+/*
+ * Key and cost functions for the fair MessageQueue tests. Messages are
+ * ControlMessages keyed on the object they carry. The cost of a
+ * CONNECTION_REMOVED message is higher than the quantum used in the tests.
+ */
+#define FAIR_QUANTUM 2
+static gpointer
+fair_key_func (GObject *obj)
+{
+    return control_message_get_object (CONTROL_MESSAGE (obj));
+}
+static guint
+fair_cost_func (GObject *obj)
+{
+    if (control_message_get_code (CONTROL_MESSAGE (obj)) == CONNECTION_REMOVED)
+        return FAIR_QUANTUM + 1;
+    return 1;
+}
+static int
+message_queue_fair_setup (void **state)
+{
+    msgq_test_data_t *data = NULL;
+
+    data = calloc (1, sizeof (msgq_test_data_t));
+    assert_non_null (data);
+    data->queue = message_queue_new_fair (fair_key_func,
+                                          fair_cost_func,
+                                          FAIR_QUANTUM);
+    *state = data;
+    return 0;
+}
+static ControlMessage*
+fair_enqueue (MessageQueue *queue,
+              ControlCode   code,
+              GObject      *key)
+{
+    ControlMessage *msg = control_message_new_with_object (code, key);
+
+    message_queue_enqueue (queue, G_OBJECT (msg));
+    g_object_unref (msg);
+    return msg;
+}
+static void
+fair_dequeue_check (MessageQueue   *queue,
+                    ControlMessage *expected)
+{
+    GObject *obj;
+
+    obj = message_queue_timeout_dequeue (queue, 1000);
+    assert_ptr_equal (obj, expected);
+    g_object_unref (obj);
+}
+/*
+ * Queue 4 messages with key 'a' followed by 1 with key 'b'. With a quantum
+ * of 2 the message for 'b' is dequeued after the first 2 for 'a', and the
+ * messages for 'a' stay in order.
+ */
+static void
+message_queue_fair_order_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *a0, *a1, *a2, *a3, *b0;
+
+    a0 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a1 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a2 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a3 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+
+    fair_dequeue_check (data->queue, a0);
+    fair_dequeue_check (data->queue, a1);
+    fair_dequeue_check (data->queue, b0);
+    fair_dequeue_check (data->queue, a2);
+    fair_dequeue_check (data->queue, a3);
+    assert_null (message_queue_timeout_dequeue (data->queue, 1000));
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * A batch dequeued from a fair queue holds the messages in the same order
+ * as single dequeues would return them.
+ */
+static void
+message_queue_fair_dequeue_batch_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *a0, *a1, *a2, *b0;
+    GObject *objs [8] = { NULL, };
+    size_t i;
+
+    a0 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a1 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a2 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+
+    assert_int_equal (message_queue_timeout_dequeue_batch (data->queue,
+                                                           objs, 8, 1000),
+                      4);
+    assert_ptr_equal (objs [0], a0);
+    assert_ptr_equal (objs [1], a1);
+    assert_ptr_equal (objs [2], b0);
+    assert_ptr_equal (objs [3], a2);
+    for (i = 0; i < 4; ++i) {
+        g_object_unref (objs [i]);
+    }
+    assert_int_equal (message_queue_timeout_dequeue_batch (data->queue,
+                                                           objs, 8, 1000),
+                      0);
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * Dequeuing by key takes the messages of that flow out of turn, the ones
+ * with the NULL key come first. The other flows keep their messages.
+ */
+static void
+message_queue_fair_dequeue_key_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *a0, *a1, *b0, *n0;
+    GObject *obj;
+
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+    a0 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    n0 = fair_enqueue (data->queue, CHECK_CANCEL, NULL);
+    a1 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+
+    obj = message_queue_timeout_dequeue_key (data->queue, key_a, 1000);
+    assert_ptr_equal (obj, n0);
+    g_object_unref (obj);
+    obj = message_queue_timeout_dequeue_key (data->queue, key_a, 1000);
+    assert_ptr_equal (obj, a0);
+    g_object_unref (obj);
+    obj = message_queue_timeout_dequeue_key (data->queue, key_a, 1000);
+    assert_ptr_equal (obj, a1);
+    g_object_unref (obj);
+    assert_null (message_queue_timeout_dequeue_key (data->queue, key_a, 1000));
+    fair_dequeue_check (data->queue, b0);
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * A message costing more than the quantum must wait for its flow to
+ * accumulate enough deficit. A cheaper message from another flow queued
+ * after it is dequeued first.
+ */
+static void
+message_queue_fair_cost_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *a0, *b0;
+
+    a0 = fair_enqueue (data->queue, CONNECTION_REMOVED, key_a);
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+
+    fair_dequeue_check (data->queue, b0);
+    fair_dequeue_check (data->queue, a0);
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * Estimate function for the fair MessageQueue tests: the expected time is
+ * carried in the key object of the message.
+ */
+#define FAIR_ESTIMATE_KEY "estimate"
+static guint64
+fair_estimate_func (GObject  *obj,
+                    gpointer  user_data)
+{
+    GObject *key = control_message_get_object (CONTROL_MESSAGE (obj));
+    UNUSED_PARAM(user_data);
+
+    return GPOINTER_TO_UINT (g_object_get_data (key, FAIR_ESTIMATE_KEY));
+}
+static GObject*
+fair_estimate_key_new (guint estimate)
+{
+    GObject *key = g_object_new (G_TYPE_OBJECT, NULL);
+
+    g_object_set_data (key, FAIR_ESTIMATE_KEY, GUINT_TO_POINTER (estimate));
+    return key;
+}
+/*
+ * Flows that are expected to be quick get their turn first. A flow with
+ * an expensive message that has been waiting long enough is served before
+ * a quick one that just arrived.
+ */
+static void
+message_queue_fair_estimate_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_slow = fair_estimate_key_new (1000);
+    GObject *key_fast = fair_estimate_key_new (100);
+    ControlMessage *slow, *fast;
+
+    message_queue_set_estimate_func (data->queue, fair_estimate_func, NULL);
+    slow = fair_enqueue (data->queue, CHECK_CANCEL, key_slow);
+    fast = fair_enqueue (data->queue, CHECK_CANCEL, key_fast);
+    g_usleep (G_TIME_SPAN_MILLISECOND);
+    fair_dequeue_check (data->queue, fast);
+    fair_dequeue_check (data->queue, slow);
+
+    slow = fair_enqueue (data->queue, CHECK_CANCEL, key_slow);
+    g_usleep (20 * G_TIME_SPAN_MILLISECOND);
+    fast = fair_enqueue (data->queue, CHECK_CANCEL, key_fast);
+    fair_dequeue_check (data->queue, slow);
+    fair_dequeue_check (data->queue, fast);
+    g_object_unref (key_slow);
+    g_object_unref (key_fast);
+}
+/*
+ * Share function for the fair MessageQueue tests: the share and its
+ * weight are carried in the key object of the message.
+ */
+#define FAIR_SHARE_KEY "share"
+#define FAIR_WEIGHT_KEY "weight"
+static gboolean
+fair_share_func (GObject  *obj,
+                 guint32  *share,
+                 guint    *weight,
+                 gpointer  user_data)
+{
+    GObject *key = control_message_get_object (CONTROL_MESSAGE (obj));
+    UNUSED_PARAM(user_data);
+
+    *share = GPOINTER_TO_UINT (g_object_get_data (key, FAIR_SHARE_KEY));
+    *weight = GPOINTER_TO_UINT (g_object_get_data (key, FAIR_WEIGHT_KEY));
+    return TRUE;
+}
+static GObject*
+fair_share_key_new (guint share,
+                    guint weight)
+{
+    GObject *key = g_object_new (G_TYPE_OBJECT, NULL);
+
+    g_object_set_data (key, FAIR_SHARE_KEY, GUINT_TO_POINTER (share));
+    g_object_set_data (key, FAIR_WEIGHT_KEY, GUINT_TO_POINTER (weight));
+    return key;
+}
+static void
+fair_dequeue_charge_check (MessageQueue   *queue,
+                           ControlMessage *expected,
+                           guint64         cost_us)
+{
+    GObject *obj;
+
+    obj = message_queue_timeout_dequeue (queue, 1000);
+    assert_ptr_equal (obj, expected);
+    message_queue_charge (queue, obj, cost_us);
+    g_object_unref (obj);
+}
+/*
+ * Queue 6 messages in a share of weight 4 and 4 in a share of weight 1,
+ * each taking the same time. Both shares get a turn, after that the
+ * first one is owed more time and keeps the turns until it runs out
+ * where plain round robin would alternate.
+ */
+static void
+message_queue_fair_share_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = fair_share_key_new (1, 4);
+    GObject *key_b = fair_share_key_new (2, 1);
+    ControlMessage *msgs_a [6], *msgs_b [4];
+    guint i;
+
+    message_queue_set_share_func (data->queue, fair_share_func, NULL);
+    for (i = 0; i < G_N_ELEMENTS (msgs_a); ++i) {
+        msgs_a [i] = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    }
+    for (i = 0; i < G_N_ELEMENTS (msgs_b); ++i) {
+        msgs_b [i] = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+    }
+    fair_dequeue_charge_check (data->queue, msgs_a [0], 100);
+    fair_dequeue_charge_check (data->queue, msgs_a [1], 100);
+    fair_dequeue_charge_check (data->queue, msgs_b [0], 100);
+    fair_dequeue_charge_check (data->queue, msgs_b [1], 100);
+    for (i = 2; i < G_N_ELEMENTS (msgs_a); ++i) {
+        fair_dequeue_charge_check (data->queue, msgs_a [i], 100);
+    }
+    fair_dequeue_charge_check (data->queue, msgs_b [2], 100);
+    fair_dequeue_charge_check (data->queue, msgs_b [3], 100);
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+static gboolean
+fair_urgent_func (GObject *obj)
+{
+    return control_message_get_code (CONTROL_MESSAGE (obj)) ==
+        CONNECTION_REMOVED;
+}
+/*
+ * An urgent message is dequeued before the messages of the other flows
+ * queued ahead of it, but not before those queued with its own key.
+ */
+static void
+message_queue_fair_urgent_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *a0, *a1, *a2, *b0, *b1;
+
+    message_queue_set_urgent_func (data->queue, fair_urgent_func);
+    a0 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    a1 = fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    b0 = fair_enqueue (data->queue, CONNECTION_REMOVED, key_b);
+    a2 = fair_enqueue (data->queue, CONNECTION_REMOVED, key_a);
+    b1 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+    assert_int_equal (message_queue_get_length (data->queue), 5);
+
+    fair_dequeue_check (data->queue, b0);
+    fair_dequeue_check (data->queue, a0);
+    fair_dequeue_check (data->queue, a1);
+    fair_dequeue_check (data->queue, b1);
+    fair_dequeue_check (data->queue, a2);
+    assert_null (message_queue_timeout_dequeue (data->queue, 1000));
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * Removing a key drops all of the messages queued with it and leaves the
+ * other flows alone.
+ */
+static void
+message_queue_fair_remove_key_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *b0;
+
+    fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+    fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+
+    assert_int_equal (message_queue_remove_key (data->queue, key_a,
+                                                NULL, NULL), 2);
+    assert_int_equal (message_queue_remove_key (data->queue, key_a,
+                                                NULL, NULL), 0);
+    fair_dequeue_check (data->queue, b0);
+    assert_null (message_queue_timeout_dequeue (data->queue, 1000));
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * The length of a fair queue counts the messages of every flow.
+ */
+static void
+message_queue_fair_get_length_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *key_b = g_object_new (G_TYPE_OBJECT, NULL);
+
+    assert_int_equal (message_queue_get_length (data->queue), 0);
+    fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    fair_enqueue (data->queue, CHECK_CANCEL, key_b);
+    fair_enqueue (data->queue, CHECK_CANCEL, key_a);
+    assert_int_equal (message_queue_get_length (data->queue), 3);
+    message_queue_remove_key (data->queue, key_a, NULL, NULL);
+    assert_int_equal (message_queue_get_length (data->queue), 1);
+    g_object_unref (key_a);
+    g_object_unref (key_b);
+}
+/*
+ * The high-water mark stays at the longest the queue has been.
+ */
+static void
+message_queue_fair_high_water_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key = g_object_new (G_TYPE_OBJECT, NULL);
+    GObject *obj;
+
+    assert_int_equal (message_queue_get_high_water (data->queue), 0);
+    fair_enqueue (data->queue, CHECK_CANCEL, key);
+    fair_enqueue (data->queue, CHECK_CANCEL, key);
+    obj = message_queue_dequeue (data->queue);
+    g_object_unref (obj);
+    fair_enqueue (data->queue, CHECK_CANCEL, key);
+    assert_int_equal (message_queue_get_length (data->queue), 2);
+    assert_int_equal (message_queue_get_high_water (data->queue), 2);
+    fair_enqueue (data->queue, CHECK_CANCEL, key);
+    assert_int_equal (message_queue_get_high_water (data->queue), 3);
+    g_object_unref (key);
+}
+/*
+ * Messages still queued when a fair MessageQueue is destroyed must be
+ * released with it.
+ */
+static void
+message_queue_fair_dispose_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_a = g_object_new (G_TYPE_OBJECT, NULL);
+    ControlMessage *msg = control_message_new_with_object (CHECK_CANCEL,
+                                                          key_a);
+
+    g_object_add_weak_pointer (G_OBJECT (msg), (gpointer*)&msg);
+    message_queue_enqueue (data->queue, G_OBJECT (msg));
+    g_object_unref (msg);
+    assert_non_null (msg);
+    g_clear_object (&data->queue);
+    assert_null (msg);
+    g_object_unref (key_a);
+    free (data);
+}
+
+/*
+ * Class function for the fair MessageQueue tests: the class of a message is
+ * carried in its key object.
+ */
+#define FAIR_CLASS_KEY "class"
+#define FAIR_SHARE 2
+static guint
+fair_class_func (GObject *obj)
+{
+    GObject *key = control_message_get_object (CONTROL_MESSAGE (obj));
+
+    return GPOINTER_TO_UINT (g_object_get_data (key, FAIR_CLASS_KEY));
+}
+static GObject*
+fair_key_new (guint class)
+{
+    GObject *key = g_object_new (G_TYPE_OBJECT, NULL);
+
+    g_object_set_data (key, FAIR_CLASS_KEY, GUINT_TO_POINTER (class));
+    return key;
+}
+/*
+ * Messages in class 0 are always dequeued first. Messages in class 2 are
+ * dequeued once every FAIR_SHARE messages in class 1 while both have
+ * messages waiting.
+ */
+static void
+message_queue_fair_class_test (void **state)
+{
+    msgq_test_data_t *data = (msgq_test_data_t*)*state;
+    GObject *key_0 = fair_key_new (0);
+    GObject *key_1a = fair_key_new (1), *key_1b = fair_key_new (1);
+    GObject *key_2 = fair_key_new (2);
+    ControlMessage *b0, *b1, *n0, *n1, *n2, *n3, *i0;
+
+    message_queue_set_class_func (data->queue, fair_class_func, FAIR_SHARE);
+    b0 = fair_enqueue (data->queue, CHECK_CANCEL, key_2);
+    b1 = fair_enqueue (data->queue, CHECK_CANCEL, key_2);
+    n0 = fair_enqueue (data->queue, CHECK_CANCEL, key_1a);
+    n1 = fair_enqueue (data->queue, CHECK_CANCEL, key_1b);
+    n2 = fair_enqueue (data->queue, CHECK_CANCEL, key_1a);
+    n3 = fair_enqueue (data->queue, CHECK_CANCEL, key_1b);
+    i0 = fair_enqueue (data->queue, CHECK_CANCEL, key_0);
+
+    fair_dequeue_check (data->queue, i0);
+    fair_dequeue_check (data->queue, n0);
+    fair_dequeue_check (data->queue, n2);
+    fair_dequeue_check (data->queue, b0);
+    fair_dequeue_check (data->queue, n1);
+    fair_dequeue_check (data->queue, n3);
+    fair_dequeue_check (data->queue, b1);
+    assert_null (message_queue_timeout_dequeue (data->queue, 1000));
+    g_object_unref (key_0);
+    g_object_unref (key_1a);
+    g_object_unref (key_1b);
+    g_object_unref (key_2);
+}
+
 int
 main(void)
 {
@@ -157,9 +686,53 @@ main(void)
         cmocka_unit_test_setup_teardown (message_queue_dequeue_order_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_timeout_dequeue_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_dequeue_batch_test,
+                                         message_queue_setup,
+                                         message_queue_teardown),
         cmocka_unit_test_setup_teardown (message_queue_thread_unblock_test,
                                          message_queue_setup,
                                          message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_order_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_dequeue_batch_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_cost_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_dequeue_key_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_class_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_estimate_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_share_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_urgent_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_remove_key_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_get_length_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup_teardown (message_queue_fair_high_water_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
+        cmocka_unit_test_setup (message_queue_fair_dispose_test,
+                                message_queue_fair_setup),
+        cmocka_unit_test_setup_teardown (message_queue_thread_unblock_test,
+                                         message_queue_fair_setup,
+                                         message_queue_teardown),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
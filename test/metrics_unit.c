@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "metrics.h"
+#include "util.h"
+
+typedef struct {
+    CommandStats *stats;
+    MessageQueue *queue;
+    GString      *out;
+} test_data_t;
+
+static int
+metrics_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->stats = command_stats_new ();
+    data->queue = message_queue_new ();
+    data->out = g_string_new (NULL);
+    *state = data;
+    return 0;
+}
+static int
+metrics_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->stats);
+    g_clear_object (&data->queue);
+    g_string_free (data->out, TRUE);
+    free (data);
+    return 0;
+}
+static void
+assert_line (GString     *out,
+             const gchar *line)
+{
+    gchar *expected = g_strdup_printf ("\n%s\n", line);
+
+    if (strstr (out->str, expected) == NULL) {
+        fail_msg ("missing line \"%s\" in:\n%s", line, out->str);
+    }
+    g_free (expected);
+}
+/*
+ * Without backends there's only the connection count, and every family
+ * is still described.
+ */
+static void
+metrics_format_empty_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    metrics_format (data->out, NULL, 0, NULL);
+    assert_true (g_str_has_prefix (data->out->str,
+                     "# TYPE tabrmd_command_duration_seconds histogram\n"));
+    assert_line (data->out, "# TYPE tabrmd_tpm_errors counter");
+    assert_line (data->out, "tabrmd_connections 0");
+    assert_line (data->out, "tabrmd_log_messages_dropped_total 0");
+    assert_line (data->out, "# TYPE process_resident_memory_bytes gauge");
+    assert_non_null (strstr (data->out->str,
+                             "\nprocess_resident_memory_bytes "));
+#if defined(HAVE_MALLINFO2)
+    assert_non_null (strstr (data->out->str,
+                             "\ntabrmd_heap_bytes{state=\"allocated\"} "));
+#endif
+    assert_true (g_str_has_suffix (data->out->str, "\n# EOF\n"));
+}
+/*
+ * Histogram buckets are cumulative with bounds in seconds, the other
+ * metrics are labeled with their backend.
+ */
+static void
+metrics_format_backend_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    metrics_backend_t backends [2] = {
+        { NULL, },
+        { .stats = data->stats, .resmgr_queue = data->queue, },
+    };
+    GObject *obj = g_object_new (G_TYPE_OBJECT, NULL);
+
+    command_stats_add (data->stats, TPM2_CC_Sign, COMMAND_STATS_EXEC, 3);
+    command_stats_add (data->stats, TPM2_CC_Sign, COMMAND_STATS_EXEC, 1500000);
+    command_stats_add_rc (data->stats, TPM2_RC_HANDLE);
+    command_stats_set_sessions (data->stats, 2);
+    message_queue_enqueue (data->queue, obj);
+    g_object_unref (obj);
+
+    metrics_format (data->out, backends, 2, 0);
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_bucket{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\",le=\"0.000002\"} 0");
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_bucket{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\",le=\"0.000004\"} 1");
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_bucket{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\",le=\"2.097152\"} 2");
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_bucket{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\",le=\"+Inf\"} 2");
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_count{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\"} 2");
+    assert_line (data->out,
+                 "tabrmd_command_duration_seconds_sum{backend=\"1\","
+                 "command=\"0x0000015d\",phase=\"exec\"} 1.500003");
+    assert_line (data->out,
+                 "tabrmd_tpm_errors_total{backend=\"1\",rc=\"0x0000008b\"} 1");
+    assert_line (data->out,
+                 "tabrmd_queue_depth{backend=\"1\",queue=\"resource_manager\"} 1");
+    assert_line (data->out,
+                 "tabrmd_queue_depth_max{backend=\"1\",queue=\"resource_manager\"} 1");
+    assert_line (data->out, "tabrmd_sessions{backend=\"1\"} 2");
+    assert_null (strstr (data->out->str, "backend=\"0\""));
+}
+/*
+ * Counters are exported for each backend and for each connection.
+ */
+static void
+metrics_format_counters_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    metrics_backend_t backend = { .stats = data->stats, };
+    HandleMap *handle_map;
+    Connection *connection;
+    GIOStream *iostream;
+    GList *connections;
+    gchar *line;
+    gint client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, 1);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 7, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    connections = g_list_append (NULL, connection);
+    command_stats_count (data->stats, COMMAND_STATS_CONTEXT_SAVE);
+    command_stats_count (data->stats, COMMAND_STATS_RESIDENT_HIT);
+    command_stats_count (data->stats, COMMAND_STATS_RESIDENT_HIT);
+    connection_count (connection, COMMAND_STATS_CONTEXT_LOAD);
+    connection_count (connection, COMMAND_STATS_REGAP);
+
+    metrics_format (data->out, &backend, 1, connections);
+    assert_line (data->out,
+                 "tabrmd_context_operations_total{backend=\"0\","
+                 "operation=\"save\"} 1");
+    assert_line (data->out,
+                 "tabrmd_context_operations_total{backend=\"0\","
+                 "operation=\"flush\"} 0");
+    assert_line (data->out, "tabrmd_resident_hits_total{backend=\"0\"} 2");
+    /* connections are labeled with their serial, the id is a secret */
+    line = g_strdup_printf ("tabrmd_connection_context_operations_total"
+                            "{connection=\"%u\",operation=\"load\"} 1",
+                            connection_get_serial (connection));
+    assert_line (data->out, line);
+    g_free (line);
+    line = g_strdup_printf ("tabrmd_connection_regaps_total"
+                            "{connection=\"%u\"} 1",
+                            connection_get_serial (connection));
+    assert_line (data->out, line);
+    g_free (line);
+    assert_line (data->out, "tabrmd_connections 1");
+    g_list_free_full (connections, g_object_unref);
+}
+/*
+ * An address that is neither a path nor a port is refused.
+ */
+static void
+metrics_listen_invalid_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_null (metrics_listen ("localhost"));
+    assert_null (metrics_listen ("0"));
+    assert_null (metrics_listen ("65536"));
+    assert_null (metrics_listen (""));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (metrics_format_empty_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_backend_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test_setup_teardown (metrics_format_counters_test,
+                                         metrics_setup,
+                                         metrics_teardown),
+        cmocka_unit_test (metrics_listen_invalid_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
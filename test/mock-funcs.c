@@ -29,6 +29,39 @@ __wrap_poll (struct pollfd *fds,
         return mock_type (int);
     }
 }
+/*
+ * Mock for the recv system call used by the receive fast path in the
+ * tabrmd TCTI. Like the poll mock it only mocks calls on TEST_FD. The
+ * first value is the return value, followed by the data for a positive
+ * return value or errno for -1.
+ */
+ssize_t
+__real_recv (int sockfd,
+             void *buf,
+             size_t len,
+             int flags);
+ssize_t
+__wrap_recv (int sockfd,
+             void *buf,
+             size_t len,
+             int flags)
+{
+    ssize_t ret;
+    uint8_t *data;
+
+    if (sockfd != TEST_FD) {
+        return __real_recv (sockfd, buf, len, flags);
+    }
+    ret = mock_type (ssize_t);
+    if (ret > 0) {
+        data = mock_type (uint8_t*);
+        assert_true ((size_t)ret <= len);
+        memcpy (buf, data, ret);
+    } else if (ret == -1) {
+        errno = mock_type (int);
+    }
+    return ret;
+}
 /*
  * The mock functions for the g_socket_* stuff are required to test the
  * tcti_tabrmd_read function. They are used to extract the GInputStream
@@ -25,6 +25,11 @@ GSocket*
 __wrap_g_socket_connection_get_socket (GSocketConnection *connection);
 int
 __wrap_g_socket_get_fd (GSocket *socket);
+ssize_t
+__wrap_recv (int sockfd,
+             void *buf,
+             size_t len,
+             int flags);
 GInputStream*
 __wrap_g_io_stream_get_input_stream (GIOStream *stream);
 gssize
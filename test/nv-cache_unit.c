@@ -0,0 +1,302 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "nv-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define NV_INDEX (TPM2_NV_INDEX_FIRST + 0x10)
+#define NV_READ_ATTRS ((2 << 25) | TPM2_CC_NV_Read)
+#define NV_IMMUTABLE_ATTRS (TPMA_NV_AUTHREAD | TPMA_NV_AUTHWRITE | \
+                            TPMA_NV_WRITEDEFINE | TPMA_NV_WRITTEN | \
+                            TPMA_NV_WRITELOCKED)
+#define CACHE_MAX 2
+
+typedef struct {
+    NvCache *cache;
+} test_data_t;
+
+static int
+nv_cache_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->cache = nv_cache_new (CACHE_MAX);
+    *state = data;
+    return 0;
+}
+static int
+nv_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+/*
+ * Build an NV_Read command for 'size' bytes at 'offset' of 'nv_index',
+ * authorized by the index with a single session with the provided handle.
+ */
+static Tpm2Command*
+nv_read_command_new (TPM2_HANDLE nv_index,
+                     TPM2_HANDLE auth_handle,
+                     UINT16      size,
+                     UINT16      offset)
+{
+    TPMS_AUTH_COMMAND auth = { .sessionHandle = auth_handle, };
+    size_t buf_size = TPM2_MAX_COMMAND_SIZE, buf_offset = TPM_HEADER_SIZE;
+    size_t auth_size_offset;
+    guint8 *buffer = calloc (1, buf_size);
+
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (nv_index, buffer,
+                                                   buf_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (nv_index, buffer,
+                                                   buf_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    auth_size_offset = buf_offset;
+    buf_offset += sizeof (UINT32);
+    assert_int_equal (Tss2_MU_TPMS_AUTH_COMMAND_Marshal (&auth,
+                                                         buffer, buf_size,
+                                                         &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (buf_offset - auth_size_offset -
+                                              sizeof (UINT32),
+                                              buffer, buf_size,
+                                              &auth_size_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT16_Marshal (size, buffer, buf_size,
+                                              &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT16_Marshal (offset, buffer, buf_size,
+                                              &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, buf_size, TPM2_ST_SESSIONS,
+                                        buf_offset, TPM2_CC_NV_Read),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, buf_offset, NV_READ_ATTRS);
+}
+/*
+ * Feed the cache the NV_ReadPublic response for 'nv_index' with the
+ * provided attributes.
+ */
+static void
+nv_cache_add_public_attrs (NvCache     *cache,
+                           TPM2_HANDLE  nv_index,
+                           TPMA_NV      attributes)
+{
+    TPM2B_NV_PUBLIC nv_public = {
+        .nvPublic = {
+            .nvIndex = nv_index,
+            .nameAlg = TPM2_ALG_SHA256,
+            .attributes = attributes,
+            .dataSize = 32,
+        },
+    };
+    TPM2B_NAME name = { .size = 0 };
+    guint8 buffer [TPM2_MAX_RESPONSE_SIZE] = { 0 };
+    size_t offset = TPM_HEADER_SIZE;
+
+    assert_int_equal (Tss2_MU_TPM2B_NV_PUBLIC_Marshal (&nv_public, buffer,
+                                                       sizeof (buffer),
+                                                       &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_NAME_Marshal (&name, buffer,
+                                                  sizeof (buffer), &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, sizeof (buffer),
+                                        TPM2_ST_NO_SESSIONS, offset,
+                                        TSS2_RC_SUCCESS),
+                      TSS2_RC_SUCCESS);
+    nv_cache_add_public (cache, buffer, offset);
+}
+static void
+nv_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_NV_CACHE (data->cache));
+    assert_int_equal (nv_cache_size (data->cache), 0);
+}
+/*
+ * Identical NV_Read commands get the same key, reads of another range get
+ * different keys. Reads authorized by a session other than a password
+ * aren't cached.
+ */
+static void
+nv_cache_key_test (void **state)
+{
+    Tpm2Command *command_a, *command_b, *command_c, *command_d;
+    GBytes *key_a, *key_b, *key_c;
+    UNUSED_PARAM(state);
+
+    command_a = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 32, 0);
+    command_b = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 32, 0);
+    command_c = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 16, 16);
+    command_d = nv_read_command_new (NV_INDEX, TPM2_HMAC_SESSION_FIRST,
+                                     32, 0);
+    key_a = nv_cache_key (command_a);
+    key_b = nv_cache_key (command_b);
+    key_c = nv_cache_key (command_c);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_true (g_bytes_equal (key_a, key_b));
+    assert_false (g_bytes_equal (key_a, key_c));
+    assert_null (nv_cache_key (command_d));
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (command_c);
+    g_object_unref (command_d);
+}
+/*
+ * Only written, write-locked indices read without a policy are immutable.
+ */
+static void
+nv_cache_is_immutable_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_true (nv_cache_is_immutable (NV_IMMUTABLE_ATTRS));
+    assert_false (nv_cache_is_immutable (NV_IMMUTABLE_ATTRS &
+                                         ~TPMA_NV_WRITELOCKED));
+    assert_false (nv_cache_is_immutable (NV_IMMUTABLE_ATTRS &
+                                         ~TPMA_NV_WRITTEN));
+    assert_false (nv_cache_is_immutable (NV_IMMUTABLE_ATTRS |
+                                         TPMA_NV_POLICYREAD));
+}
+/*
+ * Reads of an index are only cached once an NV_ReadPublic showed it's
+ * immutable, and a later one showing it isn't drops them.
+ */
+static void
+nv_cache_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x02, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    Tpm2Command *command;
+    GBytes *key, *bytes, *bytes_out;
+
+    command = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 32, 0);
+    key = nv_cache_key (command);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_false (nv_cache_insert (data->cache, key, bytes));
+    nv_cache_add_public_attrs (data->cache, NV_INDEX, NV_IMMUTABLE_ATTRS);
+    assert_true (nv_cache_insert (data->cache, key, bytes));
+    bytes_out = nv_cache_lookup (data->cache, key);
+    assert_non_null (bytes_out);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+
+    nv_cache_add_public_attrs (data->cache, NV_INDEX,
+                               NV_IMMUTABLE_ATTRS & ~TPMA_NV_WRITELOCKED);
+    assert_null (nv_cache_lookup (data->cache, key));
+    assert_false (nv_cache_insert (data->cache, key, bytes));
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+    g_object_unref (command);
+}
+/*
+ * Each cacheable read takes an entry until the cache is full.
+ */
+static void
+nv_cache_full_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x02, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    Tpm2Command *command;
+    GBytes *key, *bytes;
+    guint i;
+
+    nv_cache_add_public_attrs (data->cache, NV_INDEX, NV_IMMUTABLE_ATTRS);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    for (i = 0; i <= CACHE_MAX; ++i) {
+        command = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 8, i * 8);
+        key = nv_cache_key (command);
+        assert_int_equal (nv_cache_insert (data->cache, key, bytes),
+                          i < CACHE_MAX);
+        g_bytes_unref (key);
+        g_object_unref (command);
+    }
+    assert_int_equal (nv_cache_size (data->cache), CACHE_MAX);
+    nv_cache_clear (data->cache);
+    assert_int_equal (nv_cache_size (data->cache), 0);
+    g_bytes_unref (bytes);
+}
+/*
+ * A write to the index, successful or not, drops its reads. Reads and
+ * writes of other indices don't.
+ */
+static void
+nv_cache_invalidate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x02, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    Tpm2Command *command, *write, *other_write;
+    GBytes *key, *bytes;
+
+    command = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 32, 0);
+    /* NV_Write has the same handle and auth layout as NV_Read */
+    write = nv_read_command_new (NV_INDEX, TPM2_RS_PW, 32, 0);
+    other_write = nv_read_command_new (NV_INDEX + 1, TPM2_RS_PW, 32, 0);
+    tpm2_header_init (tpm2_command_get_buffer (write),
+                      tpm2_command_get_size (write), TPM2_ST_SESSIONS,
+                      tpm2_command_get_size (write), TPM2_CC_NV_Write);
+    tpm2_header_init (tpm2_command_get_buffer (other_write),
+                      tpm2_command_get_size (other_write), TPM2_ST_SESSIONS,
+                      tpm2_command_get_size (other_write), TPM2_CC_NV_Write);
+    key = nv_cache_key (command);
+    bytes = g_bytes_new (resp, sizeof (resp));
+
+    nv_cache_add_public_attrs (data->cache, NV_INDEX, NV_IMMUTABLE_ATTRS);
+    assert_true (nv_cache_insert (data->cache, key, bytes));
+    nv_cache_invalidate (data->cache, other_write);
+    assert_int_equal (nv_cache_size (data->cache), 1);
+    nv_cache_invalidate (data->cache, command);
+    assert_int_equal (nv_cache_size (data->cache), 1);
+    nv_cache_invalidate (data->cache, write);
+    assert_int_equal (nv_cache_size (data->cache), 0);
+    /* the index has to be read again with NV_ReadPublic */
+    assert_false (nv_cache_insert (data->cache, key, bytes));
+
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+    g_object_unref (command);
+    g_object_unref (write);
+    g_object_unref (other_write);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (nv_cache_type_test,
+                                         nv_cache_setup,
+                                         nv_cache_teardown),
+        cmocka_unit_test (nv_cache_key_test),
+        cmocka_unit_test (nv_cache_is_immutable_test),
+        cmocka_unit_test_setup_teardown (nv_cache_insert_lookup_test,
+                                         nv_cache_setup,
+                                         nv_cache_teardown),
+        cmocka_unit_test_setup_teardown (nv_cache_full_test,
+                                         nv_cache_setup,
+                                         nv_cache_teardown),
+        cmocka_unit_test_setup_teardown (nv_cache_invalidate_test,
+                                         nv_cache_setup,
+                                         nv_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "object-share.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define PARENT_PERSISTENT (TPM2_PERSISTENT_FIRST + 1)
+#define PARENT_TRANSIENT (TPM2_TRANSIENT_FIRST + 1)
+#define LOAD_ATTRS ((1 << 25) | TPMA_CC_RHANDLE | TPM2_CC_Load)
+#define SHARE_MAX 2
+
+typedef struct {
+    ObjectShare *share;
+} test_data_t;
+
+static int
+object_share_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->share = object_share_new (SHARE_MAX);
+    *state = data;
+    return 0;
+}
+static int
+object_share_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->share);
+    free (data);
+    return 0;
+}
+/*
+ * Build a Load command under 'parent' authorized with a single session with
+ * the provided handle. The one byte 'blob' stands in for the inPrivate and
+ * inPublic parameters.
+ */
+static Tpm2Command*
+load_command_new (TPM2_HANDLE parent,
+                  TPM2_HANDLE auth_handle,
+                  guint8      blob)
+{
+    TPMS_AUTH_COMMAND auth = { .sessionHandle = auth_handle, };
+    size_t buf_size = TPM2_MAX_COMMAND_SIZE, buf_offset = TPM_HEADER_SIZE;
+    size_t auth_size_offset;
+    guint8 *buffer = calloc (1, buf_size);
+
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (parent, buffer,
+                                                   buf_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    auth_size_offset = buf_offset;
+    buf_offset += sizeof (UINT32);
+    assert_int_equal (Tss2_MU_TPMS_AUTH_COMMAND_Marshal (&auth,
+                                                         buffer, buf_size,
+                                                         &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (buf_offset - auth_size_offset -
+                                              sizeof (UINT32),
+                                              buffer, buf_size,
+                                              &auth_size_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT8_Marshal (blob, buffer, buf_size,
+                                             &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, buf_size, TPM2_ST_SESSIONS,
+                                        buf_offset, TPM2_CC_Load),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, buf_offset, LOAD_ATTRS);
+}
+static void
+object_share_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_OBJECT_SHARE (data->share));
+    assert_int_equal (object_share_size (data->share), 0);
+}
+/*
+ * Identical Load commands get the same key, another blob gets a different
+ * one. Loads under a transient parent or authorized by a session other
+ * than a password aren't shared.
+ */
+static void
+object_share_key_test (void **state)
+{
+    Tpm2Command *command_a, *command_b, *command_c, *command_d, *command_e;
+    GBytes *key_a, *key_b, *key_c;
+    UNUSED_PARAM(state);
+
+    command_a = load_command_new (PARENT_PERSISTENT, TPM2_RS_PW, 0x01);
+    command_b = load_command_new (PARENT_PERSISTENT, TPM2_RS_PW, 0x01);
+    command_c = load_command_new (PARENT_PERSISTENT, TPM2_RS_PW, 0x02);
+    command_d = load_command_new (PARENT_TRANSIENT, TPM2_RS_PW, 0x01);
+    command_e = load_command_new (PARENT_PERSISTENT,
+                                  TPM2_HMAC_SESSION_FIRST,
+                                  0x01);
+    key_a = object_share_key (command_a);
+    key_b = object_share_key (command_b);
+    key_c = object_share_key (command_c);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_true (g_bytes_equal (key_a, key_b));
+    assert_false (g_bytes_equal (key_a, key_c));
+    assert_null (object_share_key (command_d));
+    assert_null (object_share_key (command_e));
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (command_c);
+    g_object_unref (command_d);
+    g_object_unref (command_e);
+}
+/*
+ * A shared object is found by its key with each lookup adding a user, and
+ * is only dropped when the last user releases it. Objects beyond the limit
+ * aren't shared.
+ */
+static void
+object_share_insert_lookup_release_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    HandleMapEntry *objects [3], *found;
+    GBytes *key_a, *key_b, *key_c, *bytes, *bytes_out = NULL;
+    size_t i;
+
+    for (i = 0; i < 3; ++i) {
+        objects [i] = handle_map_entry_new (TPM2_TRANSIENT_FIRST + i, 0);
+    }
+    key_a = g_bytes_new_static ("a", 1);
+    key_b = g_bytes_new_static ("b", 1);
+    key_c = g_bytes_new_static ("c", 1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (object_share_insert (data->share, key_a, objects [0], bytes));
+    assert_false (object_share_insert (data->share, key_a, objects [1],
+                                       bytes));
+    found = object_share_lookup (data->share, key_a, &bytes_out);
+    assert_ptr_equal (found, objects [0]);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+    g_object_unref (found);
+    assert_null (object_share_lookup (data->share, key_b, &bytes_out));
+
+    assert_true (object_share_insert (data->share, key_b, objects [1], bytes));
+    assert_false (object_share_insert (data->share, key_c, objects [2],
+                                       bytes));
+    assert_int_equal (object_share_size (data->share), SHARE_MAX);
+
+    assert_false (object_share_release (data->share, objects [0]));
+    assert_true (object_share_release (data->share, objects [0]));
+    assert_null (object_share_lookup (data->share, key_a, &bytes_out));
+    assert_true (object_share_release (data->share, objects [1]));
+    assert_int_equal (object_share_size (data->share), 0);
+    g_bytes_unref (bytes);
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (objects [i]);
+    }
+}
+/*
+ * Forgotten objects aren't found anymore but are kept, and listed, for
+ * their users until they're released.
+ */
+static void
+object_share_forget_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    HandleMapEntry *object;
+    GBytes *key, *bytes, *bytes_out = NULL;
+    GList *objects;
+
+    object = handle_map_entry_new (TPM2_TRANSIENT_FIRST, 0);
+    key = g_bytes_new_static ("a", 1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (object_share_insert (data->share, key, object, bytes));
+    object_share_forget (data->share);
+    assert_null (object_share_lookup (data->share, key, &bytes_out));
+    assert_int_equal (object_share_size (data->share), 1);
+    objects = object_share_objects (data->share);
+    assert_int_equal (g_list_length (objects), 1);
+    assert_ptr_equal (objects->data, object);
+    g_list_free_full (objects, g_object_unref);
+    assert_true (object_share_release (data->share, object));
+    assert_int_equal (object_share_size (data->share), 0);
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+    g_object_unref (object);
+}
+/*
+ * The commands that may replace persistent parents stop sharing, loading
+ * objects doesn't.
+ */
+static void
+object_share_invalidates_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_true (object_share_invalidates (TPM2_CC_EvictControl));
+    assert_true (object_share_invalidates (TPM2_CC_Clear));
+    assert_true (object_share_invalidates (TPM2_CC_Startup));
+    assert_false (object_share_invalidates (TPM2_CC_Load));
+    assert_false (object_share_invalidates (TPM2_CC_Sign));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (object_share_type_test,
+                                         object_share_setup,
+                                         object_share_teardown),
+        cmocka_unit_test (object_share_key_test),
+        cmocka_unit_test_setup_teardown (object_share_insert_lookup_release_test,
+                                         object_share_setup,
+                                         object_share_teardown),
+        cmocka_unit_test_setup_teardown (object_share_forget_test,
+                                         object_share_setup,
+                                         object_share_teardown),
+        cmocka_unit_test (object_share_invalidates_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
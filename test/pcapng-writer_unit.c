@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "command-recorder.h"
+#include "pcapng-writer.h"
+#include "util.h"
+
+/* the offset of the packet in an enhanced packet block */
+#define EPB_PACKET_OFFSET 28
+
+typedef struct {
+    gchar *dir;
+    gchar *path;
+    gchar *old_path;
+} test_data_t;
+
+static guint8 command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+                             0x00, 0x00, 0x01, 0x7b, 0x00, 0x10, };
+static guint8 response [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                              0x00, 0x00, 0x00, 0x00, };
+
+static int
+pcapng_writer_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->dir = g_dir_make_tmp ("pcapng-writer-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "capture.pcapng", NULL);
+    data->old_path = g_strconcat (data->path, PCAPNG_OLD_SUFFIX, NULL);
+    *state = data;
+    return 0;
+}
+static int
+pcapng_writer_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_unlink (data->path);
+    g_unlink (data->old_path);
+    g_rmdir (data->dir);
+    g_free (data->old_path);
+    g_free (data->path);
+    g_free (data->dir);
+    free (data);
+    return 0;
+}
+static guint32
+get_u32 (guint8 const *data)
+{
+    guint32 value;
+
+    memcpy (&value, data, sizeof (value));
+    return value;
+}
+static guint32
+get_be32 (guint8 const *data)
+{
+    return GUINT32_FROM_BE (get_u32 (data));
+}
+/*
+ * Get the block number 'n' of the blocks of 'type' in 'contents', NULL if
+ * there aren't that many. The lengths at both ends of each block must
+ * match.
+ */
+static guint8 const*
+find_block (gchar const *contents,
+            gsize        length,
+            guint32      type,
+            guint        n)
+{
+    guint8 const *block = (guint8 const*)contents;
+    guint8 const *end = block + length;
+    guint32 block_length;
+
+    while (block < end) {
+        assert_true (block + 12 <= end);
+        block_length = get_u32 (block + 4);
+        assert_int_equal (block_length % 4, 0);
+        assert_true (block + block_length <= end);
+        assert_int_equal (get_u32 (block + block_length - 4), block_length);
+        if (get_u32 (block) == type && n-- == 0) {
+            return block;
+        }
+        block += block_length;
+    }
+    return NULL;
+}
+static guint
+count_blocks (gchar const *contents,
+              gsize        length,
+              guint32      type)
+{
+    guint n = 0;
+
+    while (find_block (contents, length, type, n) != NULL) {
+        ++n;
+    }
+    return n;
+}
+/*
+ * Check that the file at 'path' starts a section with the one IPv4
+ * interface, and return the number of packets in it.
+ */
+static guint
+check_file (const gchar *path)
+{
+    gchar *contents;
+    gsize length;
+    guint8 const *block;
+    guint16 linktype;
+    guint packets;
+
+    assert_true (g_file_get_contents (path, &contents, &length, NULL));
+    block = (guint8 const*)contents;
+    assert_int_equal (get_u32 (block), PCAPNG_BLOCK_SECTION_HEADER);
+    assert_int_equal (get_u32 (block + 8), PCAPNG_BYTE_ORDER_MAGIC);
+    block = find_block (contents, length, PCAPNG_BLOCK_INTERFACE, 0);
+    assert_non_null (block);
+    memcpy (&linktype, block + 8, sizeof (linktype));
+    assert_int_equal (linktype, PCAPNG_LINKTYPE_IPV4);
+    packets = count_blocks (contents, length, PCAPNG_BLOCK_ENHANCED_PACKET);
+    g_free (contents);
+    return packets;
+}
+/*
+ * A connection is a handshake, a packet for each message and a FIN. The
+ * command is framed for the simulator's port with the serial in the
+ * comment, and the IPv4 header checksums to 0.
+ */
+static void
+pcapng_writer_stream_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    PcapngWriter *writer;
+    guint8 const *block, *packet;
+    gchar *contents;
+    gsize length;
+    GStatBuf buf;
+    guint16 option [2];
+    guint32 sum = 0;
+    guint i;
+
+    writer = pcapng_writer_new (data->path, 0);
+    assert_non_null (writer);
+    pcapng_writer_add (writer, 7, FALSE, command, sizeof (command));
+    pcapng_writer_add (writer, 7, TRUE, response, sizeof (response));
+    pcapng_writer_close (writer, 7);
+    pcapng_writer_close (writer, 8);
+    assert_int_equal (writer->packets, 5);
+    g_object_unref (writer);
+
+    assert_int_equal (g_stat (data->path, &buf), 0);
+    assert_int_equal (buf.st_mode & 0777, 0600);
+    assert_int_equal (check_file (data->path), 5);
+    assert_true (g_file_get_contents (data->path, &contents, &length, NULL));
+    block = find_block (contents, length, PCAPNG_BLOCK_ENHANCED_PACKET, 2);
+    assert_non_null (block);
+    assert_int_equal (get_u32 (block + 20),
+                      PCAPNG_PACKET_HEADERS_SIZE + 9 + sizeof (command));
+    packet = block + EPB_PACKET_OFFSET;
+    for (i = 0; i < 20; i += 2) {
+        sum += (packet [i] << 8) | packet [i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    assert_int_equal (sum, 0xffff);
+    assert_int_equal (get_be32 (packet + 12), 0x0a000007);
+    assert_int_equal ((packet [22] << 8) | packet [23], PCAPNG_SERVER_PORT);
+    packet += PCAPNG_PACKET_HEADERS_SIZE;
+    assert_int_equal (get_be32 (packet), PCAPNG_TPM_SEND_COMMAND);
+    assert_int_equal (packet [4], 0);
+    assert_int_equal (get_be32 (packet + 5), sizeof (command));
+    assert_memory_equal (packet + 9, command, sizeof (command));
+    /* the first option after the packet is the comment */
+    packet = block + EPB_PACKET_OFFSET + (get_u32 (block + 20) + 3) / 4 * 4;
+    memcpy (option, packet, sizeof (option));
+    assert_int_equal (option [0], 1);
+    assert_int_equal (option [1], strlen ("connection 7"));
+    assert_memory_equal (packet + 4, "connection 7", strlen ("connection 7"));
+
+    block = find_block (contents, length, PCAPNG_BLOCK_ENHANCED_PACKET, 3);
+    packet = block + EPB_PACKET_OFFSET + PCAPNG_PACKET_HEADERS_SIZE;
+    assert_int_equal (get_be32 (packet), sizeof (response));
+    assert_memory_equal (packet + 4, response, sizeof (response));
+    assert_int_equal (get_be32 (packet + 4 + sizeof (response)), 0);
+    g_free (contents);
+}
+/*
+ * Past the maximum size the file moves to .old and a new one starts with
+ * its own section header, neither growing past the maximum.
+ */
+static void
+pcapng_writer_rotate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    PcapngWriter *writer;
+    GStatBuf buf;
+    guint i;
+
+    writer = pcapng_writer_new (data->path, 1024);
+    assert_non_null (writer);
+    for (i = 0; i < 32; ++i) {
+        pcapng_writer_add (writer, 1, FALSE, command, sizeof (command));
+    }
+    assert_true (writer->rotations > 0);
+    g_object_unref (writer);
+
+    assert_int_equal (g_stat (data->path, &buf), 0);
+    assert_true (buf.st_size <= 1024);
+    assert_int_equal (g_stat (data->old_path, &buf), 0);
+    assert_true (buf.st_size <= 1024);
+    assert_true (check_file (data->path) > 0);
+    assert_true (check_file (data->old_path) > 0);
+}
+/*
+ * A recorder without a recording file only feeds its capture.
+ */
+static void
+pcapng_writer_recorder_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    CommandRecorder *recorder;
+    PcapngWriter *writer;
+
+    writer = pcapng_writer_new (data->path, 0);
+    recorder = command_recorder_new_full (NULL, writer);
+    assert_non_null (recorder);
+    command_recorder_add (recorder, COMMAND_RECORD_COMMAND, 3,
+                          command, sizeof (command));
+    command_recorder_add (recorder, COMMAND_RECORD_RESPONSE, 3,
+                          response, sizeof (response));
+    command_recorder_add (recorder, COMMAND_RECORD_CLOSE, 3, NULL, 0);
+    assert_int_equal (recorder->records, 0);
+    assert_int_equal (writer->packets, 5);
+    g_object_unref (recorder);
+    g_object_unref (writer);
+    assert_int_equal (check_file (data->path), 5);
+}
+/*
+ * No writer without a file to write to.
+ */
+static void
+pcapng_writer_bad_path_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_null (pcapng_writer_new ("/nonexistent/dir/capture.pcapng", 0));
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (pcapng_writer_stream_test,
+                                         pcapng_writer_setup,
+                                         pcapng_writer_teardown),
+        cmocka_unit_test_setup_teardown (pcapng_writer_rotate_test,
+                                         pcapng_writer_setup,
+                                         pcapng_writer_teardown),
+        cmocka_unit_test_setup_teardown (pcapng_writer_recorder_test,
+                                         pcapng_writer_setup,
+                                         pcapng_writer_teardown),
+        cmocka_unit_test (pcapng_writer_bad_path_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
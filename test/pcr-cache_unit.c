@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "pcr-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define CACHE_MAX 2
+
+typedef struct {
+    PcrCache *cache;
+} test_data_t;
+
+static int
+pcr_cache_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->cache = pcr_cache_new (CACHE_MAX);
+    *state = data;
+    return 0;
+}
+static int
+pcr_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+/*
+ * Build a PCR_Read command with the provided tag selecting the PCRs in
+ * the first byte of the SHA256 bank set in 'select'.
+ */
+static Tpm2Command*
+pcr_read_command_new (TPMI_ST_COMMAND_TAG tag,
+                      guint8              select)
+{
+    TPML_PCR_SELECTION selection = {
+        .count = 1,
+        .pcrSelections = {{
+            .hash = TPM2_ALG_SHA256,
+            .sizeofSelect = 3,
+            .pcrSelect = { select, 0x00, 0x00 },
+        }},
+    };
+    size_t size = TPM2_MAX_COMMAND_SIZE, offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+
+    assert_int_equal (Tss2_MU_TPML_PCR_SELECTION_Marshal (&selection,
+                                                          buffer, size,
+                                                          &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, tag, offset,
+                                        TPM2_CC_PCR_Read),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, offset, TPM2_CC_PCR_Read);
+}
+static void
+pcr_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_PCR_CACHE (data->cache));
+    assert_int_equal (pcr_cache_size (data->cache), 0);
+}
+/*
+ * PCR_Read commands selecting the same PCRs get the same key, commands
+ * selecting other PCRs get different keys. PCR_Read with sessions isn't
+ * cached.
+ */
+static void
+pcr_cache_key_test (void **state)
+{
+    Tpm2Command *command_a, *command_b, *command_c, *command_d;
+    GBytes *key_a, *key_b, *key_c;
+    UNUSED_PARAM(state);
+
+    command_a = pcr_read_command_new (TPM2_ST_NO_SESSIONS, 0x01);
+    command_b = pcr_read_command_new (TPM2_ST_NO_SESSIONS, 0x01);
+    command_c = pcr_read_command_new (TPM2_ST_NO_SESSIONS, 0x03);
+    command_d = pcr_read_command_new (TPM2_ST_SESSIONS, 0x01);
+    key_a = pcr_cache_key (command_a);
+    key_b = pcr_cache_key (command_b);
+    key_c = pcr_cache_key (command_c);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_true (g_bytes_equal (key_a, key_b));
+    assert_false (g_bytes_equal (key_a, key_c));
+    assert_null (pcr_cache_key (command_d));
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (command_c);
+    g_object_unref (command_d);
+}
+/*
+ * The commands that change PCRs drop the cache, reading them doesn't.
+ */
+static void
+pcr_cache_invalidates_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_true (pcr_cache_invalidates (TPM2_CC_PCR_Extend));
+    assert_true (pcr_cache_invalidates (TPM2_CC_PCR_Event));
+    assert_true (pcr_cache_invalidates (TPM2_CC_PCR_Reset));
+    assert_true (pcr_cache_invalidates (TPM2_CC_PCR_Allocate));
+    assert_true (pcr_cache_invalidates (TPM2_CC_SequenceComplete));
+    assert_true (pcr_cache_invalidates (TPM2_CC_EventSequenceComplete));
+    assert_true (pcr_cache_invalidates (TPM2_CC_Startup));
+    assert_false (pcr_cache_invalidates (TPM2_CC_PCR_Read));
+    assert_false (pcr_cache_invalidates (TPM2_CC_GetRandom));
+}
+/*
+ * Insert an entry, look it up, then fill the cache and check that inserts
+ * of new keys beyond the limit fail while replacing a cached one works.
+ * Clearing the cache drops everything.
+ */
+static void
+pcr_cache_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    GBytes *key_a, *key_b, *key_c, *bytes, *bytes_out;
+
+    key_a = g_bytes_new_static ("a", 1);
+    key_b = g_bytes_new_static ("b", 1);
+    key_c = g_bytes_new_static ("c", 1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (pcr_cache_insert (data->cache, key_a, bytes));
+    bytes_out = pcr_cache_lookup (data->cache, key_a);
+    assert_non_null (bytes_out);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+    assert_null (pcr_cache_lookup (data->cache, key_b));
+
+    assert_true (pcr_cache_insert (data->cache, key_b, bytes));
+    assert_false (pcr_cache_insert (data->cache, key_c, bytes));
+    assert_true (pcr_cache_insert (data->cache, key_a, bytes));
+    assert_int_equal (pcr_cache_size (data->cache), CACHE_MAX);
+    pcr_cache_clear (data->cache);
+    assert_int_equal (pcr_cache_size (data->cache), 0);
+    assert_null (pcr_cache_lookup (data->cache, key_a));
+    g_bytes_unref (bytes);
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (pcr_cache_type_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+        cmocka_unit_test (pcr_cache_key_test),
+        cmocka_unit_test (pcr_cache_invalidates_test),
+        cmocka_unit_test_setup_teardown (pcr_cache_insert_lookup_test,
+                                         pcr_cache_setup,
+                                         pcr_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,203 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "prewarm.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+/* header-only commands with a handle, the parameters don't matter here */
+#define CREATE_PRIMARY_HEX "8001 0000000e 00000131 40000001"
+#define LOAD_HEX           "8001 0000000e 00000157 81000001"
+#define PRIMARY_HANDLE     0x80000000
+
+/*
+ * Bad hex, odd digits, a size that doesn't match the header and commands
+ * other than CreatePrimary and Load are refused.
+ */
+static void
+prewarm_parse_test (void **state)
+{
+    GBytes *command;
+    gsize size;
+    UNUSED_PARAM (state);
+
+    command = prewarm_parse_command (CREATE_PRIMARY_HEX);
+    assert_non_null (command);
+    assert_int_equal (get_command_code ((uint8_t*)g_bytes_get_data (command,
+                                                                    &size)),
+                      TPM2_CC_CreatePrimary);
+    assert_int_equal (size, 14);
+    g_bytes_unref (command);
+    command = prewarm_parse_command (LOAD_HEX);
+    assert_non_null (command);
+    g_bytes_unref (command);
+
+    assert_null (prewarm_parse_command ("8001 0000000e 00000131 4000000x"));
+    assert_null (prewarm_parse_command ("8001 0000000e 00000131 4000000"));
+    assert_null (prewarm_parse_command ("8001 0000000f 00000131 40000001"));
+    assert_null (prewarm_parse_command ("8001 0000000e 0000017b 40000001"));
+    assert_null (prewarm_parse_command (""));
+}
+/*
+ * Write 'contents' to a new file and read it as a prewarm file.
+ */
+static prewarm_t*
+load_contents (const gchar *contents)
+{
+    prewarm_t *prewarm;
+    gchar *path;
+    gint fd;
+
+    fd = g_file_open_tmp ("prewarm-XXXXXX", &path, NULL);
+    assert_true (fd >= 0);
+    close (fd);
+    assert_true (g_file_set_contents (path, contents, -1, NULL));
+    prewarm = prewarm_load (path);
+    g_unlink (path);
+    g_free (path);
+    return prewarm;
+}
+/*
+ * Each group is a command, in the order of the file. A group without a
+ * command or with a bad one fails the whole file.
+ */
+static void
+prewarm_load_test (void **state)
+{
+    prewarm_t *prewarm;
+    UNUSED_PARAM (state);
+
+    prewarm = load_contents ("[srk]\ncommand=" CREATE_PRIMARY_HEX "\n"
+                             "[key]\ncommand=" LOAD_HEX "\n");
+    assert_non_null (prewarm);
+    assert_int_equal (prewarm->commands->len, 2);
+    assert_int_equal (
+        get_command_code ((uint8_t*)g_bytes_get_data (
+            g_ptr_array_index (prewarm->commands, 1), NULL)),
+        TPM2_CC_Load);
+    prewarm_free (prewarm);
+
+    assert_null (load_contents ("[srk]\ncommand=" CREATE_PRIMARY_HEX "\n"
+                                "[key]\n"));
+    assert_null (load_contents ("[srk]\ncommand=0000\n"));
+    assert_null (load_contents ("not a key file"));
+}
+/*
+ * Read a whole command from 'fd' into 'buf'. Returns its size, 0 once
+ * the other end is closed.
+ */
+static size_t
+read_command (gint    fd,
+              guint8 *buf,
+              size_t  buf_size)
+{
+    size_t got = 0, size = TPM_HEADER_SIZE;
+    ssize_t ret;
+
+    while (got < size) {
+        ret = read (fd, buf + got, size - got);
+        if (ret <= 0) {
+            return 0;
+        }
+        got += ret;
+        if (got == TPM_HEADER_SIZE) {
+            size = get_command_size (buf);
+            assert_true (size <= buf_size);
+        }
+    }
+    return size;
+}
+/*
+ * Fake TPM behind the connection: CreatePrimary creates PRIMARY_HANDLE,
+ * Load fails. The codes of the commands received are collected.
+ */
+static gpointer
+server_thread (gpointer user_data)
+{
+    gint fd = GPOINTER_TO_INT (user_data);
+    GArray *codes = g_array_new (FALSE, FALSE, sizeof (TPM2_CC));
+    guint8 command [64], response [TPM_HEADER_SIZE + sizeof (TPM2_HANDLE)];
+    guint32 handle = GUINT32_TO_BE (PRIMARY_HANDLE);
+    TPM2_CC code;
+    size_t size;
+
+    while ((size = read_command (fd, command, sizeof (command))) > 0) {
+        code = get_command_code (command);
+        g_array_append_val (codes, code);
+        switch (code) {
+        case TPM2_CC_CreatePrimary:
+            tpm2_header_init (response, sizeof (response), TPM2_ST_NO_SESSIONS,
+                              sizeof (response), TSS2_RC_SUCCESS);
+            memcpy (response + TPM_HEADER_SIZE, &handle, sizeof (handle));
+            size = sizeof (response);
+            break;
+        case TPM2_CC_FlushContext:
+            assert_memory_equal (command + TPM_HEADER_SIZE, &handle,
+                                 sizeof (handle));
+            tpm2_header_init (response, sizeof (response), TPM2_ST_NO_SESSIONS,
+                              TPM_HEADER_SIZE, TSS2_RC_SUCCESS);
+            size = TPM_HEADER_SIZE;
+            break;
+        default:
+            tpm2_header_init (response, sizeof (response), TPM2_ST_NO_SESSIONS,
+                              TPM_HEADER_SIZE, TPM2_RC_AUTH_FAIL);
+            size = TPM_HEADER_SIZE;
+            break;
+        }
+        assert_int_equal (write (fd, response, size), size);
+    }
+    close (fd);
+    return codes;
+}
+/*
+ * The commands go out one at a time, a primary created is flushed and
+ * only the commands that succeeded count.
+ */
+static void
+prewarm_run_test (void **state)
+{
+    prewarm_t *prewarm;
+    GSocket *socket;
+    GIOStream *client;
+    GThread *thread;
+    GArray *codes;
+    gint fd_client, fd_server;
+    UNUSED_PARAM (state);
+
+    prewarm = load_contents ("[srk]\ncommand=" CREATE_PRIMARY_HEX "\n"
+                             "[key]\ncommand=" LOAD_HEX "\n");
+    assert_non_null (prewarm);
+    assert_int_equal (create_socket_pair (&fd_client, &fd_server, 0), 0);
+    thread = g_thread_new ("server", server_thread,
+                           GINT_TO_POINTER (fd_server));
+    socket = g_socket_new_from_fd (fd_client, NULL);
+    client = G_IO_STREAM (g_socket_connection_factory_create_connection (socket));
+    g_object_unref (socket);
+
+    assert_int_equal (prewarm_run (client, prewarm->commands), 1);
+    g_object_unref (client);
+    codes = g_thread_join (thread);
+    assert_int_equal (codes->len, 3);
+    assert_int_equal (g_array_index (codes, TPM2_CC, 0), TPM2_CC_CreatePrimary);
+    assert_int_equal (g_array_index (codes, TPM2_CC, 1), TPM2_CC_FlushContext);
+    assert_int_equal (g_array_index (codes, TPM2_CC, 2), TPM2_CC_Load);
+    g_array_unref (codes);
+    prewarm_free (prewarm);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (prewarm_parse_test),
+        cmocka_unit_test (prewarm_load_test),
+        cmocka_unit_test (prewarm_run_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,253 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "primary-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define CREATE_PRIMARY_ATTRS ((1 << 25) | TPMA_CC_RHANDLE | TPM2_CC_CreatePrimary)
+#define CACHE_MAX 2
+
+typedef struct {
+    PrimaryCache *cache;
+} test_data_t;
+
+static int
+primary_cache_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->cache = primary_cache_new (CACHE_MAX);
+    *state = data;
+    return 0;
+}
+static int
+primary_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+/*
+ * Build a CreatePrimary command from 'connection' for a KEYEDHASH object
+ * in the provided hierarchy, authorized by a single session with the
+ * provided handle. If 'pcr' is TRUE the creationPCR parameter selects
+ * PCR 0. create_primary_command_new builds one with no connection.
+ */
+static Tpm2Command*
+create_primary_command_new_full (Connection  *connection,
+                                 TPM2_HANDLE  hierarchy,
+                                 TPM2_HANDLE  auth_handle,
+                                 gboolean     pcr)
+{
+    TPM2B_SENSITIVE_CREATE in_sensitive = { 0 };
+    TPM2B_PUBLIC in_public = {
+        .publicArea = {
+            .type = TPM2_ALG_KEYEDHASH,
+            .nameAlg = TPM2_ALG_SHA256,
+            .objectAttributes = TPMA_OBJECT_FIXEDTPM,
+            .parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_NULL,
+        },
+    };
+    TPM2B_DATA outside_info = { 0 };
+    TPML_PCR_SELECTION creation_pcr = { 0 };
+    TPMS_AUTH_COMMAND auth = { .sessionHandle = auth_handle, };
+    size_t size = TPM2_MAX_COMMAND_SIZE, offset = TPM_HEADER_SIZE;
+    size_t auth_size_offset;
+    guint8 *buffer = calloc (1, size);
+
+    if (pcr) {
+        creation_pcr.count = 1;
+        creation_pcr.pcrSelections [0].hash = TPM2_ALG_SHA256;
+        creation_pcr.pcrSelections [0].sizeofSelect = 3;
+        creation_pcr.pcrSelections [0].pcrSelect [0] = 0x01;
+    }
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (hierarchy, buffer, size,
+                                                   &offset), TSS2_RC_SUCCESS);
+    auth_size_offset = offset;
+    offset += sizeof (UINT32);
+    assert_int_equal (Tss2_MU_TPMS_AUTH_COMMAND_Marshal (&auth,
+                                                         buffer, size,
+                                                         &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (offset - auth_size_offset -
+                                              sizeof (UINT32),
+                                              buffer, size, &auth_size_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_SENSITIVE_CREATE_Marshal (&in_sensitive,
+                                                              buffer, size,
+                                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_PUBLIC_Marshal (&in_public, buffer, size,
+                                                    &offset), TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_DATA_Marshal (&outside_info, buffer, size,
+                                                  &offset), TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPML_PCR_SELECTION_Marshal (&creation_pcr,
+                                                          buffer, size,
+                                                          &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_SESSIONS,
+                                        offset, TPM2_CC_CreatePrimary),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (connection, buffer, offset, CREATE_PRIMARY_ATTRS);
+}
+static Tpm2Command*
+create_primary_command_new (TPM2_HANDLE hierarchy,
+                            TPM2_HANDLE auth_handle,
+                            gboolean    pcr)
+{
+    return create_primary_command_new_full (NULL, hierarchy, auth_handle, pcr);
+}
+static void
+primary_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_PRIMARY_CACHE (data->cache));
+    assert_int_equal (primary_cache_size (data->cache), 0);
+}
+/*
+ * Identical CreatePrimary commands get the same key, commands for
+ * different hierarchies get different keys.
+ */
+static void
+primary_cache_key_test (void **state)
+{
+    Tpm2Command *command_a, *command_b, *command_c;
+    gchar *key_a, *key_b, *key_c;
+    UNUSED_PARAM(state);
+
+    command_a = create_primary_command_new (TPM2_RH_OWNER, TPM2_RS_PW, FALSE);
+    command_b = create_primary_command_new (TPM2_RH_OWNER, TPM2_RS_PW, FALSE);
+    command_c = create_primary_command_new (TPM2_RH_ENDORSEMENT, TPM2_RS_PW,
+                                            FALSE);
+    key_a = primary_cache_key (command_a);
+    key_b = primary_cache_key (command_b);
+    key_c = primary_cache_key (command_c);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_string_equal (key_a, key_b);
+    assert_string_not_equal (key_a, key_c);
+    g_free (key_a);
+    g_free (key_b);
+    g_free (key_c);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (command_c);
+}
+/*
+ * The same CreatePrimary command sent at different localities gets
+ * different keys: the locality is in the creation data.
+ */
+static void
+primary_cache_key_locality_test (void **state)
+{
+    Connection *connection;
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    Tpm2Command *command_a, *command_b;
+    gchar *key_a, *key_b;
+    gint client_fd;
+    UNUSED_PARAM(state);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, 100);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 0, handle_map);
+    command_a = create_primary_command_new_full (connection, TPM2_RH_OWNER,
+                                                 TPM2_RS_PW, FALSE);
+    key_a = primary_cache_key (command_a);
+    connection_set_locality (connection, 3);
+    command_b = create_primary_command_new_full (connection, TPM2_RH_OWNER,
+                                                 TPM2_RS_PW, FALSE);
+    key_b = primary_cache_key (command_b);
+    assert_non_null (key_a);
+    assert_non_null (key_b);
+    assert_string_not_equal (key_a, key_b);
+    g_free (key_a);
+    g_free (key_b);
+    g_object_unref (command_a);
+    g_object_unref (command_b);
+    g_object_unref (connection);
+    g_object_unref (iostream);
+    g_object_unref (handle_map);
+    close (client_fd);
+}
+/*
+ * CreatePrimary commands authorized with an HMAC session or that select
+ * PCRs for the creation data can't be cached.
+ */
+static void
+primary_cache_key_uncacheable_test (void **state)
+{
+    Tpm2Command *command;
+    UNUSED_PARAM(state);
+
+    command = create_primary_command_new (TPM2_RH_OWNER,
+                                          TPM2_HMAC_SESSION_FIRST,
+                                          FALSE);
+    assert_null (primary_cache_key (command));
+    g_object_unref (command);
+    command = create_primary_command_new (TPM2_RH_OWNER, TPM2_RS_PW, TRUE);
+    assert_null (primary_cache_key (command));
+    g_object_unref (command);
+}
+/*
+ * Insert an entry, look it up, then fill the cache and check that inserts
+ * beyond the limit fail. Clearing the cache drops everything.
+ */
+static void
+primary_cache_insert_lookup_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPMS_CONTEXT context = { .sequence = 0x42, .savedHandle = 0x80000000 };
+    TPMS_CONTEXT context_out = { 0 };
+    guint8 resp [] = { 0x80, 0x02, 0x00, 0x00, 0x00, 0x0e,
+                       0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00 };
+    GBytes *bytes, *bytes_out = NULL;
+
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (primary_cache_insert (data->cache, "a", &context, bytes));
+    assert_true (primary_cache_lookup (data->cache, "a", &context_out,
+                                       &bytes_out));
+    assert_int_equal (context_out.sequence, context.sequence);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+    assert_false (primary_cache_lookup (data->cache, "b", &context_out,
+                                        &bytes_out));
+
+    assert_true (primary_cache_insert (data->cache, "b", &context, bytes));
+    assert_false (primary_cache_insert (data->cache, "c", &context, bytes));
+    assert_int_equal (primary_cache_size (data->cache), CACHE_MAX);
+    assert_true (primary_cache_remove (data->cache, "b"));
+    assert_int_equal (primary_cache_size (data->cache), 1);
+    primary_cache_clear (data->cache);
+    assert_int_equal (primary_cache_size (data->cache), 0);
+    g_bytes_unref (bytes);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (primary_cache_type_test,
+                                         primary_cache_setup,
+                                         primary_cache_teardown),
+        cmocka_unit_test (primary_cache_key_test),
+        cmocka_unit_test (primary_cache_key_locality_test),
+        cmocka_unit_test (primary_cache_key_uncacheable_test),
+        cmocka_unit_test_setup_teardown (primary_cache_insert_lookup_test,
+                                         primary_cache_setup,
+                                         primary_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "rate-limiter.h"
+
+#define RATE 4
+#define UID  1000
+#define NOW  G_USEC_PER_SEC
+
+typedef struct {
+    RateLimiter *limiter;
+} test_data_t;
+
+static int
+rate_limiter_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->limiter = rate_limiter_new (RATE);
+    *state = data;
+    return 0;
+}
+static int
+rate_limiter_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->limiter);
+    free (data);
+    return 0;
+}
+static void
+rate_limiter_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_RATE_LIMITER (data->limiter));
+    assert_int_equal (rate_limiter_get_rate (data->limiter), RATE);
+}
+/*
+ * A user may send a burst of RATE commands, the next one has to wait for
+ * a token and gets it once the wait is over.
+ */
+static void
+rate_limiter_burst_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gint64 wait;
+    guint i;
+
+    for (i = 0; i < RATE; ++i) {
+        assert_int_equal (rate_limiter_wait (data->limiter, UID, NOW), 0);
+        rate_limiter_take (data->limiter, UID);
+    }
+    wait = rate_limiter_wait (data->limiter, UID, NOW);
+    assert_true (wait > 0);
+    assert_true (wait <= G_USEC_PER_SEC / RATE + 1);
+    assert_true (rate_limiter_wait (data->limiter, UID, NOW + wait - 2) > 0);
+    assert_int_equal (rate_limiter_wait (data->limiter, UID, NOW + wait), 0);
+}
+/*
+ * The buckets of users are apart: one user using up its rate leaves the
+ * others alone, and clients whose user isn't known aren't limited.
+ */
+static void
+rate_limiter_users_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    for (i = 0; i < RATE; ++i) {
+        rate_limiter_wait (data->limiter, UID, NOW);
+        rate_limiter_take (data->limiter, UID);
+        rate_limiter_take (data->limiter, RATE_LIMITER_UID_NONE);
+    }
+    assert_true (rate_limiter_wait (data->limiter, UID, NOW) > 0);
+    assert_int_equal (rate_limiter_wait (data->limiter, UID + 1, NOW), 0);
+    assert_int_equal (rate_limiter_wait (data->limiter,
+                                         RATE_LIMITER_UID_NONE,
+                                         NOW),
+                      0);
+}
+/*
+ * A rate of 0 lets everything through, setting the rate back caps the
+ * buckets at a second's worth of the new rate.
+ */
+static void
+rate_limiter_set_rate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    rate_limiter_wait (data->limiter, UID, NOW);
+    rate_limiter_set_rate (data->limiter, 0);
+    assert_int_equal (rate_limiter_wait (data->limiter, UID, NOW), 0);
+    rate_limiter_take (data->limiter, UID);
+    rate_limiter_set_rate (data->limiter, 1);
+    assert_int_equal (rate_limiter_wait (data->limiter, UID, NOW), 0);
+    rate_limiter_take (data->limiter, UID);
+    assert_true (rate_limiter_wait (data->limiter, UID, NOW) > 0);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (rate_limiter_type_test,
+                                         rate_limiter_setup,
+                                         rate_limiter_teardown),
+        cmocka_unit_test_setup_teardown (rate_limiter_burst_test,
+                                         rate_limiter_setup,
+                                         rate_limiter_teardown),
+        cmocka_unit_test_setup_teardown (rate_limiter_users_test,
+                                         rate_limiter_setup,
+                                         rate_limiter_teardown),
+        cmocka_unit_test_setup_teardown (rate_limiter_set_rate_test,
+                                         rate_limiter_setup,
+                                         rate_limiter_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,526 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Microbenchmarks for the per command work of the daemon. The TPM is
+ * replaced by wrapped functions that answer instantly, so what's measured
+ * is the CPU time the ResourceManager and the lookups it relies on take
+ * for each command. Each benchmark runs the requested number of
+ * iterations and prints the mean time per iteration.
+ *
+ * The read benchmarks time how commands up to UTIL_BUF_MAX bytes are read
+ * from a client's socket, in one piece or in small fragments, and run a
+ * fraction of the iterations since each moves a lot more data.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "command-attrs.h"
+#include "connection.h"
+#include "handle-map.h"
+#include "resource-manager.h"
+#include "session-list.h"
+#include "sink-interface.h"
+#include "tcti.h"
+#include "tcti-mock.h"
+#include "tpm2-command.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define BENCH_ITERATIONS_DEFAULT 1000000
+#define BENCH_CONNECTIONS 16
+#define BENCH_TRANSIENTS 16
+/* virtual handle of the transient object the handle commands use */
+#define BENCH_VHANDLE (TPM2_HR_TRANSIENT + 0x1)
+#define BENCH_PHANDLE (TPM2_HR_TRANSIENT + 0x100)
+/* the read benchmarks run this much fewer iterations */
+#define BENCH_READ_DIVISOR 100
+/* bytes a fragmented client writes at a time */
+#define BENCH_FRAGMENT_SIZE 64
+
+/*
+ * An input stream that hands out at most 'fragment' bytes of its base
+ * stream per read, as a socket does when the client writes a command in
+ * small pieces.
+ */
+typedef struct {
+    GFilterInputStream   parent_instance;
+    gsize                fragment;
+} BenchTrickleStream;
+typedef struct {
+    GFilterInputStreamClass parent_class;
+} BenchTrickleStreamClass;
+
+G_DEFINE_TYPE (BenchTrickleStream, bench_trickle_stream,
+               G_TYPE_FILTER_INPUT_STREAM);
+
+static gssize
+bench_trickle_stream_read (GInputStream *stream,
+                           void         *buffer,
+                           gsize         count,
+                           GCancellable *cancellable,
+                           GError      **error)
+{
+    BenchTrickleStream *self = (BenchTrickleStream*)stream;
+
+    return g_input_stream_read (
+        g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (stream)),
+        buffer,
+        MIN (count, self->fragment),
+        cancellable,
+        error);
+}
+static void
+bench_trickle_stream_init (BenchTrickleStream *self)
+{
+    UNUSED_PARAM(self);
+}
+static void
+bench_trickle_stream_class_init (BenchTrickleStreamClass *klass)
+{
+    G_INPUT_STREAM_CLASS (klass)->read_fn = bench_trickle_stream_read;
+}
+static GInputStream*
+bench_trickle_stream_new (GInputStream *base,
+                          gsize         fragment)
+{
+    BenchTrickleStream *stream;
+
+    stream = g_object_new (bench_trickle_stream_get_type (),
+                           "base-stream", base,
+                           NULL);
+    stream->fragment = fragment;
+    return G_INPUT_STREAM (stream);
+}
+
+/*
+ * The TPM answers every command with a bare success response.
+ */
+Tpm2Response*
+__wrap_tpm2_send_command (Tpm2        *tpm2,
+                          Tpm2Command *command,
+                          TSS2_RC     *rc)
+{
+    UNUSED_PARAM(tpm2);
+
+    *rc = TSS2_RC_SUCCESS;
+    return tpm2_response_new_rc (tpm2_command_peek_connection (command),
+                                 TSS2_RC_SUCCESS);
+}
+/* responses are dropped instead of going to a ResponseSink */
+void
+__wrap_sink_enqueue (Sink    *self,
+                     GObject *obj)
+{
+    UNUSED_PARAM(self);
+    UNUSED_PARAM(obj);
+}
+TSS2_RC
+__wrap_tpm2_context_saveflush (Tpm2         *tpm2,
+                               TPM2_HANDLE   handle,
+                               TPMS_CONTEXT *context)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+    UNUSED_PARAM(context);
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_save (Tpm2         *tpm2,
+                          TPM2_HANDLE   handle,
+                          TPMS_CONTEXT *context)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+    UNUSED_PARAM(context);
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_flush (Tpm2        *tpm2,
+                           TPM2_HANDLE  handle)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_load (Tpm2         *tpm2,
+                          TPMS_CONTEXT *context,
+                          TPM2_HANDLE  *handle)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(context);
+
+    *handle = BENCH_PHANDLE;
+    return TSS2_RC_SUCCESS;
+}
+TSS2_RC
+__wrap_tpm2_context_load_command (Tpm2        *tpm2,
+                                  GBytes      *command,
+                                  TPM2_HANDLE *handle)
+{
+    UNUSED_PARAM(command);
+    return __wrap_tpm2_context_load (tpm2, NULL, handle);
+}
+/*
+ * The TPM implements every command the spec defines, with the number of
+ * handles the ResourceManager cares about left at 0.
+ */
+TSS2_RC
+__wrap_tpm2_get_command_attrs (Tpm2     *tpm2,
+                               UINT32   *count,
+                               TPMA_CC **attrs)
+{
+    UINT32 i;
+    UNUSED_PARAM(tpm2);
+
+    *count = TPM2_CC_LAST - TPM2_CC_FIRST + 1;
+    *attrs = g_new0 (TPMA_CC, *count);
+    for (i = 0; i < *count; ++i) {
+        (*attrs) [i] = TPM2_CC_FIRST + i;
+    }
+    return TSS2_RC_SUCCESS;
+}
+
+typedef struct {
+    Tpm2            *tpm2;
+    ResourceManager *resmgr;
+    Connection      *connections [BENCH_CONNECTIONS];
+    gint             client_fds [BENCH_CONNECTIONS];
+    guint            iterations;
+} bench_data_t;
+
+static void
+bench_report (const gchar *name,
+              guint        iterations,
+              gint64       elapsed_us)
+{
+    printf ("%-28s %10u iterations %10.1f ns each\n",
+            name,
+            iterations,
+            (gdouble)elapsed_us * 1000 / iterations);
+}
+/*
+ * A command with 'handle_count' handles, all of them BENCH_VHANDLE.
+ */
+static Tpm2Command*
+bench_command_new (Connection *connection,
+                   TPM2_CC     command_code,
+                   guint       handle_count)
+{
+    size_t size = TPM_HEADER_SIZE + handle_count * sizeof (TPM2_HANDLE);
+    guint8 *buffer = g_malloc0 (size);
+    TPMA_CC attrs = command_code | (handle_count << 25);
+    guint i;
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 ((UINT32)size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (command_code);
+    for (i = 0; i < handle_count; ++i) {
+        *(TPM2_HANDLE*)(buffer + TPM_HEADER_SIZE + i * sizeof (TPM2_HANDLE)) =
+            htobe32 (BENCH_VHANDLE);
+    }
+    return tpm2_command_new (connection, buffer, size, attrs);
+}
+/*
+ * Commands without handles, the daemon's fixed cost per command.
+ */
+static void
+bench_process_no_handles (bench_data_t *data)
+{
+    Connection *connection = data->connections [0];
+    gint64 start;
+    guint i;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->iterations; ++i) {
+        resource_manager_process_tpm2_command (data->resmgr,
+            bench_command_new (connection, TPM2_CC_GetRandom, 0));
+    }
+    bench_report ("process GetRandom",
+                  data->iterations,
+                  g_get_monotonic_time () - start);
+}
+/*
+ * Commands with a transient object handle that has to be virtualized,
+ * and loaded if the ResourceManager saved it after the last command.
+ */
+static void
+bench_process_one_handle (bench_data_t *data)
+{
+    Connection *connection = data->connections [0];
+    HandleMap *map = connection_peek_trans_map (connection);
+    HandleMapEntry *entry;
+    gint64 start;
+    guint i;
+
+    entry = handle_map_entry_new (BENCH_PHANDLE, BENCH_VHANDLE);
+    handle_map_insert (map, BENCH_VHANDLE, entry);
+    g_object_unref (entry);
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->iterations; ++i) {
+        resource_manager_process_tpm2_command (data->resmgr,
+            bench_command_new (connection, TPM2_CC_VerifySignature, 1));
+    }
+    bench_report ("process VerifySignature",
+                  data->iterations,
+                  g_get_monotonic_time () - start);
+    handle_map_remove (map, BENCH_VHANDLE);
+}
+static void
+bench_command_attrs (bench_data_t *data)
+{
+    CommandAttrs *attrs = command_attrs_new ();
+    TPMA_CC found = 0;
+    gint64 start;
+    guint i;
+
+    if (command_attrs_init_tpm (attrs, data->tpm2) != 0) {
+        g_error ("failed to initialize CommandAttrs");
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->iterations; ++i) {
+        found ^= command_attrs_from_cc (attrs,
+            TPM2_CC_FIRST + i % (TPM2_CC_LAST - TPM2_CC_FIRST + 1));
+    }
+    bench_report ("command_attrs_from_cc",
+                  data->iterations,
+                  g_get_monotonic_time () - start);
+    g_debug ("%s: 0x%08" PRIx32, __func__, found);
+    g_object_unref (attrs);
+}
+static void
+bench_handle_map (bench_data_t *data)
+{
+    HandleMap *map = handle_map_new (TPM2_HT_TRANSIENT, BENCH_TRANSIENTS);
+    HandleMapEntry *entry;
+    gint64 start;
+    guint i, hits = 0;
+
+    for (i = 0; i < BENCH_TRANSIENTS; ++i) {
+        entry = handle_map_entry_new (BENCH_PHANDLE + i, BENCH_VHANDLE + i);
+        handle_map_insert (map, BENCH_VHANDLE + i, entry);
+        g_object_unref (entry);
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->iterations; ++i) {
+        entry = handle_map_vlookup (map, BENCH_VHANDLE + i % BENCH_TRANSIENTS);
+        if (entry != NULL) {
+            ++hits;
+            g_object_unref (entry);
+        }
+    }
+    bench_report ("handle_map_vlookup",
+                  data->iterations,
+                  g_get_monotonic_time () - start);
+    g_debug ("%s: %u hits", __func__, hits);
+    g_object_unref (map);
+}
+/*
+ * Look up sessions in a list filled the way a busy daemon's would be:
+ * the most sessions each connection may have, for several connections.
+ */
+static void
+bench_session_list (bench_data_t *data)
+{
+    SessionList *list = data->resmgr->session_list;
+    SessionEntry *entry;
+    guint count = 0, i, j, hits = 0;
+    TPM2_HANDLE handles [BENCH_CONNECTIONS * SESSION_LIST_MAX_ENTRIES_DEFAULT];
+    gint64 start;
+
+    for (i = 0; i < BENCH_CONNECTIONS; ++i) {
+        for (j = 0; j < SESSION_LIST_MAX_ENTRIES_DEFAULT; ++j) {
+            handles [count] = TPM2_HR_HMAC_SESSION + count;
+            entry = session_entry_new (data->connections [i], handles [count]);
+            if (session_list_insert (list, entry)) {
+                ++count;
+            }
+            g_object_unref (entry);
+        }
+    }
+    start = g_get_monotonic_time ();
+    for (i = 0; i < data->iterations; ++i) {
+        entry = session_list_lookup_handle (list, handles [i % count]);
+        if (entry != NULL) {
+            ++hits;
+            g_object_unref (entry);
+        }
+    }
+    bench_report ("session_list_lookup_handle",
+                  data->iterations,
+                  g_get_monotonic_time () - start);
+    g_debug ("%s: %u hits in %u sessions", __func__, hits, count);
+    for (i = 0; i < count; ++i) {
+        session_list_remove_handle (list, handles [i]);
+    }
+}
+/*
+ * A command of 'size' bytes with nothing but the header filled in.
+ */
+static guint8*
+bench_buffer_new (size_t size)
+{
+    guint8 *buffer = g_malloc0 (size);
+
+    *(TPM2_ST*)buffer = htobe16 (TPM2_ST_NO_SESSIONS);
+    *(UINT32*)(buffer + 2) = htobe32 ((UINT32)size);
+    *(TPM2_CC*)(buffer + 6) = htobe32 (TPM2_CC_NV_Write);
+    return buffer;
+}
+/*
+ * Read commands of 'size' bytes from a stream socket the way the
+ * CommandSource does, after the client has written each in one go. With
+ * a 'fragment' size each read only gets that many bytes. Only the reads
+ * are timed, what's read has to be what was written.
+ */
+static void
+bench_read_stream (bench_data_t *data,
+                   const gchar  *name,
+                   size_t        size,
+                   gsize         fragment)
+{
+    guint iterations = MAX (data->iterations / BENCH_READ_DIVISOR, 1), i;
+    GIOStream *iostream;
+    GInputStream *istream;
+    guint8 *command, *buffer;
+    size_t buffer_size;
+    gint64 start, elapsed = 0;
+    gint client_fd;
+
+    command = bench_buffer_new (size);
+    iostream = create_connection_iostream (&client_fd);
+    istream = g_io_stream_get_input_stream (iostream);
+    istream = fragment > 0 ? bench_trickle_stream_new (istream, fragment) :
+                             g_object_ref (istream);
+    for (i = 0; i < iterations; ++i) {
+        if (write (client_fd, command, size) != (ssize_t)size) {
+            g_error ("%s: failed to write command", __func__);
+        }
+        start = g_get_monotonic_time ();
+        buffer = read_tpm_buffer_alloc (istream, &buffer_size);
+        elapsed += g_get_monotonic_time () - start;
+        if (buffer == NULL || buffer_size != size ||
+            memcmp (buffer, command, size) != 0)
+        {
+            g_error ("%s: failed to read command", __func__);
+        }
+        util_buf_put (buffer, buffer_size);
+    }
+    bench_report (name, iterations, elapsed);
+    g_object_unref (istream);
+    g_object_unref (iostream);
+    close (client_fd);
+    g_free (command);
+}
+/*
+ * The same with a SOCK_SEQPACKET socket, each command in one message.
+ */
+static void
+bench_read_packet (bench_data_t *data,
+                   const gchar  *name,
+                   size_t        size)
+{
+    guint iterations = MAX (data->iterations / BENCH_READ_DIVISOR, 1), i;
+    GIOStream *iostream;
+    GSocket *socket;
+    guint8 *command, *buffer;
+    size_t buffer_size;
+    gint64 start, elapsed = 0;
+    gint client_fd;
+
+    command = bench_buffer_new (size);
+    iostream = create_connection_iostream_type (&client_fd, SOCK_SEQPACKET);
+    socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (iostream));
+    for (i = 0; i < iterations; ++i) {
+        if (write (client_fd, command, size) != (ssize_t)size) {
+            g_error ("%s: failed to write command", __func__);
+        }
+        start = g_get_monotonic_time ();
+        buffer = read_tpm_packet_alloc (socket, &buffer_size);
+        elapsed += g_get_monotonic_time () - start;
+        if (buffer == NULL || buffer_size != size ||
+            memcmp (buffer, command, size) != 0)
+        {
+            g_error ("%s: failed to read command", __func__);
+        }
+        util_buf_put (buffer, buffer_size);
+    }
+    bench_report (name, iterations, elapsed);
+    g_object_unref (iostream);
+    close (client_fd);
+    g_free (command);
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    bench_data_t data = { .iterations = BENCH_ITERATIONS_DEFAULT, };
+    GOptionContext *context;
+    GError *error = NULL;
+    SessionList *session_list;
+    HandleMap *handle_map;
+    GIOStream *iostream;
+    Tcti *tcti;
+    guint i;
+    GOptionEntry entries [] = {
+        { "iterations", 'i', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &data.iterations, "Iterations of each benchmark.", NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    context = g_option_context_new (" - ResourceManager microbenchmarks");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_critical ("failed to parse options: %s", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 2;
+    }
+    g_option_context_free (context);
+    if (data.iterations == 0) {
+        g_critical ("iterations must be greater than 0");
+        return 2;
+    }
+
+    tcti = tcti_new (tcti_mock_init_full ());
+    data.tpm2 = tpm2_new (tcti);
+    g_clear_object (&tcti);
+    session_list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                                     SESSION_LIST_MAX_ABANDONED_DEFAULT);
+    data.resmgr = resource_manager_new (data.tpm2, session_list);
+    g_clear_object (&session_list);
+    for (i = 0; i < BENCH_CONNECTIONS; ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&data.client_fds [i]);
+        data.connections [i] = connection_new (iostream, i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+    }
+
+    bench_process_no_handles (&data);
+    bench_process_one_handle (&data);
+    bench_command_attrs (&data);
+    bench_handle_map (&data);
+    bench_session_list (&data);
+    bench_read_stream (&data, "read_tpm_buffer_alloc 1K",
+                       UTIL_BUF_SIZE, 0);
+    bench_read_stream (&data, "read_tpm_buffer_alloc max",
+                       UTIL_BUF_MAX, 0);
+    bench_read_stream (&data, "read_tpm_buffer_alloc max/64",
+                       UTIL_BUF_MAX, BENCH_FRAGMENT_SIZE);
+    bench_read_packet (&data, "read_tpm_packet_alloc max", UTIL_BUF_MAX);
+
+    for (i = 0; i < BENCH_CONNECTIONS; ++i) {
+        g_object_unref (data.connections [i]);
+        close (data.client_fds [i]);
+    }
+    g_object_unref (data.resmgr);
+    g_object_unref (data.tpm2);
+    return 0;
+}
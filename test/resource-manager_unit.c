@@ -15,6 +15,9 @@
 
 #include <tss2/tss2_mu.h>
 
+#include "connection.h"
+#include "control-message.h"
+#include "object-share.h"
 #include "tpm2.h"
 #include "resource-manager.h"
 #include "sink-interface.h"
@@ -23,8 +26,12 @@
 #include "tcti-mock.h"
 #include "tpm2-command.h"
 #include "tpm2-header.h"
+#include "tss2-tcti-tabrmd.h"
 #include "util.h"
 
+/* NV index the NV tests read and write */
+#define NV_INDEX 0x01500020
+
 typedef struct test_data {
     Tpm2    *tpm2;
     ResourceManager *resource_manager;
@@ -78,6 +85,14 @@ __wrap_sink_enqueue (Sink      *self,
     test_data_t *data = mock_ptr_type (test_data_t*);
     data->response = TPM2_RESPONSE (obj);
 }
+/*
+ * When set, __wrap_tpm2_context_saveflush cancels the commands of the
+ * test connection, as the IPC thread would, and keeps the result in
+ * 'cancel_rc'.
+ */
+static test_data_t *cancel_data = NULL;
+static TSS2_RC cancel_rc;
+
 TSS2_RC
 __wrap_tpm2_context_saveflush (Tpm2 *broker,
                                         TPM2_HANDLE    handle,
@@ -86,8 +101,30 @@ __wrap_tpm2_context_saveflush (Tpm2 *broker,
     UNUSED_PARAM(broker);
     UNUSED_PARAM(handle);
     UNUSED_PARAM(context);
+    if (cancel_data != NULL) {
+        cancel_rc = resource_manager_cancel (cancel_data->resource_manager,
+                                             cancel_data->connection);
+    }
    return mock_type (TSS2_RC);
 }
+TSS2_RC
+__wrap_tpm2_context_save (Tpm2         *tpm2,
+                          TPM2_HANDLE   handle,
+                          TPMS_CONTEXT *context)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+    UNUSED_PARAM(context);
+    return mock_type (TSS2_RC);
+}
+TSS2_RC
+__wrap_tpm2_context_flush (Tpm2        *tpm2,
+                           TPM2_HANDLE  handle)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(handle);
+    return mock_type (TSS2_RC);
+}
 /*
  * Wrap call to tpm2_context_load. Pops two parameters off the
  * stack with the 'mock' command. The first is the RC which is returned
@@ -109,6 +146,109 @@ __wrap_tpm2_context_load (Tpm2 *tpm2,
 
     return rc;
 }
+/*
+ * Entries are loaded with the ContextLoad command they keep, this takes
+ * the same values off the stack as __wrap_tpm2_context_load.
+ */
+TSS2_RC
+__wrap_tpm2_context_load_command (Tpm2        *tpm2,
+                                  GBytes      *command,
+                                  TPM2_HANDLE *handle)
+{
+    assert_non_null (command);
+    return __wrap_tpm2_context_load (tpm2, NULL, handle);
+}
+/*
+ * Wrap call to tpm2_hash_sequence. Checks that it's given the 'size'
+ * bytes expected and returns the mocked RC with a SHA256 sized digest.
+ */
+TSS2_RC
+__wrap_tpm2_hash_sequence (Tpm2              *tpm2,
+                           TPMI_ALG_HASH      hash_alg,
+                           TPMI_RH_HIERARCHY  hierarchy,
+                           const guint8      *data,
+                           size_t             size,
+                           TPM2B_DIGEST      *digest,
+                           TPMT_TK_HASHCHECK *validation)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(data);
+
+    assert_int_equal (hash_alg, TPM2_ALG_SHA256);
+    assert_int_equal (hierarchy, TPM2_RH_NULL);
+    assert_int_equal (size, mock_type (size_t));
+    digest->size = TPM2_SHA256_DIGEST_SIZE;
+    validation->tag = TPM2_ST_HASHCHECK;
+    validation->hierarchy = hierarchy;
+    return mock_type (TSS2_RC);
+}
+/*
+ * Wrap calls to tpm2_nv_read and tpm2_nv_write. The read fills 'data'
+ * with the low byte of its offset.
+ */
+TSS2_RC
+__wrap_tpm2_nv_read (Tpm2              *tpm2,
+                     TPMI_RH_NV_AUTH    auth_handle,
+                     TPMI_RH_NV_INDEX   nv_index,
+                     const TPM2B_AUTH  *auth,
+                     UINT16             offset,
+                     UINT16             size,
+                     guint8            *data)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(auth_handle);
+    UNUSED_PARAM(auth);
+
+    assert_int_equal (nv_index, NV_INDEX);
+    assert_int_equal (size, mock_type (UINT16));
+    memset (data, offset & 0xff, size);
+    return mock_type (TSS2_RC);
+}
+/*
+ * Wrap calls to tpm2_evict_control, checking the handles against the
+ * first two values on the stack and returning the third.
+ */
+TSS2_RC
+__wrap_tpm2_evict_control (Tpm2               *tpm2,
+                           const TPM2B_AUTH   *auth,
+                           TPMI_DH_OBJECT      handle,
+                           TPMI_DH_PERSISTENT  persistent)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(auth);
+
+    assert_int_equal (handle, mock_type (TPMI_DH_OBJECT));
+    assert_int_equal (persistent, mock_type (TPMI_DH_PERSISTENT));
+    return mock_type (TSS2_RC);
+}
+/*
+ * The TCTI on the kernel resource manager is a mock one.
+ */
+Tcti*
+__wrap_tcti_new_from_conf (const gchar *conf)
+{
+    assert_string_equal (conf, "device:/dev/tpmrm0");
+    return tcti_new (tcti_mock_init_full ());
+}
+TSS2_RC
+__wrap_tpm2_nv_write (Tpm2              *tpm2,
+                      TPMI_RH_NV_AUTH    auth_handle,
+                      TPMI_RH_NV_INDEX   nv_index,
+                      const TPM2B_AUTH  *auth,
+                      UINT16             offset,
+                      UINT16             size,
+                      const guint8      *data)
+{
+    UNUSED_PARAM(tpm2);
+    UNUSED_PARAM(auth_handle);
+    UNUSED_PARAM(auth);
+    UNUSED_PARAM(offset);
+    UNUSED_PARAM(data);
+
+    assert_int_equal (nv_index, NV_INDEX);
+    assert_int_equal (size, mock_type (UINT16));
+    return mock_type (TSS2_RC);
+}
 static int
 resource_manager_setup (void **state)
 {
@@ -274,6 +414,246 @@ resource_manager_process_tpm2_command_success_test (void **state)
     assert_int_equal (data->response, response);
     g_object_unref (response);
 }
+/*
+ * The TPM answers the command with TPM2_RC_RETRY and TPM2_RC_YIELDED
+ * before executing it. The RM sends it again itself and the client only
+ * gets the final response.
+ */
+static void
+resource_manager_process_tpm2_command_retry_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *retry, *yielded, *response;
+
+    data->command = tpm2_command_new (data->connection,
+                                      calloc (1, TPM_HEADER_SIZE),
+                                      TPM_HEADER_SIZE,
+                                      (TPMA_CC){ 0, });
+    retry = tpm2_response_new_rc (data->connection, TPM2_RC_RETRY);
+    yielded = tpm2_response_new_rc (data->connection, TPM2_RC_YIELDED);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, retry);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, yielded);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    g_object_unref (response);
+}
+/*
+ * Commands from a connection that has been closed are dropped without
+ * being sent to the TPM and without a response: neither
+ * tpm2_send_command nor sink_enqueue have been prepared to be called.
+ */
+static void
+resource_manager_process_tpm2_command_closed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 *buffer;
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    connection_set_closed (data->connection);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_null (data->response);
+}
+/*
+ * With a kernel resource manager each connection gets a TCTI of its own on
+ * it, the command goes to it with its handles as they are and the
+ * response comes back without being virtualized. Removing the connection
+ * closes its TCTI.
+ */
+static void
+resource_manager_kernel_rm_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+
+    g_object_set (data->resource_manager,
+                  "kernel-rm", "/dev/tpmrm0",
+                  NULL);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (g_hash_table_size (data->resource_manager->kernel_tpms),
+                      1);
+    assert_int_equal (handle_map_size (connection_peek_trans_map (data->connection)),
+                      0);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0),
+                      data->vhandles [0]);
+    g_object_unref (response);
+
+    resource_manager_remove_connection (data->resource_manager,
+                                        data->connection);
+    assert_int_equal (g_hash_table_size (data->resource_manager->kernel_tpms),
+                      0);
+}
+/*
+ * With a resume grace period a closed connection that had something is
+ * kept, one that had nothing isn't. A new connection of the same user
+ * with the old id takes over its virtual handles and sessions as they
+ * were, and the old one is gone after that.
+ */
+static void
+resource_manager_resume_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry, *lookup;
+    SessionEntry *session;
+    Connection *connection;
+    GIOStream *iostream;
+    HandleMap *handle_map;
+    gint client_fd;
+
+    g_object_set (resmgr, "resume-ms", 1000, NULL);
+    assert_false (resource_manager_park_connection (resmgr, data->connection));
+    entry = handle_map_entry_new (0, data->vhandles [0]);
+    handle_map_insert (connection_peek_trans_map (data->connection),
+                       data->vhandles [0],
+                       entry);
+    session = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_state (session, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (resmgr->session_list, session);
+    connection_set_uid (data->connection, 1000);
+    assert_true (resource_manager_park_connection (resmgr, data->connection));
+    assert_int_equal (g_queue_get_length (resmgr->parked), 1);
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    connection_set_resume_id (connection, 10);
+    /* another user can't have it */
+    connection_set_uid (connection, 1001);
+    assert_false (resource_manager_resume_connection (resmgr, connection));
+    connection_set_uid (connection, 1000);
+    assert_true (resource_manager_resume_connection (resmgr, connection));
+
+    assert_int_equal (g_queue_get_length (resmgr->parked), 0);
+    assert_int_equal (handle_map_size (connection_peek_trans_map (data->connection)),
+                      0);
+    lookup = handle_map_vlookup (connection_peek_trans_map (connection),
+                                 data->vhandles [0]);
+    assert_ptr_equal (lookup, entry);
+    g_object_unref (lookup);
+    assert_int_equal (session_list_connection_count (resmgr->session_list,
+                                                     connection), 1);
+    assert_int_equal (session_entry_get_state (session), SESSION_ENTRY_SAVED_RM);
+    assert_false (resource_manager_resume_connection (resmgr, connection));
+    g_object_unref (session);
+    g_object_unref (entry);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * A kept connection is removed once its grace period is over.
+ */
+static void
+resource_manager_expire_parked_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *entry;
+
+    g_object_set (resmgr, "resume-ms", 1000, NULL);
+    entry = handle_map_entry_new (0, data->vhandles [0]);
+    handle_map_insert (connection_peek_trans_map (data->connection),
+                       data->vhandles [0],
+                       entry);
+    g_object_unref (entry);
+    assert_true (resource_manager_park_connection (resmgr, data->connection));
+    assert_int_equal (resource_manager_expire_parked (resmgr,
+                                                      g_get_monotonic_time ()),
+                      0);
+    assert_int_equal (resource_manager_expire_parked (resmgr, G_MAXINT64), 1);
+    assert_int_equal (g_queue_get_length (resmgr->parked), 0);
+}
+/*
+ * Enqueue two commands followed by a CONNECTION_REMOVED message for their
+ * connection. The commands must be dropped from the queue leaving only
+ * the control message.
+ */
+static void
+resource_manager_enqueue_connection_removed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    ControlMessage *msg;
+    GObject *obj;
+    size_t i;
+
+    for (i = 0; i < 2; ++i) {
+        command = tpm2_command_new (data->connection,
+                                    calloc (1, TPM_HEADER_SIZE),
+                                    TPM_HEADER_SIZE,
+                                    (TPMA_CC){ 0, });
+        resource_manager_enqueue (SINK (data->resource_manager),
+                                  G_OBJECT (command));
+        g_object_unref (command);
+    }
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    resource_manager_enqueue (SINK (data->resource_manager), G_OBJECT (msg));
+    obj = message_queue_timeout_dequeue (data->resource_manager->in_queue,
+                                         1000);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    assert_null (message_queue_timeout_dequeue (data->resource_manager->in_queue,
+                                                1000));
+    g_object_unref (msg);
+}
+/*
+ * Canceling a connection with two queued commands answers both of them
+ * (through the mock sink_enqueue) and leaves the control messages for the
+ * connection in the queue.
+ */
+static void
+resource_manager_cancel_queued_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    ControlMessage *msg;
+    GObject *obj;
+    size_t i;
+
+    for (i = 0; i < 2; ++i) {
+        command = tpm2_command_new (data->connection,
+                                    calloc (1, TPM_HEADER_SIZE),
+                                    TPM_HEADER_SIZE,
+                                    (TPMA_CC){ 0, });
+        message_queue_enqueue (data->resource_manager->in_queue,
+                               G_OBJECT (command));
+        g_object_unref (command);
+    }
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    message_queue_enqueue (data->resource_manager->in_queue, G_OBJECT (msg));
+    will_return (__wrap_sink_enqueue, data);
+    will_return (__wrap_sink_enqueue, data);
+    assert_int_equal (resource_manager_cancel (data->resource_manager,
+                                               data->connection),
+                      TSS2_RC_SUCCESS);
+    obj = message_queue_timeout_dequeue (data->resource_manager->in_queue,
+                                         1000);
+    assert_ptr_equal (obj, msg);
+    g_object_unref (obj);
+    g_object_unref (msg);
+    data->response = NULL;
+}
 static void
 resource_manager_flushsave_context_test (void **state)
 {
@@ -285,6 +665,44 @@ resource_manager_flushsave_context_test (void **state)
     will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
     resource_manager_flushsave_context (entry, data->resource_manager);
     assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    assert_true (handle_map_entry_get_context_saved (entry));
+    g_object_unref (entry);
+}
+/*
+ * Context operations count as swaps for the slow command log, finding
+ * an object still loaded doesn't.
+ */
+static void
+resource_manager_count_swaps_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    data->resource_manager->processing_swaps = 0;
+    resource_manager_count (data->resource_manager, COMMAND_STATS_CONTEXT_LOAD);
+    resource_manager_count (data->resource_manager, COMMAND_STATS_RESIDENT_HIT);
+    resource_manager_count (data->resource_manager, COMMAND_STATS_CONTEXT_SAVE);
+    resource_manager_count (data->resource_manager, COMMAND_STATS_CONTEXT_FLUSH);
+    assert_int_equal (data->resource_manager->processing_swaps, 3);
+}
+/*
+ * Flush an entry that has already had its context saved. The saved context
+ * is still good and so the RM should only flush the object: the
+ * __wrap_tpm2_context_saveflush function has no values to return and so the
+ * test would fail if it was called.
+ */
+static void
+resource_manager_flushsave_context_saved_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    TPM2_HANDLE vhandle = TPM2_HR_TRANSIENT + 0x1, phandle = TPM2_HR_TRANSIENT + 0x2;
+
+    entry = handle_map_entry_new (phandle, vhandle);
+    handle_map_entry_set_context_saved (entry, TRUE);
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    resource_manager_flushsave_context (entry, data->resource_manager);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    assert_true (handle_map_entry_get_context_saved (entry));
     g_object_unref (entry);
 }
 
@@ -373,6 +791,46 @@ resource_manager_virt_to_phys_test (void **state)
     assert_int_equal (phandle, handle_ret);
 
 }
+/*
+ * After a TPM reset the resident objects are forgotten without going to
+ * the TPM and the objects from before are refused, objects created after
+ * it are loaded as usual.
+ */
+static void
+resource_manager_tpm_reset_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry, *resident;
+    TPM2_HANDLE      phandle = TPM2_HR_TRANSIENT + 0x1, vhandle;
+    TSS2_RC         rc;
+
+    vhandle = tpm2_command_get_handle (data->command, 0);
+    entry = handle_map_entry_new (0, vhandle);
+    resident = handle_map_entry_new (phandle, vhandle + 1);
+    g_queue_push_head (data->resource_manager->transient_lru, resident);
+
+    resource_manager_tpm_reset (data->resource_manager);
+    assert_int_equal (g_queue_get_length (data->resource_manager->transient_lru),
+                      0);
+    rc = resource_manager_virt_to_phys (data->resource_manager,
+                                        data->command,
+                                        entry,
+                                        1);
+    assert_int_equal (rc, RM_RC (TPM2_RC_REFERENCE_H0 + 1));
+    assert_int_equal (tpm2_command_get_handle (data->command, 0), vhandle);
+
+    handle_map_entry_set_epoch (entry,
+                                data->resource_manager->reset_epoch);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, phandle);
+    rc = resource_manager_virt_to_phys (data->resource_manager,
+                                        data->command,
+                                        entry,
+                                        0);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0), phandle);
+    g_object_unref (entry);
+}
 /*
  */
 static void
@@ -380,7 +838,7 @@ resource_manager_load_handles_test(void **state)
 {
     test_data_t    *data = (test_data_t*)*state;
     HandleMapEntry *entry;
-    GSList         *entry_slist;
+    GSList         *entry_slist = NULL;
     HandleMap      *map;
     TPM2_HANDLE      phandles [3] = {
         TPM2_HR_TRANSIENT + 0xeb,
@@ -418,71 +876,1333 @@ resource_manager_load_handles_test(void **state)
     }
 }
 /*
- * This setup function calls the 'resource_manager_setup' function to create
- * the ResourceManager object etc. It then creates a Tpm2Response object
- * approprite for use in testing the 'get_cap_post_process' function.
+ * Plan a batch with 2 commands from a second connection around the command
+ * from the connection set up by resource_manager_setup_two_transient_handles.
+ * One of that command's objects is still resident so it's moved to the
+ * front and the commands from the second connection stay together and in
+ * order after it.
  */
-int
-resource_manager_setup_getcap (void **state)
+static void
+resource_manager_plan_batch_test (void **state)
 {
-    int setup_ret;
-    test_data_t *data = NULL;
-    size_t offset = 0, buf_size = 0;
-    uint8_t *buf = NULL;
-    TSS2_RC rc;
-    /* structures that define the Tpm2Response object used in GetCap tests */
-    TPMI_YES_NO yes_no = TPM2_NO;
-    TPMS_CAPABILITY_DATA cap_data = {
-        .capability = TPM2_CAP_TPM_PROPERTIES,
-        /* TPMU_CAPABILITIES, union type defined by 'capability' selector */
-        .data = {
-            /* TPML_TAGGED_TPM_PROPERTY */
-            .tpmProperties = {
-                .count = 1,
-                /* TPMS_TAGGED_PROPERTY */
-                .tpmProperty = {
-                    {
-                      .property = TPM2_PT_CONTEXT_GAP_MAX,
-                      .value = 0xff,
-                    }
-                }
-            }
-        }
-    };
+    test_data_t *data = (test_data_t*)*state;
+    HandleMap *map, *map_b;
+    HandleMapEntry *entry;
+    Connection *connection_b;
+    GIOStream *iostream;
+    Tpm2Command *commands_b [2];
+    GObject *objs [3];
+    gint client_fd;
+    size_t i;
 
-    setup_ret = resource_manager_setup (state);
-    if (setup_ret != 0) {
-        g_critical ("%s: resource_manager_setup failed", __func__);
-        return setup_ret;
+    map = connection_get_trans_map (data->connection);
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10,
+                                  data->vhandles [0]);
+    handle_map_insert (map, data->vhandles [0], entry);
+    g_object_unref (entry);
+    g_object_unref (map);
+
+    map_b = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection_b = connection_new (iostream, 11, map_b);
+    for (i = 0; i < 2; ++i) {
+        commands_b [i] = tpm2_command_new (connection_b,
+                                           calloc (1, TPM_HEADER_SIZE),
+                                           TPM_HEADER_SIZE,
+                                           (TPMA_CC){ 0, });
     }
-    data = (test_data_t*)*state;
-    buf_size = TPM2_MAX_RESPONSE_SIZE;
-    g_debug ("%s: sizeof buffer required for TPMS_CAPABILITY_DATA: 0x%zx",
-             __func__, offset);
+    objs [0] = G_OBJECT (commands_b [0]);
+    objs [1] = G_OBJECT (data->command);
+    objs [2] = G_OBJECT (commands_b [1]);
+    resource_manager_plan_batch (data->resource_manager, objs, 3);
+    assert_ptr_equal (objs [0], data->command);
+    assert_ptr_equal (objs [1], commands_b [0]);
+    assert_ptr_equal (objs [2], commands_b [1]);
 
-    buf = calloc (1, buf_size);
-    if (buf == NULL) {
-        g_critical ("%s: failed to allocate buffer: %s", __func__,
-                    strerror (errno));
-        return 1;
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (commands_b [i]);
     }
-    offset = TPM_HEADER_SIZE;
-    rc = Tss2_MU_BYTE_Marshal (yes_no, buf, buf_size, &offset);
-    if (rc != TSS2_RC_SUCCESS) {
-        g_critical ("%s: failed to marshal TPMI_YES_NO into response body, "
-                    "rc: 0x%" PRIx32, __func__, rc);
-        return 1;
+    g_object_unref (connection_b);
+    g_object_unref (iostream);
+    g_object_unref (map_b);
+}
+/*
+ * Plan a batch of commands from connections at localities 2, 0 and 2. The
+ * TPM is at locality 0 so that command goes first, then the two at
+ * locality 2 in the order they came in.
+ */
+static void
+resource_manager_plan_batch_locality_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *connections [3];
+    HandleMap *maps [3];
+    GIOStream *iostreams [3];
+    Tpm2Command *commands [3];
+    GObject *objs [3];
+    guint8 localities [3] = { 2, 0, 2 };
+    gint client_fd;
+    size_t i;
+
+    for (i = 0; i < 3; ++i) {
+        maps [i] = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostreams [i] = create_connection_iostream (&client_fd);
+        connections [i] = connection_new (iostreams [i], 20 + i, maps [i]);
+        connection_set_locality (connections [i], localities [i]);
+        commands [i] = tpm2_command_new (connections [i],
+                                         calloc (1, TPM_HEADER_SIZE),
+                                         TPM_HEADER_SIZE,
+                                         (TPMA_CC){ 0, });
+        objs [i] = G_OBJECT (commands [i]);
     }
-    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data, buf, buf_size, &offset);
-    if (rc != TSS2_RC_SUCCESS) {
-        g_critical ("%s: failed to marshal TPMS_CAPABILITY_DATA into response "
-                    "body, rc: 0x%" PRIx32, __func__, rc);
-        return 1;
+    assert_int_equal (tpm2_get_locality (data->tpm2), 0);
+    resource_manager_plan_batch (data->resource_manager, objs, 3);
+    assert_ptr_equal (objs [0], commands [1]);
+    assert_ptr_equal (objs [1], commands [0]);
+    assert_ptr_equal (objs [2], commands [2]);
+
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (commands [i]);
+        g_object_unref (connections [i]);
+        g_object_unref (iostreams [i]);
+        g_object_unref (maps [i]);
     }
-    rc = tpm2_header_init (buf,
-                           buf_size,
-                           TPM2_ST_NO_SESSIONS,
-                           offset,
+}
+/*
+ * The Tpm2 object used in these tests has never been initialized and so
+ * it can't report the TPM's capacity. The RM should fall back to the
+ * minimums required by the spec.
+ */
+static void
+resource_manager_init_limits_default_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (data->resource_manager->transient_max, 3);
+    assert_int_equal (data->resource_manager->session_max, 3);
+}
+/*
+ * Populate the fixed properties in the Tpm2 object as though they'd been
+ * read from a TPM with room for 7 objects and 5 sessions, but only 4
+ * active sessions. The RM should size its limits accordingly.
+ */
+static void
+resource_manager_init_limits_tpm_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPML_TAGGED_TPM_PROPERTY *props;
+
+    props = &data->tpm2->properties_fixed.data.tpmProperties;
+    props->count = 3;
+    props->tpmProperty [0].property = TPM2_PT_HR_TRANSIENT_MIN;
+    props->tpmProperty [0].value = 7;
+    props->tpmProperty [1].property = TPM2_PT_HR_LOADED_MIN;
+    props->tpmProperty [1].value = 5;
+    props->tpmProperty [2].property = TPM2_PT_ACTIVE_SESSIONS_MAX;
+    props->tpmProperty [2].value = 4;
+
+    resource_manager_init_limits (data->resource_manager);
+    assert_int_equal (data->resource_manager->transient_max, 7);
+    assert_int_equal (data->resource_manager->session_max, 4);
+}
+/*
+ * Make the provided entries resident, most recently used last, by running
+ * each through the virt_to_phys function with a physical handle already set.
+ */
+static void
+make_resident (test_data_t     *data,
+               HandleMapEntry **entries,
+               size_t           count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        resource_manager_virt_to_phys (data->resource_manager,
+                                       data->command,
+                                       entries [i],
+                                       0);
+    }
+}
+/*
+ * Fill the list of resident transients and then ask the RM to make room
+ * for one more. The least recently used entry must be the one that's
+ * saved & flushed.
+ */
+static void
+resource_manager_evict_transients_lru_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [3];
+    guint           evicted;
+    size_t          i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    make_resident (data, entries, 3);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    evicted = resource_manager_evict_transients (data->resource_manager,
+                                                 1,
+                                                 NULL);
+    assert_int_equal (evicted, 1);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]), 0);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]),
+                      TPM2_HR_TRANSIENT + 0x11);
+    assert_int_equal (handle_map_entry_get_phandle (entries [2]),
+                      TPM2_HR_TRANSIENT + 0x12);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Same as above but with the least recently used entry pinned by the
+ * current command. The next least recently used entry should be evicted
+ * in its place.
+ */
+static void
+resource_manager_evict_transients_pinned_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [3];
+    GSList         *pinned = NULL;
+    guint           evicted;
+    size_t          i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    make_resident (data, entries, 3);
+    pinned = g_slist_prepend (pinned, entries [0]);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    evicted = resource_manager_evict_transients (data->resource_manager,
+                                                 1,
+                                                 pinned);
+    assert_int_equal (evicted, 1);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]), 0);
+    g_slist_free (pinned);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Same as the LRU test but with the least recently used entry pinned by
+ * its client. The next least recently used entry should be evicted
+ * instead.
+ */
+static void
+resource_manager_evict_transients_client_pinned_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [3];
+    guint           evicted;
+    size_t          i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    make_resident (data, entries, 3);
+    handle_map_entry_set_pinned (entries [0], TRUE);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    evicted = resource_manager_evict_transients (data->resource_manager,
+                                                 1,
+                                                 NULL);
+    assert_int_equal (evicted, 1);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]), 0);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Same as the LRU test but with the least recently used entry used as a
+ * parent. The next least recently used entry should be evicted instead
+ * and the score of the parent spared halved.
+ */
+static void
+resource_manager_evict_transients_parent_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [3];
+    guint           evicted;
+    size_t          i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    make_resident (data, entries, 3);
+    handle_map_entry_set_parent_uses (entries [0], 2);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    evicted = resource_manager_evict_transients (data->resource_manager,
+                                                 1,
+                                                 NULL);
+    assert_int_equal (evicted, 1);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]), 0);
+    assert_int_equal (handle_map_entry_get_parent_uses (entries [0]), 1);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Same as the LRU test but with the least recently used entry slow to
+ * load again. The next least recently used entry, which costs less to
+ * reload, should be evicted instead and the score of the one spared
+ * halved.
+ */
+static void
+resource_manager_evict_transients_cost_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [3];
+    guint           evicted;
+    size_t          i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    make_resident (data, entries, 3);
+    handle_map_entry_note_load (entries [0], 4 * CONTEXT_LOAD_US_DEFAULT);
+    assert_int_equal (handle_map_entry_get_uses (entries [0]), 1);
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    evicted = resource_manager_evict_transients (data->resource_manager,
+                                                 1,
+                                                 NULL);
+    assert_int_equal (evicted, 1);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]), 0);
+    assert_int_equal (handle_map_entry_get_uses (entries [0]), 0);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * A shared object used often enough is made persistent: its transient
+ * copy is flushed and taken off the list of resident transients, and
+ * commands use the persistent handle. Once it isn't used as much anymore
+ * it's evicted from NV again.
+ */
+static void
+resource_manager_promote_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    ObjectShare    *share = object_share_new (1);
+    HandleMapEntry *backing;
+    GBytes         *key, *bytes;
+    guint           i;
+
+    g_object_set (resmgr, "object-share", share, NULL);
+    resource_manager_set_promotion (resmgr, 1, NULL);
+    backing = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10, 0);
+    handle_map_entry_set_context_saved (backing, TRUE);
+    key = g_bytes_new_static ("a", 1);
+    bytes = g_bytes_new_static ("b", 1);
+    assert_true (object_share_insert (share, key, backing, bytes));
+    for (i = 0; i < RESOURCE_MANAGER_PROMOTE_USES - 1; ++i) {
+        make_resident (data, &backing, 1);
+    }
+    assert_int_equal (resource_manager_promote (resmgr), 0);
+
+    for (i = 0; i < RESOURCE_MANAGER_PROMOTE_USES; ++i) {
+        make_resident (data, &backing, 1);
+    }
+    will_return (__wrap_tpm2_evict_control, TPM2_HR_TRANSIENT + 0x10);
+    will_return (__wrap_tpm2_evict_control, RESOURCE_MANAGER_PROMOTE_BASE);
+    will_return (__wrap_tpm2_evict_control, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_promote (resmgr), 1);
+    assert_int_equal (handle_map_entry_get_phandle (backing),
+                      RESOURCE_MANAGER_PROMOTE_BASE);
+    assert_true (g_queue_is_empty (resmgr->transient_lru));
+    make_resident (data, &backing, 1);
+    assert_int_equal (tpm2_command_get_handle (data->command, 0),
+                      RESOURCE_MANAGER_PROMOTE_BASE);
+    assert_true (g_queue_is_empty (resmgr->transient_lru));
+
+    will_return (__wrap_tpm2_evict_control, RESOURCE_MANAGER_PROMOTE_BASE);
+    will_return (__wrap_tpm2_evict_control, RESOURCE_MANAGER_PROMOTE_BASE);
+    will_return (__wrap_tpm2_evict_control, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_promote (resmgr), 0);
+    assert_int_equal (handle_map_entry_get_phandle (backing), 0);
+    assert_null (resmgr->promoted [0]);
+    g_bytes_unref (key);
+    g_bytes_unref (bytes);
+    g_object_unref (backing);
+    g_object_unref (share);
+}
+/*
+ * The persistent handle of a promoted object is only for the connections
+ * sharing it. A command naming it from the test connection, which holds no
+ * share, is refused without going to the TPM while the sharing connection
+ * may use it.
+ */
+static void
+resource_manager_promote_other_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry *backing, *entry;
+    Connection     *connection;
+    GIOStream      *iostream;
+    HandleMap      *map;
+    gint            client_fd;
+
+    backing = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10,
+                                    RESOURCE_MANAGER_PROMOTE_BASE);
+    resmgr->promoted [0] = g_object_ref (backing);
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, map);
+    entry = handle_map_entry_new_shared (TPM2_HR_TRANSIENT + 0x10, backing);
+    handle_map_insert (map, TPM2_HR_TRANSIENT + 0x10, entry);
+    g_object_unref (iostream);
+
+    tpm2_command_set_handle (data->command, RESOURCE_MANAGER_PROMOTE_BASE, 0);
+    assert_int_equal (resource_manager_promoted_check (resmgr, data->command),
+                      RM_RC (TPM2_RC_HANDLE + TPM2_RC_H + TPM2_RC_1));
+    /* the refusal is the response, nothing is sent to the TPM */
+    will_return (__wrap_sink_enqueue, data);
+    resource_manager_process_tpm2_command (resmgr, data->command);
+    assert_non_null (data->response);
+    data->response = NULL;
+
+    g_object_unref (data->command);
+    data->command = tpm2_command_new (connection,
+                                      calloc (1, TPM_HEADER_SIZE +
+                                              2 * sizeof (TPM2_HANDLE)),
+                                      TPM_HEADER_SIZE +
+                                      2 * sizeof (TPM2_HANDLE),
+                                      data->command_attrs);
+    tpm2_command_set_handle (data->command, RESOURCE_MANAGER_PROMOTE_BASE, 0);
+    assert_int_equal (resource_manager_promoted_check (resmgr, data->command),
+                      TSS2_RC_SUCCESS);
+
+    g_object_unref (entry);
+    g_object_unref (backing);
+    g_object_unref (map);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Build a TSS2_TABRMD_CC_PIN command for 'handle' from the test connection.
+ */
+static Tpm2Command*
+pin_command_new (test_data_t *data,
+                 TPM2_HANDLE  handle,
+                 TPMI_YES_NO  pin)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE) + sizeof (pin);
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (handle, buffer, size,
+                                                   &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT8_Marshal (pin, buffer, size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_NO_SESSIONS,
+                                        size, TSS2_TABRMD_CC_PIN),
+                      TSS2_RC_SUCCESS);
+    return tpm2_command_new (data->connection, buffer, size, (TPMA_CC){ 0, });
+}
+/*
+ * Send a TSS2_TABRMD_CC_PIN command and return the response code.
+ */
+static TSS2_RC
+pin_transient (test_data_t *data,
+               TPM2_HANDLE  handle,
+               TPMI_YES_NO  pin)
+{
+    Tpm2Command  *command;
+    Tpm2Response *response;
+    TSS2_RC       rc;
+
+    command = pin_command_new (data, handle, pin);
+    response = resource_manager_pin_transient (data->resource_manager,
+                                               command);
+    rc = tpm2_response_get_code (response);
+    g_object_unref (response);
+    g_object_unref (command);
+    return rc;
+}
+/*
+ * Pinning an object that isn't resident loads it. With a quota of one a
+ * second object can't be pinned until the first is unpinned, handles the
+ * connection doesn't have can't be pinned at all.
+ */
+static void
+resource_manager_pin_transient_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMap      *map = connection_peek_trans_map (data->connection);
+    HandleMapEntry *entries [2];
+    size_t          i;
+
+    for (i = 0; i < 2; ++i) {
+        entries [i] = handle_map_entry_new (0, TPM2_HR_TRANSIENT + 0x20 + i);
+        handle_map_insert (map, TPM2_HR_TRANSIENT + 0x20 + i, entries [i]);
+    }
+    assert_int_equal (pin_transient (data, TPM2_HR_TRANSIENT + 0x20, TPM2_YES),
+                      TSS2_RESMGR_RC_NOT_PERMITTED);
+    g_object_set (data->resource_manager, "pin-max", 1, NULL);
+
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (pin_transient (data, TPM2_HR_TRANSIENT + 0x20, TPM2_YES),
+                      TSS2_RC_SUCCESS);
+    assert_true (handle_map_entry_get_pinned (entries [0]));
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    assert_int_equal (pin_transient (data, TPM2_HR_TRANSIENT + 0x21, TPM2_YES),
+                      TSS2_RESMGR_RC_OBJECT_MEMORY);
+    assert_false (handle_map_entry_get_pinned (entries [1]));
+    assert_int_equal (pin_transient (data, TPM2_HR_TRANSIENT + 0x20, TPM2_NO),
+                      TSS2_RC_SUCCESS);
+    assert_false (handle_map_entry_get_pinned (entries [0]));
+    assert_int_equal (pin_transient (data, TPM2_HR_TRANSIENT + 0x30, TPM2_YES),
+                      RM_RC (TPM2_RC_HANDLE + TPM2_RC_P + TPM2_RC_1));
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Send a TSS2_TABRMD_CC_LEASE command for 'lease_ms' from 'connection',
+ * the test connection for lease_tpm, and return the response code.
+ */
+static TSS2_RC
+lease_tpm_connection (test_data_t *data,
+                      Connection  *connection,
+                      UINT32       lease_ms)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (lease_ms);
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+    Tpm2Command  *command;
+    Tpm2Response *response;
+    TSS2_RC       rc;
+
+    assert_int_equal (Tss2_MU_UINT32_Marshal (lease_ms, buffer, size,
+                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_NO_SESSIONS,
+                                        size, TSS2_TABRMD_CC_LEASE),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (connection, buffer, size, (TPMA_CC){ 0, });
+    response = resource_manager_lease (data->resource_manager, command);
+    rc = tpm2_response_get_code (response);
+    g_object_unref (response);
+    g_object_unref (command);
+    return rc;
+}
+static TSS2_RC
+lease_tpm (test_data_t *data,
+           UINT32       lease_ms)
+{
+    return lease_tpm_connection (data, data->connection, lease_ms);
+}
+/*
+ * Send a TSS2_TABRMD_CC_HASH command for 'size' bytes from the test
+ * connection with 'extra' more bytes than its size field says.
+ */
+static Tpm2Response*
+hash_data (test_data_t *data,
+           UINT32       size,
+           size_t       extra)
+{
+    size_t command_size = TPM_HEADER_SIZE + 10 + size + extra;
+    size_t offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, command_size);
+    Tpm2Command  *command;
+    Tpm2Response *response;
+
+    assert_int_equal (Tss2_MU_UINT16_Marshal (TPM2_ALG_SHA256, buffer,
+                                              command_size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (TPM2_RH_NULL, buffer,
+                                              command_size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (size, buffer, command_size,
+                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, command_size,
+                                        TPM2_ST_NO_SESSIONS, command_size,
+                                        TSS2_TABRMD_CC_HASH),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (data->connection, buffer, command_size,
+                                (TPMA_CC){ 0, });
+    response = resource_manager_hash (data->resource_manager, command);
+    g_object_unref (command);
+    return response;
+}
+/*
+ * The hash command hands its data to the hash sequence and answers with
+ * the digest and ticket, a size field that doesn't match the command is
+ * refused without going to the TPM.
+ */
+static void
+resource_manager_hash_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    TPM2B_DIGEST  digest = { 0, };
+    size_t        offset = TPM_HEADER_SIZE;
+
+    will_return (__wrap_tpm2_hash_sequence, 3000);
+    will_return (__wrap_tpm2_hash_sequence, TSS2_RC_SUCCESS);
+    response = hash_data (data, 3000, 0);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_DIGEST_Unmarshal (
+                          tpm2_response_get_buffer (response),
+                          tpm2_response_get_size (response),
+                          &offset,
+                          &digest),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (digest.size, TPM2_SHA256_DIGEST_SIZE);
+    g_object_unref (response);
+
+    response = hash_data (data, 16, 1);
+    assert_int_equal (tpm2_response_get_code (response),
+                      RM_RC (TPM2_RC_COMMAND_SIZE));
+    g_object_unref (response);
+}
+/*
+ * Send a TSS2_TABRMD_CC_NV_READ or TSS2_TABRMD_CC_NV_WRITE command for
+ * 'size' bytes at 'offset' of NV_INDEX from the test connection, with
+ * 'data_size' bytes of data after the parameters.
+ */
+static Tpm2Response*
+nv_command (test_data_t *data,
+            UINT32       command_code,
+            UINT16       offset,
+            UINT16       size,
+            size_t       data_size)
+{
+    TPM2B_AUTH auth = { .size = 4, .buffer = { 'a', 'u', 't', 'h' }, };
+    size_t command_size = TPM_HEADER_SIZE + 8 + 2 + auth.size + 4 +
+        data_size;
+    size_t buf_offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, command_size);
+    Tpm2Command  *command;
+    Tpm2Response *response;
+
+    assert_int_equal (Tss2_MU_UINT32_Marshal (NV_INDEX, buffer,
+                                              command_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (NV_INDEX, buffer,
+                                              command_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_AUTH_Marshal (&auth, buffer,
+                                                  command_size, &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT16_Marshal (offset, buffer, command_size,
+                                              &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT16_Marshal (size, buffer, command_size,
+                                              &buf_offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, command_size,
+                                        TPM2_ST_NO_SESSIONS, command_size,
+                                        command_code),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (data->connection, buffer, command_size,
+                                (TPMA_CC){ 0, });
+    response = resource_manager_nv (data->resource_manager, command);
+    g_object_unref (command);
+    return response;
+}
+/*
+ * NV reads come back with a UINT16 size and the data read, NV writes
+ * without parameters. Commands whose data doesn't match their size field
+ * are refused without going to the TPM.
+ */
+static void
+resource_manager_nv_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint8       *buffer;
+    size_t        offset = TPM_HEADER_SIZE;
+    UINT16        size = 0;
+
+    will_return (__wrap_tpm2_nv_read, 3000);
+    will_return (__wrap_tpm2_nv_read, TSS2_RC_SUCCESS);
+    response = nv_command (data, TSS2_TABRMD_CC_NV_READ, 0x22, 3000, 0);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_response_get_size (response),
+                      TPM_HEADER_SIZE + sizeof (UINT16) + 3000);
+    buffer = tpm2_response_get_buffer (response);
+    assert_int_equal (Tss2_MU_UINT16_Unmarshal (buffer,
+                                                tpm2_response_get_size (response),
+                                                &offset,
+                                                &size),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (size, 3000);
+    assert_int_equal (buffer [offset], 0x22);
+    assert_int_equal (buffer [offset + 2999], 0x22);
+    g_object_unref (response);
+
+    will_return (__wrap_tpm2_nv_write, 100);
+    will_return (__wrap_tpm2_nv_write, TPM2_RC_NV_LOCKED);
+    response = nv_command (data, TSS2_TABRMD_CC_NV_WRITE, 0, 100, 100);
+    assert_int_equal (tpm2_response_get_code (response), TPM2_RC_NV_LOCKED);
+    g_object_unref (response);
+
+    response = nv_command (data, TSS2_TABRMD_CC_NV_WRITE, 0, 100, 99);
+    assert_int_equal (tpm2_response_get_code (response),
+                      RM_RC (TPM2_RC_COMMAND_SIZE));
+    g_object_unref (response);
+    response = nv_command (data, TSS2_TABRMD_CC_NV_READ, 0, 100, 1);
+    assert_int_equal (tpm2_response_get_code (response),
+                      RM_RC (TPM2_RC_COMMAND_SIZE));
+    g_object_unref (response);
+}
+/*
+ * Leases are refused until lease-max-ms is set, and then cut to it. The
+ * connection owns the TPM until it gives the lease back.
+ */
+static void
+resource_manager_lease_test (void **state)
+{
+    test_data_t     *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+
+    assert_int_equal (lease_tpm (data, 500), RM_RC (TPM2_RC_DISABLED));
+    assert_null (resmgr->group_owner);
+    g_object_set (resmgr, "lease-max-ms", 1000, NULL);
+
+    assert_int_equal (lease_tpm (data, 5000), TSS2_RC_SUCCESS);
+    assert_ptr_equal (resmgr->group_owner, data->connection);
+    assert_int_equal (resmgr->lease_end - resmgr->lease_start,
+                      1000 * G_TIME_SPAN_MILLISECOND);
+    assert_int_equal (connection_get_count (data->connection,
+                                            COMMAND_STATS_LEASE),
+                      1);
+    assert_int_equal (lease_tpm (data, 0), TSS2_RC_SUCCESS);
+    assert_null (resmgr->group_owner);
+    assert_int_equal (resmgr->lease_end, 0);
+}
+/*
+ * A connection that doesn't hold the lease can neither give it back nor
+ * extend it.
+ */
+static void
+resource_manager_lease_other_test (void **state)
+{
+    test_data_t     *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    GIOStream       *iostream;
+    HandleMap       *map;
+    Connection      *connection;
+    gint64           lease_end;
+    gint             client_fd;
+
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, map);
+    g_object_unref (iostream);
+    g_object_unref (map);
+    g_object_set (resmgr, "lease-max-ms", 1000, NULL);
+
+    assert_int_equal (lease_tpm (data, 500), TSS2_RC_SUCCESS);
+    lease_end = resmgr->lease_end;
+    assert_int_equal (lease_tpm_connection (data, connection, 0),
+                      TSS2_RESMGR_RC_NOT_PERMITTED);
+    assert_int_equal (lease_tpm_connection (data, connection, 1000),
+                      TSS2_RESMGR_RC_NOT_PERMITTED);
+    assert_ptr_equal (resmgr->group_owner, data->connection);
+    assert_int_equal (resmgr->lease_end, lease_end);
+    assert_int_equal (lease_tpm (data, 0), TSS2_RC_SUCCESS);
+    assert_null (resmgr->group_owner);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * The TPM runs out of object memory for a command: the RM evicts an
+ * object of its own and sends the command again. A cancel from the
+ * client while the object is saved must not reach the TCTI, the mock
+ * one has no cancel function so that would be seen as
+ * TSS2_TCTI_RC_NOT_IMPLEMENTED.
+ */
+static void
+resource_manager_cancel_internal_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [2], *other;
+    HandleMap      *map;
+    Tpm2Response   *response;
+    size_t          i;
+
+    data->resource_manager->transient_max = 3;
+    other = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10,
+                                  TPM2_HR_TRANSIENT + 0x20);
+    make_resident (data, &other, 1);
+    map = connection_get_trans_map (data->connection);
+    for (i = 0; i < 2; ++i) {
+        entries [i] = handle_map_entry_new (0, data->vhandles [i]);
+        handle_map_insert (map, data->vhandles [i], entries [i]);
+    }
+    g_object_unref (map);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, TPM2_HR_TRANSIENT + 0xeb);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, TPM2_HR_TRANSIENT + 0xbe);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command,
+                 tpm2_response_new_rc (data->connection,
+                                       TPM2_RC_OBJECT_MEMORY));
+    will_return (__wrap_tpm2_context_saveflush, TSS2_RC_SUCCESS);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    cancel_data = data;
+    cancel_rc = TSS2_RC_LAYER_MASK;
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    cancel_data = NULL;
+    assert_int_equal (cancel_rc, TSS2_RC_SUCCESS);
+    assert_int_equal (data->response, response);
+    assert_int_equal (handle_map_entry_get_phandle (other), 0);
+    g_object_unref (response);
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (entries [i]);
+    }
+    g_object_unref (other);
+}
+/*
+ * Process a command with two transient handles. Both are loaded before the
+ * command is sent. Neither should be saved / flushed after the command is
+ * processed: the __wrap_tpm2_context_saveflush function has no values to
+ * return and so the test would fail if it was called.
+ */
+static void
+resource_manager_process_tpm2_command_resident_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [2];
+    HandleMap      *map;
+    Tpm2Response   *response;
+    size_t          i;
+
+    map = connection_get_trans_map (data->connection);
+    for (i = 0; i < 2; ++i) {
+        entries [i] = handle_map_entry_new (0, data->vhandles [i]);
+        handle_map_insert (map, data->vhandles [i], entries [i]);
+    }
+    g_object_unref (map);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, TPM2_HR_TRANSIENT + 0xeb);
+    will_return (__wrap_tpm2_context_load, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_load, TPM2_HR_TRANSIENT + 0xbe);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0xeb);
+    assert_int_equal (handle_map_entry_get_phandle (entries [1]),
+                      TPM2_HR_TRANSIENT + 0xbe);
+    g_object_unref (response);
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Process a command from the connection that owns a loaded session. The
+ * session should be left loaded: the only call to tpm2_send_command is
+ * the one for the command itself.
+ */
+static void
+resource_manager_process_tpm2_command_session_loaded_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    Tpm2Response *response;
+    guint8       *buffer;
+
+    entry = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    session_list_insert (data->resource_manager->session_list, entry);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (session_entry_get_state (entry), SESSION_ENTRY_LOADED);
+    g_object_unref (response);
+    g_object_unref (entry);
+}
+/*
+ * Process a command from a connection other than the one that owns a
+ * loaded session. The session must be saved before the command is sent to
+ * the TPM. The first call to tpm2_send_command is the ContextSave for the
+ * session, the second is the command itself.
+ */
+static void
+resource_manager_process_tpm2_command_session_other_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    Connection   *connection;
+    GIOStream    *iostream;
+    HandleMap    *handle_map;
+    Tpm2Response *response, *save_response;
+    guint8       *buffer;
+    gint          client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    entry = session_entry_new (connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    session_list_insert (data->resource_manager->session_list, entry);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    save_response = tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS);
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, save_response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    assert_int_equal (session_entry_get_state (entry), SESSION_ENTRY_SAVED_RM);
+    g_object_unref (response);
+    g_object_unref (entry);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * The RM only walks the sessions it knows to be loaded when deciding what
+ * to save. A loaded session inserted behind its back is found by a scan,
+ * once it's saved it's dropped from the loaded sessions and the next walk
+ * has nothing to look at.
+ */
+static void
+resource_manager_save_sessions_loaded_only_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    SessionEntry *entry;
+    Connection   *connection;
+    GIOStream    *iostream;
+    HandleMap    *handle_map;
+    Tpm2Response *save_response;
+    guint8       *buffer;
+    gint          client_fd;
+
+    handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    iostream = create_connection_iostream (&client_fd);
+    connection = connection_new (iostream, 11, handle_map);
+    g_object_unref (handle_map);
+    g_object_unref (iostream);
+    entry = session_entry_new (connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_state (entry, SESSION_ENTRY_LOADED);
+    session_list_insert (resmgr->session_list, entry);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    save_response = tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, save_response);
+
+    resource_manager_save_sessions (resmgr, data->command, FALSE);
+    assert_int_equal (session_entry_get_state (entry), SESSION_ENTRY_SAVED_RM);
+    assert_int_equal (g_slist_length (resmgr->loaded_sessions), 1);
+    /* nothing is loaded, no ContextSave is expected */
+    resource_manager_save_sessions (resmgr, data->command, TRUE);
+    assert_null (resmgr->loaded_sessions);
+    assert_int_equal (session_list_size (resmgr->session_list), 1);
+
+    g_object_unref (entry);
+    g_object_unref (connection);
+    close (client_fd);
+}
+/*
+ * Idle maintenance should save the context of resident transients that
+ * don't have one yet, without flushing them. Entries that already have a
+ * saved context are skipped.
+ */
+static void
+resource_manager_idle_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entries [2];
+    size_t          i;
+
+    for (i = 0; i < 2; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            TPM2_HR_TRANSIENT + 0x20 + i);
+    }
+    handle_map_entry_set_context_saved (entries [1], TRUE);
+    make_resident (data, entries, 2);
+    will_return (__wrap_tpm2_context_save, TSS2_RC_SUCCESS);
+
+    resource_manager_idle (data->resource_manager);
+    assert_true (handle_map_entry_get_context_saved (entries [0]));
+    assert_int_equal (handle_map_entry_get_phandle (entries [0]),
+                      TPM2_HR_TRANSIENT + 0x10);
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Create a saved session with a context sequence far enough behind the
+ * context counter to need re-gapping. The RM should load & save it: two
+ * calls to tpm2_send_command.
+ */
+static void
+resource_manager_regap_sessions_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    uint8_t       buf [sizeof (TPMS_CONTEXT)] = { 0 };
+    size_t        offset = 0;
+    TPMS_CONTEXT  context = {
+        .sequence = 1,
+        .savedHandle = TPM2_HMAC_SESSION_FIRST,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    guint         regapped;
+
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                                    buf,
+                                                    sizeof (buf),
+                                                    &offset),
+                      TSS2_RC_SUCCESS);
+    entry = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_context (entry, buf, offset);
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (data->resource_manager->session_list, entry);
+    data->resource_manager->gap_max = UINT8_MAX;
+    data->resource_manager->context_counter = 200;
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command,
+                 tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS));
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command,
+                 tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS));
+    regapped = resource_manager_regap_sessions (data->resource_manager);
+    assert_int_equal (regapped, 1);
+    assert_int_equal (session_entry_get_state (entry), SESSION_ENTRY_SAVED_RM);
+    g_object_unref (entry);
+}
+/*
+ * Re-gapping a session saved by the client must leave it in state
+ * SESSION_ENTRY_SAVED_CLIENT: when its connection is closed it's
+ * abandoned, not queued to be flushed.
+ */
+static void
+resource_manager_regap_sessions_client_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    uint8_t       buf [sizeof (TPMS_CONTEXT)] = { 0 };
+    size_t        offset = 0;
+    TPMS_CONTEXT  context = {
+        .sequence = 1,
+        .savedHandle = TPM2_HMAC_SESSION_FIRST,
+        .hierarchy = TPM2_RH_NULL,
+    };
+
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                                    buf,
+                                                    sizeof (buf),
+                                                    &offset),
+                      TSS2_RC_SUCCESS);
+    entry = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_context (entry, buf, offset);
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_CLIENT);
+    session_list_insert (data->resource_manager->session_list, entry);
+    data->resource_manager->gap_max = UINT8_MAX;
+    data->resource_manager->context_counter = 200;
+
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command,
+                 tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS));
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command,
+                 tpm2_response_new_rc (NULL, TSS2_RC_SUCCESS));
+    assert_int_equal (resource_manager_regap_sessions (data->resource_manager), 1);
+    assert_int_equal (session_entry_get_state (entry),
+                      SESSION_ENTRY_SAVED_CLIENT);
+
+    resource_manager_remove_connection (data->resource_manager,
+                                        data->connection);
+    assert_int_equal (session_entry_get_state (entry),
+                      SESSION_ENTRY_SAVED_CLIENT_CLOSED);
+    assert_int_equal (data->resource_manager->flush_queue->len, 0);
+    g_object_unref (entry);
+}
+/*
+ * A saved session with a recent context sequence doesn't need re-gapping.
+ * No commands should be sent to the TPM.
+ */
+static void
+resource_manager_regap_sessions_fresh_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    SessionEntry *entry;
+    uint8_t       buf [sizeof (TPMS_CONTEXT)] = { 0 };
+    size_t        offset = 0;
+    TPMS_CONTEXT  context = {
+        .sequence = 190,
+        .savedHandle = TPM2_HMAC_SESSION_FIRST,
+        .hierarchy = TPM2_RH_NULL,
+    };
+
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&context,
+                                                    buf,
+                                                    sizeof (buf),
+                                                    &offset),
+                      TSS2_RC_SUCCESS);
+    entry = session_entry_new (data->connection, TPM2_HMAC_SESSION_FIRST);
+    session_entry_set_context (entry, buf, offset);
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+    session_list_insert (data->resource_manager->session_list, entry);
+    data->resource_manager->gap_max = UINT8_MAX;
+    data->resource_manager->context_counter = 200;
+
+    assert_int_equal (resource_manager_regap_sessions (data->resource_manager), 0);
+    g_object_unref (entry);
+}
+/*
+ * After a command is processed the connection that sent it owns the loaded
+ * set. Removing the connection must clear the owner.
+ */
+static void
+resource_manager_owner_test (void **state)
+{
+    test_data_t  *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    guint8       *buffer;
+
+    assert_null (data->resource_manager->owner);
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    data->command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, (TPMA_CC){ 0, });
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_ptr_equal (data->resource_manager->owner, data->connection);
+    resource_manager_remove_connection (data->resource_manager,
+                                        data->connection);
+    assert_null (data->resource_manager->owner);
+    g_object_unref (response);
+}
+/*
+ * Removing a connection with an object resident in the TPM drops it from
+ * the resident list right away but leaves the FlushContext for later: the
+ * __wrap_tpm2_context_flush function has no value to return until the
+ * deferred flushes run.
+ */
+static void
+resource_manager_remove_connection_deferred_test (void **state)
+{
+    test_data_t     *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry  *entry;
+    TPM2_HANDLE      vhandle = TPM2_HR_TRANSIENT + 0x20;
+
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10, vhandle);
+    handle_map_insert (connection_peek_trans_map (data->connection),
+                       vhandle,
+                       entry);
+    make_resident (data, &entry, 1);
+    resource_manager_remove_connection (resmgr, data->connection);
+    assert_int_equal (g_queue_get_length (resmgr->transient_lru), 0);
+    assert_int_equal (handle_map_entry_get_phandle (entry), 0);
+    assert_int_equal (resmgr->flush_transients, 1);
+
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_flush_deferred (resmgr, G_MAXUINT), 1);
+    assert_int_equal (resmgr->flush_transients, 0);
+    assert_int_equal (resource_manager_flush_deferred (resmgr, G_MAXUINT), 0);
+    g_object_unref (entry);
+}
+/*
+ * Connections closed together are queued and removed in one go before
+ * the next command: nothing is dropped until resource_manager_remove_pending
+ * runs, then the resident objects of both are queued to be flushed and
+ * only those of the connection still open stay resident.
+ */
+static void
+resource_manager_remove_pending_test (void **state)
+{
+    test_data_t     *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    HandleMapEntry  *entries [3];
+    Connection      *connections [2];
+    HandleMap       *handle_map;
+    GIOStream       *iostream;
+    gint             client_fd [2];
+    size_t           i;
+
+    for (i = 0; i < 2; ++i) {
+        handle_map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+        iostream = create_connection_iostream (&client_fd [i]);
+        connections [i] = connection_new (iostream, 20 + i, handle_map);
+        g_object_unref (handle_map);
+        g_object_unref (iostream);
+    }
+    for (i = 0; i < 3; ++i) {
+        entries [i] = handle_map_entry_new (TPM2_HR_TRANSIENT + 0x10 + i,
+                                            data->vhandles [0]);
+        handle_map_insert (i < 2 ?
+                           connection_peek_trans_map (connections [i]) :
+                           connection_peek_trans_map (data->connection),
+                           data->vhandles [0],
+                           entries [i]);
+    }
+    make_resident (data, entries, 3);
+
+    resource_manager_queue_removal (resmgr, connections [0]);
+    resource_manager_queue_removal (resmgr, connections [1]);
+    assert_int_equal (g_queue_get_length (resmgr->transient_lru), 3);
+    assert_int_equal (resource_manager_remove_pending (resmgr), 2);
+    assert_int_equal (g_queue_get_length (resmgr->transient_lru), 1);
+    assert_ptr_equal (g_queue_peek_head (resmgr->transient_lru), entries [2]);
+    assert_int_equal (resmgr->flush_transients, 2);
+    assert_int_equal (resource_manager_remove_pending (resmgr), 0);
+
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_context_flush, TSS2_RC_SUCCESS);
+    assert_int_equal (resource_manager_flush_deferred (resmgr, G_MAXUINT), 2);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (connections [i]);
+        close (client_fd [i]);
+    }
+}
+/*
+ * Resetting a connection for a new client drops the saved transient
+ * objects of the previous one as well as ownership of the loaded set.
+ */
+static void
+resource_manager_reset_connection_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    HandleMap      *map;
+    TPM2_HANDLE     vhandle = TPM2_HR_TRANSIENT + 0x1;
+
+    map = connection_get_trans_map (data->connection);
+    entry = handle_map_entry_new (0, vhandle);
+    handle_map_entry_set_context_saved (entry, TRUE);
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (entry);
+    data->resource_manager->owner = g_object_ref (data->connection);
+
+    resource_manager_reset_connection (data->resource_manager,
+                                       data->connection);
+    assert_int_equal (handle_map_size (map), 0);
+    assert_null (data->resource_manager->owner);
+    g_object_unref (map);
+}
+/*
+ * This setup function calls the 'resource_manager_setup' function to create
+ * the ResourceManager object etc. It then creates a Tpm2Response object
+ * approprite for use in testing the 'get_cap_post_process' function.
+ */
+int
+resource_manager_setup_getcap (void **state)
+{
+    int setup_ret;
+    test_data_t *data = NULL;
+    size_t offset = 0, buf_size = 0;
+    uint8_t *buf = NULL;
+    TSS2_RC rc;
+    /* structures that define the Tpm2Response object used in GetCap tests */
+    TPMI_YES_NO yes_no = TPM2_NO;
+    TPMS_CAPABILITY_DATA cap_data = {
+        .capability = TPM2_CAP_TPM_PROPERTIES,
+        /* TPMU_CAPABILITIES, union type defined by 'capability' selector */
+        .data = {
+            /* TPML_TAGGED_TPM_PROPERTY */
+            .tpmProperties = {
+                .count = 1,
+                /* TPMS_TAGGED_PROPERTY */
+                .tpmProperty = {
+                    {
+                      .property = TPM2_PT_CONTEXT_GAP_MAX,
+                      .value = 0xff,
+                    }
+                }
+            }
+        }
+    };
+
+    setup_ret = resource_manager_setup (state);
+    if (setup_ret != 0) {
+        g_critical ("%s: resource_manager_setup failed", __func__);
+        return setup_ret;
+    }
+    data = (test_data_t*)*state;
+    buf_size = TPM2_MAX_RESPONSE_SIZE;
+    g_debug ("%s: sizeof buffer required for TPMS_CAPABILITY_DATA: 0x%zx",
+             __func__, offset);
+
+    buf = calloc (1, buf_size);
+    if (buf == NULL) {
+        g_critical ("%s: failed to allocate buffer: %s", __func__,
+                    strerror (errno));
+        return 1;
+    }
+    offset = TPM_HEADER_SIZE;
+    rc = Tss2_MU_BYTE_Marshal (yes_no, buf, buf_size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("%s: failed to marshal TPMI_YES_NO into response body, "
+                    "rc: 0x%" PRIx32, __func__, rc);
+        return 1;
+    }
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Marshal (&cap_data, buf, buf_size, &offset);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_critical ("%s: failed to marshal TPMS_CAPABILITY_DATA into response "
+                    "body, rc: 0x%" PRIx32, __func__, rc);
+        return 1;
+    }
+    rc = tpm2_header_init (buf,
+                           buf_size,
+                           TPM2_ST_NO_SESSIONS,
+                           offset,
                            TSS2_RC_SUCCESS);
     if (rc != TSS2_RC_SUCCESS) {
         g_critical ("%s: failed to initialize TPM2 Header, rc: 0x%" PRIx32,
@@ -534,6 +2254,464 @@ resource_manager_getcap_gap_max_test (void **state)
     /* verify property was modified by the RM */
     assert_int_equal (cap_data.data.tpmProperties.tpmProperty [0].value, UINT32_MAX);
 }
+/*
+ * Populate the snapshot of supported algorithms in the Tpm2 object and
+ * query it with a 'prop' in the middle of the list and a 'count' that
+ * doesn't reach the end. We should get the entries from 'prop' on and
+ * 'moreData' should be set.
+ */
+static void
+resource_manager_get_cap_fixed_algs_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPML_ALG_PROPERTY *algs = &data->tpm2->algorithms.data.algorithms;
+    TPMS_CAPABILITY_DATA cap_data = { 0 };
+    TPMI_YES_NO more_data = TPM2_NO;
+    gboolean ret;
+
+    data->tpm2->algorithms.capability = TPM2_CAP_ALGS;
+    algs->count = 4;
+    algs->algProperties [0].alg = TPM2_ALG_RSA;
+    algs->algProperties [1].alg = TPM2_ALG_SHA1;
+    algs->algProperties [2].alg = TPM2_ALG_HMAC;
+    algs->algProperties [3].alg = TPM2_ALG_AES;
+    data->tpm2->caps_fixed |= CAP_FIXED_BIT (TPM2_CAP_ALGS);
+
+    ret = get_cap_fixed (data->tpm2,
+                         TPM2_CAP_ALGS,
+                         TPM2_ALG_SHA1,
+                         2,
+                         &cap_data,
+                         &more_data);
+    assert_true (ret);
+    assert_int_equal (cap_data.capability, TPM2_CAP_ALGS);
+    assert_int_equal (cap_data.data.algorithms.count, 2);
+    assert_int_equal (cap_data.data.algorithms.algProperties [0].alg,
+                      TPM2_ALG_SHA1);
+    assert_int_equal (cap_data.data.algorithms.algProperties [1].alg,
+                      TPM2_ALG_HMAC);
+    assert_int_equal (more_data, TPM2_YES);
+
+    ret = get_cap_fixed (data->tpm2,
+                         TPM2_CAP_ALGS,
+                         TPM2_ALG_HMAC,
+                         TPM2_MAX_CAP_ALGS,
+                         &cap_data,
+                         &more_data);
+    assert_true (ret);
+    assert_int_equal (cap_data.data.algorithms.count, 2);
+    assert_int_equal (more_data, TPM2_NO);
+}
+/*
+ * Without a complete snapshot of the capability the query must be passed
+ * through to the TPM.
+ */
+static void
+resource_manager_get_cap_fixed_none_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPMS_CAPABILITY_DATA cap_data = { 0 };
+    TPMI_YES_NO more_data = TPM2_NO;
+
+    assert_false (get_cap_fixed (data->tpm2,
+                                 TPM2_CAP_COMMANDS,
+                                 TPM2_CC_FIRST,
+                                 TPM2_MAX_CAP_CC,
+                                 &cap_data,
+                                 &more_data));
+    assert_false (get_cap_fixed (data->tpm2,
+                                 TPM2_CAP_PCRS,
+                                 0,
+                                 1,
+                                 &cap_data,
+                                 &more_data));
+}
+/*
+ * Fixed TPM properties are answered up to the end of the TPM2_PT_FIXED
+ * group with 'moreData' set, and the TPM2_PT_CONTEXT_GAP_MAX property gets
+ * the same treatment as a response from the TPM. Queries for the
+ * TPM2_PT_VAR group go to the TPM.
+ */
+static void
+resource_manager_get_cap_fixed_props_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPML_TAGGED_TPM_PROPERTY *props;
+    TPMS_CAPABILITY_DATA cap_data = { 0 };
+    TPMI_YES_NO more_data = TPM2_NO;
+    gboolean ret;
+
+    data->tpm2->properties_fixed.capability = TPM2_CAP_TPM_PROPERTIES;
+    props = &data->tpm2->properties_fixed.data.tpmProperties;
+    props->count = 3;
+    props->tpmProperty [0].property = TPM2_PT_FAMILY_INDICATOR;
+    props->tpmProperty [1].property = TPM2_PT_CONTEXT_GAP_MAX;
+    props->tpmProperty [1].value = UINT8_MAX;
+    props->tpmProperty [2].property = TPM2_PT_PERMANENT;
+    data->tpm2->caps_fixed |= CAP_FIXED_BIT (TPM2_CAP_TPM_PROPERTIES);
+
+    ret = get_cap_fixed (data->tpm2,
+                         TPM2_CAP_TPM_PROPERTIES,
+                         TPM2_PT_FIXED,
+                         TPM2_MAX_TPM_PROPERTIES,
+                         &cap_data,
+                         &more_data);
+    assert_true (ret);
+    assert_int_equal (cap_data.data.tpmProperties.count, 2);
+    assert_int_equal (cap_data.data.tpmProperties.tpmProperty [1].value,
+                      UINT32_MAX);
+    assert_int_equal (more_data, TPM2_YES);
+
+    assert_false (get_cap_fixed (data->tpm2,
+                                 TPM2_CAP_TPM_PROPERTIES,
+                                 TPM2_PT_PERMANENT,
+                                 1,
+                                 &cap_data,
+                                 &more_data));
+}
+/*
+ * Handles from a cached list are returned from 'prop' on, at most 'count'
+ * of them with 'moreData' set when some are left out.
+ */
+static void
+resource_manager_get_cap_handles_list_test (void **state)
+{
+    TPM2_HANDLE persistent [] = {
+        TPM2_PERSISTENT_FIRST,
+        TPM2_PERSISTENT_FIRST + 1,
+        TPM2_PERSISTENT_FIRST + 0x10,
+    };
+    TPMS_CAPABILITY_DATA cap_data = { 0 };
+    GArray *handles;
+    UNUSED_PARAM(state);
+
+    handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    g_array_append_vals (handles, persistent, G_N_ELEMENTS (persistent));
+    assert_false (get_cap_handles_list (handles,
+                                        TPM2_PERSISTENT_FIRST,
+                                        TPM2_MAX_CAP_HANDLES,
+                                        &cap_data));
+    assert_int_equal (cap_data.capability, TPM2_CAP_HANDLES);
+    assert_int_equal (cap_data.data.handles.count, 3);
+    assert_true (get_cap_handles_list (handles,
+                                       TPM2_PERSISTENT_FIRST,
+                                       2,
+                                       &cap_data));
+    assert_int_equal (cap_data.data.handles.count, 2);
+    assert_int_equal (cap_data.data.handles.handle [1],
+                      TPM2_PERSISTENT_FIRST + 1);
+    assert_false (get_cap_handles_list (handles,
+                                        TPM2_PERSISTENT_FIRST + 2,
+                                        1,
+                                        &cap_data));
+    assert_int_equal (cap_data.data.handles.count, 1);
+    assert_int_equal (cap_data.data.handles.handle [0],
+                      TPM2_PERSISTENT_FIRST + 0x10);
+    g_array_unref (handles);
+}
+/*
+ * EvictControl drops the cached persistent handles but not the NV
+ * indices, Clear drops both.
+ */
+static void
+resource_manager_handle_list_update_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    TPM2_CC codes [] = { TPM2_CC_EvictControl, TPM2_CC_Clear, };
+    Tpm2Command *command;
+    guint8 *buffer;
+    size_t i;
+
+    resmgr->persistent_handles = g_array_new (FALSE, FALSE,
+                                              sizeof (TPM2_HANDLE));
+    resmgr->nv_handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    for (i = 0; i < G_N_ELEMENTS (codes); ++i) {
+        buffer = calloc (1, TPM_HEADER_SIZE);
+        assert_int_equal (tpm2_header_init (buffer, TPM_HEADER_SIZE,
+                                            TPM2_ST_NO_SESSIONS,
+                                            TPM_HEADER_SIZE, codes [i]),
+                          TSS2_RC_SUCCESS);
+        command = tpm2_command_new (data->connection, buffer,
+                                    TPM_HEADER_SIZE, codes [i]);
+        resource_manager_handle_list_update (resmgr, command);
+        g_object_unref (command);
+        assert_null (resmgr->persistent_handles);
+        if (i == 0) {
+            assert_non_null (resmgr->nv_handles);
+        }
+    }
+    assert_null (resmgr->nv_handles);
+}
+/*
+ * A successful HierarchyChangeAuth or HierarchyControl drops all cached
+ * primary objects: they were created under the old hierarchy
+ * authorization.
+ */
+static void
+resource_manager_primary_cache_update_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ResourceManager *resmgr = data->resource_manager;
+    TPM2_CC codes [] = {
+        TPM2_CC_HierarchyChangeAuth,
+        TPM2_CC_HierarchyControl,
+    };
+    TPMS_CONTEXT context = { .sequence = 0x42, .savedHandle = 0x80000000 };
+    guint8 resp [] = { 0x80, 0x02, 0x00, 0x00, 0x00, 0x0e,
+                       0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00 };
+    Tpm2Command *command;
+    Tpm2Response *response;
+    GBytes *bytes;
+    guint8 *buffer;
+    size_t i;
+
+    resmgr->primary_cache = primary_cache_new (1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    response = tpm2_response_new_rc (data->connection, TSS2_RC_SUCCESS);
+    for (i = 0; i < G_N_ELEMENTS (codes); ++i) {
+        assert_true (primary_cache_insert (resmgr->primary_cache,
+                                           "a",
+                                           &context,
+                                           bytes));
+        buffer = calloc (1, TPM_HEADER_SIZE);
+        assert_int_equal (tpm2_header_init (buffer, TPM_HEADER_SIZE,
+                                            TPM2_ST_NO_SESSIONS,
+                                            TPM_HEADER_SIZE, codes [i]),
+                          TSS2_RC_SUCCESS);
+        command = tpm2_command_new (data->connection, buffer,
+                                    TPM_HEADER_SIZE, (1 << 25) | codes [i]);
+        resource_manager_primary_cache_update (resmgr, command, response);
+        g_object_unref (command);
+        assert_int_equal (primary_cache_size (resmgr->primary_cache), 0);
+    }
+    g_object_unref (response);
+    g_bytes_unref (bytes);
+}
+/*
+ * A GetCapability response built from a snapshot must unmarshal back to
+ * the same parameters.
+ */
+static void
+resource_manager_build_cap_response_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Response *response;
+    TPMS_CAPABILITY_DATA cap_data = {
+        .capability = TPM2_CAP_ECC_CURVES,
+        .data.eccCurves = {
+            .count = 2,
+            .eccCurves = { TPM2_ECC_NIST_P256, TPM2_ECC_NIST_P384 },
+        },
+    }, cap_data_out = { 0 };
+    TPMI_YES_NO more_data = TPM2_YES;
+    uint8_t *buf;
+    size_t offset = TPM_HEADER_SIZE;
+    TSS2_RC rc;
+
+    response = build_cap_response (data->connection,
+                                   TPM2_CC_GetCapability,
+                                   &cap_data,
+                                   TPM2_NO);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    buf = tpm2_response_get_buffer (response);
+    rc = Tss2_MU_BYTE_Unmarshal (buf,
+                                 tpm2_response_get_size (response),
+                                 &offset,
+                                 &more_data);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (more_data, TPM2_NO);
+    rc = Tss2_MU_TPMS_CAPABILITY_DATA_Unmarshal (buf,
+                                                 tpm2_response_get_size (response),
+                                                 &offset,
+                                                 &cap_data_out);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (offset, tpm2_response_get_size (response));
+    assert_int_equal (cap_data_out.data.eccCurves.count, 2);
+    assert_int_equal (cap_data_out.data.eccCurves.eccCurves [1],
+                      TPM2_ECC_NIST_P384);
+    g_object_unref (response);
+}
+/*
+ * Commands that can be answered before they're queued for the RM: a
+ * GetCapability for a fixed capability is answered from the snapshot and
+ * a command too short for its handle area or with a command code the TPM
+ * doesn't implement gets an error. Anything else is left to the RM.
+ */
+static void
+resource_manager_command_preprocess_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPML_ECC_CURVE *curves = &data->tpm2->ecc_curves.data.eccCurves;
+    Tpm2Command *command;
+    Tpm2Response *response;
+    TPMA_CC attrs = TPM2_CC_GetCapability;
+    size_t size = TPM2_MAX_COMMAND_SIZE, offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+
+    data->tpm2->ecc_curves.capability = TPM2_CAP_ECC_CURVES;
+    curves->count = 1;
+    curves->eccCurves [0] = TPM2_ECC_NIST_P256;
+    data->tpm2->caps_fixed |= CAP_FIXED_BIT (TPM2_CAP_ECC_CURVES);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (TPM2_CAP_ECC_CURVES, buffer,
+                                              size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (TPM2_ECC_NONE, buffer, size,
+                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT32_Marshal (TPM2_MAX_ECC_CURVES, buffer,
+                                              size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_NO_SESSIONS,
+                                        offset, TPM2_CC_GetCapability),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (data->connection, buffer, offset, attrs);
+    assert_null (command_preprocess (NULL, command));
+    response = command_preprocess (data->tpm2, command);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_code (response), TSS2_RC_SUCCESS);
+    g_object_unref (response);
+    g_object_unref (command);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    assert_int_equal (tpm2_header_init (buffer, TPM_HEADER_SIZE,
+                                        TPM2_ST_NO_SESSIONS, TPM_HEADER_SIZE,
+                                        TPM2_CC_FlushContext),
+                      TSS2_RC_SUCCESS);
+    attrs = (1 << 25) | TPM2_CC_FlushContext;
+    command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE,
+                                attrs);
+    response = command_preprocess (data->tpm2, command);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_code (response),
+                      RM_RC (TPM2_RC_COMMAND_SIZE));
+    g_object_unref (response);
+    g_object_unref (command);
+
+    buffer = calloc (1, TPM_HEADER_SIZE);
+    assert_int_equal (tpm2_header_init (buffer, TPM_HEADER_SIZE,
+                                        TPM2_ST_NO_SESSIONS, TPM_HEADER_SIZE,
+                                        TPM2_CC_LAST + 1),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (data->connection, buffer, TPM_HEADER_SIZE, 0);
+    response = command_preprocess (data->tpm2, command);
+    assert_non_null (response);
+    assert_int_equal (tpm2_response_get_code (response),
+                      RM_RC (TPM2_RC_COMMAND_CODE));
+    g_object_unref (response);
+    g_object_unref (command);
+}
+/*
+ * Create a ReadPublic command without sessions for the provided vhandle.
+ */
+static Tpm2Command*
+read_public_command_new (Connection *connection,
+                         TPM2_HANDLE vhandle)
+{
+    guint8 *buffer;
+    size_t buffer_size = TPM_HEADER_SIZE + sizeof (TPM2_HANDLE);
+
+    buffer = calloc (1, buffer_size);
+    tpm2_header_init (buffer,
+                      buffer_size,
+                      TPM2_ST_NO_SESSIONS,
+                      buffer_size,
+                      TPM2_CC_ReadPublic);
+    *(TPM2_HANDLE*)(buffer + TPM_HEADER_SIZE) = htobe32 (vhandle);
+    return tpm2_command_new (connection,
+                             buffer,
+                             buffer_size,
+                             (1 << 25) + TPM2_CC_ReadPublic);
+}
+/*
+ * Send a ReadPublic command for a resident transient object through the
+ * RM. The response must be cached on the HandleMapEntry and a second
+ * ReadPublic command for the same vhandle must be answered from the cache
+ * without a call to tpm2_send_command.
+ */
+static void
+resource_manager_read_public_cache_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    HandleMap      *map;
+    Tpm2Command    *command;
+    Tpm2Response   *response, *response_cached;
+    GBytes         *cached;
+    guint8         *buffer;
+    size_t          buffer_size = TPM_HEADER_SIZE + 4;
+    TPM2_HANDLE     vhandle = TPM2_HR_TRANSIENT + 0x1;
+
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0xeb, vhandle);
+    map = connection_get_trans_map (data->connection);
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (map);
+
+    buffer = calloc (1, buffer_size);
+    tpm2_header_init (buffer,
+                      buffer_size,
+                      TPM2_ST_NO_SESSIONS,
+                      buffer_size,
+                      TSS2_RC_SUCCESS);
+    memcpy (buffer + TPM_HEADER_SIZE, "\x00\x01\x02\x03", 4);
+    response = tpm2_response_new (data->connection,
+                                  buffer,
+                                  buffer_size,
+                                  (1 << 25) + TPM2_CC_ReadPublic);
+    g_object_ref (response);
+    will_return (__wrap_tpm2_send_command, TSS2_RC_SUCCESS);
+    will_return (__wrap_tpm2_send_command, response);
+    will_return (__wrap_sink_enqueue, data);
+
+    data->command = read_public_command_new (data->connection, vhandle);
+    resource_manager_process_tpm2_command (data->resource_manager,
+                                           data->command);
+    assert_int_equal (data->response, response);
+    cached = handle_map_entry_get_public (entry);
+    assert_non_null (cached);
+    assert_int_equal (g_bytes_get_size (cached), buffer_size);
+    g_bytes_unref (cached);
+
+    command = read_public_command_new (data->connection, vhandle);
+    response_cached = resource_manager_read_public (data->resource_manager,
+                                                    command);
+    assert_non_null (response_cached);
+    assert_int_equal (tpm2_response_get_size (response_cached), buffer_size);
+    assert_memory_equal (tpm2_response_get_buffer (response_cached),
+                         tpm2_response_get_buffer (response),
+                         buffer_size);
+    g_object_unref (response_cached);
+    g_object_unref (command);
+    g_object_unref (response);
+    g_object_unref (entry);
+}
+/*
+ * ReadPublic for a vhandle with nothing cached, or for a handle that the
+ * RM doesn't know about, must go to the TPM.
+ */
+static void
+resource_manager_read_public_miss_test (void **state)
+{
+    test_data_t    *data = (test_data_t*)*state;
+    HandleMapEntry *entry;
+    HandleMap      *map;
+    TPM2_HANDLE     vhandle = TPM2_HR_TRANSIENT + 0x1;
+
+    entry = handle_map_entry_new (TPM2_HR_TRANSIENT + 0xeb, vhandle);
+    map = connection_get_trans_map (data->connection);
+    handle_map_insert (map, vhandle, entry);
+    g_object_unref (map);
+
+    data->command = read_public_command_new (data->connection, vhandle);
+    assert_null (resource_manager_read_public (data->resource_manager,
+                                               data->command));
+    g_object_unref (data->command);
+    data->command = read_public_command_new (data->connection, vhandle + 1);
+    assert_null (resource_manager_read_public (data->resource_manager,
+                                               data->command));
+    g_object_unref (entry);
+}
 int
 main (void)
 {
@@ -547,9 +2725,36 @@ main (void)
         cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_success_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_retry_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_closed_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_kernel_rm_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_resume_connection_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_expire_parked_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_enqueue_connection_removed_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_cancel_queued_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_count_swaps_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_saved_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_flushsave_context_same_entries_test,
                                          resource_manager_setup,
                                          resource_manager_teardown),
@@ -559,12 +2764,130 @@ main (void)
         cmocka_unit_test_setup_teardown (resource_manager_virt_to_phys_test,
                                          resource_manager_setup_two_transient_handles,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_tpm_reset_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_load_handles_test,
                                          resource_manager_setup_two_transient_handles,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_plan_batch_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_plan_batch_locality_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_init_limits_default_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_init_limits_tpm_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_lru_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_pinned_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_client_pinned_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_cost_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_evict_transients_parent_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_promote_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_promote_other_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_pin_transient_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_nv_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_hash_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_lease_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_lease_other_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_resident_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_cancel_internal_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_session_loaded_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_process_tpm2_command_session_other_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_save_sessions_loaded_only_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_idle_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_regap_sessions_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_regap_sessions_client_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_regap_sessions_fresh_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_owner_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_remove_connection_deferred_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_remove_pending_test,
+                                         resource_manager_setup_two_transient_handles,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_reset_connection_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
         cmocka_unit_test_setup_teardown (resource_manager_getcap_gap_max_test,
                                          resource_manager_setup_getcap,
                                          resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_get_cap_fixed_algs_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_get_cap_fixed_none_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test (resource_manager_get_cap_handles_list_test),
+        cmocka_unit_test_setup_teardown (resource_manager_handle_list_update_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_primary_cache_update_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_get_cap_fixed_props_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_build_cap_response_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_command_preprocess_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_read_public_cache_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
+        cmocka_unit_test_setup_teardown (resource_manager_read_public_miss_test,
+                                         resource_manager_setup,
+                                         resource_manager_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -5,13 +5,20 @@
  */
 #include <glib.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "connection.h"
+#include "handle-map.h"
+#include "tpm2-header.h"
 #include "util.h"
 #include "response-sink.h"
 
+#define RESPONSE_SIZE 4096
+#define OUTBOUND_MAX (4 * RESPONSE_SIZE)
+
 /**
  * Test to allocate and destroy a ResponseSink.
  */
@@ -26,11 +33,155 @@ response_sink_allocate_test (void **state)
     g_object_unref (sink);
 }
 
+typedef struct {
+    ResponseSink *sink;
+    Connection   *connection;
+    GIOStream    *iostream;
+    gint          client_fd;
+} test_data_t;
+
+static int
+response_sink_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    HandleMap *map;
+
+    data->sink = response_sink_new ();
+    g_object_set (data->sink, "max-outbound", OUTBOUND_MAX, NULL);
+    map = handle_map_new (TPM2_HT_TRANSIENT, MAX_ENTRIES_DEFAULT);
+    data->iostream = create_connection_iostream (&data->client_fd);
+    data->connection = connection_new (data->iostream, 0, map);
+    g_object_unref (map);
+    *state = data;
+    return 0;
+}
+static int
+response_sink_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->sink);
+    g_clear_object (&data->connection);
+    g_clear_object (&data->iostream);
+    close (data->client_fd);
+    free (data);
+    return 0;
+}
+/*
+ * Hand a response of RESPONSE_SIZE bytes for the test connection to the
+ * ResponseSink the way the ResourceManager would.
+ */
+static void
+response_sink_send_response (test_data_t *data)
+{
+    Tpm2Response *response;
+    guint8 *buffer = calloc (1, RESPONSE_SIZE);
+
+    assert_int_equal (tpm2_header_init (buffer, RESPONSE_SIZE,
+                                        TPM2_ST_NO_SESSIONS, RESPONSE_SIZE,
+                                        TSS2_RC_SUCCESS),
+                      TSS2_RC_SUCCESS);
+    response = tpm2_response_new (data->connection, buffer, RESPONSE_SIZE,
+                                  (TPMA_CC){ 0 });
+    connection_command_queued (data->connection);
+    response_sink_process_response (data->sink, response);
+    g_object_unref (response);
+}
+/*
+ * A response the socket has room for is written right away.
+ */
+static void
+response_sink_write_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 buffer [RESPONSE_SIZE];
+
+    response_sink_send_response (data);
+    assert_int_equal (response_sink_get_pending (data->sink), 0);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+    assert_int_equal (read (data->client_fd, buffer, sizeof (buffer)),
+                      RESPONSE_SIZE);
+}
+/*
+ * Responses the client doesn't read are queued without blocking. Once the
+ * client reads, flushing writes them out and the connection is no longer
+ * pending.
+ */
+static void
+response_sink_queue_flush_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 buffer [RESPONSE_SIZE];
+    ssize_t ret;
+
+    while (response_sink_get_pending (data->sink) == 0) {
+        response_sink_send_response (data);
+    }
+    assert_true (connection_get_queued (data->connection) > 0);
+    assert_false (connection_is_closed (data->connection));
+    do {
+        ret = read (data->client_fd, buffer, sizeof (buffer));
+        response_sink_flush (data->sink);
+    } while (ret > 0 && response_sink_get_pending (data->sink) > 0);
+    assert_int_equal (response_sink_get_pending (data->sink), 0);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+}
+/*
+ * A client that never reads is disconnected once more than 'max-outbound'
+ * bytes are waiting for it, and its queued responses are dropped.
+ */
+static void
+response_sink_outbound_max_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint i;
+
+    while (response_sink_get_pending (data->sink) == 0) {
+        response_sink_send_response (data);
+    }
+    for (i = 0; i < OUTBOUND_MAX / RESPONSE_SIZE; ++i) {
+        response_sink_send_response (data);
+    }
+    assert_true (connection_is_closed (data->connection));
+    assert_int_equal (response_sink_get_pending (data->sink), 0);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+}
+/*
+ * Responses waiting for a connection are dropped when it's removed.
+ */
+static void
+response_sink_connection_removed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    ControlMessage *msg;
+
+    while (response_sink_get_pending (data->sink) == 0) {
+        response_sink_send_response (data);
+    }
+    msg = control_message_new_with_object (CONNECTION_REMOVED,
+                                           G_OBJECT (data->connection));
+    assert_true (response_sink_process_control (data->sink, msg));
+    g_object_unref (msg);
+    assert_int_equal (response_sink_get_pending (data->sink), 0);
+    assert_int_equal (connection_get_queued (data->connection), 0);
+}
 int
 main (void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test (response_sink_allocate_test),
+        cmocka_unit_test_setup_teardown (response_sink_write_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_queue_flush_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_outbound_max_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
+        cmocka_unit_test_setup_teardown (response_sink_connection_removed_test,
+                                         response_sink_setup,
+                                         response_sink_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -9,6 +9,8 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <tss2/tss2_mu.h>
+
 #include "session-entry.h"
 #include "util.h"
 
@@ -81,10 +83,11 @@ static void
 session_entry_get_context_test (void **state)
 {
     test_data_t *data = (test_data_t*)*state;
-    size_buf_t *size_buf;
+    GBytes *context;
 
-    size_buf = session_entry_get_context (data->session_entry);
-    assert_non_null (size_buf);
+    context = session_entry_get_context (data->session_entry);
+    assert_non_null (context);
+    assert_int_equal (g_bytes_get_size (context), 0);
 }
 
 static void
@@ -107,6 +110,91 @@ session_entry_get_handle_test (void **state)
     handle = session_entry_get_handle (data->session_entry);
     assert_int_equal (handle, TEST_HANDLE);
 }
+/*
+ * A new SessionEntry has no saved context and so the sequence is 0. Once a
+ * marshaled TPMS_CONTEXT is set the sequence should be read back from it.
+ */
+static void
+session_entry_get_sequence_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t buf [sizeof (TPMS_CONTEXT)] = { 0 };
+    size_t offset = 0;
+    TPMS_CONTEXT context = {
+        .sequence = 0x0102030405060708,
+        .savedHandle = TEST_HANDLE,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    TSS2_RC rc;
+
+    assert_int_equal (session_entry_get_sequence (data->session_entry), 0);
+    rc = Tss2_MU_TPMS_CONTEXT_Marshal (&context, buf, sizeof (buf), &offset);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    session_entry_set_context (data->session_entry, buf, offset);
+    assert_true (session_entry_get_sequence (data->session_entry) ==
+                 context.sequence);
+}
+/*
+ * The first context set is also the client copy and the two share one
+ * blob of the size set. Once the RM saves a different context the client
+ * copy is kept, and saving the client's context again shares it again.
+ */
+static void
+session_entry_set_context_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t first [] = { 0x01, 0x02, 0x03 };
+    uint8_t second [] = { 0x04, 0x05, 0x06, 0x07 };
+    GBytes *context, *context_client;
+
+    session_entry_set_context (data->session_entry, first, sizeof (first));
+    context = session_entry_get_context (data->session_entry);
+    context_client = session_entry_get_context_client (data->session_entry);
+    assert_ptr_equal (context, context_client);
+    assert_int_equal (g_bytes_get_size (context), sizeof (first));
+
+    session_entry_set_context (data->session_entry, second, sizeof (second));
+    context = session_entry_get_context (data->session_entry);
+    context_client = session_entry_get_context_client (data->session_entry);
+    assert_true (context != context_client);
+    assert_int_equal (g_bytes_get_size (context), sizeof (second));
+    assert_memory_equal (g_bytes_get_data (context_client, NULL),
+                         first,
+                         sizeof (first));
+    assert_int_equal (session_entry_compare_on_context_client (
+                          data->session_entry, first, sizeof (first)), 0);
+    assert_int_not_equal (session_entry_compare_on_context_client (
+                              data->session_entry, first, 2), 0);
+
+    session_entry_set_context (data->session_entry, first, sizeof (first));
+    assert_ptr_equal (session_entry_get_context (data->session_entry),
+                      session_entry_get_context_client (data->session_entry));
+}
+/*
+ * Setting the client copy to the bytes of the RM's context, as restoring
+ * a session handed over does, shares the RM's blob. A different client
+ * copy gets a blob of its own.
+ */
+static void
+session_entry_set_context_client_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    uint8_t first [] = { 0x01, 0x02, 0x03 };
+    uint8_t second [] = { 0x04, 0x05, 0x06, 0x07 };
+
+    session_entry_set_context_client (data->session_entry,
+                                      second,
+                                      sizeof (second));
+    session_entry_set_context (data->session_entry, first, sizeof (first));
+    assert_true (session_entry_get_context (data->session_entry) !=
+                 session_entry_get_context_client (data->session_entry));
+
+    session_entry_set_context_client (data->session_entry,
+                                      first,
+                                      sizeof (first));
+    assert_ptr_equal (session_entry_get_context (data->session_entry),
+                      session_entry_get_context_client (data->session_entry));
+}
 
 gint
 main (void)
@@ -124,6 +212,15 @@ main (void)
         cmocka_unit_test_setup_teardown (session_entry_get_handle_test,
                                          session_entry_setup,
                                          session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_get_sequence_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_set_context_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
+        cmocka_unit_test_setup_teardown (session_entry_set_context_client_test,
+                                         session_entry_setup,
+                                         session_entry_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -307,6 +307,205 @@ session_list_claim_fail_test (void **state)
     g_clear_object (&entry);
 }
 
+/*
+ * Check that the per-connection counts follow entries as they're inserted,
+ * abandoned, claimed by another connection and removed.
+ */
+#define COUNT_HANDLE_1 (TPM2_HR_TRANSIENT + 1)
+#define COUNT_HANDLE_2 (TPM2_HR_TRANSIENT + 2)
+static void
+session_list_connection_count_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn0 = NULL, *conn1 = NULL;
+    SessionEntry *entry = NULL, *lookup = NULL;
+
+    conn0 = test_connection_new (CLAIM_CONNECTION_ID_0);
+    conn1 = test_connection_new (CLAIM_CONNECTION_ID_1);
+    entry = session_entry_new (conn0, COUNT_HANDLE_2);
+    assert_true (session_list_insert (data->session_list, entry));
+    g_clear_object (&entry);
+    entry = session_entry_new (conn0, COUNT_HANDLE_1);
+    assert_true (session_list_insert (data->session_list, entry));
+    /* a second entry with the same handle is refused */
+    lookup = session_entry_new (conn1, COUNT_HANDLE_1);
+    assert_false (session_list_insert (data->session_list, lookup));
+    g_clear_object (&lookup);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn0), 2);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn1), 0);
+
+    assert_true (session_list_abandon_handle (data->session_list,
+                                              conn0,
+                                              COUNT_HANDLE_1));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn0), 1);
+    assert_true (session_list_claim (data->session_list, entry, conn1));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn1), 1);
+    lookup = session_list_lookup_handle (data->session_list, COUNT_HANDLE_1);
+    assert_ptr_equal (lookup, entry);
+    g_clear_object (&lookup);
+
+    assert_true (session_list_remove_connection (data->session_list, conn0));
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn0), 0);
+    assert_null (session_list_lookup_handle (data->session_list,
+                                             COUNT_HANDLE_2));
+    session_list_remove (data->session_list, entry);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn1), 0);
+    assert_int_equal (session_list_size (data->session_list), 0);
+    g_clear_object (&entry);
+    g_clear_object (&conn0);
+    g_clear_object (&conn1);
+}
+/*
+ * PruneFunc that removes the entry it's passed from the SessionList, like
+ * the ResourceManager does after flushing it.
+ */
+static gboolean
+session_list_prune_remove (SessionEntry *entry,
+                           gpointer      data)
+{
+    session_list_remove (SESSION_LIST (data), entry);
+    return TRUE;
+}
+/*
+ * Abandon three sessions, claim the middle one and then prune: the oldest
+ * abandoned session goes first and the claimed one is left alone. The
+ * test uses its own SessionList so that it can keep one abandoned session.
+ */
+#define PRUNE_HANDLE_0 (TPM2_HR_TRANSIENT + 0x10)
+#define PRUNE_HANDLE_1 (TPM2_HR_TRANSIENT + 0x11)
+#define PRUNE_HANDLE_2 (TPM2_HR_TRANSIENT + 0x12)
+static void
+session_list_claim_prune_test (void **state)
+{
+    TPM2_HANDLE handles [] = { PRUNE_HANDLE_0, PRUNE_HANDLE_1, PRUNE_HANDLE_2 };
+    Connection *conn0 = NULL, *conn1 = NULL;
+    SessionEntry *entry = NULL;
+    SessionList *list;
+    size_t i;
+
+    list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT, 1);
+    conn0 = test_connection_new (CLAIM_CONNECTION_ID_0);
+    conn1 = test_connection_new (CLAIM_CONNECTION_ID_1);
+    for (i = 0; i < G_N_ELEMENTS (handles); ++i) {
+        entry = session_entry_new (conn0, handles [i]);
+        assert_true (session_list_insert (list, entry));
+        g_clear_object (&entry);
+        assert_true (session_list_abandon_handle (list, conn0, handles [i]));
+    }
+    entry = session_list_lookup_handle (list, PRUNE_HANDLE_1);
+    assert_true (session_list_claim (list, entry, conn1));
+    assert_int_equal (g_queue_get_length (list->abandoned_queue), 2);
+    /* claiming it a second time finds it through the connection instead */
+    assert_true (session_list_claim (list, entry, conn1));
+    assert_int_equal (session_list_connection_count (list, conn1), 1);
+
+    assert_true (session_list_prune_abandoned (list,
+                                               session_list_prune_remove,
+                                               list));
+    assert_null (session_list_lookup_handle (list, PRUNE_HANDLE_0));
+    assert_int_equal (session_list_size (list), 2);
+    /* one abandoned session left, that's within 'max_abandoned' */
+    assert_true (session_list_prune_abandoned (list,
+                                               session_list_prune_remove,
+                                               list));
+    assert_int_equal (session_list_size (list), 2);
+    assert_null (entry->abandoned_link.data);
+
+    g_clear_object (&list);
+    assert_null (entry->connection_link.data);
+    g_clear_object (&entry);
+    g_clear_object (&conn0);
+    g_clear_object (&conn1);
+    UNUSED_PARAM (state);
+}
+/*
+ * Dropping an abandoned session doesn't depend on 'max_abandoned': the
+ * oldest goes first, then FALSE once there are none left. Abandoned
+ * entries know how long ago they were abandoned.
+ */
+static void
+session_list_drop_abandoned_test (void **state)
+{
+    TPM2_HANDLE handles [] = { PRUNE_HANDLE_0, PRUNE_HANDLE_1 };
+    Connection *conn = NULL;
+    SessionEntry *entry = NULL;
+    SessionList *list;
+    size_t i;
+
+    list = session_list_new (SESSION_LIST_MAX_ENTRIES_DEFAULT,
+                             SESSION_LIST_MAX_ABANDONED_MAX);
+    conn = test_connection_new (CLAIM_CONNECTION_ID_0);
+    for (i = 0; i < G_N_ELEMENTS (handles); ++i) {
+        entry = session_entry_new (conn, handles [i]);
+        assert_int_equal (session_entry_get_abandoned_age (entry), 0);
+        assert_true (session_list_insert (list, entry));
+        g_clear_object (&entry);
+        assert_true (session_list_abandon_handle (list, conn, handles [i]));
+    }
+    entry = session_list_lookup_handle (list, PRUNE_HANDLE_1);
+    assert_true (session_entry_get_abandoned_age (entry) >= 0);
+    assert_non_null (entry->abandoned_link.data);
+    g_clear_object (&entry);
+
+    assert_true (session_list_drop_abandoned (list,
+                                              session_list_prune_remove,
+                                              list));
+    assert_null (session_list_lookup_handle (list, PRUNE_HANDLE_0));
+    assert_int_equal (session_list_size (list), 1);
+    assert_true (session_list_drop_abandoned (list,
+                                              session_list_prune_remove,
+                                              list));
+    assert_int_equal (session_list_size (list), 0);
+    assert_false (session_list_drop_abandoned (list,
+                                               session_list_prune_remove,
+                                               list));
+
+    g_clear_object (&list);
+    g_clear_object (&conn);
+    UNUSED_PARAM (state);
+}
+
+/*
+ * Moving the entries of a connection to another one leaves their state
+ * alone and empties the bucket of the first.
+ */
+static void
+session_list_move_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Connection *conn0 = NULL, *conn1 = NULL;
+    SessionEntry *entry = NULL;
+
+    conn0 = test_connection_new (CLAIM_CONNECTION_ID_0);
+    conn1 = test_connection_new (CLAIM_CONNECTION_ID_1);
+    entry = session_entry_new (conn0, COUNT_HANDLE_1);
+    assert_true (session_list_insert (data->session_list, entry));
+    g_clear_object (&entry);
+    entry = session_entry_new (conn0, COUNT_HANDLE_2);
+    assert_true (session_list_insert (data->session_list, entry));
+    session_entry_set_state (entry, SESSION_ENTRY_SAVED_RM);
+
+    assert_int_equal (session_list_move_connection (data->session_list,
+                                                    conn0,
+                                                    conn1), 2);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn0), 0);
+    assert_int_equal (session_list_connection_count (data->session_list,
+                                                     conn1), 2);
+    assert_int_equal (session_entry_get_state (entry), SESSION_ENTRY_SAVED_RM);
+    assert_int_equal (session_list_move_connection (data->session_list,
+                                                    conn0,
+                                                    conn1), 0);
+    g_clear_object (&entry);
+    g_clear_object (&conn0);
+    g_clear_object (&conn1);
+}
 gint
 main (void)
 {
@@ -344,6 +543,18 @@ main (void)
         cmocka_unit_test_setup_teardown (session_list_claim_fail_test,
                                          session_list_setup,
                                          session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_connection_count_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_claim_prune_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_drop_abandoned_test,
+                                         session_list_setup,
+                                         session_list_teardown),
+        cmocka_unit_test_setup_teardown (session_list_move_connection_test,
+                                         session_list_setup,
+                                         session_list_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
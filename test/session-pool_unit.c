@@ -0,0 +1,281 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_mu.h>
+
+#include "session-pool.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define POOL_SIZE 2
+#define START_AUTH_SESSION_ATTRS \
+    ((2 << 25) | TPMA_CC_RHANDLE | TPM2_CC_StartAuthSession)
+
+typedef struct {
+    SessionPool *pool;
+} test_data_t;
+
+static int
+session_pool_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->pool = session_pool_new (POOL_SIZE);
+    *state = data;
+    return 0;
+}
+static int
+session_pool_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->pool);
+    free (data);
+    return 0;
+}
+/*
+ * Build a StartAuthSession command without sessions for a session of type
+ * 'session_type' salted with 'salt_size' bytes and bound to 'bind'. The
+ * nonceCaller is 'nonce_size' bytes of 'nonce'.
+ */
+static Tpm2Command*
+start_auth_session_command_new (TPM2_HANDLE bind,
+                                UINT16      salt_size,
+                                TPM2_SE     session_type,
+                                UINT16      nonce_size,
+                                guint8      nonce)
+{
+    TPM2B_NONCE nonce_caller = { .size = nonce_size, };
+    TPM2B_ENCRYPTED_SECRET salt = { .size = salt_size, };
+    size_t size = TPM2_MAX_COMMAND_SIZE, offset = TPM_HEADER_SIZE;
+    guint8 *buffer = calloc (1, size);
+
+    memset (nonce_caller.buffer, nonce, nonce_size);
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (TPM2_RH_NULL, buffer,
+                                                   size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (bind, buffer, size,
+                                                   &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_NONCE_Marshal (&nonce_caller, buffer,
+                                                   size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2B_ENCRYPTED_SECRET_Marshal (&salt, buffer,
+                                                              size, &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPM2_SE_Marshal (session_type, buffer, size,
+                                               &offset),
+                      TSS2_RC_SUCCESS);
+    /* symmetric: TPM2_ALG_NULL, authHash: TPM2_ALG_SHA256 */
+    assert_int_equal (Tss2_MU_UINT16_Marshal (TPM2_ALG_NULL, buffer, size,
+                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_UINT16_Marshal (TPM2_ALG_SHA256, buffer, size,
+                                              &offset),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_NO_SESSIONS,
+                                        offset, TPM2_CC_StartAuthSession),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, offset, START_AUTH_SESSION_ATTRS);
+}
+/*
+ * Create a saved session with the provided handle whose context has the
+ * provided sequence.
+ */
+static SessionEntry*
+saved_session_new (TPM2_HANDLE handle,
+                   guint64     sequence)
+{
+    SessionEntry *entry = session_entry_new (NULL, handle);
+    guint8 context [sizeof (UINT64) + sizeof (TPM2_HANDLE)] = { 0, };
+    size_t offset = 0;
+
+    assert_int_equal (Tss2_MU_UINT64_Marshal (sequence, context,
+                                              sizeof (context), &offset),
+                      TSS2_RC_SUCCESS);
+    session_entry_set_context (entry, context, sizeof (context));
+    return entry;
+}
+static void
+session_pool_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_SESSION_POOL (data->pool));
+    assert_int_equal (session_pool_get_level (data->pool), 0);
+    assert_int_equal (session_pool_get_space (data->pool), POOL_SIZE);
+}
+/*
+ * StartAuthSession commands differing only in the bytes of nonceCaller get
+ * the same key, another nonce size gets a different one. Salted, bound
+ * and policy sessions aren't pooled.
+ */
+static void
+session_pool_key_test (void **state)
+{
+    Tpm2Command *commands [6];
+    GBytes *key_a, *key_b, *key_c;
+    size_t i;
+    UNUSED_PARAM(state);
+
+    commands [0] = start_auth_session_command_new (TPM2_RH_NULL, 0,
+                                                   TPM2_SE_HMAC, 32, 0x01);
+    commands [1] = start_auth_session_command_new (TPM2_RH_NULL, 0,
+                                                   TPM2_SE_HMAC, 32, 0x02);
+    commands [2] = start_auth_session_command_new (TPM2_RH_NULL, 0,
+                                                   TPM2_SE_HMAC, 16, 0x01);
+    commands [3] = start_auth_session_command_new (TPM2_RH_NULL, 0,
+                                                   TPM2_SE_POLICY, 32, 0x01);
+    commands [4] = start_auth_session_command_new (TPM2_RH_NULL, 16,
+                                                   TPM2_SE_HMAC, 32, 0x01);
+    commands [5] = start_auth_session_command_new (TPM2_RH_OWNER, 0,
+                                                   TPM2_SE_HMAC, 32, 0x01);
+    key_a = session_pool_key (commands [0]);
+    key_b = session_pool_key (commands [1]);
+    key_c = session_pool_key (commands [2]);
+    assert_non_null (key_a);
+    assert_non_null (key_c);
+    assert_true (g_bytes_equal (key_a, key_b));
+    assert_false (g_bytes_equal (key_a, key_c));
+    assert_null (session_pool_key (commands [3]));
+    assert_null (session_pool_key (commands [4]));
+    assert_null (session_pool_key (commands [5]));
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    g_bytes_unref (key_c);
+    for (i = 0; i < G_N_ELEMENTS (commands); ++i) {
+        g_object_unref (commands [i]);
+    }
+}
+/*
+ * The template command is a copy of the last one set, with its key.
+ */
+static void
+session_pool_template_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command, *template;
+    GBytes *key, *template_key = NULL;
+
+    assert_null (session_pool_template_command (data->pool, &template_key));
+    command = start_auth_session_command_new (TPM2_RH_NULL, 0, TPM2_SE_HMAC,
+                                              32, 0x01);
+    key = session_pool_key (command);
+    session_pool_set_template (data->pool, key, command);
+    template = session_pool_template_command (data->pool, &template_key);
+    assert_non_null (template);
+    assert_true (g_bytes_equal (key, template_key));
+    assert_int_equal (tpm2_command_get_size (template),
+                      tpm2_command_get_size (command));
+    assert_memory_equal (tpm2_command_get_buffer (template),
+                         tpm2_command_get_buffer (command),
+                         tpm2_command_get_size (command));
+    assert_int_equal (tpm2_command_get_attributes (template),
+                      START_AUTH_SESSION_ATTRS);
+    g_bytes_unref (template_key);
+    g_bytes_unref (key);
+    g_object_unref (template);
+    g_object_unref (command);
+}
+/*
+ * Pooled sessions are taken once each, oldest first, and only for their
+ * key. Sessions beyond the size of the pool aren't added.
+ */
+static void
+session_pool_add_take_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    SessionEntry *entries [3], *taken;
+    GBytes *key_a, *key_b, *bytes, *bytes_out = NULL;
+    size_t i;
+
+    for (i = 0; i < 3; ++i) {
+        entries [i] = saved_session_new (TPM2_HMAC_SESSION_FIRST + i, i + 1);
+    }
+    key_a = g_bytes_new_static ("a", 1);
+    key_b = g_bytes_new_static ("b", 1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    assert_true (session_pool_add (data->pool, key_a, entries [0], bytes));
+    assert_true (session_pool_add (data->pool, key_a, entries [1], bytes));
+    assert_false (session_pool_add (data->pool, key_a, entries [2], bytes));
+    assert_int_equal (session_pool_get_space (data->pool), 0);
+
+    assert_null (session_pool_take (data->pool, key_b, &bytes_out));
+    taken = session_pool_take (data->pool, key_a, &bytes_out);
+    assert_ptr_equal (taken, entries [0]);
+    assert_true (g_bytes_equal (bytes, bytes_out));
+    g_bytes_unref (bytes_out);
+    g_object_unref (taken);
+    taken = session_pool_take (data->pool, key_a, &bytes_out);
+    assert_ptr_equal (taken, entries [1]);
+    g_bytes_unref (bytes_out);
+    g_object_unref (taken);
+    assert_null (session_pool_take (data->pool, key_a, &bytes_out));
+    assert_int_equal (session_pool_get_level (data->pool), 0);
+    g_bytes_unref (bytes);
+    g_bytes_unref (key_a);
+    g_bytes_unref (key_b);
+    for (i = 0; i < 3; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+/*
+ * Only sessions saved at or before the provided sequence are stale.
+ */
+static void
+session_pool_take_stale_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint8 resp [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                       0x00, 0x00, 0x00, 0x00 };
+    SessionEntry *entries [2], *taken;
+    GBytes *key, *bytes;
+    size_t i;
+
+    entries [0] = saved_session_new (TPM2_HMAC_SESSION_FIRST, 20);
+    entries [1] = saved_session_new (TPM2_HMAC_SESSION_FIRST + 1, 10);
+    key = g_bytes_new_static ("a", 1);
+    bytes = g_bytes_new (resp, sizeof (resp));
+    for (i = 0; i < 2; ++i) {
+        assert_true (session_pool_add (data->pool, key, entries [i], bytes));
+    }
+    assert_null (session_pool_take_stale (data->pool, 9));
+    taken = session_pool_take_stale (data->pool, 15);
+    assert_ptr_equal (taken, entries [1]);
+    g_object_unref (taken);
+    assert_null (session_pool_take_stale (data->pool, 15));
+    assert_int_equal (session_pool_get_level (data->pool), 1);
+    g_bytes_unref (bytes);
+    g_bytes_unref (key);
+    for (i = 0; i < 2; ++i) {
+        g_object_unref (entries [i]);
+    }
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (session_pool_type_test,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test (session_pool_key_test),
+        cmocka_unit_test_setup_teardown (session_pool_template_test,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test_setup_teardown (session_pool_add_take_test,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+        cmocka_unit_test_setup_teardown (session_pool_take_stale_test,
+                                         session_pool_setup,
+                                         session_pool_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "shm-ring.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+static guint8 message [] = { 0x80, 0x01,
+                             0x00, 0x00, 0x00, 0x0e,
+                             0x00, 0x00, 0x01, 0x7b,
+                             0x01, 0x02, 0x03, 0x04 };
+
+static int
+shm_ring_setup (void **state)
+{
+    *state = g_new0 (shm_ring_t, 1);
+    return 0;
+}
+static int
+shm_ring_teardown (void **state)
+{
+    g_free (*state);
+    return 0;
+}
+/*
+ * A message written to the ring is read back whole, after which the ring
+ * is empty again.
+ */
+static void
+shm_ring_write_read_test (void **state)
+{
+    shm_ring_t *ring = (shm_ring_t*)*state;
+    guint8 buf [sizeof (message)] = { 0 };
+
+    assert_true (shm_ring_is_empty (ring));
+    assert_int_equal (shm_ring_next_size (ring), 0);
+    assert_true (shm_ring_write (ring, message, sizeof (message)));
+    assert_false (shm_ring_is_empty (ring));
+    assert_int_equal (shm_ring_next_size (ring), sizeof (message));
+    assert_true (shm_ring_read (ring, buf, sizeof (message)));
+    assert_memory_equal (buf, message, sizeof (message));
+    assert_true (shm_ring_is_empty (ring));
+}
+/*
+ * Messages are copied across the end of the ring, and across the point
+ * where the counters wrap.
+ */
+static void
+shm_ring_wrap_test (void **state)
+{
+    shm_ring_t *ring = (shm_ring_t*)*state;
+    guint8 buf [sizeof (message)] = { 0 };
+
+    ring->head = ring->tail = (gint)(G_MAXUINT32 - 5);
+    assert_true (shm_ring_write (ring, message, sizeof (message)));
+    assert_int_equal (shm_ring_next_size (ring), sizeof (message));
+    assert_true (shm_ring_read (ring, buf, sizeof (message)));
+    assert_memory_equal (buf, message, sizeof (message));
+    assert_true (shm_ring_is_empty (ring));
+}
+/*
+ * A ring with only part of a message in it has no message to read yet.
+ * Writes that don't fit leave the ring as it was.
+ */
+static void
+shm_ring_partial_full_test (void **state)
+{
+    shm_ring_t *ring = (shm_ring_t*)*state;
+    size_t count = 0;
+
+    assert_true (shm_ring_write (ring, message, TPM_HEADER_SIZE - 1));
+    assert_int_equal (shm_ring_next_size (ring), 0);
+    assert_true (shm_ring_write (ring, &message [TPM_HEADER_SIZE - 1], 1));
+    assert_int_equal (shm_ring_next_size (ring), 0);
+    assert_true (shm_ring_write (ring, &message [TPM_HEADER_SIZE],
+                                 sizeof (message) - TPM_HEADER_SIZE));
+    assert_int_equal (shm_ring_next_size (ring), sizeof (message));
+
+    while (shm_ring_write (ring, message, sizeof (message))) {
+        ++count;
+    }
+    assert_int_equal (count, SHM_RING_SIZE / sizeof (message) - 1);
+    assert_int_equal ((guint32)ring->head,
+                      (count + 1) * sizeof (message));
+}
+/*
+ * The other side of a ring may be a process we don't trust: counters more
+ * than a ring apart or a bogus size in a header are reported as such.
+ */
+static void
+shm_ring_corrupt_test (void **state)
+{
+    shm_ring_t *ring = (shm_ring_t*)*state;
+    guint8 bad [TPM_HEADER_SIZE] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x04, };
+
+    ring->head = SHM_RING_SIZE + 1;
+    assert_int_equal (shm_ring_next_size (ring), -1);
+    assert_false (shm_ring_write (ring, message, sizeof (message)));
+    ring->head = ring->tail = 0;
+    assert_true (shm_ring_write (ring, bad, sizeof (bad)));
+    assert_int_equal (shm_ring_next_size (ring), -1);
+}
+/*
+ * A region created by the daemon can be mapped a second time from its fd
+ * and both mappings see the same rings.
+ */
+static void
+shm_region_map_test (void **state)
+{
+    shm_region_t *region, *mapped;
+    guint8 buf [sizeof (message)] = { 0 };
+    gint fd;
+    UNUSED_PARAM(state);
+
+    region = shm_region_create (&fd);
+    if (region == NULL) {
+        skip ();
+    }
+    mapped = shm_region_map (fd);
+    close (fd);
+    assert_non_null (mapped);
+    assert_true (shm_ring_write (&region->response, message, sizeof (message)));
+    assert_int_equal (shm_ring_next_size (&mapped->response), sizeof (message));
+    assert_true (shm_ring_read (&mapped->response, buf, sizeof (message)));
+    assert_memory_equal (buf, message, sizeof (message));
+    assert_true (shm_ring_is_empty (&region->response));
+    shm_region_unmap (mapped);
+    shm_region_unmap (region);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (shm_ring_write_read_test,
+                                         shm_ring_setup,
+                                         shm_ring_teardown),
+        cmocka_unit_test_setup_teardown (shm_ring_wrap_test,
+                                         shm_ring_setup,
+                                         shm_ring_teardown),
+        cmocka_unit_test_setup_teardown (shm_ring_partial_full_test,
+                                         shm_ring_setup,
+                                         shm_ring_teardown),
+        cmocka_unit_test_setup_teardown (shm_ring_corrupt_test,
+                                         shm_ring_setup,
+                                         shm_ring_teardown),
+        cmocka_unit_test (shm_region_map_test),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "stats-segment.h"
+
+typedef struct {
+    gchar           *path;
+    stats_segment_t *segment;
+} test_data_t;
+
+static int
+stats_segment_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+    gint fd;
+
+    fd = g_file_open_tmp ("stats-segment-XXXXXX", &data->path, NULL);
+    assert_true (fd >= 0);
+    close (fd);
+    data->segment = stats_segment_create (data->path);
+    assert_non_null (data->segment);
+    *state = data;
+    return 0;
+}
+static int
+stats_segment_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    stats_segment_unmap (data->segment);
+    g_unlink (data->path);
+    g_free (data->path);
+    free (data);
+    return 0;
+}
+/*
+ * A new segment has its header filled in, no records in use and can only
+ * be read by its owner and group.
+ */
+static void
+stats_segment_create_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    struct stat buf;
+
+    assert_int_equal (data->segment->magic, STATS_SEGMENT_MAGIC);
+    assert_int_equal (data->segment->version, STATS_SEGMENT_VERSION);
+    assert_int_equal (data->segment->size, sizeof (stats_segment_t));
+    assert_int_equal (data->segment->pid, getpid ());
+    assert_int_equal (data->segment->backend [0].in_use, 0);
+    assert_int_equal (data->segment->connection [0].serial, 0);
+    assert_int_equal (stat (data->path, &buf), 0);
+    assert_int_equal (buf.st_mode & 0007, 0);
+    assert_int_equal (buf.st_size, sizeof (stats_segment_t));
+}
+/*
+ * What's written through one mapping is seen through a read-only one.
+ */
+static void
+stats_segment_open_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    stats_segment_t *reader;
+
+    data->segment->backends = 2;
+    data->segment->backend [1].commands = 42;
+    reader = stats_segment_open (data->path);
+    assert_non_null (reader);
+    assert_int_equal (reader->backends, 2);
+    assert_int_equal (reader->backend [1].commands, 42);
+    stats_segment_unmap (reader);
+}
+/*
+ * A file that isn't a segment is refused.
+ */
+static void
+stats_segment_open_bad_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    data->segment->magic = 0;
+    assert_null (stats_segment_open (data->path));
+    assert_int_equal (truncate (data->path, 16), 0);
+    assert_null (stats_segment_open (data->path));
+}
+/*
+ * Only one writer gets a record at a time and no copy is made of it
+ * until the writer is done.
+ */
+static void
+stats_segment_write_read_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    stats_segment_backend_t *backend = &data->segment->backend [0];
+    stats_segment_backend_t copy = { 0, };
+
+    assert_true (stats_segment_write_begin (&backend->seq));
+    assert_false (stats_segment_write_begin (&backend->seq));
+    backend->commands = 7;
+    assert_false (stats_segment_read (&backend->seq,
+                                      backend,
+                                      &copy,
+                                      sizeof (copy)));
+    stats_segment_write_end (&backend->seq);
+    assert_true (stats_segment_read (&backend->seq,
+                                     backend,
+                                     &copy,
+                                     sizeof (copy)));
+    assert_int_equal (copy.seq, 2);
+    assert_int_equal (copy.commands, 7);
+    assert_true (stats_segment_write_begin (&backend->seq));
+    stats_segment_write_end (&backend->seq);
+}
+/*
+ * Serial numbers a multiple of STATS_SEGMENT_CONNECTIONS apart share a
+ * slot.
+ */
+static void
+stats_segment_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_ptr_equal (stats_segment_connection (data->segment, 3),
+                      &data->segment->connection [3]);
+    assert_ptr_equal (stats_segment_connection (data->segment,
+                                                3 + STATS_SEGMENT_CONNECTIONS),
+                      &data->segment->connection [3]);
+}
+/*
+ * Latencies go in the buckets of the CommandStats histograms, the longest
+ * in the last one.
+ */
+static void
+stats_segment_latency_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    stats_segment_backend_t *backend = &data->segment->backend [0];
+
+    stats_segment_latency_add (backend, 0);
+    stats_segment_latency_add (backend, 1);
+    stats_segment_latency_add (backend, 1000);
+    stats_segment_latency_add (backend, G_MAXINT64);
+    assert_int_equal (backend->latency [0], 1);
+    assert_int_equal (backend->latency [1], 1);
+    assert_int_equal (backend->latency [10], 1);
+    assert_int_equal (backend->latency [STATS_SEGMENT_BUCKETS - 1], 1);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (stats_segment_create_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+        cmocka_unit_test_setup_teardown (stats_segment_open_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+        cmocka_unit_test_setup_teardown (stats_segment_open_bad_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+        cmocka_unit_test_setup_teardown (stats_segment_write_read_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+        cmocka_unit_test_setup_teardown (stats_segment_connection_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+        cmocka_unit_test_setup_teardown (stats_segment_latency_test,
+                                         stats_segment_setup,
+                                         stats_segment_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
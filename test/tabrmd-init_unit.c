@@ -89,6 +89,66 @@ on_ipc_frontend_disconnect_test (void **state)
     assert_true (gmain_quit);
 }
 
+/*
+ * Cancel requests that arrive before the ResourceManager exists fail.
+ */
+static void
+on_ipc_frontend_cancel_no_resmgr_test (void **state)
+{
+    UNUSED_PARAM (state);
+    gmain_data_t data = { .backend_count = 0, };
+
+    assert_int_equal (on_ipc_frontend_cancel (ID_IPCFRONT, NULL, &data),
+                      TSS2_RESMGR_RC_GENERAL_FAILURE);
+}
+
+/*
+ * Limits that don't exist or are out of range are refused, valid ones
+ * can't be set before the pipeline is running.
+ */
+static void
+on_ipc_frontend_set_limit_test (void **state)
+{
+    UNUSED_PARAM (state);
+    gmain_data_t data = { .ready = FALSE, };
+
+    assert_int_equal (on_ipc_frontend_set_limit (ID_IPCFRONT, "foo", 1, &data),
+                      TSS2_RESMGR_RC_BAD_VALUE);
+    assert_int_equal (on_ipc_frontend_set_limit (ID_IPCFRONT,
+                                                 "max-sessions",
+                                                 0,
+                                                 &data),
+                      TSS2_RESMGR_RC_BAD_VALUE);
+    assert_int_equal (on_ipc_frontend_set_limit (ID_IPCFRONT,
+                                                 "max-connections",
+                                                 TABRMD_CONNECTION_MAX + 1,
+                                                 &data),
+                      TSS2_RESMGR_RC_BAD_VALUE);
+    assert_int_equal (on_ipc_frontend_set_limit (ID_IPCFRONT,
+                                                 "max-sessions",
+                                                 8,
+                                                 &data),
+                      TSS2_RESMGR_RC_GENERAL_FAILURE);
+}
+/*
+ * Before the pipeline is running no TPM can be calibrated and there are
+ * no reports.
+ */
+static void
+on_ipc_frontend_calibrate_test (void **state)
+{
+    UNUSED_PARAM (state);
+    gmain_data_t data = { .ready = FALSE, };
+    GVariant *reports;
+
+    assert_int_equal (on_ipc_frontend_calibrate (ID_IPCFRONT, &data),
+                      TSS2_RESMGR_RC_GENERAL_FAILURE);
+    reports = on_ipc_frontend_get_calibration (ID_IPCFRONT, &data);
+    assert_non_null (reports);
+    assert_int_equal (g_variant_n_children (reports), 0);
+    g_variant_unref (reports);
+}
+
 static gmain_data_t data;
 
 guint
@@ -335,6 +395,9 @@ int
 main (void)
 {
     const struct CMUnitTest tests[] = {
+        cmocka_unit_test (on_ipc_frontend_cancel_no_resmgr_test),
+        cmocka_unit_test (on_ipc_frontend_set_limit_test),
+        cmocka_unit_test (on_ipc_frontend_calibrate_test),
         cmocka_unit_test_setup (on_ipc_frontend_disconnect_test,
                                 test_setup),
         cmocka_unit_test_setup (init_thread_func_signal_add_fail,
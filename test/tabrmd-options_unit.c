@@ -44,7 +44,8 @@ __wrap_g_option_context_add_main_entries (
                 *(guint*)entries [i].arg_data = mock_type (guint);
             }
             if (strcmp (long_name, "tcti") == 0) {
-                *(char**)entries [i].arg_data = g_strdup (mock_type (char*));
+                gchar *confs [] = { mock_type (char*), NULL };
+                *(gchar***)entries [i].arg_data = g_strdupv (confs);
             }
         }
     }
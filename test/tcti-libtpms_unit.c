@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_sys.h>
+
+#include "tcti.h"
+#include "tcti-libtpms.h"
+#include "tpm2.h"
+#include "util.h"
+
+#ifdef HAVE_LIBTPMS
+/*
+ * Only "libtpms" and "libtpms:" followed by anything select the libtpms
+ * TCTI.
+ */
+static void
+tcti_libtpms_conf_matches_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_true (tcti_libtpms_conf_matches ("libtpms"));
+    assert_true (tcti_libtpms_conf_matches ("libtpms:"));
+    assert_true (tcti_libtpms_conf_matches ("libtpms:/var/lib/tpm"));
+    assert_false (tcti_libtpms_conf_matches (NULL));
+    assert_false (tcti_libtpms_conf_matches (""));
+    assert_false (tcti_libtpms_conf_matches ("libtpmsx"));
+    assert_false (tcti_libtpms_conf_matches ("swtpm:port=2321"));
+}
+/*
+ * A TPM with its state in memory starts up and answers GetRandom. There's
+ * only one libtpms TPM so a second context can't be created while the
+ * first exists, and can once it's gone.
+ */
+static void
+tcti_libtpms_get_random_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = NULL, *other = NULL;
+    TSS2_SYS_CONTEXT *sys;
+    TPM2B_DIGEST random = { 0, };
+    Tcti *tcti;
+    UNUSED_PARAM (state);
+
+    assert_int_equal (tcti_libtpms_new (TCTI_LIBTPMS_NAME, &context),
+                      TSS2_RC_SUCCESS);
+    assert_true (tcti_libtpms_is_context (context));
+    assert_int_not_equal (tcti_libtpms_new (TCTI_LIBTPMS_NAME, &other),
+                          TSS2_RC_SUCCESS);
+    assert_null (other);
+    tcti = tcti_new (context);
+    sys = sapi_context_init (tcti);
+    assert_non_null (sys);
+    assert_int_equal (Tss2_Sys_Startup (sys, TPM2_SU_CLEAR),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Sys_GetRandom (sys, NULL, 16, &random, NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (random.size, 16);
+    Tss2_Sys_Finalize (sys);
+    g_free (sys);
+    /* the Tcti frees the libtpms TCTI context */
+    g_clear_object (&tcti);
+
+    assert_int_equal (tcti_libtpms_new (TCTI_LIBTPMS_NAME, &other),
+                      TSS2_RC_SUCCESS);
+    tcti_libtpms_free (&other);
+    assert_null (other);
+}
+#else
+/*
+ * Without libtpms the conf is left to the TCTI loader.
+ */
+static void
+tcti_libtpms_disabled_test (void **state)
+{
+    TSS2_TCTI_CONTEXT *context = NULL;
+    UNUSED_PARAM (state);
+
+    assert_false (tcti_libtpms_conf_matches (TCTI_LIBTPMS_NAME));
+    assert_int_equal (tcti_libtpms_new (TCTI_LIBTPMS_NAME, &context),
+                      TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    assert_null (context);
+}
+#endif
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+#ifdef HAVE_LIBTPMS
+        cmocka_unit_test (tcti_libtpms_conf_matches_test),
+        cmocka_unit_test (tcti_libtpms_get_random_test),
+#else
+        cmocka_unit_test (tcti_libtpms_disabled_test),
+#endif
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
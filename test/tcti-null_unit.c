@@ -0,0 +1,305 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <tss2/tss2_sys.h>
+
+#include "tcti.h"
+#include "tcti-null.h"
+#include "tpm2.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+typedef struct {
+    Tcti             *tcti;
+    TSS2_SYS_CONTEXT *sys;
+} test_data_t;
+
+static int
+tcti_null_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->tcti = tcti_new (tcti_null_new ());
+    data->sys = sapi_context_init (data->tcti);
+    assert_non_null (data->sys);
+    *state = data;
+    return 0;
+}
+static int
+tcti_null_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    Tss2_Sys_Finalize (data->sys);
+    g_free (data->sys);
+    /* the Tcti frees the null TCTI context */
+    g_clear_object (&data->tcti);
+    free (data);
+    return 0;
+}
+/*
+ * Only "null" and "null:" followed by anything select the null TCTI.
+ */
+static void
+tcti_null_conf_matches_test (void **state)
+{
+    UNUSED_PARAM (state);
+
+    assert_true (tcti_null_conf_matches ("null"));
+    assert_true (tcti_null_conf_matches ("null:"));
+    assert_true (tcti_null_conf_matches ("null:whatever"));
+    assert_false (tcti_null_conf_matches (NULL));
+    assert_false (tcti_null_conf_matches (""));
+    assert_false (tcti_null_conf_matches ("nullx"));
+    assert_false (tcti_null_conf_matches ("device:/dev/null"));
+}
+/*
+ * A command the null TPM doesn't implement gets TPM2_RC_COMMAND_CODE and
+ * receiving before transmitting is a sequence error.
+ */
+static void
+tcti_null_unknown_command_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_TCTI_CONTEXT *context = tcti_peek_context (data->tcti);
+    uint8_t command [TPM_HEADER_SIZE] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x20, 0x00, 0x01, 0xff,
+    };
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t size = sizeof (response);
+
+    assert_int_equal (Tss2_Tcti_Receive (context, &size, response, 0),
+                      TSS2_TCTI_RC_BAD_SEQUENCE);
+    assert_int_equal (Tss2_Tcti_Transmit (context, sizeof (command), command),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Tcti_Receive (context, &size, response, 0),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (size, TPM_HEADER_SIZE);
+    assert_int_equal (get_response_code (response), TPM2_RC_COMMAND_CODE);
+}
+/*
+ * GetRandom gets as many bytes as it asked for.
+ */
+static void
+tcti_null_get_random_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2B_DIGEST random = { 0, };
+
+    assert_int_equal (Tss2_Sys_Startup (data->sys, TPM2_SU_CLEAR),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Sys_GetRandom (data->sys, NULL, 16, &random, NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (random.size, 16);
+}
+/*
+ * Objects get a new transient handle each time they're created or their
+ * context is loaded.
+ */
+static void
+tcti_null_object_handles_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2B_AUTH auth = { 0, };
+    TPMS_CONTEXT context = { 0, };
+    TPM2_HANDLE first = 0, second = 0, loaded = 0;
+
+    assert_int_equal (Tss2_Sys_HashSequenceStart (data->sys, NULL, &auth,
+                                                  TPM2_ALG_SHA256, &first,
+                                                  NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (Tss2_Sys_HashSequenceStart (data->sys, NULL, &auth,
+                                                  TPM2_ALG_SHA256, &second,
+                                                  NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (first >> TPM2_HR_SHIFT, TPM2_HT_TRANSIENT);
+    assert_int_equal (second >> TPM2_HR_SHIFT, TPM2_HT_TRANSIENT);
+    assert_int_not_equal (first, second);
+
+    assert_int_equal (Tss2_Sys_ContextSave (data->sys, second, &context),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (context.savedHandle, TPM2_HR_TRANSIENT);
+    assert_int_equal (Tss2_Sys_ContextLoad (data->sys, &context, &loaded),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (loaded >> TPM2_HR_SHIFT, TPM2_HT_TRANSIENT);
+    assert_int_not_equal (loaded, first);
+    assert_int_not_equal (loaded, second);
+}
+/*
+ * Sessions get a handle of their type that survives a round trip through
+ * ContextSave and ContextLoad, and a nonceTPM as big as the nonceCaller.
+ */
+static void
+tcti_null_session_handles_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TPM2B_NONCE nonce_caller = { .size = 32, };
+    TPM2B_NONCE nonce_tpm = { 0, };
+    TPM2B_ENCRYPTED_SECRET salt = { 0, };
+    TPMT_SYM_DEF symmetric = { .algorithm = TPM2_ALG_NULL, };
+    TPMS_CONTEXT context = { 0, };
+    TPM2_HANDLE hmac = 0, policy = 0, loaded = 0;
+    guint64 sequence;
+
+    assert_int_equal (Tss2_Sys_StartAuthSession (data->sys, TPM2_RH_NULL,
+                                                 TPM2_RH_NULL, NULL,
+                                                 &nonce_caller, &salt,
+                                                 TPM2_SE_HMAC, &symmetric,
+                                                 TPM2_ALG_SHA256, &hmac,
+                                                 &nonce_tpm, NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (hmac >> TPM2_HR_SHIFT, TPM2_HT_HMAC_SESSION);
+    assert_int_equal (nonce_tpm.size, nonce_caller.size);
+    assert_int_equal (Tss2_Sys_StartAuthSession (data->sys, TPM2_RH_NULL,
+                                                 TPM2_RH_NULL, NULL,
+                                                 &nonce_caller, &salt,
+                                                 TPM2_SE_POLICY, &symmetric,
+                                                 TPM2_ALG_SHA256, &policy,
+                                                 &nonce_tpm, NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (policy >> TPM2_HR_SHIFT, TPM2_HT_POLICY_SESSION);
+    assert_int_not_equal (hmac & TPM2_HR_HANDLE_MASK,
+                          policy & TPM2_HR_HANDLE_MASK);
+
+    assert_int_equal (Tss2_Sys_ContextSave (data->sys, policy, &context),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (context.savedHandle, policy);
+    sequence = context.sequence;
+    assert_int_equal (Tss2_Sys_ContextLoad (data->sys, &context, &loaded),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (loaded, policy);
+    assert_int_equal (Tss2_Sys_ContextSave (data->sys, policy, &context),
+                      TSS2_RC_SUCCESS);
+    assert_true (context.sequence > sequence);
+}
+/*
+ * A command with a session gets a response auth for it that keeps the
+ * session alive if the command asked for that.
+ */
+static void
+tcti_null_sessions_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{
+            .sessionHandle = TPM2_RS_PW,
+            .sessionAttributes = TPMA_SESSION_CONTINUESESSION,
+        }},
+    };
+    TSS2L_SYS_AUTH_RESPONSE rsp_auths = { 0, };
+    TPM2B_DIGEST digest = { .size = 32, };
+    TPMT_SIG_SCHEME scheme = { .scheme = TPM2_ALG_NULL, };
+    TPMT_TK_HASHCHECK validation = {
+        .tag = TPM2_ST_HASHCHECK,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    TPMT_SIGNATURE signature = { 0, };
+
+    assert_int_equal (Tss2_Sys_Sign (data->sys, TPM2_HR_TRANSIENT,
+                                     &cmd_auths, &digest, &scheme,
+                                     &validation, &signature, &rsp_auths),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (signature.sigAlg, TPM2_ALG_NULL);
+    assert_int_equal (rsp_auths.count, 1);
+    assert_int_equal (rsp_auths.auths [0].sessionAttributes,
+                      TPMA_SESSION_CONTINUESESSION);
+}
+/*
+ * NV_Read gets as many bytes as it asked for, up to the largest NV
+ * buffer, so the benchmark can move large buffers through the daemon.
+ */
+static void
+tcti_null_nv_read_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{ .sessionHandle = TPM2_RS_PW, }},
+    };
+    TPM2B_MAX_NV_BUFFER nv_data = { 0, };
+
+    assert_int_equal (Tss2_Sys_NV_Read (data->sys,
+                                        TPM2_NV_INDEX_FIRST,
+                                        TPM2_NV_INDEX_FIRST,
+                                        &cmd_auths,
+                                        TPM2_MAX_NV_BUFFER_SIZE,
+                                        0,
+                                        &nv_data,
+                                        NULL),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (nv_data.size, TPM2_MAX_NV_BUFFER_SIZE);
+}
+/*
+ * The daemon can initialize a Tpm2 on the null TCTI: the fixed
+ * properties and the commands come back whole.
+ */
+static void
+tcti_null_tpm2_init_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2 *tpm2 = tpm2_new (data->tcti);
+    TPMA_CC *attrs = NULL;
+    UINT32 count = 0, i;
+    guint32 value = 0;
+
+    assert_int_equal (tpm2_init_tpm (tpm2), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_init_caps_fixed (tpm2), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_fixed_property (tpm2,
+                                               TPM2_PT_HR_TRANSIENT_MIN,
+                                               &value),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (value, 3);
+    assert_int_equal (tpm2_get_fixed_property (tpm2,
+                                               TPM2_PT_TOTAL_COMMANDS,
+                                               &value),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_command_attrs (tpm2, &count, &attrs),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (count, value);
+    for (i = 0; i < count; ++i) {
+        if ((attrs [i] & TPMA_CC_COMMANDINDEX_MASK) == TPM2_CC_StartAuthSession) {
+            break;
+        }
+    }
+    assert_true (i < count);
+    assert_int_equal ((attrs [i] & TPMA_CC_CHANDLES_MASK) >>
+                      TPMA_CC_CHANDLES_SHIFT, 2);
+    assert_true (attrs [i] & TPMA_CC_RHANDLE);
+    g_free (attrs);
+    g_object_unref (tpm2);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test (tcti_null_conf_matches_test),
+        cmocka_unit_test_setup_teardown (tcti_null_unknown_command_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_get_random_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_object_handles_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_session_handles_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_sessions_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_nv_read_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+        cmocka_unit_test_setup_teardown (tcti_null_tpm2_init_test,
+                                         tcti_null_setup,
+                                         tcti_null_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
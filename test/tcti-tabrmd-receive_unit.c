@@ -80,6 +80,42 @@ tcti_tabrmd_poll_fd_ready_pollrdhup (void **state)
     ret = tcti_tabrmd_poll (TEST_FD, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (ret, 0);
 }
+/*
+ * With busy polling the FD is checked without blocking until it's ready,
+ * there's no blocking poll when that happens within the spin.
+ */
+static void
+tcti_tabrmd_busy_poll_ready (void **state)
+{
+    UNUSED_PARAM (state);
+    int ret;
+
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, POLLIN);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 1);
+
+    ret = tcti_tabrmd_busy_poll (TEST_FD, TSS2_TCTI_TIMEOUT_BLOCK, 1000000);
+    assert_int_equal (ret, 0);
+}
+/*
+ * A busy poll of 0 microseconds is the plain blocking poll.
+ */
+static void
+tcti_tabrmd_busy_poll_off (void **state)
+{
+    UNUSED_PARAM (state);
+    int ret;
+
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+
+    ret = tcti_tabrmd_busy_poll (TEST_FD, TSS2_TCTI_TIMEOUT_BLOCK, 0);
+    assert_int_equal (ret, -1);
+}
 /*
  * This tests the tcti_tabrmd_poll function, ensuring that it returns the
  * expected response code when a timeout occurs.
@@ -211,7 +247,7 @@ tcti_tabrmd_read_poll_fail (void **state)
 }
 /*
  * This test ensures that a call to tcti_tabrmd_read that causes
- * g_input_stream_read to return EOF will return the appropriate RC.
+ * recv to return EOF will return the appropriate RC.
  */
 static void
 tcti_tabrmd_read_eof (void **state)
@@ -231,18 +267,15 @@ tcti_tabrmd_read_eof (void **state)
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    /* cause g_input_stream_read to return 0 indicating EOF */
-    will_return (__wrap_g_input_stream_read, 0);
+    /* cause recv to return 0 indicating EOF */
+    will_return (__wrap_recv, 0);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_NO_CONNECTION);
 }
 /*
  * This test ensures that a call to tcti_tabrmd_read that causes
- * g_input_stream_read to indicate that it would block, returns the
- * appropriate RC.
+ * recv to indicate that it would block, returns the appropriate RC.
  */
 static void
 tcti_tabrmd_read_block_error (void **state)
@@ -252,7 +285,6 @@ tcti_tabrmd_read_block_error (void **state)
     size_t resp_size = sizeof (resp);
     uint32_t timeout = TSS2_TCTI_TIMEOUT_BLOCK;
     TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
-    GError* error;
 
     /* mock stack required to extract the fd from the GSocketConnection */
     will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
@@ -263,19 +295,17 @@ tcti_tabrmd_read_block_error (void **state)
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    error = g_error_new (1, G_IO_ERROR_WOULD_BLOCK, __func__);
-    will_return (__wrap_g_input_stream_read, -1);
-    will_return (__wrap_g_input_stream_read, error);
+    /* mock stack required to read data from the socket */
+    will_return (__wrap_recv, -1);
+    will_return (__wrap_recv, EAGAIN);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_TRY_AGAIN);
 }
 /*
- * This test forces the call to 'g_input_stream_read' to read fewer bytes
- * than requested by the caller (the 'tcti_tabrmd_read' in this case). This
- * is a "short read" and should return an RC telling the caller to retry.
+ * This test forces the call to 'recv' to read fewer bytes than requested
+ * by the caller (the 'tcti_tabrmd_read' in this case). This is a "short
+ * read" and should return an RC telling the caller to retry.
  */
 static void
 tcti_tabrmd_read_short (void **state)
@@ -296,10 +326,9 @@ tcti_tabrmd_read_short (void **state)
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, read_size);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to read data from the socket */
+    will_return (__wrap_recv, read_size);
+    will_return (__wrap_recv, buf);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_TCTI_RC_TRY_AGAIN);
@@ -322,10 +351,9 @@ tcti_tabrmd_read_success (void **state)
     will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
     will_return (__wrap_g_socket_get_fd, TEST_FD);
 
-    /* mock stack required to extract GIStream & read data */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, resp_size);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to read data from the socket */
+    will_return (__wrap_recv, resp_size);
+    will_return (__wrap_recv, buf);
 
     ret = tcti_tabrmd_read (tcti_ctx, resp, resp_size, timeout);
     assert_int_equal (ret, TSS2_RC_SUCCESS);
@@ -478,10 +506,9 @@ tcti_tabrmd_receive_header_lt_expected (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to get 10 bytes back from the socket */
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &size, NULL, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_TCTI_RC_MALFORMED_RESPONSE);
@@ -511,10 +538,9 @@ tcti_tabrmd_receive_get_size (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to get 10 bytes back from the socket */
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &size, NULL, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -544,10 +570,9 @@ tcti_tabrmd_receive_header_only (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to get 10 bytes back from the socket */
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -580,10 +605,9 @@ tcti_tabrmd_receive_header_only_retry (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get first bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, FIRST_READ_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to get first bytes back from the socket */
+    will_return (__wrap_recv, FIRST_READ_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_TCTI_RC_TRY_AGAIN);
@@ -595,10 +619,9 @@ tcti_tabrmd_receive_header_only_retry (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get first bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, SECOND_READ_SIZE);
-    will_return (__wrap_g_input_stream_read, &buf[FIRST_READ_SIZE]);
+    /* mock stack required to get first bytes back from the socket */
+    will_return (__wrap_recv, SECOND_READ_SIZE);
+    will_return (__wrap_recv, &buf[FIRST_READ_SIZE]);
 
     rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, TSS2_TCTI_TIMEOUT_BLOCK);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
@@ -630,10 +653,9 @@ tcti_tabrmd_receive_partial_reads (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, TPM_HEADER_SIZE);
-    will_return (__wrap_g_input_stream_read, buf);
+    /* mock stack required to get 10 bytes back from the socket */
+    will_return (__wrap_recv, TPM_HEADER_SIZE);
+    will_return (__wrap_recv, buf);
 
     rc = tss2_tcti_tabrmd_receive (ctx,
                                    &resp_size,
@@ -649,10 +671,9 @@ tcti_tabrmd_receive_partial_reads (void **state)
     will_return (__wrap_poll, POLLIN);
     will_return (__wrap_poll, 0);
     will_return (__wrap_poll, 1);
-    /* mock stack required to get 10 bytes back from the GInputStream */
-    will_return (__wrap_g_io_stream_get_input_stream, TEST_CONNECTION);
-    will_return (__wrap_g_input_stream_read, 4);
-    will_return (__wrap_g_input_stream_read, &buf[TPM_HEADER_SIZE]);
+    /* mock stack required to get 10 bytes back from the socket */
+    will_return (__wrap_recv, 4);
+    will_return (__wrap_recv, &buf[TPM_HEADER_SIZE]);
 
     rc = tss2_tcti_tabrmd_receive (ctx,
                                    &resp_size,
@@ -661,6 +682,102 @@ tcti_tabrmd_receive_partial_reads (void **state)
     assert_int_equal (rc, TSS2_RC_SUCCESS);
     assert_memory_equal (buf, resp, sizeof (buf));
 }
+/*
+ * When the whole response is already waiting on the socket and the
+ * caller's buffer can hold any response it's read with a single recv and
+ * without polling.
+ */
+static void
+tcti_tabrmd_receive_fast_path (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT*)*state;
+    TSS2_TCTI_TABRMD_CONTEXT *tcti_ctx = (TSS2_TCTI_TABRMD_CONTEXT*)*state;
+    uint8_t buf [] = {
+        0x80, 0x02,
+        0x00, 0x00, 0x00, 0x0e,
+        0xde, 0xad, 0xbe, 0xef,
+        0xca, 0xfe, 0xd0, 0x0d,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t resp_size = sizeof (resp);
+
+    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
+    will_return (__wrap_g_socket_get_fd, TEST_FD);
+    will_return (__wrap_recv, sizeof (buf));
+    will_return (__wrap_recv, buf);
+
+    rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (resp_size, sizeof (buf));
+    assert_memory_equal (buf, resp, sizeof (buf));
+    assert_int_equal (tcti_ctx->index, 0);
+    assert_int_equal (tcti_ctx->state, TABRMD_STATE_TRANSMIT);
+}
+/*
+ * If recv only gets part of the response the rest is read by polling and
+ * reading from the socket as before.
+ */
+static void
+tcti_tabrmd_receive_fast_path_partial (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT*)*state;
+    uint8_t buf [] = {
+        0x80, 0x02,
+        0x00, 0x00, 0x00, 0x0e,
+        0xde, 0xad, 0xbe, 0xef,
+        0xca, 0xfe, 0xd0, 0x0d,
+    };
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t resp_size = sizeof (resp);
+
+    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
+    will_return (__wrap_g_socket_get_fd, TEST_FD);
+    will_return (__wrap_recv, 12);
+    will_return (__wrap_recv, buf);
+
+    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
+    will_return (__wrap_g_socket_get_fd, TEST_FD);
+    will_return (__wrap_poll, POLLIN);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 1);
+    will_return (__wrap_recv, 2);
+    will_return (__wrap_recv, &buf [12]);
+
+    rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (resp_size, sizeof (buf));
+    assert_memory_equal (buf, resp, sizeof (buf));
+}
+/*
+ * If nothing is waiting on the socket yet we poll for it with the
+ * caller's timeout.
+ */
+static void
+tcti_tabrmd_receive_fast_path_eagain (void **state)
+{
+    TSS2_RC rc;
+    TSS2_TCTI_CONTEXT *ctx = (TSS2_TCTI_CONTEXT*)*state;
+    uint8_t resp [TPM2_MAX_RESPONSE_SIZE] = { 0, };
+    size_t resp_size = sizeof (resp);
+
+    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
+    will_return (__wrap_g_socket_get_fd, TEST_FD);
+    will_return (__wrap_recv, -1);
+    will_return (__wrap_recv, EAGAIN);
+
+    will_return (__wrap_g_socket_connection_get_socket, TEST_SOCKET);
+    will_return (__wrap_g_socket_get_fd, TEST_FD);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+    will_return (__wrap_poll, 0);
+
+    rc = tss2_tcti_tabrmd_receive (ctx, &resp_size, resp, 100);
+    assert_int_equal (rc, TSS2_TCTI_RC_TRY_AGAIN);
+}
 
 int
 main (void)
@@ -670,6 +787,8 @@ main (void)
         cmocka_unit_test (tcti_tabrmd_poll_fd_ready_pollpri),
         cmocka_unit_test (tcti_tabrmd_poll_fd_ready_pollrdhup),
         cmocka_unit_test (tcti_tabrmd_poll_timeout),
+        cmocka_unit_test (tcti_tabrmd_busy_poll_ready),
+        cmocka_unit_test (tcti_tabrmd_busy_poll_off),
         cmocka_unit_test (tcti_tabrmd_poll_error),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_read_poll_timeout,
                                          tcti_tabrmd_setup,
@@ -724,6 +843,15 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_partial_reads,
                                          tcti_tabrmd_receive_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_fast_path,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_fast_path_partial,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_fast_path_eagain,
+                                         tcti_tabrmd_receive_setup,
+                                         tcti_tabrmd_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
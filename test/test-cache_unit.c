@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "test-cache.h"
+#include "tpm2-header.h"
+#include "util.h"
+
+#define CACHE_MAX 2
+
+typedef struct {
+    TestCache *cache;
+} test_data_t;
+
+static int
+test_cache_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->cache = test_cache_new (CACHE_MAX);
+    *state = data;
+    return 0;
+}
+static int
+test_cache_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->cache);
+    free (data);
+    return 0;
+}
+/*
+ * Build a command with the provided tag and code and no handles, its
+ * parameter area is the two bytes of 'param'.
+ */
+static Tpm2Command*
+command_new (TPMI_ST_COMMAND_TAG tag,
+             TPM2_CC             code,
+             guint16             param)
+{
+    size_t size = TPM_HEADER_SIZE + sizeof (param);
+    guint8 *buffer = calloc (1, size);
+
+    buffer [TPM_HEADER_SIZE] = param >> 8;
+    buffer [TPM_HEADER_SIZE + 1] = param & 0xff;
+    assert_int_equal (tpm2_header_init (buffer, size, tag, size, code),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_command_new (NULL, buffer, size, code);
+}
+/*
+ * Build a response with the provided response code and no parameters.
+ */
+static Tpm2Response*
+response_new (TSS2_RC rc)
+{
+    guint8 *buffer = calloc (1, TPM_HEADER_SIZE);
+
+    assert_int_equal (tpm2_header_init (buffer, TPM_HEADER_SIZE,
+                                        TPM2_ST_NO_SESSIONS,
+                                        TPM_HEADER_SIZE, rc),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_response_new (NULL, buffer, TPM_HEADER_SIZE, 0);
+}
+/*
+ * Build a successful GetTestResult response with two bytes of outData and
+ * the provided testResult.
+ */
+static Tpm2Response*
+test_result_response_new (TPM2_RC result)
+{
+    size_t size = TPM_HEADER_SIZE + 2 + 2 + 4;
+    guint8 *buffer = calloc (1, size);
+
+    buffer [TPM_HEADER_SIZE + 1] = 2;
+    buffer [size - 4] = result >> 24;
+    buffer [size - 3] = result >> 16;
+    buffer [size - 2] = result >> 8;
+    buffer [size - 1] = result & 0xff;
+    assert_int_equal (tpm2_header_init (buffer, size, TPM2_ST_NO_SESSIONS,
+                                        size, TSS2_RC_SUCCESS),
+                      TSS2_RC_SUCCESS);
+
+    return tpm2_response_new (NULL, buffer, size, 0);
+}
+/*
+ * Send 'command' with 'response' through the cache and return if the
+ * command is answered from the cache afterwards.
+ */
+static gboolean
+update_and_lookup (TestCache    *cache,
+                   Tpm2Command  *command,
+                   Tpm2Response *response)
+{
+    GBytes *cached;
+
+    test_cache_update (cache, command, response);
+    cached = test_cache_lookup (cache, command);
+    if (cached == NULL) {
+        return FALSE;
+    }
+    assert_int_equal (g_bytes_get_size (cached),
+                      tpm2_response_get_size (response));
+    assert_memory_equal (g_bytes_get_data (cached, NULL),
+                         tpm2_response_get_buffer (response),
+                         tpm2_response_get_size (response));
+    g_bytes_unref (cached);
+    return TRUE;
+}
+static void
+test_cache_type_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_true (IS_TEST_CACHE (data->cache));
+    assert_int_equal (test_cache_size (data->cache), 0);
+    assert_true (test_cache_answers (TPM2_CC_TestParms));
+    assert_true (test_cache_answers (TPM2_CC_GetTestResult));
+    assert_false (test_cache_answers (TPM2_CC_SelfTest));
+}
+/*
+ * TestParms responses are cached for their parameters: success and
+ * errors about a parameter are, warnings aren't. Commands with sessions
+ * aren't cached and past CACHE_MAX nothing is added.
+ */
+static void
+test_cache_test_parms_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command, *other, *sessions;
+    Tpm2Response *success, *error, *warning;
+
+    command = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_TestParms, 1);
+    other = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_TestParms, 2);
+    sessions = command_new (TPM2_ST_SESSIONS, TPM2_CC_TestParms, 3);
+    success = response_new (TSS2_RC_SUCCESS);
+    error = response_new (TPM2_RC_VALUE | TPM2_RC_P | TPM2_RC_1);
+    warning = response_new (TPM2_RC_RETRY);
+
+    assert_null (test_cache_lookup (data->cache, command));
+    assert_false (update_and_lookup (data->cache, command, warning));
+    assert_true (update_and_lookup (data->cache, command, success));
+    assert_null (test_cache_lookup (data->cache, other));
+    assert_true (update_and_lookup (data->cache, other, error));
+    assert_int_equal (test_cache_size (data->cache), CACHE_MAX);
+    assert_false (update_and_lookup (data->cache, sessions, success));
+    assert_int_equal (test_cache_size (data->cache), CACHE_MAX);
+
+    g_object_unref (command);
+    g_object_unref (other);
+    g_object_unref (sessions);
+    g_object_unref (success);
+    g_object_unref (error);
+    g_object_unref (warning);
+}
+/*
+ * GetTestResult is only cached once the self-test has completed
+ * successfully, and dropped by SelfTest.
+ */
+static void
+test_cache_test_result_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command, *self_test;
+    Tpm2Response *testing, *complete, *success;
+
+    command = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_GetTestResult, 0);
+    self_test = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_SelfTest, 0);
+    testing = test_result_response_new (TPM2_RC_TESTING);
+    complete = test_result_response_new (TPM2_RC_SUCCESS);
+    success = response_new (TSS2_RC_SUCCESS);
+
+    assert_false (update_and_lookup (data->cache, command, testing));
+    assert_true (update_and_lookup (data->cache, command, complete));
+    assert_int_equal (test_cache_size (data->cache), 1);
+    test_cache_update (data->cache, self_test, success);
+    assert_null (test_cache_lookup (data->cache, command));
+
+    g_object_unref (command);
+    g_object_unref (self_test);
+    g_object_unref (testing);
+    g_object_unref (complete);
+    g_object_unref (success);
+}
+/*
+ * Startup and the firmware upgrade commands drop the whole cache.
+ */
+static void
+test_cache_invalidate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command, *result, *startup, *upgrade;
+    Tpm2Response *success, *complete;
+
+    command = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_TestParms, 1);
+    result = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_GetTestResult, 0);
+    startup = command_new (TPM2_ST_NO_SESSIONS, TPM2_CC_Startup, 0);
+    upgrade = command_new (TPM2_ST_SESSIONS, TPM2_CC_FieldUpgradeData, 0);
+    success = response_new (TSS2_RC_SUCCESS);
+    complete = test_result_response_new (TPM2_RC_SUCCESS);
+
+    test_cache_update (data->cache, command, success);
+    test_cache_update (data->cache, result, complete);
+    assert_int_equal (test_cache_size (data->cache), 2);
+    test_cache_update (data->cache, startup, success);
+    assert_int_equal (test_cache_size (data->cache), 0);
+
+    test_cache_update (data->cache, command, success);
+    assert_int_equal (test_cache_size (data->cache), 1);
+    test_cache_update (data->cache, upgrade, success);
+    assert_int_equal (test_cache_size (data->cache), 0);
+
+    g_object_unref (command);
+    g_object_unref (result);
+    g_object_unref (startup);
+    g_object_unref (upgrade);
+    g_object_unref (success);
+    g_object_unref (complete);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (test_cache_type_test,
+                                         test_cache_setup,
+                                         test_cache_teardown),
+        cmocka_unit_test_setup_teardown (test_cache_test_parms_test,
+                                         test_cache_setup,
+                                         test_cache_teardown),
+        cmocka_unit_test_setup_teardown (test_cache_test_result_test,
+                                         test_cache_setup,
+                                         test_cache_teardown),
+        cmocka_unit_test_setup_teardown (test_cache_invalidate_test,
+                                         test_cache_setup,
+                                         test_cache_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
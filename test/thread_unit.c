@@ -13,6 +13,7 @@
 #include <cmocka.h>
 
 #include "thread.h"
+#include "util.h"
 
 /*
  * This test exercises the Thread abstract class. We do so by creating a
@@ -164,6 +165,55 @@ test_thread_lifecycle_test (void **state)
     assert_true (test_thread->canceled);
     assert_true (test_thread->cleaned_up);
 }
+/*
+ * CPU lists are numbers and ranges separated by commas, anything else is
+ * refused.
+ */
+static void
+thread_parse_cpus_test (void **state)
+{
+    cpu_set_t cpus;
+    UNUSED_PARAM(state);
+
+    assert_true (thread_parse_cpus ("0-2,5", &cpus));
+    assert_int_equal (CPU_COUNT (&cpus), 4);
+    assert_true (CPU_ISSET (0, &cpus));
+    assert_true (CPU_ISSET (2, &cpus));
+    assert_false (CPU_ISSET (3, &cpus));
+    assert_true (CPU_ISSET (5, &cpus));
+    assert_true (thread_parse_cpus ("7", &cpus));
+    assert_int_equal (CPU_COUNT (&cpus), 1);
+    assert_false (thread_parse_cpus ("", &cpus));
+    assert_false (thread_parse_cpus ("3-1", &cpus));
+    assert_false (thread_parse_cpus ("0-", &cpus));
+    assert_false (thread_parse_cpus ("1,,2", &cpus));
+    assert_false (thread_parse_cpus ("cpu0", &cpus));
+}
+/*
+ * A thread pinned to a CPU runs there.
+ */
+static void
+test_thread_cpus_test (void **state)
+{
+    Thread *thread = THREAD (*state);
+    TestThread *test_thread = TEST_THREAD (*state);
+    cpu_set_t cpus, cpus_out;
+
+    CPU_ZERO (&cpus);
+    CPU_SET (0, &cpus);
+    thread_set_cpus (thread, &cpus);
+    assert_int_equal (thread_start (thread), 0);
+    assert_int_equal (pthread_getaffinity_np (thread->thread_id,
+                                              sizeof (cpus_out),
+                                              &cpus_out),
+                      0);
+    assert_true (CPU_EQUAL (&cpus, &cpus_out));
+    while (!test_thread->running) {
+        sched_yield ();
+    }
+    thread_cancel (thread);
+    assert_int_equal (thread_join (thread), 0);
+}
 int
 main (void)
 {
@@ -174,6 +224,10 @@ main (void)
         cmocka_unit_test_setup_teardown (test_thread_lifecycle_test,
                                          test_thread_setup,
                                          test_thread_teardown),
+        cmocka_unit_test (thread_parse_cpus_test),
+        cmocka_unit_test_setup_teardown (test_thread_cpus_test,
+                                         test_thread_setup,
+                                         test_thread_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
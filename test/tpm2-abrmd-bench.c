@@ -0,0 +1,1209 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Throughput benchmark for tpm2-abrmd. Each client thread opens its own
+ * TCTI the way the integration tests do (TABRMD_TEST_TCTI_CONF) and runs a
+ * weighted mix of commands against the daemon for a fixed time. When all
+ * of them are done the throughput and latency percentiles of each
+ * operation are printed.
+ *
+ * With --keys and --sessions each client keeps that many transient keys
+ * and policy sessions loaded, so that the clients together hold more
+ * objects than the TPM has slots and the ResourceManager has to swap
+ * contexts. Given the address of the daemon's --metrics listener the
+ * context operations it did are reported for each command.
+ *
+ * The NV operations write and read an index of --nv-size bytes that each
+ * client defines, for the largest commands and responses clients send.
+ *
+ * With --churn the clients instead connect, send a single GetRandom and
+ * disconnect as fast as they can, like short lived command line tools do.
+ * The time to get a connection from the daemon is reported apart from the
+ * time the first command takes on it.
+ *
+ * With --footprint a single thread opens the clients' connections, loads
+ * their keys and starts their sessions, then flushes and closes them all,
+ * a few times over. The daemon's resident memory and heap are read from
+ * its metrics listener after each step to show what a connection, a
+ * transient object and a session cost and whether all of it comes back.
+ */
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <tss2/tss2_sys.h>
+
+#include "common.h"
+#include "context-util.h"
+#include "test-options.h"
+#include "tpm2-struct-init.h"
+
+typedef enum {
+    BENCH_GET_RANDOM,
+    BENCH_PCR_READ,
+    BENCH_SIGN,
+    BENCH_POLICY,
+    BENCH_NV_WRITE,
+    BENCH_NV_READ,
+    BENCH_SESSION,
+    BENCH_OPS,
+} bench_op_t;
+
+static const gchar *bench_op_names [BENCH_OPS] = {
+    [BENCH_GET_RANDOM] = "getrandom",
+    [BENCH_PCR_READ] = "pcrread",
+    [BENCH_SIGN] = "sign",
+    [BENCH_POLICY] = "policy",
+    [BENCH_NV_WRITE] = "nvwrite",
+    [BENCH_NV_READ] = "nvread",
+    [BENCH_SESSION] = "session",
+};
+/* the parts of a connect, GetRandom, disconnect cycle timed with --churn */
+typedef enum {
+    BENCH_CHURN_CONNECT,
+    BENCH_CHURN_FIRST,
+    BENCH_CHURN_CYCLE,
+    BENCH_CHURN_PHASES,
+} bench_churn_phase_t;
+
+static const gchar *bench_churn_names [BENCH_CHURN_PHASES] = {
+    [BENCH_CHURN_CONNECT] = "connect",
+    [BENCH_CHURN_FIRST] = "first cmd",
+    [BENCH_CHURN_CYCLE] = "cycle",
+};
+/* what each client keeps loaded at most */
+#define BENCH_KEYS_MAX 64
+#define BENCH_SESSIONS_MAX 64
+/* the NV index of the first client, the others follow it */
+#define BENCH_NV_INDEX (TPM2_NV_INDEX_FIRST + 0x100)
+#define BENCH_NV_SIZE_DEFAULT 1024
+/* the part of the metrics page that is read */
+#define BENCH_METRICS_MAX (1024 * 1024)
+/* times --footprint fills the daemon up and empties it again */
+#define BENCH_FOOTPRINT_ROUNDS 3
+
+/* the steps of a --footprint round, memory is read after each */
+typedef enum {
+    BENCH_FOOTPRINT_IDLE,
+    BENCH_FOOTPRINT_CONNECTED,
+    BENCH_FOOTPRINT_KEYS,
+    BENCH_FOOTPRINT_SESSIONS,
+    BENCH_FOOTPRINT_FLUSHED,
+    BENCH_FOOTPRINT_CLOSED,
+    BENCH_FOOTPRINT_STEPS,
+} bench_footprint_step_t;
+
+static const gchar *bench_footprint_names [BENCH_FOOTPRINT_STEPS] = {
+    [BENCH_FOOTPRINT_IDLE] = "idle",
+    [BENCH_FOOTPRINT_CONNECTED] = "connected",
+    [BENCH_FOOTPRINT_KEYS] = "keys",
+    [BENCH_FOOTPRINT_SESSIONS] = "sessions",
+    [BENCH_FOOTPRINT_FLUSHED] = "flushed",
+    [BENCH_FOOTPRINT_CLOSED] = "closed",
+};
+/* the daemon's memory as its metrics report it, in bytes */
+typedef struct {
+    guint64      resident;
+    guint64      heap;
+    guint64      heap_free;
+} bench_memory_t;
+
+typedef struct {
+    guint        clients;
+    guint        duration;
+    guint        keys;
+    guint        sessions;
+    guint        nv_size;
+    gchar       *metrics;
+    gboolean     churn;
+    gboolean     footprint;
+    guint        weights [BENCH_OPS];
+    guint        weight_total;
+    test_opts_t  test_opts;
+} bench_config_t;
+
+typedef struct {
+    bench_config_t const *config;
+    guint                 index;
+    /* microseconds taken by each successful operation */
+    GArray               *samples [BENCH_OPS];
+    guint                 errors [BENCH_OPS];
+    GArray               *churn [BENCH_CHURN_PHASES];
+    guint                 churn_errors;
+    gboolean              failed;
+} bench_client_t;
+
+static TSS2_RC
+bench_get_random (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPM2B_DIGEST random_bytes = TPM2B_DIGEST_STATIC_INIT;
+
+    return Tss2_Sys_GetRandom (sapi_context,
+                               NULL,
+                               TPM2_SHA256_DIGEST_SIZE,
+                               &random_bytes,
+                               NULL);
+}
+static TSS2_RC
+bench_pcr_read (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPML_PCR_SELECTION selection = {
+        .count = 1,
+        .pcrSelections = {{
+            .hash = TPM2_ALG_SHA256,
+            .sizeofSelect = 3,
+            .pcrSelect = { 0x01, 0x00, 0x00 },
+        }},
+    };
+    TPML_PCR_SELECTION selection_out;
+    TPML_DIGEST values;
+    UINT32 update_counter;
+
+    return Tss2_Sys_PCR_Read (sapi_context,
+                              NULL,
+                              &selection,
+                              &update_counter,
+                              &selection_out,
+                              &values,
+                              NULL);
+}
+static TSS2_RC
+bench_sign (TSS2_SYS_CONTEXT *sapi_context,
+            TPM2_HANDLE       key_handle)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{
+            .sessionHandle = TPM2_RS_PW,
+        }}
+    };
+    TPM2B_DIGEST digest = {
+        .size = TPM2_SHA256_DIGEST_SIZE,
+    };
+    TPMT_SIG_SCHEME scheme = {
+        .scheme = TPM2_ALG_RSASSA,
+        .details.rsassa.hashAlg = TPM2_ALG_SHA256,
+    };
+    TPMT_TK_HASHCHECK validation = {
+        .tag = TPM2_ST_HASHCHECK,
+        .hierarchy = TPM2_RH_NULL,
+    };
+    TPMT_SIGNATURE signature;
+
+    return Tss2_Sys_Sign (sapi_context,
+                          key_handle,
+                          &cmd_auths,
+                          &digest,
+                          &scheme,
+                          &validation,
+                          &signature,
+                          NULL);
+}
+/*
+ * A policy session from start to end: start it, extend it with
+ * PolicyAuthValue, read the digest back and flush it.
+ */
+static TSS2_RC
+bench_policy (TSS2_SYS_CONTEXT *sapi_context)
+{
+    TPMI_SH_AUTH_SESSION session;
+    TPM2B_DIGEST policy_digest = TPM2B_DIGEST_STATIC_INIT;
+    TSS2_RC rc;
+
+    rc = start_auth_session (sapi_context, &session);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    rc = Tss2_Sys_PolicyAuthValue (sapi_context, session, NULL, NULL);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_Sys_PolicyGetDigest (sapi_context,
+                                       session,
+                                       NULL,
+                                       &policy_digest,
+                                       NULL);
+    }
+    flush_context (sapi_context, session);
+    return rc;
+}
+/*
+ * Define the client's NV index of 'size' bytes and write it once, it
+ * can't be read before that.
+ */
+static TSS2_RC
+bench_nv_define (TSS2_SYS_CONTEXT *sapi_context,
+                 TPMI_RH_NV_INDEX  index,
+                 guint             size)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{
+            .sessionHandle = TPM2_RS_PW,
+        }}
+    };
+    TPM2B_AUTH auth = { 0, };
+    TPM2B_NV_PUBLIC public_info = {
+        .nvPublic = {
+            .nvIndex = index,
+            .nameAlg = TPM2_ALG_SHA256,
+            .attributes = TPMA_NV_AUTHWRITE | TPMA_NV_AUTHREAD,
+            .dataSize = (UINT16)size,
+        },
+    };
+    TPM2B_MAX_NV_BUFFER data = { .size = (UINT16)size, };
+    TSS2_RC rc;
+
+    rc = Tss2_Sys_NV_DefineSpace (sapi_context,
+                                  TPM2_RH_OWNER,
+                                  &cmd_auths,
+                                  &auth,
+                                  &public_info,
+                                  NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+    return Tss2_Sys_NV_Write (sapi_context,
+                              index,
+                              index,
+                              &cmd_auths,
+                              &data,
+                              0,
+                              NULL);
+}
+static void
+bench_nv_undefine (TSS2_SYS_CONTEXT *sapi_context,
+                   TPMI_RH_NV_INDEX  index)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{
+            .sessionHandle = TPM2_RS_PW,
+        }}
+    };
+    TSS2_RC rc;
+
+    rc = Tss2_Sys_NV_UndefineSpace (sapi_context,
+                                    TPM2_RH_OWNER,
+                                    index,
+                                    &cmd_auths,
+                                    NULL);
+    if (rc != TSS2_RC_SUCCESS) {
+        g_warning ("failed to undefine NV index 0x%" PRIx32 ": 0x%" PRIx32,
+                   index, rc);
+    }
+}
+/*
+ * Write or read the whole of the client's NV index in one command, the
+ * largest buffers a client commonly sends through the daemon.
+ */
+static TSS2_RC
+bench_nv (TSS2_SYS_CONTEXT *sapi_context,
+          TPMI_RH_NV_INDEX  index,
+          guint             size,
+          gboolean          write)
+{
+    TSS2L_SYS_AUTH_COMMAND cmd_auths = {
+        .count = 1,
+        .auths = {{
+            .sessionHandle = TPM2_RS_PW,
+        }}
+    };
+    TPM2B_MAX_NV_BUFFER data = { .size = (UINT16)size, };
+
+    if (write) {
+        return Tss2_Sys_NV_Write (sapi_context,
+                                  index,
+                                  index,
+                                  &cmd_auths,
+                                  &data,
+                                  0,
+                                  NULL);
+    }
+    return Tss2_Sys_NV_Read (sapi_context,
+                             index,
+                             index,
+                             &cmd_auths,
+                             (UINT16)size,
+                             0,
+                             &data,
+                             NULL);
+}
+/*
+ * Extend one of the sessions the client keeps, the ResourceManager has to
+ * load it if it swapped it out.
+ */
+static TSS2_RC
+bench_session (TSS2_SYS_CONTEXT     *sapi_context,
+               TPMI_SH_AUTH_SESSION  session)
+{
+    return Tss2_Sys_PolicyAuthValue (sapi_context, session, NULL, NULL);
+}
+/*
+ * Pick the next operation at random according to the weights.
+ */
+static bench_op_t
+bench_pick (bench_config_t const *config,
+            GRand                *rand)
+{
+    guint value, op;
+
+    value = g_rand_int_range (rand, 0, (gint32)config->weight_total);
+    for (op = 0; op < BENCH_OPS - 1; ++op) {
+        if (value < config->weights [op]) {
+            break;
+        }
+        value -= config->weights [op];
+    }
+    return op;
+}
+static gpointer
+bench_client_func (gpointer user_data)
+{
+    bench_client_t *client = (bench_client_t*)user_data;
+    bench_config_t const *config = client->config;
+    test_opts_t test_opts = config->test_opts;
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPM2_HANDLE primary = 0, keys [BENCH_KEYS_MAX] = { 0, };
+    TPMI_SH_AUTH_SESSION sessions [BENCH_SESSIONS_MAX] = { 0, };
+    TPM2B_PRIVATE key_private = TPM2B_PRIVATE_STATIC_INIT;
+    TPM2B_PUBLIC key_public = TPM2B_PUBLIC_ZERO_INIT;
+    TPMI_RH_NV_INDEX nv_index = BENCH_NV_INDEX + client->index;
+    gboolean nv_defined = FALSE;
+    GRand *rand;
+    gint64 start, end, deadline;
+    guint32 sample;
+    guint i;
+    bench_op_t op;
+    TSS2_RC rc;
+
+    sapi_context = sapi_init_from_opts (&test_opts);
+    if (sapi_context == NULL) {
+        g_warning ("client %u: failed to connect to tabrmd", client->index);
+        client->failed = TRUE;
+        return NULL;
+    }
+    if (config->weights [BENCH_SIGN] > 0) {
+        rc = create_primary (sapi_context, &primary);
+        if (rc == TSS2_RC_SUCCESS) {
+            rc = create_key (sapi_context, primary, &key_private, &key_public);
+        }
+        /* the same key loaded again is another object for the TPM */
+        for (i = 0; i < config->keys && rc == TSS2_RC_SUCCESS; ++i) {
+            rc = load_key (sapi_context,
+                           primary,
+                           &keys [i],
+                           &key_private,
+                           &key_public);
+        }
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("client %u: failed to load signing key: 0x%" PRIx32,
+                       client->index, rc);
+            client->failed = TRUE;
+            goto out;
+        }
+        /* the keys have what they need, don't take a slot for nothing */
+        flush_context (sapi_context, primary);
+        primary = 0;
+    }
+    for (i = 0; i < config->sessions; ++i) {
+        rc = start_auth_session (sapi_context, &sessions [i]);
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("client %u: failed to start session: 0x%" PRIx32,
+                       client->index, rc);
+            client->failed = TRUE;
+            goto out;
+        }
+    }
+    if (config->weights [BENCH_NV_WRITE] > 0 ||
+        config->weights [BENCH_NV_READ] > 0)
+    {
+        rc = bench_nv_define (sapi_context, nv_index, config->nv_size);
+        nv_defined = rc == TSS2_RC_SUCCESS;
+        if (!nv_defined) {
+            g_warning ("client %u: failed to define NV index 0x%" PRIx32
+                       ": 0x%" PRIx32, client->index, nv_index, rc);
+            client->failed = TRUE;
+            goto out;
+        }
+    }
+    rand = g_rand_new_with_seed (client->index);
+    deadline = g_get_monotonic_time () + config->duration * G_USEC_PER_SEC;
+    do {
+        op = bench_pick (config, rand);
+        start = g_get_monotonic_time ();
+        switch (op) {
+        case BENCH_GET_RANDOM:
+            rc = bench_get_random (sapi_context);
+            break;
+        case BENCH_PCR_READ:
+            rc = bench_pcr_read (sapi_context);
+            break;
+        case BENCH_SIGN:
+            rc = bench_sign (sapi_context,
+                             keys [g_rand_int_range (rand, 0, config->keys)]);
+            break;
+        case BENCH_POLICY:
+            rc = bench_policy (sapi_context);
+            break;
+        case BENCH_NV_WRITE:
+        case BENCH_NV_READ:
+            rc = bench_nv (sapi_context, nv_index, config->nv_size,
+                           op == BENCH_NV_WRITE);
+            break;
+        default:
+            rc = bench_session (sapi_context,
+                sessions [g_rand_int_range (rand, 0, config->sessions)]);
+            break;
+        }
+        end = g_get_monotonic_time ();
+        if (rc != TSS2_RC_SUCCESS) {
+            ++client->errors [op];
+            continue;
+        }
+        sample = (guint32)MIN (end - start, G_MAXUINT32);
+        g_array_append_val (client->samples [op], sample);
+    } while (end < deadline);
+    g_rand_free (rand);
+out:
+    for (i = 0; i < BENCH_KEYS_MAX && keys [i] != 0; ++i) {
+        flush_context (sapi_context, keys [i]);
+    }
+    for (i = 0; i < BENCH_SESSIONS_MAX && sessions [i] != 0; ++i) {
+        flush_context (sapi_context, sessions [i]);
+    }
+    if (primary != 0) {
+        flush_context (sapi_context, primary);
+    }
+    if (nv_defined) {
+        bench_nv_undefine (sapi_context, nv_index);
+    }
+    sapi_teardown_full (sapi_context);
+    return NULL;
+}
+static void
+bench_churn_sample (bench_client_t      *client,
+                    bench_churn_phase_t  phase,
+                    gint64               time_us)
+{
+    guint32 sample = (guint32)CLAMP (time_us, 0, G_MAXUINT32);
+
+    g_array_append_val (client->churn [phase], sample);
+}
+/*
+ * Open a connection, send one command and close it, over and over. The
+ * connection is set up by the TCTI: over D-Bus, or the daemon's socket if
+ * the TCTI configuration asks for it.
+ */
+static gpointer
+bench_churn_func (gpointer user_data)
+{
+    bench_client_t *client = (bench_client_t*)user_data;
+    bench_config_t const *config = client->config;
+    test_opts_t test_opts = config->test_opts;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    TSS2_SYS_CONTEXT *sapi_context;
+    gint64 start, connected, answered, end, deadline;
+    TSS2_RC rc;
+
+    deadline = g_get_monotonic_time () + config->duration * G_USEC_PER_SEC;
+    do {
+        start = g_get_monotonic_time ();
+        tcti_context = tcti_init_from_opts (&test_opts);
+        connected = g_get_monotonic_time ();
+        if (tcti_context == NULL) {
+            ++client->churn_errors;
+            end = connected;
+            continue;
+        }
+        sapi_context = sapi_init_from_tcti_ctx (tcti_context);
+        if (sapi_context == NULL) {
+            tcti_free_from_opts (&test_opts, &tcti_context);
+            ++client->churn_errors;
+            end = g_get_monotonic_time ();
+            continue;
+        }
+        rc = bench_get_random (sapi_context);
+        answered = g_get_monotonic_time ();
+        sapi_teardown_full (sapi_context);
+        end = g_get_monotonic_time ();
+        if (rc != TSS2_RC_SUCCESS) {
+            ++client->churn_errors;
+            continue;
+        }
+        bench_churn_sample (client, BENCH_CHURN_CONNECT, connected - start);
+        bench_churn_sample (client, BENCH_CHURN_FIRST, answered - connected);
+        bench_churn_sample (client, BENCH_CHURN_CYCLE, end - start);
+    } while (end < deadline);
+    return NULL;
+}
+static gint
+bench_compare_samples (gconstpointer a,
+                       gconstpointer b)
+{
+    guint32 sample_a = *(guint32 const*)a, sample_b = *(guint32 const*)b;
+
+    return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+/*
+ * The sample below which 'per_mille' thousandths of the sorted samples
+ * fall, nearest rank.
+ */
+static guint32
+bench_percentile (GArray *samples,
+                  guint   per_mille)
+{
+    guint rank;
+
+    rank = (guint)(((guint64)samples->len * per_mille + 999) / 1000);
+    rank = CLAMP (rank, 1, samples->len);
+    return g_array_index (samples, guint32, rank - 1);
+}
+static void
+bench_report_line (const gchar *name,
+                   GArray      *samples,
+                   guint        errors,
+                   guint        duration)
+{
+    if (samples->len == 0) {
+        printf ("%-10s %10u %10s %10s %10s %10s %8u\n",
+                name, 0, "-", "-", "-", "-", errors);
+        return;
+    }
+    g_array_sort (samples, bench_compare_samples);
+    printf ("%-10s %10u %10.1f %10" PRIu32 " %10" PRIu32 " %10" PRIu32
+            " %8u\n",
+            name,
+            samples->len,
+            (gdouble)samples->len / duration,
+            bench_percentile (samples, 500),
+            bench_percentile (samples, 990),
+            bench_percentile (samples, 999),
+            errors);
+}
+/*
+ * Print the results of each operation and return the number of commands
+ * the clients got a response for.
+ */
+static guint64
+bench_report (bench_config_t const *config,
+              bench_client_t       *clients)
+{
+    GArray *merged, *all;
+    guint op, i, errors, all_errors = 0;
+    guint64 completed;
+
+    printf ("%u clients, %u s\n", config->clients, config->duration);
+    printf ("%-10s %10s %10s %10s %10s %10s %8s\n",
+            "operation", "count", "ops/s", "p50 us", "p99 us", "p999 us",
+            "errors");
+    all = g_array_new (FALSE, FALSE, sizeof (guint32));
+    for (op = 0; op < BENCH_OPS; ++op) {
+        if (config->weights [op] == 0) {
+            continue;
+        }
+        merged = g_array_new (FALSE, FALSE, sizeof (guint32));
+        errors = 0;
+        for (i = 0; i < config->clients; ++i) {
+            g_array_append_vals (merged,
+                                 clients [i].samples [op]->data,
+                                 clients [i].samples [op]->len);
+            errors += clients [i].errors [op];
+        }
+        g_array_append_vals (all, merged->data, merged->len);
+        all_errors += errors;
+        bench_report_line (bench_op_names [op],
+                           merged,
+                           errors,
+                           config->duration);
+        g_array_unref (merged);
+    }
+    bench_report_line ("total", all, all_errors, config->duration);
+    completed = all->len + all_errors;
+    g_array_unref (all);
+    return completed;
+}
+/*
+ * Print the results of --churn: cycles per second and the latency of
+ * each part of a cycle.
+ */
+static void
+bench_report_churn (bench_config_t const *config,
+                    bench_client_t       *clients)
+{
+    GArray *merged;
+    guint phase, i, errors = 0;
+
+    printf ("%u clients, %u s, connection churn\n",
+            config->clients, config->duration);
+    printf ("%-10s %10s %10s %10s %10s %10s %8s\n",
+            "phase", "count", "ops/s", "p50 us", "p99 us", "p999 us",
+            "errors");
+    for (i = 0; i < config->clients; ++i) {
+        errors += clients [i].churn_errors;
+    }
+    for (phase = 0; phase < BENCH_CHURN_PHASES; ++phase) {
+        merged = g_array_new (FALSE, FALSE, sizeof (guint32));
+        for (i = 0; i < config->clients; ++i) {
+            g_array_append_vals (merged,
+                                 clients [i].churn [phase]->data,
+                                 clients [i].churn [phase]->len);
+        }
+        bench_report_line (bench_churn_names [phase],
+                           merged,
+                           phase == BENCH_CHURN_CYCLE ? errors : 0,
+                           config->duration);
+        g_array_unref (merged);
+    }
+}
+/*
+ * Fetch the daemon's metrics page and split it in to lines. Returns NULL
+ * if the metrics can't be read, the caller frees the lines with
+ * g_strfreev otherwise.
+ */
+static gchar**
+bench_metrics_read (const gchar *address)
+{
+    static const gchar request [] = "GET /metrics HTTP/1.0\r\n\r\n";
+    GSocketClient *client;
+    GSocketConnection *connection = NULL;
+    GSocketAddress *socket_address;
+    GError *error = NULL;
+    gchar *page = NULL, **lines = NULL;
+    gsize received = 0;
+    gssize count;
+    guint64 port;
+
+    client = g_socket_client_new ();
+    if (address [0] == '/') {
+        socket_address = g_unix_socket_address_new (address);
+        connection = g_socket_client_connect (client,
+                                              G_SOCKET_CONNECTABLE (socket_address),
+                                              NULL,
+                                              &error);
+        g_object_unref (socket_address);
+    } else if (g_ascii_string_to_unsigned (address, 10, 1, G_MAXUINT16,
+                                           &port, &error))
+    {
+        connection = g_socket_client_connect_to_host (client,
+                                                      "127.0.0.1",
+                                                      (guint16)port,
+                                                      NULL,
+                                                      &error);
+    }
+    if (connection == NULL) {
+        g_warning ("failed to connect to metrics at %s: %s",
+                   address, error->message);
+        goto out;
+    }
+    if (!g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (connection)),
+                                    request,
+                                    sizeof (request) - 1,
+                                    NULL,
+                                    NULL,
+                                    &error))
+    {
+        g_warning ("failed to request metrics: %s", error->message);
+        goto out;
+    }
+    page = g_malloc0 (BENCH_METRICS_MAX + 1);
+    do {
+        count = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (connection)),
+                                     page + received,
+                                     BENCH_METRICS_MAX - received,
+                                     NULL,
+                                     &error);
+        if (count < 0) {
+            g_warning ("failed to read metrics: %s", error->message);
+            goto out;
+        }
+        received += count;
+    } while (count > 0 && received < BENCH_METRICS_MAX);
+    lines = g_strsplit (page, "\n", -1);
+out:
+    g_clear_error (&error);
+    g_free (page);
+    g_clear_object (&connection);
+    g_object_unref (client);
+    return lines;
+}
+/*
+ * Add up the values of the samples on the lines starting with 'prefix'.
+ */
+static guint64
+bench_metrics_sum (gchar       **lines,
+                   const gchar  *prefix)
+{
+    gchar *value;
+    guint64 sum = 0;
+    guint i;
+
+    for (i = 0; lines [i] != NULL; ++i) {
+        if (!g_str_has_prefix (lines [i], prefix)) {
+            continue;
+        }
+        value = strrchr (lines [i], ' ');
+        if (value != NULL) {
+            sum += g_ascii_strtoull (value + 1, NULL, 10);
+        }
+    }
+    return sum;
+}
+/*
+ * Add up the context loads, saves and flushes of every TPM. Returns FALSE
+ * if the metrics can't be read.
+ */
+static gboolean
+bench_context_operations (const gchar *address,
+                          guint64     *operations)
+{
+    gchar **lines;
+
+    lines = bench_metrics_read (address);
+    if (lines == NULL) {
+        return FALSE;
+    }
+    *operations = bench_metrics_sum (lines,
+                                     "tabrmd_context_operations_total{");
+    g_strfreev (lines);
+    return TRUE;
+}
+/*
+ * Read the daemon's resident memory and heap. The heap is only reported
+ * by daemons built with mallinfo2, it reads as 0 otherwise.
+ */
+static gboolean
+bench_memory_read (const gchar    *address,
+                   bench_memory_t *memory)
+{
+    gchar **lines;
+
+    lines = bench_metrics_read (address);
+    if (lines == NULL) {
+        return FALSE;
+    }
+    memory->resident = bench_metrics_sum (lines,
+                                          "process_resident_memory_bytes ");
+    memory->heap = bench_metrics_sum (lines,
+                                      "tabrmd_heap_bytes{state=\"allocated\"}");
+    memory->heap_free = bench_metrics_sum (lines,
+                                           "tabrmd_heap_bytes{state=\"free\"}");
+    g_strfreev (lines);
+    return TRUE;
+}
+/*
+ * Print the memory after a step of a --footprint round along with what
+ * the heap grew by from the step before, for each of the 'count' things
+ * the step added. The steps that free things are compared with the idle
+ * daemon at the start of the round instead: what's left is either cached
+ * by the daemon or leaked.
+ */
+static void
+bench_footprint_line (guint                   round,
+                      bench_footprint_step_t  step,
+                      guint                   count,
+                      bench_memory_t const   *memory,
+                      bench_memory_t const   *before)
+{
+    gint64 delta = (gint64)memory->heap - (gint64)before->heap;
+
+    printf ("%5u %-10s %8u %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+            " %10" G_GUINT64_FORMAT " %+12" G_GINT64_FORMAT,
+            round,
+            bench_footprint_names [step],
+            count,
+            memory->resident / 1024,
+            memory->heap / 1024,
+            memory->heap_free / 1024,
+            delta);
+    if (count > 0) {
+        printf (" %10" G_GINT64_FORMAT "\n", delta / (gint64)count);
+    } else {
+        printf (" %10s\n", "-");
+    }
+}
+/*
+ * Fill the daemon with the clients' connections, keys and sessions and
+ * empty it again, BENCH_FOOTPRINT_ROUNDS times, reading its memory after
+ * each step. To find the cost at the limits the daemon is configured
+ * with, set --clients, --keys and --sessions to --max-connections,
+ * --max-transients and --max-sessions. Returns the exit status.
+ */
+static gint
+bench_footprint (bench_config_t const *config)
+{
+    test_opts_t test_opts = config->test_opts;
+    TSS2_SYS_CONTEXT **sapi_contexts;
+    TPM2_HANDLE *keys, primary = 0;
+    TPMI_SH_AUTH_SESSION *sessions;
+    TPM2B_PRIVATE key_private = TPM2B_PRIVATE_STATIC_INIT;
+    TPM2B_PUBLIC key_public = TPM2B_PUBLIC_ZERO_INIT;
+    bench_memory_t idle, previous, memory = { 0, }, first_closed = { 0, };
+    guint round, i, j;
+    gboolean created = FALSE;
+    gint ret = 0;
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+
+    sapi_contexts = g_new0 (TSS2_SYS_CONTEXT*, config->clients);
+    keys = g_new0 (TPM2_HANDLE, config->clients * config->keys);
+    sessions = g_new0 (TPMI_SH_AUTH_SESSION,
+                       MAX (config->clients * config->sessions, 1));
+    printf ("%u connections, %u keys and %u sessions each\n",
+            config->clients, config->keys, config->sessions);
+    printf ("%5s %-10s %8s %10s %10s %10s %12s %10s\n",
+            "round", "step", "count", "rss KiB", "heap KiB", "free KiB",
+            "heap delta", "bytes each");
+    for (round = 1; round <= BENCH_FOOTPRINT_ROUNDS; ++round) {
+        if (!bench_memory_read (config->metrics, &idle)) {
+            ret = 1;
+            break;
+        }
+        bench_footprint_line (round, BENCH_FOOTPRINT_IDLE, 0, &idle, &idle);
+
+        for (i = 0; i < config->clients; ++i) {
+            sapi_contexts [i] = sapi_init_from_opts (&test_opts);
+            if (sapi_contexts [i] == NULL) {
+                g_warning ("connection %u: failed to connect to tabrmd", i);
+                ret = 1;
+                goto close;
+            }
+        }
+        bench_memory_read (config->metrics, &memory);
+        bench_footprint_line (round, BENCH_FOOTPRINT_CONNECTED,
+                              config->clients, &memory, &idle);
+        previous = memory;
+
+        for (i = 0; i < config->clients && rc == TSS2_RC_SUCCESS; ++i) {
+            rc = create_primary (sapi_contexts [i], &primary);
+            if (rc == TSS2_RC_SUCCESS && !created) {
+                /* the same key loads under the primary of any connection */
+                rc = create_key (sapi_contexts [i], primary,
+                                 &key_private, &key_public);
+                created = rc == TSS2_RC_SUCCESS;
+            }
+            for (j = 0; j < config->keys && rc == TSS2_RC_SUCCESS; ++j) {
+                rc = load_key (sapi_contexts [i],
+                               primary,
+                               &keys [i * config->keys + j],
+                               &key_private,
+                               &key_public);
+            }
+            if (primary != 0) {
+                flush_context (sapi_contexts [i], primary);
+                primary = 0;
+            }
+        }
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("connection %u: failed to load key: 0x%" PRIx32,
+                       i - 1, rc);
+            ret = 1;
+            goto close;
+        }
+        bench_memory_read (config->metrics, &memory);
+        bench_footprint_line (round, BENCH_FOOTPRINT_KEYS,
+                              config->clients * config->keys,
+                              &memory, &previous);
+        previous = memory;
+
+        for (i = 0; i < config->clients * config->sessions; ++i) {
+            rc = start_auth_session (sapi_contexts [i / config->sessions],
+                                     &sessions [i]);
+            if (rc != TSS2_RC_SUCCESS) {
+                g_warning ("connection %u: failed to start session: 0x%"
+                           PRIx32, i / config->sessions, rc);
+                ret = 1;
+                goto close;
+            }
+        }
+        if (config->sessions > 0) {
+            bench_memory_read (config->metrics, &memory);
+            bench_footprint_line (round, BENCH_FOOTPRINT_SESSIONS,
+                                  config->clients * config->sessions,
+                                  &memory, &previous);
+        }
+
+        for (i = 0; i < config->clients * config->keys; ++i) {
+            flush_context (sapi_contexts [i / config->keys], keys [i]);
+            keys [i] = 0;
+        }
+        for (i = 0; i < config->clients * config->sessions; ++i) {
+            flush_context (sapi_contexts [i / config->sessions], sessions [i]);
+            sessions [i] = 0;
+        }
+        bench_memory_read (config->metrics, &memory);
+        bench_footprint_line (round, BENCH_FOOTPRINT_FLUSHED, 0,
+                              &memory, &idle);
+close:
+        for (i = 0; i < config->clients; ++i) {
+            if (sapi_contexts [i] != NULL) {
+                sapi_teardown_full (sapi_contexts [i]);
+                sapi_contexts [i] = NULL;
+            }
+        }
+        if (ret != 0) {
+            break;
+        }
+        /* the daemon cleans up a closed connection on its own time */
+        g_usleep (G_USEC_PER_SEC / 2);
+        bench_memory_read (config->metrics, &memory);
+        bench_footprint_line (round, BENCH_FOOTPRINT_CLOSED, 0,
+                              &memory, &idle);
+        if (round == 1) {
+            first_closed = memory;
+        }
+    }
+    /*
+     * The first round warms up the caches of the daemon and its
+     * allocator, what the heap grows by in later rounds is what leaks.
+     */
+    if (ret == 0) {
+        printf ("heap grew by %+" G_GINT64_FORMAT " bytes over rounds 2 to %u\n",
+                (gint64)memory.heap - (gint64)first_closed.heap,
+                BENCH_FOOTPRINT_ROUNDS);
+    }
+    g_free (sessions);
+    g_free (keys);
+    g_free (sapi_contexts);
+    return ret;
+}
+/*
+ * Report how many transient objects the TPM can hold against how many
+ * the clients keep, to show whether the run makes the daemon swap.
+ */
+static void
+bench_report_slots (bench_config_t *config)
+{
+    test_opts_t test_opts = config->test_opts;
+    TSS2_SYS_CONTEXT *sapi_context;
+    TPMS_CAPABILITY_DATA capability_data;
+    TPMI_YES_NO more_data;
+    TSS2_RC rc;
+
+    sapi_context = sapi_init_from_opts (&test_opts);
+    if (sapi_context == NULL) {
+        return;
+    }
+    rc = Tss2_Sys_GetCapability (sapi_context,
+                                 NULL,
+                                 TPM2_CAP_TPM_PROPERTIES,
+                                 TPM2_PT_HR_TRANSIENT_MIN,
+                                 1,
+                                 &more_data,
+                                 &capability_data,
+                                 NULL);
+    if (rc == TSS2_RC_SUCCESS &&
+        capability_data.data.tpmProperties.count == 1)
+    {
+        printf ("%u transient objects kept, TPM2_PT_HR_TRANSIENT_MIN is %"
+                PRIu32 "\n",
+                config->clients * config->keys,
+                capability_data.data.tpmProperties.tpmProperty [0].value);
+    }
+    sapi_teardown_full (sapi_context);
+}
+/*
+ * Parse a command mix like "getrandom=4,sign=1" in to the weights of the
+ * operations. Operations that aren't named have a weight of 0.
+ */
+static gboolean
+bench_parse_mix (bench_config_t *config,
+                 const gchar    *mix)
+{
+    gchar **entries, **pair;
+    guint64 weight;
+    guint i, op;
+    gboolean ret = TRUE;
+
+    memset (config->weights, 0, sizeof (config->weights));
+    config->weight_total = 0;
+    entries = g_strsplit (mix, ",", -1);
+    for (i = 0; entries [i] != NULL && ret; ++i) {
+        pair = g_strsplit (entries [i], "=", 2);
+        for (op = 0; op < BENCH_OPS; ++op) {
+            if (g_strcmp0 (pair [0], bench_op_names [op]) == 0) {
+                break;
+            }
+        }
+        if (op == BENCH_OPS || pair [1] == NULL ||
+            !g_ascii_string_to_unsigned (pair [1], 10, 0, 1000, &weight, NULL))
+        {
+            g_critical ("invalid command mix entry \"%s\"", entries [i]);
+            ret = FALSE;
+        } else {
+            config->weights [op] = (guint)weight;
+            config->weight_total += (guint)weight;
+        }
+        g_strfreev (pair);
+    }
+    g_strfreev (entries);
+    if (ret && config->weight_total == 0) {
+        g_critical ("the command mix must have an operation with a weight");
+        ret = FALSE;
+    }
+    return ret;
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    bench_config_t config = {
+        .clients = 4,
+        .duration = 10,
+        .keys = 1,
+        .nv_size = BENCH_NV_SIZE_DEFAULT,
+        .test_opts = TEST_OPTS_DEFAULT_INIT,
+    };
+    gchar *mix = NULL;
+    GOptionContext *context;
+    GError *error = NULL;
+    bench_client_t *clients;
+    GThread **threads;
+    guint i, op, phase;
+    guint64 completed, operations_before = 0, operations_after = 0;
+    gboolean counted = FALSE;
+    gint ret = 0;
+    GOptionEntry entries [] = {
+        { "clients", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.clients, "Number of client threads, each with its own "
+          "connection.", NULL },
+        { "duration", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.duration, "Seconds each client runs for.", NULL },
+        { "mix", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &mix,
+          "Weights of the operations, like \"getrandom=4,pcrread=2,"
+          "sign=1,policy=1,nvwrite=0,nvread=0,session=0\".", NULL },
+        { "keys", 'k', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.keys, "Signing keys each client keeps loaded.", NULL },
+        { "sessions", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.sessions, "Policy sessions each client keeps for the "
+          "session operation.", NULL },
+        { "nv-size", 'n', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT,
+          &config.nv_size, "Bytes each client's NV index holds, written "
+          "or read whole by the NV operations.", NULL },
+        { "metrics", 'M', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING,
+          &config.metrics, "Address of the daemon's metrics listener, to "
+          "count the context operations.", NULL },
+        { "churn", 'C', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &config.churn, "Connect, send GetRandom and disconnect in a loop "
+          "instead of running the mix.", NULL },
+        { "footprint", 'F', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+          &config.footprint, "Measure the daemon's memory as the clients "
+          "connect, load their keys and start their sessions, then free "
+          "them. Needs --metrics.", NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    context = g_option_context_new (" - tpm2-abrmd throughput benchmark");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_critical ("failed to parse options: %s", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 2;
+    }
+    g_option_context_free (context);
+    if (!bench_parse_mix (&config,
+                          mix != NULL ? mix :
+                          "getrandom=4,pcrread=2,sign=1,policy=1"))
+    {
+        g_free (mix);
+        return 2;
+    }
+    g_free (mix);
+    if (config.clients == 0 || config.duration == 0) {
+        g_critical ("clients and duration must be greater than 0");
+        return 2;
+    }
+    if (config.keys == 0 || config.keys > BENCH_KEYS_MAX ||
+        config.sessions > BENCH_SESSIONS_MAX)
+    {
+        g_critical ("keys must be between 1 and %u, sessions at most %u",
+                    BENCH_KEYS_MAX, BENCH_SESSIONS_MAX);
+        return 2;
+    }
+    if (config.nv_size == 0 || config.nv_size > TPM2_MAX_NV_BUFFER_SIZE) {
+        g_critical ("nv-size must be between 1 and %u",
+                    TPM2_MAX_NV_BUFFER_SIZE);
+        return 2;
+    }
+    if (config.weights [BENCH_SESSION] > 0 && config.sessions == 0) {
+        g_critical ("the session operation needs --sessions");
+        return 2;
+    }
+    get_test_opts_from_env (&config.test_opts);
+    if (sanity_check_test_opts (&config.test_opts) != 0) {
+        return 2;
+    }
+    if (config.footprint) {
+        if (config.metrics == NULL) {
+            g_critical ("--footprint reads the daemon's memory from "
+                        "--metrics");
+            return 2;
+        }
+        ret = bench_footprint (&config);
+        g_free (config.metrics);
+        return ret;
+    }
+
+    if (config.weights [BENCH_SIGN] > 0 && !config.churn) {
+        bench_report_slots (&config);
+    }
+    if (config.metrics != NULL) {
+        counted = bench_context_operations (config.metrics,
+                                            &operations_before);
+    }
+    clients = g_new0 (bench_client_t, config.clients);
+    threads = g_new0 (GThread*, config.clients);
+    for (i = 0; i < config.clients; ++i) {
+        clients [i].config = &config;
+        clients [i].index = i;
+        for (op = 0; op < BENCH_OPS; ++op) {
+            clients [i].samples [op] = g_array_new (FALSE,
+                                                    FALSE,
+                                                    sizeof (guint32));
+        }
+        for (phase = 0; phase < BENCH_CHURN_PHASES; ++phase) {
+            clients [i].churn [phase] = g_array_new (FALSE,
+                                                     FALSE,
+                                                     sizeof (guint32));
+        }
+        threads [i] = g_thread_new (NULL,
+                                    config.churn ? bench_churn_func :
+                                    bench_client_func,
+                                    &clients [i]);
+    }
+    for (i = 0; i < config.clients; ++i) {
+        g_thread_join (threads [i]);
+        if (clients [i].failed) {
+            ret = 1;
+        }
+    }
+    if (config.churn) {
+        bench_report_churn (&config, clients);
+        completed = 0;
+    } else {
+        completed = bench_report (&config, clients);
+    }
+    if (counted &&
+        bench_context_operations (config.metrics, &operations_after) &&
+        completed > 0)
+    {
+        /* setting up and tearing down the clients is counted too */
+        printf ("%" G_GUINT64_FORMAT " context operations, %.2f per "
+                "command\n",
+                operations_after - operations_before,
+                (gdouble)(operations_after - operations_before) / completed);
+    }
+    for (i = 0; i < config.clients; ++i) {
+        for (op = 0; op < BENCH_OPS; ++op) {
+            g_array_unref (clients [i].samples [op]);
+        }
+        for (phase = 0; phase < BENCH_CHURN_PHASES; ++phase) {
+            g_array_unref (clients [i].churn [phase]);
+        }
+    }
+    g_free (threads);
+    g_free (clients);
+    g_free (config.metrics);
+    return ret;
+}
@@ -0,0 +1,400 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Replay a command recording made with tpm2-abrmd --record. Each recorded
+ * connection gets a connection of its own, opened when the first command
+ * was recorded and closed when the recorded one was, and sends the
+ * recorded commands at the times they were recorded at. The TCTI is set
+ * up the way the integration tests do (TABRMD_TEST_TCTI_CONF), this is
+ * meant to be run against a daemon on a simulator.
+ *
+ * The commands are sent as they were recorded: the handles in them are
+ * the virtual handles the original daemon gave that connection, which a
+ * fresh daemon gives out in the same order. Session handles come from the
+ * TPM though and may differ, the commands whose response code differs
+ * from the recorded one are counted.
+ */
+#include <errno.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tss2/tss2_tcti.h>
+
+#include "command-recorder.h"
+#include "context-util.h"
+#include "test-options.h"
+#include "tpm2-header.h"
+
+typedef struct {
+    guint64      time;
+    guint8      *data;
+    guint32      size;
+    /* the recorded response, if there is one */
+    gboolean     answered;
+    guint64      answer_time;
+    TSS2_RC      rc;
+} replay_command_t;
+
+typedef struct {
+    guint        serial;
+    GArray      *commands;
+    /* the next command without its response in the recording */
+    guint        unanswered;
+    gboolean     closed;
+    guint64      close_time;
+} replay_connection_t;
+
+typedef struct {
+    gdouble      speed;
+    gint64       start;
+    test_opts_t  test_opts;
+    GMutex       mutex;
+    /* the samples of all connections, under the mutex */
+    GArray      *latency;
+    GArray      *recorded_latency;
+    GArray      *lateness;
+    guint        errors;
+    guint        mismatches;
+} replay_t;
+
+typedef struct {
+    replay_t            *replay;
+    replay_connection_t *connection;
+} replay_client_t;
+
+static void
+replay_connection_free (gpointer data)
+{
+    replay_connection_t *connection = (replay_connection_t*)data;
+    guint i;
+
+    for (i = 0; i < connection->commands->len; ++i) {
+        g_free (g_array_index (connection->commands,
+                               replay_command_t, i).data);
+    }
+    g_array_unref (connection->commands);
+    g_free (connection);
+}
+/*
+ * Read the recording at 'path' into a table of replay_connection_t keyed
+ * by the connection serial. Responses are paired with the commands of
+ * their connection in order, the daemon answers them in order too.
+ */
+static GHashTable*
+replay_load (const gchar *path)
+{
+    GHashTable *connections;
+    replay_connection_t *connection;
+    replay_command_t command = { 0, }, *answered;
+    command_record_t record;
+    FILE *file;
+    gint ret;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        g_critical ("failed to open %s: %s", path, strerror (errno));
+        return NULL;
+    }
+    if (!command_record_read_header (file)) {
+        fclose (file);
+        return NULL;
+    }
+    connections = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, replay_connection_free);
+    while ((ret = command_record_read (file, &record)) > 0) {
+        connection = g_hash_table_lookup (connections,
+                                          GUINT_TO_POINTER (record.connection));
+        if (connection == NULL) {
+            if (record.type != COMMAND_RECORD_COMMAND) {
+                /* the connection was open before the recording started */
+                g_free (record.data);
+                continue;
+            }
+            connection = g_new0 (replay_connection_t, 1);
+            connection->serial = record.connection;
+            connection->commands = g_array_new (FALSE,
+                                                FALSE,
+                                                sizeof (replay_command_t));
+            g_hash_table_insert (connections,
+                                 GUINT_TO_POINTER (record.connection),
+                                 connection);
+        }
+        switch (record.type) {
+        case COMMAND_RECORD_COMMAND:
+            if (record.size < TPM_HEADER_SIZE) {
+                g_free (record.data);
+                break;
+            }
+            command.time = record.time;
+            command.data = record.data;
+            command.size = record.size;
+            g_array_append_val (connection->commands, command);
+            break;
+        case COMMAND_RECORD_RESPONSE:
+            if (connection->unanswered < connection->commands->len &&
+                record.size >= TPM_HEADER_SIZE)
+            {
+                answered = &g_array_index (connection->commands,
+                                           replay_command_t,
+                                           connection->unanswered++);
+                answered->answered = TRUE;
+                answered->answer_time = record.time;
+                answered->rc = get_response_code (record.data);
+            }
+            g_free (record.data);
+            break;
+        case COMMAND_RECORD_CLOSE:
+            connection->closed = TRUE;
+            connection->close_time = record.time;
+            break;
+        }
+    }
+    fclose (file);
+    if (ret < 0) {
+        g_warning ("recording %s is truncated, replaying what could be read",
+                   path);
+    }
+    return connections;
+}
+/*
+ * Sleep until 'time' microseconds into the recording, scaled by the
+ * speed. Returns how many microseconds late we are for it.
+ */
+static guint64
+replay_wait (replay_t const *replay,
+             guint64         time)
+{
+    gint64 due, now;
+
+    if (replay->speed <= 0) {
+        return 0;
+    }
+    due = replay->start + (gint64)(time / replay->speed);
+    now = g_get_monotonic_time ();
+    if (now < due) {
+        g_usleep (due - now);
+        return 0;
+    }
+    return now - due;
+}
+static void
+replay_sample (GArray  *samples,
+               guint64  sample)
+{
+    guint32 value = (guint32)MIN (sample, G_MAXUINT32);
+
+    g_array_append_val (samples, value);
+}
+static gpointer
+replay_client_func (gpointer user_data)
+{
+    replay_client_t *client = (replay_client_t*)user_data;
+    replay_t *replay = client->replay;
+    replay_connection_t *connection = client->connection;
+    replay_command_t *command;
+    test_opts_t test_opts = replay->test_opts;
+    TSS2_TCTI_CONTEXT *tcti_context;
+    uint8_t response [TPM2_MAX_RESPONSE_SIZE];
+    size_t size;
+    gint64 sent;
+    guint64 late, latency;
+    guint i, errors = 0, mismatches = 0;
+    TSS2_RC rc;
+
+    tcti_context = tcti_init_from_opts (&test_opts);
+    if (tcti_context == NULL) {
+        g_warning ("failed to connect for recorded connection %u",
+                   connection->serial);
+        g_mutex_lock (&replay->mutex);
+        replay->errors += connection->commands->len;
+        g_mutex_unlock (&replay->mutex);
+        goto out;
+    }
+    for (i = 0; i < connection->commands->len; ++i) {
+        command = &g_array_index (connection->commands, replay_command_t, i);
+        late = replay_wait (replay, command->time);
+        sent = g_get_monotonic_time ();
+        rc = Tss2_Tcti_Transmit (tcti_context, command->size, command->data);
+        if (rc == TSS2_RC_SUCCESS) {
+            size = sizeof (response);
+            rc = Tss2_Tcti_Receive (tcti_context,
+                                    &size,
+                                    response,
+                                    TSS2_TCTI_TIMEOUT_BLOCK);
+        }
+        latency = g_get_monotonic_time () - sent;
+        if (rc != TSS2_RC_SUCCESS) {
+            g_warning ("connection %u failed on command %u: 0x%" PRIx32,
+                       connection->serial, i, rc);
+            errors += connection->commands->len - i;
+            break;
+        }
+        if (command->answered && get_response_code (response) != command->rc) {
+            ++mismatches;
+        }
+        g_mutex_lock (&replay->mutex);
+        replay_sample (replay->latency, latency);
+        replay_sample (replay->lateness, late);
+        if (command->answered) {
+            replay_sample (replay->recorded_latency,
+                           command->answer_time - command->time);
+        }
+        g_mutex_unlock (&replay->mutex);
+    }
+    if (connection->closed) {
+        replay_wait (replay, connection->close_time);
+    }
+    tcti_free_from_opts (&test_opts, &tcti_context);
+    g_mutex_lock (&replay->mutex);
+    replay->errors += errors;
+    replay->mismatches += mismatches;
+    g_mutex_unlock (&replay->mutex);
+out:
+    g_free (client);
+    return NULL;
+}
+static gint
+replay_compare_samples (gconstpointer a,
+                        gconstpointer b)
+{
+    guint32 sample_a = *(guint32 const*)a, sample_b = *(guint32 const*)b;
+
+    return sample_a < sample_b ? -1 : sample_a > sample_b;
+}
+/* nearest rank percentile of sorted samples, in thousandths */
+static guint32
+replay_percentile (GArray *samples,
+                   guint   per_mille)
+{
+    guint rank;
+
+    rank = (guint)(((guint64)samples->len * per_mille + 999) / 1000);
+    rank = CLAMP (rank, 1, samples->len);
+    return g_array_index (samples, guint32, rank - 1);
+}
+static void
+replay_report_line (const gchar *name,
+                    GArray      *samples)
+{
+    if (samples->len == 0) {
+        printf ("%-10s %10u %10s %10s %10s\n", name, 0, "-", "-", "-");
+        return;
+    }
+    g_array_sort (samples, replay_compare_samples);
+    printf ("%-10s %10u %10" PRIu32 " %10" PRIu32 " %10" PRIu32 "\n",
+            name,
+            samples->len,
+            replay_percentile (samples, 500),
+            replay_percentile (samples, 990),
+            replay_percentile (samples, 999));
+}
+static gint
+replay_compare_connections (gconstpointer a,
+                            gconstpointer b)
+{
+    replay_connection_t const *conn_a = *(replay_connection_t* const*)a;
+    replay_connection_t const *conn_b = *(replay_connection_t* const*)b;
+    guint64 time_a = g_array_index (conn_a->commands, replay_command_t, 0).time;
+    guint64 time_b = g_array_index (conn_b->commands, replay_command_t, 0).time;
+
+    return time_a < time_b ? -1 : time_a > time_b;
+}
+int
+main (int   argc,
+      char *argv [])
+{
+    replay_t replay = {
+        .speed = 1.0,
+        .test_opts = TEST_OPTS_DEFAULT_INIT,
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    GHashTable *connections;
+    GHashTableIter iter;
+    gpointer value;
+    GPtrArray *order, *threads;
+    replay_client_t *client;
+    replay_connection_t *connection;
+    gint64 elapsed;
+    guint i;
+    GOptionEntry entries [] = {
+        { "speed", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE,
+          &replay.speed, "Replay this many times faster than recorded, 0 "
+          "for as fast as possible.", NULL },
+        { NULL, '\0', 0, 0, NULL, NULL, NULL },
+    };
+
+    context = g_option_context_new ("RECORDING - replay tpm2-abrmd "
+                                    "command recordings");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_critical ("failed to parse options: %s", error->message);
+        g_clear_error (&error);
+        g_option_context_free (context);
+        return 2;
+    }
+    g_option_context_free (context);
+    if (argc != 2 || replay.speed < 0) {
+        g_critical ("usage: %s [--speed=factor] RECORDING", argv [0]);
+        return 2;
+    }
+    get_test_opts_from_env (&replay.test_opts);
+    if (sanity_check_test_opts (&replay.test_opts) != 0) {
+        return 2;
+    }
+    connections = replay_load (argv [1]);
+    if (connections == NULL) {
+        return 1;
+    }
+
+    order = g_ptr_array_new ();
+    g_hash_table_iter_init (&iter, connections);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        g_ptr_array_add (order, value);
+    }
+    g_ptr_array_sort (order, replay_compare_connections);
+    printf ("replaying %u connections from %s\n", order->len, argv [1]);
+
+    g_mutex_init (&replay.mutex);
+    replay.latency = g_array_new (FALSE, FALSE, sizeof (guint32));
+    replay.recorded_latency = g_array_new (FALSE, FALSE, sizeof (guint32));
+    replay.lateness = g_array_new (FALSE, FALSE, sizeof (guint32));
+    threads = g_ptr_array_new ();
+    replay.start = g_get_monotonic_time ();
+    /* each connection is opened when its first command was recorded */
+    for (i = 0; i < order->len; ++i) {
+        connection = g_ptr_array_index (order, i);
+        replay_wait (&replay,
+                     g_array_index (connection->commands,
+                                    replay_command_t, 0).time);
+        client = g_new0 (replay_client_t, 1);
+        client->replay = &replay;
+        client->connection = connection;
+        g_ptr_array_add (threads,
+                         g_thread_new (NULL, replay_client_func, client));
+    }
+    for (i = 0; i < threads->len; ++i) {
+        g_thread_join (g_ptr_array_index (threads, i));
+    }
+    elapsed = g_get_monotonic_time () - replay.start;
+
+    printf ("%-10s %10s %10s %10s %10s\n",
+            "us", "count", "p50", "p99", "p999");
+    replay_report_line ("replayed", replay.latency);
+    replay_report_line ("recorded", replay.recorded_latency);
+    replay_report_line ("late", replay.lateness);
+    printf ("%.1f s, %u commands failed, %u got a different response "
+            "code\n", (gdouble)elapsed / G_USEC_PER_SEC, replay.errors,
+            replay.mismatches);
+
+    g_ptr_array_free (threads, TRUE);
+    g_ptr_array_free (order, TRUE);
+    g_hash_table_unref (connections);
+    g_array_unref (replay.latency);
+    g_array_unref (replay.recorded_latency);
+    g_array_unref (replay.lateness);
+    g_mutex_clear (&replay.mutex);
+    return replay.errors > 0 ? 1 : 0;
+}
@@ -11,6 +11,8 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <tss2/tss2_mu.h>
+
 #include "tpm2-command.h"
 #include "util.h"
 
@@ -268,6 +270,19 @@ tpm2_command_get_connection_test (void **state)
 
     assert_int_equal (data->connection, tpm2_command_get_connection (data->command));
 }
+/*
+ * The borrowed Connection is the same object and no reference is taken.
+ */
+static void
+tpm2_command_peek_connection_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    guint ref_count = G_OBJECT (data->connection)->ref_count;
+
+    assert_ptr_equal (data->connection,
+                      tpm2_command_peek_connection (data->command));
+    assert_int_equal (G_OBJECT (data->connection)->ref_count, ref_count);
+}
 
 static void
 tpm2_command_get_buffer_test (void **state)
@@ -443,6 +458,22 @@ tpm2_command_get_auth_size_test (void **state)
     auths_area_size = tpm2_command_get_auths_size (data->command);
     assert_int_equal (auths_area_size, 0x92);
 }
+/*
+ * The parameter area of the command with auths begins right after the
+ * 0x92 byte authorization area.
+ */
+static void
+tpm2_command_get_params_offset_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    size_t offset;
+
+    offset = tpm2_command_get_params_offset (data->command);
+    assert_int_equal (offset,
+                      TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) +
+                      sizeof (UINT32) + 0x92);
+    assert_int_equal (data->buffer [offset + 1], 0x10);
+}
 /*
  * This structure is used to track state while processing the authorizations
  * from the command authorization area.
@@ -510,6 +541,83 @@ tpm2_command_foreach_auth_test (void **state)
                                tpm2_command_foreach_auth_callback,
                                &callback_state);
 }
+/*
+ * Callback for the auth area that's malformed: it must never be invoked.
+ */
+static void
+tpm2_command_foreach_auth_fail_callback (gpointer authorization,
+                                         gpointer user_data)
+{
+    UNUSED_PARAM (authorization);
+    UNUSED_PARAM (user_data);
+    fail ();
+}
+/*
+ * The nonce of the second authorization in 'cmd_with_auths' is made to
+ * run past the end of the auth area. The auth area is rejected as a whole
+ * when the command is created rather than handing out the first auth.
+ */
+static void
+tpm2_command_foreach_auth_malformed_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    guint8 *buffer;
+    size_t offset;
+    gboolean ret;
+
+    buffer = calloc (1, sizeof (cmd_with_auths));
+    memcpy (buffer, cmd_with_auths, sizeof (cmd_with_auths));
+    /* high byte of the nonce size in the second auth */
+    offset = TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) + sizeof (UINT32) +
+        0x49 + sizeof (TPM2_HANDLE);
+    buffer [offset] = 0x01;
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                sizeof (cmd_with_auths),
+                                tpm2_command_get_attributes (data->command));
+    ret = tpm2_command_foreach_auth (command,
+                                     tpm2_command_foreach_auth_fail_callback,
+                                     NULL);
+    assert_false (ret);
+    assert_int_equal (tpm2_command_get_params_offset (command), 0);
+    assert_int_equal (tpm2_command_get_auths_size (command), 0x92);
+    g_object_unref (command);
+}
+/*
+ * Both auths in 'cmd_with_auths' are HMAC sessions. With both handles
+ * replaced by TPM2_RS_PW there's no session to load for the command.
+ */
+static void
+tpm2_command_has_session_auths_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    Tpm2Command *command;
+    guint8 *buffer;
+    size_t offset;
+
+    assert_true (tpm2_command_has_session_auths (data->command));
+
+    buffer = calloc (1, sizeof (cmd_with_auths));
+    memcpy (buffer, cmd_with_auths, sizeof (cmd_with_auths));
+    offset = TPM_HEADER_SIZE + 2 * sizeof (TPM2_HANDLE) + sizeof (UINT32);
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (TPM2_RS_PW, buffer,
+                                                   sizeof (cmd_with_auths),
+                                                   &offset),
+                      TSS2_RC_SUCCESS);
+    offset += 0x49 - sizeof (TPM2_HANDLE);
+    assert_int_equal (Tss2_MU_TPM2_HANDLE_Marshal (TPM2_RS_PW, buffer,
+                                                   sizeof (cmd_with_auths),
+                                                   &offset),
+                      TSS2_RC_SUCCESS);
+    command = tpm2_command_new (data->connection,
+                                buffer,
+                                sizeof (cmd_with_auths),
+                                tpm2_command_get_attributes (data->command));
+    assert_true (tpm2_command_has_auths (command));
+    assert_false (tpm2_command_has_session_auths (command));
+    g_object_unref (command);
+}
 static void
 tpm2_command_flush_context_handle_test (void **state)
 {
@@ -618,6 +726,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_command_get_connection_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_peek_connection_test,
+                                         tpm2_command_setup,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_get_buffer_test,
                                          tpm2_command_setup,
                                          tpm2_command_teardown),
@@ -657,9 +768,18 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_command_get_auth_size_test,
                                          tpm2_command_setup_with_auths,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_get_params_offset_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_foreach_auth_test,
                                          tpm2_command_setup_with_auths,
                                          tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_foreach_auth_malformed_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_command_has_session_auths_test,
+                                         tpm2_command_setup_with_auths,
+                                         tpm2_command_teardown),
         cmocka_unit_test_setup_teardown (tpm2_command_flush_context_handle_test,
                                          tpm2_command_setup_flush_context_no_handle,
                                          tpm2_command_teardown),
@@ -408,6 +408,33 @@ tpm2_response_set_handle_no_handle_test (void **state)
 
     assert_int_equal (handle_out, 0);
 }
+/*
+ * The post processing function set on a response is run once by
+ * tpm2_response_post_process, a response without one is left alone.
+ */
+static guint post_process_count = 0;
+static TSS2_RC
+post_process_counter (Tpm2Response *response)
+{
+    assert_true (IS_TPM2_RESPONSE (response));
+    ++post_process_count;
+    return TSS2_RC_SUCCESS;
+}
+static void
+tpm2_response_post_process_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    post_process_count = 0;
+    assert_int_equal (tpm2_response_post_process (data->response),
+                      TSS2_RC_SUCCESS);
+    tpm2_response_set_post_process (data->response, post_process_counter);
+    assert_int_equal (tpm2_response_post_process (data->response),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_response_post_process (data->response),
+                      TSS2_RC_SUCCESS);
+    assert_int_equal (post_process_count, 1);
+}
 gint
 main (void)
 {
@@ -463,6 +490,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_response_set_handle_no_handle_test,
                                          tpm2_response_setup_with_handle,
                                          tpm2_response_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_response_post_process_test,
+                                         tpm2_response_setup,
+                                         tpm2_response_teardown),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }
@@ -5,11 +5,14 @@
  */
 #include <glib.h>
 #include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include <tss2/tss2_mu.h>
+
 #include "tpm2.h"
 #include "tpm2-header.h"
 #include "tpm2-response.h"
@@ -52,29 +55,6 @@ __wrap_Tss2_Sys_FlushContext (TSS2_SYS_CONTEXT *sysContext,
     return mock_type (TSS2_RC);
 }
 
-TSS2_RC
-__wrap_Tss2_Sys_ContextSave (TSS2_SYS_CONTEXT *sysContext,
-                             TPM2_HANDLE handle,
-                             TPMS_CONTEXT *context)
-{
-    UNUSED_PARAM (sysContext);
-    UNUSED_PARAM (handle);
-    UNUSED_PARAM (context);
-
-    return mock_type (TSS2_RC);
-}
-
-TSS2_RC
-__wrap_Tss2_Sys_ContextLoad (TSS2_SYS_CONTEXT *sysContext,
-                             TPMS_CONTEXT *context,
-                             TPM2_HANDLE *handle)
-{
-    UNUSED_PARAM (sysContext);
-    UNUSED_PARAM (context);
-    UNUSED_PARAM (handle);
-
-    return mock_type (TSS2_RC);
-}
 TSS2_RC
 __wrap_Tss2_Sys_Initialize (TSS2_SYS_CONTEXT *sysContext,
                             size_t contextSize,
@@ -356,6 +336,94 @@ tpm2_lock_test (void **state)
     tpm2_unlock (data->tpm2);
     pthread_join (thread_id, NULL);
 }
+/*
+ * Once a thread owns the Tpm2 others only get it when the owner yields,
+ * and the owner has it back when tpm2_yield returns.
+ */
+static void
+tpm2_acquire_yield_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    pthread_t thread_id;
+
+    data->acquired_lock = FALSE;
+    tpm2_acquire (data->tpm2);
+    tpm2_lock (data->tpm2);
+    tpm2_unlock (data->tpm2);
+    assert_true (data->tpm2->owner == g_thread_self ());
+    assert_int_equal (pthread_create (&thread_id, NULL, lock_thread, data),
+                      0);
+    while (g_atomic_int_get (&data->tpm2->waiting) == 0) {
+        g_usleep (1000);
+    }
+    assert_false (data->acquired_lock);
+    tpm2_yield (data->tpm2);
+    assert_true (data->acquired_lock);
+    assert_true (data->tpm2->owner == g_thread_self ());
+    pthread_join (thread_id, NULL);
+    tpm2_release (data->tpm2);
+    assert_null (data->tpm2->owner);
+}
+/*
+ * The execution time estimate starts at the default, is set by the first
+ * sample and then moves 1 / 2^EXEC_TIME_EWMA_SHIFT of the way towards each
+ * new sample.
+ */
+static void
+tpm2_exec_estimate_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    assert_int_equal (tpm2_get_exec_estimate (data->tpm2, TPM2_CC_Create),
+                      EXEC_TIME_DEFAULT_US);
+    tpm2_note_exec_time (data->tpm2, TPM2_CC_Create, 8000);
+    assert_int_equal (tpm2_get_exec_estimate (data->tpm2, TPM2_CC_Create),
+                      8000);
+    tpm2_note_exec_time (data->tpm2, TPM2_CC_Create, 16000);
+    assert_int_equal (tpm2_get_exec_estimate (data->tpm2, TPM2_CC_Create),
+                      8000 + 8000 / (1 << EXEC_TIME_EWMA_SHIFT));
+    tpm2_note_exec_time (data->tpm2, TPM2_CC_PCR_Read, 10);
+    assert_int_equal (tpm2_get_exec_estimate (data->tpm2, TPM2_CC_PCR_Read),
+                      10);
+}
+/*
+ * tpm2_cancel only reaches the TCTI while a command is being executed for
+ * the same tag. The mock TCTI has no cancel function so the call getting
+ * through is seen as TSS2_TCTI_RC_NOT_IMPLEMENTED.
+ */
+static void
+tpm2_cancel_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    int tag_a, tag_b;
+
+    assert_int_equal (tpm2_cancel (data->tpm2, &tag_a), TSS2_RC_SUCCESS);
+    tpm2_set_executing (data->tpm2, &tag_b);
+    assert_int_equal (tpm2_cancel (data->tpm2, &tag_a), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_cancel (data->tpm2, NULL), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_cancel (data->tpm2, &tag_b),
+                      TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    tpm2_set_executing (data->tpm2, NULL);
+    assert_int_equal (tpm2_cancel (data->tpm2, &tag_b), TSS2_RC_SUCCESS);
+}
+/*
+ * The timeout of a command is the duration of its class until its usual
+ * time times the scale is longer than that.
+ */
+static void
+tpm2_timeout_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    tpm2_set_timeout_scale (data->tpm2, 8);
+    assert_int_equal (tpm2_get_timeout_us (data->tpm2, TPM2_CC_ContextLoad),
+                      TPM2_TIMEOUT_MIN_MS * 1000);
+    assert_int_equal (tpm2_get_timeout_us (data->tpm2, TPM2_CC_Sign),
+                      TPM2_DURATION_LONG_MS * 1000);
+    tpm2_note_exec_time (data->tpm2, TPM2_CC_Sign, 1000000);
+    assert_int_equal (tpm2_get_timeout_us (data->tpm2, TPM2_CC_Sign),
+                      8 * 1000000);
+}
 /**
  * Here we're testing the internals of the 'tpm2_send_command'
  * function. We're wrapping the tcti_transmit command in the TCTI that
@@ -445,6 +513,46 @@ tpm2_send_command_success (void **state)
     connection = tpm2_response_get_connection (data->response);
     assert_int_equal (connection, data->connection);
     g_object_unref (connection);
+    /* once the response is in there's nothing left to cancel */
+    assert_null (data->tpm2->executing);
+    assert_int_equal (tpm2_cancel (data->tpm2, data->connection),
+                      TSS2_RC_SUCCESS);
+}
+/*
+ * Responses are received into the same buffer every time and handed to the
+ * Tpm2Response at the size actually received.
+ */
+static void
+tpm2_send_command_recv_buffer_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    TSS2_RC rc;
+    uint8_t buf [TPM_RESPONSE_HEADER_SIZE] = { 0 };
+    guint8 *recv_buffer;
+
+    response_buffer_set_rc (buf, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (data->tpm2->recv_buffer_size, MAX_RESPONSE_VALUE);
+    assert_int_equal (data->response->buffer_size, sizeof (buf));
+    assert_true (data->response->buffer_pooled);
+    assert_memory_equal (tpm2_response_get_buffer (data->response),
+                         buf,
+                         sizeof (buf));
+    recv_buffer = data->tpm2->recv_buffer;
+    g_clear_object (&data->response);
+
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, sizeof (buf));
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+    data->response = tpm2_send_command (data->tpm2, data->command, &rc);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_ptr_equal (data->tpm2->recv_buffer, recv_buffer);
 }
 
 static void
@@ -477,6 +585,41 @@ tpm2_get_trans_object_count_success (void **state)
     assert_int_equal (count, handle.count);
 }
 
+static void
+tpm2_get_handles_fail (void **state)
+{
+    TSS2_RC rc;
+    GArray *handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    test_data_t *data = (test_data_t*)*state;
+
+    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_DISABLED);
+    rc = tpm2_get_handles (data->tpm2, TPM2_HT_PERSISTENT, handles);
+    assert_int_equal (rc, TPM2_RC_DISABLED);
+    assert_int_equal (handles->len, 0);
+    g_array_unref (handles);
+}
+
+static void
+tpm2_get_handles_success (void **state)
+{
+    TSS2_RC rc;
+    GArray *handles = g_array_new (FALSE, FALSE, sizeof (TPM2_HANDLE));
+    test_data_t *data = (test_data_t*)*state;
+    TPML_HANDLE handle = {
+        .count = 2,
+        .handle = { TPM2_PERSISTENT_FIRST, TPM2_PERSISTENT_FIRST + 1 },
+    };
+
+    will_return (__wrap_Tss2_Sys_GetCapability, TPM2_RC_SUCCESS);
+    will_return (__wrap_Tss2_Sys_GetCapability, &handle);
+    rc = tpm2_get_handles (data->tpm2, TPM2_HT_PERSISTENT, handles);
+    assert_int_equal (rc, TPM2_RC_SUCCESS);
+    assert_int_equal (handles->len, 2);
+    assert_int_equal (g_array_index (handles, TPM2_HANDLE, 1),
+                      TPM2_PERSISTENT_FIRST + 1);
+    g_array_unref (handles);
+}
+
 static void
 tpm2_sapi_context_init_fail (void **state)
 {
@@ -492,17 +635,43 @@ tpm2_sapi_context_init_fail (void **state)
     g_clear_object (&tcti);
 }
 
+/*
+ * Queue a response from the mock TCTI for the next context command: a
+ * header with 'rc' followed by 'params_size' bytes of 'params'. The
+ * response is built in 'buf' which must outlive the command.
+ */
+static void
+mock_context_response (uint8_t       *buf,
+                       TSS2_RC        rc,
+                       const uint8_t *params,
+                       size_t         params_size)
+{
+    size_t size = TPM_HEADER_SIZE + params_size;
+
+    tpm2_header_init (buf, size, TPM2_ST_NO_SESSIONS, size, rc);
+    if (params_size > 0) {
+        memcpy (&buf [TPM_HEADER_SIZE], params, params_size);
+    }
+    will_return (tcti_mock_transmit, TSS2_RC_SUCCESS);
+    will_return (tcti_mock_receive, buf);
+    will_return (tcti_mock_receive, size);
+    will_return (tcti_mock_receive, TSS2_RC_SUCCESS);
+}
+
 static void
 tpm2_context_load_test (void **state)
 {
     TSS2_RC rc;
     TPMS_CONTEXT context = { 0, };
     TPM2_HANDLE handle = 0;
+    uint8_t params [] = { 0x80, 0x00, 0x00, 0x01 };
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (params)];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextLoad, TSS2_RC_SUCCESS);
+    mock_context_response (buf, TSS2_RC_SUCCESS, params, sizeof (params));
     rc = tpm2_context_load (data->tpm2, &context, &handle);
     assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (handle, 0x80000001);
 }
 
 static void
@@ -511,24 +680,56 @@ tpm2_context_load_fail (void **state)
     TSS2_RC rc;
     TPMS_CONTEXT context = { 0, };
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextLoad, TPM2_RC_FAILURE);
+    mock_context_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_load (data->tpm2, &context, &handle);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
+/*
+ * A successful ContextLoad response without the handle doesn't have the
+ * fixed layout of the response.
+ */
+static void
+tpm2_context_load_malformed (void **state)
+{
+    TSS2_RC rc;
+    TPMS_CONTEXT context = { 0, };
+    TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
+    test_data_t *data = (test_data_t*)*state;
+
+    mock_context_response (buf, TSS2_RC_SUCCESS, NULL, 0);
+    rc = tpm2_context_load (data->tpm2, &context, &handle);
+    assert_int_equal (rc, TSS2_SYS_RC_MALFORMED_RESPONSE);
+}
 
 static void
 tpm2_context_save_test (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    TPMS_CONTEXT context = { 0, }, saved = {
+        .sequence = 5,
+        .savedHandle = 0x80000000,
+        .hierarchy = TPM2_RH_OWNER,
+        .contextBlob = { .size = 2, .buffer = { 0xaa, 0xbb } },
+    };
+    uint8_t params [sizeof (TPMS_CONTEXT)];
+    uint8_t buf [TPM_HEADER_SIZE + sizeof (params)];
+    size_t size = 0;
     TPM2_HANDLE handle = 0;
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_SUCCESS);
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&saved, params,
+                                                    sizeof (params), &size),
+                      TSS2_RC_SUCCESS);
+    mock_context_response (buf, TPM2_RC_SUCCESS, params, size);
     rc = tpm2_context_save (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_SUCCESS);
+    assert_int_equal (context.sequence, 5);
+    assert_int_equal (context.contextBlob.size, 2);
+    assert_int_equal (context.contextBlob.buffer [1], 0xbb);
 }
 
 static void
@@ -536,9 +737,10 @@ tpm2_context_flush_fail (void **state)
 {
     TSS2_RC rc;
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_FlushContext, TPM2_RC_FAILURE);
+    mock_context_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_flush (data->tpm2, handle);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
@@ -549,9 +751,10 @@ tpm2_context_saveflush_save_fail (void **state)
     TSS2_RC rc;
     TPMS_CONTEXT context = { 0, };
     TPM2_HANDLE handle = 0;
+    uint8_t buf [TPM_HEADER_SIZE];
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_FAILURE);
+    mock_context_response (buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_saveflush (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
@@ -560,12 +763,19 @@ static void
 tpm2_context_saveflush_flush_fail (void **state)
 {
     TSS2_RC rc;
-    TPMS_CONTEXT context = { 0, };
+    TPMS_CONTEXT context = { 0, }, saved = { 0, };
     TPM2_HANDLE handle = 0;
+    uint8_t params [sizeof (TPMS_CONTEXT)];
+    uint8_t save_buf [TPM_HEADER_SIZE + sizeof (params)];
+    uint8_t flush_buf [TPM_HEADER_SIZE];
+    size_t size = 0;
     test_data_t *data = (test_data_t*)*state;
 
-    will_return (__wrap_Tss2_Sys_ContextSave, TPM2_RC_SUCCESS);
-    will_return (__wrap_Tss2_Sys_FlushContext, TPM2_RC_FAILURE);
+    assert_int_equal (Tss2_MU_TPMS_CONTEXT_Marshal (&saved, params,
+                                                    sizeof (params), &size),
+                      TSS2_RC_SUCCESS);
+    mock_context_response (save_buf, TPM2_RC_SUCCESS, params, size);
+    mock_context_response (flush_buf, TPM2_RC_FAILURE, NULL, 0);
     rc = tpm2_context_saveflush (data->tpm2, handle, &context);
     assert_int_equal (rc, TPM2_RC_FAILURE);
 }
@@ -606,6 +816,59 @@ tpm2_flush_all_unlocked_flush_fail (void **state)
     assert_int_equal (rc, TPM2_RC_SUCCESS);
 }
 
+/*
+ * The data saved from an initialized Tpm2 is loaded into a new one under
+ * the same key, which then skips the TPM2_PT_FIXED query at init.
+ */
+static void
+tpm2_cache_save_load_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gchar *path = g_build_filename (g_get_tmp_dir (), "tpm2-cache-unit", NULL);
+    Tpm2 *tpm2;
+    Tcti *tcti;
+    guint32 value;
+
+    assert_true (tpm2_cache_save (data->tpm2, path, "conf"));
+    tcti = mock_tcti_setup ();
+    will_return (__wrap_Tss2_Sys_Initialize, TSS2_RC_SUCCESS);
+    tpm2 = tpm2_new (tcti);
+    g_clear_object (&tcti);
+    assert_true (tpm2_cache_load (tpm2, path, "conf"));
+    assert_true (tpm2->from_cache);
+    will_return (__wrap_Tss2_Sys_Startup, TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_init_tpm (tpm2), TSS2_RC_SUCCESS);
+    assert_int_equal (tpm2_get_max_response (tpm2, &value), TSS2_RC_SUCCESS);
+    assert_int_equal (value, MAX_RESPONSE_VALUE);
+    assert_int_equal (tpm2->caps_fixed, data->tpm2->caps_fixed);
+    g_object_unref (tpm2);
+    unlink (path);
+    g_free (path);
+}
+/*
+ * A cache written for another key, or no cache at all, isn't used.
+ */
+static void
+tpm2_cache_load_mismatch_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gchar *path = g_build_filename (g_get_tmp_dir (), "tpm2-cache-unit", NULL);
+    Tpm2 *tpm2;
+    Tcti *tcti;
+
+    tcti = mock_tcti_setup ();
+    will_return (__wrap_Tss2_Sys_Initialize, TSS2_RC_SUCCESS);
+    tpm2 = tpm2_new (tcti);
+    g_clear_object (&tcti);
+    unlink (path);
+    assert_false (tpm2_cache_load (tpm2, path, "conf"));
+    assert_true (tpm2_cache_save (data->tpm2, path, "conf"));
+    assert_false (tpm2_cache_load (tpm2, path, "other-conf"));
+    assert_false (tpm2->from_cache);
+    g_object_unref (tpm2);
+    unlink (path);
+    g_free (path);
+}
 int
 main (void)
 {
@@ -628,9 +891,27 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_get_max_response_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_save_load_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cache_load_mismatch_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_lock_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_acquire_yield_test,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_exec_estimate_test,
+                                         tpm2_setup,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_cancel_test,
+                                         tpm2_setup,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_timeout_test,
+                                         tpm2_setup,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_send_command_tcti_transmit_fail_test,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
@@ -640,12 +921,21 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_send_command_success,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_send_command_recv_buffer_test,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_get_trans_object_count_caps_fail,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_get_trans_object_count_success,
                                          tpm2_setup_with_command,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_get_handles_fail,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_get_handles_success,
+                                         tpm2_setup_with_command,
+                                         tpm2_teardown),
         cmocka_unit_test (tpm2_sapi_context_init_fail),
         cmocka_unit_test_setup_teardown (tpm2_context_load_test,
                                          tpm2_setup_with_init,
@@ -653,6 +943,9 @@ main (void)
         cmocka_unit_test_setup_teardown (tpm2_context_load_fail,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
+        cmocka_unit_test_setup_teardown (tpm2_context_load_malformed,
+                                         tpm2_setup_with_init,
+                                         tpm2_teardown),
         cmocka_unit_test_setup_teardown (tpm2_context_save_test,
                                          tpm2_setup_with_init,
                                          tpm2_teardown),
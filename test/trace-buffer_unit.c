@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "trace-buffer.h"
+#include "util.h"
+
+#define SPANS 3
+
+typedef struct {
+    gchar       *dir;
+    gchar       *path;
+    TraceBuffer *buffer;
+} test_data_t;
+
+static int
+trace_buffer_setup (void **state)
+{
+    test_data_t *data = calloc (1, sizeof (test_data_t));
+
+    data->dir = g_dir_make_tmp ("trace-buffer-XXXXXX", NULL);
+    assert_non_null (data->dir);
+    data->path = g_build_filename (data->dir, "trace.json", NULL);
+    data->buffer = trace_buffer_new (data->path, SPANS);
+    *state = data;
+    return 0;
+}
+static int
+trace_buffer_teardown (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+
+    g_clear_object (&data->buffer);
+    g_unlink (data->path);
+    g_rmdir (data->dir);
+    g_free (data->path);
+    g_free (data->dir);
+    free (data);
+    return 0;
+}
+/*
+ * Count the times 'needle' occurs in 'haystack'.
+ */
+static guint
+count_substr (const gchar *haystack,
+              const gchar *needle)
+{
+    guint count = 0;
+
+    while ((haystack = strstr (haystack, needle)) != NULL) {
+        ++count;
+        haystack += strlen (needle);
+    }
+    return count;
+}
+/*
+ * Only the last SPANS spans are kept and they come out oldest first as
+ * complete events with their duration.
+ */
+static void
+trace_buffer_wrap_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gchar *json;
+    guint i;
+
+    for (i = 1; i <= SPANS + 2; ++i) {
+        trace_buffer_add (data->buffer, TRACE_EXEC, i * 100, i * 100 + 7,
+                          i, TPM2_CC_GetRandom);
+    }
+    json = trace_buffer_to_json (data->buffer);
+    assert_true (g_str_has_prefix (json, "{\"displayTimeUnit\":\"ms\","
+                                         "\"traceEvents\":["));
+    assert_int_equal (count_substr (json, "\"name\":\"exec\""), SPANS);
+    assert_int_equal (count_substr (json, "\"ph\":\"X\",\"dur\":7,"), SPANS);
+    assert_null (strstr (json, "\"ts\":200,"));
+    assert_true (strstr (json, "\"ts\":300,") < strstr (json, "\"ts\":500,"));
+    assert_non_null (strstr (json, "\"connection\":5,\"command\":\"0x17b\""));
+    assert_true (g_str_has_suffix (json, "]}\n"));
+    g_free (json);
+}
+/*
+ * Spans that weren't timed are skipped, instants have no duration.
+ */
+static void
+trace_buffer_instant_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gchar *json;
+
+    trace_buffer_add (data->buffer, TRACE_LOAD, 0, 10, 1, TPM2_CC_Sign);
+    trace_buffer_add (data->buffer, TRACE_SAVE, 20, 10, 1, TPM2_CC_Sign);
+    trace_buffer_instant (data->buffer, TRACE_CONTEXT_LOAD, 1, TPM2_CC_Sign);
+    json = trace_buffer_to_json (data->buffer);
+    assert_null (strstr (json, "\"name\":\"load\""));
+    assert_null (strstr (json, "\"name\":\"save\""));
+    assert_non_null (strstr (json, "\"name\":\"ContextLoad\",\"cat\":\"swap\","
+                                   "\"ph\":\"i\",\"s\":\"t\","));
+    assert_null (strstr (json, "\"dur\""));
+    g_free (json);
+}
+/*
+ * Writing the trace leaves the spans in the buffer and replaces what an
+ * earlier write put in the file.
+ */
+static void
+trace_buffer_write_test (void **state)
+{
+    test_data_t *data = (test_data_t*)*state;
+    gchar *contents, *json;
+
+    trace_buffer_add (data->buffer, TRACE_READ, 1, 2, 1, TPM2_CC_Sign);
+    assert_true (trace_buffer_write (data->buffer));
+    trace_buffer_add (data->buffer, TRACE_WRITE, 3, 4, 1, TPM2_CC_Sign);
+    assert_true (trace_buffer_write (data->buffer));
+    assert_true (g_file_get_contents (data->path, &contents, NULL, NULL));
+    json = trace_buffer_to_json (data->buffer);
+    assert_string_equal (contents, json);
+    assert_int_equal (count_substr (contents, "\"name\":"), 2);
+    g_free (json);
+    g_free (contents);
+}
+gint
+main (void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown (trace_buffer_wrap_test,
+                                         trace_buffer_setup,
+                                         trace_buffer_teardown),
+        cmocka_unit_test_setup_teardown (trace_buffer_instant_test,
+                                         trace_buffer_setup,
+                                         trace_buffer_teardown),
+        cmocka_unit_test_setup_teardown (trace_buffer_write_test,
+                                         trace_buffer_setup,
+                                         trace_buffer_teardown),
+    };
+    return cmocka_run_group_tests (tests, NULL, NULL);
+}
@@ -233,6 +233,25 @@ tcti_tabrmd_conf_parse_named_system_test (void **state)
     assert_string_equal (conf.bus_name, "com.example.System");
     assert_int_equal (conf.bus_type, G_BUS_TYPE_SYSTEM);
 }
+/*
+ * The tcp key and the TLS files that go with it are taken as they are.
+ */
+static void
+tcti_tabrmd_conf_parse_tcp_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "tcp=tpm.example.com:2325,tls_cert=c.pem,"
+        "tls_key=k.pem,tls_ca=ca.pem";
+    UNUSED_PARAM(state);
+
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_string_equal (conf.tcp_address, "tpm.example.com:2325");
+    assert_string_equal (conf.tls_cert, "c.pem");
+    assert_string_equal (conf.tls_key, "k.pem");
+    assert_string_equal (conf.tls_ca, "ca.pem");
+}
 /*
  * Ensure that an unknown bus_type string results in the appropriate RC.
  */
@@ -281,6 +300,222 @@ tcti_tabrmd_conf_parse_no_type_test (void **state)
     assert_string_equal (conf.bus_name, "com.example.FooBar");
     assert_int_equal (conf.bus_type, TABRMD_DBUS_TYPE_DEFAULT);
 }
+/*
+ * Ensure that the priority key is parsed into the conf structure and that
+ * it's left at the default when omitted.
+ */
+static void
+tcti_tabrmd_conf_parse_priority_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "bus_type=session,priority=batch";
+    UNUSED_PARAM(state);
+
+    assert_int_equal (conf.priority, TABRMD_PRIORITY_DEFAULT);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.priority, TABRMD_PRIORITY_BATCH);
+}
+/*
+ * Ensure that the framing key sets the SEQPACKET connection flag and that
+ * unknown framing names are rejected.
+ */
+static void
+tcti_tabrmd_conf_parse_framing_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "bus_type=session,framing=seqpacket";
+    char conf_bad_str[] = "framing=datagram";
+    UNUSED_PARAM(state);
+
+    assert_int_equal (conf.flags, 0);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.flags, TABRMD_CONNECTION_FLAG_SEQPACKET);
+    rc = parse_key_value_string (conf_bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * The busy_poll key takes the microseconds to spin for, up to
+ * TABRMD_BUSY_POLL_MAX.
+ */
+static void
+tcti_tabrmd_conf_parse_busy_poll_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "busy_poll=50";
+    char conf_big_str[] = "busy_poll=100001";
+    char conf_bad_str[] = "busy_poll=50us";
+    UNUSED_PARAM(state);
+
+    assert_int_equal (conf.busy_poll_us, 0);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.busy_poll_us, 50);
+    rc = parse_key_value_string (conf_big_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = parse_key_value_string (conf_bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (conf.busy_poll_us, 50);
+}
+/*
+ * The resume key takes the id from Tss2_Tcti_Tabrmd_GetResumeId, in hex
+ * or decimal. 0 isn't the id of any connection.
+ */
+static void
+tcti_tabrmd_conf_parse_resume_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "resume=0x1234abcd5678ef90";
+    char conf_zero_str[] = "resume=0";
+    char conf_bad_str[] = "resume=0x12g4";
+    UNUSED_PARAM(state);
+
+    assert_true (conf.resume_id == 0);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (conf.resume_id == 0x1234abcd5678ef90);
+    rc = parse_key_value_string (conf_zero_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = parse_key_value_string (conf_bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_true (conf.resume_id == 0x1234abcd5678ef90);
+}
+/*
+ * The transport key asks for the shared memory transport.
+ */
+static void
+tcti_tabrmd_conf_parse_transport_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "framing=seqpacket,transport=shm";
+    char conf_socket_str[] = "transport=socket";
+    char conf_bad_str[] = "transport=pipe";
+    UNUSED_PARAM(state);
+
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.flags, TABRMD_CONNECTION_FLAG_SEQPACKET |
+                                  TABRMD_CONNECTION_FLAG_SHM_RING);
+    rc = parse_key_value_string (conf_socket_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (conf.flags, TABRMD_CONNECTION_FLAG_SEQPACKET);
+    rc = parse_key_value_string (conf_bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * The 'socket' key selects the daemon's Unix socket instead of D-Bus.
+ */
+static void
+tcti_tabrmd_conf_parse_socket_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "socket=/run/tpm2-abrmd.sock,priority=batch";
+    UNUSED_PARAM(state);
+
+    assert_null (conf.socket_path);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_string_equal (conf.socket_path, "/run/tpm2-abrmd.sock");
+    assert_int_equal (conf.priority, TABRMD_PRIORITY_BATCH);
+}
+/*
+ * Ensure that 'reuse' is parsed and that only 'yes' and 'no' are
+ * accepted.
+ */
+static void
+tcti_tabrmd_conf_parse_reuse_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "reuse=yes";
+    char bad_str[] = "reuse=always";
+    UNUSED_PARAM(state);
+
+    assert_false (conf.reuse);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (conf.reuse);
+    rc = parse_key_value_string (bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * Ensure that 'prefork' is parsed and that only 'yes' and 'no' are
+ * accepted.
+ */
+static void
+tcti_tabrmd_conf_parse_prefork_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "prefork=yes";
+    char bad_str[] = "prefork=maybe";
+    UNUSED_PARAM(state);
+
+    assert_false (conf.prefork);
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_true (conf.prefork);
+    rc = parse_key_value_string (bad_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * A bad count or a Unix socket are refused by Prefork before talking to
+ * the daemon, and releasing a set that was never created is harmless.
+ */
+static void
+tcti_tabrmd_prefork_bad_value_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_int_equal (Tss2_Tcti_Tabrmd_Prefork (NULL, 0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Tabrmd_Prefork (NULL, TABRMD_PREFORK_MAX + 1),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Tabrmd_Prefork ("socket=/tmp/s", 2),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    Tss2_Tcti_Tabrmd_PreforkDone ();
+}
+/*
+ * Preopen only makes sense for contexts that take their connection from
+ * the pool, anything else is refused before talking to the daemon.
+ */
+static void
+tcti_tabrmd_preopen_bad_value_test (void **state)
+{
+    UNUSED_PARAM(state);
+
+    assert_int_equal (Tss2_Tcti_Tabrmd_Preopen ("reuse=yes", 0),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Tabrmd_Preopen ("reuse=yes",
+                                                TABRMD_CREATE_CONNECTIONS_MAX + 1),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Tabrmd_Preopen ("bus_type=session", 2),
+                      TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (Tss2_Tcti_Tabrmd_Preopen ("reuse=yes,socket=/tmp/s", 2),
+                      TSS2_TCTI_RC_BAD_VALUE);
+}
+/*
+ * Ensure that an unknown priority class results in the appropriate RC.
+ */
+static void
+tcti_tabrmd_conf_parse_bad_priority_test (void **state)
+{
+    TSS2_RC rc;
+    tabrmd_conf_t conf = TABRMD_CONF_INIT_DEFAULT;
+    char conf_str[] = "priority=urgent";
+    UNUSED_PARAM(state);
+
+    rc = parse_key_value_string (conf_str, tabrmd_kv_callback, &conf);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    assert_int_equal (conf.priority, TABRMD_PRIORITY_DEFAULT);
+}
 /*
  * Ensure that a missing value results in the appropriate RC.
  */
@@ -484,7 +719,8 @@ tcti_tabrmd_setup (void **state)
         perror ("calloc");
         return 1;
     }
-    data->proxy = calloc (1, sizeof (TctiTabrmdProxy));
+    /* init keeps a reference to the proxy so it must be a real object */
+    data->proxy = g_object_new (G_TYPE_OBJECT, NULL);
     will_return (__wrap_tcti_tabrmd_proxy_new_for_bus_sync, data->proxy);
     g_debug ("preparing g_dbus_proxy_call_with_unix_fd_list_sync mock wrapper");
     assert_int_equal (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds), 0);
@@ -510,12 +746,12 @@ tcti_tabrmd_teardown (void **state)
     data_t *data = *state;
 
     tss2_tcti_tabrmd_finalize (data->context);
+    /* drops the last reference to the proxy */
+    tcti_tabrmd_pool_clear ();
     close (data->client_fd);
     close (data->server_fd);
     if (data->context)
         free (data->context);
-    if (data->proxy)
-        free (data->proxy);
     free (data);
     return 0;
 }
@@ -553,6 +789,123 @@ tcti_tabrmd_init_success_test (void **state)
 
     assert_int_equal (data->id, TSS2_TCTI_TABRMD_ID (data->context));
 }
+/*
+ * A second context for the same bus gets the proxy the first one created
+ * and only makes the CreateConnection call.
+ */
+static void
+tcti_tabrmd_init_proxy_cached_test (void **state)
+{
+    data_t *data = *state;
+    TSS2_TCTI_CONTEXT *context;
+    size_t size = sizeof (TSS2_TCTI_TABRMD_CONTEXT);
+    gint fds [2];
+    TSS2_RC rc;
+
+    context = calloc (1, size);
+    assert_int_equal (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds), 0);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, fds [0]);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, 667);
+    rc = Tss2_Tcti_Tabrmd_Init (context, &size, "bus_type=session");
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_ptr_equal (TSS2_TCTI_TABRMD_PROXY (context), data->proxy);
+    tss2_tcti_tabrmd_finalize (context);
+    free (context);
+    close (fds [0]);
+    close (fds [1]);
+}
+/*
+ * With no preforked connections to claim a context initialized with
+ * 'prefork=yes' creates its connection through the daemon.
+ */
+static void
+tcti_tabrmd_init_prefork_fallback_test (void **state)
+{
+    data_t *data = *state;
+    TSS2_TCTI_CONTEXT *context;
+    size_t size = sizeof (TSS2_TCTI_TABRMD_CONTEXT);
+    gint fds [2];
+    TSS2_RC rc;
+
+    context = calloc (1, size);
+    assert_int_equal (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds), 0);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, fds [0]);
+    will_return (__wrap_g_dbus_proxy_call_with_unix_fd_list_sync, 668);
+    rc = Tss2_Tcti_Tabrmd_Init (context, &size,
+                                "bus_type=session,prefork=yes");
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (TSS2_TCTI_TABRMD_ID (context), 668);
+    assert_ptr_equal (TSS2_TCTI_TABRMD_PROXY (context), data->proxy);
+    assert_false (((TSS2_TCTI_TABRMD_CONTEXT*)context)->prefork);
+    tss2_tcti_tabrmd_finalize (context);
+    free (context);
+    close (fds [0]);
+    close (fds [1]);
+}
+/*
+ * Response callback for the dispatch test, it counts the responses and
+ * checks each has the size in its header.
+ */
+static void
+tcti_tabrmd_dispatch_callback (TSS2_TCTI_CONTEXT *context,
+                               const uint8_t *response,
+                               size_t size,
+                               void *user_data)
+{
+    size_t *count = (size_t*)user_data;
+
+    assert_non_null (context);
+    assert_int_equal (get_response_size ((uint8_t*)response), size);
+    ++*count;
+}
+/*
+ * Two pipelined responses arrive in pieces: Dispatch hands each to the
+ * callback once it's complete and keeps the partial one in between.
+ */
+static void
+tcti_tabrmd_dispatch_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t responses [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+                             0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+                             0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+                             0x00, 0x00, 0x00, 0x00 };
+    size_t count = 0, size = sizeof (responses);
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Tabrmd_Dispatch (data->context);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+    rc = Tss2_Tcti_Tabrmd_SetResponseCallback (data->context,
+                                               tcti_tabrmd_dispatch_callback,
+                                               &count);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    TSS2_TCTI_TABRMD_STATE (data->context) = TABRMD_STATE_RECEIVE;
+    TSS2_TCTI_TABRMD_PENDING (data->context) = 2;
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, responses,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+
+    assert_int_equal (write (data->server_fd, responses, 16), 16);
+    rc = Tss2_Tcti_Tabrmd_Dispatch (data->context);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (count, 1);
+    assert_int_equal (TSS2_TCTI_TABRMD_PENDING (data->context), 1);
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_RECEIVE);
+    rc = Tss2_Tcti_Tabrmd_SetResponseCallback (data->context, NULL, NULL);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+
+    assert_int_equal (write (data->server_fd, &responses [16],
+                             sizeof (responses) - 16),
+                      sizeof (responses) - 16);
+    rc = Tss2_Tcti_Tabrmd_Dispatch (data->context);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (count, 2);
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_TRANSMIT);
+    rc = Tss2_Tcti_Tabrmd_SetResponseCallback (data->context, NULL, NULL);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+}
 /*
  * These are a series of tests to ensure that the exposed TCTI functions
  * return the appropriate RC when passed NULL contexts.
@@ -702,6 +1055,177 @@ tcti_tabrmd_transmit_bad_sequence_final_test (void **state)
     assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
                       TABRMD_STATE_FINAL);
 }
+/*
+ * With a pipeline depth of 2 two commands can be transmitted before the
+ * first response is received, a third is a BAD_SEQUENCE. The responses
+ * are received in order and the state only goes back to TRANSMIT after
+ * the last one.
+ */
+static void
+tcti_tabrmd_transmit_pipeline_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t command [] = { 0x80, 0x01,
+                           0x00, 0x00, 0x00, 0x0a,
+                           0x00, 0x00, 0x01, 0x7b };
+    uint8_t responses [] = { 0x80, 0x01,
+                             0x00, 0x00, 0x00, 0x0a,
+                             0x00, 0x00, 0x00, 0x00,
+                             0x80, 0x01,
+                             0x00, 0x00, 0x00, 0x0a,
+                             0x00, 0x00, 0x01, 0x01 };
+    uint8_t command_out [sizeof (command) * 2] = { 0 };
+    uint8_t response [TPM_HEADER_SIZE] = { 0 };
+    size_t size;
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Tabrmd_SetPipelineDepth (data->context, 2);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = tss2_tcti_tabrmd_transmit (data->context, sizeof (command), command);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = tss2_tcti_tabrmd_transmit (data->context, sizeof (command), command);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    rc = tss2_tcti_tabrmd_transmit (data->context, sizeof (command), command);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+    assert_int_equal (read (data->server_fd, command_out, sizeof (command_out)),
+                      sizeof (command_out));
+    assert_int_equal (write (data->server_fd, responses, sizeof (responses)),
+                      sizeof (responses));
+
+    size = sizeof (response);
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, response,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_memory_equal (response, responses, TPM_HEADER_SIZE);
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_RECEIVE);
+    size = sizeof (response);
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, response,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_memory_equal (response, &responses [TPM_HEADER_SIZE],
+                         TPM_HEADER_SIZE);
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_TRANSMIT);
+}
+/*
+ * The pipeline depth must be between 1 and TABRMD_PIPELINE_MAX and can't
+ * be changed while a command is in flight.
+ */
+static void
+tcti_tabrmd_set_pipeline_depth_bad_test (void **state)
+{
+    data_t *data = *state;
+    TSS2_RC rc;
+
+    rc = Tss2_Tcti_Tabrmd_SetPipelineDepth (NULL, 2);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_REFERENCE);
+    rc = Tss2_Tcti_Tabrmd_SetPipelineDepth (data->context, 0);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    rc = Tss2_Tcti_Tabrmd_SetPipelineDepth (data->context,
+                                            TABRMD_PIPELINE_MAX + 1);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_VALUE);
+    TSS2_TCTI_TABRMD_STATE (data->context) = TABRMD_STATE_RECEIVE;
+    rc = Tss2_Tcti_Tabrmd_SetPipelineDepth (data->context, 2);
+    assert_int_equal (rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+}
+/*
+ * Over a SOCK_SEQPACKET connection the size of a response can be queried
+ * without consuming it, then the whole response is read in one go.
+ */
+static void
+tcti_tabrmd_receive_seqpacket_test (void **state)
+{
+    data_t *data = *state;
+    uint8_t response_in [] = { 0x80, 0x01,
+                               0x00, 0x00, 0x00, 0x0c,
+                               0x00, 0x00, 0x00, 0x00,
+                               0x01, 0x02 };
+    uint8_t response_out [sizeof (response_in)] = { 0 };
+    size_t size = 0;
+    GSocket *sock;
+    gint fds [2];
+    TSS2_RC rc;
+
+    assert_int_equal (socketpair (PF_LOCAL, SOCK_SEQPACKET, 0, fds), 0);
+    g_clear_object (&TSS2_TCTI_TABRMD_SOCK_CONNECT (data->context));
+    sock = g_socket_new_from_fd (fds [0], NULL);
+    TSS2_TCTI_TABRMD_SOCK_CONNECT (data->context) =
+        g_socket_connection_factory_create_connection (sock);
+    g_object_unref (sock);
+    TSS2_TCTI_TABRMD_SEQPACKET (data->context) = TRUE;
+    TSS2_TCTI_TABRMD_STATE (data->context) = TABRMD_STATE_RECEIVE;
+    assert_int_equal (write (fds [1], response_in, sizeof (response_in)),
+                      sizeof (response_in));
+
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, NULL,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (response_in));
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, response_out,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (response_in));
+    assert_memory_equal (response_in, response_out, sizeof (response_in));
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_TRANSMIT);
+    close (fds [1]);
+}
+/*
+ * With the shared memory transport a transmitted command shows up in the
+ * command ring with the command doorbell rung, and a response written to
+ * the response ring is received from there.
+ */
+static void
+tcti_tabrmd_shm_test (void **state)
+{
+    data_t *data = *state;
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)data->context;
+    uint8_t command_in [] = { 0x80, 0x01,
+                              0x00, 0x00, 0x00, 0x0c,
+                              0x00, 0x00, 0x01, 0x7b,
+                              0x00, 0x08 };
+    uint8_t response_in [] = { 0x80, 0x01,
+                               0x00, 0x00, 0x00, 0x0c,
+                               0x00, 0x00, 0x00, 0x00,
+                               0x01, 0x02 };
+    uint8_t buf [sizeof (command_in)] = { 0 };
+    size_t size = sizeof (buf);
+    guint64 doorbell;
+    gint shm_fd;
+    TSS2_RC rc;
+
+    ctx->shm = shm_region_create (&shm_fd);
+    if (ctx->shm == NULL) {
+        skip ();
+    }
+    close (shm_fd);
+    ctx->shm_command_fd = shm_doorbell_new ();
+    ctx->shm_response_fd = shm_doorbell_new ();
+
+    rc = tss2_tcti_tabrmd_transmit (data->context, sizeof (command_in),
+                                    command_in);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (read (ctx->shm_command_fd, &doorbell, sizeof (doorbell)),
+                      sizeof (doorbell));
+    assert_int_equal (shm_ring_next_size (&ctx->shm->command),
+                      sizeof (command_in));
+    assert_true (shm_ring_read (&ctx->shm->command, buf, sizeof (command_in)));
+    assert_memory_equal (buf, command_in, sizeof (command_in));
+
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, buf, 0);
+    assert_int_equal (rc, TSS2_TCTI_RC_TRY_AGAIN);
+    assert_true (shm_ring_write (&ctx->shm->response, response_in,
+                                 sizeof (response_in)));
+    assert_true (shm_doorbell_ring (ctx->shm_response_fd));
+    rc = tss2_tcti_tabrmd_receive (data->context, &size, buf,
+                                   TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal (rc, TSS2_RC_SUCCESS);
+    assert_int_equal (size, sizeof (response_in));
+    assert_memory_equal (buf, response_in, sizeof (response_in));
+    assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
+                      TABRMD_STATE_TRANSMIT);
+}
 /*
  * This setup function is a thin wrapper around the main setup. The only
  * additional thing done is to set the state machine to the RECEIVE state
@@ -737,6 +1261,44 @@ tcti_tabrmd_cancel_test (void **state)
     assert_int_equal (TSS2_TCTI_TABRMD_STATE (data->context),
                       TABRMD_STATE_RECEIVE);
 }
+/*
+ * Connections set up through the Unix socket have no D-Bus proxy to send
+ * Cancel or SetLocality through.
+ */
+static void
+tcti_tabrmd_no_proxy_test (void **state)
+{
+    data_t *data = *state;
+    TctiTabrmd *proxy = TSS2_TCTI_TABRMD_PROXY (data->context);
+    TSS2_RC rc;
+
+    TSS2_TCTI_TABRMD_PROXY (data->context) = NULL;
+    rc = tss2_tcti_tabrmd_set_locality (data->context, 1);
+    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    TSS2_TCTI_TABRMD_STATE (data->context) = TABRMD_STATE_RECEIVE;
+    rc = tss2_tcti_tabrmd_cancel (data->context);
+    assert_int_equal (rc, TSS2_TCTI_RC_NOT_IMPLEMENTED);
+    TSS2_TCTI_TABRMD_PROXY (data->context) = proxy;
+}
+/*
+ * Only contexts that asked for 'reuse' and have no command in flight may
+ * hand their connection to the pool. The connection stays with the
+ * context otherwise.
+ */
+static void
+tcti_tabrmd_pool_put_refused_test (void **state)
+{
+    data_t *data = *state;
+    TSS2_TCTI_TABRMD_CONTEXT *ctx = (TSS2_TCTI_TABRMD_CONTEXT*)data->context;
+
+    assert_false (ctx->reuse);
+    assert_false (tcti_tabrmd_pool_put (ctx));
+    ctx->reuse = TRUE;
+    TSS2_TCTI_TABRMD_STATE (data->context) = TABRMD_STATE_RECEIVE;
+    assert_false (tcti_tabrmd_pool_put (ctx));
+    assert_non_null (TSS2_TCTI_TABRMD_SOCK_CONNECT (data->context));
+    ctx->reuse = FALSE;
+}
 /*
  * This test initializes the TCTI context state to TRANSMIT and then calls
  * the cancel function. This should produce a BAD_SEQUENCE error.
@@ -872,6 +1434,15 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_init_success_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_init_proxy_cached_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_init_prefork_fallback_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_dispatch_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
         cmocka_unit_test (tcti_tabrmd_info_test),
         cmocka_unit_test (tcti_tabrmd_bus_type_from_str_session_test),
         cmocka_unit_test (tcti_tabrmd_bus_type_from_str_system_test),
@@ -882,9 +1453,21 @@ main (void)
         cmocka_unit_test (tcti_tabrmd_kv_callback_bad_key_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_named_session_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_named_system_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_tcp_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_bad_type_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_no_name_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_no_type_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_priority_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_bad_priority_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_framing_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_busy_poll_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_resume_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_transport_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_socket_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_reuse_test),
+        cmocka_unit_test (tcti_tabrmd_preopen_bad_value_test),
+        cmocka_unit_test (tcti_tabrmd_conf_parse_prefork_test),
+        cmocka_unit_test (tcti_tabrmd_prefork_bad_value_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_no_value_test),
         cmocka_unit_test (tcti_tabrmd_conf_parse_no_key_test),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_magic_test,
@@ -912,12 +1495,30 @@ main (void)
         cmocka_unit_test_setup_teardown (tcti_tabrmd_transmit_bad_sequence_final_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_transmit_pipeline_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_set_pipeline_depth_bad_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_receive_seqpacket_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_shm_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_cancel_test,
                                          tcti_tabrmd_receive_setup,
                                          tcti_tabrmd_teardown),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_cancel_bad_sequence_test,
                                          tcti_tabrmd_receive_setup,
                                          tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_no_proxy_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
+        cmocka_unit_test_setup_teardown (tcti_tabrmd_pool_put_refused_test,
+                                         tcti_tabrmd_setup,
+                                         tcti_tabrmd_teardown),
         cmocka_unit_test_setup_teardown (tcti_tabrmd_get_poll_handles_all_null_test,
                                          tcti_tabrmd_setup,
                                          tcti_tabrmd_teardown),
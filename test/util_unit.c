@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <setjmp.h>
 #include <cmocka.h>
@@ -668,17 +670,103 @@ read_tpm_buf_alloc_eof_test (void **state)
     buf = read_tpm_buffer_alloc ((GInputStream*)1, &buf_size);
     assert_null (buf);
 }
+/*
+ * A buffer given back to the pool is handed out again for any size in
+ * the same size class. Sizes in other classes get other buffers.
+ */
+static void
+util_buf_pool_test (void **state)
+{
+    uint8_t *buf, *buf_again, *buf_large;
+    UNUSED_PARAM(state);
+
+    buf = util_buf_get (TPM_HEADER_SIZE);
+    assert_non_null (buf);
+    util_buf_put (buf, TPM_HEADER_SIZE);
+    buf_again = util_buf_get (UTIL_BUF_SIZE);
+    assert_ptr_equal (buf, buf_again);
+    buf_large = util_buf_get (UTIL_BUF_MAX);
+    assert_ptr_not_equal (buf_large, buf_again);
+    buf_large [UTIL_BUF_MAX - 1] = 0xff;
+    util_buf_put (buf_again, UTIL_BUF_SIZE);
+    util_buf_put (buf_large, UTIL_BUF_MAX);
+}
+/*
+ * Each message on a SOCK_SEQPACKET socket is read as one command. A
+ * message that doesn't match the size in its header is rejected.
+ */
+static void
+read_tpm_packet_alloc_test (void **state)
+{
+    uint8_t command [] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+                           0x00, 0x00, 0x01, 0x7b, 0x01, 0x02 };
+    uint8_t *buf;
+    size_t buf_size = 0;
+    GSocket *socket;
+    int client_fd, server_fd;
+    UNUSED_PARAM(state);
 
+    assert_int_equal (create_socket_pair_type (&client_fd, &server_fd,
+                                               SOCK_SEQPACKET, 0), 0);
+    socket = g_socket_new_from_fd (server_fd, NULL);
+    assert_int_equal (write (client_fd, command, sizeof (command)),
+                      sizeof (command));
+    buf = read_tpm_packet_alloc (socket, &buf_size);
+    assert_non_null (buf);
+    assert_int_equal (buf_size, sizeof (command));
+    assert_memory_equal (buf, command, sizeof (command));
+    util_buf_put (buf, buf_size);
+
+    assert_int_equal (write (client_fd, command, sizeof (command) - 1),
+                      sizeof (command) - 1);
+    assert_null (read_tpm_packet_alloc (socket, &buf_size));
+    close (client_fd);
+    assert_null (read_tpm_packet_alloc (socket, &buf_size));
+    g_object_unref (socket);
+}
+
+/*
+ * Debug messages are wanted whenever G_MESSAGES_DEBUG is set, and the
+ * hex dumps are skipped otherwise.
+ */
+static void
+util_debug_init_test (void **state)
+{
+    gchar *saved = g_strdup (g_getenv ("G_MESSAGES_DEBUG"));
+    uint8_t bytes [] = { 0x80, 0x01 };
+    UNUSED_PARAM(state);
+
+    g_unsetenv ("G_MESSAGES_DEBUG");
+    assert_false (util_debug_init ());
+    assert_false (util_debug_enabled ());
+    g_debug_bytes (bytes, sizeof (bytes), 16, 4);
+    g_setenv ("G_MESSAGES_DEBUG", "", TRUE);
+    assert_false (util_debug_init ());
+    g_setenv ("G_MESSAGES_DEBUG", "all", TRUE);
+    assert_true (util_debug_init ());
+#ifndef DISABLE_DEBUG_LOG
+    assert_true (util_debug_enabled ());
+#endif
+    if (saved != NULL) {
+        g_setenv ("G_MESSAGES_DEBUG", saved, TRUE);
+    } else {
+        g_unsetenv ("G_MESSAGES_DEBUG");
+    }
+    util_debug_init ();
+    g_free (saved);
+}
 gint
 main (void)
 {
     const struct CMUnitTest tests[] = {
+        cmocka_unit_test (util_buf_pool_test),
         cmocka_unit_test (write_in_one),
         cmocka_unit_test (write_in_two),
         cmocka_unit_test (write_in_three),
         cmocka_unit_test (write_error),
         cmocka_unit_test (write_zero),
         cmocka_unit_test (create_socket_pair_success_test),
+        cmocka_unit_test (read_tpm_packet_alloc_test),
         /* read_data tests */
         cmocka_unit_test_setup_teardown (read_data_success_test,
                                          read_data_setup,
@@ -733,6 +821,7 @@ main (void)
         cmocka_unit_test_setup_teardown (read_tpm_buf_alloc_eof_test,
                                          read_data_setup,
                                          read_data_teardown),
+        cmocka_unit_test (util_debug_init_test),
     };
     return cmocka_run_group_tests (tests, NULL, NULL);
 }